@@ -11,28 +11,80 @@
 #include "pageant.h"
 #include "sshchan.h"
 
+/*
+ * Requests on one forwarding connection are passed to the real agent
+ * without waiting for earlier ones to be answered, up to this many at
+ * a time. Replies can come back from agent_query in any order, so
+ * each is held in the queue until everything before it has been
+ * sent.
+ */
+#define AGENTF_MAX_QUERIES 16
+
+typedef struct agentf_query agentf_query;
+
 typedef struct agentf {
     SshChannel *c;
     bufchain inbuffer;
-    agent_pending_query *pending;
+    agentf_query *head, *tail;
+    size_t nqueries;
     bool input_wanted;
     bool rcvd_eof;
+    bool discarding;          /* input was malformed; ignore the rest */
+    bool throttled;           /* we've reported a backlog to the channel */
 
     Channel chan;
 } agentf;
 
-static void agentf_got_response(agentf *af, void *reply, int replylen)
+struct agentf_query {
+    agentf *af;
+    agent_pending_query *pending;
+    void *reply;
+    int replylen;
+    bool done;
+    agentf_query *next;
+};
+
+static agentf_query *agentf_query_new(agentf *af)
 {
-    af->pending = NULL;
+    agentf_query *q = snew(agentf_query);
+    q->af = af;
+    q->pending = NULL;
+    q->reply = NULL;
+    q->replylen = 0;
+    q->done = false;
+    q->next = NULL;
+
+    if (af->tail)
+        af->tail->next = q;
+    else
+        af->head = q;
+    af->tail = q;
+    af->nqueries++;
+    return q;
+}
 
-    if (!reply) {
-        /* The real agent didn't send any kind of reply at all for
-         * some reason, so fake an SSH_AGENT_FAILURE. */
-        reply = "\0\0\0\1\5";
-        replylen = 5;
+/*
+ * Send every reply at the front of the queue that has arrived.
+ */
+static void agentf_send_replies(agentf *af)
+{
+    while (af->head && af->head->done) {
+        agentf_query *q = af->head;
+
+        if (!(af->head = q->next))
+            af->tail = NULL;
+        af->nqueries--;
+
+        if (q->reply) {
+            sshfwd_write(af->c, q->reply, q->replylen);
+            sfree(q->reply);
+        } else {
+            /* The real agent didn't send any kind of reply at all for
+             * some reason, so fake an SSH_AGENT_FAILURE. */
+            sshfwd_write(af->c, "\0\0\0\1\5", 5);
+        }
+        sfree(q);
     }
-
-    sshfwd_write(af->c, reply, replylen);
 }
 
 static void agentf_callback(void *vctx, void *reply, int replylen);
@@ -42,15 +94,10 @@ static void agentf_try_forward(agentf *af)
     size_t datalen, length;
     strbuf *message;
     unsigned char msglen[4];
-    void *reply;
-    int replylen;
+    bool incomplete = false;
 
-    /*
-     * Don't try to parallelise agent requests. Wait for each one to
-     * return before attempting the next.
-     */
-    if (af->pending)
-        return;
+    if (af->discarding)
+        bufchain_clear(&af->inbuffer);
 
     /*
      * If the outgoing side of the channel connection is currently
@@ -58,18 +105,18 @@ static void agentf_try_forward(agentf *af)
      * agent. This causes the input side of the agent forwarding not
      * to be emptied, exerting the required back-pressure on the
      * remote client, and encouraging it to read our responses before
-     * sending too many more requests.
+     * sending too many more requests. Similarly, stop when we already
+     * have as many requests outstanding as we're prepared to.
      */
-    if (!af->input_wanted)
-        return;
-
-    while (1) {
+    while (af->input_wanted && af->nqueries < AGENTF_MAX_QUERIES) {
         /*
          * Try to extract a complete message from the input buffer.
          */
         datalen = bufchain_size(&af->inbuffer);
-        if (datalen < 4)
+        if (datalen < 4) {
+            incomplete = true;
             break;         /* not even a length field available yet */
+        }
 
         bufchain_fetch(&af->inbuffer, msglen, 4);
         length = GET_32BIT_MSB_FIRST(msglen);
@@ -81,58 +128,69 @@ static void agentf_try_forward(agentf *af)
              * of the incoming message, and also close the connection
              * for good measure (which avoids us having to faff about
              * with carefully ignoring just the right number of bytes
-             * from the overlong message).
+             * from the overlong message). The close has to wait
+             * until the replies to any earlier requests are sent.
              */
-            agentf_got_response(af, NULL, 0);
-            sshfwd_write_eof(af->c);
-            return;
+            agentf_query *q = agentf_query_new(af);
+            q->done = true;
+            af->discarding = af->rcvd_eof = true;
+            bufchain_clear(&af->inbuffer);
+            break;
         }
 
-        if (length > datalen - 4)
+        if (length > datalen - 4) {
+            incomplete = true;
             break;          /* a whole message is not yet available */
+        }
 
         bufchain_consume(&af->inbuffer, 4);
 
+        agentf_query *q = agentf_query_new(af);
         message = strbuf_new_for_agent_query();
         bufchain_fetch_consume(
             &af->inbuffer, strbuf_append(message, length), length);
-        af->pending = agent_query(
-            message, &reply, &replylen, agentf_callback, af);
+        q->pending = agent_query(
+            message, &q->reply, &q->replylen, agentf_callback, q);
         strbuf_free(message);
 
-        if (af->pending)
-            return;   /* agent_query promised to reply in due course */
-
         /*
-         * If the agent gave us an answer immediately, pass it
-         * straight on and go round this loop again.
+         * If agent_query didn't promise to reply in due course, the
+         * agent gave us an answer immediately.
          */
-        agentf_got_response(af, reply, replylen);
-        sfree(reply);
+        if (!q->pending)
+            q->done = true;
     }
 
+    agentf_send_replies(af);
+
     /*
-     * If we get here (i.e. we left the above while loop via 'break'
-     * rather than 'return'), that means we've determined that the
-     * input buffer for the agent forwarding connection doesn't
-     * contain a complete request.
-     *
-     * So if there's potentially more data to come, we can return now,
-     * and wait for the remote client to send it. But if the remote
-     * has sent EOF, it would be a mistake to do that, because we'd be
-     * waiting a long time. So this is the moment to check for EOF,
-     * and respond appropriately.
+     * If we've determined that the input buffer for the agent
+     * forwarding connection doesn't contain a complete request, there
+     * may be more data to come, and we wait for the remote client to
+     * send it. But if the remote has sent EOF, it would be a mistake
+     * to do that, because we'd be waiting a long time. So once the
+     * last reply has gone, this is the moment to check for EOF, and
+     * respond appropriately.
      */
-    if (af->rcvd_eof)
+    if (af->rcvd_eof && !af->head && (incomplete || af->discarding))
         sshfwd_write_eof(af->c);
 }
 
 static void agentf_callback(void *vctx, void *reply, int replylen)
 {
-    agentf *af = (agentf *)vctx;
-
-    agentf_got_response(af, reply, replylen);
-    sfree(reply);
+    agentf_query *q = (agentf_query *)vctx;
+    agentf *af = q->af;
+
+    q->pending = NULL;
+    q->reply = reply;
+    q->replylen = replylen;
+    q->done = true;
+
+    agentf_send_replies(af);
+    if (af->throttled && af->nqueries < AGENTF_MAX_QUERIES) {
+        af->throttled = false;
+        sshfwd_unthrottle(af->c, bufchain_size(&af->inbuffer));
+    }
 
     /*
      * Now try to extract and send further messages from the channel's
@@ -179,8 +237,11 @@ Channel *agentf_new(SshChannel *c)
     af->chan.vt = &agentf_channelvt;
     af->chan.initial_fixed_window_size = 0;
     af->rcvd_eof = false;
+    af->discarding = false;
+    af->throttled = false;
     bufchain_init(&af->inbuffer);
-    af->pending = NULL;
+    af->head = af->tail = NULL;
+    af->nqueries = 0;
     af->input_wanted = true;
     return &af->chan;
 }
@@ -190,8 +251,14 @@ static void agentf_free(Channel *chan)
     assert(chan->vt == &agentf_channelvt);
     agentf *af = container_of(chan, agentf, chan);
 
-    if (af->pending)
-        agent_cancel_query(af->pending);
+    while (af->head) {
+        agentf_query *q = af->head;
+        af->head = q->next;
+        if (q->pending)
+            agent_cancel_query(q->pending);
+        sfree(q->reply);
+        sfree(q);
+    }
     bufchain_clear(&af->inbuffer);
     sfree(af);
 }
@@ -206,13 +273,15 @@ static size_t agentf_send(Channel *chan, bool is_stderr,
 
     /*
      * We exert back-pressure on an agent forwarding client if and
-     * only if we're waiting for the response to an asynchronous agent
-     * request. This prevents the client running out of window while
-     * receiving the _first_ message, but means that if any message
-     * takes time to process, the client will be discouraged from
-     * sending an endless stream of further ones after it.
+     * only if we already have as many asynchronous agent requests
+     * outstanding as we allow. This lets a client pipeline a batch of
+     * requests, but means that if they take time to process, it will
+     * be discouraged from sending an endless stream of further ones.
      */
-    return (af->pending ? bufchain_size(&af->inbuffer) : 0);
+    if (af->nqueries < AGENTF_MAX_QUERIES)
+        return 0;
+    af->throttled = true;
+    return bufchain_size(&af->inbuffer);
 }
 
 static void agentf_send_eof(Channel *chan)
@@ -28,10 +28,16 @@ void backend_socket_log(Seat *seat, LogContext *logctx,
         sk_getaddr(addr, addrbuf, lenof(addrbuf));
         msg = dupprintf("Failed to connect to %s: %s", addrbuf, error_msg);
         break;
-      case PLUGLOG_CONNECT_SUCCESS:
+      case PLUGLOG_CONNECT_SUCCESS: {
+        /* We may have tried several addresses at once, so say which
+         * kind won */
+        int type = sk_addrtype(addr);
         sk_getaddr(addr, addrbuf, lenof(addrbuf));
-        msg = dupprintf("Connected to %s", addrbuf);
+        msg = dupprintf("Connected to %s%s", addrbuf,
+                        type == ADDRTYPE_IPV6 ? " (IPv6)" :
+                        type == ADDRTYPE_IPV4 ? " (IPv4)" : "");
         break;
+      }
       case PLUGLOG_PROXY_MSG: {
         /* Proxy-related log messages have their own identifying
          * prefix already, put on by our caller. */
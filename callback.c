@@ -16,6 +16,63 @@ struct callback {
 
 static struct callback *cbcurr = NULL, *cbhead = NULL, *cbtail = NULL;
 
+/*
+ * Callbacks queued from other threads go on a separate lock-free
+ * stack: each thread pushes on to it with a compare-and-swap, and the
+ * main thread takes the whole thing at once with an exchange, then
+ * reverses it to recover the order they were queued in. Since
+ * nothing is ever popped individually, there's no ABA problem.
+ */
+static struct callback *thread_cbhead = NULL;
+static void (*thread_wakeup)(void) = NULL;
+
+#if defined __GNUC__ || defined __clang__
+
+/* Returns true if the stack was empty */
+static inline bool thread_cb_push(struct callback *cb)
+{
+    struct callback *old = __atomic_load_n(&thread_cbhead, __ATOMIC_RELAXED);
+    do {
+        cb->next = old;
+    } while (!__atomic_compare_exchange_n(&thread_cbhead, &old, cb, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return old == NULL;
+}
+
+static inline struct callback *thread_cb_take(void)
+{
+    return __atomic_exchange_n(&thread_cbhead, NULL, __ATOMIC_ACQUIRE);
+}
+
+#elif defined _MSC_VER
+
+#include <intrin.h>
+
+static inline bool thread_cb_push(struct callback *cb)
+{
+    struct callback *old = *(struct callback *volatile *)&thread_cbhead;
+    while (true) {
+        struct callback *seen;
+        cb->next = old;
+        seen = _InterlockedCompareExchangePointer(
+            (void *volatile *)&thread_cbhead, cb, old);
+        if (seen == old)
+            break;
+        old = seen;
+    }
+    return old == NULL;
+}
+
+static inline struct callback *thread_cb_take(void)
+{
+    return _InterlockedExchangePointer(
+        (void *volatile *)&thread_cbhead, NULL);
+}
+
+#else
+#error "Don't know how to do atomic pointer operations with this compiler"
+#endif
+
 static toplevel_callback_notify_fn_t notify_frontend = NULL;
 static void *notify_ctx = NULL;
 
@@ -69,14 +126,8 @@ void delete_callbacks_for_context(void *ctx)
         newtail->next = NULL;
 }
 
-void queue_toplevel_callback(toplevel_callback_fn_t fn, void *ctx)
+static void queue_callback(struct callback *cb)
 {
-    struct callback *cb;
-
-    cb = snew(struct callback);
-    cb->fn = fn;
-    cb->ctx = ctx;
-
     /*
      * If the front end has requested notification of pending
      * callbacks, and we didn't already have one queued, let it know
@@ -99,6 +150,53 @@ void queue_toplevel_callback(toplevel_callback_fn_t fn, void *ctx)
     cb->next = NULL;
 }
 
+void queue_toplevel_callback(toplevel_callback_fn_t fn, void *ctx)
+{
+    struct callback *cb;
+
+    cb = snew(struct callback);
+    cb->fn = fn;
+    cb->ctx = ctx;
+    queue_callback(cb);
+}
+
+void request_thread_callback_wakeups(void (*wakeup)(void))
+{
+    thread_wakeup = wakeup;
+}
+
+void queue_toplevel_callback_from_thread(toplevel_callback_fn_t fn,
+                                         void *ctx)
+{
+    struct callback *cb;
+
+    assert(thread_wakeup);
+
+    cb = snew(struct callback);
+    cb->fn = fn;
+    cb->ctx = ctx;
+
+    /* Only the first of a batch needs to wake the main thread: the
+     * rest will be collected along with it */
+    if (thread_cb_push(cb))
+        thread_wakeup();
+}
+
+void run_thread_callbacks(void)
+{
+    struct callback *cb, *next, *rev = NULL;
+
+    for (cb = thread_cb_take(); cb; cb = next) {
+        next = cb->next;
+        cb->next = rev;
+        rev = cb;
+    }
+    for (cb = rev; cb; cb = next) {
+        next = cb->next;
+        queue_callback(cb);
+    }
+}
+
 bool run_toplevel_callbacks(void)
 {
     bool done_something = false;
@@ -117,8 +215,15 @@ bool run_toplevel_callbacks(void)
 
         /*
          * Now run the callback, and then clear it out of cbcurr.
+         * (For tracing, identify an idempotent callback by its own
+         * function rather than by the wrapper.)
          */
+        toplevel_callback_fn_t fn = cbcurr->fn;
+        if (fn == run_idempotent_callback)
+            fn = ((struct IdempotentCallback *)cbcurr->ctx)->fn;
+        uint64_t trace_start = trace_begin();
         cbcurr->fn(cbcurr->ctx);
+        trace_end("callback", (uintptr_t)fn, trace_start);
         sfree(cbcurr);
         cbcurr = NULL;
 
@@ -48,6 +48,8 @@ int charset_from_unicode(const wchar_t **input, int *inlen,
     charset_spec const *spec = charset_find_spec(charset);
     charset_state localstate;
     struct charset_emit_param param;
+    const struct sbcs_data *sd = NULL;
+    int ascii_fast = 0;
 
     param.output = output;
     param.outlen = outlen;
@@ -71,9 +73,34 @@ int charset_from_unicode(const wchar_t **input, int *inlen,
     }
     state = &localstate;
 
+    /*
+     * As in charset_to_unicode, deal with the common case directly:
+     * a character which a single-byte charset encodes as its own
+     * code point, or an ASCII character in UTF-8. (No position
+     * lowered by `sortpriority' in sbcs.dat maps to itself, so the
+     * byte chosen here is the same one write_sbcs would choose.)
+     */
+    if (spec->write == write_sbcs)
+        sd = spec->data;
+    else if (spec->charset == CS_UTF8)
+        ascii_fast = 1;
+
     while (*inlen > 0) {
-        int lenbefore = param.output - output;
-        spec->write(spec, **input, &localstate, charset_emit, &param);
+        int lenbefore;
+        long int u = **input;
+
+        if (param.outlen > 0 && u >= 0 &&
+            ((sd && u < 256 && sd->sbcs2ucs[u] == (unsigned long)u) ||
+             (ascii_fast && u < 0x80))) {
+            *param.output++ = (char)u;
+            param.outlen--;
+            (*input)++;
+            (*inlen)--;
+            continue;
+        }
+
+        lenbefore = param.output - output;
+        spec->write(spec, u, &localstate, charset_emit, &param);
         if (param.stopped) {
             /*
              * The emit function has _tried_ to output some
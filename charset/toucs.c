@@ -54,6 +54,8 @@ int charset_to_unicode(const char **input, int *inlen,
     charset_spec const *spec = charset_find_spec(charset);
     charset_state localstate;
     struct unicode_emit_param param;
+    const struct sbcs_data *sd = NULL;
+    int ascii_fast = 0;
 
     param.output = output;
     param.outlen = outlen;
@@ -67,9 +69,42 @@ int charset_to_unicode(const char **input, int *inlen,
         localstate = *state;           /* structure copy */
     }
 
+    /*
+     * For single-byte charsets and UTF-8, most input bytes map to
+     * exactly one Unicode character with no state involved. We
+     * handle those directly from the table here, instead of going
+     * through the read function and the emit callback for every
+     * byte, and only fall back to the general path for anything
+     * more complicated (errors, multibyte sequences).
+     */
+    if (spec->read == read_sbcs)
+        sd = spec->data;
+    else if (spec->charset == CS_UTF8)
+        ascii_fast = 1;
+
     while (*inlen > 0) {
-        int lenbefore = param.output - output;
-        spec->read(spec, (unsigned char)**input, &localstate,
+        int lenbefore;
+        unsigned char c = **input;
+
+        if (param.outlen > 0) {
+            if (sd && sd->sbcs2ucs[c] != ERROR) {
+                *param.output++ = sd->sbcs2ucs[c];
+                param.outlen--;
+                (*input)++;
+                (*inlen)--;
+                continue;
+            }
+            if (ascii_fast && c < 0x80 && localstate.s0 == 0) {
+                *param.output++ = c;
+                param.outlen--;
+                (*input)++;
+                (*inlen)--;
+                continue;
+            }
+        }
+
+        lenbefore = param.output - output;
+        spec->read(spec, c, &localstate,
                    unicode_emit, &param);
         if (param.stopped) {
             /*
@@ -148,6 +148,8 @@ void help(void)
            "        proven         numbers that have been proven to be prime\n"
            "        proven-even    also try harder for an even distribution\n"
            "  --strong-rsa         use \"strong\" primes as RSA key factors\n"
+           "  --batch  fingerprint (-l) or convert (-L) every public key in\n"
+           "        any number of files, or in standard input if none given\n"
            );
 }
 
@@ -193,6 +195,220 @@ static char *readpassphrase(const char *filename)
     return line;
 }
 
+/*
+ * Batch mode: fingerprint or convert every SSH-2 public key found in
+ * a list of files (or standard input), writing one line per key.
+ * Nothing here needs random numbers, so the random pool is never set
+ * up. Each key is parsed and formatted independently of the others,
+ * which we do in parallel, a chunk at a time.
+ */
+typedef struct BatchKey {
+    ptrlen text;              /* one line, or the whole of a key file */
+    size_t lineno;            /* or 0 if text is a whole file */
+    char *output;
+    const char *error;
+} BatchKey;
+
+typedef struct BatchJob {
+    BatchKey *keys;
+    size_t nkeys;
+    bool fingerprint;
+} BatchJob;
+
+#define BATCH_CHUNK 4096
+
+static bool batch_key_load(ptrlen text, strbuf *blob, char **comment,
+                           const char **error)
+{
+    BinarySource src[1];
+    char *alg = NULL;
+
+    BinarySource_BARE_INIT_PL(src, text);
+    if (!ppk_loadpub_s(src, &alg, BinarySink_UPCAST(blob), comment, error))
+        return false;
+    sfree(alg);
+    return true;
+}
+
+static void batch_key_process(BatchKey *bk, bool fingerprint)
+{
+    strbuf *blob = strbuf_new();
+    char *comment = NULL;
+
+    if (!batch_key_load(bk->text, blob, &comment, &bk->error) &&
+        bk->lineno) {
+        /*
+         * Lines from an authorized_keys file may start with options.
+         * Rather than parse those (quoting and all), try again from
+         * the start of each later word until something loads.
+         */
+        const char *p = bk->text.ptr, *end = p + bk->text.len;
+        while (true) {
+            const char *dummy;
+            while (p < end && *p != ' ' && *p != '\t')
+                p++;
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            if (p == end)
+                break;
+            strbuf_clear(blob);
+            if (batch_key_load(make_ptrlen(p, end - p), blob,
+                               &comment, &dummy)) {
+                bk->error = NULL;
+                break;
+            }
+        }
+        if (bk->error)
+            bk->error = "no OpenSSH public key found on line";
+    }
+
+    if (!bk->error) {
+        if (fingerprint) {
+            char *fp = ssh2_fingerprint_blob(ptrlen_from_strbuf(blob));
+            if (comment && *comment)
+                bk->output = dupprintf("%s %s", fp, comment);
+            else
+                bk->output = dupstr(fp);
+            sfree(fp);
+        } else {
+            bk->output = ssh2_pubkey_openssh_str_blob(
+                comment, ptrlen_from_strbuf(blob));
+        }
+    }
+
+    sfree(comment);
+    strbuf_free(blob);
+}
+
+static void batch_job_run(void *vctx)
+{
+    BatchJob *job = (BatchJob *)vctx;
+    for (size_t i = 0; i < job->nkeys; i++)
+        batch_key_process(&job->keys[i], job->fingerprint);
+}
+
+/*
+ * Process one chunk of keys, then write out the results in order.
+ * Returns false if any key couldn't be loaded.
+ */
+static bool batch_run_chunk(BatchKey *keys, size_t nkeys, bool fingerprint,
+                            const char *source, FILE *fp)
+{
+    size_t njobs = platform_parallel_jobs(), per_job, i;
+    BatchJob *jobs;
+    void **ctxs;
+    bool ok = true;
+
+    if (njobs > nkeys)
+        njobs = nkeys;
+    if (njobs < 1)
+        njobs = 1;
+    per_job = (nkeys + njobs - 1) / njobs;
+
+    jobs = snewn(njobs, BatchJob);
+    ctxs = snewn(njobs, void *);
+    for (i = 0; i < njobs; i++) {
+        size_t start = i * per_job;
+        jobs[i].keys = keys + start;
+        jobs[i].nkeys = (start >= nkeys ? 0 :
+                         nkeys - start < per_job ? nkeys - start : per_job);
+        jobs[i].fingerprint = fingerprint;
+        ctxs[i] = &jobs[i];
+    }
+    platform_run_parallel(batch_job_run, ctxs, njobs);
+    sfree(ctxs);
+    sfree(jobs);
+
+    for (i = 0; i < nkeys; i++) {
+        if (keys[i].output) {
+            fprintf(fp, "%s\n", keys[i].output);
+            sfree(keys[i].output);
+        } else {
+            if (keys[i].lineno)
+                fprintf(stderr, "puttygen: %s:%"SIZEu": %s\n", source,
+                        keys[i].lineno, keys[i].error);
+            else
+                fprintf(stderr, "puttygen: %s: %s\n", source, keys[i].error);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static bool batch_process_file(const char *name, bool fingerprint, FILE *fp)
+{
+    FILE *infp;
+    strbuf *data;
+    char buf[4096];
+    size_t got;
+    BinarySource src[1];
+    BatchKey *keys;
+    size_t nkeys = 0, lineno = 0;
+    bool ok = true;
+    int type;
+
+    if (!strcmp(name, "-")) {
+        infp = stdin;
+    } else {
+        Filename *fn = filename_from_str(name);
+        infp = f_open(fn, "rb", false);
+        filename_free(fn);
+        if (!infp) {
+            fprintf(stderr, "puttygen: unable to open `%s': %s\n",
+                    name, strerror(errno));
+            return false;
+        }
+    }
+
+    data = strbuf_new();
+    while ((got = fread(buf, 1, sizeof(buf), infp)) > 0)
+        put_data(data, buf, got);
+    if (infp != stdin)
+        fclose(infp);
+
+    keys = snewn(BATCH_CHUNK, BatchKey);
+
+    BinarySource_BARE_INIT_PL(src, ptrlen_from_strbuf(data));
+    type = key_type_s(src);
+    BinarySource_REWIND(src);
+
+    if (type == SSH_KEYTYPE_SSH2 || type == SSH_KEYTYPE_SSH2_PUBLIC_RFC4716) {
+        /* A file format that holds just one key */
+        keys[0].text = ptrlen_from_strbuf(data);
+        keys[0].lineno = 0;
+        keys[0].output = NULL;
+        keys[0].error = NULL;
+        ok = batch_run_chunk(keys, 1, fingerprint, name, fp);
+    } else {
+        /* Otherwise, expect one OpenSSH public key per line */
+        while (get_avail(src)) {
+            ptrlen line = get_chomped_line(src);
+            lineno++;
+            while (line.len && (*(const char *)line.ptr == ' ' ||
+                                *(const char *)line.ptr == '\t'))
+                line = make_ptrlen((const char *)line.ptr + 1, line.len - 1);
+            if (!line.len || *(const char *)line.ptr == '#')
+                continue;
+
+            keys[nkeys].text = line;
+            keys[nkeys].lineno = lineno;
+            keys[nkeys].output = NULL;
+            keys[nkeys].error = NULL;
+            if (++nkeys == BATCH_CHUNK) {
+                if (!batch_run_chunk(keys, nkeys, fingerprint, name, fp))
+                    ok = false;
+                nkeys = 0;
+            }
+        }
+        if (nkeys && !batch_run_chunk(keys, nkeys, fingerprint, name, fp))
+            ok = false;
+    }
+
+    sfree(keys);
+    strbuf_free(data);
+    return ok;
+}
+
 #define DEFAULT_RSADSA_BITS 2048
 
 /* For Unix in particular, but harmless if this main() is reused elsewhere */
@@ -225,6 +441,9 @@ int main(int argc, char **argv)
     int exit_status = 0;
     const PrimeGenerationPolicy *primegen = &primegen_probabilistic;
     bool strong_rsa = false;
+    bool batch = false;
+    const char **infiles = NULL;
+    size_t ninfiles = 0, infilesize = 0;
 
     if (is_interactive())
         progress_fp = stderr;
@@ -362,6 +581,8 @@ int main(int argc, char **argv)
                         }
                     } else if (!strcmp(opt, "-strong-rsa")) {
                         strong_rsa = true;
+                    } else if (!strcmp(opt, "-batch")) {
+                        batch = true;
                     } else {
                       errs = true;
                       fprintf(stderr,
@@ -497,11 +718,27 @@ int main(int argc, char **argv)
              */
             if (!infile)
                 infile = p;
-            else {
-                errs = true;
-                fprintf(stderr, "puttygen: cannot handle more than one"
-                        " input file\n");
-            }
+            sgrowarray(infiles, infilesize, ninfiles);
+            infiles[ninfiles++] = p;
+        }
+    }
+
+    if (ninfiles > 1 && !batch) {
+        errs = true;
+        fprintf(stderr, "puttygen: cannot handle more than one"
+                " input file\n");
+    }
+
+    if (batch) {
+        if (outtype != FP && outtype != PUBLICO) {
+            errs = true;
+            fprintf(stderr, "puttygen: --batch only supports the "
+                    "fingerprint and public-openssh output types\n");
+        }
+        if (keytype != NOKEYGEN || comment || change_passphrase) {
+            errs = true;
+            fprintf(stderr, "puttygen: --batch cannot generate or "
+                    "modify keys\n");
         }
     }
 
@@ -567,6 +804,28 @@ int main(int argc, char **argv)
     if (nogo)
         RETURN(0);
 
+    if (batch) {
+        FILE *fp = stdout;
+        bool ok = true;
+
+        if (outfile) {
+            outfilename = filename_from_str(outfile);
+            fp = f_open(outfilename, "w", false);
+            if (!fp) {
+                fprintf(stderr, "puttygen: unable to open output file\n");
+                RETURN(1);
+            }
+        }
+        if (!ninfiles)
+            ok = batch_process_file("-", outtype == FP, fp);
+        for (size_t i = 0; i < ninfiles; i++)
+            if (!batch_process_file(infiles[i], outtype == FP, fp))
+                ok = false;
+        if (outfile)
+            fclose(fp);
+        RETURN(ok ? 0 : 1);
+    }
+
     /*
      * If run with at least one argument _but_ not the required
      * ones, print the usage message and return failure.
@@ -1235,6 +1494,7 @@ int main(int argc, char **argv)
     if (outfilename)
         filename_free(outfilename);
     sfree(outfiletmp);
+    sfree(infiles);
 
     return exit_status;
 }
@@ -513,6 +513,25 @@ int cmdline_process_param(const char *p, char *value,
         sfree(key);
         sfree(val);
     }
+    if (!strcmp(p, "-fwdlimit")) {
+        char *eq, *key;
+        RETURN(2);
+        UNAVAILABLE_IN(TOOLTYPE_FILETRANSFER | TOOLTYPE_NONNETWORK);
+        SAVEABLE(0);
+
+        eq = strchr(value, '=');
+        if (!eq || (value[0] != 'L' && value[0] != 'R' && value[0] != 'D')) {
+            cmdline_error("-fwdlimit expects argument of form "
+                          "'[LRD]port=rate[:total[:weight]]'");
+            return ret;
+        }
+
+        /* Dynamic forwardings are filed under 'L', as for -D above */
+        key = dupprintf("%c%.*s", value[0] == 'D' ? 'L' : value[0],
+                        (int)(eq - value - 1), value + 1);
+        conf_set_str_str(conf, CONF_portfwd_limits, key, eq + 1);
+        sfree(key);
+    }
     if ((!strcmp(p, "-nc"))) {
         char *host, *portp;
 
@@ -807,6 +826,15 @@ int cmdline_process_param(const char *p, char *value,
         filename_free(fn);
     }
 
+    if (!strcmp(p, "-tracefile")) {
+        Filename *fn;
+        RETURN(2);
+        SAVEABLE(0);
+        fn = filename_from_str(value);
+        trace_start(fn);
+        filename_free(fn);
+    }
+
     if (!strcmp(p, "-proxycmd")) {
         RETURN(2);
         UNAVAILABLE_IN(TOOLTYPE_NONNETWORK);
@@ -815,6 +843,46 @@ int cmdline_process_param(const char *p, char *value,
         conf_set_str(conf, CONF_proxy_telnet_command, value);
     }
 
+    if (!strcmp(p, "-J")) {
+        const char *hostp, *at, *portp;
+        char *user, *host;
+        int port = 22;
+
+        RETURN(2);
+        UNAVAILABLE_IN(TOOLTYPE_NONNETWORK);
+        SAVEABLE(0);
+
+        /*
+         * The argument is [user@]host[:port], as for OpenSSH. The
+         * host may also be the name of a saved session, in which
+         * case the other two parts are ignored in favour of it.
+         */
+        at = strrchr(value, '@');
+        if (at) {
+            user = dupprintf("%.*s", (int)(at - value), value);
+            hostp = at + 1;
+        } else {
+            user = dupstr("");
+            hostp = value;
+        }
+        portp = host_strrchr(hostp, ':');
+        if (portp) {
+            char *tmp = dupprintf("%.*s", (int)(portp - hostp), hostp);
+            host = host_strduptrim(tmp);
+            sfree(tmp);
+            port = atoi(portp + 1);
+        } else {
+            host = host_strduptrim(hostp);
+        }
+
+        conf_set_int(conf, CONF_proxy_type, PROXY_SSH);
+        conf_set_str(conf, CONF_proxy_host, host);
+        conf_set_int(conf, CONF_proxy_port, port);
+        conf_set_str(conf, CONF_proxy_username, user);
+        sfree(host);
+        sfree(user);
+    }
+
 #ifdef _WINDOWS
     /*
      * Cross-tool options only available on Windows.
@@ -66,8 +66,19 @@ struct conf_entry {
     struct value value;
 };
 
+/*
+ * Options with no subkey are kept in an array indexed directly by
+ * their primary key, so that looking one up doesn't involve a tree
+ * search. Only the options with subkeys live in the tree.
+ */
+struct conf_scalar {
+    bool set;
+    struct value value;
+};
+
 struct conf_tag {
     tree234 *tree;
+    struct conf_scalar scalars[N_CONFIG_OPTIONS];
 };
 
 /*
@@ -207,6 +218,7 @@ Conf *conf_new(void)
     Conf *conf = snew(struct conf_tag);
 
     conf->tree = newtree234(conf_cmp);
+    memset(conf->scalars, 0, sizeof(conf->scalars));
 
     return conf;
 }
@@ -214,9 +226,17 @@ Conf *conf_new(void)
 static void conf_clear(Conf *conf)
 {
     struct conf_entry *entry;
+    int i;
 
     while ((entry = delpos234(conf->tree, 0)) != NULL)
         free_entry(entry);
+
+    for (i = 0; i < N_CONFIG_OPTIONS; i++) {
+        if (conf->scalars[i].set) {
+            free_value(&conf->scalars[i].value, valuetypes[i]);
+            conf->scalars[i].set = false;
+        }
+    }
 }
 
 void conf_free(Conf *conf)
@@ -226,9 +246,48 @@ void conf_free(Conf *conf)
     sfree(conf);
 }
 
+/*
+ * Find the slot for a scalar option, checking its types, and make it
+ * ready to receive a new value by freeing any old one. The caller
+ * must have made its own copy of the new value first, in case it was
+ * aliased to the old one.
+ */
+static struct value *conf_scalar_slot(Conf *conf, int primary, int type)
+{
+    struct conf_scalar *sc = &conf->scalars[primary];
+
+    assert(subkeytypes[primary] == TYPE_NONE);
+    assert(valuetypes[primary] == type);
+    if (sc->set)
+        free_value(&sc->value, type);
+    sc->set = true;
+    return &sc->value;
+}
+
+static struct value *conf_scalar_get(Conf *conf, int primary, int type)
+{
+    struct conf_scalar *sc = &conf->scalars[primary];
+
+    assert(subkeytypes[primary] == TYPE_NONE);
+    assert(valuetypes[primary] == type);
+    assert(sc->set);
+    return &sc->value;
+}
+
 static void conf_insert(Conf *conf, struct conf_entry *entry)
 {
-    struct conf_entry *oldentry = add234(conf->tree, entry);
+    struct conf_entry *oldentry;
+
+    if (subkeytypes[entry->key.primary] == TYPE_NONE) {
+        int primary = entry->key.primary;
+        struct value *slot = conf_scalar_slot(
+            conf, primary, valuetypes[primary]);
+        *slot = entry->value;          /* take ownership of its contents */
+        sfree(entry);
+        return;
+    }
+
+    oldentry = add234(conf->tree, entry);
     if (oldentry && oldentry != entry) {
         del234(conf->tree, oldentry);
         free_entry(oldentry);
@@ -240,17 +299,26 @@ static void conf_insert(Conf *conf, struct conf_entry *entry)
 void conf_copy_into(Conf *newconf, Conf *oldconf)
 {
     struct conf_entry *entry, *entry2;
+    iter234 it;
     int i;
 
     conf_clear(newconf);
 
-    for (i = 0; (entry = index234(oldconf->tree, i)) != NULL; i++) {
+    for (entry = iter234_first(&it, oldconf->tree); entry;
+         entry = iter234_next(&it)) {
         entry2 = snew(struct conf_entry);
         copy_key(&entry2->key, &entry->key);
         copy_value(&entry2->value, &entry->value,
                    valuetypes[entry->key.primary]);
         add234(newconf->tree, entry2);
     }
+
+    for (i = 0; i < N_CONFIG_OPTIONS; i++) {
+        newconf->scalars[i].set = oldconf->scalars[i].set;
+        if (oldconf->scalars[i].set)
+            copy_value(&newconf->scalars[i].value,
+                       &oldconf->scalars[i].value, valuetypes[i]);
+    }
 }
 
 Conf *conf_copy(Conf *oldconf)
@@ -264,28 +332,12 @@ Conf *conf_copy(Conf *oldconf)
 
 bool conf_get_bool(Conf *conf, int primary)
 {
-    struct key key;
-    struct conf_entry *entry;
-
-    assert(subkeytypes[primary] == TYPE_NONE);
-    assert(valuetypes[primary] == TYPE_BOOL);
-    key.primary = primary;
-    entry = find234(conf->tree, &key, NULL);
-    assert(entry);
-    return entry->value.u.boolval;
+    return conf_scalar_get(conf, primary, TYPE_BOOL)->u.boolval;
 }
 
 int conf_get_int(Conf *conf, int primary)
 {
-    struct key key;
-    struct conf_entry *entry;
-
-    assert(subkeytypes[primary] == TYPE_NONE);
-    assert(valuetypes[primary] == TYPE_INT);
-    key.primary = primary;
-    entry = find234(conf->tree, &key, NULL);
-    assert(entry);
-    return entry->value.u.intval;
+    return conf_scalar_get(conf, primary, TYPE_INT)->u.intval;
 }
 
 int conf_get_int_int(Conf *conf, int primary, int secondary)
@@ -304,15 +356,7 @@ int conf_get_int_int(Conf *conf, int primary, int secondary)
 
 char *conf_get_str(Conf *conf, int primary)
 {
-    struct key key;
-    struct conf_entry *entry;
-
-    assert(subkeytypes[primary] == TYPE_NONE);
-    assert(valuetypes[primary] == TYPE_STR);
-    key.primary = primary;
-    entry = find234(conf->tree, &key, NULL);
-    assert(entry);
-    return entry->value.u.stringval;
+    return conf_scalar_get(conf, primary, TYPE_STR)->u.stringval;
 }
 
 char *conf_get_str_str_opt(Conf *conf, int primary, const char *secondary)
@@ -379,50 +423,22 @@ char *conf_get_str_nthstrkey(Conf *conf, int primary, int n)
 
 Filename *conf_get_filename(Conf *conf, int primary)
 {
-    struct key key;
-    struct conf_entry *entry;
-
-    assert(subkeytypes[primary] == TYPE_NONE);
-    assert(valuetypes[primary] == TYPE_FILENAME);
-    key.primary = primary;
-    entry = find234(conf->tree, &key, NULL);
-    assert(entry);
-    return entry->value.u.fileval;
+    return conf_scalar_get(conf, primary, TYPE_FILENAME)->u.fileval;
 }
 
 FontSpec *conf_get_fontspec(Conf *conf, int primary)
 {
-    struct key key;
-    struct conf_entry *entry;
-
-    assert(subkeytypes[primary] == TYPE_NONE);
-    assert(valuetypes[primary] == TYPE_FONT);
-    key.primary = primary;
-    entry = find234(conf->tree, &key, NULL);
-    assert(entry);
-    return entry->value.u.fontval;
+    return conf_scalar_get(conf, primary, TYPE_FONT)->u.fontval;
 }
 
 void conf_set_bool(Conf *conf, int primary, bool value)
 {
-    struct conf_entry *entry = snew(struct conf_entry);
-
-    assert(subkeytypes[primary] == TYPE_NONE);
-    assert(valuetypes[primary] == TYPE_BOOL);
-    entry->key.primary = primary;
-    entry->value.u.boolval = value;
-    conf_insert(conf, entry);
+    conf_scalar_slot(conf, primary, TYPE_BOOL)->u.boolval = value;
 }
 
 void conf_set_int(Conf *conf, int primary, int value)
 {
-    struct conf_entry *entry = snew(struct conf_entry);
-
-    assert(subkeytypes[primary] == TYPE_NONE);
-    assert(valuetypes[primary] == TYPE_INT);
-    entry->key.primary = primary;
-    entry->value.u.intval = value;
-    conf_insert(conf, entry);
+    conf_scalar_slot(conf, primary, TYPE_INT)->u.intval = value;
 }
 
 void conf_set_int_int(Conf *conf, int primary,
@@ -440,13 +456,8 @@ void conf_set_int_int(Conf *conf, int primary,
 
 void conf_set_str(Conf *conf, int primary, const char *value)
 {
-    struct conf_entry *entry = snew(struct conf_entry);
-
-    assert(subkeytypes[primary] == TYPE_NONE);
-    assert(valuetypes[primary] == TYPE_STR);
-    entry->key.primary = primary;
-    entry->value.u.stringval = dupstr(value);
-    conf_insert(conf, entry);
+    char *copy = dupstr(value);
+    conf_scalar_slot(conf, primary, TYPE_STR)->u.stringval = copy;
 }
 
 void conf_set_str_str(Conf *conf, int primary, const char *secondary,
@@ -480,58 +491,68 @@ void conf_del_str_str(Conf *conf, int primary, const char *secondary)
 
 void conf_set_filename(Conf *conf, int primary, const Filename *value)
 {
-    struct conf_entry *entry = snew(struct conf_entry);
-
-    assert(subkeytypes[primary] == TYPE_NONE);
-    assert(valuetypes[primary] == TYPE_FILENAME);
-    entry->key.primary = primary;
-    entry->value.u.fileval = filename_copy(value);
-    conf_insert(conf, entry);
+    Filename *copy = filename_copy(value);
+    conf_scalar_slot(conf, primary, TYPE_FILENAME)->u.fileval = copy;
 }
 
 void conf_set_fontspec(Conf *conf, int primary, const FontSpec *value)
 {
-    struct conf_entry *entry = snew(struct conf_entry);
+    FontSpec *copy = fontspec_copy(value);
+    conf_scalar_slot(conf, primary, TYPE_FONT)->u.fontval = copy;
+}
 
-    assert(subkeytypes[primary] == TYPE_NONE);
-    assert(valuetypes[primary] == TYPE_FONT);
-    entry->key.primary = primary;
-    entry->value.u.fontval = fontspec_copy(value);
-    conf_insert(conf, entry);
+static void conf_serialise_value(BinarySink *bs, int primary,
+                                 struct value *value)
+{
+    switch (valuetypes[primary]) {
+      case TYPE_BOOL:
+        put_bool(bs, value->u.boolval);
+        break;
+      case TYPE_INT:
+        put_uint32(bs, value->u.intval);
+        break;
+      case TYPE_STR:
+        put_asciz(bs, value->u.stringval);
+        break;
+      case TYPE_FILENAME:
+        filename_serialise(bs, value->u.fileval);
+        break;
+      case TYPE_FONT:
+        fontspec_serialise(bs, value->u.fontval);
+        break;
+    }
 }
 
 void conf_serialise(BinarySink *bs, Conf *conf)
 {
-    int i;
+    int primary;
     struct conf_entry *entry;
-
-    for (i = 0; (entry = index234(conf->tree, i)) != NULL; i++) {
-        put_uint32(bs, entry->key.primary);
-
-        switch (subkeytypes[entry->key.primary]) {
-          case TYPE_INT:
-            put_uint32(bs, entry->key.secondary.i);
-            break;
-          case TYPE_STR:
-            put_asciz(bs, entry->key.secondary.s);
-            break;
+    iter234 it;
+
+    /*
+     * Output everything in primary key order, as we always have,
+     * merging the scalar options in with the tree.
+     */
+    entry = iter234_first(&it, conf->tree);
+    for (primary = 0; primary < N_CONFIG_OPTIONS; primary++) {
+        if (conf->scalars[primary].set) {
+            put_uint32(bs, primary);
+            conf_serialise_value(bs, primary, &conf->scalars[primary].value);
         }
-        switch (valuetypes[entry->key.primary]) {
-          case TYPE_BOOL:
-            put_bool(bs, entry->value.u.boolval);
-            break;
-          case TYPE_INT:
-            put_uint32(bs, entry->value.u.intval);
-            break;
-          case TYPE_STR:
-            put_asciz(bs, entry->value.u.stringval);
-            break;
-          case TYPE_FILENAME:
-            filename_serialise(bs, entry->value.u.fileval);
-            break;
-          case TYPE_FONT:
-            fontspec_serialise(bs, entry->value.u.fontval);
-            break;
+
+        for (; entry && entry->key.primary == primary;
+             entry = iter234_next(&it)) {
+            put_uint32(bs, entry->key.primary);
+
+            switch (subkeytypes[entry->key.primary]) {
+              case TYPE_INT:
+                put_uint32(bs, entry->key.secondary.i);
+                break;
+              case TYPE_STR:
+                put_asciz(bs, entry->key.secondary.s);
+                break;
+            }
+            conf_serialise_value(bs, primary, &entry->value);
         }
     }
 
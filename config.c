@@ -392,6 +392,7 @@ static void cipherlist_handler(union control *ctrl, dlgparam *dlg,
             { "Blowfish",               CIPHER_BLOWFISH },
             { "DES",                    CIPHER_DES },
             { "AES (SSH-2 only)",       CIPHER_AES },
+            { "AES-GCM (SSH-2 only)",   CIPHER_AESGCM },
             { "Arcfour (SSH-2 only)",   CIPHER_ARCFOUR },
             { "-- warn below here --",  CIPHER_WARN }
         };
@@ -1787,6 +1788,9 @@ void setup_config_box(struct controlbox *b, bool midsession,
     ctrl_checkbox(s, "Include header", 'i',
                  HELPCTX(logging_header),
                  conf_checkbox_handler, I(CONF_logheader));
+    ctrl_checkbox(s, "Compress log file with gzip", 'z',
+                 HELPCTX(logging_compress),
+                 conf_checkbox_handler, I(CONF_logcompress));
 
     if ((midsession && protocol == PROT_SSH) ||
         (!midsession && backend_vt_from_proto(PROT_SSH))) {
@@ -1798,6 +1802,15 @@ void setup_config_box(struct controlbox *b, bool midsession,
         ctrl_checkbox(s, "Omit session data", 'd',
                       HELPCTX(logging_ssh_omit_data),
                       conf_checkbox_handler, I(CONF_logomitdata));
+        ctrl_checkbox(s, "Log timings of connection setup", 'm',
+                      HELPCTX(logging_main),
+                      conf_checkbox_handler, I(CONF_logsetuptiming));
+        ctrl_checkbox(s, "Write packet log in compact binary format", 'b',
+                      HELPCTX(logging_ssh_binary),
+                      conf_checkbox_handler, I(CONF_logbinary));
+        ctrl_editbox(s, "Bytes of each packet to log (0 for all)", 'n', 20,
+                     HELPCTX(logging_ssh_pktmax),
+                     conf_editbox_handler, I(CONF_logpktmax), I(-1));
     }
 
     /*
@@ -1999,6 +2012,9 @@ void setup_config_box(struct controlbox *b, bool midsession,
     ctrl_editbox(s, "Lines of scrollback", 's', 50,
                  HELPCTX(window_scrollback),
                  conf_editbox_handler, I(CONF_savelines), I(-1));
+    ctrl_checkbox(s, "Keep older scrollback in a temporary file", 't',
+                  HELPCTX(window_scrollback),
+                  conf_checkbox_handler, I(CONF_scrollback_on_disk));
     ctrl_checkbox(s, "Display scrollbar", 'd',
                   HELPCTX(window_scrollback),
                   conf_checkbox_handler, I(CONF_scrollbar));
@@ -2270,6 +2286,12 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           "IPv6", '6', I(ADDRTYPE_IPV6),
                           NULL);
 #endif
+            ctrl_editbox(s, "Milliseconds before also trying next address",
+                         'i', 20, HELPCTX(connection_connectdelay),
+                         conf_editbox_handler, I(CONF_connect_delay), I(-1));
+            ctrl_editbox(s, "Seconds to remember host name lookups",
+                         'r', 20, HELPCTX(connection_dnscache),
+                         conf_editbox_handler, I(CONF_dns_cache_ttl), I(-1));
 
             {
                 const char *label = backend_vt_from_proto(PROT_SSH) ?
@@ -2372,6 +2394,7 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           "SOCKS 5", I(PROXY_SOCKS5),
                           "HTTP", I(PROXY_HTTP),
                           "Telnet", I(PROXY_TELNET),
+                          "SSH", I(PROXY_SSH),
                           NULL);
         ctrl_columns(s, 2, 80, 20);
         c = ctrl_editbox(s, "Proxy hostname", 'y', 100,
@@ -2479,6 +2502,10 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           HELPCTX(ssh_compress),
                           conf_checkbox_handler,
                           I(CONF_compression));
+            ctrl_editbox(s, "Compression level (1 fastest, 9 smallest)", 'v',
+                         20, HELPCTX(ssh_compress),
+                         conf_editbox_handler, I(CONF_compression_level),
+                         I(-1));
         }
 
         if (!midsession) {
@@ -2534,6 +2561,14 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           conf_checkbox_handler,
                           I(CONF_try_gssapi_kex));
 #endif
+            ctrl_checkbox(s, "Send guessed first key exchange packet",
+                          'g', HELPCTX(ssh_kexlist),
+                          conf_checkbox_handler,
+                          I(CONF_ssh_kex_guess));
+            ctrl_checkbox(s, "Use short Diffie-Hellman exponents",
+                          'u', HELPCTX(ssh_kexlist),
+                          conf_checkbox_handler,
+                          I(CONF_ssh_dh_short_exponent));
 
             s = ctrl_getset(b, "Connection/SSH/Kex", "repeat",
                             "Options controlling key re-exchange");
@@ -2639,6 +2674,12 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           HELPCTX(ssh_ciphers),
                           conf_checkbox_handler,
                           I(CONF_ssh2_des_cbc));
+
+            ctrl_checkbox(s, "Put whichever of AES, ChaCha20 and AES-GCM is"
+                          " fastest here first", 'f',
+                          HELPCTX(ssh_ciphers),
+                          conf_checkbox_handler,
+                          I(CONF_ssh_cipher_auto));
         }
 
         if (!midsession) {
@@ -2683,6 +2724,14 @@ void setup_config_box(struct controlbox *b, bool midsession,
                           HELPCTX(ssh_auth_changeuser),
                           conf_checkbox_handler,
                           I(CONF_change_username));
+            ctrl_editbox(s, "Pageant keys to offer at once", 'o', 20,
+                         HELPCTX(ssh_auth_probes),
+                         conf_editbox_handler,
+                         I(CONF_agent_key_probes), I(-1));
+            ctrl_checkbox(s, "Try the method that worked last time first",
+                          'w', HELPCTX(ssh_auth_remember),
+                          conf_checkbox_handler,
+                          I(CONF_remember_auth));
             ctrl_filesel(s, "Private key file for authentication:", 'k',
                          FILTER_KEY_FILES, false, "Select private key file",
                          HELPCTX(ssh_auth_privkey),
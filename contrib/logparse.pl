@@ -4,10 +4,12 @@ use Getopt::Long;
 use strict;
 use warnings;
 use FileHandle;
+use POSIX ();
 
 my $dumpchannels = 0;
 my $dumpdata = 0;
 my $pass_through_events = 0;
+my $text_output = 0;
 my $verbose_all;
 my %verbose_packet;
 GetOptions("dump-channels|c" => \$dumpchannels,
@@ -15,6 +17,7 @@ GetOptions("dump-channels|c" => \$dumpchannels,
            "verbose|v" => \$verbose_all,
            "full|f=s" => sub { $verbose_packet{$_[1]} = 1; },
            "events|e" => \$pass_through_events,
+           "text|t" => \$text_output,
            "help" => sub { &usage(\*STDOUT, 0); })
     or &usage(\*STDERR, 1);
 
@@ -27,6 +30,7 @@ options: --dump-channels, -c  dump the final state of every channel
          --full=PKT, -f PKT   print extra detail for packets of type PKT
          --verbose, -v        print extra detail for all packets if available
          --events, -e         copy Event Log messages from input log file
+         --text, -t           just convert a binary log to text and print it
 EOF
     exit $exitstatus;
 }
@@ -1028,11 +1032,161 @@ for my $type (keys %verbose_packet) {
     }
 }
 
+# Input. A log file may be either PuTTY's ordinary text packet log, or
+# the binary format written when 'Write packet log in compact binary
+# format' is set (see the comment in logging.c). Binary logs are
+# converted back into the text format on the fly, so the rest of this
+# script only has to understand one of them.
+my $binlog_magic = "PuTTY-binary-packet-log";
+my ($infh, $inbinary, $ineof);
+my $inbuf = "";
+my @inlines = ();
+
+sub readinput {
+    # Try to have at least $n bytes in $inbuf; return true if we do.
+    my ($n) = @_;
+    while (length $inbuf < $n && !$ineof) {
+        my $got = read $infh, $inbuf, 65536, length $inbuf;
+        die "read: $!\n" unless defined $got;
+        $ineof = 1 if $got == 0;
+    }
+    return length $inbuf >= $n;
+}
+
+sub nextline {
+    if (!defined $infh) {
+        if (@ARGV) {
+            open $infh, "<", $ARGV[0] or die "$ARGV[0]: open: $!\n";
+        } else {
+            $infh = \*STDIN;
+        }
+        binmode $infh;
+        my $hdrlen = 4 + 1 + 8 + 4 + 4 + length $binlog_magic;
+        $inbinary = (&readinput($hdrlen) &&
+                     substr($inbuf, 4, 1) eq "H" &&
+                     substr($inbuf, 17, 4 + length $binlog_magic) eq
+                     pack "N/a*", $binlog_magic);
+    }
+
+    if (!$inbinary) {
+        my $nl;
+        while (($nl = index $inbuf, "\n") < 0 && !$ineof) {
+            &readinput(length($inbuf) + 1);
+        }
+        $nl = length($inbuf) - 1 if $nl < 0;
+        return undef if $nl < 0;
+        my $line = substr $inbuf, 0, $nl + 1;
+        substr($inbuf, 0, $nl + 1) = "";
+        return $line;
+    }
+
+    while (!@inlines) {
+        return undef unless &readinput(4);
+        my $len = unpack "N", $inbuf;
+        die "binary log truncated\n" unless &readinput(4 + $len);
+        my $record = substr $inbuf, 4, $len;
+        substr($inbuf, 0, 4 + $len) = "";
+        push @inlines, &binlog_to_text($record);
+    }
+    return shift @inlines;
+}
+
+sub binlog_to_text {
+    # Reproduce exactly what log_packet() and friends would have
+    # written in text mode for one record of a binary log.
+    my ($record) = @_;
+    my ($kind, $time, $ticks, $body) = unpack "a Q> N a*", $record;
+    my @lines = ();
+
+    if ($kind eq "H") {
+        my ($magic, $version, $withheader) = unpack "N/a* N C", $body;
+        die "unsupported binary log version $version\n" if $version != 1;
+        push @lines, sprintf "=~=~=~=~=~=~=~=~=~=~=~= PuTTY log %s" .
+            " =~=~=~=~=~=~=~=~=~=~=~=\r\n",
+            POSIX::strftime("%Y.%m.%d %H:%M:%S", localtime $time)
+            if $withheader;
+    } elsif ($kind eq "E") {
+        my ($event) = unpack "N/a*", $body;
+        push @lines, "Event Log: $event\r\n";
+    } elsif ($kind eq "P" || $kind eq "R") {
+        my ($dir, $type, $texttype, $hasseq, $seq, $downstream, $addtext,
+            $len, $caplen, $nruns, $rest) =
+            unpack "C N N/a* C Q> N N/a* N N N a*", $body;
+        my @class = (0) x $caplen; # PKTLOG_EMIT, PKTLOG_BLANK, PKTLOG_OMIT
+        for (1..$nruns) {
+            my ($offset, $runlen, $runtype);
+            ($offset, $runlen, $runtype, $rest) = unpack "N N C a*", $rest;
+            @class[$offset .. $offset + $runlen - 1] = ($runtype) x $runlen;
+        }
+        my @bytes = unpack "C*", unpack "N/a*", $rest;
+        my $dirword = $dir == 0 ? "Incoming" : "Outgoing";
+
+        if ($kind eq "P") {
+            my $line = "$dirword packet ";
+            $line .= sprintf "#0x%x, ", $seq if $hasseq;
+            $line .= sprintf "type %d / 0x%02x (%s)", $type, $type, $texttype;
+            if ($downstream) {
+                $line .= sprintf " on behalf of downstream #%u", $downstream;
+                $line .= " ($addtext)" if length $addtext;
+            }
+            push @lines, "$line\r\n";
+        } else {
+            push @lines, sprintf "%s raw data at %s\r\n", $dirword,
+                POSIX::strftime("%Y-%m-%d %H:%M:%S", localtime $time);
+        }
+
+        my ($row, $outpos, $omitted) = ("", 0, 0);
+        my $omitline = sub {
+            sprintf "  (%d byte%s omitted)\r\n", $omitted,
+                $omitted == 1 ? "" : "s";
+        };
+        for (my $p = 0; $p < $caplen;) {
+            my $class = $class[$p];
+            if ($class != 2 && $omitted) {
+                push @lines, &$omitline();
+                $omitted = 0;
+            }
+            $row = sprintf "  %08x%*s", $p - ($p % 16), 1+3*16+2+16, ""
+                if !$outpos && !$omitted;
+            if ($class == 2) {
+                $omitted++;
+            } else {
+                my $c = $class == 1 ? ord "X" : shift @bytes;
+                substr($row, 10+2+3*($p % 16), 2) =
+                    $class == 1 ? "XX" : sprintf "%02x", $c;
+                substr($row, 10+1+3*16+2+($p % 16), 1) =
+                    $c >= 0x20 && $c < 0x7F ? chr $c : ".";
+                $outpos = ($p % 16) + 1;
+            }
+            $p++;
+            if (($p % 16) == 0 || $p == $caplen || $omitted) {
+                if ($outpos) {
+                    push @lines, substr($row, 0, 10+1+3*16+2+$outpos) . "\r\n";
+                    $outpos = 0;
+                }
+            }
+        }
+        push @lines, &$omitline() if $omitted;
+        push @lines, sprintf "  (%d byte%s not logged)\r\n", $len - $caplen,
+            $len - $caplen == 1 ? "" : "s" if $caplen < $len;
+    } else {
+        die "unrecognised binary log record type '$kind'\n";
+    }
+    return @lines;
+}
+
+if ($text_output) {
+    my $line;
+    binmode STDOUT;
+    print $line while defined($line = &nextline());
+    exit 0;
+}
+
 my ($direction, $seq, $ourseq, $type, $data, $recording);
 my %ourseqs = ('i'=>0, 'o'=>0);
 
 $recording = 0;
-while (<<>>) {
+while (defined($_ = &nextline())) {
     if ($recording) {
         if (/^  [0-9a-fA-F]{8}  ((?:[0-9a-fA-F]{2} )*[0-9a-fA-F]{2})/) {
             push @$data, map { $_ eq "XX" ? -1 : hex $_ } split / /, $1;
@@ -61,6 +61,7 @@ typedef struct term_utf8_decode term_utf8_decode;
 
 typedef struct Filename Filename;
 typedef struct FontSpec FontSpec;
+typedef struct TempFile TempFile;
 
 typedef struct bufchain_tag bufchain;
 
@@ -68,6 +69,7 @@ typedef struct strbuf strbuf;
 typedef struct LoadedFile LoadedFile;
 
 typedef struct RSAKey RSAKey;
+typedef struct RSAPrecomp RSAPrecomp;
 
 typedef struct BinarySink BinarySink;
 typedef struct BinarySource BinarySource;
@@ -104,10 +106,12 @@ typedef struct MontyContext MontyContext;
 
 typedef struct WeierstrassCurve WeierstrassCurve;
 typedef struct WeierstrassPoint WeierstrassPoint;
+typedef struct WeierstrassPointTable WeierstrassPointTable;
 typedef struct MontgomeryCurve MontgomeryCurve;
 typedef struct MontgomeryPoint MontgomeryPoint;
 typedef struct EdwardsCurve EdwardsCurve;
 typedef struct EdwardsPoint EdwardsPoint;
+typedef struct EdwardsPointTable EdwardsPointTable;
 
 typedef struct SshServerConfig SshServerConfig;
 typedef struct SftpServer SftpServer;
@@ -123,6 +127,7 @@ typedef struct share_channel share_channel;
 
 typedef struct PortFwdManager PortFwdManager;
 typedef struct PortFwdRecord PortFwdRecord;
+typedef struct RateLimit RateLimit;
 typedef struct ConnectionLayer ConnectionLayer;
 
 typedef struct prng prng;
@@ -187,6 +192,14 @@ typedef struct PacketProtocolLayer PacketProtocolLayer;
 #define NORETURN
 #endif
 
+/* Per-thread variables, on compilers we know how to ask for them.
+ * Code using this must cope with it being undefined. */
+#if defined _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#elif defined __GNUC__ || defined __clang__
+#define THREAD_LOCAL __thread
+#endif
+
 /* ----------------------------------------------------------------------
  * Platform-specific definitions.
  *
@@ -332,19 +332,18 @@ WeierstrassPoint *ecc_weierstrass_add(WeierstrassPoint *P, WeierstrassPoint *Q)
  * the curve equation y^2=x^3+ax+b to get 2y dy/dx = 3x^2+a.
  */
 static inline void ecc_weierstrass_tangent_slope(
-    WeierstrassPoint *P, mp_int **lambda_n, mp_int **lambda_d)
+    WeierstrassCurve *wc, mp_int *X, mp_int *Y, mp_int *Z,
+    mp_int **lambda_n, mp_int **lambda_d)
 {
-    WeierstrassCurve *wc = P->wc;
-
-    mp_int *X2 = monty_mul(wc->mc, P->X, P->X);
+    mp_int *X2 = monty_mul(wc->mc, X, X);
     mp_int *twoX2 = monty_add(wc->mc, X2, X2);
     mp_int *threeX2 = monty_add(wc->mc, twoX2, X2);
-    mp_int *Z2 = monty_mul(wc->mc, P->Z, P->Z);
+    mp_int *Z2 = monty_mul(wc->mc, Z, Z);
     mp_int *Z4 = monty_mul(wc->mc, Z2, Z2);
     mp_int *aZ4 = monty_mul(wc->mc, wc->a, Z4);
 
     *lambda_n = monty_add(wc->mc, threeX2, aZ4);
-    *lambda_d = monty_add(wc->mc, P->Y, P->Y);
+    *lambda_d = monty_add(wc->mc, Y, Y);
 
     mp_free(X2);
     mp_free(twoX2);
@@ -360,7 +359,7 @@ WeierstrassPoint *ecc_weierstrass_double(WeierstrassPoint *P)
     WeierstrassPoint *D = ecc_weierstrass_point_new_empty(wc);
 
     mp_int *lambda_n, *lambda_d;
-    ecc_weierstrass_tangent_slope(P, &lambda_n, &lambda_d);
+    ecc_weierstrass_tangent_slope(wc, P->X, P->Y, P->Z, &lambda_n, &lambda_d);
     ecc_weierstrass_epilogue(P->X, P->X, P->Y, P->Z, lambda_n, lambda_d, D);
     mp_free(lambda_n);
     mp_free(lambda_d);
@@ -390,9 +389,12 @@ WeierstrassPoint *ecc_weierstrass_add_general(
     ecc_weierstrass_add_prologue(
         P, Q, &Px, &Py, &Qx, &denom, &lambda_n, &lambda_d);
 
-    /* Slope if P == Q */
+    /* Slope if P == Q. This must be computed from P's coordinates
+     * rescaled to the common denominator, i.e. (Px,Py,denom), because
+     * that's the representation the epilogue is going to use. */
     mp_int *lambda_n_tangent, *lambda_d_tangent;
-    ecc_weierstrass_tangent_slope(P, &lambda_n_tangent, &lambda_d_tangent);
+    ecc_weierstrass_tangent_slope(wc, Px, Py, denom,
+                                  &lambda_n_tangent, &lambda_d_tangent);
 
     /* Select between those slopes depending on whether P == Q */
     unsigned same_x_coord = mp_eq_integer(lambda_d, 0);
@@ -468,6 +470,205 @@ WeierstrassPoint *ecc_weierstrass_multiply(WeierstrassPoint *B, mp_int *n)
     return k_B;
 }
 
+/*
+ * Fixed-base multiplication, by the same windowed-table technique as
+ * ecc_edwards_table_multiply below (see the comment there). Here the
+ * table entries are summed with ecc_weierstrass_add_general, because
+ * the accumulator and the selected entry can be equal, opposite, or
+ * the identity.
+ */
+#define WEIERSTRASS_TABLE_WINDOW 4
+#define WEIERSTRASS_TABLE_ROW (1 << WEIERSTRASS_TABLE_WINDOW)
+
+struct WeierstrassPointTable {
+    WeierstrassPoint *P;         /* the fixed point itself */
+    WeierstrassPoint *next_base; /* 16^nwindows * P */
+    size_t nwindows, entriessize;
+    WeierstrassPoint **entries;  /* WEIERSTRASS_TABLE_ROW per window */
+};
+
+WeierstrassPointTable *ecc_weierstrass_table_new(WeierstrassPoint *P)
+{
+    WeierstrassPointTable *tab = snew(WeierstrassPointTable);
+    tab->P = ecc_weierstrass_point_copy(P);
+    tab->next_base = ecc_weierstrass_point_copy(P);
+    tab->nwindows = tab->entriessize = 0;
+    tab->entries = NULL;
+    return tab;
+}
+
+void ecc_weierstrass_table_free(WeierstrassPointTable *tab)
+{
+    for (size_t i = 0; i < tab->nwindows * WEIERSTRASS_TABLE_ROW; i++)
+        ecc_weierstrass_point_free(tab->entries[i]);
+    sfree(tab->entries);
+    ecc_weierstrass_point_free(tab->P);
+    ecc_weierstrass_point_free(tab->next_base);
+    sfree(tab);
+}
+
+static void ecc_weierstrass_table_extend(
+    WeierstrassPointTable *tab, size_t nwindows)
+{
+    while (tab->nwindows < nwindows) {
+        sgrowarray(tab->entries, tab->entriessize,
+                   (tab->nwindows + 1) * WEIERSTRASS_TABLE_ROW - 1);
+        WeierstrassPoint **row =
+            tab->entries + tab->nwindows * WEIERSTRASS_TABLE_ROW;
+
+        row[0] = ecc_weierstrass_point_new_identity(tab->P->wc);
+        row[1] = ecc_weierstrass_point_copy(tab->next_base);
+        for (size_t j = 2; j < WEIERSTRASS_TABLE_ROW; j++)
+            row[j] = ecc_weierstrass_add_general(row[j-1], tab->next_base);
+
+        WeierstrassPoint *new_base = ecc_weierstrass_add_general(
+            row[WEIERSTRASS_TABLE_ROW - 1], tab->next_base);
+        ecc_weierstrass_point_free(tab->next_base);
+        tab->next_base = new_base;
+
+        tab->nwindows++;
+    }
+}
+
+WeierstrassPoint *ecc_weierstrass_table_multiply(
+    WeierstrassPointTable *tab, mp_int *n)
+{
+    size_t nwindows = (mp_max_bits(n) + WEIERSTRASS_TABLE_WINDOW - 1) /
+        WEIERSTRASS_TABLE_WINDOW;
+    ecc_weierstrass_table_extend(tab, nwindows);
+
+    WeierstrassCurve *wc = tab->P->wc;
+    WeierstrassPoint *acc = ecc_weierstrass_point_new_identity(wc);
+    WeierstrassPoint *selected = ecc_weierstrass_point_new_identity(wc);
+
+    for (size_t i = 0; i < nwindows; i++) {
+        unsigned window = 0;
+        for (size_t b = 0; b < WEIERSTRASS_TABLE_WINDOW; b++)
+            window |= mp_get_bit(n, i * WEIERSTRASS_TABLE_WINDOW + b) << b;
+
+        WeierstrassPoint **row = tab->entries + i * WEIERSTRASS_TABLE_ROW;
+        for (unsigned j = 0; j < WEIERSTRASS_TABLE_ROW; j++) {
+            /* window and j are both less than 16, so diff-1 has
+             * bit 8 set iff they're equal */
+            unsigned diff = window ^ j;
+            ecc_weierstrass_cond_overwrite(selected, row[j],
+                                           1 & ((diff - 1) >> 8));
+        }
+
+        WeierstrassPoint *sum = ecc_weierstrass_add_general(acc, selected);
+        ecc_weierstrass_point_free(acc);
+        acc = sum;
+    }
+
+    ecc_weierstrass_point_free(selected);
+    return acc;
+}
+
+/*
+ * Variable-time computation of a*P + b*Q, for verifying signatures,
+ * where both points and both multipliers are public. This is the
+ * Strauss-Shamir trick: instead of two separate multiplications, we
+ * make one pass down the bits of the multipliers, doubling an
+ * accumulator once per bit and adding in multiples of P and Q as we
+ * go, so that the doublings are shared.
+ *
+ * Each multiplier is first recoded into sliding windows of up to
+ * SHAMIR_WINDOW bits, each of which starts and ends with a 1 bit (so
+ * its value is odd), with zero bits between them. Then we only need
+ * tables of the odd multiples of P and Q, and only do an addition at
+ * the bottom bit of each window: about one per SHAMIR_WINDOW+1 bits
+ * of each multiplier, against one per bit in the constant-time
+ * ladder.
+ *
+ * Everything about this depends on the values of the multipliers,
+ * and the additions branch on whether the accumulator is the
+ * identity, so it must never be given secret data.
+ */
+#define SHAMIR_WINDOW 4
+#define SHAMIR_TABLE (1 << (SHAMIR_WINDOW - 1))
+
+/* digits[i] is 0, or the (odd) value of the window whose bottom bit
+ * is bit i of n */
+static unsigned char *shamir_recode(mp_int *n, size_t bits)
+{
+    unsigned char *digits = snewn(bits, unsigned char);
+    memset(digits, 0, bits);
+
+    for (size_t i = bits; i-- > 0 ;) {
+        if (!mp_get_bit(n, i))
+            continue;
+
+        size_t j = (i + 1 > SHAMIR_WINDOW ? i + 1 - SHAMIR_WINDOW : 0);
+        while (!mp_get_bit(n, j))
+            j++;
+        unsigned value = 0;
+        for (size_t k = i + 1; k-- > j ;)
+            value = (value << 1) | mp_get_bit(n, k);
+        digits[j] = value;
+        i = j;
+    }
+
+    return digits;
+}
+
+static size_t shamir_bits(mp_int *a, mp_int *b)
+{
+    size_t abits = mp_get_nbits(a), bbits = mp_get_nbits(b);
+    return abits > bbits ? abits : bbits;
+}
+
+/* table[j] = (2j+1) * P */
+static void ecc_weierstrass_odd_multiples(
+    WeierstrassPoint *P, WeierstrassPoint **table)
+{
+    WeierstrassPoint *two_P = ecc_weierstrass_add_general(P, P);
+    table[0] = ecc_weierstrass_point_copy(P);
+    for (size_t j = 1; j < SHAMIR_TABLE; j++)
+        table[j] = ecc_weierstrass_add_general(table[j-1], two_P);
+    ecc_weierstrass_point_free(two_P);
+}
+
+WeierstrassPoint *ecc_weierstrass_multiply_sum_vartime(
+    WeierstrassPoint *P, mp_int *a, WeierstrassPoint *Q, mp_int *b)
+{
+    WeierstrassPoint *Ptab[SHAMIR_TABLE], *Qtab[SHAMIR_TABLE];
+    size_t bits = shamir_bits(a, b);
+    unsigned char *adigits = shamir_recode(a, bits);
+    unsigned char *bdigits = shamir_recode(b, bits);
+
+    ecc_weierstrass_odd_multiples(P, Ptab);
+    ecc_weierstrass_odd_multiples(Q, Qtab);
+
+    WeierstrassPoint *acc = ecc_weierstrass_point_new_identity(P->wc);
+    for (size_t i = bits; i-- > 0 ;) {
+        WeierstrassPoint *tmp;
+
+        if (!ecc_weierstrass_is_identity(acc)) {
+            tmp = ecc_weierstrass_double(acc);
+            ecc_weierstrass_point_free(acc);
+            acc = tmp;
+        }
+        if (adigits[i]) {
+            tmp = ecc_weierstrass_add_general(acc, Ptab[adigits[i] >> 1]);
+            ecc_weierstrass_point_free(acc);
+            acc = tmp;
+        }
+        if (bdigits[i]) {
+            tmp = ecc_weierstrass_add_general(acc, Qtab[bdigits[i] >> 1]);
+            ecc_weierstrass_point_free(acc);
+            acc = tmp;
+        }
+    }
+
+    for (size_t j = 0; j < SHAMIR_TABLE; j++) {
+        ecc_weierstrass_point_free(Ptab[j]);
+        ecc_weierstrass_point_free(Qtab[j]);
+    }
+    sfree(adigits);
+    sfree(bdigits);
+    return acc;
+}
+
 unsigned ecc_weierstrass_is_identity(WeierstrassPoint *wp)
 {
     return mp_eq_integer(wp->Z, 0);
@@ -1129,6 +1330,187 @@ EdwardsPoint *ecc_edwards_multiply(EdwardsPoint *B, mp_int *n)
     return k_B;
 }
 
+/*
+ * Fixed-base multiplication. The table stores j * 16^i * P for every
+ * j in [0,16) and every window index i we've needed so far, so that
+ * n*P is just the sum over i of the entry for the ith 4-bit window of
+ * n: one point addition per 4 bits of exponent, and no doublings at
+ * all, instead of a doubling and an addition per bit.
+ *
+ * To stay side-channel safe, each window's entry is fetched by
+ * reading all 16 candidates and keeping the right one with
+ * ecc_edwards_cond_overwrite. (The formulae in ecc_edwards_add are
+ * complete, so it doesn't matter that entry 0 is the identity.)
+ *
+ * The table is built lazily, and extended if a longer exponent comes
+ * along; that only depends on the size of the exponent, which isn't
+ * secret.
+ */
+#define EDWARDS_TABLE_WINDOW 4
+#define EDWARDS_TABLE_ROW (1 << EDWARDS_TABLE_WINDOW)
+
+struct EdwardsPointTable {
+    EdwardsPoint *P;             /* the fixed point itself */
+    EdwardsPoint *next_base;     /* 16^nwindows * P */
+    size_t nwindows, entriessize;
+    EdwardsPoint **entries;      /* EDWARDS_TABLE_ROW per window */
+};
+
+EdwardsPointTable *ecc_edwards_table_new(EdwardsPoint *P)
+{
+    EdwardsPointTable *tab = snew(EdwardsPointTable);
+    tab->P = ecc_edwards_point_copy(P);
+    tab->next_base = ecc_edwards_point_copy(P);
+    tab->nwindows = tab->entriessize = 0;
+    tab->entries = NULL;
+    return tab;
+}
+
+void ecc_edwards_table_free(EdwardsPointTable *tab)
+{
+    for (size_t i = 0; i < tab->nwindows * EDWARDS_TABLE_ROW; i++)
+        ecc_edwards_point_free(tab->entries[i]);
+    sfree(tab->entries);
+    ecc_edwards_point_free(tab->P);
+    ecc_edwards_point_free(tab->next_base);
+    sfree(tab);
+}
+
+static EdwardsPoint *ecc_edwards_identity(EdwardsCurve *ec)
+{
+    mp_int *zero = mp_copy(monty_identity(ec->mc));
+    mp_clear(zero);
+    return ecc_edwards_point_new_imported(
+        ec, zero, mp_copy(monty_identity(ec->mc)));
+}
+
+static void ecc_edwards_table_extend(EdwardsPointTable *tab, size_t nwindows)
+{
+    EdwardsCurve *ec = tab->P->ec;
+
+    while (tab->nwindows < nwindows) {
+        sgrowarray(tab->entries, tab->entriessize,
+                   (tab->nwindows + 1) * EDWARDS_TABLE_ROW - 1);
+        EdwardsPoint **row = tab->entries + tab->nwindows * EDWARDS_TABLE_ROW;
+
+        row[0] = ecc_edwards_identity(ec);
+        row[1] = ecc_edwards_point_copy(tab->next_base);
+        for (size_t j = 2; j < EDWARDS_TABLE_ROW; j++)
+            row[j] = ecc_edwards_add(row[j-1], tab->next_base);
+
+        EdwardsPoint *new_base = ecc_edwards_add(
+            row[EDWARDS_TABLE_ROW - 1], tab->next_base);
+        ecc_edwards_point_free(tab->next_base);
+        tab->next_base = new_base;
+
+        tab->nwindows++;
+    }
+}
+
+EdwardsPoint *ecc_edwards_table_multiply(EdwardsPointTable *tab, mp_int *n)
+{
+    size_t nwindows = (mp_max_bits(n) + EDWARDS_TABLE_WINDOW - 1) /
+        EDWARDS_TABLE_WINDOW;
+    ecc_edwards_table_extend(tab, nwindows);
+
+    EdwardsCurve *ec = tab->P->ec;
+    EdwardsPoint *acc = ecc_edwards_identity(ec);
+    EdwardsPoint *selected = ecc_edwards_identity(ec);
+
+    for (size_t i = 0; i < nwindows; i++) {
+        unsigned window = 0;
+        for (size_t b = 0; b < EDWARDS_TABLE_WINDOW; b++)
+            window |= mp_get_bit(n, i * EDWARDS_TABLE_WINDOW + b) << b;
+
+        EdwardsPoint **row = tab->entries + i * EDWARDS_TABLE_ROW;
+        for (unsigned j = 0; j < EDWARDS_TABLE_ROW; j++) {
+            /* window and j are both less than 16, so diff-1 has
+             * bit 8 set iff they're equal */
+            unsigned diff = window ^ j;
+            ecc_edwards_cond_overwrite(selected, row[j],
+                                       1 & ((diff - 1) >> 8));
+        }
+
+        EdwardsPoint *sum = ecc_edwards_add(acc, selected);
+        ecc_edwards_point_free(acc);
+        acc = sum;
+    }
+
+    ecc_edwards_point_free(selected);
+    return acc;
+}
+
+/*
+ * The Edwards version of ecc_weierstrass_multiply_sum_vartime: see
+ * the comments there. ecc_edwards_add is complete, so it does all
+ * the work, doublings included.
+ */
+static void ecc_edwards_odd_multiples(EdwardsPoint *P, EdwardsPoint **table)
+{
+    EdwardsPoint *two_P = ecc_edwards_add(P, P);
+    table[0] = ecc_edwards_point_copy(P);
+    for (size_t j = 1; j < SHAMIR_TABLE; j++)
+        table[j] = ecc_edwards_add(table[j-1], two_P);
+    ecc_edwards_point_free(two_P);
+}
+
+EdwardsPoint *ecc_edwards_multiply_sum_vartime(
+    EdwardsPoint *P, mp_int *a, EdwardsPoint *Q, mp_int *b)
+{
+    EdwardsPoint *Ptab[SHAMIR_TABLE], *Qtab[SHAMIR_TABLE];
+    size_t bits = shamir_bits(a, b);
+    unsigned char *adigits = shamir_recode(a, bits);
+    unsigned char *bdigits = shamir_recode(b, bits);
+
+    ecc_edwards_odd_multiples(P, Ptab);
+    ecc_edwards_odd_multiples(Q, Qtab);
+
+    EdwardsPoint *acc = ecc_edwards_identity(P->ec);
+    bool started = false;
+    for (size_t i = bits; i-- > 0 ;) {
+        EdwardsPoint *tmp;
+
+        if (started) {
+            tmp = ecc_edwards_add(acc, acc);
+            ecc_edwards_point_free(acc);
+            acc = tmp;
+        }
+        if (adigits[i]) {
+            tmp = ecc_edwards_add(acc, Ptab[adigits[i] >> 1]);
+            ecc_edwards_point_free(acc);
+            acc = tmp;
+            started = true;
+        }
+        if (bdigits[i]) {
+            tmp = ecc_edwards_add(acc, Qtab[bdigits[i] >> 1]);
+            ecc_edwards_point_free(acc);
+            acc = tmp;
+            started = true;
+        }
+    }
+
+    for (size_t j = 0; j < SHAMIR_TABLE; j++) {
+        ecc_edwards_point_free(Ptab[j]);
+        ecc_edwards_point_free(Qtab[j]);
+    }
+    sfree(adigits);
+    sfree(bdigits);
+    return acc;
+}
+
+EdwardsPoint *ecc_edwards_negate(EdwardsPoint *P)
+{
+    EdwardsCurve *ec = P->ec;
+    EdwardsPoint *N = ecc_edwards_point_new_empty(ec);
+    mp_int *zero = mp_new(mp_max_bits(P->X));
+    N->X = monty_sub(ec->mc, zero, P->X);
+    N->Y = mp_copy(P->Y);
+    N->Z = mp_copy(P->Z);
+    N->T = monty_sub(ec->mc, zero, P->T);
+    mp_free(zero);
+    return N;
+}
+
 /*
  * Helper routine to determine whether two values each given as a pair
  * of projective coordinates represent the same affine value.
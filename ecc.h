@@ -96,6 +96,27 @@ WeierstrassPoint *ecc_weierstrass_double(WeierstrassPoint *);
  */
 WeierstrassPoint *ecc_weierstrass_multiply(WeierstrassPoint *, mp_int *);
 
+/*
+ * Precomputed table of multiples of a fixed point, for when the same
+ * point will be multiplied by a lot of different integers (such as
+ * the base point of an ECDSA or ECDH curve).
+ * ecc_weierstrass_table_multiply gives the same answer as
+ * ecc_weierstrass_multiply on the original point, but much faster.
+ * The table is built on first use.
+ */
+WeierstrassPointTable *ecc_weierstrass_table_new(WeierstrassPoint *P);
+void ecc_weierstrass_table_free(WeierstrassPointTable *tab);
+WeierstrassPoint *ecc_weierstrass_table_multiply(
+    WeierstrassPointTable *tab, mp_int *n);
+
+/*
+ * Compute a*P + b*Q in one go, faster than two multiplications and
+ * an add. This runs in variable time, so it's only for public inputs
+ * (verifying signatures), never for anything involving a private key.
+ */
+WeierstrassPoint *ecc_weierstrass_multiply_sum_vartime(
+    WeierstrassPoint *P, mp_int *a, WeierstrassPoint *Q, mp_int *b);
+
 /*
  * Query functions to get the value of a point back out. is_identity
  * tells you whether the point is the identity; if it isn't, then
@@ -175,6 +196,24 @@ void ecc_montgomery_get_affine(MontgomeryPoint *mp, mp_int **x);
  */
 unsigned ecc_montgomery_is_identity(MontgomeryPoint *mp);
 
+/*
+ * Dedicated implementation of the X25519 function from RFC 7748:
+ * multiply the Curve25519 point with x-coordinate u by the given
+ * scalar (clamped as the RFC specifies), and return the resulting
+ * x-coordinate. All three values are 32-byte little-endian strings.
+ *
+ * This is much faster than doing the same job with the generic
+ * functions above, but it needs a 128-bit integer type, so it's only
+ * available if ECC_HAVE_X25519 is true.
+ */
+#if defined __SIZEOF_INT128__
+#define ECC_HAVE_X25519 1
+#else
+#define ECC_HAVE_X25519 0
+#endif
+void ecc_x25519(unsigned char out[32], const unsigned char scalar[32],
+                const unsigned char u[32]);
+
 /* ----------------------------------------------------------------------
  * Twisted Edwards curves.
  *
@@ -233,6 +272,25 @@ void ecc_edwards_point_free(EdwardsPoint *point);
 EdwardsPoint *ecc_edwards_add(EdwardsPoint *, EdwardsPoint *);
 EdwardsPoint *ecc_edwards_multiply(EdwardsPoint *, mp_int *);
 
+/*
+ * Precomputed table of multiples of a fixed point, for when the same
+ * point will be multiplied by a lot of different integers (such as
+ * the base point of an EdDSA curve). ecc_edwards_table_multiply gives
+ * the same answer as ecc_edwards_multiply on the original point, but
+ * much faster. The table is built on first use.
+ */
+EdwardsPointTable *ecc_edwards_table_new(EdwardsPoint *P);
+void ecc_edwards_table_free(EdwardsPointTable *tab);
+EdwardsPoint *ecc_edwards_table_multiply(EdwardsPointTable *tab, mp_int *n);
+
+/*
+ * Negate a point, and compute a*P + b*Q in variable time (see
+ * ecc_weierstrass_multiply_sum_vartime).
+ */
+EdwardsPoint *ecc_edwards_negate(EdwardsPoint *P);
+EdwardsPoint *ecc_edwards_multiply_sum_vartime(
+    EdwardsPoint *P, mp_int *a, EdwardsPoint *Q, mp_int *b);
+
 /*
  * Query functions: compare two points for equality, and return the
  * affine coordinates of a point.
@@ -0,0 +1,338 @@
+/*
+ * Dedicated implementation of the X25519 function from RFC 7748,
+ * i.e. scalar multiplication on the x-coordinate of Curve25519.
+ *
+ * The generic Montgomery-curve code in ecc.c can do this too, but it
+ * works in terms of mp_int and MontyContext, so every field operation
+ * involves a general-purpose multiplication followed by a Montgomery
+ * reduction, and every step of the ladder allocates and frees
+ * temporaries. Curve25519 is the key exchange we use most often, so
+ * it's worth having a version specialised to its particular prime
+ * p = 2^255-19.
+ *
+ * Field elements are represented in radix 2^51, as five 64-bit limbs
+ * with value f[0] + f[1]*2^51 + f[2]*2^102 + f[3]*2^153 + f[4]*2^204.
+ * Since 2^255 = 19 (mod p), any product term that lands at or above
+ * 2^255 can be folded back down to the bottom by multiplying it by
+ * 19. Products of two limbs need 128 bits, so this code is only
+ * compiled where the compiler provides a 128-bit integer type;
+ * elsewhere, sshecc.c falls back to the generic code.
+ *
+ * Everything is done on the stack, and nothing has data-dependent
+ * control flow or memory access: the ladder swaps its two working
+ * points with a masked conditional swap, as the generic version does.
+ */
+
+#include <assert.h>
+
+#include "ssh.h"
+#include "mpint.h"
+#include "ecc.h"
+
+#if ECC_HAVE_X25519
+
+typedef unsigned __int128 u128;
+typedef uint64_t fe[5];
+
+#define MASK51 (((uint64_t)1 << 51) - 1)
+
+static inline void fe_copy(fe h, const fe f)
+{
+    for (size_t i = 0; i < 5; i++)
+        h[i] = f[i];
+}
+
+static inline void fe_set_small(fe h, uint64_t n)
+{
+    h[0] = n;
+    h[1] = h[2] = h[3] = h[4] = 0;
+}
+
+/*
+ * Addition and subtraction don't carry. Their inputs are assumed to
+ * be outputs of fe_mul / fe_sq (so each limb is at most a little
+ * over 2^51), and their outputs are only used as inputs to fe_mul /
+ * fe_sq, which can cope with limbs up to about 2^54.
+ *
+ * Subtraction adds 2p first, so that no limb can go negative.
+ */
+static inline void fe_add(fe h, const fe f, const fe g)
+{
+    for (size_t i = 0; i < 5; i++)
+        h[i] = f[i] + g[i];
+}
+
+static inline void fe_sub(fe h, const fe f, const fe g)
+{
+    h[0] = (f[0] + 0xFFFFFFFFFFFDA) - g[0];
+    for (size_t i = 1; i < 5; i++)
+        h[i] = (f[i] + 0xFFFFFFFFFFFFE) - g[i];
+}
+
+/*
+ * Carry-propagate a set of 128-bit column sums into a field element
+ * whose limbs are each at most 2^51 + a small amount.
+ */
+static inline void fe_carry_wide(fe h, u128 t[5])
+{
+    t[1] += (uint64_t)(t[0] >> 51); t[0] &= MASK51;
+    t[2] += (uint64_t)(t[1] >> 51); t[1] &= MASK51;
+    t[3] += (uint64_t)(t[2] >> 51); t[2] &= MASK51;
+    t[4] += (uint64_t)(t[3] >> 51); t[3] &= MASK51;
+    t[0] += 19 * (t[4] >> 51); t[4] &= MASK51;
+
+    h[0] = (uint64_t)t[0] & MASK51;
+    h[1] = (uint64_t)t[1] + (uint64_t)(t[0] >> 51);
+    h[2] = (uint64_t)t[2];
+    h[3] = (uint64_t)t[3];
+    h[4] = (uint64_t)t[4];
+}
+
+static void fe_mul(fe h, const fe f, const fe g)
+{
+    uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+    uint64_t g0 = g[0], g1 = g[1], g2 = g[2], g3 = g[3], g4 = g[4];
+    uint64_t g1_19 = 19 * g1, g2_19 = 19 * g2;
+    uint64_t g3_19 = 19 * g3, g4_19 = 19 * g4;
+    u128 t[5];
+
+    t[0] = (u128)f0 * g0 + (u128)f1 * g4_19 + (u128)f2 * g3_19 +
+        (u128)f3 * g2_19 + (u128)f4 * g1_19;
+    t[1] = (u128)f0 * g1 + (u128)f1 * g0 + (u128)f2 * g4_19 +
+        (u128)f3 * g3_19 + (u128)f4 * g2_19;
+    t[2] = (u128)f0 * g2 + (u128)f1 * g1 + (u128)f2 * g0 +
+        (u128)f3 * g4_19 + (u128)f4 * g3_19;
+    t[3] = (u128)f0 * g3 + (u128)f1 * g2 + (u128)f2 * g1 +
+        (u128)f3 * g0 + (u128)f4 * g4_19;
+    t[4] = (u128)f0 * g4 + (u128)f1 * g3 + (u128)f2 * g2 +
+        (u128)f3 * g1 + (u128)f4 * g0;
+
+    fe_carry_wide(h, t);
+}
+
+static void fe_sq(fe h, const fe f)
+{
+    uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+    uint64_t f0_2 = 2 * f0, f1_2 = 2 * f1;
+    uint64_t f3_19 = 19 * f3, f4_19 = 19 * f4;
+    u128 t[5];
+
+    t[0] = (u128)f0 * f0 + (u128)f1_2 * f4_19 + (u128)(2 * f2) * f3_19;
+    t[1] = (u128)f0_2 * f1 + (u128)(2 * f2) * f4_19 + (u128)f3 * f3_19;
+    t[2] = (u128)f0_2 * f2 + (u128)f1 * f1 + (u128)(2 * f3) * f4_19;
+    t[3] = (u128)f0_2 * f3 + (u128)f1_2 * f2 + (u128)f4 * f4_19;
+    t[4] = (u128)f0_2 * f4 + (u128)f1_2 * f3 + (u128)f2 * f2;
+
+    fe_carry_wide(h, t);
+}
+
+/* Multiply by the constant (A-2)/4 = 121665 from the ladder formulae. */
+static void fe_mul_a24(fe h, const fe f)
+{
+    u128 t[5];
+    for (size_t i = 0; i < 5; i++)
+        t[i] = (u128)f[i] * 121665;
+    fe_carry_wide(h, t);
+}
+
+/* h = f^(p-2) = f^-1, by the usual addition chain. */
+static void fe_invert(fe h, const fe f)
+{
+    fe t0, t1, t2, t3;
+    size_t i;
+
+    fe_sq(t0, f);                                    /* 2 */
+    fe_sq(t1, t0); fe_sq(t1, t1);                    /* 8 */
+    fe_mul(t1, f, t1);                               /* 9 */
+    fe_mul(t0, t0, t1);                              /* 11 */
+    fe_sq(t2, t0);                                   /* 22 */
+    fe_mul(t1, t1, t2);                              /* 2^5 - 1 */
+    fe_sq(t2, t1);
+    for (i = 1; i < 5; i++) fe_sq(t2, t2);
+    fe_mul(t1, t2, t1);                              /* 2^10 - 1 */
+    fe_sq(t2, t1);
+    for (i = 1; i < 10; i++) fe_sq(t2, t2);
+    fe_mul(t2, t2, t1);                              /* 2^20 - 1 */
+    fe_sq(t3, t2);
+    for (i = 1; i < 20; i++) fe_sq(t3, t3);
+    fe_mul(t2, t3, t2);                              /* 2^40 - 1 */
+    fe_sq(t2, t2);
+    for (i = 1; i < 10; i++) fe_sq(t2, t2);
+    fe_mul(t1, t2, t1);                              /* 2^50 - 1 */
+    fe_sq(t2, t1);
+    for (i = 1; i < 50; i++) fe_sq(t2, t2);
+    fe_mul(t2, t2, t1);                              /* 2^100 - 1 */
+    fe_sq(t3, t2);
+    for (i = 1; i < 100; i++) fe_sq(t3, t3);
+    fe_mul(t2, t3, t2);                              /* 2^200 - 1 */
+    fe_sq(t2, t2);
+    for (i = 1; i < 50; i++) fe_sq(t2, t2);
+    fe_mul(t1, t2, t1);                              /* 2^250 - 1 */
+    fe_sq(t1, t1);
+    for (i = 1; i < 5; i++) fe_sq(t1, t1);           /* 2^255 - 2^5 */
+    fe_mul(h, t1, t0);                               /* 2^255 - 21 */
+
+    smemclr(t0, sizeof(t0));
+    smemclr(t1, sizeof(t1));
+    smemclr(t2, sizeof(t2));
+    smemclr(t3, sizeof(t3));
+}
+
+/*
+ * Swap f and g if swap is 1, or leave them alone if it's 0, without
+ * any data-dependent control flow.
+ */
+static inline void fe_cswap(fe f, fe g, unsigned swap)
+{
+    uint64_t mask = -(uint64_t)(1 & swap);
+    for (size_t i = 0; i < 5; i++) {
+        uint64_t diff = (f[i] ^ g[i]) & mask;
+        f[i] ^= diff;
+        g[i] ^= diff;
+    }
+}
+
+/*
+ * Load 32 little-endian bytes as a field element. Per RFC 7748, the
+ * top bit is ignored; the remaining 255-bit value need not be less
+ * than p, since the arithmetic doesn't mind non-canonical inputs.
+ */
+static void fe_frombytes(fe h, const unsigned char *s)
+{
+    uint64_t w0 = GET_64BIT_LSB_FIRST(s);
+    uint64_t w1 = GET_64BIT_LSB_FIRST(s + 8);
+    uint64_t w2 = GET_64BIT_LSB_FIRST(s + 16);
+    uint64_t w3 = GET_64BIT_LSB_FIRST(s + 24);
+
+    h[0] = w0 & MASK51;
+    h[1] = ((w0 >> 51) | (w1 << 13)) & MASK51;
+    h[2] = ((w1 >> 38) | (w2 << 26)) & MASK51;
+    h[3] = ((w2 >> 25) | (w3 << 39)) & MASK51;
+    h[4] = (w3 >> 12) & MASK51;
+}
+
+/*
+ * Write out a field element as 32 little-endian bytes, fully reduced
+ * mod p.
+ */
+static void fe_tobytes(unsigned char *s, const fe f)
+{
+    uint64_t t[5];
+    fe_copy(t, f);
+
+#define FE_CARRY_FULL(t) do {                                   \
+        t[1] += t[0] >> 51; t[0] &= MASK51;                     \
+        t[2] += t[1] >> 51; t[1] &= MASK51;                     \
+        t[3] += t[2] >> 51; t[2] &= MASK51;                     \
+        t[4] += t[3] >> 51; t[3] &= MASK51;                     \
+        t[0] += 19 * (t[4] >> 51); t[4] &= MASK51;              \
+    } while (0)
+
+    /* Now t is in [0, 2^255), with each limb less than 2^51. */
+    FE_CARRY_FULL(t);
+    FE_CARRY_FULL(t);
+
+    /*
+     * Add 19, so that t is at least 2^255 iff the original value was
+     * at least p, in which case the wraparound via 19 * (t[4] >> 51)
+     * takes care of subtracting p. Then add 2^255 - 19 to undo the
+     * first addition in the case where t was already reduced, and
+     * throw away the 2^255 (without folding it back in) in both.
+     */
+    t[0] += 19;
+    FE_CARRY_FULL(t);
+    t[0] += ((uint64_t)1 << 51) - 19;
+    t[1] += ((uint64_t)1 << 51) - 1;
+    t[2] += ((uint64_t)1 << 51) - 1;
+    t[3] += ((uint64_t)1 << 51) - 1;
+    t[4] += ((uint64_t)1 << 51) - 1;
+    t[1] += t[0] >> 51; t[0] &= MASK51;
+    t[2] += t[1] >> 51; t[1] &= MASK51;
+    t[3] += t[2] >> 51; t[2] &= MASK51;
+    t[4] += t[3] >> 51; t[3] &= MASK51;
+    t[4] &= MASK51;
+
+#undef FE_CARRY_FULL
+
+    PUT_64BIT_LSB_FIRST(s, t[0] | (t[1] << 51));
+    PUT_64BIT_LSB_FIRST(s + 8, (t[1] >> 13) | (t[2] << 38));
+    PUT_64BIT_LSB_FIRST(s + 16, (t[2] >> 26) | (t[3] << 25));
+    PUT_64BIT_LSB_FIRST(s + 24, (t[3] >> 39) | (t[4] << 12));
+
+    smemclr(t, sizeof(t));
+}
+
+void ecc_x25519(unsigned char out[32], const unsigned char scalar[32],
+                const unsigned char u[32])
+{
+    unsigned char k[32];
+    fe x1, x2, z2, x3, z3, a, aa, b, bb, e, c, d, da, cb;
+    unsigned swap = 0;
+
+    /* Clamp the scalar, as RFC 7748's decodeScalar25519 does. */
+    memcpy(k, scalar, 32);
+    k[0] &= 0xF8;
+    k[31] &= 0x7F;
+    k[31] |= 0x40;
+
+    fe_frombytes(x1, u);
+    fe_set_small(x2, 1);
+    fe_set_small(z2, 0);
+    fe_copy(x3, x1);
+    fe_set_small(z3, 1);
+
+    for (size_t i = 255; i-- > 0 ;) {
+        unsigned bit = 1 & (k[i >> 3] >> (i & 7));
+        swap ^= bit;
+        fe_cswap(x2, x3, swap);
+        fe_cswap(z2, z3, swap);
+        swap = bit;
+
+        fe_add(a, x2, z2);
+        fe_sq(aa, a);
+        fe_sub(b, x2, z2);
+        fe_sq(bb, b);
+        fe_sub(e, aa, bb);
+        fe_add(c, x3, z3);
+        fe_sub(d, x3, z3);
+        fe_mul(da, d, a);
+        fe_mul(cb, c, b);
+
+        fe_add(x3, da, cb);
+        fe_sq(x3, x3);
+        fe_sub(z3, da, cb);
+        fe_sq(z3, z3);
+        fe_mul(z3, z3, x1);
+
+        fe_mul(x2, aa, bb);
+        fe_mul_a24(z2, e);
+        fe_add(z2, z2, aa);
+        fe_mul(z2, z2, e);
+    }
+    fe_cswap(x2, x3, swap);
+    fe_cswap(z2, z3, swap);
+
+    /* If z2 is 0 (the identity), its 'inverse' comes out as 0 too,
+     * and so does the output. */
+    fe_invert(z2, z2);
+    fe_mul(x2, x2, z2);
+    fe_tobytes(out, x2);
+
+    smemclr(k, sizeof(k));
+    smemclr(x1, sizeof(x1));
+    smemclr(x2, sizeof(x2));
+    smemclr(z2, sizeof(z2));
+    smemclr(x3, sizeof(x3));
+    smemclr(z3, sizeof(z3));
+    smemclr(a, sizeof(a));
+    smemclr(aa, sizeof(aa));
+    smemclr(b, sizeof(b));
+    smemclr(bb, sizeof(bb));
+    smemclr(e, sizeof(e));
+    smemclr(c, sizeof(c));
+    smemclr(d, sizeof(d));
+    smemclr(da, sizeof(da));
+    smemclr(cb, sizeof(cb));
+}
+
+#endif /* ECC_HAVE_X25519 */
@@ -1,16 +1,40 @@
+/*
+ * fuzzterm: drive terminal.c with no window attached.
+ *
+ * Run with no arguments, it feeds its standard input to a terminal
+ * and prints a description of everything the terminal draws, for use
+ * as a fuzzing target. Run with -bench (see bench_main at the bottom
+ * of this file), it instead measures how fast the terminal gets
+ * through various kinds of output.
+ */
+
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 
 #include "putty.h"
 #include "dialog.h"
 #include "terminal.h"
+#include "ssh.h"                       /* for platform_perf_counter_ns */
 
 /* For Unix in particular, but harmless if this main() is reused elsewhere */
 const bool buildinfo_gtk_relevant = false;
 
 static const TermWinVtable fuzz_termwin_vt;
 
+/*
+ * In benchmark mode, the drawing functions count what they're asked
+ * to do instead of printing it.
+ */
+static bool bench_mode;
+static struct {
+    uint64_t paints, text_calls, text_chars, cursor_calls, scrolls;
+} bench_counts;
+
+static int bench_main(int argc, char **argv);
+
 int main(int argc, char **argv)
 {
         char blk[512];
@@ -20,6 +44,9 @@ int main(int argc, char **argv)
         struct unicode_data ucsdata;
         TermWin termwin;
 
+        if (argc > 1 && !strcmp(argv[1], "-bench"))
+            return bench_main(argc - 1, argv + 1);
+
         termwin.vt = &fuzz_termwin_vt;
 
         conf = conf_new();
@@ -44,13 +71,23 @@ int main(int argc, char **argv)
 }
 
 /* functions required by terminal.c */
-static bool fuzz_setup_draw_ctx(TermWin *tw) { return true; }
+static bool fuzz_setup_draw_ctx(TermWin *tw)
+{
+    bench_counts.paints++;
+    return true;
+}
 static void fuzz_draw_text(
     TermWin *tw, int x, int y, wchar_t *text, int len,
     unsigned long attr, int lattr, truecolour tc)
 {
     int i;
 
+    if (bench_mode) {
+        bench_counts.text_calls++;
+        bench_counts.text_chars += len;
+        return;
+    }
+
     printf("TEXT[attr=%08lx,lattr=%02x]@(%d,%d):", attr, lattr, x, y);
     for (i = 0; i < len; i++) {
         printf(" %x", (unsigned)text[i]);
@@ -63,6 +100,11 @@ static void fuzz_draw_cursor(
 {
     int i;
 
+    if (bench_mode) {
+        bench_counts.cursor_calls++;
+        return;
+    }
+
     printf("CURS[attr=%08lx,lattr=%02x]@(%d,%d):", attr, lattr, x, y);
     for (i = 0; i < len; i++) {
         printf(" %x", (unsigned)text[i]);
@@ -71,7 +113,14 @@ static void fuzz_draw_cursor(
 }
 static void fuzz_draw_trust_sigil(TermWin *tw, int x, int y)
 {
-    printf("TRUST@(%d,%d)\n", x, y);
+    if (!bench_mode)
+        printf("TRUST@(%d,%d)\n", x, y);
+}
+static bool fuzz_scroll_rect(TermWin *tw, int topline, int botline,
+                             int lines)
+{
+    bench_counts.scrolls++;
+    return false;
 }
 static int fuzz_char_width(TermWin *tw, int uc) { return 1; }
 static void fuzz_free_draw_ctx(TermWin *tw) {}
@@ -106,6 +155,7 @@ static const TermWinVtable fuzz_termwin_vt = {
     .draw_text = fuzz_draw_text,
     .draw_cursor = fuzz_draw_cursor,
     .draw_trust_sigil = fuzz_draw_trust_sigil,
+    .scroll_rect = fuzz_scroll_rect,
     .char_width = fuzz_char_width,
     .free_draw_ctx = fuzz_free_draw_ctx,
     .set_cursor_pos = fuzz_set_cursor_pos,
@@ -225,3 +275,356 @@ char *x_get_default(const char *key)
 {
     return NULL;                       /* this is a stub */
 }
+
+/* ----------------------------------------------------------------------
+ * Benchmark mode.
+ *
+ * Each workload is a few megabytes of terminal output, either made up
+ * here to resemble some common kind of application or read from a
+ * file (e.g. a PuTTY session log of type 'All session output'). It's
+ * fed to a fresh terminal in 4K chunks, as if read from the network,
+ * over and over until the time limit is up. The terminal is painted
+ * when its own update timer says so, just as it would be in a real
+ * window, unless -update asks for a paint every so many bytes
+ * instead, which makes the paint counts repeatable.
+ *
+ * Output is CSV, after a header line, in the same style as sshbench:
+ * throughput, the number of paints and calls to draw_text, and the
+ * number of memory allocations per megabyte of output.
+ */
+
+#define BENCH_WORKLOAD_BYTES (4 << 20)
+#define BENCH_CHUNK 4096
+
+static uint64_t bench_rand_state;
+
+static unsigned bench_rand(unsigned n)
+{
+    bench_rand_state = (bench_rand_state * 6364136223846793005ULL +
+                        1442695040888963407ULL);
+    return (bench_rand_state >> 33) % n;
+}
+
+static const char *const bench_words[] = {
+    "the", "of", "and", "terminal", "window", "data", "connection",
+    "server", "client", "static", "void", "return", "struct", "if",
+    "0x3F000", "-rw-r--r--", "1 root", "Oct 15", "make[2]:", "CC",
+};
+
+/* Append words to sb until a line of about 'width' columns is full */
+static void bench_words_line(strbuf *sb, int width)
+{
+    int col = 0;
+    while (true) {
+        const char *w = bench_words[bench_rand(lenof(bench_words))];
+        int len = strlen(w);
+        if (col + len + 1 >= width)
+            break;
+        put_datapl(sb, ptrlen_from_asciz(w));
+        put_byte(sb, ' ');
+        col += len + 1;
+    }
+}
+
+/* Plain ASCII scrolling past, as from cat or a compiler */
+static void bench_gen_ascii(strbuf *sb, int rows, int cols)
+{
+    while (sb->len < BENCH_WORKLOAD_BYTES) {
+        bench_words_line(sb, bench_rand(cols) + 1);
+        put_datapl(sb, PTRLEN_LITERAL("\r\n"));
+    }
+}
+
+/* Double-width CJK text in UTF-8 */
+static void bench_gen_cjk(strbuf *sb, int rows, int cols)
+{
+    while (sb->len < BENCH_WORKLOAD_BYTES) {
+        int n = bench_rand(cols / 2) + 1;
+        for (int i = 0; i < n; i++) {
+            unsigned c = 0x4E00 + bench_rand(0x5000);
+            put_byte(sb, 0xE0 | (c >> 12));
+            put_byte(sb, 0x80 | ((c >> 6) & 0x3F));
+            put_byte(sb, 0x80 | (c & 0x3F));
+        }
+        put_datapl(sb, PTRLEN_LITERAL("\r\n"));
+    }
+}
+
+/* Every word in a different colour, as from ls --color or a
+ * syntax-highlighting pager */
+static void bench_gen_sgr(strbuf *sb, int rows, int cols)
+{
+    while (sb->len < BENCH_WORKLOAD_BYTES) {
+        int col = 0;
+        while (true) {
+            const char *w = bench_words[bench_rand(lenof(bench_words))];
+            int len = strlen(w);
+            if (col + len + 1 >= cols)
+                break;
+            switch (bench_rand(4)) {
+              case 0:
+                strbuf_catf(sb, "\033[%u;%um", bench_rand(2),
+                            30 + bench_rand(8));
+                break;
+              case 1:
+                strbuf_catf(sb, "\033[%u;%um", 30 + bench_rand(8),
+                            40 + bench_rand(8));
+                break;
+              case 2:
+                strbuf_catf(sb, "\033[38;5;%um", bench_rand(256));
+                break;
+              case 3:
+                strbuf_catf(sb, "\033[38;2;%u;%u;%um", bench_rand(256),
+                            bench_rand(256), bench_rand(256));
+                break;
+            }
+            put_datapl(sb, ptrlen_from_asciz(w));
+            put_datapl(sb, PTRLEN_LITERAL("\033[m "));
+            col += len + 1;
+        }
+        put_datapl(sb, PTRLEN_LITERAL("\r\n"));
+    }
+}
+
+/* A pager or editor scrolling a region between a fixed header and
+ * status line, mostly forwards but sometimes back */
+static void bench_gen_scroll(strbuf *sb, int rows, int cols)
+{
+    strbuf_catf(sb, "\033[H\033[2J\033[7m header \033[m"
+                "\033[2;%dr", rows - 1);
+    while (sb->len < BENCH_WORKLOAD_BYTES) {
+        if (bench_rand(8)) {
+            strbuf_catf(sb, "\033[%d;1H\n", rows - 1);
+        } else {
+            strbuf_catf(sb, "\033[2;1H\033M");
+        }
+        bench_words_line(sb, cols);
+        strbuf_catf(sb, "\033[K\033[%d;1H\033[7m line %u \033[m\033[K",
+                    rows, bench_rand(100000));
+    }
+    put_datapl(sb, PTRLEN_LITERAL("\033[r"));
+}
+
+/* A full-screen application on the alternate screen redrawing every
+ * line, as top does, and occasionally exiting and starting again */
+static void bench_gen_altscreen(strbuf *sb, int rows, int cols)
+{
+    while (sb->len < BENCH_WORKLOAD_BYTES) {
+        put_datapl(sb, PTRLEN_LITERAL("\033[?1049h\033[H\033[2J"));
+        for (int frame = 0; frame < 20; frame++) {
+            for (int y = 1; y <= rows; y++) {
+                strbuf_catf(sb, "\033[%d;1H", y);
+                if (y == 1)
+                    put_datapl(sb, PTRLEN_LITERAL("\033[1;7m"));
+                bench_words_line(sb, cols);
+                put_datapl(sb, PTRLEN_LITERAL("\033[m\033[K"));
+            }
+        }
+        put_datapl(sb, PTRLEN_LITERAL("\033[?1049l"));
+    }
+}
+
+/* A report sent straight to the printer by VT printer passthrough
+ * (ESC[5i ... ESC[4i), which the terminal doesn't display at all */
+static void bench_gen_print(strbuf *sb, int rows, int cols)
+{
+    put_datapl(sb, PTRLEN_LITERAL("\033[5i"));
+    while (sb->len < BENCH_WORKLOAD_BYTES) {
+        bench_words_line(sb, cols);
+        put_datapl(sb, PTRLEN_LITERAL("\r\n"));
+        if (!bench_rand(60))
+            put_datapl(sb, PTRLEN_LITERAL("\f"));
+    }
+    put_datapl(sb, PTRLEN_LITERAL("\033[4i"));
+}
+
+static const struct {
+    const char *name;
+    void (*gen)(strbuf *sb, int rows, int cols);
+} bench_workloads[] = {
+    { "ascii", bench_gen_ascii },
+    { "cjk", bench_gen_cjk },
+    { "sgr", bench_gen_sgr },
+    { "scroll", bench_gen_scroll },
+    { "altscreen", bench_gen_altscreen },
+    { "print", bench_gen_print },
+};
+
+static double bench_min_time = 0.5;
+static int bench_rows = 24, bench_cols = 80;
+static size_t bench_update_every;      /* 0 means use the update timer */
+
+static void bench_run(const char *name, ptrlen data)
+{
+    Conf *conf;
+    struct unicode_data ucsdata;
+    TermWin termwin;
+    Terminal *term;
+    uint64_t allocs = 0, bytes = 0, start, elapsed;
+    size_t since_update = 0;
+    unsigned long next;
+
+    if (!data.len)
+        return;
+
+    conf = conf_new();
+    do_defaults(NULL, conf);
+    conf_set_str(conf, CONF_line_codepage, "UTF-8");
+    conf_set_str(conf, CONF_printer, "cat >/dev/null");
+    init_ucs(&ucsdata, conf_get_str(conf, CONF_line_codepage),
+             conf_get_bool(conf, CONF_utf8_override),
+             CS_NONE, conf_get_int(conf, CONF_vtmode));
+
+    termwin.vt = &fuzz_termwin_vt;
+    term = term_init(conf, &ucsdata, &termwin);
+    term_size(term, bench_rows, bench_cols,
+              conf_get_int(conf, CONF_savelines));
+    term->ldisc = NULL;
+
+    memset(&bench_counts, 0, sizeof(bench_counts));
+    safemalloc_counter = &allocs;
+    start = platform_perf_counter_ns();
+    do {
+        for (size_t pos = 0; pos < data.len; pos += BENCH_CHUNK) {
+            size_t len = data.len - pos;
+            if (len > BENCH_CHUNK)
+                len = BENCH_CHUNK;
+            term_data(term, false, (const char *)data.ptr + pos, len);
+            bytes += len;
+
+            if (bench_update_every) {
+                since_update += len;
+                if (since_update >= bench_update_every) {
+                    term_update(term);
+                    since_update = 0;
+                }
+            } else {
+                run_timers(GETTICKCOUNT(), &next);
+            }
+            run_toplevel_callbacks();
+        }
+        elapsed = platform_perf_counter_ns() - start;
+    } while (elapsed < bench_min_time * 1e9);
+    term_update(term);
+    elapsed = platform_perf_counter_ns() - start;
+    safemalloc_counter = NULL;
+
+    printf("%s,%"PRIu64",%.2f,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64","
+           "%"PRIu64",%.1f\n", name, bytes, bytes * 1e3 / elapsed,
+           bench_counts.paints, bench_counts.text_calls,
+           bench_counts.text_chars, bench_counts.cursor_calls,
+           bench_counts.scrolls, allocs * 1048576.0 / bytes);
+    fflush(stdout);
+
+    term_free(term);
+    conf_free(conf);
+}
+
+static void bench_usage(void)
+{
+    printf("usage: fuzzterm -bench [options] [workload-wildcard...]\n");
+    printf("options:\n");
+    printf("  -time T      run each workload for at least T seconds"
+           " (default 0.5)\n");
+    printf("  -size WxH    terminal size (default 80x24)\n");
+    printf("  -update N    paint every N bytes instead of when the"
+           " update timer says\n");
+    printf("  -file FILE   also run the raw terminal output in FILE\n");
+    printf("  -list        list the workload names and exit\n");
+}
+
+static int bench_main(int argc, char **argv)
+{
+    char **patterns = snewn(argc, char *);
+    const char **files = snewn(argc, const char *);
+    size_t npatterns = 0, nfiles = 0;
+    bool list_only = false;
+
+    while (--argc) {
+        char *p = *++argv;
+        const char *val = argc > 1 ? argv[1] : NULL;
+
+        if (!strcmp(p, "-list")) {
+            list_only = true;
+        } else if (!strcmp(p, "--help") || !strcmp(p, "-h")) {
+            bench_usage();
+            return 0;
+        } else if (!strcmp(p, "-time") || !strcmp(p, "-size") ||
+                   !strcmp(p, "-update") || !strcmp(p, "-file")) {
+            if (!val) {
+                fprintf(stderr, "fuzzterm: option '%s' expects an "
+                        "argument\n", p);
+                return 1;
+            }
+            argc--, argv++;
+            if (!strcmp(p, "-time")) {
+                bench_min_time = atof(val);
+                if (!(bench_min_time > 0)) {
+                    fprintf(stderr, "fuzzterm: time must be positive\n");
+                    return 1;
+                }
+            } else if (!strcmp(p, "-size")) {
+                if (sscanf(val, "%dx%d", &bench_cols, &bench_rows) != 2 ||
+                    bench_cols < 2 || bench_rows < 3) {
+                    fprintf(stderr, "fuzzterm: bad size '%s'\n", val);
+                    return 1;
+                }
+            } else if (!strcmp(p, "-update")) {
+                bench_update_every = strtoul(val, NULL, 0);
+            } else {
+                files[nfiles++] = val;
+            }
+        } else if (p[0] == '-') {
+            fprintf(stderr, "fuzzterm: unknown option '%s'\n", p);
+            bench_usage();
+            return 1;
+        } else {
+            patterns[npatterns++] = p;
+        }
+    }
+
+    bench_mode = true;
+    if (!list_only)
+        printf("workload,bytes,MB/s,paints,draw_text calls,chars drawn,"
+               "cursor draws,scrolls,allocs/MB\n");
+
+    for (size_t i = 0; i < lenof(bench_workloads); i++) {
+        bool run = (npatterns == 0);
+        for (size_t j = 0; j < npatterns && !run; j++)
+            if (wc_match(patterns[j], bench_workloads[i].name))
+                run = true;
+        if (!run)
+            continue;
+        if (list_only) {
+            printf("%s\n", bench_workloads[i].name);
+            continue;
+        }
+
+        strbuf *sb = strbuf_new();
+        bench_rand_state = 12345;
+        bench_workloads[i].gen(sb, bench_rows, bench_cols);
+        bench_run(bench_workloads[i].name, ptrlen_from_strbuf(sb));
+        strbuf_free(sb);
+    }
+
+    for (size_t i = 0; i < nfiles && !list_only; i++) {
+        FILE *fp = fopen(files[i], "rb");
+        char buf[BENCH_CHUNK];
+        size_t len;
+
+        if (!fp) {
+            fprintf(stderr, "fuzzterm: %s: %s\n", files[i], strerror(errno));
+            return 1;
+        }
+        strbuf *sb = strbuf_new();
+        while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+            put_data(sb, buf, len);
+        fclose(fp);
+        bench_run(files[i], ptrlen_from_strbuf(sb));
+        strbuf_free(sb);
+    }
+
+    sfree(patterns);
+    sfree(files);
+    return 0;
+}
@@ -58,6 +58,30 @@ static void pwrite(Ldisc *ldisc, unsigned char c)
     }
 }
 
+/*
+ * Echo a run of characters as pwrite would, but passing each stretch
+ * that needs no translation to c_write in one go.
+ */
+static void pwrite_span(Ldisc *ldisc, const unsigned char *p, size_t len)
+{
+    bool utf = in_utf(ldisc->term);
+
+    while (len > 0) {
+        size_t n = 0;
+        while (n < len && ((p[n] >= 32 && p[n] <= 126) ||
+                           (!utf && p[n] >= 0xA0) || (utf && p[n] >= 0x80)))
+            n++;
+        if (n > 0) {
+            c_write(ldisc, p, n);
+        } else {
+            pwrite(ldisc, *p);
+            n = 1;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
 static bool char_start(Ldisc *ldisc, unsigned char c)
 {
     if (in_utf(ldisc->term))
@@ -154,8 +178,32 @@ void ldisc_send(Ldisc *ldisc, const void *vbuf, int len, bool interactive)
      * Either perform local editing, or just send characters.
      */
     if (EDITING) {
-        while (len--) {
+        while (len > 0) {
             int c;
+
+            /*
+             * A run of characters that aren't line-editing commands
+             * just goes on the end of the line buffer, and is echoed,
+             * without needing to go through the switch below one at
+             * a time. That makes pastes into a local-edit session
+             * much cheaper.
+             */
+            if (!keyflag && !ldisc->quotenext &&
+                (unsigned char)*buf >= ' ') {
+                size_t n = 1;
+                while (n < len && (unsigned char)buf[n] >= ' ')
+                    n++;
+                sgrowarrayn(ldisc->buf, ldisc->bufsiz, ldisc->buflen, n);
+                memcpy(ldisc->buf + ldisc->buflen, buf, n);
+                ldisc->buflen += n;
+                if (ECHOING)
+                    pwrite_span(ldisc, (const unsigned char *)buf, n);
+                buf += n;
+                len -= n;
+                continue;
+            }
+
+            len--;
             c = (unsigned char)(*buf++) + keyflag;
             if (!interactive && c == '\r')
                 c += KCTRL('@');
@@ -10,20 +10,216 @@
 #include <assert.h>
 
 #include "putty.h"
+#include "ssh.h"
 
 /* log session to file stuff ... */
 struct LogContext {
     FILE *lgfp;
+    LogWriter *writer;                 /* if non-NULL, owns lgfp's output */
+    LogFilter *filter;                 /* if non-NULL, output goes via this */
     enum { L_CLOSED, L_OPENING, L_OPEN, L_ERROR } state;
     bufchain queue;
     Filename *currlogfilename;
     LogPolicy *lp;
     Conf *conf;
     int logtype;                       /* cached out of conf */
+    bool binary;                       /* writing binary packet records */
+    size_t pktmax;                     /* max bytes of a packet to log */
+};
+
+/*
+ * Binary packet log format, used for SSH packet logs when
+ * CONF_logbinary is set. The file is a sequence of records, each
+ * consisting of a uint32 giving the length of the rest of the
+ * record, a byte giving the record kind, a uint64 wall-clock time in
+ * seconds since the epoch, and a uint32 millisecond tick count
+ * (useful only for measuring intervals). All integers are big-endian
+ * and all strings are uint32-length-prefixed, as in SSH.
+ *
+ * The rest of each record depends on its kind:
+ *
+ *  - BINLOG_HEADER: string BINLOG_MAGIC, uint32 BINLOG_VERSION, and
+ *    a bool saying whether the text log would have had a header
+ *    line. Written every time the file is opened, so a log that has
+ *    been appended to contains more than one.
+ *
+ *  - BINLOG_PACKET (a decrypted SSH packet) or BINLOG_RAW (raw data
+ *    off the wire): byte direction (PKT_INCOMING or PKT_OUTGOING),
+ *    uint32 packet type, string type name, bool and uint64 for the
+ *    sequence number, uint32 downstream id, string additional log
+ *    text, uint32 length of the packet, uint32 number of bytes of it
+ *    that were logged at all, then a uint32 count of (uint32 offset,
+ *    uint32 length, byte PKTLOG_BLANK or PKTLOG_OMIT) runs, and
+ *    finally a string containing just the logged bytes that were
+ *    not blanked or omitted.
+ *
+ *  - BINLOG_EVENT: string containing an Event Log message.
+ *
+ * contrib/logparse.pl can turn this back into the text format.
+ */
+#define BINLOG_MAGIC "PuTTY-binary-packet-log"
+#define BINLOG_VERSION 1
+enum {
+    BINLOG_HEADER = 'H', BINLOG_PACKET = 'P', BINLOG_RAW = 'R',
+    BINLOG_EVENT = 'E'
 };
 
 static Filename *xlatlognam(Filename *s, char *hostname, int port,
                             struct tm *tm);
+static strbuf *binlog_start(int kind);
+static void binlog_write(LogContext *ctx, strbuf *sb);
+
+/*
+ * Gzip (RFC 1952) filter for CONF_logcompress, built on the SSH zlib
+ * compressor. We buffer input until we have a decent amount, so that
+ * the per-block flush overhead stays small; 'flush' compresses
+ * whatever is pending, after which everything logged so far can be
+ * recovered from the file even if it's cut off there. Each time the
+ * file is opened we start a new gzip member, and a file made of
+ * several members (e.g. from appending) is still a valid gzip file.
+ */
+#define LOG_GZIP_BLOCK 32768
+
+typedef struct LogGzip {
+    ssh_compressor *comp;
+    strbuf *pending;
+    uint32_t crc, isize;
+    bool started;                      /* header written */
+    bool compressed;                   /* compressor has produced output */
+    LogFilter lf;
+} LogGzip;
+
+/* gzip's integers are little-endian, unlike everything else we write */
+static void log_gzip_put_uint32(strbuf *out, uint32_t value)
+{
+    unsigned char buf[4];
+    PUT_32BIT_LSB_FIRST(buf, value);
+    put_data(out, buf, 4);
+}
+
+static void log_gzip_output(LogGzip *gz, unsigned char *data, int len,
+                            strbuf *out)
+{
+    /* The compressor starts with a zlib header, which gzip doesn't want */
+    if (!gz->compressed) {
+        assert(len >= 2);
+        put_data(out, data + 2, len - 2);
+        gz->compressed = true;
+    } else {
+        put_data(out, data, len);
+    }
+    sfree(data);
+}
+
+static void log_gzip_compress_pending(LogGzip *gz, strbuf *out)
+{
+    unsigned char *data;
+    int len;
+
+    if (!gz->pending->len)
+        return;
+    ssh_compressor_compress(gz->comp, gz->pending->u, gz->pending->len,
+                            &data, &len, 0);
+    log_gzip_output(gz, data, len, out);
+    strbuf_clear(gz->pending);
+}
+
+static void log_gzip_start(LogGzip *gz, strbuf *out)
+{
+    if (gz->started)
+        return;
+    gz->started = true;
+    put_byte(out, 0x1F);               /* magic */
+    put_byte(out, 0x8B);
+    put_byte(out, 8);                  /* CM = deflate */
+    put_byte(out, 0);                  /* FLG: no optional fields */
+    log_gzip_put_uint32(out, time(NULL)); /* MTIME */
+    put_byte(out, 0);                  /* XFL */
+    put_byte(out, 255);                /* OS = unknown */
+}
+
+static void log_gzip_write(LogFilter *lf, ptrlen data, strbuf *out)
+{
+    LogGzip *gz = container_of(lf, LogGzip, lf);
+
+    log_gzip_start(gz, out);
+    gz->crc = crc32_update(gz->crc, data);
+    gz->isize += data.len;
+    put_datapl(gz->pending, data);
+    if (gz->pending->len >= LOG_GZIP_BLOCK)
+        log_gzip_compress_pending(gz, out);
+}
+
+static void log_gzip_flush(LogFilter *lf, strbuf *out)
+{
+    LogGzip *gz = container_of(lf, LogGzip, lf);
+    log_gzip_compress_pending(gz, out);
+}
+
+static void log_gzip_finish(LogFilter *lf, strbuf *out)
+{
+    LogGzip *gz = container_of(lf, LogGzip, lf);
+    unsigned char *data;
+    int len;
+
+    log_gzip_start(gz, out);
+    log_gzip_compress_pending(gz, out);
+    zlib_compress_finish(gz->comp, &data, &len);
+    log_gzip_output(gz, data, len, out);
+    log_gzip_put_uint32(out, gz->crc ^ 0xFFFFFFFF);
+    log_gzip_put_uint32(out, gz->isize);
+}
+
+static void log_gzip_free(LogFilter *lf)
+{
+    LogGzip *gz = container_of(lf, LogGzip, lf);
+    ssh_compressor_free(gz->comp);
+    strbuf_free(gz->pending);
+    sfree(gz);
+}
+
+static const LogFilterVtable log_gzip_vt = {
+    .write = log_gzip_write,
+    .flush = log_gzip_flush,
+    .finish = log_gzip_finish,
+    .free = log_gzip_free,
+};
+
+static LogFilter *log_gzip_new(void)
+{
+    LogGzip *gz = snew(LogGzip);
+    gz->comp = ssh_compressor_new(&ssh_zlib, 0);
+    gz->pending = strbuf_new_nm();
+    gz->crc = 0xFFFFFFFF;
+    gz->isize = 0;
+    gz->started = gz->compressed = false;
+    gz->lf.vt = &log_gzip_vt;
+    return &gz->lf;
+}
+
+/*
+ * Write to the file directly, when there's no LogWriter to do it for
+ * us, passing the data through the filter if there is one. 'fn' is
+ * NULL for ordinary data, or logfilter_flush or logfilter_finish.
+ */
+static bool log_output(LogContext *ctx, ptrlen data,
+                       void (*fn)(LogFilter *, strbuf *))
+{
+    strbuf *sb;
+    bool ok;
+
+    if (!ctx->filter)
+        return fwrite(data.ptr, 1, data.len, ctx->lgfp) == data.len;
+
+    sb = strbuf_new_nm();
+    if (fn)
+        fn(ctx->filter, sb);
+    else
+        logfilter_write(ctx->filter, data, sb);
+    ok = fwrite(sb->u, 1, sb->len, ctx->lgfp) == sb->len;
+    strbuf_free(sb);
+    return ok;
+}
 
 /*
  * Internal wrapper function which must be called for _all_ output
@@ -45,7 +241,8 @@ static void logwrite(LogContext *ctx, ptrlen data)
         bufchain_add(&ctx->queue, data.ptr, data.len);
     } else if (ctx->state == L_OPEN) {
         assert(ctx->lgfp);
-        if (fwrite(data.ptr, 1, data.len, ctx->lgfp) < data.len) {
+        if (ctx->writer ? !platform_logwriter_write(ctx->writer, data) :
+            !log_output(ctx, data, NULL)) {
             logfclose(ctx);
             ctx->state = L_ERROR;
             lp_eventlog(ctx->lp, "Disabled writing session log "
@@ -76,9 +273,17 @@ static PRINTF_LIKE(2, 3) void logprintf(LogContext *ctx, const char *fmt, ...)
  */
 void logflush(LogContext *ctx)
 {
-    if (ctx->logtype > 0)
-        if (ctx->state == L_OPEN)
-            fflush(ctx->lgfp);
+    if (ctx->logtype > 0) {
+        if (ctx->state == L_OPEN) {
+            if (ctx->writer) {
+                platform_logwriter_flush(ctx->writer);
+            } else {
+                if (ctx->filter)
+                    log_output(ctx, PTRLEN_LITERAL(""), logfilter_flush);
+                fflush(ctx->lgfp);
+            }
+        }
+    }
 }
 
 static void logfopen_callback(void *vctx, int mode)
@@ -96,13 +301,24 @@ static void logfopen_callback(void *vctx, int mode)
         ctx->lgfp = f_open(ctx->currlogfilename, fmode, false);
         if (ctx->lgfp) {
             ctx->state = L_OPEN;
+            if (conf_get_bool(ctx->conf, CONF_logcompress))
+                ctx->filter = log_gzip_new();
+            ctx->writer = platform_logwriter_new(ctx->lgfp, ctx->filter);
         } else {
             ctx->state = L_ERROR;
             shout = true;
         }
     }
 
-    if (ctx->state == L_OPEN && conf_get_bool(ctx->conf, CONF_logheader)) {
+    if (ctx->state == L_OPEN && ctx->binary) {
+        /* A binary log always needs its header, to identify it. */
+        strbuf *sb = binlog_start(BINLOG_HEADER);
+        put_stringz(sb, BINLOG_MAGIC);
+        put_uint32(sb, BINLOG_VERSION);
+        put_bool(sb, conf_get_bool(ctx->conf, CONF_logheader));
+        binlog_write(ctx, sb);
+    } else if (ctx->state == L_OPEN &&
+               conf_get_bool(ctx->conf, CONF_logheader)) {
         /* Write header line into log file. */
         tm = ltime();
         strftime(buf, 24, "%Y.%m.%d %H:%M:%S", &tm);
@@ -110,7 +326,7 @@ static void logfopen_callback(void *vctx, int mode)
                   " =~=~=~=~=~=~=~=~=~=~=~=\r\n", buf);
     }
 
-    event = dupprintf("%s session log (%s mode) to file: %s",
+    event = dupprintf("%s session log (%s mode%s%s) to file: %s",
                       ctx->state == L_ERROR ?
                       (mode == 0 ? "Disabled writing" : "Error writing") :
                       (mode == 1 ? "Appending" : "Writing new"),
@@ -119,6 +335,8 @@ static void logfopen_callback(void *vctx, int mode)
                        ctx->logtype == LGTYP_PACKETS ? "SSH packets" :
                        ctx->logtype == LGTYP_SSHRAW ? "SSH raw data" :
                        "unknown"),
+                      ctx->binary ? ", binary format" : "",
+                      ctx->filter ? ", gzip-compressed" : "",
                       filename_to_str(ctx->currlogfilename));
     lp_eventlog(ctx->lp, event);
     if (shout) {
@@ -189,6 +407,16 @@ void logfopen(LogContext *ctx)
 
 void logfclose(LogContext *ctx)
 {
+    if (ctx->writer) {
+        platform_logwriter_free(ctx->writer);
+        ctx->writer = NULL;
+    } else if (ctx->filter && ctx->lgfp) {
+        log_output(ctx, PTRLEN_LITERAL(""), logfilter_finish);
+    }
+    if (ctx->filter) {
+        logfilter_free(ctx->filter);
+        ctx->filter = NULL;
+    }
     if (ctx->lgfp) {
         fclose(ctx->lgfp);
         ctx->lgfp = NULL;
@@ -200,16 +428,30 @@ void logfclose(LogContext *ctx)
  * Log session traffic.
  */
 void logtraffic(LogContext *ctx, unsigned char c, int logmode)
+{
+    logtraffic_data(ctx, make_ptrlen(&c, 1), logmode);
+}
+
+/*
+ * Log a whole run of session traffic at once.
+ */
+void logtraffic_data(LogContext *ctx, ptrlen data, int logmode)
 {
     if (ctx->logtype > 0) {
         if (ctx->logtype == logmode)
-            logwrite(ctx, make_ptrlen(&c, 1));
+            logwrite(ctx, data);
     }
 }
 
 static void logevent_internal(LogContext *ctx, const char *event)
 {
-    if (ctx->logtype == LGTYP_PACKETS || ctx->logtype == LGTYP_SSHRAW) {
+    if (ctx->binary) {
+        strbuf *sb = binlog_start(BINLOG_EVENT);
+        put_stringz(sb, event);
+        binlog_write(ctx, sb);
+        logflush(ctx);
+    } else if (ctx->logtype == LGTYP_PACKETS ||
+               ctx->logtype == LGTYP_SSHRAW) {
         logprintf(ctx, "Event Log: %s\r\n", event);
         logflush(ctx);
     }
@@ -268,6 +510,100 @@ void logeventf(LogContext *ctx, const char *fmt, ...)
     va_end(ap);
 }
 
+/*
+ * Start and finish a record in a binary packet log. binlog_start
+ * leaves room for the length field, which binlog_write fills in.
+ */
+static strbuf *binlog_start(int kind)
+{
+    /* _nm, because packet records contain decrypted session data */
+    strbuf *sb = strbuf_new_nm();
+    put_uint32(sb, 0);
+    put_byte(sb, kind);
+    put_uint64(sb, (uint64_t)time(NULL));
+    put_uint32(sb, GETTICKCOUNT());
+    return sb;
+}
+
+static void binlog_write(LogContext *ctx, strbuf *sb)
+{
+    PUT_32BIT_MSB_FIRST(sb->u, sb->len - 4);
+    logwrite(ctx, ptrlen_from_strbuf(sb));
+    strbuf_free(sb);
+}
+
+/*
+ * Work out what type of blanking applies to byte p of a packet.
+ * *b indexes the blanking array, and is advanced as p increases.
+ */
+static int log_packet_blktype(const struct logblank_t *blanks, int n_blanks,
+                              int *b, size_t p)
+{
+    /* Move to a current entry in the blanking array. */
+    while ((*b < n_blanks) &&
+           (p >= blanks[*b].offset + blanks[*b].len))
+        (*b)++;
+    if ((*b < n_blanks) &&
+        (p >= blanks[*b].offset) &&
+        (p < blanks[*b].offset + blanks[*b].len))
+        return blanks[*b].type;
+    return PKTLOG_EMIT;
+}
+
+static void log_packet_binary(LogContext *ctx, int direction, int type,
+                              const char *texttype, const void *data,
+                              size_t len, size_t caplen,
+                              int n_blanks, const struct logblank_t *blanks,
+                              const unsigned long *seq, unsigned downstream_id,
+                              const char *additional_log_text)
+{
+    strbuf *sb = binlog_start(texttype ? BINLOG_PACKET : BINLOG_RAW);
+    strbuf *runs = strbuf_new(), *emitted = strbuf_new_nm();
+    size_t p, runstart = 0;
+    unsigned nruns = 0;
+    int b = 0, runtype = PKTLOG_EMIT;
+
+    put_byte(sb, direction);
+    put_uint32(sb, type);
+    put_stringz(sb, texttype ? texttype : "");
+    put_bool(sb, seq != NULL);
+    put_uint64(sb, seq ? *seq : 0);
+    put_uint32(sb, downstream_id);
+    put_stringz(sb, additional_log_text ? additional_log_text : "");
+    put_uint32(sb, len);
+    put_uint32(sb, caplen);
+
+    /*
+     * Rather than repeat the blanking array, which may overlap or
+     * extend past the data, record the runs of bytes actually blanked
+     * or omitted, and keep only the bytes that were neither.
+     */
+    for (p = 0; p <= caplen; p++) {
+        int blktype = (p < caplen ?
+                       log_packet_blktype(blanks, n_blanks, &b, p) : -1);
+        if (blktype != runtype) {
+            if (runtype != PKTLOG_EMIT) {
+                put_uint32(runs, runstart);
+                put_uint32(runs, p - runstart);
+                put_byte(runs, runtype);
+                nruns++;
+            }
+            runstart = p;
+            runtype = blktype;
+        }
+        if (blktype == PKTLOG_EMIT)
+            put_byte(emitted, ((const unsigned char *)data)[p]);
+    }
+
+    put_uint32(sb, nruns);
+    put_datapl(sb, ptrlen_from_strbuf(runs));
+    put_stringpl(sb, ptrlen_from_strbuf(emitted));
+    binlog_write(ctx, sb);
+
+    strbuf_free(runs);
+    strbuf_free(emitted);
+}
+
 /*
  * Log an SSH packet.
  * If n_blanks != 0, blank or omit some parts.
@@ -280,13 +616,24 @@ void log_packet(LogContext *ctx, int direction, int type,
                 unsigned downstream_id, const char *additional_log_text)
 {
     char dumpdata[128], smalldata[5];
-    size_t p = 0, b = 0, omitted = 0;
+    size_t p = 0, omitted = 0, caplen;
+    int b = 0;
     int output_pos = 0; /* NZ if pending output in dumpdata */
 
     if (!(ctx->logtype == LGTYP_SSHRAW ||
           (ctx->logtype == LGTYP_PACKETS && texttype)))
         return;
 
+    caplen = (ctx->pktmax && len > ctx->pktmax ? ctx->pktmax : len);
+
+    if (ctx->binary) {
+        log_packet_binary(ctx, direction, type, texttype, data, len, caplen,
+                          n_blanks, blanks, seq, downstream_id,
+                          additional_log_text);
+        logflush(ctx);
+        return;
+    }
+
     /* Packet header. */
     if (texttype) {
         logprintf(ctx, "%s packet ",
@@ -326,20 +673,8 @@ void log_packet(LogContext *ctx, int direction, int type,
      * Output a hex/ASCII dump of the packet body, blanking/omitting
      * parts as specified.
      */
-    while (p < len) {
-        int blktype;
-
-        /* Move to a current entry in the blanking array. */
-        while ((b < n_blanks) &&
-               (p >= blanks[b].offset + blanks[b].len))
-            b++;
-        /* Work out what type of blanking to apply to
-         * this byte. */
-        blktype = PKTLOG_EMIT; /* default */
-        if ((b < n_blanks) &&
-            (p >= blanks[b].offset) &&
-            (p < blanks[b].offset + blanks[b].len))
-            blktype = blanks[b].type;
+    while (p < caplen) {
+        int blktype = log_packet_blktype(blanks, n_blanks, &b, p);
 
         /* If we're about to stop omitting, it's time to say how
          * much we omitted. */
@@ -376,7 +711,7 @@ void log_packet(LogContext *ctx, int direction, int type,
         p++;
 
         /* Flush row if necessary */
-        if (((p % 16) == 0) || (p == len) || omitted) {
+        if (((p % 16) == 0) || (p == caplen) || omitted) {
             if (output_pos) {
                 strcpy(dumpdata + 10+1+3*16+2+output_pos, "\r\n");
                 logwrite(ctx, ptrlen_from_asciz(dumpdata));
@@ -390,18 +725,34 @@ void log_packet(LogContext *ctx, int direction, int type,
     if (omitted)
         logprintf(ctx, "  (%"SIZEu" byte%s omitted)\r\n",
                   omitted, (omitted==1?"":"s"));
+    if (caplen < len)
+        logprintf(ctx, "  (%"SIZEu" byte%s not logged)\r\n",
+                  len - caplen, (len - caplen == 1 ? "" : "s"));
     logflush(ctx);
 }
 
+static void log_cache_conf(LogContext *ctx)
+{
+    int pktmax = conf_get_int(ctx->conf, CONF_logpktmax);
+
+    ctx->logtype = conf_get_int(ctx->conf, CONF_logtype);
+    ctx->binary = (conf_get_bool(ctx->conf, CONF_logbinary) &&
+                   (ctx->logtype == LGTYP_PACKETS ||
+                    ctx->logtype == LGTYP_SSHRAW));
+    ctx->pktmax = (pktmax > 0 ? pktmax : 0);
+}
+
 LogContext *log_init(LogPolicy *lp, Conf *conf)
 {
     LogContext *ctx = snew(LogContext);
     ctx->lgfp = NULL;
+    ctx->writer = NULL;
+    ctx->filter = NULL;
     ctx->state = L_CLOSED;
     ctx->lp = lp;
     ctx->conf = conf_copy(conf);
-    ctx->logtype = conf_get_int(ctx->conf, CONF_logtype);
     ctx->currlogfilename = NULL;
+    log_cache_conf(ctx);
     bufchain_init(&ctx->queue);
     return ctx;
 }
@@ -423,7 +774,11 @@ void log_reconfig(LogContext *ctx, Conf *conf)
     if (!filename_equal(conf_get_filename(ctx->conf, CONF_logfilename),
                         conf_get_filename(conf, CONF_logfilename)) ||
         conf_get_int(ctx->conf, CONF_logtype) !=
-        conf_get_int(conf, CONF_logtype))
+        conf_get_int(conf, CONF_logtype) ||
+        conf_get_bool(ctx->conf, CONF_logbinary) !=
+        conf_get_bool(conf, CONF_logbinary) ||
+        conf_get_bool(ctx->conf, CONF_logcompress) !=
+        conf_get_bool(conf, CONF_logcompress))
         reset_logging = true;
     else
         reset_logging = false;
@@ -434,7 +789,7 @@ void log_reconfig(LogContext *ctx, Conf *conf)
     conf_free(ctx->conf);
     ctx->conf = conf_copy(conf);
 
-    ctx->logtype = conf_get_int(ctx->conf, CONF_logtype);
+    log_cache_conf(ctx);
 
     if (reset_logging)
         logfopen(ctx);
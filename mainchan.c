@@ -384,6 +384,10 @@ static void mainchan_set_input_wanted(Channel *chan, bool wanted)
      * reading from that input.
      */
     ssh_set_wants_user_input(mc->cl, wanted);
+
+    /* And if the backlog has just cleared, the seat may want to know. */
+    if (wanted)
+        seat_sent(mc->ppl->seat, ssh_stdin_backlog(mc->cl));
 }
 
 static char *mainchan_log_close_msg(Channel *chan)
@@ -5,11 +5,6 @@
 #include "marshal.h"
 #include "misc.h"
 
-void BinarySink_put_data(BinarySink *bs, const void *data, size_t len)
-{
-    bs->write(bs, data, len);
-}
-
 void BinarySink_put_datapl(BinarySink *bs, ptrlen pl)
 {
     BinarySink_put_data(bs, pl.ptr, pl.len);
@@ -21,43 +16,11 @@ void BinarySink_put_padding(BinarySink *bs, size_t len, unsigned char padbyte)
     memset(buf, padbyte, sizeof(buf));
     while (len > 0) {
         size_t thislen = len < sizeof(buf) ? len : sizeof(buf);
-        bs->write(bs, buf, thislen);
+        BinarySink_put_data(bs, buf, thislen);
         len -= thislen;
     }
 }
 
-void BinarySink_put_byte(BinarySink *bs, unsigned char val)
-{
-    bs->write(bs, &val, 1);
-}
-
-void BinarySink_put_bool(BinarySink *bs, bool val)
-{
-    unsigned char cval = val ? 1 : 0;
-    bs->write(bs, &cval, 1);
-}
-
-void BinarySink_put_uint16(BinarySink *bs, unsigned long val)
-{
-    unsigned char data[2];
-    PUT_16BIT_MSB_FIRST(data, val);
-    bs->write(bs, data, sizeof(data));
-}
-
-void BinarySink_put_uint32(BinarySink *bs, unsigned long val)
-{
-    unsigned char data[4];
-    PUT_32BIT_MSB_FIRST(data, val);
-    bs->write(bs, data, sizeof(data));
-}
-
-void BinarySink_put_uint64(BinarySink *bs, uint64_t val)
-{
-    unsigned char data[8];
-    PUT_64BIT_MSB_FIRST(data, val);
-    bs->write(bs, data, sizeof(data));
-}
-
 void BinarySink_put_string(BinarySink *bs, const void *data, size_t len)
 {
     /* Check that the string length fits in a uint32, without doing a
@@ -65,7 +28,7 @@ void BinarySink_put_string(BinarySink *bs, const void *data, size_t len)
     assert((len >> 31) < 2);
 
     BinarySink_put_uint32(bs, len);
-    bs->write(bs, data, len);
+    BinarySink_put_data(bs, data, len);
 }
 
 void BinarySink_put_stringpl(BinarySink *bs, ptrlen pl)
@@ -86,7 +49,7 @@ void BinarySink_put_stringsb(BinarySink *bs, struct strbuf *buf)
 
 void BinarySink_put_asciz(BinarySink *bs, const char *str)
 {
-    bs->write(bs, str, strlen(str) + 1);
+    BinarySink_put_data(bs, str, strlen(str) + 1);
 }
 
 bool BinarySink_put_pstring(BinarySink *bs, const char *str)
@@ -95,7 +58,7 @@ bool BinarySink_put_pstring(BinarySink *bs, const char *str)
     if (len > 255)
         return false; /* can't write a Pascal-style string this long */
     BinarySink_put_byte(bs, len);
-    bs->write(bs, str, len);
+    BinarySink_put_data(bs, str, len);
     return true;
 }
 
@@ -120,69 +83,6 @@ static bool BinarySource_data_avail(BinarySource *src, size_t wanted)
     ((const void *)((const unsigned char *)src->data + \
                     ((src->pos += dist) - dist)))
 
-ptrlen BinarySource_get_data(BinarySource *src, size_t wanted)
-{
-    if (!avail(wanted))
-        return make_ptrlen("", 0);
-
-    return make_ptrlen(consume(wanted), wanted);
-}
-
-unsigned char BinarySource_get_byte(BinarySource *src)
-{
-    const unsigned char *ucp;
-
-    if (!avail(1))
-        return 0;
-
-    ucp = consume(1);
-    return *ucp;
-}
-
-bool BinarySource_get_bool(BinarySource *src)
-{
-    const unsigned char *ucp;
-
-    if (!avail(1))
-        return false;
-
-    ucp = consume(1);
-    return *ucp != 0;
-}
-
-unsigned BinarySource_get_uint16(BinarySource *src)
-{
-    const unsigned char *ucp;
-
-    if (!avail(2))
-        return 0;
-
-    ucp = consume(2);
-    return GET_16BIT_MSB_FIRST(ucp);
-}
-
-unsigned long BinarySource_get_uint32(BinarySource *src)
-{
-    const unsigned char *ucp;
-
-    if (!avail(4))
-        return 0;
-
-    ucp = consume(4);
-    return GET_32BIT_MSB_FIRST(ucp);
-}
-
-uint64_t BinarySource_get_uint64(BinarySource *src)
-{
-    const unsigned char *ucp;
-
-    if (!avail(8))
-        return 0;
-
-    ucp = consume(8);
-    return GET_64BIT_MSB_FIRST(ucp);
-}
-
 ptrlen BinarySource_get_string(BinarySource *src)
 {
     const unsigned char *ucp;
@@ -4,6 +4,7 @@
 #include "defs.h"
 
 #include <stdio.h>
+#include <string.h>
 
 /*
  * A sort of 'abstract base class' or 'interface' or 'trait' which is
@@ -13,6 +14,18 @@
 struct BinarySink {
     void (*write)(BinarySink *sink, const void *data, size_t len);
     BinarySink *binarysink_;
+
+    /*
+     * Optional fast path, for a sink that's just a growable buffer
+     * (in practice, a strbuf). If fastbuf is non-NULL, the inline
+     * put_* functions below append directly to the buffer
+     * (*fastbuf)[0 .. *fastsize), currently filled up to *fastlen,
+     * whenever it has room for the data plus a trailing NUL (which
+     * they also write). They only call write() when it doesn't.
+     */
+    unsigned char **fastbuf;
+    size_t *fastlen;
+    const size_t *fastsize;
 };
 
 /*
@@ -25,7 +38,8 @@ struct BinarySink {
 #define BinarySink_IMPLEMENTATION BinarySink binarysink_[1]
 #define BinarySink_INIT(obj, writefn) \
     ((obj)->binarysink_->write = (writefn), \
-     (obj)->binarysink_->binarysink_ = (obj)->binarysink_)
+     (obj)->binarysink_->binarysink_ = (obj)->binarysink_, \
+     (obj)->binarysink_->fastbuf = NULL)
 
 /*
  * To define a larger structure type as a valid BinarySink in such a
@@ -149,14 +163,8 @@ struct BinarySink {
  * declared in other headers, so as to guarantee that the
  * declaration(s) of their other parameter type(s) are in scope.
  */
-void BinarySink_put_data(BinarySink *, const void *data, size_t len);
 void BinarySink_put_datapl(BinarySink *, ptrlen);
 void BinarySink_put_padding(BinarySink *, size_t len, unsigned char padbyte);
-void BinarySink_put_byte(BinarySink *, unsigned char);
-void BinarySink_put_bool(BinarySink *, bool);
-void BinarySink_put_uint16(BinarySink *, unsigned long);
-void BinarySink_put_uint32(BinarySink *, unsigned long);
-void BinarySink_put_uint64(BinarySink *, uint64_t);
 void BinarySink_put_string(BinarySink *, const void *data, size_t len);
 void BinarySink_put_stringpl(BinarySink *, ptrlen);
 void BinarySink_put_stringz(BinarySink *, const char *str);
@@ -167,6 +175,59 @@ bool BinarySink_put_pstring(BinarySink *, const char *str);
 void BinarySink_put_mp_ssh1(BinarySink *bs, mp_int *x);
 void BinarySink_put_mp_ssh2(BinarySink *bs, mp_int *x);
 
+/*
+ * The simplest and most frequently used ones are inline, so that
+ * writing a small field to a buffer sink with room for it costs a
+ * bounds check and a store, not an indirect function call.
+ */
+static inline void BinarySink_put_data(
+    BinarySink *bs, const void *data, size_t len)
+{
+    if (bs->fastbuf && len < *bs->fastsize - *bs->fastlen) {
+        unsigned char *p = *bs->fastbuf + *bs->fastlen;
+        if (len)
+            memcpy(p, data, len);
+        p[len] = '\0';
+        *bs->fastlen += len;
+    } else {
+        bs->write(bs, data, len);
+    }
+}
+
+static inline void BinarySink_put_byte(BinarySink *bs, unsigned char val)
+{
+    BinarySink_put_data(bs, &val, 1);
+}
+
+static inline void BinarySink_put_bool(BinarySink *bs, bool val)
+{
+    BinarySink_put_byte(bs, val ? 1 : 0);
+}
+
+static inline void BinarySink_put_uint16(BinarySink *bs, unsigned long val)
+{
+    unsigned char data[2];
+    data[0] = (unsigned char)(val >> 8);
+    data[1] = (unsigned char)val;
+    BinarySink_put_data(bs, data, sizeof(data));
+}
+
+static inline void BinarySink_put_uint32(BinarySink *bs, unsigned long val)
+{
+    unsigned char data[4];
+    data[0] = (unsigned char)(val >> 24);
+    data[1] = (unsigned char)(val >> 16);
+    data[2] = (unsigned char)(val >> 8);
+    data[3] = (unsigned char)val;
+    BinarySink_put_data(bs, data, sizeof(data));
+}
+
+static inline void BinarySink_put_uint64(BinarySink *bs, uint64_t val)
+{
+    BinarySink_put_uint32(bs, (unsigned long)(val >> 32));
+    BinarySink_put_uint32(bs, (unsigned long)(val & 0xFFFFFFFFU));
+}
+
 /* ---------------------------------------------------------------------- */
 
 /*
@@ -303,12 +364,72 @@ static inline void BinarySource_INIT__(BinarySource *src, ptrlen data)
         (const unsigned char *)(BinarySource_UPCAST(src)->data) +       \
         BinarySource_UPCAST(src)->pos))
 
-ptrlen BinarySource_get_data(BinarySource *, size_t);
-unsigned char BinarySource_get_byte(BinarySource *);
-bool BinarySource_get_bool(BinarySource *);
-unsigned BinarySource_get_uint16(BinarySource *);
-unsigned long BinarySource_get_uint32(BinarySource *);
-uint64_t BinarySource_get_uint64(BinarySource *);
+/*
+ * As with BinarySink, the fixed-size reads are inline: each is a
+ * single bounds check when the data is there. If it isn't, they set
+ * err and return zero, as all the get_* functions do.
+ */
+static inline const unsigned char *BinarySource_consume__(
+    BinarySource *src, size_t wanted)
+{
+    const unsigned char *p;
+    if (src->err)
+        return NULL;
+    if (wanted > src->len - src->pos) {
+        src->err = BSE_OUT_OF_DATA;
+        return NULL;
+    }
+    p = (const unsigned char *)src->data + src->pos;
+    src->pos += wanted;
+    return p;
+}
+
+static inline ptrlen BinarySource_get_data(BinarySource *src, size_t wanted)
+{
+    const unsigned char *p = BinarySource_consume__(src, wanted);
+    ptrlen pl;
+    pl.ptr = p ? (const void *)p : "";
+    pl.len = p ? wanted : 0;
+    return pl;
+}
+
+static inline unsigned char BinarySource_get_byte(BinarySource *src)
+{
+    const unsigned char *p = BinarySource_consume__(src, 1);
+    return p ? p[0] : 0;
+}
+
+static inline bool BinarySource_get_bool(BinarySource *src)
+{
+    return BinarySource_get_byte(src) != 0;
+}
+
+static inline unsigned BinarySource_get_uint16(BinarySource *src)
+{
+    const unsigned char *p = BinarySource_consume__(src, 2);
+    return p ? ((unsigned)p[0] << 8) | p[1] : 0;
+}
+
+static inline unsigned long BinarySource_get_uint32(BinarySource *src)
+{
+    const unsigned char *p = BinarySource_consume__(src, 4);
+    return p ? (((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+                ((unsigned long)p[2] << 8) | p[3]) : 0;
+}
+
+static inline uint64_t BinarySource_get_uint64(BinarySource *src)
+{
+    const unsigned char *p = BinarySource_consume__(src, 8);
+    uint64_t hi, lo;
+    if (!p)
+        return 0;
+    hi = ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+        ((unsigned long)p[2] << 8) | p[3];
+    lo = ((unsigned long)p[4] << 24) | ((unsigned long)p[5] << 16) |
+        ((unsigned long)p[6] << 8) | p[7];
+    return (hi << 32) | lo;
+}
+
 ptrlen BinarySource_get_string(BinarySource *);
 const char *BinarySource_get_asciz(BinarySource *);
 ptrlen BinarySource_get_chars(BinarySource *, const char *include_set);
@@ -10,6 +10,8 @@
 #include "puttymem.h"
 #include "misc.h"
 
+uint64_t *safemalloc_counter;
+
 void *safemalloc(size_t factor1, size_t factor2, size_t addend)
 {
     if (factor1 > SIZE_MAX / factor2)
@@ -35,6 +37,8 @@ void *safemalloc(size_t factor1, size_t factor2, size_t addend)
     if (!p)
         goto fail;
 
+    if (safemalloc_counter)
+        (*safemalloc_counter)++;
     return p;
 
   fail:
@@ -67,6 +71,8 @@ void *saferealloc(void *ptr, size_t n, size_t size)
     if (!p)
         out_of_memory();
 
+    if (safemalloc_counter)
+        (*safemalloc_counter)++;
     return p;
 }
 
@@ -132,3 +138,183 @@ void *safegrowarray(void *ptr, size_t *allocated, size_t eltsize,
     *allocated = newsize;
     return toret;
 }
+
+/* ----------------------------------------------------------------------
+ * Pooled allocation for high-churn object types.
+ *
+ * Each block is rounded up to a power-of-two size class and carries
+ * a small header recording its pool and class, so that
+ * safefree_pooled can put it back on the right free list. Each pool
+ * keeps a bounded free list per class; anything bigger than the
+ * largest class is passed straight through to malloc, but still
+ * counted.
+ *
+ * The pools are not locked, so pooled objects must only be allocated
+ * and freed by the main thread. Under MINEFIELD nothing is retained,
+ * so that use-after-free is still caught.
+ */
+
+#define MEMPOOL_MINLOG 5                /* smallest class is 32 bytes */
+#define MEMPOOL_NCLASSES 11             /* and the largest is 32K */
+#define MEMPOOL_NOCLASS 0xFF
+#define MEMPOOL_MAX_COUNT 256
+#define MEMPOOL_MAX_BYTES 262144        /* per class, per pool */
+
+typedef union MemPoolHeader {
+    struct {
+        unsigned char tag, cls;
+        size_t size;                   /* as requested, for the stats */
+    } h;
+    /* Keep the payload as aligned as malloc would have made it */
+    void *align_p;
+    uint64_t align_u;
+    long double align_ld;
+} MemPoolHeader;
+
+typedef struct MemPoolFree MemPoolFree;
+struct MemPoolFree {
+    MemPoolFree *next;
+};
+
+static struct {
+    MemPoolFree *free[MEMPOOL_NCLASSES];
+    size_t nfree[MEMPOOL_NCLASSES];
+    MemPoolStats stats;
+} mempools[N_MEMPOOLS];
+
+#define MEMPOOL_NAME_DEF(id, name) name,
+static const char *const mempool_names[] = { MEMPOOL_LIST(MEMPOOL_NAME_DEF) };
+
+static inline size_t mempool_class_size(unsigned cls)
+{
+    return (size_t)1 << (MEMPOOL_MINLOG + cls);
+}
+
+static inline size_t mempool_class_limit(unsigned cls)
+{
+    size_t limit = MEMPOOL_MAX_BYTES / mempool_class_size(cls);
+    return limit < MEMPOOL_MAX_COUNT ? limit : MEMPOOL_MAX_COUNT;
+}
+
+void *safemalloc_pooled(MemPoolTag tag, size_t size, size_t addend)
+{
+    MemPoolHeader *hdr;
+    unsigned cls;
+
+    assert(tag < N_MEMPOOLS);
+    if (addend > SIZE_MAX - sizeof(MemPoolHeader) - size)
+        out_of_memory();
+    size += addend;
+
+    for (cls = 0; cls < MEMPOOL_NCLASSES; cls++)
+        if (size <= mempool_class_size(cls))
+            break;
+
+    mempools[tag].stats.allocs++;
+    if (cls == MEMPOOL_NCLASSES) {
+        hdr = safemalloc(1, sizeof(MemPoolHeader) + size, 0);
+        cls = MEMPOOL_NOCLASS;
+    } else if (mempools[tag].free[cls]) {
+        MemPoolFree *f = mempools[tag].free[cls];
+        mempools[tag].free[cls] = f->next;
+        mempools[tag].nfree[cls]--;
+        mempools[tag].stats.bytes_pooled -= mempool_class_size(cls);
+        mempools[tag].stats.hits++;
+        hdr = (MemPoolHeader *)f - 1;
+    } else {
+        hdr = safemalloc(1, sizeof(MemPoolHeader) + mempool_class_size(cls),
+                         0);
+    }
+
+    hdr->h.tag = tag;
+    hdr->h.cls = cls;
+    hdr->h.size = size;
+    mempools[tag].stats.bytes_live += size;
+    return hdr + 1;
+}
+
+void safefree_pooled(void *ptr)
+{
+    MemPoolHeader *hdr;
+    unsigned tag, cls;
+
+    if (!ptr)
+        return;
+
+    hdr = (MemPoolHeader *)ptr - 1;
+    tag = hdr->h.tag;
+    cls = hdr->h.cls;
+    assert(tag < N_MEMPOOLS);
+    mempools[tag].stats.frees++;
+    mempools[tag].stats.bytes_live -= hdr->h.size;
+
+#ifndef MINEFIELD
+    if (cls != MEMPOOL_NOCLASS &&
+        mempools[tag].nfree[cls] < mempool_class_limit(cls)) {
+        MemPoolFree *f = ptr;
+        f->next = mempools[tag].free[cls];
+        mempools[tag].free[cls] = f;
+        mempools[tag].nfree[cls]++;
+        mempools[tag].stats.bytes_pooled += mempool_class_size(cls);
+        return;
+    }
+#endif
+
+    safefree(hdr);
+}
+
+/* How much memory a block ties up while it's sitting idle */
+static size_t mempool_idle_size(MemPoolHeader *hdr)
+{
+    return (hdr->h.cls == MEMPOOL_NOCLASS ? hdr->h.size :
+            mempool_class_size(hdr->h.cls));
+}
+
+void mempool_note_idle(void *ptr, size_t extra)
+{
+    MemPoolHeader *hdr = (MemPoolHeader *)ptr - 1;
+    unsigned tag = hdr->h.tag;
+
+    assert(tag < N_MEMPOOLS);
+    mempools[tag].stats.frees++;
+    mempools[tag].stats.bytes_live -= hdr->h.size;
+    mempools[tag].stats.bytes_pooled += mempool_idle_size(hdr) + extra;
+}
+
+void mempool_note_reused(void *ptr, size_t extra)
+{
+    MemPoolHeader *hdr = (MemPoolHeader *)ptr - 1;
+    unsigned tag = hdr->h.tag;
+
+    assert(tag < N_MEMPOOLS);
+    mempools[tag].stats.allocs++;
+    mempools[tag].stats.hits++;
+    mempools[tag].stats.bytes_live += hdr->h.size;
+    mempools[tag].stats.bytes_pooled -= mempool_idle_size(hdr) + extra;
+}
+
+void mempool_get_stats(MemPoolTag tag, MemPoolStats *stats)
+{
+    assert(tag < N_MEMPOOLS);
+    *stats = mempools[tag].stats;
+}
+
+char *mempool_stats_summary(void)
+{
+    strbuf *sb = strbuf_new();
+    unsigned tag;
+
+    for (tag = 0; tag < N_MEMPOOLS; tag++) {
+        MemPoolStats *st = &mempools[tag].stats;
+        if (!st->allocs)
+            continue;
+        strbuf_catf(sb, "%s%s: %"PRIu64" allocs, %"PRIu64" frees, "
+                    "%"SIZEu" bytes live, %"SIZEu" pooled, %u%% hits",
+                    sb->len ? "; " : "", mempool_names[tag],
+                    st->allocs, st->frees, st->bytes_live, st->bytes_pooled,
+                    (unsigned)(st->hits * 100 / st->allocs));
+    }
+    if (!sb->len)
+        strbuf_catf(sb, "no pooled allocations");
+    return strbuf_to_str(sb);
+}
@@ -183,6 +183,29 @@ bool miller_rabin_test_random(MillerRabin *mr)
     return result.passed;
 }
 
+mp_int *miller_rabin_random_witness(mp_int *p)
+{
+    mp_int *two = mp_from_integer(2);
+    mp_int *pm1 = mp_copy(p);
+    mp_sub_integer_into(pm1, pm1, 1);
+    mp_int *mw = mp_random_in_range(two, pm1);
+    mp_free(two);
+    mp_free(pm1);
+    return mw;
+}
+
+bool miller_rabin_test_witness(MillerRabin *mr, mp_int *mw, bool *ppr)
+{
+    struct mr_result result = miller_rabin_test_inner(mr, mw);
+    *ppr = result.potential_primitive_root;
+    return result.passed;
+}
+
+mp_int *miller_rabin_export_witness(MillerRabin *mr, mp_int *mw)
+{
+    return monty_export(mr->mc, mw);
+}
+
 mp_int *miller_rabin_find_potential_primitive_root(MillerRabin *mr)
 {
     while (true) {
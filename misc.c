@@ -335,6 +335,7 @@ char *buildinfo(const char *newline)
 
 size_t nullseat_output(
     Seat *seat, bool is_stderr, const void *data, size_t len) { return 0; }
+void nullseat_sent(Seat *seat, size_t bufsize) {}
 bool nullseat_eof(Seat *seat) { return true; }
 int nullseat_get_userpass_input(
     Seat *seat, prompts_t *p, bufchain *input) { return 0; }
@@ -50,6 +50,9 @@ struct strbuf {
  * avoid copies of it lingering in process memory. */
 strbuf *strbuf_new(void);
 strbuf *strbuf_new_nm(void);
+/* strbuf_new_sized is for callers that know roughly how long the
+ * finished string will be, so that it can be allocated in one go. */
+strbuf *strbuf_new_sized(size_t size);
 
 void strbuf_free(strbuf *buf);
 void *strbuf_append(strbuf *buf, size_t len);
@@ -119,7 +122,11 @@ void bufchain_init(bufchain *ch);
 void bufchain_clear(bufchain *ch);
 size_t bufchain_size(bufchain *ch);
 void bufchain_add(bufchain *ch, const void *data, size_t len);
+void bufchain_add_external(bufchain *ch, const void *data, size_t len,
+                           void (*release)(void *ctx), void *ctx);
 ptrlen bufchain_prefix(bufchain *ch);
+ptrlen bufchain_prefix_coalesced(bufchain *ch, size_t limit);
+size_t bufchain_prefixes(bufchain *ch, ptrlen *out, size_t maxn);
 void bufchain_consume(bufchain *ch, size_t len);
 void bufchain_fetch(bufchain *ch, void *data, size_t len);
 void bufchain_fetch_consume(bufchain *ch, void *data, size_t len);
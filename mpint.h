@@ -42,6 +42,21 @@ mp_int *mp_new(size_t maxbits);
 void mp_free(mp_int *);
 void mp_clear(mp_int *x);
 
+/*
+ * Bracket a high-level operation (a signature, a key exchange) with
+ * these to stop its temporaries going back and forth to the heap.
+ * Between the two calls, mp_ints freed by the current thread are
+ * wiped and kept for reuse by later allocations of the same size in
+ * that thread, and mp_scratch_end frees whatever is left over.
+ *
+ * Every mp_int is still its own heap block, so results can safely
+ * outlive the scope. Calls may be nested; only the outermost pair
+ * has any effect. Which sizes get reused depends only on the sizes
+ * of the numbers involved, never their values.
+ */
+void mp_scratch_begin(void);
+void mp_scratch_end(void);
+
 /*
  * Create mp_ints from various sources: little- and big-endian binary
  * data, an ordinary C unsigned integer type, a decimal or hex string
@@ -390,6 +405,23 @@ mp_int *mp_modmul(mp_int *x, mp_int *y, mp_int *modulus);
 mp_int *mp_modadd(mp_int *x, mp_int *y, mp_int *modulus);
 mp_int *mp_modsub(mp_int *x, mp_int *y, mp_int *modulus);
 
+/*
+ * Variable-time versions of mp_modpow and mp_invert, for use only
+ * where every input is public, such as when verifying a
+ * signature: the signature, the public key and the signed data can
+ * all be seen by anyone watching the connection. They skip over zero
+ * bits of the exponent and stop as soon as they have the answer, so
+ * they're much faster for short exponents like RSA's 65537, but how
+ * long they take depends on the values, so never give them anything
+ * secret. (They have 'vartime' in their names so that grepping for
+ * that finds every call site to audit.)
+ *
+ * Unlike mp_modpow, mp_modpow_vartime doesn't need an odd modulus;
+ * mp_invert_vartime does.
+ */
+mp_int *mp_modpow_vartime(mp_int *base, mp_int *exponent, mp_int *modulus);
+mp_int *mp_invert_vartime(mp_int *x, mp_int *modulus);
+
 /*
  * Shift an mp_int by a given number of bits. The shift count is
  * considered to be secret data, and as a result, the algorithm takes
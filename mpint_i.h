@@ -315,7 +315,10 @@ struct MontyContext {
 
     /*
      * Persistent scratch space from which monty_* functions can
-     * allocate storage for intermediate values.
+     * allocate storage for intermediate values. Only used outside an
+     * mp_scratch_begin scope: inside one, each thread takes its
+     * scratch from its own arena instead, so that worker threads can
+     * share a MontyContext (such as a curve's) with the main thread.
      */
     mp_int *scratch;
 };
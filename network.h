@@ -119,6 +119,17 @@ Socket *new_listener(const char *srcaddr, int port, Plug *plug,
 SockAddr *name_lookup(const char *host, int port, char **canonicalname,
                       Conf *conf, int addressfamily, LogContext *logctx,
                       const char *lookup_reason_for_logging);
+/* sk_namelookup, but reusing any answer obtained in the last ttl
+ * seconds (0 = always look up afresh). Lives in proxy.c, along with
+ * the functions to consult and update the same cache around an
+ * asynchronous lookup. */
+SockAddr *sk_namelookup_cached(const char *host, char **canonicalname,
+                               int addressfamily, int ttl);
+SockAddr *sk_namelookup_from_cache(const char *host, char **canonicalname,
+                                   int addressfamily, int ttl);
+void sk_namelookup_add_to_cache(const char *host, int addressfamily,
+                                int ttl, SockAddr *addr,
+                                const char *canonicalname);
 
 /* platform-dependent callback from new_connection() */
 /* (same caveat about addr as new_connection()) */
@@ -127,6 +138,14 @@ Socket *platform_new_connection(SockAddr *addr, const char *hostname,
                                 bool oobinline, bool nodelay, bool keepalive,
                                 Plug *plug, Conf *conf);
 
+/* callback from new_connection() for PROXY_SSH, making the connection
+ * through a direct-tcpip channel of an in-process SSH session to the
+ * jump host (sshproxy.c, or a stub in nosshproxy.c) */
+Socket *sshproxy_new_connection(SockAddr *addr, const char *hostname,
+                                int port, bool privport,
+                                bool oobinline, bool nodelay, bool keepalive,
+                                Plug *plug, Conf *conf);
+
 /* socket functions */
 
 void sk_init(void);                    /* called once at program startup */
@@ -134,6 +153,26 @@ void sk_cleanup(void);                 /* called just before program exit */
 
 SockAddr *sk_namelookup(const char *host, char **canonicalname, int address_family);
 SockAddr *sk_nonamelookup(const char *host);
+
+/*
+ * Asynchronous version of sk_namelookup, so that a slow name server
+ * doesn't hold up everything else the process is doing.
+ *
+ * The lookup happens in the background, and 'done' is called from
+ * the main loop (never from within sk_namelookup_start itself) with
+ * the SockAddr and canonical name that sk_namelookup would have
+ * returned. Both then belong to the callee. (As with sk_namelookup,
+ * canonicalname may be NULL if the lookup failed.)
+ *
+ * sk_namelookup_cancel abandons a lookup whose callback hasn't
+ * happened yet, and guarantees that it never will.
+ */
+typedef struct NameLookup NameLookup;
+typedef void (*namelookup_done_fn_t)(void *ctx, SockAddr *addr,
+                                     char *canonicalname);
+NameLookup *sk_namelookup_start(const char *host, int address_family,
+                                namelookup_done_fn_t done, void *ctx);
+void sk_namelookup_cancel(NameLookup *nl);
 void sk_getaddr(SockAddr *addr, char *buf, int buflen);
 bool sk_addr_needs_port(SockAddr *addr);
 bool sk_hostname_is_local(const char *name);
@@ -150,9 +189,13 @@ void sk_addr_free(SockAddr *addr);
 SockAddr *sk_addr_dup(SockAddr *addr);
 
 /* NB, control of 'addr' is passed via sk_new, which takes responsibility
- * for freeing it, as for new_connection() */
+ * for freeing it, as for new_connection().
+ *
+ * If 'addr' has several candidate addresses, connect_delay is how many
+ * milliseconds to give each connection attempt before starting the
+ * next one in parallel; 0 means to try them strictly one at a time. */
 Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
-               bool nodelay, bool keepalive, Plug *p);
+               bool nodelay, bool keepalive, int connect_delay, Plug *p);
 
 Socket *sk_newlistener(const char *srcaddr, int port, Plug *plug,
                        bool local_host_only, int address_family);
@@ -190,6 +233,15 @@ const char *sk_addr_error(SockAddr *addr);
 static inline const char *sk_socket_error(Socket *s)
 { return s->vt->socket_error(s); }
 
+/*
+ * Arrange for a network connection to be reset, rather than shut
+ * down in the usual way, when it's closed. This is for telling the
+ * peer that something went wrong, when it's too late to tell it any
+ * other way. Has no effect on sockets other than plain network
+ * connections.
+ */
+void sk_reset_on_close(Socket *s);
+
 /*
  * Set the `frozen' flag on a socket. A frozen socket is one in
  * which all READABLE notifications are ignored, so that data is
@@ -0,0 +1,17 @@
+/*
+ * Stub version of sshproxy.c, for tools that can't run an SSH client
+ * session of their own (PuTTYtel, the SSH servers, and so on).
+ */
+
+#include "putty.h"
+#include "network.h"
+
+Socket *sshproxy_new_connection(SockAddr *addr, const char *hostname,
+                                int port, bool privport,
+                                bool oobinline, bool nodelay, bool keepalive,
+                                Plug *plug, Conf *clientconf)
+{
+    sk_addr_free(addr);
+    return new_error_socket_fmt(
+        plug, "Proxy error: SSH proxying is not supported in this tool");
+}
@@ -0,0 +1,18 @@
+/*
+ * Stub implementations of the background-job functions for
+ * applications without a pool of worker threads.
+ */
+
+#include "putty.h"
+#include "ssh.h"
+
+bool platform_run_in_background(void (*fn)(void *), void (*done)(void *),
+                                void *ctx)
+{
+    return false;
+}
+
+void platform_finish_background(void *ctx)
+{
+    unreachable("No background jobs are run in this application");
+}
@@ -39,6 +39,8 @@ typedef struct PageantAsyncOp PageantAsyncOp;
 typedef struct PageantAsyncOpVtable PageantAsyncOpVtable;
 typedef struct PageantClientRequestNode PageantClientRequestNode;
 typedef struct PageantKeyRequestNode PageantKeyRequestNode;
+typedef struct PageantDecryptJob PageantDecryptJob;
+typedef struct PageantKeyRef PageantKeyRef;
 
 struct PageantClientRequestNode {
     PageantClientRequestNode *prev, *next;
@@ -105,17 +107,69 @@ struct PageantKey {
     };
     strbuf *encrypted_key_file;
     bool decryption_prompt_active;
+    PageantDecryptJob *decrypt_job;    /* non-NULL while the KDF runs */
+    PageantKeyRef *keyref;     /* shares skey->key with sign jobs */
     PageantKeyRequestNode blocked_requests;
     PageantClientDialogId dlgid;
 };
 
+/*
+ * A reference-counted handle on the ssh_key inside a PageantKey's
+ * skey, so that a background signing job can go on using the key
+ * even if the PageantKey lets go of it in the meantime. The count is
+ * only ever changed on the main thread.
+ */
+struct PageantKeyRef {
+    ssh_key *key;
+    unsigned refcount;
+};
+
+static PageantKeyRef *pk_keyref(PageantKey *pk)
+{
+    if (!pk->keyref) {
+        pk->keyref = snew(PageantKeyRef);
+        pk->keyref->key = pk->skey->key;
+        pk->keyref->refcount = 1;      /* the PageantKey's own reference */
+    }
+    pk->keyref->refcount++;
+    return pk->keyref;
+}
+
+static void keyref_put(PageantKeyRef *kr)
+{
+    if (--kr->refcount == 0) {
+        ssh_key_free(kr->key);
+        sfree(kr);
+    }
+}
+
+/*
+ * Discard the decrypted form of a key, leaving the key itself to any
+ * signing job that's still using it.
+ */
+static void pk_free_skey(PageantKey *pk)
+{
+    sfree(pk->skey->comment);
+    if (pk->keyref) {
+        keyref_put(pk->keyref);
+        pk->keyref = NULL;
+    } else {
+        ssh_key_free(pk->skey->key);
+    }
+    sfree(pk->skey);
+    pk->skey = NULL;
+}
+
 typedef struct PageantSignOp PageantSignOp;
+typedef struct PageantSignJob PageantSignJob;
 struct PageantSignOp {
     PageantKey *pk;
     strbuf *data_to_sign;
     unsigned flags;
     int crLine;
     unsigned char failure_type;
+    PageantSignJob *job;
+    strbuf *signature;
 
     PageantKeyRequestNode pkr;
     PageantAsyncOp pao;
@@ -128,6 +182,7 @@ static bool gui_request_in_progress = false;
 static void failure(PageantClient *pc, PageantClientRequestId *reqid,
                     strbuf *sb, unsigned char type, const char *fmt, ...);
 static void fail_requests_for_key(PageantKey *pk, const char *reason);
+static void decryptjob_abandon(PageantDecryptJob *job);
 
 static void pk_free(PageantKey *pk)
 {
@@ -137,12 +192,10 @@ static void pk_free(PageantKey *pk)
         freersakey(pk->rkey);
         sfree(pk->rkey);
     }
-    if (pk->sort.ssh_version == 2 && pk->skey) {
-        sfree(pk->skey->comment);
-        ssh_key_free(pk->skey->key);
-        sfree(pk->skey);
-    }
+    if (pk->sort.ssh_version == 2 && pk->skey)
+        pk_free_skey(pk);
     if (pk->encrypted_key_file) strbuf_free(pk->encrypted_key_file);
+    if (pk->decrypt_job) decryptjob_abandon(pk->decrypt_job);
     fail_requests_for_key(pk, "key deleted from Pageant while signing "
                           "request was pending");
     sfree(pk);
@@ -268,12 +321,13 @@ static void remove_all_keys(int ssh_version)
 
 static void list_keys(BinarySink *bs, int ssh_version)
 {
-    int i;
+    iter234 it;
     PageantKey *pk;
 
     put_uint32(bs, count_keys(ssh_version));
-    for (i = find_first_key_for_version(ssh_version);
-         NULL != (pk = index234(keytree, i)); i++) {
+    for (pk = iter234_at(&it, keytree, find_first_key_for_version(
+                             ssh_version));
+         pk != NULL; pk = iter234_next(&it)) {
         if (pk->sort.ssh_version != ssh_version)
             break;
 
@@ -327,31 +381,123 @@ static PRINTF_LIKE(5, 6) void failure(
     }
 }
 
-static void signop_link(PageantSignOp *so)
+/*
+ * Sign requests for an encrypted key that find some other key's
+ * passphrase prompt already up wait on this list, and are woken when
+ * that prompt (and the decryption that follows it) is finished.
+ */
+static PageantKeyRequestNode requests_blocked_on_gui = {
+    &requests_blocked_on_gui, &requests_blocked_on_gui
+};
+
+static void signop_link_to(PageantSignOp *so, PageantKeyRequestNode *head)
 {
     assert(!so->pkr.prev);
     assert(!so->pkr.next);
 
-    so->pkr.prev = so->pk->blocked_requests.prev;
-    so->pkr.next = &so->pk->blocked_requests;
+    so->pkr.prev = head->prev;
+    so->pkr.next = head;
     so->pkr.prev->next = &so->pkr;
     so->pkr.next->prev = &so->pkr;
 }
 
+static void signop_link(PageantSignOp *so)
+{
+    signop_link_to(so, &so->pk->blocked_requests);
+}
+
 static void signop_unlink(PageantSignOp *so)
 {
     if (so->pkr.next) {
         assert(so->pkr.prev);
         so->pkr.next->prev = so->pkr.prev;
         so->pkr.prev->next = so->pkr.next;
+        so->pkr.next = so->pkr.prev = NULL;
     } else {
         assert(!so->pkr.prev);
     }
 }
 
+/*
+ * The actual signing can be done on a worker thread, so that a slow
+ * key (e.g. large RSA) doesn't hold up every other client while it
+ * runs. The job holds a reference to the key itself (signing doesn't
+ * modify it, and anything an algorithm caches for its private-key
+ * operations is worked out when the key is loaded), and its own copy
+ * of the data, so it doesn't matter if the key is deleted or
+ * re-encrypted, or the client goes away, while it's running.
+ */
+struct PageantSignJob {
+    PageantSignOp *so;     /* NULL if the request has been abandoned */
+    PageantKeyRef *keyref;
+    strbuf *data_to_sign, *signature;
+    unsigned flags;
+};
+
+/*
+ * Even apart from sharing the key with the main thread, elliptic-curve
+ * keys share their curve's MontyContext with every other thread, and
+ * without per-thread variables mpint.c can't give each thread its
+ * own scratch space for it. So in that case, sign on the main thread.
+ */
+#ifdef THREAD_LOCAL
+static const bool signjob_background_ok = true;
+#else
+static const bool signjob_background_ok = false;
+#endif
+
+static PageantSignJob *signjob_new(PageantSignOp *so)
+{
+    PageantSignJob *job = snew(PageantSignJob);
+    job->keyref = pk_keyref(so->pk);
+    job->so = so;
+    job->data_to_sign = strbuf_new();
+    put_datapl(job->data_to_sign, ptrlen_from_strbuf(so->data_to_sign));
+    job->signature = strbuf_new();
+    job->flags = so->flags;
+    return job;
+}
+
+static void signjob_free(PageantSignJob *job)
+{
+    keyref_put(job->keyref);
+    strbuf_free(job->data_to_sign);
+    if (job->signature)
+        strbuf_free(job->signature);
+    sfree(job);
+}
+
+static void signjob_run(void *vctx)
+{
+    PageantSignJob *job = (PageantSignJob *)vctx;
+    ssh_key_sign(job->keyref->key, ptrlen_from_strbuf(job->data_to_sign),
+                 job->flags, BinarySink_UPCAST(job->signature));
+}
+
+static void signjob_done(void *vctx)
+{
+    PageantSignJob *job = (PageantSignJob *)vctx;
+    PageantSignOp *so = job->so;
+
+    if (so) {
+        so->job = NULL;
+        so->signature = job->signature;
+        job->signature = NULL;
+    }
+    signjob_free(job);
+
+    if (so)
+        pageant_async_op_coroutine(&so->pao);
+}
+
 static void signop_free(PageantAsyncOp *pao)
 {
     PageantSignOp *so = container_of(pao, PageantSignOp, pao);
+    signop_unlink(so);
+    if (so->job)
+        so->job->so = NULL;     /* signjob_done will clean it up */
+    if (so->signature)
+        strbuf_free(so->signature);
     strbuf_free(so->data_to_sign);
     sfree(so);
 }
@@ -384,13 +530,18 @@ static void signop_coroutine(PageantAsyncOp *pao)
 
     crBegin(so->crLine);
 
-    while (!so->pk->skey && gui_request_in_progress)
+    while (!so->pk->skey && !so->pk->decrypt_job &&
+           !so->pk->decryption_prompt_active && gui_request_in_progress) {
+        signop_link_to(so, &requests_blocked_on_gui);
         crReturnV;
+        signop_unlink(so);
+    }
 
     if (!so->pk->skey) {
         assert(so->pk->encrypted_key_file);
 
-        if (!request_passphrase(so->pao.info->pc, so->pk)) {
+        if (!so->pk->decrypt_job &&
+            !request_passphrase(so->pao.info->pc, so->pk)) {
             response = strbuf_new();
             failure(so->pao.info->pc, so->pao.reqid, response,
                     so->failure_type, "on-demand decryption could not "
@@ -425,13 +576,26 @@ static void signop_coroutine(PageantAsyncOp *pao)
         goto respond;
     }
 
-    strbuf *signature = strbuf_new();
-    ssh_key_sign(so->pk->skey->key, ptrlen_from_strbuf(so->data_to_sign),
-                 so->flags, BinarySink_UPCAST(signature));
+    if (signjob_background_ok)
+        so->job = signjob_new(so);
+    if (so->job && platform_run_in_background(
+            signjob_run, signjob_done, so->job)) {
+        crReturnV;                     /* resumed by signjob_done */
+    } else {
+        /* No worker threads, so just do it here */
+        if (so->job) {
+            signjob_free(so->job);
+            so->job = NULL;
+        }
+        so->signature = strbuf_new();
+        ssh_key_sign(so->pk->skey->key, ptrlen_from_strbuf(so->data_to_sign),
+                     so->flags, BinarySink_UPCAST(so->signature));
+    }
 
     response = strbuf_new();
     put_byte(response, SSH2_AGENT_SIGN_RESPONSE);
-    put_stringsb(response, signature);
+    put_stringsb(response, so->signature);
+    so->signature = NULL;
 
   respond:
     pageant_client_got_response(so->pao.info->pc, so->pao.reqid,
@@ -449,6 +613,17 @@ static const PageantAsyncOpVtable signop_vtable = {
 
 static void fail_requests_for_key(PageantKey *pk, const char *reason)
 {
+    /* Include any requests for this key still waiting on the GUI */
+    for (PageantKeyRequestNode *pkr = requests_blocked_on_gui.next, *next;
+         pkr != &requests_blocked_on_gui; pkr = next) {
+        PageantSignOp *so = container_of(pkr, PageantSignOp, pkr);
+        next = pkr->next;
+        if (so->pk == pk) {
+            signop_unlink(so);
+            signop_link(so);
+        }
+    }
+
     while (pk->blocked_requests.next != &pk->blocked_requests) {
         PageantSignOp *so = container_of(pk->blocked_requests.next,
                                          PageantSignOp, pkr);
@@ -463,82 +638,164 @@ static void fail_requests_for_key(PageantKey *pk, const char *reason)
     }
 }
 
-static void unblock_requests_for_key(PageantKey *pk)
+static void unblock_pending_gui_requests(void)
 {
-    for (PageantKeyRequestNode *pkr = pk->blocked_requests.next;
-         pkr != &pk->blocked_requests; pkr = pkr->next) {
-        PageantSignOp *so = container_of(pk->blocked_requests.next,
-                                         PageantSignOp, pkr);
+    for (PageantKeyRequestNode *pkr = requests_blocked_on_gui.next;
+         pkr != &requests_blocked_on_gui; pkr = pkr->next) {
+        PageantSignOp *so = container_of(pkr, PageantSignOp, pkr);
         queue_toplevel_callback(pageant_async_op_callback, &so->pao);
     }
 }
 
-void pageant_passphrase_request_success(PageantClientDialogId *dlgid,
-                                        ptrlen passphrase)
+static void gui_request_finished(void)
 {
-    PageantKey *pk = container_of(dlgid, PageantKey, dlgid);
-
     assert(gui_request_in_progress);
     gui_request_in_progress = false;
-    pk->decryption_prompt_active = false;
+    unblock_pending_gui_requests();
+}
 
-    if (!pk->skey) {
-        const char *error;
+static void unblock_requests_for_key(PageantKey *pk)
+{
+    for (PageantKeyRequestNode *pkr = pk->blocked_requests.next;
+         pkr != &pk->blocked_requests; pkr = pkr->next) {
+        PageantSignOp *so = container_of(pkr, PageantSignOp, pkr);
+        queue_toplevel_callback(pageant_async_op_callback, &so->pao);
+    }
+}
 
-        BinarySource src[1];
-        BinarySource_BARE_INIT_PL(src, ptrlen_from_strbuf(
-                                      pk->encrypted_key_file));
+/*
+ * Decrypting a key file means running its KDF, which is deliberately
+ * slow, so we do it on a worker thread if we can. The job keeps its
+ * own copies of the key file and passphrase; if the key is deleted
+ * from Pageant meanwhile, the result is just thrown away.
+ *
+ * gui_request_in_progress stays set until the job finishes, so that
+ * no other passphrase prompt can appear before we know whether this
+ * one needs asking again.
+ */
+struct PageantDecryptJob {
+    PageantKey *pk;                    /* NULL if abandoned */
+    strbuf *keyfile, *passphrase;
+    ssh2_userkey *skey;
+    const char *error;
+};
 
-        strbuf *ppsb = strbuf_new_nm();
-        put_datapl(ppsb, passphrase);
+static void decryptjob_run(void *vctx)
+{
+    PageantDecryptJob *job = (PageantDecryptJob *)vctx;
+    BinarySource src[1];
 
-        pk->skey = ppk_load_s(src, ppsb->s, &error);
+    BinarySource_BARE_INIT_PL(src, ptrlen_from_strbuf(job->keyfile));
+    job->skey = ppk_load_s(src, job->passphrase->s, &job->error);
+}
 
-        strbuf_free(ppsb);
+static void decryptjob_abandon(PageantDecryptJob *job)
+{
+    job->pk->decrypt_job = NULL;
+    job->pk = NULL;
+}
 
-        if (!pk->skey) {
-            fail_requests_for_key(pk, "unable to decrypt key");
-            return;
-        } else if (pk->skey == SSH2_WRONG_PASSPHRASE) {
-            pk->skey = NULL;
+static void decrypted_key_free(ssh2_userkey *skey)
+{
+    sfree(skey->comment);
+    ssh_key_free(skey->key);
+    sfree(skey);
+}
 
+static void pageant_key_decrypted(PageantKey *pk, ssh2_userkey *skey)
+{
+    if (!skey) {
+        fail_requests_for_key(pk, "unable to decrypt key");
+        return;
+    } else if (skey == SSH2_WRONG_PASSPHRASE) {
+        /*
+         * Find a PageantClient to use for another attempt at
+         * request_passphrase.
+         */
+        PageantKeyRequestNode *pkr = pk->blocked_requests.next;
+        if (pkr == &pk->blocked_requests) {
             /*
-             * Find a PageantClient to use for another attempt at
-             * request_passphrase.
+             * Special case: if all the requests have gone away at
+             * this point, we need not bother putting up a request
+             * at all any more.
              */
-            PageantKeyRequestNode *pkr = pk->blocked_requests.next;
-            if (pkr == &pk->blocked_requests) {
-                /*
-                 * Special case: if all the requests have gone away at
-                 * this point, we need not bother putting up a request
-                 * at all any more.
-                 */
-                return;
-            }
+            return;
+        }
 
-            PageantSignOp *so = container_of(pk->blocked_requests.next,
-                                             PageantSignOp, pkr);
+        PageantSignOp *so = container_of(pk->blocked_requests.next,
+                                         PageantSignOp, pkr);
 
-            pk->decryption_prompt_active = false;
-            if (!request_passphrase(so->pao.info->pc, pk)) {
-                fail_requests_for_key(pk, "unable to continue creating "
-                                      "passphrase prompts");
-            }
-            return;
+        pk->decryption_prompt_active = false;
+        if (!request_passphrase(so->pao.info->pc, pk)) {
+            fail_requests_for_key(pk, "unable to continue creating "
+                                  "passphrase prompts");
         }
+        return;
     }
 
+    if (!pk->skey)
+        pk->skey = skey;
+    else
+        decrypted_key_free(skey);      /* someone beat us to it */
+
     unblock_requests_for_key(pk);
 }
 
-void pageant_passphrase_request_refused(PageantClientDialogId *dlgid)
+static void decryptjob_done(void *vctx)
+{
+    PageantDecryptJob *job = (PageantDecryptJob *)vctx;
+    PageantKey *pk = job->pk;
+
+    gui_request_finished();
+
+    strbuf_free(job->keyfile);
+    strbuf_free(job->passphrase);
+    if (pk) {
+        pk->decrypt_job = NULL;
+        pageant_key_decrypted(pk, job->skey);
+    } else if (job->skey && job->skey != SSH2_WRONG_PASSPHRASE) {
+        decrypted_key_free(job->skey);
+    }
+    sfree(job);
+}
+
+void pageant_passphrase_request_success(PageantClientDialogId *dlgid,
+                                        ptrlen passphrase)
 {
     PageantKey *pk = container_of(dlgid, PageantKey, dlgid);
 
     assert(gui_request_in_progress);
-    gui_request_in_progress = false;
     pk->decryption_prompt_active = false;
 
+    if (pk->skey) {
+        gui_request_finished();
+        unblock_requests_for_key(pk);
+        return;
+    }
+
+    PageantDecryptJob *job = snew(PageantDecryptJob);
+    job->pk = pk;
+    job->keyfile = strbuf_new_nm();
+    put_datapl(job->keyfile, ptrlen_from_strbuf(pk->encrypted_key_file));
+    job->passphrase = strbuf_new_nm();
+    put_datapl(job->passphrase, passphrase);
+    job->skey = NULL;
+    job->error = NULL;
+
+    pk->decrypt_job = job;
+    if (!platform_run_in_background(decryptjob_run, decryptjob_done, job)) {
+        decryptjob_run(job);
+        decryptjob_done(job);
+    }
+}
+
+void pageant_passphrase_request_refused(PageantClientDialogId *dlgid)
+{
+    PageantKey *pk = container_of(dlgid, PageantKey, dlgid);
+
+    pk->decryption_prompt_active = false;
+    gui_request_finished();
+
     fail_requests_for_key(pk, "user refused to supply passphrase");
 }
 
@@ -599,12 +856,8 @@ static bool reencrypt_key(PageantKey *pk)
     /* Only actually free pk->skey if it exists. But we return success
      * regardless, so that 'please ensure this key isn't stored
      * decrypted' is idempotent. */
-    if (pk->skey) {
-        sfree(pk->skey->comment);
-        ssh_key_free(pk->skey->key);
-        sfree(pk->skey);
-        pk->skey = NULL;
-    }
+    if (pk->skey)
+        pk_free_skey(pk);
 
     return true;
 }
@@ -824,6 +1077,8 @@ static PageantAsyncOp *pageant_make_op(
         so->flags = flags;
         so->failure_type = failure_type;
         so->crLine = 0;
+        so->job = NULL;
+        so->signature = NULL;
         return &so->pao;
         break;
       }
@@ -1266,8 +1521,10 @@ static PageantAsyncOp *pageant_make_op(
              */
             unsigned nfailures = 0, nsuccesses = 0;
             PageantKey *pk;
+            iter234 it;
 
-            for (int i = 0; (pk = index234(keytree, i)) != NULL; i++) {
+            for (pk = iter234_first(&it, keytree); pk;
+                 pk = iter234_next(&it)) {
               if (reencrypt_key(pk))
                   nsuccesses++;
               else
@@ -2270,7 +2527,7 @@ int pageant_sign(struct pageant_pubkey *key, ptrlen message, strbuf *out,
 struct pageant_pubkey *pageant_pubkey_copy(struct pageant_pubkey *key)
 {
     struct pageant_pubkey *ret = snew(struct pageant_pubkey);
-    ret->blob = strbuf_new();
+    ret->blob = strbuf_new_sized(key->blob->len);
     put_data(ret->blob, key->blob->s, key->blob->len);
     ret->comment = key->comment ? dupstr(key->comment) : NULL;
     ret->ssh_version = key->ssh_version;
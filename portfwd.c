@@ -44,6 +44,15 @@ typedef struct PortForwarding {
     strbuf *socksbuf;
     size_t socksbuf_consumed;
 
+    /*
+     * Rate limits and scheduling weight from the forwarding this
+     * connection belongs to, waiting to be passed on to the SSH
+     * channel before it sends any data (see pfd_apply_rate_limits).
+     */
+    bool limits_pending;
+    RateLimit *rl_own, *rl_shared;
+    unsigned weight;
+
     Plug plug;
     Channel chan;
 } PortForwarding;
@@ -59,6 +68,8 @@ struct PortListener {
     char *hostname;
     int port;
 
+    PortFwdRecord *pfr;                /* for its rate limits */
+
     Plug plug;
 };
 
@@ -67,6 +78,9 @@ static struct PortForwarding *new_portfwd_state(void)
     struct PortForwarding *pf = snew(struct PortForwarding);
     pf->hostname = NULL;
     pf->socksbuf = NULL;
+    pf->limits_pending = false;
+    pf->rl_own = pf->rl_shared = NULL;
+    pf->weight = 1;
     return pf;
 }
 
@@ -74,6 +88,10 @@ static void free_portfwd_state(struct PortForwarding *pf)
 {
     if (!pf)
         return;
+    if (pf->rl_own)
+        ratelimit_free(pf->rl_own);
+    if (pf->rl_shared)
+        ratelimit_free(pf->rl_shared);
     sfree(pf->hostname);
     if (pf->socksbuf)
         strbuf_free(pf->socksbuf);
@@ -141,6 +159,7 @@ static void pfd_closing(Plug *plug, const char *error_msg, int error_code,
 }
 
 static void pfl_terminate(struct PortListener *pl);
+static void pfr_limit_connection(PortFwdRecord *pfr, struct PortForwarding *pf);
 
 static void pfl_closing(Plug *plug, const char *error_msg, int error_code,
                         bool calling_back)
@@ -192,6 +211,27 @@ static char *ipv6_to_string(ptrlen ipv6)
                      (unsigned)GET_16BIT_MSB_FIRST(addr + 14));
 }
 
+/*
+ * Limit on the data we'll accept from a SOCKS client after its
+ * request, while we wait for the SSH server to open the channel.
+ */
+#define SOCKS_EARLY_DATA_LIMIT 16384
+
+static void pfd_apply_rate_limits(struct PortForwarding *pf)
+{
+    if (pf->limits_pending && pf->c) {
+        sshfwd_set_rate_limits(pf->c, pf->rl_own, pf->rl_shared, pf->weight);
+        pf->limits_pending = false;
+    }
+}
+
+static void pfd_check_early_data(struct PortForwarding *pf)
+{
+    if (!pf->ready && pf->socksbuf &&
+        pf->socksbuf->len - pf->socksbuf_consumed >= SOCKS_EARLY_DATA_LIMIT)
+        sk_set_frozen(pf->s, true);
+}
+
 static void pfd_receive(Plug *plug, int urgent, const char *data, size_t len)
 {
     struct PortForwarding *pf =
@@ -402,19 +442,26 @@ static void pfd_receive(Plug *plug, int urgent, const char *data, size_t len)
         /*
          * We come here when we're ready to make an actual
          * connection.
+         *
+         * We've already told the SOCKS client it succeeded, so it
+         * may well send its first request without waiting. Rather
+         * than freezing the socket straight away until the SSH
+         * server confirms the channel, keep accepting data into
+         * socksbuf (up to a limit), so that pfd_open_confirmation
+         * can send all of it immediately behind the channel open.
          */
-
-        /*
-         * Freeze the socket until the SSH server confirms the
-         * connection.
-         */
-        sk_set_frozen(pf->s, true);
-
         pf->c = wrap_lportfwd_open(pf->cl, pf->hostname, pf->port, pf->s,
                                    &pf->chan);
+        pfd_check_early_data(pf);
+        return;
     }
-    if (pf->ready)
+    if (pf->ready) {
+        pfd_apply_rate_limits(pf);
         sshfwd_write(pf->c, data, len);
+    } else if (pf->socksbuf) {
+        put_data(pf->socksbuf, data, len);
+        pfd_check_early_data(pf);
+    }
 }
 
 static void pfd_sent(Plug *plug, size_t bufsize)
@@ -530,6 +577,8 @@ static int pfl_accepting(Plug *p, accept_fn_t constructor, accept_ctx_t ctx)
     }
 
     pf = container_of(chan, struct PortForwarding, chan);
+    if (pl->pfr)
+        pfr_limit_connection(pl->pfr, pf);
 
     if (pl->is_dynamic) {
         pf->s = s;
@@ -566,7 +615,8 @@ static const PlugVtable PortListener_plugvt = {
 static char *pfl_listen(const char *desthost, int destport,
                         const char *srcaddr, int port,
                         ConnectionLayer *cl, Conf *conf,
-                        struct PortListener **pl_ret, int address_family)
+                        struct PortListener **pl_ret, int address_family,
+                        PortFwdRecord *pfr)
 {
     const char *err;
     struct PortListener *pl;
@@ -583,6 +633,7 @@ static char *pfl_listen(const char *desthost, int destport,
     } else
         pl->is_dynamic = true;
     pl->cl = cl;
+    pl->pfr = pfr;
 
     pl->s = new_listener(srcaddr, port, &pl->plug,
                          !conf_get_bool(conf, CONF_lport_acceptall),
@@ -663,6 +714,7 @@ static void pfd_open_confirmation(Channel *chan)
     PortForwarding *pf = container_of(chan, PortForwarding, chan);
 
     pf->ready = true;
+    pfd_apply_rate_limits(pf);
     sk_set_frozen(pf->s, false);
     sk_write(pf->s, NULL, 0);
     if (pf->socksbuf) {
@@ -673,6 +725,27 @@ static void pfd_open_confirmation(Channel *chan)
     }
 }
 
+/*
+ * Return the socket behind a forwarding channel, if the forwarding
+ * has finished any SOCKS exchange and has no data of its own still
+ * waiting to go anywhere: at that point the channel is nothing but a
+ * conduit, and a caller (psocks) can take over the socket's traffic
+ * directly. Otherwise return NULL.
+ */
+Socket *portfwd_idle_socket(Channel *chan)
+{
+    PortForwarding *pf;
+
+    if (chan->vt != &PortForwarding_channelvt)
+        return NULL;
+    pf = container_of(chan, PortForwarding, chan);
+
+    if (!pf->ready || pf->socks_state != SOCKS_NONE || pf->socksbuf ||
+        sk_write(pf->s, NULL, 0) > 0)
+        return NULL;
+    return pf->s;
+}
+
 static void pfd_open_failure(Channel *chan, const char *errtext)
 {
     assert(chan->vt == &PortForwarding_channelvt);
@@ -681,6 +754,14 @@ static void pfd_open_failure(Channel *chan, const char *errtext)
     logeventf(pf->cl->logctx,
               "Forwarded connection refused by remote%s%s",
               errtext ? ": " : "", errtext ? errtext : "");
+
+    /*
+     * If this was a SOCKS connection, we've already told the client
+     * it succeeded, so the best we can do now is to reset it, so
+     * that it doesn't mistake this for an ordinary close.
+     */
+    if (pf->socksbuf)
+        sk_reset_on_close(pf->s);
 }
 
 /* ----------------------------------------------------------------------
@@ -697,8 +778,62 @@ struct PortFwdRecord {
     struct ssh_rportfwd *remote;
     int addressfamily;
     struct PortListener *local;
+
+    /*
+     * Limits from CONF_portfwd_limits: bytes per second for each
+     * connection (0 for none), a bucket shared by all of them (NULL
+     * for none), and their scheduling weight.
+     */
+    unsigned long rate_each;
+    RateLimit *rate_total;
+    unsigned weight;
 };
 
+/*
+ * Set up a PortFwdRecord's limits from the CONF_portfwd_limits entry
+ * with the same key as its CONF_portfwd one, if any. The value has
+ * the form "rate[:total[:weight]]", where 'rate' limits each
+ * connection and 'total' all of them together, in bytes per second,
+ * with an empty or zero value meaning no limit.
+ */
+static void pfr_set_limits(PortFwdRecord *pfr, Conf *conf, const char *key)
+{
+    const char *val = conf_get_str_str_opt(conf, CONF_portfwd_limits, key);
+    unsigned long rate_each = 0, rate_total = 0, weight = 1;
+
+    if (val) {
+        char *end;
+        rate_each = strtoul(val, &end, 10);
+        if (*end == ':') {
+            rate_total = strtoul(end + 1, &end, 10);
+            if (*end == ':')
+                weight = strtoul(end + 1, &end, 10);
+        }
+    }
+
+    pfr->rate_each = rate_each;
+    pfr->weight = weight ? weight : 1;
+    if (!rate_total) {
+        if (pfr->rate_total)
+            ratelimit_free(pfr->rate_total);
+        pfr->rate_total = NULL;
+    } else if (pfr->rate_total) {
+        ratelimit_set_rate(pfr->rate_total, rate_total);
+    } else {
+        pfr->rate_total = ratelimit_new(rate_total);
+    }
+}
+
+static void pfr_limit_connection(PortFwdRecord *pfr, struct PortForwarding *pf)
+{
+    if (!pfr->rate_each && !pfr->rate_total && pfr->weight == 1)
+        return;
+    pf->rl_own = pfr->rate_each ? ratelimit_new(pfr->rate_each) : NULL;
+    pf->rl_shared = pfr->rate_total ? ratelimit_ref(pfr->rate_total) : NULL;
+    pf->weight = pfr->weight;
+    pf->limits_pending = true;
+}
+
 static int pfr_cmp(void *av, void *bv)
 {
     PortFwdRecord *a = (PortFwdRecord *) av;
@@ -739,6 +874,8 @@ static void pfr_free(PortFwdRecord *pfr)
     sfree(pfr->daddr);
     sfree(pfr->sserv);
     sfree(pfr->dserv);
+    if (pfr->rate_total)
+        ratelimit_free(pfr->rate_total);
     sfree(pfr);
 }
 
@@ -786,6 +923,7 @@ void portfwdmgr_free(PortFwdManager *mgr)
 void portfwdmgr_config(PortFwdManager *mgr, Conf *conf)
 {
     PortFwdRecord *pfr;
+    iter234 it;
     int i;
     char *key, *val;
 
@@ -800,7 +938,8 @@ void portfwdmgr_config(PortFwdManager *mgr, Conf *conf)
      * configuration and find out which bits are the same as
      * they were before.
      */
-    for (i = 0; (pfr = index234(mgr->forwardings, i)) != NULL; i++)
+    for (pfr = iter234_first(&it, mgr->forwardings); pfr;
+         pfr = iter234_next(&it))
         pfr->status = DESTROY;
 
     for (val = conf_get_str_strs(conf, CONF_portfwd, NULL, &key);
@@ -888,6 +1027,8 @@ void portfwdmgr_config(PortFwdManager *mgr, Conf *conf)
             pfr->addressfamily = (address_family == '4' ? ADDRTYPE_IPV4 :
                                   address_family == '6' ? ADDRTYPE_IPV6 :
                                   ADDRTYPE_UNSPEC);
+            pfr->rate_total = NULL;
+            pfr_set_limits(pfr, conf, key);
 
             PortFwdRecord *existing = add234(mgr->forwardings, pfr);
             if (existing != pfr) {
@@ -899,6 +1040,7 @@ void portfwdmgr_config(PortFwdManager *mgr, Conf *conf)
                      * as KEEP.
                      */
                     existing->status = KEEP;
+                    pfr_set_limits(existing, conf, key);
                 }
                 /*
                  * Anything else indicates that there was a duplicate
@@ -971,7 +1113,8 @@ void portfwdmgr_config(PortFwdManager *mgr, Conf *conf)
     /*
      * And finally, set up any new port forwardings (status==CREATE).
      */
-    for (i = 0; (pfr = index234(mgr->forwardings, i)) != NULL; i++) {
+    for (pfr = iter234_first(&it, mgr->forwardings); pfr;
+         pfr = iter234_next(&it)) {
         if (pfr->status == CREATE) {
             char *sportdesc, *dportdesc;
             sportdesc = dupprintf("%s%s%s%s%d%s",
@@ -996,7 +1139,7 @@ void portfwdmgr_config(PortFwdManager *mgr, Conf *conf)
                 char *err = pfl_listen(pfr->daddr, pfr->dport,
                                        pfr->saddr, pfr->sport,
                                        mgr->cl, conf, &pfr->local,
-                                       pfr->addressfamily);
+                                       pfr->addressfamily, pfr);
 
                 logeventf(mgr->cl->logctx,
                           "Local %sport %s forwarding to %s%s%s",
@@ -1009,7 +1152,7 @@ void portfwdmgr_config(PortFwdManager *mgr, Conf *conf)
             } else if (pfr->type == 'D') {
                 char *err = pfl_listen(NULL, -1, pfr->saddr, pfr->sport,
                                        mgr->cl, conf, &pfr->local,
-                                       pfr->addressfamily);
+                                       pfr->addressfamily, pfr);
 
                 logeventf(mgr->cl->logctx,
                           "Local %sport %s SOCKS dynamic forwarding%s%s",
@@ -1066,6 +1209,9 @@ bool portfwdmgr_listen(PortFwdManager *mgr, const char *host, int port,
     pfr->local = NULL;
     pfr->remote = NULL;
     pfr->addressfamily = ADDRTYPE_UNSPEC;
+    pfr->rate_each = 0;
+    pfr->rate_total = NULL;
+    pfr->weight = 1;
 
     PortFwdRecord *existing = add234(mgr->forwardings, pfr);
     if (existing != pfr) {
@@ -1077,7 +1223,8 @@ bool portfwdmgr_listen(PortFwdManager *mgr, const char *host, int port,
     }
 
     char *err = pfl_listen(keyhost, keyport, host, port,
-                           mgr->cl, conf, &pfr->local, pfr->addressfamily);
+                           mgr->cl, conf, &pfr->local, pfr->addressfamily,
+                           NULL);
     logeventf(mgr->cl->logctx,
               "%s on port %s:%d to forward to client%s%s",
               err ? "Failed to listen" : "Listening", host, port,
@@ -1123,10 +1270,14 @@ bool portfwdmgr_unlisten(PortFwdManager *mgr, const char *host, int port)
  *
  * On success, returns NULL and fills in *pf_ret. On error, returns a
  * dynamically allocated error message string.
+ *
+ * The host name is looked up here and now (or found in the DNS
+ * cache), rather than in the background, so that a name that doesn't
+ * resolve can still be reported by refusing the channel open.
  */
 char *portfwdmgr_connect(PortFwdManager *mgr, Channel **chan_ret,
                          char *hostname, int port, SshChannel *c,
-                         int addressfamily)
+                         int addressfamily, PortFwdRecord *pfr)
 {
     SockAddr *addr;
     const char *err;
@@ -1158,6 +1309,8 @@ char *portfwdmgr_connect(PortFwdManager *mgr, Channel **chan_ret,
     pf->c = c;
     pf->cl = mgr->cl;
     pf->socks_state = SOCKS_NONE;
+    if (pfr)
+        pfr_limit_connection(pfr, pf);
 
     pf->s = new_connection(addr, dummy_realhost, port,
                            false, true, false, false, &pf->plug, mgr->conf);
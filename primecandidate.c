@@ -34,6 +34,13 @@ struct PrimeCandidateSource {
     struct avoid *avoids;
     size_t navoids, avoidsize;
 
+    /* If the limit is large, we choose all our random numbers from
+     * the same block of 2^64 consecutive integers (see pcs_generate).
+     * These are the base of that block, and its residue modulo each
+     * avoids[i].mod. */
+    mp_int *block_base;
+    unsigned *block_res;
+
     /* List of known primes that our number will be congruent to 1 modulo */
     mp_int **kps;
     size_t nkps, kpsize;
@@ -58,6 +65,9 @@ PrimeCandidateSource *pcs_new_with_firstbits(unsigned bits,
     s->avoids = NULL;
     s->navoids = s->avoidsize = 0;
 
+    s->block_base = NULL;
+    s->block_res = NULL;
+
     /* Make the number that's the lower limit of our range */
     mp_int *firstmp = mp_from_integer(first);
     mp_int *base = mp_lshift_fixed(firstmp, bits - nfirst);
@@ -98,6 +108,9 @@ void pcs_free(PrimeCandidateSource *s)
         mp_free(s->kps[i]);
     sfree(s->avoids);
     sfree(s->kps);
+    if (s->block_base)
+        mp_free(s->block_base);
+    sfree(s->block_res);
     sfree(s);
 }
 
@@ -365,6 +378,86 @@ void pcs_ready(PrimeCandidateSource *s)
     s->ready = true;
 }
 
+/*
+ * Checking a random x against every entry in the avoid list takes
+ * one mp_unsafe_mod_integer per small prime, which for a
+ * multi-thousand-bit x costs considerably more than the Miller-Rabin
+ * test we're trying to save. So when the limit is large enough, we
+ * pick a random multiple of 2^64 once, compute its residues modulo
+ * everything in the avoid list, and after that generate x by adding
+ * a random 64-bit offset to it. Then each residue check needs only
+ * single-word arithmetic.
+ *
+ * This doesn't make x uniform over the full range. But every block
+ * contains so many primes (more than 2^50, at any size we use) that
+ * they are all chosen with very nearly the same probability in the
+ * end. An incremental search from a random start would not have that
+ * property: it favours primes that follow long gaps.
+ */
+#define PCS_BLOCK_BITS 64
+#define PCS_BLOCK_MIN_LIMIT_BITS (PCS_BLOCK_BITS + 64)
+
+static void pcs_setup_block(PrimeCandidateSource *s)
+{
+    mp_int *nblocks = mp_rshift_safe(s->limit, PCS_BLOCK_BITS);
+    mp_int *block = mp_random_upto(nblocks);
+    s->block_base = mp_lshift_fixed(block, PCS_BLOCK_BITS);
+    mp_free(block);
+    mp_free(nblocks);
+
+    s->block_res = snewn(s->navoids, unsigned);
+    unsigned res = 0, last_mod = 0;
+    for (size_t i = 0; i < s->navoids; i++) {
+        unsigned mod = s->avoids[i].mod;
+        if (mod != last_mod) {
+            last_mod = mod;
+            res = mp_unsafe_mod_integer(s->block_base, mod);
+        }
+        s->block_res[i] = res;
+    }
+}
+
+static mp_int *pcs_generate_from_block(PrimeCandidateSource *s)
+{
+    if (!s->block_base)
+        pcs_setup_block(s);
+
+    while (true) {
+        unsigned char buf[8];
+        random_read(buf, sizeof(buf));
+        uint64_t offset = GET_64BIT_MSB_FIRST(buf);
+
+        unsigned x_res = 0, last_mod = 0;
+        bool ok = true;
+
+        for (size_t i = 0; i < s->navoids; i++) {
+            unsigned mod = s->avoids[i].mod, avoid_res = s->avoids[i].res;
+
+            if (mod != last_mod) {
+                last_mod = mod;
+                x_res = (s->block_res[i] + offset % mod) % mod;
+            }
+
+            if (x_res == avoid_res) {
+                ok = false;
+                break;
+            }
+        }
+
+        if (!ok)
+            continue; /* try a new offset */
+
+        mp_int *x = mp_copy(s->block_base);
+        mp_add_integer_into(x, x, offset);
+
+        mp_int *toret = mp_new(s->bits);
+        mp_mul_into(toret, x, s->factor);
+        mp_add_into(toret, toret, s->addend);
+        mp_free(x);
+        return toret;
+    }
+}
+
 mp_int *pcs_generate(PrimeCandidateSource *s)
 {
     assert(s->ready);
@@ -374,6 +467,9 @@ mp_int *pcs_generate(PrimeCandidateSource *s)
         s->thrown_away_my_shot = true;
     }
 
+    if (mp_get_nbits(s->limit) >= PCS_BLOCK_MIN_LIMIT_BITS)
+        return pcs_generate_from_block(s);
+
     while (true) {
         mp_int *x = mp_random_upto(s->limit);
 
@@ -12,6 +12,7 @@
 #include "putty.h"
 #include "network.h"
 #include "proxy.h"
+#include "tree234.h"
 
 #define do_proxy_dns(conf) \
     (conf_get_int(conf, CONF_proxy_dns) == FORCE_ON || \
@@ -83,8 +84,13 @@ static void sk_proxy_close (Socket *s)
 {
     ProxySocket *ps = container_of(s, ProxySocket, sock);
 
-    sk_close(ps->sub_socket);
-    sk_addr_free(ps->remote_addr);
+    if (ps->lookup)
+        sk_namelookup_cancel(ps->lookup);
+    if (ps->sub_socket)
+        sk_close(ps->sub_socket);
+    if (ps->remote_addr)
+        sk_addr_free(ps->remote_addr);
+    sfree(ps->lookup_host);
     sfree(ps);
 }
 
@@ -348,13 +354,175 @@ static char *dns_log_msg(const char *host, int addressfamily,
                       ""), reason);
 }
 
+/*
+ * Process-wide cache of host name lookups, so that programs making
+ * lots of connections to the same few hosts (psocks, or a session
+ * with many port forwardings) don't have to go back to the resolver
+ * every time.
+ *
+ * getaddrinfo doesn't tell us the DNS TTL of its answers, so instead
+ * each caller says how long it's prepared to trust one, and an entry
+ * is only reused by a lookup that would have been willing to keep it
+ * that long. Failed lookups are remembered too, but never for more
+ * than DNS_CACHE_NEGATIVE_SECS, since a failure is often transient.
+ */
+#define DNS_CACHE_NEGATIVE_SECS 10
+
+typedef struct dns_cache_entry {
+    char *host;
+    int addressfamily;
+    SockAddr *addr;                    /* possibly with an error */
+    char *canonicalname;               /* NULL if sk_namelookup left it */
+    unsigned long when;                /* GETTICKCOUNT at lookup */
+} dns_cache_entry;
+
+static tree234 *dns_cache;
+
+static int dns_cache_cmp(void *av, void *bv)
+{
+    dns_cache_entry *a = (dns_cache_entry *)av;
+    dns_cache_entry *b = (dns_cache_entry *)bv;
+    int c = strcmp(a->host, b->host);
+    if (c)
+        return c;
+    if (a->addressfamily < b->addressfamily)
+        return -1;
+    if (a->addressfamily > b->addressfamily)
+        return +1;
+    return 0;
+}
+
+static void dns_cache_entry_free(dns_cache_entry *e)
+{
+    sfree(e->host);
+    sk_addr_free(e->addr);
+    sfree(e->canonicalname);
+    sfree(e);
+}
+
+static bool dns_cache_entry_live(dns_cache_entry *e, unsigned long now,
+                                 int ttl)
+{
+    if (sk_addr_error(e->addr) && ttl > DNS_CACHE_NEGATIVE_SECS)
+        ttl = DNS_CACHE_NEGATIVE_SECS;
+    return now - e->when < (unsigned long)ttl * TICKSPERSEC;
+}
+
+/*
+ * Return another reference to the cached result of looking up a host
+ * name, if there's one from the last 'ttl' seconds. Otherwise return
+ * NULL.
+ */
+SockAddr *sk_namelookup_from_cache(const char *host, char **canonicalname,
+                                   int addressfamily, int ttl)
+{
+    dns_cache_entry *e, key;
+
+    if (ttl <= 0 || !dns_cache)
+        return NULL;
+    if (ttl > MAX_TICK_MINS * 60)
+        ttl = MAX_TICK_MINS * 60;
+
+    key.host = (char *)host;
+    key.addressfamily = addressfamily;
+    e = find234(dns_cache, &key, NULL);
+    if (!e || !dns_cache_entry_live(e, GETTICKCOUNT(), ttl))
+        return NULL;
+
+    if (e->canonicalname)
+        *canonicalname = dupstr(e->canonicalname);
+    return sk_addr_dup(e->addr);
+}
+
+/*
+ * Remember the result of a lookup, unless the caller's 'ttl' says
+ * it's not going to want it again. The cache takes its own copies of
+ * addr and canonicalname.
+ */
+void sk_namelookup_add_to_cache(const char *host, int addressfamily,
+                                int ttl, SockAddr *addr,
+                                const char *canonicalname)
+{
+    dns_cache_entry *e, key;
+    unsigned long now = GETTICKCOUNT();
+
+    if (ttl <= 0)
+        return;
+
+    if (!dns_cache)
+        dns_cache = newtree234(dns_cache_cmp);
+
+    key.host = (char *)host;
+    key.addressfamily = addressfamily;
+    if ((e = del234(dns_cache, &key)) != NULL)
+        dns_cache_entry_free(e);
+
+    /*
+     * Take the chance to throw out anything that's been there long
+     * enough to be stale for any caller. (sk_namelookup_from_cache
+     * won't trust anything for longer than MAX_TICK_MINS.)
+     */
+    {
+        int i = 0;
+        while ((e = index234(dns_cache, i)) != NULL) {
+            if (!dns_cache_entry_live(e, now, MAX_TICK_MINS * 60)) {
+                del234(dns_cache, e);
+                dns_cache_entry_free(e);
+            } else {
+                i++;
+            }
+        }
+    }
+
+    e = snew(dns_cache_entry);
+    e->host = dupstr(host);
+    e->addressfamily = addressfamily;
+    e->addr = sk_addr_dup(addr);
+    e->canonicalname = canonicalname ? dupstr(canonicalname) : NULL;
+    e->when = now;
+    add234(dns_cache, e);
+}
+
+/*
+ * Look up a host name as sk_namelookup does, but reuse the result of
+ * a previous lookup of the same name if it was made in the last 'ttl'
+ * seconds. A ttl of zero bypasses the cache completely.
+ */
+SockAddr *sk_namelookup_cached(const char *host, char **canonicalname,
+                               int addressfamily, int ttl)
+{
+    SockAddr *addr;
+    char *canon = NULL;
+
+    if (ttl <= 0)
+        return sk_namelookup(host, canonicalname, addressfamily);
+
+    addr = sk_namelookup_from_cache(host, canonicalname, addressfamily, ttl);
+    if (addr)
+        return addr;
+
+    addr = sk_namelookup(host, &canon, addressfamily);
+    sk_namelookup_add_to_cache(host, addressfamily, ttl, addr, canon);
+    if (canon)
+        *canonicalname = canon;
+    return addr;
+}
+
+/*
+ * Decide whether to leave looking up a host name to the proxy.
+ */
+static bool lookup_at_proxy(const char *host, int port, Conf *conf)
+{
+    return (conf_get_int(conf, CONF_proxy_type) != PROXY_NONE &&
+            do_proxy_dns(conf) &&
+            proxy_for_destination(NULL, host, port, conf));
+}
+
 SockAddr *name_lookup(const char *host, int port, char **canonicalname,
                      Conf *conf, int addressfamily, LogContext *logctx,
                      const char *reason)
 {
-    if (conf_get_int(conf, CONF_proxy_type) != PROXY_NONE &&
-        do_proxy_dns(conf) &&
-        proxy_for_destination(NULL, host, port, conf)) {
+    if (lookup_at_proxy(host, port, conf)) {
 
         if (logctx)
             logeventf(logctx, "Leaving host lookup to proxy of \"%s\""
@@ -367,7 +535,8 @@ SockAddr *name_lookup(const char *host, int port, char **canonicalname,
             logevent_and_free(
                 logctx, dns_log_msg(host, addressfamily, reason));
 
-        return sk_namelookup(host, canonicalname, addressfamily);
+        return sk_namelookup_cached(host, canonicalname, addressfamily,
+                                    conf_get_int(conf, CONF_dns_cache_ttl));
     }
 }
 
@@ -390,6 +559,100 @@ static const PlugVtable ProxySocket_plugvt = {
     .accepting = plug_proxy_accepting
 };
 
+static ProxySocket *proxy_socket_new(Plug *plug, Conf *conf)
+{
+    ProxySocket *ret = snew(ProxySocket);
+    ret->sock.vt = &ProxySocket_sockvt;
+    ret->plugimpl.vt = &ProxySocket_plugvt;
+    ret->conf = conf_copy(conf);
+    ret->plug = plug;
+    ret->remote_addr = NULL;
+    ret->remote_port = 0;
+
+    ret->error = NULL;
+    ret->pending_eof = false;
+    ret->freeze = false;
+
+    bufchain_init(&ret->pending_input_data);
+    bufchain_init(&ret->pending_output_data);
+    bufchain_init(&ret->pending_oob_output_data);
+
+    ret->sub_socket = NULL;
+    ret->state = PROXY_STATE_NEW;
+    ret->negotiate = NULL;
+
+    ret->lookup = NULL;
+    ret->lookup_host = NULL;
+    ret->lookup_addressfamily = ADDRTYPE_UNSPEC;
+    ret->privport = ret->oobinline = ret->nodelay = ret->keepalive = false;
+    ret->proxy_type = NULL;
+
+    ret->socks5_method = -1;
+    ret->socks5_pipelined = false;
+
+    return ret;
+}
+
+/*
+ * Carry on setting up a proxied connection, once we know the proxy's
+ * address. Returns an error message if we couldn't get as far as
+ * starting the negotiation.
+ */
+static const char *proxy_connect(ProxySocket *ps, SockAddr *proxy_addr)
+{
+    Conf *conf = ps->conf;
+    const char *err;
+
+    if (sk_addr_error(proxy_addr) != NULL) {
+        sk_addr_free(proxy_addr);
+        return "Proxy error: Unable to resolve proxy host name";
+    }
+
+    {
+        char addrbuf[256], *logmsg;
+        sk_getaddr(proxy_addr, addrbuf, lenof(addrbuf));
+        logmsg = dupprintf("Connecting to %s proxy at %s port %d",
+                           ps->proxy_type, addrbuf,
+                           conf_get_int(conf, CONF_proxy_port));
+        plug_log(ps->plug, PLUGLOG_PROXY_MSG, NULL, 0, logmsg, 0);
+        sfree(logmsg);
+    }
+
+    /* create the actual socket we will be using,
+     * connected to our proxy server and port.
+     */
+    ps->sub_socket = sk_new(proxy_addr,
+                            conf_get_int(conf, CONF_proxy_port),
+                            ps->privport, ps->oobinline,
+                            ps->nodelay, ps->keepalive,
+                            conf_get_int(conf, CONF_connect_delay),
+                            &ps->plugimpl);
+    if ((err = sk_socket_error(ps->sub_socket)) != NULL)
+        return err;
+
+    /* start the proxy negotiation process... */
+    sk_set_frozen(ps->sub_socket, false);
+    ps->negotiate(ps, PROXY_CHANGE_NEW);
+    return NULL;
+}
+
+static void proxy_lookup_done(void *ctx, SockAddr *addr, char *canonicalname)
+{
+    ProxySocket *ps = (ProxySocket *)ctx;
+    const char *err;
+
+    ps->lookup = NULL;
+    sk_namelookup_add_to_cache(ps->lookup_host, ps->lookup_addressfamily,
+                               conf_get_int(ps->conf, CONF_dns_cache_ttl),
+                               addr, canonicalname);
+    sfree(canonicalname);
+
+    if ((err = proxy_connect(ps, addr)) != NULL) {
+        ps->error = err;
+        plug_closing(ps->plug, err, PROXY_ERROR_GENERAL, false);
+    }
+}
+
 Socket *new_connection(SockAddr *addr, const char *hostname,
                        int port, bool privport,
                        bool oobinline, bool nodelay, bool keepalive,
@@ -400,10 +663,15 @@ Socket *new_connection(SockAddr *addr, const char *hostname,
     {
         ProxySocket *ret;
         SockAddr *proxy_addr;
-        char *proxy_canonical_name;
-        const char *proxy_type;
+        char *proxy_canonical_name = NULL;
+        const char *proxy_host;
         Socket *sret;
-        int type;
+        int type, addressfamily;
+
+        if (conf_get_int(conf, CONF_proxy_type) == PROXY_SSH)
+            return sshproxy_new_connection(addr, hostname, port, privport,
+                                           oobinline, nodelay, keepalive,
+                                           plug, conf);
 
         if ((sret = platform_new_connection(addr, hostname, port, privport,
                                             oobinline, nodelay, keepalive,
@@ -411,39 +679,27 @@ Socket *new_connection(SockAddr *addr, const char *hostname,
             NULL)
             return sret;
 
-        ret = snew(ProxySocket);
-        ret->sock.vt = &ProxySocket_sockvt;
-        ret->plugimpl.vt = &ProxySocket_plugvt;
-        ret->conf = conf_copy(conf);
-        ret->plug = plug;
+        ret = proxy_socket_new(plug, conf);
         ret->remote_addr = addr;       /* will need to be freed on close */
         ret->remote_port = port;
-
-        ret->error = NULL;
-        ret->pending_eof = false;
-        ret->freeze = false;
-
-        bufchain_init(&ret->pending_input_data);
-        bufchain_init(&ret->pending_output_data);
-        bufchain_init(&ret->pending_oob_output_data);
-
-        ret->sub_socket = NULL;
-        ret->state = PROXY_STATE_NEW;
-        ret->negotiate = NULL;
+        ret->privport = privport;
+        ret->oobinline = oobinline;
+        ret->nodelay = nodelay;
+        ret->keepalive = keepalive;
 
         type = conf_get_int(conf, CONF_proxy_type);
         if (type == PROXY_HTTP) {
             ret->negotiate = proxy_http_negotiate;
-            proxy_type = "HTTP";
+            ret->proxy_type = "HTTP";
         } else if (type == PROXY_SOCKS4) {
             ret->negotiate = proxy_socks4_negotiate;
-            proxy_type = "SOCKS 4";
+            ret->proxy_type = "SOCKS 4";
         } else if (type == PROXY_SOCKS5) {
             ret->negotiate = proxy_socks5_negotiate;
-            proxy_type = "SOCKS 5";
+            ret->proxy_type = "SOCKS 5";
         } else if (type == PROXY_TELNET) {
             ret->negotiate = proxy_telnet_negotiate;
-            proxy_type = "Telnet";
+            ret->proxy_type = "Telnet";
         } else {
             ret->error = "Proxy error: Unknown proxy method";
             return &ret->sock;
@@ -451,7 +707,7 @@ Socket *new_connection(SockAddr *addr, const char *hostname,
 
         {
             char *logmsg = dupprintf("Will use %s proxy at %s:%d to connect"
-                                      " to %s:%d", proxy_type,
+                                      " to %s:%d", ret->proxy_type,
                                       conf_get_str(conf, CONF_proxy_host),
                                       conf_get_int(conf, CONF_proxy_port),
                                       hostname, port);
@@ -459,54 +715,39 @@ Socket *new_connection(SockAddr *addr, const char *hostname,
             sfree(logmsg);
         }
 
-        {
-            char *logmsg = dns_log_msg(conf_get_str(conf, CONF_proxy_host),
-                                       conf_get_int(conf, CONF_addressfamily),
-                                       "proxy");
-            plug_log(plug, PLUGLOG_PROXY_MSG, NULL, 0, logmsg, 0);
-            sfree(logmsg);
-        }
-
-        /* look-up proxy */
-        proxy_addr = sk_namelookup(conf_get_str(conf, CONF_proxy_host),
-                                   &proxy_canonical_name,
-                                   conf_get_int(conf, CONF_addressfamily));
-        if (sk_addr_error(proxy_addr) != NULL) {
-            ret->error = "Proxy error: Unable to resolve proxy host name";
-            sk_addr_free(proxy_addr);
-            return &ret->sock;
-        }
-        sfree(proxy_canonical_name);
+        proxy_host = conf_get_str(conf, CONF_proxy_host);
+        addressfamily = conf_get_int(conf, CONF_addressfamily);
 
         {
-            char addrbuf[256], *logmsg;
-            sk_getaddr(proxy_addr, addrbuf, lenof(addrbuf));
-            logmsg = dupprintf("Connecting to %s proxy at %s port %d",
-                               proxy_type, addrbuf,
-                               conf_get_int(conf, CONF_proxy_port));
+            char *logmsg = dns_log_msg(proxy_host, addressfamily, "proxy");
             plug_log(plug, PLUGLOG_PROXY_MSG, NULL, 0, logmsg, 0);
             sfree(logmsg);
         }
 
-        /* create the actual socket we will be using,
-         * connected to our proxy server and port.
+        /*
+         * Look up the proxy. Unless we remember its address already,
+         * do that in the background, and carry on in
+         * proxy_lookup_done.
          */
-        ret->sub_socket = sk_new(proxy_addr,
-                                 conf_get_int(conf, CONF_proxy_port),
-                                 privport, oobinline,
-                                 nodelay, keepalive, &ret->plugimpl);
-        if (sk_socket_error(ret->sub_socket) != NULL)
+        proxy_addr = sk_namelookup_from_cache(
+            proxy_host, &proxy_canonical_name, addressfamily,
+            conf_get_int(conf, CONF_dns_cache_ttl));
+        if (!proxy_addr) {
+            ret->lookup_host = dupstr(proxy_host);
+            ret->lookup_addressfamily = addressfamily;
+            ret->lookup = sk_namelookup_start(proxy_host, addressfamily,
+                                              proxy_lookup_done, ret);
             return &ret->sock;
+        }
+        sfree(proxy_canonical_name);
 
-        /* start the proxy negotiation process... */
-        sk_set_frozen(ret->sub_socket, false);
-        ret->negotiate(ret, PROXY_CHANGE_NEW);
-
+        ret->error = proxy_connect(ret, proxy_addr);
         return &ret->sock;
     }
 
     /* no proxy, so just return the direct socket */
-    return sk_new(addr, port, privport, oobinline, nodelay, keepalive, plug);
+    return sk_new(addr, port, privport, oobinline, nodelay, keepalive,
+                  conf_get_int(conf, CONF_connect_delay), plug);
 }
 
 Socket *new_listener(const char *srcaddr, int port, Plug *plug,
@@ -893,6 +1134,149 @@ int proxy_socks4_negotiate (ProxySocket *p, int change)
 }
 
 /* SOCKS version 5 */
+
+/*
+ * The authentication method each SOCKS 5 proxy (identified by its
+ * host, port and the username we give it) chose the last time it let
+ * us through, if that was one we can complete without waiting to
+ * hear from the proxy. Knowing that, we can send the method offer,
+ * the authentication and the CONNECT request all in one go, instead
+ * of waiting a round trip after each.
+ */
+typedef struct socks5_auth_cache_entry {
+    char *host;
+    int port;
+    char *username;
+    int method;
+} socks5_auth_cache_entry;
+
+static tree234 *socks5_auth_cache;
+
+static int socks5_auth_cache_cmp(void *av, void *bv)
+{
+    socks5_auth_cache_entry *a = (socks5_auth_cache_entry *)av;
+    socks5_auth_cache_entry *b = (socks5_auth_cache_entry *)bv;
+    int c = strcmp(a->host, b->host);
+    if (c)
+        return c;
+    if (a->port < b->port)
+        return -1;
+    if (a->port > b->port)
+        return +1;
+    return strcmp(a->username, b->username);
+}
+
+static void socks5_auth_cache_key(socks5_auth_cache_entry *key, Conf *conf)
+{
+    key->host = conf_get_str(conf, CONF_proxy_host);
+    key->port = conf_get_int(conf, CONF_proxy_port);
+    key->username = conf_get_str(conf, CONF_proxy_username);
+}
+
+/* Returns the remembered method, or -1 if there isn't one */
+static int socks5_auth_cache_find(Conf *conf)
+{
+    socks5_auth_cache_entry *e, key;
+
+    if (!socks5_auth_cache)
+        return -1;
+    socks5_auth_cache_key(&key, conf);
+    e = find234(socks5_auth_cache, &key, NULL);
+    return e ? e->method : -1;
+}
+
+/* Remember a method, or forget the proxy's entry if method is -1 */
+static void socks5_auth_cache_set(Conf *conf, int method)
+{
+    socks5_auth_cache_entry *e, key;
+
+    if (!socks5_auth_cache)
+        socks5_auth_cache = newtree234(socks5_auth_cache_cmp);
+
+    socks5_auth_cache_key(&key, conf);
+    if ((e = del234(socks5_auth_cache, &key)) != NULL) {
+        sfree(e->host);
+        sfree(e->username);
+        sfree(e);
+    }
+
+    if (method >= 0) {
+        e = snew(socks5_auth_cache_entry);
+        e->host = dupstr(key.host);
+        e->port = key.port;
+        e->username = dupstr(key.username);
+        e->method = method;
+        add234(socks5_auth_cache, e);
+    }
+}
+
+/*
+ * Write a username/password subnegotiation (RFC 1929) for a SOCKS 5
+ * proxy. Returns an error message, or NULL on success.
+ */
+static const char *proxy_socks5_put_password(ProxySocket *p, strbuf *auth)
+{
+    const char *username = conf_get_str(p->conf, CONF_proxy_username);
+    const char *password = conf_get_str(p->conf, CONF_proxy_password);
+
+    put_byte(auth, 1);                 /* version number of subnegotiation */
+    if (!put_pstring(auth, username))
+        return "Proxy error: SOCKS 5 authentication cannot "
+            "support usernames longer than 255 chars";
+    if (!put_pstring(auth, password))
+        return "Proxy error: SOCKS 5 authentication cannot "
+            "support passwords longer than 255 chars";
+    return NULL;
+}
+
+/*
+ * Write a SOCKS 5 CONNECT request for our destination. Returns an
+ * error message, or NULL on success.
+ */
+static const char *proxy_socks5_put_connect(ProxySocket *p, strbuf *command)
+{
+    /* request format:
+     *  version number (1 byte) = 5
+     *  command code (1 byte)
+     *    1 = CONNECT
+     *    2 = BIND
+     *    3 = UDP ASSOCIATE
+     *  reserved (1 byte) = 0x00
+     *  address type (1 byte)
+     *    1 = IPv4
+     *    3 = domainname (first byte has length, no terminating null)
+     *    4 = IPv6
+     *  dest. address (variable)
+     *  dest. port (2 bytes) [network order]
+     */
+    put_byte(command, 5);              /* SOCKS version 5 */
+    put_byte(command, 1);              /* CONNECT command */
+    put_byte(command, 0x00);           /* reserved byte */
+
+    switch (sk_addrtype(p->remote_addr)) {
+      case ADDRTYPE_IPV4:
+        put_byte(command, 1);          /* IPv4 */
+        sk_addrcopy(p->remote_addr, strbuf_append(command, 4));
+        break;
+      case ADDRTYPE_IPV6:
+        put_byte(command, 4);          /* IPv6 */
+        sk_addrcopy(p->remote_addr, strbuf_append(command, 16));
+        break;
+      case ADDRTYPE_NAME: {
+        char hostname[512];
+        put_byte(command, 3);          /* domain name */
+        sk_getaddr(p->remote_addr, hostname, lenof(hostname));
+        if (!put_pstring(command, hostname))
+            return "Proxy error: SOCKS 5 cannot "
+                "support host names longer than 255 chars";
+        break;
+      }
+    }
+
+    put_uint16(command, p->remote_port);
+    return NULL;
+}
+
 int proxy_socks5_negotiate (ProxySocket *p, int change)
 {
     if (p->state == PROXY_CHANGE_NEW) {
@@ -910,13 +1294,48 @@ int proxy_socks5_negotiate (ProxySocket *p, int change)
 
         strbuf *command;
         char *username, *password;
-        int method_count_offset, methods_start;
+        int method_count_offset, methods_start, method;
 
-        command = strbuf_new();
+        command = strbuf_new_nm();     /* might contain a password */
         put_byte(command, 5);          /* SOCKS version 5 */
         username = conf_get_str(p->conf, CONF_proxy_username);
         password = conf_get_str(p->conf, CONF_proxy_password);
 
+        method = socks5_auth_cache_find(p->conf);
+        if (method == 0x02 && !(username[0] || password[0]))
+            method = -1;               /* we've nothing to send it now */
+        if (method >= 0) {
+            /*
+             * We know what this proxy will choose, so offer only
+             * that, and follow it straight away with everything
+             * we'd otherwise have waited to send.
+             */
+            const char *err = NULL;
+
+            put_byte(command, 1);
+            put_byte(command, method);
+            if (method == 0x02)
+                err = proxy_socks5_put_password(p, command);
+            if (!err)
+                err = proxy_socks5_put_connect(p, command);
+            if (err) {
+                p->error = err;
+                strbuf_free(command);
+                return 1;
+            }
+
+            plug_log(p->plug, PLUGLOG_PROXY_MSG, NULL, 0,
+                     "Sending SOCKS 5 negotiation in one go, using the "
+                     "authentication this proxy chose before", 0);
+            sk_write(p->sub_socket, command->s, command->len);
+            strbuf_free(command);
+
+            p->socks5_method = method;
+            p->socks5_pipelined = true;
+            p->state = 1;
+            return 0;
+        }
+
         method_count_offset = command->len;
         put_byte(command, 0);
         methods_start = command->len;
@@ -944,6 +1363,8 @@ int proxy_socks5_negotiate (ProxySocket *p, int change)
          * a socket close, then some error must have occurred. we'll
          * just pass those errors up to the backend.
          */
+        if (p->socks5_pipelined)
+            socks5_auth_cache_set(p->conf, -1); /* don't try that again */
         plug_closing(p->plug, p->closing_error_msg, p->closing_error_code,
                      p->closing_calling_back);
         return 0; /* ignored */
@@ -973,6 +1394,30 @@ int proxy_socks5_negotiate (ProxySocket *p, int change)
          * we'll need to parse, process, and respond to appropriately.
          */
 
+        if (p->state == 1 && p->socks5_pipelined) {
+            /*
+             * We've already sent everything up to the CONNECT
+             * request, so all we can do with the method choice is
+             * check it's the one we were relying on.
+             */
+            char data[2];
+
+            if (bufchain_size(&p->pending_input_data) < 2)
+                return 1;              /* not got anything yet */
+
+            bufchain_fetch(&p->pending_input_data, data, 2);
+            if (data[0] != 5 || (unsigned char)data[1] != p->socks5_method) {
+                socks5_auth_cache_set(p->conf, -1);
+                plug_closing(p->plug, "Proxy error: SOCKS proxy no longer "
+                             "accepts the authentication it chose before",
+                             PROXY_ERROR_GENERAL, 0);
+                return 1;
+            }
+
+            p->state = (p->socks5_method == 0x02 ? 7 : 3);
+            bufchain_consume(&p->pending_input_data, 2);
+        }
+
         if (p->state == 1) {
 
             /* initial response:
@@ -999,6 +1444,7 @@ int proxy_socks5_negotiate (ProxySocket *p, int change)
                 return 1;
             }
 
+            p->socks5_method = (unsigned char)data[1];
             if (data[1] == 0x00) p->state = 2; /* no authentication needed */
             else if (data[1] == 0x01) p->state = 4; /* GSSAPI authentication */
             else if (data[1] == 0x02) p->state = 5; /* username/password authentication */
@@ -1035,7 +1481,7 @@ int proxy_socks5_negotiate (ProxySocket *p, int change)
             }
 
             if (data[1] != 0) {
-
+                socks5_auth_cache_set(p->conf, -1);
                 plug_closing(p->plug, "Proxy error: SOCKS proxy refused"
                              " password authentication",
                              PROXY_ERROR_GENERAL, 0);
@@ -1043,7 +1489,8 @@ int proxy_socks5_negotiate (ProxySocket *p, int change)
             }
 
             bufchain_consume(&p->pending_input_data, 2);
-            p->state = 2;              /* now proceed as authenticated */
+            /* now proceed as authenticated, unless we already have */
+            p->state = (p->socks5_pipelined ? 3 : 2);
         }
 
         if (p->state == 8) {
@@ -1053,52 +1500,14 @@ int proxy_socks5_negotiate (ProxySocket *p, int change)
         }
 
         if (p->state == 2) {
-
-            /* request format:
-             *  version number (1 byte) = 5
-             *  command code (1 byte)
-             *    1 = CONNECT
-             *    2 = BIND
-             *    3 = UDP ASSOCIATE
-             *  reserved (1 byte) = 0x00
-             *  address type (1 byte)
-             *    1 = IPv4
-             *    3 = domainname (first byte has length, no terminating null)
-             *    4 = IPv6
-             *  dest. address (variable)
-             *  dest. port (2 bytes) [network order]
-             */
-
             strbuf *command = strbuf_new();
-            put_byte(command, 5);      /* SOCKS version 5 */
-            put_byte(command, 1);      /* CONNECT command */
-            put_byte(command, 0x00);   /* reserved byte */
-
-            switch (sk_addrtype(p->remote_addr)) {
-              case ADDRTYPE_IPV4:
-                put_byte(command, 1);  /* IPv4 */
-                sk_addrcopy(p->remote_addr, strbuf_append(command, 4));
-                break;
-              case ADDRTYPE_IPV6:
-                put_byte(command, 4);  /* IPv6 */
-                sk_addrcopy(p->remote_addr, strbuf_append(command, 16));
-                break;
-              case ADDRTYPE_NAME: {
-                char hostname[512];
-                put_byte(command, 3);  /* domain name */
-                sk_getaddr(p->remote_addr, hostname, lenof(hostname));
-                if (!put_pstring(command, hostname)) {
-                  p->error = "Proxy error: SOCKS 5 cannot "
-                      "support host names longer than 255 chars";
-                  strbuf_free(command);
-                  return 1;
-                }
-                break;
-              }
+            const char *err = proxy_socks5_put_connect(p, command);
+            if (err) {
+                p->error = err;
+                strbuf_free(command);
+                return 1;
             }
 
-            put_uint16(command, p->remote_port);
-
             sk_write(p->sub_socket, command->s, command->len);
 
             strbuf_free(command);
@@ -1187,6 +1596,10 @@ int proxy_socks5_negotiate (ProxySocket *p, int change)
                 return 1;              /* not got whole reply yet */
             bufchain_consume(&p->pending_input_data, len);
 
+            /* remember what got us through, if we can use it again */
+            if (p->socks5_method == 0x00 || p->socks5_method == 0x02)
+                socks5_auth_cache_set(p->conf, p->socks5_method);
+
             /* we're done */
             proxy_activate(p);
             return 1;
@@ -1204,16 +1617,9 @@ int proxy_socks5_negotiate (ProxySocket *p, int change)
             const char *password = conf_get_str(p->conf, CONF_proxy_password);
             if (username[0] || password[0]) {
                 strbuf *auth = strbuf_new_nm();
-                put_byte(auth, 1); /* version number of subnegotiation */
-                if (!put_pstring(auth, username)) {
-                    p->error = "Proxy error: SOCKS 5 authentication cannot "
-                        "support usernames longer than 255 chars";
-                    strbuf_free(auth);
-                    return 1;
-                }
-                if (!put_pstring(auth, password)) {
-                    p->error = "Proxy error: SOCKS 5 authentication cannot "
-                        "support passwords longer than 255 chars";
+                const char *err = proxy_socks5_put_password(p, auth);
+                if (err) {
+                    p->error = err;
                     strbuf_free(auth);
                     return 1;
                 }
@@ -77,6 +77,23 @@ struct ProxySocket {
     /* configuration, used to look up proxy settings */
     Conf *conf;
 
+    /*
+     * While we're waiting for the lookup of the proxy's own host name
+     * to finish, this is it, and the rest is what we need to carry on
+     * after.
+     */
+    NameLookup *lookup;
+    char *lookup_host;
+    int lookup_addressfamily;
+    bool privport, oobinline, nodelay, keepalive;
+    const char *proxy_type;
+
+    /* SOCKS 5: the authentication method the proxy chose, and
+     * whether we sent the whole negotiation without waiting to hear
+     * it because we knew in advance (see socks5_auth_cache) */
+    int socks5_method;
+    bool socks5_pipelined;
+
     /* CHAP transient data */
     int chap_num_attributes;
     int chap_num_attributes_processed;
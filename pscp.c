@@ -31,8 +31,10 @@ static bool recursive = false;
 static bool preserve = false;
 static bool targetshouldbedirectory = false;
 static bool statistics = true;
+static bool transfer_stats = false;
 static int prev_stats_len = 0;
 static bool scp_unsafe_mode = false;
+static bool scp_pipeline = false;
 static int errs = 0;
 static bool try_scp = true;
 static bool try_sftp = true;
@@ -64,6 +66,7 @@ static bool pscp_eof(Seat *);
 
 static const SeatVtable pscp_seat_vt = {
     .output = pscp_output,
+    .sent = nullseat_sent,
     .eof = pscp_eof,
     .get_userpass_input = filexfer_get_userpass_input,
     .notify_remote_exit = nullseat_notify_remote_exit,
@@ -459,6 +462,9 @@ static void do_cmd(char *host, char *user, char *cmd)
     }
     conf_set_bool(conf, CONF_nopty, true);
 
+    xfer_set_window_limit(
+        parse_blocksize(conf_get_str(conf, CONF_sftp_max_window)));
+
     logctx = log_init(console_cli_logpolicy, conf);
 
     platform_psftp_pre_conn_setup(console_cli_logpolicy);
@@ -589,6 +595,66 @@ static int response(void)
     }
 }
 
+/*
+ * Pipelined uploads over the SCP protocol (the -pipeline option).
+ *
+ * The server acknowledges every line we send it, and every file body,
+ * with a zero byte or an error message, and the acknowledgements come
+ * back in the same order. Normally we wait for each one before going
+ * on, which costs several round trips per file. In pipelined mode we
+ * carry on without waiting for the acknowledgements of T, D and E
+ * lines and of file bodies, just counting how many are outstanding,
+ * and read them later: whenever some have arrived anyway, when too
+ * many are outstanding, and before anything we do have to wait for.
+ * Because they arrive in order, each error the server reports is
+ * still printed (and counted) against the right file.
+ *
+ * We still wait for the reply to each C (file header) line before
+ * sending the file's data. If the server can't create the file it
+ * refuses the header, and will then read whatever we send next as
+ * protocol lines, so sending the data regardless would not be safe.
+ * That leaves one round trip per file instead of up to three.
+ */
+#define SCP_PIPELINE_MAX 1024
+static size_t scp_acks_pending;
+
+/* Read all the outstanding acknowledgements, or only those which
+ * have already arrived if 'all' is false */
+static void scp_collect_acks(bool all)
+{
+    while (scp_acks_pending > 0 &&
+           (all || bufchain_size(&received_data) > 0)) {
+        scp_acks_pending--;
+        (void) response();
+    }
+}
+
+/*
+ * Used in place of response() for acknowledgements we don't need to
+ * wait for. In pipelined mode the caller always sees success; any
+ * error is reported when the acknowledgement is eventually read.
+ */
+static int deferred_response(void)
+{
+    if (!scp_pipeline)
+        return response();
+
+    scp_acks_pending++;
+    while (scp_acks_pending > SCP_PIPELINE_MAX) {
+        scp_acks_pending--;
+        (void) response();
+    }
+    scp_collect_acks(false);
+    return 0;
+}
+
+/* Wait for a reply, after any acknowledgements still outstanding */
+static int pipelined_response(void)
+{
+    scp_collect_acks(true);
+    return response();
+}
+
 bool sftp_recvdata(char *buf, size_t len)
 {
     return ssh_scp_recv(buf, len);
@@ -642,30 +708,41 @@ void scp_sftp_listdir(const char *dirname)
                 errs++;
     } else {
         struct list_directory_from_sftp_ctx *ctx =
-            list_directory_from_sftp_new();
+            list_directory_from_sftp_new(true);
+        struct fxp_readdirs *rd =
+            readdirs_init(dirh, LIST_DIRECTORY_READDIRS);
+        struct sftp_request *rreq;
 
         while (1) {
+            readdirs_queue(rd);
 
-            req = fxp_readdir_send(dirh);
-            pktin = sftp_wait_for_reply(req);
-            names = fxp_readdir_recv(pktin, req);
-
-            if (names == NULL) {
-                if (fxp_error_type() == SSH_FX_EOF)
-                    break;
-                printf("Reading directory %s: %s\n", dirname, fxp_error());
-                break;
-            }
-            if (names->nnames == 0) {
+            while ((names = readdirs_next(rd)) != NULL) {
+                for (size_t i = 0; i < names->nnames; i++)
+                    list_directory_from_sftp_feed(ctx, &names->names[i]);
                 fxp_free_names(names);
-                break;
             }
 
-            for (size_t i = 0; i < names->nnames; i++)
-                list_directory_from_sftp_feed(ctx, &names->names[i]);
+            if (readdirs_done(rd))
+                break;
 
-            fxp_free_names(names);
+            pktin = sftp_recv();
+            if (pktin == NULL) {
+                seat_connection_fatal(
+                    pscp_seat,
+                    "did not receive SFTP response packet from server");
+            }
+            rreq = sftp_find_request(pktin);
+            if (!rreq || !readdirs_gotreply(rd, rreq, pktin)) {
+                seat_connection_fatal(
+                    pscp_seat,
+                    "unable to understand SFTP response packet from "
+                    "server: %s", fxp_error());
+            }
         }
+        if (fxp_error_type() != SSH_FX_EOF)
+            printf("Reading directory %s: %s\n", dirname, fxp_error());
+        readdirs_cleanup(rd);
+
         req = fxp_close_send(dirh);
         pktin = sftp_wait_for_reply(req);
         fxp_close_recv(pktin, req);
@@ -686,6 +763,7 @@ static struct scp_sftp_dirstack {
     int namepos, namelen;
     char *dirpath;
     char *wildcard;
+    WildcardPattern *wcp;              /* compiled form of wildcard */
     bool matched_something;     /* wildcard match set was non-empty */
 } *scp_sftp_dirstack_head;
 static char *scp_sftp_remotepath, *scp_sftp_currentname;
@@ -696,8 +774,41 @@ static unsigned long scp_sftp_mtime, scp_sftp_atime;
 static bool scp_has_times;
 static struct fxp_handle *scp_sftp_filehandle;
 static struct fxp_xfer *scp_sftp_xfer;
+static char *scp_sftp_rbuf;         /* leftover data from a large read */
+static int scp_sftp_rbuflen, scp_sftp_rbufpos;
 static uint64_t scp_sftp_fileoffset;
 
+/* For -stats: what we've found out about the current file transfer */
+static struct fxp_xfer_stats scp_xstats;
+static bool scp_have_xstats;
+static unsigned long scp_window0, scp_socket0, scp_disk;
+
+static void scp_stats_start(void)
+{
+    scp_have_xstats = false;
+    scp_disk = 0;
+    ssh_send_stall_times(backend, &scp_window0, &scp_socket0);
+}
+
+static void scp_stats_xfer_done(void)
+{
+    xfer_get_stats(scp_sftp_xfer, &scp_xstats);
+    scp_have_xstats = true;
+}
+
+static void scp_stats_print(const char *name)
+{
+    unsigned long window, socket;
+
+    if (!transfer_stats)
+        return;
+    ssh_send_stall_times(backend, &window, &socket);
+    printf("stats for %s:\n", name);
+    print_transfer_stats(scp_have_xstats ? &scp_xstats : NULL,
+                         window - scp_window0, socket - scp_socket0,
+                         scp_disk);
+}
+
 int scp_source_setup(const char *target, bool shouldbedir)
 {
     if (using_sftp) {
@@ -760,7 +871,7 @@ int scp_send_filetimes(unsigned long mtime, unsigned long atime)
         char buf[80];
         sprintf(buf, "T%lu 0 %lu 0\n", mtime, atime);
         backend_send(backend, buf, strlen(buf));
-        return response();
+        return deferred_response();
     }
 }
 
@@ -808,11 +919,23 @@ int scp_send_filename(const char *name, uint64_t size, int permissions)
         sfree(buf);
         backend_send(backend, name, strlen(name));
         backend_send(backend, "\n", 1);
-        return response();
+        return pipelined_response();
     }
 }
 
-int scp_send_filedata(char *data, int len)
+/*
+ * The amount of file data we'd like to be handed at a time by
+ * scp_send_filedata's caller.
+ */
+#define PSCP_SEND_BLOCK 4096
+static int scp_send_blocksize(void)
+{
+    if (using_sftp && scp_sftp_filehandle)
+        return xfer_upload_chunksize(scp_sftp_xfer);
+    return PSCP_SEND_BLOCK;
+}
+
+int scp_send_filedata(const char *data, int len)
 {
     if (using_sftp) {
         int ret;
@@ -866,6 +989,37 @@ int scp_send_filedata(char *data, int len)
     }
 }
 
+/*
+ * If the local file has a hole at pos, then over SFTP we can skip it
+ * and leave the same hole in the remote file. (SCP has to send every
+ * byte.) Returns the position to carry on reading from, and sets
+ * *dataend to where the data there runs out.
+ */
+uint64_t scp_send_skiphole(RFile *f, uint64_t pos, uint64_t size,
+                           uint64_t *dataend)
+{
+    uint64_t start, end;
+
+    if (!using_sftp || !find_file_data(f, pos, &start, &end)) {
+        *dataend = UINT64_MAX;
+        return pos;
+    }
+
+    if (start >= size) {
+        /* send the last byte anyway, so the file comes out full size */
+        start = size - 1;
+        end = size;
+    }
+
+    if (start > pos) {
+        xfer_upload_skip(scp_sftp_xfer, start - pos);
+        scp_sftp_fileoffset += start - pos;
+    }
+
+    *dataend = end;
+    return start;
+}
+
 int scp_send_finish(void)
 {
     if (using_sftp) {
@@ -884,6 +1038,7 @@ int scp_send_finish(void)
                 return 1;
             }
         }
+        scp_stats_xfer_done();
         xfer_cleanup(scp_sftp_xfer);
 
         if (!scp_sftp_filehandle) {
@@ -908,7 +1063,7 @@ int scp_send_finish(void)
         return 0;
     } else {
         backend_send(backend, "", 1);
-        return response();
+        return deferred_response();
     }
 }
 
@@ -980,7 +1135,7 @@ int scp_send_dirname(const char *name, int modes)
         backend_send(backend, buf, strlen(buf));
         backend_send(backend, name, strlen(name));
         backend_send(backend, "\n", 1);
-        return response();
+        return deferred_response();
     }
 }
 
@@ -991,7 +1146,7 @@ int scp_send_enddir(void)
         return 0;
     } else {
         backend_send(backend, "E\n", 2);
-        return response();
+        return deferred_response();
     }
 }
 
@@ -1141,9 +1296,9 @@ int scp_get_sink_action(struct scp_sink_action *act)
             struct scp_sftp_dirstack *head = scp_sftp_dirstack_head;
             while (head->namepos < head->namelen &&
                    (is_dots(head->names[head->namepos].filename) ||
-                    (head->wildcard &&
-                     !wc_match(head->wildcard,
-                               head->names[head->namepos].filename))))
+                    (head->wcp &&
+                     !wc_match_compiled(head->wcp, ptrlen_from_asciz(
+                         head->names[head->namepos].filename)))))
                 head->namepos++;       /* skip . and .. */
             if (head->namepos < head->namelen) {
                 head->matched_something = true;
@@ -1164,6 +1319,7 @@ int scp_get_sink_action(struct scp_sink_action *act)
                         errs++;
                     }
                     sfree(head->wildcard);
+                    wc_compiled_free(head->wcp);
 
                 } else {
                     act->action = SCP_SINK_ENDDIR;
@@ -1315,10 +1471,12 @@ int scp_get_sink_action(struct scp_sink_action *act)
                 newitem->dirpath = dupstr(fname);
             if (scp_sftp_wildcard) {
                 newitem->wildcard = scp_sftp_wildcard;
+                newitem->wcp = wc_compile(scp_sftp_wildcard);
                 newitem->matched_something = false;
                 scp_sftp_wildcard = NULL;
             } else {
                 newitem->wildcard = NULL;
+                newitem->wcp = NULL;
             }
             scp_sftp_dirstack_head = newitem;
 
@@ -1479,35 +1637,65 @@ int scp_recv_filedata(char *data, int len)
         int ret, actuallen;
         void *vbuf;
 
-        xfer_download_queue(scp_sftp_xfer);
-        pktin = sftp_recv();
-        ret = xfer_download_gotpkt(scp_sftp_xfer, pktin);
-        if (ret <= 0) {
-            tell_user(stderr, "pscp: error while reading: %s", fxp_error());
-            if (ret == INT_MIN)        /* pktin not even freed */
-                sfree(pktin);
-            errs++;
-            return -1;
+        if (scp_sftp_rbuf) {
+            actuallen = scp_sftp_rbuflen - scp_sftp_rbufpos;
+            if (actuallen > len)
+                actuallen = len;
+            memcpy(data, scp_sftp_rbuf + scp_sftp_rbufpos, actuallen);
+            scp_sftp_rbufpos += actuallen;
+            if (scp_sftp_rbufpos == scp_sftp_rbuflen) {
+                xfer_download_release(scp_sftp_xfer, scp_sftp_rbuf);
+                scp_sftp_rbuf = NULL;
+            }
+            scp_sftp_fileoffset += actuallen;
+            return actuallen;
         }
 
-        if (xfer_download_data(scp_sftp_xfer, &vbuf, &actuallen)) {
-            if (actuallen <= 0) {
+        /*
+         * Replies needn't complete in file order, so keep receiving
+         * until the next block in sequence is available.
+         */
+        while (!xfer_download_data(scp_sftp_xfer, &vbuf, &actuallen)) {
+            if (xfer_done(scp_sftp_xfer)) {
                 tell_user(stderr, "pscp: end of file while reading");
                 errs++;
-                sfree(vbuf);
                 return -1;
             }
-            /*
-             * This assertion relies on the fact that the natural
-             * block size used in the xfer manager is at most that
-             * used in this module. I don't like crossing layers in
-             * this way, but it'll do for now.
-             */
-            assert(actuallen <= len);
+            xfer_download_queue(scp_sftp_xfer);
+            pktin = sftp_recv();
+            ret = xfer_download_gotpkt(scp_sftp_xfer, pktin);
+            if (ret <= 0) {
+                tell_user(stderr, "pscp: error while reading: %s",
+                          fxp_error());
+                if (ret == INT_MIN)        /* pktin not even freed */
+                    sfree(pktin);
+                errs++;
+                return -1;
+            }
+        }
+
+        if (actuallen <= 0) {
+            tell_user(stderr, "pscp: end of file while reading");
+            errs++;
+            xfer_download_release(scp_sftp_xfer, vbuf);
+            return -1;
+        }
+
+        /*
+         * The xfer manager's read size adapts to the connection, so
+         * it may hand us more than our caller asked for. Keep the
+         * rest for next time.
+         */
+        if (actuallen > len) {
+            scp_sftp_rbuf = vbuf;
+            scp_sftp_rbuflen = actuallen;
+            scp_sftp_rbufpos = len;
+            actuallen = len;
             memcpy(data, vbuf, actuallen);
-            sfree(vbuf);
-        } else
-            actuallen = 0;
+        } else {
+            memcpy(data, vbuf, actuallen);
+            xfer_download_release(scp_sftp_xfer, vbuf);
+        }
 
         scp_sftp_fileoffset += actuallen;
 
@@ -1523,6 +1711,11 @@ int scp_finish_filerecv(void)
         struct sftp_packet *pktin;
         struct sftp_request *req;
 
+        if (scp_sftp_rbuf) {
+            xfer_download_release(scp_sftp_xfer, scp_sftp_rbuf);
+            scp_sftp_rbuf = NULL;
+        }
+
         /*
          * Ensure that xfer_done() will work correctly, so we can
          * clean up any outstanding requests from the file
@@ -1533,6 +1726,11 @@ int scp_finish_filerecv(void)
             void *vbuf;
             int ret, len;
 
+            if (xfer_download_data(scp_sftp_xfer, &vbuf, &len)) {
+                xfer_download_release(scp_sftp_xfer, vbuf);
+                continue;
+            }
+
             pktin = sftp_recv();
             ret = xfer_download_gotpkt(scp_sftp_xfer, pktin);
             if (ret <= 0) {
@@ -1542,9 +1740,8 @@ int scp_finish_filerecv(void)
                 errs++;
                 return -1;
             }
-            if (xfer_download_data(scp_sftp_xfer, &vbuf, &len))
-                sfree(vbuf);
         }
+        scp_stats_xfer_done();
         xfer_cleanup(scp_sftp_xfer);
 
         req = fxp_close_send(scp_sftp_filehandle);
@@ -1587,10 +1784,11 @@ static void source(const char *src)
     long permissions;
     const char *last;
     RFile *f;
-    int attr;
-    uint64_t i;
+    int attr, k;
+    uint64_t i, dataend = 0;
     uint64_t stat_bytes;
     time_t stat_starttime, stat_lasttime;
+    const void *data;
 
     attr = file_type(src);
     if (attr == FILE_TYPE_NONEXISTENT ||
@@ -1655,18 +1853,26 @@ static void source(const char *src)
     stat_bytes = 0;
     stat_starttime = time(NULL);
     stat_lasttime = 0;
+    scp_stats_start();
 
-#define PSCP_SEND_BLOCK 4096
-    for (i = 0; i < size; i += PSCP_SEND_BLOCK) {
-        char transbuf[PSCP_SEND_BLOCK];
-        int j, k = PSCP_SEND_BLOCK;
+    for (i = 0; i < size; i += k) {
+        int j;
 
+        if (i >= dataend) {
+            uint64_t next = scp_send_skiphole(f, i, size, &dataend);
+            stat_bytes += next - i;
+            i = next;
+        }
+
+        k = scp_send_blocksize();
         if (i + k > size)
             k = size - i;
-        if ((j = read_from_file(f, transbuf, k)) != k) {
+        if (i + k > dataend)
+            k = dataend - i;
+        if ((j = read_from_file_mapped(f, i, &data, k)) != k) {
             bump("%s: Read error", src);
         }
-        if (scp_send_filedata(transbuf, k))
+        if (scp_send_filedata(data, k))
             bump("%s: Network error occurred", src);
 
         if (statistics) {
@@ -1682,6 +1888,7 @@ static void source(const char *src)
     close_rfile(f);
 
     (void) scp_send_finish();
+    scp_stats_print(last);
 }
 
 /*
@@ -1742,7 +1949,7 @@ static void sink(const char *targ, const char *src)
     int attr;
     WFile *f;
     uint64_t received;
-    bool wrerror = false;
+    bool wrerror = false, sparse;
     uint64_t stat_bytes;
     time_t stat_starttime, stat_lasttime;
     char *stat_name;
@@ -1900,10 +2107,13 @@ static void sink(const char *targ, const char *src)
             string_scc, stripslashes(destfname, true));
 
         received = 0;
+        sparse = false;
+        scp_stats_start();
         while (received < act.size) {
             char transbuf[32768];
             uint64_t blksize;
-            int read;
+            int read, written;
+            unsigned long started;
             blksize = 32768;
             if (blksize > act.size - received)
                 blksize = act.size - received;
@@ -1914,7 +2124,20 @@ static void sink(const char *targ, const char *src)
                 received += read;
                 continue;
             }
-            if (write_to_file(f, transbuf, read) != (int)read) {
+            started = GETTICKCOUNT();
+            if (is_all_zero(transbuf, read)) {
+                /* leave a hole, so that a sparse file stays sparse */
+                if (!sparse) {
+                    set_file_sparse(f);
+                    sparse = true;
+                }
+                written = seek_file(f, read, FROM_CURRENT) == 0 ? read :
+                    write_to_file(f, transbuf, read);
+            } else {
+                written = write_to_file(f, transbuf, read);
+            }
+            scp_disk += GETTICKCOUNT() - started;
+            if (written != read) {
                 wrerror = true;
                 /* FIXME: in sftp we can actually abort the transfer */
                 if (statistics)
@@ -1935,11 +2158,16 @@ static void sink(const char *targ, const char *src)
             }
             received += read;
         }
+        if (sparse && !wrerror) {
+            /* if the file ended in a hole, extend it to full size */
+            truncate_file(f, received);
+        }
         if (act.settime) {
             set_file_times(f, act.mtime, act.atime);
         }
 
-        close_wfile(f);
+        if (close_wfile(f) < 0)
+            wrerror = true;
         if (wrerror) {
             with_stripctrl(san, destfname)
                 run_err("%s: Write error", san);
@@ -1947,6 +2175,7 @@ static void sink(const char *targ, const char *src)
             continue;
         }
         (void) scp_finish_filerecv();
+        scp_stats_print(stat_name);
         sfree(stat_name);
         sfree(destfname);
     }
@@ -2047,6 +2276,9 @@ static void toremote(int argc, char *argv[])
             finish_wildcard_matching(wc);
         }
     }
+
+    if (!using_sftp)
+        scp_collect_acks(true);
 }
 
 /*
@@ -2189,6 +2421,7 @@ static void usage(void)
     printf("  -pgpfp    print PGP key fingerprints and exit\n");
     printf("  -p        preserve file attributes\n");
     printf("  -q        quiet, don't show statistics\n");
+    printf("  -stats    show where the time went in each file transfer\n");
     printf("  -r        copy directories recursively\n");
     printf("  -v        show verbose messages\n");
     printf("  -load sessname  Load settings from saved session\n");
@@ -2211,9 +2444,13 @@ static void usage(void)
     printf("  -unsafe   allow server-side wildcards (DANGEROUS)\n");
     printf("  -sftp     force use of SFTP protocol\n");
     printf("  -scp      force use of SCP protocol\n");
+    printf("  -pipeline don't wait for every SCP acknowledgement when"
+           " uploading\n");
     printf("  -sshlog file\n");
     printf("  -sshrawlog file\n");
     printf("            log protocol details to a file\n");
+    printf("  -tracefile file\n");
+    printf("            record an event-loop trace to a file\n");
     cleanup_exit(1);
 }
 
@@ -2281,6 +2518,8 @@ int psftp_main(int argc, char *argv[])
             preserve = true;
         } else if (strcmp(argv[i], "-q") == 0) {
             statistics = false;
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            transfer_stats = true;
         } else if (strcmp(argv[i], "-h") == 0 ||
                    strcmp(argv[i], "-?") == 0 ||
                    strcmp(argv[i], "--help") == 0) {
@@ -2298,6 +2537,8 @@ int psftp_main(int argc, char *argv[])
             try_scp = false; try_sftp = true;
         } else if (strcmp(argv[i], "-scp") == 0) {
             try_scp = true; try_sftp = false;
+        } else if (strcmp(argv[i], "-pipeline") == 0) {
+            scp_pipeline = true;
         } else if (strcmp(argv[i], "-sanitise-stderr") == 0) {
             sanitise_stderr = true;
         } else if (strcmp(argv[i], "-no-sanitise-stderr") == 0) {
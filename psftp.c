@@ -13,6 +13,7 @@
 #include "storage.h"
 #include "ssh.h"
 #include "sftp.h"
+#include "tree234.h"
 
 const char *const appname = "PSFTP";
 
@@ -26,6 +27,8 @@ const char *const appname = "PSFTP";
 static int psftp_connect(char *userhost, char *user, int portnumber);
 static int do_sftp_init(void);
 static void do_sftp_cleanup(void);
+static bool transfer_dispatch(struct sftp_request *rreq,
+                              struct sftp_packet *pktin);
 
 /* ----------------------------------------------------------------------
  * sftp client state.
@@ -46,6 +49,7 @@ static bool psftp_eof(Seat *);
 
 static const SeatVtable psftp_seat_vt = {
     .output = psftp_output,
+    .sent = nullseat_sent,
     .eof = psftp_eof,
     .get_userpass_input = filexfer_get_userpass_input,
     .notify_remote_exit = nullseat_notify_remote_exit,
@@ -88,168 +92,1803 @@ struct sftp_packet *sftp_wait_for_reply(struct sftp_request *req)
     struct sftp_request *rreq;
 
     sftp_register(req);
+    while (1) {
+        pktin = sftp_recv();
+        if (pktin == NULL) {
+            seat_connection_fatal(
+                psftp_seat, "did not receive SFTP response packet from server");
+        }
+        rreq = sftp_find_request(pktin);
+        if (rreq == req)
+            return pktin;
+
+        /*
+         * Anything else had better be a reply to one of the file
+         * transfers still running in the background.
+         */
+        if (!rreq || !transfer_dispatch(rreq, pktin)) {
+            seat_connection_fatal(
+                psftp_seat,
+                "unable to understand SFTP response packet from server: %s",
+                fxp_error());
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * A cache of what we've recently found out about remote paths.
+ *
+ * Scripted sessions tend to mention the same few paths again and
+ * again, and canonifying or stat-ing one costs a round trip every
+ * time. So we remember the answers for a while, keyed by the
+ * absolute path we asked about. Anything we change ourselves is
+ * dropped from the cache straight away; changes made by anyone else
+ * show up once the entry has expired.
+ */
+
+#define PATH_CACHE_TTL (20 * TICKSPERSEC)
+#define PATH_CACHE_MAX 1024
+
+typedef struct PathCacheEntry {
+    char *path;
+    char *canon;                       /* FXP_REALPATH result, or NULL */
+    unsigned long canon_time;
+    bool have_attrs;
+    struct fxp_attrs attrs;            /* FXP_STAT result */
+    unsigned long attrs_time;
+} PathCacheEntry;
+
+static tree234 *path_cache;
+
+static int path_cache_cmp(void *av, void *bv)
+{
+    PathCacheEntry *a = (PathCacheEntry *)av;
+    PathCacheEntry *b = (PathCacheEntry *)bv;
+    return strcmp(a->path, b->path);
+}
+
+static int path_cache_find(void *av, void *bv)
+{
+    const char *a = (const char *)av;
+    PathCacheEntry *b = (PathCacheEntry *)bv;
+    return strcmp(a, b->path);
+}
+
+static bool path_cache_fresh(unsigned long when)
+{
+    return GETTICKCOUNT() - when < PATH_CACHE_TTL;
+}
+
+static void path_cache_free_entry(PathCacheEntry *pce)
+{
+    sfree(pce->path);
+    sfree(pce->canon);
+    sfree(pce);
+}
+
+static void path_cache_flush(void)
+{
+    PathCacheEntry *pce;
+
+    if (!path_cache)
+        return;
+    while ((pce = delpos234(path_cache, 0)) != NULL)
+        path_cache_free_entry(pce);
+}
+
+static PathCacheEntry *path_cache_get(const char *path, bool create)
+{
+    PathCacheEntry *pce;
+
+    if (!path_cache)
+        path_cache = newtree234(path_cache_cmp);
+
+    pce = find234(path_cache, (void *)path, path_cache_find);
+    if (pce || !create)
+        return pce;
+
+    /* Rather than work out what to evict, just start again */
+    if (count234(path_cache) >= PATH_CACHE_MAX)
+        path_cache_flush();
+
+    pce = snew(PathCacheEntry);
+    memset(pce, 0, sizeof(*pce));
+    pce->path = dupstr(path);
+    add234(path_cache, pce);
+    return pce;
+}
+
+/*
+ * Forget the attributes of something we've just changed.
+ */
+static void path_cache_forget(const char *path)
+{
+    PathCacheEntry *pce = path_cache_get(path, false);
+    if (pce)
+        pce->have_attrs = false;
+}
+
+static bool path_is_within(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    return !strncmp(path, dir, len) && (path[len] == '\0' ||
+                                        path[len] == '/');
+}
+
+/*
+ * Forget everything about a path and anything beneath it, for when
+ * it's removed or renamed.
+ */
+static void path_cache_forget_tree(const char *path)
+{
+    PathCacheEntry *pce;
+    int i;
+
+    if (!path_cache)
+        return;
+    for (i = 0; (pce = index234(path_cache, i)) != NULL;) {
+        if (path_is_within(pce->path, path) ||
+            (pce->canon && path_is_within(pce->canon, path))) {
+            del234(path_cache, pce);
+            path_cache_free_entry(pce);
+        } else {
+            i++;
+        }
+    }
+}
+
+/*
+ * Look up, or record, the results of a REALPATH or STAT. The lookup
+ * functions return NULL or false if there's nothing fresh enough in
+ * the cache.
+ */
+static char *path_cache_lookup_canon(const char *path)
+{
+    PathCacheEntry *pce = path_cache_get(path, false);
+    if (pce && pce->canon && path_cache_fresh(pce->canon_time))
+        return dupstr(pce->canon);
+    return NULL;
+}
+
+static void path_cache_set_canon(const char *path, const char *canon)
+{
+    PathCacheEntry *pce = path_cache_get(path, true);
+    sfree(pce->canon);
+    pce->canon = dupstr(canon);
+    pce->canon_time = GETTICKCOUNT();
+}
+
+static bool path_cache_lookup_attrs(const char *path, struct fxp_attrs *attrs)
+{
+    PathCacheEntry *pce = path_cache_get(path, false);
+    if (pce && pce->have_attrs && path_cache_fresh(pce->attrs_time)) {
+        *attrs = pce->attrs;
+        return true;
+    }
+    return false;
+}
+
+static void path_cache_set_attrs(const char *path,
+                                 const struct fxp_attrs *attrs)
+{
+    PathCacheEntry *pce = path_cache_get(path, true);
+    pce->have_attrs = true;
+    pce->attrs = *attrs;
+    pce->attrs_time = GETTICKCOUNT();
+}
+
+/*
+ * FXP_REALPATH, through the cache. Returns a dynamically allocated
+ * string, or NULL on failure (which isn't cached).
+ */
+static char *cached_realpath(const char *path)
+{
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+    char *canonname;
+
+    if ((canonname = path_cache_lookup_canon(path)) != NULL)
+        return canonname;
+
+    req = fxp_realpath_send(path);
+    pktin = sftp_wait_for_reply(req);
+    canonname = fxp_realpath_recv(pktin, req);
+    if (canonname)
+        path_cache_set_canon(path, canonname);
+    return canonname;
+}
+
+/*
+ * FXP_STAT, through the cache. As with fxp_stat_recv, returns false
+ * on failure, in which case fxp_error says why.
+ */
+static bool cached_stat(const char *path, struct fxp_attrs *attrs)
+{
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+    bool result;
+
+    if (path_cache_lookup_attrs(path, attrs))
+        return true;
+
+    req = fxp_stat_send(path);
+    pktin = sftp_wait_for_reply(req);
+    result = fxp_stat_recv(pktin, req, attrs);
+    if (result)
+        path_cache_set_attrs(path, attrs);
+    return result;
+}
+
+/* ----------------------------------------------------------------------
+ * Higher-level helper functions used in commands.
+ */
+
+/*
+ * Make a pathname absolute, by prefixing the pwd if necessary.
+ */
+static char *canonify_fullname(const char *name)
+{
+    if (name[0] == '/') {
+        return dupstr(name);
+    } else {
+        const char *slash;
+        if (pwd[strlen(pwd) - 1] == '/')
+            slash = "";
+        else
+            slash = "/";
+        return dupcat(pwd, slash, name);
+    }
+}
+
+/*
+ * The second half of canonify, for when FXP_REALPATH on the whole of
+ * an absolute pathname has failed.
+ *
+ * Attempt number 2. Some FXP_REALPATH implementations (glibc-based
+ * ones, in particular) require the _whole_ path to point to
+ * something that exists, whereas others (BSD-based) only require
+ * all but the last component to exist. So if the first call failed,
+ * we should strip off everything from the last slash onwards and
+ * try again, then put the final component back on.
+ *
+ * Special cases:
+ *
+ *  - if the last component is "/." or "/..", then we don't bother
+ *    trying this because there's no way it can work.
+ *
+ *  - if the thing actually ends with a "/", we remove it before we
+ *    start. Except if the string is "/" itself (although I can't see
+ *    why we'd have got here if so, because surely "/" would have
+ *    worked the first time?), in which case we don't bother.
+ *
+ *  - if there's no slash in the string at all, give up in confusion
+ *    (we expect at least one because of the way we constructed the
+ *    string).
+ *
+ * canonify_split does the first part of that, returning the index of
+ * the slash to split at, or -1 if we should give up.
+ */
+static int canonify_split(char *fullname)
+{
+    int i;
+
+    i = strlen(fullname);
+    if (i > 2 && fullname[i - 1] == '/')
+        fullname[--i] = '\0';          /* strip trailing / unless at pos 0 */
+    while (i > 0 && fullname[--i] != '/');
+
+    /*
+     * Give up on special cases.
+     */
+    if (fullname[i] != '/' ||          /* no slash at all */
+        !strcmp(fullname + i, "/.") ||          /* ends in /. */
+        !strcmp(fullname + i, "/..") ||         /* ends in /.. */
+        !strcmp(fullname, "/")) {
+        return -1;
+    }
+
+    return i;
+}
+
+/*
+ * Given a canonical name for all but the last path component,
+ * concatenate the last component.
+ */
+static char *canonify_join(const char *canonname, const char *last)
+{
+    return dupcat(canonname, (strendswith(canonname, "/") ? "" : "/"), last);
+}
+
+/*
+ * Takes ownership of fullname.
+ */
+static char *canonify_fallback(char *fullname)
+{
+    char *canonname, *returnname;
+    int i;
+
+    if ((i = canonify_split(fullname)) < 0)
+        return fullname;
+
+    /*
+     * Now i points at the slash. Deal with the final special
+     * case i==0 (ie the whole path was "/nonexistentfile").
+     */
+    fullname[i] = '\0';                /* separate the string */
+    canonname = cached_realpath(i == 0 ? "/" : fullname);
+
+    if (!canonname) {
+        /* Even that failed. Restore our best guess at the
+         * constructed filename and give up */
+        fullname[i] = '/';      /* restore slash and last component */
+        return fullname;
+    }
+
+    returnname = canonify_join(canonname, fullname + i + 1);
+    sfree(fullname);
+    sfree(canonname);
+    return returnname;
+}
+
+/*
+ * Attempt to canonify a pathname starting from the pwd. If
+ * canonification fails, at least fall back to returning a _valid_
+ * pathname (though it may be ugly, eg /home/simon/../foobar).
+ */
+char *canonify(const char *name)
+{
+    char *fullname, *canonname;
+
+    fullname = canonify_fullname(name);
+    canonname = cached_realpath(fullname);
+
+    if (canonname) {
+        sfree(fullname);
+        return canonname;
+    }
+
+    return canonify_fallback(fullname);
+}
+
+static int bare_name_compare(const void *av, const void *bv)
+{
+    const char **a = (const char **) av;
+    const char **b = (const char **) bv;
+    return strcmp(*a, *b);
+}
+
+static void not_connected(void)
+{
+    printf("psftp: not connected to a host; use \"open host.name\"\n");
+}
+
+/* ----------------------------------------------------------------------
+ * Running several file transfers at once.
+ *
+ * Each file being transferred is represented by a TransferJob, which
+ * works its way through opening the remote file, moving the data and
+ * closing it again, one SFTP reply at a time. Up to max_transfers of
+ * these can be in progress at once, all sharing the one SFTP
+ * channel, so that a batch of small files doesn't cost several
+ * serialised round trips apiece.
+ *
+ * Replies are routed to their jobs by transfer_dispatch, which is
+ * also called by sftp_wait_for_reply for any packet that isn't the
+ * one it was waiting for. So the rest of psftp can go on issuing
+ * requests one at a time while transfers it has already started
+ * carry on in the background.
+ *
+ * A recursive transfer walks its directory tree the same way, with a
+ * WalkJob for each directory, so that many directories can be being
+ * listed at once. The files they turn up are queued, and started as
+ * slots become free.
+ *
+ * A large file can also be split into up to max_stripes byte ranges,
+ * each transferred by its own job through its own file handle, so
+ * that it isn't limited to what one fxp_xfer's window can keep in
+ * flight.
+ */
+
+typedef enum {
+    TJ_OPENING,          /* waiting for the remote open (and stat) */
+    TJ_FSTAT,            /* reput: asking how much is already there */
+    TJ_DATA,             /* moving data */
+    TJ_CLOSING,          /* waiting for the remote close */
+} TransferJobState;
+
+/*
+ * The local file written by the stripes of a striped download. Not
+ * every platform will let us open the same file for writing more
+ * than once, so the stripes share one WFile.
+ */
+typedef struct SharedWFile {
+    WFile *wfile;
+    int refcount;
+} SharedWFile;
+
+typedef struct TransferJob {
+    bool upload, restart;
+    char *fname, *outfname;
+    TransferJobState state;
+    struct sftp_request *req, *statreq;
+    struct fxp_handle *fh;
+    struct fxp_attrs attrs;
+    struct fxp_xfer *xfer;
+    WFile *wfile;
+    RFile *rfile;
+    bool err, eof, shown_err;
+    uint64_t bytes;
+    int stripe, nstripes;              /* which part of the file, of how many */
+    uint64_t start, end, pos;          /* the file region this job covers */
+    uint64_t gap;                      /* download: earliest local write error */
+    uint64_t size, dataend;            /* upload: file size, end of this data */
+    bool sparse;                       /* download: we've left holes */
+    bool inorder;                      /* download: can only append */
+    /* For -stats */
+    struct fxp_xfer_stats xstats;
+    bool have_xstats;
+    unsigned long window0, socket0;    /* SSH stall times at the start */
+    unsigned long disk;                /* time spent writing locally */
+    SharedWFile *swf;
+    struct TransferJob *next;          /* in the queue of unstarted jobs */
+} TransferJob;
+
+typedef enum {
+    WJ_STAT,             /* get: is it a directory? put: is the target? */
+    WJ_MKDIR,            /* put: creating the remote directory */
+    WJ_OPENDIR,          /* get: opening the remote directory */
+    WJ_READDIR,          /* get: listing it */
+    WJ_CLOSEDIR,         /* get: closing it again */
+    WJ_LISTLOCAL,        /* put: listing the local directory */
+} WalkJobState;
+
+typedef struct WalkJob {
+    bool upload;
+    char *fname, *outfname;
+    WalkJobState state;
+    struct sftp_request *req;
+    struct fxp_handle *dirhandle;
+    bool err;
+    /* put: the local listing, filled in by a worker thread if we can */
+    char **names;
+    bool *isdir;
+    size_t nnames;
+    char *listerr;
+    struct WalkJob *next;              /* in the queue of unstarted walks,
+                                        * or of finished local listings */
+} WalkJob;
+
+/*
+ * Don't bother striping a file unless each stripe gets at least
+ * this much of it.
+ */
+#define STRIPE_MIN_SIZE (8 * 1024 * 1024)
+
+static int max_transfers = 1;
+static int max_stripes = 1;
+static bool transfer_stats = false;
+static TransferJob **transfers;
+static size_t ntransfers, transfersize;
+static bool transfers_failed;
+static unsigned transfers_completed;
+static uint64_t transfers_bytes;
+
+/*
+ * How many directories to be listing at once, and how many
+ * discovered files to let pile up before we stop looking for more.
+ */
+#define MAX_WALKS 16
+#define MAX_QUEUED_TRANSFERS 1024
+
+static WalkJob **walks;
+static size_t nwalks, walksize;
+static WalkJob *walkqueue_head, *walkqueue_tail;
+static WalkJob *walklisted_head, *walklisted_tail;
+static size_t nwalks_listing;          /* walks waiting for a local listing */
+static TransferJob *tjqueue_head, *tjqueue_tail;
+static size_t ntjqueue;
+
+static bool walk_dispatch(struct sftp_request *rreq,
+                          struct sftp_packet *pktin);
+static void transfer_start_queued(void);
+
+static size_t nasyncops;
+static bool async_dispatch(struct sftp_request *rreq,
+                           struct sftp_packet *pktin);
+
+static void transfer_send(TransferJob *tj, struct sftp_request *req)
+{
+    sftp_register(req);
+    tj->req = req;
+}
+
+static void transfer_close_wfile(TransferJob *tj)
+{
+    int ret = 0;
+
+    if (tj->swf) {
+        if (--tj->swf->refcount == 0) {
+            ret = close_wfile(tj->swf->wfile);
+            sfree(tj->swf);
+        }
+        tj->swf = NULL;
+    } else if (tj->wfile) {
+        ret = close_wfile(tj->wfile);
+    }
+    tj->wfile = NULL;
+
+    if (ret < 0 && !tj->err) {
+        printf("error while writing local file\n");
+        tj->err = true;
+    }
+}
+
+static void transfer_free(TransferJob *tj)
+{
+    transfer_close_wfile(tj);
+    if (tj->rfile)
+        close_rfile(tj->rfile);
+    sfree(tj->fname);
+    sfree(tj->outfname);
+    sfree(tj);
+}
+
+static void transfer_print_stats(TransferJob *tj)
+{
+    unsigned long window, socket;
+
+    ssh_send_stall_times(backend, &window, &socket);
+    with_stripctrl(san, tj->upload ? tj->outfname : tj->fname) {
+        if (tj->nstripes > 1)
+            printf("stats for %s (part %d of %d):\n", san,
+                   tj->stripe + 1, tj->nstripes);
+        else
+            printf("stats for %s:\n", san);
+    }
+    print_transfer_stats(&tj->xstats, window - tj->window0,
+                         socket - tj->socket0, tj->disk);
+}
+
+/*
+ * Called once a job is completely finished with, successfully or
+ * otherwise.
+ */
+static void transfer_finish(TransferJob *tj)
+{
+    size_t i;
+
+    for (i = 0; i < ntransfers; i++)
+        if (transfers[i] == tj)
+            break;
+    assert(i < ntransfers);
+    transfers[i] = transfers[--ntransfers];
+
+    if (transfer_stats && tj->have_xstats)
+        transfer_print_stats(tj);
+    if (tj->err)
+        transfers_failed = true;
+    if (tj->upload)
+        path_cache_forget(tj->outfname);
+    if (tj->stripe == 0)
+        transfers_completed++;
+    transfers_bytes += tj->bytes;
+    transfer_free(tj);
+}
+
+static void transfer_start_close(TransferJob *tj)
+{
+    if (tj->err && tj->xfer && tj->wfile && !tj->swf) {
+        /*
+         * A failed download may have left gaps in the local file,
+         * where chunks beyond them had already arrived. Cut it back
+         * to the part we know is complete, so that a later reget
+         * picks up from the right place.
+         */
+        uint64_t size = xfer_download_contiguous(tj->xfer);
+        if (size > tj->gap)
+            size = tj->gap;
+        truncate_file(tj->wfile, size);
+    } else if (!tj->err && tj->sparse && tj->end == UINT64_MAX) {
+        /*
+         * If the file ended in a hole, we haven't written anything
+         * that far, so extend it to its full size.
+         */
+        truncate_file(tj->wfile, xfer_download_contiguous(tj->xfer));
+    }
+    if (tj->xfer) {
+        xfer_get_stats(tj->xfer, &tj->xstats);
+        tj->have_xstats = true;
+        xfer_cleanup(tj->xfer);
+        tj->xfer = NULL;
+    }
+    transfer_close_wfile(tj);
+    tj->state = TJ_CLOSING;
+    transfer_send(tj, fxp_close_send(tj->fh));
+}
+
+/*
+ * On an upload, if the local file has a hole where we've got to,
+ * skip over it so that the remote file gets the same hole, and find
+ * out how far the data after it goes.
+ */
+static void transfer_find_data(TransferJob *tj)
+{
+    uint64_t start, end, limit = tj->end < tj->size ? tj->end : tj->size;
+
+    if (!find_file_data(tj->rfile, tj->pos, &start, &end)) {
+        tj->dataend = UINT64_MAX;
+        return;
+    }
+
+    if (start >= limit) {
+        /*
+         * Nothing but hole from here to the end of our part. If
+         * that's the end of the whole file, we still have to write
+         * its last byte, or the remote file will come out short.
+         */
+        if (limit < tj->size) {
+            start = end = limit;
+        } else if (tj->pos < tj->size) {
+            start = tj->size - 1;
+            end = tj->size;
+        } else {
+            /* at the end already: read on to EOF, as usual */
+            tj->dataend = UINT64_MAX;
+            return;
+        }
+    }
+
+    if (start > tj->pos) {
+        xfer_upload_skip(tj->xfer, start - tj->pos);
+        tj->pos = start;
+    }
+    tj->dataend = end;
+}
+
+/*
+ * Keep a job's data moving: queue more reads on a download, or send
+ * more of the file on an upload.
+ */
+static void transfer_pump(TransferJob *tj)
+{
+    if (tj->state != TJ_DATA)
+        return;
+
+    if (tj->upload) {
+        while (xfer_upload_ready(tj->xfer) && !tj->err && !tj->eof) {
+            int len, size = xfer_upload_chunksize(tj->xfer);
+            const void *data;
+            if (tj->pos >= tj->dataend)
+                transfer_find_data(tj);
+            if (tj->end - tj->pos < (uint64_t)size)
+                size = tj->end - tj->pos;
+            if (tj->dataend - tj->pos < (uint64_t)size)
+                size = tj->dataend - tj->pos;
+            len = size ? read_from_file_mapped(tj->rfile, tj->pos,
+                                               &data, size) : 0;
+            if (len == -1) {
+                printf("error while reading local file\n");
+                tj->err = true;
+            } else if (len == 0) {
+                tj->eof = true;
+            } else {
+                xfer_upload_data(tj->xfer, data, len);
+                tj->bytes += len;
+                tj->pos += len;
+            }
+        }
+        if ((tj->err || tj->eof) && xfer_done(tj->xfer))
+            transfer_start_close(tj);
+    } else {
+        xfer_download_queue(tj->xfer);
+    }
+}
+
+static void transfer_start_data(TransferJob *tj, uint64_t offset)
+{
+    tj->pos = offset;
+    ssh_send_stall_times(backend, &tj->window0, &tj->socket0);
+    if (tj->upload) {
+        if (tj->stripe == 0)
+            printf("local:%s => remote:%s\n", tj->fname, tj->outfname);
+        tj->xfer = xfer_upload_init(tj->fh, offset);
+    } else {
+        if (tj->stripe == 0) {
+            with_stripctrl(san, tj->fname) {
+                with_stripctrl(sano, tj->outfname)
+                    printf("remote:%s => local:%s\n", san, sano);
+            }
+        }
+        tj->xfer = xfer_download_init_range(tj->fh, offset, tj->end);
+    }
+    tj->state = TJ_DATA;
+    transfer_pump(tj);
+}
+
+/*
+ * The remote file is open (and, for a download, we know what we can
+ * about it). Sort out the local end and get going.
+ */
+static void transfer_opened(TransferJob *tj)
+{
+    uint64_t offset = 0;
+
+    if (tj->upload) {
+        if (tj->restart) {
+            tj->state = TJ_FSTAT;
+            transfer_send(tj, fxp_fstat_send(tj->fh));
+            return;
+        }
+        transfer_start_data(tj, tj->start);
+        return;
+    }
+
+    if (tj->swf) {
+        tj->wfile = tj->swf->wfile;
+        transfer_start_data(tj, tj->start);
+        return;
+    }
+
+    if (tj->restart) {
+        tj->wfile = open_existing_wfile(tj->outfname, NULL);
+    } else {
+        tj->wfile = open_new_file(tj->outfname,
+                                  GET_PERMISSIONS(tj->attrs, -1));
+    }
+
+    if (!tj->wfile) {
+        with_stripctrl(san, tj->outfname)
+            printf("local: unable to open %s\n", san);
+        tj->err = true;
+        transfer_start_close(tj);
+        return;
+    }
+    tj->inorder = !wfile_can_write_at(tj->wfile);
+
+    if (tj->restart) {
+        if (seek_file(tj->wfile, 0, FROM_END) == -1) {
+            with_stripctrl(san, tj->outfname)
+                printf("reget: cannot restart %s - file too large\n", san);
+            tj->err = true;
+            transfer_start_close(tj);
+            return;
+        }
+
+        offset = get_file_posn(tj->wfile);
+        printf("reget: restarting at file position %"PRIu64"\n", offset);
+    }
+
+    transfer_start_data(tj, offset);
+}
+
+static void transfer_got_data_reply(TransferJob *tj,
+                                    struct sftp_request *rreq,
+                                    struct sftp_packet *pktin)
+{
+    int ret;
+
+    if (tj->upload) {
+        ret = xfer_upload_gotreply(tj->xfer, rreq, pktin);
+        if (ret <= 0) {
+            if (ret == INT_MIN)        /* pktin not even freed */
+                sfree(pktin);
+            if (!tj->err) {
+                printf("error while writing: %s\n", fxp_error());
+                tj->err = true;
+            }
+        }
+    } else {
+        void *vbuf;
+        int len;
+        uint64_t offset = 0;
+
+        ret = xfer_download_gotreply(tj->xfer, rreq, pktin);
+        if (ret <= 0) {
+            if (!tj->shown_err) {
+                printf("error while reading: %s\n", fxp_error());
+                tj->shown_err = true;
+            }
+            if (ret == INT_MIN)        /* pktin not even freed */
+                sfree(pktin);
+            tj->err = true;
+        }
+
+        /*
+         * Write each chunk straight to its place in the file as soon
+         * as it arrives, so that one slow reply doesn't hold up all
+         * the data behind it. If the output is a pipe or similar,
+         * though, it has to be written in order.
+         */
+        while (tj->inorder ?
+               xfer_download_data(tj->xfer, &vbuf, &len) :
+               xfer_download_data_at(tj->xfer, &vbuf, &len, &offset)) {
+            unsigned char *buf = (unsigned char *)vbuf;
+            int wpos = 0, wlen;
+            unsigned long started = GETTICKCOUNT();
+
+            /*
+             * Leave a hole in place of a chunk of zeroes, so that a
+             * sparse file stays sparse. The file was created empty,
+             * or (for a reget) we're only writing past its old end,
+             * so the hole reads back as zeroes.
+             */
+            if (!tj->inorder && is_all_zero(buf, len)) {
+                if (!tj->sparse) {
+                    set_file_sparse(tj->wfile);
+                    tj->sparse = true;
+                }
+                wpos = len;
+            }
+
+            while (wpos < len) {
+                wlen = tj->inorder ?
+                    write_to_file(tj->wfile, buf + wpos, len - wpos) :
+                    write_to_file_at(tj->wfile, offset + wpos,
+                                     buf + wpos, len - wpos);
+                if (wlen <= 0) {
+                    printf("error while writing local file\n");
+                    tj->err = true;
+                    xfer_set_error(tj->xfer);
+                    if (!tj->inorder && tj->gap > offset + wpos)
+                        tj->gap = offset + wpos;
+                    break;
+                }
+                wpos += wlen;
+            }
+            tj->disk += GETTICKCOUNT() - started;
+            tj->bytes += wpos;
+
+            xfer_download_release(tj->xfer, vbuf);
+        }
+
+        if (xfer_done(tj->xfer)) {
+            transfer_start_close(tj);
+            return;
+        }
+    }
+
+    transfer_pump(tj);
+}
+
+/*
+ * Handle a reply to one of the requests a job makes for itself, as
+ * opposed to the data requests made on its behalf by its fxp_xfer.
+ */
+static void transfer_got_reply(TransferJob *tj, struct sftp_request *rreq,
+                               struct sftp_packet *pktin)
+{
+    if (rreq == tj->statreq) {
+        tj->statreq = NULL;
+        if (!fxp_stat_recv(pktin, rreq, &tj->attrs))
+            tj->attrs.flags = 0;
+        if (!tj->req) {
+            if (tj->fh)
+                transfer_opened(tj);
+            else
+                transfer_finish(tj);
+        }
+        return;
+    }
+
+    tj->req = NULL;
+
+    switch (tj->state) {
+      case TJ_OPENING:
+        tj->fh = fxp_open_recv(pktin, rreq);
+        if (!tj->fh) {
+            if (tj->upload) {
+                printf("%s: open for write: %s\n", tj->outfname, fxp_error());
+            } else {
+                with_stripctrl(san, tj->fname)
+                    printf("%s: open for read: %s\n", san, fxp_error());
+            }
+            tj->err = true;
+            if (!tj->statreq)
+                transfer_finish(tj);
+            return;
+        }
+        if (!tj->statreq)
+            transfer_opened(tj);
+        break;
+
+      case TJ_FSTAT: {
+        struct fxp_attrs attrs;
+        uint64_t offset;
+
+        if (!fxp_fstat_recv(pktin, rreq, &attrs)) {
+            printf("read size of %s: %s\n", tj->outfname, fxp_error());
+            tj->err = true;
+            transfer_start_close(tj);
+            return;
+        }
+        if (!(attrs.flags & SSH_FILEXFER_ATTR_SIZE)) {
+            printf("read size of %s: size was not given\n", tj->outfname);
+            tj->err = true;
+            transfer_start_close(tj);
+            return;
+        }
+        offset = attrs.size;
+        printf("reput: restarting at file position %"PRIu64"\n", offset);
+
+        if (seek_file((WFile *)tj->rfile, offset, FROM_START) != 0)
+            seek_file((WFile *)tj->rfile, 0, FROM_END);    /* *shrug* */
+        transfer_start_data(tj, offset);
+        break;
+      }
+
+      case TJ_CLOSING:
+        if (!fxp_close_recv(pktin, rreq) && tj->upload && !tj->err) {
+            printf("error while closing: %s", fxp_error());
+            tj->err = true;
+        }
+        transfer_finish(tj);
+        break;
+
+      default:
+        unreachable("unexpected reply in TransferJob");
+    }
+}
+
+/*
+ * Find the job a reply belongs to, and pass it on. Returns false if
+ * no job claims it.
+ */
+static bool transfer_dispatch(struct sftp_request *rreq,
+                              struct sftp_packet *pktin)
+{
+    struct fxp_xfer *xfer = xfer_from_request(rreq);
+    size_t i;
+
+    for (i = 0; i < ntransfers; i++) {
+        TransferJob *tj = transfers[i];
+        if (rreq == tj->req || rreq == tj->statreq) {
+            transfer_got_reply(tj, rreq, pktin);
+            return true;
+        }
+        if (xfer && xfer == tj->xfer) {
+            transfer_got_data_reply(tj, rreq, pktin);
+            return true;
+        }
+    }
+
+    return walk_dispatch(rreq, pktin) || async_dispatch(rreq, pktin);
+}
+
+/*
+ * Wait for one reply to arrive, and deal with it.
+ */
+static void transfer_run_once(void)
+{
+    struct sftp_packet *pktin;
+    struct sftp_request *rreq;
+    size_t i;
+
+    transfer_start_queued();
+
+    for (i = 0; i < ntransfers; i++)
+        transfer_pump(transfers[i]);
+
+    /*
+     * If we have pending callbacks, they might clear a backlog in
+     * the SSH layer and let an upload send more data. So run them
+     * first, before we go as far as waiting for a packet to arrive.
+     */
+    if (toplevel_callback_pending()) {
+        run_toplevel_callbacks();
+        return;
+    }
+
+    if (!ntransfers && !nwalks && !nasyncops)
+        return;
+
+    /*
+     * If all we're doing is listing local directories, there's no
+     * reply to wait for: just wait for the listings to finish.
+     */
+    if (!ntransfers && !nasyncops && nwalks == nwalks_listing) {
+        if (ssh_sftp_loop_iteration() < 0)
+            seat_connection_fatal(psftp_seat, "connection died");
+        return;
+    }
+
     pktin = sftp_recv();
     if (pktin == NULL) {
         seat_connection_fatal(
             psftp_seat, "did not receive SFTP response packet from server");
     }
     rreq = sftp_find_request(pktin);
-    if (rreq != req) {
+    if (!rreq || !transfer_dispatch(rreq, pktin)) {
         seat_connection_fatal(
             psftp_seat,
             "unable to understand SFTP response packet from server: %s",
             fxp_error());
     }
-    return pktin;
 }
 
-/* ----------------------------------------------------------------------
- * Higher-level helper functions used in commands.
- */
+/*
+ * Start a job, whether or not there's a slot free for it. Returns
+ * false if it failed before it even got started; failures after that
+ * are only reported by transfer_wait_all.
+ */
+static bool transfer_start(TransferJob *tj)
+{
+    sgrowarray(transfers, transfersize, ntransfers);
+    transfers[ntransfers++] = tj;
+
+    tj->state = TJ_OPENING;
+    if (tj->upload) {
+        struct fxp_attrs attrs;
+        long permissions;
+
+        tj->rfile = open_existing_file(tj->fname, &tj->size, NULL, NULL,
+                                       &permissions);
+        if (!tj->rfile) {
+            printf("local: unable to open %s\n", tj->fname);
+            tj->err = true;
+            transfer_finish(tj);
+            return false;
+        }
+        if (tj->nstripes > 1) {
+            /* The caller has already created the remote file */
+            if (seek_file((WFile *)tj->rfile, tj->start, FROM_START) != 0) {
+                printf("local: unable to seek in %s\n", tj->fname);
+                tj->err = true;
+                transfer_finish(tj);
+                return false;
+            }
+            transfer_send(tj, fxp_open_send(tj->outfname, SSH_FXF_WRITE,
+                                            NULL));
+            return true;
+        }
+        attrs.flags = 0;
+        PUT_PERMISSIONS(attrs, permissions);
+        transfer_send(tj, fxp_open_send(
+                          tj->outfname, tj->restart ? SSH_FXF_WRITE :
+                          SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC,
+                          &attrs));
+    } else if (tj->nstripes > 1) {
+        /* The caller already knows what it needs to about the file */
+        transfer_send(tj, fxp_open_send(tj->fname, SSH_FXF_READ, NULL));
+    } else {
+        /*
+         * Send the stat and the open together, rather than waiting
+         * for one before sending the other.
+         */
+        tj->statreq = fxp_stat_send(tj->fname);
+        sftp_register(tj->statreq);
+        transfer_send(tj, fxp_open_send(tj->fname, SSH_FXF_READ, NULL));
+    }
+
+    return true;
+}
+
+/*
+ * Start a new job, first waiting for a free slot if necessary. (The
+ * later stripes of a striped file don't wait, since they share the
+ * first stripe's slot.)
+ */
+static bool transfer_add(TransferJob *tj)
+{
+    while (tj->stripe == 0 && ntransfers >= max_transfers)
+        transfer_run_once();
+
+    return transfer_start(tj);
+}
+
+static TransferJob *transfer_new(bool upload, const char *fname,
+                                 const char *outfname, bool restart)
+{
+    TransferJob *tj = snew(TransferJob);
+    memset(tj, 0, sizeof(*tj));
+    tj->upload = upload;
+    tj->restart = restart;
+    tj->fname = dupstr(fname);
+    tj->outfname = dupstr(outfname);
+    tj->nstripes = 1;
+    tj->end = UINT64_MAX;
+    tj->gap = UINT64_MAX;
+    return tj;
+}
+
+static bool transfer_add_file(bool upload, const char *fname,
+                              const char *outfname, bool restart)
+{
+    return transfer_add(transfer_new(upload, fname, outfname, restart));
+}
+
+/*
+ * Work out how many stripes a file of the given size should be
+ * split into.
+ */
+static int transfer_nstripes(uint64_t size)
+{
+    uint64_t n = size / STRIPE_MIN_SIZE;
+    return n < max_stripes ? (int)(n ? n : 1) : max_stripes;
+}
+
+/*
+ * Transfer a file of known size as nstripes jobs, one for each byte
+ * range. For an upload, the remote file must already exist; for a
+ * download, the caller passes in the local file it has opened, and
+ * the jobs take it over.
+ */
+static bool transfer_add_stripes(bool upload, const char *fname,
+                                 const char *outfname, WFile *wfile,
+                                 uint64_t size, int nstripes)
+{
+    SharedWFile *swf = NULL;
+    int i;
+
+    if (wfile) {
+        swf = snew(SharedWFile);
+        swf->wfile = wfile;
+        swf->refcount = nstripes;
+    }
+
+    for (i = 0; i < nstripes; i++) {
+        TransferJob *tj = transfer_new(upload, fname, outfname, false);
+        tj->swf = swf;
+        tj->stripe = i;
+        tj->nstripes = nstripes;
+        tj->start = size / nstripes * i;
+        if (i + 1 < nstripes)
+            tj->end = size / nstripes * (i + 1);
+        if (!transfer_add(tj)) {
+            /* drop the references the remaining stripes would have had */
+            for (i++; i < nstripes; i++)
+                if (swf && --swf->refcount == 0) {
+                    close_wfile(swf->wfile);
+                    sfree(swf);
+                }
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Wait for every job to finish. Returns false if any of them failed.
+ */
+static bool transfer_wait_all(void)
+{
+    bool ok;
+
+    while (ntransfers > 0 || nwalks > 0 || walkqueue_head || tjqueue_head)
+        transfer_run_once();
+
+    if (max_transfers > 1 && transfers_completed > 1)
+        printf("%u files, %"PRIu64" bytes transferred%s\n",
+               transfers_completed, transfers_bytes,
+               transfers_failed ? " (with errors)" : "");
+
+    ok = !transfers_failed;
+    transfers_failed = false;
+    transfers_completed = 0;
+    transfers_bytes = 0;
+    return ok;
+}
+
+/*
+ * Queue a file found by a recursive walk, to be started once there's
+ * a slot for it.
+ */
+static void transfer_queue_file(bool upload, const char *fname,
+                                const char *outfname)
+{
+    TransferJob *tj = transfer_new(upload, fname, outfname, false);
+    if (tjqueue_tail)
+        tjqueue_tail->next = tj;
+    else
+        tjqueue_head = tj;
+    tjqueue_tail = tj;
+    ntjqueue++;
+}
+
+/*
+ * Queue a directory (or, for a get, something that might be one) to
+ * be walked.
+ */
+static void walk_queue(bool upload, const char *fname, const char *outfname,
+                       WalkJobState state)
+{
+    WalkJob *wj = snew(WalkJob);
+    memset(wj, 0, sizeof(*wj));
+    wj->upload = upload;
+    wj->fname = dupstr(fname);
+    wj->outfname = dupstr(outfname);
+    wj->state = state;
+    if (walkqueue_tail)
+        walkqueue_tail->next = wj;
+    else
+        walkqueue_head = wj;
+    walkqueue_tail = wj;
+}
+
+static void walk_send(WalkJob *wj, struct sftp_request *req)
+{
+    sftp_register(req);
+    wj->req = req;
+}
+
+static void walk_finish(WalkJob *wj)
+{
+    size_t i;
+
+    for (i = 0; i < nwalks; i++)
+        if (walks[i] == wj)
+            break;
+    assert(i < nwalks);
+    walks[i] = walks[--nwalks];
+
+    if (wj->err)
+        transfers_failed = true;
+    sfree(wj->fname);
+    sfree(wj->outfname);
+    sfree(wj);
+}
+
+/*
+ * get: create the local directory, and start listing the remote one.
+ */
+static void walk_opendir(WalkJob *wj)
+{
+    if (file_type(wj->outfname) != FILE_TYPE_DIRECTORY &&
+        !create_directory(wj->outfname)) {
+        with_stripctrl(san, wj->outfname)
+            printf("%s: Cannot create directory\n", san);
+        wj->err = true;
+        walk_finish(wj);
+        return;
+    }
+
+    wj->state = WJ_OPENDIR;
+    walk_send(wj, fxp_opendir_send(wj->fname));
+}
+
+/*
+ * get: deal with one batch of names from the remote directory. We
+ * can usually tell from the attributes that come with each name
+ * whether it's a file or a directory; anything else (a symlink, say)
+ * gets a stat of its own to find out what it points to.
+ */
+static void walk_got_names(WalkJob *wj, struct fxp_names *names)
+{
+    int i;
+
+    for (i = 0; i < names->nnames; i++) {
+        struct fxp_name *name = &names->names[i];
+        char *nextfname, *nextoutfname;
+
+        if (!strcmp(name->filename, ".") || !strcmp(name->filename, ".."))
+            continue;
+        if (!vet_filename(name->filename)) {
+            with_stripctrl(san, name->filename)
+                printf("ignoring potentially dangerous server-"
+                       "supplied filename '%s'\n", san);
+            continue;
+        }
+
+        nextfname = dupcat(wj->fname, "/", name->filename);
+        nextoutfname = dir_file_cat(wj->outfname, name->filename);
+        if (!(name->attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS))
+            walk_queue(false, nextfname, nextoutfname, WJ_STAT);
+        else if ((name->attrs.permissions & 0170000) == 0040000)
+            walk_queue(false, nextfname, nextoutfname, WJ_OPENDIR);
+        else if ((name->attrs.permissions & 0170000) == 0100000)
+            transfer_queue_file(false, nextfname, nextoutfname);
+        else
+            walk_queue(false, nextfname, nextoutfname, WJ_STAT);
+        sfree(nextoutfname);
+        sfree(nextfname);
+    }
+}
+
+/*
+ * put: list the local directory, and find out which of its entries
+ * are directories. On a big tree on a network filesystem this can
+ * take as long as the uploads, so where we can, it's done on a
+ * worker thread while the main one gets on with talking to the
+ * server. It mustn't touch anything but the WalkJob.
+ */
+static void walk_list_local_run(void *vctx)
+{
+    WalkJob *wj = (WalkJob *)vctx;
+    size_t namesize = 0, i;
+    char *name;
+    const char *opendir_err;
+    DirHandle *dh;
+
+    dh = open_directory(wj->fname, &opendir_err);
+    if (!dh) {
+        wj->listerr = dupstr(opendir_err);
+        return;
+    }
+    while ((name = read_filename(dh)) != NULL) {
+        sgrowarray(wj->names, namesize, wj->nnames);
+        wj->names[wj->nnames++] = name;
+    }
+    close_directory(dh);
+
+    if (wj->nnames > 0)
+        qsort(wj->names, wj->nnames, sizeof(*wj->names), bare_name_compare);
+
+    wj->isdir = snewn(wj->nnames, bool);
+    for (i = 0; i < wj->nnames; i++) {
+        char *nextfname = dir_file_cat(wj->fname, wj->names[i]);
+        wj->isdir[i] = (file_type(nextfname) == FILE_TYPE_DIRECTORY);
+        sfree(nextfname);
+    }
+}
+
+static void walk_list_local_done(void *vctx)
+{
+    WalkJob *wj = (WalkJob *)vctx;
+
+    /* Picked up by transfer_start_queued, rather than acting on it
+     * here in whatever we happened to be waiting for */
+    wj->next = NULL;
+    if (walklisted_tail)
+        walklisted_tail->next = wj;
+    else
+        walklisted_head = wj;
+    walklisted_tail = wj;
+}
 
 /*
- * Attempt to canonify a pathname starting from the pwd. If
- * canonification fails, at least fall back to returning a _valid_
- * pathname (though it may be ugly, eg /home/simon/../foobar).
+ * put: create the remote directory if need be, then list the local
+ * one. That part doesn't have to wait for the server, so each
+ * subdirectory is just queued to be walked in turn.
  */
-char *canonify(const char *name)
+static void walk_list_local(WalkJob *wj)
 {
-    char *fullname, *canonname;
-    struct sftp_packet *pktin;
-    struct sftp_request *req;
+    wj->state = WJ_LISTLOCAL;
+    nwalks_listing++;
+    if (!platform_run_in_background(walk_list_local_run,
+                                    walk_list_local_done, wj)) {
+        walk_list_local_run(wj);
+        walk_list_local_done(wj);
+    }
+}
 
-    if (name[0] == '/') {
-        fullname = dupstr(name);
-    } else {
-        const char *slash;
-        if (pwd[strlen(pwd) - 1] == '/')
-            slash = "";
+static void walk_got_local_list(WalkJob *wj)
+{
+    size_t i;
+
+    nwalks_listing--;
+
+    if (wj->listerr) {
+        printf("%s: unable to open directory: %s\n", wj->fname, wj->listerr);
+        sfree(wj->listerr);
+        wj->err = true;
+        walk_finish(wj);
+        return;
+    }
+
+    for (i = 0; i < wj->nnames; i++) {
+        char *nextfname, *nextoutfname;
+
+        nextfname = dir_file_cat(wj->fname, wj->names[i]);
+        nextoutfname = dupcat(wj->outfname, "/", wj->names[i]);
+        if (wj->isdir[i])
+            walk_queue(true, nextfname, nextoutfname, WJ_STAT);
         else
-            slash = "/";
-        fullname = dupcat(pwd, slash, name);
+            transfer_queue_file(true, nextfname, nextoutfname);
+        sfree(nextoutfname);
+        sfree(nextfname);
+        sfree(wj->names[i]);
     }
+    sfree(wj->names);
+    sfree(wj->isdir);
 
-    req = fxp_realpath_send(fullname);
-    pktin = sftp_wait_for_reply(req);
-    canonname = fxp_realpath_recv(pktin, req);
+    walk_finish(wj);
+}
 
-    if (canonname) {
-        sfree(fullname);
-        return canonname;
-    } else {
-        /*
-         * Attempt number 2. Some FXP_REALPATH implementations
-         * (glibc-based ones, in particular) require the _whole_
-         * path to point to something that exists, whereas others
-         * (BSD-based) only require all but the last component to
-         * exist. So if the first call failed, we should strip off
-         * everything from the last slash onwards and try again,
-         * then put the final component back on.
-         *
-         * Special cases:
-         *
-         *  - if the last component is "/." or "/..", then we don't
-         *    bother trying this because there's no way it can work.
-         *
-         *  - if the thing actually ends with a "/", we remove it
-         *    before we start. Except if the string is "/" itself
-         *    (although I can't see why we'd have got here if so,
-         *    because surely "/" would have worked the first
-         *    time?), in which case we don't bother.
-         *
-         *  - if there's no slash in the string at all, give up in
-         *    confusion (we expect at least one because of the way
-         *    we constructed the string).
-         */
+static void walk_start(WalkJob *wj)
+{
+    sgrowarray(walks, walksize, nwalks);
+    walks[nwalks++] = wj;
 
-        int i;
-        char *returnname;
+    if (wj->upload)
+        walk_send(wj, fxp_stat_send(wj->outfname));
+    else if (wj->state == WJ_STAT)
+        walk_send(wj, fxp_stat_send(wj->fname));
+    else
+        walk_opendir(wj);
+}
 
-        i = strlen(fullname);
-        if (i > 2 && fullname[i - 1] == '/')
-            fullname[--i] = '\0';      /* strip trailing / unless at pos 0 */
-        while (i > 0 && fullname[--i] != '/');
+static void walk_got_reply(WalkJob *wj, struct sftp_request *rreq,
+                           struct sftp_packet *pktin)
+{
+    struct fxp_attrs attrs;
+    struct fxp_names *names;
+    bool result;
 
-        /*
-         * Give up on special cases.
-         */
-        if (fullname[i] != '/' ||      /* no slash at all */
-            !strcmp(fullname + i, "/.") ||      /* ends in /. */
-            !strcmp(fullname + i, "/..") ||     /* ends in /.. */
-            !strcmp(fullname, "/")) {
-            return fullname;
-        }
+    wj->req = NULL;
 
-        /*
-         * Now i points at the slash. Deal with the final special
-         * case i==0 (ie the whole path was "/nonexistentfile").
-         */
-        fullname[i] = '\0';            /* separate the string */
-        if (i == 0) {
-            req = fxp_realpath_send("/");
+    switch (wj->state) {
+      case WJ_STAT:
+        result = fxp_stat_recv(pktin, rreq, &attrs);
+        result = result &&
+            (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) &&
+            (attrs.permissions & 0040000);
+        if (wj->upload) {
+            if (result) {
+                walk_list_local(wj);
+            } else {
+                wj->state = WJ_MKDIR;
+                walk_send(wj, fxp_mkdir_send(wj->outfname, NULL));
+            }
+        } else if (result) {
+            walk_opendir(wj);
         } else {
-            req = fxp_realpath_send(fullname);
+            /* not a directory, so just fetch it */
+            transfer_queue_file(false, wj->fname, wj->outfname);
+            walk_finish(wj);
         }
-        pktin = sftp_wait_for_reply(req);
-        canonname = fxp_realpath_recv(pktin, req);
+        break;
+      case WJ_MKDIR:
+        path_cache_forget(wj->outfname);
+        if (!fxp_mkdir_recv(pktin, rreq)) {
+            printf("%s: create directory: %s\n", wj->outfname, fxp_error());
+            wj->err = true;
+            walk_finish(wj);
+            break;
+        }
+        walk_list_local(wj);
+        break;
+      case WJ_OPENDIR:
+        wj->dirhandle = fxp_opendir_recv(pktin, rreq);
+        if (!wj->dirhandle) {
+            with_stripctrl(san, wj->fname)
+                printf("%s: unable to open directory: %s\n",
+                       san, fxp_error());
+            wj->err = true;
+            walk_finish(wj);
+            break;
+        }
+        wj->state = WJ_READDIR;
+        walk_send(wj, fxp_readdir_send(wj->dirhandle));
+        break;
+      case WJ_READDIR:
+        names = fxp_readdir_recv(pktin, rreq);
+        if (names && names->nnames > 0) {
+            walk_got_names(wj, names);
+            fxp_free_names(names);
+            walk_send(wj, fxp_readdir_send(wj->dirhandle));
+            break;
+        }
+        if (names) {
+            fxp_free_names(names);
+        } else if (fxp_error_type() != SSH_FX_EOF) {
+            with_stripctrl(san, wj->fname)
+                printf("%s: reading directory: %s\n", san, fxp_error());
+            wj->err = true;
+        }
+        wj->state = WJ_CLOSEDIR;
+        walk_send(wj, fxp_close_send(wj->dirhandle));
+        break;
+      case WJ_CLOSEDIR:
+        fxp_close_recv(pktin, rreq);
+        walk_finish(wj);
+        break;
+      case WJ_LISTLOCAL:
+        unreachable("no request outstanding while listing locally");
+    }
+}
 
-        if (!canonname) {
-            /* Even that failed. Restore our best guess at the
-             * constructed filename and give up */
-            fullname[i] = '/';  /* restore slash and last component */
-            return fullname;
+static bool walk_dispatch(struct sftp_request *rreq,
+                          struct sftp_packet *pktin)
+{
+    size_t i;
+
+    for (i = 0; i < nwalks; i++) {
+        if (rreq == walks[i]->req) {
+            walk_got_reply(walks[i], rreq, pktin);
+            return true;
         }
+    }
 
-        /*
-         * We have a canonical name for all but the last path
-         * component. Concatenate the last component and return.
-         */
-        returnname = dupcat(canonname,
-                            (strendswith(canonname, "/") ? "" : "/"),
-                            fullname + i + 1);
-        sfree(fullname);
-        sfree(canonname);
-        return returnname;
+    return false;
+}
+
+/*
+ * Start as many queued walks and transfers as there's room for. We
+ * stop walking while plenty of files are already waiting for a slot,
+ * so that a huge tree doesn't have to be held in memory all at once.
+ */
+static void transfer_start_queued(void)
+{
+    while (walklisted_head) {
+        WalkJob *wj = walklisted_head;
+        if (!(walklisted_head = wj->next))
+            walklisted_tail = NULL;
+        walk_got_local_list(wj);
+    }
+
+    while (nwalks < MAX_WALKS && ntjqueue < MAX_QUEUED_TRANSFERS &&
+           walkqueue_head) {
+        WalkJob *wj = walkqueue_head;
+        walkqueue_head = wj->next;
+        if (!walkqueue_head)
+            walkqueue_tail = NULL;
+        wj->next = NULL;
+        walk_start(wj);
+    }
+
+    while (ntransfers < max_transfers && tjqueue_head) {
+        TransferJob *tj = tjqueue_head;
+        tjqueue_head = tj->next;
+        if (!tjqueue_head)
+            tjqueue_tail = NULL;
+        tj->next = NULL;
+        ntjqueue--;
+        transfer_start(tj);
     }
 }
 
-static int bare_name_compare(const void *av, const void *bv)
+/* ----------------------------------------------------------------------
+ * Checking, for `reget -c' and `reput -c', that the part of the
+ * destination file a resume would keep really does match the source.
+ *
+ * We ask the server to hash each block of the remote file, using the
+ * check-file extension, hash the same blocks of the local file
+ * ourselves, and transfer again only the blocks that differ. Then the
+ * ordinary resume can carry on from the end.
+ */
+
+#define VERIFY_BLOCK_SIZE 131072
+#define VERIFY_BLOCKS_PER_REQUEST 1024
+
+static const struct {
+    const char *name;
+    const ssh_hashalg *alg;
+} verify_hashes[] = {
+    { "sha256", &ssh_sha256 },
+    { "sha1", &ssh_sha1 },
+    { "md5", &ssh_md5 },
+};
+#define VERIFY_HASH_LIST "sha256,sha1,md5"
+
+/*
+ * Copy one block from the local file to the remote one, or the other
+ * way round.
+ */
+static bool verify_resend_block(bool upload, struct fxp_handle *fh,
+                                RFile *rf, WFile *wf,
+                                uint64_t offset, uint64_t len)
 {
-    const char **a = (const char **) av;
-    const char **b = (const char **) bv;
-    return strcmp(*a, *b);
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+    char buf[32768];
+    int got;
+
+    while (len > 0) {
+        int chunk = len < sizeof(buf) ? len : sizeof(buf);
+
+        if (upload) {
+            const void *data;
+
+            got = read_from_file_mapped(rf, offset, &data, chunk);
+            if (got <= 0) {
+                printf("error while reading local file\n");
+                return false;
+            }
+            req = fxp_write_send(fh, data, offset, got);
+            pktin = sftp_wait_for_reply(req);
+            if (!fxp_write_recv(pktin, req)) {
+                printf("error while writing: %s\n", fxp_error());
+                return false;
+            }
+        } else {
+            req = fxp_read_send(fh, offset, chunk);
+            pktin = sftp_wait_for_reply(req);
+            got = fxp_read_recv(pktin, req, buf, chunk);
+            if (got <= 0) {
+                printf("error while reading: %s\n", fxp_error());
+                return false;
+            }
+            if (write_to_file_at(wf, offset, buf, got) != got) {
+                printf("error while writing local file\n");
+                return false;
+            }
+        }
+
+        offset += got;
+        len -= got;
+    }
+
+    return true;
 }
 
-static void not_connected(void)
+/*
+ * Returns false if something went wrong that should stop the resume.
+ * If we simply can't check (say the server doesn't support
+ * check-file), we say so and let the resume go ahead unchecked.
+ */
+static bool resume_verify(bool upload, const char *fname,
+                          const char *outfname)
 {
-    printf("psftp: not connected to a host; use \"open host.name\"\n");
+    const char *cmd = upload ? "reput" : "reget";
+    const char *remote = upload ? outfname : fname;
+    const char *local = upload ? fname : outfname;
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+    struct fxp_handle *fh;
+    struct fxp_attrs attrs;
+    RFile *rf;
+    WFile *wf = NULL;
+    uint64_t lsize, size, offset, resent = 0;
+    strbuf *hashes;
+    bool ok = false;
+
+    rf = open_existing_file(local, &lsize, NULL, NULL, NULL);
+    if (rf && !upload)
+        wf = open_existing_wfile(local, NULL);
+    if (!rf || (!upload && !wf)) {
+        with_stripctrl(san, local)
+            printf("local: unable to open %s\n", san);
+        if (rf)
+            close_rfile(rf);
+        return false;
+    }
+
+    req = fxp_open_send(remote, upload ? SSH_FXF_READ | SSH_FXF_WRITE :
+                        SSH_FXF_READ, NULL);
+    pktin = sftp_wait_for_reply(req);
+    fh = fxp_open_recv(pktin, req);
+    if (!fh) {
+        with_stripctrl(san, remote)
+            printf("%s: open for %s: %s\n", san,
+                   upload ? "write" : "read", fxp_error());
+        close_rfile(rf);
+        if (wf)
+            close_wfile(wf);
+        return false;
+    }
+
+    hashes = strbuf_new();
+
+    req = fxp_fstat_send(fh);
+    pktin = sftp_wait_for_reply(req);
+    if (!fxp_fstat_recv(pktin, req, &attrs) ||
+        !(attrs.flags & SSH_FILEXFER_ATTR_SIZE)) {
+        with_stripctrl(san, remote)
+            printf("read size of %s: %s\n", san, fxp_error());
+        goto out;
+    }
+
+    size = attrs.size < lsize ? attrs.size : lsize;
+    for (offset = 0; offset < size ;) {
+        uint64_t len = size - offset, blocks, i;
+        const ssh_hashalg *alg = NULL;
+        char *algname;
+
+        if (len > (uint64_t)VERIFY_BLOCK_SIZE * VERIFY_BLOCKS_PER_REQUEST)
+            len = (uint64_t)VERIFY_BLOCK_SIZE * VERIFY_BLOCKS_PER_REQUEST;
+        blocks = (len + VERIFY_BLOCK_SIZE - 1) / VERIFY_BLOCK_SIZE;
+
+        strbuf_clear(hashes);
+        req = fxp_check_file_send(fh, VERIFY_HASH_LIST, offset, len,
+                                  VERIFY_BLOCK_SIZE);
+        pktin = sftp_wait_for_reply(req);
+        algname = fxp_check_file_recv(pktin, req, hashes);
+        if (!algname) {
+            printf("%s: unable to check existing data (%s); "
+                   "resuming without checking\n", cmd, fxp_error());
+            ok = true;
+            goto out;
+        }
+        for (i = 0; i < lenof(verify_hashes); i++)
+            if (!strcmp(algname, verify_hashes[i].name))
+                alg = verify_hashes[i].alg;
+        sfree(algname);
+        if (!alg || hashes->len != blocks * alg->hlen) {
+            printf("%s: unable to check existing data (unusable reply "
+                   "from server); resuming without checking\n", cmd);
+            ok = true;
+            goto out;
+        }
+
+        for (i = 0; i < blocks; i++) {
+            uint64_t start = offset + i * VERIFY_BLOCK_SIZE, pos;
+            uint64_t end = start + VERIFY_BLOCK_SIZE;
+            unsigned char digest[MAX_HASH_LEN];
+            ssh_hash *h = ssh_hash_new(alg);
+
+            if (end > offset + len)
+                end = offset + len;
+            for (pos = start; pos < end ;) {
+                const void *data;
+                int got = read_from_file_mapped(rf, pos, &data, end - pos);
+                if (got <= 0)
+                    break;
+                put_data(h, data, got);
+                pos += got;
+            }
+            ssh_hash_final(h, digest);
+            if (pos < end) {
+                printf("error while reading local file\n");
+                goto out;
+            }
+
+            if (!memcmp(digest, hashes->u + i * alg->hlen, alg->hlen))
+                continue;
+            if (!verify_resend_block(upload, fh, rf, wf, start, end - start))
+                goto out;
+            resent += end - start;
+        }
+
+        offset += len;
+    }
+
+    /*
+     * If the destination is longer than the source, it's not just
+     * unfinished; cut it down so that the resume leaves a true copy.
+     */
+    if (!upload && lsize > attrs.size) {
+        if (truncate_file(wf, attrs.size) != 0) {
+            printf("error while writing local file\n");
+            goto out;
+        }
+    } else if (upload && attrs.size > lsize) {
+        attrs.flags = SSH_FILEXFER_ATTR_SIZE;
+        attrs.size = lsize;
+        req = fxp_fsetstat_send(fh, attrs);
+        pktin = sftp_wait_for_reply(req);
+        if (!fxp_fsetstat_recv(pktin, req)) {
+            printf("%s: truncate: %s\n", remote, fxp_error());
+            goto out;
+        }
+    }
+
+    printf("%s: checked %"PRIu64" bytes already there, "
+           "%"PRIu64" of them sent again\n", cmd, size, resent);
+    ok = true;
+
+  out:
+    if (upload)
+        path_cache_forget(remote);
+    strbuf_free(hashes);
+    req = fxp_close_send(fh);
+    pktin = sftp_wait_for_reply(req);
+    fxp_close_recv(pktin, req);
+    close_rfile(rf);
+    if (wf && close_wfile(wf) < 0) {
+        printf("error while writing local file\n");
+        ok = false;
+    }
+    return ok;
 }
 
 /* ----------------------------------------------------------------------
  * The meat of the `get' and `put' commands.
  */
-bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart)
+bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart,
+                   bool verify)
 {
-    struct fxp_handle *fh;
     struct sftp_packet *pktin;
     struct sftp_request *req;
-    struct fxp_xfer *xfer;
-    uint64_t offset;
-    WFile *file;
-    bool toret, shown_err = false;
     struct fxp_attrs attrs;
 
     /*
      * In recursive mode, see if we're dealing with a directory.
      * (If we're not in recursive mode, we need not even check: the
      * subsequent FXP_OPEN will return a usable error message.)
+     *
+     * When we're running several transfers at once anyway, hand the
+     * whole tree to the walker instead, which finds out for itself.
+     * (Except for a reget, which needs to see each directory's
+     * listing in full, in order, before it can tell where to resume.)
      */
+    if (recurse && max_transfers > 1 && !restart) {
+        walk_queue(false, fname, outfname, WJ_STAT);
+        return true;
+    }
     if (recurse) {
         bool result;
 
-        req = fxp_stat_send(fname);
-        pktin = sftp_wait_for_reply(req);
-        result = fxp_stat_recv(pktin, req, &attrs);
+        result = cached_stat(fname, &attrs);
 
         if (result &&
             (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) &&
@@ -381,7 +2020,7 @@ bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart)
                 nextfname = dupcat(fname, "/", ournames[i]->filename);
                 nextoutfname = dir_file_cat(outfname, ournames[i]->filename);
                 retd = sftp_get_file(
-                    nextfname, nextoutfname, recurse, restart);
+                    nextfname, nextoutfname, recurse, restart, verify);
                 restart = false;       /* after first partial file, do full */
                 sfree(nextoutfname);
                 sfree(nextfname);
@@ -406,136 +2045,64 @@ bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart)
         }
     }
 
-    req = fxp_stat_send(fname);
-    pktin = sftp_wait_for_reply(req);
-    if (!fxp_stat_recv(pktin, req, &attrs))
-        attrs.flags = 0;
-
-    req = fxp_open_send(fname, SSH_FXF_READ, NULL);
-    pktin = sftp_wait_for_reply(req);
-    fh = fxp_open_recv(pktin, req);
-
-    if (!fh) {
-        with_stripctrl(san, fname)
-            printf("%s: open for read: %s\n", san, fxp_error());
-        return false;
-    }
-
-    if (restart) {
-        file = open_existing_wfile(outfname, NULL);
-    } else {
-        file = open_new_file(outfname, GET_PERMISSIONS(attrs, -1));
-    }
-
-    if (!file) {
-        with_stripctrl(san, outfname)
-            printf("local: unable to open %s\n", san);
-
-        req = fxp_close_send(fh);
-        pktin = sftp_wait_for_reply(req);
-        fxp_close_recv(pktin, req);
-
-        return false;
-    }
-
-    if (restart) {
-        if (seek_file(file, 0, FROM_END) == -1) {
-            close_wfile(file);
-            with_stripctrl(san, outfname)
-                printf("reget: cannot restart %s - file too large\n", san);
-            req = fxp_close_send(fh);
-            pktin = sftp_wait_for_reply(req);
-            fxp_close_recv(pktin, req);
-
-            return false;
-        }
-
-        offset = get_file_posn(file);
-        printf("reget: restarting at file position %"PRIu64"\n", offset);
-    } else {
-        offset = 0;
-    }
-
-    with_stripctrl(san, fname) {
-        with_stripctrl(sano, outfname)
-            printf("remote:%s => local:%s\n", san, sano);
-    }
-
     /*
-     * FIXME: we can use FXP_FSTAT here to get the file size, and
-     * thus put up a progress bar.
+     * Only stripe into an ordinary local file: anything else (such as
+     * a pipe) can only be written in order.
      */
-    toret = true;
-    xfer = xfer_download_init(fh, offset);
-    while (!xfer_done(xfer)) {
-        void *vbuf;
-        int retd, len;
-        int wpos, wlen;
-
-        xfer_download_queue(xfer);
-        pktin = sftp_recv();
-        retd = xfer_download_gotpkt(xfer, pktin);
-        if (retd <= 0) {
-            if (!shown_err) {
-                printf("error while reading: %s\n", fxp_error());
-                shown_err = true;
-            }
-            if (retd == INT_MIN)        /* pktin not even freed */
-                sfree(pktin);
-            toret = false;
-        }
+    if (max_stripes > 1 && !restart &&
+        file_type(outfname) != FILE_TYPE_WEIRD) {
+        int nstripes;
 
-        while (xfer_download_data(xfer, &vbuf, &len)) {
-            unsigned char *buf = (unsigned char *)vbuf;
+        req = fxp_stat_send(fname);
+        pktin = sftp_wait_for_reply(req);
+        if (fxp_stat_recv(pktin, req, &attrs) &&
+            (attrs.flags & SSH_FILEXFER_ATTR_SIZE) &&
+            (!(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) ||
+             (attrs.permissions & 0170000) == 0100000) &&
+            (nstripes = transfer_nstripes(attrs.size)) > 1) {
+            WFile *file;
 
-            wpos = 0;
-            while (wpos < len) {
-                wlen = write_to_file(file, buf + wpos, len - wpos);
-                if (wlen <= 0) {
-                    printf("error while writing local file\n");
-                    toret = false;
-                    xfer_set_error(xfer);
-                    break;
-                }
-                wpos += wlen;
-            }
-            if (wpos < len) {          /* we had an error */
-                toret = false;
-                xfer_set_error(xfer);
+            /*
+             * Create the local file now, for all the stripes to
+             * write their own parts into.
+             */
+            file = open_new_file(outfname, GET_PERMISSIONS(attrs, -1));
+            if (!file) {
+                with_stripctrl(san, outfname)
+                    printf("local: unable to open %s\n", san);
+                return false;
             }
 
-            sfree(vbuf);
+            return transfer_add_stripes(false, fname, outfname, file,
+                                        attrs.size, nstripes) &&
+                (max_transfers > 1 || transfer_wait_all());
         }
     }
 
-    xfer_cleanup(xfer);
-
-    close_wfile(file);
-
-    req = fxp_close_send(fh);
-    pktin = sftp_wait_for_reply(req);
-    fxp_close_recv(pktin, req);
+    if (restart && verify && !resume_verify(false, fname, outfname))
+        return false;
 
-    return toret;
+    return transfer_add_file(false, fname, outfname, restart) &&
+        (max_transfers > 1 || transfer_wait_all());
 }
 
-bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
-{
-    struct fxp_handle *fh;
-    struct fxp_xfer *xfer;
+bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart,
+                   bool verify)
+{
     struct sftp_packet *pktin;
     struct sftp_request *req;
-    uint64_t offset;
-    RFile *file;
-    bool err = false, eof;
     struct fxp_attrs attrs;
-    long permissions;
 
     /*
      * In recursive mode, see if we're dealing with a directory.
      * (If we're not in recursive mode, we need not even check: the
      * subsequent fopen will return an error message.)
      */
+    if (recurse && file_type(fname) == FILE_TYPE_DIRECTORY &&
+        max_transfers > 1 && !restart) {
+        walk_queue(true, fname, outfname, WJ_STAT);
+        return true;
+    }
     if (recurse && file_type(fname) == FILE_TYPE_DIRECTORY) {
         bool result;
         size_t nnames, namesize;
@@ -548,15 +2115,14 @@ bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
          * First, attempt to create the destination directory,
          * unless it already exists.
          */
-        req = fxp_stat_send(outfname);
-        pktin = sftp_wait_for_reply(req);
-        result = fxp_stat_recv(pktin, req, &attrs);
+        result = cached_stat(outfname, &attrs);
         if (!result ||
             !(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) ||
             !(attrs.permissions & 0040000)) {
             req = fxp_mkdir_send(outfname, NULL);
             pktin = sftp_wait_for_reply(req);
             result = fxp_mkdir_recv(pktin, req);
+            path_cache_forget(outfname);
 
             if (!result) {
                 printf("%s: create directory: %s\n",
@@ -604,9 +2170,7 @@ bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
             while (i < nnames) {
                 char *nextoutfname;
                 nextoutfname = dupcat(outfname, "/", ournames[i]);
-                req = fxp_stat_send(nextoutfname);
-                pktin = sftp_wait_for_reply(req);
-                result = fxp_stat_recv(pktin, req, &attrs);
+                result = cached_stat(nextoutfname, &attrs);
                 sfree(nextoutfname);
                 if (!result)
                     break;
@@ -628,7 +2192,8 @@ bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
 
             nextfname = dir_file_cat(fname, ournames[i]);
             nextoutfname = dupcat(outfname, "/", ournames[i]);
-            retd = sftp_put_file(nextfname, nextoutfname, recurse, restart);
+            retd = sftp_put_file(nextfname, nextoutfname, recurse, restart,
+                                 verify);
             restart = false;           /* after first partial file, do full */
             sfree(nextoutfname);
             sfree(nextfname);
@@ -652,119 +2217,58 @@ bool sftp_put_file(char *fname, char *outfname, bool recurse, bool restart)
         return true;
     }
 
-    file = open_existing_file(fname, NULL, NULL, NULL, &permissions);
-    if (!file) {
-        printf("local: unable to open %s\n", fname);
-        return false;
-    }
-    attrs.flags = 0;
-    PUT_PERMISSIONS(attrs, permissions);
-    if (restart) {
-        req = fxp_open_send(outfname, SSH_FXF_WRITE, &attrs);
-    } else {
-        req = fxp_open_send(outfname,
-                            SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC,
-                            &attrs);
-    }
-    pktin = sftp_wait_for_reply(req);
-    fh = fxp_open_recv(pktin, req);
-
-    if (!fh) {
-        close_rfile(file);
-        printf("%s: open for write: %s\n", outfname, fxp_error());
-        return false;
-    }
-
-    if (restart) {
-        struct fxp_attrs attrs;
-        bool retd;
-
-        req = fxp_fstat_send(fh);
-        pktin = sftp_wait_for_reply(req);
-        retd = fxp_fstat_recv(pktin, req, &attrs);
-
-        if (!retd) {
-            printf("read size of %s: %s\n", outfname, fxp_error());
-            err = true;
-            goto cleanup;
-        }
-        if (!(attrs.flags & SSH_FILEXFER_ATTR_SIZE)) {
-            printf("read size of %s: size was not given\n", outfname);
-            err = true;
-            goto cleanup;
-        }
-        offset = attrs.size;
-        printf("reput: restarting at file position %"PRIu64"\n", offset);
-
-        if (seek_file((WFile *)file, offset, FROM_START) != 0)
-            seek_file((WFile *)file, 0, FROM_END);    /* *shrug* */
-    } else {
-        offset = 0;
-    }
-
-    printf("local:%s => remote:%s\n", fname, outfname);
-
     /*
-     * FIXME: we can use FXP_FSTAT here to get the file size, and
-     * thus put up a progress bar.
+     * Only stripe an ordinary local file: a pipe can only be read in
+     * order, and even opening it to find its size would use it up.
      */
-    xfer = xfer_upload_init(fh, offset);
-    eof = false;
-    while ((!err && !eof) || !xfer_done(xfer)) {
-        char buffer[4096];
-        int len, ret;
-
-        while (xfer_upload_ready(xfer) && !err && !eof) {
-            len = read_from_file(file, buffer, sizeof(buffer));
-            if (len == -1) {
-                printf("error while reading local file\n");
-                err = true;
-            } else if (len == 0) {
-                eof = true;
-            } else {
-                xfer_upload_data(xfer, buffer, len);
-            }
+    if (max_stripes > 1 && !restart && file_type(fname) == FILE_TYPE_FILE) {
+        RFile *file;
+        uint64_t size;
+        long permissions;
+        int nstripes;
+
+        file = open_existing_file(fname, &size, NULL, NULL, &permissions);
+        if (file) {
+            close_rfile(file);
+            nstripes = transfer_nstripes(size);
+        } else {
+            nstripes = 1;     /* let the ordinary code report the error */
         }
 
-        if (toplevel_callback_pending() && !err && !eof) {
-            /* If we have pending callbacks, they might make
-             * xfer_upload_ready start to return true. So we should
-             * run them and then re-check xfer_upload_ready, before
-             * we go as far as waiting for an entire packet to
-             * arrive. */
-            run_toplevel_callbacks();
-            continue;
-        }
+        if (nstripes > 1) {
+            struct fxp_handle *fh;
 
-        if (!xfer_done(xfer)) {
-            pktin = sftp_recv();
-            ret = xfer_upload_gotpkt(xfer, pktin);
-            if (ret <= 0) {
-                if (ret == INT_MIN)        /* pktin not even freed */
-                    sfree(pktin);
-                if (!err) {
-                    printf("error while writing: %s\n", fxp_error());
-                    err = true;
-                }
+            /*
+             * Create (or truncate) the remote file before any of the
+             * stripes start writing to it.
+             */
+            attrs.flags = 0;
+            PUT_PERMISSIONS(attrs, permissions);
+            req = fxp_open_send(outfname,
+                                SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC,
+                                &attrs);
+            pktin = sftp_wait_for_reply(req);
+            fh = fxp_open_recv(pktin, req);
+            path_cache_forget(outfname);
+            if (!fh) {
+                printf("%s: open for write: %s\n", outfname, fxp_error());
+                return false;
             }
-        }
-    }
-
-    xfer_cleanup(xfer);
+            req = fxp_close_send(fh);
+            pktin = sftp_wait_for_reply(req);
+            fxp_close_recv(pktin, req);
 
-  cleanup:
-    req = fxp_close_send(fh);
-    pktin = sftp_wait_for_reply(req);
-    if (!fxp_close_recv(pktin, req)) {
-        if (!err) {
-            printf("error while closing: %s", fxp_error());
-            err = true;
+            return transfer_add_stripes(true, fname, outfname, NULL,
+                                        size, nstripes) &&
+                (max_transfers > 1 || transfer_wait_all());
         }
     }
 
-    close_rfile(file);
+    if (restart && verify && !resume_verify(true, fname, outfname))
+        return false;
 
-    return !err;
+    return transfer_add_file(true, fname, outfname, restart) &&
+        (max_transfers > 1 || transfer_wait_all());
 }
 
 /* ----------------------------------------------------------------------
@@ -776,7 +2280,8 @@ typedef struct SftpWildcardMatcher {
     struct fxp_handle *dirh;
     struct fxp_names *names;
     int namepos;
-    char *wildcard, *prefix;
+    WildcardPattern *wildcard;
+    char *prefix;
 } SftpWildcardMatcher;
 
 SftpWildcardMatcher *sftp_begin_wildcard_matching(char *name)
@@ -822,7 +2327,7 @@ SftpWildcardMatcher *sftp_begin_wildcard_matching(char *name)
         swcm = snew(SftpWildcardMatcher);
         swcm->dirh = dirh;
         swcm->names = NULL;
-        swcm->wildcard = dupstr(wildcard);
+        swcm->wildcard = wc_compile(wildcard);
         swcm->prefix = unwcdir;
     } else {
         printf("Unable to open %s: %s\n", cdir, fxp_error());
@@ -874,109 +2379,537 @@ char *sftp_wildcard_get_filename(SftpWildcardMatcher *swcm)
             swcm->namepos = 0;
         }
 
-        assert(swcm->names && swcm->namepos < swcm->names->nnames);
-
-        name = &swcm->names->names[swcm->namepos++];
+        assert(swcm->names && swcm->namepos < swcm->names->nnames);
+
+        name = &swcm->names->names[swcm->namepos++];
+
+        /*
+         * In a big directory most names won't match, so check that
+         * first, as cheaply as possible.
+         */
+        if (!wc_match_compiled(swcm->wildcard,
+                               ptrlen_from_asciz(name->filename)))
+            continue;                  /* doesn't match the wildcard */
+
+        if (!strcmp(name->filename, ".") || !strcmp(name->filename, ".."))
+            continue;                  /* expected bad filenames */
+
+        if (!vet_filename(name->filename)) {
+            with_stripctrl(san, name->filename)
+                printf("ignoring potentially dangerous server-"
+                       "supplied filename '%s'\n", san);
+            continue;                  /* unexpected bad filename */
+        }
+
+        /*
+         * We have a working filename. Return it.
+         */
+        return dupprintf("%s%s%s", swcm->prefix,
+                         (!swcm->prefix[0] ||
+                          swcm->prefix[strlen(swcm->prefix)-1]=='/' ?
+                          "" : "/"),
+                         name->filename);
+    }
+}
+
+void sftp_finish_wildcard_matching(SftpWildcardMatcher *swcm)
+{
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+
+    req = fxp_close_send(swcm->dirh);
+    pktin = sftp_wait_for_reply(req);
+    fxp_close_recv(pktin, req);
+
+    if (swcm->names)
+        fxp_free_names(swcm->names);
+
+    sfree(swcm->prefix);
+    wc_compiled_free(swcm->wildcard);
+
+    sfree(swcm);
+}
+
+/*
+ * General function to match a potential wildcard in a filename
+ * argument and iterate over every matching file. Used in several
+ * PSFTP commands (rmdir, rm, chmod, mv).
+ */
+bool wildcard_iterate(char *filename, bool (*func)(void *, char *), void *ctx)
+{
+    char *unwcfname, *newname, *cname;
+    bool is_wc, toret;
+
+    unwcfname = snewn(strlen(filename)+1, char);
+    is_wc = !wc_unescape(unwcfname, filename);
+
+    if (is_wc) {
+        SftpWildcardMatcher *swcm = sftp_begin_wildcard_matching(filename);
+        bool matched = false;
+        sfree(unwcfname);
+
+        if (!swcm)
+            return false;
+
+        toret = true;
+
+        while ( (newname = sftp_wildcard_get_filename(swcm)) != NULL ) {
+            cname = canonify(newname);
+            sfree(newname);
+            matched = true;
+            if (!func(ctx, cname))
+                toret = false;
+            sfree(cname);
+        }
+
+        if (!matched) {
+            /* Politely warn the user that nothing matched. */
+            printf("%s: nothing matched\n", filename);
+        }
+
+        sftp_finish_wildcard_matching(swcm);
+    } else {
+        cname = canonify(unwcfname);
+        toret = func(ctx, cname);
+        sfree(cname);
+        sfree(unwcfname);
+    }
+
+    return toret;
+}
+
+/*
+ * Handy helper function.
+ */
+bool is_wildcard(char *name)
+{
+    char *unwcfname = snewn(strlen(name)+1, char);
+    bool is_wc = !wc_unescape(unwcfname, name);
+    sfree(unwcfname);
+    return is_wc;
+}
+
+/* ----------------------------------------------------------------------
+ * Running simple commands asynchronously.
+ *
+ * With -async, the rm, rmdir, mkdir, chmod and mv commands don't wait
+ * for the server to answer each request before moving on; up to
+ * max_async operations (each one file, or one wildcard match) are
+ * kept going at once, both within a command and across consecutive
+ * commands. Each operation still prints its own result, naming the
+ * file it was applied to, when its reply arrives.
+ *
+ * Operations are kept in the order they were issued, and one isn't
+ * sent while an earlier one is still outstanding on the same path,
+ * or on a directory containing it (or vice versa). Any other command
+ * waits for everything outstanding to finish before it starts.
+ */
+
+typedef enum {
+    AO_RM, AO_RMDIR, AO_MKDIR, AO_CHMOD, AO_MV
+} AsyncOpKind;
+
+typedef enum {
+    AO_REALPATH,         /* canonifying the name */
+    AO_REALPATH_PARENT,  /* ... or, failing that, its parent */
+    AO_WAITING,          /* waiting for earlier operations on the path */
+    AO_STAT,             /* chmod: finding out the current permissions */
+    AO_ACTION,           /* waiting for the actual operation */
+} AsyncOpState;
+
+typedef struct AsyncOp {
+    AsyncOpKind kind;
+    AsyncOpState state;
+    char *fullname;                    /* before canonification */
+    char *path;                        /* canonical, once we know it */
+    int split;                         /* where fullname's parent ends */
+    char *dstpath;                     /* mv: where to */
+    char *mvdest;                      /* mv: the destination given */
+    bool dest_is_dir;                  /* mv: ... and whether it's a dir */
+    unsigned attrs_clr, attrs_xor;     /* chmod: how to alter the mode */
+    unsigned oldperms, newperms;
+    struct sftp_request *req;
+} AsyncOp;
+
+static int max_async = 0;
+static AsyncOp **asyncops;
+static size_t asyncopsize;
+static bool async_failed;
+
+static void async_send(AsyncOp *op, AsyncOpState state,
+                       struct sftp_request *req)
+{
+    sftp_register(req);
+    op->state = state;
+    op->req = req;
+}
+
+static void async_finish(AsyncOp *op, bool ok)
+{
+    size_t i;
+
+    for (i = 0; i < nasyncops; i++)
+        if (asyncops[i] == op)
+            break;
+    assert(i < nasyncops);
+    memmove(asyncops + i, asyncops + i + 1,
+            (nasyncops - i - 1) * sizeof(*asyncops));
+    nasyncops--;
+
+    if (!ok)
+        async_failed = true;
+    sfree(op->fullname);
+    sfree(op->path);
+    sfree(op->dstpath);
+    sfree(op->mvdest);
+    sfree(op);
+}
+
+static bool paths_related(const char *a, const char *b)
+{
+    return path_is_within(a, b) || path_is_within(b, a);
+}
+
+/*
+ * Check whether the operation at the given position in the queue
+ * has to wait for one before it.
+ */
+static bool async_blocked(size_t index)
+{
+    AsyncOp *op = asyncops[index];
+    size_t i;
+
+    for (i = 0; i < index; i++) {
+        AsyncOp *prev = asyncops[i];
+        const char *prevpath = prev->path ? prev->path : prev->fullname;
+
+        if (paths_related(op->path, prevpath) ||
+            (prev->dstpath && paths_related(op->path, prev->dstpath)))
+            return true;
+        if (op->dstpath &&
+            (paths_related(op->dstpath, prevpath) ||
+             (prev->dstpath && paths_related(op->dstpath, prev->dstpath))))
+            return true;
+    }
+
+    return false;
+}
+
+static void async_chmod_got_attrs(AsyncOp *op, struct fxp_attrs *attrs)
+{
+    if (!(attrs->flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+        printf("get attrs for %s: file permissions not provided\n", op->path);
+        async_finish(op, false);
+        return;
+    }
+
+    attrs->flags = SSH_FILEXFER_ATTR_PERMISSIONS;   /* perms _only_ */
+    op->oldperms = attrs->permissions & 07777;
+    attrs->permissions &= ~op->attrs_clr;
+    attrs->permissions ^= op->attrs_xor;
+    op->newperms = attrs->permissions & 07777;
+
+    if (op->oldperms == op->newperms) {
+        async_finish(op, true);        /* no need to do anything! */
+        return;
+    }
+
+    async_send(op, AO_ACTION, fxp_setstat_send(op->path, *attrs));
+}
+
+static void async_start_action(AsyncOp *op)
+{
+    struct fxp_attrs attrs;
+
+    switch (op->kind) {
+      case AO_RM:
+        async_send(op, AO_ACTION, fxp_remove_send(op->path));
+        break;
+      case AO_RMDIR:
+        async_send(op, AO_ACTION, fxp_rmdir_send(op->path));
+        break;
+      case AO_MKDIR:
+        async_send(op, AO_ACTION, fxp_mkdir_send(op->path, NULL));
+        break;
+      case AO_MV:
+        async_send(op, AO_ACTION, fxp_rename_send(op->path, op->dstpath));
+        break;
+      case AO_CHMOD:
+        if (path_cache_lookup_attrs(op->path, &attrs))
+            async_chmod_got_attrs(op, &attrs);
+        else
+            async_send(op, AO_STAT, fxp_stat_send(op->path));
+        break;
+    }
+}
+
+/*
+ * Send every operation that's no longer held up by an earlier one.
+ */
+static void async_advance(void)
+{
+    bool progress = true;
+    size_t i;
+
+    while (progress) {
+        progress = false;
+        for (i = 0; i < nasyncops; i++) {
+            if (asyncops[i]->state == AO_WAITING && !async_blocked(i)) {
+                async_start_action(asyncops[i]);
+                progress = true;
+                break;
+            }
+        }
+    }
+}
+
+static void async_got_path(AsyncOp *op, char *path)
+{
+    op->path = path;
+    if (op->kind == AO_MV) {
+        if (op->dest_is_dir) {
+            const char *p = path + strlen(path);
+            while (p > path && p[-1] != '/') p--;
+            op->dstpath = dupcat(op->mvdest, "/", p);
+        } else {
+            op->dstpath = dupstr(op->mvdest);
+        }
+    }
+    op->state = AO_WAITING;
+    async_advance();
+}
+
+static void async_got_action_reply(AsyncOp *op, struct sftp_request *rreq,
+                                   struct sftp_packet *pktin)
+{
+    bool result;
+
+    switch (op->kind) {
+      case AO_RM:
+        result = fxp_remove_recv(pktin, rreq);
+        path_cache_forget_tree(op->path);
+        if (!result)
+            printf("rm %s: %s\n", op->path, fxp_error());
+        else
+            printf("rm %s: OK\n", op->path);
+        break;
+      case AO_RMDIR:
+        result = fxp_rmdir_recv(pktin, rreq);
+        path_cache_forget_tree(op->path);
+        if (!result)
+            printf("rmdir %s: %s\n", op->path, fxp_error());
+        else
+            printf("rmdir %s: OK\n", op->path);
+        break;
+      case AO_MKDIR:
+        result = fxp_mkdir_recv(pktin, rreq);
+        path_cache_forget(op->path);
+        if (!result)
+            with_stripctrl(san, op->path)
+                printf("mkdir %s: %s\n", san, fxp_error());
+        else
+            with_stripctrl(san, op->path)
+                printf("mkdir %s: OK\n", san);
+        break;
+      case AO_MV:
+        result = fxp_rename_recv(pktin, rreq);
+        path_cache_forget_tree(op->path);
+        path_cache_forget_tree(op->dstpath);
+        if (!result)
+            with_stripctrl(san, op->dstpath)
+                printf("mv %s %s: %s\n", op->path, san, fxp_error());
+        else
+            with_stripctrl(san, op->dstpath)
+                printf("%s -> %s\n", op->path, san);
+        break;
+      case AO_CHMOD:
+        result = fxp_setstat_recv(pktin, rreq);
+        path_cache_forget(op->path);
+        if (!result)
+            printf("set attrs for %s: %s\n", op->path, fxp_error());
+        else
+            printf("%s: %04o -> %04o\n", op->path,
+                   op->oldperms, op->newperms);
+        break;
+      default:
+        unreachable("bad AsyncOpKind");
+    }
+
+    async_finish(op, result);
+}
+
+static void async_got_reply(AsyncOp *op, struct sftp_request *rreq,
+                            struct sftp_packet *pktin)
+{
+    struct fxp_attrs attrs;
+    char *canonname, *parent;
+
+    op->req = NULL;
+
+    switch (op->state) {
+      case AO_REALPATH:
+        canonname = fxp_realpath_recv(pktin, rreq);
+        if (canonname) {
+            path_cache_set_canon(op->fullname, canonname);
+            async_got_path(op, canonname);
+            break;
+        }
+
+        /*
+         * Do the same as canonify_fallback, but without waiting for
+         * the reply (which we can't do from in here).
+         */
+        if ((op->split = canonify_split(op->fullname)) < 0) {
+            async_got_path(op, dupstr(op->fullname));
+            break;
+        }
+        parent = (op->split == 0 ? dupstr("/") :
+                  dupprintf("%.*s", op->split, op->fullname));
+        if ((canonname = path_cache_lookup_canon(parent)) != NULL) {
+            async_got_path(op, canonify_join(
+                               canonname, op->fullname + op->split + 1));
+            sfree(canonname);
+        } else {
+            async_send(op, AO_REALPATH_PARENT, fxp_realpath_send(parent));
+        }
+        sfree(parent);
+        break;
+      case AO_REALPATH_PARENT:
+        canonname = fxp_realpath_recv(pktin, rreq);
+        if (!canonname) {
+            async_got_path(op, dupstr(op->fullname));
+            break;
+        }
+        parent = (op->split == 0 ? dupstr("/") :
+                  dupprintf("%.*s", op->split, op->fullname));
+        path_cache_set_canon(parent, canonname);
+        sfree(parent);
+        async_got_path(op, canonify_join(
+                           canonname, op->fullname + op->split + 1));
+        sfree(canonname);
+        break;
+      case AO_STAT:
+        if (!fxp_stat_recv(pktin, rreq, &attrs)) {
+            printf("get attrs for %s: %s\n", op->path, fxp_error());
+            async_finish(op, false);
+            break;
+        }
+        path_cache_set_attrs(op->path, &attrs);
+        async_chmod_got_attrs(op, &attrs);
+        break;
+      case AO_ACTION:
+        async_got_action_reply(op, rreq, pktin);
+        break;
+      default:
+        unreachable("reply for an AsyncOp with nothing outstanding");
+    }
+
+    async_advance();
+}
 
-        if (!strcmp(name->filename, ".") || !strcmp(name->filename, ".."))
-            continue;                  /* expected bad filenames */
+static bool async_dispatch(struct sftp_request *rreq,
+                           struct sftp_packet *pktin)
+{
+    size_t i;
 
-        if (!vet_filename(name->filename)) {
-            with_stripctrl(san, name->filename)
-                printf("ignoring potentially dangerous server-"
-                       "supplied filename '%s'\n", san);
-            continue;                  /* unexpected bad filename */
+    for (i = 0; i < nasyncops; i++) {
+        if (rreq == asyncops[i]->req) {
+            async_got_reply(asyncops[i], rreq, pktin);
+            return true;
         }
+    }
 
-        if (!wc_match(swcm->wildcard, name->filename))
-            continue;                  /* doesn't match the wildcard */
+    return false;
+}
 
-        /*
-         * We have a working filename. Return it.
-         */
-        return dupprintf("%s%s%s", swcm->prefix,
-                         (!swcm->prefix[0] ||
-                          swcm->prefix[strlen(swcm->prefix)-1]=='/' ?
-                          "" : "/"),
-                         name->filename);
-    }
+/*
+ * Wait for every asynchronous operation to finish.
+ */
+static void async_drain(void)
+{
+    while (nasyncops > 0)
+        transfer_run_once();
 }
 
-void sftp_finish_wildcard_matching(SftpWildcardMatcher *swcm)
+/*
+ * Find out whether any asynchronous operation has failed since the
+ * last time we asked.
+ */
+static bool async_check(void)
 {
-    struct sftp_packet *pktin;
-    struct sftp_request *req;
+    bool ok = !async_failed;
+    async_failed = false;
+    return ok;
+}
 
-    req = fxp_close_send(swcm->dirh);
-    pktin = sftp_wait_for_reply(req);
-    fxp_close_recv(pktin, req);
+/*
+ * Start an operation like 'tmpl' on the given (not yet canonified)
+ * file name, first waiting for room in the queue if necessary.
+ */
+static void async_add(const AsyncOp *tmpl, const char *name)
+{
+    AsyncOp *op;
+    char *canonname;
 
-    if (swcm->names)
-        fxp_free_names(swcm->names);
+    while (nasyncops >= max_async)
+        transfer_run_once();
 
-    sfree(swcm->prefix);
-    sfree(swcm->wildcard);
+    op = snew(AsyncOp);
+    *op = *tmpl;
+    op->fullname = canonify_fullname(name);
+    op->path = op->dstpath = NULL;
+    op->mvdest = tmpl->mvdest ? dupstr(tmpl->mvdest) : NULL;
+    op->req = NULL;
 
-    sfree(swcm);
+    sgrowarray(asyncops, asyncopsize, nasyncops);
+    asyncops[nasyncops++] = op;
+
+    if ((canonname = path_cache_lookup_canon(op->fullname)) != NULL)
+        async_got_path(op, canonname);
+    else
+        async_send(op, AO_REALPATH, fxp_realpath_send(op->fullname));
 }
 
 /*
- * General function to match a potential wildcard in a filename
- * argument and iterate over every matching file. Used in several
- * PSFTP commands (rmdir, rm, chmod, mv).
+ * The asynchronous counterpart of wildcard_iterate.
  */
-bool wildcard_iterate(char *filename, bool (*func)(void *, char *), void *ctx)
+static bool async_iterate(char *filename, const AsyncOp *tmpl)
 {
-    char *unwcfname, *newname, *cname;
-    bool is_wc, toret;
+    SftpWildcardMatcher *swcm;
+    char *unwcfname, *newname;
+    bool matched = false;
 
     unwcfname = snewn(strlen(filename)+1, char);
-    is_wc = !wc_unescape(unwcfname, filename);
-
-    if (is_wc) {
-        SftpWildcardMatcher *swcm = sftp_begin_wildcard_matching(filename);
-        bool matched = false;
+    if (wc_unescape(unwcfname, filename)) {
+        async_add(tmpl, unwcfname);
         sfree(unwcfname);
+        return true;
+    }
+    sfree(unwcfname);
 
-        if (!swcm)
-            return false;
-
-        toret = true;
-
-        while ( (newname = sftp_wildcard_get_filename(swcm)) != NULL ) {
-            cname = canonify(newname);
-            sfree(newname);
-            matched = true;
-            if (!func(ctx, cname))
-                toret = false;
-            sfree(cname);
-        }
+    /*
+     * Don't list the directory while earlier operations might still
+     * be changing what's in it.
+     */
+    async_drain();
 
-        if (!matched) {
-            /* Politely warn the user that nothing matched. */
-            printf("%s: nothing matched\n", filename);
-        }
+    swcm = sftp_begin_wildcard_matching(filename);
+    if (!swcm)
+        return false;
 
-        sftp_finish_wildcard_matching(swcm);
-    } else {
-        cname = canonify(unwcfname);
-        toret = func(ctx, cname);
-        sfree(cname);
-        sfree(unwcfname);
+    while ( (newname = sftp_wildcard_get_filename(swcm)) != NULL ) {
+        matched = true;
+        async_add(tmpl, newname);
+        sfree(newname);
     }
 
-    return toret;
-}
+    if (!matched) {
+        /* Politely warn the user that nothing matched. */
+        printf("%s: nothing matched\n", filename);
+    }
 
-/*
- * Handy helper function.
- */
-bool is_wildcard(char *name)
-{
-    char *unwcfname = snewn(strlen(name)+1, char);
-    bool is_wc = !wc_unescape(unwcfname, name);
-    sfree(unwcfname);
-    return is_wc;
+    sftp_finish_wildcard_matching(swcm);
+    return true;
 }
 
 /* ----------------------------------------------------------------------
@@ -1035,7 +2968,7 @@ void list_directory_from_sftp_print(struct fxp_name *name)
 
 /*
  * List a directory. If no arguments are given, list pwd; otherwise
- * list the directory given in words[1].
+ * list the directory given in the first non-option word.
  */
 int sftp_cmd_ls(struct sftp_command *cmd)
 {
@@ -1045,16 +2978,33 @@ int sftp_cmd_ls(struct sftp_command *cmd)
     char *cdir, *unwcdir, *wildcard;
     struct sftp_packet *pktin;
     struct sftp_request *req;
+    bool sort = true;
+    int i;
 
     if (!backend) {
         not_connected();
         return 0;
     }
 
-    if (cmd->nwords < 2)
+    i = 1;
+    while (i < cmd->nwords && cmd->words[i][0] == '-') {
+        if (!strcmp(cmd->words[i], "--")) {
+            /* finish processing options */
+            i++;
+            break;
+        } else if (!strcmp(cmd->words[i], "-U")) {
+            sort = false;
+        } else {
+            printf("%s: unrecognised option '%s'\n", cmd->words[0], cmd->words[i]);
+            return 0;
+        }
+        i++;
+    }
+
+    if (i >= cmd->nwords)
         dir = ".";
     else
-        dir = cmd->words[1];
+        dir = cmd->words[i];
 
     unwcdir = snewn(1 + strlen(dir), char);
     if (wc_unescape(unwcdir, dir)) {
@@ -1099,31 +3049,48 @@ int sftp_cmd_ls(struct sftp_command *cmd)
         return 0;
     } else {
         struct list_directory_from_sftp_ctx *ctx =
-            list_directory_from_sftp_new();
+            list_directory_from_sftp_new(sort);
+        struct fxp_readdirs *rd =
+            readdirs_init(dirh, LIST_DIRECTORY_READDIRS);
+        struct sftp_request *rreq;
+        WildcardPattern *wcp = wildcard ? wc_compile(wildcard) : NULL;
 
         while (1) {
+            readdirs_queue(rd);
 
-            req = fxp_readdir_send(dirh);
-            pktin = sftp_wait_for_reply(req);
-            names = fxp_readdir_recv(pktin, req);
-
-            if (names == NULL) {
-                if (fxp_error_type() == SSH_FX_EOF)
-                    break;
-                printf("Reading directory %s: %s\n", dir, fxp_error());
-                break;
-            }
-            if (names->nnames == 0) {
+            while ((names = readdirs_next(rd)) != NULL) {
+                for (size_t i = 0; i < names->nnames; i++)
+                    if (!wcp || wc_match_compiled(
+                            wcp, ptrlen_from_asciz(names->names[i].filename)))
+                        list_directory_from_sftp_feed(ctx, &names->names[i]);
                 fxp_free_names(names);
-                break;
             }
+            if (!sort)
+                fflush(stdout);
 
-            for (size_t i = 0; i < names->nnames; i++)
-                if (!wildcard || wc_match(wildcard, names->names[i].filename))
-                    list_directory_from_sftp_feed(ctx, &names->names[i]);
+            if (readdirs_done(rd))
+                break;
 
-            fxp_free_names(names);
+            pktin = sftp_recv();
+            if (pktin == NULL) {
+                seat_connection_fatal(
+                    psftp_seat,
+                    "did not receive SFTP response packet from server");
+            }
+            rreq = sftp_find_request(pktin);
+            if (!rreq || (!readdirs_gotreply(rd, rreq, pktin) &&
+                          !transfer_dispatch(rreq, pktin))) {
+                seat_connection_fatal(
+                    psftp_seat,
+                    "unable to understand SFTP response packet from "
+                    "server: %s", fxp_error());
+            }
         }
+        if (fxp_error_type() != SSH_FX_EOF)
+            printf("Reading directory %s: %s\n", dir, fxp_error());
+        readdirs_cleanup(rd);
+        if (wcp)
+            wc_compiled_free(wcp);
 
         req = fxp_close_send(dirh);
         pktin = sftp_wait_for_reply(req);
@@ -1212,7 +3179,7 @@ int sftp_general_get(struct sftp_command *cmd, bool restart, bool multiple)
 {
     char *fname, *unwcfname, *origfname, *origwfname, *outfname;
     int i, toret;
-    bool recurse = false;
+    bool recurse = false, verify = false;
 
     if (!backend) {
         not_connected();
@@ -1227,6 +3194,8 @@ int sftp_general_get(struct sftp_command *cmd, bool restart, bool multiple)
             break;
         } else if (!strcmp(cmd->words[i], "-r")) {
             recurse = true;
+        } else if (restart && !strcmp(cmd->words[i], "-c")) {
+            verify = true;
         } else {
             printf("%s: unrecognised option '%s'\n", cmd->words[0], cmd->words[i]);
             return 0;
@@ -1273,7 +3242,8 @@ int sftp_general_get(struct sftp_command *cmd, bool restart, bool multiple)
             else
                 outfname = stripslashes(origwfname, false);
 
-            toret = sftp_get_file(fname, outfname, recurse, restart);
+            toret = sftp_get_file(fname, outfname, recurse, restart,
+                                  verify);
 
             sfree(fname);
 
@@ -1288,10 +3258,16 @@ int sftp_general_get(struct sftp_command *cmd, bool restart, bool multiple)
         if (swcm)
             sftp_finish_wildcard_matching(swcm);
         if (!toret)
-            return toret;
+            break;
 
     } while (multiple && i < cmd->nwords);
 
+    /*
+     * Wait for any transfers still running in the background.
+     */
+    if (!transfer_wait_all())
+        toret = 0;
+
     return toret;
 }
 int sftp_cmd_get(struct sftp_command *cmd)
@@ -1321,7 +3297,7 @@ int sftp_general_put(struct sftp_command *cmd, bool restart, bool multiple)
     char *fname, *wfname, *origoutfname, *outfname;
     int i;
     int toret;
-    bool recurse = false;
+    bool recurse = false, verify = false;
 
     if (!backend) {
         not_connected();
@@ -1336,6 +3312,8 @@ int sftp_general_put(struct sftp_command *cmd, bool restart, bool multiple)
             break;
         } else if (!strcmp(cmd->words[i], "-r")) {
             recurse = true;
+        } else if (restart && !strcmp(cmd->words[i], "-c")) {
+            verify = true;
         } else {
             printf("%s: unrecognised option '%s'\n", cmd->words[0], cmd->words[i]);
             return 0;
@@ -1374,7 +3352,8 @@ int sftp_general_put(struct sftp_command *cmd, bool restart, bool multiple)
                 origoutfname = stripslashes(wfname, true);
 
             outfname = canonify(origoutfname);
-            toret = sftp_put_file(wfname, outfname, recurse, restart);
+            toret = sftp_put_file(wfname, outfname, recurse, restart,
+                                  verify);
             sfree(outfname);
 
             if (wcm) {
@@ -1389,10 +3368,16 @@ int sftp_general_put(struct sftp_command *cmd, bool restart, bool multiple)
             finish_wildcard_matching(wcm);
 
         if (!toret)
-            return toret;
+            break;
 
     } while (multiple && i < cmd->nwords);
 
+    /*
+     * Wait for any transfers still running in the background.
+     */
+    if (!transfer_wait_all())
+        toret = 0;
+
     return toret;
 }
 int sftp_cmd_put(struct sftp_command *cmd)
@@ -1426,6 +3411,13 @@ int sftp_cmd_mkdir(struct sftp_command *cmd)
         return 0;
     }
 
+    if (max_async > 0) {
+        AsyncOp tmpl = { .kind = AO_MKDIR };
+        for (i = 1; i < cmd->nwords; i++)
+            async_add(&tmpl, cmd->words[i]);
+        return 1;
+    }
+
     ret = 1;
     for (i = 1; i < cmd->nwords; i++) {
         dir = canonify(cmd->words[i]);
@@ -1433,6 +3425,7 @@ int sftp_cmd_mkdir(struct sftp_command *cmd)
         req = fxp_mkdir_send(dir, NULL);
         pktin = sftp_wait_for_reply(req);
         result = fxp_mkdir_recv(pktin, req);
+        path_cache_forget(dir);
 
         if (!result) {
             with_stripctrl(san, dir)
@@ -1457,6 +3450,7 @@ static bool sftp_action_rmdir(void *vctx, char *dir)
     req = fxp_rmdir_send(dir);
     pktin = sftp_wait_for_reply(req);
     result = fxp_rmdir_recv(pktin, req);
+    path_cache_forget_tree(dir);
 
     if (!result) {
         printf("rmdir %s: %s\n", dir, fxp_error());
@@ -1483,6 +3477,12 @@ int sftp_cmd_rmdir(struct sftp_command *cmd)
     }
 
     ret = 1;
+    if (max_async > 0) {
+        AsyncOp tmpl = { .kind = AO_RMDIR };
+        for (i = 1; i < cmd->nwords; i++)
+            ret &= async_iterate(cmd->words[i], &tmpl);
+        return ret;
+    }
     for (i = 1; i < cmd->nwords; i++)
         ret &= wildcard_iterate(cmd->words[i], sftp_action_rmdir, NULL);
 
@@ -1498,6 +3498,7 @@ static bool sftp_action_rm(void *vctx, char *fname)
     req = fxp_remove_send(fname);
     pktin = sftp_wait_for_reply(req);
     result = fxp_remove_recv(pktin, req);
+    path_cache_forget_tree(fname);
 
     if (!result) {
         printf("rm %s: %s\n", fname, fxp_error());
@@ -1524,6 +3525,12 @@ int sftp_cmd_rm(struct sftp_command *cmd)
     }
 
     ret = 1;
+    if (max_async > 0) {
+        AsyncOp tmpl = { .kind = AO_RM };
+        for (i = 1; i < cmd->nwords; i++)
+            ret &= async_iterate(cmd->words[i], &tmpl);
+        return ret;
+    }
     for (i = 1; i < cmd->nwords; i++)
         ret &= wildcard_iterate(cmd->words[i], sftp_action_rm, NULL);
 
@@ -1532,14 +3539,10 @@ int sftp_cmd_rm(struct sftp_command *cmd)
 
 static bool check_is_dir(char *dstfname)
 {
-    struct sftp_packet *pktin;
-    struct sftp_request *req;
     struct fxp_attrs attrs;
     bool result;
 
-    req = fxp_stat_send(dstfname);
-    pktin = sftp_wait_for_reply(req);
-    result = fxp_stat_recv(pktin, req, &attrs);
+    result = cached_stat(dstfname, &attrs);
 
     if (result &&
         (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) &&
@@ -1581,6 +3584,8 @@ static bool sftp_action_mv(void *vctx, char *srcfname)
     req = fxp_rename_send(srcfname, finalfname);
     pktin = sftp_wait_for_reply(req);
     result = fxp_rename_recv(pktin, req);
+    path_cache_forget_tree(srcfname);
+    path_cache_forget_tree(finalfname);
 
     error = result ? NULL : fxp_error();
 
@@ -1613,6 +3618,9 @@ int sftp_cmd_mv(struct sftp_command *cmd)
         return 0;
     }
 
+    /* We need to know what the destination is before we start */
+    async_drain();
+
     ctx->dstfname = canonify(cmd->words[cmd->nwords-1]);
 
     /*
@@ -1632,6 +3640,14 @@ int sftp_cmd_mv(struct sftp_command *cmd)
      * Now iterate over the source arguments.
      */
     ret = 1;
+    if (max_async > 0) {
+        AsyncOp tmpl = { .kind = AO_MV, .mvdest = ctx->dstfname,
+                         .dest_is_dir = ctx->dest_is_dir };
+        for (i = 1; i < cmd->nwords-1; i++)
+            ret &= async_iterate(cmd->words[i], &tmpl);
+        sfree(ctx->dstfname);
+        return ret;
+    }
     for (i = 1; i < cmd->nwords-1; i++)
         ret &= wildcard_iterate(cmd->words[i], sftp_action_mv, ctx);
 
@@ -1639,6 +3655,138 @@ int sftp_cmd_mv(struct sftp_command *cmd)
     return ret;
 }
 
+/*
+ * Copy a file without its data leaving the server, using the
+ * copy-data extension. Reuses mv's context, since the two commands
+ * treat their arguments in the same way.
+ */
+static bool sftp_action_cp(void *vctx, char *srcfname)
+{
+    struct sftp_context_mv *ctx = (struct sftp_context_mv *)vctx;
+    struct sftp_packet *pktin;
+    struct sftp_request *req;
+    struct fxp_handle *srcfh, *dstfh;
+    struct fxp_attrs attrs, newattrs;
+    char *finalfname, *newcanon = NULL;
+    bool toret = false;
+
+    if (ctx->dest_is_dir) {
+        char *p;
+        char *newname;
+
+        p = srcfname + strlen(srcfname);
+        while (p > srcfname && p[-1] != '/') p--;
+        newname = dupcat(ctx->dstfname, "/", p);
+        newcanon = canonify(newname);
+        sfree(newname);
+
+        finalfname = newcanon;
+    } else {
+        finalfname = ctx->dstfname;
+    }
+
+    req = fxp_open_send(srcfname, SSH_FXF_READ, NULL);
+    pktin = sftp_wait_for_reply(req);
+    srcfh = fxp_open_recv(pktin, req);
+    if (!srcfh) {
+        printf("cp %s: open for read: %s\n", srcfname, fxp_error());
+        goto out;
+    }
+
+    req = fxp_fstat_send(srcfh);
+    pktin = sftp_wait_for_reply(req);
+    if (fxp_fstat_recv(pktin, req, &attrs) &&
+        (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) &&
+        (attrs.permissions & 0040000)) {
+        printf("cp %s: is a directory\n", srcfname);
+        goto close_src;
+    }
+
+    newattrs.flags = 0;
+    if (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+        PUT_PERMISSIONS(newattrs, attrs.permissions & 07777);
+    req = fxp_open_send(finalfname,
+                        SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC,
+                        &newattrs);
+    pktin = sftp_wait_for_reply(req);
+    dstfh = fxp_open_recv(pktin, req);
+    path_cache_forget(finalfname);
+    if (!dstfh) {
+        with_stripctrl(san, finalfname)
+            printf("cp %s: open for write: %s\n", san, fxp_error());
+        goto close_src;
+    }
+
+    req = fxp_copy_data_send(srcfh, 0, 0, dstfh, 0);
+    pktin = sftp_wait_for_reply(req);
+    if (fxp_copy_data_recv(pktin, req)) {
+        with_stripctrl(san, finalfname)
+            printf("%s -> %s\n", srcfname, san);
+        toret = true;
+    } else {
+        with_stripctrl(san, finalfname)
+            printf("cp %s %s: %s\n", srcfname, san, fxp_error());
+    }
+
+    req = fxp_close_send(dstfh);
+    pktin = sftp_wait_for_reply(req);
+    if (!fxp_close_recv(pktin, req) && toret) {
+        with_stripctrl(san, finalfname)
+            printf("cp %s: close: %s\n", san, fxp_error());
+        toret = false;
+    }
+
+  close_src:
+    req = fxp_close_send(srcfh);
+    pktin = sftp_wait_for_reply(req);
+    fxp_close_recv(pktin, req);
+
+  out:
+    sfree(newcanon);
+    return toret;
+}
+
+int sftp_cmd_cp(struct sftp_command *cmd)
+{
+    struct sftp_context_mv ctx[1];
+    int i, ret;
+
+    if (!backend) {
+        not_connected();
+        return 0;
+    }
+
+    if (cmd->nwords < 3) {
+        printf("cp: expects two filenames\n");
+        return 0;
+    }
+
+    if (!fxp_server_has_extension("copy-data")) {
+        printf("cp: server does not support copying files remotely\n");
+        return 0;
+    }
+
+    async_drain();
+
+    ctx->dstfname = canonify(cmd->words[cmd->nwords-1]);
+
+    /* The same rule for multiple sources as in mv */
+    ctx->dest_is_dir = check_is_dir(ctx->dstfname);
+    if ((cmd->nwords > 3 || is_wildcard(cmd->words[1])) && !ctx->dest_is_dir) {
+        printf("cp: multiple or wildcard arguments require the destination"
+               " to be a directory\n");
+        sfree(ctx->dstfname);
+        return 0;
+    }
+
+    ret = 1;
+    for (i = 1; i < cmd->nwords-1; i++)
+        ret &= wildcard_iterate(cmd->words[i], sftp_action_cp, ctx);
+
+    sfree(ctx->dstfname);
+    return ret;
+}
+
 struct sftp_context_chmod {
     unsigned attrs_clr, attrs_xor;
 };
@@ -1652,9 +3800,7 @@ static bool sftp_action_chmod(void *vctx, char *fname)
     unsigned oldperms, newperms;
     struct sftp_context_chmod *ctx = (struct sftp_context_chmod *)vctx;
 
-    req = fxp_stat_send(fname);
-    pktin = sftp_wait_for_reply(req);
-    result = fxp_stat_recv(pktin, req, &attrs);
+    result = cached_stat(fname, &attrs);
 
     if (!result || !(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
         printf("get attrs for %s: %s\n", fname,
@@ -1674,6 +3820,7 @@ static bool sftp_action_chmod(void *vctx, char *fname)
     req = fxp_setstat_send(fname, attrs);
     pktin = sftp_wait_for_reply(req);
     result = fxp_setstat_recv(pktin, req);
+    path_cache_forget(fname);
 
     if (!result) {
         printf("set attrs for %s: %s\n", fname, fxp_error());
@@ -1807,6 +3954,13 @@ int sftp_cmd_chmod(struct sftp_command *cmd)
     }
 
     ret = 1;
+    if (max_async > 0) {
+        AsyncOp tmpl = { .kind = AO_CHMOD, .attrs_clr = ctx->attrs_clr,
+                         .attrs_xor = ctx->attrs_xor };
+        for (i = 2; i < cmd->nwords; i++)
+            ret &= async_iterate(cmd->words[i], &tmpl);
+        return ret;
+    }
     for (i = 2; i < cmd->nwords; i++)
         ret &= wildcard_iterate(cmd->words[i], sftp_action_chmod, ctx);
 
@@ -1968,6 +4122,19 @@ static struct sftp_cmd_lookup {
             "  session, to the same server or to a different one.\n",
             sftp_cmd_close
     },
+    {
+        "cp", true, "copy file(s) on the remote server",
+            " <source> [ <source>... ] <destination>\n"
+            "  Copies <source>(s) on the server to <destination>, also on\n"
+            "  the server, without the data passing through PSFTP. This\n"
+            "  needs a server that supports the \"copy-data\" extension.\n"
+            "  If <destination> specifies an existing directory, then <source>\n"
+            "  may be a wildcard, and multiple <source>s may be given; all\n"
+            "  source files are copied into <destination>.\n"
+            "  Otherwise, <source> must specify a single file, which is copied\n"
+            "  to the name <destination>.\n",
+            sftp_cmd_cp
+    },
     {
         "del", true, "delete files on the remote server",
             " <filename-or-wildcard> [ <filename-or-wildcard>... ]\n"
@@ -1979,12 +4146,14 @@ static struct sftp_cmd_lookup {
     },
     {
         "dir", true, "list remote files",
-            " [ <directory-name> ]/[ <wildcard> ]\n"
+            " [ -U ] [ <directory-name> ]/[ <wildcard> ]\n"
             "  List the contents of a specified directory on the server.\n"
             "  If <directory-name> is not given, the current working directory\n"
             "  is assumed.\n"
             "  If <wildcard> is given, it is treated as a set of files to\n"
-            "  list; otherwise, all files are listed.\n",
+            "  list; otherwise, all files are listed.\n"
+            "  If -U is specified, files are listed unsorted, as soon as the\n"
+            "  server sends them.\n",
             sftp_cmd_ls
     },
     {
@@ -2089,11 +4258,14 @@ static struct sftp_cmd_lookup {
     },
     {
         "reget", true, "continue downloading files",
-            " [ -r ] [ -- ] <filename> [ <local-filename> ]\n"
+            " [ -r ] [ -c ] [ -- ] <filename> [ <local-filename> ]\n"
             "  Works exactly like the \"get\" command, but the local file\n"
             "  must already exist. The download will begin at the end of the\n"
             "  file. This is for resuming a download that was interrupted.\n"
-            "  If -r specified, resume interrupted \"get -r\".\n",
+            "  If -r specified, resume interrupted \"get -r\".\n"
+            "  If -c specified, first check the existing part of the file\n"
+            "  against the remote one (if the server supports this), and\n"
+            "  download again any parts that differ.\n",
             sftp_cmd_reget
     },
     {
@@ -2106,11 +4278,14 @@ static struct sftp_cmd_lookup {
     },
     {
         "reput", true, "continue uploading files",
-            " [ -r ] [ -- ] <filename> [ <remote-filename> ]\n"
+            " [ -r ] [ -c ] [ -- ] <filename> [ <remote-filename> ]\n"
             "  Works exactly like the \"put\" command, but the remote file\n"
             "  must already exist. The upload will begin at the end of the\n"
             "  file. This is for resuming an upload that was interrupted.\n"
-            "  If -r specified, resume interrupted \"put -r\".\n",
+            "  If -r specified, resume interrupted \"put -r\".\n"
+            "  If -c specified, first check the existing part of the file\n"
+            "  against the local one (if the server supports this), and\n"
+            "  upload again any parts that differ.\n",
             sftp_cmd_reput
     },
     {
@@ -2381,6 +4556,19 @@ static void do_sftp_cleanup(void)
         sfree(homedir);
         homedir = NULL;
     }
+    path_cache_flush();
+}
+
+/*
+ * Whether a command can be left running asynchronously while we go
+ * on to the next one.
+ */
+static bool cmd_is_async(struct sftp_command *cmd)
+{
+    return max_async > 0 &&
+        (cmd->obey == sftp_cmd_rm || cmd->obey == sftp_cmd_rmdir ||
+         cmd->obey == sftp_cmd_mkdir || cmd->obey == sftp_cmd_chmod ||
+         cmd->obey == sftp_cmd_mv);
 }
 
 int do_sftp(int mode, int modeflags, char *batchfile)
@@ -2403,6 +4591,9 @@ int do_sftp(int mode, int modeflags, char *batchfile)
                 break;
             ret = cmd->obey(cmd);
             sftp_cmd_free(cmd);
+            /* finish before the next prompt, so the output isn't mixed */
+            async_drain();
+            async_check();
             if (ret < 0)
                 break;
         }
@@ -2418,8 +4609,24 @@ int do_sftp(int mode, int modeflags, char *batchfile)
             cmd = sftp_getcmd(fp, mode, modeflags);
             if (!cmd)
                 break;
+            if (!cmd_is_async(cmd)) {
+                async_drain();
+                if (!async_check() && !(modeflags & 2)) {
+                    /* stop before this command, as sync mode would have */
+                    sftp_cmd_free(cmd);
+                    ret = 0;
+                    break;
+                }
+            }
             ret = cmd->obey(cmd);
             sftp_cmd_free(cmd);
+            /*
+             * An asynchronous operation from this command or an
+             * earlier one might have failed meanwhile. Treat that as
+             * if this command had failed.
+             */
+            if (!async_check() && ret > 0)
+                ret = 0;
             if (ret < 0)
                 break;
             if (ret == 0) {
@@ -2427,6 +4634,9 @@ int do_sftp(int mode, int modeflags, char *batchfile)
                     break;
             }
         }
+        async_drain();
+        if (!async_check() && ret > 0)
+            ret = 0;
         fclose(fp);
         /*
          * In batch mode, and if exit on command failure is enabled,
@@ -2525,6 +4735,10 @@ static void usage(void)
     printf("  -b file   use specified batchfile\n");
     printf("  -bc       output batchfile commands\n");
     printf("  -be       don't stop batchfile processing if errors\n");
+    printf("  -parallel n  run up to n file transfers at once\n");
+    printf("  -stripes n   split large files into up to n parallel parts\n");
+    printf("  -async n     run up to n rm/mkdir/chmod/mv requests at once\n");
+    printf("  -stats    show where the time went in each file transfer\n");
     printf("  -v        show verbose messages\n");
     printf("  -load sessname  Load settings from saved session\n");
     printf("  -l user   connect with specified username\n");
@@ -2546,6 +4760,8 @@ static void usage(void)
     printf("  -sshlog file\n");
     printf("  -sshrawlog file\n");
     printf("            log protocol details to a file\n");
+    printf("  -tracefile file\n");
+    printf("            record an event-loop trace to a file\n");
     cleanup_exit(1);
 }
 
@@ -2722,6 +4938,9 @@ static int psftp_connect(char *userhost, char *user, int portnumber)
                  "exec sftp-server");
     conf_set_bool(conf, CONF_ssh_subsys2, false);
 
+    xfer_set_window_limit(
+        parse_blocksize(conf_get_str(conf, CONF_sftp_max_window)));
+
     psftp_logctx = log_init(console_cli_logpolicy, conf);
 
     platform_psftp_pre_conn_setup(console_cli_logpolicy);
@@ -2829,6 +5048,20 @@ int psftp_main(int argc, char *argv[])
             modeflags = modeflags | 1;
         } else if (strcmp(argv[i], "-be") == 0) {
             modeflags = modeflags | 2;
+        } else if (strcmp(argv[i], "-parallel") == 0 && i + 1 < argc) {
+            max_transfers = atoi(argv[++i]);
+            if (max_transfers < 1)
+                cmdline_error("-parallel expects a positive number");
+        } else if (strcmp(argv[i], "-stripes") == 0 && i + 1 < argc) {
+            max_stripes = atoi(argv[++i]);
+            if (max_stripes < 1)
+                cmdline_error("-stripes expects a positive number");
+        } else if (strcmp(argv[i], "-async") == 0 && i + 1 < argc) {
+            max_async = atoi(argv[++i]);
+            if (max_async < 1)
+                cmdline_error("-async expects a positive number");
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            transfer_stats = true;
         } else if (strcmp(argv[i], "-sanitise-stderr") == 0) {
             sanitise_stderr = true;
         } else if (strcmp(argv[i], "-no-sanitise-stderr") == 0) {
@@ -97,19 +97,47 @@ RFile *open_existing_file(const char *name, uint64_t *size,
 WFile *open_existing_wfile(const char *name, uint64_t *size);
 /* Returns <0 on error, 0 on eof, or number of bytes read, as usual */
 int read_from_file(RFile *f, void *buffer, int length);
+/* Like read_from_file, but reads at the given offset, independently of
+ * (and not necessarily moving) the file position. Rather than copying
+ * into a buffer of the caller's, it points *data at the data itself,
+ * usually in a memory mapping of the file; that pointer is good until
+ * the next such read or until the file is closed. */
+int read_from_file_mapped(RFile *f, uint64_t offset,
+                          const void **data, int length);
 /* Closes and frees the RFile */
 void close_rfile(RFile *f);
 WFile *open_new_file(const char *name, long perms);
 /* Returns <0 on error, 0 on eof, or number of bytes written, as usual */
 int write_to_file(WFile *f, void *buffer, int length);
+/* Like write_to_file, but writes at the given offset in the file,
+ * independently of (and not necessarily moving) the file position */
+int write_to_file_at(WFile *f, uint64_t offset, void *buffer, int length);
+/* Whether write_to_file_at can be used at all. It can't on a pipe,
+ * terminal or the like, which can only be written in order. */
+bool wfile_can_write_at(WFile *f);
+/* Cut the file off at the given size. Returns 0 on success */
+int truncate_file(WFile *f, uint64_t size);
 void set_file_times(WFile *f, unsigned long mtime, unsigned long atime);
-/* Closes and frees the WFile */
-void close_wfile(WFile *f);
+/* Closes and frees the WFile. Returns 0 on success, or <0 if any
+ * write turned out to have failed (writes may complete after
+ * write_to_file has returned) */
+int close_wfile(WFile *f);
 /* Seek offset bytes through file */
 enum { FROM_START, FROM_CURRENT, FROM_END };
 int seek_file(WFile *f, uint64_t offset, int whence);
 /* Get file position */
 uint64_t get_file_posn(WFile *f);
+/*
+ * Find the first stretch of data at or after offset in a possibly
+ * sparse file, without moving the file position: *start is where it
+ * begins and *end is where the next hole does. If there's nothing but
+ * hole from offset onwards, both are set to the file size. Returns
+ * false if the OS can't tell us, in which case treat it all as data.
+ */
+bool find_file_data(RFile *f, uint64_t offset,
+                    uint64_t *start, uint64_t *end);
+/* Let the OS know we may leave holes in a file we're writing */
+void set_file_sparse(WFile *f);
 /*
  * Determine the type of a file: nonexistent, file, directory or
  * weird. `weird' covers anything else - named pipes, Unix sockets,
@@ -208,14 +236,34 @@ char *stripslashes(const char *str, bool local);
  */
 int sftp_name_compare(const void *av, const void *bv);
 
+/*
+ * Check whether a block of data is entirely zero, so that a download
+ * can leave a hole in the local file instead of writing it.
+ */
+bool is_all_zero(const void *data, size_t len);
+
+/*
+ * Print what a -stats run found out about one file transfer: xs may
+ * be NULL if it wasn't done over SFTP. The other figures, in ticks,
+ * are how long the SSH channel window and the SSH socket held up
+ * outgoing data during the transfer, and how long was spent writing
+ * to the local disk.
+ */
+struct fxp_xfer_stats; /* in sftp.h */
+void print_transfer_stats(const struct fxp_xfer_stats *xs,
+                          unsigned long window, unsigned long socket,
+                          unsigned long disk);
+
 /*
  * Shared code for outputting a directory listing in response to a
  * stream of name structures from FXP_READDIR operations. Used by
- * psftp's ls command and pscp -ls.
+ * psftp's ls command and pscp -ls. If 'sort' is false, each name is
+ * printed as soon as it's fed in, rather than being held back to
+ * sort the whole listing.
  */
 struct list_directory_from_sftp_ctx;
 struct fxp_name; /* in sftp.h */
-struct list_directory_from_sftp_ctx *list_directory_from_sftp_new(void);
+struct list_directory_from_sftp_ctx *list_directory_from_sftp_new(bool sort);
 void list_directory_from_sftp_feed(struct list_directory_from_sftp_ctx *ctx,
                                    struct fxp_name *name);
 void list_directory_from_sftp_finish(struct list_directory_from_sftp_ctx *ctx);
@@ -224,4 +272,10 @@ void list_directory_from_sftp_free(struct list_directory_from_sftp_ctx *ctx);
 void list_directory_from_sftp_warn_unsorted(void);
 void list_directory_from_sftp_print(struct fxp_name *name);
 
+/*
+ * How many FXP_READDIR requests a directory listing keeps
+ * outstanding at once.
+ */
+#define LIST_DIRECTORY_READDIRS 4
+
 #endif /* PUTTY_PSFTP_H */
@@ -24,18 +24,63 @@ int sftp_name_compare(const void *av, const void *bv)
     return strcmp((*a)->filename, (*b)->filename);
 }
 
+bool is_all_zero(const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    return len > 0 && p[0] == 0 && !memcmp(p, p + 1, len - 1);
+}
+
+static uint64_t ticks_to_ms(unsigned long ticks)
+{
+    return (uint64_t)ticks * 1000 / TICKSPERSEC;
+}
+
+void print_transfer_stats(const struct fxp_xfer_stats *xs,
+                          unsigned long window, unsigned long socket,
+                          unsigned long disk)
+{
+    static const char *const rtt_names[XFER_RTT_BUCKETS] = {
+        "<1ms", "<4ms", "<16ms", "<64ms", "<256ms", "<1024ms", "<4096ms",
+        "longer",
+    };
+
+    if (xs) {
+        printf("  %lu requests, %"PRIu64" bytes;"
+               " in flight: max %"SIZEu", mean %"PRIu64"\n",
+               xs->requests, xs->bytes, xs->max_inflight,
+               xs->sends ? xs->inflight_total / xs->sends : 0);
+        if (xs->requests) {
+            printf("  reply latency: min %"PRIu64"ms, mean %"PRIu64"ms,"
+                   " max %"PRIu64"ms\n", ticks_to_ms(xs->rtt_min),
+                   ticks_to_ms(xs->rtt_total / xs->requests),
+                   ticks_to_ms(xs->rtt_max));
+            printf("   ");
+            for (int i = 0; i < XFER_RTT_BUCKETS; i++)
+                printf(" %s:%lu", rtt_names[i], xs->rtt_hist[i]);
+            printf("\n");
+        }
+        printf("  held up by SFTP window %"PRIu64"ms,"
+               " SSH backlog %"PRIu64"ms\n",
+               ticks_to_ms(xs->window_full), ticks_to_ms(xs->backlogged));
+    }
+    printf("  SSH channel window closed %"PRIu64"ms,"
+           " socket backed up %"PRIu64"ms\n",
+           ticks_to_ms(window), ticks_to_ms(socket));
+    printf("  local disk writes %"PRIu64"ms\n", ticks_to_ms(disk));
+}
+
 struct list_directory_from_sftp_ctx {
     size_t nnames, namesize, total_memory;
     struct fxp_name **names;
     bool sorting;
 };
 
-struct list_directory_from_sftp_ctx *list_directory_from_sftp_new(void)
+struct list_directory_from_sftp_ctx *list_directory_from_sftp_new(bool sort)
 {
     struct list_directory_from_sftp_ctx *ctx =
         snew(struct list_directory_from_sftp_ctx);
     memset(ctx, 0, sizeof(*ctx));
-    ctx->sorting = true;
+    ctx->sorting = sort;
     return ctx;
 }
 
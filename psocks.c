@@ -42,6 +42,7 @@ struct psocks_state {
     const PsocksPlatform *platform;
     int listen_port;
     bool acceptall;
+    int dns_cache_ttl;
     PortFwdManager *portfwdmgr;
     uint64_t next_conn_index;
     FILE *logging_fp;
@@ -50,6 +51,19 @@ struct psocks_state {
     char *rec_cmd;
     strbuf *subcmd;
 
+    /*
+     * Connections beyond max_connections (if nonzero) wait in a
+     * queue, without any outgoing socket, until an active one closes.
+     */
+    int max_connections;
+    size_t nactive, nqueued;
+    psocks_connection *queue_head, *queue_tail;
+
+    /* Traffic counters, and the periodic report of them */
+    uint64_t bytes[2], bytes_reported[2];
+    int stats_interval;
+    unsigned long stats_next;
+
     ConnectionLayer cl;
 };
 
@@ -59,8 +73,11 @@ struct psocks_connection {
     char *host, *realhost;
     int port;
     SockAddr *addr;
+    NameLookup *lookup;
     Socket *socket;
     bool connecting, eof_pfmgr_to_socket, eof_socket_to_pfmgr;
+    bool relaying, queued;
+    psocks_connection *queue_prev, *queue_next;
     uint64_t index;
     PsocksDataSink *rec_sink;
 
@@ -248,17 +265,69 @@ static SshChannel *psocks_lportfwd_open(
       default:
         break;
     }
-    queue_toplevel_callback(psocks_connection_establish, conn);
+
+    if (ps->max_connections && ps->nactive >= ps->max_connections) {
+        conn->queued = true;
+        conn->queue_prev = ps->queue_tail;
+        conn->queue_next = NULL;
+        if (ps->queue_tail)
+            ps->queue_tail->queue_next = conn;
+        else
+            ps->queue_head = conn;
+        ps->queue_tail = conn;
+        ps->nqueued++;
+        if (conn->ps->log_flags & LOG_CONNSTATUS)
+            psocks_conn_log(conn, "queued behind %"SIZEu" others",
+                            ps->nqueued - 1);
+    } else {
+        ps->nactive++;
+        queue_toplevel_callback(psocks_connection_establish, conn);
+    }
     return &conn->sc;
 }
 
+static void psocks_unqueue(psocks_connection *conn)
+{
+    psocks_state *ps = conn->ps;
+
+    if (conn->queue_prev)
+        conn->queue_prev->queue_next = conn->queue_next;
+    else
+        ps->queue_head = conn->queue_next;
+    if (conn->queue_next)
+        conn->queue_next->queue_prev = conn->queue_prev;
+    else
+        ps->queue_tail = conn->queue_prev;
+    conn->queued = false;
+    ps->nqueued--;
+}
+
 static void psocks_conn_free(psocks_connection *conn)
 {
+    psocks_state *ps = conn->ps;
+
     if (conn->ps->log_flags & LOG_CONNSTATUS)
         psocks_conn_log(conn, "closed");
 
+    if (conn->queued) {
+        psocks_unqueue(conn);
+    } else {
+        ps->nactive--;
+
+        /* Let the next waiting connection have our place */
+        if (ps->queue_head &&
+            (!ps->max_connections || ps->nactive < ps->max_connections)) {
+            psocks_connection *next = ps->queue_head;
+            psocks_unqueue(next);
+            ps->nactive++;
+            queue_toplevel_callback(psocks_connection_establish, next);
+        }
+    }
+
     sfree(conn->host);
     sfree(conn->realhost);
+    if (conn->lookup)
+        sk_namelookup_cancel(conn->lookup);
     if (conn->socket)
         sk_close(conn->socket);
     if (conn->chan)
@@ -269,15 +338,8 @@ static void psocks_conn_free(psocks_connection *conn)
     sfree(conn);
 }
 
-static void psocks_connection_establish(void *vctx)
+static void psocks_connection_connect(psocks_connection *conn)
 {
-    psocks_connection *conn = (psocks_connection *)vctx;
-
-    /*
-     * Look up destination host name.
-     */
-    conn->addr = sk_namelookup(conn->host, &conn->realhost, ADDRTYPE_UNSPEC);
-
     const char *err = sk_addr_error(conn->addr);
     if (err) {
         char *msg = dupprintf("name lookup failed: %s", err);
@@ -293,7 +355,37 @@ static void psocks_connection_establish(void *vctx)
      */
     conn->connecting = true;
     conn->socket = sk_new(conn->addr, conn->port, false, false, false, false,
-                          &conn->plug);
+                          0, &conn->plug);
+}
+
+static void psocks_lookup_done(void *vctx, SockAddr *addr, char *realhost)
+{
+    psocks_connection *conn = (psocks_connection *)vctx;
+
+    conn->lookup = NULL;
+    sk_namelookup_add_to_cache(conn->host, ADDRTYPE_UNSPEC,
+                               conn->ps->dns_cache_ttl, addr, realhost);
+    conn->addr = addr;
+    conn->realhost = realhost;
+    psocks_connection_connect(conn);
+}
+
+static void psocks_connection_establish(void *vctx)
+{
+    psocks_connection *conn = (psocks_connection *)vctx;
+
+    /*
+     * Look up destination host name, in the background unless we
+     * remember it already.
+     */
+    conn->addr = sk_namelookup_from_cache(conn->host, &conn->realhost,
+                                          ADDRTYPE_UNSPEC,
+                                          conn->ps->dns_cache_ttl);
+    if (conn->addr)
+        psocks_connection_connect(conn);
+    else
+        conn->lookup = sk_namelookup_start(conn->host, ADDRTYPE_UNSPEC,
+                                           psocks_lookup_done, conn);
 }
 
 static size_t psocks_sc_write(SshChannel *sc, bool is_stderr,
@@ -303,6 +395,7 @@ static size_t psocks_sc_write(SshChannel *sc, bool is_stderr,
     if (!conn->socket) return 0;
 
     psocks_conn_log_data(conn, UP, data, len);
+    conn->ps->bytes[UP] += len;
 
     return sk_write(conn->socket, data, len);
 }
@@ -318,6 +411,12 @@ static void psocks_check_close(void *vctx)
 static void psocks_sc_write_eof(SshChannel *sc)
 {
     psocks_connection *conn = container_of(sc, psocks_connection, sc);
+    if (conn->queued) {
+        /* The client gave up before we even started on its request */
+        conn->eof_pfmgr_to_socket = conn->eof_socket_to_pfmgr = true;
+        queue_toplevel_callback(psocks_check_close, conn);
+        return;
+    }
     if (!conn->socket) return;
     sk_write_eof(conn->socket);
     conn->eof_pfmgr_to_socket = true;
@@ -331,8 +430,64 @@ static void psocks_sc_write_eof(SshChannel *sc)
 static void psocks_sc_initiate_close(SshChannel *sc, const char *err)
 {
     psocks_connection *conn = container_of(sc, psocks_connection, sc);
+    if (conn->lookup) {
+        sk_namelookup_cancel(conn->lookup);
+        conn->lookup = NULL;
+    }
+    if (conn->socket)
+        sk_close(conn->socket);
+    conn->socket = NULL;
+}
+
+/*
+ * Once a connection is up, and we're not recording or logging its
+ * contents, there's no need for its data to pass through the channel
+ * and socket layers at all: if the platform can relay it directly
+ * (on Linux, without even copying it into user space), we hand it
+ * over. We do that at the first moment when neither side has any
+ * data buffered, since those buffers would be lost.
+ */
+static void psocks_relay_done(void *vctx, const char *err)
+{
+    psocks_connection *conn = (psocks_connection *)vctx;
+    if (err && (conn->ps->log_flags & LOG_CONNSTATUS))
+        psocks_conn_log(conn, "relay error: %s", err);
+    psocks_conn_free(conn);
+}
+
+static void psocks_try_relay(void *vctx)
+{
+    psocks_connection *conn = (psocks_connection *)vctx;
+    Socket *client;
+
+    if (conn->relaying || conn->connecting || !conn->socket ||
+        !conn->chan || conn->rec_sink ||
+        (conn->ps->log_flags & LOG_DIALOGUE) ||
+        !conn->ps->platform->start_relay ||
+        conn->eof_pfmgr_to_socket || conn->eof_socket_to_pfmgr)
+        return;
+
+    if (sk_write(conn->socket, NULL, 0) > 0)
+        return;                        /* wait for psocks_plug_sent */
+    if (!(client = portfwd_idle_socket(conn->chan)))
+        return;                        /* wait for psocks_sc_unthrottle */
+
+    if (!conn->ps->platform->start_relay(client, conn->socket,
+                                         conn->ps->bytes,
+                                         psocks_relay_done, conn))
+        return;
+
+    conn->relaying = true;
+    if (conn->ps->log_flags & LOG_CONNSTATUS)
+        psocks_conn_log(conn, "relaying directly");
+
+    /* The relay has the connections now, so dispose of everything
+     * else, including any callbacks still pending for it */
+    chan_free(conn->chan);
+    conn->chan = NULL;
     sk_close(conn->socket);
     conn->socket = NULL;
+    delete_callbacks_for_context(conn);
 }
 
 static void psocks_sc_unthrottle(SshChannel *sc, size_t bufsize)
@@ -340,6 +495,8 @@ static void psocks_sc_unthrottle(SshChannel *sc, size_t bufsize)
     psocks_connection *conn = container_of(sc, psocks_connection, sc);
     if (bufsize < BUFLIMIT)
 	sk_set_frozen(conn->socket, false);
+    if (bufsize == 0)
+        queue_toplevel_callback(psocks_try_relay, conn);
 }
 
 static void psocks_plug_log(Plug *plug, PlugLogType type, SockAddr *addr,
@@ -368,6 +525,13 @@ static void psocks_plug_log(Plug *plug, PlugLogType type, SockAddr *addr,
         if (conn->connecting) {
             chan_open_confirmation(conn->chan);
             conn->connecting = false;
+            queue_toplevel_callback(psocks_try_relay, conn);
+
+            /* We've no further use for the names, so don't keep them
+             * around for the life of the connection */
+            sfree(conn->host);
+            sfree(conn->realhost);
+            conn->host = conn->realhost = NULL;
         }
         break;
       case PLUGLOG_PROXY_MSG:
@@ -406,12 +570,40 @@ static void psocks_plug_receive(Plug *plug, int urgent,
     sk_set_frozen(conn->socket, bufsize > BUFLIMIT);
 
     psocks_conn_log_data(conn, DN, data, len);
+    conn->ps->bytes[DN] += len;
 }
 
 static void psocks_plug_sent(Plug *plug, size_t bufsize)
 {
     psocks_connection *conn = container_of(plug, psocks_connection, plug);
     sk_set_frozen(conn->socket, bufsize > BUFLIMIT);
+    if (bufsize == 0)
+        queue_toplevel_callback(psocks_try_relay, conn);
+}
+
+static void psocks_stats_timer(void *ctx, unsigned long now)
+{
+    psocks_state *ps = (psocks_state *)ctx;
+    uint64_t rate[2];
+
+    if (now != ps->stats_next)
+        return;
+
+    for (size_t i = 0; i < 2; i++) {
+        rate[i] = (ps->bytes[i] - ps->bytes_reported[i]) / ps->stats_interval;
+        ps->bytes_reported[i] = ps->bytes[i];
+    }
+
+    if (ps->logging_fp) {
+        fprintf(ps->logging_fp, "stats: %"SIZEu" active, %"SIZEu" queued, "
+                "%"PRIu64" total; %"PRIu64" bytes/sec sent, "
+                "%"PRIu64" bytes/sec received\n", ps->nactive, ps->nqueued,
+                ps->next_conn_index, rate[UP], rate[DN]);
+        fflush(ps->logging_fp);
+    }
+
+    ps->stats_next = schedule_timer(ps->stats_interval * TICKSPERSEC,
+                                    psocks_stats_timer, ps);
 }
 
 psocks_state *psocks_new(const PsocksPlatform *platform)
@@ -460,6 +652,30 @@ void psocks_cmdline(psocks_state *ps, int argc, char **argv)
 		ps->log_flags |= LOG_DIALOGUE;
             } else if (!strcmp(p, "-f")) {
 		ps->rec_dest = REC_FILE;
+            } else if (!strcmp(p, "--dns-cache")) {
+		if (--argc > 0) {
+		    ps->dns_cache_ttl = atoi(*++argv);
+		} else {
+		    fprintf(stderr, "psocks: expected an argument to "
+                            "'--dns-cache'\n");
+		    exit(1);
+		}
+            } else if (!strcmp(p, "--max-connections")) {
+		if (--argc > 0) {
+		    ps->max_connections = atoi(*++argv);
+		} else {
+		    fprintf(stderr, "psocks: expected an argument to "
+                            "'--max-connections'\n");
+		    exit(1);
+		}
+            } else if (!strcmp(p, "--stats")) {
+		if (--argc > 0) {
+		    ps->stats_interval = atoi(*++argv);
+		} else {
+		    fprintf(stderr, "psocks: expected an argument to "
+                            "'--stats'\n");
+		    exit(1);
+		}
             } else if (!strcmp(p, "-p")) {
                 if (!ps->platform->open_pipes) {
 		    fprintf(stderr, "psocks: '-p' is not supported on this "
@@ -487,8 +703,9 @@ void psocks_cmdline(psocks_state *ps, int argc, char **argv)
                 printf("usage: psocks [ -d | -f");
                 if (ps->platform->open_pipes)
                     printf(" | -p pipe-cmd");
-                printf(" ] [ -g ] port-number");
-                printf("\n");
+                printf(" ] [ -g ] [ --dns-cache secs ]\n"
+                       "              [ --max-connections n ] [ --stats secs ]"
+                       " port-number\n");
                 printf("where: -d           log all connection contents to"
                        " standard output\n");
                 printf("       -f           record each half-connection to "
@@ -498,6 +715,12 @@ void psocks_cmdline(psocks_state *ps, int argc, char **argv)
                            " to 'pipe-cmd [in|out] N'\n");
                 printf("       -g           accept connections from anywhere,"
                        " not just localhost\n");
+                printf("       --dns-cache secs  reuse host name lookups for"
+                       " this long\n");
+                printf("       --max-connections n  queue connections beyond"
+                       " this many at once\n");
+                printf("       --stats secs  report connection counts and"
+                       " throughput this often\n");
                 if (ps->platform->start_subcommand)
                     printf("       --exec subcmd [args...]   run command, and "
                            "terminate when it exits\n");
@@ -538,6 +761,10 @@ void psocks_start(psocks_state *ps)
     if (ps->subcmd->len)
         ps->platform->start_subcommand(ps->subcmd);
 
+    if (ps->stats_interval > 0)
+        ps->stats_next = schedule_timer(ps->stats_interval * TICKSPERSEC,
+                                        psocks_stats_timer, ps);
+
     conf_free(conf);
 }
 
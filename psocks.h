@@ -20,6 +20,20 @@ struct PsocksPlatform {
         const char *cmd, const char *const *direction_args,
         const char *index_arg, char **err);
     void (*start_subcommand)(strbuf *args);
+
+    /*
+     * Take over the traffic between two connected sockets, passing
+     * data each way until both directions have seen EOF, then call
+     * done (with an error message if it stopped for some other
+     * reason). bytes[UP] and bytes[DN] are incremented by the amount
+     * of data passed from s1 to s2 and from s2 to s1 respectively. On success, the caller should close both Sockets
+     * straight away, without them having read or written anything
+     * further. Returns false if the platform can't relay these
+     * particular sockets.
+     */
+    bool (*start_relay)(Socket *s1, Socket *s2, uint64_t *bytes,
+                        void (*done)(void *ctx, const char *err),
+                        void *ctx);
 };
 
 psocks_state *psocks_new(const PsocksPlatform *);
@@ -195,6 +195,7 @@ typedef enum {
      */
     SS_REKEY,  /* trigger an immediate repeat key exchange */
     SS_XCERT,  /* cross-certify another host key ('arg' indicates which) */
+    SS_COUNTERS, /* write the connection's running totals to the Event Log */
 
     /*
      * Send a POSIX-style signal. (Useful in SSH and also pterm.)
@@ -326,6 +327,7 @@ enum {
     CIPHER_DES,
     CIPHER_ARCFOUR,
     CIPHER_CHACHA20,
+    CIPHER_AESGCM,                     /* (SSH-2 only) */
     CIPHER_MAX                         /* no. ciphers (inc warn) */
 };
 
@@ -347,7 +349,7 @@ enum {
      * Proxy types.
      */
     PROXY_NONE, PROXY_SOCKS4, PROXY_SOCKS5,
-    PROXY_HTTP, PROXY_TELNET, PROXY_CMD, PROXY_FUZZ
+    PROXY_HTTP, PROXY_TELNET, PROXY_CMD, PROXY_SSH, PROXY_FUZZ
 };
 
 enum {
@@ -733,6 +735,14 @@ struct SeatVtable {
      */
     size_t (*output)(Seat *seat, bool is_stderr, const void *data, size_t len);
 
+    /*
+     * Notify the seat that the backend's buffer of data sent from
+     * the seat's input side may have shrunk. 'bufsize' is the new
+     * size, as backend_sendbuffer() would return it. Seats which poll
+     * backend_sendbuffer() in their own event loop can ignore this.
+     */
+    void (*sent)(Seat *seat, size_t bufsize);
+
     /*
      * Called when the back end wants to indicate that EOF has arrived
      * on the server-to-client stream. Returns false to indicate that
@@ -947,6 +957,8 @@ struct SeatVtable {
 static inline size_t seat_output(
     Seat *seat, bool err, const void *data, size_t len)
 { return seat->vt->output(seat, err, data, len); }
+static inline void seat_sent(Seat *seat, size_t bufsize)
+{ seat->vt->sent(seat, bufsize); }
 static inline bool seat_eof(Seat *seat)
 { return seat->vt->eof(seat); }
 static inline int seat_get_userpass_input(
@@ -1018,6 +1030,7 @@ static inline size_t seat_stderr_pl(Seat *seat, ptrlen data)
  */
 size_t nullseat_output(
     Seat *seat, bool is_stderr, const void *data, size_t len);
+void nullseat_sent(Seat *seat, size_t bufsize);
 bool nullseat_eof(Seat *seat);
 int nullseat_get_userpass_input(Seat *seat, prompts_t *p, bufchain *input);
 void nullseat_notify_remote_exit(Seat *seat);
@@ -1110,6 +1123,13 @@ struct TermWinVtable {
      * PuTTY itself rather than the far end (defence against end-of-
      * authentication spoofing) */
     void (*draw_trust_sigil)(TermWin *, int x, int y);
+    /* Move the existing contents of rows topline..botline up by
+     * `lines' rows (or down, if negative), by copying pixels rather
+     * than redrawing text. The rows left uncovered needn't be
+     * touched, because the terminal will redraw them next. Returns
+     * false if the front end can't do this, in which case nothing
+     * has been changed. */
+    bool (*scroll_rect)(TermWin *, int topline, int botline, int lines);
     int (*char_width)(TermWin *, int uc);
     void (*free_draw_ctx)(TermWin *);
 
@@ -1121,6 +1141,8 @@ struct TermWinVtable {
 
     void (*bell)(TermWin *, int mode);
 
+    /* attrs and colours are NULL unless CONF_rtf_paste was set when
+     * the selection was made */
     void (*clip_write)(TermWin *, int clipboard, wchar_t *text, int *attrs,
                        truecolour *colours, int len, bool must_deselect);
     void (*clip_request_paste)(TermWin *, int clipboard);
@@ -1164,6 +1186,9 @@ static inline void win_draw_cursor(
 { win->vt->draw_cursor(win, x, y, text, len, attrs, line_attrs, tc); }
 static inline void win_draw_trust_sigil(TermWin *win, int x, int y)
 { win->vt->draw_trust_sigil(win, x, y); }
+static inline bool win_scroll_rect(
+    TermWin *win, int topline, int botline, int lines)
+{ return win->vt->scroll_rect(win, topline, botline, lines); }
 static inline int win_char_width(TermWin *win, int uc)
 { return win->vt->char_width(win, uc); }
 static inline void win_free_draw_ctx(TermWin *win)
@@ -1232,6 +1257,8 @@ NORETURN void cleanup_exit(int);
     X(INT, NONE, port) \
     X(INT, NONE, protocol) /* PROT_SSH, PROT_TELNET etc */ \
     X(INT, NONE, addressfamily) /* ADDRTYPE_IPV[46] or ADDRTYPE_UNSPEC */ \
+    X(INT, NONE, connect_delay) /* ms before trying next address too */ \
+    X(INT, NONE, dns_cache_ttl) /* secs to reuse a name lookup; 0 = never */ \
     X(INT, NONE, close_on_exit) /* FORCE_ON, FORCE_OFF, AUTO */ \
     X(BOOL, NONE, warn_on_close) \
     X(INT, NONE, ping_interval) /* in seconds */ \
@@ -1254,12 +1281,17 @@ NORETURN void cleanup_exit(int);
     X(STR, NONE, remote_cmd2) /* fallback if remote_cmd fails; never loaded or saved */ \
     X(BOOL, NONE, nopty) \
     X(BOOL, NONE, compression) \
+    X(INT, NONE, compression_level) /* 1 (fastest) to 9 (smallest) */ \
     X(INT, INT, ssh_kexlist) \
+    X(BOOL, NONE, ssh_kex_guess) \
+    X(BOOL, NONE, ssh_dh_short_exponent) \
     X(INT, INT, ssh_hklist) \
     X(BOOL, NONE, ssh_prefer_known_hostkeys) \
     X(INT, NONE, ssh_rekey_time) /* in minutes */ \
     X(STR, NONE, ssh_rekey_data) /* string encoding e.g. "100K", "2M", "1G" */ \
     X(BOOL, NONE, tryagent) \
+    X(INT, NONE, agent_key_probes) /* Pageant keys to offer at once */ \
+    X(BOOL, NONE, remember_auth) /* try last successful auth first */ \
     X(BOOL, NONE, agentfwd) \
     X(BOOL, NONE, change_username) /* allow username switching in SSH-2 */ \
     X(INT, INT, ssh_cipherlist) \
@@ -1279,6 +1311,7 @@ NORETURN void cleanup_exit(int);
      */ \
     X(INT, NONE, sshprot) \
     X(BOOL, NONE, ssh2_des_cbc) /* "des-cbc" unrecommended SSH-2 cipher */ \
+    X(BOOL, NONE, ssh_cipher_auto) /* fastest of AES/ChaCha20/GCM first */ \
     X(BOOL, NONE, ssh_no_userauth) /* bypass "ssh-userauth" (SSH-2 only) */ \
     X(BOOL, NONE, ssh_show_banner) /* show USERAUTH_BANNERs (SSH-2 only) */ \
     X(BOOL, NONE, try_tis_auth) \
@@ -1294,6 +1327,8 @@ NORETURN void cleanup_exit(int);
     X(BOOL, NONE, ssh_no_shell) /* avoid running a shell */ \
     X(STR, NONE, ssh_nc_host) /* host to connect to in `nc' mode */ \
     X(INT, NONE, ssh_nc_port) /* port to connect to in `nc' mode */ \
+    /* SFTP options */ \
+    X(STR, NONE, sftp_max_window) /* string encoding e.g. "32M" */ \
     /* Telnet options */ \
     X(STR, NONE, termtype) \
     X(STR, NONE, termspeed) \
@@ -1353,6 +1388,7 @@ NORETURN void cleanup_exit(int);
     X(STR, NONE, wintitle) /* initial window title */ \
     /* Terminal options */ \
     X(INT, NONE, savelines) \
+    X(BOOL, NONE, scrollback_on_disk) \
     X(BOOL, NONE, dec_om) \
     X(BOOL, NONE, wrap_mode) \
     X(BOOL, NONE, lfhascr) \
@@ -1380,8 +1416,12 @@ NORETURN void cleanup_exit(int);
     X(INT, NONE, logxfovr) /* LGXF_OVR, LGXF_APN, LGXF_ASK */ \
     X(BOOL, NONE, logflush) \
     X(BOOL, NONE, logheader) \
+    X(BOOL, NONE, logcompress) /* write the log file gzipped */ \
     X(BOOL, NONE, logomitpass) \
     X(BOOL, NONE, logomitdata) \
+    X(BOOL, NONE, logsetuptiming) \
+    X(BOOL, NONE, logbinary) \
+    X(INT, NONE, logpktmax) /* bytes of each packet to log; 0 = all */ \
     X(BOOL, NONE, hide_mouseptr) \
     X(BOOL, NONE, sunken_edge) \
     X(INT, NONE, window_border) /* in pixels */ \
@@ -1438,6 +1478,8 @@ NORETURN void cleanup_exit(int);
      * should be of the form 'host:port'.                             \
      */ \
     X(STR, STR, portfwd) \
+    /* Keyed as for 'portfwd': "rate[:total[:weight]]" in bytes/sec */ \
+    X(STR, STR, portfwd_limits) \
     /* SSH bug compatibility modes. All FORCE_ON/FORCE_OFF/AUTO */ \
     X(INT, NONE, sshbug_ignore1) \
     X(INT, NONE, sshbug_plainpw1) \
@@ -1458,9 +1500,13 @@ NORETURN void cleanup_exit(int);
      * large window in SSH-2.                                         \
      */ \
     X(BOOL, NONE, ssh_simple) \
+    X(STR, NONE, ssh_max_window) /* largest SSH-2 channel window, e.g. "16M" */ \
+    X(STR, NONE, ssh_buffer_limit) /* total buffered by all channels, e.g. "64M" */ \
     X(BOOL, NONE, ssh_connection_sharing) \
     X(BOOL, NONE, ssh_connection_sharing_upstream) \
     X(BOOL, NONE, ssh_connection_sharing_downstream) \
+    X(INT, NONE, ssh_connection_sharing_persist) /* secs an upstream outlives its own session (Unix Plink only) */ \
+    X(BOOL, NONE, ssh_connection_sharing_stats) /* instead of a session, print an upstream's statistics (Plink only) */ \
     /*
      * ssh_manual_hostkeys is conceptually a set rather than a
      * dictionary: the string subkeys are the important thing, and the
@@ -1559,6 +1605,9 @@ typedef enum NoiseSourceId {
     NOISE_MAX_SOURCES
 } NoiseSourceId;
 void noise_get_heavy(void (*func) (void *, int));
+/* Cheap alternative to noise_get_heavy, fetching seed data from the
+ * OS's own cryptographic RNG. Returns false if there isn't one. */
+bool noise_get_fast(void (*func) (void *, int));
 void noise_get_light(void (*func) (void *, int));
 void noise_regular(void);
 void noise_ultralight(NoiseSourceId id, unsigned long data);
@@ -1616,6 +1665,8 @@ void term_size(Terminal *, int, int, int);
 void term_paint(Terminal *, int, int, int, int, bool);
 void term_scroll(Terminal *, int, int);
 void term_scroll_to_selection(Terminal *, int);
+bool term_find(Terminal *, const wchar_t *text, bool backwards,
+               bool include_current);
 void term_pwron(Terminal *, bool);
 void term_clrsb(Terminal *);
 void term_mouse(Terminal *, Mouse_Button, Mouse_Button, Mouse_Action,
@@ -1732,6 +1783,57 @@ void log_reconfig(LogContext *logctx, Conf *conf);
 void logfopen(LogContext *logctx);
 void logfclose(LogContext *logctx);
 void logtraffic(LogContext *logctx, unsigned char c, int logmode);
+void logtraffic_data(LogContext *logctx, ptrlen data, int logmode);
+
+/*
+ * A LogFilter transforms log data on its way to the file (logging.c
+ * uses one to gzip it). 'write' may hold on to data; 'flush' must
+ * output everything written so far in a form that can be read back
+ * even if the file ends there; 'finish' outputs whatever has to come
+ * at the very end of the file. Each appends its output to 'out'.
+ */
+typedef struct LogFilter LogFilter;
+typedef struct LogFilterVtable LogFilterVtable;
+struct LogFilter {
+    const LogFilterVtable *vt;
+};
+struct LogFilterVtable {
+    void (*write)(LogFilter *lf, ptrlen data, strbuf *out);
+    void (*flush)(LogFilter *lf, strbuf *out);
+    void (*finish)(LogFilter *lf, strbuf *out);
+    void (*free)(LogFilter *lf);
+};
+static inline void logfilter_write(LogFilter *lf, ptrlen data, strbuf *out)
+{ lf->vt->write(lf, data, out); }
+static inline void logfilter_flush(LogFilter *lf, strbuf *out)
+{ lf->vt->flush(lf, out); }
+static inline void logfilter_finish(LogFilter *lf, strbuf *out)
+{ lf->vt->finish(lf, out); }
+static inline void logfilter_free(LogFilter *lf)
+{ lf->vt->free(lf); }
+
+/*
+ * Platform hooks for writing a log file from a background thread,
+ * so that a slow disk doesn't hold up the event loop.
+ * platform_logwriter_new returns NULL if that isn't possible, in
+ * which case the caller should write to the file itself. While a
+ * LogWriter exists, only it may touch the FILE; write and free return
+ * false if writing to the file has failed. flush doesn't return until
+ * everything written so far has reached the file.
+ *
+ * If 'lf' is non-NULL, the data goes through that filter on the
+ * background thread, so that (for instance) compression doesn't hold
+ * up the event loop either, and free finishes the filter's output.
+ * The caller still owns the filter, and frees it after the LogWriter.
+ */
+typedef struct LogWriter LogWriter;
+LogWriter *platform_logwriter_new(FILE *fp, LogFilter *lf);
+bool platform_logwriter_write(LogWriter *lw, ptrlen data);
+void platform_logwriter_flush(LogWriter *lw);
+bool platform_logwriter_free(LogWriter *lw);
+/* Drain and stop every live LogWriter, e.g. on the way out via
+ * cleanup_exit. This is also registered with atexit. */
+void platform_logwriter_close_all(void);
 void logflush(LogContext *logctx);
 void logevent(LogContext *logctx, const char *event);
 void logeventf(LogContext *logctx, const char *fmt, ...) PRINTF_LIKE(2, 3);
@@ -1932,6 +2034,15 @@ const char *wc_error(int value);
 int wc_match_pl(const char *wildcard, ptrlen target);
 int wc_match(const char *wildcard, const char *target);
 bool wc_unescape(char *output, const char *wildcard);
+/*
+ * For matching one wildcard against many names (e.g. every entry in
+ * a large remote directory), compile it once. wc_match_compiled gives
+ * exactly the same answers as wc_match_pl.
+ */
+typedef struct WildcardPattern WildcardPattern;
+WildcardPattern *wc_compile(const char *wildcard);
+int wc_match_compiled(WildcardPattern *wcp, ptrlen target);
+void wc_compiled_free(WildcardPattern *wcp);
 
 /*
  * Exports from frontend (windlg.c etc)
@@ -2090,6 +2201,18 @@ char *get_random_data(int bytes, const char *device); /* used in cmdgen.c */
 char filename_char_sanitise(char c);   /* rewrite special pathname chars */
 bool open_for_write_would_lose_data(const Filename *fn);
 
+/*
+ * An anonymous temporary file, which goes away by itself when it's
+ * freed (or when the process exits). Used by the terminal to keep
+ * old scrollback out of memory. tempfile_new returns NULL if no such
+ * file could be created.
+ */
+TempFile *tempfile_new(void);
+bool tempfile_write(TempFile *tf, uint64_t offset,
+                    const void *data, size_t len);
+bool tempfile_read(TempFile *tf, uint64_t offset, void *data, size_t len);
+void tempfile_free(TempFile *tf);
+
 /*
  * Exports and imports from timing.c.
  *
@@ -2239,6 +2362,120 @@ typedef void (*toplevel_callback_notify_fn_t)(void *ctx);
 void request_callback_notifications(toplevel_callback_notify_fn_t notify,
                                     void *ctx);
 
+/*
+ * queue_toplevel_callback_from_thread is the one function in
+ * callback.c that may be called from threads other than the main
+ * one. The callback is still run on the main thread, by way of the
+ * main queue. The first callback queued since the main thread last
+ * looked wakes its event loop, which then calls run_thread_callbacks
+ * to move everything queued from other threads into the main queue.
+ *
+ * Before starting a thread that will use this, the main thread must
+ * call platform_enable_thread_callbacks, which sets up the means of
+ * waking the event loop and returns false if there isn't one. (The
+ * platform passes its wakeup function to
+ * request_thread_callback_wakeups.)
+ *
+ * delete_callbacks_for_context can't see these callbacks until
+ * they've been moved to the main queue, so a context mustn't be
+ * freed while another thread might still queue callbacks for it.
+ */
+void queue_toplevel_callback_from_thread(toplevel_callback_fn_t fn,
+                                         void *ctx);
+void run_thread_callbacks(void);
+void request_thread_callback_wakeups(void (*wakeup)(void));
+bool platform_enable_thread_callbacks(void);
+
+/*
+ * Exports from trace.c. Instrumented code brackets each piece of work
+ * it wants to appear in the trace with
+ *
+ *     uint64_t t = trace_begin();
+ *     ...
+ *     trace_end("name", arg, t);
+ *
+ * which costs no more than a test of trace_on while tracing is off.
+ * (A trace_begin that happened before tracing was started returns 0,
+ * and the matching trace_end then records nothing.) 'arg' is shown
+ * in hex alongside the event: usually the address of the function
+ * that did the work, or an fd.
+ *
+ * trace_request_write may be called from a signal handler, and
+ * causes the trace to be written out after the next event.
+ * platform_trace_started is passed it when tracing begins, to hook
+ * up to whatever the platform offers for asking for that.
+ */
+extern bool trace_on;
+uint64_t trace_clock(void);
+void trace_record(const char *name, uintptr_t arg, uint64_t start);
+static inline uint64_t trace_begin(void)
+{ return trace_on ? trace_clock() : 0; }
+static inline void trace_end(const char *name, uintptr_t arg, uint64_t start)
+{ if (start) trace_record(name, arg, start); }
+void trace_start(Filename *fn);
+void trace_write(void);
+void trace_request_write(void);
+void platform_trace_started(void (*request_write)(void));
+
+/*
+ * Static probes, for watching a live program with bpftrace, SystemTap
+ * or perf (via USDT) or with WPA and xperf on Windows (via ETW
+ * TraceLogging), without rebuilding it. They're only compiled in if
+ * PUTTY_PROBES is defined: on Unix, 'configure --enable-probes' does
+ * that, and needs <sys/sdt.h>; on Windows, add -DPUTTY_PROBES to the
+ * compiler flags by hand. An unattached USDT probe costs a nop; an ETW
+ * one, a test of whether anyone has enabled the provider.
+ *
+ * probeN(name, ...) fires probe 'name' of provider 'putty' with N (from
+ * 1 to 3) integer arguments. The probes are:
+ *
+ *   bpp_send(type, length)              SSH-2 packet formatted to send
+ *   bpp_recv(type, length)              SSH-2 packet received and decoded
+ *   channel_open(localid, remoteid)     SSH-2 channel open confirmed
+ *   channel_close(localid)              SSH-2 channel destroyed
+ *   channel_window_adjust(localid, n, outgoing)
+ *                                       window grown by n bytes by us
+ *                                       (outgoing=1) or by the peer
+ *   sftp_request(id, type)              SFTP request sent
+ *   sftp_response(id, type)             SFTP reply matched to its request
+ *   socket_send(fd, bytes)              send() on a network socket
+ *   socket_recv(fd, bytes)              recv() on a network socket
+ *   term_out_start(bytes)               terminal starts on queued output
+ *   term_out_done(bytes)                terminal has consumed that output
+ *
+ * Lengths from send() and recv() are as returned, so can be negative.
+ */
+#if defined PUTTY_PROBES && !defined _WIN32
+#include <sys/sdt.h>
+#define probe1(name, a) DTRACE_PROBE1(putty, name, a)
+#define probe2(name, a, b) DTRACE_PROBE2(putty, name, a, b)
+#define probe3(name, a, b, c) DTRACE_PROBE3(putty, name, a, b, c)
+#elif defined PUTTY_PROBES
+#include <TraceLoggingProvider.h>
+TRACELOGGING_DECLARE_PROVIDER(putty_etw_provider);
+extern bool etw_probes_registered;
+void etw_probes_register(void);        /* in trace.c */
+#define probe_etw(name, ...) do {                                       \
+        if (!etw_probes_registered)                                     \
+            etw_probes_register();                                      \
+        TraceLoggingWrite(putty_etw_provider, #name, __VA_ARGS__);      \
+    } while (0)
+#define probe_etw_arg(x, argname)                       \
+    TraceLoggingInt64((int64_t)(x), argname)
+#define probe1(name, a) probe_etw(name, probe_etw_arg(a, "arg0"))
+#define probe2(name, a, b) probe_etw(                                   \
+        name, probe_etw_arg(a, "arg0"), probe_etw_arg(b, "arg1"))
+#define probe3(name, a, b, c) probe_etw(                                \
+        name, probe_etw_arg(a, "arg0"), probe_etw_arg(b, "arg1"),       \
+        probe_etw_arg(c, "arg2"))
+#else
+/* sizeof, so that a variable kept only for a probe isn't 'unused' */
+#define probe1(name, a) ((void)sizeof(a))
+#define probe2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define probe3(name, a, b, c) \
+    ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#endif
+
 /*
  * Define no-op macros for the jump list functions, on platforms that
  * don't support them. (This is a bit of a hack, and it'd be nicer to
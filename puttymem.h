@@ -20,6 +20,15 @@ void *safemalloc(size_t factor1, size_t factor2, size_t addend);
 void *saferealloc(void *, size_t, size_t);
 void safefree(void *);
 
+/*
+ * If this is non-NULL, safemalloc and saferealloc add one to what it
+ * points at for every allocation they make. It's for benchmarks that
+ * report allocations per unit of work; since the count isn't
+ * thread-safe, nothing that allocates on more than one thread should
+ * set it.
+ */
+extern uint64_t *safemalloc_counter;
+
 /*
  * Direct use of smalloc within the code should be avoided where
  * possible, in favour of these type-casting macros which ensure you
@@ -48,6 +57,59 @@ void safefree(void *);
 #define snew_plus(type, extra) ((type *)snmalloc(1, sizeof(type), (extra)))
 #define snew_plus_get_aux(ptr) ((void *)((ptr) + 1))
 
+/*
+ * Pooled allocation, for the object types that are allocated and
+ * freed at a high rate. Blocks are rounded up to a size class, and
+ * freed blocks are kept on a bounded per-pool free list for reuse
+ * rather than going back to the heap. Each pool also keeps counts of
+ * its activity, which mempool_get_stats returns and
+ * mempool_stats_summary formats as a dynamically allocated string.
+ *
+ * A pooled block must be freed with sfree_pooled, not sfree. Nothing
+ * is wiped on the way back into a pool, so callers holding sensitive
+ * data must smemclr it first, exactly as they would before sfree.
+ * The pools are not thread-safe: only use them from the main thread.
+ *
+ * A caller that keeps pooled blocks on a free list of its own should
+ * call mempool_note_idle when it puts one there and
+ * mempool_note_reused when it takes one back, so that the statistics
+ * still count it as freed and reallocated. 'extra' is any separately
+ * allocated memory the block keeps hold of while it's idle, which
+ * must be the same in both calls.
+ */
+#define MEMPOOL_LIST(X)                         \
+    X(MEMPOOL_BUFCHAIN, "bufchain")             \
+    X(MEMPOOL_PACKET, "packets")                \
+    X(MEMPOOL_TERMLINE, "terminal lines")       \
+    /* end of list */
+#define MEMPOOL_ENUM_DEF(id, name) id,
+typedef enum MemPoolTag {
+    MEMPOOL_LIST(MEMPOOL_ENUM_DEF)
+    N_MEMPOOLS
+} MemPoolTag;
+#undef MEMPOOL_ENUM_DEF
+
+typedef struct MemPoolStats {
+    uint64_t allocs, frees;
+    uint64_t hits;                     /* allocs served from the pool */
+    size_t bytes_live;                 /* requested size of live blocks */
+    size_t bytes_pooled;               /* held on the free lists */
+} MemPoolStats;
+
+void *safemalloc_pooled(MemPoolTag tag, size_t size, size_t addend);
+void safefree_pooled(void *ptr);
+void mempool_note_idle(void *ptr, size_t extra);
+void mempool_note_reused(void *ptr, size_t extra);
+void mempool_get_stats(MemPoolTag tag, MemPoolStats *stats);
+char *mempool_stats_summary(void);
+
+#define smalloc_pooled(tag, z) safemalloc_pooled(tag, z, 0)
+#define snew_pooled(tag, type) \
+    ((type *)safemalloc_pooled(tag, sizeof(type), 0))
+#define snew_plus_pooled(tag, type, extra) \
+    ((type *)safemalloc_pooled(tag, sizeof(type), (extra)))
+#define sfree_pooled safefree_pooled
+
 /*
  * Helper macros to deal with the common use case of growing an array.
  *
@@ -365,6 +365,15 @@ static void scp_reply_cleanup(ScpReplyReceiver *reply)
 
 #define SCP_MAX_BACKLOG 65536
 
+/*
+ * Size of the reads we make from a file we're sending. The first
+ * block of each file is read ahead, at the same time as we open and
+ * stat it, before the client has acknowledged the previous file. So
+ * a file no bigger than this goes out the moment the client acks its
+ * C command, without waiting for any more disk I/O.
+ */
+#define SCP_READ_BLOCK 32768
+
 typedef struct ScpSource ScpSource;
 typedef struct ScpSourceStackEntry ScpSourceStackEntry;
 
@@ -383,6 +392,7 @@ struct ScpSource {
     int n_pending_commands;
 
     uint64_t file_offset, file_size;
+    strbuf *readahead;           /* data from file_offset not yet sent */
 
     ScpReplyReceiver reply;
 
@@ -505,6 +515,7 @@ static ScpSource *scp_source_new(
     scp->sc = sc;
     scp->sf = sftpsrv_new(sftpserver_vt);
     scp->n_pending_commands = 0;
+    scp->readahead = strbuf_new();
 
     scp_source_push(scp, SCP_ROOTPATH, pathname, PTRLEN_LITERAL(""),
                     NULL, NULL);
@@ -516,6 +527,7 @@ static void scp_source_free(ScpServer *s)
 {
     ScpSource *scp = container_of(s, ScpSource, scpserver);
     scp_reply_cleanup(&scp->reply);
+    strbuf_free(scp->readahead);
     while (scp->n_pending_commands > 0)
         strbuf_free(scp->pending_commands[--scp->n_pending_commands]);
     while (scp->head) {
@@ -571,6 +583,27 @@ static void scp_source_send_CD(
     }
 }
 
+/*
+ * Read the next block of the file we're sending into scp->readahead.
+ * On failure, scp->reply.err is set and the caller decides what to do.
+ */
+static bool scp_source_read_block(ScpSource *scp, ptrlen handle)
+{
+    uint64_t limit = scp->file_size - scp->file_offset;
+    if (limit > SCP_READ_BLOCK)
+        limit = SCP_READ_BLOCK;
+
+    assert(scp->readahead->len == 0);
+    if (limit == 0)
+        return true;
+
+    sftpsrv_read(scp->sf, &scp->reply.srb, handle, scp->file_offset, limit);
+    if (scp->reply.err)
+        return false;
+    put_datapl(scp->readahead, scp->reply.data);
+    return true;
+}
+
 static void scp_source_process_stack(ScpSource *scp);
 static void scp_source_process_stack_cb(void *vscp)
 {
@@ -716,16 +749,20 @@ static void scp_source_process_stack(ScpSource *scp)
 
     if (scp->head && scp->head->type == SCP_READFILE) {
         /*
-         * Transfer file data if our backlog hasn't filled up.
+         * Transfer file data until our backlog fills up, or we've
+         * sent as much as we're prepared to in one go.
          */
-        int backlog;
-        uint64_t limit = scp->file_size - scp->file_offset;
-        if (limit > 4096)
-            limit = 4096;
-        if (limit > 0) {
-            sftpsrv_read(scp->sf, &scp->reply.srb, scp->head->handle,
-                         scp->file_offset, limit);
-            if (scp->reply.err) {
+        size_t backlog = 0, sent = 0;
+        while (scp->file_offset < scp->file_size) {
+            if (backlog >= SCP_MAX_BACKLOG)
+                return;
+            if (sent >= SCP_MAX_BACKLOG) {
+                scp_requeue(scp);
+                return;
+            }
+
+            if (!scp->readahead->len &&
+                !scp_source_read_block(scp, scp->head->handle)) {
                 scp_source_abort(
                     scp, "%.*s: unable to read: %s",
                     PTRLEN_PRINTF(scp->head->pathname), scp->reply.errmsg);
@@ -733,12 +770,10 @@ static void scp_source_process_stack(ScpSource *scp)
             }
 
             backlog = sshfwd_write(
-                scp->sc, scp->reply.data.ptr, scp->reply.data.len);
-            scp->file_offset += scp->reply.data.len;
-
-            if (backlog < SCP_MAX_BACKLOG)
-                scp_requeue(scp);
-            return;
+                scp->sc, scp->readahead->s, scp->readahead->len);
+            scp->file_offset += scp->readahead->len;
+            sent += scp->readahead->len;
+            strbuf_clear(scp->readahead);
         }
 
         /*
@@ -855,10 +890,22 @@ static void scp_source_process_stack(ScpSource *scp)
         }
         scp->file_offset = 0;
         scp->file_size = scp->reply.attrs.size;
-        scp_source_send_CD(scp, 'C', node->attrs,
-                           scp->file_size, node->pathname);
         scp_source_push(
             scp, SCP_READFILE, node->pathname, scp->reply.handle, NULL, NULL);
+        if (!scp_source_read_block(scp, scp->head->handle)) {
+            scp_source_err(
+                scp, "%.*s: unable to read: %s",
+                PTRLEN_PRINTF(node->pathname), scp->reply.errmsg);
+            sftpsrv_close(scp->sf, &scp->reply.srb, scp->head->handle);
+            ScpSourceStackEntry *readnode = scp->head;
+            scp->head = readnode->next;
+            sfree(readnode);
+            sfree(node);
+            scp_requeue(scp);
+            return;
+        }
+        scp_source_send_CD(scp, 'C', node->attrs,
+                           scp->file_size, node->pathname);
     }
     sfree(node);
     scp_requeue(scp);
@@ -932,6 +979,9 @@ static void scp_source_eof(ScpServer *s)
  * Sink end of the SCP protocol.
  */
 
+/* Amount of file data we collect before writing it out */
+#define SCP_WRITE_BLOCK 65536
+
 typedef struct ScpSink ScpSink;
 typedef struct ScpSinkStackEntry ScpSinkStackEntry;
 
@@ -942,6 +992,7 @@ struct ScpSink {
     ScpSinkStackEntry *head;
 
     uint64_t file_offset, file_size;
+    strbuf *write_buf;           /* data up to file_offset not yet written */
     unsigned long atime, mtime;
     bool got_file_times;
 
@@ -1030,6 +1081,7 @@ static ScpSink *scp_sink_new(
     bufchain_init(&scp->data);
     scp->command = strbuf_new();
     scp->filename_sb = strbuf_new();
+    scp->write_buf = strbuf_new();
 
     if (!pathname_is_definitely_dir) {
         /*
@@ -1058,6 +1110,7 @@ static void scp_sink_free(ScpServer *s)
     bufchain_clear(&scp->data);
     strbuf_free(scp->command);
     strbuf_free(scp->filename_sb);
+    strbuf_free(scp->write_buf);
     while (scp->head)
         scp_sink_pop(scp);
     sfree(scp->errmsg);
@@ -1067,6 +1120,29 @@ static void scp_sink_free(ScpServer *s)
     sfree(scp);
 }
 
+/*
+ * Write out whatever file data we've accumulated. On failure, closes
+ * the file and sets scp->errmsg.
+ */
+static bool scp_sink_flush(ScpSink *scp)
+{
+    if (!scp->write_buf->len)
+        return true;
+
+    sftpsrv_write(scp->sf, &scp->reply.srb, scp->reply.handle,
+                  scp->file_offset - scp->write_buf->len,
+                  ptrlen_from_strbuf(scp->write_buf));
+    strbuf_clear(scp->write_buf);
+    if (scp->reply.err) {
+        scp->errmsg = dupprintf(
+            "'%.*s': unable to write to file: %s",
+            PTRLEN_PRINTF(scp->filename), scp->reply.errmsg);
+        sftpsrv_close(scp->sf, &scp->reply.srb, scp->reply.handle);
+        return false;
+    }
+    return true;
+}
+
 static void scp_sink_coroutine(ScpSink *scp)
 {
     crBegin(scp->crState);
@@ -1175,10 +1251,13 @@ static void scp_sink_coroutine(ScpSink *scp)
                 }
 
                 /*
-                 * Now send an ack, and read the file data.
+                 * Now send an ack, and read the file data. We gather
+                 * it up into large blocks before writing it, rather
+                 * than making a write call for every SSH packet.
                  */
                 sshfwd_write(scp->sc, "\0", 1);
                 scp->file_offset = 0;
+                strbuf_clear(scp->write_buf);
                 while (scp->file_offset < scp->file_size) {
                     ptrlen data;
                     uint64_t this_len, remaining;
@@ -1186,8 +1265,9 @@ static void scp_sink_coroutine(ScpSink *scp)
                     crMaybeWaitUntilV(
                         scp->input_eof || bufchain_size(&scp->data) > 0);
                     if (scp->input_eof) {
-                        sftpsrv_close(scp->sf, &scp->reply.srb,
-                                      scp->reply.handle);
+                        if (scp_sink_flush(scp))
+                            sftpsrv_close(scp->sf, &scp->reply.srb,
+                                          scp->reply.handle);
                         goto done;
                     }
 
@@ -1196,29 +1276,25 @@ static void scp_sink_coroutine(ScpSink *scp)
                     remaining = scp->file_size - scp->file_offset;
                     if (this_len > remaining)
                         this_len = remaining;
-                    sftpsrv_write(scp->sf, &scp->reply.srb,
-                                  scp->reply.handle, scp->file_offset,
-                                  make_ptrlen(data.ptr, this_len));
-                    if (scp->reply.err) {
-                        scp->errmsg = dupprintf(
-                            "'%.*s': unable to write to file: %s",
-                            PTRLEN_PRINTF(scp->filename), scp->reply.errmsg);
-                        goto done;
-                    }
+                    put_data(scp->write_buf, data.ptr, this_len);
                     bufchain_consume(&scp->data, this_len);
                     scp->file_offset += this_len;
+
+                    if (scp->write_buf->len >= SCP_WRITE_BLOCK &&
+                        !scp_sink_flush(scp))
+                        goto done;
                 }
+                if (!scp_sink_flush(scp))
+                    goto done;
 
                 /*
                  * Wait for the trailing NUL byte.
                  */
                 crMaybeWaitUntilV(
                     scp->input_eof || bufchain_size(&scp->data) > 0);
-                if (scp->input_eof) {
-                    sftpsrv_close(scp->sf, &scp->reply.srb,
-                                  scp->reply.handle);
+                sftpsrv_close(scp->sf, &scp->reply.srb, scp->reply.handle);
+                if (scp->input_eof)
                     goto done;
-                }
                 bufchain_consume(&scp->data, 1);
             }
         } else if (scp->command_chr == 'E') {
@@ -31,6 +31,13 @@ typedef struct sesschan {
     bool ignoring_input;
     bool seen_eof, seen_exit;
 
+    /* Output held back by ssc->output_coalesce_ms */
+    bufchain coalesced;
+    bool coalesced_is_stderr, coalesce_timer_pending;
+    unsigned long coalesce_deadline;
+    bool seen_input;
+    unsigned long last_input_time;
+
     Plug xfwd_plug;
     int n_x11_sockets;
     Socket *x11_sockets[MAX_X11_SOCKETS];
@@ -42,6 +49,8 @@ typedef struct sesschan {
 
     bufchain subsys_input;
     SftpServer *sftpsrv;
+    size_t sftp_deferred_count, sftp_deferred_size;
+    bool sftp_eof_pending;
     ScpServer *scpsrv;
     const SshServerConfig *ssc;
 
@@ -180,6 +189,7 @@ static bool sesschan_get_window_pixel_size(Seat *seat, int *w, int *h);
 
 static const SeatVtable sesschan_seat_vt = {
     .output = sesschan_seat_output,
+    .sent = nullseat_sent,
     .eof = sesschan_seat_eof,
     .get_userpass_input = nullseat_get_userpass_input,
     .notify_remote_exit = sesschan_notify_remote_exit,
@@ -230,6 +240,7 @@ Channel *sesschan_new(SshChannel *c, LogContext *logctx,
     sess->sftpserver_vt = sftpserver_vt;
 
     bufchain_init(&sess->subsys_input);
+    bufchain_init(&sess->coalesced);
 
     return &sess->chan;
 }
@@ -240,6 +251,8 @@ static void sesschan_free(Channel *chan)
     int i;
 
     delete_callbacks_for_context(sess);
+    expire_timer_context(sess);
+    bufchain_clear(&sess->coalesced);
     conf_free(sess->conf);
     if (sess->backend)
         backend_free(sess->backend);
@@ -254,6 +267,8 @@ static void sesschan_free(Channel *chan)
     sfree(sess);
 }
 
+static void sesschan_flush_output(sesschan *sess);
+
 static size_t sesschan_send(Channel *chan, bool is_stderr,
                             const void *data, size_t length)
 {
@@ -262,6 +277,12 @@ static size_t sesschan_send(Channel *chan, bool is_stderr,
     if (!sess->backend || sess->ignoring_input)
         return 0;
 
+    /* Whatever the client types is likely to be echoed, so stop
+     * holding back output for a while */
+    sess->seen_input = true;
+    sess->last_input_time = GETTICKCOUNT();
+    sesschan_flush_output(sess);
+
     return backend_send(sess->backend, data, length);
 }
 
@@ -578,11 +599,61 @@ bool sesschan_change_window_size(
     return true;
 }
 
+/* How long after the client last sent us data we treat the session
+ * as interactive, and pass output straight through */
+#define SESSCHAN_INTERACTIVE_TICKS (TICKSPERSEC / 2)
+
+static void sesschan_flush_output(sesschan *sess)
+{
+    while (bufchain_size(&sess->coalesced) > 0) {
+        ptrlen data = bufchain_prefix(&sess->coalesced);
+        sshfwd_write_ext(sess->c, sess->coalesced_is_stderr,
+                         data.ptr, data.len);
+        bufchain_consume(&sess->coalesced, data.len);
+    }
+}
+
+static void sesschan_coalesce_timer(void *ctx, unsigned long now)
+{
+    sesschan *sess = (sesschan *)ctx;
+
+    if (sess->coalesce_timer_pending && now == sess->coalesce_deadline) {
+        sess->coalesce_timer_pending = false;
+        sesschan_flush_output(sess);
+    }
+}
+
 static size_t sesschan_seat_output(
     Seat *seat, bool is_stderr, const void *data, size_t len)
 {
     sesschan *sess = container_of(seat, sesschan, seat);
-    return sshfwd_write_ext(sess->c, is_stderr, data, len);
+    const SshServerConfig *ssc = sess->ssc;
+
+    if (!ssc->output_coalesce_ms || (sess->seen_input &&
+            GETTICKCOUNT() - sess->last_input_time <
+            SESSCHAN_INTERACTIVE_TICKS)) {
+        sesschan_flush_output(sess);
+        return sshfwd_write_ext(sess->c, is_stderr, data, len);
+    }
+
+    /* Keep stdout and stderr data in the order it arrived */
+    if (bufchain_size(&sess->coalesced) > 0 &&
+        sess->coalesced_is_stderr != is_stderr)
+        sesschan_flush_output(sess);
+
+    sess->coalesced_is_stderr = is_stderr;
+    bufchain_add(&sess->coalesced, data, len);
+
+    if (bufchain_size(&sess->coalesced) >= ssc->output_coalesce_bytes) {
+        sesschan_flush_output(sess);
+    } else if (!sess->coalesce_timer_pending) {
+        int ticks = (ssc->output_coalesce_ms * TICKSPERSEC + 999) / 1000;
+        sess->coalesce_deadline = schedule_timer(
+            ticks, sesschan_coalesce_timer, sess);
+        sess->coalesce_timer_pending = true;
+    }
+
+    return bufchain_size(&sess->coalesced);
 }
 
 static void sesschan_check_close_callback(void *vctx)
@@ -614,6 +685,7 @@ static bool sesschan_seat_eof(Seat *seat)
 {
     sesschan *sess = container_of(seat, sesschan, seat);
 
+    sesschan_flush_output(sess);
     sshfwd_write_eof(sess->c);
     sess->seen_eof = true;
 
@@ -628,6 +700,8 @@ static void sesschan_notify_remote_exit(Seat *seat)
     if (!sess->backend)
         return;
 
+    sesschan_flush_output(sess);
+
     bool got_signal = false;
     if (!sess->ssc->exit_signal_numeric) {
         char *sigmsg;
@@ -686,6 +760,39 @@ static bool sesschan_get_window_pixel_size(Seat *seat, int *width, int *height)
  * Built-in SFTP subsystem.
  */
 
+/*
+ * The SftpServer may answer some requests later, out of order. While
+ * it's working on them, we count their size as data still buffered
+ * by this channel, so that the client's window stops it from sending
+ * an unlimited number of them.
+ */
+struct sftp_chan_deferred {
+    sesschan *sess;
+    size_t size;
+};
+
+static void sftp_chan_deferred_reply(void *vctx, struct sftp_packet *reply)
+{
+    struct sftp_chan_deferred *sd = (struct sftp_chan_deferred *)vctx;
+    sesschan *sess = sd->sess;
+
+    if (reply) {
+        sess->sftp_deferred_count--;
+        sess->sftp_deferred_size -= sd->size;
+
+        sftp_send_prepare(reply);
+        sshfwd_write(sess->c, reply->data, reply->length);
+        sftp_pkt_free(reply);
+
+        sshfwd_unthrottle(sess->c, sess->sftp_deferred_size);
+        if (sess->sftp_eof_pending && !sess->sftp_deferred_count)
+            sshfwd_write_eof(sess->c);
+    }
+    /* else the SftpServer is being freed, and so are we */
+
+    sfree(sd);
+}
+
 static size_t sftp_chan_send(Channel *chan, bool is_stderr,
                              const void *data, size_t length)
 {
@@ -697,6 +804,7 @@ static size_t sftp_chan_send(Channel *chan, bool is_stderr,
         char lenbuf[4];
         unsigned pktlen;
         struct sftp_packet *pkt, *reply;
+        struct sftp_chan_deferred *sd;
 
         bufchain_fetch(&sess->subsys_input, lenbuf, 4);
         pktlen = GET_32BIT_MSB_FIRST(lenbuf);
@@ -708,21 +816,36 @@ static size_t sftp_chan_send(Channel *chan, bool is_stderr,
         pkt = sftp_recv_prepare(pktlen);
         bufchain_fetch_consume(&sess->subsys_input, pkt->data, pktlen);
         sftp_recv_finish(pkt);
-        reply = sftp_handle_request(sess->sftpsrv, pkt);
+
+        sd = snew(struct sftp_chan_deferred);
+        sd->sess = sess;
+        sd->size = 4 + pktlen;
+        reply = sftp_handle_request_deferrable(
+            sess->sftpsrv, pkt, sftp_chan_deferred_reply, sd);
         sftp_pkt_free(pkt);
 
+        if (!reply) {
+            sess->sftp_deferred_count++;
+            sess->sftp_deferred_size += sd->size;
+            continue;
+        }
+        sfree(sd);
+
         sftp_send_prepare(reply);
         sshfwd_write(sess->c, reply->data, reply->length);
         sftp_pkt_free(reply);
     }
 
-    return 0;
+    return sess->sftp_deferred_size;
 }
 
 static void sftp_chan_send_eof(Channel *chan)
 {
     sesschan *sess = container_of(chan, sesschan, chan);
-    sshfwd_write_eof(sess->c);
+    if (sess->sftp_deferred_count)
+        sess->sftp_eof_pending = true; /* send it after the last reply */
+    else
+        sshfwd_write_eof(sess->c);
 }
 
 static char *sftp_log_close_msg(Channel *chan)
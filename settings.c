@@ -17,6 +17,7 @@
 static const struct keyvalwhere ciphernames[] = {
     { "aes",        CIPHER_AES,             -1, -1 },
     { "chacha20",   CIPHER_CHACHA20,        CIPHER_AES, +1 },
+    { "aesgcm",     CIPHER_AESGCM,          CIPHER_CHACHA20, +1 },
     { "3des",       CIPHER_3DES,            -1, -1 },
     { "WARN",       CIPHER_WARN,            -1, -1 },
     { "des",        CIPHER_DES,             -1, -1 },
@@ -71,8 +72,17 @@ const char *const ttymodes[] = {
 };
 
 static int default_protocol, default_port;
-void settings_set_default_protocol(int newval) { default_protocol = newval; }
-void settings_set_default_port(int newval) { default_port = newval; }
+static void forget_cached_defaults(void);
+void settings_set_default_protocol(int newval)
+{
+    default_protocol = newval;
+    forget_cached_defaults();
+}
+void settings_set_default_port(int newval)
+{
+    default_port = newval;
+    forget_cached_defaults();
+}
 
 /*
  * Convenience functions to access the backends[] array
@@ -535,6 +545,7 @@ char *save_settings(const char *section, Conf *conf)
         return errmsg;
     save_open_settings(sesskey, conf);
     close_settings_w(sesskey);
+    forget_cached_defaults();
     return NULL;
 }
 
@@ -550,8 +561,12 @@ void save_open_settings(settings_w *sesskey, Conf *conf)
     write_setting_i(sesskey, "LogFileClash", conf_get_int(conf, CONF_logxfovr));
     write_setting_b(sesskey, "LogFlush", conf_get_bool(conf, CONF_logflush));
     write_setting_b(sesskey, "LogHeader", conf_get_bool(conf, CONF_logheader));
+    write_setting_b(sesskey, "LogCompress", conf_get_bool(conf, CONF_logcompress));
     write_setting_b(sesskey, "SSHLogOmitPasswords", conf_get_bool(conf, CONF_logomitpass));
     write_setting_b(sesskey, "SSHLogOmitData", conf_get_bool(conf, CONF_logomitdata));
+    write_setting_b(sesskey, "SSHLogBinary", conf_get_bool(conf, CONF_logbinary));
+    write_setting_i(sesskey, "SSHLogMaxPacket", conf_get_int(conf, CONF_logpktmax));
+    write_setting_b(sesskey, "SSHLogSetupTiming", conf_get_bool(conf, CONF_logsetuptiming));
     p = "raw";
     {
         const struct BackendVtable *vt =
@@ -575,6 +590,8 @@ void save_open_settings(settings_w *sesskey, Conf *conf)
 
     /* Address family selection */
     write_setting_i(sesskey, "AddressFamily", conf_get_int(conf, CONF_addressfamily));
+    write_setting_i(sesskey, "ConnectDelay", conf_get_int(conf, CONF_connect_delay));
+    write_setting_i(sesskey, "DNSCacheTTL", conf_get_int(conf, CONF_dns_cache_ttl));
 
     /* proxy settings */
     write_setting_s(sesskey, "ProxyExcludeList", conf_get_str(conf, CONF_proxy_exclude_list));
@@ -593,15 +610,21 @@ void save_open_settings(settings_w *sesskey, Conf *conf)
     write_setting_s(sesskey, "LocalUserName", conf_get_str(conf, CONF_localusername));
     write_setting_b(sesskey, "NoPTY", conf_get_bool(conf, CONF_nopty));
     write_setting_b(sesskey, "Compression", conf_get_bool(conf, CONF_compression));
+    write_setting_i(sesskey, "CompressionLevel", conf_get_int(conf, CONF_compression_level));
     write_setting_b(sesskey, "TryAgent", conf_get_bool(conf, CONF_tryagent));
+    write_setting_i(sesskey, "AgentKeyProbes", conf_get_int(conf, CONF_agent_key_probes));
+    write_setting_b(sesskey, "RememberAuth", conf_get_bool(conf, CONF_remember_auth));
     write_setting_b(sesskey, "AgentFwd", conf_get_bool(conf, CONF_agentfwd));
 #ifndef NO_GSSAPI
     write_setting_b(sesskey, "GssapiFwd", conf_get_bool(conf, CONF_gssapifwd));
 #endif
     write_setting_b(sesskey, "ChangeUsername", conf_get_bool(conf, CONF_change_username));
     wprefs(sesskey, "Cipher", ciphernames, CIPHER_MAX, conf, CONF_ssh_cipherlist);
+    write_setting_b(sesskey, "CipherAuto", conf_get_bool(conf, CONF_ssh_cipher_auto));
     wprefs(sesskey, "KEX", kexnames, KEX_MAX, conf, CONF_ssh_kexlist);
     wprefs(sesskey, "HostKey", hknames, HK_MAX, conf, CONF_ssh_hklist);
+    write_setting_b(sesskey, "SshKexGuess", conf_get_bool(conf, CONF_ssh_kex_guess));
+    write_setting_b(sesskey, "DHShortExponent", conf_get_bool(conf, CONF_ssh_dh_short_exponent));
     write_setting_b(sesskey, "PreferKnownHostKeys", conf_get_bool(conf, CONF_ssh_prefer_known_hostkeys));
     write_setting_i(sesskey, "RekeyTime", conf_get_int(conf, CONF_ssh_rekey_time));
 #ifndef NO_GSSAPI
@@ -619,6 +642,9 @@ void save_open_settings(settings_w *sesskey, Conf *conf)
     write_setting_filename(sesskey, "GSSCustom", conf_get_filename(conf, CONF_ssh_gss_custom));
 #endif
     write_setting_b(sesskey, "SshNoShell", conf_get_bool(conf, CONF_ssh_no_shell));
+    write_setting_s(sesskey, "SFTPMaxWindow", conf_get_str(conf, CONF_sftp_max_window));
+    write_setting_s(sesskey, "SshMaxWindow", conf_get_str(conf, CONF_ssh_max_window));
+    write_setting_s(sesskey, "SshBufferLimit", conf_get_str(conf, CONF_ssh_buffer_limit));
     write_setting_i(sesskey, "SshProt", conf_get_int(conf, CONF_sshprot));
     write_setting_s(sesskey, "LogHost", conf_get_str(conf, CONF_loghost));
     write_setting_b(sesskey, "SSH2DES", conf_get_bool(conf, CONF_ssh2_des_cbc));
@@ -679,6 +705,7 @@ void save_open_settings(settings_w *sesskey, Conf *conf)
 #endif
                     );
     write_setting_i(sesskey, "ScrollbackLines", conf_get_int(conf, CONF_savelines));
+    write_setting_b(sesskey, "ScrollbackOnDisk", conf_get_bool(conf, CONF_scrollback_on_disk));
     write_setting_b(sesskey, "DECOriginMode", conf_get_bool(conf, CONF_dec_om));
     write_setting_b(sesskey, "AutoWrapMode", conf_get_bool(conf, CONF_wrap_mode));
     write_setting_b(sesskey, "LFImpliesCR", conf_get_bool(conf, CONF_lfhascr));
@@ -755,6 +782,7 @@ void save_open_settings(settings_w *sesskey, Conf *conf)
     write_setting_b(sesskey, "LocalPortAcceptAll", conf_get_bool(conf, CONF_lport_acceptall));
     write_setting_b(sesskey, "RemotePortAcceptAll", conf_get_bool(conf, CONF_rport_acceptall));
     wmap(sesskey, "PortForwardings", conf, CONF_portfwd, true);
+    wmap(sesskey, "PortForwardLimits", conf, CONF_portfwd_limits, true);
     write_setting_i(sesskey, "BugIgnore1", 2-conf_get_int(conf, CONF_sshbug_ignore1));
     write_setting_i(sesskey, "BugPlainPW1", 2-conf_get_int(conf, CONF_sshbug_plainpw1));
     write_setting_i(sesskey, "BugRSA1", 2-conf_get_int(conf, CONF_sshbug_rsa1));
@@ -823,6 +851,8 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
     conf_set_str(conf, CONF_remote_cmd, "");
     conf_set_str(conf, CONF_remote_cmd2, "");
     conf_set_str(conf, CONF_ssh_nc_host, "");
+    conf_set_int(conf, CONF_ssh_nc_port, 0);
+    conf_set_bool(conf, CONF_ssh_subsys2, false);
 
     gpps(sesskey, "HostName", "", conf, CONF_host);
     gppfile(sesskey, "LogFileName", conf, CONF_logfilename);
@@ -830,8 +860,12 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
     gppi(sesskey, "LogFileClash", LGXF_ASK, conf, CONF_logxfovr);
     gppb(sesskey, "LogFlush", true, conf, CONF_logflush);
     gppb(sesskey, "LogHeader", true, conf, CONF_logheader);
+    gppb(sesskey, "LogCompress", false, conf, CONF_logcompress);
     gppb(sesskey, "SSHLogOmitPasswords", true, conf, CONF_logomitpass);
     gppb(sesskey, "SSHLogOmitData", false, conf, CONF_logomitdata);
+    gppb(sesskey, "SSHLogBinary", false, conf, CONF_logbinary);
+    gppi(sesskey, "SSHLogMaxPacket", 0, conf, CONF_logpktmax);
+    gppb(sesskey, "SSHLogSetupTiming", false, conf, CONF_logsetuptiming);
 
     prot = gpps_raw(sesskey, "Protocol", "default");
     conf_set_int(conf, CONF_protocol, default_protocol);
@@ -847,6 +881,8 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
 
     /* Address family selection */
     gppi(sesskey, "AddressFamily", ADDRTYPE_UNSPEC, conf, CONF_addressfamily);
+    gppi(sesskey, "ConnectDelay", 250, conf, CONF_connect_delay);
+    gppi(sesskey, "DNSCacheTTL", 0, conf, CONF_dns_cache_ttl);
 
     /* The CloseOnExit numbers are arranged in a different order from
      * the standard FORCE_ON / FORCE_OFF / AUTO. */
@@ -952,7 +988,10 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
     gpps(sesskey, "LocalUserName", "", conf, CONF_localusername);
     gppb(sesskey, "NoPTY", false, conf, CONF_nopty);
     gppb(sesskey, "Compression", false, conf, CONF_compression);
+    gppi(sesskey, "CompressionLevel", 6, conf, CONF_compression_level);
     gppb(sesskey, "TryAgent", true, conf, CONF_tryagent);
+    gppi(sesskey, "AgentKeyProbes", 1, conf, CONF_agent_key_probes);
+    gppb(sesskey, "RememberAuth", false, conf, CONF_remember_auth);
     gppb(sesskey, "AgentFwd", false, conf, CONF_agentfwd);
     gppb(sesskey, "ChangeUsername", false, conf, CONF_change_username);
 #ifndef NO_GSSAPI
@@ -960,6 +999,7 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
 #endif
     gprefs(sesskey, "Cipher", "\0",
            ciphernames, CIPHER_MAX, conf, CONF_ssh_cipherlist);
+    gppb(sesskey, "CipherAuto", false, conf, CONF_ssh_cipher_auto);
     {
         /* Backward-compatibility: before 0.58 (when the "KEX"
          * preference was first added), we had an option to
@@ -1009,6 +1049,8 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
     }
     gprefs(sesskey, "HostKey", "ed25519,ecdsa,rsa,dsa,WARN",
            hknames, HK_MAX, conf, CONF_ssh_hklist);
+    gppb(sesskey, "SshKexGuess", false, conf, CONF_ssh_kex_guess);
+    gppb(sesskey, "DHShortExponent", false, conf, CONF_ssh_dh_short_exponent);
     gppb(sesskey, "PreferKnownHostKeys", true, conf, CONF_ssh_prefer_known_hostkeys);
     gppi(sesskey, "RekeyTime", 60, conf, CONF_ssh_rekey_time);
 #ifndef NO_GSSAPI
@@ -1038,6 +1080,9 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
     gppfile(sesskey, "GSSCustom", conf, CONF_ssh_gss_custom);
 #endif
     gppb(sesskey, "SshNoShell", false, conf, CONF_ssh_no_shell);
+    gpps(sesskey, "SFTPMaxWindow", "32M", conf, CONF_sftp_max_window);
+    gpps(sesskey, "SshMaxWindow", "16M", conf, CONF_ssh_max_window);
+    gpps(sesskey, "SshBufferLimit", "64M", conf, CONF_ssh_buffer_limit);
     gppfile(sesskey, "PublicKeyFile", conf, CONF_keyfile);
     gpps(sesskey, "RemoteCommand", "", conf, CONF_remote_cmd);
     gppb(sesskey, "RFCEnviron", false, conf, CONF_rfc_environ);
@@ -1117,6 +1162,7 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
 #endif
                  );
     gppi(sesskey, "ScrollbackLines", 2000, conf, CONF_savelines);
+    gppb(sesskey, "ScrollbackOnDisk", false, conf, CONF_scrollback_on_disk);
     gppb(sesskey, "DECOriginMode", false, conf, CONF_dec_om);
     gppb(sesskey, "AutoWrapMode", true, conf, CONF_wrap_mode);
     gppb(sesskey, "LFImpliesCR", false, conf, CONF_lfhascr);
@@ -1223,6 +1269,7 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
     gppb(sesskey, "LocalPortAcceptAll", false, conf, CONF_lport_acceptall);
     gppb(sesskey, "RemotePortAcceptAll", false, conf, CONF_rport_acceptall);
     gppmap(sesskey, "PortForwardings", conf, CONF_portfwd);
+    gppmap(sesskey, "PortForwardLimits", conf, CONF_portfwd_limits);
     i = gppi_raw(sesskey, "BugIgnore1", 0); conf_set_int(conf, CONF_sshbug_ignore1, 2-i);
     i = gppi_raw(sesskey, "BugPlainPW1", 0); conf_set_int(conf, CONF_sshbug_plainpw1, 2-i);
     i = gppi_raw(sesskey, "BugRSA1", 0); conf_set_int(conf, CONF_sshbug_rsa1, 2-i);
@@ -1245,6 +1292,8 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
     i = gppi_raw(sesskey, "BugWinadj", 0); conf_set_int(conf, CONF_sshbug_winadj, 2-i);
     i = gppi_raw(sesskey, "BugChanReq", 0); conf_set_int(conf, CONF_sshbug_chanreq, 2-i);
     conf_set_bool(conf, CONF_ssh_simple, false);
+    conf_set_int(conf, CONF_ssh_connection_sharing_persist, 0);
+    conf_set_bool(conf, CONF_ssh_connection_sharing_stats, false);
     gppb(sesskey, "StampUtmp", true, conf, CONF_stamp_utmp);
     gppb(sesskey, "LoginShell", true, conf, CONF_login_shell);
     gppb(sesskey, "ScrollbarOnLeft", false, conf, CONF_scrollbar_on_left);
@@ -1279,9 +1328,37 @@ void load_open_settings(settings_r *sesskey, Conf *conf)
     gppb(sesskey, "SUPDUPScrolling", false, conf, CONF_supdup_scroll);
 }
 
+/*
+ * Default Settings are loaded at least once by nearly every tool,
+ * and sometimes several times (for instance, while working out
+ * whether a command-line host name is really a saved session), so we
+ * keep a copy of them once loaded. Since load_open_settings fills in
+ * every option, copying the cached Conf is equivalent to reloading
+ * it. Anything in this process that could change the result throws
+ * the copy away.
+ */
+static Conf *cached_defaults;
+static bool cached_defaults_exist;
+
+static void forget_cached_defaults(void)
+{
+    if (cached_defaults) {
+        conf_free(cached_defaults);
+        cached_defaults = NULL;
+    }
+}
+
 bool do_defaults(const char *session, Conf *conf)
 {
-    return load_settings(session, conf);
+    if (session && *session && strcmp(session, "Default Settings"))
+        return load_settings(session, conf);
+
+    if (!cached_defaults) {
+        cached_defaults = conf_new();
+        cached_defaults_exist = load_settings(session, cached_defaults);
+    }
+    conf_copy_into(conf, cached_defaults);
+    return cached_defaults_exist;
 }
 
 static int sessioncmp(const void *av, const void *bv)
@@ -8,7 +8,7 @@
 #include <assert.h>
 #include <limits.h>
 
-#include "misc.h"
+#include "putty.h"
 #include "tree234.h"
 #include "sftp.h"
 
@@ -25,6 +25,8 @@ bool sftp_send(struct sftp_packet *pkt)
 {
     bool ret;
     sftp_send_prepare(pkt);
+    if (pkt->type != SSH_FXP_INIT)
+        probe2(sftp_request, GET_32BIT_MSB_FIRST(pkt->data + 5), pkt->type);
     ret = sftp_senddata(pkt->data, pkt->length);
     sftp_pkt_free(pkt);
     return ret;
@@ -63,6 +65,7 @@ struct sftp_request {
     unsigned id;
     bool registered;
     void *userdata;
+    struct fxp_xfer *xfer;             /* transfer this belongs to, if any */
 };
 
 static int sftp_reqcmp(void *av, void *bv)
@@ -134,6 +137,7 @@ static struct sftp_request *sftp_alloc_request(void)
     r->id = low + 1 + REQUEST_ID_OFFSET;
     r->registered = false;
     r->userdata = NULL;
+    r->xfer = NULL;
     add234(sftp_requests, r);
     return r;
 }
@@ -174,6 +178,7 @@ struct sftp_request *sftp_find_request(struct sftp_packet *pktin)
     }
 
     del234(sftp_requests, req);
+    probe2(sftp_response, id, pktin->type);
 
     return req;
 }
@@ -244,6 +249,67 @@ int fxp_error_type(void)
     return fxp_errtype;
 }
 
+/*
+ * The extensions the server listed in its FXP_VERSION packet, and
+ * what it told us about its size limits if one of them was
+ * limits@openssh.com. (All zero if we don't know.)
+ */
+static char **fxp_extensions;
+static size_t fxp_nextensions, fxp_extensionsize;
+
+static struct {
+    uint64_t max_packet, max_read, max_write;
+} fxp_limits;
+
+bool fxp_server_has_extension(const char *name)
+{
+    for (size_t i = 0; i < fxp_nextensions; i++)
+        if (!strcmp(fxp_extensions[i], name))
+            return true;
+    return false;
+}
+
+/*
+ * Ask the server for its limits. Return false only if the connection
+ * has gone away; a server that refuses just leaves fxp_limits zero.
+ */
+static bool fxp_get_limits(void)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout, *pktin;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "limits@openssh.com");
+    sftp_register(req);
+    sftp_send(pktout);
+
+    pktin = sftp_recv();
+    if (!pktin) {
+        fxp_internal_error("could not connect");
+        return false;
+    }
+    if (sftp_find_request(pktin) != req) {
+        sftp_pkt_free(pktin);
+        return false;
+    }
+    sfree(req);
+
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+        uint64_t max_packet = get_uint64(pktin);
+        uint64_t max_read = get_uint64(pktin);
+        uint64_t max_write = get_uint64(pktin);
+        get_uint64(pktin);             /* max open handles: not our problem */
+        if (!get_err(pktin)) {
+            fxp_limits.max_packet = max_packet;
+            fxp_limits.max_read = max_read;
+            fxp_limits.max_write = max_write;
+        }
+    }
+    sftp_pkt_free(pktin);
+    return true;
+}
+
 /*
  * Perform exchange of init/version packets. Return 0 on failure.
  */
@@ -252,6 +318,11 @@ bool fxp_init(void)
     struct sftp_packet *pktout, *pktin;
     unsigned long remotever;
 
+    for (size_t i = 0; i < fxp_nextensions; i++)
+        sfree(fxp_extensions[i]);
+    fxp_nextensions = 0;
+    memset(&fxp_limits, 0, sizeof(fxp_limits));
+
     pktout = sftp_pkt_init(SSH_FXP_INIT);
     put_uint32(pktout, SFTP_PROTO_VERSION);
     sftp_send(pktout);
@@ -278,14 +349,24 @@ bool fxp_init(void)
         sftp_pkt_free(pktin);
         return false;
     }
+
     /*
-     * In principle, this packet might also contain extension-
-     * string pairs. We should work through them and look for any
-     * we recognise. In practice we don't currently do so because
-     * we know we don't recognise _any_.
+     * The rest of the packet is a list of extension-name and
+     * extension-data string pairs. We only need the names.
      */
+    while (get_avail(pktin) > 0) {
+        ptrlen name = get_string(pktin);
+        get_string(pktin);             /* extension data, unused */
+        if (get_err(pktin))
+            break;
+        sgrowarray(fxp_extensions, fxp_extensionsize, fxp_nextensions);
+        fxp_extensions[fxp_nextensions++] = mkstr(name);
+    }
     sftp_pkt_free(pktin);
 
+    if (fxp_server_has_extension("limits@openssh.com") && !fxp_get_limits())
+        return false;
+
     return true;
 }
 
@@ -535,6 +616,39 @@ bool fxp_rename_recv(struct sftp_packet *pktin, struct sftp_request *req)
     return id == 1;
 }
 
+/*
+ * Copy data between two open files on the server, using the
+ * copy-data extension.
+ */
+struct sftp_request *fxp_copy_data_send(
+    struct fxp_handle *src, uint64_t srcoffset, uint64_t length,
+    struct fxp_handle *dst, uint64_t dstoffset)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "copy-data");
+    put_string(pktout, src->hstring, src->hlen);
+    put_uint64(pktout, srcoffset);
+    put_uint64(pktout, length);
+    put_string(pktout, dst->hstring, dst->hlen);
+    put_uint64(pktout, dstoffset);
+    sftp_send(pktout);
+
+    return req;
+}
+
+bool fxp_copy_data_recv(struct sftp_packet *pktin, struct sftp_request *req)
+{
+    int id;
+    sfree(req);
+    id = fxp_got_status(pktin);
+    sftp_pkt_free(pktin);
+    return id == 1;
+}
+
 /*
  * Retrieve the attributes of a file. We have fxp_stat which works
  * on filenames, and fxp_fstat which works on open file handles.
@@ -678,27 +792,36 @@ struct sftp_request *fxp_read_send(struct fxp_handle *handle,
 
 int fxp_read_recv(struct sftp_packet *pktin, struct sftp_request *req,
                   char *buffer, int len)
+{
+    ptrlen data;
+    int ret = fxp_read_recv_ptr(pktin, req, &data, len);
+
+    if (ret >= 0) {
+        memcpy(buffer, data.ptr, data.len);
+        sftp_pkt_free(pktin);
+    }
+    return ret;
+}
+
+int fxp_read_recv_ptr(struct sftp_packet *pktin, struct sftp_request *req,
+                      ptrlen *data, int len)
 {
     sfree(req);
     if (pktin->type == SSH_FXP_DATA) {
-        ptrlen data;
-
-        data = get_string(pktin);
+        *data = get_string(pktin);
         if (get_err(pktin)) {
             fxp_internal_error("READ returned malformed SSH_FXP_DATA packet");
             sftp_pkt_free(pktin);
             return -1;
         }
 
-        if (data.len > len) {
+        if (data->len > len) {
             fxp_internal_error("READ returned more bytes than requested");
             sftp_pkt_free(pktin);
             return -1;
         }
 
-        memcpy(buffer, data.ptr, data.len);
-        sftp_pkt_free(pktin);
-        return data.len;
+        return data->len;
     } else {
         fxp_got_status(pktin);
         sftp_pkt_free(pktin);
@@ -790,7 +913,8 @@ struct fxp_names *fxp_readdir_recv(struct sftp_packet *pktin,
  * Write to a file. Returns 0 on error, 1 on OK.
  */
 struct sftp_request *fxp_write_send(struct fxp_handle *handle,
-                                    void *buffer, uint64_t offset, int len)
+                                    const void *buffer, uint64_t offset,
+                                    int len)
 {
     struct sftp_request *req = sftp_alloc_request();
     struct sftp_packet *pktout;
@@ -813,6 +937,58 @@ bool fxp_write_recv(struct sftp_packet *pktin, struct sftp_request *req)
     return fxp_errtype == SSH_FX_OK;
 }
 
+/*
+ * Ask for hashes of the blocks of an open file, using the check-file
+ * extension.
+ */
+struct sftp_request *fxp_check_file_send(struct fxp_handle *handle,
+                                         const char *algs, uint64_t offset,
+                                         uint64_t len, unsigned blocksize)
+{
+    struct sftp_request *req = sftp_alloc_request();
+    struct sftp_packet *pktout;
+
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    put_uint32(pktout, req->id);
+    put_stringz(pktout, "check-file-handle");
+    put_string(pktout, handle->hstring, handle->hlen);
+    put_stringz(pktout, algs);
+    put_uint64(pktout, offset);
+    put_uint64(pktout, len);
+    put_uint32(pktout, blocksize);
+    sftp_send(pktout);
+
+    return req;
+}
+
+char *fxp_check_file_recv(struct sftp_packet *pktin, struct sftp_request *req,
+                          strbuf *hashes)
+{
+    sfree(req);
+
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+        ptrlen name, data;
+        char *alg;
+
+        name = get_string(pktin);
+        alg = mkstr(get_string(pktin));
+        data = get_data(pktin, get_avail(pktin));
+        if (get_err(pktin) || !ptrlen_eq_string(name, "check-file")) {
+            fxp_internal_error("malformed check-file reply");
+            sfree(alg);
+            sftp_pkt_free(pktin);
+            return NULL;
+        }
+        put_datapl(hashes, data);
+        sftp_pkt_free(pktin);
+        return alg;
+    } else {
+        fxp_got_status(pktin);
+        sftp_pkt_free(pktin);
+        return NULL;
+    }
+}
+
 /*
  * Free up an fxp_names structure.
  */
@@ -867,21 +1043,97 @@ void fxp_set_userdata(struct sftp_request *req, void *data)
 /*
  * A wrapper to go round fxp_read_* and fxp_write_*, which manages
  * the queueing of multiple read/write requests.
+ *
+ * The amount of data we keep outstanding at once (the 'window') is
+ * not fixed. We time every request, and grow the window in the
+ * manner of TCP slow start until either we reach the configured
+ * ceiling, or the round-trip time starts to climb noticeably above
+ * the best we've seen - which is the sign that we're now queueing
+ * data somewhere rather than filling an empty pipe, so there's
+ * nothing to be gained by asking for more at once. At that point we
+ * back off and switch to growing linearly, once per round trip,
+ * which lets us follow changes in the available bandwidth.
+ *
+ * The size of each individual request grows along with the window,
+ * so that a big window doesn't cost a proportionally big number of
+ * packets. Not all servers will return as much data as we ask for in
+ * one read, so if a larger-than-standard read comes back short, we
+ * take that as the server's limit rather than as a sign of EOF.
+ *
+ * Uploads use the same window logic, with one extra input: if the
+ * SSH layer has a backlog of data it hasn't been able to send (i.e.
+ * the channel is throttled because the server's window is full),
+ * then the bottleneck is downstream of us and a bigger SFTP window
+ * won't help, so we hold the window steady instead of growing it.
+ * Writes are never larger than the 32K every server must accept,
+ * since a server receiving an oversized write can't recover from it,
+ * unless the server has told us its real limit with the
+ * limits@openssh.com extension. If it has, that also sets the read
+ * size exactly, instead of leaving us to infer it from short reads.
+ */
+
+#define XFER_MIN_REQSIZE 32768         /* every server must cope with this */
+#define XFER_MAX_REQSIZE 262144
+#define XFER_PACKET_OVERHEAD 1024     /* headroom for everything in a write
+                                        * packet except the data */
+#define XFER_MAX_WRITESIZE XFER_MIN_REQSIZE
+#define XFER_MIN_WINDOW 1048576
+#define XFER_DEFAULT_MAX_WINDOW (32 * 1048576)
+
+/*
+ * Round-trip times above twice the minimum we've seen, plus this much
+ * slack to allow for timer granularity and ordinary jitter, count as
+ * a sign that our window is bigger than the pipe.
  */
+#define XFER_RTT_SLACK (TICKSPERSEC / 50)
+
+static size_t xfer_max_window = XFER_DEFAULT_MAX_WINDOW;
+
+void xfer_set_window_limit(size_t limit)
+{
+    if (limit < XFER_MIN_WINDOW)
+        limit = XFER_MIN_WINDOW;
+    xfer_max_window = limit;
+}
 
 struct req {
-    char *buffer;
+    struct sftp_packet *pkt;           /* read reply holding our data */
+    const void *data;                  /* where in pkt the data is */
     int len, retlen, complete;
     uint64_t offset;
+    unsigned long sent;
     struct req *next, *prev;
 };
 
 struct fxp_xfer {
     uint64_t offset, furthestdata, filesize;
-    int req_totalsize, req_maxsize;
-    bool eof, err;
+    uint64_t end;                      /* download no further than this */
+    uint64_t gap;                      /* earliest read that failed */
+    size_t req_totalsize, req_maxsize;
+    int req_size, req_size_limit;
+    bool eof, err, throttled;
     struct fxp_handle *fh;
     struct req *head, *tail;
+
+    /*
+     * Finished requests are kept for reuse on the 'spare' list,
+     * rather than freed, so that a transfer in its steady state
+     * doesn't go back to the heap for every chunk of the file.
+     * 'lent' holds the ones whose data xfer_download_data has
+     * handed to the caller, until it gives them back.
+     */
+    struct req *spare, *lent;
+
+    /* State of the adaptive window */
+    bool slow_start;
+    bool rtt_valid;
+    unsigned long rtt_min, rtt_smoothed;
+    unsigned long backoff_until;
+
+    /* For xfer_get_stats, and the stalls currently in progress */
+    struct fxp_xfer_stats stats;
+    bool window_full, backlogged;
+    unsigned long window_full_since, backlogged_since;
 };
 
 static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64_t offset)
@@ -891,15 +1143,179 @@ static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64_t offset)
     xfer->fh = fh;
     xfer->offset = offset;
     xfer->head = xfer->tail = NULL;
+    xfer->spare = xfer->lent = NULL;
     xfer->req_totalsize = 0;
-    xfer->req_maxsize = 1048576;
+    xfer->req_maxsize = XFER_MIN_WINDOW;
+    xfer->req_size = XFER_MIN_REQSIZE;
+    xfer->req_size_limit = XFER_MAX_REQSIZE;
+    if (fxp_limits.max_read && fxp_limits.max_read < XFER_MAX_REQSIZE) {
+        xfer->req_size_limit = fxp_limits.max_read;
+        if (xfer->req_size > xfer->req_size_limit)
+            xfer->req_size = xfer->req_size_limit;
+    }
     xfer->err = false;
+    xfer->throttled = false;
     xfer->filesize = UINT64_MAX;
     xfer->furthestdata = 0;
+    xfer->end = UINT64_MAX;
+    xfer->gap = UINT64_MAX;
+
+    xfer->slow_start = true;
+    xfer->rtt_valid = false;
+    xfer->rtt_min = xfer->rtt_smoothed = 0;
+    xfer->backoff_until = GETTICKCOUNT();
+
+    memset(&xfer->stats, 0, sizeof(xfer->stats));
+    xfer->window_full = xfer->backlogged = false;
 
     return xfer;
 }
 
+/*
+ * Note whether we're currently stalled for one reason or another,
+ * adding up how long each stall lasts.
+ */
+static void xfer_note_stall(bool stalled, bool *flag, unsigned long *since,
+                            unsigned long *total)
+{
+    if (stalled && !*flag)
+        *since = GETTICKCOUNT();
+    else if (!stalled && *flag)
+        *total += GETTICKCOUNT() - *since;
+    *flag = stalled;
+}
+
+static void xfer_note_sent(struct fxp_xfer *xfer)
+{
+    if (xfer->stats.max_inflight < xfer->req_totalsize)
+        xfer->stats.max_inflight = xfer->req_totalsize;
+    xfer->stats.inflight_total += xfer->req_totalsize;
+    xfer->stats.sends++;
+}
+
+void xfer_get_stats(struct fxp_xfer *xfer, struct fxp_xfer_stats *stats)
+{
+    unsigned long now = GETTICKCOUNT();
+
+    *stats = xfer->stats;
+    if (xfer->window_full)
+        stats->window_full += now - xfer->window_full_since;
+    if (xfer->backlogged)
+        stats->backlogged += now - xfer->backlogged_since;
+}
+
+/*
+ * Get a request structure, from the transfer's spare list if
+ * possible.
+ */
+static struct req *xfer_req_new(struct fxp_xfer *xfer)
+{
+    struct req *rr = xfer->spare;
+
+    if (rr) {
+        xfer->spare = rr->next;
+    } else {
+        rr = snew(struct req);
+        rr->pkt = NULL;
+    }
+
+    rr->data = NULL;
+    return rr;
+}
+
+static void xfer_req_free(struct fxp_xfer *xfer, struct req *rr)
+{
+    if (rr->pkt) {
+        sftp_pkt_free(rr->pkt);
+        rr->pkt = NULL;
+    }
+    rr->next = xfer->spare;
+    xfer->spare = rr;
+}
+
+static void xfer_req_free_list(struct req *rr)
+{
+    while (rr) {
+        struct req *next = rr->next;
+        if (rr->pkt)
+            sftp_pkt_free(rr->pkt);
+        sfree(rr);
+        rr = next;
+    }
+}
+
+/*
+ * Feed the window-sizing logic with the outcome of one request: its
+ * round-trip time, and how many bytes it moved.
+ */
+static void xfer_update_window(struct fxp_xfer *xfer, struct req *rr,
+                               int bytes)
+{
+    unsigned long now = GETTICKCOUNT();
+    unsigned long rtt = now - rr->sent, limit;
+    size_t window = xfer->req_maxsize;
+    int bucket;
+
+    if (!xfer->stats.requests || rtt < xfer->stats.rtt_min)
+        xfer->stats.rtt_min = rtt;
+    if (rtt > xfer->stats.rtt_max)
+        xfer->stats.rtt_max = rtt;
+    xfer->stats.rtt_total += rtt;
+    xfer->stats.requests++;
+    if (bytes > 0)
+        xfer->stats.bytes += bytes;
+    for (bucket = 0, limit = TICKSPERSEC / 1000;
+         bucket < XFER_RTT_BUCKETS - 1 && rtt >= limit; bucket++)
+        limit *= 4;
+    xfer->stats.rtt_hist[bucket]++;
+
+    if (!xfer->rtt_valid) {
+        xfer->rtt_min = xfer->rtt_smoothed = rtt;
+        xfer->rtt_valid = true;
+    } else {
+        if (rtt < xfer->rtt_min)
+            xfer->rtt_min = rtt;
+        xfer->rtt_smoothed = (7 * xfer->rtt_smoothed + rtt) / 8;
+    }
+
+    if (rtt > 2 * xfer->rtt_min + XFER_RTT_SLACK) {
+        /*
+         * Queueing delay has set in. Back off, but at most once per
+         * round trip, since all the requests that were already in
+         * flight when we noticed will see the same delay.
+         */
+        if ((long)(now - xfer->backoff_until) >= 0) {
+            xfer->slow_start = false;
+            window /= 2;
+            xfer->backoff_until = now + xfer->rtt_smoothed;
+        }
+    } else if (bytes > 0 && !xfer->throttled) {
+        if (xfer->slow_start)
+            window += bytes;           /* doubles once per round trip */
+        else
+            window += (size_t)xfer->req_size * bytes / window;
+    }
+
+    if (window < XFER_MIN_WINDOW)
+        window = XFER_MIN_WINDOW;
+    if (window > xfer_max_window)
+        window = xfer_max_window;
+    xfer->req_maxsize = window;
+
+    /*
+     * Aim for a few dozen requests in flight at once, which is
+     * plenty to keep the pipe full without making each one so
+     * large that losing the tail of the window hurts.
+     */
+    xfer->req_size = window / 32;
+    if (xfer->req_size < XFER_MIN_REQSIZE)
+        xfer->req_size = XFER_MIN_REQSIZE;
+    if (xfer->req_size > xfer->req_size_limit)
+        xfer->req_size = xfer->req_size_limit;
+
+    xfer->throttled = false;
+}
+
 bool xfer_done(struct fxp_xfer *xfer)
 {
     /*
@@ -909,53 +1325,93 @@ bool xfer_done(struct fxp_xfer *xfer)
     return (xfer->eof || xfer->err) && !xfer->head;
 }
 
+/*
+ * Allocate a read request for the given file region, link it into
+ * the queue after 'prev' (or at the tail, if prev is NULL), and send
+ * it.
+ */
+static struct req *xfer_download_send(struct fxp_xfer *xfer, struct req *prev,
+                                      uint64_t offset, int len)
+{
+    struct req *rr;
+    struct sftp_request *req;
+
+    rr = xfer_req_new(xfer);
+    rr->offset = offset;
+    rr->complete = 0;
+    if (!prev)
+        prev = xfer->tail;
+    rr->prev = prev;
+    rr->next = prev ? prev->next : NULL;
+    if (rr->prev)
+        rr->prev->next = rr;
+    else
+        xfer->head = rr;
+    if (rr->next)
+        rr->next->prev = rr;
+    else
+        xfer->tail = rr;
+
+    rr->len = len;
+    rr->sent = GETTICKCOUNT();
+    sftp_register(req = fxp_read_send(xfer->fh, rr->offset, rr->len));
+    fxp_set_userdata(req, rr);
+    req->xfer = xfer;
+
+    xfer->req_totalsize += rr->len;
+    xfer_note_sent(xfer);
+
+#ifdef DEBUG_DOWNLOAD
+    printf("queueing read request %p at %"PRIu64" [len %d]\n",
+           rr, rr->offset, rr->len);
+#endif
+
+    return rr;
+}
+
 void xfer_download_queue(struct fxp_xfer *xfer)
 {
     while (xfer->req_totalsize < xfer->req_maxsize &&
            !xfer->eof && !xfer->err) {
-        /*
-         * Queue a new read request.
-         */
         struct req *rr;
-        struct sftp_request *req;
+        int len = xfer->req_size;
 
-        rr = snew(struct req);
-        rr->offset = xfer->offset;
-        rr->complete = 0;
-        if (xfer->tail) {
-            xfer->tail->next = rr;
-            rr->prev = xfer->tail;
-        } else {
-            xfer->head = rr;
-            rr->prev = NULL;
+        if (xfer->offset >= xfer->end) {
+            xfer->eof = true;          /* reached the end of our range */
+            break;
         }
-        xfer->tail = rr;
-        rr->next = NULL;
-
-        rr->len = 32768;
-        rr->buffer = snewn(rr->len, char);
-        sftp_register(req = fxp_read_send(xfer->fh, rr->offset, rr->len));
-        fxp_set_userdata(req, rr);
+        if (xfer->end - xfer->offset < (uint64_t)len)
+            len = xfer->end - xfer->offset;
 
+        /*
+         * Queue a new read request.
+         */
+        rr = xfer_download_send(xfer, NULL, xfer->offset, len);
         xfer->offset += rr->len;
-        xfer->req_totalsize += rr->len;
-
-#ifdef DEBUG_DOWNLOAD
-        printf("queueing read request %p at %"PRIu64"\n", rr, rr->offset);
-#endif
     }
+
+    xfer_note_stall(xfer->req_totalsize >= xfer->req_maxsize &&
+                    !xfer->eof && !xfer->err, &xfer->window_full,
+                    &xfer->window_full_since, &xfer->stats.window_full);
 }
 
-struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64_t offset)
+struct fxp_xfer *xfer_download_init_range(struct fxp_handle *fh,
+                                          uint64_t offset, uint64_t end)
 {
     struct fxp_xfer *xfer = xfer_init(fh, offset);
 
     xfer->eof = false;
+    xfer->end = end;
     xfer_download_queue(xfer);
 
     return xfer;
 }
 
+struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64_t offset)
+{
+    return xfer_download_init_range(fh, offset, UINT64_MAX);
+}
+
 /*
  * Returns INT_MIN to indicate that it didn't even get as far as
  * fxp_read_recv and hence has not freed pktin.
@@ -963,17 +1419,33 @@ struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64_t offset)
 int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 {
     struct sftp_request *rreq;
-    struct req *rr;
 
     rreq = sftp_find_request(pktin);
     if (!rreq)
         return INT_MIN;            /* this packet doesn't even make sense */
+    return xfer_download_gotreply(xfer, rreq, pktin);
+}
+
+int xfer_download_gotreply(struct fxp_xfer *xfer, struct sftp_request *rreq,
+                           struct sftp_packet *pktin)
+{
+    struct req *rr;
+    ptrlen data;
+
     rr = (struct req *)fxp_get_userdata(rreq);
-    if (!rr) {
+    if (!rr || rreq->xfer != xfer) {
         fxp_internal_error("request ID is not part of the current download");
         return INT_MIN;                /* this packet isn't ours */
     }
-    rr->retlen = fxp_read_recv(pktin, rreq, rr->buffer, rr->len);
+    /*
+     * Rather than copying the data out of the reply packet, keep the
+     * packet itself until the data has been consumed.
+     */
+    rr->retlen = fxp_read_recv_ptr(pktin, rreq, &data, rr->len);
+    if (rr->retlen >= 0) {
+        rr->pkt = pktin;
+        rr->data = data.ptr;
+    }
 #ifdef DEBUG_DOWNLOAD
     printf("read request %p has returned [%d]\n", rr, rr->retlen);
 #endif
@@ -981,6 +1453,8 @@ int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     if ((rr->retlen < 0 && fxp_error_type()==SSH_FX_EOF) || rr->retlen == 0) {
         xfer->eof = true;
         rr->retlen = 0;
+        if (!rr->data)
+            rr->data = "";        /* an empty buffer, to hand back */
         rr->complete = -1;
 #ifdef DEBUG_DOWNLOAD
         printf("setting eof\n");
@@ -993,6 +1467,7 @@ int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     }
 
     rr->complete = 1;
+    xfer_update_window(xfer, rr, rr->retlen);
 
     /*
      * Special case: if we have received fewer bytes than we
@@ -1013,6 +1488,32 @@ int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 #endif
     }
 
+    /*
+     * If a read larger than the size every server is obliged to
+     * support came back short, assume we've found the server's
+     * limit on the size of a single read, rather than the end of
+     * the file. Stop asking for more than that, and send a
+     * follow-up request for the rest of this one's region, queued
+     * directly after it so that the data still comes out in order.
+     * If it really was EOF, the follow-up will say so.
+     */
+    if (rr->retlen > 0 && rr->retlen < rr->len &&
+        rr->len > XFER_MIN_REQSIZE && !xfer->err) {
+        int limit = rr->retlen < XFER_MIN_REQSIZE ?
+            XFER_MIN_REQSIZE : rr->retlen;
+        if (xfer->req_size_limit > limit)
+            xfer->req_size_limit = limit;
+        if (xfer->req_size > limit)
+            xfer->req_size = limit;
+#ifdef DEBUG_DOWNLOAD
+        printf("short block from large read; limiting reads to %d\n",
+               xfer->req_size_limit);
+#endif
+        xfer_download_send(xfer, rr, rr->offset + rr->retlen,
+                           rr->len - rr->retlen);
+        return 1;
+    }
+
     if (rr->retlen < rr->len) {
         uint64_t filesize = rr->offset + (rr->retlen < 0 ? 0 : rr->retlen);
 #ifdef DEBUG_DOWNLOAD
@@ -1037,6 +1538,11 @@ int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     return 1;
 }
 
+struct fxp_xfer *xfer_from_request(struct sftp_request *req)
+{
+    return req->xfer;
+}
+
 void xfer_set_error(struct fxp_xfer *xfer)
 {
     xfer->err = true;
@@ -1055,7 +1561,7 @@ bool xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len)
         struct req *rr = xfer->head;
 
         if (rr->complete > 0) {
-            retbuf = rr->buffer;
+            retbuf = (void *)rr->data;
             retlen = rr->retlen;
 #ifdef DEBUG_DOWNLOAD
             printf("handing back data from read request %p\n", rr);
@@ -1072,7 +1578,12 @@ bool xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len)
         else
             xfer->tail = NULL;
         xfer->req_totalsize -= rr->len;
-        sfree(rr);
+        if (retbuf) {
+            rr->next = xfer->lent;
+            xfer->lent = rr;
+        } else {
+            xfer_req_free(xfer, rr);
+        }
     }
 
     if (retbuf) {
@@ -1083,6 +1594,81 @@ bool xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len)
         return false;
 }
 
+bool xfer_download_data_at(struct fxp_xfer *xfer, void **buf, int *len,
+                           uint64_t *offset)
+{
+    struct req *rr, *next;
+
+    /*
+     * Discard anything in the rr queue with complete < 0; return the
+     * first thing with complete > 0, wherever it is in the queue.
+     */
+    for (rr = xfer->head; rr; rr = next) {
+        next = rr->next;
+        if (!rr->complete)
+            continue;
+
+        if (rr->complete < 0 && rr->retlen < 0 && xfer->gap > rr->offset)
+            xfer->gap = rr->offset;
+
+        if (rr->prev)
+            rr->prev->next = rr->next;
+        else
+            xfer->head = rr->next;
+        if (rr->next)
+            rr->next->prev = rr->prev;
+        else
+            xfer->tail = rr->prev;
+        xfer->req_totalsize -= rr->len;
+
+        if (rr->complete > 0) {
+#ifdef DEBUG_DOWNLOAD
+            printf("handing back data from read request %p at %"PRIu64"\n",
+                   rr, rr->offset);
+#endif
+            *buf = (void *)rr->data;
+            *len = rr->retlen;
+            *offset = rr->offset;
+            rr->next = xfer->lent;
+            xfer->lent = rr;
+            return true;
+        }
+
+#ifdef DEBUG_DOWNLOAD
+        printf("skipping failed read request %p\n", rr);
+#endif
+        xfer_req_free(xfer, rr);
+    }
+
+    return false;
+}
+
+void xfer_download_release(struct fxp_xfer *xfer, void *buf)
+{
+    struct req **prev, *rr;
+
+    for (prev = &xfer->lent; (rr = *prev) != NULL; prev = &rr->next) {
+        if (rr->data == buf) {
+            *prev = rr->next;
+            xfer_req_free(xfer, rr);
+            return;
+        }
+    }
+
+    unreachable("buffer was not lent out by this transfer");
+}
+
+uint64_t xfer_download_contiguous(struct fxp_xfer *xfer)
+{
+    uint64_t toret = xfer->head ? xfer->head->offset : xfer->offset;
+
+    if (toret > xfer->filesize)
+        toret = xfer->filesize;
+    if (toret > xfer->gap)
+        toret = xfer->gap;
+    return toret;
+}
+
 struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64_t offset)
 {
     struct fxp_xfer *xfer = xfer_init(fh, offset);
@@ -1096,21 +1682,65 @@ struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64_t offset)
      * handled once that's done.
      */
     xfer->eof = true;
+    xfer->req_size_limit = XFER_MAX_WRITESIZE;
+    if (fxp_limits.max_write) {
+        uint64_t limit = fxp_limits.max_write;
+        if (fxp_limits.max_packet) {
+            uint64_t room = (fxp_limits.max_packet > XFER_PACKET_OVERHEAD ?
+                             fxp_limits.max_packet - XFER_PACKET_OVERHEAD : 0);
+            if (limit > room)
+                limit = room;
+        }
+        if (limit > XFER_MAX_REQSIZE)
+            limit = XFER_MAX_REQSIZE;
+        if (limit > 0)
+            xfer->req_size_limit = limit;
+    }
+    if (xfer->req_size > xfer->req_size_limit)
+        xfer->req_size = xfer->req_size_limit;
 
     return xfer;
 }
 
 bool xfer_upload_ready(struct fxp_xfer *xfer)
 {
-    return sftp_sendbuffer() == 0;
+    size_t backlog;
+
+    bool full = xfer->req_totalsize >= xfer->req_maxsize;
+
+    xfer_note_stall(full, &xfer->window_full, &xfer->window_full_since,
+                    &xfer->stats.window_full);
+    if (full) {
+        xfer_note_stall(false, &xfer->backlogged, &xfer->backlogged_since,
+                        &xfer->stats.backlogged);
+        return false;                  /* window is full */
+    }
+
+    /*
+     * Allow up to one chunk of data to sit in the SSH layer's
+     * backlog, so that there's something ready to go the moment the
+     * server's channel window opens, but no more than that, so that
+     * a slow server can't make us buffer the whole file locally.
+     */
+    backlog = sftp_sendbuffer();
+    if (backlog > 0)
+        xfer->throttled = true;
+    xfer_note_stall(backlog >= (size_t)xfer->req_size, &xfer->backlogged,
+                    &xfer->backlogged_since, &xfer->stats.backlogged);
+    return backlog < (size_t)xfer->req_size;
 }
 
-void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
+int xfer_upload_chunksize(struct fxp_xfer *xfer)
+{
+    return xfer->req_size;
+}
+
+void xfer_upload_data(struct fxp_xfer *xfer, const void *buffer, int len)
 {
     struct req *rr;
     struct sftp_request *req;
 
-    rr = snew(struct req);
+    rr = xfer_req_new(xfer);
     rr->offset = xfer->offset;
     rr->complete = 0;
     if (xfer->tail) {
@@ -1124,12 +1754,14 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
     rr->next = NULL;
 
     rr->len = len;
-    rr->buffer = NULL;
+    rr->sent = GETTICKCOUNT();
     sftp_register(req = fxp_write_send(xfer->fh, buffer, rr->offset, len));
     fxp_set_userdata(req, rr);
+    req->xfer = xfer;
 
     xfer->offset += rr->len;
     xfer->req_totalsize += rr->len;
+    xfer_note_sent(xfer);
 
 #ifdef DEBUG_UPLOAD
     printf("queueing write request %p at %"PRIu64" [len %d]\n",
@@ -1137,6 +1769,11 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
 #endif
 }
 
+void xfer_upload_skip(struct fxp_xfer *xfer, uint64_t len)
+{
+    xfer->offset += len;
+}
+
 /*
  * Returns INT_MIN to indicate that it didn't even get as far as
  * fxp_write_recv and hence has not freed pktin.
@@ -1144,14 +1781,21 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
 int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 {
     struct sftp_request *rreq;
-    struct req *rr, *prev, *next;
-    bool ret;
 
     rreq = sftp_find_request(pktin);
     if (!rreq)
         return INT_MIN;            /* this packet doesn't even make sense */
+    return xfer_upload_gotreply(xfer, rreq, pktin);
+}
+
+int xfer_upload_gotreply(struct fxp_xfer *xfer, struct sftp_request *rreq,
+                         struct sftp_packet *pktin)
+{
+    struct req *rr, *prev, *next;
+    bool ret;
+
     rr = (struct req *)fxp_get_userdata(rreq);
-    if (!rr) {
+    if (!rr || rreq->xfer != xfer) {
         fxp_internal_error("request ID is not part of the current upload");
         return INT_MIN;                /* this packet isn't ours */
     }
@@ -1160,6 +1804,8 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     printf("write request %p has returned [%d]\n", rr, ret ? 1 : 0);
 #endif
 
+    xfer_update_window(xfer, rr, ret ? rr->len : 0);
+
     /*
      * Remove this one from the queue.
      */
@@ -1174,7 +1820,7 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     else
         xfer->tail = prev;
     xfer->req_totalsize -= rr->len;
-    sfree(rr);
+    xfer_req_free(xfer, rr);
 
     if (!ret)
         return -1;
@@ -1184,12 +1830,144 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 
 void xfer_cleanup(struct fxp_xfer *xfer)
 {
-    struct req *rr;
-    while (xfer->head) {
-        rr = xfer->head;
-        xfer->head = xfer->head->next;
-        sfree(rr->buffer);
-        sfree(rr);
-    }
+    xfer_req_free_list(xfer->head);
+    xfer_req_free_list(xfer->spare);
+    xfer_req_free_list(xfer->lent);
     sfree(xfer);
 }
+
+/* ----------------------------------------------------------------------
+ * A wrapper to go round fxp_readdir_*, which keeps several READDIR
+ * requests outstanding on the one directory handle, so that listing
+ * a big directory doesn't cost a round trip per batch of names.
+ */
+
+struct readdir_slot {
+    struct sftp_request *req;
+    struct fxp_names *names;
+    bool complete;
+    int errtype;
+    const char *errmsg;
+};
+
+struct fxp_readdirs {
+    struct fxp_handle *dh;
+    struct readdir_slot *slots;        /* circular queue, in send order */
+    int depth, head, count;
+    bool eof;                          /* a reply has ended the listing */
+    bool ended;                        /* ... and we've handed that out */
+    int errtype;
+    const char *errmsg;
+};
+
+struct fxp_readdirs *readdirs_init(struct fxp_handle *dh, int depth)
+{
+    struct fxp_readdirs *rd = snew(struct fxp_readdirs);
+
+    rd->dh = dh;
+    rd->slots = snewn(depth, struct readdir_slot);
+    rd->depth = depth;
+    rd->head = rd->count = 0;
+    rd->eof = rd->ended = false;
+    rd->errtype = SSH_FX_EOF;
+    rd->errmsg = NULL;
+
+    return rd;
+}
+
+void readdirs_queue(struct fxp_readdirs *rd)
+{
+    while (!rd->eof && rd->count < rd->depth) {
+        struct readdir_slot *slot =
+            &rd->slots[(rd->head + rd->count) % rd->depth];
+
+        slot->req = fxp_readdir_send(rd->dh);
+        sftp_register(slot->req);
+        slot->names = NULL;
+        slot->complete = false;
+        rd->count++;
+    }
+}
+
+bool readdirs_gotreply(struct fxp_readdirs *rd, struct sftp_request *rreq,
+                       struct sftp_packet *pktin)
+{
+    struct readdir_slot *slot = NULL;
+    int i;
+
+    for (i = 0; i < rd->count; i++) {
+        struct readdir_slot *s = &rd->slots[(rd->head + i) % rd->depth];
+        if (!s->complete && s->req == rreq) {
+            slot = s;
+            break;
+        }
+    }
+    if (!slot)
+        return false;
+
+    slot->names = fxp_readdir_recv(pktin, rreq);
+    slot->req = NULL;
+    slot->complete = true;
+    if (slot->names && slot->names->nnames == 0) {
+        /* an empty batch counts as the end of the directory */
+        fxp_free_names(slot->names);
+        slot->names = NULL;
+        fxp_errtype = SSH_FX_EOF;
+        fxp_error_message = "end of file";
+    }
+    if (!slot->names) {
+        slot->errtype = fxp_errtype;
+        slot->errmsg = fxp_error_message;
+        rd->eof = true;
+    }
+
+    return true;
+}
+
+struct fxp_names *readdirs_next(struct fxp_readdirs *rd)
+{
+    while (rd->count > 0 && rd->slots[rd->head].complete) {
+        struct readdir_slot *slot = &rd->slots[rd->head];
+        struct fxp_names *names = slot->names;
+
+        rd->head = (rd->head + 1) % rd->depth;
+        rd->count--;
+
+        if (rd->ended) {
+            /* anything after the end of the listing is discarded */
+            if (names)
+                fxp_free_names(names);
+        } else if (names) {
+            return names;
+        } else {
+            rd->ended = true;
+            rd->errtype = slot->errtype;
+            rd->errmsg = slot->errmsg;
+        }
+    }
+
+    return NULL;
+}
+
+bool readdirs_done(struct fxp_readdirs *rd)
+{
+    if (!rd->ended || rd->count > 0)
+        return false;
+
+    fxp_errtype = rd->errtype;
+    fxp_error_message = rd->errmsg;
+    return true;
+}
+
+void readdirs_cleanup(struct fxp_readdirs *rd)
+{
+    while (rd->count > 0) {
+        struct readdir_slot *slot = &rd->slots[rd->head];
+        if (slot->names)
+            fxp_free_names(slot->names);
+        rd->head = (rd->head + 1) % rd->depth;
+        rd->count--;
+    }
+    sfree(rd->slots);
+    sfree(rd);
+}
@@ -168,6 +168,12 @@ int fxp_error_type(void);
  */
 bool fxp_init(void);
 
+/*
+ * Find out whether the server listed a given extension in its
+ * FXP_VERSION packet.
+ */
+bool fxp_server_has_extension(const char *name);
+
 /*
  * Canonify a pathname. Concatenate the two given path elements
  * with a separating slash, unless the second is NULL.
@@ -223,6 +229,16 @@ struct sftp_request *fxp_rename_send(const char *srcfname,
                                      const char *dstfname);
 bool fxp_rename_recv(struct sftp_packet *pktin, struct sftp_request *req);
 
+/*
+ * Copy a range of one open file into another, entirely on the server,
+ * using the 'copy-data' extension. A length of 0 means copy up to the
+ * end of the source file. Check fxp_server_has_extension first.
+ */
+struct sftp_request *fxp_copy_data_send(
+    struct fxp_handle *src, uint64_t srcoffset, uint64_t length,
+    struct fxp_handle *dst, uint64_t dstoffset);
+bool fxp_copy_data_recv(struct sftp_packet *pktin, struct sftp_request *req);
+
 /*
  * Return file attributes.
  */
@@ -250,14 +266,37 @@ struct sftp_request *fxp_read_send(struct fxp_handle *handle,
                                    uint64_t offset, int len);
 int fxp_read_recv(struct sftp_packet *pktin, struct sftp_request *req,
                   char *buffer, int len);
+/*
+ * Like fxp_read_recv, but instead of copying the data out, points
+ * 'data' at it inside pktin. On success (a return value >= 0) pktin
+ * is therefore not freed, and the caller must free it once it has
+ * finished with the data.
+ */
+int fxp_read_recv_ptr(struct sftp_packet *pktin, struct sftp_request *req,
+                      ptrlen *data, int len);
 
 /*
  * Write to a file.
  */
 struct sftp_request *fxp_write_send(struct fxp_handle *handle,
-                                    void *buffer, uint64_t offset, int len);
+                                    const void *buffer, uint64_t offset,
+                                    int len);
 bool fxp_write_recv(struct sftp_packet *pktin, struct sftp_request *req);
 
+/*
+ * Ask the server to hash each blocksize-byte block of part of an open
+ * file, using the check-file extension. algs is a comma-separated
+ * list of hash names we understand, in order of preference. On
+ * success, the recv function appends the hashes to 'hashes' and
+ * returns the name of the algorithm the server chose, in dynamically
+ * allocated storage.
+ */
+struct sftp_request *fxp_check_file_send(struct fxp_handle *handle,
+                                         const char *algs, uint64_t offset,
+                                         uint64_t len, unsigned blocksize);
+char *fxp_check_file_recv(struct sftp_packet *pktin, struct sftp_request *req,
+                          strbuf *hashes);
+
 /*
  * Read from a directory.
  */
@@ -298,20 +337,112 @@ struct sftp_packet *sftp_recv(void);
 
 struct fxp_xfer;
 
+/*
+ * Set the ceiling on how much data a single transfer may have
+ * outstanding at once. The actual amount adapts to the connection,
+ * within that limit.
+ */
+void xfer_set_window_limit(size_t limit);
+
 struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64_t offset);
+/* Download only the part of the file before 'end' */
+struct fxp_xfer *xfer_download_init_range(struct fxp_handle *fh,
+                                          uint64_t offset, uint64_t end);
 void xfer_download_queue(struct fxp_xfer *xfer);
 int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
 bool xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len);
+/*
+ * The buffers handed back by xfer_download_data and
+ * xfer_download_data_at point into the transfer's own copies of the
+ * server's reply packets, and must not be written to. Once the
+ * caller has finished with one, it must pass it to
+ * xfer_download_release (or else leave it for xfer_cleanup, by not
+ * releasing it before the transfer is cleaned up).
+ */
+void xfer_download_release(struct fxp_xfer *xfer, void *buf);
+/*
+ * Alternative to xfer_download_data, for callers that can write
+ * data anywhere in their output file: hands back each chunk as soon
+ * as it arrives, in whatever order, along with the file offset it
+ * belongs at. Having done that, xfer_download_contiguous says how
+ * much of the file from the start offset onwards has been handed
+ * back without a gap.
+ */
+bool xfer_download_data_at(struct fxp_xfer *xfer, void **buf, int *len,
+                           uint64_t *offset);
+uint64_t xfer_download_contiguous(struct fxp_xfer *xfer);
 
 struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64_t offset);
 bool xfer_upload_ready(struct fxp_xfer *xfer);
-void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len);
+/* The amount of data the caller should pass to each xfer_upload_data */
+int xfer_upload_chunksize(struct fxp_xfer *xfer);
+void xfer_upload_data(struct fxp_xfer *xfer, const void *buffer, int len);
+/* Move on through the remote file without writing, leaving a hole */
+void xfer_upload_skip(struct fxp_xfer *xfer, uint64_t len);
 int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
 
+/*
+ * For clients running several transfers at once over the same
+ * channel, and hence dispatching incoming packets themselves: find
+ * out which transfer (if any) a request belongs to, and then pass
+ * the reply to it. Like the gotpkt functions, these return INT_MIN
+ * if they haven't freed pktin.
+ */
+struct fxp_xfer *xfer_from_request(struct sftp_request *req);
+int xfer_download_gotreply(struct fxp_xfer *xfer, struct sftp_request *rreq,
+                           struct sftp_packet *pktin);
+int xfer_upload_gotreply(struct fxp_xfer *xfer, struct sftp_request *rreq,
+                         struct sftp_packet *pktin);
+
 bool xfer_done(struct fxp_xfer *xfer);
 void xfer_set_error(struct fxp_xfer *xfer);
 void xfer_cleanup(struct fxp_xfer *xfer);
 
+/*
+ * What a transfer has seen of its own progress, for finding out
+ * where the time went when it's slow. Times are in ticks. Reply
+ * latencies are also counted in a histogram: bucket 0 counts replies
+ * taking under 1ms, and each bucket after that goes up by a factor
+ * of 4, except the last, which counts all the rest.
+ */
+#define XFER_RTT_BUCKETS 8
+struct fxp_xfer_stats {
+    uint64_t bytes;                    /* data moved by completed requests */
+    unsigned long requests;            /* READ or WRITE requests completed */
+    size_t max_inflight;               /* most data outstanding at once */
+    uint64_t inflight_total;           /* summed at each send, for a mean */
+    unsigned long sends;
+    unsigned long window_full;         /* time unable to send: SFTP window */
+    unsigned long backlogged;          /* ... upload: SSH layer backed up */
+    unsigned long rtt_min, rtt_max, rtt_total;
+    unsigned long rtt_hist[XFER_RTT_BUCKETS];
+};
+void xfer_get_stats(struct fxp_xfer *xfer, struct fxp_xfer_stats *stats);
+
+/*
+ * A similar wrapper round fxp_readdir_*, keeping up to 'depth'
+ * READDIR requests outstanding on an open directory handle.
+ *
+ * The caller alternates between readdirs_queue, to send more
+ * requests; readdirs_next, to collect each batch of names that has
+ * arrived (in order, and to be freed with fxp_free_names); and
+ * passing incoming replies to readdirs_gotreply, which returns false
+ * (without freeing pktin) for any request that isn't one of its own.
+ * Once readdirs_done returns true, the listing is complete and
+ * fxp_error_type says why it ended: SSH_FX_EOF if the whole
+ * directory was read successfully. Only then may the caller free
+ * the wrapper with readdirs_cleanup; it still closes the directory
+ * handle itself.
+ */
+struct fxp_readdirs;
+struct fxp_readdirs *readdirs_init(struct fxp_handle *dh, int depth);
+void readdirs_queue(struct fxp_readdirs *rd);
+bool readdirs_gotreply(struct fxp_readdirs *rd, struct sftp_request *rreq,
+                       struct sftp_packet *pktin);
+struct fxp_names *readdirs_next(struct fxp_readdirs *rd);
+bool readdirs_done(struct fxp_readdirs *rd);
+void readdirs_cleanup(struct fxp_readdirs *rd);
+
 /*
  * Vtable for the platform-specific filesystem implementation that
  * answers requests in an SFTP server.
@@ -387,6 +518,13 @@ struct SftpServerVtable {
      * then fxp_reply_full_name that many times */
     void (*readdir)(SftpServer *srv, SftpReplyBuilder *reply, ptrlen handle,
                     int max_entries, bool omit_longname);
+
+    /* Optional (NULL if the 'copy-data' extension isn't supported).
+     * A length of 0 means copy to end of file. Should call
+     * fxp_reply_error or fxp_reply_ok */
+    void (*copy_data)(SftpServer *srv, SftpReplyBuilder *reply,
+                      ptrlen srchandle, uint64_t srcoffset, uint64_t length,
+                      ptrlen dsthandle, uint64_t dstoffset);
 };
 
 static inline SftpServer *sftpsrv_new(const SftpServerVtable *vt)
@@ -441,6 +579,11 @@ static inline void sftpsrv_readdir(
     SftpServer *srv, SftpReplyBuilder *reply, ptrlen handle,
     int max_entries, bool omit_longname)
 { srv->vt->readdir(srv, reply, handle, max_entries, omit_longname); }
+static inline void sftpsrv_copy_data(
+    SftpServer *srv, SftpReplyBuilder *reply, ptrlen srchandle,
+    uint64_t srcoffset, uint64_t length, ptrlen dsthandle, uint64_t dstoffset)
+{ srv->vt->copy_data(srv, reply, srchandle, srcoffset, length,
+                     dsthandle, dstoffset); }
 
 typedef struct SftpReplyBuilderVtable SftpReplyBuilderVtable;
 struct SftpReplyBuilder {
@@ -457,6 +600,7 @@ struct SftpReplyBuilderVtable {
     void (*reply_handle)(SftpReplyBuilder *reply, ptrlen handle);
     void (*reply_data)(SftpReplyBuilder *reply, ptrlen data);
     void (*reply_attrs)(SftpReplyBuilder *reply, struct fxp_attrs attrs);
+    SftpReplyBuilder *(*defer)(SftpReplyBuilder *reply);
 };
 
 static inline void fxp_reply_ok(SftpReplyBuilder *reply)
@@ -480,6 +624,24 @@ static inline void fxp_reply_attrs(
     SftpReplyBuilder *reply, struct fxp_attrs attrs)
 { reply->vt->reply_attrs(reply, attrs); }
 
+/*
+ * A request method that can't answer straight away (e.g. because it
+ * has handed the work to another thread) can call fxp_reply_defer to
+ * detach the reply from the request. The returned SftpReplyBuilder
+ * stays valid after the method returns: fill it in later in the usual
+ * way and then pass it to sftp_deferred_reply_send, or to
+ * sftp_deferred_reply_abandon if the reply will never be sent. The
+ * original 'reply' must not be used again.
+ *
+ * Returns NULL if whoever called sftp_handle_request can't accept
+ * deferred replies, in which case the method must reply before
+ * returning, as usual.
+ */
+static inline SftpReplyBuilder *fxp_reply_defer(SftpReplyBuilder *reply)
+{ return reply->vt->defer ? reply->vt->defer(reply) : NULL; }
+void sftp_deferred_reply_send(SftpReplyBuilder *reply);
+void sftp_deferred_reply_abandon(SftpReplyBuilder *reply);
+
 /*
  * The usual implementation of an SftpReplyBuilder, containing a
  * 'struct sftp_packet' which is assumed to be already initialised
@@ -487,9 +649,13 @@ static inline void fxp_reply_attrs(
  */
 extern const struct SftpReplyBuilderVtable DefaultSftpReplyBuilder_vt;
 typedef struct DefaultSftpReplyBuilder DefaultSftpReplyBuilder;
+typedef void (*sftp_deferred_reply_fn_t)(
+    void *ctx, struct sftp_packet *reply);
 struct DefaultSftpReplyBuilder {
     SftpReplyBuilder rb;
     struct sftp_packet *pkt;
+    sftp_deferred_reply_fn_t deferred_fn;  /* NULL if we can't defer */
+    void *deferred_ctx;
 };
 
 /*
@@ -501,6 +667,18 @@ struct DefaultSftpReplyBuilder {
 struct sftp_packet *sftp_handle_request(
     SftpServer *srv, struct sftp_packet *request);
 
+/*
+ * Alternative version which allows the SftpServer to defer its reply.
+ * If it does, this returns NULL, and the reply is passed to 'fn' when
+ * it's ready, possibly after replies to later requests. 'fn' takes
+ * ownership of the packet. If the reply is abandoned (because the
+ * SftpServer is freed first), 'fn' is called with a NULL packet, so
+ * that it can free 'ctx'.
+ */
+struct sftp_packet *sftp_handle_request_deferrable(
+    SftpServer *srv, struct sftp_packet *request,
+    sftp_deferred_reply_fn_t fn, void *ctx);
+
 /* ----------------------------------------------------------------------
  * Not exactly SFTP-related, but here's a system that implements an
  * old-fashioned SCP server module, given an SftpServer vtable to use
@@ -12,12 +12,19 @@
 
 struct sftp_packet *sftp_handle_request(
     SftpServer *srv, struct sftp_packet *req)
+{
+    return sftp_handle_request_deferrable(srv, req, NULL, NULL);
+}
+
+struct sftp_packet *sftp_handle_request_deferrable(
+    SftpServer *srv, struct sftp_packet *req,
+    sftp_deferred_reply_fn_t fn, void *ctx)
 {
     struct sftp_packet *reply;
     unsigned id;
     uint32_t flags;
-    ptrlen path, dstpath, handle, data;
-    uint64_t offset;
+    ptrlen path, dstpath, handle, dsthandle, data, extname;
+    uint64_t offset, dstoffset, copylen;
     unsigned length;
     struct fxp_attrs attrs;
     DefaultSftpReplyBuilder dsrb;
@@ -35,6 +42,10 @@ struct sftp_packet *sftp_handle_request(
          * input packet.
          */
         put_uint32(reply, SFTP_PROTO_VERSION);
+        if (srv->vt->copy_data) {
+            put_stringz(reply, "copy-data");
+            put_stringz(reply, "1");
+        }
         return reply;
     }
 
@@ -48,6 +59,8 @@ struct sftp_packet *sftp_handle_request(
 
     dsrb.rb.vt = &DefaultSftpReplyBuilder_vt;
     dsrb.pkt = reply;
+    dsrb.deferred_fn = fn;
+    dsrb.deferred_ctx = ctx;
     rb = &dsrb.rb;
 
     switch (req->type) {
@@ -184,6 +197,26 @@ struct sftp_packet *sftp_handle_request(
         sftpsrv_write(srv, rb, handle, offset, data);
         break;
 
+      case SSH_FXP_EXTENDED:
+        extname = get_string(req);
+        if (get_err(req))
+            goto decode_error;
+        if (ptrlen_eq_string(extname, "copy-data") && srv->vt->copy_data) {
+            handle = get_string(req);
+            offset = get_uint64(req);
+            copylen = get_uint64(req);
+            dsthandle = get_string(req);
+            dstoffset = get_uint64(req);
+            if (get_err(req))
+                goto decode_error;
+            sftpsrv_copy_data(srv, rb, handle, offset, copylen,
+                              dsthandle, dstoffset);
+        } else {
+            fxp_reply_error(rb, SSH_FX_OP_UNSUPPORTED,
+                            "Unrecognised extended request");
+        }
+        break;
+
       default:
         if (get_err(req))
             goto decode_error;
@@ -195,7 +228,8 @@ struct sftp_packet *sftp_handle_request(
         fxp_reply_error(rb, SSH_FX_BAD_MESSAGE, "Unable to decode request");
     }
 
-    return reply;
+    /* If the server deferred its reply, this will now be NULL */
+    return dsrb.pkt;
 }
 
 static void default_reply_ok(SftpReplyBuilder *reply)
@@ -267,6 +301,38 @@ static void default_reply_attrs(
     put_fxp_attrs(d->pkt, attrs);
 }
 
+static SftpReplyBuilder *default_reply_defer(SftpReplyBuilder *reply)
+{
+    DefaultSftpReplyBuilder *d =
+        container_of(reply, DefaultSftpReplyBuilder, rb);
+    DefaultSftpReplyBuilder *deferred;
+
+    if (!d->deferred_fn)
+        return NULL;
+
+    deferred = snew(DefaultSftpReplyBuilder);
+    *deferred = *d;
+    d->pkt = NULL;                     /* tell sftp_handle_request */
+    return &deferred->rb;
+}
+
+void sftp_deferred_reply_send(SftpReplyBuilder *reply)
+{
+    DefaultSftpReplyBuilder *d =
+        container_of(reply, DefaultSftpReplyBuilder, rb);
+    d->deferred_fn(d->deferred_ctx, d->pkt);
+    sfree(d);
+}
+
+void sftp_deferred_reply_abandon(SftpReplyBuilder *reply)
+{
+    DefaultSftpReplyBuilder *d =
+        container_of(reply, DefaultSftpReplyBuilder, rb);
+    sftp_pkt_free(d->pkt);
+    d->deferred_fn(d->deferred_ctx, NULL);
+    sfree(d);
+}
+
 const SftpReplyBuilderVtable DefaultSftpReplyBuilder_vt = {
     .reply_ok = default_reply_ok,
     .reply_error = default_reply_error,
@@ -276,4 +342,5 @@ const SftpReplyBuilderVtable DefaultSftpReplyBuilder_vt = {
     .reply_handle = default_reply_handle,
     .reply_data = default_reply_data,
     .reply_attrs = default_reply_attrs,
+    .defer = default_reply_defer,
 };
@@ -60,11 +60,25 @@ struct Ssh {
 
     bool fallback_cmd;
     int exitcode;
+    bool sharing_lingering;     /* session over, still up for downstreams */
 
     int version;
     int conn_throttle_count;
     size_t overall_bufsize;
+    size_t socket_backlog;             /* as last reported by the socket */
     bool throttled_all;
+    unsigned long throttled_all_since, throttled_all_ticks;
+
+    /* Socket-level totals for ssh_counters_summary: how many
+     * receive events and writes there have been, and the data in
+     * each */
+    struct {
+        uint64_t calls, bytes;
+    } sock_in, sock_out;
+
+    /* Connection setup phases so far, if CONF_logsetuptiming is set */
+    strbuf *setup_timing;
+    unsigned long setup_start, setup_last;
 
     /*
      * logically_frozen is true if we're not currently _processing_
@@ -160,8 +174,82 @@ static void ssh_connect_bpp(Ssh *ssh)
     ssh->bpp->pls = &ssh->pls;
     ssh->bpp->logctx = ssh->logctx;
     ssh->bpp->remote_bugs = ssh->remote_bugs;
+    ssh->bpp->compression_level =
+        conf_get_int(ssh->conf, CONF_compression_level);
+}
+
+#ifndef NO_GSSAPI
+/*
+ * The GSSAPI library list from the last ssh_gss_setup_cached, kept
+ * for the rest of the process, along with the custom library path it
+ * was set up for and the number of SSH connections using it.
+ */
+static struct ssh_gss_liblist *gss_libs_cache;
+static Filename *gss_libs_cache_custom;
+static int gss_libs_cache_users;
+
+struct ssh_gss_liblist *ssh_gss_setup_cached(Conf *conf, bool *reused)
+{
+    Filename *custom = conf_get_filename(conf, CONF_ssh_gss_custom);
+    struct ssh_gss_liblist *list;
+
+    if (gss_libs_cache && filename_equal(custom, gss_libs_cache_custom)) {
+        gss_libs_cache_users++;
+        if (reused)
+            *reused = true;
+        return gss_libs_cache;
+    }
+
+    list = ssh_gss_setup(conf);
+    if (reused)
+        *reused = false;
+
+    /*
+     * Replace the cached list with this one, unless the cached one
+     * is still in use (for a different custom library), in which
+     * case this one just gets freed at the end of its connection.
+     */
+    if (!gss_libs_cache || gss_libs_cache_users == 0) {
+        if (gss_libs_cache) {
+            ssh_gss_cleanup(gss_libs_cache);
+            filename_free(gss_libs_cache_custom);
+        }
+        gss_libs_cache = list;
+        gss_libs_cache_custom = filename_copy(custom);
+        gss_libs_cache_users = 1;
+    }
+
+    return list;
 }
 
+void ssh_gss_cleanup_cached(struct ssh_gss_liblist *list)
+{
+    if (list == gss_libs_cache)
+        gss_libs_cache_users--;        /* but keep it for next time */
+    else
+        ssh_gss_cleanup(list);
+}
+
+char *ssh_gss_step_summary(const struct ssh_connection_shared_gss_state *gss)
+{
+    static const char *const names[SSH_GSS_NSTEPS] = {
+        "library setup", "import name",
+        "acquire credentials", "security context",
+    };
+    strbuf *sb = strbuf_new();
+    int slowest = 0;
+
+    for (int i = 0; i < SSH_GSS_NSTEPS; i++) {
+        strbuf_catf(sb, "%s%s %lu ms", i ? ", " : "", names[i],
+                    gss->step_ticks[i] * 1000UL / TICKSPERSEC);
+        if (gss->step_ticks[i] > gss->step_ticks[slowest])
+            slowest = i;
+    }
+    strbuf_catf(sb, " (most time in %s)", names[slowest]);
+    return strbuf_to_str(sb);
+}
+#endif
+
 static void ssh_connect_ppl(Ssh *ssh, PacketProtocolLayer *ppl)
 {
     ppl->bpp = ssh->bpp;
@@ -180,6 +268,7 @@ static void ssh_got_ssh_version(struct ssh_version_receiver *rcv,
     PacketProtocolLayer *connection_layer;
 
     ssh->session_started = true;
+    ssh_setup_mark(ssh, "verstring");
 
     /*
      * We don't support choosing a major protocol version dynamically,
@@ -212,8 +301,15 @@ static void ssh_got_ssh_version(struct ssh_version_receiver *rcv,
 #ifndef NO_GSSAPI
             /* Load and pick the highest GSS library on the preference
              * list. */
-            if (!ssh->gss_state.libs)
-                ssh->gss_state.libs = ssh_gss_setup(ssh->conf);
+            if (!ssh->gss_state.libs) {
+                bool reused;
+                SSH_GSS_TIMED(&ssh->gss_state, SSH_GSS_STEP_SETUP,
+                              ssh->gss_state.libs = ssh_gss_setup_cached(
+                                  ssh->conf, &reused));
+                if (reused)
+                    ssh_logevent(("Reusing GSSAPI libraries loaded earlier "
+                                  "in this process"));
+            }
             ssh->gss_state.lib = NULL;
             if (ssh->gss_state.libs->nlibraries > 0) {
                 int i, j;
@@ -252,9 +348,12 @@ static void ssh_got_ssh_version(struct ssh_version_receiver *rcv,
 
                 userauth_layer = ssh2_userauth_new(
                     connection_layer, ssh->savedhost, ssh->fullhostname,
+                    ssh->savedport,
                     conf_get_filename(ssh->conf, CONF_keyfile),
                     conf_get_bool(ssh->conf, CONF_ssh_show_banner),
-                    conf_get_bool(ssh->conf, CONF_tryagent), username,
+                    conf_get_bool(ssh->conf, CONF_tryagent),
+                    conf_get_int(ssh->conf, CONF_agent_key_probes),
+                    conf_get_bool(ssh->conf, CONF_remember_auth), username,
                     conf_get_bool(ssh->conf, CONF_change_username),
                     conf_get_bool(ssh->conf, CONF_try_ki_auth),
 #ifndef NO_GSSAPI
@@ -339,9 +438,16 @@ void ssh_check_frozen(Ssh *ssh)
     if (!ssh->s)
         return;
 
+    /*
+     * The BPP can't take anything out of in_raw until a whole packet
+     * has arrived, so the backlog we tolerate has to leave room for
+     * one of the largest packets we accept, or we'd stop reading the
+     * socket with no way to start again.
+     */
     bool prev_frozen = ssh->socket_frozen;
     ssh->socket_frozen = (ssh->logically_frozen ||
-                          bufchain_size(&ssh->in_raw) > SSH_MAX_BACKLOG);
+                          bufchain_size(&ssh->in_raw) >
+                          SSH_MAX_BACKLOG + OUR_V2_PACKETLIMIT);
     sk_set_frozen(ssh->s, ssh->socket_frozen);
     if (prev_frozen && !ssh->socket_frozen && ssh->bpp) {
         /*
@@ -367,12 +473,16 @@ static void ssh_bpp_output_raw_data_callback(void *vctx)
     while (bufchain_size(&ssh->out_raw) > 0) {
         size_t backlog;
 
-        ptrlen data = bufchain_prefix(&ssh->out_raw);
+        ptrlen data = bufchain_prefix_coalesced(
+            &ssh->out_raw, SSH_RAW_WRITE_COALESCE);
 
         if (ssh->logctx)
             log_packet(ssh->logctx, PKT_OUTGOING, -1, NULL, data.ptr, data.len,
                        0, NULL, NULL, 0, NULL);
         backlog = sk_write(ssh->s, data.ptr, data.len);
+        ssh->socket_backlog = backlog;
+        ssh->sock_out.calls++;
+        ssh->sock_out.bytes += data.len;
 
         bufchain_consume(&ssh->out_raw, data.len);
 
@@ -384,6 +494,9 @@ static void ssh_bpp_output_raw_data_callback(void *vctx)
 
     ssh_check_frozen(ssh);
 
+    if (ssh->cl)
+        ssh_output_drained(ssh->cl);
+
     if (ssh->pending_close) {
         sk_close(ssh->s);
         ssh->s = NULL;
@@ -421,6 +534,19 @@ static void ssh_shutdown(Ssh *ssh)
     ssh_shutdown_internal(ssh);
 
     if (ssh->bpp) {
+        PacketPoolStats pps;
+        ssh_packet_pool_stats(&pps);
+        if (pps.pktin_allocs || pps.pktout_allocs)
+            ssh_logevent(("Packet pools reused %lu of %lu incoming and "
+                          "%lu of %lu outgoing packets",
+                          pps.pktin_reused, pps.pktin_allocs,
+                          pps.pktout_reused, pps.pktout_allocs));
+        {
+            char *stats = mempool_stats_summary();
+            ssh_logevent(("Memory pools: %s", stats));
+            sfree(stats);
+        }
+
         ssh_bpp_free(ssh->bpp);
         ssh->bpp = NULL;
     }
@@ -590,10 +716,13 @@ static void ssh_socket_log(Plug *plug, PlugLogType type, SockAddr *addr,
      * simply wait and see whether it worked afterwards.
      */
 
-    if (!ssh->attempting_connshare)
+    if (!ssh->attempting_connshare) {
         backend_socket_log(ssh->seat, ssh->logctx, type, addr, port,
                            error_msg, error_code, ssh->conf,
                            ssh->session_started);
+        if (type == PLUGLOG_CONNECT_SUCCESS)
+            ssh_setup_mark(ssh, "connect");
+    }
 }
 
 static void ssh_closing(Plug *plug, const char *error_msg, int error_code,
@@ -618,6 +747,8 @@ static void ssh_receive(Plug *plug, int urgent, const char *data, size_t len)
                    0, NULL, NULL, 0, NULL);
 
     bufchain_add(&ssh->in_raw, data, len);
+    ssh->sock_in.calls++;
+    ssh->sock_in.bytes += len;
     if (!ssh->logically_frozen && ssh->bpp)
         queue_idempotent_callback(&ssh->bpp->ic_in_raw);
 
@@ -627,6 +758,7 @@ static void ssh_receive(Plug *plug, int urgent, const char *data, size_t len)
 static void ssh_sent(Plug *plug, size_t bufsize)
 {
     Ssh *ssh = container_of(plug, Ssh, plug);
+    ssh->socket_backlog = bufsize;
     /*
      * If the send backlog on the SSH socket itself clears, we should
      * unthrottle the whole world if it was throttled. Also trigger an
@@ -760,9 +892,15 @@ static char *connect_to_host(
         /*
          * Try to find host.
          */
+        if (conf_get_bool(ssh->conf, CONF_logsetuptiming)) {
+            ssh->setup_timing = strbuf_new();
+            ssh->setup_start = ssh->setup_last = GETTICKCOUNT();
+        }
+
         addressfamily = conf_get_int(ssh->conf, CONF_addressfamily);
         addr = name_lookup(host, port, realhost, ssh->conf, addressfamily,
                            ssh->logctx, "SSH connection");
+        ssh_setup_mark(ssh, "lookup");
         if ((err = sk_addr_error(addr)) != NULL) {
             sk_addr_free(addr);
             return dupstr(err);
@@ -850,6 +988,10 @@ static void ssh_throttle_all(Ssh *ssh, bool enable, size_t bufsize)
         return;
     ssh->throttled_all = enable;
     ssh->overall_bufsize = bufsize;
+    if (enable)
+        ssh->throttled_all_since = GETTICKCOUNT();
+    else
+        ssh->throttled_all_ticks += GETTICKCOUNT() - ssh->throttled_all_since;
 
     ssh_throttle_all_channels(ssh->cl, enable);
 }
@@ -860,6 +1002,36 @@ static void ssh_cache_conf_values(Ssh *ssh)
     ssh->pls.omit_data = conf_get_bool(ssh->conf, CONF_logomitdata);
 }
 
+size_t ssh_output_backlog(Ssh *ssh)
+{
+    return bufchain_size(&ssh->out_raw) + ssh->socket_backlog;
+}
+
+void ssh_setup_mark(Ssh *ssh, const char *phase)
+{
+    unsigned long now;
+
+    if (!ssh->setup_timing)
+        return;
+
+    now = GETTICKCOUNT();
+    strbuf_catf(ssh->setup_timing, " %s=%lu", phase,
+                (now - ssh->setup_last) * 1000UL / TICKSPERSEC);
+    ssh->setup_last = now;
+}
+
+void ssh_setup_report(Ssh *ssh)
+{
+    if (!ssh->setup_timing)
+        return;
+
+    ssh_logevent(("Setup timing (ms):%s total=%lu", ssh->setup_timing->s,
+                  (ssh->setup_last - ssh->setup_start) * 1000UL /
+                  TICKSPERSEC));
+    strbuf_free(ssh->setup_timing);
+    ssh->setup_timing = NULL;
+}
+
 bool ssh_is_bare(Ssh *ssh)
 {
     return ssh->backend.vt->protocol == PROT_SSHCONN;
@@ -942,10 +1114,12 @@ static void ssh_free(Backend *be)
         ssh->gss_state.lib->release_cred(
             ssh->gss_state.lib, &ssh->gss_state.ctx);
     if (ssh->gss_state.libs)
-        ssh_gss_cleanup(ssh->gss_state.libs);
+        ssh_gss_cleanup_cached(ssh->gss_state.libs);
 #endif
 
     sfree(ssh->deferred_abort_message);
+    if (ssh->setup_timing)
+        strbuf_free(ssh->setup_timing);
 
     delete_callbacks_for_context(ssh); /* likely to catch ic_out_raw */
 
@@ -1065,8 +1239,10 @@ static const SessionSpecial *ssh_get_specials(Backend *be)
     ctx->specials = NULL;
     ctx->nspecials = ctx->specials_size = 0;
 
-    if (ssh->base_layer)
+    if (ssh->base_layer) {
         ssh_ppl_get_specials(ssh->base_layer, ssh_add_special, ctx);
+        ssh_add_special(ctx, "Dump counters to Event Log", SS_COUNTERS, 0);
+    }
 
     if (ctx->specials) {
         /* If the list is non-empty, terminate it with a SS_EXITMENU. */
@@ -1085,6 +1261,20 @@ static void ssh_special(Backend *be, SessionSpecialCode code, int arg)
 {
     Ssh *ssh = container_of(be, Ssh, backend);
 
+    if (code == SS_COUNTERS) {
+        /* Handled here rather than by a layer, since it's about all
+         * of them */
+        char *summary = ssh_counters_summary(be), *line, *next;
+        for (line = summary; *line; line = next) {
+            next = line + strcspn(line, "\n");
+            if (*next)
+                *next++ = '\0';
+            logevent(ssh->logctx, line);
+        }
+        sfree(summary);
+        return;
+    }
+
     if (ssh->base_layer)
         ssh_ppl_special_cmd(ssh->base_layer, code, arg);
 }
@@ -1138,10 +1328,29 @@ void ssh_got_exitcode(Ssh *ssh, int exitcode)
     ssh->exitcode = exitcode;
 }
 
+void ssh_sharing_lingering(Ssh *ssh)
+{
+    if (ssh->sharing_lingering)
+        return;
+
+    /*
+     * From the front end's point of view, this is the end of the
+     * session, and it may collect the exit code now, even though
+     * the connection itself carries on.
+     */
+    ssh->sharing_lingering = true;
+    if (ssh->exitcode < 0)
+        ssh->exitcode = 0;
+    logevent(ssh->logctx, "Session finished; keeping connection open for "
+             "sharing downstreams");
+    seat_notify_remote_exit(ssh->seat);
+}
+
 static int ssh_return_exitcode(Backend *be)
 {
     Ssh *ssh = container_of(be, Ssh, backend);
-    if (ssh->s && (!ssh->session_started || ssh->base_layer))
+    if (ssh->s && (!ssh->session_started || ssh->base_layer) &&
+        !ssh->sharing_lingering)
         return -1;
     else
         return (ssh->exitcode >= 0 ? ssh->exitcode : INT_MAX);
@@ -1174,6 +1383,67 @@ extern bool ssh_fallback_cmd(Backend *be)
     return ssh->fallback_cmd;
 }
 
+extern void ssh_send_stall_times(Backend *be, unsigned long *window,
+                                 unsigned long *socket)
+{
+    Ssh *ssh = container_of(be, Ssh, backend);
+
+    *window = ssh->cl ? ssh_stdin_window_stall(ssh->cl) : 0;
+    *socket = ssh->throttled_all_ticks;
+    if (ssh->throttled_all)
+        *socket += GETTICKCOUNT() - ssh->throttled_all_since;
+}
+
+static void ssh_bpp_counters(strbuf *out, const char *dir,
+                             const struct BppCountersDirection *c,
+                             size_t queued)
+{
+    strbuf_catf(out, "bpp.%s.packets=%"PRIu64"\n", dir, c->packets);
+    strbuf_catf(out, "bpp.%s.bytes=%"PRIu64"\n", dir, c->bytes);
+    strbuf_catf(out, "bpp.%s.crypto_ns=%"PRIu64"\n", dir, c->crypto_ns);
+    strbuf_catf(out, "bpp.%s.queued=%"SIZEu"\n", dir, queued);
+    if (c->compressed) {
+        strbuf_catf(out, "bpp.%s.uncompressed=%"PRIu64"\n",
+                    dir, c->uncompressed);
+        strbuf_catf(out, "bpp.%s.compressed=%"PRIu64"\n",
+                    dir, c->compressed);
+        strbuf_catf(out, "bpp.%s.compression_ratio=%.3f\n", dir,
+                    (double)c->uncompressed / (double)c->compressed);
+    }
+}
+
+extern char *ssh_counters_summary(Backend *be)
+{
+    Ssh *ssh = container_of(be, Ssh, backend);
+    strbuf *out = strbuf_new();
+
+    strbuf_catf(out, "socket.in.reads=%"PRIu64"\n", ssh->sock_in.calls);
+    strbuf_catf(out, "socket.in.bytes=%"PRIu64"\n", ssh->sock_in.bytes);
+    strbuf_catf(out, "socket.in.queued=%"SIZEu"\n",
+                bufchain_size(&ssh->in_raw));
+    strbuf_catf(out, "socket.out.writes=%"PRIu64"\n", ssh->sock_out.calls);
+    strbuf_catf(out, "socket.out.bytes=%"PRIu64"\n", ssh->sock_out.bytes);
+    strbuf_catf(out, "socket.out.queued=%"SIZEu"\n",
+                bufchain_size(&ssh->out_raw));
+    strbuf_catf(out, "socket.out.backlog=%"SIZEu"\n", ssh->socket_backlog);
+    strbuf_catf(out, "socket.throttled=%d\n", (int)ssh->throttled_all);
+
+    if (ssh->bpp) {
+        const struct BppCounters *c = &ssh->bpp->counters;
+        ssh_bpp_counters(out, "in", &c->in, ssh->bpp->in_pq.pqb.total_size);
+        ssh_bpp_counters(out, "out", &c->out,
+                         ssh->bpp->out_pq.pqb.total_size);
+        strbuf_catf(out, "kex.count=%u\n", c->out.newkeys);
+        strbuf_catf(out, "kex.rekeys=%u\n",
+                    c->out.newkeys ? c->out.newkeys - 1 : 0);
+    }
+
+    if (ssh->cl)
+        ssh_connection_counters(ssh->cl, out);
+
+    return strbuf_to_str(out);
+}
+
 void ssh_got_fallback_cmd(Ssh *ssh)
 {
     ssh->fallback_cmd = true;
@@ -25,8 +25,16 @@ struct ssh_channel;
  *    ensure that the server never has any need to throttle its end
  *    of the connection), so we set this high as well.
  *
- *  - OUR_V2_WINSIZE is the default window size we present on SSH-2
- *    channels.
+ *  - SSH_RAW_WRITE_COALESCE is how much outgoing data we'll gather
+ *    up from separately formatted small packets to hand to the
+ *    network layer in a single write, so that a burst of them
+ *    doesn't cost one system call (and TCP segment) each.
+ *
+ *  - OUR_V2_WINSIZE is the initial window size we present on SSH-2
+ *    channels. We grow it from there if the other end keeps running
+ *    out of window, up to the limit in CONF_ssh_max_window, and
+ *    shrink what we offer if all the channels together are
+ *    buffering more than CONF_ssh_buffer_limit.
  *
  *  - OUR_V2_BIGWIN is the window size we advertise for the only
  *    channel in a simple connection.  It must be <= INT_MAX.
@@ -35,19 +43,24 @@ struct ssh_channel;
  *    to the remote side. This actually has nothing to do with the
  *    size of the _packet_, but is instead a limit on the amount
  *    of data we're willing to receive in a single SSH2 channel
- *    data message.
+ *    data message. We allow up to nearly the whole of
+ *    OUR_V2_PACKETLIMIT, so that a peer able to send big packets
+ *    pays the per-packet costs of MAC, padding and framing as
+ *    rarely as possible.
  *
  *  - OUR_V2_PACKETLIMIT is actually the maximum size of SSH
  *    _packet_ we're prepared to cope with.  It must be a multiple
- *    of the cipher block size, and must be at least 35000.
+ *    of the cipher block size, and must be at least 35000. We use
+ *    the same 256K limit as OpenSSH.
  */
 
 #define SSH1_BUFFER_LIMIT 32768
 #define SSH_MAX_BACKLOG 32768
+#define SSH_RAW_WRITE_COALESCE 16384
 #define OUR_V2_WINSIZE 16384
 #define OUR_V2_BIGWIN 0x7fffffff
-#define OUR_V2_MAXPKT 0x4000UL
-#define OUR_V2_PACKETLIMIT 0x9000UL
+#define OUR_V2_MAXPKT 0x3F000UL
+#define OUR_V2_PACKETLIMIT 0x40000UL
 
 typedef struct PacketQueueNode PacketQueueNode;
 struct PacketQueueNode {
@@ -60,6 +73,13 @@ typedef struct PktIn {
     int type;
     unsigned long sequence; /* SSH-2 incoming sequence number */
     PacketQueueNode qnode;  /* for linking this packet on to a queue */
+    int pool_class;         /* size class for recycling, or -1 if none */
+    /*
+     * How many bytes of the packet's own storage (the BPP's framing)
+     * come before the payload, which the consumer of the packet may
+     * overwrite along with the payload itself. 0 if unknown.
+     */
+    size_t headroom;
     BinarySource_IMPLEMENTATION;
 } PktIn;
 
@@ -164,18 +184,36 @@ int ssh2_censor_packet(
 PktOut *ssh_new_packet(void);
 void ssh_free_pktout(PktOut *pkt);
 
+/*
+ * Allocate a PktIn with room for 'datalen' bytes of packet data
+ * after it (retrieved by snew_plus_get_aux), and give one back. Both
+ * kinds of packet are recycled through free lists rather than going
+ * back to the heap every time; ssh_packet_pool_stats reports how
+ * often an allocation was satisfied that way.
+ */
+PktIn *ssh_new_pktin(size_t datalen);
+void ssh_free_pktin(PktIn *pkt);
+typedef struct PacketPoolStats {
+    unsigned long pktin_allocs, pktin_reused;
+    unsigned long pktout_allocs, pktout_reused;
+} PacketPoolStats;
+void ssh_packet_pool_stats(PacketPoolStats *stats);
+
 Socket *ssh_connection_sharing_init(
     const char *host, int port, Conf *conf, LogContext *logctx,
     Plug *sshplug, ssh_sharing_state **state);
 void ssh_connshare_provide_connlayer(ssh_sharing_state *sharestate,
                                      ConnectionLayer *cl);
 bool ssh_share_test_for_upstream(const char *host, int port, Conf *conf);
+/* 'pkt' is an incoming packet's payload, which sshshare.c may modify
+ * in place, along with up to 'headroom' bytes before it */
 void share_got_pkt_from_server(ssh_sharing_connstate *ctx, int type,
-                               const void *pkt, int pktlen);
+                               void *pkt, int pktlen, size_t headroom);
 void share_activate(ssh_sharing_state *sharestate,
                     const char *server_verstring);
 void sharestate_free(ssh_sharing_state *state);
 int share_ndownstreams(ssh_sharing_state *state);
+void share_output_drained(ssh_sharing_state *state);
 
 void ssh_connshare_log(Ssh *ssh, int event, const char *logtext,
                        const char *ds_err, const char *us_err);
@@ -268,6 +306,11 @@ struct ConnectionLayerVtable {
     /* Indicate that the last downstream has disconnected */
     void (*sharing_no_more_downstreams)(ConnectionLayer *cl);
 
+    /* Ask whether the outgoing backlog has room for a downstream's
+     * bulk channel data now. If not, share_output_drained will
+     * be called when it might have. */
+    bool (*sharing_may_send_bulk)(ConnectionLayer *cl);
+
     /* Query whether the connection layer is doing agent forwarding */
     bool (*agent_forwarding_permitted)(ConnectionLayer *cl);
 
@@ -280,12 +323,25 @@ struct ConnectionLayerVtable {
     /* Query the size of the backlog on standard _input_ */
     size_t (*stdin_backlog)(ConnectionLayer *cl);
 
+    /* Query how long (in ticks) standard input has spent held up
+     * waiting for the server to open the channel window */
+    unsigned long (*stdin_window_stall)(ConnectionLayer *cl);
+
+    /* Append the connection layer's part of ssh_counters_summary,
+     * as lines of the form key=value */
+    void (*counters)(ConnectionLayer *cl, strbuf *out);
+
     /* Tell the connection layer that the SSH connection itself has
      * backed up, so it should tell all currently open channels to
      * cease reading from their local input sources if they can. (Or
      * tell it that that state of affairs has gone away again.) */
     void (*throttle_all_channels)(ConnectionLayer *cl, bool throttled);
 
+    /* Tell the connection layer that outgoing data queued below it
+     * (see ssh_output_backlog) has drained, so that it can schedule
+     * more channel data if it was holding any back. */
+    void (*output_drained)(ConnectionLayer *cl);
+
     /* Ask the connection layer about its current preference for
      * line-discipline options. */
     bool (*ldisc_option)(ConnectionLayer *cl, int option);
@@ -354,6 +410,8 @@ static inline void ssh_sharing_queue_global_request(
 { cl->vt->sharing_queue_global_request(cl, connstate); }
 static inline void ssh_sharing_no_more_downstreams(ConnectionLayer *cl)
 { cl->vt->sharing_no_more_downstreams(cl); }
+static inline bool ssh_sharing_may_send_bulk(ConnectionLayer *cl)
+{ return cl->vt->sharing_may_send_bulk(cl); }
 static inline bool ssh_agent_forwarding_permitted(ConnectionLayer *cl)
 { return cl->vt->agent_forwarding_permitted(cl); }
 static inline void ssh_terminal_size(ConnectionLayer *cl, int w, int h)
@@ -362,8 +420,14 @@ static inline void ssh_stdout_unthrottle(ConnectionLayer *cl, size_t bufsize)
 { cl->vt->stdout_unthrottle(cl, bufsize); }
 static inline size_t ssh_stdin_backlog(ConnectionLayer *cl)
 { return cl->vt->stdin_backlog(cl); }
+static inline unsigned long ssh_stdin_window_stall(ConnectionLayer *cl)
+{ return cl->vt->stdin_window_stall(cl); }
+static inline void ssh_connection_counters(ConnectionLayer *cl, strbuf *out)
+{ cl->vt->counters(cl, out); }
 static inline void ssh_throttle_all_channels(ConnectionLayer *cl, bool thr)
 { cl->vt->throttle_all_channels(cl, thr); }
+static inline void ssh_output_drained(ConnectionLayer *cl)
+{ cl->vt->output_drained(cl); }
 static inline bool ssh_ldisc_option(ConnectionLayer *cl, int option)
 { return cl->vt->ldisc_option(cl, option); }
 static inline void ssh_set_ldisc_option(ConnectionLayer *cl, int opt, bool val)
@@ -383,13 +447,14 @@ void portfwdmgr_close(PortFwdManager *mgr, PortFwdRecord *pfr);
 void portfwdmgr_close_all(PortFwdManager *mgr);
 char *portfwdmgr_connect(PortFwdManager *mgr, Channel **chan_ret,
                          char *hostname, int port, SshChannel *c,
-                         int addressfamily);
+                         int addressfamily, PortFwdRecord *pfr);
 bool portfwdmgr_listen(PortFwdManager *mgr, const char *host, int port,
                        const char *keyhost, int keyport, Conf *conf);
 bool portfwdmgr_unlisten(PortFwdManager *mgr, const char *host, int port);
 Channel *portfwd_raw_new(ConnectionLayer *cl, Plug **plug, bool start_ready);
 void portfwd_raw_free(Channel *pfchan);
 void portfwd_raw_setup(Channel *pfchan, Socket *s, SshChannel *sc);
+Socket *portfwd_idle_socket(Channel *pfchan);
 
 Socket *platform_make_agent_socket(Plug *plug, const char *dirprefix,
                                    char **error, char **name);
@@ -399,9 +464,17 @@ LogContext *ssh_get_logctx(Ssh *ssh);
 /* Communications back to ssh.c from connection layers */
 void ssh_throttle_conn(Ssh *ssh, int adjust);
 void ssh_got_exitcode(Ssh *ssh, int status);
+/* Our own session is over, but we're staying up for sharing downstreams */
+void ssh_sharing_lingering(Ssh *ssh);
 void ssh_ldisc_update(Ssh *ssh);
 void ssh_got_fallback_cmd(Ssh *ssh);
 bool ssh_is_bare(Ssh *ssh);
+/* Outgoing data that has left the BPP but not yet the socket */
+size_t ssh_output_backlog(Ssh *ssh);
+/* Note the end of a connection setup phase, if CONF_logsetuptiming is
+ * set; ssh_setup_report logs them all in one line and stops */
+void ssh_setup_mark(Ssh *ssh, const char *phase);
+void ssh_setup_report(Ssh *ssh);
 
 /* Communications back to ssh.c from the BPP */
 void ssh_conn_processed_data(Ssh *ssh);
@@ -445,6 +518,7 @@ struct RSAKey {
     mp_int *p;
     mp_int *q;
     mp_int *iqmp;
+    RSAPrecomp *precomp;  /* cached by sshrsa.c for private-key operations */
     char *comment;
     ssh_key sshk;
 };
@@ -461,6 +535,7 @@ struct ec_wcurve
 {
     WeierstrassCurve *wc;
     WeierstrassPoint *G;
+    WeierstrassPointTable *G_table;    /* for fast multiplication of G */
     mp_int *G_order;
 };
 
@@ -477,6 +552,7 @@ struct ec_ecurve
 {
     EdwardsCurve *ec;
     EdwardsPoint *G;
+    EdwardsPointTable *G_table;        /* for fast multiplication of G */
     mp_int *G_order;
     unsigned log2_cofactor;
 };
@@ -609,6 +685,12 @@ mp_int *ssh_rsakex_decrypt(
  */
 const char *ssh_ecdhkex_curve_textname(const ssh_kex *kex);
 ecdh_key *ssh_ecdhkex_newkey(const ssh_kex *kex);
+/* ssh_ecdhkex_newkey in two halves: the first chooses the private
+ * key, and the second (the slow part, which doesn't use the random
+ * number generator, so it can run on a worker thread) computes the
+ * public one. The key can't be used until both have been done. */
+ecdh_key *ssh_ecdhkex_newkey_private(const ssh_kex *kex);
+void ssh_ecdhkex_finishkey(ecdh_key *key);
 void ssh_ecdhkex_freekey(ecdh_key *key);
 void ssh_ecdhkex_getpublic(ecdh_key *key, BinarySink *bs);
 mp_int *ssh_ecdhkex_getkey(ecdh_key *key, ptrlen remoteKey);
@@ -636,6 +718,8 @@ struct ssh_cipheralg {
                            unsigned long seq);
     void (*decrypt_length)(ssh_cipher *, void *blk, int len,
                            unsigned long seq);
+    /* Called by the SSH-2 BPP after each packet, if non-NULL */
+    void (*next_message)(ssh_cipher *);
     const char *ssh2_id;
     int blksize;
     /* real_keybits is the number of bits of entropy genuinely used by
@@ -680,6 +764,8 @@ static inline void ssh_cipher_encrypt_length(
 static inline void ssh_cipher_decrypt_length(
     ssh_cipher *c, void *blk, int len, unsigned long seq)
 { c->vt->decrypt_length(c, blk, len, seq); }
+static inline void ssh_cipher_next_message(ssh_cipher *c)
+{ if (c->vt->next_message) c->vt->next_message(c); }
 static inline const struct ssh_cipheralg *ssh_cipher_alg(ssh_cipher *c)
 { return c->vt; }
 
@@ -751,6 +837,7 @@ struct ssh_hashalg {
     const char *text_basename;     /* the semantic name of the hash */
     const char *annotation;   /* extra info, e.g. which of multiple impls */
     const char *text_name;    /* both combined, e.g. "SHA-n (unaccelerated)" */
+    const void *extra;        /* private to the hash module */
 };
 
 static inline ssh_hash *ssh_hash_new(const ssh_hashalg *alg)
@@ -890,7 +977,13 @@ struct ssh_compression_alg {
     /* For zlib@openssh.com: if non-NULL, this name will be considered once
      * userauth has completed successfully. */
     const char *delayed_name;
-    ssh_compressor *(*compress_new)(void);
+    /* If non-NULL, says whether this algorithm can be used at all in
+     * this run (e.g. if it relies on a library found at run time).
+     * name may be NULL if only the delayed form is offered. */
+    bool (*available)(void);
+    /* level runs from 1 (fastest) to 9 (smallest output), as in
+     * zlib; anything else means the algorithm's default. */
+    ssh_compressor *(*compress_new)(int level);
     void (*compress_free)(ssh_compressor *);
     void (*compress)(ssh_compressor *, const unsigned char *block, int len,
                      unsigned char **outblock, int *outlen,
@@ -903,8 +996,8 @@ struct ssh_compression_alg {
 };
 
 static inline ssh_compressor *ssh_compressor_new(
-    const ssh_compression_alg *alg)
-{ return alg->compress_new(); }
+    const ssh_compression_alg *alg, int level)
+{ return alg->compress_new(level); }
 static inline ssh_decompressor *ssh_decompressor_new(
     const ssh_compression_alg *alg)
 { return alg->decompress_new(); }
@@ -920,6 +1013,9 @@ static inline bool ssh_decompressor_decompress(
     ssh_decompressor *d, const unsigned char *block, int len,
     unsigned char **outblock, int *outlen)
 { return d->vt->decompress(d, block, len, outblock, outlen); }
+static inline bool ssh_compression_alg_available(
+    const ssh_compression_alg *alg)
+{ return !alg->available || alg->available(); }
 static inline const ssh_compression_alg *ssh_compressor_alg(
     ssh_compressor *c)
 { return c->vt; }
@@ -963,13 +1059,23 @@ extern const ssh_cipheralg ssh_blowfish_ssh2_ctr;
 extern const ssh_cipheralg ssh_blowfish_ssh2;
 extern const ssh_cipheralg ssh_arcfour256_ssh2;
 extern const ssh_cipheralg ssh_arcfour128_ssh2;
+extern const ssh_cipheralg ssh_aes256_gcm;
+extern const ssh_cipheralg ssh_aes256_gcm_hw;
+extern const ssh_cipheralg ssh_aes256_gcm_sw;
+extern const ssh_cipheralg ssh_aes128_gcm;
+extern const ssh_cipheralg ssh_aes128_gcm_hw;
+extern const ssh_cipheralg ssh_aes128_gcm_sw;
 extern const ssh_cipheralg ssh2_chacha20_poly1305;
+extern const ssh_cipheralg ssh2_chacha20_poly1305_sw;
+extern const ssh_cipheralg ssh2_chacha20_poly1305_hw;
+extern const ssh_cipheralg ssh2_chacha20_poly1305_avx2;
 extern const ssh2_ciphers ssh2_3des;
 extern const ssh2_ciphers ssh2_des;
 extern const ssh2_ciphers ssh2_aes;
 extern const ssh2_ciphers ssh2_blowfish;
 extern const ssh2_ciphers ssh2_arcfour;
 extern const ssh2_ciphers ssh2_ccp;
+extern const ssh2_ciphers ssh2_aesgcm;
 extern const ssh_hashalg ssh_md5;
 extern const ssh_hashalg ssh_sha1;
 extern const ssh_hashalg ssh_sha1_hw;
@@ -978,7 +1084,11 @@ extern const ssh_hashalg ssh_sha256;
 extern const ssh_hashalg ssh_sha256_hw;
 extern const ssh_hashalg ssh_sha256_sw;
 extern const ssh_hashalg ssh_sha384;
+extern const ssh_hashalg ssh_sha384_hw;
+extern const ssh_hashalg ssh_sha384_sw;
 extern const ssh_hashalg ssh_sha512;
+extern const ssh_hashalg ssh_sha512_hw;
+extern const ssh_hashalg ssh_sha512_sw;
 extern const ssh_hashalg ssh_sha3_224;
 extern const ssh_hashalg ssh_sha3_256;
 extern const ssh_hashalg ssh_sha3_384;
@@ -1009,7 +1119,12 @@ extern const ssh2_macalg ssh_hmac_sha1_96;
 extern const ssh2_macalg ssh_hmac_sha1_96_buggy;
 extern const ssh2_macalg ssh_hmac_sha256;
 extern const ssh2_macalg ssh2_poly1305;
+extern const ssh2_macalg ssh2_aesgcm_mac;
 extern const ssh_compression_alg ssh_zlib;
+/* Finish a zlib compressor's output as a complete Deflate stream */
+void zlib_compress_finish(ssh_compressor *sc,
+                          unsigned char **outblock, int *outlen);
+extern const ssh_compression_alg ssh_zstd;
 
 /*
  * On some systems, you have to detect hardware crypto acceleration by
@@ -1018,8 +1133,52 @@ extern const ssh_compression_alg ssh_zlib;
  * platform subdirectory.
  */
 bool platform_aes_hw_available(void);
+/* Look up a function in the zstd library, if one is installed */
+void *platform_zstd_function(const char *name);
 bool platform_sha256_hw_available(void);
 bool platform_sha1_hw_available(void);
+bool platform_sha512_hw_available(void);
+bool platform_sha3_hw_available(void);
+bool platform_pmull_hw_available(void);
+
+/*
+ * Run a batch of independent jobs, calling fn(ctxs[i]) for each i,
+ * and return when they have all finished. On platforms that support
+ * threads, the jobs run concurrently; platform_parallel_jobs() says
+ * how many it's worth submitting in one batch, and returns 1 if
+ * there's no point at all.
+ *
+ * The job function must only touch data belonging to its own
+ * context: in particular it mustn't use the random number generator.
+ */
+unsigned platform_parallel_jobs(void);
+void platform_run_parallel(void (*fn)(void *), void **ctxs, size_t n);
+
+/*
+ * Run fn(ctx) on a background worker thread, and call done(ctx) from
+ * the main event loop once it has finished. Returns false without
+ * doing anything if there are no worker threads to be had, in which
+ * case the caller should do the work itself. fn is subject to the
+ * same restrictions as for platform_run_parallel, and until done is
+ * called, nothing else may touch the data fn is using.
+ */
+bool platform_run_in_background(void (*fn)(void *), void (*done)(void *),
+                                void *ctx);
+
+/*
+ * Wait for a job started by platform_run_in_background to finish (or
+ * run it here, if no worker has picked it up yet), and call its done
+ * function now rather than from the event loop. For callers that
+ * sometimes can't proceed without the results.
+ */
+void platform_finish_background(void *ctx);
+
+/*
+ * A monotonic clock with much finer resolution than GETTICKCOUNT, in
+ * nanoseconds from an arbitrary origin, for timing short pieces of
+ * work.
+ */
+uint64_t platform_perf_counter_ns(void);
 
 /*
  * PuTTY version number formatted as an SSH version string.
@@ -1033,6 +1192,22 @@ extern const char sshver[];
  */
 extern bool ssh_fallback_cmd(Backend *backend);
 
+/*
+ * For the file transfer tools to report where a slow transfer's time
+ * went: how long (in ticks) outgoing data has been held up by the
+ * main channel's window, and by the SSH connection's own socket
+ * backing up.
+ */
+extern void ssh_send_stall_times(Backend *backend, unsigned long *window,
+                                 unsigned long *socket);
+
+/*
+ * Running totals for every layer of a live SSH connection (socket,
+ * BPP, connection layer and channels), as a dynamically allocated
+ * string of "key=value" lines, for monitoring to scrape.
+ */
+extern char *ssh_counters_summary(Backend *backend);
+
 /*
  * The PRNG type, defined in sshprng.c. Visible data fields are
  * 'savesize', which suggests how many random bytes you should request
@@ -1050,6 +1225,10 @@ void prng_free(prng *p);
 void prng_seed_begin(prng *p);
 void prng_seed_finish(prng *p);
 void prng_read(prng *p, void *vout, size_t size);
+/* Generate output in bulk, 'size' bytes at a time, and hand it out
+ * from a buffer, instead of running the generator and rekeying on
+ * every prng_read. */
+void prng_enable_buffering(prng *p, size_t size);
 void prng_add_entropy(prng *p, unsigned source_id, ptrlen data);
 size_t prng_seed_bits(prng *p);
 
@@ -1175,6 +1354,7 @@ bool dh_is_gex(const ssh_kex *kex);
 dh_ctx *dh_setup_group(const ssh_kex *kex);
 dh_ctx *dh_setup_gex(mp_int *pval, mp_int *gval);
 int dh_modulus_bit_size(const dh_ctx *ctx);
+int dh_exponent_bits(const dh_ctx *ctx, int nbits, bool short_exponent);
 void dh_cleanup(dh_ctx *);
 mp_int *dh_create_e(dh_ctx *, int nbits);
 const char *dh_validate_f(dh_ctx *, mp_int *f);
@@ -1281,6 +1461,7 @@ enum {
 char *ssh1_pubkey_str(RSAKey *ssh1key);
 void ssh1_write_pubkey(FILE *fp, RSAKey *ssh1key);
 char *ssh2_pubkey_openssh_str(ssh2_userkey *key);
+char *ssh2_pubkey_openssh_str_blob(const char *comment, ptrlen blob);
 void ssh2_write_pubkey(FILE *fp, const char *comment,
                        const void *v_pub_blob, int pub_len,
                        int keytype);
@@ -68,7 +68,8 @@ static void ssh1_bpp_free(BinaryPacketProtocol *bpp)
         ssh_decompressor_free(s->decompctx);
     if (s->crcda_ctx)
         crcda_free_context(s->crcda_ctx);
-    sfree(s->pktin);
+    if (s->pktin)
+        ssh_free_pktin(s->pktin);
     sfree(s);
 }
 
@@ -82,6 +83,8 @@ void ssh1_bpp_new_cipher(BinaryPacketProtocol *bpp,
 
     assert(!s->cipher_in);
     assert(!s->cipher_out);
+    bpp->counters.in.newkeys++;
+    bpp->counters.out.newkeys++;
 
     if (cipher) {
         s->cipher_in = ssh_cipher_new(cipher);
@@ -111,7 +114,7 @@ void ssh1_bpp_start_compression(BinaryPacketProtocol *bpp)
     assert(!s->compctx);
     assert(!s->decompctx);
 
-    s->compctx = ssh_compressor_new(&ssh_zlib);
+    s->compctx = ssh_compressor_new(&ssh_zlib, bpp->compression_level);
     s->decompctx = ssh_decompressor_new(&ssh_zlib);
 
     bpp_logevent("Started zlib (RFC1950) compression");
@@ -158,15 +161,14 @@ static void ssh1_bpp_handle_input(BinaryPacketProtocol *bpp)
         /*
          * Allocate the packet to return, now we know its length.
          */
-        s->pktin = snew_plus(PktIn, s->biglen);
-        s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
-        s->pktin->qnode.on_free_queue = false;
-        s->pktin->type = 0;
+        s->pktin = ssh_new_pktin(s->biglen);
 
         s->maxlen = s->biglen;
         s->data = snew_plus_get_aux(s->pktin);
 
         BPP_READ(s->data, s->biglen);
+        s->bpp.counters.in.packets++;
+        s->bpp.counters.in.bytes += 4 + s->biglen;
 
         if (s->cipher_in && detect_attack(s->crcda_ctx,
                                           s->data, s->biglen, s->iv)) {
@@ -199,17 +201,18 @@ static void ssh1_bpp_handle_input(BinaryPacketProtocol *bpp)
                              "Zlib decompression encountered invalid data");
                 crStopV;
             }
+            s->bpp.counters.in.compressed += s->length + 1;
+            s->bpp.counters.in.uncompressed += decomplen;
 
             if (s->maxlen < s->pad + decomplen) {
                 PktIn *old_pktin = s->pktin;
 
                 s->maxlen = s->pad + decomplen;
-                s->pktin = snew_plus(PktIn, s->maxlen);
-                *s->pktin = *old_pktin; /* structure copy */
+                s->pktin = ssh_new_pktin(s->maxlen);
                 s->data = snew_plus_get_aux(s->pktin);
 
-                smemclr(old_pktin, s->biglen);
-                sfree(old_pktin);
+                smemclr(snew_plus_get_aux(old_pktin), s->biglen);
+                ssh_free_pktin(old_pktin);
             }
 
             memcpy(s->data + s->pad, decompblk, decomplen);
@@ -319,6 +322,8 @@ static void ssh1_bpp_format_packet(struct ssh1_bpp_state *s, PktOut *pkt)
         int complen;
         ssh_compressor_compress(s->compctx, pkt->data + 12, pkt->length - 12,
                                 &compblk, &complen, 0);
+        s->bpp.counters.out.uncompressed += pkt->length - 12;
+        s->bpp.counters.out.compressed += complen;
         /* Replace the uncompressed packet data with the compressed
          * version. */
         pkt->length = 12;
@@ -343,6 +348,8 @@ static void ssh1_bpp_format_packet(struct ssh1_bpp_state *s, PktOut *pkt)
 
     bufchain_add(s->bpp.out_raw, pkt->data + pktoffs,
                  biglen + 4); /* len(length+padding+type+data+CRC) */
+    s->bpp.counters.out.packets++;
+    s->bpp.counters.out.bytes += biglen + 4;
 }
 
 static void ssh1_bpp_handle_output(BinaryPacketProtocol *bpp)
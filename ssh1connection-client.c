@@ -220,7 +220,7 @@ bool ssh1_handle_direction_specific_packet(
                          pf.dhost, port);
             err = portfwdmgr_connect(
                 s->portfwdmgr, &c->chan, pf.dhost, port,
-                &c->sc, pfp->addressfamily);
+                &c->sc, pfp->addressfamily, pfp->pfr);
 
             if (err) {
                 ppl_logevent("Port open failed: %s", err);
@@ -206,7 +206,7 @@ bool ssh1_handle_direction_specific_packet(
         c->connlayer = s;
         err = portfwdmgr_connect(
             s->portfwdmgr, &c->chan, host_str, port,
-            &c->sc, ADDRTYPE_UNSPEC);
+            &c->sc, ADDRTYPE_UNSPEC, NULL);
 
         sfree(host_str);
 
@@ -58,7 +58,10 @@ static bool ssh1_agent_forwarding_permitted(ConnectionLayer *cl);
 static void ssh1_terminal_size(ConnectionLayer *cl, int width, int height);
 static void ssh1_stdout_unthrottle(ConnectionLayer *cl, size_t bufsize);
 static size_t ssh1_stdin_backlog(ConnectionLayer *cl);
+static unsigned long ssh1_stdin_window_stall(ConnectionLayer *cl);
+static void ssh1_counters(ConnectionLayer *cl, strbuf *out);
 static void ssh1_throttle_all_channels(ConnectionLayer *cl, bool throttled);
+static void ssh1_output_drained(ConnectionLayer *cl);
 static bool ssh1_ldisc_option(ConnectionLayer *cl, int option);
 static void ssh1_set_ldisc_option(ConnectionLayer *cl, int option, bool value);
 static void ssh1_enable_x_fwd(ConnectionLayer *cl);
@@ -77,7 +80,10 @@ static const ConnectionLayerVtable ssh1_connlayer_vtable = {
     .terminal_size = ssh1_terminal_size,
     .stdout_unthrottle = ssh1_stdout_unthrottle,
     .stdin_backlog = ssh1_stdin_backlog,
+    .stdin_window_stall = ssh1_stdin_window_stall,
+    .counters = ssh1_counters,
     .throttle_all_channels = ssh1_throttle_all_channels,
+    .output_drained = ssh1_output_drained,
     .ldisc_option = ssh1_ldisc_option,
     .set_ldisc_option = ssh1_set_ldisc_option,
     .enable_x_fwd = ssh1_enable_x_fwd,
@@ -735,6 +741,20 @@ static size_t ssh1_stdin_backlog(ConnectionLayer *cl)
     return 0;
 }
 
+static unsigned long ssh1_stdin_window_stall(ConnectionLayer *cl)
+{
+    return 0;                          /* SSH-1 has no channel windows */
+}
+
+static void ssh1_counters(ConnectionLayer *cl, strbuf *out)
+{
+    struct ssh1_connection_state *s =
+        container_of(cl, struct ssh1_connection_state, cl);
+
+    /* SSH-1 channels have no windows to report */
+    strbuf_catf(out, "channel.count=%d\n", count234(s->channels));
+}
+
 static void ssh1_throttle_all_channels(ConnectionLayer *cl, bool throttled)
 {
     struct ssh1_connection_state *s =
@@ -746,6 +766,11 @@ static void ssh1_throttle_all_channels(ConnectionLayer *cl, bool throttled)
         chan_set_input_wanted(c->chan, !throttled);
 }
 
+static void ssh1_output_drained(ConnectionLayer *cl)
+{
+    /* SSH-1 channel data isn't scheduled, so there's nothing to do */
+}
+
 static bool ssh1_ldisc_option(ConnectionLayer *cl, int option)
 {
     struct ssh1_connection_state *s =
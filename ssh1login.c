@@ -310,7 +310,8 @@ static void ssh1_login_process_queue(PacketProtocolLayer *ppl)
             if (next_cipher == CIPHER_WARN) {
                 /* If/when we choose a cipher, warn about it */
                 warn = true;
-            } else if (next_cipher == CIPHER_AES) {
+            } else if (next_cipher == CIPHER_AES ||
+                       next_cipher == CIPHER_AESGCM) {
                 /* XXX Probably don't need to mention this. */
                 ppl_logevent("AES not supported in SSH-1, skipping");
             } else {
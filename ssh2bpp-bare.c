@@ -50,7 +50,8 @@ static void ssh2_bare_bpp_free(BinaryPacketProtocol *bpp)
 {
     struct ssh2_bare_bpp_state *s =
         container_of(bpp, struct ssh2_bare_bpp_state, bpp);
-    sfree(s->pktin);
+    if (s->pktin)
+        ssh_free_pktin(s->pktin);
     sfree(s);
 }
 
@@ -88,9 +89,7 @@ static void ssh2_bare_bpp_handle_input(BinaryPacketProtocol *bpp)
         /*
          * Allocate the packet to return, now we know its length.
          */
-        s->pktin = snew_plus(PktIn, s->packetlen);
-        s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
-        s->pktin->qnode.on_free_queue = false;
+        s->pktin = ssh_new_pktin(s->packetlen);
         s->maxlen = 0;
         s->data = snew_plus_get_aux(s->pktin);
 
@@ -100,6 +99,8 @@ static void ssh2_bare_bpp_handle_input(BinaryPacketProtocol *bpp)
          * Read the remainder of the packet.
          */
         BPP_READ(s->data, s->packetlen);
+        s->bpp.counters.in.packets++;
+        s->bpp.counters.in.bytes += 4 + s->packetlen;
 
         /*
          * The data we just read is precisely the initial type byte
@@ -109,6 +110,7 @@ static void ssh2_bare_bpp_handle_input(BinaryPacketProtocol *bpp)
         s->data++;
         s->packetlen--;
         BinarySource_INIT(s->pktin, s->data, s->packetlen);
+        s->pktin->headroom = 1;
 
         /*
          * Log incoming packet, possibly omitting sensitive fields.
@@ -126,7 +128,7 @@ static void ssh2_bare_bpp_handle_input(BinaryPacketProtocol *bpp)
         }
 
         if (ssh2_bpp_check_unimplemented(&s->bpp, s->pktin)) {
-            sfree(s->pktin);
+            ssh_free_pktin(s->pktin);
             s->pktin = NULL;
             continue;
         }
@@ -177,6 +179,8 @@ static void ssh2_bare_bpp_format_packet(struct ssh2_bare_bpp_state *s,
 
     PUT_32BIT_MSB_FIRST(pkt->data, pkt->length - 4);
     bufchain_add(s->bpp.out_raw, pkt->data, pkt->length);
+    s->bpp.counters.out.packets++;
+    s->bpp.counters.out.bytes += pkt->length;
 }
 
 static void ssh2_bare_bpp_handle_output(BinaryPacketProtocol *bpp)
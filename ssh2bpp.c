@@ -25,6 +25,7 @@ struct ssh2_bpp_state {
     unsigned char *data;
     unsigned cipherblk;
     PktIn *pktin;
+    uint64_t crypto_start;
     struct DataTransferStats *stats;
     bool cbc_ignore_workaround;
 
@@ -38,13 +39,34 @@ struct ssh2_bpp_state {
     bool pending_newkeys;
     bool pending_compression, seen_userauth_success;
 
+    struct ssh2_bpp_sealjob *sealjob;  /* outgoing packets being encrypted */
+    bool freeing;
+
+#ifdef BPP_RECORD
+    FILE *record;
+#endif
+
     BinaryPacketProtocol bpp;
 };
 
+/*
+ * A run of outgoing packets that have been formatted, logged and
+ * padded on the main thread, and are now being encrypted and MACed
+ * by a worker thread (see ssh2_bpp_start_sealjob).
+ */
+struct ssh2_bpp_sealjob {
+    struct ssh2_bpp_state *s;
+    PktOut **pkts;
+    size_t npkts;
+    unsigned long sequence;            /* of pkts[0] */
+    uint64_t crypto_ns;                /* time the worker spent on them */
+};
+
 static void ssh2_bpp_free(BinaryPacketProtocol *bpp);
 static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp);
 static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp);
 static PktOut *ssh2_bpp_new_pktout(int type);
+static void ssh2_bpp_output_callback(void *vctx);
 
 static const BinaryPacketProtocolVtable ssh2_bpp_vtable = {
     .free = ssh2_bpp_free,
@@ -55,6 +77,80 @@ static const BinaryPacketProtocolVtable ssh2_bpp_vtable = {
     .packet_size_limit = 0xFFFFFFFF, /* no special limit for this bpp */
 };
 
+#ifdef BPP_RECORD
+/*
+ * Test builds only (compile with -DBPP_RECORD): if the environment
+ * variable PUTTY_BPP_RECORD names a file, write to it the raw byte
+ * stream the BPP reads from the network, and every set of incoming
+ * keys it's given, so that 'bppbench -replay' can put the same input
+ * through a BPP again without a network or a server. Since that gives
+ * away the session keys, it must never be in a build anyone uses for
+ * real.
+ *
+ * The file is BPP_RECORD_MAGIC, then a byte saying whether we're the
+ * server, then a sequence of records: 'D' and a string of data, or
+ * 'K' followed by the arguments to ssh2_bpp_new_incoming_crypto.
+ */
+static void ssh2_bpp_record_open(struct ssh2_bpp_state *s)
+{
+    const char *name = getenv("PUTTY_BPP_RECORD");
+
+    if (!name || !*name)
+        return;
+    s->record = fopen(name, "wb");
+    if (!s->record)
+        return;
+    fputs(BPP_RECORD_MAGIC, s->record);
+    fputc(s->is_server, s->record);
+}
+
+static void ssh2_bpp_record_write(struct ssh2_bpp_state *s, strbuf *sb)
+{
+    fwrite(sb->u, 1, sb->len, s->record);
+    fflush(s->record);
+    strbuf_free(sb);
+}
+
+static void ssh2_bpp_record_data(struct ssh2_bpp_state *s,
+                                 const void *data, size_t len)
+{
+    strbuf *sb;
+
+    if (!s->record)
+        return;
+    sb = strbuf_new();
+    put_byte(sb, 'D');
+    put_string(sb, data, len);
+    ssh2_bpp_record_write(s, sb);
+}
+
+static void ssh2_bpp_record_keys(
+    struct ssh2_bpp_state *s,
+    const ssh_cipheralg *cipher, const void *ckey, const void *iv,
+    const ssh2_macalg *mac, bool etm_mode, const void *mac_key,
+    const ssh_compression_alg *compression, bool delayed_compression)
+{
+    strbuf *sb;
+
+    if (!s->record)
+        return;
+    sb = strbuf_new_nm();
+    put_byte(sb, 'K');
+    put_stringz(sb, cipher ? cipher->ssh2_id : "");
+    put_string(sb, ckey, cipher ? cipher->padded_keybytes : 0);
+    put_string(sb, iv, cipher ? cipher->blksize : 0);
+    put_stringz(sb, mac ? mac->name : "");
+    put_bool(sb, etm_mode);
+    put_string(sb, mac_key, mac ? mac->keylen : 0);
+    put_stringz(sb, compression->name ? compression->name :
+                compression->delayed_name);
+    put_bool(sb, delayed_compression);
+    ssh2_bpp_record_write(s, sb);
+}
+#else
+#define ssh2_bpp_record_data(s, data, len) ((void)0)
+#endif
+
 BinaryPacketProtocol *ssh2_bpp_new(
     LogContext *logctx, struct DataTransferStats *stats, bool is_server)
 {
@@ -64,7 +160,13 @@ BinaryPacketProtocol *ssh2_bpp_new(
     s->bpp.logctx = logctx;
     s->stats = stats;
     s->is_server = is_server;
+#ifdef BPP_RECORD
+    ssh2_bpp_record_open(s);
+#endif
     ssh_bpp_common_setup(&s->bpp);
+    /* Only output triggered from the callback is allowed to go to a
+     * worker thread; a direct call to handle_output is a flush */
+    s->bpp.ic_out_pq.fn = ssh2_bpp_output_callback;
     return &s->bpp;
 }
 
@@ -101,10 +203,20 @@ static void ssh2_bpp_free_incoming_crypto(struct ssh2_bpp_state *s)
 static void ssh2_bpp_free(BinaryPacketProtocol *bpp)
 {
     struct ssh2_bpp_state *s = container_of(bpp, struct ssh2_bpp_state, bpp);
+    if (s->sealjob) {
+        /* The worker is using our outgoing cipher and MAC */
+        s->freeing = true;
+        platform_finish_background(s->sealjob);
+    }
     sfree(s->buf);
     ssh2_bpp_free_outgoing_crypto(s);
     ssh2_bpp_free_incoming_crypto(s);
-    sfree(s->pktin);
+    if (s->pktin)
+        ssh_free_pktin(s->pktin);
+#ifdef BPP_RECORD
+    if (s->record)
+        fclose(s->record);
+#endif
     sfree(s);
 }
 
@@ -119,6 +231,7 @@ void ssh2_bpp_new_outgoing_crypto(
     s = container_of(bpp, struct ssh2_bpp_state, bpp);
 
     ssh2_bpp_free_outgoing_crypto(s);
+    bpp->counters.out.newkeys++;
 
     if (cipher) {
         s->out.cipher = ssh_cipher_new(cipher);
@@ -162,7 +275,8 @@ void ssh2_bpp_new_outgoing_crypto(
         /* 'compression' is always non-NULL, because no compression is
          * indicated by ssh_comp_none. But this setup call may return a
          * null out_comp. */
-        s->out_comp = ssh_compressor_new(compression);
+        s->out_comp = ssh_compressor_new(compression,
+                                         bpp->compression_level);
 
         if (s->out_comp)
             bpp_logevent("Initialised %s compression",
@@ -181,6 +295,11 @@ void ssh2_bpp_new_incoming_crypto(
     s = container_of(bpp, struct ssh2_bpp_state, bpp);
 
     ssh2_bpp_free_incoming_crypto(s);
+    bpp->counters.in.newkeys++;
+#ifdef BPP_RECORD
+    ssh2_bpp_record_keys(s, cipher, ckey, iv, mac, etm_mode, mac_key,
+                         compression, delayed_compression);
+#endif
 
     if (cipher) {
         s->in.cipher = ssh_cipher_new(cipher);
@@ -255,7 +374,8 @@ static void ssh2_bpp_enable_pending_compression(struct ssh2_bpp_state *s)
         s->in.pending_compression = NULL;
     }
     if (s->out.pending_compression) {
-        s->out_comp = ssh_compressor_new(s->out.pending_compression);
+        s->out_comp = ssh_compressor_new(s->out.pending_compression,
+                                         bpp->compression_level);
         bpp_logevent("Initialised delayed %s compression",
                      ssh_compressor_alg(s->out_comp)->text_name);
         s->out.pending_compression = NULL;
@@ -270,12 +390,13 @@ static void ssh2_bpp_enable_pending_compression(struct ssh2_bpp_state *s)
                           s->bpp.input_eof);                            \
         if (!success)                                                   \
             goto eof;                                                   \
+        ssh2_bpp_record_data(s, ptr, len);                              \
         ssh_check_frozen(s->bpp.ssh);                                   \
     } while (0)
 
 #define userauth_range(pkttype) ((unsigned)((pkttype) - 50) < 20)
 
-static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
+static void ssh2_bpp_process_input(BinaryPacketProtocol *bpp)
 {
     struct ssh2_bpp_state *s = container_of(bpp, struct ssh2_bpp_state, bpp);
 
@@ -359,10 +480,7 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             /*
              * Now transfer the data into an output packet.
              */
-            s->pktin = snew_plus(PktIn, s->maxlen);
-            s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
-            s->pktin->type = 0;
-            s->pktin->qnode.on_free_queue = false;
+            s->pktin = ssh_new_pktin(s->maxlen);
             s->data = snew_plus_get_aux(s->pktin);
             memcpy(s->data, s->buf, s->maxlen);
         } else if (s->in.mac && s->in.etm_mode) {
@@ -409,10 +527,8 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             /*
              * Allocate the packet to return, now we know its length.
              */
-            s->pktin = snew_plus(PktIn, OUR_V2_PACKETLIMIT + s->maclen);
-            s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
-            s->pktin->type = 0;
-            s->pktin->qnode.on_free_queue = false;
+            s->maxlen = s->packetlen + s->maclen;
+            s->pktin = ssh_new_pktin(s->maxlen);
             s->data = snew_plus_get_aux(s->pktin);
             memcpy(s->data, s->buf, 4);
 
@@ -424,6 +540,7 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             /*
              * Check the MAC.
              */
+            s->crypto_start = platform_perf_counter_ns();
             if (s->in.mac && !ssh2_mac_verify(
                     s->in.mac, s->data, s->len + 4, s->in.sequence)) {
                 ssh_sw_abort(s->bpp.ssh, "Incorrect MAC received on packet");
@@ -434,6 +551,8 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             if (s->in.cipher)
                 ssh_cipher_decrypt(
                     s->in.cipher, s->data + 4, s->packetlen - 4);
+            s->bpp.counters.in.crypto_ns +=
+                platform_perf_counter_ns() - s->crypto_start;
         } else {
             if (s->bufsize < s->cipherblk) {
                 s->bufsize = s->cipherblk;
@@ -474,10 +593,7 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
              * Allocate the packet to return, now we know its length.
              */
             s->maxlen = s->packetlen + s->maclen;
-            s->pktin = snew_plus(PktIn, s->maxlen);
-            s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
-            s->pktin->type = 0;
-            s->pktin->qnode.on_free_queue = false;
+            s->pktin = ssh_new_pktin(s->maxlen);
             s->data = snew_plus_get_aux(s->pktin);
             memcpy(s->data, s->buf, s->cipherblk);
 
@@ -488,6 +604,7 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
                      s->packetlen + s->maclen - s->cipherblk);
 
             /* Decrypt everything _except_ the MAC. */
+            s->crypto_start = platform_perf_counter_ns();
             if (s->in.cipher)
                 ssh_cipher_decrypt(
                     s->in.cipher,
@@ -501,6 +618,8 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
                 ssh_sw_abort(s->bpp.ssh, "Incorrect MAC received on packet");
                 crStopV;
             }
+            s->bpp.counters.in.crypto_ns +=
+                platform_perf_counter_ns() - s->crypto_start;
         }
         /* Get and sanity-check the amount of random padding. */
         s->pad = s->data[4];
@@ -517,8 +636,12 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
         s->length = s->payload + 5;
 
         dts_consume(&s->stats->in, s->packetlen);
+        s->bpp.counters.in.packets++;
+        s->bpp.counters.in.bytes += s->packetlen + s->maclen;
 
         s->pktin->sequence = s->in.sequence++;
+        if (s->in.cipher)
+            ssh_cipher_next_message(s->in.cipher);
 
         s->length = s->packetlen - s->pad;
         assert(s->length >= 0);
@@ -532,16 +655,19 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             if (s->in_decomp && ssh_decompressor_decompress(
                     s->in_decomp, s->data + 5, s->length - 5,
                     &newpayload, &newlen)) {
+                s->bpp.counters.in.compressed += s->length - 5;
+                s->bpp.counters.in.uncompressed += newlen;
                 if (s->maxlen < newlen + 5) {
                     PktIn *old_pktin = s->pktin;
 
                     s->maxlen = newlen + 5;
-                    s->pktin = snew_plus(PktIn, s->maxlen);
-                    *s->pktin = *old_pktin; /* structure copy */
+                    s->pktin = ssh_new_pktin(s->maxlen);
+                    s->pktin->sequence = old_pktin->sequence;
                     s->data = snew_plus_get_aux(s->pktin);
 
-                    smemclr(old_pktin, s->packetlen + s->maclen);
-                    sfree(old_pktin);
+                    smemclr(snew_plus_get_aux(old_pktin),
+                            s->packetlen + s->maclen);
+                    ssh_free_pktin(old_pktin);
                 }
                 s->length = 5 + newlen;
                 memcpy(s->data + 5, newpayload, newlen);
@@ -570,6 +696,9 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             s->length -= 6;
         }
         BinarySource_INIT(s->pktin, s->data, s->length);
+        s->pktin->headroom =
+            s->data - (unsigned char *)snew_plus_get_aux(s->pktin);
+        probe2(bpp_recv, s->pktin->type, s->length);
 
         if (s->bpp.logctx) {
             logblank_t blanks[MAX_BLANKS];
@@ -584,7 +713,7 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
         }
 
         if (ssh2_bpp_check_unimplemented(&s->bpp, s->pktin)) {
-            sfree(s->pktin);
+            ssh_free_pktin(s->pktin);
             s->pktin = NULL;
             continue;
         }
@@ -665,6 +794,13 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
     crFinishV;
 }
 
+static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
+{
+    uint64_t trace_start = trace_begin();
+    ssh2_bpp_process_input(bpp);
+    trace_end("ssh2_bpp_handle_input", (uintptr_t)bpp, trace_start);
+}
+
 static PktOut *ssh2_bpp_new_pktout(int pkt_type)
 {
     PktOut *pkt = ssh_new_packet();
@@ -676,7 +812,62 @@ static PktOut *ssh2_bpp_new_pktout(int pkt_type)
     return pkt;
 }
 
-static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
+/*
+ * Encrypt and MAC a packet that ssh2_bpp_prepare_packet has finished
+ * laying out. This is the only part of sending a packet that can be
+ * done on a worker thread, so it uses nothing but the direction
+ * state and the packet.
+ */
+static void ssh2_bpp_seal_packet(struct ssh2_bpp_direction *out, PktOut *pkt,
+                                 unsigned long sequence)
+{
+    int maclen = out->mac ? ssh2_mac_alg(out->mac)->len : 0;
+    int len = pkt->length - maclen;
+
+    /* Encrypt length if the scheme requires it */
+    if (out->cipher &&
+        (ssh_cipher_alg(out->cipher)->flags & SSH_CIPHER_SEPARATE_LENGTH)) {
+        ssh_cipher_encrypt_length(out->cipher, pkt->data, 4, sequence);
+    }
+
+    /*
+     * The cipher and MAC are run as two separate passes over the
+     * packet. It's tempting to interleave them (e.g. AES-NI CTR
+     * blocks alternating with SHA-NI compressions) so the data only
+     * goes through the cache once; but a packet is small enough to
+     * stay in L1 between the passes anyway, and when I tried it, the
+     * per-chunk overhead of feeding the HMAC through its BinarySink
+     * (plus the MAC's 4- or 8-byte offset from the cipher's block
+     * boundaries) more than cancelled out any overlap. So don't
+     * bother unless that changes.
+     */
+    if (out->mac && out->etm_mode) {
+        /*
+         * OpenSSH-defined encrypt-then-MAC protocol.
+         */
+        if (out->cipher)
+            ssh_cipher_encrypt(out->cipher, pkt->data + 4, len - 4);
+        ssh2_mac_generate(out->mac, pkt->data, len, sequence);
+    } else {
+        /*
+         * SSH-2 standard protocol.
+         */
+        if (out->mac)
+            ssh2_mac_generate(out->mac, pkt->data, len, sequence);
+        if (out->cipher)
+            ssh_cipher_encrypt(out->cipher, pkt->data, len);
+    }
+
+    if (out->cipher)
+        ssh_cipher_next_message(out->cipher);
+}
+
+/*
+ * Log, compress and pad a packet, leaving room for the MAC, and
+ * allocate it a sequence number, which is returned.
+ */
+static unsigned long ssh2_bpp_prepare_packet(struct ssh2_bpp_state *s,
+                                             PktOut *pkt)
 {
     int origlen, cipherblk, maclen, padding, unencrypted_prefix, i;
 
@@ -716,6 +907,8 @@ static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
 
         ssh_compressor_compress(s->out_comp, pkt->data + 5, pkt->length - 5,
                                 &newpayload, &newlen, minlen);
+        s->bpp.counters.out.uncompressed += pkt->length - 5;
+        s->bpp.counters.out.compressed += newlen;
         pkt->length = 5;
         put_data(pkt, newpayload, newlen);
         sfree(newpayload);
@@ -741,40 +934,52 @@ static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
     pkt->data[4] = padding;
     PUT_32BIT_MSB_FIRST(pkt->data, origlen + padding - 4);
 
-    /* Encrypt length if the scheme requires it */
-    if (s->out.cipher &&
-        (ssh_cipher_alg(s->out.cipher)->flags & SSH_CIPHER_SEPARATE_LENGTH)) {
-        ssh_cipher_encrypt_length(s->out.cipher, pkt->data, 4,
-                                  s->out.sequence);
-    }
-
     put_padding(pkt, maclen, 0);
 
-    if (s->out.mac && s->out.etm_mode) {
-        /*
-         * OpenSSH-defined encrypt-then-MAC protocol.
-         */
-        if (s->out.cipher)
-            ssh_cipher_encrypt(s->out.cipher,
-                               pkt->data + 4, origlen + padding - 4);
-        ssh2_mac_generate(s->out.mac, pkt->data, origlen + padding,
-                          s->out.sequence);
-    } else {
-        /*
-         * SSH-2 standard protocol.
-         */
-        if (s->out.mac)
-            ssh2_mac_generate(s->out.mac, pkt->data, origlen + padding,
-                              s->out.sequence);
-        if (s->out.cipher)
-            ssh_cipher_encrypt(s->out.cipher, pkt->data, origlen + padding);
-    }
+    dts_consume(&s->stats->out, origlen + padding);
+    s->bpp.counters.out.packets++;
+    s->bpp.counters.out.bytes += pkt->length;
+    probe2(bpp_send, pkt->type, pkt->length);
+    return s->out.sequence++;  /* whether or not we MAC */
+}
 
-    s->out.sequence++;       /* whether or not we MACed */
+static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
+{
+    unsigned long sequence = ssh2_bpp_prepare_packet(s, pkt);
+    uint64_t start = platform_perf_counter_ns();
+    ssh2_bpp_seal_packet(&s->out, pkt, sequence);
+    s->bpp.counters.out.crypto_ns += platform_perf_counter_ns() - start;
+}
 
-    dts_consume(&s->stats->out, origlen + padding);
+/*
+ * Outgoing packets at least this long are passed to out_raw by
+ * reference, and freed once they've been sent. Smaller ones are
+ * cheaper to copy into the spare space in out_raw's last block.
+ */
+#define SSH2_BPP_ADOPT_MIN 4096
+
+static void ssh2_bpp_release_pktout(void *vpkt)
+{
+    ssh_free_pktout((PktOut *)vpkt);
+}
+
+/* Append a finished packet to out_raw, and free it (now or later) */
+static void ssh2_bpp_emit_packet(struct ssh2_bpp_state *s, PktOut *pkt)
+{
+    if (pkt->length >= SSH2_BPP_ADOPT_MIN) {
+        /* Big enough to be worth handing over rather than copying */
+        bufchain_add_external(s->bpp.out_raw, pkt->data, pkt->length,
+                              ssh2_bpp_release_pktout, pkt);
+    } else {
+        bufchain_add(s->bpp.out_raw, pkt->data, pkt->length);
+        ssh_free_pktout(pkt);
+    }
 }
 
+/*
+ * Format a packet and append it to out_raw. Frees the packet (now or
+ * later), so the caller must not touch it afterwards.
+ */
 static void ssh2_bpp_format_packet(struct ssh2_bpp_state *s, PktOut *pkt)
 {
     if (pkt->minlen > 0 && !s->out_comp) {
@@ -841,12 +1046,117 @@ static void ssh2_bpp_format_packet(struct ssh2_bpp_state *s, PktOut *pkt)
     }
 
     ssh2_bpp_format_packet_inner(s, pkt);
-    bufchain_add(s->bpp.out_raw, pkt->data, pkt->length);
+    ssh2_bpp_emit_packet(s, pkt);
 }
 
-static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
+/*
+ * Sending bulk data, the encryption and MAC are most of the work the
+ * main thread does, and they can be taken off it: each packet's
+ * layout, padding and sequence number are settled here (which needs
+ * the random number generator, and is the part that feeds the rekey
+ * accounting), and then a worker encrypts a whole run of packets
+ * while the main thread gets on with generating the next lot. Only
+ * one run is in flight at a time, since the cipher state carries on
+ * from one packet to the next, and the packets reach out_raw in the
+ * order they were taken off out_pq.
+ *
+ * Small runs aren't worth the trip through the worker pool, and
+ * anything other than channel data is done the ordinary way, so that
+ * key exchange and authentication packets are never held up, and
+ * nothing unusual (minimum lengths, the CBC IGNORE workaround, the
+ * wait for delayed compression) has to be coped with here.
+ */
+#define SSH2_BPP_SEALJOB_MIN 16384
+#define SSH2_BPP_SEALJOB_MAX 262144
+
+static bool ssh2_bpp_sealjob_wanted(PktOut *pkt)
+{
+    return ((pkt->type == SSH2_MSG_CHANNEL_DATA ||
+             pkt->type == SSH2_MSG_CHANNEL_EXTENDED_DATA) &&
+            pkt->minlen == 0);
+}
+
+static void ssh2_bpp_sealjob_run(void *vjob)
+{
+    struct ssh2_bpp_sealjob *job = (struct ssh2_bpp_sealjob *)vjob;
+    uint64_t start = platform_perf_counter_ns();
+    for (size_t i = 0; i < job->npkts; i++)
+        ssh2_bpp_seal_packet(&job->s->out, job->pkts[i], job->sequence + i);
+    job->crypto_ns = platform_perf_counter_ns() - start;
+}
+
+static void ssh2_bpp_sealjob_free(struct ssh2_bpp_sealjob *job)
+{
+    struct ssh2_bpp_state *s = job->s;
+
+    s->bpp.counters.out.crypto_ns += job->crypto_ns;
+    for (size_t i = 0; i < job->npkts; i++) {
+        if (s->freeing)
+            ssh_free_pktout(job->pkts[i]);
+        else
+            ssh2_bpp_emit_packet(s, job->pkts[i]);
+    }
+    sfree(job->pkts);
+    sfree(job);
+}
+
+static void ssh2_bpp_sealjob_done(void *vjob)
+{
+    struct ssh2_bpp_sealjob *job = (struct ssh2_bpp_sealjob *)vjob;
+    struct ssh2_bpp_state *s = job->s;
+
+    s->sealjob = NULL;
+    ssh2_bpp_sealjob_free(job);
+    if (!s->freeing)
+        queue_idempotent_callback(&s->bpp.ic_out_pq);
+}
+
+/*
+ * Returns true if it has left a run of packets with a worker, in
+ * which case the caller must wait for ssh2_bpp_sealjob_done.
+ */
+static bool ssh2_bpp_start_sealjob(struct ssh2_bpp_state *s)
+{
+    struct ssh2_bpp_sealjob *job;
+    PktOut *pkt;
+    size_t n = 0, bytes = 0;
+
+    if (!s->out.cipher || s->cbc_ignore_workaround ||
+        s->out.pending_compression)
+        return false;
+
+    for (pkt = pq_first(&s->bpp.out_pq);
+         pkt && ssh2_bpp_sealjob_wanted(pkt) && bytes < SSH2_BPP_SEALJOB_MAX;
+         pkt = pq_next(&s->bpp.out_pq, pkt)) {
+        bytes += pkt->length;
+        n++;
+    }
+    if (bytes < SSH2_BPP_SEALJOB_MIN)
+        return false;
+
+    job = snew(struct ssh2_bpp_sealjob);
+    job->s = s;
+    job->pkts = snewn(n, PktOut *);
+    job->npkts = n;
+    job->sequence = s->out.sequence;
+    for (size_t i = 0; i < n; i++) {
+        job->pkts[i] = pq_pop(&s->bpp.out_pq);
+        ssh2_bpp_prepare_packet(s, job->pkts[i]);
+    }
+
+    if (!platform_run_in_background(ssh2_bpp_sealjob_run,
+                                    ssh2_bpp_sealjob_done, job)) {
+        ssh2_bpp_sealjob_run(job);
+        ssh2_bpp_sealjob_free(job);
+        return false;
+    }
+
+    s->sealjob = job;
+    return true;
+}
+
+static void ssh2_bpp_do_output(struct ssh2_bpp_state *s, bool can_offload)
 {
-    struct ssh2_bpp_state *s = container_of(bpp, struct ssh2_bpp_state, bpp);
     PktOut *pkt;
     int n_userauth;
 
@@ -899,14 +1209,19 @@ static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
         }
     }
 
-    while ((pkt = pq_pop(&s->bpp.out_pq)) != NULL) {
-        int type = pkt->type;
+    while (pq_peek(&s->bpp.out_pq)) {
+        int type;
+
+        if (can_offload && ssh2_bpp_start_sealjob(s))
+            return;
+
+        pkt = pq_pop(&s->bpp.out_pq);
+        type = pkt->type;
 
         if (userauth_range(type))
             n_userauth--;
 
         ssh2_bpp_format_packet(s, pkt);
-        ssh_free_pktout(pkt);
 
         if (n_userauth == 0 && s->out.pending_compression && !s->is_server) {
             /*
@@ -923,3 +1238,34 @@ static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
         }
     }
 }
+
+static void ssh2_bpp_output_callback(void *vctx)
+{
+    BinaryPacketProtocol *bpp = (BinaryPacketProtocol *)vctx;
+    struct ssh2_bpp_state *s = container_of(bpp, struct ssh2_bpp_state, bpp);
+
+    /* If a run of packets is already with a worker, we'll be called
+     * again when it comes back */
+    if (!s->sealjob) {
+        uint64_t trace_start = trace_begin();
+        ssh2_bpp_do_output(s, true);
+        trace_end("ssh2_bpp_handle_output", (uintptr_t)bpp, trace_start);
+    }
+}
+
+static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
+{
+    struct ssh2_bpp_state *s = container_of(bpp, struct ssh2_bpp_state, bpp);
+
+    /*
+     * Callers of this expect every queued packet to be in out_raw by
+     * the time it returns - e.g. before switching to new keys after
+     * NEWKEYS, or before closing the connection - so collect anything
+     * a worker is still encrypting, and do the rest here.
+     */
+    uint64_t trace_start = trace_begin();
+    if (s->sealjob)
+        platform_finish_background(s->sealjob);
+    ssh2_bpp_do_output(s, false);
+    trace_end("ssh2_bpp_handle_output", (uintptr_t)bpp, trace_start);
+}
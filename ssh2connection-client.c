@@ -71,7 +71,7 @@ static ChanopenResult chan_open_forwarded_tcpip(
 
     err = portfwdmgr_connect(
         s->portfwdmgr, &ch, realpf->dhost, realpf->dport,
-        sc, realpf->addressfamily);
+        sc, realpf->addressfamily, realpf->pfr);
     ppl_logevent("Attempting to forward remote port to %s:%d",
                  realpf->dhost, realpf->dport);
     if (err != NULL) {
@@ -503,3 +503,53 @@ bool ssh2_connection_need_antispoof_prompt(struct ssh2_connection_state *s)
     bool success = seat_set_trust_status(s->ppl.seat, false);
     return (!success && !ssh_is_bare(s->ppl.ssh));
 }
+
+static void ssh2_sharing_stats_response(struct ssh2_connection_state *s,
+                                        PktIn *pktin, void *ctx)
+{
+    strbuf *out;
+    unsigned n, i;
+
+    if (pktin->type != SSH2_MSG_REQUEST_SUCCESS) {
+        ssh_sw_abort(s->ppl.ssh, "Connection sharing statistics not "
+                     "available from this connection");
+        return;
+    }
+
+    out = strbuf_new();
+    strbuf_catf(out, "%-10s %8s %14s %14s %10s %10s\n", "downstream",
+                "channels", "bytes up", "bytes down", "queued up",
+                "queued down");
+    n = get_uint32(pktin);
+    for (i = 0; i < n; i++) {
+        unsigned id = get_uint32(pktin);
+        unsigned nchannels = get_uint32(pktin);
+        uint64_t up = get_uint64(pktin);
+        uint64_t down = get_uint64(pktin);
+        uint64_t qup = get_uint64(pktin);
+        uint64_t qdown = get_uint64(pktin);
+        if (get_err(pktin))
+            break;
+        strbuf_catf(out, "%-10u %8u %14"PRIu64" %14"PRIu64" %10"PRIu64
+                    " %10"PRIu64"\n", id, nchannels, up, down, qup, qdown);
+    }
+    seat_stdout(s->ppl.seat, out->s, out->len);
+    strbuf_free(out);
+
+    ssh_got_exitcode(s->ppl.ssh, 0);
+    ssh_user_close(s->ppl.ssh, "Received connection sharing statistics");
+}
+
+/*
+ * Ask a connection-sharing upstream (see sshshare.c) for its
+ * per-downstream statistics, in place of opening a session.
+ */
+void ssh2_connection_request_sharing_stats(struct ssh2_connection_state *s)
+{
+    PktOut *pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_GLOBAL_REQUEST);
+    put_stringz(pktout, "share-stats@putty.projects.tartarus.org");
+    put_bool(pktout, true);            /* want reply */
+    pq_push(s->ppl.out_pq, pktout);
+
+    ssh2_queue_global_request_handler(s, ssh2_sharing_stats_response, NULL);
+}
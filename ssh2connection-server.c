@@ -46,7 +46,7 @@ static ChanopenResult chan_open_direct_tcpip(
     ppl_logevent("Received request to connect to port %s:%d (from %.*s:%d)",
                  dstaddr_str, dstport, PTRLEN_PRINTF(peeraddr), peerport);
     err = portfwdmgr_connect(
-        s->portfwdmgr, &ch, dstaddr_str, dstport, sc, ADDRTYPE_UNSPEC);
+        s->portfwdmgr, &ch, dstaddr_str, dstport, sc, ADDRTYPE_UNSPEC, NULL);
 
     sfree(dstaddr_str);
 
@@ -304,3 +304,8 @@ bool ssh2_connection_need_antispoof_prompt(struct ssh2_connection_state *s)
 {
     return false;
 }
+
+void ssh2_connection_request_sharing_stats(struct ssh2_connection_state *s)
+{
+    unreachable("Should never be called in the server");
+}
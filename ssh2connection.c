@@ -54,11 +54,15 @@ static void ssh2_delete_sharing_channel(
 static void ssh2_sharing_queue_global_request(
     ConnectionLayer *cl, ssh_sharing_connstate *share_ctx);
 static void ssh2_sharing_no_more_downstreams(ConnectionLayer *cl);
+static bool ssh2_sharing_may_send_bulk(ConnectionLayer *cl);
 static bool ssh2_agent_forwarding_permitted(ConnectionLayer *cl);
 static void ssh2_terminal_size(ConnectionLayer *cl, int width, int height);
 static void ssh2_stdout_unthrottle(ConnectionLayer *cl, size_t bufsize);
 static size_t ssh2_stdin_backlog(ConnectionLayer *cl);
+static unsigned long ssh2_stdin_window_stall(ConnectionLayer *cl);
+static void ssh2_counters(ConnectionLayer *cl, strbuf *out);
 static void ssh2_throttle_all_channels(ConnectionLayer *cl, bool throttled);
+static void ssh2_output_drained(ConnectionLayer *cl);
 static bool ssh2_ldisc_option(ConnectionLayer *cl, int option);
 static void ssh2_set_ldisc_option(ConnectionLayer *cl, int option, bool value);
 static void ssh2_enable_x_fwd(ConnectionLayer *cl);
@@ -80,11 +84,15 @@ static const ConnectionLayerVtable ssh2_connlayer_vtable = {
     .delete_sharing_channel = ssh2_delete_sharing_channel,
     .sharing_queue_global_request = ssh2_sharing_queue_global_request,
     .sharing_no_more_downstreams = ssh2_sharing_no_more_downstreams,
+    .sharing_may_send_bulk = ssh2_sharing_may_send_bulk,
     .agent_forwarding_permitted = ssh2_agent_forwarding_permitted,
     .terminal_size = ssh2_terminal_size,
     .stdout_unthrottle = ssh2_stdout_unthrottle,
     .stdin_backlog = ssh2_stdin_backlog,
+    .stdin_window_stall = ssh2_stdin_window_stall,
+    .counters = ssh2_counters,
     .throttle_all_channels = ssh2_throttle_all_channels,
+    .output_drained = ssh2_output_drained,
     .ldisc_option = ssh2_ldisc_option,
     .set_ldisc_option = ssh2_set_ldisc_option,
     .enable_x_fwd = ssh2_enable_x_fwd,
@@ -131,6 +139,8 @@ static void ssh2channel_x11_sharing_handover(
     const char *peer_addr, int peer_port, int endian,
     int protomajor, int protominor, const void *initial_data, int initial_len);
 static void ssh2channel_hint_channel_is_simple(SshChannel *c);
+static void ssh2channel_set_rate_limits(
+    SshChannel *c, RateLimit *own, RateLimit *shared, unsigned weight);
 
 static const SshChannelVtable ssh2channel_vtable = {
     .write = ssh2channel_write,
@@ -154,6 +164,7 @@ static const SshChannelVtable ssh2channel_vtable = {
     .send_signal = ssh2channel_send_signal,
     .send_terminal_size_change = ssh2channel_send_terminal_size_change,
     .hint_channel_is_simple = ssh2channel_hint_channel_is_simple,
+    .set_rate_limits = ssh2channel_set_rate_limits,
 };
 
 static void ssh2_channel_check_close(struct ssh2_channel *c);
@@ -162,6 +173,11 @@ static void ssh2_set_window(struct ssh2_channel *c, int newwin);
 static size_t ssh2_try_send(struct ssh2_channel *c);
 static void ssh2_try_send_and_unthrottle(struct ssh2_channel *c);
 static void ssh2_channel_check_throttle(struct ssh2_channel *c);
+static void ssh2_connection_check_budget(struct ssh2_connection_state *s);
+static void ssh2_channel_count_buffered(
+    struct ssh2_channel *c, size_t out, size_t in);
+static int ssh2_channel_window_limit(struct ssh2_channel *c);
+static void ssh2_connection_schedule(void *vctx);
 static void ssh2_channel_close_local(struct ssh2_channel *c,
                                      const char *reason);
 static void ssh2_channel_destroy(struct ssh2_channel *c);
@@ -209,6 +225,88 @@ static int ssh2_channelfind(void *av, void *bv)
     return 0;
 }
 
+/*
+ * Local channel ids are handed out from a table of slots, so that the
+ * channel a message is for can be found without a search. The low
+ * bits of an id give its slot (offset so that the first id is 256, as
+ * it's always been), and the top bits a generation count, bumped each
+ * time the slot is reused, so that a message citing a channel that's
+ * gone away is rejected even if its slot has a new channel in it.
+ *
+ * The tree s->channels is kept as well, for going through the
+ * channels in id order.
+ */
+#define CHANNEL_SLOT_OFFSET 256
+#define CHANNEL_SLOT_BITS 24
+#define CHANNEL_SLOT_MASK ((1U << CHANNEL_SLOT_BITS) - 1)
+#define CHANNEL_SLOT_MAX (CHANNEL_SLOT_MASK + 1 - CHANNEL_SLOT_OFFSET)
+#define CHANNEL_SLOT_NONE ((size_t)-1)
+
+struct ssh2_channel_slot {
+    struct ssh2_channel *c;     /* NULL if the slot is free */
+    unsigned generation;
+    size_t next_free;
+};
+
+static unsigned ssh2_channel_slot_id(
+    struct ssh2_connection_state *s, size_t slot)
+{
+    return ((s->chanslots[slot].generation << CHANNEL_SLOT_BITS) |
+            (unsigned)(slot + CHANNEL_SLOT_OFFSET));
+}
+
+static void ssh2_channel_add(struct ssh2_connection_state *s,
+                             struct ssh2_channel *c)
+{
+    size_t slot;
+
+    if (s->chanfree != CHANNEL_SLOT_NONE) {
+        slot = s->chanfree;
+        s->chanfree = s->chanslots[slot].next_free;
+    } else {
+        if (s->nchanslots >= CHANNEL_SLOT_MAX)
+            out_of_memory();       /* 16 million channels open at once */
+        sgrowarray(s->chanslots, s->chanslotsize, s->nchanslots);
+        slot = s->nchanslots++;
+        s->chanslots[slot].generation = 0;
+    }
+
+    s->chanslots[slot].c = c;
+    c->localid = ssh2_channel_slot_id(s, slot);
+    add234(s->channels, c);
+}
+
+static void ssh2_channel_remove(struct ssh2_connection_state *s,
+                                struct ssh2_channel *c)
+{
+    size_t slot = (c->localid & CHANNEL_SLOT_MASK) - CHANNEL_SLOT_OFFSET;
+
+    assert(slot < s->nchanslots && s->chanslots[slot].c == c);
+    del234(s->channels, c);
+
+    s->chanslots[slot].c = NULL;
+    s->chanslots[slot].generation =
+        (s->chanslots[slot].generation + 1) &
+        (~0U >> CHANNEL_SLOT_BITS);
+    s->chanslots[slot].next_free = s->chanfree;
+    s->chanfree = slot;
+}
+
+static struct ssh2_channel *ssh2_channel_find(
+    struct ssh2_connection_state *s, unsigned localid)
+{
+    size_t slot = (localid & CHANNEL_SLOT_MASK) - CHANNEL_SLOT_OFFSET;
+    struct ssh2_channel *c;
+
+    /* Ids below the offset wrap round to a huge slot number here */
+    if (slot >= s->nchanslots)
+        return NULL;
+    c = s->chanslots[slot].c;
+    if (!c || c->localid != localid)
+        return NULL;
+    return c;
+}
+
 /*
  * Each channel has a queue of outstanding CHANNEL_REQUESTS and their
  * handlers.
@@ -221,6 +319,14 @@ struct outstanding_channel_request {
 
 static void ssh2_channel_free(struct ssh2_channel *c)
 {
+    if (c->budget_out || c->budget_in) {
+        c->connlayer->buffered -= c->budget_out + c->budget_in;
+        c->connlayer->nbuffering--;
+    }
+    expire_timer_context(c);
+    for (size_t i = 0; i < lenof(c->ratelimits); i++)
+        if (c->ratelimits[i])
+            ratelimit_free(c->ratelimits[i]);
     bufchain_clear(&c->outbuffer);
     bufchain_clear(&c->errbuffer);
     while (c->chanreq_head) {
@@ -239,6 +345,26 @@ static void ssh2_channel_free(struct ssh2_channel *c)
     sfree(c);
 }
 
+static int ssh2_connection_max_window(Conf *conf)
+{
+    unsigned long limit = parse_blocksize(
+        conf_get_str(conf, CONF_ssh_max_window));
+    if (limit < OUR_V2_WINSIZE)
+        limit = OUR_V2_WINSIZE;
+    if (limit > 0x40000000)
+        limit = 0x40000000;
+    return limit;
+}
+
+static size_t ssh2_connection_buffer_limit(Conf *conf)
+{
+    unsigned long limit = parse_blocksize(
+        conf_get_str(conf, CONF_ssh_buffer_limit));
+    if (limit < OUR_V2_WINSIZE)
+        limit = OUR_V2_WINSIZE;
+    return limit;
+}
+
 PacketProtocolLayer *ssh2_connection_new(
     Ssh *ssh, ssh_sharing_state *connshare, bool is_simple,
     Conf *conf, const char *peer_verstring, ConnectionLayer **cl_out)
@@ -259,10 +385,18 @@ PacketProtocolLayer *ssh2_connection_new(
      */
     s->persistent = conf_get_bool(s->conf, CONF_ssh_no_shell);
 
+    s->max_window = ssh2_connection_max_window(s->conf);
+    s->buffer_limit = ssh2_connection_buffer_limit(s->conf);
+    s->share_persist = conf_get_int(
+        s->conf, CONF_ssh_connection_sharing_persist);
+
     s->connshare = connshare;
     s->peer_verstring = dupstr(peer_verstring);
 
     s->channels = newtree234(ssh2_channelcmp);
+    s->chanfree = CHANNEL_SLOT_NONE;
+    s->ic_schedule.fn = ssh2_connection_schedule;
+    s->ic_schedule.ctx = &s->ppl;  /* so ssh_ppl_free will cancel it */
 
     s->x11authtree = newtree234(x11_authcmp);
 
@@ -293,9 +427,12 @@ static void ssh2_connection_free(PacketProtocolLayer *ppl)
 
     conf_free(s->conf);
 
+    expire_timer_context(s);
+
     while ((c = delpos234(s->channels, 0)) != NULL)
         ssh2_channel_free(c);
     freetree234(s->channels);
+    sfree(s->chanslots);
 
     while ((auth = delpos234(s->x11authtree, 0)) != NULL) {
         if (auth->disp)
@@ -319,8 +456,32 @@ static void ssh2_connection_free(PacketProtocolLayer *ppl)
     sfree(s);
 }
 
+/*
+ * Pass an incoming packet to a sharing downstream. The packet is
+ * about to be freed, so sshshare.c may rewrite it in place.
+ */
+static void ssh2_share_pktin(ssh_sharing_connstate *cs, PktIn *pktin)
+{
+    share_got_pkt_from_server(cs, pktin->type,
+                              (void *)BinarySource_UPCAST(pktin)->data,
+                              BinarySource_UPCAST(pktin)->len,
+                              pktin->headroom);
+}
+
+/*
+ * During a bulk transfer, nearly every packet the connection layer
+ * receives is channel data, dealt with entirely in filter_queue, and
+ * a single network read can decode into hundreds of them. After this
+ * many in one call, we reschedule ourselves and let the other
+ * pending callbacks have a turn - in particular the BPP, which can
+ * then send the window adjustments we've queued so far instead of
+ * holding them back until the whole backlog has been handed out.
+ */
+#define FILTER_QUEUE_BUDGET 64
+
 static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
 {
+    unsigned handled = 0;
     PktIn *pktin;
     PktOut *pktout;
     ptrlen type, data;
@@ -336,6 +497,10 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
             return true;
         if ((pktin = pq_peek(s->ppl.in_pq)) == NULL)
             return false;
+        if (++handled > FILTER_QUEUE_BUDGET) {
+            queue_idempotent_callback(&s->ppl.ic_process_queue);
+            return true;
+        }
 
         switch (pktin->type) {
           case SSH2_MSG_GLOBAL_REQUEST:
@@ -395,10 +560,8 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                  * channel-open procedure and just pass the message on
                  * to sshshare.c.
                  */
-                share_got_pkt_from_server(
-                    chanopen_result.u.downstream.share_ctx, pktin->type,
-                    BinarySource_UPCAST(pktin)->data,
-                    BinarySource_UPCAST(pktin)->len);
+                ssh2_share_pktin(
+                    chanopen_result.u.downstream.share_ctx, pktin);
                 sfree(c);
                 break;
             }
@@ -435,6 +598,7 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                 put_uint32(pktout, c->locwindow);
                 put_uint32(pktout, OUR_V2_MAXPKT); /* our max pkt size */
                 pq_push(s->ppl.out_pq, pktout);
+                probe2(channel_open, c->localid, c->remoteid);
             }
 
             pq_pop(s->ppl.in_pq);
@@ -457,12 +621,10 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
              * downstream, pass it on.
              */
             localid = get_uint32(pktin);
-            c = find234(s->channels, &localid, ssh2_channelfind);
+            c = ssh2_channel_find(s, localid);
 
             if (c && c->sharectx) {
-                share_got_pkt_from_server(c->sharectx, pktin->type,
-                                          BinarySource_UPCAST(pktin)->data,
-                                          BinarySource_UPCAST(pktin)->len);
+                ssh2_share_pktin(c->sharectx, pktin);
                 pq_pop(s->ppl.in_pq);
                 break;
             }
@@ -483,6 +645,12 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                 return true;
             }
 
+            if (expect_halfopen) {
+                /* The first channel open ends connection setup. */
+                ssh_setup_mark(s->ppl.ssh, "chanopen");
+                ssh_setup_report(s->ppl.ssh);
+            }
+
             switch (pktin->type) {
               case SSH2_MSG_CHANNEL_OPEN_CONFIRMATION:
                 assert(c->halfopen);
@@ -492,6 +660,7 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                 c->remmaxpkt = get_uint32(pktin);
                 if (c->remmaxpkt > s->ppl.bpp->vt->packet_size_limit)
                     c->remmaxpkt = s->ppl.bpp->vt->packet_size_limit;
+                probe2(channel_open, c->localid, c->remoteid);
 
                 chan_open_confirmation(c->chan);
 
@@ -523,7 +692,7 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                 chan_open_failed(c->chan, err);
                 sfree(err);
 
-                del234(s->channels, c);
+                ssh2_channel_remove(s, c);
                 ssh2_channel_free(c);
 
                 break;
@@ -535,7 +704,9 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                             get_uint32(pktin));
                 data = get_string(pktin);
                 if (!get_err(pktin)) {
-                    int bufsize;
+                    int bufsize, winlimit;
+                    s->data_in.packets++;
+                    s->data_in.bytes += data.len;
                     c->locwindow -= data.len;
                     c->remlocwin -= data.len;
                     if (ext_type != 0 && ext_type != SSH2_EXTENDED_DATA_STDERR)
@@ -555,15 +726,44 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                     if (c->sharectx)
                         break;
 
+                    ssh2_channel_count_buffered(c, c->budget_out, bufsize);
+
                     /*
                      * If it looks like the remote end hit the end of
                      * its window, and we didn't want it to do that,
-                     * think about using a larger window.
+                     * then the window is smaller than the amount of
+                     * data the link can carry in one round trip
+                     * (which is what the winadj@putty acks measure).
+                     * Double it, up to our configured limit. We only
+                     * do that on the packet that actually ran the
+                     * window out, so it happens at most once per
+                     * round trip, and a long fat link is matched in a
+                     * handful of them. Not, though, while the whole
+                     * connection is over its buffer budget.
                      */
                     if (c->remlocwin <= 0 &&
+                        c->remlocwin + (int)data.len > 0 &&
                         c->throttle_state == UNTHROTTLED &&
-                        c->locmaxwin < 0x40000000)
-                        c->locmaxwin += OUR_V2_WINSIZE;
+                        c->locmaxwin < s->max_window && !s->over_budget) {
+                        if (c->locmaxwin > s->max_window / 2)
+                            c->locmaxwin = s->max_window;
+                        else
+                            c->locmaxwin *= 2;
+                    }
+
+                    /*
+                     * Conversely, if our own end of the channel has
+                     * stopped consuming data, a big window only means
+                     * a big buffer. Halve it (once per stall) and let
+                     * the above grow it again when data is moving.
+                     */
+                    if (bufsize >= c->locmaxwin && !c->window_shrunk &&
+                        c->locmaxwin > OUR_V2_WINSIZE) {
+                        c->locmaxwin /= 2;
+                        if (c->locmaxwin < OUR_V2_WINSIZE)
+                            c->locmaxwin = OUR_V2_WINSIZE;
+                        c->window_shrunk = true;
+                    }
 
                     /*
                      * If we are not buffering too much data, enlarge
@@ -571,8 +771,9 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                      * buffering too much, we may still need to adjust
                      * the window if the server's sent excess data.
                      */
-                    if (bufsize < c->locmaxwin)
-                        ssh2_set_window(c, c->locmaxwin - bufsize);
+                    winlimit = ssh2_channel_window_limit(c);
+                    if (bufsize < winlimit)
+                        ssh2_set_window(c, winlimit - bufsize);
 
                     /*
                      * If we're either buffering way too much data, or
@@ -584,13 +785,33 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                         !c->throttling_conn) {
                         c->throttling_conn = true;
                         ssh_throttle_conn(s->ppl.ssh, +1);
+                    } else if (c->throttling_conn &&
+                               bufsize <= (s->ssh_is_simple ?
+                                           0 : c->locmaxwin)) {
+                        /*
+                         * Packets decoded before the connection froze
+                         * still arrive here, and the channel's buffer
+                         * may have drained below the limit while
+                         * taking one. If it emptied completely,
+                         * nothing will ever call sshfwd_unthrottle,
+                         * so let go here.
+                         */
+                        c->throttling_conn = false;
+                        ssh_throttle_conn(s->ppl.ssh, -1);
                     }
                 }
                 break;
 
               case SSH2_MSG_CHANNEL_WINDOW_ADJUST:
                 if (!(c->closes & CLOSES_SENT_EOF)) {
-                    c->remwindow += get_uint32(pktin);
+                    unsigned adjust = get_uint32(pktin);
+                    c->remwindow += adjust;
+                    probe3(channel_window_adjust, c->localid, adjust, 0);
+                    if (c->window_stalled) {
+                        c->window_stall_ticks +=
+                            GETTICKCOUNT() - c->window_stall_since;
+                        c->window_stalled = false;
+                    }
                     ssh2_try_send_and_unthrottle(c);
                 }
                 break;
@@ -821,6 +1042,7 @@ static bool ssh2_connection_filter_queue(struct ssh2_connection_state *s)
                      */
                     bufchain_clear(&c->outbuffer);
                     bufchain_clear(&c->errbuffer);
+                    ssh2_channel_count_buffered(c, 0, c->budget_in);
 
                     /*
                      * Send outgoing EOF.
@@ -931,6 +1153,9 @@ static void ssh2_set_window(struct ssh2_channel *c, int newwin)
          * If we're not, then throughput is being constrained by
          * something other than the maximum window size anyway.
          */
+        if (newwin == c->locmaxwin)
+            c->window_shrunk = false;  /* our end is keeping up again */
+
         if (newwin == c->locmaxwin &&
             !(s->ppl.remote_bugs & BUG_CHOKES_ON_WINADJ)) {
             up = snew(unsigned);
@@ -950,13 +1175,16 @@ static void ssh2_set_window(struct ssh2_channel *c, int newwin)
         put_uint32(pktout, c->remoteid);
         put_uint32(pktout, newwin - c->locwindow);
         pq_push(s->ppl.out_pq, pktout);
+        probe3(channel_window_adjust, c->localid, newwin - c->locwindow, 1);
         c->locwindow = newwin;
     }
 }
 
 static PktIn *ssh2_connection_pop(struct ssh2_connection_state *s)
 {
-    ssh2_connection_filter_queue(s);
+    /* If filter_queue stopped early, what's left isn't for us yet */
+    if (ssh2_connection_filter_queue(s))
+        return NULL;
     return pq_pop(s->ppl.in_pq);
 }
 
@@ -1017,11 +1245,16 @@ static void ssh2_connection_process_queue(PacketProtocolLayer *ppl)
     s->portfwdmgr_configured = true;
 
     /*
-     * Create the main session channel, if any.
+     * Create the main session channel, if any. (Or, if all we've
+     * been asked for is a sharing upstream's statistics, ask for
+     * those instead.)
      */
-    s->mainchan = mainchan_new(
-        &s->ppl, &s->cl, s->conf, s->term_width, s->term_height,
-        s->ssh_is_simple, &s->mainchan_sc);
+    if (conf_get_bool(s->conf, CONF_ssh_connection_sharing_stats))
+        ssh2_connection_request_sharing_stats(s);
+    else
+        s->mainchan = mainchan_new(
+            &s->ppl, &s->cl, s->conf, s->term_width, s->term_height,
+            s->ssh_is_simple, &s->mainchan_sc);
 
     /*
      * Transfer data!
@@ -1065,7 +1298,7 @@ static void ssh2_channel_check_close(struct ssh2_channel *c)
 
     if (chan_want_close(c->chan, (c->closes & CLOSES_SENT_EOF),
                         (c->closes & CLOSES_RCVD_EOF)) &&
-        !c->chanreq_head &&
+        !c->chanreq_head && !c->pending_eof &&
         !(c->closes & CLOSES_SENT_CLOSE)) {
         /*
          * We have both sent and received EOF (or the channel is a
@@ -1108,6 +1341,149 @@ static void ssh2_channel_try_eof(struct ssh2_channel *c)
     ssh2_channel_check_close(c);
 }
 
+/*
+ * Outgoing channel data isn't pushed on to the output queue as fast
+ * as the channel windows allow, because everything queued below us
+ * goes out in FIFO order: one bulk download could otherwise bury a
+ * keystroke in the shell channel next to it under megabytes of data.
+ * Instead:
+ *
+ *  - control messages, and data packets of at most SSH2_SEND_SMALL
+ *    bytes, always go straight out;
+ *
+ *  - larger data packets are only queued while the outgoing backlog
+ *    below this layer is under SSH2_SEND_BACKLOG. That counts our own
+ *    output queue (which the transport layer holds on to during
+ *    rekeys), the BPP's, and whatever ssh_output_backlog reports for
+ *    the raw output and the socket;
+ *
+ *  - once any channel is held back, the held channels take turns by
+ *    deficit round robin, SSH2_SEND_QUANTUM bytes per channel per
+ *    round (times the channel's weight), whenever the lower layers
+ *    report that the backlog has drained. A channel that gets new
+ *    data meanwhile joins the queue rather than jumping it;
+ *
+ *  - a channel with rate limits sends nothing, however small, beyond
+ *    what they allow, and sits out of the scheduler on a timer until
+ *    they allow more. So that its buffer can't grow without bound in
+ *    the meantime, it stops accepting input once it has
+ *    SSH2_RATE_LIMIT_BUFFER bytes waiting.
+ */
+#define SSH2_SEND_SMALL 1024
+#define SSH2_SEND_BACKLOG 131072
+#define SSH2_SEND_QUANTUM 65536
+#define SSH2_RATE_LIMIT_BUFFER 32768
+
+static size_t ssh2_connection_send_backlog(struct ssh2_connection_state *s)
+{
+    size_t backlog = s->ppl.out_pq->pqb.total_size;
+    if (s->ppl.out_pq != &s->ppl.bpp->out_pq)
+        backlog += s->ppl.bpp->out_pq.pqb.total_size;
+    return backlog + ssh_output_backlog(s->ppl.ssh);
+}
+
+static bool ssh2_channel_may_send_bulk(struct ssh2_channel *c)
+{
+    struct ssh2_connection_state *s = c->connlayer;
+
+    if (ssh2_connection_send_backlog(s) >= SSH2_SEND_BACKLOG)
+        return false;
+    if (s->sched_running)
+        return c->sched_deficit > 0;
+    return s->sched_nwaiting == (c->sched_waiting ? 1 : 0);
+}
+
+static void ssh2_connection_schedule(void *vctx)
+{
+    struct ssh2_connection_state *s = container_of(
+        (PacketProtocolLayer *)vctx, struct ssh2_connection_state, ppl);
+    struct ssh2_channel *c;
+
+    s->sched_running = true;
+    while (s->sched_nwaiting > 0 &&
+           ssh2_connection_send_backlog(s) < SSH2_SEND_BACKLOG) {
+        /*
+         * Step to the next channel after the last one we looked at,
+         * wrapping round at the end. We look channels up by id each
+         * time, because sending on one can end up destroying it.
+         */
+        c = findrel234(s->channels, &s->sched_last, ssh2_channelfind,
+                       REL234_GT);
+        if (!c)
+            c = index234(s->channels, 0);
+        assert(c);                 /* sched_nwaiting counts some channel */
+        s->sched_last = c->localid;
+
+        if (c->sched_waiting) {
+            c->sched_deficit += (long)SSH2_SEND_QUANTUM * c->sched_weight;
+            ssh2_try_send_and_unthrottle(c);
+        }
+    }
+    s->sched_running = false;
+}
+
+/*
+ * How much of a channel's data its rate limits will let it send now.
+ */
+static size_t ssh2_channel_rate_allowance(struct ssh2_channel *c)
+{
+    size_t allowed = SIZE_MAX;
+    for (size_t i = 0; i < lenof(c->ratelimits); i++) {
+        if (c->ratelimits[i]) {
+            size_t avail = ratelimit_available(c->ratelimits[i]);
+            if (allowed > avail)
+                allowed = avail;
+        }
+    }
+    return allowed;
+}
+
+static void ssh2_channel_rate_timer(void *ctx, unsigned long now)
+{
+    struct ssh2_channel *c = (struct ssh2_channel *)ctx;
+
+    if (!c->rate_timer_pending || now != c->rate_timer_next)
+        return;
+    c->rate_timer_pending = false;
+    ssh2_try_send_and_unthrottle(c);
+}
+
+static void ssh2_channel_rate_wait(struct ssh2_channel *c, size_t len)
+{
+    unsigned long ticks = 1;
+
+    if (c->rate_timer_pending)
+        return;
+    for (size_t i = 0; i < lenof(c->ratelimits); i++) {
+        if (c->ratelimits[i]) {
+            unsigned long t = ratelimit_wait(c->ratelimits[i], len);
+            if (ticks < t)
+                ticks = t;
+        }
+    }
+    c->rate_timer_next = schedule_timer(ticks, ssh2_channel_rate_timer, c);
+    c->rate_timer_pending = true;
+}
+
+static void ssh2_output_drained(ConnectionLayer *cl)
+{
+    struct ssh2_connection_state *s =
+        container_of(cl, struct ssh2_connection_state, cl);
+
+    if (s->sched_nwaiting > 0)
+        queue_idempotent_callback(&s->ic_schedule);
+    if (s->connshare)
+        share_output_drained(s->connshare);
+}
+
+static bool ssh2_sharing_may_send_bulk(ConnectionLayer *cl)
+{
+    struct ssh2_connection_state *s =
+        container_of(cl, struct ssh2_connection_state, cl);
+
+    return ssh2_connection_send_backlog(s) < SSH2_SEND_BACKLOG;
+}
+
 /*
  * Attempt to send data on an SSH-2 channel.
  */
@@ -1116,6 +1492,7 @@ static size_t ssh2_try_send(struct ssh2_channel *c)
     struct ssh2_connection_state *s = c->connlayer;
     PktOut *pktout;
     size_t bufsize;
+    bool held;
 
     if (!c->halfopen) {
         while (c->remwindow > 0 &&
@@ -1124,11 +1501,25 @@ static size_t ssh2_try_send(struct ssh2_channel *c)
             bufchain *buf = (bufchain_size(&c->errbuffer) > 0 ?
                              &c->errbuffer : &c->outbuffer);
 
-            ptrlen data = bufchain_prefix(buf);
-            if (data.len > c->remwindow)
-                data.len = c->remwindow;
-            if (data.len > c->remmaxpkt)
-                data.len = c->remmaxpkt;
+            size_t len = bufchain_size(buf);
+            if (len > c->remwindow)
+                len = c->remwindow;
+            if (len > c->remmaxpkt)
+                len = c->remmaxpkt;
+            if (c->ratelimits[0] || c->ratelimits[1]) {
+                size_t allowed = ssh2_channel_rate_allowance(c);
+                if (allowed == 0) {
+                    ssh2_channel_rate_wait(c, len);
+                    break;
+                }
+                if (len > allowed)
+                    len = allowed;
+            }
+            if (len > SSH2_SEND_SMALL) {
+                if (!ssh2_channel_may_send_bulk(c))
+                    break;
+                c->sched_deficit -= len;
+            }
             if (buf == &c->errbuffer) {
                 pktout = ssh_bpp_new_pktout(
                     s->ppl.bpp, SSH2_MSG_CHANNEL_EXTENDED_DATA);
@@ -1138,10 +1529,28 @@ static size_t ssh2_try_send(struct ssh2_channel *c)
                 pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_CHANNEL_DATA);
                 put_uint32(pktout, c->remoteid);
             }
-            put_stringpl(pktout, data);
+            /*
+             * Fill the packet from as many bufchain blocks as it
+             * takes, rather than sending one packet per block, so
+             * that a peer with a large maximum packet size gets
+             * full-sized ones.
+             */
+            put_uint32(pktout, len);
+            c->remwindow -= len;
+            s->data_out.packets++;
+            s->data_out.bytes += len;
+            for (size_t i = 0; i < lenof(c->ratelimits); i++)
+                if (c->ratelimits[i])
+                    ratelimit_consume(c->ratelimits[i], len);
+            while (len > 0) {
+                ptrlen data = bufchain_prefix(buf);
+                if (data.len > len)
+                    data.len = len;
+                put_datapl(pktout, data);
+                bufchain_consume(buf, data.len);
+                len -= data.len;
+            }
             pq_push(s->ppl.out_pq, pktout);
-            bufchain_consume(buf, data.len);
-            c->remwindow -= data.len;
         }
     }
 
@@ -1150,6 +1559,28 @@ static size_t ssh2_try_send(struct ssh2_channel *c)
      * still buffered.
      */
     bufsize = bufchain_size(&c->outbuffer) + bufchain_size(&c->errbuffer);
+    ssh2_channel_count_buffered(c, bufsize, c->budget_in);
+
+    /*
+     * If we stopped with both data and window left, and not because
+     * of a rate limit, the scheduler held us back, so make sure we're
+     * queued for a turn.
+     */
+    held = bufsize && !c->halfopen && c->remwindow && !c->rate_timer_pending;
+    if (held && !c->sched_waiting) {
+        c->sched_waiting = true;
+        c->sched_deficit = 0;
+        s->sched_nwaiting++;
+        queue_idempotent_callback(&s->ic_schedule);
+    } else if (!held && c->sched_waiting) {
+        c->sched_waiting = false;
+        s->sched_nwaiting--;
+    }
+
+    if (bufsize && !c->halfopen && !c->remwindow && !c->window_stalled) {
+        c->window_stalled = true;
+        c->window_stall_since = GETTICKCOUNT();
+    }
 
     /*
      * And if there's no data pending but we need to send an EOF, send
@@ -1169,6 +1600,7 @@ static void ssh2_try_send_and_unthrottle(struct ssh2_channel *c)
     bufsize = ssh2_try_send(c);
     if (bufsize == 0) {
         c->throttled_by_backlog = false;
+        c->throttled_by_budget = false;
         ssh2_channel_check_throttle(c);
     }
 }
@@ -1177,18 +1609,104 @@ static void ssh2_channel_check_throttle(struct ssh2_channel *c)
 {
     /*
      * We don't want this channel to read further input if this
-     * particular channel has a backed-up SSH window, or if the
-     * outgoing side of the whole SSH connection is currently
-     * throttled, or if this channel already has an outgoing EOF
-     * either sent or pending.
+     * particular channel has a backed-up SSH window, or is one of the
+     * biggest contributors to a connection over its buffer budget,
+     * or if the outgoing side of the whole SSH connection is
+     * currently throttled, or if this channel already has an outgoing
+     * EOF either sent or pending.
      */
     chan_set_input_wanted(c->chan,
                           !c->throttled_by_backlog &&
+                          !c->throttled_by_budget &&
                           !c->connlayer->all_channels_throttled &&
                           !c->pending_eof &&
                           !(c->closes & CLOSES_SENT_EOF));
 }
 
+/*
+ * The connection-wide buffer budget. Each channel's buffering is
+ * bounded on its own, by the remote window in one direction and our
+ * local window in the other, but with enough channels those bounds
+ * add up to more memory than we'd like to spend. So we also keep a
+ * running total of what all the channels are buffering, and while
+ * it's over CONF_ssh_buffer_limit we squeeze them:
+ *
+ *  - a channel that's buffering more outgoing data than an even
+ *    share of the budget stops reading local input, until it has
+ *    sent everything it has;
+ *
+ *  - no channel gets offered more window than an even share, so a
+ *    channel whose local end is slow to consume data stops getting
+ *    any more of it, and channels don't have their windows grown.
+ *
+ * Between them, those pick on the biggest and slowest channels
+ * first, while letting ones moving small amounts of data carry on
+ * as normal. We stop once we're back down to three quarters of the
+ * budget, so as not to flap in and out of that state.
+ */
+static size_t ssh2_connection_budget_share(struct ssh2_connection_state *s)
+{
+    return s->buffer_limit / (s->nbuffering > 0 ? s->nbuffering : 1);
+}
+
+static int ssh2_channel_window_limit(struct ssh2_channel *c)
+{
+    struct ssh2_connection_state *s = c->connlayer;
+    size_t share;
+
+    if (!s->over_budget)
+        return c->locmaxwin;
+
+    share = ssh2_connection_budget_share(s);
+    if (share < OUR_V2_WINSIZE)
+        share = OUR_V2_WINSIZE;
+    return share < (size_t)c->locmaxwin ? share : c->locmaxwin;
+}
+
+static void ssh2_connection_check_budget(struct ssh2_connection_state *s)
+{
+    PacketProtocolLayer *ppl = &s->ppl; /* for ppl_logevent */
+    struct ssh2_channel *c;
+
+    if (!s->over_budget && s->buffered > s->buffer_limit) {
+        s->over_budget = true;
+        if (!s->over_budget_logged) {
+            /* (only the once, since a busy connection can go in and
+             * out of this state all the time) */
+            ppl_logevent("Channels are buffering %"SIZEu" bytes, over the "
+                         "limit of %"SIZEu"; throttling the largest",
+                         s->buffered, s->buffer_limit);
+            s->over_budget_logged = true;
+        }
+    } else if (s->over_budget && s->buffered <= s->buffer_limit / 4 * 3) {
+        s->over_budget = false;
+
+        for (int i = 0; (c = index234(s->channels, i)) != NULL; i++) {
+            if (c->throttled_by_budget) {
+                c->throttled_by_budget = false;
+                ssh2_channel_check_throttle(c);
+            }
+            if (c->chan && !c->sharectx && !c->halfopen &&
+                c->budget_in < (size_t)c->locmaxwin)
+                ssh2_set_window(c, c->locmaxwin - c->budget_in);
+        }
+    }
+}
+
+static void ssh2_channel_count_buffered(
+    struct ssh2_channel *c, size_t out, size_t in)
+{
+    struct ssh2_connection_state *s = c->connlayer;
+    bool was = c->budget_out || c->budget_in, is = out || in;
+
+    s->buffered += (out + in) - (c->budget_out + c->budget_in);
+    s->nbuffering += (int)is - (int)was;
+    c->budget_out = out;
+    c->budget_in = in;
+
+    ssh2_connection_check_budget(s);
+}
+
 /*
  * Close any local socket and free any local resources associated with
  * a channel.  This converts the channel into a zombie.
@@ -1226,8 +1744,11 @@ static void ssh2_channel_destroy(struct ssh2_channel *c)
 
     assert(c->chanreq_head == NULL);
 
+    probe1(channel_close, c->localid);
     ssh2_channel_close_local(c, NULL);
-    del234(s->channels, c);
+    if (c->sched_waiting)
+        s->sched_nwaiting--;
+    ssh2_channel_remove(s, c);
     ssh2_channel_free(c);
 
     /*
@@ -1239,6 +1760,35 @@ static void ssh2_channel_destroy(struct ssh2_channel *c)
     queue_toplevel_callback(ssh2_check_termination_callback, s);
 }
 
+/*
+ * Whether every channel we have belongs to a sharing downstream, i.e.
+ * whatever we were doing on our own account is finished.
+ */
+static bool ssh2_connection_only_shared_channels(
+    struct ssh2_connection_state *s)
+{
+    struct ssh2_channel *c;
+
+    for (int i = 0; (c = index234(s->channels, i)) != NULL; i++)
+        if (!c->sharectx)
+            return false;
+    return true;
+}
+
+static void ssh2_connection_persist_timer(void *ctx, unsigned long now)
+{
+    struct ssh2_connection_state *s = (struct ssh2_connection_state *)ctx;
+
+    if (!s->share_persist_pending || now != s->share_persist_next)
+        return;
+    s->share_persist_pending = false;
+
+    if (count234(s->channels) == 0 &&
+        share_ndownstreams(s->connshare) == 0)
+        ssh_user_close(s->ppl.ssh, "No downstreams for %d seconds",
+                       s->share_persist);
+}
+
 static void ssh2_check_termination(struct ssh2_connection_state *s)
 {
     /*
@@ -1250,6 +1800,26 @@ static void ssh2_check_termination(struct ssh2_connection_state *s)
     if (s->persistent)
         return;     /* persistent mode: never proactively terminate */
 
+    if (s->connshare && s->share_persist > 0 &&
+        ssh2_connection_only_shared_channels(s)) {
+        /*
+         * We're a sharing upstream told to outlive our own session.
+         * Once that's over, tell ssh.c, so that our front end can
+         * stop waiting for it; and whenever we've also no
+         * downstreams left, give them CONF_ssh_connection_sharing_
+         * persist seconds to turn up before we close after all.
+         */
+        ssh_sharing_lingering(s->ppl.ssh);
+        if (count234(s->channels) == 0 &&
+            share_ndownstreams(s->connshare) == 0) {
+            s->share_persist_next = schedule_timer(
+                s->share_persist * TICKSPERSEC,
+                ssh2_connection_persist_timer, s);
+            s->share_persist_pending = true;
+        }
+        return;
+    }
+
     if (count234(s->channels) == 0 &&
         !(s->connshare && share_ndownstreams(s->connshare) > 0)) {
         /*
@@ -1278,6 +1848,16 @@ void ssh2_channel_init(struct ssh2_channel *c)
     c->pending_eof = false;
     c->throttling_conn = false;
     c->throttled_by_backlog = false;
+    c->throttled_by_budget = false;
+    c->budget_out = c->budget_in = 0;
+    c->window_stalled = false;
+    c->window_stall_ticks = 0;
+    c->window_shrunk = false;
+    c->sched_waiting = false;
+    c->sched_deficit = 0;
+    c->sched_weight = 1;
+    c->ratelimits[0] = c->ratelimits[1] = NULL;
+    c->rate_timer_pending = false;
     c->sharectx = NULL;
     c->locwindow = c->locmaxwin = c->remlocwin =
         s->ssh_is_simple ? OUR_V2_BIGWIN : OUR_V2_WINSIZE;
@@ -1287,8 +1867,7 @@ void ssh2_channel_init(struct ssh2_channel *c)
     bufchain_init(&c->errbuffer);
     c->sc.vt = &ssh2channel_vtable;
     c->sc.cl = &s->cl;
-    c->localid = alloc_channel_id(s->channels, struct ssh2_channel);
-    add234(s->channels, c);
+    ssh2_channel_add(s, c);
 }
 
 /*
@@ -1373,6 +1952,19 @@ static void ssh2channel_initiate_close(SshChannel *sc, const char *err)
     reason = err ? dupprintf("due to local error: %s", err) : NULL;
     ssh2_channel_close_local(c, reason);
     sfree(reason);
+
+    if (!err && !(c->closes & CLOSES_SENT_EOF) &&
+        (bufchain_size(&c->outbuffer) > 0 ||
+         bufchain_size(&c->errbuffer) > 0)) {
+        /*
+         * A clean close of a channel the scheduler is still holding
+         * data for: let the data drain, and send EOF then CLOSE after
+         * it, rather than throwing it away.
+         */
+        c->pending_eof = true;
+        return;
+    }
+
     c->pending_eof = false;   /* this will confuse a zombie channel */
 
     ssh2_channel_check_close(c);
@@ -1382,11 +1974,14 @@ static void ssh2channel_unthrottle(SshChannel *sc, size_t bufsize)
 {
     struct ssh2_channel *c = container_of(sc, struct ssh2_channel, sc);
     struct ssh2_connection_state *s = c->connlayer;
-    size_t buflimit;
+    size_t buflimit, winlimit;
+
+    ssh2_channel_count_buffered(c, c->budget_out, bufsize);
 
     buflimit = s->ssh_is_simple ? 0 : c->locmaxwin;
-    if (bufsize < buflimit)
-        ssh2_set_window(c, buflimit - bufsize);
+    winlimit = s->ssh_is_simple ? 0 : ssh2_channel_window_limit(c);
+    if (bufsize < winlimit)
+        ssh2_set_window(c, winlimit - bufsize);
 
     if (c->throttling_conn && bufsize <= buflimit) {
         c->throttling_conn = false;
@@ -1398,9 +1993,23 @@ static size_t ssh2channel_write(
     SshChannel *sc, bool is_stderr, const void *buf, size_t len)
 {
     struct ssh2_channel *c = container_of(sc, struct ssh2_channel, sc);
+    size_t bufsize;
+
     assert(!(c->closes & CLOSES_SENT_EOF));
     bufchain_add(is_stderr ? &c->errbuffer : &c->outbuffer, buf, len);
-    return ssh2_try_send(c);
+    bufsize = ssh2_try_send(c);
+
+    if (c->rate_timer_pending && bufsize > SSH2_RATE_LIMIT_BUFFER &&
+        !c->throttled_by_backlog) {
+        c->throttled_by_backlog = true;
+        ssh2_channel_check_throttle(c);
+    }
+    if (c->connlayer->over_budget && !c->throttled_by_budget &&
+        bufsize > ssh2_connection_budget_share(c->connlayer)) {
+        c->throttled_by_budget = true;
+        ssh2_channel_check_throttle(c);
+    }
+    return bufsize;
 }
 
 static void ssh2channel_x11_sharing_handover(
@@ -1451,6 +2060,20 @@ static void ssh2channel_hint_channel_is_simple(SshChannel *sc)
     pq_push(s->ppl.out_pq, pktout);
 }
 
+static void ssh2channel_set_rate_limits(
+    SshChannel *sc, RateLimit *own, RateLimit *shared, unsigned weight)
+{
+    struct ssh2_channel *c = container_of(sc, struct ssh2_channel, sc);
+    RateLimit *limits[2] = { own, shared };
+
+    for (size_t i = 0; i < lenof(c->ratelimits); i++) {
+        if (c->ratelimits[i])
+            ratelimit_free(c->ratelimits[i]);
+        c->ratelimits[i] = limits[i] ? ratelimit_ref(limits[i]) : NULL;
+    }
+    c->sched_weight = weight ? weight : 1;
+}
+
 static SshChannel *ssh2_lportfwd_open(
     ConnectionLayer *cl, const char *hostname, int port,
     const char *description, const SocketPeerInfo *pi, Channel *chan)
@@ -1475,9 +2098,7 @@ static void ssh2_sharing_globreq_response(
     struct ssh2_connection_state *s, PktIn *pktin, void *ctx)
 {
     ssh_sharing_connstate *cs = (ssh_sharing_connstate *)ctx;
-    share_got_pkt_from_server(cs, pktin->type,
-                              BinarySource_UPCAST(pktin)->data,
-                              BinarySource_UPCAST(pktin)->len);
+    ssh2_share_pktin(cs, pktin);
 }
 
 static void ssh2_sharing_queue_global_request(
@@ -1552,7 +2173,7 @@ static void ssh2_delete_sharing_channel(ConnectionLayer *cl, unsigned localid)
 {
     struct ssh2_connection_state *s =
         container_of(cl, struct ssh2_connection_state, cl);
-    struct ssh2_channel *c = find234(s->channels, &localid, ssh2_channelfind);
+    struct ssh2_channel *c = ssh2_channel_find(s, localid);
     if (c)
         ssh2_channel_destroy(c);
 }
@@ -1656,6 +2277,50 @@ static size_t ssh2_stdin_backlog(ConnectionLayer *cl)
         bufchain_size(&c->outbuffer) + bufchain_size(&c->errbuffer) : 0;
 }
 
+static void ssh2_counters(ConnectionLayer *cl, strbuf *out)
+{
+    struct ssh2_connection_state *s =
+        container_of(cl, struct ssh2_connection_state, cl);
+    struct ssh2_channel *c;
+
+    strbuf_catf(out, "channel.in.packets=%"PRIu64"\n", s->data_in.packets);
+    strbuf_catf(out, "channel.in.bytes=%"PRIu64"\n", s->data_in.bytes);
+    strbuf_catf(out, "channel.out.packets=%"PRIu64"\n", s->data_out.packets);
+    strbuf_catf(out, "channel.out.bytes=%"PRIu64"\n", s->data_out.bytes);
+    strbuf_catf(out, "channel.count=%d\n", count234(s->channels));
+    strbuf_catf(out, "channel.buffered=%"SIZEu"\n", s->buffered);
+
+    for (int i = 0; (c = index234(s->channels, i)) != NULL; i++) {
+        /* Downstreams' channels are accounted for by their own
+         * connection layers */
+        if (c->sharectx)
+            continue;
+        strbuf_catf(out, "channel.%u.remwindow=%u\n",
+                    c->localid, c->remwindow);
+        strbuf_catf(out, "channel.%u.locwindow=%d\n",
+                    c->localid, c->locwindow);
+        strbuf_catf(out, "channel.%u.outbuffer=%"SIZEu"\n", c->localid,
+                    bufchain_size(&c->outbuffer) +
+                    bufchain_size(&c->errbuffer));
+    }
+}
+
+static unsigned long ssh2_stdin_window_stall(ConnectionLayer *cl)
+{
+    struct ssh2_connection_state *s =
+        container_of(cl, struct ssh2_connection_state, cl);
+    struct ssh2_channel *c;
+    unsigned long ticks;
+
+    if (!s->mainchan)
+        return 0;
+    c = container_of(s->mainchan_sc, struct ssh2_channel, sc);
+    ticks = c->window_stall_ticks;
+    if (c->window_stalled)
+        ticks += GETTICKCOUNT() - c->window_stall_since;
+    return ticks;
+}
+
 static void ssh2_throttle_all_channels(ConnectionLayer *cl, bool throttled)
 {
     struct ssh2_connection_state *s =
@@ -1740,6 +2405,10 @@ static void ssh2_connection_reconfigure(PacketProtocolLayer *ppl, Conf *conf)
     conf_free(s->conf);
     s->conf = conf_copy(conf);
 
+    s->max_window = ssh2_connection_max_window(s->conf);
+    s->buffer_limit = ssh2_connection_buffer_limit(s->conf);
+    ssh2_connection_check_budget(s);
+
     if (s->portfwdmgr_configured)
         portfwdmgr_config(s->portfwdmgr, s->conf);
 }
@@ -20,11 +20,58 @@ struct ssh2_connection_state {
     bool ssh_is_simple;
     bool persistent;
 
+    /*
+     * If we're a connection-sharing upstream, how many seconds we
+     * stay up after our own session and the last downstream have
+     * gone, in case another downstream comes along; and the timer
+     * counting that down.
+     */
+    int share_persist;
+    bool share_persist_pending;
+    unsigned long share_persist_next;
+    int max_window;                    /* limit on any channel's locmaxwin */
+
+    /*
+     * Budget for the data buffered by all channels together, in both
+     * directions (see ssh2_connection_check_budget): the limit, the
+     * current total, how many channels contribute to it, and whether
+     * we're currently over the limit and squeezing them.
+     */
+    size_t buffer_limit;
+    size_t buffered;
+    int nbuffering;
+    bool over_budget, over_budget_logged;
+
     Conf *conf;
 
-    tree234 *channels;                 /* indexed by local id */
+    tree234 *channels;                 /* sorted by local id */
+
+    /*
+     * Direct lookup of channels by local id (see ssh2_channel_find):
+     * a dense array of slots, one per channel id we've ever had
+     * open at once, and a free list of the unused ones.
+     */
+    struct ssh2_channel_slot *chanslots;
+    size_t nchanslots, chanslotsize;
+    size_t chanfree;
     bool all_channels_throttled;
 
+    /* Channel data carried in each direction, over all channels */
+    struct {
+        uint64_t packets, bytes;
+    } data_in, data_out;
+
+    /*
+     * Scheduling of bulk channel data (see ssh2_connection_schedule):
+     * the number of channels held back waiting for their turn, the
+     * local id of the last one served, and whether we're in the
+     * middle of a scheduling round.
+     */
+    IdempotentCallback ic_schedule;
+    int sched_nwaiting;
+    unsigned sched_last;
+    bool sched_running;
+
     bool X11_fwd_enabled;
     tree234 *x11authtree;
 
@@ -98,8 +145,28 @@ struct ssh2_channel {
      */
     bool throttled_by_backlog;
 
+    /*
+     * True if the connection-wide buffer budget has stopped this
+     * channel reading local input, because it was over budget and
+     * this channel was buffering more than its share.
+     */
+    bool throttled_by_budget;
+
+    /*
+     * What this channel last counted towards the connection's
+     * buffered total: data waiting to go out over SSH, and data we
+     * received that the local end hasn't yet consumed.
+     */
+    size_t budget_out, budget_in;
+
     bufchain outbuffer, errbuffer;
     unsigned remwindow, remmaxpkt;
+    /*
+     * How long we've spent with data to send but no remote window
+     * to send it in, including the current stall if window_stalled.
+     */
+    bool window_stalled;
+    unsigned long window_stall_since, window_stall_ticks;
     /* locwindow is signed so we can cope with excess data. */
     int locwindow, locmaxwin;
     /*
@@ -108,6 +175,33 @@ struct ssh2_channel {
      * last data packet or window adjust ack.
      */
     int remlocwin;
+    /*
+     * window_shrunk is set when we've cut locmaxwin because our own
+     * end of the channel wasn't consuming data, so that we only do
+     * that once per stall.
+     */
+    bool window_shrunk;
+
+    /*
+     * sched_waiting is set while this channel has data to send and
+     * window to send it in, but is being held back by the connection
+     * layer's scheduler. sched_deficit is what it may still send in
+     * the current round; it can go negative when a whole packet
+     * overshoots it.
+     */
+    bool sched_waiting;
+    long sched_deficit;
+    unsigned sched_weight;
+
+    /*
+     * Optional limits on the rate at which we send this channel's
+     * data. While they're holding it back, rate_timer_pending is set
+     * and the channel waits for a timer rather than for the
+     * scheduler.
+     */
+    RateLimit *ratelimits[2];
+    bool rate_timer_pending;
+    unsigned long rate_timer_next;
 
     /*
      * These store the list of channel requests that we're waiting for
@@ -231,5 +325,6 @@ bool ssh2_connection_parse_global_request(
     struct ssh2_connection_state *s, ptrlen type, PktIn *pktin);
 
 bool ssh2_connection_need_antispoof_prompt(struct ssh2_connection_state *s);
+void ssh2_connection_request_sharing_stats(struct ssh2_connection_state *s);
 
 #endif /* PUTTY_SSH2CONNECTION_H */
@@ -118,7 +118,9 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
          * Now generate and send e for Diffie-Hellman.
          */
         seat_set_busy_status(s->ppl.seat, BUSY_CPU);
-        s->e = dh_create_e(s->dh_ctx, s->nbits * 2);
+        s->e = dh_create_e(s->dh_ctx, dh_exponent_bits(
+            s->dh_ctx, s->nbits,
+            conf_get_bool(s->conf, CONF_ssh_dh_short_exponent)));
         pktout = ssh_bpp_new_pktout(s->ppl.bpp, s->kex_init_value);
         put_mp_ssh2(pktout, s->e);
         pq_push(s->ppl.out_pq, pktout);
@@ -189,21 +191,28 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
                      ssh_hash_alg(s->exhash)->text_name);
         s->ppl.bpp->pls->kctx = SSH2_PKTCTX_ECDHKEX;
 
-        s->ecdh_key = ssh_ecdhkex_newkey(s->kex_alg);
-        if (!s->ecdh_key) {
-            ssh_sw_abort(s->ppl.ssh, "Unable to generate key for ECDH");
-            *aborted = true;
-            return;
-        }
+        if (s->guessok) {
+            /* Our KEX_ECDH_INIT already went out with our KEXINIT. */
+            assert(s->ecdh_key);
+            s->guessok = false;
+        } else {
+            s->ecdh_key = ssh2_transport_ecdh_key(s);
+            if (!s->ecdh_key) {
+                ssh_sw_abort(s->ppl.ssh, "Unable to generate key for ECDH");
+                *aborted = true;
+                return;
+            }
 
-        pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_INIT);
-        {
-            strbuf *pubpoint = strbuf_new();
-            ssh_ecdhkex_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
-            put_stringsb(pktout, pubpoint);
-        }
+            pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_INIT);
+            {
+                strbuf *pubpoint = strbuf_new();
+                ssh_ecdhkex_getpublic(s->ecdh_key,
+                                      BinarySink_UPCAST(pubpoint));
+                put_stringsb(pktout, pubpoint);
+            }
 
-        pq_push(s->ppl.out_pq, pktout);
+            pq_push(s->ppl.out_pq, pktout);
+        }
 
         crMaybeWaitUntilV((pktin = ssh2_transport_pop(s)) != NULL);
         if (pktin->type != SSH2_MSG_KEX_ECDH_REPLY) {
@@ -323,7 +332,9 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
                      "exchange with hash %s", ssh_hash_alg(s->exhash)->text_name);
         /* Now generate e for Diffie-Hellman. */
         seat_set_busy_status(s->ppl.seat, BUSY_CPU);
-        s->e = dh_create_e(s->dh_ctx, s->nbits * 2);
+        s->e = dh_create_e(s->dh_ctx, dh_exponent_bits(
+            s->dh_ctx, s->nbits,
+            conf_get_bool(s->conf, CONF_ssh_dh_short_exponent)));
 
         if (s->shgss->lib->gsslogmsg)
             ppl_logevent("%s", s->shgss->lib->gsslogmsg);
@@ -332,8 +343,10 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
         SSH_GSS_CLEAR_BUF(&s->gss_rcvtok);
         SSH_GSS_CLEAR_BUF(&s->gss_sndtok);
         SSH_GSS_CLEAR_BUF(&s->mic);
-        s->gss_stat = s->shgss->lib->acquire_cred(
-            s->shgss->lib, &s->shgss->ctx, &s->gss_cred_expiry);
+        SSH_GSS_TIMED(s->shgss, SSH_GSS_STEP_ACQUIRE_CRED,
+                      s->gss_stat = s->shgss->lib->acquire_cred(
+                          s->shgss->lib, &s->shgss->ctx,
+                          &s->gss_cred_expiry));
         if (s->gss_stat != SSH_GSS_OK) {
             ssh_sw_abort(s->ppl.ssh,
                          "GSSAPI key exchange failed to initialise");
@@ -348,11 +361,13 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
              * When acquire_cred yields no useful expiration, go with the
              * service ticket expiration.
              */
-            s->gss_stat = s->shgss->lib->init_sec_context(
-                s->shgss->lib, &s->shgss->ctx, s->shgss->srv_name,
-                s->gss_delegate, &s->gss_rcvtok, &s->gss_sndtok,
-                (s->gss_cred_expiry == GSS_NO_EXPIRATION ?
-                 &s->gss_cred_expiry : NULL), NULL);
+            SSH_GSS_TIMED(
+                s->shgss, SSH_GSS_STEP_INIT_SEC_CONTEXT,
+                s->gss_stat = s->shgss->lib->init_sec_context(
+                    s->shgss->lib, &s->shgss->ctx, s->shgss->srv_name,
+                    s->gss_delegate, &s->gss_rcvtok, &s->gss_sndtok,
+                    (s->gss_cred_expiry == GSS_NO_EXPIRATION ?
+                     &s->gss_cred_expiry : NULL), NULL));
             SSH_GSS_CLEAR_BUF(&s->gss_rcvtok);
 
             if (s->gss_stat == SSH_GSS_S_COMPLETE && s->complete_rcvd)
@@ -682,6 +697,11 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
             s->shgss->lib->release_cred(s->shgss->lib, &s->shgss->ctx);
         }
         ppl_logevent("GSSAPI Key Exchange complete!");
+        if (!s->got_session_id) {
+            char *steps = ssh_gss_step_summary(s->shgss);
+            ppl_logevent("GSSAPI step times: %s", steps);
+            sfree(steps);
+        }
     }
 #endif
 
@@ -843,6 +863,7 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
              * Authenticate remote host: verify host key. (We've already
              * checked the signature of the exchange hash.)
              */
+            ssh_setup_mark(s->ppl.ssh, "kex");
             s->fingerprint = ssh2_fingerprint(s->hkey);
             ppl_logevent("Host key fingerprint is:");
             ppl_logevent("%s", s->fingerprint);
@@ -872,6 +893,7 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
             }
             sfree(s->fingerprint);
             s->fingerprint = NULL;
+            ssh_setup_mark(s->ppl.ssh, "hostkey");
             /*
              * Save this host key, to check against the one presented in
              * subsequent rekeys.
@@ -25,6 +25,116 @@ void ssh2_transport_provide_hostkeys(PacketProtocolLayer *ppl,
     s->nhostkeys = nhostkeys;
 }
 
+/*
+ * A pool of ready-made ECDH keypairs, shared between all the
+ * connections this process is serving, so that under a flood of new
+ * connections the expensive half of making each one (the point
+ * multiplication that computes its public key) has usually already
+ * been done on a worker thread. Each key is still used for exactly
+ * one key exchange.
+ *
+ * Choosing the private key needs the random number generator, which
+ * is main-thread only, so that half is done here before the job is
+ * handed to a worker.
+ *
+ * There's nothing comparable to precompute for the host key
+ * signature: RSA keys already cache their CRT setup, and our ECDSA
+ * and EdDSA nonces are derived from the message being signed.
+ */
+#define ECDH_POOL_METHODS 4
+#define ECDH_POOL_DEPTH 8
+
+struct ecdh_pool {
+    const ssh_kex *kex;
+    ecdh_key *keys[ECDH_POOL_DEPTH];
+    unsigned nkeys, npending;
+};
+static struct ecdh_pool ecdh_pools[ECDH_POOL_METHODS];
+
+static struct ecdh_pool *ecdh_pool_find(const ssh_kex *kex)
+{
+    for (size_t i = 0; i < ECDH_POOL_METHODS; i++) {
+        if (!ecdh_pools[i].kex)
+            ecdh_pools[i].kex = kex;
+        if (ecdh_pools[i].kex == kex)
+            return &ecdh_pools[i];
+    }
+    return NULL;
+}
+
+static void ecdh_pool_put(struct ecdh_pool *pool, ecdh_key *key)
+{
+    if (pool && pool->nkeys < ECDH_POOL_DEPTH)
+        pool->keys[pool->nkeys++] = key;
+    else
+        ssh_ecdhkex_freekey(key);
+}
+
+#ifdef THREAD_LOCAL
+static bool ecdh_pool_unavailable;     /* no worker threads to be had */
+
+struct ecdh_pool_job {
+    const ssh_kex *kex;
+    ecdh_key *key;
+};
+
+static void ecdh_pool_job_run(void *vctx)
+{
+    struct ecdh_pool_job *job = (struct ecdh_pool_job *)vctx;
+    ssh_ecdhkex_finishkey(job->key);
+}
+
+static void ecdh_pool_job_done(void *vctx)
+{
+    struct ecdh_pool_job *job = (struct ecdh_pool_job *)vctx;
+    struct ecdh_pool *pool = ecdh_pool_find(job->kex);
+    pool->npending--;
+    ecdh_pool_put(pool, job->key);
+    sfree(job);
+}
+
+static void ecdh_pool_refill(struct ecdh_pool *pool)
+{
+    while (!ecdh_pool_unavailable &&
+           pool->nkeys + pool->npending < ECDH_POOL_DEPTH) {
+        struct ecdh_pool_job *job = snew(struct ecdh_pool_job);
+        job->kex = pool->kex;
+        job->key = ssh_ecdhkex_newkey_private(pool->kex);
+        if (!platform_run_in_background(
+                ecdh_pool_job_run, ecdh_pool_job_done, job)) {
+            ssh_ecdhkex_freekey(job->key);
+            sfree(job);
+            ecdh_pool_unavailable = true;
+            break;
+        }
+        pool->npending++;
+    }
+}
+#else
+/*
+ * The workers would share the curve's MontyContext with the main
+ * thread, and without per-thread variables mpint.c can't give them
+ * scratch space of their own. So the pool only ever holds keys that
+ * a connection made and then didn't need.
+ */
+static void ecdh_pool_refill(struct ecdh_pool *pool)
+{
+}
+#endif
+
+static ecdh_key *ecdh_pool_take(const ssh_kex *kex)
+{
+    struct ecdh_pool *pool = ecdh_pool_find(kex);
+    ecdh_key *key = NULL;
+
+    if (!pool)
+        return NULL;
+    if (pool->nkeys)
+        key = pool->keys[--pool->nkeys];
+    ecdh_pool_refill(pool);
+    return key;
+}
+
 static strbuf *finalise_and_sign_exhash(struct ssh2_transport_state *s)
 {
     strbuf *sb;
@@ -194,7 +304,16 @@ void ssh2kex_coroutine(struct ssh2_transport_state *s, bool *aborted)
                      ssh_hash_alg(s->exhash)->text_name);
         s->ppl.bpp->pls->kctx = SSH2_PKTCTX_ECDHKEX;
 
-        s->ecdh_key = ssh_ecdhkex_newkey(s->kex_alg);
+        if ((s->ecdh_key = ecdh_pool_take(s->kex_alg)) != NULL) {
+            /* Don't waste any spare key the transport layer made */
+            if (s->ecdh_spare)
+                ecdh_pool_put(ecdh_pool_find(s->ecdh_spare_kex),
+                              s->ecdh_spare);
+            s->ecdh_spare = NULL;
+            s->ecdh_spare_kex = NULL;
+        } else {
+            s->ecdh_key = ssh2_transport_ecdh_key(s);
+        }
         if (!s->ecdh_key) {
             ssh_sw_abort(s->ppl.ssh, "Unable to generate key for ECDH");
             *aborted = true;
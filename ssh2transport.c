@@ -26,7 +26,7 @@ const static ssh2_macalg *const buggymacs[] = {
     &ssh_hmac_sha1_buggy, &ssh_hmac_sha1_96_buggy, &ssh_hmac_md5
 };
 
-static ssh_compressor *ssh_comp_none_init(void)
+static ssh_compressor *ssh_comp_none_init(int level)
 {
     return NULL;
 }
@@ -64,7 +64,7 @@ static const ssh_compression_alg ssh_comp_none = {
     .text_name = NULL,
 };
 const static ssh_compression_alg *const compressions[] = {
-    &ssh_zlib, &ssh_comp_none
+    &ssh_zstd, &ssh_zlib, &ssh_comp_none
 };
 
 static void ssh2_transport_free(PacketProtocolLayer *);
@@ -81,6 +81,7 @@ static size_t ssh2_transport_queued_data_size(PacketProtocolLayer *ppl);
 static void ssh2_transport_set_max_data_size(struct ssh2_transport_state *s);
 static unsigned long sanitise_rekey_time(int rekey_time, unsigned long def);
 static void ssh2_transport_higher_layer_packet_callback(void *context);
+static void ssh2_transport_ecdh_spare_callback(void *context);
 
 static const PacketProtocolLayerVtable ssh2_transport_vtable = {
     .free = ssh2_transport_free,
@@ -101,6 +102,9 @@ static void ssh2_transport_gss_update(struct ssh2_transport_state *s,
 
 static bool ssh2_transport_timer_update(struct ssh2_transport_state *s,
                                         unsigned long rekey_time);
+static void ssh2_transport_arm_idle_check(struct ssh2_transport_state *s,
+                                          unsigned long ticks);
+static bool ssh2_transport_rekey_due_soon(struct ssh2_transport_state *s);
 static int ssh2_transport_confirm_weak_crypto_primitive(
     struct ssh2_transport_state *s, const char *type, const char *name,
     const void *alg);
@@ -144,6 +148,8 @@ PacketProtocolLayer *ssh2_transport_new(
     s->pq_out_higher.pqb.ic = &s->ic_pq_out_higher;
     s->ic_pq_out_higher.fn = ssh2_transport_higher_layer_packet_callback;
     s->ic_pq_out_higher.ctx = &s->ppl;
+    s->ic_ecdh_spare.fn = ssh2_transport_ecdh_spare_callback;
+    s->ic_ecdh_spare.ctx = &s->ppl;
 
     s->higher_layer = higher_layer;
     s->higher_layer->selfptr = &s->higher_layer;
@@ -233,6 +239,8 @@ static void ssh2_transport_free(PacketProtocolLayer *ppl)
     }
     if (s->ecdh_key)
         ssh_ecdhkex_freekey(s->ecdh_key);
+    if (s->ecdh_spare)
+        ssh_ecdhkex_freekey(s->ecdh_spare);
     if (s->exhash)
         ssh_hash_free(s->exhash);
     strbuf_free(s->outgoing_kexinit);
@@ -428,6 +436,104 @@ PktIn *ssh2_transport_pop(struct ssh2_transport_state *s)
     return pq_pop(s->ppl.in_pq);
 }
 
+/*
+ * Support for CONF_ssh_cipher_auto: time one packet's worth of work
+ * for the preferred cipher of each modern cipher group, including
+ * the MAC it would be used with, and move the fastest to the front.
+ */
+#define CIPHER_TIMING_BYTES 16384
+#define CIPHER_TIMING_RUNS 3
+
+static const ssh2_ciphers *const timed_cipher_groups[] = {
+    &ssh2_aes, &ssh2_ccp, &ssh2_aesgcm,
+};
+
+static uint64_t ssh2_time_cipher_group(const ssh2_ciphers *group)
+{
+    const ssh_cipheralg *alg = group->list[0];
+    ssh_cipher *c = ssh_cipher_new(alg);
+    if (!c)
+        return UINT64_MAX;
+    const ssh2_macalg *malg = alg->required_mac ? alg->required_mac : macs[0];
+    ssh2_mac *m = ssh2_mac_new(malg, alg->required_mac ? c : NULL);
+    if (!m) {
+        ssh_cipher_free(c);
+        return UINT64_MAX;
+    }
+
+    /* The keys don't matter, only how long they take to use */
+    unsigned char *data = snewn(CIPHER_TIMING_BYTES + malg->len,
+                                unsigned char);
+    memset(data, 0, CIPHER_TIMING_BYTES + malg->len);
+    ssh_cipher_setkey(c, data);
+    if (alg->blksize > 1)
+        ssh_cipher_setiv(c, data);
+    ssh2_mac_setkey(m, make_ptrlen(data, malg->keylen));
+
+    /* Take the best of a few runs, to discount interruptions and
+     * the first run's cache misses */
+    uint64_t best = UINT64_MAX;
+    for (unsigned i = 0; i < CIPHER_TIMING_RUNS; i++) {
+        uint64_t start = platform_perf_counter_ns();
+        if (alg->flags & SSH_CIPHER_SEPARATE_LENGTH)
+            ssh_cipher_encrypt_length(c, data, 4, i);
+        ssh_cipher_encrypt(c, data, CIPHER_TIMING_BYTES);
+        ssh2_mac_generate(m, data, CIPHER_TIMING_BYTES, i);
+        uint64_t elapsed = platform_perf_counter_ns() - start;
+        if (best > elapsed)
+            best = elapsed;
+    }
+
+    sfree(data);
+    ssh2_mac_free(m);
+    ssh_cipher_free(c);
+    return best;
+}
+
+static void ssh2_order_ciphers_by_speed(
+    const ssh2_ciphers **ciphers, int nciphers)
+{
+    /* The answer won't change while we're running, so only work it
+     * out the first time */
+    static uint64_t times[lenof(timed_cipher_groups)];
+    static bool timed = false;
+    if (!timed) {
+        for (size_t i = 0; i < lenof(timed_cipher_groups); i++)
+            times[i] = ssh2_time_cipher_group(timed_cipher_groups[i]);
+        timed = true;
+    }
+
+    /*
+     * Find the slots above the warning line holding the groups we
+     * timed, and sort those groups among those same slots, leaving
+     * everything else where the user put it.
+     */
+    int slots[lenof(timed_cipher_groups)];
+    uint64_t slottimes[lenof(timed_cipher_groups)];
+    int nslots = 0;
+    for (int i = 0; i < nciphers && ciphers[i]; i++) {
+        for (size_t j = 0; j < lenof(timed_cipher_groups); j++) {
+            if (ciphers[i] == timed_cipher_groups[j]) {
+                slots[nslots] = i;
+                slottimes[nslots] = times[j];
+                nslots++;
+            }
+        }
+    }
+
+    /* Insertion sort: there are at most three, and it's stable */
+    for (int i = 1; i < nslots; i++) {
+        for (int j = i; j > 0 && slottimes[j-1] > slottimes[j]; j--) {
+            uint64_t t = slottimes[j-1];
+            slottimes[j-1] = slottimes[j];
+            slottimes[j] = t;
+            const ssh2_ciphers *c = ciphers[slots[j-1]];
+            ciphers[slots[j-1]] = ciphers[slots[j]];
+            ciphers[slots[j]] = c;
+        }
+    }
+}
+
 static void ssh2_write_kexinit_lists(
     BinarySink *pktout,
     struct kexinit_algorithm kexlists[NKEXLIST][MAXKEXLIST],
@@ -529,6 +635,9 @@ static void ssh2_write_kexinit_lists(
           case CIPHER_CHACHA20:
             preferred_ciphers[n_preferred_ciphers++] = &ssh2_ccp;
             break;
+          case CIPHER_AESGCM:
+            preferred_ciphers[n_preferred_ciphers++] = &ssh2_aesgcm;
+            break;
           case CIPHER_WARN:
             /* Flag for later. Don't bother if it's the last in
              * the list. */
@@ -538,12 +647,15 @@ static void ssh2_write_kexinit_lists(
             break;
         }
     }
+    if (conf_get_bool(conf, CONF_ssh_cipher_auto))
+        ssh2_order_ciphers_by_speed(preferred_ciphers, n_preferred_ciphers);
 
     /*
      * Set up preferred compression.
      */
     if (conf_get_bool(conf, CONF_compression))
-        preferred_comp = &ssh_zlib;
+        preferred_comp = (ssh_compression_alg_available(&ssh_zstd) ?
+                          &ssh_zstd : &ssh_zlib);
     else
         preferred_comp = &ssh_comp_none;
 
@@ -726,9 +838,11 @@ static void ssh2_write_kexinit_lists(
     for (j = KEXLIST_CSCOMP; j <= KEXLIST_SCCOMP; j++) {
         assert(lenof(compressions) > 1);
         /* Prefer non-delayed versions */
-        alg = ssh2_kexinit_addalg(kexlists[j], preferred_comp->name);
-        alg->u.comp.comp = preferred_comp;
-        alg->u.comp.delayed = false;
+        if (preferred_comp->name) {
+            alg = ssh2_kexinit_addalg(kexlists[j], preferred_comp->name);
+            alg->u.comp.comp = preferred_comp;
+            alg->u.comp.delayed = false;
+        }
         if (preferred_comp->delayed_name) {
             alg = ssh2_kexinit_addalg(kexlists[j],
                                       preferred_comp->delayed_name);
@@ -737,9 +851,13 @@ static void ssh2_write_kexinit_lists(
         }
         for (i = 0; i < lenof(compressions); i++) {
             const ssh_compression_alg *c = compressions[i];
-            alg = ssh2_kexinit_addalg(kexlists[j], c->name);
-            alg->u.comp.comp = c;
-            alg->u.comp.delayed = false;
+            if (!ssh_compression_alg_available(c))
+                continue;
+            if (c->name) {
+                alg = ssh2_kexinit_addalg(kexlists[j], c->name);
+                alg->u.comp.comp = c;
+                alg->u.comp.delayed = false;
+            }
             if (c->delayed_name) {
                 alg = ssh2_kexinit_addalg(kexlists[j], c->delayed_name);
                 alg->u.comp.comp = c;
@@ -866,9 +984,11 @@ static bool ssh2_scan_kexinits(
         /*
          * If the kex or host key algorithm is not the first one in
          * both sides' lists, that means the guessed key exchange
-         * packet (if any) is officially wrong.
+         * packet (if any) is officially wrong. (It isn't enough for
+         * it to be first in just one list: the guesser's first
+         * choice might not be the one that won.)
          */
-        if ((i == KEXLIST_KEX || i == KEXLIST_HOSTKEY) && !(cfirst || sfirst))
+        if ((i == KEXLIST_KEX || i == KEXLIST_HOSTKEY) && !(cfirst && sfirst))
             guess_correct = false;
     }
 
@@ -1102,8 +1222,26 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
         s->hostkeys, s->nhostkeys,
         !s->got_session_id, s->can_gssapi_keyex,
         s->gss_kex_used && !s->need_gss_transient_hostkey);
-    /* First KEX packet does _not_ follow, because we're not that brave. */
-    put_bool(s->outgoing_kexinit, false);
+
+    /*
+     * If the user has asked for it, bet that the server will agree to
+     * our first-choice kex method, and send the first packet of it
+     * straight after our KEXINIT, saving a round trip if we're right.
+     * We only try this as a client in the initial key exchange, and
+     * only for ECDH methods, whose first packet doesn't depend on
+     * anything the server has to tell us.
+     */
+    s->guessok = false;
+    if (!s->ssc && !s->got_session_id &&
+        conf_get_bool(s->conf, CONF_ssh_kex_guess) &&
+        s->kexlists[KEXLIST_KEX][0].name &&
+        s->kexlists[KEXLIST_KEX][0].u.kex.kex->main_type == KEXTYPE_ECDH) {
+        s->ecdh_key = ssh_ecdhkex_newkey(
+            s->kexlists[KEXLIST_KEX][0].u.kex.kex);
+        if (s->ecdh_key)
+            s->guessok = true;
+    }
+    put_bool(s->outgoing_kexinit, s->guessok);
     put_uint32(s->outgoing_kexinit, 0);             /* reserved */
 
     /*
@@ -1114,10 +1252,29 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
              s->outgoing_kexinit->len - 1); /* omit initial packet type byte */
     pq_push(s->ppl.out_pq, pktout);
 
+    if (s->guessok) {
+        s->ppl.bpp->pls->kctx = SSH2_PKTCTX_ECDHKEX;
+        pktout = ssh_bpp_new_pktout(s->ppl.bpp, SSH2_MSG_KEX_ECDH_INIT);
+        {
+            strbuf *pubpoint = strbuf_new();
+            ssh_ecdhkex_getpublic(s->ecdh_key, BinarySink_UPCAST(pubpoint));
+            put_stringsb(pktout, pubpoint);
+        }
+        pq_push(s->ppl.out_pq, pktout);
+        ppl_logevent("Sent guessed %s key exchange packet",
+                     s->kexlists[KEXLIST_KEX][0].name);
+    } else if (s->kexlists[KEXLIST_KEX][0].name &&
+               s->kexlists[KEXLIST_KEX][0].u.kex.kex->main_type ==
+               KEXTYPE_ECDH) {
+        s->ecdh_spare_kex = s->kexlists[KEXLIST_KEX][0].u.kex.kex;
+        queue_idempotent_callback(&s->ic_ecdh_spare);
+    }
+
     /*
      * Flag that KEX is in progress.
      */
     s->kex_in_progress = true;
+    s->kex_start = GETTICKCOUNT();
 
     /*
      * Wait for the other side's KEXINIT, and save it.
@@ -1133,6 +1290,8 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
     strbuf_clear(s->incoming_kexinit);
     put_byte(s->incoming_kexinit, SSH2_MSG_KEXINIT);
     put_data(s->incoming_kexinit, get_ptr(pktin), get_avail(pktin));
+    if (!s->got_session_id)
+        ssh_setup_mark(s->ppl.ssh, "kexinit");
 
     /*
      * Work through the two KEXINIT packets in parallel to find the
@@ -1140,15 +1299,32 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      */
     {
         int nhk, hks[MAXKEXLIST], i, j;
+        bool guess_ignored = false;
 
         if (!ssh2_scan_kexinits(
                 ptrlen_from_strbuf(s->client_kexinit),
                 ptrlen_from_strbuf(s->server_kexinit),
                 s->kexlists, &s->kex_alg, &s->hostkey_alg, s->cstrans,
                 s->sctrans, &s->warn_kex, &s->warn_hk, &s->warn_cscipher,
-                &s->warn_sccipher, s->ppl.ssh, NULL, &s->ignorepkt, &nhk, hks))
+                &s->warn_sccipher, s->ppl.ssh,
+                s->ssc ? &s->ignorepkt : &guess_ignored,
+                s->ssc ? NULL : &s->ignorepkt, &nhk, hks))
             return; /* false means a fatal error function was called */
 
+        /*
+         * If we sent a guessed kex packet and the server is going to
+         * discard it, throw away the key that went with it, and let
+         * the kex proceed from scratch.
+         */
+        if (s->guessok && guess_ignored) {
+            ppl_logevent("Server will discard our guessed key exchange "
+                         "packet");
+            ssh_ecdhkex_freekey(s->ecdh_key);
+            s->ecdh_key = NULL;
+            s->guessok = false;
+            s->ppl.bpp->pls->kctx = SSH2_PKTCTX_NOKEX;
+        }
+
         /*
          * In addition to deciding which host key we're actually going
          * to use, we should make a list of the host keys offered by
@@ -1349,7 +1525,16 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
      * Now our end of the key exchange is complete, we can send all
      * our queued higher-layer packets. Transfer the whole of the next
      * layer's outgoing queue on to our own.
+     *
+     * On a rekey, report how much the exchange held up. The SSH-2
+     * connection layer stops queueing bulk channel data once its
+     * output backlog (which includes this queue) reaches a limit,
+     * so this should stay small however long the exchange took.
      */
+    if (s->higher_layer_ok)
+        ppl_logevent("Key exchange held %"SIZEu" bytes of outgoing data "
+                     "for %lu ms", s->pq_out_higher.pqb.total_size,
+                     (GETTICKCOUNT() - s->kex_start) * 1000UL / TICKSPERSEC);
     pq_concatenate(s->ppl.out_pq, s->ppl.out_pq, &s->pq_out_higher);
 
     /*
@@ -1365,6 +1550,9 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
                                       pktin->type));
         return;
     }
+    if (!s->higher_layer_ok)
+        ssh_setup_mark(s->ppl.ssh, "newkeys");
+
     /* Start counting down the incoming-data limit for these cipher keys. */
     dts_reset(&s->stats->in, s->max_data_size);
 
@@ -1429,6 +1617,18 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
     s->last_rekey = GETTICKCOUNT();
     (void) ssh2_transport_timer_update(s, 0);
 
+    /*
+     * And arrange to start watching for a quiet moment to rekey in
+     * when the time-based rekey is three quarters due.
+     */
+    s->idle_check_pending = false;
+    {
+        unsigned long mins = sanitise_rekey_time(
+            conf_get_int(s->conf, CONF_ssh_rekey_time), 60);
+        if (mins)
+            ssh2_transport_arm_idle_check(s, mins * 45 * TICKSPERSEC);
+    }
+
     /*
      * Now we're encrypting. Get the next-layer protocol started if it
      * hasn't already, and then sit here waiting for reasons to go
@@ -1481,6 +1681,14 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
         queue_idempotent_callback(&s->higher_layer->ic_process_queue);
     }
 
+    /*
+     * The higher layer may have queued more packets while we were
+     * waiting for the other side's NEWKEYS, and it won't queue our
+     * callback again on their account, so pass those on before we
+     * go to sleep.
+     */
+    pq_concatenate(s->ppl.out_pq, s->ppl.out_pq, &s->pq_out_higher);
+
     s->rekey_class = RK_NONE;
     do {
         crReturnV;
@@ -1488,6 +1696,11 @@ static void ssh2_transport_process_queue(PacketProtocolLayer *ppl)
         /* Pass through outgoing packets from the higher layer. */
         pq_concatenate(s->ppl.out_pq, s->ppl.out_pq, &s->pq_out_higher);
 
+        /* If a rekey will soon be due anyway, look out for a lull in
+         * the traffic to do it in. */
+        if (ssh2_transport_rekey_due_soon(s))
+            ssh2_transport_arm_idle_check(s, SSH2_REKEY_IDLE_TICKS);
+
         /* Wait for either a KEXINIT, or something setting
          * s->rekey_class. This call to ssh2_transport_pop also has
          * the side effect of transferring incoming packets _to_ the
@@ -1575,6 +1788,40 @@ static void ssh2_transport_higher_layer_packet_callback(void *context)
     ssh_ppl_process_queue(ppl);
 }
 
+/*
+ * Generating an ECDH key pair is the one piece of kex arithmetic we
+ * can do before the peer's KEXINIT arrives, so once ours is sent we
+ * make a spare key for our first-choice method from a toplevel
+ * callback, and the kex picks it up if that method is the one agreed.
+ */
+static void ssh2_transport_ecdh_spare_callback(void *context)
+{
+    PacketProtocolLayer *ppl = (PacketProtocolLayer *)context;
+    struct ssh2_transport_state *s =
+        container_of(ppl, struct ssh2_transport_state, ppl);
+
+    if (s->ecdh_spare_kex && !s->ecdh_spare)
+        s->ecdh_spare = ssh_ecdhkex_newkey(s->ecdh_spare_kex);
+}
+
+ecdh_key *ssh2_transport_ecdh_key(struct ssh2_transport_state *s)
+{
+    ecdh_key *key = NULL;
+
+    if (s->ecdh_spare) {
+        if (s->ecdh_spare_kex == s->kex_alg)
+            key = s->ecdh_spare;
+        else
+            ssh_ecdhkex_freekey(s->ecdh_spare);
+        s->ecdh_spare = NULL;
+    }
+    s->ecdh_spare_kex = NULL;      /* and stop the callback making one */
+
+    if (!key)
+        key = ssh_ecdhkex_newkey(s->kex_alg);
+    return key;
+}
+
 static void ssh2_transport_timer(void *ctx, unsigned long now)
 {
     struct ssh2_transport_state *s = (struct ssh2_transport_state *)ctx;
@@ -1619,6 +1866,72 @@ static void ssh2_transport_timer(void *ctx, unsigned long now)
     (void) ssh2_transport_timer_update(s, 0);
 }
 
+/*
+ * A rekey holds up all other traffic for at least a round trip, so
+ * rather than wait for the time or data limit to run out - probably
+ * in the middle of a transfer - we bring the rekey forward if the
+ * connection goes quiet once it's nearly due. 'Nearly due' means
+ * three quarters of the rekey time has passed, or three quarters of
+ * the data allowance has been used in either direction; 'quiet'
+ * means fewer than SSH2_REKEY_IDLE_BYTES went past in either
+ * direction in SSH2_REKEY_IDLE_TICKS.
+ */
+static bool ssh2_transport_rekey_due_soon(struct ssh2_transport_state *s)
+{
+    unsigned long mins;
+
+    if (s->kex_in_progress || !s->higher_layer_ok)
+        return false;
+
+    if (s->max_data_size &&
+        ((s->stats->in.running &&
+          s->stats->in.remaining < s->max_data_size / 4) ||
+         (s->stats->out.running &&
+          s->stats->out.remaining < s->max_data_size / 4)))
+        return true;
+
+    mins = sanitise_rekey_time(conf_get_int(s->conf, CONF_ssh_rekey_time), 60);
+    return mins && (GETTICKCOUNT() - s->last_rekey >=
+                    mins * 45 * TICKSPERSEC);
+}
+
+static void ssh2_transport_idle_timer(void *ctx, unsigned long now)
+{
+    struct ssh2_transport_state *s = (struct ssh2_transport_state *)ctx;
+
+    if (!s->idle_check_pending || now != s->next_idle_check)
+        return;
+    s->idle_check_pending = false;
+
+    if (!ssh2_transport_rekey_due_soon(s))
+        return;
+
+    if (s->stats->in.consumed - s->idle_in_mark < SSH2_REKEY_IDLE_BYTES &&
+        s->stats->out.consumed - s->idle_out_mark < SSH2_REKEY_IDLE_BYTES) {
+        s->rekey_reason = "rekey nearly due and connection quiet";
+        s->rekey_class = RK_NORMAL;
+        queue_idempotent_callback(&s->ppl.ic_process_queue);
+        return;
+    }
+
+    ssh2_transport_arm_idle_check(s, SSH2_REKEY_IDLE_TICKS);
+}
+
+static void ssh2_transport_arm_idle_check(struct ssh2_transport_state *s,
+                                          unsigned long ticks)
+{
+    unsigned long when = GETTICKCOUNT() + ticks;
+
+    /* Only ever move a pending check earlier */
+    if (s->idle_check_pending && (long)(when - s->next_idle_check) >= 0)
+        return;
+
+    s->idle_in_mark = s->stats->in.consumed;
+    s->idle_out_mark = s->stats->out.consumed;
+    s->next_idle_check = schedule_timer(ticks, ssh2_transport_idle_timer, s);
+    s->idle_check_pending = true;
+}
+
 /*
  * The rekey_time is zero except when re-configuring.
  *
@@ -1730,8 +2043,10 @@ static void ssh2_transport_gss_update(struct ssh2_transport_state *s,
 
     /* Import server name and cache it */
     if (s->shgss->srv_name == GSS_C_NO_NAME) {
-        gss_stat = s->shgss->lib->import_name(
-            s->shgss->lib, s->fullhostname, &s->shgss->srv_name);
+        SSH_GSS_TIMED(s->shgss, SSH_GSS_STEP_IMPORT_NAME,
+                      gss_stat = s->shgss->lib->import_name(
+                          s->shgss->lib, s->fullhostname,
+                          &s->shgss->srv_name));
         if (gss_stat != SSH_GSS_OK) {
             if (gss_stat == SSH_GSS_BAD_HOST_NAME)
                 ppl_logevent("GSSAPI import name failed - Bad service name;"
@@ -1747,8 +2062,9 @@ static void ssh2_transport_gss_update(struct ssh2_transport_state *s,
      * Do we (still) have credentials? Capture the credential
      * expiration when available
      */
-    gss_stat = s->shgss->lib->acquire_cred(
-        s->shgss->lib, &gss_ctx, &gss_cred_expiry);
+    SSH_GSS_TIMED(s->shgss, SSH_GSS_STEP_ACQUIRE_CRED,
+                  gss_stat = s->shgss->lib->acquire_cred(
+                      s->shgss->lib, &gss_ctx, &gss_cred_expiry));
     if (gss_stat != SSH_GSS_OK)
         return;
 
@@ -1759,11 +2075,13 @@ static void ssh2_transport_gss_update(struct ssh2_transport_state *s,
      * When acquire_cred yields no useful expiration, get a proxy for
      * the cred expiration from the context expiration.
      */
-    gss_stat = s->shgss->lib->init_sec_context(
-        s->shgss->lib, &gss_ctx, s->shgss->srv_name,
-        0 /* don't delegate */, &gss_rcvtok, &gss_sndtok,
-        (gss_cred_expiry == GSS_NO_EXPIRATION ? &gss_cred_expiry : NULL),
-        &s->gss_ctxt_lifetime);
+    SSH_GSS_TIMED(
+        s->shgss, SSH_GSS_STEP_INIT_SEC_CONTEXT,
+        gss_stat = s->shgss->lib->init_sec_context(
+            s->shgss->lib, &gss_ctx, s->shgss->srv_name,
+            0 /* don't delegate */, &gss_rcvtok, &gss_sndtok,
+            (gss_cred_expiry == GSS_NO_EXPIRATION ? &gss_cred_expiry : NULL),
+            &s->gss_ctxt_lifetime));
 
     /* This context was for testing only. */
     if (gss_ctx)
@@ -1975,7 +2293,9 @@ static void ssh2_transport_reconfigure(PacketProtocolLayer *ppl, Conf *conf)
         rekey_mandatory = true;
     }
     if (conf_get_bool(s->conf, CONF_ssh2_des_cbc) !=
-        conf_get_bool(conf, CONF_ssh2_des_cbc)) {
+        conf_get_bool(conf, CONF_ssh2_des_cbc) ||
+        conf_get_bool(s->conf, CONF_ssh_cipher_auto) !=
+        conf_get_bool(conf, CONF_ssh_cipher_auto)) {
         rekey_reason = "cipher settings changed";
         rekey_mandatory = true;
     }
@@ -18,7 +18,12 @@
 #define DH_MIN_SIZE 1024
 #define DH_MAX_SIZE 8192
 
-#define MAXKEXLIST 16
+/* What counts as a quiet spell to bring a nearly-due rekey forward
+ * into (see ssh2_transport_rekey_due_soon) */
+#define SSH2_REKEY_IDLE_TICKS (2*TICKSPERSEC)
+#define SSH2_REKEY_IDLE_BYTES 4096
+
+#define MAXKEXLIST 32
 struct kexinit_algorithm {
     const char *name;
     union {
@@ -141,6 +146,14 @@ struct ssh2_transport_state {
 
     bool kex_in_progress;
     unsigned long next_rekey, last_rekey;
+    unsigned long kex_start;     /* when we last sent KEXINIT */
+
+    /*
+     * State for bringing a rekey forward into a quiet spell: see
+     * ssh2_transport_idle_timer.
+     */
+    bool idle_check_pending;
+    unsigned long next_idle_check, idle_in_mark, idle_out_mark;
     const char *deferred_rekey_reason;
     bool higher_layer_ok;
 
@@ -176,6 +189,9 @@ struct ssh2_transport_state {
     RSAKey *rsa_kex_key;             /* for RSA kex */
     bool rsa_kex_key_needs_freeing;
     ecdh_key *ecdh_key;                     /* for ECDH kex */
+    ecdh_key *ecdh_spare;        /* made in advance while awaiting KEXINIT */
+    const ssh_kex *ecdh_spare_kex;       /* method ecdh_spare is wanted for */
+    IdempotentCallback ic_ecdh_spare;
     unsigned char exchange_hash[MAX_HASH_LEN];
     bool can_gssapi_keyex;
     bool need_gss_transient_hostkey;
@@ -230,6 +246,7 @@ void ssh2_transport_dialog_callback(void *, int);
 
 /* Provided by transport for use in kex */
 void ssh2transport_finalise_exhash(struct ssh2_transport_state *s);
+ecdh_key *ssh2_transport_ecdh_key(struct ssh2_transport_state *s);
 
 /* Provided by kex for use in transport. Must set the 'aborted' flag
  * if it throws a connection-terminating error, so that the caller
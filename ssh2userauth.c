@@ -10,6 +10,7 @@
 #include "sshbpp.h"
 #include "sshppl.h"
 #include "sshcr.h"
+#include "storage.h"
 
 #ifndef NO_GSSAPI
 #include "sshgssc.h"
@@ -30,6 +31,7 @@ struct ssh2_userauth_state {
     Filename *keyfile;
     bool show_banner, tryagent, change_username;
     char *hostname, *fullhostname;
+    int port;
     char *default_username;
     bool try_ki_auth, try_gssapi_auth, try_gssapi_kex_auth, gssapi_fwd;
 
@@ -77,6 +79,18 @@ struct ssh2_userauth_state {
     size_t agent_keys_len;
     agent_key *agent_keys;
     size_t agent_key_index, agent_key_limit;
+    size_t agent_key_sent, agent_key_probes;
+    strbuf *signed_key_blob;           /* not owned: key we last signed with */
+    bool remember_auth;
+    enum {
+        AUTH_HINT_NONE,
+        AUTH_HINT_KEYFILE,
+        AUTH_HINT_GSSAPI,
+        AUTH_HINT_KEYBOARD_INTERACTIVE,
+        AUTH_HINT_PASSWORD
+    } hint_method;
+    bool hint_active;
+    char *stored_hint;
     int len;
     PktOut *pktout;
     bool want_user_input;
@@ -116,6 +130,15 @@ static PktOut *ssh2_userauth_gss_packet(
 #endif
 static void ssh2_userauth_antispoof_msg(
     struct ssh2_userauth_state *s, const char *msg);
+static void ssh2_userauth_apply_hint(struct ssh2_userauth_state *s);
+static bool ssh2_userauth_hint_usable(struct ssh2_userauth_state *s);
+static void ssh2_userauth_save_hint(struct ssh2_userauth_state *s);
+
+static inline bool ssh2_userauth_hint_allows(
+    struct ssh2_userauth_state *s, int method)
+{
+    return !s->hint_active || s->hint_method == method;
+}
 
 static const PacketProtocolLayerVtable ssh2_userauth_vtable = {
     .free = ssh2_userauth_free,
@@ -131,8 +154,9 @@ static const PacketProtocolLayerVtable ssh2_userauth_vtable = {
 
 PacketProtocolLayer *ssh2_userauth_new(
     PacketProtocolLayer *successor_layer,
-    const char *hostname, const char *fullhostname,
+    const char *hostname, const char *fullhostname, int port,
     Filename *keyfile, bool show_banner, bool tryagent,
+    int agent_key_probes, bool remember_auth,
     const char *default_username, bool change_username,
     bool try_ki_auth, bool try_gssapi_auth, bool try_gssapi_kex_auth,
     bool gssapi_fwd, struct ssh_connection_shared_gss_state *shgss)
@@ -144,9 +168,12 @@ PacketProtocolLayer *ssh2_userauth_new(
     s->successor_layer = successor_layer;
     s->hostname = dupstr(hostname);
     s->fullhostname = dupstr(fullhostname);
+    s->port = port;
     s->keyfile = filename_copy(keyfile);
     s->show_banner = show_banner;
     s->tryagent = tryagent;
+    s->agent_key_probes = agent_key_probes > 1 ? agent_key_probes : 1;
+    s->remember_auth = remember_auth;
     s->default_username = dupstr(default_username);
     s->change_username = change_username;
     s->try_ki_auth = try_ki_auth;
@@ -193,6 +220,7 @@ static void ssh2_userauth_free(PacketProtocolLayer *ppl)
     sfree(s->locally_allocated_username);
     sfree(s->hostname);
     sfree(s->fullhostname);
+    sfree(s->stored_hint);
     sfree(s->publickey_comment);
     sfree(s->publickey_algorithm);
     if (s->publickey_blob)
@@ -241,6 +269,25 @@ static void ssh2_userauth_filter_queue(struct ssh2_userauth_state *s)
     }
 }
 
+/* Label for an authentication attempt in the setup timing log */
+static const char *ssh2_userauth_timing_label(struct ssh2_userauth_state *s)
+{
+    switch (s->type) {
+      case AUTH_TYPE_NONE:
+        return "userauth:none";
+      case AUTH_TYPE_PUBLICKEY:
+      case AUTH_TYPE_PUBLICKEY_OFFER_LOUD:
+      case AUTH_TYPE_PUBLICKEY_OFFER_QUIET:
+        return "userauth:publickey";
+      case AUTH_TYPE_PASSWORD:
+        return "userauth:password";
+      case AUTH_TYPE_GSSAPI:
+        return "userauth:gssapi";
+      default:
+        return "userauth:keyboard-interactive";
+    }
+}
+
 static PktIn *ssh2_userauth_pop(struct ssh2_userauth_state *s)
 {
     ssh2_userauth_filter_queue(s);
@@ -476,6 +523,10 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
         }
         s->got_username = true;
 
+        s->hint_active = false;
+        if (s->remember_auth)
+            ssh2_userauth_apply_hint(s);
+
         /*
          * Send an authentication request using method "none": (a)
          * just in case it succeeds, and (b) so that we know what
@@ -506,6 +557,7 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
             } else {
                 crMaybeWaitUntilV((pktin = ssh2_userauth_pop(s)) != NULL);
             }
+            ssh_setup_mark(s->ppl.ssh, ssh2_userauth_timing_label(s));
 
             /*
              * Now is a convenient point to spew any banner material
@@ -553,6 +605,8 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
 
             if (pktin && pktin->type == SSH2_MSG_USERAUTH_SUCCESS) {
                 ppl_logevent("Access granted");
+                if (s->remember_auth)
+                    ssh2_userauth_save_hint(s);
                 goto userauth_success;
             }
 
@@ -687,6 +741,17 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                     srv_gssapi_keyex_auth &&
                     s->shgss->libs->nlibraries > 0 && s->shgss->ctx;
 #endif
+
+                /*
+                 * If the method that worked last time isn't
+                 * available now, forget about it and try everything
+                 * in the usual order.
+                 */
+                if (s->hint_active && !ssh2_userauth_hint_usable(s)) {
+                    ppl_logevent("Method that worked last time is not "
+                                 "available");
+                    s->hint_active = false;
+                }
             }
 
             s->ppl.bpp->pls->actx = SSH2_PKTCTX_NOAUTH;
@@ -713,8 +778,9 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
             } else
 #endif /* NO_GSSAPI */
 
-            if (s->can_pubkey && !s->done_agent &&
-                s->agent_key_index < s->agent_key_limit) {
+            if ((s->can_pubkey && !s->done_agent && !s->hint_active &&
+                 s->agent_key_index < s->agent_key_limit) ||
+                s->agent_key_index < s->agent_key_sent) {
 
                 /*
                  * Attempt public-key authentication using a key from Pageant.
@@ -722,21 +788,39 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
 
                 s->ppl.bpp->pls->actx = SSH2_PKTCTX_PUBLICKEY;
 
-                ppl_logevent("Trying Pageant key #%"SIZEu, s->agent_key_index);
-
-                /* See if server will accept it */
-                s->pktout = ssh_bpp_new_pktout(
-                    s->ppl.bpp, SSH2_MSG_USERAUTH_REQUEST);
-                put_stringz(s->pktout, s->username);
-                put_stringz(s->pktout, s->successor_layer->vt->name);
-                put_stringz(s->pktout, "publickey");
-                                                    /* method */
-                put_bool(s->pktout, false); /* no signature included */
-                put_stringpl(s->pktout,
-                             s->agent_keys[s->agent_key_index].algorithm);
-                put_stringpl(s->pktout, ptrlen_from_strbuf(
-                            s->agent_keys[s->agent_key_index].blob));
-                pq_push(s->ppl.out_pq, s->pktout);
+                /*
+                 * Offer keys to the server, keeping up to
+                 * agent_key_probes offers outstanding at once. The
+                 * server answers them in the order it received them,
+                 * so the next reply always concerns agent_key_index.
+                 * (If the server has stopped accepting publickey
+                 * entirely, we still have to collect the replies to
+                 * any offers already in flight.)
+                 */
+                if (s->agent_key_sent < s->agent_key_index)
+                    s->agent_key_sent = s->agent_key_index;
+                while (s->can_pubkey &&
+                       s->agent_key_sent < s->agent_key_limit &&
+                       s->agent_key_sent - s->agent_key_index <
+                       s->agent_key_probes) {
+                    ppl_logevent("Trying Pageant key #%"SIZEu,
+                                 s->agent_key_sent);
+
+                    /* See if server will accept it */
+                    s->pktout = ssh_bpp_new_pktout(
+                        s->ppl.bpp, SSH2_MSG_USERAUTH_REQUEST);
+                    put_stringz(s->pktout, s->username);
+                    put_stringz(s->pktout, s->successor_layer->vt->name);
+                    put_stringz(s->pktout, "publickey");
+                                                        /* method */
+                    put_bool(s->pktout, false); /* no signature included */
+                    put_stringpl(s->pktout,
+                                 s->agent_keys[s->agent_key_sent].algorithm);
+                    put_stringpl(s->pktout, ptrlen_from_strbuf(
+                                s->agent_keys[s->agent_key_sent].blob));
+                    pq_push(s->ppl.out_pq, s->pktout);
+                    s->agent_key_sent++;
+                }
                 s->type = AUTH_TYPE_PUBLICKEY_OFFER_QUIET;
 
                 crMaybeWaitUntilV((pktin = ssh2_userauth_pop(s)) != NULL);
@@ -748,6 +832,30 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
 
                 } else {
                     strbuf *agentreq, *sigdata;
+
+                    /*
+                     * Collect the replies to any offers we made after
+                     * this one, so that none of them can be mistaken
+                     * for the response to our signature. Those keys
+                     * will be offered again if this one doesn't work
+                     * out.
+                     */
+                    while (s->agent_key_sent > s->agent_key_index + 1) {
+                        crMaybeWaitUntilV(
+                            (pktin = ssh2_userauth_pop(s)) != NULL);
+                        if (pktin->type != SSH2_MSG_USERAUTH_FAILURE &&
+                            pktin->type != SSH2_MSG_USERAUTH_PK_OK) {
+                            ssh_proto_error(
+                                s->ppl.ssh, "Received unexpected packet "
+                                "in response to public key offer, "
+                                "type %d (%s)", pktin->type,
+                                ssh2_pkt_type(s->ppl.bpp->pls->kctx,
+                                              s->ppl.bpp->pls->actx,
+                                              pktin->type));
+                            return;
+                        }
+                        s->agent_key_sent--;
+                    }
                     ptrlen comment = ptrlen_from_strbuf(
                         s->agent_keys[s->agent_key_index].comment);
 
@@ -805,6 +913,8 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                                 sigblob);
                             pq_push(s->ppl.out_pq, s->pktout);
                             s->type = AUTH_TYPE_PUBLICKEY;
+                            s->signed_key_blob =
+                                s->agent_keys[s->agent_key_index].blob;
                         } else {
                             ppl_logevent("Pageant refused signing request");
                             ppl_printf("Pageant failed to "
@@ -827,7 +937,8 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                     s->done_agent = true;
 
             } else if (s->can_pubkey && s->publickey_blob &&
-                       s->privatekey_available && !s->tried_pubkey_config) {
+                       s->privatekey_available && !s->tried_pubkey_config &&
+                       ssh2_userauth_hint_allows(s, AUTH_HINT_KEYFILE)) {
 
                 ssh2_userkey *key;   /* not live over crReturn */
                 char *passphrase;           /* not live over crReturn */
@@ -835,6 +946,7 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                 s->ppl.bpp->pls->actx = SSH2_PKTCTX_PUBLICKEY;
 
                 s->tried_pubkey_config = true;
+                s->hint_active = false;
 
                 /*
                  * Try the public key supplied in the configuration.
@@ -1005,13 +1117,15 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                     pq_push(s->ppl.out_pq, s->pktout);
                     ppl_logevent("Sent public key signature");
                     s->type = AUTH_TYPE_PUBLICKEY;
+                    s->signed_key_blob = s->publickey_blob;
                     ssh_key_free(key->key);
                     sfree(key->comment);
                     sfree(key);
                 }
 
 #ifndef NO_GSSAPI
-            } else if (s->can_gssapi && !s->tried_gssapi) {
+            } else if (s->can_gssapi && !s->tried_gssapi &&
+                       ssh2_userauth_hint_allows(s, AUTH_HINT_GSSAPI)) {
 
                 /* gssapi-with-mic authentication */
 
@@ -1019,6 +1133,7 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
 
                 s->type = AUTH_TYPE_GSSAPI;
                 s->tried_gssapi = true;
+                s->hint_active = false;
                 s->ppl.bpp->pls->actx = SSH2_PKTCTX_GSSAPI;
 
                 if (s->shgss->lib->gsslogmsg)
@@ -1072,8 +1187,10 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
 
                 /* Import server name if not cached from KEX */
                 if (s->shgss->srv_name == GSS_C_NO_NAME) {
-                    s->gss_stat = s->shgss->lib->import_name(
-                        s->shgss->lib, s->fullhostname, &s->shgss->srv_name);
+                    SSH_GSS_TIMED(s->shgss, SSH_GSS_STEP_IMPORT_NAME,
+                                  s->gss_stat = s->shgss->lib->import_name(
+                                      s->shgss->lib, s->fullhostname,
+                                      &s->shgss->srv_name));
                     if (s->gss_stat != SSH_GSS_OK) {
                         if (s->gss_stat == SSH_GSS_BAD_HOST_NAME)
                             ppl_logevent("GSSAPI import name failed -"
@@ -1085,8 +1202,9 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                 }
 
                 /* Allocate our gss_ctx */
-                s->gss_stat = s->shgss->lib->acquire_cred(
-                    s->shgss->lib, &s->shgss->ctx, NULL);
+                SSH_GSS_TIMED(s->shgss, SSH_GSS_STEP_ACQUIRE_CRED,
+                              s->gss_stat = s->shgss->lib->acquire_cred(
+                                  s->shgss->lib, &s->shgss->ctx, NULL));
                 if (s->gss_stat != SSH_GSS_OK) {
                     ppl_logevent("GSSAPI authentication failed to get "
                                  "credentials");
@@ -1108,7 +1226,9 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                      * When acquire_cred yields no useful expiration, go with
                      * the service ticket expiration.
                      */
-                    s->gss_stat = s->shgss->lib->init_sec_context
+                    SSH_GSS_TIMED(
+                        s->shgss, SSH_GSS_STEP_INIT_SEC_CONTEXT,
+                        s->gss_stat = s->shgss->lib->init_sec_context
                         (s->shgss->lib,
                          &s->shgss->ctx,
                          s->shgss->srv_name,
@@ -1116,7 +1236,7 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                          &s->gss_rcvtok,
                          &s->gss_sndtok,
                          NULL,
-                         NULL);
+                         NULL));
 
                     if (s->gss_stat!=SSH_GSS_S_COMPLETE &&
                         s->gss_stat!=SSH_GSS_S_CONTINUE_NEEDED) {
@@ -1196,6 +1316,12 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                     }
                 } while (s-> gss_stat == SSH_GSS_S_CONTINUE_NEEDED);
 
+                {
+                    char *steps = ssh_gss_step_summary(s->shgss);
+                    ppl_logevent("GSSAPI step times: %s", steps);
+                    sfree(steps);
+                }
+
                 if (s->gss_stat != SSH_GSS_OK) {
                     s->shgss->lib->release_cred(s->shgss->lib, &s->shgss->ctx);
                     continue;
@@ -1210,13 +1336,16 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                 s->shgss->lib->release_cred(s->shgss->lib, &s->shgss->ctx);
                 continue;
 #endif
-            } else if (s->can_keyb_inter && !s->kbd_inter_refused) {
+            } else if (s->can_keyb_inter && !s->kbd_inter_refused &&
+                       ssh2_userauth_hint_allows(
+                           s, AUTH_HINT_KEYBOARD_INTERACTIVE)) {
 
                 /*
                  * Keyboard-interactive authentication.
                  */
 
                 s->type = AUTH_TYPE_KEYBOARD_INTERACTIVE;
+                s->hint_active = false;
 
                 s->ppl.bpp->pls->actx = SSH2_PKTCTX_KBDINTER;
 
@@ -1441,7 +1570,8 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                  */
                 pq_push_front(s->ppl.in_pq, pktin);
 
-            } else if (s->can_passwd) {
+            } else if (s->can_passwd &&
+                       ssh2_userauth_hint_allows(s, AUTH_HINT_PASSWORD)) {
 
                 /*
                  * Plain old password authentication.
@@ -1449,6 +1579,7 @@ static void ssh2_userauth_process_queue(PacketProtocolLayer *ppl)
                 bool changereq_first_time; /* not live over crReturn */
 
                 s->ppl.bpp->pls->actx = SSH2_PKTCTX_PASSWORD;
+                s->hint_active = false;
 
                 s->cur_prompt = new_prompts();
                 s->cur_prompt->to_server = true;
@@ -1929,3 +2060,148 @@ static void ssh2_userauth_antispoof_msg(
     seat_stderr_pl(s->ppl.seat, ptrlen_from_strbuf(sb));
     strbuf_free(sb);
 }
+
+/*
+ * The hint we store for a successful login is the name of the
+ * method, followed for publickey by the SHA-256 hash of the key blob
+ * (so as not to keep the key itself lying around in another file),
+ * or for gssapi-with-mic by the id of the GSSAPI library we used.
+ * Only the Kerberos mechanism is ever offered, so there's no need to
+ * record that.
+ */
+static char *ssh2_userauth_key_hint(ptrlen blob)
+{
+    unsigned char digest[32];
+    strbuf *sb = strbuf_new();
+
+    hash_simple(&ssh_sha256, blob, digest);
+    put_datapl(sb, PTRLEN_LITERAL("publickey "));
+    for (size_t i = 0; i < lenof(digest); i++)
+        strbuf_catf(sb, "%02x", digest[i]);
+    smemclr(digest, sizeof(digest));
+    return strbuf_to_str(sb);
+}
+
+static bool ssh2_userauth_key_matches_hint(ptrlen blob, const char *hint)
+{
+    char *keyhint = ssh2_userauth_key_hint(blob);
+    bool match = !strcmp(keyhint, hint);
+    sfree(keyhint);
+    return match;
+}
+
+/*
+ * Arrange to try whatever worked last time for this user first. A
+ * Pageant key is moved to the front of the list of keys to try (the
+ * others stay in their original order after it); any other method
+ * is tried before everything except gssapi-keyex and Pageant keys,
+ * and then we fall back to the usual order.
+ */
+static void ssh2_userauth_apply_hint(struct ssh2_userauth_state *s)
+{
+    PacketProtocolLayer *ppl = &s->ppl; /* for ppl_logevent */
+    char *hint;
+
+    sfree(s->stored_hint);
+    s->stored_hint = hint =
+        retrieve_auth_hint(s->hostname, s->port, s->username);
+    if (!hint)
+        return;
+
+    if (!strncmp(hint, "publickey ", 10)) {
+        if (s->agent_key_index == 0 && s->agent_key_limit > 1 &&
+            s->agent_key_limit == s->agent_keys_len) {
+            for (size_t i = 0; i < s->agent_key_limit; i++) {
+                if (ssh2_userauth_key_matches_hint(
+                        ptrlen_from_strbuf(s->agent_keys[i].blob), hint)) {
+                    if (i > 0) {
+                        agent_key tmp = s->agent_keys[i];
+                        memmove(s->agent_keys + 1, s->agent_keys,
+                                i * sizeof(*s->agent_keys));
+                        s->agent_keys[0] = tmp;
+                    }
+                    ppl_logevent("Moving Pageant key #%"SIZEu" to the "
+                                 "front, as it worked last time", i);
+                    break;
+                }
+            }
+        } else if (s->publickey_blob && s->agent_key_limit == 0 &&
+                   ssh2_userauth_key_matches_hint(
+                       ptrlen_from_strbuf(s->publickey_blob), hint)) {
+            s->hint_method = AUTH_HINT_KEYFILE;
+            s->hint_active = true;
+        }
+#ifndef NO_GSSAPI
+    } else if (!strncmp(hint, "gssapi-with-mic ", 16)) {
+        if (s->shgss->lib && s->shgss->lib->id == atoi(hint + 16)) {
+            s->hint_method = AUTH_HINT_GSSAPI;
+            s->hint_active = true;
+        }
+#endif
+    } else if (!strcmp(hint, "keyboard-interactive")) {
+        s->hint_method = AUTH_HINT_KEYBOARD_INTERACTIVE;
+        s->hint_active = true;
+    } else if (!strcmp(hint, "password")) {
+        s->hint_method = AUTH_HINT_PASSWORD;
+        s->hint_active = true;
+    }
+
+    if (s->hint_active)
+        ppl_logevent("Trying %s first, as it worked last time",
+                     s->hint_method == AUTH_HINT_KEYFILE ?
+                     "configured key file" : hint);
+}
+
+static bool ssh2_userauth_hint_usable(struct ssh2_userauth_state *s)
+{
+    switch (s->hint_method) {
+      case AUTH_HINT_KEYFILE:
+        return s->can_pubkey && s->publickey_blob &&
+            s->privatekey_available && !s->tried_pubkey_config;
+#ifndef NO_GSSAPI
+      case AUTH_HINT_GSSAPI:
+        return s->can_gssapi && !s->tried_gssapi;
+#endif
+      case AUTH_HINT_KEYBOARD_INTERACTIVE:
+        return s->can_keyb_inter && !s->kbd_inter_refused;
+      case AUTH_HINT_PASSWORD:
+        return s->can_passwd;
+      default:
+        return false;
+    }
+}
+
+static void ssh2_userauth_save_hint(struct ssh2_userauth_state *s)
+{
+    char *hint;
+
+    switch (s->type) {
+      case AUTH_TYPE_PUBLICKEY:
+        if (!s->signed_key_blob)
+            return;
+        hint = ssh2_userauth_key_hint(ptrlen_from_strbuf(s->signed_key_blob));
+        break;
+#ifndef NO_GSSAPI
+      case AUTH_TYPE_GSSAPI:
+        /* gssapi-keyex is always tried first anyway */
+        if (!s->tried_gssapi || !s->shgss->lib)
+            return;
+        hint = dupprintf("gssapi-with-mic %d", s->shgss->lib->id);
+        break;
+#endif
+      case AUTH_TYPE_KEYBOARD_INTERACTIVE:
+      case AUTH_TYPE_KEYBOARD_INTERACTIVE_QUIET:
+        hint = dupstr("keyboard-interactive");
+        break;
+      case AUTH_TYPE_PASSWORD:
+        hint = dupstr("password");
+        break;
+      default:
+        return;                        /* "none" succeeded: nothing to say */
+    }
+
+    /* Don't rewrite the hints file if nothing has changed */
+    if (!s->stored_hint || strcmp(hint, s->stored_hint))
+        store_auth_hint(s->hostname, s->port, s->username, hint);
+    sfree(hint);
+}
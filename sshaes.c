@@ -160,7 +160,8 @@ struct aes_extra {
                   keylen, "AES-" #keylen " CBC", _encrypt, _decrypt,    \
                   setiv_cbc, SSH_CIPHER_IS_CBC)                         \
     VTABLES_INNER(aes ## keylen ## _sdctr, "aes" #keylen "-ctr",        \
-                  keylen, "AES-" #keylen " SDCTR",,, setiv_sdctr, 0)
+                  keylen, "AES-" #keylen " SDCTR", _encrypt, _decrypt,  \
+                  setiv_sdctr, 0)
 
 VTABLES(128)
 VTABLES(192)
@@ -1038,9 +1039,45 @@ DECRYPT_FN(parallel, BignumInt, SLICE_PARALLELISM)
 
 #define SDCTR_WORDS (16 / BIGNUM_INT_BYTES)
 
+/*
+ * When decrypting in bulk in SDCTR mode, we generate keystream ahead
+ * of time on worker threads, HPN-style, so that the main thread only
+ * has to XOR it in. (The encrypting side of an SSH connection is
+ * already done on a worker thread by ssh2bpp.c.) The keystream is
+ * kept in a ring of chunks, each filled by one background job, and
+ * each refilled as soon as it's been used up.
+ *
+ * We only start doing this once a cipher has decrypted a fair amount
+ * of data, so that short interactive sessions never pay for it. It
+ * isn't worth doing at all for the hardware implementations, which
+ * generate keystream far faster than the rest of the SSH stack can
+ * use it.
+ */
+#define SDCTR_AHEAD_CHUNKS 4
+#define SDCTR_AHEAD_BYTES 16384
+#define SDCTR_AHEAD_AFTER 262144
+
+typedef struct aes_sdctr_chunk aes_sdctr_chunk;
+struct aes_sdctr_chunk {
+    const aes_sliced_key *sk;
+    BignumInt counter[SDCTR_WORDS];    /* for the first block */
+    bool pending;                      /* a background job is filling it */
+    uint8_t keystream[SDCTR_AHEAD_BYTES];
+};
+
+typedef struct aes_sdctr_ahead {
+    aes_sdctr_chunk chunks[SDCTR_AHEAD_CHUNKS];
+    unsigned cur;                      /* the chunk we're consuming */
+    size_t pos;                        /* and our position within it */
+} aes_sdctr_ahead;
+
 typedef struct aes_sw_context aes_sw_context;
 struct aes_sw_context {
     aes_sliced_key sk;
+    /* SDCTR only: the keystream ring, once decryption has gone on
+     * long enough to start it, and how far there is to go until then */
+    aes_sdctr_ahead *ahead;
+    size_t ahead_countdown;
     union {
         struct {
             /* In CBC mode, the IV is just a copy of the last seen
@@ -1068,12 +1105,29 @@ static ssh_cipher *aes_sw_new(const ssh_cipheralg *alg)
 {
     aes_sw_context *ctx = snew(aes_sw_context);
     ctx->ciph.vt = alg;
+    ctx->ahead = NULL;
+    ctx->ahead_countdown = SDCTR_AHEAD_AFTER;
     return &ctx->ciph;
 }
 
+static void aes_sdctr_ahead_free(aes_sw_context *ctx)
+{
+    aes_sdctr_ahead *ahead = ctx->ahead;
+
+    if (!ahead)
+        return;
+    for (unsigned i = 0; i < SDCTR_AHEAD_CHUNKS; i++)
+        if (ahead->chunks[i].pending)
+            platform_finish_background(&ahead->chunks[i]);
+    smemclr(ahead, sizeof(*ahead));
+    sfree(ahead);
+    ctx->ahead = NULL;
+}
+
 static void aes_sw_free(ssh_cipher *ciph)
 {
     aes_sw_context *ctx = container_of(ciph, aes_sw_context, ciph);
+    aes_sdctr_ahead_free(ctx);
     smemclr(ctx, sizeof(*ctx));
     sfree(ctx);
 }
@@ -1081,6 +1135,7 @@ static void aes_sw_free(ssh_cipher *ciph)
 static void aes_sw_setkey(ssh_cipher *ciph, const void *vkey)
 {
     aes_sw_context *ctx = container_of(ciph, aes_sw_context, ciph);
+    aes_sdctr_ahead_free(ctx);         /* its jobs are using the old key */
     aes_sliced_key_setup(&ctx->sk, vkey, ctx->ciph.vt->real_keybits);
 }
 
@@ -1095,6 +1150,10 @@ static void aes_sw_setiv_sdctr(ssh_cipher *ciph, const void *viv)
     aes_sw_context *ctx = container_of(ciph, aes_sw_context, ciph);
     const uint8_t *iv = (const uint8_t *)viv;
 
+    /* Any keystream generated ahead is for the old counter */
+    aes_sdctr_ahead_free(ctx);
+    ctx->ahead_countdown = SDCTR_AHEAD_AFTER;
+
     /* Import the initial counter value into the internal representation */
     for (unsigned i = 0; i < SDCTR_WORDS; i++)
         ctx->iv.sdctr.counter[i] =
@@ -1205,11 +1264,30 @@ static inline void aes_cbc_sw_decrypt(
     smemclr(data, sizeof(data));
 }
 
-static inline void aes_sdctr_sw(
-    ssh_cipher *ciph, void *vblk, int blklen)
+/*
+ * Format nblocks successive SDCTR counter values into a buffer, and
+ * advance the counter past them.
+ */
+static inline void aes_sdctr_sw_counters(
+    uint8_t *out, size_t nblocks, BignumInt *counter)
 {
-    aes_sw_context *ctx = container_of(ciph, aes_sw_context, ciph);
+    for (; nblocks-- > 0; out += 16) {
+        /* Format the counter value into the buffer. */
+        for (unsigned i = 0; i < SDCTR_WORDS; i++)
+            PUT_BIGNUMINT_MSB_FIRST(
+                out + 16 - BIGNUM_INT_BYTES - i*BIGNUM_INT_BYTES,
+                counter[i]);
+
+        /* Increment the counter. */
+        BignumCarry carry = 1;
+        for (unsigned i = 0; i < SDCTR_WORDS; i++)
+            BignumADC(counter[i], carry, counter[i], 0, carry);
+    }
+}
 
+static inline void aes_sdctr_sw(
+    aes_sw_context *ctx, uint8_t *blk, size_t blklen)
+{
     /*
      * SDCTR encrypt/decrypt loops round one block at a time XORing
      * the keystream into the user's data, and periodically has to run
@@ -1219,27 +1297,14 @@ static inline void aes_sdctr_sw(
     uint8_t *keystream_end =
         ctx->iv.sdctr.keystream + sizeof(ctx->iv.sdctr.keystream);
 
-    for (uint8_t *blk = (uint8_t *)vblk, *finish = blk + blklen;
-         blk < finish; blk += 16) {
+    for (uint8_t *finish = blk + blklen; blk < finish; blk += 16) {
 
         if (ctx->iv.sdctr.keystream_pos == keystream_end) {
             /*
              * Generate some keystream.
              */
-            for (uint8_t *block = ctx->iv.sdctr.keystream;
-                 block < keystream_end; block += 16) {
-                /* Format the counter value into the buffer. */
-                for (unsigned i = 0; i < SDCTR_WORDS; i++)
-                    PUT_BIGNUMINT_MSB_FIRST(
-                        block + 16 - BIGNUM_INT_BYTES - i*BIGNUM_INT_BYTES,
-                        ctx->iv.sdctr.counter[i]);
-
-                /* Increment the counter. */
-                BignumCarry carry = 1;
-                for (unsigned i = 0; i < SDCTR_WORDS; i++)
-                    BignumADC(ctx->iv.sdctr.counter[i], carry,
-                              ctx->iv.sdctr.counter[i], 0, carry);
-            }
+            aes_sdctr_sw_counters(ctx->iv.sdctr.keystream,
+                                  SLICE_PARALLELISM, ctx->iv.sdctr.counter);
 
             /* Encrypt all those counter blocks. */
             aes_sliced_e_parallel(ctx->iv.sdctr.keystream,
@@ -1254,6 +1319,135 @@ static inline void aes_sdctr_sw(
     }
 }
 
+static void aes_sdctr_chunk_fill(void *vchunk)
+{
+    aes_sdctr_chunk *chunk = (aes_sdctr_chunk *)vchunk;
+    BignumInt counter[SDCTR_WORDS];
+    const size_t step = SLICE_PARALLELISM * 16;
+
+    memcpy(counter, chunk->counter, sizeof(counter));
+    for (uint8_t *p = chunk->keystream,
+             *end = chunk->keystream + SDCTR_AHEAD_BYTES; p < end; p += step) {
+        aes_sdctr_sw_counters(p, SLICE_PARALLELISM, counter);
+        aes_sliced_e_parallel(p, p, chunk->sk);
+    }
+}
+
+static void aes_sdctr_chunk_filled(void *vchunk)
+{
+    aes_sdctr_chunk *chunk = (aes_sdctr_chunk *)vchunk;
+    chunk->pending = false;
+}
+
+/*
+ * Set a chunk of the ring to be filled with the next stretch of
+ * keystream after everything handed out so far.
+ */
+static void aes_sdctr_chunk_start(aes_sw_context *ctx, aes_sdctr_chunk *chunk)
+{
+    BignumCarry carry = 0;
+
+    chunk->sk = &ctx->sk;
+    memcpy(chunk->counter, ctx->iv.sdctr.counter, sizeof(chunk->counter));
+    BignumADC(ctx->iv.sdctr.counter[0], carry, ctx->iv.sdctr.counter[0],
+              SDCTR_AHEAD_BYTES / 16, 0);
+    for (unsigned i = 1; i < SDCTR_WORDS; i++)
+        BignumADC(ctx->iv.sdctr.counter[i], carry,
+                  ctx->iv.sdctr.counter[i], 0, carry);
+
+    chunk->pending = true;
+    if (!platform_run_in_background(
+            aes_sdctr_chunk_fill, aes_sdctr_chunk_filled, chunk)) {
+        aes_sdctr_chunk_fill(chunk);
+        chunk->pending = false;
+    }
+}
+
+static void aes_sdctr_sw_ahead(
+    aes_sw_context *ctx, uint8_t *blk, size_t blklen)
+{
+    aes_sdctr_ahead *ahead = ctx->ahead;
+
+    while (blklen > 0) {
+        aes_sdctr_chunk *chunk = &ahead->chunks[ahead->cur];
+        size_t len = SDCTR_AHEAD_BYTES - ahead->pos;
+        if (len > blklen)
+            len = blklen;
+
+        if (chunk->pending)
+            platform_finish_background(chunk);
+        for (size_t i = 0; i < len; i += 16)
+            memxor16(blk + i, blk + i, chunk->keystream + ahead->pos + i);
+        blk += len;
+        blklen -= len;
+
+        if ((ahead->pos += len) == SDCTR_AHEAD_BYTES) {
+            aes_sdctr_chunk_start(ctx, chunk);
+            ahead->cur = (ahead->cur + 1) % SDCTR_AHEAD_CHUNKS;
+            ahead->pos = 0;
+        }
+    }
+}
+
+static inline void aes_sdctr_sw_encrypt(
+    ssh_cipher *ciph, void *vblk, int blklen)
+{
+    aes_sw_context *ctx = container_of(ciph, aes_sw_context, ciph);
+
+    /* Encryption may be running on a worker thread (see ssh2bpp.c),
+     * so it never starts the ring itself, whose jobs finish on the
+     * main thread. But it must use it if decryption has. */
+    if (ctx->ahead)
+        aes_sdctr_sw_ahead(ctx, vblk, blklen);
+    else
+        aes_sdctr_sw(ctx, vblk, blklen);
+}
+
+static inline void aes_sdctr_sw_decrypt(
+    ssh_cipher *ciph, void *vblk, int blklen)
+{
+    aes_sw_context *ctx = container_of(ciph, aes_sw_context, ciph);
+    uint8_t *blk = (uint8_t *)vblk;
+
+    if (!ctx->ahead) {
+        uint8_t *keystream_end =
+            ctx->iv.sdctr.keystream + sizeof(ctx->iv.sdctr.keystream);
+        size_t len;
+
+        if (ctx->ahead_countdown > blklen) {
+            ctx->ahead_countdown -= blklen;
+            aes_sdctr_sw(ctx, blk, blklen);
+            return;
+        }
+        if (platform_parallel_jobs() < 2) {
+            /* Only costs us thread switches on a single CPU */
+            ctx->ahead_countdown = SDCTR_AHEAD_AFTER;
+            aes_sdctr_sw(ctx, blk, blklen);
+            return;
+        }
+        ctx->ahead_countdown = 0;
+
+        /* Use up the keystream we've already made, so that the ring
+         * can start from the current counter value */
+        len = keystream_end - ctx->iv.sdctr.keystream_pos;
+        if (len > blklen)
+            len = blklen;
+        aes_sdctr_sw(ctx, blk, len);
+        blk += len;
+        blklen -= len;
+        if (ctx->iv.sdctr.keystream_pos != keystream_end)
+            return;
+
+        ctx->ahead = snew(aes_sdctr_ahead);
+        ctx->ahead->cur = 0;
+        ctx->ahead->pos = 0;
+        for (unsigned i = 0; i < SDCTR_AHEAD_CHUNKS; i++)
+            aes_sdctr_chunk_start(ctx, &ctx->ahead->chunks[i]);
+    }
+
+    aes_sdctr_sw_ahead(ctx, blk, blklen);
+}
+
 #define SW_ENC_DEC(len)                                 \
     static void aes##len##_cbc_sw_encrypt(              \
         ssh_cipher *ciph, void *vblk, int blklen)       \
@@ -1261,9 +1455,12 @@ static inline void aes_sdctr_sw(
     static void aes##len##_cbc_sw_decrypt(              \
         ssh_cipher *ciph, void *vblk, int blklen)       \
     { aes_cbc_sw_decrypt(ciph, vblk, blklen); }         \
-    static void aes##len##_sdctr_sw(                    \
+    static void aes##len##_sdctr_sw_encrypt(            \
         ssh_cipher *ciph, void *vblk, int blklen)       \
-    { aes_sdctr_sw(ciph, vblk, blklen); }
+    { aes_sdctr_sw_encrypt(ciph, vblk, blklen); }       \
+    static void aes##len##_sdctr_sw_decrypt(            \
+        ssh_cipher *ciph, void *vblk, int blklen)       \
+    { aes_sdctr_sw_decrypt(ciph, vblk, blklen); }
 
 SW_ENC_DEC(128)
 SW_ENC_DEC(192)
@@ -1330,6 +1527,43 @@ NI_CIPHER(192, d, dec, REP11)
 NI_CIPHER(256, e, enc, REP13)
 NI_CIPHER(256, d, dec, REP13)
 
+/*
+ * Versions of the above which process four independent blocks at
+ * once. The AES instructions have a latency of several cycles but can
+ * be issued every cycle, so interleaving the rounds of separate
+ * blocks keeps the pipeline full in the modes that allow it (SDCTR,
+ * and CBC decryption).
+ */
+
+#define NI_CIPHER4(len, dir, dirlong, repmacro)                         \
+    static FUNC_ISA inline void aes_ni_##len##_##dir##4(                \
+        __m128i *v, const __m128i *keysched)                            \
+    {                                                                   \
+        __m128i v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3], rkey;       \
+        rkey = *keysched++;                                             \
+        v0 = _mm_xor_si128(v0, rkey);                                   \
+        v1 = _mm_xor_si128(v1, rkey);                                   \
+        v2 = _mm_xor_si128(v2, rkey);                                   \
+        v3 = _mm_xor_si128(v3, rkey);                                   \
+        repmacro(rkey = *keysched++;                                    \
+                 v0 = _mm_aes##dirlong##_si128(v0, rkey);               \
+                 v1 = _mm_aes##dirlong##_si128(v1, rkey);               \
+                 v2 = _mm_aes##dirlong##_si128(v2, rkey);               \
+                 v3 = _mm_aes##dirlong##_si128(v3, rkey););             \
+        rkey = *keysched;                                               \
+        v[0] = _mm_aes##dirlong##last_si128(v0, rkey);                  \
+        v[1] = _mm_aes##dirlong##last_si128(v1, rkey);                  \
+        v[2] = _mm_aes##dirlong##last_si128(v2, rkey);                  \
+        v[3] = _mm_aes##dirlong##last_si128(v3, rkey);                  \
+    }
+
+NI_CIPHER4(128, e, enc, REP9)
+NI_CIPHER4(128, d, dec, REP9)
+NI_CIPHER4(192, e, enc, REP11)
+NI_CIPHER4(192, d, dec, REP11)
+NI_CIPHER4(256, e, enc, REP13)
+NI_CIPHER4(256, d, dec, REP13)
+
 /*
  * The main key expansion.
  */
@@ -1498,6 +1732,7 @@ static FUNC_ISA void aes_hw_setiv_sdctr(ssh_cipher *ciph, const void *iv)
 }
 
 typedef __m128i (*aes_ni_fn)(__m128i v, const __m128i *keysched);
+typedef void (*aes_ni_fn4)(__m128i *v, const __m128i *keysched);
 
 static FUNC_ISA inline void aes_cbc_ni_encrypt(
     ssh_cipher *ciph, void *vblk, int blklen, aes_ni_fn encrypt)
@@ -1515,12 +1750,26 @@ static FUNC_ISA inline void aes_cbc_ni_encrypt(
 }
 
 static FUNC_ISA inline void aes_cbc_ni_decrypt(
-    ssh_cipher *ciph, void *vblk, int blklen, aes_ni_fn decrypt)
+    ssh_cipher *ciph, void *vblk, int blklen,
+    aes_ni_fn decrypt, aes_ni_fn4 decrypt4)
 {
     aes_ni_context *ctx = container_of(ciph, aes_ni_context, ciph);
+    uint8_t *blk = (uint8_t *)vblk, *finish = blk + blklen;
+
+    for (; finish - blk >= 64; blk += 64) {
+        __m128i ciphertext[4], v[4];
+        for (unsigned i = 0; i < 4; i++)
+            v[i] = ciphertext[i] = _mm_loadu_si128((const __m128i *)blk + i);
+        decrypt4(v, ctx->keysched_d);
+        v[0] = _mm_xor_si128(v[0], ctx->iv);
+        for (unsigned i = 1; i < 4; i++)
+            v[i] = _mm_xor_si128(v[i], ciphertext[i-1]);
+        for (unsigned i = 0; i < 4; i++)
+            _mm_storeu_si128((__m128i *)blk + i, v[i]);
+        ctx->iv = ciphertext[3];
+    }
 
-    for (uint8_t *blk = (uint8_t *)vblk, *finish = blk + blklen;
-         blk < finish; blk += 16) {
+    for (; blk < finish; blk += 16) {
         __m128i ciphertext = _mm_loadu_si128((const __m128i *)blk);
         __m128i decrypted = decrypt(ciphertext, ctx->keysched_d);
         __m128i plaintext = _mm_xor_si128(decrypted, ctx->iv);
@@ -1530,12 +1779,26 @@ static FUNC_ISA inline void aes_cbc_ni_decrypt(
 }
 
 static FUNC_ISA inline void aes_sdctr_ni(
-    ssh_cipher *ciph, void *vblk, int blklen, aes_ni_fn encrypt)
+    ssh_cipher *ciph, void *vblk, int blklen,
+    aes_ni_fn encrypt, aes_ni_fn4 encrypt4)
 {
     aes_ni_context *ctx = container_of(ciph, aes_ni_context, ciph);
+    uint8_t *blk = (uint8_t *)vblk, *finish = blk + blklen;
 
-    for (uint8_t *blk = (uint8_t *)vblk, *finish = blk + blklen;
-         blk < finish; blk += 16) {
+    for (; finish - blk >= 64; blk += 64) {
+        __m128i v[4];
+        for (unsigned i = 0; i < 4; i++) {
+            v[i] = aes_ni_sdctr_reverse(ctx->iv);
+            ctx->iv = aes_ni_sdctr_increment(ctx->iv);
+        }
+        encrypt4(v, ctx->keysched_e);
+        for (unsigned i = 0; i < 4; i++) {
+            __m128i input = _mm_loadu_si128((const __m128i *)blk + i);
+            _mm_storeu_si128((__m128i *)blk + i, _mm_xor_si128(input, v[i]));
+        }
+    }
+
+    for (; blk < finish; blk += 16) {
         __m128i counter = aes_ni_sdctr_reverse(ctx->iv);
         __m128i keystream = encrypt(counter, ctx->keysched_e);
         __m128i input = _mm_loadu_si128((const __m128i *)blk);
@@ -1551,10 +1814,16 @@ static FUNC_ISA inline void aes_sdctr_ni(
     { aes_cbc_ni_encrypt(ciph, vblk, blklen, aes_ni_##len##_e); }       \
     static FUNC_ISA void aes##len##_cbc_hw_decrypt(                     \
         ssh_cipher *ciph, void *vblk, int blklen)                       \
-    { aes_cbc_ni_decrypt(ciph, vblk, blklen, aes_ni_##len##_d); }       \
-    static FUNC_ISA void aes##len##_sdctr_hw(                           \
+    { aes_cbc_ni_decrypt(ciph, vblk, blklen,                            \
+                         aes_ni_##len##_d, aes_ni_##len##_d4); }        \
+    static FUNC_ISA void aes##len##_sdctr_hw_encrypt(                   \
         ssh_cipher *ciph, void *vblk, int blklen)                       \
-    { aes_sdctr_ni(ciph, vblk, blklen, aes_ni_##len##_e); }             \
+    { aes_sdctr_ni(ciph, vblk, blklen,                                  \
+                   aes_ni_##len##_e, aes_ni_##len##_e4); }              \
+    static FUNC_ISA void aes##len##_sdctr_hw_decrypt(                   \
+        ssh_cipher *ciph, void *vblk, int blklen)                       \
+    { aes_sdctr_ni(ciph, vblk, blklen,                                  \
+                   aes_ni_##len##_e, aes_ni_##len##_e4); }              \
 
 NI_ENC_DEC(128)
 NI_ENC_DEC(192)
@@ -1634,6 +1903,41 @@ NEON_CIPHER(128, REP9)
 NEON_CIPHER(192, REP11)
 NEON_CIPHER(256, REP13)
 
+/*
+ * Versions of the above which process four independent blocks at
+ * once, interleaving their rounds so that each one can be issued
+ * while the previous block's instruction is still in flight.
+ */
+
+#define NEON_CIPHER4_DIR(len, dir, repmacro, round, last)               \
+    static FUNC_ISA inline void aes_neon_##len##_##dir##4(              \
+        uint8x16_t *v, const uint8x16_t *keysched)                      \
+    {                                                                   \
+        uint8x16_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3], rkey;    \
+        repmacro(rkey = *keysched++;                                    \
+                 v0 = round(v0, rkey); v1 = round(v1, rkey);            \
+                 v2 = round(v2, rkey); v3 = round(v3, rkey););          \
+        rkey = *keysched++;                                             \
+        v0 = last(v0, rkey); v1 = last(v1, rkey);                       \
+        v2 = last(v2, rkey); v3 = last(v3, rkey);                       \
+        rkey = *keysched;                                               \
+        v[0] = veorq_u8(v0, rkey);                                      \
+        v[1] = veorq_u8(v1, rkey);                                      \
+        v[2] = veorq_u8(v2, rkey);                                      \
+        v[3] = veorq_u8(v3, rkey);                                      \
+    }
+
+#define NEON_ENC_ROUND(v, k) vaesmcq_u8(vaeseq_u8(v, k))
+#define NEON_DEC_ROUND(v, k) vaesimcq_u8(vaesdq_u8(v, k))
+
+#define NEON_CIPHER4(len, repmacro)                                     \
+    NEON_CIPHER4_DIR(len, e, repmacro, NEON_ENC_ROUND, vaeseq_u8)       \
+    NEON_CIPHER4_DIR(len, d, repmacro, NEON_DEC_ROUND, vaesdq_u8)
+
+NEON_CIPHER4(128, REP9)
+NEON_CIPHER4(192, REP11)
+NEON_CIPHER4(256, REP13)
+
 /*
  * The main key expansion.
  */
@@ -1809,6 +2113,7 @@ static FUNC_ISA void aes_hw_setiv_sdctr(ssh_cipher *ciph, const void *iv)
 }
 
 typedef uint8x16_t (*aes_neon_fn)(uint8x16_t v, const uint8x16_t *keysched);
+typedef void (*aes_neon_fn4)(uint8x16_t *v, const uint8x16_t *keysched);
 
 static FUNC_ISA inline void aes_cbc_neon_encrypt(
     ssh_cipher *ciph, void *vblk, int blklen, aes_neon_fn encrypt)
@@ -1826,12 +2131,26 @@ static FUNC_ISA inline void aes_cbc_neon_encrypt(
 }
 
 static FUNC_ISA inline void aes_cbc_neon_decrypt(
-    ssh_cipher *ciph, void *vblk, int blklen, aes_neon_fn decrypt)
+    ssh_cipher *ciph, void *vblk, int blklen,
+    aes_neon_fn decrypt, aes_neon_fn4 decrypt4)
 {
     aes_neon_context *ctx = container_of(ciph, aes_neon_context, ciph);
+    uint8_t *blk = (uint8_t *)vblk, *finish = blk + blklen;
+
+    for (; finish - blk >= 64; blk += 64) {
+        uint8x16_t ciphertext[4], v[4];
+        for (unsigned i = 0; i < 4; i++)
+            v[i] = ciphertext[i] = vld1q_u8(blk + 16*i);
+        decrypt4(v, ctx->keysched_d);
+        v[0] = veorq_u8(v[0], ctx->iv);
+        for (unsigned i = 1; i < 4; i++)
+            v[i] = veorq_u8(v[i], ciphertext[i-1]);
+        for (unsigned i = 0; i < 4; i++)
+            vst1q_u8(blk + 16*i, v[i]);
+        ctx->iv = ciphertext[3];
+    }
 
-    for (uint8_t *blk = (uint8_t *)vblk, *finish = blk + blklen;
-         blk < finish; blk += 16) {
+    for (; blk < finish; blk += 16) {
         uint8x16_t ciphertext = vld1q_u8(blk);
         uint8x16_t decrypted = decrypt(ciphertext, ctx->keysched_d);
         uint8x16_t plaintext = veorq_u8(decrypted, ctx->iv);
@@ -1841,12 +2160,24 @@ static FUNC_ISA inline void aes_cbc_neon_decrypt(
 }
 
 static FUNC_ISA inline void aes_sdctr_neon(
-    ssh_cipher *ciph, void *vblk, int blklen, aes_neon_fn encrypt)
+    ssh_cipher *ciph, void *vblk, int blklen,
+    aes_neon_fn encrypt, aes_neon_fn4 encrypt4)
 {
     aes_neon_context *ctx = container_of(ciph, aes_neon_context, ciph);
+    uint8_t *blk = (uint8_t *)vblk, *finish = blk + blklen;
 
-    for (uint8_t *blk = (uint8_t *)vblk, *finish = blk + blklen;
-         blk < finish; blk += 16) {
+    for (; finish - blk >= 64; blk += 64) {
+        uint8x16_t v[4];
+        for (unsigned i = 0; i < 4; i++) {
+            v[i] = aes_neon_sdctr_reverse(ctx->iv);
+            ctx->iv = aes_neon_sdctr_increment(ctx->iv);
+        }
+        encrypt4(v, ctx->keysched_e);
+        for (unsigned i = 0; i < 4; i++)
+            vst1q_u8(blk + 16*i, veorq_u8(vld1q_u8(blk + 16*i), v[i]));
+    }
+
+    for (; blk < finish; blk += 16) {
         uint8x16_t counter = aes_neon_sdctr_reverse(ctx->iv);
         uint8x16_t keystream = encrypt(counter, ctx->keysched_e);
         uint8x16_t input = vld1q_u8(blk);
@@ -1862,10 +2193,16 @@ static FUNC_ISA inline void aes_sdctr_neon(
     { aes_cbc_neon_encrypt(ciph, vblk, blklen, aes_neon_##len##_e); }   \
     static FUNC_ISA void aes##len##_cbc_hw_decrypt(                     \
         ssh_cipher *ciph, void *vblk, int blklen)                       \
-    { aes_cbc_neon_decrypt(ciph, vblk, blklen, aes_neon_##len##_d); }   \
-    static FUNC_ISA void aes##len##_sdctr_hw(                           \
+    { aes_cbc_neon_decrypt(ciph, vblk, blklen,                          \
+                           aes_neon_##len##_d, aes_neon_##len##_d4); }  \
+    static FUNC_ISA void aes##len##_sdctr_hw_encrypt(                   \
+        ssh_cipher *ciph, void *vblk, int blklen)                       \
+    { aes_sdctr_neon(ciph, vblk, blklen,                                \
+                     aes_neon_##len##_e, aes_neon_##len##_e4); }        \
+    static FUNC_ISA void aes##len##_sdctr_hw_decrypt(                   \
         ssh_cipher *ciph, void *vblk, int blklen)                       \
-    { aes_sdctr_neon(ciph, vblk, blklen, aes_neon_##len##_e); }         \
+    { aes_sdctr_neon(ciph, vblk, blklen,                                \
+                     aes_neon_##len##_e, aes_neon_##len##_e4); }        \
 
 NEON_ENC_DEC(128)
 NEON_ENC_DEC(192)
@@ -1902,7 +2239,9 @@ static void aes_hw_setiv_sdctr(ssh_cipher *ciph, const void *iv) STUB_BODY
         ssh_cipher *ciph, void *vblk, int blklen) STUB_BODY     \
     static void aes##len##_cbc_hw_decrypt(                      \
         ssh_cipher *ciph, void *vblk, int blklen) STUB_BODY     \
-    static void aes##len##_sdctr_hw(                            \
+    static void aes##len##_sdctr_hw_encrypt(                    \
+        ssh_cipher *ciph, void *vblk, int blklen) STUB_BODY     \
+    static void aes##len##_sdctr_hw_decrypt(                    \
         ssh_cipher *ciph, void *vblk, int blklen) STUB_BODY
 
 STUB_ENC_DEC(128)
@@ -0,0 +1,852 @@
+/*
+ * AES-GCM for SSH-2, as specified by OpenSSH (RFC 5647 with the
+ * amendments in OpenSSH's PROTOCOL file): aes128-gcm@openssh.com and
+ * aes256-gcm@openssh.com.
+ *
+ * Like ChaCha20-Poly1305 in sshccp.c, this is presented to the BPP as
+ * a cipher with a required MAC that shares its context. The packet
+ * length field is sent in clear but authenticated, which is exactly
+ * the shape of OpenSSH's encrypt-then-MAC mode, so the BPP needs no
+ * special handling beyond telling us when each packet is finished.
+ *
+ * The counter-mode half of GCM is done by the existing AES-SDCTR
+ * implementations in sshaes.c (including their hardware-accelerated
+ * versions). GCM only increments the low 32 bits of its counter
+ * block, but each packet starts its counter again at 1 and no SSH
+ * packet is anywhere near 2^32 blocks long, so a 128-bit increment
+ * gives exactly the same keystream.
+ */
+
+#include "ssh.h"
+
+/*
+ * Start by deciding whether we can support hardware GHASH at all.
+ */
+#define HW_GHASH_NONE 0
+#define HW_GHASH_CLMUL 1
+#define HW_GHASH_NEON 2
+
+#ifdef _FORCE_GHASH_CLMUL
+#   define HW_GHASH HW_GHASH_CLMUL
+#elif defined(__clang__)
+#   if __has_attribute(target) && __has_include(<wmmintrin.h>) &&       \
+    __has_include(<tmmintrin.h>) && (defined(__x86_64__) || defined(__i386))
+#       define HW_GHASH HW_GHASH_CLMUL
+#   endif
+#elif defined(__GNUC__)
+#    if (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 4)) && \
+    (defined(__x86_64__) || defined(__i386))
+#       define HW_GHASH HW_GHASH_CLMUL
+#    endif
+#elif defined (_MSC_VER)
+#   if (defined(_M_X64) || defined(_M_IX86)) && _MSC_FULL_VER >= 150030729
+#      define HW_GHASH HW_GHASH_CLMUL
+#   endif
+#endif
+
+#ifdef _FORCE_GHASH_NEON
+#   define HW_GHASH HW_GHASH_NEON
+#elif defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    /* As in sshaes.c, the NEON code assumes little-endian. */
+#elif defined __ARM_FEATURE_CRYPTO
+#   define HW_GHASH HW_GHASH_NEON
+#elif defined(__clang__)
+#   if __has_attribute(target) && __has_include(<arm_neon.h>) &&       \
+    (defined(__aarch64__))
+#       define HW_GHASH HW_GHASH_NEON
+#       define USE_CLANG_ATTR_TARGET_AARCH64
+#   endif
+#elif defined _MSC_VER
+#   if defined _M_ARM64
+#       define HW_GHASH HW_GHASH_NEON
+#       define USE_ARM64_NEON_H
+#   endif
+#endif
+
+#if defined _FORCE_SOFTWARE_GHASH || !defined HW_GHASH
+#   undef HW_GHASH
+#   define HW_GHASH HW_GHASH_NONE
+#endif
+
+#if HW_GHASH == HW_GHASH_CLMUL
+#define HW_NAME_SUFFIX " (PCLMUL accelerated)"
+#elif HW_GHASH == HW_GHASH_NEON
+#define HW_NAME_SUFFIX " (NEON accelerated)"
+#else
+#define HW_NAME_SUFFIX " (!NONEXISTENT ACCELERATED VERSION!)"
+#endif
+
+/* ----------------------------------------------------------------------
+ * Representation of GF(2^128).
+ *
+ * GHASH takes the bits of each 16-byte block in an awkward order: the
+ * top bit of the first byte is the coefficient of x^0. If we reverse
+ * the bits within every byte, then loading the block as a
+ * little-endian 128-bit integer gives an ordinary polynomial, with
+ * bit i holding the coefficient of x^i, reduced modulo
+ * x^128 + x^7 + x^2 + x + 1.
+ *
+ * All the implementations below work in that representation, stored
+ * as two 64-bit words with the low one first, so the key powers and
+ * the running hash can live in the common context whichever one is
+ * in use.
+ */
+
+typedef struct gf128 {
+    uint64_t w[2];
+} gf128;
+
+static inline uint64_t ghash_bitrev8(uint64_t x)
+{
+    x = ((x & 0x5555555555555555) << 1) | ((x >> 1) & 0x5555555555555555);
+    x = ((x & 0x3333333333333333) << 2) | ((x >> 2) & 0x3333333333333333);
+    x = ((x & 0x0F0F0F0F0F0F0F0F) << 4) | ((x >> 4) & 0x0F0F0F0F0F0F0F0F);
+    return x;
+}
+
+static inline uint64_t ghash_bitrev64(uint64_t x)
+{
+    x = ghash_bitrev8(x);
+    x = ((x & 0x00FF00FF00FF00FF) << 8) | ((x >> 8) & 0x00FF00FF00FF00FF);
+    x = ((x & 0x0000FFFF0000FFFF) << 16) | ((x >> 16) & 0x0000FFFF0000FFFF);
+    return (x << 32) | (x >> 32);
+}
+
+static inline void gf128_load(gf128 *r, const void *vblk)
+{
+    const unsigned char *blk = (const unsigned char *)vblk;
+    r->w[0] = ghash_bitrev8(GET_64BIT_LSB_FIRST(blk));
+    r->w[1] = ghash_bitrev8(GET_64BIT_LSB_FIRST(blk + 8));
+}
+
+static inline void gf128_store(void *vblk, const gf128 *a)
+{
+    unsigned char *blk = (unsigned char *)vblk;
+    PUT_64BIT_LSB_FIRST(blk, ghash_bitrev8(a->w[0]));
+    PUT_64BIT_LSB_FIRST(blk + 8, ghash_bitrev8(a->w[1]));
+}
+
+/*
+ * Low 64 bits of the carryless product of two 64-bit words, using
+ * ordinary integer multiplication in constant time. Splitting each
+ * input into four interleaved sets of bits leaves three-bit gaps
+ * between the bits that matter, wide enough to absorb the carries
+ * (for the bit positions that survive in the low 64 bits).
+ */
+static inline uint64_t ghash_bmul64(uint64_t x, uint64_t y)
+{
+    const uint64_t m0 = 0x1111111111111111, m1 = 0x2222222222222222;
+    const uint64_t m2 = 0x4444444444444444, m3 = 0x8888888888888888;
+    uint64_t x0 = x & m0, x1 = x & m1, x2 = x & m2, x3 = x & m3;
+    uint64_t y0 = y & m0, y1 = y & m1, y2 = y & m2, y3 = y & m3;
+    uint64_t z0 = (x0 * y0) ^ (x1 * y3) ^ (x2 * y2) ^ (x3 * y1);
+    uint64_t z1 = (x0 * y1) ^ (x1 * y0) ^ (x2 * y3) ^ (x3 * y2);
+    uint64_t z2 = (x0 * y2) ^ (x1 * y1) ^ (x2 * y0) ^ (x3 * y3);
+    uint64_t z3 = (x0 * y3) ^ (x1 * y2) ^ (x2 * y1) ^ (x3 * y0);
+    return (z0 & m0) | (z1 & m1) | (z2 & m2) | (z3 & m3);
+}
+
+/*
+ * Full 128-bit carryless product of two 64-bit words. The high half
+ * comes from multiplying the bit-reversed inputs, whose low half is
+ * the reversal of bits 63 to 126 of the product we want.
+ */
+static inline void ghash_clmul64(uint64_t x, uint64_t y,
+                                 uint64_t *lo, uint64_t *hi)
+{
+    *lo = ghash_bmul64(x, y);
+    *hi = ghash_bitrev64(ghash_bmul64(ghash_bitrev64(x),
+                                      ghash_bitrev64(y))) >> 1;
+}
+
+/*
+ * Multiply a 64-bit word by x^128 mod the GHASH polynomial, i.e. by
+ * x^7 + x^2 + x + 1, giving a result of up to 71 bits.
+ */
+static inline void ghash_mul_poly(uint64_t x, uint64_t *lo, uint64_t *hi)
+{
+    *lo = x ^ (x << 1) ^ (x << 2) ^ (x << 7);
+    *hi = (x >> 63) ^ (x >> 62) ^ (x >> 57);
+}
+
+/*
+ * Reduce a 256-bit product d3:d2:d1:d0 modulo the GHASH polynomial,
+ * by folding the top word and then the next one down into the words
+ * 128 bits below them.
+ */
+static inline void ghash_reduce(gf128 *r, uint64_t d0, uint64_t d1,
+                                uint64_t d2, uint64_t d3)
+{
+    uint64_t lo, hi;
+    ghash_mul_poly(d3, &lo, &hi);
+    d1 ^= lo;
+    d2 ^= hi;
+    ghash_mul_poly(d2, &lo, &hi);
+    r->w[0] = d0 ^ lo;
+    r->w[1] = d1 ^ hi;
+}
+
+static void gf128_mul(gf128 *r, const gf128 *a, const gf128 *b)
+{
+    uint64_t lo0, lo1, hi0, hi1, mid0, mid1;
+
+    /* Karatsuba: three 64x64 products instead of four */
+    ghash_clmul64(a->w[0], b->w[0], &lo0, &lo1);
+    ghash_clmul64(a->w[1], b->w[1], &hi0, &hi1);
+    ghash_clmul64(a->w[0] ^ a->w[1], b->w[0] ^ b->w[1], &mid0, &mid1);
+    mid0 ^= lo0 ^ hi0;
+    mid1 ^= lo1 ^ hi1;
+
+    ghash_reduce(r, lo0, lo1 ^ mid0, hi0 ^ mid1, hi1);
+}
+
+/* ----------------------------------------------------------------------
+ * The common context, shared between the cipher and MAC halves.
+ */
+
+#define GHASH_POWERS 4
+
+typedef struct aesgcm_context aesgcm_context;
+
+/*
+ * Absorb a run of whole 16-byte blocks into the running hash.
+ */
+typedef void (*ghash_blocks_fn)(aesgcm_context *ctx,
+                                const unsigned char *data, size_t nblocks);
+
+struct aesgcm_extra {
+    const ssh_cipheralg *ctr;          /* the AES-SDCTR implementation */
+    ghash_blocks_fn ghash;
+    bool (*available)(void);
+    const char *mac_text_name;
+};
+
+struct aesgcm_context {
+    const struct aesgcm_extra *extra;
+    ssh_cipher *ctr;
+
+    /* 4 bytes fixed, then the 64-bit invocation counter, big-endian */
+    unsigned char iv[12];
+    /* AES of the initial counter block, to be XORed into the tag */
+    unsigned char mask[16];
+
+    gf128 hpow[GHASH_POWERS];          /* H, H^2, H^3, H^4 */
+    gf128 acc;
+
+    /*
+     * The MAC is fed the 4-byte sequence number (which GCM has no use
+     * for), then the 4-byte length field as additional authenticated
+     * data, then the ciphertext. 'pos' counts bytes fed in so far;
+     * 'partial' holds anything short of a whole block.
+     */
+    uint64_t pos;
+    unsigned char partial[16];
+    size_t partial_len;
+
+    BinarySink_IMPLEMENTATION;
+    ssh_cipher ciph;
+    ssh2_mac mac_if;
+};
+
+#define GCM_SEQ_LEN 4
+#define GCM_AAD_LEN 4
+
+static void ghash_sw(aesgcm_context *ctx, const unsigned char *data,
+                     size_t nblocks)
+{
+    for (; nblocks > 0; nblocks--, data += 16) {
+        gf128 x;
+        gf128_load(&x, data);
+        ctx->acc.w[0] ^= x.w[0];
+        ctx->acc.w[1] ^= x.w[1];
+        gf128_mul(&ctx->acc, &ctx->acc, &ctx->hpow[0]);
+    }
+}
+
+static bool ghash_sw_available(void)
+{
+    return true;
+}
+
+/* ----------------------------------------------------------------------
+ * Hardware-accelerated GHASH using x86 carryless multiplication.
+ */
+
+#if HW_GHASH == HW_GHASH_CLMUL
+
+#if !defined(__clang__) && defined(__GNUC__)
+#    pragma GCC target("pclmul")
+#    pragma GCC target("ssse3")
+#endif
+
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)))
+#    define FUNC_ISA __attribute__ ((target("ssse3,pclmul")))
+#else
+#    define FUNC_ISA
+#endif
+
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#include <cpuid.h>
+#define GET_CPU_ID(out) __cpuid(1, (out)[0], (out)[1], (out)[2], (out)[3])
+#else
+#define GET_CPU_ID(out) __cpuid(out, 1)
+#endif
+
+static bool ghash_hw_available(void)
+{
+    /*
+     * Check for both PCLMULQDQ and SSSE3 (for PSHUFB).
+     */
+    unsigned int CPUInfo[4];
+    GET_CPU_ID(CPUInfo);
+    return (CPUInfo[2] & (1 << 1)) && (CPUInfo[2] & (1 << 9));
+}
+
+/*
+ * Load a block of data and reverse the bits of each byte, using
+ * PSHUFB as a lookup table on each nibble.
+ */
+static FUNC_ISA inline __m128i ghash_clmul_load(const unsigned char *p)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i revtab = _mm_setr_epi8(
+        0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE,
+        0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF);
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i lo = _mm_and_si128(v, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    return _mm_or_si128(_mm_slli_epi16(_mm_shuffle_epi8(revtab, lo), 4),
+                        _mm_shuffle_epi8(revtab, hi));
+}
+
+/*
+ * Accumulate the unreduced product of a and b into lo, mid and hi.
+ * mid holds the cross terms, which belong 64 bits up.
+ */
+static FUNC_ISA inline void ghash_clmul_acc(
+    __m128i a, __m128i b, __m128i *lo, __m128i *mid, __m128i *hi)
+{
+    *lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+    *hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+    *mid = _mm_xor_si128(*mid, _mm_clmulepi64_si128(a, b, 0x01));
+    *mid = _mm_xor_si128(*mid, _mm_clmulepi64_si128(a, b, 0x10));
+}
+
+/*
+ * The same reduction as ghash_reduce() above.
+ */
+static FUNC_ISA inline __m128i ghash_clmul_reduce(
+    __m128i lo, __m128i mid, __m128i hi)
+{
+    const __m128i poly = _mm_setr_epi32(0x87, 0, 0, 0);
+    __m128i r;
+
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    r = _mm_clmulepi64_si128(hi, poly, 0x01);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(r, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(r, 8));
+
+    r = _mm_clmulepi64_si128(hi, poly, 0x00);
+    return _mm_xor_si128(lo, r);
+}
+
+static FUNC_ISA void ghash_hw(aesgcm_context *ctx, const unsigned char *data,
+                              size_t nblocks)
+{
+    const __m128i h1 = _mm_loadu_si128((const __m128i *)ctx->hpow[0].w);
+    const __m128i h2 = _mm_loadu_si128((const __m128i *)ctx->hpow[1].w);
+    const __m128i h3 = _mm_loadu_si128((const __m128i *)ctx->hpow[2].w);
+    const __m128i h4 = _mm_loadu_si128((const __m128i *)ctx->hpow[3].w);
+    __m128i acc = _mm_loadu_si128((const __m128i *)ctx->acc.w);
+
+    /*
+     * Four blocks at a time, multiplying each by the power of H it
+     * would have accumulated by the end of the group, so that the
+     * multiplications are independent and only one reduction is
+     * needed.
+     */
+    for (; nblocks >= 4; nblocks -= 4, data += 64) {
+        __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+        __m128i x0 = _mm_xor_si128(acc, ghash_clmul_load(data));
+        ghash_clmul_acc(x0, h4, &lo, &mid, &hi);
+        ghash_clmul_acc(ghash_clmul_load(data + 16), h3, &lo, &mid, &hi);
+        ghash_clmul_acc(ghash_clmul_load(data + 32), h2, &lo, &mid, &hi);
+        ghash_clmul_acc(ghash_clmul_load(data + 48), h1, &lo, &mid, &hi);
+        acc = ghash_clmul_reduce(lo, mid, hi);
+    }
+
+    for (; nblocks > 0; nblocks--, data += 16) {
+        __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+        __m128i x = _mm_xor_si128(acc, ghash_clmul_load(data));
+        ghash_clmul_acc(x, h1, &lo, &mid, &hi);
+        acc = ghash_clmul_reduce(lo, mid, hi);
+    }
+
+    _mm_storeu_si128((__m128i *)ctx->acc.w, acc);
+}
+
+/* ----------------------------------------------------------------------
+ * Hardware-accelerated GHASH using the Arm PMULL instruction.
+ */
+
+#elif HW_GHASH == HW_GHASH_NEON
+
+#ifdef USE_CLANG_ATTR_TARGET_AARCH64
+/* As in sshaes.c, set up the feature macros arm_neon.h looks at. */
+#define __ARM_NEON 1
+#define __ARM_FEATURE_CRYPTO 1
+#define FUNC_ISA __attribute__ ((target("neon,crypto")))
+#endif /* USE_CLANG_ATTR_TARGET_AARCH64 */
+
+#ifndef FUNC_ISA
+#define FUNC_ISA
+#endif
+
+#ifdef USE_ARM64_NEON_H
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+
+static bool ghash_hw_available(void)
+{
+    /*
+     * As with AES, we have to ask the OS whether the PMULL
+     * instruction is available.
+     */
+    return platform_pmull_hw_available();
+}
+
+static FUNC_ISA inline uint64x2_t ghash_neon_load(const unsigned char *p)
+{
+    return vreinterpretq_u64_u8(vrbitq_u8(vld1q_u8(p)));
+}
+
+static FUNC_ISA inline uint64x2_t ghash_neon_pmull(uint64_t a, uint64_t b)
+{
+    return vreinterpretq_u64_p128(vmull_p64((poly64_t)a, (poly64_t)b));
+}
+
+static FUNC_ISA inline void ghash_neon_acc(
+    uint64x2_t a, uint64x2_t b,
+    uint64x2_t *lo, uint64x2_t *mid, uint64x2_t *hi)
+{
+    uint64_t a0 = vgetq_lane_u64(a, 0), a1 = vgetq_lane_u64(a, 1);
+    uint64_t b0 = vgetq_lane_u64(b, 0), b1 = vgetq_lane_u64(b, 1);
+    *lo = veorq_u64(*lo, ghash_neon_pmull(a0, b0));
+    *hi = veorq_u64(*hi, ghash_neon_pmull(a1, b1));
+    *mid = veorq_u64(*mid, ghash_neon_pmull(a0, b1));
+    *mid = veorq_u64(*mid, ghash_neon_pmull(a1, b0));
+}
+
+static FUNC_ISA inline uint64x2_t ghash_neon_reduce(
+    uint64x2_t lo, uint64x2_t mid, uint64x2_t hi)
+{
+    const uint64x2_t zero = vdupq_n_u64(0);
+    uint64x2_t r;
+
+    lo = veorq_u64(lo, vextq_u64(zero, mid, 1));
+    hi = veorq_u64(hi, vextq_u64(mid, zero, 1));
+
+    r = ghash_neon_pmull(vgetq_lane_u64(hi, 1), 0x87);
+    lo = veorq_u64(lo, vextq_u64(zero, r, 1));
+    hi = veorq_u64(hi, vextq_u64(r, zero, 1));
+
+    r = ghash_neon_pmull(vgetq_lane_u64(hi, 0), 0x87);
+    return veorq_u64(lo, r);
+}
+
+static FUNC_ISA void ghash_hw(aesgcm_context *ctx, const unsigned char *data,
+                              size_t nblocks)
+{
+    const uint64x2_t h1 = vld1q_u64(ctx->hpow[0].w);
+    const uint64x2_t h2 = vld1q_u64(ctx->hpow[1].w);
+    const uint64x2_t h3 = vld1q_u64(ctx->hpow[2].w);
+    const uint64x2_t h4 = vld1q_u64(ctx->hpow[3].w);
+    uint64x2_t acc = vld1q_u64(ctx->acc.w);
+
+    /* Four blocks at a time, as in the x86 version */
+    for (; nblocks >= 4; nblocks -= 4, data += 64) {
+        uint64x2_t lo = vdupq_n_u64(0), mid = lo, hi = lo;
+        uint64x2_t x0 = veorq_u64(acc, ghash_neon_load(data));
+        ghash_neon_acc(x0, h4, &lo, &mid, &hi);
+        ghash_neon_acc(ghash_neon_load(data + 16), h3, &lo, &mid, &hi);
+        ghash_neon_acc(ghash_neon_load(data + 32), h2, &lo, &mid, &hi);
+        ghash_neon_acc(ghash_neon_load(data + 48), h1, &lo, &mid, &hi);
+        acc = ghash_neon_reduce(lo, mid, hi);
+    }
+
+    for (; nblocks > 0; nblocks--, data += 16) {
+        uint64x2_t lo = vdupq_n_u64(0), mid = lo, hi = lo;
+        uint64x2_t x = veorq_u64(acc, ghash_neon_load(data));
+        ghash_neon_acc(x, h1, &lo, &mid, &hi);
+        acc = ghash_neon_reduce(lo, mid, hi);
+    }
+
+    vst1q_u64(ctx->acc.w, acc);
+}
+
+/* ----------------------------------------------------------------------
+ * Stub functions if we have no hardware-accelerated GHASH. The hw
+ * vtables are then never successfully instantiated.
+ */
+
+#else
+
+static bool ghash_hw_available(void)
+{
+    return false;
+}
+
+static void ghash_hw(aesgcm_context *ctx, const unsigned char *data,
+                     size_t nblocks)
+{
+    unreachable("GHASH hardware stub should never be called");
+}
+
+#endif
+
+/* ----------------------------------------------------------------------
+ * The MAC half.
+ */
+
+static ssh2_mac *aesgcm_mac_new(const ssh2_macalg *alg, ssh_cipher *cipher)
+{
+    aesgcm_context *ctx = container_of(cipher, aesgcm_context, ciph);
+    ctx->mac_if.vt = alg;
+    BinarySink_DELEGATE_INIT(&ctx->mac_if, ctx);
+    return &ctx->mac_if;
+}
+
+static void aesgcm_mac_free(ssh2_mac *mac)
+{
+    /* Not allocated, just forwarded, no need to free */
+}
+
+static void aesgcm_mac_setkey(ssh2_mac *mac, ptrlen key)
+{
+    /* The hash key is derived from the cipher key, so ignore */
+}
+
+static void aesgcm_mac_start(ssh2_mac *mac)
+{
+    aesgcm_context *ctx = container_of(mac, aesgcm_context, mac_if);
+    ctx->acc.w[0] = ctx->acc.w[1] = 0;
+    ctx->pos = 0;
+    ctx->partial_len = 0;
+}
+
+/* Hash whatever is in the partial block, padded with zeroes */
+static void aesgcm_flush_partial(aesgcm_context *ctx)
+{
+    if (ctx->partial_len) {
+        memset(ctx->partial + ctx->partial_len, 0,
+               16 - ctx->partial_len);
+        ctx->extra->ghash(ctx, ctx->partial, 1);
+        ctx->partial_len = 0;
+    }
+}
+
+static void aesgcm_mac_BinarySink_write(
+    BinarySink *bs, const void *blkv, size_t len)
+{
+    aesgcm_context *ctx = BinarySink_DOWNCAST(bs, aesgcm_context);
+    const unsigned char *blk = (const unsigned char *)blkv;
+
+    /* Skip the sequence number */
+    while (ctx->pos < GCM_SEQ_LEN && len) {
+        ctx->pos++;
+        blk++;
+        len--;
+    }
+
+    /* Collect the additional data into a block of its own */
+    while (ctx->pos < GCM_SEQ_LEN + GCM_AAD_LEN && len) {
+        ctx->partial[ctx->partial_len++] = *blk++;
+        ctx->pos++;
+        len--;
+        if (ctx->pos == GCM_SEQ_LEN + GCM_AAD_LEN)
+            aesgcm_flush_partial(ctx);
+    }
+
+    /* Then the ciphertext, taking whole blocks straight from the input */
+    ctx->pos += len;
+    if (ctx->partial_len) {
+        size_t n = 16 - ctx->partial_len;
+        if (n > len)
+            n = len;
+        memcpy(ctx->partial + ctx->partial_len, blk, n);
+        ctx->partial_len += n;
+        blk += n;
+        len -= n;
+        if (ctx->partial_len == 16) {
+            ctx->extra->ghash(ctx, ctx->partial, 1);
+            ctx->partial_len = 0;
+        }
+    }
+    if (len >= 16) {
+        size_t nblocks = len / 16;
+        ctx->extra->ghash(ctx, blk, nblocks);
+        blk += 16 * nblocks;
+        len -= 16 * nblocks;
+    }
+    if (len) {
+        memcpy(ctx->partial, blk, len);
+        ctx->partial_len = len;
+    }
+}
+
+static void aesgcm_mac_genresult(ssh2_mac *mac, unsigned char *output)
+{
+    aesgcm_context *ctx = container_of(mac, aesgcm_context, mac_if);
+    uint64_t aadlen, ctlen;
+    unsigned char lengths[16];
+    gf128 tag;
+
+    if (ctx->pos <= GCM_SEQ_LEN) {
+        aadlen = ctlen = 0;
+    } else if (ctx->pos <= GCM_SEQ_LEN + GCM_AAD_LEN) {
+        aadlen = ctx->pos - GCM_SEQ_LEN;
+        ctlen = 0;
+    } else {
+        aadlen = GCM_AAD_LEN;
+        ctlen = ctx->pos - GCM_SEQ_LEN - GCM_AAD_LEN;
+    }
+
+    aesgcm_flush_partial(ctx);
+    PUT_64BIT_MSB_FIRST(lengths, aadlen * 8);
+    PUT_64BIT_MSB_FIRST(lengths + 8, ctlen * 8);
+    ctx->extra->ghash(ctx, lengths, 1);
+
+    tag = ctx->acc;
+    gf128_store(output, &tag);
+    for (size_t i = 0; i < 16; i++)
+        output[i] ^= ctx->mask[i];
+
+    smemclr(&tag, sizeof(tag));
+}
+
+static const char *aesgcm_mac_text_name(ssh2_mac *mac)
+{
+    aesgcm_context *ctx = container_of(mac, aesgcm_context, mac_if);
+    return ctx->extra->mac_text_name;
+}
+
+const ssh2_macalg ssh2_aesgcm_mac = {
+    .new = aesgcm_mac_new,
+    .free = aesgcm_mac_free,
+    .setkey = aesgcm_mac_setkey,
+    .start = aesgcm_mac_start,
+    .genresult = aesgcm_mac_genresult,
+    .text_name = aesgcm_mac_text_name,
+    .name = "",
+    .etm_name = "", /* Not selectable individually, just part of
+                     * AES-GCM */
+    .len = 16,
+    .keylen = 0,
+};
+
+/* ----------------------------------------------------------------------
+ * The cipher half.
+ */
+
+/*
+ * Set the counter up for the start of a packet: compute the tag mask
+ * from the first counter block, leaving the SDCTR cipher ready to
+ * encrypt the data from the second.
+ */
+static void aesgcm_start_packet(aesgcm_context *ctx)
+{
+    unsigned char block[16];
+    memcpy(block, ctx->iv, 12);
+    PUT_32BIT_MSB_FIRST(block + 12, 1);
+    ssh_cipher_setiv(ctx->ctr, block);
+    memset(ctx->mask, 0, 16);
+    ssh_cipher_encrypt(ctx->ctr, ctx->mask, 16);
+    smemclr(block, sizeof(block));
+}
+
+static bool aesgcm_hw_available_cached(void)
+{
+    static bool initialised = false;
+    static bool hw_available;
+    if (!initialised) {
+        hw_available = ghash_hw_available();
+        initialised = true;
+    }
+    return hw_available;
+}
+
+static ssh_cipher *aesgcm_new(const ssh_cipheralg *alg)
+{
+    const struct aesgcm_extra *extra = (const struct aesgcm_extra *)alg->extra;
+
+    if (!extra->available())
+        return NULL;
+
+    ssh_cipher *ctr = ssh_cipher_new(extra->ctr);
+    if (!ctr)
+        return NULL;
+
+    aesgcm_context *ctx = snew(aesgcm_context);
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->extra = extra;
+    ctx->ctr = ctr;
+    BinarySink_INIT(ctx, aesgcm_mac_BinarySink_write);
+    ctx->ciph.vt = alg;
+    return &ctx->ciph;
+}
+
+static void aesgcm_free(ssh_cipher *cipher)
+{
+    aesgcm_context *ctx = container_of(cipher, aesgcm_context, ciph);
+    ssh_cipher_free(ctx->ctr);
+    smemclr(ctx, sizeof(*ctx));
+    sfree(ctx);
+}
+
+static void aesgcm_setkey(ssh_cipher *cipher, const void *key)
+{
+    aesgcm_context *ctx = container_of(cipher, aesgcm_context, ciph);
+    unsigned char block[16];
+
+    ssh_cipher_setkey(ctx->ctr, key);
+
+    /* The hash key H is the encryption of the zero block */
+    memset(block, 0, 16);
+    ssh_cipher_setiv(ctx->ctr, block);
+    ssh_cipher_encrypt(ctx->ctr, block, 16);
+    gf128_load(&ctx->hpow[0], block);
+    for (size_t i = 1; i < GHASH_POWERS; i++)
+        gf128_mul(&ctx->hpow[i], &ctx->hpow[i-1], &ctx->hpow[0]);
+    smemclr(block, sizeof(block));
+
+    aesgcm_start_packet(ctx);
+}
+
+static void aesgcm_setiv(ssh_cipher *cipher, const void *iv)
+{
+    aesgcm_context *ctx = container_of(cipher, aesgcm_context, ciph);
+    /* The SSH key derivation gives us a whole cipher block of IV, of
+     * which GCM uses the first 12 bytes */
+    memcpy(ctx->iv, iv, 12);
+    aesgcm_start_packet(ctx);
+}
+
+static void aesgcm_crypt(ssh_cipher *cipher, void *blk, int len)
+{
+    aesgcm_context *ctx = container_of(cipher, aesgcm_context, ciph);
+    /* Counter mode: encryption and decryption are the same */
+    ssh_cipher_encrypt(ctx->ctr, blk, len);
+}
+
+static void aesgcm_next_message(ssh_cipher *cipher)
+{
+    aesgcm_context *ctx = container_of(cipher, aesgcm_context, ciph);
+    /* Increment the 64-bit invocation counter, wrapping round */
+    PUT_64BIT_MSB_FIRST(ctx->iv + 4, GET_64BIT_MSB_FIRST(ctx->iv + 4) + 1);
+    aesgcm_start_packet(ctx);
+}
+
+/*
+ * Vtables, in the same arrangement as sshaes.c: for each key length,
+ * one using software AES and GHASH, one using hardware AES and GHASH,
+ * and a selector which is never instantiated itself but decides
+ * which of the other two to return.
+ */
+
+struct aesgcm_select_extra {
+    const ssh_cipheralg *sw, *hw;
+};
+
+static ssh_cipher *aesgcm_select(const ssh_cipheralg *alg)
+{
+    const struct aesgcm_select_extra *extra =
+        (const struct aesgcm_select_extra *)alg->extra;
+
+    /* The hardware version fails to instantiate if either hardware
+     * AES or hardware GHASH is missing */
+    ssh_cipher *c = ssh_cipher_new(extra->hw);
+    if (!c)
+        c = ssh_cipher_new(extra->sw);
+    return c;
+}
+
+#define AESGCM_VTABLES(bits)                                            \
+    static const struct aesgcm_extra extra_aes##bits##_gcm_sw = {       \
+        .ctr = &ssh_aes##bits##_sdctr_sw,                               \
+        .ghash = ghash_sw,                                              \
+        .available = ghash_sw_available,                                \
+        .mac_text_name = "GHASH (unaccelerated)",                       \
+    };                                                                  \
+    const ssh_cipheralg ssh_aes##bits##_gcm_sw = {                      \
+        .new = aesgcm_new,                                              \
+        .free = aesgcm_free,                                            \
+        .setiv = aesgcm_setiv,                                          \
+        .setkey = aesgcm_setkey,                                        \
+        .encrypt = aesgcm_crypt,                                        \
+        .decrypt = aesgcm_crypt,                                        \
+        .next_message = aesgcm_next_message,                            \
+        .ssh2_id = "aes" #bits "-gcm@openssh.com",                      \
+        .blksize = 16,                                                  \
+        .real_keybits = bits,                                           \
+        .padded_keybytes = bits/8,                                      \
+        .flags = 0,                                                     \
+        .text_name = "AES-" #bits " GCM (unaccelerated)",               \
+        .required_mac = &ssh2_aesgcm_mac,                               \
+        .extra = &extra_aes##bits##_gcm_sw,                             \
+    };                                                                  \
+                                                                        \
+    static const struct aesgcm_extra extra_aes##bits##_gcm_hw = {       \
+        .ctr = &ssh_aes##bits##_sdctr_hw,                               \
+        .ghash = ghash_hw,                                              \
+        .available = aesgcm_hw_available_cached,                        \
+        .mac_text_name = "GHASH" HW_NAME_SUFFIX,                        \
+    };                                                                  \
+    const ssh_cipheralg ssh_aes##bits##_gcm_hw = {                      \
+        .new = aesgcm_new,                                              \
+        .free = aesgcm_free,                                            \
+        .setiv = aesgcm_setiv,                                          \
+        .setkey = aesgcm_setkey,                                        \
+        .encrypt = aesgcm_crypt,                                        \
+        .decrypt = aesgcm_crypt,                                        \
+        .next_message = aesgcm_next_message,                            \
+        .ssh2_id = "aes" #bits "-gcm@openssh.com",                      \
+        .blksize = 16,                                                  \
+        .real_keybits = bits,                                           \
+        .padded_keybytes = bits/8,                                      \
+        .flags = 0,                                                     \
+        .text_name = "AES-" #bits " GCM (hardware accelerated)",        \
+        .required_mac = &ssh2_aesgcm_mac,                               \
+        .extra = &extra_aes##bits##_gcm_hw,                             \
+    };                                                                  \
+                                                                        \
+    static const struct aesgcm_select_extra extra_aes##bits##_gcm = {   \
+        &ssh_aes##bits##_gcm_sw, &ssh_aes##bits##_gcm_hw };             \
+                                                                        \
+    const ssh_cipheralg ssh_aes##bits##_gcm = {                         \
+        .new = aesgcm_select,                                           \
+        .ssh2_id = "aes" #bits "-gcm@openssh.com",                      \
+        .blksize = 16,                                                  \
+        .real_keybits = bits,                                           \
+        .padded_keybytes = bits/8,                                      \
+        .flags = 0,                                                     \
+        .text_name = "AES-" #bits " GCM (dummy selector vtable)",       \
+        .required_mac = &ssh2_aesgcm_mac,                               \
+        .extra = &extra_aes##bits##_gcm,                                \
+    };
+
+AESGCM_VTABLES(128)
+AESGCM_VTABLES(256)
+
+static const ssh_cipheralg *const aesgcm_list[] = {
+    &ssh_aes256_gcm,
+    &ssh_aes128_gcm,
+};
+
+const ssh2_ciphers ssh2_aesgcm = { lenof(aesgcm_list), aesgcm_list };
@@ -11,73 +11,141 @@
 #include "ssh.h"
 #include "sshblowf.h"
 
-BlowfishContext *bcrypt_setup(const unsigned char *key, int keybytes,
-                              const unsigned char *salt, int saltbytes)
+/*
+ * openssh_bcrypt below needs several independent chains of bcrypt
+ * computations, one per 32-byte block of output. So everything here
+ * works on either one chain or two at once, using the interleaved
+ * Blowfish key schedule for the latter.
+ */
+
+static void bcrypt_setup(BlowfishContext *ctx[2], int n,
+                         const unsigned char *key, int keybytes,
+                         const unsigned char *const salt[2], int saltbytes)
 {
+    const void *const keys[2] = { key, key };
     int i;
-    BlowfishContext *ctx;
 
-    ctx = blowfish_make_context();
-    blowfish_initkey(ctx);
-    blowfish_expandkey(ctx, key, keybytes, salt, saltbytes);
+    for (i = 0; i < n; i++) {
+        ctx[i] = blowfish_make_context();
+        blowfish_initkey(ctx[i]);
+    }
+
+    if (n == 2)
+        blowfish_expandkey_x2(ctx, keys, keybytes,
+                              (const void *const *)salt, saltbytes);
+    else
+        blowfish_expandkey(ctx[0], key, keybytes, salt[0], saltbytes);
 
     /* Original bcrypt replaces this fixed loop count with the
      * variable cost. OpenSSH instead iterates the whole thing more
      * than once if it wants extra rounds. */
     for (i = 0; i < 64; i++) {
-        blowfish_expandkey(ctx, salt, saltbytes, NULL, 0);
-        blowfish_expandkey(ctx, key, keybytes, NULL, 0);
+        if (n == 2) {
+            const void *const nulls[2] = { NULL, NULL };
+            blowfish_expandkey_x2(ctx, (const void *const *)salt,
+                                  saltbytes, nulls, 0);
+            blowfish_expandkey_x2(ctx, keys, keybytes, nulls, 0);
+        } else {
+            blowfish_expandkey(ctx[0], salt[0], saltbytes, NULL, 0);
+            blowfish_expandkey(ctx[0], key, keybytes, NULL, 0);
+        }
     }
-
-    return ctx;
 }
 
-void bcrypt_hash(const unsigned char *key, int keybytes,
-                 const unsigned char *salt, int saltbytes,
-                 unsigned char output[32])
+static void bcrypt_hash(int n, const unsigned char *key, int keybytes,
+                        const unsigned char *const salt[2], int saltbytes,
+                        unsigned char output[2][32])
 {
-    BlowfishContext *ctx;
-    int i;
-
-    ctx = bcrypt_setup(key, keybytes, salt, saltbytes);
-    /* This was quite a nice starting string until it ran into
-     * little-endian Blowfish :-/ */
-    memcpy(output, "cyxOmorhcitawolBhsiftawSanyDetim", 32);
-    for (i = 0; i < 64; i++) {
-        blowfish_lsb_encrypt_ecb(output, 32, ctx);
+    BlowfishContext *ctx[2];
+    int i, j;
+
+    bcrypt_setup(ctx, n, key, keybytes, salt, saltbytes);
+    for (j = 0; j < n; j++) {
+        /* This was quite a nice starting string until it ran into
+         * little-endian Blowfish :-/ */
+        memcpy(output[j], "cyxOmorhcitawolBhsiftawSanyDetim", 32);
+        for (i = 0; i < 64; i++) {
+            blowfish_lsb_encrypt_ecb(output[j], 32, ctx[j]);
+        }
+        blowfish_free_context(ctx[j]);
     }
-    blowfish_free_context(ctx);
 }
 
-void bcrypt_genblock(int counter,
-                     const unsigned char hashed_passphrase[64],
-                     const unsigned char *salt, int saltbytes,
-                     unsigned char output[32])
+static void bcrypt_genblock(int n, const int counter[2],
+                            const unsigned char hashed_passphrase[64],
+                            const unsigned char *const salt[2], int saltbytes,
+                            unsigned char output[2][32])
 {
-    unsigned char hashed_salt[64];
+    unsigned char hashed_salt[2][64];
+    const unsigned char *const hashed_salt_ptrs[2] = {
+        hashed_salt[0], hashed_salt[1] };
 
     /* Hash the input salt with the counter value optionally suffixed
      * to get our real 32-byte salt */
-    ssh_hash *h = ssh_hash_new(&ssh_sha512);
-    put_data(h, salt, saltbytes);
-    if (counter)
-        put_uint32(h, counter);
-    ssh_hash_final(h, hashed_salt);
+    for (int j = 0; j < n; j++) {
+        ssh_hash *h = ssh_hash_new(&ssh_sha512);
+        put_data(h, salt[j], saltbytes);
+        if (counter[j])
+            put_uint32(h, counter[j]);
+        ssh_hash_final(h, hashed_salt[j]);
+    }
 
-    bcrypt_hash(hashed_passphrase, 64, hashed_salt, 64, output);
+    bcrypt_hash(n, hashed_passphrase, 64, hashed_salt_ptrs, 64, output);
 
     smemclr(&hashed_salt, sizeof(hashed_salt));
 }
 
+typedef struct bcrypt_job {
+    const unsigned char *hashed_passphrase;
+    const unsigned char *salt;
+    int saltbytes, rounds;
+
+    int n, residue[2];
+    unsigned char outblock[2][32];
+} bcrypt_job;
+
+static void bcrypt_run_job(void *vjob)
+{
+    bcrypt_job *job = (bcrypt_job *)vjob;
+    unsigned char block[2][32];
+    const unsigned char *thissalt[2];
+    int thissaltbytes, counter[2];
+    int i, j, round;
+
+    /* Our output block of data is the XOR of all blocks generated
+     * by bcrypt in the following loop */
+    memset(job->outblock, 0, sizeof(job->outblock));
+
+    for (j = 0; j < job->n; j++)
+        thissalt[j] = job->salt;
+    thissaltbytes = job->saltbytes;
+    for (round = 0; round < job->rounds; round++) {
+        for (j = 0; j < job->n; j++)
+            counter[j] = (round == 0 ? job->residue[j] + 1 : 0);
+        bcrypt_genblock(job->n, counter, job->hashed_passphrase,
+                        thissalt, thissaltbytes, block);
+        /* Each subsequent bcrypt call reuses the previous one's
+         * output as its salt */
+        for (j = 0; j < job->n; j++)
+            thissalt[j] = block[j];
+        thissaltbytes = 32;
+
+        for (j = 0; j < job->n; j++)
+            for (i = 0; i < 32; i++)
+                job->outblock[j][i] ^= block[j][i];
+    }
+
+    smemclr(block, sizeof(block));
+}
+
 void openssh_bcrypt(const char *passphrase,
                     const unsigned char *salt, int saltbytes,
                     int rounds, unsigned char *out, int outbytes)
 {
     unsigned char hashed_passphrase[64];
-    unsigned char block[32], outblock[32];
-    const unsigned char *thissalt;
-    int thissaltbytes;
-    int modulus, residue, i, j, round;
+    int modulus, residue, i, j, k, njobs, per_job;
+    bcrypt_job *jobs;
+    void **ctxs;
 
     /* Hash the passphrase to get the bcrypt key material */
     hash_simple(&ssh_sha512, ptrlen_from_asciz(passphrase), hashed_passphrase);
@@ -92,28 +160,36 @@ void openssh_bcrypt(const char *passphrase,
      * most 32 bytes are used in the pass. */
     modulus = (outbytes + 31) / 32;
 
-    for (residue = 0; residue < modulus; residue++) {
-        /* Our output block of data is the XOR of all blocks generated
-         * by bcrypt in the following loop */
-        memset(outblock, 0, sizeof(outblock));
-
-        thissalt = salt;
-        thissaltbytes = saltbytes;
-        for (round = 0; round < rounds; round++) {
-            bcrypt_genblock(round == 0 ? residue+1 : 0,
-                            hashed_passphrase,
-                            thissalt, thissaltbytes, block);
-            /* Each subsequent bcrypt call reuses the previous one's
-             * output as its salt */
-            thissalt = block;
-            thissaltbytes = 32;
+    /* Each residue's chain of bcrypt calls is independent of the
+     * others. Give them a thread each if there are enough CPUs;
+     * otherwise pair them up, so that each thread runs two at once
+     * using the interleaved key schedule. */
+    per_job = ((unsigned)modulus <= platform_parallel_jobs() ? 1 : 2);
+    njobs = (modulus + per_job - 1) / per_job;
+    jobs = snewn(njobs, bcrypt_job);
+    ctxs = snewn(njobs, void *);
+
+    for (i = 0, residue = 0; i < njobs; i++) {
+        jobs[i].hashed_passphrase = hashed_passphrase;
+        jobs[i].salt = salt;
+        jobs[i].saltbytes = saltbytes;
+        jobs[i].rounds = rounds;
+        for (jobs[i].n = 0; jobs[i].n < per_job && residue < modulus;
+             jobs[i].n++)
+            jobs[i].residue[jobs[i].n] = residue++;
+        ctxs[i] = &jobs[i];
+    }
 
-            for (i = 0; i < 32; i++)
-                outblock[i] ^= block[i];
-        }
+    platform_run_parallel(bcrypt_run_job, ctxs, njobs);
 
-        for (i = residue, j = 0; i < outbytes; i += modulus, j++)
-            out[i] = outblock[j];
-    }
+    for (k = 0; k < njobs; k++)
+        for (j = 0; j < jobs[k].n; j++)
+            for (residue = jobs[k].residue[j], i = residue;
+                 i < outbytes; i += modulus)
+                out[i] = jobs[k].outblock[j][(i - residue) / modulus];
+
+    smemclr(jobs, njobs * sizeof(*jobs));
+    sfree(jobs);
+    sfree(ctxs);
     smemclr(&hashed_passphrase, sizeof(hashed_passphrase));
 }
@@ -471,77 +471,159 @@ void blowfish_initkey(BlowfishContext *ctx)
     }
 }
 
+/*
+ * The key schedule XORs the key cyclically into the P-array, and
+ * then repeatedly encrypts a running block (XORed with successive
+ * 8-byte chunks of the cyclically repeated salt, if any) to
+ * generate the new P-array and S-boxes in order. These helpers
+ * fetch the key and salt bytes without dividing by the key or salt
+ * length each time, which used to cost more than the encryption.
+ */
+static inline uint32_t blowfish_next_word(
+    const unsigned char *data, int len, int *pos)
+{
+    uint32_t word = 0;
+    for (int j = 0; j < 4; j++) {
+        word = (word << 8) | data[*pos];
+        if (++*pos == len)
+            *pos = 0;
+    }
+    return word;
+}
+
+static inline void blowfish_xor_key(BlowfishContext *ctx,
+                                    const unsigned char *key, int keybytes)
+{
+    int keypos = 0;
+    for (int i = 0; i < 18; i++)
+        ctx->P[i] ^= blowfish_next_word(key, keybytes, &keypos);
+}
+
+static inline void blowfish_xor_salt(uint32_t *str, const unsigned char *salt,
+                                     int saltbytes, int *saltpos)
+{
+    if (salt) {
+        str[0] ^= blowfish_next_word(salt, saltbytes, saltpos);
+        str[1] ^= blowfish_next_word(salt, saltbytes, saltpos);
+    }
+}
+
+/* The P-array followed by the S-boxes, in the order the key schedule
+ * overwrites them */
+#define BLOWFISH_SCHEDULE_TABLES(ctx) {                         \
+        { (ctx)->P, 18 }, { (ctx)->S0, 256 }, { (ctx)->S1, 256 },   \
+        { (ctx)->S2, 256 }, { (ctx)->S3, 256 } }
+
+struct blowfish_schedule_table {
+    uint32_t *words;
+    int nwords;
+};
+
 void blowfish_expandkey(BlowfishContext * ctx,
                         const void *vkey, short keybytes,
                         const void *vsalt, short saltbytes)
 {
     const unsigned char *key = (const unsigned char *)vkey;
     const unsigned char *salt = (const unsigned char *)vsalt;
-    uint32_t *S0 = ctx->S0;
-    uint32_t *S1 = ctx->S1;
-    uint32_t *S2 = ctx->S2;
-    uint32_t *S3 = ctx->S3;
-    uint32_t *P = ctx->P;
+    struct blowfish_schedule_table tables[] = BLOWFISH_SCHEDULE_TABLES(ctx);
     uint32_t str[2];
-    int i, j;
-    int saltpos;
-    unsigned char dummysalt[1];
-
-    saltpos = 0;
-    if (!salt) {
-        saltbytes = 1;
-        salt = dummysalt;
-        dummysalt[0] = 0;
-    }
+    int saltpos = 0;
 
-    for (i = 0; i < 18; i++) {
-        P[i] ^=
-            ((uint32_t) (unsigned char) (key[(i * 4 + 0) % keybytes])) << 24;
-        P[i] ^=
-            ((uint32_t) (unsigned char) (key[(i * 4 + 1) % keybytes])) << 16;
-        P[i] ^=
-            ((uint32_t) (unsigned char) (key[(i * 4 + 2) % keybytes])) << 8;
-        P[i] ^= ((uint32_t) (unsigned char) (key[(i * 4 + 3) % keybytes]));
-    }
+    blowfish_xor_key(ctx, key, keybytes);
 
     str[0] = str[1] = 0;
 
-    for (i = 0; i < 18; i += 2) {
-        for (j = 0; j < 8; j++)
-            str[j/4] ^= ((uint32_t)salt[saltpos++ % saltbytes]) << (24-8*(j%4));
-
-        blowfish_encrypt(str[0], str[1], str, ctx);
-        P[i] = str[0];
-        P[i + 1] = str[1];
+    for (size_t t = 0; t < lenof(tables); t++) {
+        uint32_t *words = tables[t].words;
+        for (int i = 0; i < tables[t].nwords; i += 2) {
+            blowfish_xor_salt(str, salt, saltbytes, &saltpos);
+            blowfish_encrypt(str[0], str[1], str, ctx);
+            words[i] = str[0];
+            words[i + 1] = str[1];
+        }
     }
+}
 
-    for (i = 0; i < 256; i += 2) {
-        for (j = 0; j < 8; j++)
-            str[j/4] ^= ((uint32_t)salt[saltpos++ % saltbytes]) << (24-8*(j%4));
-        blowfish_encrypt(str[0], str[1], str, ctx);
-        S0[i] = str[0];
-        S0[i + 1] = str[1];
-    }
-    for (i = 0; i < 256; i += 2) {
-        for (j = 0; j < 8; j++)
-            str[j/4] ^= ((uint32_t)salt[saltpos++ % saltbytes]) << (24-8*(j%4));
-        blowfish_encrypt(str[0], str[1], str, ctx);
-        S1[i] = str[0];
-        S1[i + 1] = str[1];
-    }
-    for (i = 0; i < 256; i += 2) {
-        for (j = 0; j < 8; j++)
-            str[j/4] ^= ((uint32_t)salt[saltpos++ % saltbytes]) << (24-8*(j%4));
-        blowfish_encrypt(str[0], str[1], str, ctx);
-        S2[i] = str[0];
-        S2[i + 1] = str[1];
-    }
-    for (i = 0; i < 256; i += 2) {
-        for (j = 0; j < 8; j++)
-            str[j/4] ^= ((uint32_t)salt[saltpos++ % saltbytes]) << (24-8*(j%4));
-        blowfish_encrypt(str[0], str[1], str, ctx);
-        S3[i] = str[0];
-        S3[i + 1] = str[1];
+/*
+ * Two Blowfish encryptions under different keys, with their rounds
+ * interleaved. Each encryption on its own is one long chain of
+ * dependent table lookups, so a single thread can run two of them in
+ * not much more time than it takes to run one.
+ */
+static inline void blowfish_encrypt_x2(
+    uint32_t *str0, BlowfishContext *ctx0,
+    uint32_t *str1, BlowfishContext *ctx1)
+{
+    uint32_t *S0 = ctx0->S0, *S1 = ctx0->S1, *S2 = ctx0->S2, *S3 = ctx0->S3;
+    uint32_t *T0 = ctx1->S0, *T1 = ctx1->S1, *T2 = ctx1->S2, *T3 = ctx1->S3;
+    uint32_t *P = ctx0->P, *Q = ctx1->P;
+    uint32_t xL = str0[0], xR = str0[1], yL = str1[0], yR = str1[1];
+    uint32_t t, u;
+
+#define Gprime(a,b,c,d) ( ( (T0[a] + T1[b]) ^ T2[c] ) + T3[d] )
+#define G(x) Gprime( ((x>>24)&0xFF), ((x>>16)&0xFF), ((x>>8)&0xFF), (x&0xFF) )
+#define ROUND_X2(n) ( ROUND(n), yL ^= Q[n], u = yL, yL = G(yL) ^ yR, yR = u )
+
+    ROUND_X2(0);
+    ROUND_X2(1);
+    ROUND_X2(2);
+    ROUND_X2(3);
+    ROUND_X2(4);
+    ROUND_X2(5);
+    ROUND_X2(6);
+    ROUND_X2(7);
+    ROUND_X2(8);
+    ROUND_X2(9);
+    ROUND_X2(10);
+    ROUND_X2(11);
+    ROUND_X2(12);
+    ROUND_X2(13);
+    ROUND_X2(14);
+    ROUND_X2(15);
+
+#undef ROUND_X2
+#undef G
+#undef Gprime
+
+    str0[0] = xR ^ P[17];
+    str0[1] = xL ^ P[16];
+    str1[0] = yR ^ Q[17];
+    str1[1] = yL ^ Q[16];
+}
+
+void blowfish_expandkey_x2(BlowfishContext *ctx[2],
+                           const void *const vkey[2], short keybytes,
+                           const void *const vsalt[2], short saltbytes)
+{
+    const unsigned char *key0 = (const unsigned char *)vkey[0];
+    const unsigned char *key1 = (const unsigned char *)vkey[1];
+    const unsigned char *salt0 = (const unsigned char *)vsalt[0];
+    const unsigned char *salt1 = (const unsigned char *)vsalt[1];
+    struct blowfish_schedule_table tables0[] =
+        BLOWFISH_SCHEDULE_TABLES(ctx[0]);
+    struct blowfish_schedule_table tables1[] =
+        BLOWFISH_SCHEDULE_TABLES(ctx[1]);
+    uint32_t str0[2], str1[2];
+    int saltpos0 = 0, saltpos1 = 0;
+
+    assert(!salt0 == !salt1);
+
+    blowfish_xor_key(ctx[0], key0, keybytes);
+    blowfish_xor_key(ctx[1], key1, keybytes);
+
+    str0[0] = str0[1] = str1[0] = str1[1] = 0;
+
+    for (size_t t = 0; t < lenof(tables0); t++) {
+        uint32_t *words0 = tables0[t].words, *words1 = tables1[t].words;
+        for (int i = 0; i < tables0[t].nwords; i += 2) {
+            blowfish_xor_salt(str0, salt0, saltbytes, &saltpos0);
+            blowfish_xor_salt(str1, salt1, saltbytes, &saltpos1);
+            blowfish_encrypt_x2(str0, ctx[0], str1, ctx[1]);
+            words0[i] = str0[0];
+            words0[i + 1] = str0[1];
+            words1[i] = str1[0];
+            words1[i + 1] = str1[1];
+        }
     }
 }
 
@@ -11,4 +11,10 @@ void blowfish_initkey(BlowfishContext *ctx);
 void blowfish_expandkey(BlowfishContext *ctx,
                         const void *key, short keybytes,
                         const void *salt, short saltbytes);
+/* Run the key schedule on two contexts at once, which is faster than
+ * doing them one after the other. The two salts must be both
+ * present or both NULL. */
+void blowfish_expandkey_x2(BlowfishContext *ctx[2],
+                           const void *const key[2], short keybytes,
+                           const void *const salt[2], short saltbytes);
 void blowfish_lsb_encrypt_ecb(void *blk, int len, BlowfishContext *ctx);
@@ -7,6 +7,24 @@
 
 typedef struct BinaryPacketProtocolVtable BinaryPacketProtocolVtable;
 
+/*
+ * Running totals kept by every BPP, for ssh_counters_summary. 'bytes'
+ * is what went over the wire, including lengths, padding and MACs.
+ * Where compression is in use, 'uncompressed' and 'compressed' are
+ * the payload sizes of the packets that went through it, on either
+ * side of the compressor. 'crypto_ns' is time spent encrypting,
+ * decrypting and MACing; 'newkeys' counts the key sets installed.
+ */
+struct BppCountersDirection {
+    uint64_t packets, bytes;
+    uint64_t uncompressed, compressed;
+    uint64_t crypto_ns;
+    unsigned newkeys;
+};
+struct BppCounters {
+    struct BppCountersDirection in, out;
+};
+
 struct BinaryPacketProtocolVtable {
     void (*free)(BinaryPacketProtocol *);
     void (*handle_input)(BinaryPacketProtocol *);
@@ -38,6 +56,12 @@ struct BinaryPacketProtocol {
 
     int remote_bugs;
 
+    /* Speed/ratio trade-off for outgoing compression, passed to
+     * ssh_compressor_new. Zero means the default. */
+    int compression_level;
+
+    struct BppCounters counters;
+
     /* Set this if remote connection closure should not generate an
      * error message (either because it's not to be treated as an
      * error at all, or because some other error message has already
@@ -98,6 +122,7 @@ bool ssh2_bpp_check_unimplemented(BinaryPacketProtocol *bpp, PktIn *pktin);
 struct DataTransferStatsDirection {
     bool running, expired;
     unsigned long remaining;
+    unsigned long consumed;    /* running total, wrapping, never reset */
 };
 struct DataTransferStats {
     struct DataTransferStatsDirection in, out;
@@ -105,6 +130,7 @@ struct DataTransferStats {
 static inline void dts_consume(struct DataTransferStatsDirection *s,
                                unsigned long size_consumed)
 {
+    s->consumed += size_consumed;
     if (s->running) {
         if (s->remaining <= size_consumed) {
             s->running = false;
@@ -131,6 +157,11 @@ static inline void dts_reset(struct DataTransferStatsDirection *s,
 
 BinaryPacketProtocol *ssh2_bpp_new(
     LogContext *logctx, struct DataTransferStats *stats, bool is_server);
+
+/* Start of a file written by an ssh2bpp built with -DBPP_RECORD, and
+ * replayed by bppbench */
+#define BPP_RECORD_MAGIC "PuTTY SSH-2 BPP recording 1\n"
+
 void ssh2_bpp_new_outgoing_crypto(
     BinaryPacketProtocol *bpp,
     const ssh_cipheralg *cipher, const void *ckey, const void *iv,
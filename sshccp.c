@@ -36,6 +36,60 @@
 #define INLINE
 #endif
 
+/*
+ * Decide whether we can compile SIMD versions of the bulk routines.
+ * Unlike AES, these need no special instructions, only vector
+ * registers: SSE2 (and AVX2 where the CPU has it) on x86, or NEON on
+ * Arm.
+ */
+#define HW_CCP_NONE 0
+#define HW_CCP_X86 1
+#define HW_CCP_NEON 2
+
+#ifdef _FORCE_CCP_X86
+#   define HW_CCP HW_CCP_X86
+#elif defined(__clang__)
+#   if __has_attribute(target) && __has_include(<immintrin.h>) &&       \
+    (defined(__x86_64__) || defined(__i386))
+#       define HW_CCP HW_CCP_X86
+#   endif
+#elif defined(__GNUC__)
+#    if (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386))
+#       define HW_CCP HW_CCP_X86
+#    endif
+#elif defined (_MSC_VER)
+#   if (defined(_M_X64) || defined(_M_IX86)) && _MSC_VER >= 1800
+#      define HW_CCP HW_CCP_X86
+#   endif
+#endif
+
+#ifdef _FORCE_CCP_NEON
+#   define HW_CCP HW_CCP_NEON
+#elif defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    /* As in sshaes.c, the NEON code assumes little-endian. */
+#elif defined __ARM_NEON
+#   define HW_CCP HW_CCP_NEON
+#elif defined _MSC_VER
+#   if defined _M_ARM64
+#       define HW_CCP HW_CCP_NEON
+#       define USE_ARM64_NEON_H
+#   endif
+#endif
+
+#if defined _FORCE_SOFTWARE_CCP || !defined HW_CCP
+#   undef HW_CCP
+#   define HW_CCP HW_CCP_NONE
+#endif
+
+#if HW_CCP == HW_CCP_X86
+#define HW_NAME_SUFFIX " (SSE2 accelerated)"
+#elif HW_CCP == HW_CCP_NEON
+#define HW_NAME_SUFFIX " (NEON accelerated)"
+#else
+#define HW_NAME_SUFFIX " (!NONEXISTENT ACCELERATED VERSION!)"
+#endif
+
 /* ChaCha20 implementation, only supporting 256-bit keys */
 
 /* State for each ChaCha20 instance */
@@ -52,6 +106,14 @@ struct chacha20 {
     int currentIndex;
 };
 
+/*
+ * XOR the keystream for nblocks whole 64-byte blocks into data,
+ * starting at the block counter in the state, and advance the counter
+ * past them. This is the part the SIMD implementations replace.
+ */
+typedef void (*chacha20_blocks_fn)(struct chacha20 *ctx, unsigned char *data,
+                                   size_t nblocks);
+
 static INLINE void chacha20_round(struct chacha20 *ctx)
 {
     int i;
@@ -155,16 +217,61 @@ static void chacha20_iv(struct chacha20 *ctx, const unsigned char *iv)
     ctx->currentIndex = 64;
 }
 
-static void chacha20_encrypt(struct chacha20 *ctx, unsigned char *blk, int len)
+static void chacha20_blocks_sw(struct chacha20 *ctx, unsigned char *data,
+                               size_t nblocks)
 {
-    while (len) {
-        /* If we don't have any state left, then cycle to the next */
-        if (ctx->currentIndex >= 64) {
-            chacha20_round(ctx);
-        }
+    for (; nblocks > 0; nblocks--, data += 64) {
+        chacha20_round(ctx);
+        for (int i = 0; i < 64; i++)
+            data[i] ^= ctx->current[i];
+    }
+    ctx->currentIndex = 64;
+}
+
+#if HW_CCP != HW_CCP_NONE
+/*
+ * Work out the 64-bit block counters for n consecutive blocks, for
+ * the SIMD implementations to load into their lanes.
+ */
+static inline void chacha20_counters(const struct chacha20 *ctx, size_t n,
+                                     uint32_t *lo, uint32_t *hi)
+{
+    for (size_t i = 0; i < n; i++) {
+        lo[i] = ctx->state[12] + (uint32_t)i;
+        hi[i] = ctx->state[13] + (lo[i] < ctx->state[12]);
+    }
+}
+
+static inline void chacha20_advance(struct chacha20 *ctx, size_t n)
+{
+    uint32_t old = ctx->state[12];
+    ctx->state[12] += (uint32_t)n;
+    if (ctx->state[12] < old)
+        ctx->state[13]++;
+}
+#endif
+
+static void chacha20_encrypt(struct chacha20 *ctx, chacha20_blocks_fn blocks,
+                             unsigned char *blk, int len)
+{
+    /* Use up any keystream left over from last time */
+    while (ctx->currentIndex < 64 && len) {
+        *blk++ ^= ctx->current[ctx->currentIndex++];
+        --len;
+    }
 
-        /* Do the xor while there's some state left and some plaintext left */
-        while (ctx->currentIndex < 64 && len) {
+    /* Whole blocks go straight through the bulk routine */
+    if (len >= 64) {
+        size_t nblocks = len / 64;
+        blocks(ctx, blk, nblocks);
+        blk += 64 * nblocks;
+        len -= 64 * nblocks;
+    }
+
+    /* And keep the rest of the last block's keystream for next time */
+    if (len) {
+        chacha20_round(ctx);
+        while (len) {
             *blk++ ^= ctx->current[ctx->currentIndex++];
             --len;
         }
@@ -173,9 +280,10 @@ static void chacha20_encrypt(struct chacha20 *ctx, unsigned char *blk, int len)
 
 /* Decrypt is encrypt... It's xor against a PRNG... */
 static INLINE void chacha20_decrypt(struct chacha20 *ctx,
+                                    chacha20_blocks_fn blocks,
                                     unsigned char *blk, int len)
 {
-    chacha20_encrypt(ctx, blk, len);
+    chacha20_encrypt(ctx, blocks, blk, len);
 }
 
 /* Poly1305 implementation (no AES, nonce is not encrypted) */
@@ -765,6 +873,13 @@ struct poly1305 {
     int bufferIndex;
 };
 
+/*
+ * Absorb nblocks whole 16-byte blocks of message into h. This is the
+ * part the SIMD implementations replace.
+ */
+typedef void (*poly1305_blocks_fn)(struct poly1305 *ctx,
+                                   const unsigned char *data, size_t nblocks);
+
 static void poly1305_init(struct poly1305 *ctx)
 {
     memset(ctx->nonce, 0, 16);
@@ -808,7 +923,14 @@ static void poly1305_feed_chunk(struct poly1305 *ctx,
     bigval_mul_mod_p(&ctx->h, &c, &ctx->r);
 }
 
-static void poly1305_feed(struct poly1305 *ctx,
+static void poly1305_blocks_sw(struct poly1305 *ctx,
+                               const unsigned char *data, size_t nblocks)
+{
+    for (; nblocks > 0; nblocks--, data += 16)
+        poly1305_feed_chunk(ctx, data, 16);
+}
+
+static void poly1305_feed(struct poly1305 *ctx, poly1305_blocks_fn blocks,
                           const unsigned char *buf, int len)
 {
     /* Check for stuff left in the buffer from last time */
@@ -825,10 +947,11 @@ static void poly1305_feed(struct poly1305 *ctx,
     }
 
     /* Process 16 byte whole chunks */
-    while (len >= 16) {
-        poly1305_feed_chunk(ctx, buf, 16);
-        len -= 16;
-        buf += 16;
+    if (len >= 16) {
+        size_t nblocks = len / 16;
+        blocks(ctx, buf, nblocks);
+        len -= 16 * nblocks;
+        buf += 16 * nblocks;
     }
 
     /* Cache stuff that's left over */
@@ -853,9 +976,767 @@ static void poly1305_finalise(struct poly1305 *ctx, unsigned char *mac)
     bigval_export_le(&tmp, mac, 16);
 }
 
+#if HW_CCP != HW_CCP_NONE
+/*
+ * The SIMD versions of Poly1305 work in radix 2^26, which leaves
+ * room in each 64-bit vector lane for a 26x26-bit product plus the
+ * factor of 5 from folding 2^130 back round to the bottom, and a sum
+ * of five such terms.
+ *
+ * Rather than multiplying every block by r one after another, they
+ * run several independent accumulators, each absorbing every Nth
+ * block and multiplying by r^N in between. At the end the lanes are
+ * multiplied by r^N, r^(N-1), ..., r respectively and added up,
+ * which gives the same polynomial evaluation as the serial method.
+ *
+ * The running total and key stay in the bigval representation
+ * between calls, so the scalar code can pick up where these leave
+ * off. A value up to 133 bits (the most bigval_mul_mod_p can leave
+ * us) fits in 17 bytes.
+ */
+#define POLY26_MASK 0x3ffffff
+
+/* Carry a set of wide limbs so that all of them fit in 26 bits,
+ * except possibly a carry of 1 into the top one */
+static inline void poly26_carry(uint32_t out[5], uint64_t d[5])
+{
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < 4; i++) {
+            d[i+1] += d[i] >> 26;
+            d[i] &= POLY26_MASK;
+        }
+        d[0] += 5 * (d[4] >> 26);
+        d[4] &= POLY26_MASK;
+    }
+    for (int i = 0; i < 4; i++) {
+        d[i+1] += d[i] >> 26;
+        d[i] &= POLY26_MASK;
+    }
+    for (int i = 0; i < 5; i++)
+        out[i] = d[i];
+}
+
+static void poly26_from_bigval(uint32_t out[5], const bigval *v)
+{
+    unsigned char buf[17];
+    uint64_t d[5], lo, hi;
+
+    bigval_export_le(v, buf, 17);
+    lo = GET_64BIT_LSB_FIRST(buf);
+    hi = GET_64BIT_LSB_FIRST(buf + 8);
+    d[0] = lo & POLY26_MASK;
+    d[1] = (lo >> 26) & POLY26_MASK;
+    d[2] = ((lo >> 52) | (hi << 12)) & POLY26_MASK;
+    d[3] = (hi >> 14) & POLY26_MASK;
+    d[4] = (hi >> 40) | ((uint64_t)buf[16] << 24);
+    poly26_carry(out, d);
+    smemclr(buf, sizeof(buf));
+    smemclr(d, sizeof(d));
+}
+
+/* Input limbs as left by poly26_carry: the low four are exact, so
+ * the shifted fields can't overlap */
+static void poly26_to_bigval(bigval *v, const uint32_t in[5])
+{
+    unsigned char buf[17];
+    uint64_t lo, hi;
+
+    lo = in[0] | ((uint64_t)in[1] << 26) | ((uint64_t)in[2] << 52);
+    hi = (in[2] >> 12) | ((uint64_t)in[3] << 14) | ((uint64_t)in[4] << 40);
+    PUT_64BIT_LSB_FIRST(buf, lo);
+    PUT_64BIT_LSB_FIRST(buf + 8, hi);
+    buf[16] = in[4] >> 24;
+    bigval_import_le(v, buf, 17);
+    smemclr(buf, sizeof(buf));
+}
+
+/* Scalar multiplication mod p, used to make the powers of r */
+static void poly26_mul(uint32_t out[5], const uint32_t a[5],
+                       const uint32_t b[5])
+{
+    uint64_t d[5];
+    for (int i = 0; i < 5; i++) {
+        d[i] = 0;
+        for (int j = 0; j < 5; j++) {
+            /* Terms that land at 2^130 or above wrap round times 5 */
+            uint64_t bj = (j <= i ? b[i-j] : 5 * (uint64_t)b[5+i-j]);
+            d[i] += a[j] * bj;
+        }
+    }
+    poly26_carry(out, d);
+    smemclr(d, sizeof(d));
+}
+
+/*
+ * Compute r, r^2, ..., r^n into pow[0..n-1]. Also returns h, so that
+ * the caller has everything in radix 2^26.
+ */
+static void poly26_setup(const struct poly1305 *ctx, uint32_t (*pow)[5],
+                         int n, uint32_t h[5])
+{
+    poly26_from_bigval(pow[0], &ctx->r);
+    for (int i = 1; i < n; i++)
+        poly26_mul(pow[i], pow[i-1], pow[0]);
+    poly26_from_bigval(h, &ctx->h);
+}
+
+/* Don't bother setting up the vector code for only a few blocks */
+#define POLY1305_SIMD_MIN_BLOCKS 16
+#endif
+
+/* ----------------------------------------------------------------------
+ * Pieces shared between the SIMD implementations.
+ */
+
+#if HW_CCP != HW_CCP_NONE
+
+/*
+ * All the SIMD ChaCha20 implementations keep word i of the state for
+ * each of several blocks in the lanes of vector x[i], so that the
+ * quarter rounds are done on all the blocks at once. At the end, the
+ * output has to be transposed back into block order before XORing
+ * it into the data.
+ */
+#define CCP_QUARTER(x, a, b, c, d, add, xor, rot16, rot12, rot8, rot7)  \
+    do {                                                                \
+        x[a] = add(x[a], x[b]); x[d] = rot16(xor(x[d], x[a]));          \
+        x[c] = add(x[c], x[d]); x[b] = rot12(xor(x[b], x[c]));          \
+        x[a] = add(x[a], x[b]); x[d] = rot8(xor(x[d], x[a]));           \
+        x[c] = add(x[c], x[d]); x[b] = rot7(xor(x[b], x[c]));           \
+    } while (0)
+
+#define CCP_DOUBLE_ROUND(x, add, xor, r16, r12, r8, r7) do {            \
+        CCP_QUARTER(x, 0, 4,  8, 12, add, xor, r16, r12, r8, r7);       \
+        CCP_QUARTER(x, 1, 5,  9, 13, add, xor, r16, r12, r8, r7);       \
+        CCP_QUARTER(x, 2, 6, 10, 14, add, xor, r16, r12, r8, r7);       \
+        CCP_QUARTER(x, 3, 7, 11, 15, add, xor, r16, r12, r8, r7);       \
+        CCP_QUARTER(x, 0, 5, 10, 15, add, xor, r16, r12, r8, r7);       \
+        CCP_QUARTER(x, 1, 6, 11, 12, add, xor, r16, r12, r8, r7);       \
+        CCP_QUARTER(x, 2, 7,  8, 13, add, xor, r16, r12, r8, r7);       \
+        CCP_QUARTER(x, 3, 4,  9, 14, add, xor, r16, r12, r8, r7);       \
+    } while (0)
+
+#endif
+
+/* ----------------------------------------------------------------------
+ * SIMD implementations for x86: SSE2, which every x86-64 CPU has, and
+ * AVX2 where the CPU and OS support it.
+ */
+
+#if HW_CCP == HW_CCP_X86
+
+#if defined(__clang__) || defined(__GNUC__)
+#    define FUNC_ISA_SSE2 __attribute__ ((target("sse2")))
+#    define FUNC_ISA_AVX2 __attribute__ ((target("avx2")))
+#else
+#    define FUNC_ISA_SSE2
+#    define FUNC_ISA_AVX2
+#endif
+
+#include <immintrin.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#include <cpuid.h>
+#define GET_CPU_ID(leaf, out) \
+    __cpuid_count(leaf, 0, (out)[0], (out)[1], (out)[2], (out)[3])
+static inline uint64_t get_xcr0(void)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    return ((uint64_t)hi << 32) | lo;
+}
+#else
+#include <intrin.h>
+#define GET_CPU_ID(leaf, out) __cpuidex(out, leaf, 0)
+#define get_xcr0() _xgetbv(0)
+#endif
+
+static bool ccp_hw_available(void)
+{
+    unsigned int CPUInfo[4];
+    GET_CPU_ID(1, CPUInfo);
+    return CPUInfo[3] & (1 << 26);     /* SSE2 */
+}
+
+static bool ccp_avx2_available(void)
+{
+    unsigned int CPUInfo[4];
+
+    GET_CPU_ID(0, CPUInfo);
+    if (CPUInfo[0] < 7)
+        return false;
+
+    /*
+     * As well as the CPU having AVX and AVX2, the OS must have
+     * enabled the ymm registers (and be saving them on context
+     * switches), which we find out from XCR0 once we know the CPU
+     * has XGETBV at all.
+     */
+    GET_CPU_ID(1, CPUInfo);
+    if (!(CPUInfo[2] & (1 << 27)) ||   /* OSXSAVE */
+        !(CPUInfo[2] & (1 << 28)))     /* AVX */
+        return false;
+    if ((get_xcr0() & 6) != 6)         /* xmm and ymm state */
+        return false;
+
+    GET_CPU_ID(7, CPUInfo);
+    return CPUInfo[1] & (1 << 5);      /* AVX2 */
+}
+
+#define SSE2_ROTL(x, n)                                                 \
+    _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define SSE2_ROTL16(x) SSE2_ROTL(x, 16)
+#define SSE2_ROTL12(x) SSE2_ROTL(x, 12)
+#define SSE2_ROTL8(x) SSE2_ROTL(x, 8)
+#define SSE2_ROTL7(x) SSE2_ROTL(x, 7)
+
+static FUNC_ISA_SSE2 void chacha20_blocks_hw(
+    struct chacha20 *ctx, unsigned char *data, size_t nblocks)
+{
+    uint32_t lo[4], hi[4];
+    __m128i x[16], s[16];
+
+    for (int i = 0; i < 16; i++)
+        s[i] = _mm_set1_epi32(ctx->state[i]);
+
+    /* Four blocks at a time */
+    for (; nblocks >= 4; nblocks -= 4, data += 256) {
+        chacha20_counters(ctx, 4, lo, hi);
+        s[12] = _mm_loadu_si128((const __m128i *)lo);
+        s[13] = _mm_loadu_si128((const __m128i *)hi);
+        for (int i = 0; i < 16; i++)
+            x[i] = s[i];
+
+        for (int i = 0; i < 10; i++)
+            CCP_DOUBLE_ROUND(x, _mm_add_epi32, _mm_xor_si128, SSE2_ROTL16,
+                             SSE2_ROTL12, SSE2_ROTL8, SSE2_ROTL7);
+
+        for (int i = 0; i < 16; i += 4) {
+            __m128i a = _mm_add_epi32(x[i], s[i]);
+            __m128i b = _mm_add_epi32(x[i+1], s[i+1]);
+            __m128i c = _mm_add_epi32(x[i+2], s[i+2]);
+            __m128i d = _mm_add_epi32(x[i+3], s[i+3]);
+
+            /* Transpose, so that out[j] is words i..i+3 of block j */
+            __m128i ab0 = _mm_unpacklo_epi32(a, b);
+            __m128i ab1 = _mm_unpackhi_epi32(a, b);
+            __m128i cd0 = _mm_unpacklo_epi32(c, d);
+            __m128i cd1 = _mm_unpackhi_epi32(c, d);
+            __m128i out[4];
+            out[0] = _mm_unpacklo_epi64(ab0, cd0);
+            out[1] = _mm_unpackhi_epi64(ab0, cd0);
+            out[2] = _mm_unpacklo_epi64(ab1, cd1);
+            out[3] = _mm_unpackhi_epi64(ab1, cd1);
+
+            for (int j = 0; j < 4; j++) {
+                __m128i *p = (__m128i *)(data + 64 * j + 4 * i);
+                _mm_storeu_si128(
+                    p, _mm_xor_si128(_mm_loadu_si128(p), out[j]));
+            }
+        }
+
+        chacha20_advance(ctx, 4);
+    }
+
+    smemclr(x, sizeof(x));
+    smemclr(s, sizeof(s));
+
+    chacha20_blocks_sw(ctx, data, nblocks);
+}
+
+/*
+ * With AVX2 we can do eight blocks at once, and the rotations by
+ * whole bytes can be done with a byte shuffle.
+ */
+#define AVX2_ROTL(x, n)                                                 \
+    _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define AVX2_ROTL16(x) _mm256_shuffle_epi8(x, rot16)
+#define AVX2_ROTL12(x) AVX2_ROTL(x, 12)
+#define AVX2_ROTL8(x) _mm256_shuffle_epi8(x, rot8)
+#define AVX2_ROTL7(x) AVX2_ROTL(x, 7)
+
+static FUNC_ISA_AVX2 void chacha20_blocks_avx2(
+    struct chacha20 *ctx, unsigned char *data, size_t nblocks)
+{
+    const __m256i rot16 = _mm256_setr_epi8(
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(
+        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    uint32_t lo[8], hi[8];
+    __m256i x[16], s[16], out[16];
+
+    for (int i = 0; i < 16; i++)
+        s[i] = _mm256_set1_epi32(ctx->state[i]);
+
+    /* Eight blocks at a time */
+    for (; nblocks >= 8; nblocks -= 8, data += 512) {
+        chacha20_counters(ctx, 8, lo, hi);
+        s[12] = _mm256_loadu_si256((const __m256i *)lo);
+        s[13] = _mm256_loadu_si256((const __m256i *)hi);
+        for (int i = 0; i < 16; i++)
+            x[i] = s[i];
+
+        for (int i = 0; i < 10; i++)
+            CCP_DOUBLE_ROUND(x, _mm256_add_epi32, _mm256_xor_si256,
+                             AVX2_ROTL16, AVX2_ROTL12, AVX2_ROTL8,
+                             AVX2_ROTL7);
+
+        /*
+         * The unpack instructions work within each 128-bit half, so
+         * this leaves out[4*g+j] holding words 4g..4g+3 of block j in
+         * its low half and of block j+4 in its high half.
+         */
+        for (int i = 0; i < 16; i += 4) {
+            __m256i a = _mm256_add_epi32(x[i], s[i]);
+            __m256i b = _mm256_add_epi32(x[i+1], s[i+1]);
+            __m256i c = _mm256_add_epi32(x[i+2], s[i+2]);
+            __m256i d = _mm256_add_epi32(x[i+3], s[i+3]);
+            __m256i ab0 = _mm256_unpacklo_epi32(a, b);
+            __m256i ab1 = _mm256_unpackhi_epi32(a, b);
+            __m256i cd0 = _mm256_unpacklo_epi32(c, d);
+            __m256i cd1 = _mm256_unpackhi_epi32(c, d);
+            out[i] = _mm256_unpacklo_epi64(ab0, cd0);
+            out[i+1] = _mm256_unpackhi_epi64(ab0, cd0);
+            out[i+2] = _mm256_unpacklo_epi64(ab1, cd1);
+            out[i+3] = _mm256_unpackhi_epi64(ab1, cd1);
+        }
+
+        /* Then gather the halves into whole 32-byte pieces of blocks */
+        for (int j = 0; j < 4; j++) {
+            __m256i v[4];
+            v[0] = _mm256_permute2x128_si256(out[j], out[4+j], 0x20);
+            v[1] = _mm256_permute2x128_si256(out[8+j], out[12+j], 0x20);
+            v[2] = _mm256_permute2x128_si256(out[j], out[4+j], 0x31);
+            v[3] = _mm256_permute2x128_si256(out[8+j], out[12+j], 0x31);
+            for (int k = 0; k < 4; k++) {
+                /* v[0], v[1] are block j; v[2], v[3] are block j+4 */
+                __m256i *p = (__m256i *)(data + 64 * (j + 4 * (k >> 1)) +
+                                         32 * (k & 1));
+                _mm256_storeu_si256(
+                    p, _mm256_xor_si256(_mm256_loadu_si256(p), v[k]));
+            }
+        }
+
+        chacha20_advance(ctx, 8);
+    }
+
+    smemclr(x, sizeof(x));
+    smemclr(s, sizeof(s));
+    smemclr(out, sizeof(out));
+
+    /* SSE2 can finish off a run of four */
+    chacha20_blocks_hw(ctx, data, nblocks);
+}
+
+/*
+ * SSE2's multiplier only gives two 32x32-bit products at once, which
+ * doesn't beat the scalar code's 64-bit multiplications on x86-64, so
+ * the SSE2 version keeps the portable Poly1305.
+ */
+static void poly1305_blocks_hw(
+    struct poly1305 *ctx, const unsigned char *data, size_t nblocks)
+{
+    poly1305_blocks_sw(ctx, data, nblocks);
+}
+
+/*
+ * Poly1305 with AVX2: four accumulators, one in each 64-bit lane,
+ * stepping by r^4.
+ */
+
+/* d = h * r, unreduced, using s = 5*r for the terms that wrap round */
+static FUNC_ISA_AVX2 inline void poly1305_avx2_mul(
+    __m256i d[5], const __m256i h[5], const __m256i r[5], const __m256i s[5])
+{
+#define M(a, b) _mm256_mul_epu32(a, b)
+#define A(a, b) _mm256_add_epi64(a, b)
+    d[0] = A(A(A(A(M(h[0], r[0]), M(h[1], s[4])), M(h[2], s[3])),
+               M(h[3], s[2])), M(h[4], s[1]));
+    d[1] = A(A(A(A(M(h[0], r[1]), M(h[1], r[0])), M(h[2], s[4])),
+               M(h[3], s[3])), M(h[4], s[2]));
+    d[2] = A(A(A(A(M(h[0], r[2]), M(h[1], r[1])), M(h[2], r[0])),
+               M(h[3], s[4])), M(h[4], s[3]));
+    d[3] = A(A(A(A(M(h[0], r[3]), M(h[1], r[2])), M(h[2], r[1])),
+               M(h[3], r[0])), M(h[4], s[4]));
+    d[4] = A(A(A(A(M(h[0], r[4]), M(h[1], r[3])), M(h[2], r[2])),
+               M(h[3], r[1])), M(h[4], r[0]));
+#undef M
+#undef A
+}
+
+/* Partially carry d back into 26-bit limbs in h */
+static FUNC_ISA_AVX2 inline void poly1305_avx2_carry(
+    __m256i h[5], __m256i d[5])
+{
+    const __m256i mask = _mm256_set1_epi64x(POLY26_MASK);
+    __m256i c;
+    for (int i = 0; i < 4; i++) {
+        d[i+1] = _mm256_add_epi64(d[i+1], _mm256_srli_epi64(d[i], 26));
+        h[i] = _mm256_and_si256(d[i], mask);
+    }
+    c = _mm256_srli_epi64(d[4], 26);
+    h[4] = _mm256_and_si256(d[4], mask);
+    h[0] = _mm256_add_epi64(h[0], _mm256_add_epi64(c, _mm256_slli_epi64(c, 2)));
+    h[1] = _mm256_add_epi64(h[1], _mm256_srli_epi64(h[0], 26));
+    h[0] = _mm256_and_si256(h[0], mask);
+}
+
+/* Add four message blocks, one to each lane, with the 2^128 bit set */
+static FUNC_ISA_AVX2 inline void poly1305_avx2_add_message(
+    __m256i h[5], const unsigned char *data)
+{
+    const __m256i mask = _mm256_set1_epi64x(POLY26_MASK);
+    __m256i x = _mm256_loadu_si256((const __m256i *)data);
+    __m256i y = _mm256_loadu_si256((const __m256i *)(data + 32));
+    /* Low and high halves of blocks 0..3, in lane order */
+    __m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(x, y), 0xD8);
+    __m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(x, y), 0xD8);
+
+    h[0] = _mm256_add_epi64(h[0], _mm256_and_si256(lo, mask));
+    h[1] = _mm256_add_epi64(h[1], _mm256_and_si256(
+                                _mm256_srli_epi64(lo, 26), mask));
+    h[2] = _mm256_add_epi64(h[2], _mm256_and_si256(
+                                _mm256_or_si256(_mm256_srli_epi64(lo, 52),
+                                                _mm256_slli_epi64(hi, 12)),
+                                mask));
+    h[3] = _mm256_add_epi64(h[3], _mm256_and_si256(
+                                _mm256_srli_epi64(hi, 14), mask));
+    h[4] = _mm256_add_epi64(h[4], _mm256_or_si256(
+                                _mm256_srli_epi64(hi, 40),
+                                _mm256_set1_epi64x(1 << 24)));
+}
+
+static FUNC_ISA_AVX2 void poly1305_blocks_avx2(
+    struct poly1305 *ctx, const unsigned char *data, size_t nblocks)
+{
+    uint32_t pow[4][5], h0[5];
+    uint64_t dsum[5], lanes[4];
+    __m256i h[5], d[5], r[5], s[5];
+    size_t nvec = nblocks & ~(size_t)3;
+
+    if (nblocks < POLY1305_SIMD_MIN_BLOCKS) {
+        poly1305_blocks_sw(ctx, data, nblocks);
+        return;
+    }
+
+    poly26_setup(ctx, pow, 4, h0);
+    for (int i = 0; i < 5; i++) {
+        r[i] = _mm256_set1_epi64x(pow[3][i]);
+        s[i] = _mm256_set1_epi64x(5 * pow[3][i]);
+        h[i] = _mm256_setr_epi64x(h0[i], 0, 0, 0);
+    }
+
+    poly1305_avx2_add_message(h, data);
+    for (size_t i = 4; i < nvec; i += 4) {
+        poly1305_avx2_mul(d, h, r, s);
+        poly1305_avx2_carry(h, d);
+        poly1305_avx2_add_message(h, data + 16 * i);
+    }
+
+    /* Bring the lanes level, and add them up */
+    for (int i = 0; i < 5; i++) {
+        r[i] = _mm256_setr_epi64x(pow[3][i], pow[2][i], pow[1][i], pow[0][i]);
+        s[i] = _mm256_setr_epi64x(5 * pow[3][i], 5 * pow[2][i],
+                                  5 * pow[1][i], 5 * pow[0][i]);
+    }
+    poly1305_avx2_mul(d, h, r, s);
+    for (int i = 0; i < 5; i++) {
+        _mm256_storeu_si256((__m256i *)lanes, d[i]);
+        dsum[i] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    poly26_carry(h0, dsum);
+    poly26_to_bigval(&ctx->h, h0);
+
+    smemclr(pow, sizeof(pow));
+    smemclr(h0, sizeof(h0));
+    smemclr(dsum, sizeof(dsum));
+    smemclr(lanes, sizeof(lanes));
+    smemclr(h, sizeof(h));
+    smemclr(d, sizeof(d));
+    smemclr(r, sizeof(r));
+    smemclr(s, sizeof(s));
+
+    poly1305_blocks_sw(ctx, data + 16 * nvec, nblocks - nvec);
+}
+
+/* ----------------------------------------------------------------------
+ * SIMD implementations for Arm, using NEON.
+ */
+
+#elif HW_CCP == HW_CCP_NEON
+
+#ifdef USE_ARM64_NEON_H
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+
+static bool ccp_hw_available(void)
+{
+    /* NEON is compulsory in AArch64, and if we were compiled with it
+     * enabled for 32-bit Arm, we've already assumed it's there */
+    return true;
+}
+
+static bool ccp_avx2_available(void)
+{
+    return false;
+}
+
+static inline uint32x4_t neon_rotl16(uint32x4_t x)
+{
+    return vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(x)));
+}
+#define NEON_ROTL(x, n) vsriq_n_u32(vshlq_n_u32(x, n), x, 32 - (n))
+#define NEON_ROTL12(x) NEON_ROTL(x, 12)
+#define NEON_ROTL8(x) NEON_ROTL(x, 8)
+#define NEON_ROTL7(x) NEON_ROTL(x, 7)
+
+static void chacha20_blocks_hw(struct chacha20 *ctx, unsigned char *data,
+                               size_t nblocks)
+{
+    uint32_t lo[4], hi[4];
+    uint32x4_t x[16], s[16];
+
+    for (int i = 0; i < 16; i++)
+        s[i] = vdupq_n_u32(ctx->state[i]);
+
+    /* Four blocks at a time */
+    for (; nblocks >= 4; nblocks -= 4, data += 256) {
+        chacha20_counters(ctx, 4, lo, hi);
+        s[12] = vld1q_u32(lo);
+        s[13] = vld1q_u32(hi);
+        for (int i = 0; i < 16; i++)
+            x[i] = s[i];
+
+        for (int i = 0; i < 10; i++)
+            CCP_DOUBLE_ROUND(x, vaddq_u32, veorq_u32, neon_rotl16,
+                             NEON_ROTL12, NEON_ROTL8, NEON_ROTL7);
+
+        for (int i = 0; i < 16; i += 4) {
+            uint32x4_t a = vaddq_u32(x[i], s[i]);
+            uint32x4_t b = vaddq_u32(x[i+1], s[i+1]);
+            uint32x4_t c = vaddq_u32(x[i+2], s[i+2]);
+            uint32x4_t d = vaddq_u32(x[i+3], s[i+3]);
+
+            /* Transpose, so that out[j] is words i..i+3 of block j */
+            uint32x4x2_t ab = vtrnq_u32(a, b), cd = vtrnq_u32(c, d);
+            uint32x4_t out[4];
+            out[0] = vcombine_u32(vget_low_u32(ab.val[0]),
+                                  vget_low_u32(cd.val[0]));
+            out[1] = vcombine_u32(vget_low_u32(ab.val[1]),
+                                  vget_low_u32(cd.val[1]));
+            out[2] = vcombine_u32(vget_high_u32(ab.val[0]),
+                                  vget_high_u32(cd.val[0]));
+            out[3] = vcombine_u32(vget_high_u32(ab.val[1]),
+                                  vget_high_u32(cd.val[1]));
+
+            for (int j = 0; j < 4; j++) {
+                unsigned char *p = data + 64 * j + 4 * i;
+                uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(p));
+                vst1q_u8(p, vreinterpretq_u8_u32(veorq_u32(v, out[j])));
+            }
+        }
+
+        chacha20_advance(ctx, 4);
+    }
+
+    smemclr(x, sizeof(x));
+    smemclr(s, sizeof(s));
+
+    chacha20_blocks_sw(ctx, data, nblocks);
+}
+
+/*
+ * Poly1305 with NEON: two accumulators, one in each 64-bit lane,
+ * stepping by r^2. The multiplications take the limbs narrowed to
+ * 32 bits, which they always fit in.
+ */
+static inline void poly1305_neon_mul(
+    uint64x2_t d[5], const uint64x2_t h[5],
+    const uint32x2_t r[5], const uint32x2_t s[5])
+{
+    uint32x2_t n[5];
+    for (int i = 0; i < 5; i++)
+        n[i] = vmovn_u64(h[i]);
+    d[0] = vmull_u32(n[0], r[0]);
+    d[0] = vmlal_u32(d[0], n[1], s[4]);
+    d[0] = vmlal_u32(d[0], n[2], s[3]);
+    d[0] = vmlal_u32(d[0], n[3], s[2]);
+    d[0] = vmlal_u32(d[0], n[4], s[1]);
+    d[1] = vmull_u32(n[0], r[1]);
+    d[1] = vmlal_u32(d[1], n[1], r[0]);
+    d[1] = vmlal_u32(d[1], n[2], s[4]);
+    d[1] = vmlal_u32(d[1], n[3], s[3]);
+    d[1] = vmlal_u32(d[1], n[4], s[2]);
+    d[2] = vmull_u32(n[0], r[2]);
+    d[2] = vmlal_u32(d[2], n[1], r[1]);
+    d[2] = vmlal_u32(d[2], n[2], r[0]);
+    d[2] = vmlal_u32(d[2], n[3], s[4]);
+    d[2] = vmlal_u32(d[2], n[4], s[3]);
+    d[3] = vmull_u32(n[0], r[3]);
+    d[3] = vmlal_u32(d[3], n[1], r[2]);
+    d[3] = vmlal_u32(d[3], n[2], r[1]);
+    d[3] = vmlal_u32(d[3], n[3], r[0]);
+    d[3] = vmlal_u32(d[3], n[4], s[4]);
+    d[4] = vmull_u32(n[0], r[4]);
+    d[4] = vmlal_u32(d[4], n[1], r[3]);
+    d[4] = vmlal_u32(d[4], n[2], r[2]);
+    d[4] = vmlal_u32(d[4], n[3], r[1]);
+    d[4] = vmlal_u32(d[4], n[4], r[0]);
+}
+
+static inline void poly1305_neon_carry(uint64x2_t h[5], uint64x2_t d[5])
+{
+    const uint64x2_t mask = vdupq_n_u64(POLY26_MASK);
+    uint64x2_t c;
+    for (int i = 0; i < 4; i++) {
+        d[i+1] = vaddq_u64(d[i+1], vshrq_n_u64(d[i], 26));
+        h[i] = vandq_u64(d[i], mask);
+    }
+    c = vshrq_n_u64(d[4], 26);
+    h[4] = vandq_u64(d[4], mask);
+    h[0] = vaddq_u64(h[0], vaddq_u64(c, vshlq_n_u64(c, 2)));
+    h[1] = vaddq_u64(h[1], vshrq_n_u64(h[0], 26));
+    h[0] = vandq_u64(h[0], mask);
+}
+
+/* Add two message blocks, one to each lane, with the 2^128 bit set */
+static inline void poly1305_neon_add_message(
+    uint64x2_t h[5], const unsigned char *data)
+{
+    const uint64x2_t mask = vdupq_n_u64(POLY26_MASK);
+    uint64x2_t x = vreinterpretq_u64_u8(vld1q_u8(data));
+    uint64x2_t y = vreinterpretq_u64_u8(vld1q_u8(data + 16));
+    uint64x2_t lo = vcombine_u64(vget_low_u64(x), vget_low_u64(y));
+    uint64x2_t hi = vcombine_u64(vget_high_u64(x), vget_high_u64(y));
+
+    h[0] = vaddq_u64(h[0], vandq_u64(lo, mask));
+    h[1] = vaddq_u64(h[1], vandq_u64(vshrq_n_u64(lo, 26), mask));
+    h[2] = vaddq_u64(h[2], vandq_u64(vorrq_u64(vshrq_n_u64(lo, 52),
+                                               vshlq_n_u64(hi, 12)), mask));
+    h[3] = vaddq_u64(h[3], vandq_u64(vshrq_n_u64(hi, 14), mask));
+    h[4] = vaddq_u64(h[4], vorrq_u64(vshrq_n_u64(hi, 40),
+                                     vdupq_n_u64(1 << 24)));
+}
+
+static void poly1305_blocks_hw(
+    struct poly1305 *ctx, const unsigned char *data, size_t nblocks)
+{
+    uint32_t pow[2][5], h0[5];
+    uint64_t dsum[5];
+    uint64x2_t h[5], d[5];
+    uint32x2_t r[5], s[5];
+    size_t nvec = nblocks & ~(size_t)1;
+
+    if (nblocks < POLY1305_SIMD_MIN_BLOCKS) {
+        poly1305_blocks_sw(ctx, data, nblocks);
+        return;
+    }
+
+    poly26_setup(ctx, pow, 2, h0);
+    for (int i = 0; i < 5; i++) {
+        r[i] = vdup_n_u32(pow[1][i]);
+        s[i] = vdup_n_u32(5 * pow[1][i]);
+        h[i] = vcombine_u64(vcreate_u64(h0[i]), vcreate_u64(0));
+    }
+
+    poly1305_neon_add_message(h, data);
+    for (size_t i = 2; i < nvec; i += 2) {
+        poly1305_neon_mul(d, h, r, s);
+        poly1305_neon_carry(h, d);
+        poly1305_neon_add_message(h, data + 16 * i);
+    }
+
+    /* Bring the lanes level, and add them up */
+    for (int i = 0; i < 5; i++) {
+        r[i] = vset_lane_u32(pow[0][i], vdup_n_u32(pow[1][i]), 1);
+        s[i] = vset_lane_u32(5 * pow[0][i], vdup_n_u32(5 * pow[1][i]), 1);
+    }
+    poly1305_neon_mul(d, h, r, s);
+    for (int i = 0; i < 5; i++)
+        dsum[i] = vgetq_lane_u64(d[i], 0) + vgetq_lane_u64(d[i], 1);
+    poly26_carry(h0, dsum);
+    poly26_to_bigval(&ctx->h, h0);
+
+    smemclr(pow, sizeof(pow));
+    smemclr(h0, sizeof(h0));
+    smemclr(dsum, sizeof(dsum));
+    smemclr(h, sizeof(h));
+    smemclr(d, sizeof(d));
+
+    poly1305_blocks_sw(ctx, data + 16 * nvec, nblocks - nvec);
+}
+
+static void chacha20_blocks_avx2(struct chacha20 *ctx, unsigned char *data,
+                                 size_t nblocks)
+{
+    unreachable("AVX2 stub should never be called");
+}
+
+static void poly1305_blocks_avx2(
+    struct poly1305 *ctx, const unsigned char *data, size_t nblocks)
+{
+    unreachable("AVX2 stub should never be called");
+}
+
+/* ----------------------------------------------------------------------
+ * Stub functions if we have no SIMD implementations. Those vtables
+ * are then never successfully instantiated.
+ */
+
+#else
+
+static bool ccp_hw_available(void)
+{
+    return false;
+}
+
+static bool ccp_avx2_available(void)
+{
+    return false;
+}
+
+static void chacha20_blocks_hw(struct chacha20 *ctx, unsigned char *data,
+                               size_t nblocks)
+{
+    unreachable("SIMD stub should never be called");
+}
+
+static void chacha20_blocks_avx2(struct chacha20 *ctx, unsigned char *data,
+                                 size_t nblocks)
+{
+    unreachable("SIMD stub should never be called");
+}
+
+static void poly1305_blocks_hw(
+    struct poly1305 *ctx, const unsigned char *data, size_t nblocks)
+{
+    unreachable("SIMD stub should never be called");
+}
+
+static void poly1305_blocks_avx2(
+    struct poly1305 *ctx, const unsigned char *data, size_t nblocks)
+{
+    unreachable("SIMD stub should never be called");
+}
+
+#endif
+
 /* SSH-2 wrapper */
 
+struct ccp_extra {
+    chacha20_blocks_fn chacha20_blocks;
+    poly1305_blocks_fn poly1305_blocks;
+    bool (*available)(void);
+    const char *mac_text_name;
+};
+
 struct ccp_context {
+    const struct ccp_extra *extra;
+
     struct chacha20 a_cipher; /* Used for length */
     struct chacha20 b_cipher; /* Used for content */
 
@@ -928,7 +1809,7 @@ static void poly_BinarySink_write(BinarySink *bs, const void *blkv, size_t len)
 
     /* Update the MAC with anything left */
     if (len) {
-        poly1305_feed(&ctx->mac, blk, len);
+        poly1305_feed(&ctx->mac, ctx->extra->poly1305_blocks, blk, len);
     }
 }
 
@@ -940,7 +1821,8 @@ static void poly_genresult(ssh2_mac *mac, unsigned char *blk)
 
 static const char *poly_text_name(ssh2_mac *mac)
 {
-    return "Poly1305";
+    struct ccp_context *ctx = container_of(mac, struct ccp_context, mac_if);
+    return ctx->extra->mac_text_name;
 }
 
 const ssh2_macalg ssh2_poly1305 = {
@@ -959,7 +1841,13 @@ const ssh2_macalg ssh2_poly1305 = {
 
 static ssh_cipher *ccp_new(const ssh_cipheralg *alg)
 {
+    const struct ccp_extra *extra = (const struct ccp_extra *)alg->extra;
+
+    if (!extra->available())
+        return NULL;
+
     struct ccp_context *ctx = snew(struct ccp_context);
+    ctx->extra = extra;
     BinarySink_INIT(ctx, poly_BinarySink_write);
     poly1305_init(&ctx->mac);
     ctx->ciph.vt = alg;
@@ -995,13 +1883,13 @@ static void ccp_key(ssh_cipher *cipher, const void *vkey)
 static void ccp_encrypt(ssh_cipher *cipher, void *blk, int len)
 {
     struct ccp_context *ctx = container_of(cipher, struct ccp_context, ciph);
-    chacha20_encrypt(&ctx->b_cipher, blk, len);
+    chacha20_encrypt(&ctx->b_cipher, ctx->extra->chacha20_blocks, blk, len);
 }
 
 static void ccp_decrypt(ssh_cipher *cipher, void *blk, int len)
 {
     struct ccp_context *ctx = container_of(cipher, struct ccp_context, ciph);
-    chacha20_decrypt(&ctx->b_cipher, blk, len);
+    chacha20_decrypt(&ctx->b_cipher, ctx->extra->chacha20_blocks, blk, len);
 }
 
 static void ccp_length_op(struct ccp_context *ctx, void *blk, int len,
@@ -1026,7 +1914,7 @@ static void ccp_encrypt_length(ssh_cipher *cipher, void *blk, int len,
 {
     struct ccp_context *ctx = container_of(cipher, struct ccp_context, ciph);
     ccp_length_op(ctx, blk, len, seq);
-    chacha20_encrypt(&ctx->a_cipher, blk, len);
+    chacha20_encrypt(&ctx->a_cipher, ctx->extra->chacha20_blocks, blk, len);
 }
 
 static void ccp_decrypt_length(ssh_cipher *cipher, void *blk, int len,
@@ -1034,25 +1922,114 @@ static void ccp_decrypt_length(ssh_cipher *cipher, void *blk, int len,
 {
     struct ccp_context *ctx = container_of(cipher, struct ccp_context, ciph);
     ccp_length_op(ctx, blk, len, seq);
-    chacha20_decrypt(&ctx->a_cipher, blk, len);
+    chacha20_decrypt(&ctx->a_cipher, ctx->extra->chacha20_blocks, blk, len);
+}
+
+static bool ccp_sw_available(void)
+{
+    return true;
+}
+
+static bool ccp_hw_available_cached(void)
+{
+    static bool initialised = false;
+    static bool hw_available;
+    if (!initialised) {
+        hw_available = ccp_hw_available();
+        initialised = true;
+    }
+    return hw_available;
 }
 
+static bool ccp_avx2_available_cached(void)
+{
+    static bool initialised = false;
+    static bool avx2_available;
+    if (!initialised) {
+        avx2_available = ccp_avx2_available();
+        initialised = true;
+    }
+    return avx2_available;
+}
+
+/*
+ * Vtables: one for each implementation, plus a selector which is
+ * never instantiated itself but returns the fastest of the others
+ * that works on this machine.
+ */
+
+static ssh_cipher *ccp_select(const ssh_cipheralg *alg)
+{
+    const ssh_cipheralg *const *real_algs =
+        (const ssh_cipheralg *const *)alg->extra;
+
+    for (size_t i = 0; real_algs[i]; i++) {
+        ssh_cipher *c = ssh_cipher_new(real_algs[i]);
+        if (c)
+            return c;
+    }
+
+    unreachable("the software ChaCha20 should always be available");
+}
+
+#define CCP_VTABLE(suffix, chacha_fn, poly_fn, avail_fn, cname, mname)  \
+    static const struct ccp_extra extra_ccp##suffix = {                 \
+        .chacha20_blocks = chacha_fn,                                   \
+        .poly1305_blocks = poly_fn,                                     \
+        .available = avail_fn,                                          \
+        .mac_text_name = mname,                                         \
+    };                                                                  \
+    const ssh_cipheralg ssh2_chacha20_poly1305##suffix = {              \
+        .new = ccp_new,                                                 \
+        .free = ccp_free,                                               \
+        .setiv = ccp_iv,                                                \
+        .setkey = ccp_key,                                              \
+        .encrypt = ccp_encrypt,                                         \
+        .decrypt = ccp_decrypt,                                         \
+        .encrypt_length = ccp_encrypt_length,                           \
+        .decrypt_length = ccp_decrypt_length,                           \
+        .ssh2_id = "chacha20-poly1305@openssh.com",                     \
+        .blksize = 1,                                                   \
+        .real_keybits = 512,                                            \
+        .padded_keybytes = 64,                                          \
+        .flags = SSH_CIPHER_SEPARATE_LENGTH,                            \
+        .text_name = cname,                                             \
+        .required_mac = &ssh2_poly1305,                                 \
+        .extra = &extra_ccp##suffix,                                    \
+    };
+
+CCP_VTABLE(_sw, chacha20_blocks_sw, poly1305_blocks_sw, ccp_sw_available,
+           "ChaCha20 (unaccelerated)", "Poly1305 (unaccelerated)")
+#if HW_CCP == HW_CCP_NEON
+CCP_VTABLE(_hw, chacha20_blocks_hw, poly1305_blocks_hw,
+           ccp_hw_available_cached, "ChaCha20" HW_NAME_SUFFIX,
+           "Poly1305" HW_NAME_SUFFIX)
+#else
+CCP_VTABLE(_hw, chacha20_blocks_hw, poly1305_blocks_hw,
+           ccp_hw_available_cached, "ChaCha20" HW_NAME_SUFFIX,
+           "Poly1305 (unaccelerated)")
+#endif
+CCP_VTABLE(_avx2, chacha20_blocks_avx2, poly1305_blocks_avx2,
+           ccp_avx2_available_cached, "ChaCha20 (AVX2 accelerated)",
+           "Poly1305 (AVX2 accelerated)")
+
+static const ssh_cipheralg *const ccp_impls[] = {
+    &ssh2_chacha20_poly1305_avx2,
+    &ssh2_chacha20_poly1305_hw,
+    &ssh2_chacha20_poly1305_sw,
+    NULL
+};
+
 const ssh_cipheralg ssh2_chacha20_poly1305 = {
-    .new = ccp_new,
-    .free = ccp_free,
-    .setiv = ccp_iv,
-    .setkey = ccp_key,
-    .encrypt = ccp_encrypt,
-    .decrypt = ccp_decrypt,
-    .encrypt_length = ccp_encrypt_length,
-    .decrypt_length = ccp_decrypt_length,
+    .new = ccp_select,
     .ssh2_id = "chacha20-poly1305@openssh.com",
     .blksize = 1,
     .real_keybits = 512,
     .padded_keybytes = 64,
     .flags = SSH_CIPHER_SEPARATE_LENGTH,
-    .text_name = "ChaCha20",
+    .text_name = "ChaCha20 (dummy selector vtable)",
     .required_mac = &ssh2_poly1305,
+    .extra = ccp_impls,
 };
 
 static const ssh_cipheralg *const ccp_list[] = {
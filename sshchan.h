@@ -228,6 +228,17 @@ struct SshChannelVtable {
     void (*send_terminal_size_change)(
         SshChannel *c, int w, int h);
     void (*hint_channel_is_simple)(SshChannel *c);
+
+    /*
+     * Limit the rate at which this channel sends data, by either or
+     * both of two RateLimits (either may be NULL): one of its own,
+     * and one it shares with other channels. The channel takes its
+     * own references to them. 'weight' sets its share of the
+     * connection relative to other busy channels, whose default
+     * weight is 1. Optional: NULL if the protocol can't do this.
+     */
+    void (*set_rate_limits)(SshChannel *c, RateLimit *own, RateLimit *shared,
+                            unsigned weight);
 };
 
 struct SshChannel {
@@ -297,6 +308,24 @@ static inline void sshfwd_send_terminal_size_change(
 { c->vt->send_terminal_size_change(c, w, h); }
 static inline void sshfwd_hint_channel_is_simple(SshChannel *c)
 { c->vt->hint_channel_is_simple(c); }
+static inline void sshfwd_set_rate_limits(
+    SshChannel *c, RateLimit *own, RateLimit *shared, unsigned weight)
+{ if (c->vt->set_rate_limits) c->vt->set_rate_limits(c, own, shared, weight); }
+
+/*
+ * A token bucket, limiting a flow of data to a given number of bytes
+ * per second, with bursts of up to a quarter of a second's worth.
+ * Reference-counted, so that several channels can share one.
+ */
+RateLimit *ratelimit_new(unsigned long rate);
+RateLimit *ratelimit_ref(RateLimit *rl);
+void ratelimit_free(RateLimit *rl);    /* drops one reference */
+void ratelimit_set_rate(RateLimit *rl, unsigned long rate);
+/* How many bytes may be sent right now */
+size_t ratelimit_available(RateLimit *rl);
+void ratelimit_consume(RateLimit *rl, size_t len);
+/* How many ticks until 'len' bytes (or a full burst, if less) may be sent */
+unsigned long ratelimit_wait(RateLimit *rl, size_t len);
 
 /* ----------------------------------------------------------------------
  * The 'main' or primary channel of the SSH connection is special,
@@ -64,7 +64,7 @@ static void pktin_free_queue_callback(void *vctx)
         PacketQueueNode *node = pktin_freeq_head.next;
         PktIn *pktin = container_of(node, PktIn, qnode);
         pktin_freeq_head.next = node->next;
-        sfree(pktin);
+        ssh_free_pktin(pktin);
     }
 
     pktin_freeq_head.prev = &pktin_freeq_head;
@@ -238,20 +238,125 @@ void pq_base_concatenate(PacketQueueBase *qdest,
  * Low-level functions for the packet structures themselves.
  */
 
+/*
+ * Freed packets are kept on free lists and handed out again, rather
+ * than going back to the heap: every SSH message costs one, and
+ * under bulk transfer or heavy forwarding they come and go at a
+ * great rate in a handful of sizes.
+ *
+ * A PktIn's data lives in the same allocation as the structure, so
+ * PktIns are kept by power-of-two size class. A PktOut keeps the
+ * data buffer it had grown to, so there's just one list of those.
+ * Each list is bounded both in count and in the bytes it holds.
+ * Packets are allocated from MEMPOOL_PACKET, and these lists tell
+ * it whenever one goes idle or is reused, so that its statistics
+ * still show where the memory is.
+ *
+ * The lists are global rather than per-BPP, because a packet can
+ * outlive the BPP that made it (the version-string BPP hands its
+ * queues on to its successor), and new_pktout isn't told which BPP
+ * it's allocating for in any case.
+ */
+#define PKTIN_POOL_MINLOG 9             /* smallest class is 512 bytes */
+#define PKTIN_POOL_NCLASSES 10          /* and the largest is 256K */
+#define PKT_POOL_MAX_COUNT 64
+#define PKT_POOL_MAX_BYTES 1048576
+
+static PacketQueueNode *pktin_pool[PKTIN_POOL_NCLASSES];
+static size_t pktin_pool_count[PKTIN_POOL_NCLASSES];
+static PacketQueueNode *pktout_pool;
+static size_t pktout_pool_count, pktout_pool_bytes;
+static PacketPoolStats pool_stats;
+
+static int pktin_pool_class(size_t datalen)
+{
+    int sizeclass;
+    for (sizeclass = 0; sizeclass < PKTIN_POOL_NCLASSES; sizeclass++)
+        if (datalen <= ((size_t)1 << (PKTIN_POOL_MINLOG + sizeclass)))
+            return sizeclass;
+    return -1;                         /* too big to be worth keeping */
+}
+
+static size_t pktin_pool_limit(int sizeclass)
+{
+    size_t limit = PKT_POOL_MAX_BYTES >> (PKTIN_POOL_MINLOG + sizeclass);
+    if (limit > PKT_POOL_MAX_COUNT)
+        limit = PKT_POOL_MAX_COUNT;
+    if (limit < 4)
+        limit = 4;
+    return limit;
+}
+
+PktIn *ssh_new_pktin(size_t datalen)
+{
+    int sizeclass = pktin_pool_class(datalen);
+    PktIn *pkt;
+
+    pool_stats.pktin_allocs++;
+    if (sizeclass < 0) {
+        pkt = snew_plus_pooled(MEMPOOL_PACKET, PktIn, datalen);
+    } else if (pktin_pool[sizeclass]) {
+        PacketQueueNode *node = pktin_pool[sizeclass];
+        pktin_pool[sizeclass] = node->next;
+        pktin_pool_count[sizeclass]--;
+        pkt = container_of(node, PktIn, qnode);
+        pool_stats.pktin_reused++;
+        mempool_note_reused(pkt, 0);
+    } else {
+        pkt = snew_plus_pooled(MEMPOOL_PACKET, PktIn,
+                               (size_t)1 << (PKTIN_POOL_MINLOG + sizeclass));
+    }
+
+    pkt->type = 0;
+    pkt->qnode.prev = pkt->qnode.next = NULL;
+    pkt->qnode.on_free_queue = false;
+    pkt->pool_class = sizeclass;
+    pkt->headroom = 0;
+    return pkt;
+}
+
+void ssh_free_pktin(PktIn *pkt)
+{
+    int sizeclass = pkt->pool_class;
+
+    if (sizeclass >= 0 &&
+        pktin_pool_count[sizeclass] < pktin_pool_limit(sizeclass)) {
+        pkt->qnode.next = pktin_pool[sizeclass];
+        pktin_pool[sizeclass] = &pkt->qnode;
+        pktin_pool_count[sizeclass]++;
+        mempool_note_idle(pkt, 0);
+    } else {
+        sfree_pooled(pkt);
+    }
+}
+
 static void ssh_pkt_BinarySink_write(BinarySink *bs,
                                      const void *data, size_t len);
 PktOut *ssh_new_packet(void)
 {
-    PktOut *pkt = snew(PktOut);
+    PktOut *pkt;
+
+    pool_stats.pktout_allocs++;
+    if (pktout_pool) {
+        pkt = container_of(pktout_pool, PktOut, qnode);
+        pktout_pool = pkt->qnode.next;
+        pktout_pool_count--;
+        pktout_pool_bytes -= pkt->maxlen;
+        pool_stats.pktout_reused++;
+        mempool_note_reused(pkt, pkt->maxlen);
+    } else {
+        pkt = snew_pooled(MEMPOOL_PACKET, PktOut);
+        pkt->data = NULL;
+        pkt->maxlen = 0;
+    }
 
     BinarySink_INIT(pkt, ssh_pkt_BinarySink_write);
-    pkt->data = NULL;
     pkt->length = 0;
-    pkt->maxlen = 0;
     pkt->downstream_id = 0;
     pkt->additional_log_text = NULL;
     pkt->qnode.next = pkt->qnode.prev = NULL;
     pkt->qnode.on_free_queue = false;
+    pkt->qnode.formal_size = 0;
 
     return pkt;
 }
@@ -273,8 +378,29 @@ static void ssh_pkt_BinarySink_write(BinarySink *bs,
 
 void ssh_free_pktout(PktOut *pkt)
 {
-    sfree(pkt->data);
-    sfree(pkt);
+    if (pktout_pool_count >= PKT_POOL_MAX_COUNT) {
+        sfree(pkt->data);
+        sfree_pooled(pkt);
+        return;
+    }
+
+    if (pktout_pool_bytes + pkt->maxlen > PKT_POOL_MAX_BYTES) {
+        /* Keep the structure, but not the oversized buffer */
+        sfree(pkt->data);
+        pkt->data = NULL;
+        pkt->maxlen = 0;
+    }
+
+    pkt->qnode.next = pktout_pool;
+    pktout_pool = &pkt->qnode;
+    pktout_pool_count++;
+    pktout_pool_bytes += pkt->maxlen;
+    mempool_note_idle(pkt, pkt->maxlen);
+}
+
+void ssh_packet_pool_stats(PacketPoolStats *stats)
+{
+    *stats = pool_stats;
 }
 
 /* ----------------------------------------------------------------------
@@ -78,15 +78,350 @@ static inline uint32_t crc32_shift_8(uint32_t v)
     return crc32_shift_4(crc32_shift_4(v));
 }
 
+/*
+ * Absorb bytes one at a time, using the table-free shift above.
+ */
+static uint32_t crc32_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len-- > 0)
+        crc = crc32_shift_8(crc ^ *p++);
+    return crc;
+}
+
+/*
+ * Decide whether we can support a carryless-multiply CRC at all, in
+ * the same way sshaesgcm.c does for GHASH.
+ */
+#define HW_CRC32_NONE 0
+#define HW_CRC32_CLMUL 1
+#define HW_CRC32_NEON 2
+
+#ifdef _FORCE_CRC32_CLMUL
+#   define HW_CRC32 HW_CRC32_CLMUL
+#elif defined(__clang__)
+#   if __has_attribute(target) && __has_include(<wmmintrin.h>) &&       \
+    (defined(__x86_64__) || defined(__i386))
+#       define HW_CRC32 HW_CRC32_CLMUL
+#   endif
+#elif defined(__GNUC__)
+#    if (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 4)) && \
+    (defined(__x86_64__) || defined(__i386))
+#       define HW_CRC32 HW_CRC32_CLMUL
+#    endif
+#elif defined (_MSC_VER)
+#   if (defined(_M_X64) || defined(_M_IX86)) && _MSC_FULL_VER >= 150030729
+#      define HW_CRC32 HW_CRC32_CLMUL
+#   endif
+#endif
+
+#ifdef _FORCE_CRC32_NEON
+#   define HW_CRC32 HW_CRC32_NEON
+#elif defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    /* The NEON code below loads data assuming little-endian. */
+#elif defined __ARM_FEATURE_CRYPTO && defined __aarch64__
+#   define HW_CRC32 HW_CRC32_NEON
+#elif defined(__clang__)
+#   if __has_attribute(target) && __has_include(<arm_neon.h>) &&       \
+    (defined(__aarch64__))
+#       define HW_CRC32 HW_CRC32_NEON
+#       define USE_CLANG_ATTR_TARGET_AARCH64
+#   endif
+#elif defined _MSC_VER
+#   if defined _M_ARM64
+#       define HW_CRC32 HW_CRC32_NEON
+#       define USE_ARM64_NEON_H
+#   endif
+#endif
+
+#if defined _FORCE_SOFTWARE_CRC32 || !defined HW_CRC32
+#   undef HW_CRC32
+#   define HW_CRC32 HW_CRC32_NONE
+#endif
+
+/*
+ * Both hardware versions use the folding technique from Intel's
+ * white paper "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction". The input is kept as four 128-bit
+ * accumulators; each round multiplies every accumulator by x^512 mod
+ * P (split into two 64-bit halves, because that's all a single
+ * carryless multiply can take) and XORs in the next 64 bytes. At the
+ * end the accumulators are folded down to one, then to 64 bits, and
+ * finally Barrett-reduced to the 32-bit CRC.
+ *
+ * The constants are 33-bit polynomials, in the same bit-reversed
+ * representation as the CRC state but shifted left by one bit to
+ * make up for the carryless product of two reversed values coming
+ * out one bit short. They are:
+ *
+ *   K1 = x^(4*128+32) mod P,  K2 = x^(4*128-32) mod P  (fold by 4)
+ *   K3 = x^(128+32) mod P,    K4 = x^(128-32) mod P    (fold by 1)
+ *   K5 = x^64 mod P                                    (128 -> 64)
+ *   POLY = P itself, MU = floor(x^64 / P)              (Barrett)
+ *
+ * Unlike a lookup table,
+ * the multiply instructions take time independent of their data, so
+ * this is as safe as the software version for SSH-1 session data.
+ *
+ * The hardware functions take a length that is a multiple of 16 and
+ * at least 64; the caller deals with any odd bytes at the end.
+ */
+#define CRC32_HW_MIN 64
+
+static const uint64_t crc32_k1 = 0x0154442bd4, crc32_k2 = 0x01c6e41596;
+static const uint64_t crc32_k3 = 0x01751997d0, crc32_k4 = 0x00ccaa009e;
+static const uint64_t crc32_k5 = 0x0163cd6124;
+static const uint64_t crc32_poly = 0x01db710641, crc32_mu = 0x01f7011641;
+
+/* ----------------------------------------------------------------------
+ * Hardware-accelerated CRC using x86 carryless multiplication.
+ */
+
+#if HW_CRC32 == HW_CRC32_CLMUL
+
+#if !defined(__clang__) && defined(__GNUC__)
+#    pragma GCC target("pclmul")
+#    pragma GCC target("sse2")
+#endif
+
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)))
+#    define FUNC_ISA __attribute__ ((target("sse2,pclmul")))
+#else
+#    define FUNC_ISA
+#endif
+
+#include <wmmintrin.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#include <cpuid.h>
+#define GET_CPU_ID(out) __cpuid(1, (out)[0], (out)[1], (out)[2], (out)[3])
+#else
+#define GET_CPU_ID(out) __cpuid(out, 1)
+#endif
+
+static bool crc32_hw_available(void)
+{
+    /*
+     * Check for both PCLMULQDQ and SSE2.
+     */
+    unsigned int CPUInfo[4];
+    GET_CPU_ID(CPUInfo);
+    return (CPUInfo[2] & (1 << 1)) && (CPUInfo[3] & (1 << 26));
+}
+
+/*
+ * Multiply both halves of acc by the corresponding halves of k, and
+ * XOR the results together with the next block of data.
+ */
+static FUNC_ISA inline __m128i crc32_clmul_fold(
+    __m128i acc, __m128i k, __m128i data)
+{
+    __m128i lo = _mm_clmulepi64_si128(acc, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(acc, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), data);
+}
+
+static FUNC_ISA uint32_t crc32_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, k;
+
+    x0 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+    p += 64;
+    len -= 64;
+
+    k = _mm_set_epi64x(crc32_k2, crc32_k1);
+    for (; len >= 64; p += 64, len -= 64) {
+        x0 = crc32_clmul_fold(
+            x0, k, _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x1 = crc32_clmul_fold(
+            x1, k, _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x2 = crc32_clmul_fold(
+            x2, k, _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x3 = crc32_clmul_fold(
+            x3, k, _mm_loadu_si128((const __m128i *)(p + 0x30)));
+    }
+
+    /* Fold the four accumulators into one, then any leftover blocks */
+    k = _mm_set_epi64x(crc32_k4, crc32_k3);
+    x0 = crc32_clmul_fold(x0, k, x1);
+    x0 = crc32_clmul_fold(x0, k, x2);
+    x0 = crc32_clmul_fold(x0, k, x3);
+    for (; len >= 16; p += 16, len -= 16)
+        x0 = crc32_clmul_fold(x0, k, _mm_loadu_si128((const __m128i *)p));
+
+    /* Fold 128 bits down to 64 */
+    x1 = _mm_clmulepi64_si128(x0, k, 0x10);
+    x0 = _mm_xor_si128(_mm_srli_si128(x0, 8), x1);
+    k = _mm_set_epi64x(0, crc32_k5);
+    x1 = _mm_srli_si128(x0, 4);
+    x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k, 0x00);
+    x0 = _mm_xor_si128(x0, x1);
+
+    /* Barrett reduction to 32 bits */
+    k = _mm_set_epi64x(crc32_mu, crc32_poly);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k, 0x10);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+    x0 = _mm_xor_si128(x0, x1);
+
+    return _mm_cvtsi128_si32(_mm_srli_si128(x0, 4));
+}
+
+/* ----------------------------------------------------------------------
+ * Hardware-accelerated CRC using the Arm PMULL instruction.
+ */
+
+#elif HW_CRC32 == HW_CRC32_NEON
+
+#ifdef USE_CLANG_ATTR_TARGET_AARCH64
+/* As in sshaes.c, set up the feature macros arm_neon.h looks at. */
+#define __ARM_NEON 1
+#define __ARM_FEATURE_CRYPTO 1
+#define FUNC_ISA __attribute__ ((target("neon,crypto")))
+#endif /* USE_CLANG_ATTR_TARGET_AARCH64 */
+
+#ifndef FUNC_ISA
+#define FUNC_ISA
+#endif
+
+#ifdef USE_ARM64_NEON_H
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+
+static bool crc32_hw_available(void)
+{
+    /*
+     * As with GHASH, we have to ask the OS whether the PMULL
+     * instruction is available.
+     */
+    return platform_pmull_hw_available();
+}
+
+/*
+ * Carryless-multiply one half of a by one half of b, mirroring
+ * _mm_clmulepi64_si128 so that this code follows the x86 version
+ * step for step.
+ */
+static FUNC_ISA inline uint64x2_t crc32_neon_pmull(
+    uint64x2_t a, unsigned ai, uint64x2_t b, unsigned bi)
+{
+    uint64_t aw = ai ? vgetq_lane_u64(a, 1) : vgetq_lane_u64(a, 0);
+    uint64_t bw = bi ? vgetq_lane_u64(b, 1) : vgetq_lane_u64(b, 0);
+    return vreinterpretq_u64_p128(vmull_p64((poly64_t)aw, (poly64_t)bw));
+}
+
+static FUNC_ISA inline uint64x2_t crc32_neon_load(const uint8_t *p)
+{
+    return vreinterpretq_u64_u8(vld1q_u8(p));
+}
+
+static FUNC_ISA inline uint64x2_t crc32_neon_fold(
+    uint64x2_t acc, uint64x2_t k, uint64x2_t data)
+{
+    return veorq_u64(veorq_u64(crc32_neon_pmull(acc, 0, k, 0),
+                               crc32_neon_pmull(acc, 1, k, 1)), data);
+}
+
+static FUNC_ISA uint32_t crc32_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    const uint64x2_t mask32 = vdupq_n_u64(0xFFFFFFFF);
+    const uint64x2_t zero = vdupq_n_u64(0);
+    uint64x2_t x0, x1, x2, x3, k;
+
+    x0 = crc32_neon_load(p + 0x00);
+    x1 = crc32_neon_load(p + 0x10);
+    x2 = crc32_neon_load(p + 0x20);
+    x3 = crc32_neon_load(p + 0x30);
+    x0 = veorq_u64(x0, vsetq_lane_u64(crc, zero, 0));
+    p += 64;
+    len -= 64;
+
+    k = vcombine_u64(vcreate_u64(crc32_k1), vcreate_u64(crc32_k2));
+    for (; len >= 64; p += 64, len -= 64) {
+        x0 = crc32_neon_fold(x0, k, crc32_neon_load(p + 0x00));
+        x1 = crc32_neon_fold(x1, k, crc32_neon_load(p + 0x10));
+        x2 = crc32_neon_fold(x2, k, crc32_neon_load(p + 0x20));
+        x3 = crc32_neon_fold(x3, k, crc32_neon_load(p + 0x30));
+    }
+
+    /* Fold the four accumulators into one, then any leftover blocks */
+    k = vcombine_u64(vcreate_u64(crc32_k3), vcreate_u64(crc32_k4));
+    x0 = crc32_neon_fold(x0, k, x1);
+    x0 = crc32_neon_fold(x0, k, x2);
+    x0 = crc32_neon_fold(x0, k, x3);
+    for (; len >= 16; p += 16, len -= 16)
+        x0 = crc32_neon_fold(x0, k, crc32_neon_load(p));
+
+    /* Fold 128 bits down to 64 */
+    x1 = crc32_neon_pmull(x0, 0, k, 1);
+    x0 = veorq_u64(vcombine_u64(vget_high_u64(x0), vcreate_u64(0)), x1);
+    k = vcombine_u64(vcreate_u64(crc32_k5), vcreate_u64(0));
+    x1 = vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(x0),
+                                       vdupq_n_u8(0), 4));
+    x0 = crc32_neon_pmull(vandq_u64(x0, mask32), 0, k, 0);
+    x0 = veorq_u64(x0, x1);
+
+    /* Barrett reduction to 32 bits */
+    k = vcombine_u64(vcreate_u64(crc32_poly), vcreate_u64(crc32_mu));
+    x1 = crc32_neon_pmull(vandq_u64(x0, mask32), 0, k, 1);
+    x1 = crc32_neon_pmull(vandq_u64(x1, mask32), 0, k, 0);
+    x0 = veorq_u64(x0, x1);
+
+    return vgetq_lane_u32(vreinterpretq_u32_u64(x0), 1);
+}
+
+/* ----------------------------------------------------------------------
+ * Stub functions if we have no hardware-accelerated CRC. In this
+ * case, crc32_hw_available always returns false, and hence the
+ * hardware function is never called.
+ */
+
+#else /* HW_CRC32 */
+
+static bool crc32_hw_available(void)
+{
+    return false;
+}
+
+static uint32_t crc32_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    unreachable("CRC32 hardware stub should never be called");
+}
+
+#endif /* HW_CRC32 */
+
+static bool crc32_hw_available_cached(void)
+{
+    static bool initialised = false;
+    static bool hw_available;
+    if (!initialised) {
+        hw_available = crc32_hw_available();
+        initialised = true;
+    }
+    return hw_available;
+}
+
 /*
  * Update an existing hash value with extra bytes of data.
  */
 uint32_t crc32_update(uint32_t crc, ptrlen data)
 {
     const uint8_t *p = (const uint8_t *)data.ptr;
-    for (size_t len = data.len; len-- > 0 ;)
-        crc = crc32_shift_8(crc ^ *p++);
-    return crc;
+    size_t len = data.len;
+
+    if (len >= CRC32_HW_MIN && crc32_hw_available_cached()) {
+        size_t hwlen = len & ~(size_t)15;
+        crc = crc32_hw(crc, p, hwlen);
+        p += hwlen;
+        len -= hwlen;
+    }
+
+    return crc32_sw(crc, p, len);
 }
 
 /*
@@ -44,19 +44,30 @@
 
 #define CMP(a, b)       (memcmp(a, b, SSH_BLOCKSIZE))
 
-static const uint8_t ONE[4] = { 1, 0, 0, 0 };
-static const uint8_t ZERO[4] = { 0, 0, 0, 0 };
-
 struct crcda_ctx {
     uint16_t *h;
     uint32_t n;
+
+    /*
+     * shift[k][b] is the CRC state (b << 8k) multiplied by x^64, i.e.
+     * the effect of absorbing a whole block of zero bytes. Unlike
+     * sshcrc.c, it's fine to use lookup tables here, because the
+     * detector only ever hashes ciphertext (or rather, the pattern
+     * of which ciphertext blocks are equal).
+     */
+    uint32_t shift[4][256];
 };
 
 struct crcda_ctx *crcda_make_context(void)
 {
     struct crcda_ctx *ret = snew(struct crcda_ctx);
+    static const uint8_t zeroes[SSH_BLOCKSIZE];
     ret->h = NULL;
     ret->n = HASH_MINSIZE / HASH_ENTRYSIZE;
+    for (unsigned k = 0; k < 4; k++)
+        for (unsigned b = 0; b < 256; b++)
+            ret->shift[k][b] = crc32_update(
+                (uint32_t)b << (8 * k), make_ptrlen(zeroes, sizeof(zeroes)));
     return ret;
 }
 
@@ -69,32 +80,35 @@ void crcda_free_context(struct crcda_ctx *ctx)
     }
 }
 
-static void crc_update(uint32_t *a, const void *b)
+/*
+ * Absorb one 8-byte block into the CRC: either { 1, 0, 0, 0, 0, 0,
+ * 0, 0 } if bit is 1, or all zeroes if it's 0. By linearity that's
+ * the same as XORing bit into the bottom of the state and then
+ * shifting it along by 64 bits, which we can do with four lookups
+ * instead of eight byte-by-byte updates.
+ */
+static inline uint32_t crc_block(const struct crcda_ctx *ctx,
+                                 uint32_t crc, unsigned bit)
 {
-    *a = crc32_update(*a, make_ptrlen(b, 4));
+    crc ^= bit;
+    return (ctx->shift[0][crc & 0xFF] ^
+            ctx->shift[1][(crc >> 8) & 0xFF] ^
+            ctx->shift[2][(crc >> 16) & 0xFF] ^
+            ctx->shift[3][crc >> 24]);
 }
 
 /* detect if a block is used in a particular pattern */
-static bool check_crc(const uint8_t *S, const uint8_t *buf,
-                      uint32_t len, const uint8_t *IV)
+static bool check_crc(const struct crcda_ctx *ctx, const uint8_t *S,
+                      const uint8_t *buf, uint32_t len, const uint8_t *IV)
 {
     uint32_t crc;
     const uint8_t *c;
 
     crc = 0;
-    if (IV && !CMP(S, IV)) {
-        crc_update(&crc, ONE);
-        crc_update(&crc, ZERO);
-    }
-    for (c = buf; c < buf + len; c += SSH_BLOCKSIZE) {
-        if (!CMP(S, c)) {
-            crc_update(&crc, ONE);
-            crc_update(&crc, ZERO);
-        } else {
-            crc_update(&crc, ZERO);
-            crc_update(&crc, ZERO);
-        }
-    }
+    if (IV && !CMP(S, IV))
+        crc = crc_block(ctx, crc, 1);
+    for (c = buf; c < buf + len; c += SSH_BLOCKSIZE)
+        crc = crc_block(ctx, crc, !CMP(S, c));
     return (crc == 0);
 }
 
@@ -126,14 +140,14 @@ bool detect_attack(struct crcda_ctx *ctx,
     if (len <= HASH_MINBLOCKS) {
         for (c = buf; c < buf + len; c += SSH_BLOCKSIZE) {
             if (IV && (!CMP(c, IV))) {
-                if ((check_crc(c, buf, len, IV)))
+                if ((check_crc(ctx, c, buf, len, IV)))
                     return true;          /* attack detected */
                 else
                     break;
             }
             for (d = buf; d < c; d += SSH_BLOCKSIZE) {
                 if (!CMP(c, d)) {
-                    if ((check_crc(c, buf, len, IV)))
+                    if ((check_crc(ctx, c, buf, len, IV)))
                         return true;      /* attack detected */
                     else
                         break;
@@ -153,13 +167,13 @@ bool detect_attack(struct crcda_ctx *ctx,
             if (ctx->h[i] == HASH_IV) {
                 assert(IV); /* or we wouldn't have stored HASH_IV above */
                 if (!CMP(c, IV)) {
-                    if (check_crc(c, buf, len, IV))
+                    if (check_crc(ctx, c, buf, len, IV))
                         return true;      /* attack detected */
                     else
                         break;
                 }
             } else if (!CMP(c, buf + ctx->h[i] * SSH_BLOCKSIZE)) {
-                if (check_crc(c, buf, len, IV))
+                if (check_crc(ctx, c, buf, len, IV))
                     return true;          /* attack detected */
                 else
                     break;
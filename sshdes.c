@@ -619,6 +619,719 @@ static inline LR des_full_cipher(LR lr, const des_keysched *sched,
 #define ENCIPHER 0, 1                  /* for encryption */
 #define DECIPHER 15, -1                /* for decryption */
 
+/* ----------------------------------------------------------------------
+ * Bitsliced DES, for modes that can process many blocks at once (CBC
+ * decryption, and SDCTR in both directions).
+ *
+ * Here we run DES_BS_BLOCKS cipher blocks through the cipher in
+ * parallel, by transposing them so that each of 64 uint64_t words
+ * holds one bit position of every block. Then the bitwise operations
+ * of the cipher each act on all the blocks at once. That makes the
+ * permutations IP, E and P free, because they just change which word
+ * we take each bit from; and the S-boxes become fixed sequences of
+ * AND, OR, XOR and NOT, generated by test/desbitslice.py. Since
+ * nothing depends on the data except the values in the words, this
+ * is constant-time in the same way as the rest of this file.
+ *
+ * The S-boxes in this section are the ones in the official DES spec,
+ * because the bit shuffling that SGTDES does to suit des_S() above
+ * is no use here. But the key schedule is the same in both forms, so
+ * we take the 6 key bits for each S-box straight out of k7531 and
+ * k6420.
+ *
+ * The setup and the transposes cost about as much as a few blocks of
+ * the ordinary cipher, so this is only worth it if we have at least
+ * DES_BS_MIN_BLOCKS blocks to process.
+ */
+
+#define DES_BS_BLOCKS 64
+#define DES_BS_MIN_BLOCKS 4
+
+static inline void des_bs_sbox0(
+    uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3, uint64_t x4,
+    uint64_t x5, uint64_t *y0, uint64_t *y1, uint64_t *y2, uint64_t *y3)
+{
+    uint64_t t0 = ~x2;
+    uint64_t t1 = t0 ^ x1;
+    uint64_t t2 = t1 ^ (x3 & x1);
+    uint64_t t3 = t0 & t1;
+    uint64_t t4 = t3 ^ x3;
+    uint64_t t5 = t2 ^ (x4 & t4);
+    uint64_t t6 = t5 ^ x0;
+    uint64_t t7 = x2 ^ (x3 & t1);
+    uint64_t t8 = ~t3;
+    uint64_t t9 = t8 ^ (x3 & t0);
+    uint64_t t10 = t7 ^ (x4 & t9);
+    uint64_t t11 = ~t1;
+    uint64_t t12 = t11 & ~x3;
+    uint64_t t13 = x2 & x3;
+    uint64_t t14 = t12 ^ (x4 & t13);
+    uint64_t t15 = t10 ^ (x0 & t14);
+    uint64_t t16 = t6 ^ (x5 & t15);
+    uint64_t t17 = t0 | t11;
+    uint64_t t18 = t4 ^ (x4 & t17);
+    uint64_t t19 = t11 ^ (x3 & t8);
+    uint64_t t20 = x1 ^ x3;
+    uint64_t t21 = t19 ^ (x4 & t20);
+    uint64_t t22 = t18 ^ (x0 & t21);
+    uint64_t t23 = x1 | x3;
+    uint64_t t24 = t8 ^ t23;
+    uint64_t t25 = t23 ^ (x4 & t24);
+    uint64_t t26 = t3 | t12;
+    uint64_t t27 = t26 ^ (x4 & t12);
+    uint64_t t28 = t25 ^ (x0 & t27);
+    uint64_t t29 = t22 ^ (x5 & t28);
+    uint64_t t30 = t2 ^ t7;
+    uint64_t t31 = x3 ^ t9;
+    uint64_t t32 = t30 ^ (x4 & t31);
+    uint64_t t33 = t0 | t20;
+    uint64_t t34 = t1 ^ t13;
+    uint64_t t35 = t33 ^ (x4 & t34);
+    uint64_t t36 = t32 ^ (x0 & t35);
+    uint64_t t37 = t3 | t14;
+    uint64_t t38 = t25 ^ t37;
+    uint64_t t39 = t37 ^ (x0 & t38);
+    uint64_t t40 = t36 ^ (x5 & t39);
+    uint64_t t41 = t7 ^ t31;
+    uint64_t t42 = t41 ^ x4;
+    uint64_t t43 = ~t9;
+    uint64_t t44 = x4 & t43;
+    uint64_t t45 = t42 ^ (x0 & t44);
+    uint64_t t46 = t10 ^ t38;
+    uint64_t t47 = x1 & t2;
+    uint64_t t48 = t8 ^ (x4 & t47);
+    uint64_t t49 = t46 ^ (x0 & t48);
+    uint64_t t50 = t45 ^ (x5 & t49);
+    *y0 ^= t29;
+    *y1 ^= t50;
+    *y2 ^= t16;
+    *y3 ^= t40;
+}
+
+static inline void des_bs_sbox1(
+    uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3, uint64_t x4,
+    uint64_t x5, uint64_t *y0, uint64_t *y1, uint64_t *y2, uint64_t *y3)
+{
+    uint64_t t0 = ~x5;
+    uint64_t t1 = t0 | x0;
+    uint64_t t2 = t1 ^ x1;
+    uint64_t t3 = t2 ^ (x3 & x5);
+    uint64_t t4 = x0 ^ t0;
+    uint64_t t5 = x5 ^ t1;
+    uint64_t t6 = t4 ^ (x3 & t5);
+    uint64_t t7 = t3 ^ (x4 & t6);
+    uint64_t t8 = ~t4;
+    uint64_t t9 = x1 & t8;
+    uint64_t t10 = t0 ^ (x3 & t9);
+    uint64_t t11 = x0 & t0;
+    uint64_t t12 = t5 ^ (x1 & t11);
+    uint64_t t13 = t12 ^ (x3 & x5);
+    uint64_t t14 = t10 ^ (x4 & t13);
+    uint64_t t15 = t7 ^ (x2 & t14);
+    uint64_t t16 = x1 ^ t8;
+    uint64_t t17 = t16 ^ x3;
+    uint64_t t18 = t2 | t5;
+    uint64_t t19 = t18 ^ (x3 & t5);
+    uint64_t t20 = t17 ^ (x4 & t19);
+    uint64_t t21 = ~t5;
+    uint64_t t22 = t21 | x1;
+    uint64_t t23 = t22 | x3;
+    uint64_t t24 = x0 & t16;
+    uint64_t t25 = t23 ^ (x4 & t24);
+    uint64_t t26 = t20 ^ (x2 & t25);
+    uint64_t t27 = t1 & t16;
+    uint64_t t28 = t0 | t16;
+    uint64_t t29 = t27 ^ (x3 & t28);
+    uint64_t t30 = t8 ^ t28;
+    uint64_t t31 = x5 ^ (x3 & t30);
+    uint64_t t32 = t29 ^ (x4 & t31);
+    uint64_t t33 = x5 & t18;
+    uint64_t t34 = t24 ^ t27;
+    uint64_t t35 = t33 ^ (x3 & t34);
+    uint64_t t36 = x1 | t0;
+    uint64_t t37 = x0 ^ t1;
+    uint64_t t38 = t36 ^ (x3 & t37);
+    uint64_t t39 = t35 ^ (x4 & t38);
+    uint64_t t40 = t32 ^ (x2 & t39);
+    uint64_t t41 = t4 & t22;
+    uint64_t t42 = t2 ^ t27;
+    uint64_t t43 = t41 ^ (x3 & t42);
+    uint64_t t44 = t13 | t22;
+    uint64_t t45 = t43 ^ (x4 & t44);
+    uint64_t t46 = t12 ^ t22;
+    uint64_t t47 = x0 & t12;
+    uint64_t t48 = t46 ^ (x3 & t47);
+    uint64_t t49 = t33 | t34;
+    uint64_t t50 = t49 ^ (x3 & t11);
+    uint64_t t51 = t48 ^ (x4 & t50);
+    uint64_t t52 = t45 ^ (x2 & t51);
+    *y0 ^= t26;
+    *y1 ^= t52;
+    *y2 ^= t15;
+    *y3 ^= t40;
+}
+
+static inline void des_bs_sbox2(
+    uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3, uint64_t x4,
+    uint64_t x5, uint64_t *y0, uint64_t *y1, uint64_t *y2, uint64_t *y3)
+{
+    uint64_t t0 = ~x4;
+    uint64_t t1 = x4 ^ x5;
+    uint64_t t2 = t0 ^ (x3 & t1);
+    uint64_t t3 = ~x5;
+    uint64_t t4 = t3 | x3;
+    uint64_t t5 = t2 ^ (x1 & t4);
+    uint64_t t6 = x4 | t3;
+    uint64_t t7 = x5 ^ (x3 & t6);
+    uint64_t t8 = t7 | x1;
+    uint64_t t9 = t5 ^ (x0 & t8);
+    uint64_t t10 = x1 | x3;
+    uint64_t t11 = x5 | t0;
+    uint64_t t12 = t6 ^ (x3 & t11);
+    uint64_t t13 = x3 ^ t6;
+    uint64_t t14 = t12 ^ (x1 & t13);
+    uint64_t t15 = t10 ^ (x0 & t14);
+    uint64_t t16 = t9 ^ (x2 & t15);
+    uint64_t t17 = t0 ^ t7;
+    uint64_t t18 = t4 ^ t7;
+    uint64_t t19 = t17 ^ (x1 & t18);
+    uint64_t t20 = t5 | t6;
+    uint64_t t21 = t19 ^ (x0 & t20);
+    uint64_t t22 = ~t6;
+    uint64_t t23 = t22 ^ (x3 & t3);
+    uint64_t t24 = t0 ^ (x1 & t23);
+    uint64_t t25 = x3 & t18;
+    uint64_t t26 = t25 ^ (x1 & t1);
+    uint64_t t27 = t24 ^ (x0 & t26);
+    uint64_t t28 = t21 ^ (x2 & t27);
+    uint64_t t29 = t7 & t12;
+    uint64_t t30 = t7 & t11;
+    uint64_t t31 = t29 ^ (x1 & t30);
+    uint64_t t32 = x4 | t29;
+    uint64_t t33 = t4 ^ (x1 & t32);
+    uint64_t t34 = t31 ^ (x0 & t33);
+    uint64_t t35 = x5 | t33;
+    uint64_t t36 = x1 & t6;
+    uint64_t t37 = t35 ^ (x0 & t36);
+    uint64_t t38 = t34 ^ (x2 & t37);
+    uint64_t t39 = x5 ^ (x3 & t0);
+    uint64_t t40 = x5 ^ t4;
+    uint64_t t41 = t39 ^ (x1 & t40);
+    uint64_t t42 = t13 ^ t18;
+    uint64_t t43 = t41 ^ (x0 & t42);
+    uint64_t t44 = t1 ^ t30;
+    uint64_t t45 = x3 | x5;
+    uint64_t t46 = t44 ^ (x1 & t45);
+    uint64_t t47 = t6 & t30;
+    uint64_t t48 = t0 ^ t23;
+    uint64_t t49 = t47 ^ (x1 & t48);
+    uint64_t t50 = t46 ^ (x0 & t49);
+    uint64_t t51 = t43 ^ (x2 & t50);
+    *y0 ^= t51;
+    *y1 ^= t38;
+    *y2 ^= t28;
+    *y3 ^= t16;
+}
+
+static inline void des_bs_sbox3(
+    uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3, uint64_t x4,
+    uint64_t x5, uint64_t *y0, uint64_t *y1, uint64_t *y2, uint64_t *y3)
+{
+    uint64_t t0 = ~x5;
+    uint64_t t1 = x3 & t0;
+    uint64_t t2 = x3 | x5;
+    uint64_t t3 = t1 ^ (x0 & t2);
+    uint64_t t4 = x0 | x3;
+    uint64_t t5 = t3 ^ (x1 & t4);
+    uint64_t t6 = x5 ^ (x0 & t1);
+    uint64_t t7 = ~t2;
+    uint64_t t8 = t7 ^ (x0 & t1);
+    uint64_t t9 = t6 ^ (x1 & t8);
+    uint64_t t10 = t5 ^ (x2 & t9);
+    uint64_t t11 = x3 ^ t2;
+    uint64_t t12 = t11 | x0;
+    uint64_t t13 = ~t11;
+    uint64_t t14 = t7 ^ (x0 & t13);
+    uint64_t t15 = t12 ^ (x1 & t14);
+    uint64_t t16 = x0 ^ t13;
+    uint64_t t17 = x0 ^ x5;
+    uint64_t t18 = t16 ^ (x1 & t17);
+    uint64_t t19 = t15 ^ (x2 & t18);
+    uint64_t t20 = t10 ^ (x4 & t19);
+    uint64_t t21 = t4 ^ t14;
+    uint64_t t22 = x5 | t14;
+    uint64_t t23 = t21 ^ (x1 & t22);
+    uint64_t t24 = x0 ^ t8;
+    uint64_t t25 = t24 ^ (x1 & t8);
+    uint64_t t26 = t23 ^ (x2 & t25);
+    uint64_t t27 = t6 ^ t21;
+    uint64_t t28 = t16 & t22;
+    uint64_t t29 = t27 ^ (x1 & t28);
+    uint64_t t30 = ~t24;
+    uint64_t t31 = t0 | t17;
+    uint64_t t32 = t30 ^ (x1 & t31);
+    uint64_t t33 = t29 ^ (x2 & t32);
+    uint64_t t34 = t26 ^ (x4 & t33);
+    uint64_t t35 = x5 ^ t4;
+    uint64_t t36 = t14 ^ t30;
+    uint64_t t37 = t35 ^ (x1 & t36);
+    uint64_t t38 = t11 | t21;
+    uint64_t t39 = t6 & t35;
+    uint64_t t40 = t38 ^ (x1 & t39);
+    uint64_t t41 = t37 ^ (x2 & t40);
+    uint64_t t42 = x3 ^ t3;
+    uint64_t t43 = t42 | x2;
+    uint64_t t44 = t41 ^ (x4 & t43);
+    uint64_t t45 = t7 ^ t28;
+    uint64_t t46 = t1 ^ t14;
+    uint64_t t47 = t45 ^ (x1 & t46);
+    uint64_t t48 = t4 & t30;
+    uint64_t t49 = t1 ^ t38;
+    uint64_t t50 = t48 ^ (x1 & t49);
+    uint64_t t51 = t47 ^ (x2 & t50);
+    uint64_t t52 = t5 | t36;
+    uint64_t t53 = t3 ^ t28;
+    uint64_t t54 = x0 | t0;
+    uint64_t t55 = t53 ^ (x1 & t54);
+    uint64_t t56 = t52 ^ (x2 & t55);
+    uint64_t t57 = t51 ^ (x4 & t56);
+    *y0 ^= t20;
+    *y1 ^= t34;
+    *y2 ^= t44;
+    *y3 ^= t57;
+}
+
+static inline void des_bs_sbox4(
+    uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3, uint64_t x4,
+    uint64_t x5, uint64_t *y0, uint64_t *y1, uint64_t *y2, uint64_t *y3)
+{
+    uint64_t t0 = ~x3;
+    uint64_t t1 = x1 | t0;
+    uint64_t t2 = t0 ^ (x5 & t1);
+    uint64_t t3 = x1 ^ x3;
+    uint64_t t4 = t3 | x5;
+    uint64_t t5 = t2 ^ (x4 & t4);
+    uint64_t t6 = ~x1;
+    uint64_t t7 = x3 ^ t4;
+    uint64_t t8 = t6 ^ (x4 & t7);
+    uint64_t t9 = t5 ^ (x2 & t8);
+    uint64_t t10 = ~t3;
+    uint64_t t11 = ~t1;
+    uint64_t t12 = t10 ^ (x5 & t11);
+    uint64_t t13 = t7 ^ (x4 & t12);
+    uint64_t t14 = x3 ^ t1;
+    uint64_t t15 = x1 ^ t14;
+    uint64_t t16 = t14 ^ (x5 & t15);
+    uint64_t t17 = t16 ^ (x4 & t3);
+    uint64_t t18 = t13 ^ (x2 & t17);
+    uint64_t t19 = t9 ^ (x0 & t18);
+    uint64_t t20 = t9 ^ t18;
+    uint64_t t21 = ~t18;
+    uint64_t t22 = t20 ^ (x0 & t21);
+    uint64_t t23 = x3 ^ t16;
+    uint64_t t24 = t23 ^ (x4 & t0);
+    uint64_t t25 = x1 ^ t4;
+    uint64_t t26 = x1 ^ (x4 & t25);
+    uint64_t t27 = t24 ^ (x2 & t26);
+    uint64_t t28 = ~t15;
+    uint64_t t29 = t3 ^ (x5 & t28);
+    uint64_t t30 = x5 | t15;
+    uint64_t t31 = t29 ^ (x4 & t30);
+    uint64_t t32 = t2 ^ t3;
+    uint64_t t33 = t32 ^ (x4 & t3);
+    uint64_t t34 = t31 ^ (x2 & t33);
+    uint64_t t35 = t27 ^ (x0 & t34);
+    uint64_t t36 = x5 ^ t28;
+    uint64_t t37 = x3 | t29;
+    uint64_t t38 = t36 ^ (x4 & t37);
+    uint64_t t39 = t26 ^ t33;
+    uint64_t t40 = t38 ^ (x2 & t39);
+    uint64_t t41 = ~t34;
+    uint64_t t42 = t40 ^ (x0 & t41);
+    *y0 ^= t19;
+    *y1 ^= t22;
+    *y2 ^= t35;
+    *y3 ^= t42;
+}
+
+static inline void des_bs_sbox5(
+    uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3, uint64_t x4,
+    uint64_t x5, uint64_t *y0, uint64_t *y1, uint64_t *y2, uint64_t *y3)
+{
+    uint64_t t0 = x0 ^ x4;
+    uint64_t t1 = t0 ^ (x3 & x1);
+    uint64_t t2 = ~x1;
+    uint64_t t3 = t2 & ~x4;
+    uint64_t t4 = x1 | t3;
+    uint64_t t5 = t3 ^ (x0 & t4);
+    uint64_t t6 = t3 ^ (x0 & x4);
+    uint64_t t7 = t5 ^ (x3 & t6);
+    uint64_t t8 = t1 ^ (x5 & t7);
+    uint64_t t9 = x0 ^ x1;
+    uint64_t t10 = x0 & x4;
+    uint64_t t11 = t9 ^ (x3 & t10);
+    uint64_t t12 = t2 ^ (x5 & t11);
+    uint64_t t13 = t8 ^ (x2 & t12);
+    uint64_t t14 = t5 ^ t10;
+    uint64_t t15 = x1 ^ x4;
+    uint64_t t16 = t15 | x0;
+    uint64_t t17 = t14 ^ (x3 & t16);
+    uint64_t t18 = t5 ^ t15;
+    uint64_t t19 = x1 & t9;
+    uint64_t t20 = t18 ^ (x3 & t19);
+    uint64_t t21 = t17 ^ (x5 & t20);
+    uint64_t t22 = x1 | t14;
+    uint64_t t23 = ~t16;
+    uint64_t t24 = t22 ^ (x3 & t23);
+    uint64_t t25 = ~t15;
+    uint64_t t26 = t25 ^ (x0 & t3);
+    uint64_t t27 = x1 ^ t16;
+    uint64_t t28 = t26 ^ (x3 & t27);
+    uint64_t t29 = t24 ^ (x5 & t28);
+    uint64_t t30 = t21 ^ (x2 & t29);
+    uint64_t t31 = ~t18;
+    uint64_t t32 = x0 ^ t5;
+    uint64_t t33 = t31 ^ (x3 & t32);
+    uint64_t t34 = x0 | t4;
+    uint64_t t35 = t34 | x3;
+    uint64_t t36 = t33 ^ (x5 & t35);
+    uint64_t t37 = t16 ^ (x3 & x4);
+    uint64_t t38 = t15 ^ t19;
+    uint64_t t39 = t38 & ~x3;
+    uint64_t t40 = t37 ^ (x5 & t39);
+    uint64_t t41 = t36 ^ (x2 & t40);
+    uint64_t t42 = t0 ^ t14;
+    uint64_t t43 = t25 ^ (x3 & t42);
+    uint64_t t44 = ~t38;
+    uint64_t t45 = t0 ^ (x3 & t44);
+    uint64_t t46 = t43 ^ (x5 & t45);
+    uint64_t t47 = t0 | t19;
+    uint64_t t48 = t47 ^ (x3 & t44);
+    uint64_t t49 = t48 | x5;
+    uint64_t t50 = t46 ^ (x2 & t49);
+    *y0 ^= t13;
+    *y1 ^= t30;
+    *y2 ^= t41;
+    *y3 ^= t50;
+}
+
+static inline void des_bs_sbox6(
+    uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3, uint64_t x4,
+    uint64_t x5, uint64_t *y0, uint64_t *y1, uint64_t *y2, uint64_t *y3)
+{
+    uint64_t t0 = ~x0;
+    uint64_t t1 = t0 ^ x5;
+    uint64_t t2 = t1 ^ x1;
+    uint64_t t3 = t2 ^ x4;
+    uint64_t t4 = x0 | t1;
+    uint64_t t5 = t4 | ~x1;
+    uint64_t t6 = x0 ^ (x4 & t5);
+    uint64_t t7 = t3 ^ (x3 & t6);
+    uint64_t t8 = t0 | ~x1;
+    uint64_t t9 = x0 ^ t5;
+    uint64_t t10 = t8 ^ (x4 & t9);
+    uint64_t t11 = ~t8;
+    uint64_t t12 = t10 ^ (x3 & t11);
+    uint64_t t13 = t7 ^ (x2 & t12);
+    uint64_t t14 = x0 & x5;
+    uint64_t t15 = t4 ^ (x1 & t14);
+    uint64_t t16 = t1 ^ t5;
+    uint64_t t17 = t15 ^ (x4 & t16);
+    uint64_t t18 = x0 ^ t4;
+    uint64_t t19 = t18 ^ (x1 & t4);
+    uint64_t t20 = x5 | t0;
+    uint64_t t21 = t14 ^ (x1 & t20);
+    uint64_t t22 = t19 ^ (x4 & t21);
+    uint64_t t23 = t17 ^ (x3 & t22);
+    uint64_t t24 = x5 | t8;
+    uint64_t t25 = t14 | t21;
+    uint64_t t26 = t24 ^ (x4 & t25);
+    uint64_t t27 = t23 ^ (x2 & t26);
+    uint64_t t28 = t2 | t11;
+    uint64_t t29 = t1 ^ t15;
+    uint64_t t30 = t28 ^ (x4 & t29);
+    uint64_t t31 = t10 | t16;
+    uint64_t t32 = t30 ^ (x3 & t31);
+    uint64_t t33 = x1 & t4;
+    uint64_t t34 = t33 | x4;
+    uint64_t t35 = t32 ^ (x2 & t34);
+    uint64_t t36 = x0 ^ t28;
+    uint64_t t37 = t1 | t36;
+    uint64_t t38 = t36 ^ (x4 & t37);
+    uint64_t t39 = x1 | x5;
+    uint64_t t40 = t39 ^ (x4 & t16);
+    uint64_t t41 = t38 ^ (x3 & t40);
+    uint64_t t42 = t9 | t15;
+    uint64_t t43 = t9 ^ t37;
+    uint64_t t44 = t42 ^ (x4 & t43);
+    uint64_t t45 = t2 & t19;
+    uint64_t t46 = t45 ^ (x4 & x5);
+    uint64_t t47 = t44 ^ (x3 & t46);
+    uint64_t t48 = t41 ^ (x2 & t47);
+    *y0 ^= t27;
+    *y1 ^= t48;
+    *y2 ^= t13;
+    *y3 ^= t35;
+}
+
+static inline void des_bs_sbox7(
+    uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3, uint64_t x4,
+    uint64_t x5, uint64_t *y0, uint64_t *y1, uint64_t *y2, uint64_t *y3)
+{
+    uint64_t t0 = ~x4;
+    uint64_t t1 = t0 ^ x0;
+    uint64_t t2 = t1 ^ x1;
+    uint64_t t3 = x0 & x4;
+    uint64_t t4 = t3 | ~x1;
+    uint64_t t5 = t2 ^ (x5 & t4);
+    uint64_t t6 = t0 ^ t4;
+    uint64_t t7 = t0 ^ (x5 & t6);
+    uint64_t t8 = t5 ^ (x3 & t7);
+    uint64_t t9 = x0 & x1;
+    uint64_t t10 = t0 & t1;
+    uint64_t t11 = t10 ^ (x1 & x4);
+    uint64_t t12 = t9 ^ (x5 & t11);
+    uint64_t t13 = x1 ^ t10;
+    uint64_t t14 = t2 ^ (x5 & t13);
+    uint64_t t15 = t12 ^ (x3 & t14);
+    uint64_t t16 = t8 ^ (x2 & t15);
+    uint64_t t17 = t9 | t10;
+    uint64_t t18 = ~t10;
+    uint64_t t19 = t18 ^ (x1 & t0);
+    uint64_t t20 = t17 ^ (x5 & t19);
+    uint64_t t21 = ~t3;
+    uint64_t t22 = ~x0;
+    uint64_t t23 = t21 ^ (x1 & t22);
+    uint64_t t24 = x0 | t0;
+    uint64_t t25 = t24 ^ (x1 & t18);
+    uint64_t t26 = t23 ^ (x5 & t25);
+    uint64_t t27 = t20 ^ (x3 & t26);
+    uint64_t t28 = ~t4;
+    uint64_t t29 = t19 ^ (x5 & t28);
+    uint64_t t30 = x0 ^ t9;
+    uint64_t t31 = x0 ^ t17;
+    uint64_t t32 = t30 ^ (x5 & t31);
+    uint64_t t33 = t29 ^ (x3 & t32);
+    uint64_t t34 = t27 ^ (x2 & t33);
+    uint64_t t35 = x4 | t2;
+    uint64_t t36 = t2 | t30;
+    uint64_t t37 = t35 ^ (x5 & t36);
+    uint64_t t38 = x4 & t23;
+    uint64_t t39 = t19 ^ (x5 & t38);
+    uint64_t t40 = t37 ^ (x3 & t39);
+    uint64_t t41 = t36 ^ (x5 & t38);
+    uint64_t t42 = t31 ^ t32;
+    uint64_t t43 = t41 ^ (x3 & t42);
+    uint64_t t44 = t40 ^ (x2 & t43);
+    uint64_t t45 = t6 & t23;
+    uint64_t t46 = t11 ^ t36;
+    uint64_t t47 = t45 ^ (x5 & t46);
+    uint64_t t48 = x1 | t3;
+    uint64_t t49 = ~t6;
+    uint64_t t50 = t48 ^ (x5 & t49);
+    uint64_t t51 = t47 ^ (x3 & t50);
+    uint64_t t52 = t2 ^ t19;
+    uint64_t t53 = t3 ^ t35;
+    uint64_t t54 = t52 ^ (x5 & t53);
+    uint64_t t55 = t12 & t49;
+    uint64_t t56 = t54 ^ (x3 & t55);
+    uint64_t t57 = t51 ^ (x2 & t56);
+    *y0 ^= t57;
+    *y1 ^= t44;
+    *y2 ^= t34;
+    *y3 ^= t16;
+}
+
+static inline uint64_t des_bs_keybit(uint32_t k, unsigned sbox, unsigned bit)
+{
+    return -(uint64_t)(1 & (k >> (2 + 8 * (sbox >> 1) + bit)));
+}
+
+/*
+ * The bitsliced form of des_f: XOR f(R) into L.
+ */
+static inline void des_bs_f(uint64_t *l, const uint64_t *r,
+                            uint32_t k7531, uint32_t k6420)
+{
+#define DES_BS_SBOX(j, k, i, y0, y1, y2, y3) des_bs_sbox##j(     \
+        r[(i+0) & 31] ^ des_bs_keybit(k, j, 0),                 \
+        r[(i+1) & 31] ^ des_bs_keybit(k, j, 1),                 \
+        r[(i+2) & 31] ^ des_bs_keybit(k, j, 2),                 \
+        r[(i+3) & 31] ^ des_bs_keybit(k, j, 3),                 \
+        r[(i+4) & 31] ^ des_bs_keybit(k, j, 4),                 \
+        r[(i+5) & 31] ^ des_bs_keybit(k, j, 5),                 \
+        &l[y0], &l[y1], &l[y2], &l[y3])
+
+    DES_BS_SBOX(0, k6420, 31, 11, 17,  5, 27);
+    DES_BS_SBOX(1, k7531,  3, 25, 10, 20,  0);
+    DES_BS_SBOX(2, k6420,  7, 13, 21,  3, 28);
+    DES_BS_SBOX(3, k7531, 11, 29,  7, 18, 24);
+    DES_BS_SBOX(4, k6420, 15, 31, 22, 12,  6);
+    DES_BS_SBOX(5, k7531, 19, 26,  2, 16,  8);
+    DES_BS_SBOX(6, k6420, 23, 14, 30,  4, 19);
+    DES_BS_SBOX(7, k7531, 27,  1,  9, 15, 23);
+
+#undef DES_BS_SBOX
+}
+
+/*
+ * The 16 rounds of DES, on L and R in place. Like des_inner_cipher,
+ * the output has its halves swapped: the output L is left in the
+ * array R, and vice versa.
+ */
+static void des_bs_inner_cipher(uint64_t *L, uint64_t *R,
+                                const des_keysched *sched,
+                                size_t start, size_t step)
+{
+    for (size_t i = 0; i < 16; i += 2) {
+        size_t r0 = start + i*step, r1 = start + (i+1)*step;
+        des_bs_f(L, R, sched->k7531[r0], sched->k6420[r0]);
+        des_bs_f(R, L, sched->k7531[r1], sched->k6420[r1]);
+    }
+}
+
+/*
+ * Transpose a 64x64 bit matrix, so that bit j of x[i] swaps with bit
+ * i of x[j].
+ */
+static void des_bs_transpose(uint64_t *x)
+{
+    uint64_t mask = 0x00000000FFFFFFFF;
+    for (unsigned d = 32; d; d >>= 1, mask ^= mask << d) {
+        for (unsigned i = 0; i < 64; i = ((i | d) + 1) & ~d) {
+            uint64_t diff = (x[i] ^ (x[i | d] << d)) & ~mask;
+            x[i] ^= diff;
+            x[i | d] ^= diff >> d;
+        }
+    }
+}
+
+/*
+ * des_bs_IP[i] is the bit of an input block (numbered from the least
+ * significant end, after loading it with GET_64BIT_MSB_FIRST) that
+ * the official IP moves to bit i. So bit i of R, and bit i of L, come
+ * from des_bs_IP[i] and des_bs_IP[32+i] respectively; and FP, being
+ * the inverse, sends them back there.
+ */
+static const uint8_t des_bs_IP[64] = {
+    57, 49, 41, 33, 25, 17,  9,  1, 59, 51, 43, 35, 27, 19, 11,  3,
+    61, 53, 45, 37, 29, 21, 13,  5, 63, 55, 47, 39, 31, 23, 15,  7,
+    56, 48, 40, 32, 24, 16,  8,  0, 58, 50, 42, 34, 26, 18, 10,  2,
+    60, 52, 44, 36, 28, 20, 12,  4, 62, 54, 46, 38, 30, 22, 14,  6,
+};
+
+typedef struct des_bs_blocks des_bs_blocks;
+struct des_bs_blocks {
+    uint64_t L[32], R[32];
+};
+
+/* Load n <= DES_BS_BLOCKS blocks (the rest are zero) and apply IP */
+static void des_bs_load(des_bs_blocks *bs, const uint64_t *blocks, size_t n)
+{
+    uint64_t x[64];
+    for (size_t i = 0; i < 64; i++)
+        x[i] = i < n ? blocks[i] : 0;
+    des_bs_transpose(x);
+    for (size_t i = 0; i < 32; i++) {
+        bs->R[i] = x[des_bs_IP[i]];
+        bs->L[i] = x[des_bs_IP[32+i]];
+    }
+    smemclr(x, sizeof(x));
+}
+
+/* Apply FP, to L and R given separately, and retrieve the blocks */
+static void des_bs_store(uint64_t *blocks, const uint64_t *L,
+                         const uint64_t *R)
+{
+    for (size_t i = 0; i < 32; i++) {
+        blocks[des_bs_IP[i]] = R[i];
+        blocks[des_bs_IP[32+i]] = L[i];
+    }
+    des_bs_transpose(blocks);
+}
+
+/*
+ * Run up to DES_BS_BLOCKS blocks through single DES, or triple DES in
+ * EDE or DED order, in place. Each block is a 64-bit integer, loaded
+ * from the wire with GET_64BIT_MSB_FIRST.
+ */
+static void des_bs_cipher(uint64_t *blocks, size_t n,
+                          const des_keysched *sched, size_t start, size_t step)
+{
+    des_bs_blocks bs;
+    des_bs_load(&bs, blocks, n);
+    des_bs_inner_cipher(bs.L, bs.R, sched, start, step);
+    des_bs_store(blocks, bs.R, bs.L);
+    smemclr(&bs, sizeof(bs));
+}
+
+static void des3_bs_encipher(uint64_t *blocks, size_t n,
+                             const des_keysched *sched)
+{
+    des_bs_blocks bs;
+    des_bs_load(&bs, blocks, n);
+    des_bs_inner_cipher(bs.L, bs.R, &sched[0], ENCIPHER);
+    des_bs_inner_cipher(bs.R, bs.L, &sched[1], DECIPHER);
+    des_bs_inner_cipher(bs.L, bs.R, &sched[2], ENCIPHER);
+    des_bs_store(blocks, bs.R, bs.L);
+    smemclr(&bs, sizeof(bs));
+}
+
+static void des3_bs_decipher(uint64_t *blocks, size_t n,
+                             const des_keysched *sched)
+{
+    des_bs_blocks bs;
+    des_bs_load(&bs, blocks, n);
+    des_bs_inner_cipher(bs.L, bs.R, &sched[2], DECIPHER);
+    des_bs_inner_cipher(bs.R, bs.L, &sched[1], ENCIPHER);
+    des_bs_inner_cipher(bs.L, bs.R, &sched[0], DECIPHER);
+    des_bs_store(blocks, bs.R, bs.L);
+    smemclr(&bs, sizeof(bs));
+}
+
+static void des_bs_decipher(uint64_t *blocks, size_t n,
+                            const des_keysched *sched)
+{
+    des_bs_cipher(blocks, n, sched, DECIPHER);
+}
+
+/*
+ * CBC-decrypt as much of a buffer as is worth doing in bitsliced
+ * form, given a function to decipher a batch of blocks. Returns the
+ * number of bytes it dealt with, leaving the rest to the caller.
+ */
+static int des_bs_cbc_decrypt(
+    uint8_t *data, int len, LR *iv, const des_keysched *sched,
+    void (*decipher)(uint64_t *, size_t, const des_keysched *))
+{
+    uint64_t blocks[DES_BS_BLOCKS];
+    uint64_t prev = ((uint64_t)iv->L << 32) | iv->R;
+    int done = 0;
+
+    while (len - done >= 8 * DES_BS_MIN_BLOCKS) {
+        size_t n = (len - done) / 8;
+        if (n > DES_BS_BLOCKS)
+            n = DES_BS_BLOCKS;
+        uint8_t *p = data + done;
+
+        for (size_t i = 0; i < n; i++)
+            blocks[i] = GET_64BIT_MSB_FIRST(p + 8*i);
+        decipher(blocks, n, sched);
+        for (size_t i = 0; i < n; i++) {
+            uint64_t ciphertext = GET_64BIT_MSB_FIRST(p + 8*i);
+            PUT_64BIT_MSB_FIRST(p + 8*i, blocks[i] ^ prev);
+            prev = ciphertext;
+        }
+
+        done += 8 * n;
+    }
+
+    iv->L = prev >> 32;
+    iv->R = (uint32_t)prev;
+    smemclr(blocks, sizeof(blocks));
+    return done;
+}
+
 /* ----------------------------------------------------------------------
  * Single-DES
  */
@@ -673,6 +1386,10 @@ static void des_cbc_decrypt(ssh_cipher *ciph, void *vdata, int len)
 {
     struct des_cbc_ctx *ctx = container_of(ciph, struct des_cbc_ctx, ciph);
     uint8_t *data = (uint8_t *)vdata;
+    int done = des_bs_cbc_decrypt(data, len, &ctx->iv, &ctx->sched,
+                                  des_bs_decipher);
+    data += done;
+    len -= done;
     for (; len > 0; len -= 8, data += 8) {
         LR ciphertext = des_load_lr(data);
         LR cipher_out = des_full_cipher(ciphertext, &ctx->sched, DECIPHER);
@@ -785,6 +1502,10 @@ static void des3_cbc1_cbc_decrypt(ssh_cipher *ciph, void *vdata, int len)
 {
     struct des3_cbc1_ctx *ctx = container_of(ciph, struct des3_cbc1_ctx, ciph);
     uint8_t *data = (uint8_t *)vdata;
+    int done = des_bs_cbc_decrypt(data, len, &ctx->iv, ctx->sched,
+                                  des3_bs_decipher);
+    data += done;
+    len -= done;
     for (; len > 0; len -= 8, data += 8) {
         LR ciphertext = des_load_lr(data);
 
@@ -872,6 +1593,35 @@ static void des3_sdctr_encrypt_decrypt(ssh_cipher *ciph, void *vdata, int len)
         ciph, struct des3_sdctr_ctx, ciph);
     uint8_t *data = (uint8_t *)vdata;
     uint8_t iv_buf[8];
+
+    /* Encrypt runs of counter values in bitsliced form, if there are
+     * enough of them. */
+    uint64_t blocks[DES_BS_BLOCKS];
+    while (len >= 8 * DES_BS_MIN_BLOCKS) {
+        size_t n = len / 8;
+        if (n > DES_BS_BLOCKS)
+            n = DES_BS_BLOCKS;
+
+        for (size_t i = 0; i < n; i++) {
+            for (unsigned j = 0; j < SDCTR_WORDS; j++)
+                PUT_BIGNUMINT_MSB_FIRST(
+                    iv_buf + 8 - BIGNUM_INT_BYTES - j*BIGNUM_INT_BYTES,
+                    ctx->counter[j]);
+            blocks[i] = GET_64BIT_MSB_FIRST(iv_buf);
+
+            BignumCarry carry = 1;
+            for (unsigned j = 0; j < SDCTR_WORDS; j++)
+                BignumADC(ctx->counter[j], carry, ctx->counter[j], 0, carry);
+        }
+
+        des3_bs_encipher(blocks, n, ctx->sched);
+
+        for (size_t i = 0; i < n; i++, data += 8)
+            PUT_64BIT_MSB_FIRST(data, GET_64BIT_MSB_FIRST(data) ^ blocks[i]);
+        len -= 8 * n;
+    }
+    smemclr(blocks, sizeof(blocks));
+
     for (; len > 0; len -= 8, data += 8) {
         /* Format the counter value into the buffer. */
         for (unsigned i = 0; i < SDCTR_WORDS; i++)
@@ -173,6 +173,30 @@ int dh_modulus_bit_size(const dh_ctx *ctx)
     return mp_get_nbits(ctx->p);
 }
 
+/*
+ * Choose the size of private exponent to pass to dh_create_e, given
+ * the strength in bits that the negotiated ciphers want. Normally
+ * that's simply twice their strength. In short-exponent mode we also
+ * cap it at twice the strength of the group itself, as estimated in
+ * NIST SP 800-57 part 1 table 2 (and as SP 800-56A suggests for the
+ * exponent), since a longer one can't make the key exchange as a
+ * whole any stronger, only slower.
+ */
+int dh_exponent_bits(const dh_ctx *ctx, int nbits, bool short_exponent)
+{
+    int xbits = nbits * 2;
+
+    if (short_exponent) {
+        int pbits = dh_modulus_bit_size(ctx);
+        int strength = (pbits < 2048 ? 80 : pbits < 3072 ? 112 :
+                        pbits < 7680 ? 128 : pbits < 15360 ? 192 : 256);
+        if (xbits > 2 * strength)
+            xbits = 2 * strength;
+    }
+
+    return xbits;
+}
+
 /*
  * Clean up and free a context.
  */
@@ -208,6 +232,8 @@ void dh_cleanup(dh_ctx *ctx)
  */
 mp_int *dh_create_e(dh_ctx *ctx, int nbits)
 {
+    mp_scratch_begin();
+
     /*
      * Lower limit is just 2.
      */
@@ -237,6 +263,7 @@ mp_int *dh_create_e(dh_ctx *ctx, int nbits)
      */
     ctx->e = mp_modpow(ctx->g, ctx->x, ctx->p);
 
+    mp_scratch_end();
     return ctx->e;
 }
 
@@ -268,5 +295,8 @@ const char *dh_validate_f(dh_ctx *ctx, mp_int *f)
  */
 mp_int *dh_find_K(dh_ctx *ctx, mp_int *f)
 {
-    return mp_modpow(f, ctx->x, ctx->p);
+    mp_scratch_begin();
+    mp_int *K = mp_modpow(f, ctx->x, ctx->p);
+    mp_scratch_end();
+    return K;
 }
@@ -165,8 +165,11 @@ static bool dss_verify(ssh_key *key, ptrlen sig, ptrlen data)
 
     /*
      * Step 1. w <- s^-1 mod q.
+     *
+     * (Everything in signature verification is public, so we use the
+     * variable-time arithmetic functions throughout.)
      */
-    mp_int *w = mp_invert(s, dss->q);
+    mp_int *w = mp_invert_vartime(s, dss->q);
     if (!w) {
         mp_free(r);
         mp_free(s);
@@ -188,8 +191,8 @@ static bool dss_verify(ssh_key *key, ptrlen sig, ptrlen data)
     /*
      * Step 4. v <- (g^u1 * y^u2 mod p) mod q.
      */
-    mp_int *gu1p = mp_modpow(dss->g, u1, dss->p);
-    mp_int *yu2p = mp_modpow(dss->y, u2, dss->p);
+    mp_int *gu1p = mp_modpow_vartime(dss->g, u1, dss->p);
+    mp_int *yu2p = mp_modpow_vartime(dss->y, u2, dss->p);
     mp_int *gu1yu2p = mp_modmul(gu1p, yu2p, dss->p);
     mp_int *v = mp_mod(gu1yu2p, dss->q);
 
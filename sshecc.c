@@ -62,6 +62,7 @@ static void initialise_wcurve(
     curve->w.wc = ecc_weierstrass_curve(p, a, b, nonsquare);
 
     curve->w.G = ecc_weierstrass_point_new(curve->w.wc, G_x, G_y);
+    curve->w.G_table = ecc_weierstrass_table_new(curve->w.G);
     curve->w.G_order = mp_copy(G_order);
 }
 
@@ -90,6 +91,7 @@ static void initialise_ecurve(
     curve->e.log2_cofactor = log2_cofactor;
 
     curve->e.G = ecc_edwards_point_new(curve->e.ec, G_x, G_y);
+    curve->e.G_table = ecc_edwards_table_new(curve->e.G);
     curve->e.G_order = mp_copy(G_order);
 }
 
@@ -346,8 +348,8 @@ WeierstrassPoint *ecdsa_public(mp_int *private_key, const ssh_keyalg *alg)
     assert(curve->type == EC_WEIERSTRASS);
 
     mp_int *priv_reduced = mp_mod(private_key, curve->p);
-    WeierstrassPoint *toret = ecc_weierstrass_multiply(
-        curve->w.G, priv_reduced);
+    WeierstrassPoint *toret = ecc_weierstrass_table_multiply(
+        curve->w.G_table, priv_reduced);
     mp_free(priv_reduced);
     return toret;
 }
@@ -394,7 +396,7 @@ EdwardsPoint *eddsa_public(mp_int *private_key, const ssh_keyalg *alg)
     mp_int *exponent = eddsa_exponent_from_hash(
         make_ptrlen(hash, extra->hash->hlen), curve);
 
-    EdwardsPoint *toret = ecc_edwards_multiply(curve->e.G, exponent);
+    EdwardsPoint *toret = ecc_edwards_table_multiply(curve->e.G_table, exponent);
     mp_free(exponent);
 
     return toret;
@@ -997,11 +999,13 @@ static bool ecdsa_verify(ssh_key *key, ptrlen sig, ptrlen data)
     BinarySource_BARE_INIT_PL(src, sigstr);
 
     /* Extract the signature integers r,s */
+    mp_scratch_begin();
     mp_int *r = get_mp_ssh2(src);
     mp_int *s = get_mp_ssh2(src);
     if (get_err(src)) {
         mp_free(r);
         mp_free(s);
+        mp_scratch_end();
         return false;
     }
 
@@ -1015,19 +1019,17 @@ static bool ecdsa_verify(ssh_key *key, ptrlen sig, ptrlen data)
     /* Get the hash of the signed data, converted to an integer */
     mp_int *z = ecdsa_signing_exponent_from_data(ek->curve, extra, data);
 
-    /* Verify the signature integers against the hash */
-    mp_int *w = mp_invert(s, ek->curve->w.G_order);
+    /* Verify the signature integers against the hash. (All of this
+     * is public, so the inverse can be computed in variable time.) */
+    mp_int *w = mp_invert_vartime(s, ek->curve->w.G_order);
     mp_int *u1 = mp_modmul(z, w, ek->curve->w.G_order);
     mp_free(z);
     mp_int *u2 = mp_modmul(r, w, ek->curve->w.G_order);
     mp_free(w);
-    WeierstrassPoint *u1G = ecc_weierstrass_multiply(ek->curve->w.G, u1);
+    WeierstrassPoint *sum = ecc_weierstrass_multiply_sum_vartime(
+        ek->curve->w.G, u1, ek->publicKey, u2);
     mp_free(u1);
-    WeierstrassPoint *u2P = ecc_weierstrass_multiply(ek->publicKey, u2);
     mp_free(u2);
-    WeierstrassPoint *sum = ecc_weierstrass_add_general(u1G, u2P);
-    ecc_weierstrass_point_free(u1G);
-    ecc_weierstrass_point_free(u2P);
 
     mp_int *x;
     ecc_weierstrass_get_affine(sum, &x, NULL);
@@ -1039,6 +1041,7 @@ static bool ecdsa_verify(ssh_key *key, ptrlen sig, ptrlen data)
 
     mp_free(r);
     mp_free(s);
+    mp_scratch_end();
 
     return !invalid;
 }
@@ -1087,24 +1090,29 @@ static bool eddsa_verify(ssh_key *key, ptrlen sig, ptrlen data)
     if (get_err(src) || get_avail(src))
         return false;
 
+    mp_scratch_begin();
     EdwardsPoint *r = eddsa_decode(rstr, ek->curve);
-    if (!r)
+    if (!r) {
+        mp_scratch_end();
         return false;
+    }
     mp_int *s = mp_from_bytes_le(sstr);
 
     mp_int *H = eddsa_signing_exponent_from_data(ek, extra, rstr, data);
 
-    /* Verify that s*G == r + H*publicKey */
-    EdwardsPoint *lhs = ecc_edwards_multiply(ek->curve->e.G, s);
+    /* Verify that s*G == r + H*publicKey, by checking that
+     * s*G - H*publicKey == r. (Everything here is public, so this
+     * can be done in variable time.) */
+    EdwardsPoint *negpk = ecc_edwards_negate(ek->publicKey);
+    EdwardsPoint *lhs = ecc_edwards_multiply_sum_vartime(
+        ek->curve->e.G, s, negpk, H);
     mp_free(s);
-    EdwardsPoint *hpk = ecc_edwards_multiply(ek->publicKey, H);
     mp_free(H);
-    EdwardsPoint *rhs = ecc_edwards_add(r, hpk);
-    ecc_edwards_point_free(hpk);
-    unsigned valid = ecc_edwards_eq(lhs, rhs);
+    ecc_edwards_point_free(negpk);
+    unsigned valid = ecc_edwards_eq(lhs, r);
     ecc_edwards_point_free(lhs);
-    ecc_edwards_point_free(rhs);
     ecc_edwards_point_free(r);
+    mp_scratch_end();
 
     return valid;
 }
@@ -1117,6 +1125,7 @@ static void ecdsa_sign(ssh_key *key, ptrlen data,
         (const struct ecsign_extra *)ek->sshk.vt->extra;
     assert(ek->privateKey);
 
+    mp_scratch_begin();
     mp_int *z = ecdsa_signing_exponent_from_data(ek->curve, extra, data);
 
     /* Generate k between 1 and curve->n, using the same deterministic
@@ -1130,7 +1139,8 @@ static void ecdsa_sign(ssh_key *key, ptrlen data,
             ek->privateKey, digest, sizeof(digest));
     }
 
-    WeierstrassPoint *kG = ecc_weierstrass_multiply(ek->curve->w.G, k);
+    WeierstrassPoint *kG = ecc_weierstrass_table_multiply(
+        ek->curve->w.G_table, k);
     mp_int *x;
     ecc_weierstrass_get_affine(kG, &x, NULL);
     ecc_weierstrass_point_free(kG);
@@ -1160,6 +1170,7 @@ static void ecdsa_sign(ssh_key *key, ptrlen data,
 
     mp_free(r);
     mp_free(s);
+    mp_scratch_end();
 }
 
 static void eddsa_sign(ssh_key *key, ptrlen data,
@@ -1184,6 +1195,7 @@ static void eddsa_sign(ssh_key *key, ptrlen data,
      * First, we hash the private key integer (bare, little-endian)
      * into a hash generating 2*fieldBytes of output.
      */
+    mp_scratch_begin();
     unsigned char hash[MAX_HASH_LEN];
     ssh_hash *h = ssh_hash_new(extra->hash);
     for (size_t i = 0; i < ek->curve->fieldBytes; ++i)
@@ -1212,7 +1224,8 @@ static void eddsa_sign(ssh_key *key, ptrlen data,
         make_ptrlen(hash, extra->hash->hlen));
     mp_int *log_r = mp_mod(log_r_unreduced, ek->curve->e.G_order);
     mp_free(log_r_unreduced);
-    EdwardsPoint *r = ecc_edwards_multiply(ek->curve->e.G, log_r);
+    EdwardsPoint *r = ecc_edwards_table_multiply(
+        ek->curve->e.G_table, log_r);
 
     /*
      * Encode r now, because we'll need its encoding for the next
@@ -1245,6 +1258,7 @@ static void eddsa_sign(ssh_key *key, ptrlen data,
     for (size_t i = 0; i < ek->curve->fieldBytes; ++i)
         put_byte(bs, mp_get_byte(s, i));
     mp_free(s);
+    mp_scratch_end();
 }
 
 static const struct ecsign_extra sign_extra_ed25519 = {
@@ -1380,7 +1394,8 @@ const ssh_keyalg ssh_ecdsa_nistp521 = {
 
 struct eckex_extra {
     struct ec_curve *(*curve)(void);
-    void (*setup)(ecdh_key *dh);
+    void (*make_private)(ecdh_key *dh);
+    void (*make_public)(ecdh_key *dh);
     void (*cleanup)(ecdh_key *dh);
     void (*getpublic)(ecdh_key *dh, BinarySink *bs);
     mp_int *(*getkey)(ecdh_key *dh, ptrlen remoteKey);
@@ -1393,6 +1408,7 @@ struct ecdh_key {
     union {
         WeierstrassPoint *w_public;
         MontgomeryPoint *m_public;
+        unsigned char x25519_public[32];
     };
 };
 
@@ -1403,16 +1419,20 @@ const char *ssh_ecdhkex_curve_textname(const ssh_kex *kex)
     return curve->textname;
 }
 
-static void ssh_ecdhkex_w_setup(ecdh_key *dh)
+static void ssh_ecdhkex_w_make_private(ecdh_key *dh)
 {
     mp_int *one = mp_from_integer(1);
     dh->private = mp_random_in_range(one, dh->curve->w.G_order);
     mp_free(one);
+}
 
-    dh->w_public = ecc_weierstrass_multiply(dh->curve->w.G, dh->private);
+static void ssh_ecdhkex_w_make_public(ecdh_key *dh)
+{
+    dh->w_public = ecc_weierstrass_table_multiply(
+        dh->curve->w.G_table, dh->private);
 }
 
-static void ssh_ecdhkex_m_setup(ecdh_key *dh)
+static void ssh_ecdhkex_m_make_private(ecdh_key *dh)
 {
     strbuf *bytes = strbuf_new_nm();
     random_read(strbuf_append(bytes, dh->curve->fieldBytes),
@@ -1430,19 +1450,55 @@ static void ssh_ecdhkex_m_setup(ecdh_key *dh)
         mp_set_bit(dh->private, bit, 0);
 
     strbuf_free(bytes);
+}
 
+static void ssh_ecdhkex_m_make_public(ecdh_key *dh)
+{
     dh->m_public = ecc_montgomery_multiply(dh->curve->m.G, dh->private);
 }
 
-ecdh_key *ssh_ecdhkex_newkey(const ssh_kex *kex)
+#if ECC_HAVE_X25519
+/*
+ * Curve25519 can use the dedicated X25519 implementation in
+ * ecc25519.c, which is a lot faster than the generic Montgomery-curve
+ * code. It works on little-endian byte strings rather than mp_ints.
+ */
+static void ssh_ecdhkex_x25519_make_public(ecdh_key *dh)
+{
+    static const unsigned char basepoint[32] = { 9 };
+    unsigned char private[32];
+
+    for (size_t i = 0; i < 32; i++)
+        private[i] = mp_get_byte(dh->private, i);
+    ecc_x25519(dh->x25519_public, private, basepoint);
+    smemclr(private, sizeof(private));
+}
+#endif
+
+ecdh_key *ssh_ecdhkex_newkey_private(const ssh_kex *kex)
 {
     const struct eckex_extra *extra = (const struct eckex_extra *)kex->extra;
     const struct ec_curve *curve = extra->curve();
 
     ecdh_key *dh = snew(ecdh_key);
+    memset(dh, 0, sizeof(*dh));
     dh->extra = extra;
     dh->curve = curve;
-    dh->extra->setup(dh);
+    dh->extra->make_private(dh);
+    return dh;
+}
+
+void ssh_ecdhkex_finishkey(ecdh_key *dh)
+{
+    mp_scratch_begin();
+    dh->extra->make_public(dh);
+    mp_scratch_end();
+}
+
+ecdh_key *ssh_ecdhkex_newkey(const ssh_kex *kex)
+{
+    ecdh_key *dh = ssh_ecdhkex_newkey_private(kex);
+    ssh_ecdhkex_finishkey(dh);
     return dh;
 }
 
@@ -1460,6 +1516,13 @@ static void ssh_ecdhkex_m_getpublic(ecdh_key *dh, BinarySink *bs)
     mp_free(x);
 }
 
+#if ECC_HAVE_X25519
+static void ssh_ecdhkex_x25519_getpublic(ecdh_key *dh, BinarySink *bs)
+{
+    put_data(bs, dh->x25519_public, 32);
+}
+#endif
+
 void ssh_ecdhkex_getpublic(ecdh_key *dh, BinarySink *bs)
 {
     dh->extra->getpublic(dh, bs);
@@ -1541,20 +1604,64 @@ static mp_int *ssh_ecdhkex_m_getkey(ecdh_key *dh, ptrlen remoteKey)
     return x;
 }
 
+#if ECC_HAVE_X25519
+static mp_int *ssh_ecdhkex_x25519_getkey(ecdh_key *dh, ptrlen remoteKey)
+{
+    unsigned char private[32], remote[32], shared[32];
+
+    /* As in ssh_ecdhkex_m_getkey, only the low 255 bits of the
+     * other side's public value count. X25519 ignores bit 255 itself,
+     * and anything beyond 32 bytes is dropped here. */
+    memset(remote, 0, sizeof(remote));
+    memcpy(remote, remoteKey.ptr,
+           remoteKey.len < sizeof(remote) ? remoteKey.len : sizeof(remote));
+
+    for (size_t i = 0; i < 32; i++)
+        private[i] = mp_get_byte(dh->private, i);
+
+    ecc_x25519(shared, private, remote);
+
+    /* An all-zero output means the input was a point of small order,
+     * which is not a sensible Diffie-Hellman input value. */
+    unsigned char nonzero = 0;
+    for (size_t i = 0; i < 32; i++)
+        nonzero |= shared[i];
+
+    /* Same endianness swap as in ssh_ecdhkex_m_getkey. */
+    mp_int *x = nonzero ? mp_from_bytes_be(make_ptrlen(shared, 32)) : NULL;
+
+    smemclr(private, sizeof(private));
+    smemclr(shared, sizeof(shared));
+    return x;
+}
+#endif
+
 mp_int *ssh_ecdhkex_getkey(ecdh_key *dh, ptrlen remoteKey)
 {
-    return dh->extra->getkey(dh, remoteKey);
+    mp_scratch_begin();
+    mp_int *toret = dh->extra->getkey(dh, remoteKey);
+    mp_scratch_end();
+    return toret;
 }
 
 static void ssh_ecdhkex_w_cleanup(ecdh_key *dh)
 {
-    ecc_weierstrass_point_free(dh->w_public);
+    if (dh->w_public)
+        ecc_weierstrass_point_free(dh->w_public);
 }
 
 static void ssh_ecdhkex_m_cleanup(ecdh_key *dh)
 {
-    ecc_montgomery_point_free(dh->m_public);
+    if (dh->m_public)
+        ecc_montgomery_point_free(dh->m_public);
+}
+
+#if ECC_HAVE_X25519
+static void ssh_ecdhkex_x25519_cleanup(ecdh_key *dh)
+{
+    /* The public value is stored inline, so nothing to free */
 }
+#endif
 
 void ssh_ecdhkex_freekey(ecdh_key *dh)
 {
@@ -1565,10 +1672,19 @@ void ssh_ecdhkex_freekey(ecdh_key *dh)
 
 static const struct eckex_extra kex_extra_curve25519 = {
     ec_curve25519,
-    ssh_ecdhkex_m_setup,
+#if ECC_HAVE_X25519
+    ssh_ecdhkex_m_make_private,
+    ssh_ecdhkex_x25519_make_public,
+    ssh_ecdhkex_x25519_cleanup,
+    ssh_ecdhkex_x25519_getpublic,
+    ssh_ecdhkex_x25519_getkey,
+#else
+    ssh_ecdhkex_m_make_private,
+    ssh_ecdhkex_m_make_public,
     ssh_ecdhkex_m_cleanup,
     ssh_ecdhkex_m_getpublic,
     ssh_ecdhkex_m_getkey,
+#endif
 };
 const ssh_kex ssh_ec_kex_curve25519 = {
     "curve25519-sha256", NULL, KEXTYPE_ECDH,
@@ -1582,7 +1698,8 @@ const ssh_kex ssh_ec_kex_curve25519_libssh = {
 
 static const struct eckex_extra kex_extra_curve448 = {
     ec_curve448,
-    ssh_ecdhkex_m_setup,
+    ssh_ecdhkex_m_make_private,
+    ssh_ecdhkex_m_make_public,
     ssh_ecdhkex_m_cleanup,
     ssh_ecdhkex_m_getpublic,
     ssh_ecdhkex_m_getkey,
@@ -1594,7 +1711,8 @@ const ssh_kex ssh_ec_kex_curve448 = {
 
 static const struct eckex_extra kex_extra_nistp256 = {
     ec_p256,
-    ssh_ecdhkex_w_setup,
+    ssh_ecdhkex_w_make_private,
+    ssh_ecdhkex_w_make_public,
     ssh_ecdhkex_w_cleanup,
     ssh_ecdhkex_w_getpublic,
     ssh_ecdhkex_w_getkey,
@@ -1606,7 +1724,8 @@ const ssh_kex ssh_ec_kex_nistp256 = {
 
 static const struct eckex_extra kex_extra_nistp384 = {
     ec_p384,
-    ssh_ecdhkex_w_setup,
+    ssh_ecdhkex_w_make_private,
+    ssh_ecdhkex_w_make_public,
     ssh_ecdhkex_w_cleanup,
     ssh_ecdhkex_w_getpublic,
     ssh_ecdhkex_w_getkey,
@@ -1618,7 +1737,8 @@ const ssh_kex ssh_ec_kex_nistp384 = {
 
 static const struct eckex_extra kex_extra_nistp521 = {
     ec_p521,
-    ssh_ecdhkex_w_setup,
+    ssh_ecdhkex_w_make_private,
+    ssh_ecdhkex_w_make_public,
     ssh_ecdhkex_w_cleanup,
     ssh_ecdhkex_w_getpublic,
     ssh_ecdhkex_w_getkey,
@@ -56,6 +56,15 @@ struct ssh_gss_liblist {
 struct ssh_gss_liblist *ssh_gss_setup(Conf *conf);
 void ssh_gss_cleanup(struct ssh_gss_liblist *list);
 
+/*
+ * Versions of the above which keep the library list for the rest of
+ * the process once it's been set up, so that later SSH connections
+ * (and the cached credentials in the libraries) can reuse it. If
+ * 'reused' is non-NULL, it's set to say whether that happened.
+ */
+struct ssh_gss_liblist *ssh_gss_setup_cached(Conf *conf, bool *reused);
+void ssh_gss_cleanup_cached(struct ssh_gss_liblist *list);
+
 /*
  * Fills in buf with a string describing the GSSAPI mechanism in
  * use. buf->data is not dynamically allocated.
@@ -198,8 +207,35 @@ struct ssh_gss_library {
      * of some sort for cleanup time.
      */
     void *handle;
+
+    /*
+     * A credential handle kept by acquire_cred for reuse by later
+     * calls, or NULL, and when it was acquired. It belongs to the
+     * wrapper layer, which frees it in ssh_gss_cleanup.
+     */
+    void *cached_cred;
+    time_t cached_cred_time;
+};
+
+/*
+ * The steps of GSSAPI setup whose time we keep track of, so that the
+ * Event Log can say which one a slow start was waiting for.
+ */
+enum {
+    SSH_GSS_STEP_SETUP,                /* loading the libraries */
+    SSH_GSS_STEP_IMPORT_NAME,
+    SSH_GSS_STEP_ACQUIRE_CRED,
+    SSH_GSS_STEP_INIT_SEC_CONTEXT,
+    SSH_GSS_NSTEPS
 };
 
+/* Evaluate 'expr', adding the time it took to the given step */
+#define SSH_GSS_TIMED(gss, step, expr) do {                           \
+        unsigned long gss_timed_start = GETTICKCOUNT();               \
+        expr;                                                         \
+        (gss)->step_ticks[step] += GETTICKCOUNT() - gss_timed_start;  \
+    } while (0)
+
 /*
  * State that has to be shared between all GSSAPI-using parts of the
  * same SSH connection, in particular between GSS key exchange and the
@@ -210,8 +246,15 @@ struct ssh_connection_shared_gss_state {
     struct ssh_gss_library *lib;
     Ssh_gss_name srv_name;
     Ssh_gss_ctx ctx;
+    unsigned long step_ticks[SSH_GSS_NSTEPS];
 };
 
+/*
+ * Describe the time spent in each step so far, and which took the
+ * longest, for the Event Log. Returns a dynamically allocated string.
+ */
+char *ssh_gss_step_summary(const struct ssh_connection_shared_gss_state *gss);
+
 #endif /* NO_GSSAPI */
 
 #endif /*PUTTY_SSHGSS_H*/
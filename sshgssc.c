@@ -38,6 +38,14 @@ static Ssh_gss_stat ssh_gssapi_import_name(struct ssh_gss_library *lib,
     return SSH_GSS_FAILURE;
 }
 
+/*
+ * How long acquire_cred will go on reusing a credential handle it got
+ * earlier, instead of asking the library for a fresh one. This is
+ * well under the interval between the checks in ssh2transport.c for
+ * renewed credentials, so those still see a renewal when it happens.
+ */
+#define GSS_CRED_CACHE_SECS 60
+
 static Ssh_gss_stat ssh_gssapi_acquire_cred(struct ssh_gss_library *lib,
                                             Ssh_gss_ctx *ctx,
                                             time_t *expiry)
@@ -47,48 +55,80 @@ static Ssh_gss_stat ssh_gssapi_acquire_cred(struct ssh_gss_library *lib,
     gss_cred_id_t cred;
     OM_uint32 dummy;
     OM_uint32 time_rec;
+    time_t now = time(NULL);
     gssapi_ssh_gss_ctx *gssctx = snew(gssapi_ssh_gss_ctx);
 
     gssctx->ctx = GSS_C_NO_CONTEXT;
     gssctx->expiry = 0;
 
-    gssctx->maj_stat =
-        gss->acquire_cred(&gssctx->min_stat, GSS_C_NO_NAME, GSS_C_INDEFINITE,
-                          &k5only, GSS_C_INITIATE, &cred,
-                          (gss_OID_set *)0, &time_rec);
-
-    if (gssctx->maj_stat != GSS_S_COMPLETE) {
-        sfree(gssctx);
-        return SSH_GSS_FAILURE;
-    }
-
     /*
-     * When the credential lifetime is not yet available due to deferred
-     * processing, gss_acquire_cred should return a 0 lifetime which is
-     * distinct from GSS_C_INDEFINITE which signals a crential that never
-     * expires.  However, not all implementations get this right, and with
-     * Kerberos, initiator credentials always expire at some point.  So when
-     * lifetime is 0 or GSS_C_INDEFINITE we call gss_inquire_cred_by_mech() to
-     * complete deferred processing.
+     * Reuse the credential from a recent call if we can, asking only
+     * for its remaining lifetime, which saves re-reading the
+     * credential cache. If it's too old, or has run out, get a new
+     * one.
      */
-    if (time_rec == GSS_C_INDEFINITE || time_rec == 0) {
-        gssctx->maj_stat =
-            gss->inquire_cred_by_mech(&gssctx->min_stat, cred,
-                                      (gss_OID) GSS_MECH_KRB5,
-                                      GSS_C_NO_NAME,
-                                      &time_rec,
-                                      NULL,
-                                      NULL);
+    cred = (gss_cred_id_t)lib->cached_cred;
+    if (cred != GSS_C_NO_CREDENTIAL) {
+        time_rec = 0;
+        if (now - lib->cached_cred_time < GSS_CRED_CACHE_SECS &&
+            now >= lib->cached_cred_time)
+            gssctx->maj_stat =
+                gss->inquire_cred_by_mech(&gssctx->min_stat, cred,
+                                          (gss_OID) GSS_MECH_KRB5,
+                                          GSS_C_NO_NAME,
+                                          &time_rec,
+                                          NULL,
+                                          NULL);
+        if (time_rec == 0 || gssctx->maj_stat != GSS_S_COMPLETE) {
+            (void) gss->release_cred(&dummy, &cred);
+            cred = GSS_C_NO_CREDENTIAL;
+            lib->cached_cred = NULL;
+        }
     }
-    (void) gss->release_cred(&dummy, &cred);
 
-    if (gssctx->maj_stat != GSS_S_COMPLETE) {
-        sfree(gssctx);
-        return SSH_GSS_FAILURE;
+    if (cred == GSS_C_NO_CREDENTIAL) {
+        gssctx->maj_stat =
+            gss->acquire_cred(&gssctx->min_stat, GSS_C_NO_NAME,
+                              GSS_C_INDEFINITE, &k5only, GSS_C_INITIATE,
+                              &cred, (gss_OID_set *)0, &time_rec);
+
+        if (gssctx->maj_stat != GSS_S_COMPLETE) {
+            sfree(gssctx);
+            return SSH_GSS_FAILURE;
+        }
+
+        /*
+         * When the credential lifetime is not yet available due to
+         * deferred processing, gss_acquire_cred should return a 0
+         * lifetime which is distinct from GSS_C_INDEFINITE which
+         * signals a crential that never expires. However, not all
+         * implementations get this right, and with Kerberos,
+         * initiator credentials always expire at some point. So when
+         * lifetime is 0 or GSS_C_INDEFINITE we call
+         * gss_inquire_cred_by_mech() to complete deferred processing.
+         */
+        if (time_rec == GSS_C_INDEFINITE || time_rec == 0) {
+            gssctx->maj_stat =
+                gss->inquire_cred_by_mech(&gssctx->min_stat, cred,
+                                          (gss_OID) GSS_MECH_KRB5,
+                                          GSS_C_NO_NAME,
+                                          &time_rec,
+                                          NULL,
+                                          NULL);
+        }
+
+        if (gssctx->maj_stat != GSS_S_COMPLETE) {
+            (void) gss->release_cred(&dummy, &cred);
+            sfree(gssctx);
+            return SSH_GSS_FAILURE;
+        }
+
+        lib->cached_cred = cred;
+        lib->cached_cred_time = now;
     }
 
     if (time_rec != GSS_C_INDEFINITE)
-        gssctx->expiry = time(NULL) + time_rec;
+        gssctx->expiry = now + time_rec;
     else
         gssctx->expiry = GSS_NO_EXPIRATION;
 
@@ -273,6 +313,17 @@ void ssh_gssapi_bind_fns(struct ssh_gss_library *lib)
     lib->verify_mic = ssh_gssapi_verify_mic;
     lib->free_mic = ssh_gssapi_free_mic;
     lib->display_status = ssh_gssapi_display_status;
+    lib->cached_cred = NULL;
+}
+
+void ssh_gssapi_free_cached_cred(struct ssh_gss_library *lib)
+{
+    gss_cred_id_t cred = (gss_cred_id_t)lib->cached_cred;
+    OM_uint32 dummy;
+
+    if (cred != GSS_C_NO_CREDENTIAL)
+        (void) lib->u.gssapi.release_cred(&dummy, &cred);
+    lib->cached_cred = NULL;
 }
 
 #else
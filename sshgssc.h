@@ -14,6 +14,7 @@ typedef struct gssapi_ssh_gss_ctx {
 } gssapi_ssh_gss_ctx;
 
 void ssh_gssapi_bind_fns(struct ssh_gss_library *lib);
+void ssh_gssapi_free_cached_cred(struct ssh_gss_library *lib);
 
 #else
 
@@ -106,6 +106,22 @@ unsigned miller_rabin_checks_needed(unsigned bits);
  * that proves the number to be composite. */
 mp_int *miller_rabin_find_potential_primitive_root(MillerRabin *mr);
 
+/* Split-phase versions of the above, for a caller that wants to draw
+ * all its random witnesses in one thread and do the modpows in
+ * another. miller_rabin_random_witness doesn't need a MillerRabin
+ * object, so that setting those up can be left to the other thread
+ * too. miller_rabin_test_witness returns false if the witness proves
+ * p composite, and otherwise sets *ppr to say whether it is also a
+ * potential primitive root, in which case miller_rabin_export_witness
+ * gives the value that miller_rabin_find_potential_primitive_root
+ * would have returned.
+ *
+ * Different MillerRabin objects can be used in different threads at
+ * once, but not the same one. */
+mp_int *miller_rabin_random_witness(mp_int *p);
+bool miller_rabin_test_witness(MillerRabin *mr, mp_int *mw, bool *ppr);
+mp_int *miller_rabin_export_witness(MillerRabin *mr, mp_int *mw);
+
 /* ----------------------------------------------------------------------
  * A system for proving numbers to be prime, using the Pocklington
  * test, which requires knowing a partial factorisation of p-1
@@ -115,8 +115,9 @@ PacketProtocolLayer *ssh2_transport_new(
     const SshServerConfig *ssc);
 PacketProtocolLayer *ssh2_userauth_new(
     PacketProtocolLayer *successor_layer,
-    const char *hostname, const char *fullhostname,
+    const char *hostname, const char *fullhostname, int port,
     Filename *keyfile, bool show_banner, bool tryagent,
+    int agent_key_probes, bool remember_auth,
     const char *default_username, bool change_username,
     bool try_ki_auth,
     bool try_gssapi_auth, bool try_gssapi_kex_auth,
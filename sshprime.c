@@ -10,6 +10,157 @@
 #include "mpunsafe.h"
 #include "sshkeygen.h"
 
+/* ----------------------------------------------------------------------
+ * Parallel candidate testing, shared between both the algorithms
+ * below.
+ *
+ * Both of them spend nearly all their time running Miller-Rabin on
+ * candidates that turn out to be composite. If the platform can run
+ * several jobs at once, we deal out a batch of candidates, one per
+ * job, and test them all concurrently. The first candidate in the
+ * batch to pass wins, and the rest are thrown away.
+ *
+ * Neither the PrimeCandidateSource nor the random number generator is
+ * thread-safe, so the candidates and all their witness values are
+ * drawn in this thread before each batch is started. The jobs
+ * themselves do nothing but arithmetic on their own data.
+ *
+ * For small primes, the cost of starting the threads would outweigh
+ * the modpows, so below PARALLEL_MIN_BITS we don't bother.
+ */
+
+#define PARALLEL_MIN_BITS 256
+
+/*
+ * When we're looking for a potential primitive root rather than
+ * simply testing for primality, we don't know in advance how many
+ * witnesses it will take (on average about two, if the candidate is
+ * prime). So a job is given this many per batch, and if none of them
+ * is conclusive, it keeps its candidate and gets some more next time.
+ */
+#define PPR_WITNESSES_PER_BATCH 2
+#define MAX_WITNESSES_PER_BATCH 32
+
+typedef struct PrimeSearchJob {
+    mp_int *p;
+    MillerRabin *mr;
+    mp_int *witnesses[MAX_WITNESSES_PER_BATCH];
+    unsigned nwitnesses;
+    bool want_ppr;
+
+    bool composite;
+    mp_int *ppr;
+} PrimeSearchJob;
+
+static void prime_search_job(void *vjob)
+{
+    PrimeSearchJob *job = (PrimeSearchJob *)vjob;
+
+    if (!job->mr)
+        job->mr = miller_rabin_new(job->p);
+
+    for (unsigned i = 0; i < job->nwitnesses; i++) {
+        bool ppr;
+        if (!miller_rabin_test_witness(job->mr, job->witnesses[i], &ppr)) {
+            job->composite = true;
+            return;
+        }
+        if (job->want_ppr && ppr) {
+            job->ppr = miller_rabin_export_witness(
+                job->mr, job->witnesses[i]);
+            return;
+        }
+    }
+}
+
+static void prime_search_job_discard(PrimeSearchJob *job)
+{
+    if (job->p)
+        mp_free(job->p);
+    if (job->mr)
+        miller_rabin_free(job->mr);
+    if (job->ppr)
+        mp_free(job->ppr);
+    job->p = job->ppr = NULL;
+    job->mr = NULL;
+}
+
+/*
+ * Returns a candidate that passed, or NULL if the candidate source ran
+ * out. If want_ppr is set, the candidate's potential primitive root is
+ * returned via ppr_out. If prog is not NULL, each new candidate is
+ * reported to it as an attempt.
+ */
+static mp_int *prime_search_parallel(
+    PrimeCandidateSource *pcs, ProgressReceiver *prog, unsigned njobs,
+    bool want_ppr, mp_int **ppr_out)
+{
+    PrimeSearchJob *jobs = snewn(njobs, PrimeSearchJob);
+    void **ctxs = snewn(njobs, void *);
+    mp_int *result = NULL;
+    bool exhausted = false;
+
+    for (unsigned i = 0; i < njobs; i++) {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].want_ppr = want_ppr;
+        ctxs[i] = &jobs[i];
+    }
+
+    while (!result && !exhausted) {
+        unsigned n;
+
+        for (n = 0; n < njobs; n++) {
+            PrimeSearchJob *job = &jobs[n];
+
+            if (!job->p) {
+                if (prog)
+                    progress_report_attempt(prog);
+                if (!(job->p = pcs_generate(pcs))) {
+                    exhausted = true;
+                    break;
+                }
+            }
+
+            job->nwitnesses = (want_ppr ? PPR_WITNESSES_PER_BATCH :
+                               miller_rabin_checks_needed(
+                                   mp_get_nbits(job->p)));
+            assert(job->nwitnesses <= MAX_WITNESSES_PER_BATCH);
+            for (unsigned i = 0; i < job->nwitnesses; i++)
+                job->witnesses[i] = miller_rabin_random_witness(job->p);
+            job->composite = false;
+        }
+
+        platform_run_parallel(prime_search_job, ctxs, n);
+
+        for (unsigned i = 0; i < n; i++) {
+            PrimeSearchJob *job = &jobs[i];
+
+            for (unsigned j = 0; j < job->nwitnesses; j++)
+                mp_free(job->witnesses[j]);
+            job->nwitnesses = 0;
+
+            if (!result && !job->composite && (!want_ppr || job->ppr)) {
+                result = job->p;
+                job->p = NULL;
+                if (want_ppr) {
+                    *ppr_out = job->ppr;
+                    job->ppr = NULL;
+                }
+            }
+
+            if (job->composite)
+                prime_search_job_discard(job);
+        }
+    }
+
+    for (unsigned i = 0; i < njobs; i++)
+        prime_search_job_discard(&jobs[i]);
+    sfree(jobs);
+    sfree(ctxs);
+
+    return result;
+}
+
 /* ----------------------------------------------------------------------
  * Standard probabilistic prime-generation algorithm:
  *
@@ -71,6 +222,13 @@ static mp_int *probprime_generate(
 {
     pcs_ready(pcs);
 
+    unsigned njobs = platform_parallel_jobs();
+    if (njobs > 1 && pcs_get_bits(pcs) >= PARALLEL_MIN_BITS) {
+        mp_int *p = prime_search_parallel(pcs, prog, njobs, false, NULL);
+        pcs_free(pcs);
+        return p;
+    }
+
     while (true) {
         progress_report_attempt(prog);
 
@@ -633,24 +791,38 @@ static mp_int *provableprime_generate_inner(
             bits, pcs_get_bits_remaining(pcs));
     pcs_ready(pcs);
 
+    unsigned njobs = platform_parallel_jobs();
+    bool parallel = (njobs > 1 && bits >= PARALLEL_MIN_BITS);
+
     while (true) {
-        mp_int *p = pcs_generate(pcs);
-        if (!p) {
-            pcs_free(pcs);
-            return NULL;
-        }
+        mp_int *p, *witness;
+
+        if (parallel) {
+            p = prime_search_parallel(pcs, NULL, njobs, true, &witness);
+            if (!p) {
+                pcs_free(pcs);
+                return NULL;
+            }
+            debug_f_mp("provable_step p=", p);
+        } else {
+            p = pcs_generate(pcs);
+            if (!p) {
+                pcs_free(pcs);
+                return NULL;
+            }
 
-        debug_f_mp("provable_step p=", p);
+            debug_f_mp("provable_step p=", p);
 
-        MillerRabin *mr = miller_rabin_new(p);
-        debug_f("provable_step mr setup done");
-        mp_int *witness = miller_rabin_find_potential_primitive_root(mr);
-        miller_rabin_free(mr);
+            MillerRabin *mr = miller_rabin_new(p);
+            debug_f("provable_step mr setup done");
+            witness = miller_rabin_find_potential_primitive_root(mr);
+            miller_rabin_free(mr);
 
-        if (!witness) {
-            debug_f("provable_step mr failed");
-            mp_free(p);
-            continue;
+            if (!witness) {
+                debug_f("provable_step mr failed");
+                mp_free(p);
+                continue;
+            }
         }
 
         size_t nfactors;
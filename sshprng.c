@@ -59,6 +59,21 @@ struct prng_impl {
     ssh_hash *generator;
     mp_int *counter;
 
+    /*
+     * Optionally, the generator can be run in bulk to fill a buffer,
+     * from which prng_read hands out data until it's used up. This is
+     * still 'fast key erasure': the generator is rekeyed as soon as
+     * the buffer is filled, and each byte of the buffer is wiped as
+     * soon as it's been returned, so nothing in our state at any
+     * moment can reconstruct anything we've already output.
+     *
+     * The unread data belongs to the old key, so it's thrown away
+     * whenever the PRNG is reseeded, to ensure that new seed data
+     * affects the very next read.
+     */
+    unsigned char *buf;
+    size_t bufsize, bufpos;
+
     /*
      * When re-seeding the generator, you call prng_seed_begin(),
      * which sets up a hash object in 'keymaker'. You write your new
@@ -128,6 +143,10 @@ void prng_free(prng *pr)
 {
     prng_impl *pi = container_of(pr, prng_impl, Prng);
 
+    if (pi->buf) {
+        smemclr(pi->buf, pi->bufsize);
+        sfree(pi->buf);
+    }
     mp_free(pi->counter);
     for (size_t i = 0; i < NCOLLECTORS; i++)
         ssh_hash_free(pi->collectors[i]);
@@ -139,6 +158,17 @@ void prng_free(prng *pr)
     sfree(pi);
 }
 
+void prng_enable_buffering(prng *pr, size_t size)
+{
+    prng_impl *pi = container_of(pr, prng_impl, Prng);
+    size_t hlen = pi->hashalg->hlen;
+
+    assert(!pi->buf);
+    pi->bufsize = (size + hlen - 1) / hlen * hlen;
+    pi->buf = snewn(pi->bufsize, unsigned char);
+    pi->bufpos = pi->bufsize;          /* start off empty */
+}
+
 void prng_seed_begin(prng *pr)
 {
     prng_impl *pi = container_of(pr, prng_impl, Prng);
@@ -147,6 +177,11 @@ void prng_seed_begin(prng *pr)
 
     prngdebug("prng: reseed begin\n");
 
+    if (pi->buf) {
+        smemclr(pi->buf, pi->bufsize);
+        pi->bufpos = pi->bufsize;
+    }
+
     /*
      * Make a hash instance that will generate the key for the new one.
      */
@@ -211,6 +246,33 @@ static inline void prng_generate(prng_impl *pi, void *outbuf)
     ssh_hash_final(h, outbuf);
 }
 
+static void prng_read_buffered(prng_impl *pi, uint8_t *out, size_t size)
+{
+    while (size > 0) {
+        if (pi->bufpos == pi->bufsize) {
+            for (size_t pos = 0; pos < pi->bufsize; pos += pi->hashalg->hlen)
+                prng_generate(pi, pi->buf + pos);
+            pi->bufpos = 0;
+
+            /* Rekey straight away (which mustn't discard the buffer
+             * we've just filled, so we can't call prng_seed_begin) */
+            pi->keymaker = pi->generator;
+            pi->generator = NULL;
+            put_byte(pi->keymaker, 'R');
+            prng_seed_finish(&pi->Prng);
+        }
+
+        size_t to_use = pi->bufsize - pi->bufpos;
+        if (to_use > size)
+            to_use = size;
+        memcpy(out, pi->buf + pi->bufpos, to_use);
+        smemclr(pi->buf + pi->bufpos, to_use);
+        pi->bufpos += to_use;
+        out += to_use;
+        size -= to_use;
+    }
+}
+
 void prng_read(prng *pr, void *vout, size_t size)
 {
     prng_impl *pi = container_of(pr, prng_impl, Prng);
@@ -221,6 +283,12 @@ void prng_read(prng *pr, void *vout, size_t size)
     prngdebug("prng_read %"SIZEu"\n", size);
 
     uint8_t *out = (uint8_t *)vout;
+
+    if (pi->buf) {
+        prng_read_buffered(pi, out, size);
+        return;
+    }
+
     while (size > 0) {
         prng_generate(pi, buf);
         size_t to_use = size > pi->hashalg->hlen ? pi->hashalg->hlen : size;
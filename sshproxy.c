@@ -0,0 +1,447 @@
+/*
+ * sshproxy.c: make a proxied connection by running an SSH session to
+ * a jump host inside this same process, and opening the connection
+ * to the real destination as a direct-tcpip channel of that session.
+ *
+ * This does the same job as setting up a local proxy command that
+ * runs another copy of Plink with -nc, but without forking, and
+ * without every byte of the session having to pass through a pair
+ * of pipes and a second process's event loop.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "putty.h"
+#include "network.h"
+#include "storage.h"
+
+/*
+ * Limit on how many SSH proxies may be in the middle of setting each
+ * other up at once, so that a saved session which names itself (or a
+ * loop of sessions naming each other) as its SSH proxy fails cleanly
+ * instead of recursing until the stack runs out.
+ */
+#define SSHPROXY_MAX_DEPTH 8
+static int sshproxy_depth;
+
+typedef struct SshProxy {
+    char *errmsg;
+    Conf *conf;
+    LogContext *logctx;
+    Backend *backend;
+    Plug *plug;
+    ProxyStderrBuf psb;
+
+    bufchain ssh_to_socket;
+    IdempotentCallback ic_ssh_to_socket;
+    bool frozen;
+    bool rcvd_eof_ssh_to_socket, closed;
+    bool tried_password;
+
+    Socket sock;
+    Seat seat;
+    LogPolicy logpolicy;
+} SshProxy;
+
+/*
+ * Pass data from the jump host's channel on to our plug. This is
+ * always done from a toplevel callback rather than directly from the
+ * Seat output method, because the plug is very likely to respond by
+ * writing to this socket, i.e. calling back into the SSH backend
+ * that's still in the middle of delivering the data.
+ */
+static void sshproxy_try_send_ssh_to_socket(void *ctx)
+{
+    SshProxy *sp = (SshProxy *)ctx;
+
+    if (sp->closed)
+        return;
+
+    while (!sp->frozen && bufchain_size(&sp->ssh_to_socket) > 0) {
+        ptrlen data = bufchain_prefix(&sp->ssh_to_socket);
+        plug_receive(sp->plug, 0, data.ptr, data.len);
+        bufchain_consume(&sp->ssh_to_socket, data.len);
+    }
+
+    if (bufchain_size(&sp->ssh_to_socket) == 0 &&
+        (sp->rcvd_eof_ssh_to_socket || sp->errmsg)) {
+        sp->closed = true;
+        plug_closing(sp->plug, sp->errmsg, 0, false);
+        return;
+    }
+
+    if (sp->backend)
+        backend_unthrottle(sp->backend, bufchain_size(&sp->ssh_to_socket));
+}
+
+/* ----------------------------------------------------------------------
+ * Socket methods, called by the client of the proxied connection.
+ */
+
+static Plug *sshproxy_plug(Socket *s, Plug *p)
+{
+    SshProxy *sp = container_of(s, SshProxy, sock);
+    Plug *oldplug = sp->plug;
+    if (p)
+        sp->plug = p;
+    return oldplug;
+}
+
+static void sshproxy_close(Socket *s)
+{
+    SshProxy *sp = container_of(s, SshProxy, sock);
+
+    delete_callbacks_for_context(sp);
+    if (sp->backend)
+        backend_free(sp->backend);
+    if (sp->logctx)
+        log_free(sp->logctx);
+    conf_free(sp->conf);
+    bufchain_clear(&sp->ssh_to_socket);
+    sfree(sp->errmsg);
+    sfree(sp);
+}
+
+static size_t sshproxy_write(Socket *s, const void *data, size_t len)
+{
+    SshProxy *sp = container_of(s, SshProxy, sock);
+    if (!sp->backend)
+        return 0;
+    return backend_send(sp->backend, data, len);
+}
+
+static size_t sshproxy_write_oob(Socket *s, const void *data, size_t len)
+{
+    /* There's no urgent data in an SSH channel, so send it in line */
+    return sshproxy_write(s, data, len);
+}
+
+static void sshproxy_write_eof(Socket *s)
+{
+    SshProxy *sp = container_of(s, SshProxy, sock);
+    if (sp->backend)
+        backend_special(sp->backend, SS_EOF, 0);
+}
+
+static void sshproxy_set_frozen(Socket *s, bool is_frozen)
+{
+    SshProxy *sp = container_of(s, SshProxy, sock);
+    sp->frozen = is_frozen;
+    if (!is_frozen)
+        queue_idempotent_callback(&sp->ic_ssh_to_socket);
+}
+
+static const char *sshproxy_socket_error(Socket *s)
+{
+    SshProxy *sp = container_of(s, SshProxy, sock);
+    return sp->errmsg;
+}
+
+static SocketPeerInfo *sshproxy_peer_info(Socket *s)
+{
+    return NULL;
+}
+
+static const SocketVtable SshProxy_sock_vt = {
+    .plug = sshproxy_plug,
+    .close = sshproxy_close,
+    .write = sshproxy_write,
+    .write_oob = sshproxy_write_oob,
+    .write_eof = sshproxy_write_eof,
+    .set_frozen = sshproxy_set_frozen,
+    .socket_error = sshproxy_socket_error,
+    .peer_info = sshproxy_peer_info,
+};
+
+/* ----------------------------------------------------------------------
+ * LogPolicy methods. The jump host's Event Log goes into the proxy
+ * log messages of the real connection.
+ */
+
+static void sshproxy_eventlog(LogPolicy *lp, const char *event)
+{
+    SshProxy *sp = container_of(lp, SshProxy, logpolicy);
+    plug_log(sp->plug, PLUGLOG_PROXY_MSG, NULL, 0, event, 0);
+}
+
+static int sshproxy_askappend(
+    LogPolicy *lp, Filename *filename,
+    void (*callback)(void *ctx, int result), void *ctx)
+{
+    /* We never open a session log for the jump host, but just in case */
+    return 0;
+}
+
+static const LogPolicyVtable SshProxy_logpolicy_vt = {
+    .eventlog = sshproxy_eventlog,
+    .askappend = sshproxy_askappend,
+    .logging_error = sshproxy_eventlog,
+    .verbose = null_lp_verbose_no,
+};
+
+/* ----------------------------------------------------------------------
+ * Seat methods, called by the SSH backend talking to the jump host.
+ * There's no user to ask about anything, so everything that would
+ * need an interactive decision is refused.
+ */
+
+static void sshproxy_set_error(SshProxy *sp, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (sp->errmsg)
+        return;                        /* keep the first, most useful one */
+
+    va_start(ap, fmt);
+    sp->errmsg = dupvprintf(fmt, ap);
+    va_end(ap);
+    queue_idempotent_callback(&sp->ic_ssh_to_socket);
+}
+
+static size_t sshproxy_output(Seat *seat, bool is_stderr,
+                              const void *data, size_t len)
+{
+    SshProxy *sp = container_of(seat, SshProxy, seat);
+
+    if (is_stderr) {
+        log_proxy_stderr(sp->plug, &sp->psb, data, len);
+        return 0;
+    }
+
+    bufchain_add(&sp->ssh_to_socket, data, len);
+    queue_idempotent_callback(&sp->ic_ssh_to_socket);
+    return bufchain_size(&sp->ssh_to_socket);
+}
+
+static void sshproxy_sent(Seat *seat, size_t bufsize)
+{
+    SshProxy *sp = container_of(seat, SshProxy, seat);
+    plug_sent(sp->plug, bufsize);
+}
+
+static bool sshproxy_eof(Seat *seat)
+{
+    SshProxy *sp = container_of(seat, SshProxy, seat);
+    sp->rcvd_eof_ssh_to_socket = true;
+    queue_idempotent_callback(&sp->ic_ssh_to_socket);
+    return false;                /* the other direction may carry on */
+}
+
+static int sshproxy_get_userpass_input(Seat *seat, prompts_t *p,
+                                       bufchain *input)
+{
+    SshProxy *sp = container_of(seat, SshProxy, seat);
+    const char *password = conf_get_str(sp->conf, CONF_proxy_password);
+
+    /*
+     * The one question we can answer is a single password prompt, and
+     * only once, using the configured proxy password.
+     */
+    if (*password && !sp->tried_password &&
+        p->n_prompts == 1 && !p->prompts[0]->echo) {
+        sp->tried_password = true;
+        prompt_set_result(p->prompts[0], password);
+        return 1;
+    }
+
+    sshproxy_set_error(sp, "Proxy error: SSH proxy needs interactive "
+                       "authentication, which is not supported");
+    return 0;
+}
+
+static void sshproxy_notify_remote_exit(Seat *seat)
+{
+    SshProxy *sp = container_of(seat, SshProxy, seat);
+    sp->rcvd_eof_ssh_to_socket = true;
+    queue_idempotent_callback(&sp->ic_ssh_to_socket);
+}
+
+static void sshproxy_connection_fatal(Seat *seat, const char *message)
+{
+    SshProxy *sp = container_of(seat, SshProxy, seat);
+    sshproxy_set_error(sp, "Proxy error: %s", message);
+}
+
+static int sshproxy_verify_ssh_host_key(
+    Seat *seat, const char *host, int port,
+    const char *keytype, char *keystr, char *key_fingerprint,
+    void (*callback)(void *ctx, int result), void *ctx)
+{
+    SshProxy *sp = container_of(seat, SshProxy, seat);
+    int ret = verify_host_key(host, port, keytype, keystr);
+
+    if (ret == 0)
+        return 1;                      /* matches the cached key */
+
+    sshproxy_set_error(sp, "Proxy error: host key for SSH proxy %s is %s; "
+                       "connect to it directly once to check and cache it",
+                       host, ret == 2 ? "different from the cached one" :
+                       "not cached");
+    return 0;
+}
+
+static int sshproxy_confirm_weak_crypto_primitive(
+    Seat *seat, const char *algtype, const char *algname,
+    void (*callback)(void *ctx, int result), void *ctx)
+{
+    SshProxy *sp = container_of(seat, SshProxy, seat);
+    sshproxy_set_error(sp, "Proxy error: SSH proxy would need %s %s, which "
+                       "is below the configured warning threshold",
+                       algtype, algname);
+    return 0;
+}
+
+static int sshproxy_confirm_weak_cached_hostkey(
+    Seat *seat, const char *algname, const char *betteralgs,
+    void (*callback)(void *ctx, int result), void *ctx)
+{
+    SshProxy *sp = container_of(seat, SshProxy, seat);
+    sshproxy_set_error(sp, "Proxy error: SSH proxy's only cached host key "
+                       "type %s is below the configured warning threshold",
+                       algname);
+    return 0;
+}
+
+static const SeatVtable SshProxy_seat_vt = {
+    .output = sshproxy_output,
+    .sent = sshproxy_sent,
+    .eof = sshproxy_eof,
+    .get_userpass_input = sshproxy_get_userpass_input,
+    .notify_remote_exit = sshproxy_notify_remote_exit,
+    .connection_fatal = sshproxy_connection_fatal,
+    .update_specials_menu = nullseat_update_specials_menu,
+    .get_ttymode = nullseat_get_ttymode,
+    .set_busy_status = nullseat_set_busy_status,
+    .verify_ssh_host_key = sshproxy_verify_ssh_host_key,
+    .confirm_weak_crypto_primitive = sshproxy_confirm_weak_crypto_primitive,
+    .confirm_weak_cached_hostkey = sshproxy_confirm_weak_cached_hostkey,
+    .is_utf8 = nullseat_is_never_utf8,
+    .echoedit_update = nullseat_echoedit_update,
+    .get_x_display = nullseat_get_x_display,
+    .get_windowid = nullseat_get_windowid,
+    .get_window_pixel_size = nullseat_get_window_pixel_size,
+    .stripctrl_new = nullseat_stripctrl_new,
+    .set_trust_status = nullseat_set_trust_status_vacuously,
+    .verbose = nullseat_verbose_no,
+    .interactive = nullseat_interactive_no,
+    .get_cursor_position = nullseat_get_cursor_position,
+};
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Make the configuration for the SSH session to the jump host. If the
+ * configured proxy host name is the name of a saved session, we use
+ * that session as it stands; otherwise we start from Default Settings
+ * and fill in the proxy host, port and user name.
+ */
+static Conf *sshproxy_make_conf(Conf *clientconf)
+{
+    Conf *conf = conf_new();
+    const char *proxy_host = conf_get_str(clientconf, CONF_proxy_host);
+    char *key;
+
+    if (!do_defaults(proxy_host, conf) || !conf_launchable(conf)) {
+        do_defaults(NULL, conf);
+        conf_set_str(conf, CONF_host, proxy_host);
+        conf_set_int(conf, CONF_port,
+                     conf_get_int(clientconf, CONF_proxy_port));
+        conf_set_str(conf, CONF_username,
+                     conf_get_str(clientconf, CONF_proxy_username));
+        conf_set_bool(conf, CONF_username_from_env, false);
+
+        /* The jump host will often take the same key as the target */
+        if (filename_is_null(conf_get_filename(conf, CONF_keyfile)))
+            conf_set_filename(conf, CONF_keyfile,
+                              conf_get_filename(clientconf, CONF_keyfile));
+    }
+    conf_set_int(conf, CONF_protocol, PROT_SSH);
+    conf_set_str(conf, CONF_proxy_password,
+                 conf_get_str(clientconf, CONF_proxy_password));
+
+    /*
+     * The jump host session is only there to carry our one channel,
+     * so it mustn't try to do anything else on the user's behalf, or
+     * log to the user's session log file.
+     */
+    conf_set_int(conf, CONF_logtype, LGTYP_NONE);
+    conf_set_bool(conf, CONF_ssh_connection_sharing, false);
+    conf_set_bool(conf, CONF_x11_forward, false);
+    conf_set_bool(conf, CONF_agentfwd, false);
+    while ((key = conf_get_str_nthstrkey(conf, CONF_portfwd, 0)) != NULL)
+        conf_del_str_str(conf, CONF_portfwd, key);
+
+    return conf;
+}
+
+Socket *sshproxy_new_connection(SockAddr *addr, const char *hostname,
+                                int port, bool privport,
+                                bool oobinline, bool nodelay, bool keepalive,
+                                Plug *plug, Conf *clientconf)
+{
+    SshProxy *sp;
+    const BackendVtable *vt;
+    char *err, *realhost = NULL;
+
+    /* We only ever pass the destination to the jump host by name */
+    sk_addr_free(addr);
+
+    if (sshproxy_depth >= SSHPROXY_MAX_DEPTH)
+        return new_error_socket_fmt(
+            plug, "Proxy error: too many nested SSH proxies");
+
+    sp = snew(SshProxy);
+    memset(sp, 0, sizeof(SshProxy));
+    sp->sock.vt = &SshProxy_sock_vt;
+    sp->seat.vt = &SshProxy_seat_vt;
+    sp->logpolicy.vt = &SshProxy_logpolicy_vt;
+    sp->plug = plug;
+    psb_init(&sp->psb);
+    bufchain_init(&sp->ssh_to_socket);
+    sp->ic_ssh_to_socket.fn = sshproxy_try_send_ssh_to_socket;
+    sp->ic_ssh_to_socket.ctx = sp;
+
+    sp->conf = sshproxy_make_conf(clientconf);
+    conf_set_str(sp->conf, CONF_ssh_nc_host, hostname);
+    conf_set_int(sp->conf, CONF_ssh_nc_port, port);
+
+    {
+        char *logmsg = dupprintf("Will use SSH proxy at %s:%d to connect "
+                                 "to %s:%d",
+                                 conf_get_str(sp->conf, CONF_host),
+                                 conf_get_int(sp->conf, CONF_port),
+                                 hostname, port);
+        plug_log(plug, PLUGLOG_PROXY_MSG, NULL, 0, logmsg, 0);
+        sfree(logmsg);
+    }
+
+    vt = backend_vt_from_proto(PROT_SSH);
+    if (!vt) {
+        sp->errmsg = dupstr("Proxy error: SSH is not available");
+        return &sp->sock;
+    }
+
+    sp->logctx = log_init(&sp->logpolicy, sp->conf);
+
+    sshproxy_depth++;
+    err = backend_init(vt, &sp->seat, &sp->backend, sp->logctx, sp->conf,
+                       conf_get_str(sp->conf, CONF_host),
+                       conf_get_int(sp->conf, CONF_port),
+                       &realhost, nodelay, keepalive);
+    sshproxy_depth--;
+    sfree(realhost);
+
+    if (err) {
+        sp->errmsg = dupprintf("Proxy error: %s", err);
+        sfree(err);
+        if (sp->backend) {
+            backend_free(sp->backend);
+            sp->backend = NULL;
+        }
+    }
+
+    return &sp->sock;
+}
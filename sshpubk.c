@@ -1509,6 +1509,11 @@ static char *ssh2_pubkey_openssh_str_internal(const char *comment,
     return buffer;
 }
 
+char *ssh2_pubkey_openssh_str_blob(const char *comment, ptrlen blob)
+{
+    return ssh2_pubkey_openssh_str_internal(comment, blob.ptr, blob.len);
+}
+
 char *ssh2_pubkey_openssh_str(ssh2_userkey *key)
 {
     strbuf *blob;
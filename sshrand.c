@@ -10,6 +10,15 @@
 /* Collect environmental noise every 5 minutes */
 #define NOISE_REGULAR_INTERVAL (5*60*TICKSPERSEC)
 
+/* If the OS's RNG lets us start up without the heavyweight noise
+ * collection, do that this long afterwards instead */
+#define NOISE_DEFERRED_INTERVAL (2*TICKSPERSEC)
+
+/* Generate random data this much at a time, so that small reads (such
+ * as the padding for every outgoing SSH-2 packet) don't each cost a
+ * full run of the generator plus a rekey */
+#define RANDOM_BUFFER_SIZE 1024
+
 int random_active = 0;
 
 #ifdef FUZZING
@@ -34,6 +43,7 @@ static struct random_timer_context { int dummy; } random_timer_ctx;
 
 static prng *global_prng;
 static unsigned long next_noise_collection;
+static unsigned long deferred_noise_collection;
 
 void random_add_noise(NoiseSourceId source, const void *noise, int length)
 {
@@ -58,19 +68,12 @@ static void random_seed_callback(void *noise, int length)
     put_data(global_prng, noise, length);
 }
 
-static void random_create(const ssh_hashalg *hashalg)
+static void random_get_heavy_noise(void)
 {
-    assert(!global_prng);
-    global_prng = prng_new(hashalg);
-
     prng_seed_begin(global_prng);
     noise_get_heavy(random_seed_callback);
     prng_seed_finish(global_prng);
 
-    next_noise_collection =
-        schedule_timer(NOISE_REGULAR_INTERVAL, random_timer,
-                       &random_timer_ctx);
-
     /* noise_get_heavy probably read our random seed file.
      * Therefore (in fact, even if it didn't), we should write a
      * fresh one, in case another instance of ourself starts up
@@ -79,6 +82,41 @@ static void random_create(const ssh_hashalg *hashalg)
     random_save_seed();
 }
 
+static void random_deferred_timer(void *ctx, unsigned long now)
+{
+    if (random_active > 0 && now == deferred_noise_collection)
+        random_get_heavy_noise();
+}
+
+static void random_create(const ssh_hashalg *hashalg)
+{
+    assert(!global_prng);
+    global_prng = prng_new(hashalg);
+    prng_enable_buffering(global_prng, RANDOM_BUFFER_SIZE);
+
+    /*
+     * If the OS has a random number generator of its own, that's
+     * good enough to seed from on its own for the moment, and we put
+     * off the slow part (running external commands, reading and
+     * rewriting the seed file) until the session is under way. If
+     * not, we have to do it all now.
+     */
+    prng_seed_begin(global_prng);
+    if (noise_get_fast(random_seed_callback)) {
+        prng_seed_finish(global_prng);
+        deferred_noise_collection =
+            schedule_timer(NOISE_DEFERRED_INTERVAL, random_deferred_timer,
+                           &random_timer_ctx);
+    } else {
+        prng_seed_finish(global_prng);
+        random_get_heavy_noise();
+    }
+
+    next_noise_collection =
+        schedule_timer(NOISE_REGULAR_INTERVAL, random_timer,
+                       &random_timer_ctx);
+}
+
 void random_save_seed(void)
 {
     int len;
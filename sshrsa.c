@@ -41,6 +41,7 @@ void BinarySource_get_rsa_ssh1_priv(
     BinarySource *src, RSAKey *rsa)
 {
     rsa->private_exponent = get_mp_ssh1(src);
+    rsa->precomp = NULL;
 }
 
 key_components *rsa_components(RSAKey *rsa)
@@ -138,38 +139,85 @@ bool rsa_ssh1_encrypt(unsigned char *data, int length, RSAKey *key)
 }
 
 /*
- * Compute (base ^ exp) % mod, provided mod == p * q, with p,q
- * distinct primes, and iqmp is the multiplicative inverse of q mod p.
- * Uses Chinese Remainder Theorem to speed computation up over the
- * obvious implementation of a single big modpow.
+ * Everything the private-key operation needs that depends only on
+ * the key, so that it can be worked out once and kept with the key
+ * rather than redone for every signature.
  */
-static mp_int *crt_modpow(mp_int *base, mp_int *exp, mp_int *mod,
-                          mp_int *p, mp_int *q, mp_int *iqmp)
+struct RSAPrecomp {
+    MontyContext *pmc, *qmc;           /* Montgomery contexts mod p, q */
+    mp_int *pexp, *qexp;               /* d mod (p-1), d mod (q-1) */
+    mp_int *iqmp_m;                    /* iqmp, in Montgomery form mod p */
+};
+
+static RSAPrecomp *rsa_precomp(RSAKey *key)
 {
-    mp_int *pm1, *qm1, *pexp, *qexp, *presult, *qresult;
-    mp_int *diff, *multiplier, *ret0, *ret;
+    if (key->precomp)
+        return key->precomp;
+
+    RSAPrecomp *pc = snew(RSAPrecomp);
+    pc->pmc = monty_new(key->p);
+    pc->qmc = monty_new(key->q);
 
     /*
      * Reduce the exponent mod phi(p) and phi(q), to save time when
      * exponentiating mod p and mod q respectively. Of course, since p
      * and q are prime, phi(p) == p-1 and similarly for q.
      */
-    pm1 = mp_copy(p);
+    mp_int *pm1 = mp_copy(key->p);
     mp_sub_integer_into(pm1, pm1, 1);
-    qm1 = mp_copy(q);
+    mp_int *qm1 = mp_copy(key->q);
     mp_sub_integer_into(qm1, qm1, 1);
-    pexp = mp_mod(exp, pm1);
-    qexp = mp_mod(exp, qm1);
+    pc->pexp = mp_mod(key->private_exponent, pm1);
+    pc->qexp = mp_mod(key->private_exponent, qm1);
+    mp_free(pm1);
+    mp_free(qm1);
+
+    pc->iqmp_m = monty_import(pc->pmc, key->iqmp);
+
+    key->precomp = pc;
+    return pc;
+}
+
+static void rsa_free_precomp(RSAKey *key)
+{
+    RSAPrecomp *pc = key->precomp;
+    if (!pc)
+        return;
+    monty_free(pc->pmc);
+    monty_free(pc->qmc);
+    mp_free(pc->pexp);
+    mp_free(pc->qexp);
+    mp_free(pc->iqmp_m);
+    sfree(pc);
+    key->precomp = NULL;
+}
+
+/*
+ * Compute (base ^ d) % n for an RSAKey with all its private fields
+ * present, using the Chinese Remainder Theorem to speed computation
+ * up over the obvious implementation of a single big modpow. Relies
+ * on p > q, which rsa_verify ensures.
+ */
+static mp_int *rsa_privkey_op(mp_int *input, RSAKey *key)
+{
+    mp_scratch_begin();
+    RSAPrecomp *pc = rsa_precomp(key);
 
     /*
-     * Do the two modpows.
+     * Do the two modpows. (monty_import reduces its input mod p or q
+     * as a side effect.)
      */
-    mp_int *base_mod_p = mp_mod(base, p);
-    presult = mp_modpow(base_mod_p, pexp, p);
-    mp_free(base_mod_p);
-    mp_int *base_mod_q = mp_mod(base, q);
-    qresult = mp_modpow(base_mod_q, qexp, q);
-    mp_free(base_mod_q);
+    mp_int *m_base = monty_import(pc->pmc, input);
+    mp_int *m_out = monty_pow(pc->pmc, m_base, pc->pexp);
+    mp_int *presult = monty_export(pc->pmc, m_out);
+    mp_free(m_base);
+    mp_free(m_out);
+
+    m_base = monty_import(pc->qmc, input);
+    m_out = monty_pow(pc->qmc, m_base, pc->qexp);
+    mp_int *qresult = monty_export(pc->qmc, m_out);
+    mp_free(m_base);
+    mp_free(m_out);
 
     /*
      * Recombine the results. We want a value which is congruent to
@@ -178,50 +226,31 @@ static mp_int *crt_modpow(mp_int *base, mp_int *exp, mp_int *mod,
      * We know that iqmp * q is congruent to 1 * mod p (by definition
      * of iqmp) and to 0 mod q (obviously). So we start with qresult
      * (which is congruent to qresult mod both primes), and add on
-     * (presult-qresult) * (iqmp * q) which adjusts it to be congruent
-     * to presult mod p without affecting its value mod q.
+     * h * q, where h = (presult-qresult) * iqmp mod p, which adjusts
+     * it to be congruent to presult mod p without affecting its value
+     * mod q. Since h < p and qresult < q, the answer is already
+     * less than n, with no final reduction needed.
      *
      * (If presult-qresult < 0, we add p to it to keep it positive.)
      */
     unsigned presult_too_small = mp_cmp_hs(qresult, presult);
-    mp_cond_add_into(presult, presult, p, presult_too_small);
+    mp_cond_add_into(presult, presult, key->p, presult_too_small);
+    mp_int *diff = mp_sub(presult, qresult);
+    mp_int *h = monty_mul(pc->pmc, diff, pc->iqmp_m);
 
-    diff = mp_sub(presult, qresult);
-    multiplier = mp_mul(iqmp, q);
-    ret0 = mp_mul(multiplier, diff);
-    mp_add_into(ret0, ret0, qresult);
+    mp_int *ret = mp_new(mp_max_bits(key->modulus));
+    mp_mul_into(ret, h, key->q);
+    mp_add_into(ret, ret, qresult);
 
-    /*
-     * Finally, reduce the result mod n.
-     */
-    ret = mp_mod(ret0, mod);
-
-    /*
-     * Free all the intermediate results before returning.
-     */
-    mp_free(pm1);
-    mp_free(qm1);
-    mp_free(pexp);
-    mp_free(qexp);
     mp_free(presult);
     mp_free(qresult);
     mp_free(diff);
-    mp_free(multiplier);
-    mp_free(ret0);
+    mp_free(h);
+    mp_scratch_end();
 
     return ret;
 }
 
-/*
- * Wrapper on crt_modpow that looks up all the right values from an
- * RSAKey.
- */
-static mp_int *rsa_privkey_op(mp_int *input, RSAKey *key)
-{
-    return crt_modpow(input, key->private_exponent,
-                      key->modulus, key->p, key->q, key->iqmp);
-}
-
 mp_int *rsa_ssh1_decrypt(mp_int *input, RSAKey *key)
 {
     return rsa_privkey_op(input, key);
@@ -364,6 +393,7 @@ bool rsa_verify(RSAKey *key)
      * should instead flip them round into the canonical order of
      * p > q. This also involves regenerating iqmp.
      */
+    rsa_free_precomp(key);
     mp_int *p_new = mp_max(key->p, key->q);
     mp_int *q_new = mp_min(key->p, key->q);
     mp_free(key->p);
@@ -420,6 +450,7 @@ int rsa_ssh1_public_blob_len(ptrlen data)
 
 void freersapriv(RSAKey *key)
 {
+    rsa_free_precomp(key);
     if (key->private_exponent) {
         mp_free(key->private_exponent);
         key->private_exponent = NULL;
@@ -476,6 +507,7 @@ static ssh_key *rsa2_new_pub(const ssh_keyalg *self, ptrlen data)
     rsa->modulus = get_mp_ssh2(src);
     rsa->private_exponent = NULL;
     rsa->p = rsa->q = rsa->iqmp = NULL;
+    rsa->precomp = NULL;
     rsa->comment = NULL;
 
     if (get_err(src)) {
@@ -547,6 +579,10 @@ static ssh_key *rsa2_new_priv(const ssh_keyalg *self,
         return NULL;
     }
 
+    /* Set up the private-key precomputation now, so that signing
+     * never modifies the key and it can be shared between threads. */
+    rsa_precomp(rsa);
+
     return &rsa->sshk;
 }
 
@@ -558,6 +594,7 @@ static ssh_key *rsa2_new_priv_openssh(const ssh_keyalg *self,
     rsa = snew(RSAKey);
     rsa->sshk.vt = &ssh_rsa;
     rsa->comment = NULL;
+    rsa->precomp = NULL;
 
     rsa->modulus = get_mp_ssh2(src);
     rsa->exponent = get_mp_ssh2(src);
@@ -571,6 +608,10 @@ static ssh_key *rsa2_new_priv_openssh(const ssh_keyalg *self,
         return NULL;
     }
 
+    /* Set up the private-key precomputation now, so that signing
+     * never modifies the key and it can be shared between threads. */
+    rsa_precomp(rsa);
+
     return &rsa->sshk;
 }
 
@@ -754,8 +795,10 @@ static bool rsa2_verify(ssh_key *key, ptrlen sig, ptrlen data)
     if (get_err(src) || !ptrlen_eq_string(type, "ssh-rsa"))
         return false;
 
+    mp_scratch_begin();
     in = mp_from_bytes_be(in_pl);
-    out = mp_modpow(in, rsa->exponent, rsa->modulus);
+    /* Everything here is public, so we needn't be constant-time */
+    out = mp_modpow_vartime(in, rsa->exponent, rsa->modulus);
     mp_free(in);
 
     unsigned diff = 0;
@@ -766,6 +809,7 @@ static bool rsa2_verify(ssh_key *key, ptrlen sig, ptrlen data)
     smemclr(bytes, nbytes);
     sfree(bytes);
     mp_free(out);
+    mp_scratch_end();
 
     return diff == 0;
 }
@@ -36,6 +36,7 @@ struct server {
     Plug plug;
     int conn_throttle_count;
     bool frozen;
+    size_t socket_backlog;             /* as last reported by the socket */
 
     Conf *conf;
     const SshServerConfig *ssc;
@@ -70,8 +71,9 @@ void share_activate(ssh_sharing_state *sharestate,
 void ssh_connshare_provide_connlayer(ssh_sharing_state *sharestate,
                                      ConnectionLayer *cl) {}
 int share_ndownstreams(ssh_sharing_state *sharestate) { return 0; }
+void share_output_drained(ssh_sharing_state *sharestate) {}
 void share_got_pkt_from_server(ssh_sharing_connstate *cs, int type,
-                               const void *vpkt, int pktlen) {}
+                               void *vpkt, int pktlen, size_t headroom) {}
 void share_setup_x11_channel(ssh_sharing_connstate *cs, share_channel *chan,
                              unsigned upstream_id, unsigned server_id,
                              unsigned server_currwin, unsigned server_maxpkt,
@@ -82,6 +84,7 @@ void share_setup_x11_channel(ssh_sharing_connstate *cs, share_channel *chan,
 Channel *agentf_new(SshChannel *c) { return NULL; }
 bool agent_exists(void) { return false; }
 void ssh_got_exitcode(Ssh *ssh, int exitcode) {}
+void ssh_sharing_lingering(Ssh *ssh) {}
 void ssh_check_frozen(Ssh *ssh) {}
 
 mainchan *mainchan_new(
@@ -104,6 +107,7 @@ static int server_confirm_weak_cached_hostkey(
 
 static const SeatVtable server_seat_vt = {
     .output = nullseat_output,
+    .sent = nullseat_sent,
     .eof = nullseat_eof,
     .get_userpass_input = nullseat_get_userpass_input,
     .notify_remote_exit = nullseat_notify_remote_exit,
@@ -162,9 +166,10 @@ static void server_receive(
 
 static void server_sent(Plug *plug, size_t bufsize)
 {
-#ifdef FIXME
     server *srv = container_of(plug, server, plug);
 
+    srv->socket_backlog = bufsize;
+
     /*
      * If the send backlog on the SSH socket itself clears, we should
      * unthrottle the whole world if it was throttled. Also trigger an
@@ -172,10 +177,11 @@ static void server_sent(Plug *plug, size_t bufsize)
      * some more data off its bufchain.
      */
     if (bufsize < SSH_MAX_BACKLOG) {
+#ifdef FIXME
         srv_throttle_all(srv, 0, bufsize);
+#endif
         queue_idempotent_callback(&srv->ic_out_raw);
     }
-#endif
 }
 
 LogContext *ssh_get_logctx(Ssh *ssh)
@@ -214,6 +220,20 @@ void ssh_throttle_conn(Ssh *ssh, int adjust)
     }
 }
 
+size_t ssh_output_backlog(Ssh *ssh)
+{
+    server *srv = container_of(ssh, server, ssh);
+    return bufchain_size(&srv->out_raw) + srv->socket_backlog;
+}
+
+void ssh_setup_mark(Ssh *ssh, const char *phase)
+{
+}
+
+void ssh_setup_report(Ssh *ssh)
+{
+}
+
 void ssh_conn_processed_data(Ssh *ssh)
 {
     /* FIXME: we could add the same check_frozen_state system as we
@@ -374,12 +394,14 @@ static void server_bpp_output_raw_data_callback(void *vctx)
     while (bufchain_size(&srv->out_raw) > 0) {
         size_t backlog;
 
-        ptrlen data = bufchain_prefix(&srv->out_raw);
+        ptrlen data = bufchain_prefix_coalesced(
+            &srv->out_raw, SSH_RAW_WRITE_COALESCE);
 
         if (srv->logctx)
             log_packet(srv->logctx, PKT_OUTGOING, -1, NULL, data.ptr, data.len,
                        0, NULL, NULL, 0, NULL);
         backlog = sk_write(srv->socket, data.ptr, data.len);
+        srv->socket_backlog = backlog;
 
         bufchain_consume(&srv->out_raw, data.len);
 
@@ -391,6 +413,9 @@ static void server_bpp_output_raw_data_callback(void *vctx)
         }
     }
 
+    if (srv->cl)
+        ssh_output_drained(srv->cl);
+
     if (srv->pending_close) {
         sk_close(srv->socket);
         srv->socket = NULL;
@@ -19,6 +19,16 @@ struct SshServerConfig {
     bool bare_connection;
 
     bool stunt_pretend_to_accept_any_pubkey;
+
+    /*
+     * If output_coalesce_ms is nonzero, output from a session
+     * channel's subprocess is held back for up to that long, or until
+     * output_coalesce_bytes of it have built up, so that chatty
+     * programs send fewer, larger CHANNEL_DATA messages. Coalescing
+     * is suspended while the client is typing.
+     */
+    unsigned output_coalesce_ms;
+    size_t output_coalesce_bytes;
 };
 
 Plug *ssh_server_plug(
@@ -24,46 +24,332 @@ static inline uint64_t rol(uint64_t x, unsigned shift)
 typedef uint64_t keccak_core_state[5][5];
 #define NROUNDS 24               /* would differ for other word sizes */
 static const uint64_t round_constants[NROUNDS];
-static const unsigned rotation_counts[5][5];
+
+/*
+ * Decide whether we can support hardware Keccak. The only instruction
+ * set with any real help to offer is the Armv8.2-A SHA-3 extension,
+ * whose EOR3, RAX1, XAR and BCAX instructions are each a piece of the
+ * Keccak round. x86 has nothing comparable: AVX2 can only work on a
+ * single state by shuffling lanes around for the pi step, which costs
+ * more than it saves over the unrolled integer code below.
+ */
+#define HW_SHA3_NONE 0
+#define HW_SHA3_NEON 1
+
+#ifdef _FORCE_SHA3_NEON
+#   define HW_SHA3 HW_SHA3_NEON
+#elif defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    /* As in sshsh512.c, only tested on little-endian Arm. */
+#elif defined __ARM_FEATURE_SHA3
+    /* If the Armv8.2-A SHA-3 extension is available already, we can
+     * use it without having to enable anything by hand */
+#   define HW_SHA3 HW_SHA3_NEON
+#elif defined(__clang__)
+#   if __has_attribute(target) && __has_include(<arm_neon.h>) &&       \
+    (defined(__aarch64__))
+        /* clang can enable the SHA-3 extension in AArch64 using
+         * __attribute__((target)) */
+#       define HW_SHA3 HW_SHA3_NEON
+#       define USE_CLANG_ATTR_TARGET_AARCH64
+#   endif
+#endif
+
+#if defined _FORCE_SOFTWARE_SHA || !defined HW_SHA3
+#   undef HW_SHA3
+#   define HW_SHA3 HW_SHA3_NONE
+#endif
+
+static bool keccak_hw_available(void);
+static void keccak_transform_hw(keccak_core_state A);
+
+/*
+ * Cache the results of keccak_hw_available() so it only has to run
+ * once.
+ */
+static bool keccak_hw_available_cached(void)
+{
+    static bool initialised = false;
+    static bool hw_available;
+    if (!initialised) {
+        hw_available = keccak_hw_available();
+        initialised = true;
+    }
+    return hw_available;
+}
+
+/*
+ * One Keccak round, fully unrolled, reading the state from A and
+ * writing it to R.
+ *
+ * The theta step is done as usual. Then, for each row y of the
+ * output, the five lanes that the rho and pi steps will move into
+ * that row are rotated straight into B[], and chi and iota combine
+ * them into R[x][y].
+ *
+ * This is the 'lane complementing' form described in the Keccak
+ * implementation overview: the caller keeps six of the lanes
+ * inverted, which lets most of the chi computations B[x] ^ (~B[x+1] &
+ * B[x+2]) be done as a single AND or OR, with the inversions absorbed
+ * into which lanes are stored complemented. keccak_complement() puts
+ * the state into that form and takes it out again.
+ */
+static inline void keccak_round(
+    keccak_core_state R, keccak_core_state A, uint64_t rc)
+{
+    uint64_t C[5], D[5], B[5];
+
+    C[0] = A[0][0] ^ A[0][1] ^ A[0][2] ^ A[0][3] ^ A[0][4];
+    C[1] = A[1][0] ^ A[1][1] ^ A[1][2] ^ A[1][3] ^ A[1][4];
+    C[2] = A[2][0] ^ A[2][1] ^ A[2][2] ^ A[2][3] ^ A[2][4];
+    C[3] = A[3][0] ^ A[3][1] ^ A[3][2] ^ A[3][3] ^ A[3][4];
+    C[4] = A[4][0] ^ A[4][1] ^ A[4][2] ^ A[4][3] ^ A[4][4];
+
+    D[0] = rol(C[1], 1) ^ C[4];
+    D[1] = rol(C[2], 1) ^ C[0];
+    D[2] = rol(C[3], 1) ^ C[1];
+    D[3] = rol(C[4], 1) ^ C[2];
+    D[4] = rol(C[0], 1) ^ C[3];
+
+    B[0] =     A[0][0] ^ D[0];
+    B[1] = rol(A[1][1] ^ D[1], 44);
+    B[2] = rol(A[2][2] ^ D[2], 43);
+    B[3] = rol(A[3][3] ^ D[3], 21);
+    B[4] = rol(A[4][4] ^ D[4], 14);
+    R[0][0] = B[0] ^ (B[1] | B[2]) ^ rc;
+    R[1][0] = B[1] ^ (~B[2] | B[3]);
+    R[2][0] = B[2] ^ (B[3] & B[4]);
+    R[3][0] = B[3] ^ (B[4] | B[0]);
+    R[4][0] = B[4] ^ (B[0] & B[1]);
+
+    B[0] = rol(A[3][0] ^ D[3], 28);
+    B[1] = rol(A[4][1] ^ D[4], 20);
+    B[2] = rol(A[0][2] ^ D[0],  3);
+    B[3] = rol(A[1][3] ^ D[1], 45);
+    B[4] = rol(A[2][4] ^ D[2], 61);
+    R[0][1] = B[0] ^ (B[1] | B[2]);
+    R[1][1] = B[1] ^ (B[2] & B[3]);
+    R[2][1] = B[2] ^ (B[3] | ~B[4]);
+    R[3][1] = B[3] ^ (B[4] | B[0]);
+    R[4][1] = B[4] ^ (B[0] & B[1]);
+
+    B[0] = rol(A[1][0] ^ D[1],  1);
+    B[1] = rol(A[2][1] ^ D[2],  6);
+    B[2] = rol(A[3][2] ^ D[3], 25);
+    B[3] = rol(A[4][3] ^ D[4],  8);
+    B[4] = rol(A[0][4] ^ D[0], 18);
+    R[0][2] = B[0] ^ (B[1] | B[2]);
+    R[1][2] = B[1] ^ (B[2] & B[3]);
+    R[2][2] = B[2] ^ (~B[3] & B[4]);
+    R[3][2] = ~B[3] ^ (B[4] | B[0]);
+    R[4][2] = B[4] ^ (B[0] & B[1]);
+
+    B[0] = rol(A[4][0] ^ D[4], 27);
+    B[1] = rol(A[0][1] ^ D[0], 36);
+    B[2] = rol(A[1][2] ^ D[1], 10);
+    B[3] = rol(A[2][3] ^ D[2], 15);
+    B[4] = rol(A[3][4] ^ D[3], 56);
+    R[0][3] = B[0] ^ (B[1] & B[2]);
+    R[1][3] = B[1] ^ (B[2] | B[3]);
+    R[2][3] = B[2] ^ (~B[3] | B[4]);
+    R[3][3] = ~B[3] ^ (B[4] & B[0]);
+    R[4][3] = B[4] ^ (B[0] | B[1]);
+
+    B[0] = rol(A[2][0] ^ D[2], 62);
+    B[1] = rol(A[3][1] ^ D[3], 55);
+    B[2] = rol(A[4][2] ^ D[4], 39);
+    B[3] = rol(A[0][3] ^ D[0], 41);
+    B[4] = rol(A[1][4] ^ D[1],  2);
+    R[0][4] = B[0] ^ (~B[1] & B[2]);
+    R[1][4] = ~B[1] ^ (B[2] | B[3]);
+    R[2][4] = B[2] ^ (B[3] & B[4]);
+    R[3][4] = B[3] ^ (B[4] | B[0]);
+    R[4][4] = B[4] ^ (B[0] & B[1]);
+}
+
+static inline void keccak_complement(keccak_core_state A)
+{
+    A[1][0] = ~A[1][0];
+    A[2][0] = ~A[2][0];
+    A[3][1] = ~A[3][1];
+    A[2][2] = ~A[2][2];
+    A[2][3] = ~A[2][3];
+    A[0][4] = ~A[0][4];
+}
 
 /*
  * Core Keccak transform: just squodge the state around internally,
  * without adding or extracting any data from it.
  */
+static void keccak_transform_sw(keccak_core_state A)
+{
+    keccak_core_state T;
+
+    keccak_complement(A);
+    for (unsigned round = 0; round < NROUNDS; round += 2) {
+        keccak_round(T, A, round_constants[round]);
+        keccak_round(A, T, round_constants[round + 1]);
+    }
+    keccak_complement(A);
+
+    smemclr(T, sizeof(T));
+}
+
 static void keccak_transform(keccak_core_state A)
 {
-    union {
-        uint64_t C[5];
-        uint64_t B[5][5];
-    } u;
-
-    for (unsigned round = 0; round < NROUNDS; round++) {
-        /* theta step */
-        for (unsigned x = 0; x < 5; x++)
-            u.C[x] = A[x][0] ^ A[x][1] ^ A[x][2] ^ A[x][3] ^ A[x][4];
-        for (unsigned x = 0; x < 5; x++) {
-            uint64_t D = rol(u.C[(x+1) % 5], 1) ^ u.C[(x+4) % 5];
-            for (unsigned y = 0; y < 5; y++)
-                A[x][y] ^= D;
-        }
+    if (keccak_hw_available_cached())
+        keccak_transform_hw(A);
+    else
+        keccak_transform_sw(A);
+}
+
+#if HW_SHA3 == HW_SHA3_NEON
+
+/*
+ * Manually set the target architecture, if we decided above that we
+ * need to.
+ */
+#ifdef USE_CLANG_ATTR_TARGET_AARCH64
+/*
+ * As in sshsh256.c, redefine the ACLE feature macros before including
+ * arm_neon.h, so that it will define the intrinsics we're going to
+ * enable with __attribute__((target)) on particular functions.
+ */
+#define __ARM_NEON 1
+#define __ARM_FEATURE_SHA3 1
+#define FUNC_ISA __attribute__ ((target("neon,sha3")))
+#endif /* USE_CLANG_ATTR_TARGET_AARCH64 */
+
+#ifndef FUNC_ISA
+#define FUNC_ISA
+#endif
+
+#include <arm_neon.h>
+
+static bool keccak_hw_available(void)
+{
+    /*
+     * For Arm, we delegate to a per-platform detection function (see
+     * explanation in sshaes.c).
+     */
+    return platform_sha3_hw_available();
+}
+
+/*
+ * The same round as keccak_round, with each lane in the bottom half
+ * of a NEON register. EOR3 does the five-way XOR of theta in two
+ * instructions, RAX1 makes D, XAR does the theta XOR and the rho
+ * rotation in one, and BCAX is exactly the chi operation, so there's
+ * no need for lane complementing.
+ */
+FUNC_ISA
+static inline void keccak_round_neon(
+    uint64x2_t R[5][5], uint64x2_t A[5][5], uint64x2_t rc)
+{
+    uint64x2_t C[5], D[5], B[5];
+
+    for (unsigned x = 0; x < 5; x++)
+        C[x] = veor3q_u64(veor3q_u64(A[x][0], A[x][1], A[x][2]),
+                          A[x][3], A[x][4]);
+
+    D[0] = vrax1q_u64(C[4], C[1]);
+    D[1] = vrax1q_u64(C[0], C[2]);
+    D[2] = vrax1q_u64(C[1], C[3]);
+    D[3] = vrax1q_u64(C[2], C[4]);
+    D[4] = vrax1q_u64(C[3], C[0]);
+
+    B[0] = vxarq_u64(A[0][0], D[0],  0);
+    B[1] = vxarq_u64(A[1][1], D[1], 20);
+    B[2] = vxarq_u64(A[2][2], D[2], 21);
+    B[3] = vxarq_u64(A[3][3], D[3], 43);
+    B[4] = vxarq_u64(A[4][4], D[4], 50);
+    R[0][0] = vbcaxq_u64(B[0], B[2], B[1]);
+    R[1][0] = vbcaxq_u64(B[1], B[3], B[2]);
+    R[2][0] = vbcaxq_u64(B[2], B[4], B[3]);
+    R[3][0] = vbcaxq_u64(B[3], B[0], B[4]);
+    R[4][0] = vbcaxq_u64(B[4], B[1], B[0]);
+
+    B[0] = vxarq_u64(A[3][0], D[3], 36);
+    B[1] = vxarq_u64(A[4][1], D[4], 44);
+    B[2] = vxarq_u64(A[0][2], D[0], 61);
+    B[3] = vxarq_u64(A[1][3], D[1], 19);
+    B[4] = vxarq_u64(A[2][4], D[2],  3);
+    R[0][1] = vbcaxq_u64(B[0], B[2], B[1]);
+    R[1][1] = vbcaxq_u64(B[1], B[3], B[2]);
+    R[2][1] = vbcaxq_u64(B[2], B[4], B[3]);
+    R[3][1] = vbcaxq_u64(B[3], B[0], B[4]);
+    R[4][1] = vbcaxq_u64(B[4], B[1], B[0]);
+
+    B[0] = vxarq_u64(A[1][0], D[1], 63);
+    B[1] = vxarq_u64(A[2][1], D[2], 58);
+    B[2] = vxarq_u64(A[3][2], D[3], 39);
+    B[3] = vxarq_u64(A[4][3], D[4], 56);
+    B[4] = vxarq_u64(A[0][4], D[0], 46);
+    R[0][2] = vbcaxq_u64(B[0], B[2], B[1]);
+    R[1][2] = vbcaxq_u64(B[1], B[3], B[2]);
+    R[2][2] = vbcaxq_u64(B[2], B[4], B[3]);
+    R[3][2] = vbcaxq_u64(B[3], B[0], B[4]);
+    R[4][2] = vbcaxq_u64(B[4], B[1], B[0]);
+
+    B[0] = vxarq_u64(A[4][0], D[4], 37);
+    B[1] = vxarq_u64(A[0][1], D[0], 28);
+    B[2] = vxarq_u64(A[1][2], D[1], 54);
+    B[3] = vxarq_u64(A[2][3], D[2], 49);
+    B[4] = vxarq_u64(A[3][4], D[3],  8);
+    R[0][3] = vbcaxq_u64(B[0], B[2], B[1]);
+    R[1][3] = vbcaxq_u64(B[1], B[3], B[2]);
+    R[2][3] = vbcaxq_u64(B[2], B[4], B[3]);
+    R[3][3] = vbcaxq_u64(B[3], B[0], B[4]);
+    R[4][3] = vbcaxq_u64(B[4], B[1], B[0]);
+
+    B[0] = vxarq_u64(A[2][0], D[2],  2);
+    B[1] = vxarq_u64(A[3][1], D[3],  9);
+    B[2] = vxarq_u64(A[4][2], D[4], 25);
+    B[3] = vxarq_u64(A[0][3], D[0], 23);
+    B[4] = vxarq_u64(A[1][4], D[1], 62);
+    R[0][4] = vbcaxq_u64(B[0], B[2], B[1]);
+    R[1][4] = vbcaxq_u64(B[1], B[3], B[2]);
+    R[2][4] = vbcaxq_u64(B[2], B[4], B[3]);
+    R[3][4] = vbcaxq_u64(B[3], B[0], B[4]);
+    R[4][4] = vbcaxq_u64(B[4], B[1], B[0]);
+    R[0][0] = veorq_u64(R[0][0], rc);
+}
 
-        /* rho and pi steps */
-        for (unsigned x = 0; x < 5; x++)
-            for (unsigned y = 0; y < 5; y++)
-                u.B[y][(2*x+3*y) % 5] = rol(A[x][y], rotation_counts[x][y]);
+FUNC_ISA
+static void keccak_transform_hw(keccak_core_state A)
+{
+    uint64x2_t S[5][5], T[5][5];
 
-        /* chi step */
-        for (unsigned x = 0; x < 5; x++)
-            for (unsigned y = 0; y < 5; y++)
-                A[x][y] = u.B[x][y] ^ (u.B[(x+2)%5][y] & ~u.B[(x+1)%5][y]);
+    for (unsigned x = 0; x < 5; x++)
+        for (unsigned y = 0; y < 5; y++)
+            S[x][y] = vdupq_n_u64(A[x][y]);
 
-        /* iota step */
-        A[0][0] ^= round_constants[round];
+    for (unsigned round = 0; round < NROUNDS; round += 2) {
+        keccak_round_neon(T, S, vdupq_n_u64(round_constants[round]));
+        keccak_round_neon(S, T, vdupq_n_u64(round_constants[round + 1]));
     }
 
-    smemclr(&u, sizeof(u));
+    for (unsigned x = 0; x < 5; x++)
+        for (unsigned y = 0; y < 5; y++)
+            A[x][y] = vgetq_lane_u64(S[x][y], 0);
+
+    smemclr(S, sizeof(S));
+    smemclr(T, sizeof(T));
+}
+
+#elif HW_SHA3 == HW_SHA3_NONE
+
+static bool keccak_hw_available(void)
+{
+    return false;
 }
 
+static void keccak_transform_hw(keccak_core_state A)
+{
+    unreachable("Should never be called");
+}
+
+#endif /* HW_SHA3 */
+
 typedef struct {
     keccak_core_state A;
     unsigned char bytes[25*8];
@@ -205,8 +491,12 @@ static const uint64_t round_constants[24] = {
 };
 
 /*
- * Keccak per-element rotation counts, generated from the matrix
- * formula in the Keccak reference by the following piece of Python:
+ * Keccak per-element rotation counts, written out inline in
+ * keccak_round (and in keccak_round_neon as 64 minus each count,
+ * because XAR rotates right). rotation_counts[x][y], in the table
+ * below, is the count for lane A[x][y]. It was generated from the
+ * matrix formula in the Keccak reference by the following piece of
+ * Python:
 
 coords = [1, 0]
 while len(coords) < 26:
@@ -221,8 +511,8 @@ for y in range(5):
     print("    {{{}}},".format(", ".join("{:2d}".format(f(matrix[y,x]))
                                          for x in range(5))))
 
-*/
-static const unsigned rotation_counts[5][5] = {
+
+rotation_counts[5][5] = {
     { 0, 36,  3, 41, 18},
     { 1, 44, 10, 45,  2},
     {62,  6, 43, 15, 61},
@@ -230,6 +520,8 @@ static const unsigned rotation_counts[5][5] = {
     {27, 20, 39,  8, 14},
 };
 
+*/
+
 /*
  * The PuTTY ssh_hashalg abstraction.
  */
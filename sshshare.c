@@ -47,6 +47,19 @@
  * downstreams, and sends the incoming CHANNEL_OPENs to those
  * downstreams when connections come in).
  *
+ * The one global request the upstream answers entirely by itself is
+ * "share-stats@putty.projects.tartarus.org", with which a downstream
+ * can find out what all the downstreams of the connection are doing.
+ * Its reply, in REQUEST_SUCCESS, is a uint32 count of downstreams
+ * followed by that many records of the form
+ *
+ *     uint32     downstream id (as used in the upstream's log)
+ *     uint32     number of open channels
+ *     uint64     bytes received from the downstream
+ *     uint64     bytes sent to the downstream
+ *     uint64     bytes from the downstream waiting to go upstream
+ *     uint64     bytes waiting to be written to the downstream
+ *
  * Other fiddly pieces of this mechanism are X forwarding and
  * (OpenSSH-style) agent forwarding. Both of these have a fundamental
  * problem arising from the protocol design: that the CHANNEL_OPEN
@@ -148,6 +161,17 @@ struct ssh_sharing_state {
     ConnectionLayer *cl;             /* instance of the ssh connection layer */
     char *server_verstring;          /* server version string after "SSH-" */
 
+    /*
+     * Fair queueing of bulk data between downstreams (see
+     * share_process_input). sched_nwaiting counts the downstreams
+     * held back with a data packet to send; sched_last is the id of
+     * the one last given a turn.
+     */
+    IdempotentCallback ic_sched;
+    int sched_nwaiting;
+    unsigned sched_last;
+    bool sched_running;
+
     Plug plug;
 };
 
@@ -162,11 +186,26 @@ struct ssh_sharing_connstate {
     int crLine;                        /* coroutine state for share_receive */
 
     bool sent_verstring, got_verstring;
-    int curr_packetlen;
 
     unsigned char recvbuf[0x4010];
     size_t recvlen;
 
+    /*
+     * Data received from downstream after its version string, not yet
+     * passed upstream. share_process_input takes whole packets off
+     * the front of this while the scheduler lets it, and we freeze
+     * the socket while there's too much of it.
+     */
+    bufchain inqueue;
+    bool frozen;
+    bool processing_input;             /* so cleanup mustn't free us yet */
+    bool sched_waiting;
+    long sched_deficit;
+
+    /* Statistics, for share-stats@putty.projects.tartarus.org */
+    uint64_t bytes_up, bytes_down;
+    size_t down_backlog;
+
     /*
      * Assorted state we have to remember about this downstream, so
      * that we can clean it up appropriately when the downstream goes
@@ -287,7 +326,8 @@ struct share_xchannel {
 
 enum {
     GLOBREQ_TCPIP_FORWARD,
-    GLOBREQ_CANCEL_TCPIP_FORWARD
+    GLOBREQ_CANCEL_TCPIP_FORWARD,
+    GLOBREQ_SHARE_STATS     /* answered by us, but in turn with the rest */
 };
 
 struct share_globreq {
@@ -312,6 +352,20 @@ static int share_connstate_cmp(void *av, void *bv)
         return 0;
 }
 
+static int share_connstate_find(void *av, void *bv)
+{
+    unsigned a = *(unsigned *)av;
+    const struct ssh_sharing_connstate *b =
+        (const struct ssh_sharing_connstate *)bv;
+
+    if (a < b->id)
+        return -1;
+    else if (a > b->id)
+        return +1;
+    else
+        return 0;
+}
+
 static unsigned share_find_unused_id
 (struct ssh_sharing_state *sharestate, unsigned first)
 {
@@ -471,6 +525,10 @@ static void share_connstate_free(struct ssh_sharing_connstate *cs)
     struct share_channel *chan;
     struct share_forwarding *fwd;
 
+    if (cs->sched_waiting)
+        cs->parent->sched_nwaiting--;
+    bufchain_clear(&cs->inqueue);
+
     while ((hc = (struct share_halfchannel *)
             delpos234(cs->halfchannels, 0)) != NULL)
         sfree(hc);
@@ -521,6 +579,7 @@ void sharestate_free(ssh_sharing_state *sharestate)
         share_connstate_free(cs);
     }
     freetree234(sharestate->connections);
+    delete_callbacks_for_context(sharestate);
     if (sharestate->listensock) {
         sk_close(sharestate->listensock);
         sharestate->listensock = NULL;
@@ -778,7 +837,8 @@ static void send_packet_to_downstream(struct ssh_sharing_connstate *cs,
             data.ptr = (const char *)data.ptr + this_len;
             data.len -= this_len;
             PUT_32BIT_MSB_FIRST(packet->s, packet->len-4);
-            sk_write(cs->sock, packet->s, packet->len);
+            cs->bytes_down += packet->len;
+            cs->down_backlog = sk_write(cs->sock, packet->s, packet->len);
             strbuf_free(packet);
         } while (data.len > 0);
     } else {
@@ -790,11 +850,32 @@ static void send_packet_to_downstream(struct ssh_sharing_connstate *cs,
         put_byte(packet, type);
         put_data(packet, pkt, pktlen);
         PUT_32BIT_MSB_FIRST(packet->s, packet->len-4);
-        sk_write(cs->sock, packet->s, packet->len);
+        cs->bytes_down += packet->len;
+        cs->down_backlog = sk_write(cs->sock, packet->s, packet->len);
         strbuf_free(packet);
     }
 }
 
+/*
+ * Send a packet downstream without copying it, by writing the
+ * downstream framing into the (at least 5) bytes of headroom that the
+ * upstream BPP left in front of the payload.
+ */
+static void send_packet_to_downstream_in_place(
+    struct ssh_sharing_connstate *cs, int type, unsigned char *pkt,
+    int pktlen)
+{
+    unsigned char *start = pkt - 5;
+
+    if (!cs->sock) /* throw away all packets destined for a dead downstream */
+        return;
+
+    PUT_32BIT_MSB_FIRST(start, pktlen + 1);
+    start[4] = type;
+    cs->bytes_down += pktlen + 5;
+    cs->down_backlog = sk_write(cs->sock, start, pktlen + 5);
+}
+
 static void share_try_cleanup(struct ssh_sharing_connstate *cs)
 {
     int i;
@@ -894,7 +975,7 @@ static void share_try_cleanup(struct ssh_sharing_connstate *cs)
 
     if (count234(cs->halfchannels) == 0 &&
         count234(cs->channels_by_us) == 0 &&
-        count234(cs->forwardings) == 0) {
+        count234(cs->forwardings) == 0 && !cs->processing_input) {
         struct ssh_sharing_state *sharestate = cs->parent;
 
         /*
@@ -920,6 +1001,13 @@ static void share_begin_cleanup(struct ssh_sharing_connstate *cs)
     sk_close(cs->sock);
     cs->sock = NULL;
 
+    /* Nothing else downstream sent us is going anywhere now */
+    bufchain_clear(&cs->inqueue);
+    if (cs->sched_waiting) {
+        cs->sched_waiting = false;
+        cs->parent->sched_nwaiting--;
+    }
+
     share_try_cleanup(cs);
 }
 
@@ -1163,10 +1251,65 @@ void share_setup_x11_channel(ssh_sharing_connstate *cs, share_channel *chan,
     }
 }
 
+static void share_queue_globreq(struct ssh_sharing_connstate *cs, int type,
+                                bool want_reply, struct share_forwarding *fwd)
+{
+    struct share_globreq *globreq = snew(struct share_globreq);
+    globreq->next = NULL;
+    globreq->type = type;
+    globreq->want_reply = want_reply;
+    globreq->fwd = fwd;
+    if (cs->globreq_tail)
+        cs->globreq_tail->next = globreq;
+    else
+        cs->globreq_head = globreq;
+    cs->globreq_tail = globreq;
+}
+
+static void share_send_stats(struct ssh_sharing_connstate *cs)
+{
+    struct ssh_sharing_state *sharestate = cs->parent;
+    struct ssh_sharing_connstate *other;
+    strbuf *packet = strbuf_new();
+    iter234 it;
+
+    put_uint32(packet, count234(sharestate->connections));
+    for (other = iter234_first(&it, sharestate->connections); other;
+         other = iter234_next(&it)) {
+        put_uint32(packet, other->id);
+        put_uint32(packet, count234(other->channels_by_us));
+        put_uint64(packet, other->bytes_up);
+        put_uint64(packet, other->bytes_down);
+        put_uint64(packet, bufchain_size(&other->inqueue));
+        put_uint64(packet, other->down_backlog);
+    }
+    send_packet_to_downstream(cs, SSH2_MSG_REQUEST_SUCCESS,
+                              packet->s, packet->len, NULL);
+    strbuf_free(packet);
+}
+
+/*
+ * Reply to any global requests of our own that have reached the
+ * front of a downstream's queue.
+ */
+static void share_answer_own_globreqs(struct ssh_sharing_connstate *cs)
+{
+    struct share_globreq *globreq;
+
+    while ((globreq = cs->globreq_head) != NULL &&
+           globreq->type == GLOBREQ_SHARE_STATS) {
+        share_send_stats(cs);
+        cs->globreq_head = globreq->next;
+        sfree(globreq);
+        if (cs->globreq_head == NULL)
+            cs->globreq_tail = NULL;
+    }
+}
+
 void share_got_pkt_from_server(ssh_sharing_connstate *cs, int type,
-                               const void *vpkt, int pktlen)
+                               void *vpkt, int pktlen, size_t headroom)
 {
-    const unsigned char *pkt = (const unsigned char *)vpkt;
+    unsigned char *pkt = (unsigned char *)vpkt;
     struct share_globreq *globreq;
     size_t id_pos;
     unsigned upstream_id, server_id;
@@ -1199,6 +1342,7 @@ void share_got_pkt_from_server(ssh_sharing_connstate *cs, int type,
         sfree(globreq);
         if (cs->globreq_head == NULL)
             cs->globreq_tail = NULL;
+        share_answer_own_globreqs(cs);
 
         if (!cs->sock) {
             /* Retry cleaning up this connection, in case that reply
@@ -1237,12 +1381,19 @@ void share_got_pkt_from_server(ssh_sharing_connstate *cs, int type,
         if ((chan = share_find_channel_by_upstream(cs, upstream_id)) != NULL) {
             /*
              * The normal case: this id refers to an open channel.
+             * The packet is ours to scribble on, so rewrite the id
+             * in place, and if there's room in front of it for the
+             * downstream framing (and no CHANNEL_DATA splitting to
+             * do) then send it straight from where it is.
              */
-            unsigned char *rewritten = snewn(pktlen, unsigned char);
-            memcpy(rewritten, pkt, pktlen);
-            PUT_32BIT_MSB_FIRST(rewritten + id_pos, chan->downstream_id);
-            send_packet_to_downstream(cs, type, rewritten, pktlen, chan);
-            sfree(rewritten);
+            PUT_32BIT_MSB_FIRST(pkt + id_pos, chan->downstream_id);
+            if (headroom >= 5 &&
+                (type != SSH2_MSG_CHANNEL_DATA ||
+                 (pktlen >= 8 && GET_32BIT_MSB_FIRST(pkt + 4) <=
+                  chan->downstream_maxpkt)))
+                send_packet_to_downstream_in_place(cs, type, pkt, pktlen);
+            else
+                send_packet_to_downstream(cs, type, pkt, pktlen, chan);
 
             /*
              * Update the channel state, for messages that need it.
@@ -1305,7 +1456,6 @@ static void share_got_pkt_from_downstream(struct ssh_sharing_connstate *cs,
     size_t id_pos;
     unsigned maxpkt;
     unsigned old_id, new_id, server_id;
-    struct share_globreq *globreq;
     struct share_channel *chan;
     struct share_halfchannel *hc;
     struct share_xchannel *xc;
@@ -1389,16 +1539,8 @@ static void share_got_pkt_from_downstream(struct ssh_sharing_connstate *cs,
                 ssh_sharing_queue_global_request(cs->parent->cl, cs);
 
                 if (fwd) {
-                    globreq = snew(struct share_globreq);
-                    globreq->next = NULL;
-                    if (cs->globreq_tail)
-                        cs->globreq_tail->next = globreq;
-                    else
-                        cs->globreq_head = globreq;
-                    globreq->fwd = fwd;
-                    globreq->want_reply = orig_wantreply;
-                    globreq->type = GLOBREQ_TCPIP_FORWARD;
-
+                    share_queue_globreq(cs, GLOBREQ_TCPIP_FORWARD,
+                                        orig_wantreply, fwd);
                     fwd->rpf = rpf;
                 }
             }
@@ -1454,18 +1596,23 @@ static void share_got_pkt_from_downstream(struct ssh_sharing_connstate *cs,
                  * And queue a globreq so that when the reply comes
                  * back we know to cancel it.
                  */
-                globreq = snew(struct share_globreq);
-                globreq->next = NULL;
-                if (cs->globreq_tail)
-                    cs->globreq_tail->next = globreq;
-                else
-                    cs->globreq_head = globreq;
-                globreq->fwd = fwd;
-                globreq->want_reply = orig_wantreply;
-                globreq->type = GLOBREQ_CANCEL_TCPIP_FORWARD;
+                share_queue_globreq(cs, GLOBREQ_CANCEL_TCPIP_FORWARD,
+                                    orig_wantreply, fwd);
             }
 
             sfree(host);
+        } else if (ptrlen_eq_string(
+                       request_name,
+                       "share-stats@putty.projects.tartarus.org")) {
+            /*
+             * Our own statistics request. This goes no further than
+             * us, but its reply still has to wait its turn behind
+             * those of any requests we've passed on to the server.
+             */
+            if (orig_wantreply) {
+                share_queue_globreq(cs, GLOBREQ_SHARE_STATS, true, NULL);
+                share_answer_own_globreqs(cs);
+            }
         } else {
             /*
              * Request we don't understand. Manufacture a failure
@@ -1753,6 +1900,140 @@ static void share_got_pkt_from_downstream(struct ssh_sharing_connstate *cs,
         (c) = (unsigned char)*data++;                           \
     } while (0)
 
+/*
+ * Bulk data from downstreams is scheduled much like the connection
+ * layer schedules its own channels (see ssh2_connection_schedule), so
+ * that one busy downstream can't crowd out the rest:
+ *
+ *  - a downstream's packets go upstream in the order it sent them,
+ *    and only while the connection layer says its outgoing backlog
+ *    has room for bulk data;
+ *
+ *  - once any downstream is held back with a data packet of more
+ *    than SHARE_SEND_SMALL bytes at the front of its queue, the held
+ *    downstreams take turns by deficit round robin, SHARE_SEND_QUANTUM
+ *    bytes per turn, whenever the backlog drains;
+ *
+ *  - we stop reading from a downstream while it has more than
+ *    SHARE_INPUT_LIMIT bytes queued.
+ */
+#define SHARE_SEND_SMALL 1024
+#define SHARE_SEND_QUANTUM 65536
+#define SHARE_INPUT_LIMIT 65536
+
+static bool share_may_send_bulk(struct ssh_sharing_connstate *cs)
+{
+    struct ssh_sharing_state *sharestate = cs->parent;
+
+    if (!ssh_sharing_may_send_bulk(sharestate->cl))
+        return false;
+    if (sharestate->sched_running)
+        return cs->sched_deficit > 0;
+    return sharestate->sched_nwaiting == (cs->sched_waiting ? 1 : 0);
+}
+
+/*
+ * Returns false if the downstream has gone away, in which case cs
+ * may have been freed.
+ */
+static bool share_process_input(struct ssh_sharing_connstate *cs)
+{
+    struct ssh_sharing_state *sharestate = cs->parent;
+    unsigned char lenbuf[4];
+    size_t pktlen;
+    bool held = false, frozen;
+    int type;
+
+    cs->processing_input = true;
+    while (cs->sock && bufchain_size(&cs->inqueue) >= 4) {
+        bufchain_fetch(&cs->inqueue, lenbuf, 4);
+        pktlen = GET_32BIT_MSB_FIRST(lenbuf) + (size_t)4;
+        if (pktlen < 5 || pktlen > sizeof(cs->recvbuf)) {
+            char *buf = dupprintf("Bad packet length %u\n",
+                                  (unsigned)(pktlen - 4));
+            share_disconnect(cs, buf);
+            sfree(buf);
+            break;
+        }
+        if (bufchain_size(&cs->inqueue) < pktlen)
+            break;
+
+        bufchain_fetch(&cs->inqueue, cs->recvbuf, pktlen);
+        type = cs->recvbuf[4];
+        if ((type == SSH2_MSG_CHANNEL_DATA ||
+             type == SSH2_MSG_CHANNEL_EXTENDED_DATA) &&
+            pktlen > SHARE_SEND_SMALL) {
+            if (!share_may_send_bulk(cs)) {
+                held = true;
+                break;
+            }
+            cs->sched_deficit -= pktlen;
+        }
+        bufchain_consume(&cs->inqueue, pktlen);
+        cs->bytes_up += pktlen;
+
+        share_got_pkt_from_downstream(cs, type, cs->recvbuf + 5, pktlen - 5);
+    }
+    cs->processing_input = false;
+
+    if (!cs->sock) {
+        /* Finish any cleanup we held up by being in the loop above */
+        share_try_cleanup(cs);
+        return false;
+    }
+
+    if (held && !cs->sched_waiting) {
+        cs->sched_waiting = true;
+        cs->sched_deficit = 0;
+        sharestate->sched_nwaiting++;
+        queue_idempotent_callback(&sharestate->ic_sched);
+    } else if (!held && cs->sched_waiting) {
+        cs->sched_waiting = false;
+        sharestate->sched_nwaiting--;
+    }
+
+    frozen = bufchain_size(&cs->inqueue) > SHARE_INPUT_LIMIT;
+    if (frozen != cs->frozen) {
+        cs->frozen = frozen;
+        sk_set_frozen(cs->sock, frozen);
+    }
+    return true;
+}
+
+static void share_schedule(void *vctx)
+{
+    struct ssh_sharing_state *sharestate = (struct ssh_sharing_state *)vctx;
+    struct ssh_sharing_connstate *cs;
+
+    sharestate->sched_running = true;
+    while (sharestate->sched_nwaiting > 0 &&
+           ssh_sharing_may_send_bulk(sharestate->cl)) {
+        /*
+         * Step to the next downstream after the last one, wrapping
+         * round at the end, and looking it up by id each time in case
+         * the last one went away.
+         */
+        cs = findrel234(sharestate->connections, &sharestate->sched_last,
+                        share_connstate_find, REL234_GT);
+        if (!cs)
+            cs = index234(sharestate->connections, 0);
+        assert(cs);                /* sched_nwaiting counts some downstream */
+        sharestate->sched_last = cs->id;
+
+        if (cs->sched_waiting) {
+            cs->sched_deficit += SHARE_SEND_QUANTUM;
+            share_process_input(cs);
+        }
+    }
+    sharestate->sched_running = false;
+}
+
+void share_output_drained(ssh_sharing_state *sharestate)
+{
+    if (sharestate->sched_nwaiting > 0)
+        queue_idempotent_callback(&sharestate->ic_sched);
+}
+
 static void share_receive(Plug *plug, int urgent, const char *data, size_t len)
 {
     ssh_sharing_connstate *cs = container_of(
@@ -1800,30 +2081,14 @@ static void share_receive(Plug *plug, int urgent, const char *data, size_t len)
     cs->got_verstring = true;
 
     /*
-     * Loop round reading packets.
+     * Everything after that goes into the input queue, which
+     * share_process_input works through as the scheduler lets it.
      */
     while (1) {
-        cs->recvlen = 0;
-        while (cs->recvlen < 4) {
-            crGetChar(c);
-            cs->recvbuf[cs->recvlen++] = c;
-        }
-        cs->curr_packetlen = toint(GET_32BIT_MSB_FIRST(cs->recvbuf) + 4);
-        if (cs->curr_packetlen < 5 ||
-            cs->curr_packetlen > sizeof(cs->recvbuf)) {
-            char *buf = dupprintf("Bad packet length %u\n",
-                                  (unsigned)cs->curr_packetlen);
-            share_disconnect(cs, buf);
-            sfree(buf);
-            goto dead;
-        }
-        while (cs->recvlen < cs->curr_packetlen) {
-            crGetChar(c);
-            cs->recvbuf[cs->recvlen++] = c;
-        }
-
-        share_got_pkt_from_downstream(cs, cs->recvbuf[4],
-                                      cs->recvbuf + 5, cs->recvlen - 5);
+        bufchain_add(&cs->inqueue, data, len);
+        if (!share_process_input(cs))
+            return;
+        crReturnV;
     }
 
   dead:;
@@ -1832,17 +2097,18 @@ static void share_receive(Plug *plug, int urgent, const char *data, size_t len)
 
 static void share_sent(Plug *plug, size_t bufsize)
 {
-    /* ssh_sharing_connstate *cs = container_of(
-        plug, ssh_sharing_connstate, plug); */
+    ssh_sharing_connstate *cs = container_of(
+        plug, ssh_sharing_connstate, plug);
 
     /*
-     * We do nothing here, because we expect that there won't be a
-     * need to throttle and unthrottle the connection to a downstream.
-     * It should automatically throttle itself: if the SSH server
-     * sends huge amounts of data on all channels then it'll run out
-     * of window until our downstream sends it back some
-     * WINDOW_ADJUSTs.
+     * We only note the backlog for the statistics, because we expect
+     * that there won't be a need to throttle and unthrottle the
+     * connection to a downstream. It should automatically throttle
+     * itself: if the SSH server sends huge amounts of data on all
+     * channels then it'll run out of window until our downstream
+     * sends it back some WINDOW_ADJUSTs.
      */
+    cs->down_backlog = bufsize;
 }
 
 static void share_listen_closing(Plug *plug, const char *error_msg,
@@ -1949,6 +2215,13 @@ static int share_listen_accepting(Plug *plug,
     cs->got_verstring = false;
     cs->recvlen = 0;
     cs->crLine = 0;
+    bufchain_init(&cs->inqueue);
+    cs->frozen = false;
+    cs->processing_input = false;
+    cs->sched_waiting = false;
+    cs->sched_deficit = 0;
+    cs->bytes_up = cs->bytes_down = 0;
+    cs->down_backlog = 0;
     cs->halfchannels = newtree234(share_halfchannel_cmp);
     cs->channels_by_us = newtree234(share_channel_us_cmp);
     cs->channels_by_server = newtree234(share_channel_server_cmp);
@@ -2170,6 +2443,12 @@ Socket *ssh_connection_sharing_init(
         sharestate->server_verstring = NULL;
         sharestate->sockname = sockname;
         sharestate->nextid = 1;
+        sharestate->ic_sched.fn = share_schedule;
+        sharestate->ic_sched.ctx = sharestate;
+        sharestate->ic_sched.queued = false;
+        sharestate->sched_nwaiting = 0;
+        sharestate->sched_last = 0;
+        sharestate->sched_running = false;
         break;
     }
 
@@ -129,3 +129,92 @@ void free_rportfwd(struct ssh_rportfwd *rpf)
         sfree(rpf);
     }
 }
+
+/* ----------------------------------------------------------------------
+ * Token buckets for limiting the rate of channel data.
+ *
+ * 'credit' is kept in units of 1/TICKSPERSEC of a byte, so that each
+ * tick that passes adds exactly 'rate' to it without any rounding.
+ */
+
+#define RATELIMIT_BURST_TICKS (TICKSPERSEC / 4)
+
+struct RateLimit {
+    unsigned long rate;                /* bytes per second */
+    uint64_t credit;
+    unsigned long last;                /* when credit was last topped up */
+    unsigned refcount;
+};
+
+static uint64_t ratelimit_max_credit(RateLimit *rl)
+{
+    return (uint64_t)rl->rate * RATELIMIT_BURST_TICKS;
+}
+
+static void ratelimit_update(RateLimit *rl)
+{
+    unsigned long now = GETTICKCOUNT();
+    unsigned long elapsed = now - rl->last;
+    uint64_t max = ratelimit_max_credit(rl);
+
+    if (elapsed > RATELIMIT_BURST_TICKS)
+        elapsed = RATELIMIT_BURST_TICKS;   /* enough to fill it anyway */
+    rl->credit += (uint64_t)elapsed * rl->rate;
+    if (rl->credit > max)
+        rl->credit = max;
+    rl->last = now;
+}
+
+RateLimit *ratelimit_new(unsigned long rate)
+{
+    RateLimit *rl = snew(RateLimit);
+    rl->rate = rate;
+    rl->credit = ratelimit_max_credit(rl);
+    rl->last = GETTICKCOUNT();
+    rl->refcount = 1;
+    return rl;
+}
+
+RateLimit *ratelimit_ref(RateLimit *rl)
+{
+    rl->refcount++;
+    return rl;
+}
+
+void ratelimit_free(RateLimit *rl)
+{
+    if (--rl->refcount == 0)
+        sfree(rl);
+}
+
+void ratelimit_set_rate(RateLimit *rl, unsigned long rate)
+{
+    ratelimit_update(rl);
+    rl->rate = rate;
+    if (rl->credit > ratelimit_max_credit(rl))
+        rl->credit = ratelimit_max_credit(rl);
+}
+
+size_t ratelimit_available(RateLimit *rl)
+{
+    ratelimit_update(rl);
+    return rl->credit / TICKSPERSEC;
+}
+
+void ratelimit_consume(RateLimit *rl, size_t len)
+{
+    uint64_t cost = (uint64_t)len * TICKSPERSEC;
+    rl->credit = (cost < rl->credit ? rl->credit - cost : 0);
+}
+
+unsigned long ratelimit_wait(RateLimit *rl, size_t len)
+{
+    uint64_t need = (uint64_t)len * TICKSPERSEC;
+
+    ratelimit_update(rl);
+    if (need > ratelimit_max_credit(rl))
+        need = ratelimit_max_credit(rl);
+    if (need <= rl->credit)
+        return 0;
+    return (need - rl->credit + rl->rate - 1) / rl->rate;
+}
@@ -59,66 +59,97 @@ struct LZ77Context {
 };
 
 /*
- * Initialise the private fields of an LZ77Context. It's up to the
- * user to initialise the public fields.
+ * Initialise the private fields of an LZ77Context. `level' trades
+ * speed against compression ratio in the same way as zlib's levels
+ * 1 to 9; anything out of that range gets the default. It's up to
+ * the user to initialise the public fields.
  */
-static int lz77_init(struct LZ77Context *ctx);
+static int lz77_init(struct LZ77Context *ctx, int level);
 
 /*
  * Supply data to be compressed. Will update the private fields of
  * the LZ77Context, and will call literal() and match() to output.
- * If `compress' is false, it will never emit a match, but will
- * instead call literal() for everything.
+ * All the data is output before this function returns, so that
+ * the caller can end a block afterwards.
  */
 static void lz77_compress(struct LZ77Context *ctx,
                           const unsigned char *data, int len);
 
+/*
+ * Add data to the window without compressing it, because the caller
+ * is sending it some other way. Later matches can still refer back
+ * into it, but it isn't indexed in the hash chains.
+ */
+static void lz77_skip(struct LZ77Context *ctx,
+                      const unsigned char *data, int len);
+
 /*
  * Modifiable parameters.
  */
 #define WINSIZE 32768                  /* window size. Must be power of 2! */
-#define HASHMAX 2039                   /* one more than max hash value */
-#define MAXMATCH 32                    /* how many matches we track */
+#define HASHBITS 15                    /* log2 of the hash table size */
 #define HASHCHARS 3                    /* how many chars make a hash */
+#define MAXLEN 258                     /* longest match Deflate can send */
+#define DEFAULT_LEVEL 6
 
 /*
- * This compressor takes a less slapdash approach than the
- * gzip/zlib one. Rather than allowing our hash chains to fall into
- * disuse near the far end, we keep them doubly linked so we can
- * _find_ the far end, and then every time we add a new byte to the
- * window (thus rolling round by one and removing the previous
- * byte), we can carefully remove the hash chain entry.
+ * The hash chains work the same way as zlib's. head[] gives the most
+ * recent position with each hash value, and prev[] links every
+ * position to the previous one with the same hash. Nothing is ever
+ * removed from a chain: a search simply stops when it gets further
+ * back than the window reaches, or when it has looked at as many
+ * entries as the compression level allows.
+ *
+ * Positions are indices into buf[], which holds the data being
+ * compressed preceded by at least a window's worth of history.
+ * When buf[] fills up, we slide its contents down by exactly
+ * WINSIZE, so that prev[] (indexed by position mod WINSIZE) stays
+ * consistent.
  */
-
-#define INVALID -1                     /* invalid hash _and_ invalid offset */
-struct WindowEntry {
-    short next, prev;                  /* array indices within the window */
-    short hashval;
+#define INVALID -1                     /* invalid position */
+#define BUFSIZE (3 * WINSIZE)
+
+struct LZ77Level {
+    int good;          /* search less hard once we have a match this long */
+    int lazy;          /* try for a better match only below this length */
+    int nice;          /* stop searching at a match this long */
+    int chain;         /* most hash chain entries to examine */
 };
 
-struct HashEntry {
-    short first;                       /* window index of first in chain */
-};
-
-struct Match {
-    int distance, len;
+static const struct LZ77Level lz77_levels[] = {
+    /* The same tuning as zlib's. Levels 1-3 do no lazy matching. */
+    {0, 0, 0, 0},                      /* level 0, unused */
+    {4, 0, 8, 4},
+    {4, 0, 16, 8},
+    {4, 0, 32, 32},
+    {4, 4, 16, 16},
+    {8, 16, 32, 32},
+    {8, 16, 128, 128},
+    {8, 32, 128, 256},
+    {32, 128, MAXLEN, 1024},
+    {32, MAXLEN, MAXLEN, 4096},
 };
 
 struct LZ77InternalContext {
-    struct WindowEntry win[WINSIZE];
-    unsigned char data[WINSIZE];
-    int winpos;
-    struct HashEntry hashtab[HASHMAX];
-    unsigned char pending[HASHCHARS];
-    int npending;
+    const struct LZ77Level *level;
+    unsigned char buf[BUFSIZE];
+    int head[1 << HASHBITS];
+    int prev[WINSIZE];
+    int end;                           /* end of the data in buf */
+    int pos;                           /* next byte to compress */
+    int ins;                           /* next position to hash */
 };
 
-static int lz77_hash(const unsigned char *data)
+static inline unsigned lz77_hash(const unsigned char *data)
 {
-    return (257 * data[0] + 263 * data[1] + 269 * data[2]) % HASHMAX;
+    /* Multiplicative hashing: the top bits of the product depend on
+     * all three bytes */
+    uint32_t v = data[0] | ((uint32_t)data[1] << 8) |
+        ((uint32_t)data[2] << 16);
+    return (uint32_t)(v * 0x9E3779B1U) >> (32 - HASHBITS);
 }
 
-static int lz77_init(struct LZ77Context *ctx)
+static int lz77_init(struct LZ77Context *ctx, int level)
 {
     struct LZ77InternalContext *st;
     int i;
@@ -129,200 +160,168 @@ static int lz77_init(struct LZ77Context *ctx)
 
     ctx->ictx = st;
 
-    for (i = 0; i < WINSIZE; i++)
-        st->win[i].next = st->win[i].prev = st->win[i].hashval = INVALID;
-    for (i = 0; i < HASHMAX; i++)
-        st->hashtab[i].first = INVALID;
-    st->winpos = 0;
+    if (level < 1 || level >= lenof(lz77_levels))
+        level = DEFAULT_LEVEL;
+    st->level = &lz77_levels[level];
 
-    st->npending = 0;
+    for (i = 0; i < lenof(st->head); i++)
+        st->head[i] = INVALID;
+    st->end = st->pos = st->ins = 0;
 
     return 1;
 }
 
-static void lz77_advance(struct LZ77InternalContext *st,
-                         unsigned char c, int hash)
+/*
+ * Add every position before `upto' to the hash chains, as far as
+ * there's enough data to hash. The last couple of positions of one
+ * call to lz77_compress get added at the start of the next.
+ */
+static void lz77_insert(struct LZ77InternalContext *st, int upto)
+{
+    if (upto > st->end - HASHCHARS + 1)
+        upto = st->end - HASHCHARS + 1;
+
+    while (st->ins < upto) {
+        unsigned hash = lz77_hash(st->buf + st->ins);
+        st->prev[st->ins & (WINSIZE - 1)] = st->head[hash];
+        st->head[hash] = st->ins;
+        st->ins++;
+    }
+}
+
+/*
+ * Find the longest match for the data at `pos' that beats `prevlen'.
+ * Returns its length, or 0 if there wasn't one; favours the shortest
+ * distance among equally long matches.
+ */
+static int lz77_longest_match(struct LZ77InternalContext *st, int pos,
+                              int prevlen, int *distance)
 {
+    const struct LZ77Level *lv = st->level;
+    const unsigned char *scan = st->buf + pos;
+    int maxlen = st->end - pos, bestlen, chain = lv->chain;
+    int limit = pos > WINSIZE ? pos - WINSIZE : INVALID;
     int off;
 
-    /*
-     * Remove the hash entry at winpos from the tail of its chain,
-     * or empty the chain if it's the only thing on the chain.
-     */
-    if (st->win[st->winpos].prev != INVALID) {
-        st->win[st->win[st->winpos].prev].next = INVALID;
-    } else if (st->win[st->winpos].hashval != INVALID) {
-        st->hashtab[st->win[st->winpos].hashval].first = INVALID;
+    if (maxlen > MAXLEN)
+        maxlen = MAXLEN;
+    bestlen = prevlen < HASHCHARS - 1 ? HASHCHARS - 1 : prevlen;
+    if (maxlen <= bestlen)
+        return 0;
+    if (prevlen >= lv->good)
+        chain >>= 2;
+
+    for (off = st->head[lz77_hash(scan)]; off > limit && chain-- > 0;
+         off = st->prev[off & (WINSIZE - 1)]) {
+        const unsigned char *m = st->buf + off;
+        int len;
+
+        /* Quick rejection: a match has to differ from the best so
+         * far at the byte just past its end */
+        if (m[bestlen] != scan[bestlen] || m[0] != scan[0] ||
+            m[1] != scan[1])
+            continue;
+
+        for (len = 2; len < maxlen && m[len] == scan[len]; len++);
+
+        if (len > bestlen) {
+            bestlen = len;
+            *distance = pos - off;
+            if (len >= lv->nice || len == maxlen)
+                break;
+        }
     }
 
-    /*
-     * Create a new entry at winpos and add it to the head of its
-     * hash chain.
-     */
-    st->win[st->winpos].hashval = hash;
-    st->win[st->winpos].prev = INVALID;
-    off = st->win[st->winpos].next = st->hashtab[hash].first;
-    st->hashtab[hash].first = st->winpos;
-    if (off != INVALID)
-        st->win[off].prev = st->winpos;
-    st->data[st->winpos] = c;
+    return bestlen > prevlen && bestlen >= HASHCHARS ? bestlen : 0;
+}
 
-    /*
-     * Advance the window pointer.
-     */
-    st->winpos = (st->winpos + 1) & (WINSIZE - 1);
+static void lz77_slide(struct LZ77InternalContext *st)
+{
+    int i;
+
+    memmove(st->buf, st->buf + WINSIZE, st->end - WINSIZE);
+    st->end -= WINSIZE;
+    st->pos -= WINSIZE;
+    st->ins -= WINSIZE;
+
+    for (i = 0; i < lenof(st->head); i++)
+        st->head[i] = st->head[i] >= WINSIZE ?
+            st->head[i] - WINSIZE : INVALID;
+    for (i = 0; i < lenof(st->prev); i++)
+        st->prev[i] = st->prev[i] >= WINSIZE ?
+            st->prev[i] - WINSIZE : INVALID;
 }
 
-#define CHARAT(k) ( (k)<0 ? st->data[(st->winpos+k)&(WINSIZE-1)] : data[k] )
+/*
+ * Append up to a window's worth of data to buf[], and return how
+ * much was added.
+ */
+static int lz77_append(struct LZ77InternalContext *st,
+                       const unsigned char *data, int len)
+{
+    int chunk = len < WINSIZE ? len : WINSIZE;
+
+    /* Make room, keeping at least a window of history */
+    if (st->end + chunk > BUFSIZE)
+        lz77_slide(st);
+    memcpy(st->buf + st->end, data, chunk);
+    st->end += chunk;
+    return chunk;
+}
 
-static void lz77_compress(struct LZ77Context *ctx,
-                          const unsigned char *data, int len)
+static void lz77_skip(struct LZ77Context *ctx,
+                      const unsigned char *data, int len)
 {
     struct LZ77InternalContext *st = ctx->ictx;
-    int i, distance, off, nmatch, matchlen, advance;
-    struct Match defermatch, matches[MAXMATCH];
-    int deferchr;
-
-    assert(st->npending <= HASHCHARS);
-
-    /*
-     * Add any pending characters from last time to the window. (We
-     * might not be able to.)
-     *
-     * This leaves st->pending empty in the usual case (when len >=
-     * HASHCHARS); otherwise it leaves st->pending empty enough that
-     * adding all the remaining 'len' characters will not push it past
-     * HASHCHARS in size.
-     */
-    for (i = 0; i < st->npending; i++) {
-        unsigned char foo[HASHCHARS];
-        int j;
-        if (len + st->npending - i < HASHCHARS) {
-            /* Update the pending array. */
-            for (j = i; j < st->npending; j++)
-                st->pending[j - i] = st->pending[j];
-            break;
-        }
-        for (j = 0; j < HASHCHARS; j++)
-            foo[j] = (i + j < st->npending ? st->pending[i + j] :
-                      data[i + j - st->npending]);
-        lz77_advance(st, foo[0], lz77_hash(foo));
-    }
-    st->npending -= i;
 
-    defermatch.distance = 0; /* appease compiler */
-    defermatch.len = 0;
-    deferchr = '\0';
     while (len > 0) {
+        int chunk = lz77_append(st, data, len);
+        data += chunk;
+        len -= chunk;
+        st->pos = st->ins = st->end;
+    }
+}
 
-        if (len >= HASHCHARS) {
-            /*
-             * Hash the next few characters.
-             */
-            int hash = lz77_hash(data);
+static void lz77_compress(struct LZ77Context *ctx,
+                          const unsigned char *data, int len)
+{
+    struct LZ77InternalContext *st = ctx->ictx;
+    const struct LZ77Level *lv = st->level;
 
-            /*
-             * Look the hash up in the corresponding hash chain and see
-             * what we can find.
-             */
-            nmatch = 0;
-            for (off = st->hashtab[hash].first;
-                 off != INVALID; off = st->win[off].next) {
-                /* distance = 1       if off == st->winpos-1 */
-                /* distance = WINSIZE if off == st->winpos   */
-                distance =
-                    WINSIZE - (off + WINSIZE - st->winpos) % WINSIZE;
-                for (i = 0; i < HASHCHARS; i++)
-                    if (CHARAT(i) != CHARAT(i - distance))
-                        break;
-                if (i == HASHCHARS) {
-                    matches[nmatch].distance = distance;
-                    matches[nmatch].len = 3;
-                    if (++nmatch >= MAXMATCH)
-                        break;
-                }
+    while (len > 0) {
+        int chunk = lz77_append(st, data, len);
+        data += chunk;
+        len -= chunk;
+
+        while (st->pos < st->end) {
+            int matchlen, distance, nextlen, nextdist;
+
+            lz77_insert(st, st->pos);
+            matchlen = lz77_longest_match(st, st->pos, 0, &distance);
+            if (!matchlen) {
+                ctx->literal(ctx, st->buf[st->pos++]);
+                continue;
             }
-        } else {
-            nmatch = 0;
-        }
 
-        if (nmatch > 0) {
             /*
-             * We've now filled up matches[] with nmatch potential
-             * matches. Follow them down to find the longest. (We
-             * assume here that it's always worth favouring a
-             * longer match over a shorter one.)
+             * Lazy matching: if this match isn't already long, see
+             * if one starting at the next byte is longer. If so,
+             * emit this byte as a literal and consider that one
+             * instead.
              */
-            matchlen = HASHCHARS;
-            while (matchlen < len) {
-                int j;
-                for (i = j = 0; i < nmatch; i++) {
-                    if (CHARAT(matchlen) ==
-                        CHARAT(matchlen - matches[i].distance)) {
-                        matches[j++] = matches[i];
-                    }
-                }
-                if (j == 0)
+            while (matchlen < lv->lazy) {
+                lz77_insert(st, st->pos + 1);
+                nextlen = lz77_longest_match(st, st->pos + 1, matchlen,
+                                             &nextdist);
+                if (!nextlen)
                     break;
-                matchlen++;
-                nmatch = j;
-            }
-
-            /*
-             * We've now got all the longest matches. We favour the
-             * shorter distances, which means we go with matches[0].
-             * So see if we want to defer it or throw it away.
-             */
-            matches[0].len = matchlen;
-            if (defermatch.len > 0) {
-                if (matches[0].len > defermatch.len + 1) {
-                    /* We have a better match. Emit the deferred char,
-                     * and defer this match. */
-                    ctx->literal(ctx, (unsigned char) deferchr);
-                    defermatch = matches[0];
-                    deferchr = data[0];
-                    advance = 1;
-                } else {
-                    /* We don't have a better match. Do the deferred one. */
-                    ctx->match(ctx, defermatch.distance, defermatch.len);
-                    advance = defermatch.len - 1;
-                    defermatch.len = 0;
-                }
-            } else {
-                /* There was no deferred match. Defer this one. */
-                defermatch = matches[0];
-                deferchr = data[0];
-                advance = 1;
-            }
-        } else {
-            /*
-             * We found no matches. Emit the deferred match, if
-             * any; otherwise emit a literal.
-             */
-            if (defermatch.len > 0) {
-                ctx->match(ctx, defermatch.distance, defermatch.len);
-                advance = defermatch.len - 1;
-                defermatch.len = 0;
-            } else {
-                ctx->literal(ctx, data[0]);
-                advance = 1;
+                ctx->literal(ctx, st->buf[st->pos++]);
+                matchlen = nextlen;
+                distance = nextdist;
             }
-        }
 
-        /*
-         * Now advance the position by `advance' characters,
-         * keeping the window and hash chains consistent.
-         */
-        while (advance > 0) {
-            if (len >= HASHCHARS) {
-                lz77_advance(st, *data, lz77_hash(data));
-            } else {
-                assert(st->npending < HASHCHARS);
-                st->pending[st->npending++] = *data;
-            }
-            data++;
-            len--;
-            advance--;
+            ctx->match(ctx, distance, matchlen);
+            st->pos += matchlen;
         }
     }
 }
@@ -568,20 +567,70 @@ static void zlib_match(struct LZ77Context *ectx, int distance, int len)
     }
 }
 
+/*
+ * Send data in Deflate stored (uncompressed) blocks. We're called in
+ * the middle of an open static block, and leave a new one open
+ * afterwards, so that zlib_compress_block can carry on as usual.
+ */
+static void zlib_stored(struct Outbuf *out,
+                        const unsigned char *data, int len)
+{
+    outbits(out, 0, 7);                /* close the static block */
+    while (len > 0) {
+        int thislen = len < 0xFFFF ? len : 0xFFFF;
+
+        outbits(out, 0, 3);            /* BFINAL=0, BTYPE=00 */
+        if (out->noutbits)
+            outbits(out, 0, 8 - out->noutbits);   /* align to a byte */
+        outbits(out, thislen, 16);
+        outbits(out, thislen ^ 0xFFFF, 16);
+        put_data(out->outbuf, data, thislen);
+        data += thislen;
+        len -= thislen;
+    }
+    outbits(out, 2, 3);                /* open new static block */
+}
+
+/*
+ * Adaptive bypass for data that won't compress (already-compressed
+ * files, encrypted backups and so on). We keep a running count of
+ * input and output bytes, halving both every ZLIB_PROBE_BYTES of
+ * input so that it follows recent traffic. If the ratio it shows is
+ * worse than ZLIB_POOR_RATIO, we stop running the compressor and
+ * send stored blocks for a while, then try compressing again. Each
+ * consecutive failed probe doubles the length of the bypass, up to a
+ * limit.
+ *
+ * Independently of that, a single block whose compressed form came
+ * out bigger than a stored block would be is resent as a stored
+ * block, so compression never makes a packet much bigger.
+ */
+#define ZLIB_PROBE_BYTES 65536
+#define ZLIB_POOR_RATIO(in, out) ((out) * 16 > (in) * 15)
+#define ZLIB_BYPASS_MIN (1 << 20)
+#define ZLIB_BYPASS_MAX (4 << 20)
+#define ZLIB_STORED_OVERHEAD 5         /* 3 bits, padding, LEN, NLEN */
+
 struct ssh_zlib_compressor {
     struct LZ77Context ectx;
+    unsigned long probe_in, probe_out; /* recent bytes in and out */
+    unsigned long bypass;              /* bytes left to send stored */
+    unsigned long bypass_next;         /* length of the next bypass */
     ssh_compressor sc;
 };
 
-ssh_compressor *zlib_compress_init(void)
+ssh_compressor *zlib_compress_init(int level)
 {
     struct Outbuf *out;
     struct ssh_zlib_compressor *comp = snew(struct ssh_zlib_compressor);
 
-    lz77_init(&comp->ectx);
+    lz77_init(&comp->ectx, level);
     comp->sc.vt = &ssh_zlib;
     comp->ectx.literal = zlib_literal;
     comp->ectx.match = zlib_match;
+    comp->probe_in = comp->probe_out = 0;
+    comp->bypass = 0;
+    comp->bypass_next = ZLIB_BYPASS_MIN;
 
     out = snew(struct Outbuf);
     out->outbuf = NULL;
@@ -640,10 +689,47 @@ void zlib_compress_block(ssh_compressor *sc,
         outbits(out, 2, 3);
     }
 
-    /*
-     * Do the compression.
-     */
-    lz77_compress(&comp->ectx, block, len);
+    if (comp->bypass > 0) {
+        lz77_skip(&comp->ectx, block, len);
+        zlib_stored(out, block, len);
+        comp->bypass = (comp->bypass > len ? comp->bypass - len : 0);
+    } else {
+        size_t startlen = out->outbuf->len;
+        unsigned long startbits = out->outbits;
+        int startnbits = out->noutbits;
+        size_t outlen;
+
+        /*
+         * Do the compression.
+         */
+        lz77_compress(&comp->ectx, block, len);
+
+        outlen = out->outbuf->len - startlen;
+        if (outlen > len + ZLIB_STORED_OVERHEAD) {
+            /* Throw away the compressed data and send it stored. The
+             * LZ77 window is the same either way. */
+            strbuf_shrink_to(out->outbuf, startlen);
+            out->outbits = startbits;
+            out->noutbits = startnbits;
+            zlib_stored(out, block, len);
+            outlen = len + ZLIB_STORED_OVERHEAD;
+        }
+
+        comp->probe_in += len;
+        comp->probe_out += outlen;
+        if (comp->probe_in >= ZLIB_PROBE_BYTES) {
+            if (ZLIB_POOR_RATIO(comp->probe_in, comp->probe_out)) {
+                comp->bypass = comp->bypass_next;
+                if (comp->bypass_next < ZLIB_BYPASS_MAX)
+                    comp->bypass_next *= 2;
+                comp->probe_in = comp->probe_out = 0;
+            } else {
+                comp->bypass_next = ZLIB_BYPASS_MIN;
+                comp->probe_in /= 2;
+                comp->probe_out /= 2;
+            }
+        }
+    }
 
     /*
      * End the block (by transmitting code 256, which is
@@ -687,6 +773,40 @@ void zlib_compress_block(ssh_compressor *sc,
     out->outbuf = NULL;
 }
 
+/*
+ * End the Deflate data, by closing the block left open by
+ * zlib_compress_block and sending an empty final block, padded to a
+ * byte boundary. SSH never does this, since its compressed stream
+ * lasts as long as the connection; it's for users who want a
+ * complete Deflate stream, such as gzip log files. We don't add the
+ * zlib Adler-32 trailer, which such users won't want either.
+ */
+void zlib_compress_finish(ssh_compressor *sc,
+                          unsigned char **outblock, int *outlen)
+{
+    struct ssh_zlib_compressor *comp =
+        container_of(sc, struct ssh_zlib_compressor, sc);
+    struct Outbuf *out = (struct Outbuf *) comp->ectx.userdata;
+
+    assert(!out->outbuf);
+    out->outbuf = strbuf_new_nm();
+
+    if (out->firstblock) {
+        outbits(out, 0x9C78, 16);      /* zlib header, as above */
+        out->firstblock = false;
+    } else {
+        outbits(out, 0, 7);            /* close the open block */
+    }
+    outbits(out, 3, 3);                /* BFINAL=1, BTYPE=01 */
+    outbits(out, 0, 7);                /* and end it straight away */
+    if (out->noutbits)
+        outbits(out, 0, 8 - out->noutbits);
+
+    *outlen = out->outbuf->len;
+    *outblock = (unsigned char *)strbuf_to_str(out->outbuf);
+    out->outbuf = NULL;
+}
+
 /* ----------------------------------------------------------------------
  * Zlib decompression. Of course, even though our compressor always
  * uses static trees, our _decompressor_ has to be capable of
@@ -699,6 +819,12 @@ void zlib_compress_block(ssh_compressor *sc,
  * of course, i.e. the first bit of the Huffman code is in bit 0).
  * Each table entry lists the number of bits to consume, plus
  * either an output code or a pointer to a secondary table.
+ *
+ * In a literal/length table, the first-level lookup is wide enough
+ * that it often covers two short literal codes at once. In that case
+ * the entry also records the second literal and the total number of
+ * bits for both, so that the fast decoding loop can output a pair of
+ * bytes per lookup.
  */
 struct zlib_table;
 struct zlib_tableentry;
@@ -707,6 +833,8 @@ struct zlib_tableentry {
     unsigned char nbits;
     short code;
     struct zlib_table *nexttable;
+    unsigned char nbits2;              /* total bits for code and code2 */
+    short code2;                       /* second literal, or -1 if none */
 };
 
 struct zlib_table {
@@ -716,6 +844,7 @@ struct zlib_table {
 
 #define MAXCODELEN 16
 #define MAXSYMS 288
+#define ZLIB_LITBITS 10                /* first-level literal table size */
 
 /*
  * Build a single-level decode table for elements
@@ -737,6 +866,8 @@ static struct zlib_table *zlib_mkonetab(int *codes, unsigned char *lengths,
         tab->table[code].code = -1;
         tab->table[code].nbits = 0;
         tab->table[code].nexttable = NULL;
+        tab->table[code].code2 = -1;
+        tab->table[code].nbits2 = 0;
     }
 
     for (i = 0; i < nsyms; i++) {
@@ -767,6 +898,29 @@ static struct zlib_table *zlib_mkonetab(int *codes, unsigned char *lengths,
     return tab;
 }
 
+/*
+ * Fill in the code2 fields of a first-level literal/length table: for
+ * every entry giving a literal, see if the index bits left over after
+ * that code are enough to determine another literal.
+ */
+static void zlib_pairlits(struct zlib_table *tab, int bits)
+{
+    int i;
+
+    for (i = 0; i <= tab->mask; i++) {
+        struct zlib_tableentry *ent = &tab->table[i], *ent2;
+
+        if (ent->code < 0 || ent->code >= 256)
+            continue;
+        ent2 = &tab->table[i >> ent->nbits];
+        if (ent2->code < 0 || ent2->code >= 256 ||
+            ent->nbits + ent2->nbits > bits)
+            continue;
+        ent->code2 = ent2->code;
+        ent->nbits2 = ent->nbits + ent2->nbits;
+    }
+}
+
 /*
  * Build a decode table, given a set of Huffman tree lengths.
  */
@@ -774,8 +928,9 @@ static struct zlib_table *zlib_mktable(unsigned char *lengths,
                                        int nlengths)
 {
     int count[MAXCODELEN], startcode[MAXCODELEN], codes[MAXSYMS];
-    int code, maxlen;
+    int code, maxlen, bits;
     int i, j;
+    struct zlib_table *tab;
 
     /* Count the codes of each length. */
     maxlen = 0;
@@ -805,10 +960,16 @@ static struct zlib_table *zlib_mktable(unsigned char *lengths,
 
     /*
      * Now we have the complete list of Huffman codes. Build a
-     * table.
+     * table. A literal/length table gets a wider first level, to
+     * give more opportunities for pairing literals.
      */
-    return zlib_mkonetab(codes, lengths, nlengths, 0, 0,
-                         maxlen < 9 ? maxlen : 9);
+    bits = (nlengths > 256 ? ZLIB_LITBITS : 9);
+    if (bits > maxlen)
+        bits = maxlen;
+    tab = zlib_mkonetab(codes, lengths, nlengths, 0, 0, bits);
+    if (nlengths > 256)
+        zlib_pairlits(tab, bits);
+    return tab;
 }
 
 static int zlib_freetable(struct zlib_table **ztab)
@@ -895,10 +1056,16 @@ struct zlib_decompress_ctx {
      */
     unsigned char lengths[288 + 32];
 
-    unsigned long bits;
+    uint64_t bits;
     int nbits;
+
+    /*
+     * Output goes into window[] first. The bytes from flushpos to
+     * winpos haven't been copied to outblk yet; that happens when the
+     * window wraps round, and at the end of each block of input.
+     */
     unsigned char window[WINSIZE];
-    int winpos;
+    int winpos, flushpos;
     strbuf *outblk;
 
     ssh_decompressor dc;
@@ -920,7 +1087,7 @@ ssh_decompressor *zlib_decompress_init(void)
     dctx->currlentable = dctx->currdisttable = dctx->lenlentable = NULL;
     dctx->bits = 0;
     dctx->nbits = 0;
-    dctx->winpos = 0;
+    dctx->winpos = dctx->flushpos = 0;
     dctx->outblk = NULL;
 
     dctx->dc.vt = &ssh_zlib;
@@ -945,10 +1112,10 @@ void zlib_decompress_cleanup(ssh_decompressor *dc)
     sfree(dctx);
 }
 
-static int zlib_huflookup(unsigned long *bitsp, int *nbitsp,
-                   struct zlib_table *tab)
+static int zlib_huflookup(uint64_t *bitsp, int *nbitsp,
+                          struct zlib_table *tab)
 {
-    unsigned long bits = *bitsp;
+    uint64_t bits = *bitsp;
     int nbits = *nbitsp;
     while (1) {
         struct zlib_tableentry *ent;
@@ -977,11 +1144,142 @@ static int zlib_huflookup(unsigned long *bitsp, int *nbitsp,
     }
 }
 
-static void zlib_emit_char(struct zlib_decompress_ctx *dctx, int c)
+static void zlib_flush_window(struct zlib_decompress_ctx *dctx)
+{
+    put_data(dctx->outblk, dctx->window + dctx->flushpos,
+             dctx->winpos - dctx->flushpos);
+    dctx->flushpos = dctx->winpos &= (WINSIZE - 1);
+}
+
+static inline void zlib_emit_char(struct zlib_decompress_ctx *dctx, int c)
+{
+    dctx->window[dctx->winpos++] = c;
+    if (dctx->winpos == WINSIZE)
+        zlib_flush_window(dctx);
+}
+
+static void zlib_emit_match(struct zlib_decompress_ctx *dctx,
+                            int dist, int len)
+{
+    while (len > 0) {
+        int from = (dctx->winpos - dist) & (WINSIZE - 1);
+        int n = len;
+
+        /* Copy in chunks that don't run off the end of the window,
+         * either where we're reading or where we're writing. */
+        if (n > WINSIZE - from)
+            n = WINSIZE - from;
+        if (n > WINSIZE - dctx->winpos)
+            n = WINSIZE - dctx->winpos;
+
+        if (n <= dist) {
+            memcpy(dctx->window + dctx->winpos, dctx->window + from, n);
+        } else {
+            /* The match overlaps its own output, repeating the last
+             * dist bytes, so it has to be copied a byte at a time. */
+            unsigned char *p = dctx->window + dctx->winpos;
+            const unsigned char *q = dctx->window + from;
+            int i;
+            for (i = 0; i < n; i++)
+                p[i] = q[i];
+        }
+
+        dctx->winpos += n;
+        if (dctx->winpos == WINSIZE)
+            zlib_flush_window(dctx);
+        len -= n;
+    }
+}
+
+static void zlib_free_block_tables(struct zlib_decompress_ctx *dctx)
 {
-    dctx->window[dctx->winpos] = c;
-    dctx->winpos = (dctx->winpos + 1) & (WINSIZE - 1);
-    put_byte(dctx->outblk, c);
+    if (dctx->currlentable != dctx->staticlentable) {
+        zlib_freetable(&dctx->currlentable);
+        dctx->currlentable = NULL;
+    }
+    if (dctx->currdisttable != dctx->staticdisttable) {
+        zlib_freetable(&dctx->currdisttable);
+        dctx->currdisttable = NULL;
+    }
+}
+
+/*
+ * Decode the body of a Huffman-coded block for as long as we have at
+ * least 8 bytes of input left. That's more than enough for a whole
+ * literal, or a length and distance pair with their extra bits (48
+ * bits at most). So this loop never has to stop halfway through a
+ * symbol or check whether a lookup ran out of data. Returns false on
+ * a decoding error.
+ */
+static bool zlib_decode_fast(struct zlib_decompress_ctx *dctx,
+                             const unsigned char **blockp, int *lenp)
+{
+    const unsigned char *block = *blockp;
+    int len = *lenp;
+    uint64_t bits = dctx->bits;
+    int nbits = dctx->nbits;
+    struct zlib_table *lentab = dctx->currlentable;
+    struct zlib_table *disttab = dctx->currdisttable;
+    const coderecord *rec;
+    bool ok = false;
+
+    while (len >= 8) {
+        const struct zlib_tableentry *ent;
+        int code, mlen, dist;
+
+        while (nbits <= 56) {
+            bits |= (uint64_t)*block++ << nbits;
+            nbits += 8;
+            len--;
+        }
+
+        ent = &lentab->table[bits & lentab->mask];
+        if (ent->code2 >= 0) {
+            zlib_emit_char(dctx, ent->code);
+            zlib_emit_char(dctx, ent->code2);
+            bits >>= ent->nbits2;
+            nbits -= ent->nbits2;
+            continue;
+        }
+
+        code = zlib_huflookup(&bits, &nbits, lentab);
+        if (code < 0)
+            goto out;
+        if (code < 256) {
+            zlib_emit_char(dctx, code);
+            continue;
+        }
+        if (code == 256) {
+            dctx->state = OUTSIDEBLK;
+            zlib_free_block_tables(dctx);
+            break;
+        }
+        if (code >= 286)
+            goto out;                  /* symbols 286 and 287 are invalid */
+
+        rec = &lencodes[code - 257];
+        mlen = rec->min + (bits & ((1 << rec->extrabits) - 1));
+        bits >>= rec->extrabits;
+        nbits -= rec->extrabits;
+
+        code = zlib_huflookup(&bits, &nbits, disttab);
+        if (code < 0 || code >= 30)
+            goto out;                  /* symbols 30 and 31 are invalid */
+        rec = &distcodes[code];
+        dist = rec->min + (bits & ((1 << rec->extrabits) - 1));
+        bits >>= rec->extrabits;
+        nbits -= rec->extrabits;
+
+        zlib_emit_match(dctx, dist, mlen);
+    }
+    ok = true;
+
+  out:
+    dctx->bits = bits;
+    dctx->nbits = nbits;
+    *blockp = block;
+    *lenp = len;
+    return ok;
 }
 
 #define EATBITS(n) ( dctx->nbits -= (n), dctx->bits >>= (n) )
@@ -1131,6 +1429,11 @@ bool zlib_decompress_block(ssh_decompressor *dc,
             dctx->state = TREES_LEN;
             break;
           case INBLK:
+            if (len >= 8) {
+                if (!zlib_decode_fast(dctx, &block, &len))
+                    goto decode_error;
+                break;
+            }
             code =
                 zlib_huflookup(&dctx->bits, &dctx->nbits, dctx->currlentable);
             if (code == -1)
@@ -1141,14 +1444,7 @@ bool zlib_decompress_block(ssh_decompressor *dc,
                 zlib_emit_char(dctx, code);
             else if (code == 256) {
                 dctx->state = OUTSIDEBLK;
-                if (dctx->currlentable != dctx->staticlentable) {
-                    zlib_freetable(&dctx->currlentable);
-                    dctx->currlentable = NULL;
-                }
-                if (dctx->currdisttable != dctx->staticdisttable) {
-                    zlib_freetable(&dctx->currdisttable);
-                    dctx->currdisttable = NULL;
-                }
+                zlib_free_block_tables(dctx);
             } else if (code < 286) {
                 dctx->state = GOTLENSYM;
                 dctx->sym = code;
@@ -1186,9 +1482,7 @@ bool zlib_decompress_block(ssh_decompressor *dc,
             dist = rec->min + (dctx->bits & ((1 << rec->extrabits) - 1));
             EATBITS(rec->extrabits);
             dctx->state = INBLK;
-            while (dctx->len--)
-                zlib_emit_char(dctx, dctx->window[(dctx->winpos - dist) &
-                                                  (WINSIZE - 1)]);
+            zlib_emit_match(dctx, dist, dctx->len);
             break;
           case UNCOMP_LEN:
             /*
@@ -1229,6 +1523,7 @@ bool zlib_decompress_block(ssh_decompressor *dc,
     }
 
   finished:
+    zlib_flush_window(dctx);
     *outlen = dctx->outblk->len;
     *outblock = (unsigned char *)strbuf_to_str(dctx->outblk);
     dctx->outblk = NULL;
@@ -0,0 +1,277 @@
+/*
+ * zstd compression for SSH-2, using the system's zstd library if
+ * one can be found at run time.
+ *
+ * This is PuTTY's own method, negotiated under the name
+ * "zstd@putty.projects.tartarus.org", so it's only used when both
+ * ends of the connection are PuTTY-family tools (or something else
+ * that chooses to implement the same thing). It's only offered in
+ * delayed form, i.e. starting after user authentication, like
+ * "zlib@openssh.com".
+ *
+ * The data in each direction is one zstd stream, flushed at the end
+ * of every packet so that the receiver can decode the whole packet.
+ * The stream can be a sequence of frames, including skippable ones,
+ * which the sender uses to pad packets if it has to. The sender's
+ * window is at most 2^ZSTD_WINDOWLOG bytes, and the receiver won't
+ * accept one larger than 2^ZSTD_WINDOWLOG_MAX.
+ *
+ * We don't include zstd.h, because we don't want a build dependency
+ * on it. We just declare the handful of functions and constants we
+ * need, all of which are part of zstd's stable API.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "defs.h"
+#include "ssh.h"
+
+#define ZSTD_WINDOWLOG 20
+#define ZSTD_WINDOWLOG_MAX 23
+#define ZSTD_CHUNK 16384               /* output buffer increment */
+#define ZSTD_MAX_OUTPUT (1 << 20)      /* sanity limit per packet */
+
+/* Values from zstd.h */
+#define ZSTD_c_compressionLevel 100
+#define ZSTD_c_windowLog 101
+#define ZSTD_d_windowLogMax 100
+#define ZSTD_e_continue 0
+#define ZSTD_e_flush 1
+#define ZSTD_e_end 2
+#define ZSTD_MAGIC_SKIPPABLE 0x184D2A50U
+
+typedef struct zstd_cctx zstd_cctx;
+typedef struct zstd_dctx zstd_dctx;
+typedef struct { const void *src; size_t size, pos; } zstd_inbuf;
+typedef struct { void *dst; size_t size, pos; } zstd_outbuf;
+
+static struct {
+    int state;                  /* 0 = not tried, 1 = loaded, -1 = failed */
+    zstd_cctx *(*createCCtx)(void);
+    size_t (*freeCCtx)(zstd_cctx *);
+    size_t (*CCtx_setParameter)(zstd_cctx *, int, int);
+    size_t (*compressStream2)(zstd_cctx *, zstd_outbuf *, zstd_inbuf *,
+                              int);
+    zstd_dctx *(*createDCtx)(void);
+    size_t (*freeDCtx)(zstd_dctx *);
+    size_t (*DCtx_setParameter)(zstd_dctx *, int, int);
+    size_t (*decompressStream)(zstd_dctx *, zstd_outbuf *, zstd_inbuf *);
+    unsigned (*isError)(size_t);
+} zstd;
+
+static bool zstd_available(void)
+{
+    if (!zstd.state) {
+        bool ok = true;
+
+#define BIND_ZSTD_FN(name) \
+        ok &= ((*(void **)&zstd.name = \
+                platform_zstd_function("ZSTD_" #name)) != NULL)
+
+        BIND_ZSTD_FN(createCCtx);
+        BIND_ZSTD_FN(freeCCtx);
+        BIND_ZSTD_FN(CCtx_setParameter);
+        BIND_ZSTD_FN(compressStream2);
+        BIND_ZSTD_FN(createDCtx);
+        BIND_ZSTD_FN(freeDCtx);
+        BIND_ZSTD_FN(DCtx_setParameter);
+        BIND_ZSTD_FN(decompressStream);
+        BIND_ZSTD_FN(isError);
+
+#undef BIND_ZSTD_FN
+
+        zstd.state = ok ? 1 : -1;
+    }
+    return zstd.state > 0;
+}
+
+/*
+ * Our levels run from 1 to 9 as for zlib. zstd's go much higher, but
+ * the top ones are far too slow to keep up with a network link.
+ */
+static const int zstd_levels[] = { 3, 1, 1, 2, 2, 3, 3, 6, 9, 12 };
+
+struct ssh_zstd_compressor {
+    zstd_cctx *cctx;
+    ssh_compressor sc;
+};
+
+struct ssh_zstd_decompressor {
+    zstd_dctx *dctx;
+    ssh_decompressor dc;
+};
+
+static ssh_compressor *zstd_compress_init(int level)
+{
+    struct ssh_zstd_compressor *comp;
+    zstd_cctx *cctx;
+
+    if (!zstd_available() || !(cctx = zstd.createCCtx()))
+        return NULL;
+
+    if (level < 0 || level >= lenof(zstd_levels))
+        level = 0;
+    zstd.CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                           zstd_levels[level]);
+    zstd.CCtx_setParameter(cctx, ZSTD_c_windowLog, ZSTD_WINDOWLOG);
+
+    comp = snew(struct ssh_zstd_compressor);
+    comp->cctx = cctx;
+    comp->sc.vt = &ssh_zstd;
+    return &comp->sc;
+}
+
+static void zstd_compress_cleanup(ssh_compressor *sc)
+{
+    struct ssh_zstd_compressor *comp =
+        container_of(sc, struct ssh_zstd_compressor, sc);
+    zstd.freeCCtx(comp->cctx);
+    sfree(comp);
+}
+
+/*
+ * Run the compressor until it has taken all of 'in' and emptied its
+ * internal buffers, appending everything it outputs to 'out'.
+ */
+static void zstd_run(zstd_cctx *cctx, strbuf *out, zstd_inbuf *in, int op)
+{
+    size_t ret;
+
+    do {
+        zstd_outbuf ob;
+
+        ob.dst = strbuf_append(out, ZSTD_CHUNK);
+        ob.size = ZSTD_CHUNK;
+        ob.pos = 0;
+        ret = zstd.compressStream2(cctx, &ob, in, op);
+        strbuf_shrink_to(out, out->len - ZSTD_CHUNK + ob.pos);
+
+        /* The only errors zstd can report here are misuse of the
+         * API, or running out of memory */
+        assert(!zstd.isError(ret));
+    } while (ret != 0 || in->pos < in->size);
+}
+
+static void zstd_compress_block(ssh_compressor *sc,
+                                const unsigned char *block, int len,
+                                unsigned char **outblock, int *outlen,
+                                int minlen)
+{
+    struct ssh_zstd_compressor *comp =
+        container_of(sc, struct ssh_zstd_compressor, sc);
+    strbuf *out = strbuf_new_nm();
+    zstd_inbuf in;
+
+    in.src = block;
+    in.size = len;
+    in.pos = 0;
+
+    if (!minlen) {
+        zstd_run(comp->cctx, out, &in, ZSTD_e_flush);
+    } else {
+        /*
+         * To pad the data, we have to finish the current frame, and
+         * then we can add a skippable frame of any size (at least
+         * its 8-byte header). The next packet starts a new frame,
+         * so it loses the benefit of the history so far; but this
+         * only happens for the few packets (if any) that ask for it.
+         */
+        zstd_run(comp->cctx, out, &in, ZSTD_e_end);
+        if (out->len < minlen) {
+            size_t pad = minlen - out->len;
+            unsigned char *hdr;
+
+            if (pad < 8)
+                pad = 8;
+            hdr = strbuf_append(out, 8);
+            PUT_32BIT_LSB_FIRST(hdr, ZSTD_MAGIC_SKIPPABLE);
+            PUT_32BIT_LSB_FIRST(hdr + 4, pad - 8);
+            put_padding(out, pad - 8, 0);
+        }
+    }
+
+    *outlen = out->len;
+    *outblock = (unsigned char *)strbuf_to_str(out);
+}
+
+static ssh_decompressor *zstd_decompress_init(void)
+{
+    struct ssh_zstd_decompressor *decomp;
+    zstd_dctx *dctx;
+
+    if (!zstd_available() || !(dctx = zstd.createDCtx()))
+        return NULL;
+
+    zstd.DCtx_setParameter(dctx, ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_MAX);
+
+    decomp = snew(struct ssh_zstd_decompressor);
+    decomp->dctx = dctx;
+    decomp->dc.vt = &ssh_zstd;
+    return &decomp->dc;
+}
+
+static void zstd_decompress_cleanup(ssh_decompressor *dc)
+{
+    struct ssh_zstd_decompressor *decomp =
+        container_of(dc, struct ssh_zstd_decompressor, dc);
+    zstd.freeDCtx(decomp->dctx);
+    sfree(decomp);
+}
+
+static bool zstd_decompress_block(ssh_decompressor *dc,
+                                  const unsigned char *block, int len,
+                                  unsigned char **outblock, int *outlen)
+{
+    struct ssh_zstd_decompressor *decomp =
+        container_of(dc, struct ssh_zstd_decompressor, dc);
+    strbuf *out = strbuf_new_nm();
+    zstd_inbuf in;
+    size_t ret;
+
+    in.src = block;
+    in.size = len;
+    in.pos = 0;
+
+    /*
+     * Keep going until we've used all the input and the decompressor
+     * didn't fill the whole output buffer, meaning it has nothing
+     * more it could give us until it sees more input.
+     */
+    while (true) {
+        zstd_outbuf ob;
+
+        ob.dst = strbuf_append(out, ZSTD_CHUNK);
+        ob.size = ZSTD_CHUNK;
+        ob.pos = 0;
+        ret = zstd.decompressStream(decomp->dctx, &ob, &in);
+        strbuf_shrink_to(out, out->len - ZSTD_CHUNK + ob.pos);
+
+        if (zstd.isError(ret) || out->len > ZSTD_MAX_OUTPUT) {
+            strbuf_free(out);
+            *outblock = NULL;
+            *outlen = 0;
+            return false;
+        }
+        if (in.pos == in.size && ob.pos < ob.size)
+            break;
+    }
+
+    *outlen = out->len;
+    *outblock = (unsigned char *)strbuf_to_str(out);
+    return true;
+}
+
+const ssh_compression_alg ssh_zstd = {
+    .name = NULL,                       /* only in delayed form */
+    .delayed_name = "zstd@putty.projects.tartarus.org",
+    .available = zstd_available,
+    .compress_new = zstd_compress_init,
+    .compress_free = zstd_compress_cleanup,
+    .compress = zstd_compress_block,
+    .decompress_new = zstd_decompress_init,
+    .decompress_free = zstd_decompress_cleanup,
+    .decompress = zstd_decompress_block,
+    .text_name = "zstd",
+};
@@ -91,6 +91,26 @@ int verify_host_key(const char *hostname, int port,
 void store_host_key(const char *hostname, int port,
                     const char *keytype, const char *key);
 
+/* ----------------------------------------------------------------------
+ * Functions to remember how we last logged in to an SSH server, so
+ * that the next connection can try the same thing first.
+ */
+
+/*
+ * Retrieve the hint stored for a given user on a given server, or
+ * NULL if there isn't one. A hint is a single line of text whose
+ * format is private to the SSH userauth layer.
+ */
+char *retrieve_auth_hint(const char *hostname, int port,
+                         const char *username);
+
+/*
+ * Store a hint, overwriting any previous one for the same user and
+ * server. A NULL hint removes the entry.
+ */
+void store_auth_hint(const char *hostname, int port,
+                     const char *username, const char *hint);
+
 /* ----------------------------------------------------------------------
  * Functions to access PuTTY's random number seed file.
  */
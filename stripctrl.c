@@ -242,6 +242,60 @@ static inline void stripctrl_term_put_wc(
         put_data(scc->bs_out, outbuf, produced);
 }
 
+/*
+ * Return the length of the run of bytes at the start of vp which are
+ * either printable ASCII or \n. Provided the multibyte conversion
+ * states are in their initial state, every such byte is a character
+ * on its own in any sensible locale, and would be passed through
+ * unchanged, so we can skip the round trip via mbrtowc and wcrtomb.
+ */
+static size_t stripctrl_plain_span(const void *vp, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)vp;
+    size_t n = 0;
+
+    while (n < len) {
+        /*
+         * Check 8 bytes at a time for anything with the top bit set,
+         * anything below 0x20, and 0x7F, using the usual
+         * borrow-propagation tricks. (The last two tests are only
+         * exact given that the first one has passed.)
+         */
+        while (len - n >= 8) {
+            uint64_t x = GET_64BIT_LSB_FIRST(p + n);
+            uint64_t del = x ^ 0x7F7F7F7F7F7F7F7FULL;
+            if ((x & 0x8080808080808080ULL) ||
+                ((x - 0x2020202020202020ULL) & ~x &
+                 0x8080808080808080ULL) ||
+                ((del - 0x0101010101010101ULL) & ~del &
+                 0x8080808080808080ULL))
+                break;
+            n += 8;
+        }
+
+        if (n < len && ((p[n] >= 0x20 && p[n] < 0x7F) || p[n] == '\n'))
+            n++;
+        else
+            break;
+    }
+
+    return n;
+}
+
+static void stripctrl_locale_put_plain(
+    StripCtrlCharsImpl *scc, const char *p, size_t len)
+{
+    if (!scc->line_limit) {
+        put_data(scc->bs_out, p, len);
+        return;
+    }
+
+    for (; len > 0; len--, p++) {
+        stripctrl_check_line_limit(scc, *p, *p == '\n' ? 0 : 1);
+        put_byte(scc->bs_out, *p);
+    }
+}
+
 static inline size_t stripctrl_locale_try_consume(
     StripCtrlCharsImpl *scc, const char *p, size_t len)
 {
@@ -373,7 +427,17 @@ static void stripctrl_locale_BinarySink_write(
      * Now charge along the main string.
      */
     while (len > 0) {
-        size_t consumed = stripctrl_locale_try_consume(scc, p, len);
+        size_t consumed;
+
+        if (mbsinit(&scc->mbs_in) && mbsinit(&scc->mbs_out) &&
+            (consumed = stripctrl_plain_span(p, len)) > 0) {
+            stripctrl_locale_put_plain(scc, p, consumed);
+            p += consumed;
+            len -= consumed;
+            continue;
+        }
+
+        consumed = stripctrl_locale_try_consume(scc, p, len);
         if (consumed == 0)
             break;
         assert(consumed <= len);
@@ -504,12 +504,56 @@ static void process_subneg(Telnet *telnet)
     }
 }
 
+/*
+ * Return the length of the run of bytes at the start of buf that
+ * can go straight to the terminal while we're in TOP_LEVEL state,
+ * i.e. everything up to the next IAC, or (unless the server is
+ * sending binary) the next CR, which might be followed by a NUL we
+ * have to drop.
+ */
+static size_t telnet_plain_span(Telnet *telnet, const char *buf, size_t len)
+{
+    const char *p;
+
+    /* Look for CR first: it's the common one, so this keeps the
+     * search for IAC down to a short stretch */
+    if (telnet->opt_states[o_they_bin.index] != ACTIVE &&
+        (p = memchr(buf, CR, len)) != NULL)
+        len = p - buf;
+    if ((p = memchr(buf, IAC, len)) != NULL)
+        len = p - buf;
+    return len;
+}
+
 static void do_telnet_read(Telnet *telnet, const char *buf, size_t len)
 {
     strbuf *outbuf = strbuf_new_nm();
 
-    while (len--) {
-        int c = (unsigned char) *buf++;
+    while (len > 0) {
+        int c;
+
+        if (telnet->state == TOP_LEVEL && !telnet->in_synch) {
+            size_t n = telnet_plain_span(telnet, buf, len);
+            if (n) {
+                if (outbuf->len + n < 4096) {
+                    put_data(outbuf, buf, n);
+                } else {
+                    /* Big runs of data skip the buffer altogether */
+                    if (outbuf->len) {
+                        c_write(telnet, outbuf->u, outbuf->len);
+                        strbuf_clear(outbuf);
+                    }
+                    c_write(telnet, buf, n);
+                }
+                buf += n;
+                len -= n;
+                if (!len)
+                    break;
+            }
+        }
+
+        c = (unsigned char) *buf++;
+        len--;
 
         switch (telnet->state) {
           case TOP_LEVEL:
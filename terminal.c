@@ -38,9 +38,26 @@
 #define TM_PUTTY        (0xFFFF)
 
 #define UPDATE_DELAY    ((TICKSPERSEC+49)/50)/* ticks to defer window update */
+#define UPDATE_DELAY_MAX ((TICKSPERSEC+9)/10) /* ... when output is flooding */
+#define UPDATE_ECHO_MAX 256            /* bytes of output to paint at once */
 #define TBLINK_DELAY    ((TICKSPERSEC*9+19)/20)/* ticks between text blinks*/
 #define CBLINK_DELAY    (CURSORBLINK) /* ticks between cursor blinks */
 #define VBELL_DELAY     (VBELL_TIMEOUT) /* visual bell timeout in ticks */
+#define SBCOMPRESS_DELAY (TICKSPERSEC) /* ticks to defer scrollback compression */
+#define PASTE_RETRY_DELAY ((TICKSPERSEC+49)/50) /* ticks between tries when
+                                                 * the backend is backlogged */
+
+#define PASTE_CHUNK         1024       /* chars of paste to convert at once */
+#define PASTE_BURST         65536      /* bytes of paste to send per callback */
+#define PASTE_MAX_BACKLOG   32768      /* backend backlog at which paste waits */
+
+#define SB_UNCOMPRESSED_MAX 256        /* most scrollback lines left as termlines */
+#define SB_COMPRESS_BATCH   64         /* lines to compress when over that */
+#define SBCHUNK_SIZE        65536      /* bytes of compressed scrollback to
+                                          pack into each allocation */
+#define SB_MEMORY_BUDGET    (4<<20)    /* most compressed scrollback to keep
+                                          in memory if it can go to disk */
+#define SB_BLOOM_BITS       32768      /* size of each chunk's search index */
 
 #define compatibility(x) \
     if ( ((CL_##x)&term->compatibility_level) == 0 ) {  \
@@ -90,8 +107,9 @@ static termline *lineptr(Terminal *, int, int, int);
 static void unlineptr(termline *);
 static void check_line_size(Terminal *, termline *);
 static void do_paint(Terminal *);
+static void do_dispscrolls(Terminal *);
 static void erase_lots(Terminal *, bool, bool, bool);
-static int find_last_nonempty_line(Terminal *, tree234 *);
+static int find_last_nonempty_line(Terminal *, termscreen *);
 static void swap_screen(Terminal *, int, bool, bool);
 static void update_sbar(Terminal *);
 static void deselect(Terminal *);
@@ -105,14 +123,16 @@ static termline *newtermline(Terminal *term, int cols, bool bce)
     termline *line;
     int j;
 
-    line = snew(termline);
+    line = snew_pooled(MEMPOOL_TERMLINE, termline);
     line->chars = snewn(cols, termchar);
     for (j = 0; j < cols; j++)
         line->chars[j] = (bce ? term->erase_char : term->basic_erase_char);
     line->cols = line->size = cols;
     line->lattr = LATTR_NORM;
     line->trusted = false;
+    line->maybe_rtl = false;
     line->temporary = false;
+    line->dirty = false;
     line->cc_free = 0;
 
     return line;
@@ -122,7 +142,7 @@ static void freetermline(termline *line)
 {
     if (line) {
         sfree(line->chars);
-        sfree(line);
+        sfree_pooled(line);
     }
 }
 
@@ -132,6 +152,143 @@ static void unlineptr(termline *line)
         freetermline(line);
 }
 
+/*
+ * Keep a termline we've finished with for scroll() to reuse, rather
+ * than freeing it and allocating another straight away.
+ */
+static void term_release_line(Terminal *term, termline *line)
+{
+    if (term->nspare_lines < lenof(term->spare_lines) &&
+        line->size <= 2 * term->cols)
+        term->spare_lines[term->nspare_lines++] = line;
+    else
+        freetermline(line);
+}
+
+static termline *term_spare_line(Terminal *term)
+{
+    termline *line;
+
+    if (term->nspare_lines == 0)
+        return newtermline(term, term->cols, false);
+
+    line = term->spare_lines[--term->nspare_lines];
+    line->lattr = LATTR_NORM;
+    line->trusted = false;
+    line->temporary = false;
+    line->dirty = false;
+    return line;
+}
+
+static termscreen *termscreen_new(void)
+{
+    termscreen *s = snew(termscreen);
+    s->lines = NULL;
+    s->nlines = s->start = 0;
+    s->size = 0;
+    return s;
+}
+
+static void termscreen_free(termscreen *s)
+{
+    int i;
+
+    if (s) {
+        for (i = 0; i < s->nlines; i++)
+            freetermline(s->lines[i]);
+        sfree(s->lines);
+        sfree(s);
+    }
+}
+
+static inline int termscreen_count(termscreen *s)
+{
+    return s ? s->nlines : 0;
+}
+
+static inline termline **termscreen_slot(termscreen *s, int y)
+{
+    int i = s->start + y;
+    if (i >= s->nlines)
+        i -= s->nlines;
+    return &s->lines[i];
+}
+
+static termline *termscreen_line(termscreen *s, int y)
+{
+    if (!s || y < 0 || y >= s->nlines)
+        return NULL;
+    return *termscreen_slot(s, y);
+}
+
+/*
+ * Put the lines back in order from the start of the array, so that
+ * they can be inserted and deleted with memmove. Only resizing the
+ * terminal needs that.
+ */
+static void termscreen_linearise(termscreen *s)
+{
+    if (s->start != 0) {
+        termline **lines = snewn(s->size, termline *);
+        int i;
+
+        for (i = 0; i < s->nlines; i++)
+            lines[i] = *termscreen_slot(s, i);
+        sfree(s->lines);
+        s->lines = lines;
+        s->start = 0;
+    }
+}
+
+static void termscreen_insert(termscreen *s, int y, termline *line)
+{
+    termscreen_linearise(s);
+    sgrowarray(s->lines, s->size, s->nlines);
+    memmove(s->lines + y + 1, s->lines + y,
+            (s->nlines - y) * sizeof(*s->lines));
+    s->lines[y] = line;
+    s->nlines++;
+}
+
+static termline *termscreen_delete(termscreen *s, int y)
+{
+    termline *line;
+
+    termscreen_linearise(s);
+    line = s->lines[y];
+    memmove(s->lines + y, s->lines + y + 1,
+            (s->nlines - y - 1) * sizeof(*s->lines));
+    s->nlines--;
+    return line;
+}
+
+/*
+ * Move the line at row 'top' to row 'bot', and each of the lines in
+ * between up by one; or, if 'down', the other way round.
+ */
+static void termscreen_rotate(termscreen *s, int top, int bot, bool down)
+{
+    termline *line;
+    int y;
+
+    if (top == 0 && bot == s->nlines - 1) {
+        if (down)
+            s->start = (s->start == 0 ? s->nlines : s->start) - 1;
+        else if (++s->start == s->nlines)
+            s->start = 0;
+    } else if (down) {
+        line = *termscreen_slot(s, bot);
+        for (y = bot; y > top; y--)
+            *termscreen_slot(s, y) = *termscreen_slot(s, y - 1);
+        *termscreen_slot(s, top) = line;
+    } else {
+        line = *termscreen_slot(s, top);
+        for (y = top; y < bot; y++)
+            *termscreen_slot(s, y) = *termscreen_slot(s, y + 1);
+        *termscreen_slot(s, bot) = line;
+    }
+}
+
 #ifdef TERM_CC_DIAGS
 /*
  * Diagnostic function: verify that a termline has a correct
@@ -336,6 +493,22 @@ static bool termchars_equal(termchar *a, termchar *b)
     return termchars_equal_override(a, b, b->chr, b->attr);
 }
 
+/*
+ * Record that a character is being written into a termline, for the
+ * benefit of term_bidi_line, which can skip all of its work for a
+ * line containing nothing that the bidi algorithm or Arabic shaping
+ * would touch. Characters still in a CSET_* form are only mapped to
+ * Unicode at paint time, so we count any of those outside the ASCII
+ * range. The flag is conservative: it stays set until the whole line
+ * is cleared.
+ */
+static inline void termline_note_chr(termline *line, unsigned long chr)
+{
+    if ((chr & CSET_MASK) ? (chr & 0x80) != 0 :
+        chr >= 0x590 && is_rtl(chr))   /* nothing below Hebrew is RTL */
+        line->maybe_rtl = true;
+}
+
 /*
  * Copy a character cell. (Requires a pointer to the destination
  * termline, so as to access its free list.)
@@ -346,6 +519,7 @@ static void copy_termchar(termline *destline, int x, termchar *src)
 
     destline->chars[x] = *src;         /* copy everything except cc-list */
     destline->chars[x].cc_next = 0;    /* and make sure this is zero */
+    termline_note_chr(destline, src->chr);
 
     while (src->cc_next) {
         src += src->cc_next;
@@ -665,18 +839,16 @@ static void makeliteral_cc(strbuf *b, termchar *c, unsigned long *state)
     makeliteral_chr(b, &z, &zstate);
 }
 
-typedef struct compressed_scrollback_line {
-    size_t len;
-} compressed_scrollback_line;
-
-static termline *decompressline(compressed_scrollback_line *line);
+static termline *decompressline(ptrlen data);
 
-static compressed_scrollback_line *compressline(termline *ldata)
+/*
+ * Compress a termline, appending the result to a strbuf.
+ */
+static void compressline(strbuf *b, termline *ldata)
 {
-    strbuf *b = strbuf_new();
-
-    /* Leave space for the header structure */
-    strbuf_append(b, sizeof(compressed_scrollback_line));
+#if defined TERM_CC_DIAGS && !defined CHECK_SB_COMPRESSION
+    size_t start = b->len;
+#endif
 
     /*
      * First, store the column count, 7 bits at a time, least
@@ -742,7 +914,7 @@ static compressed_scrollback_line *compressline(termline *ldata)
         printf("\n");
 #endif
 
-        dcl = decompressline((compressed_scrollback_line *)b->u);
+        dcl = decompressline(make_ptrlen(b->u + start, b->len - start));
         assert(ldata->cols == dcl->cols);
         assert(ldata->lattr == dcl->lattr);
         for (i = 0; i < ldata->cols; i++)
@@ -758,12 +930,6 @@ static compressed_scrollback_line *compressline(termline *ldata)
     }
 #endif
 #endif /* TERM_CC_DIAGS */
-
-    size_t linelen = b->len - sizeof(compressed_scrollback_line);
-    compressed_scrollback_line *line =
-        (compressed_scrollback_line *)strbuf_to_str(b);
-    line->len = linelen;
-    return line;
 }
 
 static void readrle(BinarySource *bs, termline *ldata,
@@ -831,6 +997,7 @@ static void readliteral_chr(BinarySource *bs, termchar *c, termline *ldata,
         c->chr = get_uint32(bs);
     }
     *state = c->chr & ~0xFF;
+    termline_note_chr(ldata, c->chr);
 }
 static void readliteral_attr(BinarySource *bs, termchar *c, termline *ldata,
                              unsigned long *state)
@@ -899,13 +1066,13 @@ static void readliteral_cc(BinarySource *bs, termchar *c, termline *ldata,
     }
 }
 
-static termline *decompressline(compressed_scrollback_line *line)
+static termline *decompressline(ptrlen data)
 {
     int ncols, byte, shift;
     BinarySource bs[1];
     termline *ldata;
 
-    BinarySource_BARE_INIT(bs, line+1, line->len);
+    BinarySource_BARE_INIT_PL(bs, data);
 
     /*
      * First read in the column count.
@@ -920,10 +1087,12 @@ static termline *decompressline(compressed_scrollback_line *line)
     /*
      * Now create the output termline.
      */
-    ldata = snew(termline);
+    ldata = snew_pooled(MEMPOOL_TERMLINE, termline);
     ldata->chars = snewn(ncols, termchar);
     ldata->cols = ldata->size = ncols;
     ldata->temporary = true;
+    ldata->dirty = false;
+    ldata->maybe_rtl = false;
     ldata->cc_free = 0;
 
     /*
@@ -1043,12 +1212,432 @@ static void resizeline(Terminal *term, termline *line, int cols)
     }
 }
 
+/*
+ * Storage for the scrollback.
+ *
+ * Lines scrolled off the top of the screen don't go through
+ * compressline() straight away. Instead the most recent ones are
+ * kept in term->scrollback as ordinary termlines, and compressed in
+ * batches a little later: either from a timer once output has had a
+ * chance to settle, or immediately if too many of them have built
+ * up.
+ *
+ * Once compressed, lines are packed end to end into large chunks,
+ * which are kept in order in term->sbchunks. So there's no heap
+ * allocation per line, and the only per-line overhead is an offset
+ * into the chunk. Lines are only ever added at the end and removed
+ * from either end, so a chunk is just an append-only buffer with a
+ * moving start point, and is freed once it empties.
+ *
+ * Logically, the term->sbcompressed lines in the chunks come first
+ * (oldest), and then the termlines in term->scrollback.
+ *
+ * If scrollback_on_disk is set, then once the chunks' data adds up
+ * to more than SB_MEMORY_BUDGET, the oldest chunks have their data
+ * written out to a temporary file and freed, keeping just the line
+ * offsets in memory. The chunks on disk are always an initial
+ * segment of term->sbchunks (we only ever spill the oldest resident
+ * one, and new lines never go into a chunk on disk). Each chunk
+ * gets a slot of SBCHUNK_SIZE in the file (or its exact size, for
+ * the rare chunk that's bigger than that because of one huge line),
+ * and slots of the standard size are reused when their chunk goes
+ * away. Reading back in is done a chunk at a time, and the last few
+ * chunks read are kept in term->sbcache.
+ */
+typedef struct sbchunk {
+    uint64_t base;                     /* number of this chunk's line 0,
+                                          counting since the chunk list
+                                          was last empty */
+    int start, nlines;                 /* lines [start,nlines) are live */
+    uint32_t *offsets;                 /* line i is data[offsets[i]] up to
+                                          data[offsets[i+1]] */
+    size_t offsetsize;
+    unsigned char *data;               /* NULL if on disk and not cached */
+    size_t len, size;
+    bool on_disk;
+    uint64_t fileoff;
+    uint64_t bloom[SB_BLOOM_BITS / 64]; /* see sb_bloom_add_line */
+} sbchunk;
+
+/*
+ * What we show for a line of scrollback that we couldn't read back
+ * from the temporary file: the compressed form of a line with no
+ * columns and no attributes, which lineptr() will pad with blanks.
+ */
+static const unsigned char sb_unreadable_line[] = { 0, 0 };
+
+static void term_schedule_sbcompress(Terminal *term);
+
+static int sb_count(Terminal *term)
+{
+    return term->sbcompressed + count234(term->scrollback);
+}
+
+static void sb_uncache_chunk(Terminal *term, sbchunk *ck)
+{
+    for (size_t i = 0; i < lenof(term->sbcache); i++) {
+        if (term->sbcache[i] == ck) {
+            memmove(term->sbcache + i, term->sbcache + i + 1,
+                    (lenof(term->sbcache) - i - 1) * sizeof(*term->sbcache));
+            term->sbcache[lenof(term->sbcache) - 1] = NULL;
+            return;
+        }
+    }
+}
+
+/*
+ * Make sure a chunk's data is in memory, reading it back from the
+ * temporary file if necessary. Returns false if that failed.
+ */
+static bool sb_load_chunk(Terminal *term, sbchunk *ck)
+{
+    if (!ck->on_disk)
+        return true;
+
+    sb_uncache_chunk(term, ck);
+    if (!ck->data) {
+        ck->data = snewn(ck->len ? ck->len : 1, unsigned char);
+        ck->size = ck->len;
+        if (!tempfile_read(term->sbfile, ck->fileoff, ck->data, ck->len)) {
+            sfree(ck->data);
+            ck->data = NULL;
+            ck->size = 0;
+            return false;
+        }
+    }
+
+    /* Put it at the front of the cache, evicting the last entry if
+     * the cache was already full. */
+    sbchunk *evict = term->sbcache[lenof(term->sbcache) - 1];
+    if (evict) {
+        sfree(evict->data);
+        evict->data = NULL;
+        evict->size = 0;
+    }
+    memmove(term->sbcache + 1, term->sbcache,
+            (lenof(term->sbcache) - 1) * sizeof(*term->sbcache));
+    term->sbcache[0] = ck;
+    return true;
+}
+
+static ptrlen sbchunk_line(Terminal *term, sbchunk *ck, int i)
+{
+    if (!sb_load_chunk(term, ck))
+        return make_ptrlen(sb_unreadable_line, sizeof(sb_unreadable_line));
+    return make_ptrlen(ck->data + ck->offsets[i],
+                       ck->offsets[i+1] - ck->offsets[i]);
+}
+
+static void sb_free_chunk(Terminal *term, sbchunk *ck)
+{
+    if (ck->on_disk) {
+        sb_uncache_chunk(term, ck);
+        if (ck->len <= SBCHUNK_SIZE) {
+            sgrowarray(term->sbfreeslots, term->sbfreeslotsize,
+                       term->nsbfreeslots);
+            term->sbfreeslots[term->nsbfreeslots++] = ck->fileoff;
+        }
+        term->nsbspilled--;
+    } else {
+        term->sbmembytes -= ck->size;
+    }
+    sfree(ck->offsets);
+    sfree(ck->data);
+    sfree(ck);
+
+    if (term->nsbspilled == 0) {
+        /* Nothing left in the file, so start again from the top */
+        term->nsbfreeslots = 0;
+        term->sbfilelen = 0;
+    }
+}
+
+/*
+ * Write the oldest chunks out to disk until we're within our memory
+ * budget, if we've been asked to.
+ */
+static void sb_spill_chunks(Terminal *term)
+{
+    if (!term->scrollback_on_disk || term->sbfile_failed)
+        return;
+
+    /* Always leave the last chunk in memory, since we append to it */
+    while (term->sbmembytes > SB_MEMORY_BUDGET &&
+           term->nsbspilled + 1 < term->nsbchunks) {
+        sbchunk *ck = term->sbchunks[term->nsbspilled];
+        uint64_t off;
+
+        if (!term->sbfile && !(term->sbfile = tempfile_new())) {
+            term->sbfile_failed = true;
+            return;
+        }
+
+        if (ck->len <= SBCHUNK_SIZE && term->nsbfreeslots > 0) {
+            off = term->sbfreeslots[--term->nsbfreeslots];
+        } else {
+            off = term->sbfilelen;
+            term->sbfilelen += (ck->len > SBCHUNK_SIZE ?
+                                ck->len : SBCHUNK_SIZE);
+        }
+
+        if (!tempfile_write(term->sbfile, off, ck->data, ck->len)) {
+            /* Give up on the file, and just keep everything from
+             * now on in memory as if we'd never been asked. */
+            term->sbfile_failed = true;
+            return;
+        }
+
+        term->sbmembytes -= ck->size;
+        sfree(ck->data);
+        ck->data = NULL;
+        ck->size = 0;
+        ck->on_disk = true;
+        ck->fileoff = off;
+        term->nsbspilled++;
+    }
+}
+
+/*
+ * Find the compressed form of one of the first term->sbcompressed
+ * lines of the scrollback.
+ */
+static sbchunk *sb_find_chunk(Terminal *term, int index, int *lineno)
+{
+    sbchunk *first = term->sbchunks[0];
+    uint64_t n = first->base + first->start + index;
+    size_t lo = 0, hi = term->nsbchunks;
+
+    assert(index >= 0 && index < term->sbcompressed);
+
+    /* Find the last chunk whose base is no later than n */
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (term->sbchunks[mid]->base <= n)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    sbchunk *ck = term->sbchunks[lo];
+    assert(n - ck->base < (uint64_t)ck->nlines);
+    *lineno = n - ck->base;
+    return ck;
+}
+
+static ptrlen sb_compressed_line(Terminal *term, int index)
+{
+    int lineno;
+    sbchunk *ck = sb_find_chunk(term, index, &lineno);
+    return sbchunk_line(term, ck, lineno);
+}
+
+/*
+ * Reduce a terminal character to the form we compare when searching
+ * the scrollback: drop the CSET_* font selection, and fold ASCII
+ * letters to lower case.
+ */
+static unsigned long term_search_key(unsigned long chr)
+{
+    if (DIRECT_CHAR(chr) || DIRECT_FONT(chr))
+        chr &= 0xFF;
+    if (chr >= 'A' && chr <= 'Z')
+        chr += 'a' - 'A';
+    return chr;
+}
+
+/*
+ * Convert a termline into search keys, one per character cell
+ * (skipping the right halves of wide characters and ignoring
+ * combining characters). If cols is non-NULL, it receives the
+ * column each key came from. Returns the number of keys.
+ */
+static int term_line_search_keys(termline *ldata, unsigned long *keys,
+                                 int *cols)
+{
+    int n = 0;
+    for (int x = 0; x < ldata->cols; x++) {
+        if (ldata->chars[x].chr == UCSWIDE)
+            continue;
+        keys[n] = term_search_key(ldata->chars[x].chr);
+        if (cols)
+            cols[n] = x;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Each chunk of compressed scrollback has a Bloom filter recording
+ * which trigrams of search keys appear anywhere in it, so a search
+ * can skip over chunks that can't contain a match without reading or
+ * decompressing them. Every trigram sets two bits.
+ */
+static uint32_t sb_bloom_hash(const unsigned long *k)
+{
+    uint32_t h = (uint32_t)k[0] * 0x9E3779B1U;
+    h = (h ^ (h >> 15) ^ (uint32_t)k[1]) * 0x85EBCA77U;
+    h = (h ^ (h >> 13) ^ (uint32_t)k[2]) * 0xC2B2AE3DU;
+    return h ^ (h >> 16);
+}
+
+static inline void sb_bloom_set(uint64_t *bloom, uint32_t h)
+{
+    unsigned b1 = h % SB_BLOOM_BITS, b2 = (h >> 16) % SB_BLOOM_BITS;
+    bloom[b1 / 64] |= (uint64_t)1 << (b1 % 64);
+    bloom[b2 / 64] |= (uint64_t)1 << (b2 % 64);
+}
+
+static inline bool sb_bloom_test(const uint64_t *bloom, uint32_t h)
+{
+    unsigned b1 = h % SB_BLOOM_BITS, b2 = (h >> 16) % SB_BLOOM_BITS;
+    return ((bloom[b1 / 64] >> (b1 % 64)) & 1) &&
+        ((bloom[b2 / 64] >> (b2 % 64)) & 1);
+}
+
+static void sb_bloom_add_line(sbchunk *ck, termline *ldata)
+{
+    unsigned long *keys = snewn(ldata->cols, unsigned long);
+    int n = term_line_search_keys(ldata, keys, NULL);
+
+    for (int i = 0; i + 3 <= n; i++)
+        sb_bloom_set(ck->bloom, sb_bloom_hash(keys + i));
+    sfree(keys);
+}
+
+static void sb_append_compressed(Terminal *term, ptrlen data)
+{
+    sbchunk *ck = term->nsbchunks ? term->sbchunks[term->nsbchunks-1] : NULL;
+
+    if (ck && ck->on_disk) {
+        /* Only possible if lines were taken back off the end. */
+        ck = NULL;
+    } else if (ck && ck->len + data.len > SBCHUNK_SIZE) {
+        /* This chunk is full, so give back any slack space in it. */
+        ck->data = sresize(ck->data, ck->len, unsigned char);
+        term->sbmembytes -= ck->size - ck->len;
+        ck->size = ck->len;
+        ck = NULL;
+        sb_spill_chunks(term);
+    }
+
+    if (!ck) {
+        sbchunk *prev = term->nsbchunks ?
+            term->sbchunks[term->nsbchunks-1] : NULL;
+        ck = snew(sbchunk);
+        ck->base = prev ? prev->base + prev->nlines : 0;
+        ck->start = ck->nlines = 0;
+        ck->offsets = NULL;
+        ck->offsetsize = 0;
+        sgrowarray(ck->offsets, ck->offsetsize, 0);
+        ck->offsets[0] = 0;
+        ck->data = NULL;
+        ck->len = ck->size = 0;
+        ck->on_disk = false;
+        memset(ck->bloom, 0, sizeof(ck->bloom));
+        sgrowarray(term->sbchunks, term->sbchunksize, term->nsbchunks);
+        term->sbchunks[term->nsbchunks++] = ck;
+    }
+
+    term->sbmembytes -= ck->size;
+    sgrowarrayn(ck->data, ck->size, ck->len, data.len);
+    term->sbmembytes += ck->size;
+    memcpy(ck->data + ck->len, data.ptr, data.len);
+    ck->len += data.len;
+    ck->nlines++;
+    sgrowarray(ck->offsets, ck->offsetsize, ck->nlines);
+    ck->offsets[ck->nlines] = ck->len;
+    term->sbcompressed++;
+}
+
+static void sb_compress_lines(Terminal *term, int n)
+{
+    strbuf *b = strbuf_new();
+    termline *line;
+
+    while (n-- > 0 && (line = delpos234(term->scrollback, 0)) != NULL) {
+        strbuf_clear(b);
+        compressline(b, line);
+        sb_append_compressed(term, ptrlen_from_strbuf(b));
+        sb_bloom_add_line(term->sbchunks[term->nsbchunks - 1], line);
+        term_release_line(term, line);
+    }
+
+    strbuf_free(b);
+}
+
+/*
+ * Add a line to the end of the scrollback. The termline becomes the
+ * property of the scrollback.
+ */
+static void sb_add_line(Terminal *term, termline *line)
+{
+    line->temporary = false;
+    addpos234(term->scrollback, line, count234(term->scrollback));
+    if (count234(term->scrollback) > SB_UNCOMPRESSED_MAX)
+        sb_compress_lines(term, SB_COMPRESS_BATCH);
+    else
+        term_schedule_sbcompress(term);
+}
+
+/*
+ * Remove the last line of the scrollback and return it as a
+ * termline, decompressing it if necessary. The caller owns the
+ * result.
+ */
+static termline *sb_remove_last_line(Terminal *term)
+{
+    int n = count234(term->scrollback);
+    termline *line;
+
+    if (n > 0)
+        return delpos234(term->scrollback, n - 1);
+    if (term->sbcompressed == 0)
+        return NULL;
+
+    sbchunk *ck = term->sbchunks[term->nsbchunks - 1];
+    ck->nlines--;
+    line = decompressline(sbchunk_line(term, ck, ck->nlines));
+    line->temporary = false;
+    if (!ck->on_disk)
+        ck->len = ck->offsets[ck->nlines];
+    if (ck->nlines == ck->start) {
+        term->nsbchunks--;
+        sb_free_chunk(term, ck);
+    }
+    term->sbcompressed--;
+    return line;
+}
+
+/*
+ * Discard the first (oldest) line of the scrollback.
+ */
+static bool sb_delete_first_line(Terminal *term)
+{
+    if (term->sbcompressed > 0) {
+        sbchunk *ck = term->sbchunks[0];
+        if (++ck->start == ck->nlines) {
+            term->nsbchunks--;
+            memmove(term->sbchunks, term->sbchunks + 1,
+                    term->nsbchunks * sizeof(*term->sbchunks));
+            sb_free_chunk(term, ck);
+        }
+        term->sbcompressed--;
+        return true;
+    } else {
+        termline *line = delpos234(term->scrollback, 0);
+        if (!line)
+            return false;
+        freetermline(line);
+        return true;
+    }
+}
+
 /*
  * Get the number of lines in the scrollback.
  */
 static int sblines(Terminal *term)
 {
-    int sblines = count234(term->scrollback);
+    int sblines = sb_count(term);
     if (term->erase_to_scrollback &&
         term->alt_which && term->alt_screen) {
             sblines += term->alt_sblines;
@@ -1057,7 +1646,7 @@ static int sblines(Terminal *term)
 }
 
 static void null_line_error(Terminal *term, int y, int lineno,
-                            tree234 *whichtree, int treeindex,
+                            void *whichtree, int treeindex,
                             const char *varname)
 {
     modalfatalbox("%s==NULL in terminal.c\n"
@@ -1070,23 +1659,41 @@ static void null_line_error(Terminal *term, int y, int lineno,
                   "Please contact <putty@projects.tartarus.org> "
                   "and pass on the above information.",
                   varname, lineno, y, term->cols, term->rows,
-                  term->scrollback, count234(term->scrollback),
-                  term->screen, count234(term->screen),
-                  term->alt_screen, count234(term->alt_screen),
+                  term->scrollback, sb_count(term),
+                  term->screen, termscreen_count(term->screen),
+                  term->alt_screen, termscreen_count(term->alt_screen),
                   term->alt_sblines, whichtree, treeindex, commitid);
 }
 
+/*
+ * Note that the line at the given y coordinate may have changed, so
+ * that do_paint must look at whichever row of the display it's on
+ * (if any) next time round.
+ */
+static inline void term_dirty_line(Terminal *term, int y)
+{
+    int i = y - term->disptop;
+    if (term->disptext && i >= 0 && i < term->rows)
+        term->disptext[i]->dirty = true;
+}
+
 /*
  * Retrieve a line of the screen or of the scrollback, according to
  * whether the y coordinate is non-negative or negative
  * (respectively).
+ *
+ * Everything that modifies a screen line fetches it with
+ * scrlineptr(), so that is where we mark it as needing repainting.
  */
 static termline *lineptr(Terminal *term, int y, int lineno, int screen)
 {
     termline *line;
-    tree234 *whichtree;
+    void *whichtree;
     int treeindex;
 
+    if (screen)
+        term_dirty_line(term, y);
+
     if (y >= 0) {
         whichtree = term->screen;
         treeindex = y;
@@ -1101,20 +1708,22 @@ static termline *lineptr(Terminal *term, int y, int lineno, int screen)
         }
         if (y < -altlines) {
             whichtree = term->scrollback;
-            treeindex = y + altlines + count234(term->scrollback);
+            treeindex = y + altlines + sb_count(term);
         } else {
             whichtree = term->alt_screen;
             treeindex = y + term->alt_sblines;
-            /* treeindex = y + count234(term->alt_screen); */
+            /* treeindex = y + termscreen_count(term->alt_screen); */
         }
     }
-    if (whichtree == term->scrollback) {
-        compressed_scrollback_line *cline = index234(whichtree, treeindex);
-        if (!cline)
+    if (whichtree == term->scrollback && treeindex < term->sbcompressed) {
+        if (treeindex < 0)
             null_line_error(term, y, lineno, whichtree, treeindex, "cline");
-        line = decompressline(cline);
+        line = decompressline(sb_compressed_line(term, treeindex));
+    } else if (whichtree == term->scrollback) {
+        treeindex -= term->sbcompressed;
+        line = index234(term->scrollback, treeindex);
     } else {
-        line = index234(whichtree, treeindex);
+        line = termscreen_line(whichtree, treeindex);
     }
 
     /* We assume that we don't screw up and retrieve something out of range. */
@@ -1191,6 +1800,19 @@ static void term_timer(void *ctx, unsigned long now)
         update = true;
     }
 
+    if (term->sbcompress_pending && now == term->next_sbcompress) {
+        /*
+         * Leave alone the newest lines, which making the window
+         * taller would bring straight back on to the screen, so that
+         * a run of resizes (e.g. a drag, or a tiling WM retiling)
+         * doesn't compress and decompress them every time.
+         */
+        int keep = (term->tempsblines < term->rows ?
+                    term->tempsblines : term->rows);
+        term->sbcompress_pending = false;
+        sb_compress_lines(term, count234(term->scrollback) - keep);
+    }
+
     if (update ||
         (term->window_update_pending && now == term->next_update))
         term_update(term);
@@ -1200,7 +1822,17 @@ static void term_schedule_update(Terminal *term)
 {
     if (!term->window_update_pending) {
         term->window_update_pending = true;
-        term->next_update = schedule_timer(UPDATE_DELAY, term_timer, term);
+        term->next_update =
+            schedule_timer(term->update_delay, term_timer, term);
+    }
+}
+
+static void term_schedule_sbcompress(Terminal *term)
+{
+    if (!term->sbcompress_pending) {
+        term->sbcompress_pending = true;
+        term->next_sbcompress =
+            schedule_timer(SBCOMPRESS_DELAY, term_timer, term);
     }
 }
 
@@ -1369,6 +2001,21 @@ void term_update(Terminal *term)
 {
     term->window_update_pending = false;
 
+    /*
+     * If more than a screenful of output has gone past since the
+     * last update, nobody will have been able to read it, so spend
+     * less time painting and more time parsing until that stops.
+     */
+    if (term->update_bytes > (size_t)term->rows * term->cols) {
+        term->update_delay *= 2;
+        if (term->update_delay > UPDATE_DELAY_MAX)
+            term->update_delay = UPDATE_DELAY_MAX;
+    } else {
+        term->update_delay = UPDATE_DELAY;
+    }
+    term->update_bytes = 0;
+    term->last_update = GETTICKCOUNT();
+
     if (win_setup_draw_ctx(term->win)) {
         bool need_sbar_update = term->seen_disp_event;
         if (term->seen_disp_event && term->scroll_on_disp) {
@@ -1379,6 +2026,7 @@ void term_update(Terminal *term)
 
         if (need_sbar_update)
             update_sbar(term);
+        do_dispscrolls(term);
         do_paint(term);
         win_set_cursor_pos(
             term->win, term->curs.x, term->curs.y - term->disptop);
@@ -1408,6 +2056,8 @@ void term_seen_key_event(Terminal *term)
     term->beeptail = NULL;
     term->nbeeps = 0;
 
+    term->echo_pending = true;
+
     /*
      * Reset the scrollback on keypress, if we're doing that.
      */
@@ -1480,12 +2130,14 @@ void term_copy_stuff_from_conf(Terminal *term)
     term->no_remote_wintitle = conf_get_bool(term->conf, CONF_no_remote_wintitle);
     term->no_remote_clearscroll = conf_get_bool(term->conf, CONF_no_remote_clearscroll);
     term->rawcnp = conf_get_bool(term->conf, CONF_rawcnp);
+    term->rtf_paste = conf_get_bool(term->conf, CONF_rtf_paste);
     term->utf8linedraw = conf_get_bool(term->conf, CONF_utf8linedraw);
     term->rect_select = conf_get_bool(term->conf, CONF_rect_select);
     term->remote_qtitle_action = conf_get_int(term->conf, CONF_remote_qtitle_action);
     term->rxvt_homeend = conf_get_bool(term->conf, CONF_rxvt_homeend);
     term->scroll_on_disp = conf_get_bool(term->conf, CONF_scroll_on_disp);
     term->scroll_on_key = conf_get_bool(term->conf, CONF_scroll_on_key);
+    term->scrollback_on_disk = conf_get_bool(term->conf, CONF_scrollback_on_disk);
     term->xterm_256_colour = conf_get_bool(term->conf, CONF_xterm_256_colour);
     term->true_colour = conf_get_bool(term->conf, CONF_true_colour);
 
@@ -1598,6 +2250,7 @@ void term_reconfig(Terminal *term, Conf *conf)
     term_schedule_tblink(term);
     term_schedule_cblink(term);
     term_copy_stuff_from_conf(term);
+    term->paint_all = true;
 }
 
 /*
@@ -1605,7 +2258,6 @@ void term_reconfig(Terminal *term, Conf *conf)
  */
 void term_clrsb(Terminal *term)
 {
-    unsigned char *line;
     int i;
 
     /*
@@ -1617,9 +2269,8 @@ void term_clrsb(Terminal *term)
     /*
      * Clear the actual scrollback.
      */
-    while ((line = delpos234(term->scrollback, 0)) != NULL) {
-        sfree(line);            /* this is compressed data, not a termline */
-    }
+    while (sb_delete_first_line(term))
+        ;
 
     /*
      * When clearing the scrollback, we also truncate any termlines on
@@ -1676,7 +2327,8 @@ Terminal *term_init(Conf *myconf, struct unicode_data *ucsdata, TermWin *win)
     strcpy(term->id_string, "\033[?6c");
     term->cblink_pending = term->tblink_pending = false;
     term->paste_buffer = NULL;
-    term->paste_len = 0;
+    term->paste_len = term->paste_pos = 0;
+    term->paste_waiting = term->paste_callback_pending = false;
     bufchain_init(&term->inbuf);
     bufchain_init(&term->printer_buf);
     term->printing = term->only_printing = false;
@@ -1696,12 +2348,30 @@ Terminal *term_init(Conf *myconf, struct unicode_data *ucsdata, TermWin *win)
 
     term_copy_stuff_from_conf(term);
 
-    term->screen = term->alt_screen = term->scrollback = NULL;
+    term->screen = term->alt_screen = NULL;
+    term->scrollback = NULL;
     term->tempsblines = 0;
+    term->sbchunks = NULL;
+    term->nsbchunks = term->sbchunksize = 0;
+    term->sbcompressed = 0;
+    term->sbmembytes = 0;
+    term->nsbspilled = 0;
+    memset(term->sbcache, 0, sizeof(term->sbcache));
+    term->sbfile = NULL;
+    term->sbfile_failed = false;
+    term->sbfilelen = 0;
+    term->sbfreeslots = NULL;
+    term->nsbfreeslots = term->sbfreeslotsize = 0;
+    term->nspare_lines = 0;
+    term->sbcompress_pending = false;
     term->alt_sblines = 0;
     term->disptop = 0;
     term->disptext = NULL;
     term->dispcursx = term->dispcursy = -1;
+    term->dispscrolls = NULL;
+    term->ndispscrolls = term->dispscrollsize = 0;
+    memset(&term->paintstate, 0, sizeof(term->paintstate));
+    term->paint_all = true;
     term->tabs = NULL;
     deselect(term);
     term->rows = term->cols = -1;
@@ -1720,6 +2390,10 @@ Terminal *term_init(Conf *myconf, struct unicode_data *ucsdata, TermWin *win)
     term->wcFromTo_size = 0;
 
     term->window_update_pending = false;
+    term->update_delay = UPDATE_DELAY;
+    term->last_update = GETTICKCOUNT();
+    term->update_bytes = 0;
+    term->echo_pending = false;
 
     term->bidi_cache_size = 0;
     term->pre_bidi_cache = term->post_bidi_cache = NULL;
@@ -1753,24 +2427,26 @@ Terminal *term_init(Conf *myconf, struct unicode_data *ucsdata, TermWin *win)
 
 void term_free(Terminal *term)
 {
-    termline *line;
     struct beeptime *beep;
     int i;
 
-    while ((line = delpos234(term->scrollback, 0)) != NULL)
-        sfree(line);                   /* compressed data, not a termline */
+    while (sb_delete_first_line(term))
+        ;
     freetree234(term->scrollback);
-    while ((line = delpos234(term->screen, 0)) != NULL)
-        freetermline(line);
-    freetree234(term->screen);
-    while ((line = delpos234(term->alt_screen, 0)) != NULL)
-        freetermline(line);
-    freetree234(term->alt_screen);
+    sfree(term->sbchunks);
+    sfree(term->sbfreeslots);
+    if (term->sbfile)
+        tempfile_free(term->sbfile);
+    termscreen_free(term->screen);
+    termscreen_free(term->alt_screen);
+    while (term->nspare_lines > 0)
+        freetermline(term->spare_lines[--term->nspare_lines]);
     if (term->disptext) {
         for (i = 0; i < term->rows; i++)
             freetermline(term->disptext[i]);
     }
     sfree(term->disptext);
+    sfree(term->dispscrolls);
     while (term->beephead) {
         beep = term->beephead;
         term->beephead = beep->next;
@@ -1821,7 +2497,7 @@ void term_get_cursor_position(Terminal *term, int *x, int *y)
  */
 void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
 {
-    tree234 *newalt;
+    termscreen *newalt;
     termline **newdisp, *line;
     int i, j, oldrows = term->rows;
     int sblen;
@@ -1843,8 +2519,10 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
     term->alt_b = term->marg_b = newrows - 1;
 
     if (term->rows == -1) {
-        term->scrollback = newtree234(NULL);
-        term->screen = newtree234(NULL);
+        /* Scrollback can run to many thousands of lines, all indexed
+         * on every redraw of a scrolled-back window */
+        term->scrollback = newtree234_wide(NULL);
+        term->screen = termscreen_new();
         term->tempsblines = 0;
         term->rows = 0;
     }
@@ -1868,20 +2546,17 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
      *    amount of scrollback we actually have, we must throw some
      *    away.
      */
-    sblen = count234(term->scrollback);
+    sblen = sb_count(term);
     /* Do this loop to expand the screen if newrows > rows */
-    assert(term->rows == count234(term->screen));
+    assert(term->rows == termscreen_count(term->screen));
     while (term->rows < newrows) {
         if (term->tempsblines > 0) {
-            compressed_scrollback_line *cline;
             /* Insert a line from the scrollback at the top of the screen. */
             assert(sblen >= term->tempsblines);
-            cline = delpos234(term->scrollback, --sblen);
-            line = decompressline(cline);
-            sfree(cline);
-            line->temporary = false;   /* reconstituted line is now real */
+            line = sb_remove_last_line(term);
+            sblen--;
             term->tempsblines -= 1;
-            addpos234(term->screen, line, 0);
+            termscreen_insert(term->screen, 0, line);
             term->curs.y += 1;
             term->savecurs.y += 1;
             term->alt_y += 1;
@@ -1889,7 +2564,7 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
         } else {
             /* Add a new blank line at the bottom of the screen. */
             line = newtermline(term, newcols, false);
-            addpos234(term->screen, line, count234(term->screen));
+            termscreen_insert(term->screen, term->rows, line);
         }
         term->rows += 1;
     }
@@ -1897,13 +2572,13 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
     while (term->rows > newrows) {
         if (term->curs.y < term->rows - 1) {
             /* delete bottom row, unless it contains the cursor */
-            line = delpos234(term->screen, term->rows - 1);
+            line = termscreen_delete(term->screen, term->rows - 1);
             freetermline(line);
         } else {
             /* push top row to scrollback */
-            line = delpos234(term->screen, 0);
-            addpos234(term->scrollback, compressline(line), sblen++);
-            freetermline(line);
+            line = termscreen_delete(term->screen, 0);
+            sb_add_line(term, line);
+            sblen++;
             term->tempsblines += 1;
             term->curs.y -= 1;
             term->savecurs.y -= 1;
@@ -1913,18 +2588,17 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
         term->rows -= 1;
     }
     assert(term->rows == newrows);
-    assert(count234(term->screen) == newrows);
+    assert(termscreen_count(term->screen) == newrows);
 
     /* Delete any excess lines from the scrollback. */
     while (sblen > newsavelines) {
-        line = delpos234(term->scrollback, 0);
-        sfree(line);
+        sb_delete_first_line(term);
         sblen--;
     }
     if (sblen < term->tempsblines)
         term->tempsblines = sblen;
-    assert(count234(term->scrollback) <= newsavelines);
-    assert(count234(term->scrollback) >= term->tempsblines);
+    assert(sb_count(term) <= newsavelines);
+    assert(sb_count(term) >= term->tempsblines);
     term->disptop = 0;
 
     /* Make a new displayed text buffer. */
@@ -1941,18 +2615,16 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
     sfree(term->disptext);
     term->disptext = newdisp;
     term->dispcursx = term->dispcursy = -1;
+    term->ndispscrolls = 0;
+    term->paint_all = true;
 
     /* Make a new alternate screen. */
-    newalt = newtree234(NULL);
+    newalt = termscreen_new();
     for (i = 0; i < newrows; i++) {
         line = newtermline(term, newcols, true);
-        addpos234(newalt, line, i);
-    }
-    if (term->alt_screen) {
-        while (NULL != (line = delpos234(term->alt_screen, 0)))
-            freetermline(line);
-        freetree234(term->alt_screen);
+        termscreen_insert(newalt, i, line);
     }
+    termscreen_free(term->alt_screen);
     term->alt_screen = newalt;
     term->alt_sblines = 0;
 
@@ -2018,11 +2690,11 @@ void term_provide_backend(Terminal *term, Backend *backend)
  * If only the top line has content, returns 0.
  * If no lines have content, return -1.
  */
-static int find_last_nonempty_line(Terminal * term, tree234 * screen)
+static int find_last_nonempty_line(Terminal * term, termscreen * screen)
 {
     int i;
-    for (i = count234(screen) - 1; i >= 0; i--) {
-        termline *line = index234(screen, i);
+    for (i = termscreen_count(screen) - 1; i >= 0; i--) {
+        termline *line = termscreen_line(screen, i);
         int j;
         for (j = 0; j < line->cols; j++)
             if (!termchars_equal(&line->chars[j], &term->erase_char))
@@ -2046,7 +2718,7 @@ static void swap_screen(Terminal *term, int which,
     bool bt;
     pos tp;
     truecolour ttc;
-    tree234 *ttr;
+    termscreen *ttr;
 
     if (!which)
         reset = false;                 /* do no weird resetting if which==0 */
@@ -2072,6 +2744,7 @@ static void swap_screen(Terminal *term, int which,
         ttr = term->alt_screen;
         term->alt_screen = term->screen;
         term->screen = ttr;
+        term->paint_all = true;
         term->alt_sblines = (
             term->alt_screen ?
             find_last_nonempty_line(term, term->alt_screen) + 1 : 0);
@@ -2199,6 +2872,7 @@ static void clear_line(Terminal *term, termline *line)
     for (int i = 0; i < term->cols; i++)
         copy_termchar(line, i, &term->erase_char);
     line->lattr = LATTR_NORM;
+    line->maybe_rtl = false;
 }
 
 static void check_trust_status(Terminal *term, termline *line)
@@ -2215,6 +2889,98 @@ static void check_trust_status(Terminal *term, termline *line)
     }
 }
 
+/*
+ * Remember that a region of the screen has scrolled, so that the
+ * next update can ask the front end to move the pixels that are
+ * already on the window instead of redrawing every row of text.
+ * Only the region and distance are kept: whatever has happened to
+ * the screen since, do_dispscrolls keeps disptext in step with what
+ * it moves, so do_paint will still correct anything that differs.
+ */
+static void add_dispscroll(Terminal *term, int topline, int botline,
+                           int lines)
+{
+    struct dispscroll *ds;
+
+    if (term->ndispscrolls > 0) {
+        ds = &term->dispscrolls[term->ndispscrolls - 1];
+        if (ds->topline == topline && ds->botline == botline) {
+            ds->lines += lines;
+            if (ds->lines == 0)
+                term->ndispscrolls--;
+            return;
+        }
+    }
+
+    /* Beyond a handful of different regions, the copies would cost
+     * more than the redraws they save */
+    if (term->ndispscrolls >= 8)
+        return;
+
+    sgrowarray(term->dispscrolls, term->dispscrollsize, term->ndispscrolls);
+    ds = &term->dispscrolls[term->ndispscrolls++];
+    ds->topline = topline;
+    ds->botline = botline;
+    ds->lines = lines;
+}
+
+/*
+ * Pass the scrolls recorded by add_dispscroll on to the front end,
+ * and move the rows of disptext to match, leaving the uncovered rows
+ * marked for redrawing.
+ */
+static void do_dispscrolls(Terminal *term)
+{
+    size_t k;
+
+    /* Only worth it if the window is showing the live screen and
+     * won't be repainted from scratch anyway */
+    if (term->paint_all || term->disptop != 0 ||
+        term->paintstate.disptop != 0)
+        goto out;
+
+    for (k = 0; k < term->ndispscrolls; k++) {
+        struct dispscroll *ds = &term->dispscrolls[k];
+        int top = ds->topline, bot = ds->botline, size = bot - top + 1;
+        int lines = ds->lines, n = abs(lines), i, j;
+        termline **disp = term->disptext + top, **tmp;
+
+        if (n >= size)
+            continue;
+        if (!win_scroll_rect(term->win, top, bot, lines))
+            break;
+
+        /* Rotate the region's rows, so that the ones scrolled off
+         * the edge reappear in the rows that have been uncovered */
+        tmp = snewn(n, termline *);
+        if (lines > 0) {
+            memcpy(tmp, disp, n * sizeof(*disp));
+            memmove(disp, disp + n, (size - n) * sizeof(*disp));
+            memcpy(disp + size - n, tmp, n * sizeof(*disp));
+        } else {
+            memcpy(tmp, disp + size - n, n * sizeof(*disp));
+            memmove(disp + n, disp, (size - n) * sizeof(*disp));
+            memcpy(disp, tmp, n * sizeof(*disp));
+        }
+        sfree(tmp);
+
+        for (i = (lines > 0 ? size - n : 0); n-- > 0; i++) {
+            for (j = 0; j < term->cols; j++)
+                disp[i]->chars[j].attr |= ATTR_INVALID;
+            disp[i]->dirty = true;
+        }
+
+        if (term->dispcursy >= top && term->dispcursy <= bot) {
+            term->dispcursy -= lines;
+            if (term->dispcursy < top || term->dispcursy > bot)
+                term->dispcursx = term->dispcursy = -1;
+        }
+    }
+
+  out:
+    term->ndispscrolls = 0;
+}
+
 /*
  * Scroll the screen. (`lines' is +ve for scrolling forward, -ve
  * for backward.) `sb' is true if the scrolling is permitted to
@@ -2224,22 +2990,33 @@ static void scroll(Terminal *term, int topline, int botline,
                    int lines, bool sb)
 {
     termline *line;
-    int seltop, scrollwinsize;
+    int i, seltop, scrollwinsize;
 
     if (topline != 0 || term->alt_which != 0)
         sb = false;
 
     scrollwinsize = botline - topline + 1;
 
+    /*
+     * Every line in the scroll region moves to a different row, and
+     * so does any scrollback on display if we're adding to it.
+     */
+    if (sb && term->disptop < 0)
+        term->paint_all = true;
+    for (i = topline; i <= botline; i++)
+        term_dirty_line(term, i);
+    if (term->disptop == 0)
+        add_dispscroll(term, topline, botline, lines);
+
     if (lines < 0) {
         lines = -lines;
         if (lines > scrollwinsize)
             lines = scrollwinsize;
         while (lines-- > 0) {
-            line = delpos234(term->screen, botline);
+            termscreen_rotate(term->screen, topline, botline, true);
+            line = termscreen_line(term->screen, topline);
             resizeline(term, line, term->cols);
             clear_line(term, line);
-            addpos234(term->screen, line, topline);
 
             if (term->selstart.y >= topline && term->selstart.y <= botline) {
                 term->selstart.y++;
@@ -2260,29 +3037,29 @@ static void scroll(Terminal *term, int topline, int botline,
         if (lines > scrollwinsize)
             lines = scrollwinsize;
         while (lines-- > 0) {
-            line = delpos234(term->screen, topline);
+            line = termscreen_line(term->screen, topline);
 #ifdef TERM_CC_DIAGS
             cc_check(line);
 #endif
             if (sb && term->savelines > 0) {
-                int sblen = count234(term->scrollback);
+                int sblen = sb_count(term);
                 /*
                  * We must add this line to the scrollback. We'll
                  * remove a line from the top of the scrollback if
                  * the scrollback is full.
                  */
                 if (sblen == term->savelines) {
-                    unsigned char *cline;
-
                     sblen--;
-                    cline = delpos234(term->scrollback, 0);
-                    sfree(cline);
+                    sb_delete_first_line(term);
                 } else
                     term->tempsblines += 1;
 
-                addpos234(term->scrollback, compressline(line), sblen);
+                sb_add_line(term, line);
 
-                /* now `line' itself can be reused as the bottom line */
+                /* `line' now belongs to the scrollback, so we need a
+                 * fresh one for the bottom line */
+                line = term_spare_line(term);
+                *termscreen_slot(term->screen, topline) = line;
 
                 /*
                  * If the user is currently looking at part of the
@@ -2304,7 +3081,7 @@ static void scroll(Terminal *term, int topline, int botline,
             resizeline(term, line, term->cols);
             clear_line(term, line);
             check_trust_status(term, line);
-            addpos234(term->screen, line, botline);
+            termscreen_rotate(term->screen, topline, botline, false);
 
             /*
              * If the selection endpoints move into the scrollback,
@@ -2842,6 +3619,28 @@ static void term_print_flush(Terminal *term)
         bufchain_consume(&term->printer_buf, data.len);
     }
 }
+/*
+ * In print-only mode, nearly all the data is simply passed to the
+ * printer, and the only thing term_out has to look for is the ESC[4i
+ * (or CSI 4i) that ends it. So if we aren't part way through such a
+ * sequence, we can add everything up to the next ESC or CSI byte to
+ * the printer buffer in one go. Returns the number of bytes consumed.
+ */
+static size_t term_bulk_print(Terminal *term, ptrlen data)
+{
+    const unsigned char *p = data.ptr;
+    size_t n;
+
+    if (!term->printing || !term->only_printing || term->print_state != 0)
+        return 0;
+
+    for (n = 0; n < data.len; n++)
+        if (p[n] == '\033' || p[n] == 0x9B)
+            break;
+
+    bufchain_add(&term->printer_buf, p, n);
+    return n;
+}
 static void term_print_finish(Terminal *term)
 {
     size_t size;
@@ -2950,6 +3749,7 @@ static void term_display_graphic_char(Terminal *term, unsigned long c)
         /* FULL-TERMCHAR */
         clear_cc(cline, term->curs.x);
         cline->chars[term->curs.x].chr = c;
+        termline_note_chr(cline, c);
         cline->chars[term->curs.x].attr = term->curr_attr;
         cline->chars[term->curs.x].truecolour =
             term->curr_truecolour;
@@ -2971,6 +3771,7 @@ static void term_display_graphic_char(Terminal *term, unsigned long c)
         /* FULL-TERMCHAR */
         clear_cc(cline, term->curs.x);
         cline->chars[term->curs.x].chr = c;
+        termline_note_chr(cline, c);
         cline->chars[term->curs.x].attr = term->curr_attr;
         cline->chars[term->curs.x].truecolour =
             term->curr_truecolour;
@@ -3018,6 +3819,161 @@ static void term_display_graphic_char(Terminal *term, unsigned long c)
     seen_disp_event(term);
 }
 
+/*
+ * Fast path for term_out: if the terminal is in a state where a
+ * plain printable ASCII byte would simply be written to the cursor
+ * position and the cursor advanced, write as long a run of such
+ * bytes as will fit on the current line in one go, without going
+ * through the full per-character state machine. Returns the number
+ * of bytes consumed, which may be zero, in which case the caller
+ * must process the next byte the slow way.
+ *
+ * The conditions below are exactly those under which
+ * term_translate would return (c | CSET_ASCII) and
+ * term_display_graphic_char would neither wrap, insert, combine nor
+ * touch the selection.
+ */
+static size_t term_bulk_graphic_chars(
+    Terminal *term, const unsigned char *chars, size_t nchars)
+{
+    if (term->termstate != TOPLEVEL || term->printing ||
+        term->wrapnext || term->insert ||
+        term->selstate != NO_SELECTION)
+        return 0;
+
+    if (in_utf(term)) {
+        if (term->utf8.state != 0 ||
+            (term->utf8linedraw &&
+             term->cset_attr[term->cset] == CSET_LINEDRW))
+            return 0;
+    } else {
+        if (term->sco_acs || term->cset_attr[term->cset] != CSET_ASCII)
+            return 0;
+    }
+
+    termline *cline = scrlineptr(term->curs.y);
+    check_trust_status(term, cline);
+    int linecols = term->cols;
+    if (cline->trusted)
+        linecols -= TRUST_SIGIL_WIDTH;
+    if (term->curs.x >= linecols)
+        return 0;
+
+    size_t avail = linecols - term->curs.x;
+    size_t n = 0;
+    while (n < nchars && n < avail) {
+        unsigned char c = chars[n];
+        if (c < 0x20 || c >= 0x7F || term->ucsdata->unitab_ctrl[c] != 0xFF)
+            break;
+        n++;
+    }
+    if (n == 0)
+        return 0;
+
+    int x0 = term->curs.x;
+    check_boundary(term, x0, term->curs.y);
+    check_boundary(term, x0 + n, term->curs.y);
+
+    for (size_t i = 0; i < n; i++) {
+        unsigned long c = chars[i] | CSET_ASCII;
+        /* FULL-TERMCHAR */
+        clear_cc(cline, x0 + i);
+        cline->chars[x0 + i].chr = c;
+        cline->chars[x0 + i].attr = term->curr_attr;
+        cline->chars[x0 + i].truecolour = term->curr_truecolour;
+    }
+    if (term->logctx)
+        logtraffic_data(term->logctx, make_ptrlen(chars, n), LGTYP_ASCII);
+    term->last_graphic_char = chars[n-1] | CSET_ASCII;
+
+    term->curs.x += n;
+    if (term->curs.x >= linecols) {
+        term->curs.x = linecols - 1;
+        term->wrapnext = true;
+        if (term->wrap && term->vt52_mode) {
+            cline->lattr |= LATTR_WRAPPED;
+            if (term->curs.y == term->marg_b)
+                scroll(term, term->marg_t, term->marg_b, 1, true);
+            else if (term->curs.y < term->rows - 1)
+                term->curs.y++;
+            term->curs.x = 0;
+            term->wrapnext = false;
+        }
+    }
+    seen_disp_event(term);
+    return n;
+}
+
+/*
+ * The UTF-8 counterpart of term_bulk_graphic_chars: decode a run of
+ * printable characters (ASCII or well-formed multibyte sequences)
+ * from the start of 'chars' and display them, without going through
+ * term_translate's byte-at-a-time state machine or the rest of
+ * term_out. The run stops at anything that needs more care -
+ * controls, malformed or incomplete sequences, and the code points
+ * term_translate treats specially - and term_out then handles that
+ * in the usual way. Returns the number of bytes consumed.
+ */
+static size_t term_bulk_utf8_chars(
+    Terminal *term, const unsigned char *chars, size_t nchars)
+{
+    if (term->termstate != TOPLEVEL || term->printing ||
+        !in_utf(term) || term->utf8.state != 0 ||
+        (term->utf8linedraw &&
+         term->cset_attr[term->cset] == CSET_LINEDRW))
+        return 0;
+
+    size_t i = 0;
+    while (i < nchars) {
+        const unsigned char *p = chars + i;
+        size_t left = nchars - i, len;
+        unsigned long t;
+
+        if (p[0] < 0x80) {
+            if (p[0] < 0x20 || p[0] == 0x7F ||
+                term->ucsdata->unitab_ctrl[p[0]] != 0xFF)
+                break;
+            term_display_graphic_char(term, p[0] | CSET_ASCII);
+            term->last_graphic_char = p[0] | CSET_ASCII;
+            i++;
+            continue;
+        } else if (p[0] >= 0xC2 && p[0] < 0xE0) {
+            if (left < 2 || (p[1] & 0xC0) != 0x80)
+                break;
+            t = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+            len = 2;
+        } else if ((p[0] & 0xF0) == 0xE0) {
+            if (left < 3 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80)
+                break;
+            t = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+            if (t < 0x800)
+                break;
+            len = 3;
+        } else if (p[0] >= 0xF0 && p[0] < 0xF5) {
+            if (left < 4 || (p[1] & 0xC0) != 0x80 ||
+                (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80)
+                break;
+            t = ((p[0] & 0x07) << 18) | ((p[1] & 0x3F) << 12) |
+                ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+            if (t < 0x10000 || t > 0x10FFFF)
+                break;
+            len = 4;
+        } else {
+            break;
+        }
+
+        if (t < 0xA0 || t == 0x2028 || t == 0x2029 ||
+            (t >= 0xD800 && t < 0xE000) || (t >= 0xE0000 && t <= 0xE007F) ||
+            t == 0xFEFF || t == 0xFFFE || t == 0xFFFF)
+            break;
+
+        term_display_graphic_char(term, t);
+        term->last_graphic_char = t;
+        i += len;
+    }
+    return i;
+}
+
 static strbuf *term_input_data_from_unicode(
     Terminal *term, const wchar_t *widebuf, int len)
 {
@@ -3077,7 +4033,7 @@ static strbuf *term_input_data_from_charset(
     strbuf *buf;
 
     if (codepage < 0) {
-        buf = strbuf_new();
+        buf = strbuf_new_sized(len);
         put_data(buf, str, len);
     } else {
         int widesize = len * 2;        /* allow for UTF-16 surrogates */
@@ -3284,7 +4240,10 @@ static void term_out(Terminal *term)
     int unget;
     unsigned char localbuf[256], *chars;
     size_t nchars = 0;
+    uint64_t trace_start = trace_begin();
+    size_t probe_bytes = bufchain_size(&term->inbuf);
 
+    probe1(term_out_start, probe_bytes);
     unget = -1;
 
     chars = NULL;                      /* placate compiler warnings */
@@ -3292,6 +4251,17 @@ static void term_out(Terminal *term)
         if (unget == -1) {
             if (nchars == 0) {
                 ptrlen data = bufchain_prefix(&term->inbuf);
+                size_t nprint = term_bulk_print(term, data);
+                if (nprint > 0) {
+                    /* Straight from inbuf, to avoid the 256-byte copies */
+                    if (term->logtype == LGTYP_DEBUG && term->logctx)
+                        logtraffic_data(term->logctx,
+                                        make_ptrlen(data.ptr, nprint),
+                                        LGTYP_DEBUG);
+                    bufchain_consume(&term->inbuf, nprint);
+                    continue;
+                }
+
                 if (data.len > sizeof(localbuf))
                     data.len = sizeof(localbuf);
                 memcpy(localbuf, data.ptr, data.len);
@@ -3300,16 +4270,33 @@ static void term_out(Terminal *term)
                 chars = localbuf;
                 assert(chars != NULL);
                 assert(nchars > 0);
+
+                /*
+                 * Optionally log the session traffic to a file.
+                 * Useful for debugging and possibly also useful for
+                 * actual logging.
+                 */
+                if (term->logtype == LGTYP_DEBUG && term->logctx)
+                    logtraffic_data(term->logctx, make_ptrlen(chars, nchars),
+                                    LGTYP_DEBUG);
+            }
+
+            {
+                size_t nbulk = term_bulk_print(
+                    term, make_ptrlen(chars, nchars));
+                if (nbulk == 0)
+                    nbulk = term_bulk_graphic_chars(term, chars, nchars);
+                if (nbulk == 0)
+                    nbulk = term_bulk_utf8_chars(term, chars, nchars);
+                if (nbulk > 0) {
+                    chars += nbulk;
+                    nchars -= nbulk;
+                    continue;
+                }
             }
+
             c = *chars++;
             nchars--;
-
-            /*
-             * Optionally log the session traffic to a file. Useful for
-             * debugging and possibly also useful for actual logging.
-             */
-            if (term->logtype == LGTYP_DEBUG && term->logctx)
-                logtraffic(term->logctx, (unsigned char) c, LGTYP_DEBUG);
         } else {
             c = unget;
             unget = -1;
@@ -5101,6 +6088,8 @@ static void term_out(Terminal *term)
     term_print_flush(term);
     if (term->logflush && term->logctx)
         logflush(term->logctx);
+    probe1(term_out_done, probe_bytes);
+    trace_end("term_out", (uintptr_t)term, trace_start);
 }
 
 /*
@@ -5211,9 +6200,10 @@ static void term_bidi_cache_store(Terminal *term, int line, termchar *lbefore,
 /*
  * Prepare the bidi information for a screen line. Returns the
  * transformed list of termchars, or NULL if no transformation at
- * all took place (because bidi is disabled). If return was
- * non-NULL, auxiliary information such as the forward and reverse
- * mappings of permutation position are available in
+ * all took place (because bidi is disabled, or the line contains
+ * nothing it would affect). If return was non-NULL, auxiliary
+ * information such as the forward and reverse mappings of
+ * permutation position are available in
  * term->post_bidi_cache[scr_y].*.
  */
 static termchar *term_bidi_line(Terminal *term, struct termline *ldata,
@@ -5222,8 +6212,10 @@ static termchar *term_bidi_line(Terminal *term, struct termline *ldata,
     termchar *lchars;
     int it;
 
-    /* Do Arabic shaping and bidi. */
-    if (!term->no_bidi || !term->no_arabicshaping ||
+    /* Do Arabic shaping and bidi, unless the line has nothing in it
+     * that either could change. (The trust sigil needs this path
+     * regardless.) */
+    if (((!term->no_bidi || !term->no_arabicshaping) && ldata->maybe_rtl) ||
         (ldata->trusted && term->cols > TRUST_SIGIL_WIDTH)) {
 
         if (!term_bidi_cache_hit(term, scr_y, ldata->chars, term->cols,
@@ -5369,6 +6361,38 @@ static void do_paint_draw(Terminal *term, termline *ldata, int x, int y,
     }
 }
 
+#ifdef CHECK_PAINT_DIRTY
+/*
+ * Debugging cross-check for do_paint: a row we weren't told was
+ * dirty must turn out to need no redrawing.
+ */
+static void check_paint_clean(Terminal *term, int i, termline *ldata,
+                              termchar *lchars, termchar *newline)
+{
+    termline *disp = term->disptext[i];
+    int j;
+
+    assert(disp->lattr == ldata->lattr);
+    for (j = 0; j < term->cols; j++) {
+        termchar *a = disp->chars + j, *b = lchars + j;
+
+        assert(a->chr == newline[j].chr);
+        assert((a->attr &~ DATTR_MASK) == newline[j].attr);
+        assert(truecolour_equal(a->truecolour, newline[j].truecolour));
+        while (a->cc_next || b->cc_next) {
+            assert(a->cc_next && b->cc_next);
+            a += a->cc_next;
+            b += b->cc_next;
+            assert(a->chr == b->chr);
+        }
+
+        /* The right-hand half of a wide character isn't compared */
+        if (newline[j].attr & ATTR_WIDE)
+            j++;
+    }
+}
+#endif
+
 /*
  * Given a context, update the window.
  */
@@ -5380,6 +6404,11 @@ static void do_paint(Terminal *term)
     wchar_t *ch;
     size_t chlen;
     termchar *newline;
+    struct term_paint_state ps;
+
+    /* Whatever scrolls haven't been passed on yet, this brings
+     * disptext up to date with them the slow way */
+    term->ndispscrolls = 0;
 
     chlen = 1024;
     ch = snewn(chlen, wchar_t);
@@ -5388,6 +6417,31 @@ static void do_paint(Terminal *term)
 
     rv = (!term->rvideo ^ !term->in_vbell ? ATTR_REVERSE : 0);
 
+    /*
+     * Rows whose terminal lines haven't changed only need looking at
+     * if something has changed that affects how every row is drawn.
+     */
+    memset(&ps, 0, sizeof(ps));
+    ps.disptop = term->disptop;
+    ps.rv = rv;
+    ps.selstate = term->selstate;
+    if (ps.selstate != NO_SELECTION) {
+        ps.seltype = term->seltype;
+        ps.selstart = term->selstart;
+        ps.selend = term->selend;
+    }
+    ps.ansi_colour = term->ansi_colour;
+    ps.xterm_256_colour = term->xterm_256_colour;
+    ps.true_colour = term->true_colour;
+    ps.blink_is_real = term->blink_is_real;
+    ps.tblinker = term->tblinker;
+    ps.has_focus = term->has_focus;
+    ps.ucsdata = term->ucsdata;
+    if (memcmp(&ps, &term->paintstate, sizeof(ps))) {
+        term->paintstate = ps;
+        term->paint_all = true;
+    }
+
     /* Depends on:
      * screen array, disptop, scrtop,
      * selection, rv,
@@ -5453,11 +6507,16 @@ static void do_paint(Terminal *term)
         if (term->dispcursx < term->cols-1 && dispcurs[1].chr == UCSWIDE)
             dispcurs[1].attr |= ATTR_INVALID;
         dispcurs->attr |= ATTR_INVALID;
+        term->disptext[term->dispcursy]->dirty = true;
 
         term->curstype = 0;
     }
     term->dispcursx = term->dispcursy = -1;
 
+    /* The cursor row is always redone, to put the cursor back on it. */
+    if (our_curs_y >= 0 && our_curs_y < term->rows)
+        term->disptext[our_curs_y]->dirty = true;
+
     /* The normal screen data */
     for (i = 0; i < term->rows; i++) {
         termline *ldata;
@@ -5471,6 +6530,13 @@ static void do_paint(Terminal *term)
         bool dirtyrect;
         int *backward;
         truecolour tc;
+        bool dirty = term->paint_all || term->disptext[i]->dirty;
+
+#ifndef CHECK_PAINT_DIRTY
+        if (!dirty)
+            continue;
+#endif
+        term->disptext[i]->dirty = false;
 
         scrpos.y = i + term->disptop;
         ldata = lineptr(scrpos.y);
@@ -5579,6 +6645,11 @@ static void do_paint(Terminal *term)
             newline[j].cc_next = 0;
         }
 
+#ifdef CHECK_PAINT_DIRTY
+        if (!dirty)
+            check_paint_clean(term, i, ldata, lchars, newline);
+#endif
+
         /*
          * Now loop over the line again, noting where things have
          * changed.
@@ -5775,6 +6846,7 @@ static void do_paint(Terminal *term)
 
         unlineptr(ldata);
     }
+    term->paint_all = false;
 
     sfree(newline);
     sfree(ch);
@@ -5790,6 +6862,7 @@ void term_invalidate(Terminal *term)
     for (i = 0; i < term->rows; i++)
         for (j = 0; j < term->cols; j++)
             term->disptext[i]->chars[j].attr |= ATTR_INVALID;
+    term->paint_all = true;
 
     term_schedule_update(term);
 }
@@ -5807,6 +6880,7 @@ void term_paint(Terminal *term,
     if (bottom >= term->rows) bottom = term->rows-1;
 
     for (i = top; i <= bottom && i < term->rows; i++) {
+        term->disptext[i]->dirty = true;
         if ((term->disptext[i]->lattr & LATTR_MODE) == LATTR_NORM)
             for (j = left; j <= right && j < term->cols; j++)
                 term->disptext[i]->chars[j].attr |= ATTR_INVALID;
@@ -5867,6 +6941,125 @@ void term_scroll_to_selection(Terminal *term, int which_end)
     term_scroll(term, -1, y);
 }
 
+/*
+ * Search the screen and scrollback for a piece of text. We look
+ * backwards (or forwards) from the start of the current selection,
+ * or from the bottom (or top) of the scrollback if there isn't one,
+ * and select and scroll to the first match we find. If
+ * include_current is true, a match starting exactly where the
+ * selection does counts too, which is what's wanted when the search
+ * text has just been extended by typing.
+ *
+ * Matching ignores ASCII case and combining characters, and doesn't
+ * find text that's split across two lines. Returns false, leaving
+ * the selection alone, if there's no match.
+ */
+bool term_find(Terminal *term, const wchar_t *text, bool backwards,
+               bool include_current)
+{
+    size_t nneedle = wcslen(text), nhashes, i;
+    unsigned long *needle, *keys = NULL;
+    uint32_t *hashes;
+    int *cols = NULL;
+    size_t keysize = 0, colsize = 0;
+    int top = -sblines(term), bottom = term->rows - 1, altlines = 0, y;
+    pos start, mstart, mend;
+    bool found = false;
+
+    if (nneedle == 0)
+        return false;
+
+    needle = snewn(nneedle, unsigned long);
+    for (i = 0; i < nneedle; i++)
+        needle[i] = term_search_key(text[i]);
+    nhashes = nneedle >= 3 ? nneedle - 2 : 0;
+    hashes = snewn(nhashes + 1, uint32_t);
+    for (i = 0; i < nhashes; i++)
+        hashes[i] = sb_bloom_hash(needle + i);
+
+    if (term->erase_to_scrollback && term->alt_which && term->alt_screen)
+        altlines = term->alt_sblines;
+
+    if (term->selstate == SELECTED) {
+        start = term->selstart;
+    } else if (backwards) {
+        start.y = bottom;
+        start.x = INT_MAX;
+    } else {
+        start.y = top;
+        start.x = -1;
+    }
+
+    for (y = start.y; !found && (backwards ? y >= top : y <= bottom);
+         y += (backwards ? -1 : +1)) {
+        int index = y + altlines + sb_count(term);
+
+        if (nhashes && y < -altlines && index < term->sbcompressed) {
+            int lineno;
+            sbchunk *ck = sb_find_chunk(term, index, &lineno);
+
+            for (i = 0; i < nhashes; i++)
+                if (!sb_bloom_test(ck->bloom, hashes[i]))
+                    break;
+            if (i < nhashes) {
+                /* No match anywhere in this chunk, so skip to its
+                 * last line in the direction we're going. */
+                if (backwards)
+                    y -= lineno - ck->start;
+                else
+                    y += ck->nlines - 1 - lineno;
+                continue;
+            }
+        }
+
+        termline *ldata = lineptr(y);
+        sgrowarray(keys, keysize, ldata->cols);
+        sgrowarray(cols, colsize, ldata->cols);
+        int n = term_line_search_keys(ldata, keys, cols);
+
+        for (int k = 0; k + (int)nneedle <= n; k++) {
+            if (y == start.y &&
+                !(backwards ? cols[k] < start.x : cols[k] > start.x) &&
+                !(include_current && cols[k] == start.x))
+                continue;
+            if (memcmp(keys + k, needle, nneedle * sizeof(*needle)))
+                continue;
+
+            int endx = cols[k + nneedle - 1] + 1;
+            if (endx < ldata->cols && ldata->chars[endx].chr == UCSWIDE)
+                endx++;
+            if (endx > term->cols)
+                break;                 /* off the edge of the display */
+
+            mstart.x = cols[k];
+            mend.x = endx;
+            mstart.y = mend.y = y;
+            found = true;
+            if (!backwards)
+                break;                 /* otherwise, keep looking for the
+                                        * last match on the line */
+        }
+
+        unlineptr(ldata);
+    }
+
+    sfree(needle);
+    sfree(hashes);
+    sfree(keys);
+    sfree(cols);
+
+    if (!found)
+        return false;
+
+    term->selstate = SELECTED;
+    term->seltype = LEXICOGRAPHIC;
+    term->selmode = SM_CHAR;
+    term->selstart = term->selanchor = mstart;
+    term->selend = mend;
+    term_scroll_to_selection(term, 0);
+    return true;
+}
+
 /*
  * Helper routine for clipme(): growing buffer.
  */
@@ -5886,14 +7079,18 @@ static void clip_addchar(clip_workbuf *b, wchar_t chr, int attr, truecolour tc)
     if (b->bufpos >= b->bufsize) {
         sgrowarray(b->textbuf, b->bufsize, b->bufpos);
         b->textptr = b->textbuf + b->bufpos;
-        b->attrbuf = sresize(b->attrbuf, b->bufsize, int);
-        b->attrptr = b->attrbuf + b->bufpos;
-        b->tcbuf = sresize(b->tcbuf, b->bufsize, truecolour);
-        b->tcptr = b->tcbuf + b->bufpos;
+        if (b->attrbuf) {
+            b->attrbuf = sresize(b->attrbuf, b->bufsize, int);
+            b->attrptr = b->attrbuf + b->bufpos;
+            b->tcbuf = sresize(b->tcbuf, b->bufsize, truecolour);
+            b->tcptr = b->tcbuf + b->bufpos;
+        }
     }
     *b->textptr++ = chr;
-    *b->attrptr++ = attr;
-    *b->tcptr++ = tc;
+    if (b->attrbuf) {
+        *b->attrptr++ = attr;
+        *b->tcptr++ = tc;
+    }
     b->bufpos++;
 }
 
@@ -5908,8 +7105,20 @@ static void clipme(Terminal *term, pos top, pos bottom, bool rect, bool desel,
     buf.bufsize = 5120;
     buf.bufpos = 0;
     buf.textptr = buf.textbuf = snewn(buf.bufsize, wchar_t);
-    buf.attrptr = buf.attrbuf = snewn(buf.bufsize, int);
-    buf.tcptr = buf.tcbuf = snewn(buf.bufsize, truecolour);
+
+    /*
+     * The attributes and colours are only wanted by a front end
+     * that's going to produce RTF from them. Otherwise, leave them
+     * out: for a big selection (say, the whole of a long
+     * scrollback) they're most of the memory we'd allocate here.
+     */
+    if (term->rtf_paste) {
+        buf.attrptr = buf.attrbuf = snewn(buf.bufsize, int);
+        buf.tcptr = buf.tcbuf = snewn(buf.bufsize, truecolour);
+    } else {
+        buf.attrptr = buf.attrbuf = NULL;
+        buf.tcptr = buf.tcbuf = NULL;
+    }
 
     old_top_x = top.x;                 /* needed for rect==1 */
 
@@ -6099,7 +7308,7 @@ void term_copyall(Terminal *term, const int *clipboards, int n_clipboards)
 {
     pos top;
     pos bottom;
-    tree234 *screen = term->screen;
+    termscreen *screen = term->screen;
     top.y = -sblines(term);
     top.x = 0;
     bottom.y = find_last_nonempty_line(term, screen);
@@ -6382,38 +7591,6 @@ static void sel_spread(Terminal *term)
     }
 }
 
-static void term_paste_callback(void *vterm)
-{
-    Terminal *term = (Terminal *)vterm;
-
-    if (term->paste_len == 0)
-        return;
-
-    while (term->paste_pos < term->paste_len) {
-        int n = 0;
-        while (n + term->paste_pos < term->paste_len) {
-            if (term->paste_buffer[term->paste_pos + n++] == '\015')
-                break;
-        }
-        if (term->ldisc) {
-            strbuf *buf = term_input_data_from_unicode(
-                term, term->paste_buffer + term->paste_pos, n);
-            term_keyinput_internal(term, buf->s, buf->len, false);
-            strbuf_free(buf);
-        }
-        term->paste_pos += n;
-
-        if (term->paste_pos < term->paste_len) {
-            queue_toplevel_callback(term_paste_callback, term);
-            return;
-        }
-    }
-    term_bracketed_paste_stop(term);
-    sfree(term->paste_buffer);
-    term->paste_buffer = NULL;
-    term->paste_len = 0;
-}
-
 /*
  * Specialist string compare function. Returns true if the buffer of
  * alen wide characters starting at a has as a prefix the buffer of
@@ -6425,34 +7602,26 @@ static bool wstartswith(const wchar_t *a, size_t alen,
     return alen >= blen && !wcsncmp(a, b, blen);
 }
 
-void term_do_paste(Terminal *term, const wchar_t *data, int len)
+/*
+ * Take up to 'max' characters of the pending paste out of
+ * term->paste_buffer, normalising newlines and dropping any control
+ * characters we aren't willing to send, and put them in 'out'.
+ * Returns the number of characters written, which can be zero even
+ * if some input was consumed.
+ */
+static size_t term_paste_filter(Terminal *term, wchar_t *out, size_t max)
 {
-    const wchar_t *p;
+    const wchar_t *data = term->paste_buffer;
+    const wchar_t *end = data + term->paste_len;
+    const wchar_t *p = data + term->paste_pos;
     bool paste_controls = conf_get_bool(term->conf, CONF_paste_controls);
+    size_t n = 0;
 
-    /*
-     * Pasting data into the terminal counts as a keyboard event (for
-     * purposes of the 'Reset scrollback on keypress' config option),
-     * unless the paste is zero-length.
-     */
-    if (len == 0)
-        return;
-    term_seen_key_event(term);
-
-    if (term->paste_buffer)
-        sfree(term->paste_buffer);
-    term->paste_pos = term->paste_len = 0;
-    term->paste_buffer = snewn(len + 12, wchar_t);
-
-    if (term->bracketed_paste)
-        term_bracketed_paste_start(term);
-
-    p = data;
-    while (p < data + len) {
+    while (p < end && n < max) {
         wchar_t wc = *p++;
 
         if (wc == sel_nl[0] &&
-            wstartswith(p-1, data+len-(p-1), sel_nl, sel_nl_sz)) {
+            wstartswith(p-1, end-(p-1), sel_nl, sel_nl_sz)) {
             /*
              * This is the (platform-dependent) sequence that the host
              * OS uses to represent newlines in clipboard data.
@@ -6481,8 +7650,8 @@ void term_do_paste(Terminal *term, const wchar_t *data, int len)
                     continue;
             }
 
-            if (wc == '\033' && term->bracketed_paste &&
-                wstartswith(p-1, data+len-(p-1), L"\033[201~", 6)) {
+            if (wc == '\033' && term->bracketed_paste_active &&
+                wstartswith(p-1, end-(p-1), L"\033[201~", 6)) {
                 /*
                  * Also, in bracketed-paste mode, reject the ESC
                  * character that begins the end-of-paste sequence.
@@ -6491,25 +7660,118 @@ void term_do_paste(Terminal *term, const wchar_t *data, int len)
             }
         }
 
-        term->paste_buffer[term->paste_len++] = wc;
+        out[n++] = wc;
     }
 
-    /* Assume a small paste will be OK in one go. */
-    if (term->paste_len < 256) {
-        if (term->ldisc) {
-            strbuf *buf = term_input_data_from_unicode(
-                term, term->paste_buffer, term->paste_len);
+    term->paste_pos = p - data;
+    return n;
+}
+
+static void term_paste_finish(Terminal *term)
+{
+    term_bracketed_paste_stop(term);
+    sfree(term->paste_buffer);
+    term->paste_buffer = NULL;
+    term->paste_pos = term->paste_len = 0;
+    term->paste_waiting = false;
+}
+
+static void term_paste_callback(void *vterm);
+static void term_paste_timer(void *vterm, unsigned long now);
+
+/*
+ * Send as much of a pending paste as the backend will take right
+ * now. We stop when the backend's send buffer fills up, and poll on
+ * a timer until it has drained, so that a huge paste goes out as
+ * fast as the other end can absorb it without all piling up in
+ * memory. We also stop after a burst of data, so that a fast
+ * connection doesn't lock up the rest of the event loop until the
+ * whole paste is done.
+ */
+static void term_paste_pump(Terminal *term)
+{
+    wchar_t chunk[PASTE_CHUNK];
+    size_t sent = 0;
+
+    while (term->paste_pos < term->paste_len) {
+        size_t n;
+
+        if (sent >= PASTE_BURST) {
+            if (!term->paste_callback_pending) {
+                term->paste_callback_pending = true;
+                queue_toplevel_callback(term_paste_callback, term);
+            }
+            return;
+        }
+
+        if (term->backend &&
+            backend_sendbuffer(term->backend) > PASTE_MAX_BACKLOG) {
+            term->paste_waiting = true;
+            term->paste_retry_time = schedule_timer(
+                PASTE_RETRY_DELAY, term_paste_timer, term);
+            return;
+        }
+
+        n = term_paste_filter(term, chunk, lenof(chunk));
+        if (n && term->ldisc) {
+            strbuf *buf = term_input_data_from_unicode(term, chunk, n);
             term_keyinput_internal(term, buf->s, buf->len, false);
+            sent += buf->len;
             strbuf_free(buf);
         }
-        if (term->paste_buffer)
-            sfree(term->paste_buffer);
-        term_bracketed_paste_stop(term);
-        term->paste_buffer = NULL;
-        term->paste_pos = term->paste_len = 0;
     }
 
-    queue_toplevel_callback(term_paste_callback, term);
+    term_paste_finish(term);
+}
+
+static void term_paste_callback(void *vterm)
+{
+    Terminal *term = (Terminal *)vterm;
+
+    term->paste_callback_pending = false;
+    if (term->paste_len && !term->paste_waiting)
+        term_paste_pump(term);
+}
+
+static void term_paste_timer(void *vterm, unsigned long now)
+{
+    Terminal *term = (Terminal *)vterm;
+
+    if (term->paste_waiting && now == term->paste_retry_time) {
+        term->paste_waiting = false;
+        term_paste_pump(term);
+    }
+}
+
+void term_do_paste(Terminal *term, const wchar_t *data, int len)
+{
+    /*
+     * Pasting data into the terminal counts as a keyboard event (for
+     * purposes of the 'Reset scrollback on keypress' config option),
+     * unless the paste is zero-length.
+     */
+    if (len == 0)
+        return;
+    term_seen_key_event(term);
+
+    /*
+     * Keep our own copy of the raw clipboard data, and filter and
+     * translate it a chunk at a time as it's sent, rather than
+     * converting the whole thing up front.
+     */
+    if (term->paste_len)
+        term_paste_finish(term);       /* abandon any previous paste */
+    term->paste_buffer = snewn(len, wchar_t);
+    memcpy(term->paste_buffer, data, len * sizeof(wchar_t));
+    term->paste_pos = 0;
+    term->paste_len = len;
+    term->paste_waiting = false;
+
+    if (term->bracketed_paste)
+        term_bracketed_paste_start(term);
+
+    /* Small pastes will normally go in one go, right now */
+    term_paste_pump(term);
 }
 
 void term_mouse(Terminal *term, Mouse_Button braw, Mouse_Button bcooked,
@@ -7062,10 +8324,7 @@ void term_nopaste(Terminal *term)
 {
     if (term->paste_len == 0)
         return;
-    sfree(term->paste_buffer);
-    term_bracketed_paste_stop(term);
-    term->paste_buffer = NULL;
-    term->paste_len = 0;
+    term_paste_finish(term);
 }
 
 static void deselect(Terminal *term)
@@ -7111,8 +8370,21 @@ static void term_added_data(Terminal *term)
 size_t term_data(Terminal *term, bool is_stderr, const void *data, size_t len)
 {
     bufchain_add(&term->inbuf, data, len);
+    term->update_bytes += len;
     term_added_data(term);
 
+    /*
+     * A little output soon after a keypress is probably its echo, so
+     * paint it now instead of waiting for the update timer, unless
+     * we're already painting as often as we would anyway.
+     */
+    if (term->echo_pending && term->window_update_pending &&
+        !term->in_term_out && len <= UPDATE_ECHO_MAX &&
+        GETTICKCOUNT() - term->last_update >= UPDATE_DELAY) {
+        term->echo_pending = false;
+        term_update(term);
+    }
+
     /*
      * term_out() always completely empties inbuf. Therefore,
      * there's no reason at all to return anything other than zero
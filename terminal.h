@@ -16,6 +16,11 @@ struct beeptime {
     unsigned long ticks;
 };
 
+/* A scroll of the display not yet passed on to the front end */
+struct dispscroll {
+    int topline, botline, lines;
+};
+
 #define TRUST_SIGIL_WIDTH 3
 #define TRUST_SIGIL_CHAR 0xDFFE
 
@@ -31,9 +36,15 @@ struct termchar {
      * Any code in terminal.c which definitely needs to be changed
      * when extra fields are added here is labelled with a comment
      * saying FULL-TERMCHAR.
+     *
+     * Every character and attribute value fits in 32 bits (the
+     * scrollback compression in terminal.c relies on that too), so
+     * they're stored that way to keep each cell to 20 bytes rather
+     * than 32 on LP64: do_paint and the scrolling code walk through
+     * a lot of these.
      */
-    unsigned long chr;
-    unsigned long attr;
+    uint32_t chr;
+    uint32_t attr;
     truecolour truecolour;
 
     /*
@@ -56,11 +67,41 @@ struct termline {
     int size;                          /* number of allocated termchars
                                         * (cc-lists may make this > cols) */
     bool temporary;                    /* true if decompressed from scrollback */
+    bool dirty;                        /* in disptext: row may need repaint */
     int cc_free;                       /* offset to first cc in free list */
     struct termchar *chars;
     bool trusted;
+    bool maybe_rtl;                    /* might need bidi or shaping; see
+                                        * termline_note_chr */
+};
+
+/*
+ * The parts of the terminal state, other than the lines themselves,
+ * that affect what every row of the display looks like. do_paint
+ * keeps a copy of these as they were at the last update, and
+ * re-examines every row if any of them has changed.
+ */
+struct term_paint_state {
+    int disptop;
+    unsigned long rv;
+    int selstate, seltype;
+    pos selstart, selend;
+    bool ansi_colour, xterm_256_colour, true_colour;
+    bool blink_is_real, tblinker, has_focus;
+    struct unicode_data *ucsdata;
 };
 
+/*
+ * The lines of the main or alternate screen, as a circular array:
+ * row y of the screen is lines[(start + y) % nlines]. Scrolling the
+ * whole screen only has to move 'start'.
+ */
+typedef struct termscreen {
+    termline **lines;
+    int nlines, start;
+    size_t size;
+} termscreen;
+
 struct bidi_cache_entry {
     int width;
     bool trusted;
@@ -78,17 +119,49 @@ struct terminal_tag {
 
     int compatibility_level;
 
-    tree234 *scrollback;               /* lines scrolled off top of screen */
-    tree234 *screen;                   /* lines on primary screen */
-    tree234 *alt_screen;               /* lines on alternate screen */
+    tree234 *scrollback;               /* recent lines scrolled off top of
+                                          screen, not yet compressed */
+    termscreen *screen;                /* lines on primary screen */
+    termscreen *alt_screen;            /* lines on alternate screen */
     int disptop;                       /* distance scrolled back (0 or -ve) */
-    int tempsblines;                   /* number of lines of .scrollback that
+    int tempsblines;                   /* number of lines of scrollback that
                                           can be retrieved onto the terminal
                                           ("temporary scrollback") */
 
+    /*
+     * Older scrollback lines, compressed and packed into large
+     * chunks. These logically precede the ones in .scrollback,
+     * which are still termlines awaiting compression.
+     */
+    struct sbchunk **sbchunks;
+    size_t nsbchunks, sbchunksize;
+    int sbcompressed;                  /* number of lines in sbchunks */
+
+    /*
+     * Chunks of compressed scrollback moved out to a temporary file
+     * (see sb_spill_chunks in terminal.c).
+     */
+    size_t sbmembytes;                 /* chunk data kept in memory */
+    size_t nsbspilled;                 /* chunks at the start of sbchunks
+                                          whose data is in sbfile */
+    struct sbchunk *sbcache[4];        /* spilled chunks read back in, most
+                                          recently used first */
+    TempFile *sbfile;
+    bool sbfile_failed;
+    uint64_t sbfilelen;
+    uint64_t *sbfreeslots;             /* reusable offsets in sbfile */
+    size_t nsbfreeslots, sbfreeslotsize;
+
+    termline *spare_lines[64];         /* finished with, for scroll() to reuse */
+    int nspare_lines;
+
     termline **disptext;               /* buffer of text on real screen */
     int dispcursx, dispcursy;          /* location of cursor on real screen */
     int curstype;                      /* type of cursor on real screen */
+    struct term_paint_state paintstate;
+    bool paint_all;                    /* every row of disptext is dirty */
+    struct dispscroll *dispscrolls;    /* scrolls since the last update */
+    size_t ndispscrolls, dispscrollsize;
 
 #define VBELL_TIMEOUT (TICKSPERSEC/10) /* visual bell lasts 1/10 sec */
 
@@ -223,8 +296,11 @@ struct terminal_tag {
     /* Mask of attributes to pay attention to when painting. */
     int attr_mask;
 
-    wchar_t *paste_buffer;
-    int paste_len, paste_pos;
+    wchar_t *paste_buffer;             /* raw data still to be pasted */
+    size_t paste_len, paste_pos;
+    bool paste_waiting;                /* for the backend to catch up */
+    bool paste_callback_pending;
+    unsigned long paste_retry_time;
 
     Backend *backend;
 
@@ -264,6 +340,24 @@ struct terminal_tag {
     bool window_update_pending;
     long next_update;
 
+    /*
+     * The delay before an update stretches, up to UPDATE_DELAY_MAX,
+     * while output is arriving faster than anyone could read it, and
+     * drops back to UPDATE_DELAY once it isn't. Small amounts of
+     * output just after a keypress are painted straight away.
+     */
+    long update_delay;
+    unsigned long last_update;
+    size_t update_bytes;               /* output received since last_update */
+    bool echo_pending;                 /* key event not yet followed by output */
+
+    /*
+     * Lines scrolled into the scrollback are compressed in batches,
+     * after a short delay. This tracks whether that's pending.
+     */
+    bool sbcompress_pending;
+    long next_sbcompress;
+
     /*
      * Track pending blinks and tblinks.
      */
@@ -326,11 +420,13 @@ struct terminal_tag {
     bool no_remote_wintitle;
     bool no_remote_clearscroll;
     bool rawcnp;
+    bool rtf_paste;
     bool utf8linedraw;
     bool rect_select;
     int remote_qtitle_action;
     bool rxvt_homeend;
     bool scroll_on_disp;
+    bool scrollback_on_disk;
     bool scroll_on_key;
     bool xterm_256_colour;
     bool true_colour;
@@ -481,6 +481,10 @@ class mpint(MyTestBase):
                 inv = int(mp_invert(x, m))
                 assert x * inv % m == 1
 
+                # And mp_invert_vartime, which needs m odd
+                if m & 1:
+                    self.assertEqual(int(mp_invert_vartime(x, m)), inv)
+
                 # Test monty_invert too, while we're here
                 if mc is not None:
                     self.assertEqual(
@@ -590,16 +594,21 @@ class mpint(MyTestBase):
                 # we've got the machinery available
                 for index, power in zip(indices, powers):
                     self.assertEqual(int(mp_modpow(a, index, m)), power)
+                    self.assertEqual(int(mp_modpow_vartime(a, index, m)),
+                                     power)
 
         # A regression test for a bug I encountered during initial
         # development of mpint.c, in which an incomplete reduction
         # happened somewhere in an intermediate value.
         b, e, m = 0x2B5B93812F253FF91F56B3B4DAD01CA2884B6A80719B0DA4E2159A230C6009EDA97C5C8FD4636B324F9594706EE3AD444831571BA5E17B1B2DFA92DEA8B7E, 0x25, 0xC8FCFD0FD7371F4FE8D0150EFC124E220581569587CCD8E50423FA8D41E0B2A0127E100E92501E5EE3228D12EA422A568C17E0AD2E5C5FCC2AE9159D2B7FB8CB
         assert(int(mp_modpow(b, e, m)) == pow(b, e, m))
+        assert(int(mp_modpow_vartime(b, e, m)) == pow(b, e, m))
 
         # Make sure mp_modpow can handle a base larger than the
         # modulus, by pre-reducing it
         assert(int(mp_modpow(1<<877, 907, 999979)) == pow(2, 877*907, 999979))
+        assert(int(mp_modpow_vartime(1<<877, 907, 999979)) ==
+               pow(2, 877*907, 999979))
 
     def testModsqrt(self):
         moduli = [
@@ -888,6 +897,17 @@ class ecc(MyTestBase):
             self.assertEqual(int(x), int(rGi.x))
             self.assertEqual(int(y), int(rGi.y))
 
+        # The variable-time a*P + b*Q, with a different P and Q
+        wH = ecc_weierstrass_multiply(wG, 12345)
+        rH = p256.G * 12345
+        for i in sorted(ints):
+            j = (i * 31337 + 17) % p256.G_order
+            wS = ecc_weierstrass_multiply_sum_vartime(wG, i, wH, j)
+            x, y = ecc_weierstrass_get_affine(wS)
+            rS = p256.G * i + rH * j
+            self.assertEqual(int(x), int(rS.x))
+            self.assertEqual(int(y), int(rS.y))
+
     def testMontgomeryMultiply(self):
         mc = ecc_montgomery_curve(
             curve25519.p, int(curve25519.a), int(curve25519.b))
@@ -914,6 +934,17 @@ class ecc(MyTestBase):
             self.assertEqual(int(x), int(rGi.x))
             self.assertEqual(int(y), int(rGi.y))
 
+        # The variable-time a*P + b*Q, with Q negated
+        eH = ecc_edwards_negate(ecc_edwards_multiply(eG, 12345))
+        rH = ed25519.G * -12345
+        for i in sorted(ints):
+            j = (i * 31337 + 17) % ed25519.G_order
+            eS = ecc_edwards_multiply_sum_vartime(eG, i, eH, j)
+            x, y = ecc_edwards_get_affine(eS)
+            rS = ed25519.G * i + rH * j
+            self.assertEqual(int(x), int(rS.x))
+            self.assertEqual(int(y), int(rS.y))
+
 class keygen(MyTestBase):
     def testPrimeCandidateSource(self):
         def inspect(pcs):
@@ -1275,8 +1306,8 @@ class crypt(MyTestBase):
                     test(keylen, suffix, ivInteger)
 
     def testAESParallelism(self):
-        # Since at least one of our implementations of AES works in
-        # parallel, here's a test that CBC decryption works the same
+        # Since some of our implementations of AES work in parallel,
+        # here's a test that CBC decryption and SDCTR work the same
         # way no matter how the input data is divided up.
 
         # A pile of conveniently available random-looking test data.
@@ -1305,6 +1336,106 @@ class crypt(MyTestBase):
             for d in decryptions:
                 self.assertEqualBin(d, decryptions[0])
 
+        # Similarly for SDCTR, starting from an IV whose low 64 bits
+        # are about to wrap, so that the carry happens part way
+        # through a batch of blocks processed together.
+        sdctr_iv = b"FOOBARBA" + b"\xff" * 7 + b"\xfe"
+        for keylen in [128, 192, 256]:
+            encryptions = []
+
+            for suffix in "hw", "sw":
+                c = ssh_cipher_new("aes{:d}_ctr_{}".format(keylen, suffix))
+                if c is None: continue
+                ssh_cipher_setkey(c, test_key[:keylen//8])
+                for chunklen in range(16, 16*12, 16):
+                    ssh_cipher_setiv(c, sdctr_iv)
+                    encryption = b""
+                    for pos in range(0, len(test_ciphertext), chunklen):
+                        chunk = test_ciphertext[pos:pos+chunklen]
+                        encryption += ssh_cipher_encrypt(c, chunk)
+                    encryptions.append(encryption)
+
+            for e in encryptions:
+                self.assertEqualBin(e, encryptions[0])
+
+    def testAESGCM(self):
+        # Encrypt and authenticate two consecutive SSH packets with
+        # AES-GCM, checking the ciphertext and tag of each against
+        # an independent implementation, and that the second packet
+        # uses the nonce incremented as RFC 5647 requires.
+        p = b'64 bytes of test input data, enough to check any cipher mode xyz'
+        k = b'sixty-four bytes of test key data, enough to key any cipher pqrs'
+        iv = b'12 bytes IV!' + b'xtra' # GCM only uses the first 12 bytes
+        aad = b'\0\0\0\x40' # the packet length field, sent in clear
+
+        vectors = [
+            (128, [('7a0bfb09095ccbc5ac1d15847dee9146221533c391823278b8381b8a0f811c265a1bcef17d60ce4b48fd2f97c61795d2fd47dc5c841a19db01ef1d068cfb8d98', '8c43ed274b385305eaa934ad6a0a024e'),
+                   ('e9006c5eaf54144f47421a218f86dceb418d1193036de9af04335061b6071338f1b030955cd1dcbfb52cbb8776903400488893177712353adc5843aff8aec041', 'b1781eaac0b8b0aff77c4e86f57d0075')]),
+            (256, [('2edf5e494f08671359a4f70785f05897056b34c1845cfcc6852aa3c4e685b3d43d99c44ff326261f7df79dcef62dade2a8ca3b513479c96f02d9c1bac08ff89d', 'e7e77efa23ade6ebfd19bdaf14ee9625'),
+                   ('41520662038448ede2fd8afa5b35262a1b249e1ef2e7fed183fc74088b4cc01d8907fc7df45a75542eeb60d24ea4f327adc25aee4b07e3f2552589f3380eac88', '3c5b21b5f3531ba2f4118d9b69d4fa22')]),
+        ]
+
+        for keylen, packets in vectors:
+            for suffix in "hw", "sw":
+                c = ssh_cipher_new("aes{:d}_gcm_{}".format(keylen, suffix))
+                if c is None: continue # skip if HW GHASH not available
+                ssh_cipher_setkey(c, k[:keylen//8])
+                ssh_cipher_setiv(c, iv)
+                m = ssh2_mac_new("aesgcm", c)
+                for seq, (ct, tag) in enumerate(packets):
+                    ssh2_mac_start(m)
+                    ciphertext = ssh_cipher_encrypt(c, p)
+                    self.assertEqualBin(ciphertext, unhex(ct))
+                    ssh2_mac_update(m, ssh_uint32(seq) + aad + ciphertext)
+                    self.assertEqualBin(ssh2_mac_genresult(m), unhex(tag))
+                    ssh_cipher_next_message(c)
+                del m
+                del c
+
+    def testChaCha20Poly1305(self):
+        # Encrypt and authenticate some SSH packets with
+        # ChaCha20-Poly1305, checking the encrypted length and tag
+        # against an independent implementation. The tag covers the
+        # whole ciphertext, so that checks the ciphertext too. The
+        # packets are 13 blocks long, so that the SIMD versions go
+        # through each size of batch they work in, and the last
+        # sequence number checks the nonce is formed correctly from
+        # a value with its top bit set.
+        p = b'64 bytes of test input data, enough to check any cipher mode xyz' * 13
+        k = b'sixty-four bytes of test key data, enough to key any cipher pqrs'
+
+        packets = [
+            (0, 'a4df4a18', 'a73af7154abc787c28c219cfa13276f2'),
+            (1, '500dace2', '12bb7bfbd4a16bd58784b60fb8973c79'),
+            (0xffffffff, '096edd51', '513427999343a2a7025f1fddd1fd6e01'),
+        ]
+
+        for suffix in "sw", "hw", "avx2":
+            c = ssh_cipher_new("chacha20_poly1305_" + suffix)
+            if c is None: continue # skip if SIMD version not available
+            ssh_cipher_setkey(c, k)
+            m = ssh2_mac_new("poly1305", c)
+            for seq, enclen, tag in packets:
+                length = ssh_cipher_encrypt_length(c, ssh_uint32(len(p)), seq)
+                self.assertEqualBin(length, unhex(enclen))
+                ciphertext = ssh_cipher_encrypt(c, p)
+                ssh2_mac_start(m)
+                ssh2_mac_update(m, ssh_uint32(seq) + length + ciphertext)
+                self.assertEqualBin(ssh2_mac_genresult(m), unhex(tag))
+
+                # Decrypting in pieces that don't line up with the
+                # blocks should get the plaintext back.
+                self.assertEqualBin(
+                    ssh_cipher_decrypt_length(c, length, seq),
+                    ssh_uint32(len(p)))
+                decryption = b""
+                for pos in range(0, len(ciphertext), 100):
+                    decryption += ssh_cipher_decrypt(
+                        c, ciphertext[pos:pos+100])
+                self.assertEqualBin(decryption, p)
+            del m
+            del c
+
     def testCRC32(self):
         # Check the effect of every possible single-byte input to
         # crc32_update. In the traditional implementation with a
@@ -1335,6 +1466,24 @@ class crypt(MyTestBase):
                 # we're at it!
                 self.assertEqual(shift8(i ^ prior), exp)
 
+    def testCRC32Long(self):
+        # Longer inputs may be handed to a hardware implementation
+        # that absorbs many bytes at a time, with the remainder done
+        # by the byte-by-byte code. Check every length either side of
+        # the various boundaries against binascii.crc32, which
+        # implements the same function as crc32_rfc1662.
+        data = b"".join(hashlib.sha256(struct.pack(">I", i)).digest()
+                        for i in range(40))
+        for length in range(len(data) + 1):
+            for offset in [0, 1, 7]:
+                s = data[offset:offset+length]
+                exp = binascii.crc32(s) & 0xFFFFFFFF
+                self.assertEqual(crc32_rfc1662(s), exp)
+                self.assertEqual(crc32_update(0xFFFFFFFF, s) ^ 0xFFFFFFFF,
+                                 exp)
+        self.assertEqual(crc32_ssh1(data),
+                         ~binascii.crc32(data, 0xFFFFFFFF) & 0xFFFFFFFF)
+
     def testCRCDA(self):
         def pattern(badblk, otherblks, pat):
             # Arrange copies of the bad block in a pattern
@@ -1611,6 +1760,52 @@ class crypt(MyTestBase):
             key = ssh_ecdhkex_getkey(ecdh448, unhex(pub))
             self.assertEqual(key, None)
 
+    def testCurve25519Kex(self):
+        # Test vectors from RFC 7748 section 6.1.
+        alice_priv = unhex('77076d0a7318a57d3c16c17251b26645'
+                           'df4c2f87ebc0992ab177fba51db92c2a')
+        alice_pub = unhex('8520f0098930a754748b7ddcb43ef75a'
+                          '0dbf3a0d26381af4eba4a98eaa9b4e6a')
+        bob_priv = unhex('5dab087e624a8a4b79e17f8b83800ee6'
+                         '6f3bb1292618b6fd1c2f8b27ff88e0eb')
+        bob_pub = unhex('de9edb7d7b7dc1b4d35b61c2ece43537'
+                        '3f8343c85b78674dadfc7e146f882b4f')
+        shared = unhex('4a5d9d5ba4ce2de1728e3bf480350f25'
+                       'e07e21c947d19e3376f09b3c1e161742')
+
+        for priv, pub, otherpub in [(alice_priv, alice_pub, bob_pub),
+                                    (bob_priv, bob_pub, alice_pub)]:
+            with queued_specific_random_data(priv):
+                ecdh = ssh_ecdhkex_newkey('curve25519')
+            self.assertEqualBin(ssh_ecdhkex_getpublic(ecdh), pub)
+            key = ssh_ecdhkex_getkey(ecdh, otherpub)
+            self.assertEqual(int(key), int.from_bytes(shared, 'big'))
+
+        # Cross-check some random key pairs against the reference
+        # implementation.
+        for i in range(8):
+            with queued_random_data(64, "curve25519 kex {:d}".format(i)):
+                ecdh_a = ssh_ecdhkex_newkey('curve25519')
+                ecdh_b = ssh_ecdhkex_newkey('curve25519')
+            pub_a = ssh_ecdhkex_getpublic(ecdh_a)
+            pub_b = ssh_ecdhkex_getpublic(ecdh_b)
+            a = int(ssh_ecdhkex_getkey(ecdh_a, pub_b))
+            b = int(ssh_ecdhkex_getkey(ecdh_b, pub_a))
+            self.assertEqual(a, b)
+
+            # Reconstruct the private keys from the same random data
+            rawkeys = hashlib.sha512("preimage:0:curve25519 kex {:d}"
+                                     .format(i).encode('ascii')).digest()
+            ka = int.from_bytes(rawkeys[:32], 'little')
+            kb = int.from_bytes(rawkeys[32:], 'little')
+            clamp = lambda k: (k & ((1 << 254) - 8)) | (1 << 254)
+            ka, kb = clamp(ka), clamp(kb)
+            self.assertEqual(int.from_bytes(pub_a, 'little'),
+                             int((curve25519.G * ka).x))
+            self.assertEqual(
+                a, int.from_bytes(int((curve25519.G * ka * kb).x)
+                                  .to_bytes(32, 'little'), 'big'))
+
     def testPRNG(self):
         hashalg = 'sha256'
         seed = b"hello, world"
@@ -1650,6 +1845,41 @@ class crypt(MyTestBase):
         self.assertEqualBin(data2, expected_data2[:127])
         self.assertEqualBin(data3, expected_data3)
 
+    def testPRNGBuffered(self):
+        hashalg = 'sha256'
+        seed = b"hello, world"
+        entropy = b'1234567890' * 100
+
+        pr = prng_new(hashalg)
+        prng_enable_buffering(pr, 100) # rounds up to 4 hash blocks
+        prng_seed_begin(pr)
+        prng_seed_update(pr, seed)
+        prng_seed_finish(pr)
+        data1 = prng_read(pr, 40)
+        data2 = prng_read(pr, 100) # runs off the end of the buffer
+        prng_add_entropy(pr, 0, entropy) # forces a reseed
+        data3 = prng_read(pr, 20)
+
+        def block(key, counters):
+            return b''.join(hash_str(hashalg, key + b'G' + ssh2_mpint(c))
+                            for c in counters)
+
+        # The buffer is filled in one go, and the generator rekeyed
+        # immediately afterwards, but not again until it runs out.
+        key1 = hash_str(hashalg, b'R' + seed)
+        buf1 = block(key1, range(4))
+        key2 = hash_str(hashalg, key1 + b'R')
+        buf2 = block(key2, range(4,8))
+        key3 = hash_str(hashalg, key2 + b'R')
+        # The reseed throws away the rest of buf2, so that data3 is
+        # generated from the new key.
+        key4 = hash_str(hashalg, key3 + b'R' + hash_str(hashalg, entropy))
+        buf3 = block(key4, range(8,12))
+
+        self.assertEqualBin(data1, buf1[:40])
+        self.assertEqualBin(data2, buf1[40:] + buf2[:12])
+        self.assertEqualBin(data3, buf3[:20])
+
     def testHashPadding(self):
         # A consistency test for hashes that use MD5/SHA-1/SHA-2 style
         # padding of the message into a whole number of fixed-size
@@ -2170,6 +2400,42 @@ class standard_test_vectors(MyTestBase):
             key, plaintext, ciphertext = test.split(":")
             vector(key, plaintext, ciphertext)
 
+    def testDESBitsliced(self):
+        # CBC decryption and SDCTR in the DES family switch to
+        # processing many blocks at once when given enough data.
+        # Check that gives the same answers as doing one block at a
+        # time, for lengths either side of the batch sizes.
+        key = b'twenty-four bytes of key'
+        iv = b'eight iv'
+        data = b''.join(struct.pack('>I', i * 0x9e3779b9 & 0xFFFFFFFF)
+                        for i in range(2*200))
+        for alg, keylen in [('des_cbc', 8), ('3des_ssh2', 24),
+                            ('3des_ctr', 24)]:
+            for nblocks in [1, 3, 4, 7, 8, 9, 63, 64, 65, 128, 200]:
+                p = data[:8*nblocks]
+
+                c = ssh_cipher_new(alg)
+                ssh_cipher_setkey(c, key[:keylen])
+                ssh_cipher_setiv(c, iv)
+                onebyone = b''.join(ssh_cipher_encrypt(c, p[i:i+8])
+                                    for i in range(0, len(p), 8))
+
+                ssh_cipher_setkey(c, key[:keylen])
+                ssh_cipher_setiv(c, iv)
+                self.assertEqualBin(ssh_cipher_encrypt(c, p), onebyone)
+
+                ssh_cipher_setkey(c, key[:keylen])
+                ssh_cipher_setiv(c, iv)
+                self.assertEqualBin(ssh_cipher_decrypt(c, onebyone), p)
+
+                # Check the IV or counter is left in the right state
+                # after a batch, by splitting off the last block
+                ssh_cipher_setkey(c, key[:keylen])
+                ssh_cipher_setiv(c, iv)
+                self.assertEqualBin(
+                    ssh_cipher_decrypt(c, onebyone[:-8]) +
+                    ssh_cipher_decrypt(c, onebyone[-8:]), p)
+
     def testMD5(self):
         MD5 = lambda s: hash_str('md5', s)
 
@@ -2283,80 +2549,88 @@ class standard_test_vectors(MyTestBase):
                     "8ad3361763f7e9b2d95f4f0da6e1ccbc"))
 
     def testSHA384(self):
-        # Test cases from RFC 6234 section 8.5, omitting the ones
-        # whose input is not a multiple of 8 bits
-        self.assertEqualBin(hash_str('sha384', "abc"), unhex(
-            'cb00753f45a35e8bb5a03d699ac65007272c32ab0eded163'
-            '1a8b605a43ff5bed8086072ba1e7cc2358baeca134c825a7'))
-        self.assertEqualBin(hash_str('sha384',
-            "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
-            "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu"), unhex(
-            '09330c33f71147e83d192fc782cd1b4753111b173b3b05d2'
-            '2fa08086e3b0f712fcc7c71a557e2db966c3e9fa91746039'))
-        self.assertEqualBin(hash_str_iter('sha384',
-            ("a" * 1000 for _ in range(1000))), unhex(
-            '9d0e1809716474cb086e834e310a4a1ced149e9c00f24852'
-            '7972cec5704c2a5b07b8b3dc38ecc4ebae97ddd87f3d8985'))
-        self.assertEqualBin(hash_str('sha384',
-            "01234567012345670123456701234567" * 20), unhex(
-            '2fc64a4f500ddb6828f6a3430b8dd72a368eb7f3a8322a70'
-            'bc84275b9c0b3ab00d27a5cc3c2d224aa6b61a0d79fb4596'))
-        self.assertEqualBin(hash_str('sha384', b"\xB9"), unhex(
-            'bc8089a19007c0b14195f4ecc74094fec64f01f90929282c'
-            '2fb392881578208ad466828b1c6c283d2722cf0ad1ab6938'))
-        self.assertEqualBin(hash_str('sha384',
-            unhex("a41c497779c0375ff10a7f4e08591739")), unhex(
-            'c9a68443a005812256b8ec76b00516f0dbb74fab26d66591'
-            '3f194b6ffb0e91ea9967566b58109cbc675cc208e4c823f7'))
-        self.assertEqualBin(hash_str('sha384', unhex(
-            "399669e28f6b9c6dbcbb6912ec10ffcf74790349b7dc8fbe4a8e7b3b5621db0f"
-            "3e7dc87f823264bbe40d1811c9ea2061e1c84ad10a23fac1727e7202fc3f5042"
-            "e6bf58cba8a2746e1f64f9b9ea352c711507053cf4e5339d52865f25cc22b5e8"
-            "7784a12fc961d66cb6e89573199a2ce6565cbdf13dca403832cfcb0e8b7211e8"
-            "3af32a11ac17929ff1c073a51cc027aaedeff85aad7c2b7c5a803e2404d96d2a"
-            "77357bda1a6daeed17151cb9bc5125a422e941de0ca0fc5011c23ecffefdd096"
-            "76711cf3db0a3440720e1615c1f22fbc3c721de521e1b99ba1bd557740864214"
-            "7ed096")), unhex(
-            '4f440db1e6edd2899fa335f09515aa025ee177a79f4b4aaf'
-            '38e42b5c4de660f5de8fb2a5b2fbd2a3cbffd20cff1288c0'))
+        for hashname in ['sha384_sw', 'sha384_hw']:
+            if ssh_hash_new(hashname) is None:
+                continue # skip testing of unavailable HW implementation
+
+            # Test cases from RFC 6234 section 8.5, omitting the ones
+            # whose input is not a multiple of 8 bits
+            self.assertEqualBin(hash_str(hashname, "abc"), unhex(
+                'cb00753f45a35e8bb5a03d699ac65007272c32ab0eded163'
+                '1a8b605a43ff5bed8086072ba1e7cc2358baeca134c825a7'))
+            self.assertEqualBin(hash_str(hashname,
+                "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+                "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu"), unhex(
+                '09330c33f71147e83d192fc782cd1b4753111b173b3b05d2'
+                '2fa08086e3b0f712fcc7c71a557e2db966c3e9fa91746039'))
+            self.assertEqualBin(hash_str_iter(hashname,
+                ("a" * 1000 for _ in range(1000))), unhex(
+                '9d0e1809716474cb086e834e310a4a1ced149e9c00f24852'
+                '7972cec5704c2a5b07b8b3dc38ecc4ebae97ddd87f3d8985'))
+            self.assertEqualBin(hash_str(hashname,
+                "01234567012345670123456701234567" * 20), unhex(
+                '2fc64a4f500ddb6828f6a3430b8dd72a368eb7f3a8322a70'
+                'bc84275b9c0b3ab00d27a5cc3c2d224aa6b61a0d79fb4596'))
+            self.assertEqualBin(hash_str(hashname, b"\xB9"), unhex(
+                'bc8089a19007c0b14195f4ecc74094fec64f01f90929282c'
+                '2fb392881578208ad466828b1c6c283d2722cf0ad1ab6938'))
+            self.assertEqualBin(hash_str(hashname,
+                unhex("a41c497779c0375ff10a7f4e08591739")), unhex(
+                'c9a68443a005812256b8ec76b00516f0dbb74fab26d66591'
+                '3f194b6ffb0e91ea9967566b58109cbc675cc208e4c823f7'))
+            self.assertEqualBin(hash_str(hashname, unhex(
+                "399669e28f6b9c6dbcbb6912ec10ffcf74790349b7dc8fbe4a8e7b3b5621db0f"
+                "3e7dc87f823264bbe40d1811c9ea2061e1c84ad10a23fac1727e7202fc3f5042"
+                "e6bf58cba8a2746e1f64f9b9ea352c711507053cf4e5339d52865f25cc22b5e8"
+                "7784a12fc961d66cb6e89573199a2ce6565cbdf13dca403832cfcb0e8b7211e8"
+                "3af32a11ac17929ff1c073a51cc027aaedeff85aad7c2b7c5a803e2404d96d2a"
+                "77357bda1a6daeed17151cb9bc5125a422e941de0ca0fc5011c23ecffefdd096"
+                "76711cf3db0a3440720e1615c1f22fbc3c721de521e1b99ba1bd557740864214"
+                "7ed096")), unhex(
+                '4f440db1e6edd2899fa335f09515aa025ee177a79f4b4aaf'
+                '38e42b5c4de660f5de8fb2a5b2fbd2a3cbffd20cff1288c0'))
 
     def testSHA512(self):
-        # Test cases from RFC 6234 section 8.5, omitting the ones
-        # whose input is not a multiple of 8 bits
-        self.assertEqualBin(hash_str('sha512', "abc"), unhex(
-            'ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a'
-            '2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f'))
-        self.assertEqualBin(hash_str('sha512',
-            "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
-            "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu"), unhex(
-            '8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018'
-            '501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909'))
-        self.assertEqualBin(hash_str_iter('sha512',
-            ("a" * 1000 for _ in range(1000))), unhex(
-            'e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973eb'
-            'de0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b'))
-        self.assertEqualBin(hash_str('sha512',
-            "01234567012345670123456701234567" * 20), unhex(
-            '89d05ba632c699c31231ded4ffc127d5a894dad412c0e024db872d1abd2ba814'
-            '1a0f85072a9be1e2aa04cf33c765cb510813a39cd5a84c4acaa64d3f3fb7bae9'))
-        self.assertEqualBin(hash_str('sha512', b"\xD0"), unhex(
-            '9992202938e882e73e20f6b69e68a0a7149090423d93c81bab3f21678d4aceee'
-            'e50e4e8cafada4c85a54ea8306826c4ad6e74cece9631bfa8a549b4ab3fbba15'))
-        self.assertEqualBin(hash_str('sha512',
-            unhex("8d4e3c0e3889191491816e9d98bff0a0")), unhex(
-            'cb0b67a4b8712cd73c9aabc0b199e9269b20844afb75acbdd1c153c9828924c3'
-            'ddedaafe669c5fdd0bc66f630f6773988213eb1b16f517ad0de4b2f0c95c90f8'))
-        self.assertEqualBin(hash_str('sha512', unhex(
-            "a55f20c411aad132807a502d65824e31a2305432aa3d06d3e282a8d84e0de1de"
-            "6974bf495469fc7f338f8054d58c26c49360c3e87af56523acf6d89d03e56ff2"
-            "f868002bc3e431edc44df2f0223d4bb3b243586e1a7d924936694fcbbaf88d95"
-            "19e4eb50a644f8e4f95eb0ea95bc4465c8821aacd2fe15ab4981164bbb6dc32f"
-            "969087a145b0d9cc9c67c22b763299419cc4128be9a077b3ace634064e6d9928"
-            "3513dc06e7515d0d73132e9a0dc6d3b1f8b246f1a98a3fc72941b1e3bb2098e8"
-            "bf16f268d64f0b0f4707fe1ea1a1791ba2f3c0c758e5f551863a96c949ad47d7"
-            "fb40d2")), unhex(
-            'c665befb36da189d78822d10528cbf3b12b3eef726039909c1a16a270d487193'
-            '77966b957a878e720584779a62825c18da26415e49a7176a894e7510fd1451f5'))
+        for hashname in ['sha512_sw', 'sha512_hw']:
+            if ssh_hash_new(hashname) is None:
+                continue # skip testing of unavailable HW implementation
+
+            # Test cases from RFC 6234 section 8.5, omitting the ones
+            # whose input is not a multiple of 8 bits
+            self.assertEqualBin(hash_str(hashname, "abc"), unhex(
+                'ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a'
+                '2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f'))
+            self.assertEqualBin(hash_str(hashname,
+                "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+                "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu"), unhex(
+                '8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018'
+                '501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909'))
+            self.assertEqualBin(hash_str_iter(hashname,
+                ("a" * 1000 for _ in range(1000))), unhex(
+                'e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973eb'
+                'de0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b'))
+            self.assertEqualBin(hash_str(hashname,
+                "01234567012345670123456701234567" * 20), unhex(
+                '89d05ba632c699c31231ded4ffc127d5a894dad412c0e024db872d1abd2ba814'
+                '1a0f85072a9be1e2aa04cf33c765cb510813a39cd5a84c4acaa64d3f3fb7bae9'))
+            self.assertEqualBin(hash_str(hashname, b"\xD0"), unhex(
+                '9992202938e882e73e20f6b69e68a0a7149090423d93c81bab3f21678d4aceee'
+                'e50e4e8cafada4c85a54ea8306826c4ad6e74cece9631bfa8a549b4ab3fbba15'))
+            self.assertEqualBin(hash_str(hashname,
+                unhex("8d4e3c0e3889191491816e9d98bff0a0")), unhex(
+                'cb0b67a4b8712cd73c9aabc0b199e9269b20844afb75acbdd1c153c9828924c3'
+                'ddedaafe669c5fdd0bc66f630f6773988213eb1b16f517ad0de4b2f0c95c90f8'))
+            self.assertEqualBin(hash_str(hashname, unhex(
+                "a55f20c411aad132807a502d65824e31a2305432aa3d06d3e282a8d84e0de1de"
+                "6974bf495469fc7f338f8054d58c26c49360c3e87af56523acf6d89d03e56ff2"
+                "f868002bc3e431edc44df2f0223d4bb3b243586e1a7d924936694fcbbaf88d95"
+                "19e4eb50a644f8e4f95eb0ea95bc4465c8821aacd2fe15ab4981164bbb6dc32f"
+                "969087a145b0d9cc9c67c22b763299419cc4128be9a077b3ace634064e6d9928"
+                "3513dc06e7515d0d73132e9a0dc6d3b1f8b246f1a98a3fc72941b1e3bb2098e8"
+                "bf16f268d64f0b0f4707fe1ea1a1791ba2f3c0c758e5f551863a96c949ad47d7"
+                "fb40d2")), unhex(
+                'c665befb36da189d78822d10528cbf3b12b3eef726039909c1a16a270d487193'
+                '77966b957a878e720584779a62825c18da26415e49a7176a894e7510fd1451f5'))
 
     def testSHA3(self):
         # Source: all the SHA-3 test strings from
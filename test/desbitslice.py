@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+
+# Generate the bitsliced DES S-box functions in sshdes.c.
+#
+# Each S-box is a function from 6 input bits to 4 output bits. In
+# bitsliced form, every one of those bits is a whole machine word
+# (holding that bit of 64 different cipher blocks at once), and the
+# S-box has to be computed as a straight-line sequence of AND, OR,
+# XOR and NOT operations on the words.
+#
+# The circuits are found by a simple greedy method. Each output bit
+# is a 64-entry truth table. To make a truth table we haven't already
+# got, we first see whether it's the complement of one we have, or a
+# single AND, OR or XOR of two we have. Otherwise we split it on the
+# next input variable in a fixed order, into the sub-functions for
+# that variable being 0 and 1, and combine those (made the same way,
+# recursively) with a multiplexer, or something cheaper if one of
+# them is constant. Everything made along the way is remembered and
+# reused, including across the four outputs of the same S-box.
+#
+# The variable order, and the order in which the four outputs are
+# made, make a lot of difference to the size of the result. The
+# orders in ORDERS below were found by trying all of them (which
+# takes a long time, so the script doesn't do it by default; run it
+# with --search to do it again).
+#
+# To regenerate, run
+#     python3 desbitslice.py
+# and replace the S-box functions in sshdes.c with the output. It
+# also prints the list of S-box calls in des_bs_f, and the table
+# des_bs_IP, which come from the same DES definition in desref.py.
+
+import sys
+import itertools
+import argparse
+
+import desref
+
+assert sys.version_info[:2] >= (3,0), "This is Python 3 code"
+
+FULL = (1 << 64) - 1
+VARS = [sum(1 << i for i in range(64) if (i >> v) & 1) for v in range(6)]
+
+# (input variable order, output order) for each S-box
+ORDERS = [
+    ((5, 0, 4, 3, 1, 2), (2, 0, 3, 1)),
+    ((2, 4, 3, 1, 0, 5), (2, 0, 3, 1)),
+    ((2, 0, 1, 3, 4, 5), (3, 2, 1, 0)),
+    ((4, 2, 1, 0, 3, 5), (0, 1, 2, 3)),
+    ((0, 2, 4, 5, 1, 3), (0, 1, 2, 3)),
+    ((2, 5, 3, 0, 4, 1), (0, 1, 2, 3)),
+    ((2, 3, 4, 1, 5, 0), (2, 0, 3, 1)),
+    ((2, 3, 5, 1, 0, 4), (3, 2, 1, 0)),
+]
+
+def cofactors(f, v):
+    shift = 1 << v
+    hi = f & VARS[v]
+    lo = f & ~VARS[v] & FULL
+    return lo | (lo << shift), hi | (hi >> shift)
+
+class Circuit(object):
+    def __init__(self, order):
+        self.order = order
+        self.avail = {VARS[v]: "x{:d}".format(v) for v in range(6)}
+        self.lines = []
+        self.ops = 0
+
+    def emit(self, f, expr, ops):
+        name = "t{:d}".format(len(self.lines))
+        self.lines.append("uint64_t {} = {};".format(name, expr))
+        self.avail[f] = name
+        self.ops += ops
+        return name
+
+    def get(self, f):
+        if f in self.avail:
+            return self.avail[f]
+        if f ^ FULL in self.avail:
+            return self.emit(f, "~" + self.avail[f ^ FULL], 1)
+        for (a, an), (b, bn) in itertools.combinations(
+                list(self.avail.items()), 2):
+            for value, op in ((a & b, "&"), (a | b, "|"), (a ^ b, "^")):
+                if value == f:
+                    return self.emit(f, "{} {} {}".format(an, op, bn), 1)
+
+        for v in self.order:
+            lo, hi = cofactors(f, v)
+            if lo != hi:
+                break
+        x = self.avail[VARS[v]]
+        if lo == 0:
+            return self.emit(f, "{} & {}".format(x, self.get(hi)), 1)
+        if hi == 0:
+            return self.emit(f, "{} & ~{}".format(self.get(lo), x), 2)
+        if hi == FULL:
+            return self.emit(f, "{} | {}".format(self.get(lo), x), 1)
+        if lo == FULL:
+            return self.emit(f, "{} | ~{}".format(self.get(hi), x), 2)
+        if lo ^ hi == FULL:
+            return self.emit(f, "{} ^ {}".format(self.get(lo), x), 1)
+        lo_name = self.get(lo)
+        diff_name = self.get(lo ^ hi)
+        return self.emit(f, "{} ^ ({} & {})".format(lo_name, x, diff_name), 2)
+
+def circuit(sbox, order, output_order):
+    c = Circuit(order)
+    outputs = {}
+    for o in output_order:
+        outputs[o] = c.get(sum(((sbox[i] >> o) & 1) << i for i in range(64)))
+    return c, outputs
+
+def search():
+    for index, sbox in enumerate(desref.DES.sboxes):
+        best = min(((circuit(sbox, order, output_order)[0].ops,
+                     order, output_order)
+                    for order in itertools.permutations(range(6))
+                    for output_order in itertools.permutations(range(4))),
+                   key=lambda t: t[0])
+        sys.stdout.write("    ({!r}, {!r}), # {:d} ops\n".format(
+            best[1], best[2], best[0]))
+
+def generate():
+    for index, (sbox, (order, output_order)) in enumerate(
+            zip(desref.DES.sboxes, ORDERS)):
+        c, outputs = circuit(sbox, order, output_order)
+        sys.stdout.write("""\
+static inline void des_bs_sbox{:d}(
+    uint64_t x0, uint64_t x1, uint64_t x2, uint64_t x3, uint64_t x4,
+    uint64_t x5, uint64_t *y0, uint64_t *y1, uint64_t *y2, uint64_t *y3)
+{{
+""".format(index))
+        for line in c.lines:
+            sys.stdout.write("    {}\n".format(line))
+        for o in range(4):
+            sys.stdout.write("    *y{:d} ^= {};\n".format(o, outputs[o]))
+        sys.stdout.write("}\n\n")
+
+def generate_round():
+    # The S-box calls in des_bs_f. S-box j takes its input from bits
+    # 4j-1 to 4j+4 of R (as desref.DES.f does), and its outputs go to
+    # wherever the permutation P sends them.
+    P_inverse = [desref.DES.P.index(i) for i in range(32)]
+    for j in range(8):
+        sys.stdout.write(
+            "    DES_BS_SBOX({:d}, k{}, {:2d}, {:2d}, {:2d}, {:2d}, {:2d});\n"
+            .format(j, "7531" if j & 1 else "6420", (4*j+31) % 32,
+                    *[P_inverse[4*j+c] for c in range(4)]))
+    sys.stdout.write("\n")
+
+    # The table des_bs_IP
+    for i in range(0, 64, 16):
+        sys.stdout.write("    {},\n".format(", ".join(
+            "{:2d}".format(x) for x in desref.DES.IP[i:i+16])))
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Generate bitsliced DES S-boxes for sshdes.c.')
+    parser.add_argument("--search", action="store_true",
+                        help="Search for the best orders to use, instead "
+                        "of generating code using the ones already found.")
+    args = parser.parse_args()
+    if args.search:
+        search()
+    else:
+        generate()
+        generate_round()
+
+if __name__ == '__main__':
+    main()
@@ -215,7 +215,11 @@ static const ssh_hashalg *get_hashalg(BinarySource *in)
         {"sha256_sw", &ssh_sha256_sw},
         {"sha256_hw", &ssh_sha256_hw},
         {"sha384", &ssh_sha384},
+        {"sha384_sw", &ssh_sha384_sw},
+        {"sha384_hw", &ssh_sha384_hw},
         {"sha512", &ssh_sha512},
+        {"sha512_sw", &ssh_sha512_sw},
+        {"sha512_hw", &ssh_sha512_hw},
         {"sha3_224", &ssh_sha3_224},
         {"sha3_256", &ssh_sha3_256},
         {"sha3_384", &ssh_sha3_384},
@@ -244,6 +248,7 @@ static const ssh2_macalg *get_macalg(BinarySource *in)
         {"hmac_sha1_96_buggy", &ssh_hmac_sha1_96_buggy},
         {"hmac_sha256", &ssh_hmac_sha256},
         {"poly1305", &ssh2_poly1305},
+        {"aesgcm", &ssh2_aesgcm_mac},
     };
 
     ptrlen name = get_word(in);
@@ -310,7 +315,16 @@ static const ssh_cipheralg *get_cipheralg(BinarySource *in)
         {"blowfish_ssh1", &ssh_blowfish_ssh1},
         {"arcfour256", &ssh_arcfour256_ssh2},
         {"arcfour128", &ssh_arcfour128_ssh2},
+        {"aes256_gcm", &ssh_aes256_gcm},
+        {"aes256_gcm_hw", &ssh_aes256_gcm_hw},
+        {"aes256_gcm_sw", &ssh_aes256_gcm_sw},
+        {"aes128_gcm", &ssh_aes128_gcm},
+        {"aes128_gcm_hw", &ssh_aes128_gcm_hw},
+        {"aes128_gcm_sw", &ssh_aes128_gcm_sw},
         {"chacha20_poly1305", &ssh2_chacha20_poly1305},
+        {"chacha20_poly1305_sw", &ssh2_chacha20_poly1305_sw},
+        {"chacha20_poly1305_hw", &ssh2_chacha20_poly1305_hw},
+        {"chacha20_poly1305_avx2", &ssh2_chacha20_poly1305_avx2},
     };
 
     ptrlen name = get_word(in);
@@ -56,6 +56,7 @@ FUNC3(val_mpint, mp_nthroot, val_mpint, uint, opt_val_mpint)
 FUNC2(void, mp_reduce_mod_2to, val_mpint, uint)
 FUNC2(val_mpint, mp_invert_mod_2to, val_mpint, uint)
 FUNC2(val_mpint, mp_invert, val_mpint, val_mpint)
+FUNC2(val_mpint, mp_invert_vartime, val_mpint, val_mpint)
 FUNC5(void, mp_gcd_into, val_mpint, val_mpint, opt_val_mpint, opt_val_mpint, opt_val_mpint)
 FUNC2(val_mpint, mp_gcd, val_mpint, val_mpint)
 FUNC2(uint, mp_coprime, val_mpint, val_mpint)
@@ -77,6 +78,7 @@ FUNC3(val_mpint, monty_pow, val_monty, val_mpint, val_mpint)
 FUNC2(val_mpint, monty_invert, val_monty, val_mpint)
 FUNC3(val_mpint, monty_modsqrt, val_modsqrt, val_mpint, out_uint)
 FUNC3(val_mpint, mp_modpow, val_mpint, val_mpint, val_mpint)
+FUNC3(val_mpint, mp_modpow_vartime, val_mpint, val_mpint, val_mpint)
 FUNC3(val_mpint, mp_modmul, val_mpint, val_mpint, val_mpint)
 FUNC3(val_mpint, mp_modadd, val_mpint, val_mpint, val_mpint)
 FUNC3(val_mpint, mp_modsub, val_mpint, val_mpint, val_mpint)
@@ -102,6 +104,7 @@ FUNC2(val_wpoint, ecc_weierstrass_add_general, val_wpoint, val_wpoint)
 FUNC2(val_wpoint, ecc_weierstrass_add, val_wpoint, val_wpoint)
 FUNC1(val_wpoint, ecc_weierstrass_double, val_wpoint)
 FUNC2(val_wpoint, ecc_weierstrass_multiply, val_wpoint, val_mpint)
+FUNC4(val_wpoint, ecc_weierstrass_multiply_sum_vartime, val_wpoint, val_mpint, val_wpoint, val_mpint)
 FUNC1(uint, ecc_weierstrass_is_identity, val_wpoint)
 /* The output pointers in get_affine all become extra output values */
 FUNC3(void, ecc_weierstrass_get_affine, val_wpoint, out_val_mpint, out_val_mpint)
@@ -119,6 +122,8 @@ FUNC3(val_epoint, ecc_edwards_point_new_from_y, val_ecurve, val_mpint, uint)
 FUNC1(val_epoint, ecc_edwards_point_copy, val_epoint)
 FUNC2(val_epoint, ecc_edwards_add, val_epoint, val_epoint)
 FUNC2(val_epoint, ecc_edwards_multiply, val_epoint, val_mpint)
+FUNC1(val_epoint, ecc_edwards_negate, val_epoint)
+FUNC4(val_epoint, ecc_edwards_multiply_sum_vartime, val_epoint, val_mpint, val_epoint, val_mpint)
 FUNC2(uint, ecc_edwards_eq, val_epoint, val_epoint)
 FUNC3(void, ecc_edwards_get_affine, val_epoint, out_val_mpint, out_val_mpint)
 
@@ -188,6 +193,7 @@ FUNC2(val_string, ssh_cipher_encrypt, val_cipher, val_string_ptrlen)
 FUNC2(val_string, ssh_cipher_decrypt, val_cipher, val_string_ptrlen)
 FUNC3(val_string, ssh_cipher_encrypt_length, val_cipher, val_string_ptrlen, uint)
 FUNC3(val_string, ssh_cipher_decrypt_length, val_cipher, val_string_ptrlen, uint)
+FUNC1(void, ssh_cipher_next_message, val_cipher)
 
 /*
  * Integer Diffie-Hellman.
@@ -244,6 +250,7 @@ FUNC1(void, prng_seed_begin, val_prng)
 FUNC2(void, prng_seed_update, val_prng, val_string_ptrlen)
 FUNC1(void, prng_seed_finish, val_prng)
 FUNC2(val_string, prng_read, val_prng, uint)
+FUNC2(void, prng_enable_buffering, val_prng, uint)
 FUNC3(void, prng_add_entropy, val_prng, uint, val_string_ptrlen)
 
 /*
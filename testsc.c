@@ -66,6 +66,10 @@
  * where testsc has been built):
  *
  *   $DRBUILD/bin64/drrun -c test/sclog/libsclog.so -- ./testsc -O $SCTMP
+ *
+ * Add '-j N' to share the tests out between N worker processes (which
+ * will need N times the temp space), and '-T' to finish with a list
+ * of how long each test took.
  */
 
 #include <assert.h>
@@ -73,6 +77,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "defs.h"
 #include "putty.h"
@@ -271,7 +281,11 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
     X(Y, ssh_sha256_hw)                         \
     X(Y, ssh_sha256_sw)                         \
     X(Y, ssh_sha384)                            \
+    X(Y, ssh_sha384_hw)                         \
+    X(Y, ssh_sha384_sw)                         \
     X(Y, ssh_sha512)                            \
+    X(Y, ssh_sha512_hw)                         \
+    X(Y, ssh_sha512_sw)                         \
     X(Y, ssh_sha3_224)                          \
     X(Y, ssh_sha3_256)                          \
     X(Y, ssh_sha3_384)                          \
@@ -281,6 +295,12 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
 
 #define HASH_TESTLIST(X, name) X(hash_ ## name)
 
+#if ECC_HAVE_X25519
+#define X25519_TESTLIST(X) X(ecc_x25519)
+#else
+#define X25519_TESTLIST(X)
+#endif
+
 #define TESTLIST(X)                             \
     X(mp_get_nbits)                             \
     X(mp_from_decimal)                          \
@@ -311,6 +331,7 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
     X(ecc_weierstrass_double)                   \
     X(ecc_weierstrass_add_general)              \
     X(ecc_weierstrass_multiply)                 \
+    X(ecc_weierstrass_table_multiply)           \
     X(ecc_weierstrass_is_identity)              \
     X(ecc_weierstrass_get_affine)               \
     X(ecc_weierstrass_decompress)               \
@@ -318,8 +339,10 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
     X(ecc_montgomery_double)                    \
     X(ecc_montgomery_multiply)                  \
     X(ecc_montgomery_get_affine)                \
+    X25519_TESTLIST(X)                          \
     X(ecc_edwards_add)                          \
     X(ecc_edwards_multiply)                     \
+    X(ecc_edwards_table_multiply)               \
     X(ecc_edwards_eq)                           \
     X(ecc_edwards_get_affine)                   \
     X(ecc_edwards_decompress)                   \
@@ -842,6 +865,31 @@ static void test_ecc_weierstrass_multiply(void)
     mp_free(exponent);
 }
 
+static void test_ecc_weierstrass_table_multiply(void)
+{
+    WeierstrassCurve *wc = wcurve();
+    WeierstrassPoint *a = wpoint(wc, 1);
+    WeierstrassPointTable *tab = ecc_weierstrass_table_new(a);
+    mp_int *exponent = mp_new(56);
+
+    /* Make sure the table is already built before we start logging */
+    ecc_weierstrass_point_free(ecc_weierstrass_table_multiply(tab, exponent));
+
+    for (size_t i = 0; i < looplimit(5); i++) {
+        mp_random_fill(exponent);
+
+        log_start();
+        WeierstrassPoint *r = ecc_weierstrass_table_multiply(tab, exponent);
+        log_end();
+
+        ecc_weierstrass_point_free(r);
+    }
+    ecc_weierstrass_table_free(tab);
+    ecc_weierstrass_point_free(a);
+    ecc_weierstrass_curve_free(wc);
+    mp_free(exponent);
+}
+
 static void test_ecc_weierstrass_is_identity(void)
 {
     WeierstrassCurve *wc = wcurve();
@@ -1071,6 +1119,21 @@ static void test_ecc_montgomery_get_affine(void)
     ecc_montgomery_curve_free(wc);
 }
 
+#if ECC_HAVE_X25519
+static void test_ecc_x25519(void)
+{
+    unsigned char out[32], scalar[32], u[32];
+    for (size_t i = 0; i < looplimit(5); i++) {
+        random_read(scalar, 32);
+        random_read(u, 32);
+
+        log_start();
+        ecc_x25519(out, scalar, u);
+        log_end();
+    }
+}
+#endif
+
 static EdwardsCurve *ecurve(void)
 {
     mp_int *p = MP_LITERAL(0xfce2dac1704095de0b5c48876c45063cd475);
@@ -1174,6 +1237,31 @@ static void test_ecc_edwards_multiply(void)
     mp_free(exponent);
 }
 
+static void test_ecc_edwards_table_multiply(void)
+{
+    EdwardsCurve *ec = ecurve();
+    EdwardsPoint *a = epoint(ec, 1);
+    EdwardsPointTable *tab = ecc_edwards_table_new(a);
+    mp_int *exponent = mp_new(56);
+
+    /* Make sure the table is already built before we start logging */
+    ecc_edwards_point_free(ecc_edwards_table_multiply(tab, exponent));
+
+    for (size_t i = 0; i < looplimit(5); i++) {
+        mp_random_fill(exponent);
+
+        log_start();
+        EdwardsPoint *r = ecc_edwards_table_multiply(tab, exponent);
+        log_end();
+
+        ecc_edwards_point_free(r);
+    }
+    ecc_edwards_table_free(tab);
+    ecc_edwards_point_free(a);
+    ecc_edwards_curve_free(ec);
+    mp_free(exponent);
+}
+
 static void test_ecc_edwards_eq(void)
 {
     EdwardsCurve *ec = ecurve();
@@ -1414,6 +1502,222 @@ TESTLIST(STRUCT_TEST)
 #undef STRUCT_TEST
 };
 
+typedef enum {
+    TEST_SKIPPED, TEST_DRY_RUN, TEST_PASS, TEST_FAIL
+} TestOutcome;
+
+typedef struct TestResult {
+    TestOutcome outcome;
+    double elapsed;                    /* seconds */
+    char msg[400];
+} TestResult;
+
+static PRINTF_LIKE(2, 3) void test_result(
+    TestResult *res, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(res->msg, sizeof(res->msg), fmt, ap);
+    va_end(ap);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run one test, compare its log files, and clean up after it.
+ */
+static void run_test(const struct test *test, bool is_dry_run,
+                     bool keep_outfiles, TestResult *res)
+{
+    bool keep_these_outfiles = true;
+    double start = now();
+
+    res->outcome = TEST_FAIL;
+    test_skipped = false;
+    random_seed(test->testname);
+    test_basename = test->testname;
+    test_index = 0;
+
+    test->testfn();
+
+    if (test_skipped) {
+        /* Used for e.g. tests of hardware-accelerated crypto when
+         * the hardware acceleration isn't available */
+        res->outcome = TEST_SKIPPED;
+        test_result(res, "skipped");
+        goto out;
+    }
+
+    if (is_dry_run) {
+        res->outcome = TEST_DRY_RUN;
+        test_result(res, "dry run done");
+        goto out;                      /* test files won't exist anyway */
+    }
+
+    if (test_index < 2) {
+        test_result(res, "FAIL: test did not generate multiple output files");
+        goto test_done;
+    }
+
+    char *firstfile = log_filename(test_basename, 0);
+    FILE *firstfp = fopen(firstfile, "rb");
+    if (!firstfp) {
+        test_result(res, "ERR: %s: open: %s", firstfile, strerror(errno));
+        goto test_done;
+    }
+    for (size_t i = 1; i < test_index; i++) {
+        char *nextfile = log_filename(test_basename, i);
+        FILE *nextfp = fopen(nextfile, "rb");
+        if (!nextfp) {
+            test_result(res, "ERR: %s: open: %s", nextfile, strerror(errno));
+            goto test_done;
+        }
+
+        rewind(firstfp);
+        char buf1[4096], bufn[4096];
+        bool compare_ok = false;
+        while (true) {
+            size_t r1 = fread(buf1, 1, sizeof(buf1), firstfp);
+            size_t rn = fread(bufn, 1, sizeof(bufn), nextfp);
+            if (r1 != rn) {
+                test_result(res, "FAIL: %s %s: different lengths",
+                            firstfile, nextfile);
+                break;
+            }
+            if (r1 == 0) {
+                if (feof(firstfp) && feof(nextfp)) {
+                    compare_ok = true;
+                } else {
+                    test_result(res, "FAIL: %s %s: error at end of file",
+                                firstfile, nextfile);
+                }
+                break;
+            }
+            if (memcmp(buf1, bufn, r1) != 0) {
+                test_result(res, "FAIL: %s %s: different content",
+                            firstfile, nextfile);
+                break;
+            }
+        }
+        fclose(nextfp);
+        sfree(nextfile);
+        if (!compare_ok) {
+            goto test_done;
+        }
+    }
+    fclose(firstfp);
+    sfree(firstfile);
+
+    res->outcome = TEST_PASS;
+    test_result(res, "pass");
+    keep_these_outfiles = keep_outfiles;
+
+  test_done:
+    if (!keep_these_outfiles) {
+        for (size_t i = 0; i < test_index; i++) {
+            char *file = log_filename(test_basename, i);
+            remove(file);
+            sfree(file);
+        }
+    }
+
+  out:
+    res->elapsed = now() - start;
+}
+
+/*
+ * Run the selected tests in 'njobs' worker processes. (Processes
+ * rather than threads, because the sclog instrumentation has only
+ * one current log file per process. DynamoRIO follows fork(), so
+ * the children are instrumented just like the parent.)
+ *
+ * The parent writes the index of every test to be run into a pipe
+ * before starting any workers, and each worker repeatedly reads the
+ * next index out of it, so the tests are handed out dynamically and
+ * one slow test doesn't hold up the rest of a fixed share. Results
+ * come back through another pipe, one fixed-size record per test,
+ * which is small enough for each write to be atomic.
+ */
+struct test_record {
+    uint16_t index;
+    TestResult res;
+};
+
+static void run_tests_parallel(
+    const uint8_t *tests_to_run, unsigned njobs, bool is_dry_run,
+    bool keep_outfiles, TestResult *results, bool *have_result)
+{
+    int queue[2], reply[2];
+
+    assert(sizeof(struct test_record) <= PIPE_BUF);
+    if (pipe(queue) < 0 || pipe(reply) < 0)
+        fatal_error("pipe: %s", strerror(errno));
+
+    for (size_t i = 0; i < lenof(tests); i++) {
+        if (tests_to_run[i]) {
+            uint16_t index = i;
+            if (write(queue[1], &index, sizeof(index)) != sizeof(index))
+                fatal_error("write: %s", strerror(errno));
+        }
+    }
+    close(queue[1]);
+
+    fflush(stdout);
+    for (unsigned j = 0; j < njobs; j++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            fatal_error("fork: %s", strerror(errno));
+        if (pid == 0) {
+            close(reply[0]);
+            struct test_record rec;
+            while (read(queue[0], &rec.index, sizeof(rec.index)) ==
+                   sizeof(rec.index)) {
+                run_test(&tests[rec.index], is_dry_run, keep_outfiles,
+                         &rec.res);
+                if (write(reply[1], &rec, sizeof(rec)) != sizeof(rec))
+                    _exit(1);
+            }
+            _exit(0);
+        }
+    }
+    close(queue[0]);
+    close(reply[1]);
+
+    struct test_record rec;
+    while (read(reply[0], &rec, sizeof(rec)) == sizeof(rec)) {
+        results[rec.index] = rec.res;
+        have_result[rec.index] = true;
+        printf("Test %s ... %s\n", tests[rec.index].testname, rec.res.msg);
+        fflush(stdout);
+    }
+    close(reply[0]);
+
+    while (wait(NULL) > 0);
+
+    /* Anything we didn't hear back about must have crashed a worker */
+    for (size_t i = 0; i < lenof(tests); i++) {
+        if (tests_to_run[i] && !have_result[i]) {
+            results[i].outcome = TEST_FAIL;
+            results[i].elapsed = 0;
+            test_result(&results[i], "ERR: worker process died");
+            have_result[i] = true;
+            printf("Test %s ... %s\n", tests[i].testname, results[i].msg);
+        }
+    }
+}
+
+static int compare_elapsed(const void *av, const void *bv)
+{
+    const TestResult *a = *(const TestResult *const *)av;
+    const TestResult *b = *(const TestResult *const *)bv;
+    return a->elapsed > b->elapsed ? -1 : a->elapsed < b->elapsed ? +1 : 0;
+}
+
 int main(int argc, char **argv)
 {
     bool doing_opts = true;
@@ -1421,6 +1725,8 @@ int main(int argc, char **argv)
     uint8_t tests_to_run[lenof(tests)];
     bool keep_outfiles = false;
     bool test_names_given = false;
+    bool show_timings = false;
+    unsigned njobs = 1;
 
     memset(tests_to_run, 1, sizeof(tests_to_run));
     random_hash = ssh_hash_new(&ssh_sha256);
@@ -1437,6 +1743,18 @@ int main(int argc, char **argv)
                 outdir = *++argv;
             } else if (!strcmp(p, "-k") || !strcmp(p, "--keep")) {
                 keep_outfiles = true;
+            } else if (!strcmp(p, "-j")) {
+                if (--argc <= 0) {
+                    fprintf(stderr, "'-j' expects a number of jobs\n");
+                    return 1;
+                }
+                njobs = atoi(*++argv);
+                if (njobs < 1) {
+                    fprintf(stderr, "'-j' expects a positive number\n");
+                    return 1;
+                }
+            } else if (!strcmp(p, "-T") || !strcmp(p, "--timings")) {
+                show_timings = true;
             } else if (!strcmp(p, "--")) {
                 doing_opts = false;
             } else if (!strcmp(p, "--help")) {
@@ -1446,6 +1764,10 @@ int main(int argc, char **argv)
                        "put log files in the specified directory\n");
                 printf("         -k, --keep            "
                        "do not delete log files for tests that passed\n");
+                printf("         -j <jobs>             "
+                       "run tests in this many worker processes\n");
+                printf("         -T, --timings         "
+                       "list how long each test took, slowest first\n");
                 printf("   also: --help                "
                        "display this text\n");
                 return 0;
@@ -1493,106 +1815,52 @@ int main(int argc, char **argv)
         printf("Will write log files to %s\n", outdir);
     }
 
-    size_t nrun = 0, npass = 0;
-
-    for (size_t i = 0; i < lenof(tests); i++) {
-        bool keep_these_outfiles = true;
-
-        if (!tests_to_run[i])
-            continue;
-        const struct test *test = &tests[i];
-        printf("Running test %s ... ", test->testname);
-        fflush(stdout);
-
-        test_skipped = false;
-        random_seed(test->testname);
-        test_basename = test->testname;
-        test_index = 0;
-
-        test->testfn();
+    TestResult *results = snewn(lenof(tests), TestResult);
+    bool *have_result = snewn(lenof(tests), bool);
+    memset(have_result, 0, lenof(tests) * sizeof(bool));
 
-        if (test_skipped) {
-            /* Used for e.g. tests of hardware-accelerated crypto when
-             * the hardware acceleration isn't available */
-            printf("skipped\n");
-            continue;
+    if (njobs > 1) {
+        run_tests_parallel(tests_to_run, njobs, is_dry_run, keep_outfiles,
+                           results, have_result);
+    } else {
+        for (size_t i = 0; i < lenof(tests); i++) {
+            if (!tests_to_run[i])
+                continue;
+            printf("Running test %s ... ", tests[i].testname);
+            fflush(stdout);
+            run_test(&tests[i], is_dry_run, keep_outfiles, &results[i]);
+            have_result[i] = true;
+            printf("%s\n", results[i].msg);
         }
+    }
 
+    size_t nrun = 0, npass = 0;
+    for (size_t i = 0; i < lenof(tests); i++) {
+        if (!have_result[i] || results[i].outcome == TEST_SKIPPED)
+            continue;
         nrun++;
+        if (results[i].outcome != TEST_FAIL)
+            npass++;
+    }
 
-        if (is_dry_run) {
-            printf("dry run done\n");
-            continue;                  /* test files won't exist anyway */
-        }
-
-        if (test_index < 2) {
-            printf("FAIL: test did not generate multiple output files\n");
-            goto test_done;
-        }
-
-        char *firstfile = log_filename(test_basename, 0);
-        FILE *firstfp = fopen(firstfile, "rb");
-        if (!firstfp) {
-            printf("ERR: %s: open: %s\n", firstfile, strerror(errno));
-            goto test_done;
-        }
-        for (size_t i = 1; i < test_index; i++) {
-            char *nextfile = log_filename(test_basename, i);
-            FILE *nextfp = fopen(nextfile, "rb");
-            if (!nextfp) {
-                printf("ERR: %s: open: %s\n", nextfile, strerror(errno));
-                goto test_done;
-            }
-
-            rewind(firstfp);
-            char buf1[4096], bufn[4096];
-            bool compare_ok = false;
-            while (true) {
-                size_t r1 = fread(buf1, 1, sizeof(buf1), firstfp);
-                size_t rn = fread(bufn, 1, sizeof(bufn), nextfp);
-                if (r1 != rn) {
-                    printf("FAIL: %s %s: different lengths\n",
-                           firstfile, nextfile);
-                    break;
-                }
-                if (r1 == 0) {
-                    if (feof(firstfp) && feof(nextfp)) {
-                        compare_ok = true;
-                    } else {
-                        printf("FAIL: %s %s: error at end of file\n",
-                               firstfile, nextfile);
-                    }
-                    break;
-                }
-                if (memcmp(buf1, bufn, r1) != 0) {
-                    printf("FAIL: %s %s: different content\n",
-                           firstfile, nextfile);
-                    break;
-                }
-            }
-            fclose(nextfp);
-            sfree(nextfile);
-            if (!compare_ok) {
-                goto test_done;
-            }
-        }
-        fclose(firstfp);
-        sfree(firstfile);
-
-        printf("pass\n");
-        npass++;
-        keep_these_outfiles = keep_outfiles;
-
-      test_done:
-        if (!keep_these_outfiles) {
-            for (size_t i = 0; i < test_index; i++) {
-                char *file = log_filename(test_basename, i);
-                remove(file);
-                sfree(file);
-            }
-        }
+    if (show_timings) {
+        /* Slowest first, since those are the ones worth looking at */
+        const TestResult **sorted = snewn(lenof(tests), const TestResult *);
+        size_t nsorted = 0;
+        for (size_t i = 0; i < lenof(tests); i++)
+            if (have_result[i] && results[i].outcome != TEST_SKIPPED)
+                sorted[nsorted++] = &results[i];
+        qsort(sorted, nsorted, sizeof(*sorted), compare_elapsed);
+        printf("Test timings:\n");
+        for (size_t i = 0; i < nsorted; i++)
+            printf("%10.3fs  %s\n", sorted[i]->elapsed,
+                   tests[sorted[i] - results].testname);
+        sfree(sorted);
     }
 
+    sfree(results);
+    sfree(have_result);
+
     ssh_hash_free(random_hash);
 
     if (npass == nrun) {
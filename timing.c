@@ -25,41 +25,95 @@
  * fired OR before the time it was set. In the latter case the clock must
  * have jumped, the former is (probably) just the normal passage of time.
  *
+ * Timers are kept in a hierarchical timing wheel, so that scheduling,
+ * running and cancelling one costs constant time however many there
+ * are (psocks or a connection-sharing upstream can have several per
+ * connection). Level 0 of the wheel has a slot for each of the next
+ * 256 ticks; level 1 has a slot for each of the next 256 blocks of
+ * 256 ticks, and so on. As the current time passes a block boundary,
+ * the timers in the corresponding slot of the level above are
+ * redistributed ('cascaded') into the finer levels below. Timers too
+ * far in the future for the top level wait on an overflow list.
+ *
+ * Separately, every timer is chained into a small hash table keyed
+ * on its context pointer, so that expire_timer_context can find and
+ * discard a context's timers without searching the whole wheel.
+ *
  */
 
 #include <assert.h>
 #include <stdio.h>
 
 #include "putty.h"
-#include "tree234.h"
+
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 3       /* so the wheel spans 2^24 ticks */
+
+#define TIMER_CTX_HASH_MIN 64       /* initial size; grows to match */
+
+/* The list a timer is on, when it isn't in one of the wheel levels */
+#define TIMER_OVERFLOW TIMER_WHEEL_LEVELS
+#define TIMER_HELD (TIMER_WHEEL_LEVELS + 1)
+#define TIMER_DUE (TIMER_WHEEL_LEVELS + 2)
+
+/* How far the clock may step back past the time a timer was set
+ * before we give up waiting for it and run the timer anyway */
+#define TIMER_JUMP_SLACK 10
 
 struct timer {
     timer_fn_t fn;
     void *ctx;
     unsigned long now;
     unsigned long when_set;
+
+    int list;                          /* wheel level, or TIMER_DUE etc */
+    struct timer *next, **prevp;       /* within that list */
+    struct timer *ctxnext, **ctxprevp; /* within a timer_ctx_hash chain */
 };
 
-static tree234 *timers = NULL;
-static tree234 *timer_contexts = NULL;
+static bool timers_initialised = false;
+static struct timer *timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+static size_t timer_wheel_count[TIMER_WHEEL_LEVELS];
+static struct timer *timer_overflow;   /* beyond the top of the wheel */
+static struct timer *timer_held;       /* behind the wheel; see below */
+static struct timer *timer_due;        /* reached their time, not yet run */
+static struct timer **timer_due_tail = &timer_due;
+static struct timer **timer_ctx_hash;
+static size_t timer_ctx_hash_size;
+static struct timer *timer_free_list;  /* recycled timer structures */
+static size_t timer_count;
+
+/* Time up to which timer_wheel has been advanced. Every timer still
+ * in the wheel or the overflow list is due strictly after this. */
+static unsigned long wheel_now;
+
+/* Latest when_set of any timer we have, for spotting when the clock
+ * has gone back past it */
+static unsigned long timer_latest_set;
+
+/* Cached answer from timer_first, if first_known */
+static bool first_known;
+static unsigned long first_when;
+
 static unsigned long now = 0L;
 
-static int compare_timers(void *av, void *bv)
+static void init_timers(void)
 {
-    struct timer *a = (struct timer *)av;
-    struct timer *b = (struct timer *)bv;
-    long at = a->now - now;
-    long bt = b->now - now;
-
-    if (at < bt)
-        return -1;
-    else if (at > bt)
-        return +1;
+    if (!timers_initialised) {
+        timers_initialised = true;
+        now = wheel_now = GETTICKCOUNT();
+    }
+}
 
-    /*
-     * Failing that, compare on the other two fields, just so that
-     * we don't get unwanted equality.
-     */
+/*
+ * Order in which to run timers due at the same moment. (Callers can
+ * observe it, e.g. if one timer's function expires the other's
+ * context, so we keep it stable.)
+ */
+static int timer_tie_cmp(struct timer *a, struct timer *b)
+{
 #if defined(__LCC__) || defined(__clang__)
     /* lcc won't let us compare function pointers. Legal, but annoying. */
     {
@@ -78,40 +132,375 @@ static int compare_timers(void *av, void *bv)
         return -1;
     else if (a->ctx > b->ctx)
         return +1;
+    return 0;
+}
+
+static size_t timer_ctx_hash_index(void *ctx)
+{
+    uintptr_t h = (uintptr_t)ctx;
+    h ^= h >> 4;
+    h ^= h >> 12;
+    h ^= h >> 20;
+    return h & (timer_ctx_hash_size - 1);
+}
+
+static void timer_ctx_hash_link(struct timer *t)
+{
+    struct timer **head = &timer_ctx_hash[timer_ctx_hash_index(t->ctx)];
+    t->ctxnext = *head;
+    t->ctxprevp = head;
+    if (t->ctxnext)
+        t->ctxnext->ctxprevp = &t->ctxnext;
+    *head = t;
+}
+
+/*
+ * Keep the context hash table at least as big as the number of
+ * timers, so that its chains stay short.
+ */
+static void timer_ctx_hash_grow(void)
+{
+    struct timer **old = timer_ctx_hash, *t, *next;
+    size_t oldsize = timer_ctx_hash_size;
+
+    if (timer_ctx_hash_size >= TIMER_CTX_HASH_MIN &&
+        timer_ctx_hash_size > timer_count)
+        return;
+
+    timer_ctx_hash_size = (oldsize ? oldsize * 2 : TIMER_CTX_HASH_MIN);
+    timer_ctx_hash = snewn(timer_ctx_hash_size, struct timer *);
+    for (size_t i = 0; i < timer_ctx_hash_size; i++)
+        timer_ctx_hash[i] = NULL;
+
+    for (size_t i = 0; i < oldsize; i++) {
+        for (t = old[i]; t; t = next) {
+            next = t->ctxnext;
+            timer_ctx_hash_link(t);
+        }
+    }
+    sfree(old);
+}
+
+static void timer_list_add(struct timer **head, struct timer *t, int list)
+{
+    t->list = list;
+    t->next = *head;
+    t->prevp = head;
+    if (t->next)
+        t->next->prevp = &t->next;
+    *head = t;
+}
+
+static void timer_list_remove(struct timer *t)
+{
+    *t->prevp = t->next;
+    if (t->next)
+        t->next->prevp = t->prevp;
+    else if (t->list == TIMER_DUE)
+        timer_due_tail = t->prevp;
+    if (t->list < TIMER_WHEEL_LEVELS)
+        timer_wheel_count[t->list]--;
+}
+
+static void timer_due_append(struct timer *t)
+{
+    t->list = TIMER_DUE;
+    t->next = NULL;
+    t->prevp = timer_due_tail;
+    *timer_due_tail = t;
+    timer_due_tail = &t->next;
+}
+
+/*
+ * File a timer in the wheel according to how far after wheel_now it
+ * is due.
+ */
+static void timer_wheel_insert(struct timer *t)
+{
+    unsigned long delta = t->now - wheel_now;
+    int level;
+
+    if ((long)delta <= 0) {
+        /*
+         * Only possible when the clock has stepped back a little
+         * since we last advanced the wheel. We can't file this timer
+         * in the wheel, so hold it until the clock catches up.
+         */
+        timer_list_add(&timer_held, t, TIMER_HELD);
+        return;
+    }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (delta < (1UL << (TIMER_WHEEL_BITS * (level + 1)))) {
+            unsigned slot = (t->now >> (TIMER_WHEEL_BITS * level)) &
+                TIMER_WHEEL_MASK;
+            timer_list_add(&timer_wheel[level][slot], t, level);
+            timer_wheel_count[level]++;
+            return;
+        }
+    }
+
+    timer_list_add(&timer_overflow, t, TIMER_OVERFLOW);
+}
+
+/*
+ * Move every timer on a list back through timer_wheel_insert. (We
+ * detach the whole list first, because some of its timers may belong
+ * back on it, e.g. if it's the overflow list.)
+ */
+static void timer_cascade(struct timer **head)
+{
+    struct timer *t = *head, *next;
+
+    *head = NULL;
+    for (; t; t = next) {
+        next = t->next;
+        if (t->list < TIMER_WHEEL_LEVELS)
+            timer_wheel_count[t->list]--;
+        if (t->now == wheel_now) {
+            /* Due right at this boundary, so it goes in the level 0
+             * slot we're about to empty */
+            timer_list_add(&timer_wheel[0][wheel_now & TIMER_WHEEL_MASK],
+                           t, 0);
+            timer_wheel_count[0]++;
+        } else {
+            timer_wheel_insert(t);
+        }
+    }
+}
+
+/*
+ * Advance wheel_now to 'to', moving every timer that falls due on the
+ * way to the due list, in order of expiry.
+ */
+static void timer_wheel_advance(unsigned long to)
+{
+    while ((long)(to - wheel_now) > 0) {
+        unsigned long target = to;
+
+        /*
+         * Stop at the next block boundary at which a cascade might
+         * actually move something down a level. If there's nothing
+         * in level 1, the level 0 boundaries don't matter, and so on.
+         */
+        if (timer_wheel_count[1] || timer_wheel_count[2] || timer_overflow) {
+            unsigned long boundary;
+            if (timer_wheel_count[1])
+                boundary = (wheel_now | 0xFFUL) + 1;
+            else if (timer_wheel_count[2])
+                boundary = (wheel_now | 0xFFFFUL) + 1;
+            else
+                boundary = (wheel_now | 0xFFFFFFUL) + 1;
+            if ((long)(boundary - target) < 0)
+                target = boundary;
+        }
+
+        /*
+         * And stop at the next tick with anything in level 0.
+         */
+        if (timer_wheel_count[0]) {
+            unsigned long t, limit = target - wheel_now;
+            if (limit > TIMER_WHEEL_MASK)
+                limit = TIMER_WHEEL_MASK;
+            for (t = 1; t <= limit; t++) {
+                if (timer_wheel[0][(wheel_now + t) & TIMER_WHEEL_MASK]) {
+                    target = wheel_now + t;
+                    break;
+                }
+            }
+        }
+
+        wheel_now = target;
+
+        if ((wheel_now & 0xFFUL) == 0) {
+            if ((wheel_now & 0xFFFFUL) == 0) {
+                if ((wheel_now & 0xFFFFFFUL) == 0)
+                    timer_cascade(&timer_overflow);
+                timer_cascade(&timer_wheel[2][(wheel_now >> 16) &
+                                              TIMER_WHEEL_MASK]);
+            }
+            timer_cascade(&timer_wheel[1][(wheel_now >> 8) &
+                                          TIMER_WHEEL_MASK]);
+        }
+
+        /*
+         * Everything in this slot is due at wheel_now. Sort it before
+         * moving it to the due list.
+         */
+        struct timer **slot = &timer_wheel[0][wheel_now & TIMER_WHEEL_MASK];
+        struct timer *t, *sorted = NULL, **pos;
+        while ((t = *slot) != NULL) {
+            timer_list_remove(t);
+            for (pos = &sorted; *pos && timer_tie_cmp(*pos, t) < 0;
+                 pos = &(*pos)->next);
+            t->next = *pos;
+            *pos = t;
+        }
+        while ((t = sorted) != NULL) {
+            sorted = t->next;
+            timer_due_append(t);
+        }
+    }
+}
+
+/*
+ * The test we've always used for whether a timer is due, which copes
+ * with the clock jumping backwards: see the comment at the top.
+ */
+static bool timer_is_due(struct timer *t)
+{
+    unsigned long base = t->when_set - TIMER_JUMP_SLACK;
+    return now - base > t->now - base;
+}
+
+/*
+ * Bring the wheel up to the current time, moving everything that's
+ * now due to the due list. A timer counts as due once the clock has
+ * passed its time, not when it reaches it.
+ */
+static void timer_wheel_sync(void)
+{
+    unsigned long limit = now - 1;
 
     /*
-     * Failing _that_, the two entries genuinely are equal, and we
-     * never have a need to store them separately in the tree.
+     * Release any held timers whose time has come, earliest first.
      */
-    return 0;
+    while (timer_held) {
+        struct timer *t, *first = NULL;
+        for (t = timer_held; t; t = t->next)
+            if ((long)(limit - t->now) >= 0 &&
+                (!first || (long)(t->now - first->now) < 0 ||
+                 (t->now == first->now && timer_tie_cmp(t, first) < 0)))
+                first = t;
+        if (!first)
+            break;
+        timer_list_remove(first);
+        timer_due_append(first);
+    }
+
+    /*
+     * If the clock has stepped back a little, the wheel will have to
+     * wait for it to catch up. Otherwise, advance it.
+     */
+    if ((long)(limit - wheel_now) > 0)
+        timer_wheel_advance(limit);
 }
 
-static int compare_timer_contexts(void *av, void *bv)
+/*
+ * Find the earliest of the timers on a list, relative to wheel_now,
+ * if it's earlier than *first.
+ */
+static void timer_list_min(struct timer *t, struct timer **first)
 {
-    char *a = (char *)av;
-    char *b = (char *)bv;
-    if (a < b)
-        return -1;
-    else if (a > b)
-        return +1;
-    return 0;
+    for (; t; t = t->next) {
+        if (*first) {
+            long d1 = t->now - wheel_now, d2 = (*first)->now - wheel_now;
+            if (d1 > d2 || (d1 == d2 && timer_tie_cmp(t, *first) > 0))
+                continue;
+        }
+        *first = t;
+    }
 }
 
-static void init_timers(void)
+/*
+ * Find the timer that's due next.
+ */
+static struct timer *timer_find_first(void)
 {
-    if (!timers) {
-        timers = newtree234(compare_timers);
-        timer_contexts = newtree234(compare_timer_contexts);
-        now = GETTICKCOUNT();
+    struct timer *first = NULL;
+
+    if (timer_due)
+        return timer_due;
+
+    timer_list_min(timer_held, &first);
+
+    /*
+     * Timers don't necessarily sit in the lowest level that would now
+     * hold them, so we may have to look at every level. Within each
+     * one, the slots cover successive ranges of time starting just
+     * after wheel_now, so the first non-empty slot holds the earliest
+     * timers at that level, and the start of its range is a lower
+     * bound on them. If we've already found something earlier than
+     * that, we needn't search the slot.
+     */
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (!timer_wheel_count[level])
+            continue;
+        unsigned shift = TIMER_WHEEL_BITS * level;
+        unsigned long base = (wheel_now >> shift) + 1;
+        for (unsigned i = 0; i < TIMER_WHEEL_SIZE; i++) {
+            struct timer *t =
+                timer_wheel[level][(base + i) & TIMER_WHEEL_MASK];
+            if (t) {
+                unsigned long start = (base + i) << shift;
+                if (!first || (long)(start - first->now) <= 0)
+                    timer_list_min(t, &first);
+                break;
+            }
+        }
     }
+
+    if (timer_overflow) {
+        unsigned long start = (wheel_now | 0xFFFFFFUL) + 1;
+        if (!first || (long)(start - first->now) <= 0)
+            timer_list_min(timer_overflow, &first);
+    }
+
+    return first;
+}
+
+/*
+ * Work out when the next timer is due, if there is one.
+ */
+static bool timer_first(unsigned long *when)
+{
+    if (!first_known) {
+        struct timer *first = timer_find_first();
+        if (!first)
+            return false;
+        first_known = true;
+        first_when = first->now;
+    }
+
+    *when = first_when;
+    return true;
+}
+
+static struct timer *timer_alloc(void)
+{
+    struct timer *t = timer_free_list;
+    if (t)
+        timer_free_list = t->next;
+    else
+        t = snew(struct timer);
+    return t;
+}
+
+/*
+ * Unlink a timer from everything and put it back on the free list.
+ */
+static void timer_free(struct timer *t)
+{
+    timer_list_remove(t);
+    *t->ctxprevp = t->ctxnext;
+    if (t->ctxnext)
+        t->ctxnext->ctxprevp = t->ctxprevp;
+    timer_count--;
+    if (first_known && t->now == first_when)
+        first_known = false;
+
+    t->next = timer_free_list;
+    timer_free_list = t;
 }
 
 unsigned long schedule_timer(int ticks, timer_fn_t fn, void *ctx)
 {
-    unsigned long when;
-    struct timer *t, *first;
+    unsigned long when, first;
+    struct timer *t;
+    bool had_first;
 
     init_timers();
+    timer_ctx_hash_grow();
 
     now = GETTICKCOUNT();
     when = ticks + now;
@@ -124,25 +513,38 @@ unsigned long schedule_timer(int ticks, timer_fn_t fn, void *ctx)
     if (when - now <= 0)
         when = now + 1;
 
-    t = snew(struct timer);
+    /*
+     * If an identical timer already exists, there's no need for
+     * another one.
+     */
+    for (t = timer_ctx_hash[timer_ctx_hash_index(ctx)]; t; t = t->ctxnext)
+        if (t->ctx == ctx && t->fn == fn && t->now == when)
+            return when;
+
+    had_first = timer_first(&first);
+
+    t = timer_alloc();
     t->fn = fn;
     t->ctx = ctx;
     t->now = when;
     t->when_set = now;
 
-    if (t != add234(timers, t)) {
-        sfree(t);                      /* identical timer already exists */
-    } else {
-        add234(timer_contexts, t->ctx);/* don't care if this fails */
-    }
+    if (timer_count == 0 || (long)(now - timer_latest_set) > 0)
+        timer_latest_set = now;
+
+    timer_ctx_hash_link(t);
 
-    first = (struct timer *)index234(timers, 0);
-    if (first == t) {
+    timer_wheel_insert(t);
+    timer_count++;
+
+    if (!had_first || (long)(when - now) < (long)(first - now)) {
         /*
          * This timer is the very first on the list, so we must
          * notify the front end.
          */
-        timer_change_notify(first->now);
+        first_known = true;
+        first_when = when;
+        timer_change_notify(when);
     }
 
     return when;
@@ -166,43 +568,51 @@ unsigned long timing_last_clock(void)
  */
 bool run_timers(unsigned long anow, unsigned long *next)
 {
-    struct timer *first;
+    struct timer *t;
 
     init_timers();
 
     now = GETTICKCOUNT();
 
     while (1) {
-        first = (struct timer *)index234(timers, 0);
-
-        if (!first)
-            return false;              /* no timers remaining */
+        /*
+         * Collect everything that's due by now. ('now' can move on
+         * while we run timers, because schedule_timer updates it.)
+         */
+        timer_wheel_sync();
 
-        if (find234(timer_contexts, first->ctx, NULL) == NULL) {
+        if ((t = timer_due) == NULL) {
             /*
-             * This timer belongs to a context that has been
-             * expired. Delete it without running.
+             * If the clock has gone back past the time some timer was
+             * set, the next timer in line may be due by our
+             * jump-detecting test even though its time hasn't come.
              */
-            delpos234(timers, 0);
-            sfree(first);
-        } else if (now - (first->when_set - 10) >
-                   first->now - (first->when_set - 10)) {
-            /*
-             * This timer is active and has reached its running
-             * time. Run it.
-             */
-            delpos234(timers, 0);
-            first->fn(first->ctx, first->now);
-            sfree(first);
-        } else {
-            /*
-             * This is the first still-active timer that is in the
-             * future. Return how long it has yet to go.
-             */
-            *next = first->now;
-            return true;
+            if (!timer_count ||
+                (long)(now - (timer_latest_set - TIMER_JUMP_SLACK)) >= 0)
+                break;
+            t = timer_find_first();
+            if (!timer_is_due(t))
+                break;
         }
+
+        timer_fn_t fn = t->fn;
+        void *ctx = t->ctx;
+        unsigned long when = t->now;
+
+        /*
+         * Free the timer before running it, so that the callback
+         * can reschedule itself or expire its own context freely.
+         */
+        timer_free(t);
+        uint64_t trace_start = trace_begin();
+        fn(ctx, when);
+        trace_end("timer", (uintptr_t)fn, trace_start);
     }
+
+    /*
+     * Return when the first still-active timer is due.
+     */
+    return timer_first(next);
 }
 
 /*
@@ -210,13 +620,15 @@ bool run_timers(unsigned long anow, unsigned long *next)
  */
 void expire_timer_context(void *ctx)
 {
+    struct timer *t, *next;
+
     init_timers();
+    if (!timer_ctx_hash)
+        return;
 
-    /*
-     * We don't bother to check the return value; if the context
-     * already wasn't in the tree (presumably because no timers
-     * ever actually got scheduled for it) then that's fine and we
-     * simply don't need to do anything.
-     */
-    del234(timer_contexts, ctx);
+    for (t = timer_ctx_hash[timer_ctx_hash_index(ctx)]; t; t = next) {
+        next = t->ctxnext;
+        if (t->ctx == ctx)
+            timer_free(t);
+    }
 }
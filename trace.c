@@ -0,0 +1,150 @@
+/*
+ * trace.c: optional tracing of what the event loop spends its time
+ * doing, for looking into stalls and throughput problems.
+ *
+ * While tracing is on, each instrumented piece of work (a toplevel
+ * callback, a timer, an fd or socket event, a run of the SSH packet
+ * layer or the terminal) records its start and end time in a ring of
+ * the most recent events. The ring is written out in the Chrome trace
+ * event format, readable by chrome://tracing or Perfetto, when the
+ * program exits or when asked to (see trace_request_write).
+ *
+ * Only the main thread may record events.
+ */
+
+#include <stdio.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include "putty.h"
+#include "ssh.h"
+
+#define TRACE_RING_EVENTS 65536
+
+typedef struct trace_event {
+    const char *name;
+    uintptr_t arg;
+    uint64_t start, end;
+} trace_event;
+
+bool trace_on = false;
+
+static trace_event *trace_ring;
+static size_t trace_pos;
+static bool trace_wrapped;
+static Filename *trace_filename;
+static volatile sig_atomic_t trace_write_pending;
+
+uint64_t trace_clock(void)
+{
+    return platform_perf_counter_ns();
+}
+
+static void trace_write_at_exit(void)
+{
+    trace_write();
+}
+
+void trace_start(Filename *fn)
+{
+    if (trace_on) {
+        filename_free(trace_filename);
+        trace_filename = filename_copy(fn);
+        return;
+    }
+
+    trace_ring = snewn(TRACE_RING_EVENTS, trace_event);
+    trace_pos = 0;
+    trace_wrapped = false;
+    trace_filename = filename_copy(fn);
+    trace_on = true;
+
+    atexit(trace_write_at_exit);
+    platform_trace_started(trace_request_write);
+}
+
+void trace_record(const char *name, uintptr_t arg, uint64_t start)
+{
+    trace_event *ev = &trace_ring[trace_pos];
+
+    ev->name = name;
+    ev->arg = arg;
+    ev->start = start;
+    ev->end = trace_clock();
+    if (++trace_pos == TRACE_RING_EVENTS) {
+        trace_pos = 0;
+        trace_wrapped = true;
+    }
+
+    if (trace_write_pending) {
+        trace_write_pending = false;
+        trace_write();
+    }
+}
+
+void trace_request_write(void)
+{
+    /* Called from signal handlers, so it can only set a flag for the
+     * next event to notice */
+    trace_write_pending = true;
+}
+
+void trace_write(void)
+{
+    FILE *fp;
+    size_t i, n, first;
+    uint64_t origin;
+    const char *sep = "";
+
+    if (!trace_on)
+        return;
+
+    fp = f_open(trace_filename, "w", false);
+    if (!fp)
+        return;
+
+    n = trace_wrapped ? TRACE_RING_EVENTS : trace_pos;
+    first = trace_wrapped ? trace_pos : 0;
+
+    /* Timestamps are written relative to the earliest event, in
+     * microseconds as the format expects */
+    origin = UINT64_MAX;
+    for (i = 0; i < n; i++)
+        if (trace_ring[i].start < origin)
+            origin = trace_ring[i].start;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (i = 0; i < n; i++) {
+        trace_event *ev = &trace_ring[(first + i) % TRACE_RING_EVENTS];
+        uint64_t ts = ev->start - origin, dur = ev->end - ev->start;
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                "\"ts\":%"PRIu64".%03u,\"dur\":%"PRIu64".%03u,"
+                "\"args\":{\"arg\":\"0x%"PRIxPTR"\"}}",
+                sep, ev->name, ts / 1000, (unsigned)(ts % 1000),
+                dur / 1000, (unsigned)(dur % 1000), ev->arg);
+        sep = ",";
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+#if defined PUTTY_PROBES && defined _WIN32
+/*
+ * The ETW provider behind the probeN macros in putty.h. It's
+ * registered the first time any probe fires, and never unregistered:
+ * the system does that when the process exits.
+ */
+/* {5bbd4aa2-8f6e-4c07-9b3e-1d5c2e7a6f41} */
+TRACELOGGING_DEFINE_PROVIDER(
+    putty_etw_provider, "PuTTY",
+    (0x5bbd4aa2, 0x8f6e, 0x4c07,
+     0x9b, 0x3e, 0x1d, 0x5c, 0x2e, 0x7a, 0x6f, 0x41));
+
+bool etw_probes_registered;
+
+void etw_probes_register(void)
+{
+    etw_probes_registered = true;
+    TraceLoggingRegister(putty_etw_provider);
+}
+#endif
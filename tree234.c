@@ -27,6 +27,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "defs.h"
@@ -46,10 +47,13 @@
 #endif
 
 typedef struct node234_Tag node234;
+typedef struct bpnode234 bpnode234;
 
 struct tree234_Tag {
     node234 *root;
     cmpfn234 cmp;
+    bool wide;                         /* use broot, not root */
+    bpnode234 *broot;
 };
 
 struct node234_Tag {
@@ -68,9 +72,453 @@ tree234 *newtree234(cmpfn234 cmp)
     LOG(("created tree %p\n", ret));
     ret->root = NULL;
     ret->cmp = cmp;
+    ret->wide = false;
+    ret->broot = NULL;
+    return ret;
+}
+
+/*
+ * Create a wide tree: see below.
+ */
+tree234 *newtree234_wide(cmpfn234 cmp)
+{
+    tree234 *ret = newtree234(cmp);
+    ret->wide = true;
     return ret;
 }
 
+/* ----------------------------------------------------------------------
+ * The wide variant: a counted B+tree.
+ *
+ * Every element lives in a leaf, and each leaf holds up to BP234_MAX
+ * of them in an array, so a lookup touches one node per level of a
+ * much shallower tree, and a walk along a leaf is a walk along an
+ * array. Inner nodes hold up to BP234_MAX children, the element
+ * count of each child's subtree (for index lookups), and the first
+ * element of each child's subtree (for comparisons). Keeping those
+ * exactly equal to the first element, rather than using an arbitrary
+ * separator, means an inner node never refers to an element that's
+ * been deleted from the tree and perhaps freed by the caller.
+ *
+ * Leaves are linked left to right, so that in-order iteration
+ * doesn't have to go back up the tree.
+ */
+
+#ifndef BP234_MAX
+#ifdef TEST
+#define BP234_MAX 4                    /* exercise splits and merges */
+#else
+#define BP234_MAX 32
+#endif
+#endif
+#define BP234_MIN (BP234_MAX / 2)
+
+typedef struct bpinner234 bpinner234;
+
+struct bpnode234 {
+    bpinner234 *parent;
+    bpnode234 *next;                   /* next leaf (leaves only) */
+    int n;                             /* number of elements or kids */
+    bool leaf;
+    /* One spare slot lets a node overflow briefly before it's split */
+    void *elems[BP234_MAX + 1];
+};
+
+struct bpinner234 {
+    bpnode234 node;                    /* must come first */
+    bpnode234 *kids[BP234_MAX + 1];
+    int counts[BP234_MAX + 1];
+};
+
+#define BPINNER(n) ((bpinner234 *)(n))
+
+static void bp_freenode(bpnode234 *n)
+{
+    int i;
+
+    if (!n)
+        return;
+    if (!n->leaf)
+        for (i = 0; i < n->n; i++)
+            bp_freenode(BPINNER(n)->kids[i]);
+    sfree(n);
+}
+
+static int bp_count(bpnode234 *n)
+{
+    int i, count = 0;
+
+    if (!n)
+        return 0;
+    if (n->leaf)
+        return n->n;
+    for (i = 0; i < n->n; i++)
+        count += BPINNER(n)->counts[i];
+    return count;
+}
+
+static int bp_kidindex(bpinner234 *p, bpnode234 *kid)
+{
+    int i;
+    for (i = 0; i < p->node.n; i++)
+        if (p->kids[i] == kid)
+            return i;
+    assert(false && "node not found in its parent");
+    return -1;
+}
+
+/*
+ * After the first element of n's subtree has changed, update the
+ * copies of it in the ancestors.
+ */
+static void bp_fixfirst(bpnode234 *n)
+{
+    while (n->parent) {
+        bpinner234 *p = n->parent;
+        int i = bp_kidindex(p, n);
+        p->node.elems[i] = n->elems[0];
+        if (i)
+            break;
+        n = &p->node;
+    }
+}
+
+/*
+ * Find the leaf containing a given index, and convert the index to a
+ * position in that leaf. The index must be in range.
+ */
+static bpnode234 *bp_findleaf(tree234 *t, int *index)
+{
+    bpnode234 *n = t->broot;
+
+    while (!n->leaf) {
+        bpinner234 *in = BPINNER(n);
+        int i;
+        for (i = 0; i < n->n - 1 && *index >= in->counts[i]; i++)
+            *index -= in->counts[i];
+        n = in->kids[i];
+    }
+    return n;
+}
+
+static void *bp_index(tree234 *t, int index)
+{
+    bpnode234 *n;
+
+    if (index < 0 || index >= bp_count(t->broot))
+        return NULL;
+    n = bp_findleaf(t, &index);
+    return n->elems[index];
+}
+
+/*
+ * Split an overflowing node into two, adding the new right half to
+ * the parent (making a new root if necessary). Returns the parent,
+ * which may now be overflowing in turn.
+ */
+static bpnode234 *bp_split(tree234 *t, bpnode234 *n)
+{
+    int h = n->n / 2, k;
+    bpnode234 *m;
+    bpinner234 *p;
+
+    if (n->leaf) {
+        m = snew(bpnode234);
+        m->next = n->next;
+        n->next = m;
+    } else {
+        bpinner234 *in = BPINNER(n), *im = snew(bpinner234);
+        for (k = h; k < n->n; k++) {
+            im->kids[k - h] = in->kids[k];
+            im->counts[k - h] = in->counts[k];
+            in->kids[k]->parent = im;
+        }
+        m = &im->node;
+        m->next = NULL;
+    }
+    m->leaf = n->leaf;
+    m->n = n->n - h;
+    memcpy(m->elems, n->elems + h, m->n * sizeof(*m->elems));
+    n->n = h;
+
+    if (!n->parent) {
+        p = snew(bpinner234);
+        p->node.parent = NULL;
+        p->node.next = NULL;
+        p->node.leaf = false;
+        p->node.n = 1;
+        p->node.elems[0] = n->elems[0];
+        p->kids[0] = n;
+        n->parent = p;
+        t->broot = &p->node;
+        k = 0;
+    } else {
+        p = n->parent;
+        k = bp_kidindex(p, n);
+    }
+
+    memmove(p->node.elems + k + 2, p->node.elems + k + 1,
+            (p->node.n - k - 1) * sizeof(*p->node.elems));
+    memmove(p->kids + k + 2, p->kids + k + 1,
+            (p->node.n - k - 1) * sizeof(*p->kids));
+    memmove(p->counts + k + 2, p->counts + k + 1,
+            (p->node.n - k - 1) * sizeof(*p->counts));
+    p->node.elems[k + 1] = m->elems[0];
+    p->kids[k + 1] = m;
+    p->counts[k] = bp_count(n);
+    p->counts[k + 1] = bp_count(m);
+    p->node.n++;
+    m->parent = p;
+
+    return &p->node;
+}
+
+static void bp_insert(tree234 *t, void *e, int index)
+{
+    bpnode234 *n;
+
+    if (!t->broot) {
+        n = snew(bpnode234);
+        n->parent = NULL;
+        n->next = NULL;
+        n->n = 0;
+        n->leaf = true;
+        t->broot = n;
+    }
+
+    n = t->broot;
+    while (!n->leaf) {
+        bpinner234 *in = BPINNER(n);
+        int i;
+        /* An index at a boundary goes on the end of the left kid */
+        for (i = 0; i < n->n - 1 && index > in->counts[i]; i++)
+            index -= in->counts[i];
+        in->counts[i]++;
+        n = in->kids[i];
+    }
+
+    memmove(n->elems + index + 1, n->elems + index,
+            (n->n - index) * sizeof(*n->elems));
+    n->elems[index] = e;
+    n->n++;
+    if (index == 0)
+        bp_fixfirst(n);
+
+    while (n->n > BP234_MAX)
+        n = bp_split(t, n);
+}
+
+static void *bp_add(tree234 *t, void *e)
+{
+    search234_state ss;
+
+    search234_start(&ss, t);
+    while (ss.element) {
+        int c = t->cmp(e, ss.element);
+        if (c == 0)
+            return ss.element;         /* already exists */
+        search234_step(&ss, c);
+    }
+    bp_insert(t, e, ss.index);
+    return e;
+}
+
+/*
+ * Move one entry between the adjacent kids lk and lk+1 of p: from the
+ * front of the right one to the end of the left one if dir < 0, or
+ * the other way if dir > 0.
+ */
+static void bp_move(bpinner234 *p, int lk, int dir)
+{
+    bpnode234 *l = p->kids[lk], *r = p->kids[lk + 1];
+    int amount = 1;
+
+    if (dir < 0) {
+        l->elems[l->n] = r->elems[0];
+        memmove(r->elems, r->elems + 1, (r->n - 1) * sizeof(*r->elems));
+        if (!l->leaf) {
+            bpinner234 *il = BPINNER(l), *ir = BPINNER(r);
+            il->kids[l->n] = ir->kids[0];
+            il->counts[l->n] = amount = ir->counts[0];
+            il->kids[l->n]->parent = il;
+            memmove(ir->kids, ir->kids + 1, (r->n - 1) * sizeof(*ir->kids));
+            memmove(ir->counts, ir->counts + 1,
+                    (r->n - 1) * sizeof(*ir->counts));
+        }
+        l->n++;
+        r->n--;
+        amount = -amount;
+    } else {
+        memmove(r->elems + 1, r->elems, r->n * sizeof(*r->elems));
+        r->elems[0] = l->elems[l->n - 1];
+        if (!l->leaf) {
+            bpinner234 *il = BPINNER(l), *ir = BPINNER(r);
+            memmove(ir->kids + 1, ir->kids, r->n * sizeof(*ir->kids));
+            memmove(ir->counts + 1, ir->counts, r->n * sizeof(*ir->counts));
+            ir->kids[0] = il->kids[l->n - 1];
+            ir->counts[0] = amount = il->counts[l->n - 1];
+            ir->kids[0]->parent = ir;
+        }
+        l->n--;
+        r->n++;
+    }
+
+    /* amount is now what the right kid gained */
+    p->counts[lk] -= amount;
+    p->counts[lk + 1] += amount;
+    p->node.elems[lk + 1] = r->elems[0];
+}
+
+/*
+ * Merge kid lk+1 of p into kid lk, and remove it from p.
+ */
+static void bp_merge(bpinner234 *p, int lk)
+{
+    bpnode234 *l = p->kids[lk], *r = p->kids[lk + 1];
+    int i;
+
+    memcpy(l->elems + l->n, r->elems, r->n * sizeof(*r->elems));
+    if (l->leaf) {
+        l->next = r->next;
+    } else {
+        bpinner234 *il = BPINNER(l), *ir = BPINNER(r);
+        for (i = 0; i < r->n; i++) {
+            il->kids[l->n + i] = ir->kids[i];
+            il->counts[l->n + i] = ir->counts[i];
+            ir->kids[i]->parent = il;
+        }
+    }
+    l->n += r->n;
+    sfree(r);
+
+    p->counts[lk] += p->counts[lk + 1];
+    memmove(p->node.elems + lk + 1, p->node.elems + lk + 2,
+            (p->node.n - lk - 2) * sizeof(*p->node.elems));
+    memmove(p->kids + lk + 1, p->kids + lk + 2,
+            (p->node.n - lk - 2) * sizeof(*p->kids));
+    memmove(p->counts + lk + 1, p->counts + lk + 2,
+            (p->node.n - lk - 2) * sizeof(*p->counts));
+    p->node.n--;
+}
+
+static void *bp_delete(tree234 *t, int index)
+{
+    bpnode234 *n = t->broot;
+    void *e;
+
+    while (!n->leaf) {
+        bpinner234 *in = BPINNER(n);
+        int i;
+        for (i = 0; i < n->n - 1 && index >= in->counts[i]; i++)
+            index -= in->counts[i];
+        in->counts[i]--;
+        n = in->kids[i];
+    }
+
+    e = n->elems[index];
+    memmove(n->elems + index, n->elems + index + 1,
+            (n->n - index - 1) * sizeof(*n->elems));
+    n->n--;
+    if (index == 0 && n->n > 0)
+        bp_fixfirst(n);
+
+    /*
+     * Now restore the minimum occupancy of every node but the root,
+     * by borrowing from a sibling if it can spare an entry, or
+     * merging with it if not (which might leave the parent short in
+     * turn).
+     */
+    while (n->parent && n->n < BP234_MIN) {
+        bpinner234 *p = n->parent;
+        int k = bp_kidindex(p, n);
+        int lk = (k > 0 ? k - 1 : 0);
+
+        if (p->kids[lk]->n + p->kids[lk + 1]->n > BP234_MAX) {
+            bp_move(p, lk, k > 0 ? +1 : -1);
+            break;
+        }
+        bp_merge(p, lk);
+        n = &p->node;
+    }
+
+    /* Shrink the tree from the top if the root is now redundant. */
+    n = t->broot;
+    if (n->leaf && n->n == 0) {
+        sfree(n);
+        t->broot = NULL;
+    } else if (!n->leaf && n->n == 1) {
+        t->broot = BPINNER(n)->kids[0];
+        t->broot->parent = NULL;
+        sfree(n);
+    }
+
+    return e;
+}
+
+/*
+ * search234 on the wide tree. _lo and _hi are the absolute bounds of
+ * the indices still in the running, [_lo,_hi). _node is the lowest
+ * node we know contains all of them, and _base is the index of the
+ * first element in its subtree. _last is the index we last returned.
+ */
+static void bp_search_step(search234_state *state, int direction)
+{
+    bpnode234 *n = state->_node;
+
+    if (direction > 0)
+        state->_lo = state->_last + 1;
+    else if (direction < 0)
+        state->_hi = state->_last;
+
+    if (state->_lo >= state->_hi) {
+        state->element = NULL;
+        state->index = state->_lo;
+        return;
+    }
+
+    while (!n->leaf) {
+        bpinner234 *in = BPINNER(n);
+        int i, start, a = -1, b = -1, descend = 0, descbase = state->_base;
+
+        /*
+         * Find the kids whose first elements are candidates, and
+         * the kid that would contain _lo.
+         */
+        for (i = 0, start = state->_base; i < n->n; i++) {
+            if (start <= state->_lo) {
+                descend = i;
+                descbase = start;
+            }
+            if (i > 0 && start >= state->_lo && start < state->_hi) {
+                if (a < 0)
+                    a = i;
+                b = i;
+            }
+            start += in->counts[i];
+        }
+
+        if (a >= 0) {
+            /* Offer the middle candidate */
+            int m = (a + b) / 2;
+            for (i = 0, start = state->_base; i < m; i++)
+                start += in->counts[i];
+            state->_node = n;
+            state->_last = state->index = start;
+            state->element = n->elems[m];
+            return;
+        }
+
+        /* Everything left is in one kid */
+        n = in->kids[descend];
+        state->_base = descbase;
+    }
+
+    state->_node = n;
+    state->_last = state->index = (state->_lo + state->_hi) / 2;
+    state->element = n->elems[state->index - state->_base];
+}
+
+
 /*
  * Free a 2-3-4 tree (not including freeing the elements).
  */
@@ -87,6 +535,7 @@ static void freenode234(node234 * n)
 
 void freetree234(tree234 * t)
 {
+    bp_freenode(t->broot);
     freenode234(t->root);
     sfree(t);
 }
@@ -125,7 +574,9 @@ static int elements234(node234 *n)
  */
 int count234(tree234 * t)
 {
-    if (t->root)
+    if (t->wide)
+        return bp_count(t->broot);
+    else if (t->root)
         return countnode234(t->root);
     else
         return 0;
@@ -469,6 +920,8 @@ void *add234(tree234 * t, void *e)
     if (!t->cmp)                       /* tree is unsorted */
         return NULL;
 
+    if (t->wide)
+        return bp_add(t, e);
     return add234_internal(t, e, -1);
 }
 void *addpos234(tree234 * t, void *e, int index)
@@ -477,6 +930,13 @@ void *addpos234(tree234 * t, void *e, int index)
         t->cmp)                        /* tree is sorted */
         return NULL;                   /* return failure */
 
+    if (t->wide) {
+        if (index > bp_count(t->broot))
+            return NULL;
+        bp_insert(t, e, index);
+        return e;
+    }
+
     return add234_internal(t, e, index);        /* this checks the upper bound */
 }
 
@@ -488,6 +948,9 @@ void *index234(tree234 * t, int index)
 {
     node234 *n;
 
+    if (t->wide)
+        return bp_index(t, index);
+
     if (!t->root)
         return NULL;                   /* tree is empty */
 
@@ -517,6 +980,92 @@ void *index234(tree234 * t, int index)
     return NULL;
 }
 
+/*
+ * In-order iteration. The cursor records a node and a position in
+ * it, so each step is usually just an increment; moving to the next
+ * leaf or back up the tree costs O(1) amortised over a whole walk.
+ */
+static void *iter234_set(iter234 *it, void *node, int pos)
+{
+    it->_node = node;
+    it->_pos = pos;
+    if (!node)
+        return NULL;
+    return (it->_tree->wide ? ((bpnode234 *)node)->elems[pos] :
+            ((node234 *)node)->elems[pos]);
+}
+
+void *iter234_at(iter234 *it, tree234 *t, int index)
+{
+    node234 *n;
+
+    it->_tree = t;
+    if (index < 0 || index >= count234(t))
+        return iter234_set(it, NULL, 0);
+
+    if (t->wide) {
+        bpnode234 *leaf = bp_findleaf(t, &index);
+        return iter234_set(it, leaf, index);
+    }
+
+    n = t->root;
+    while (true) {
+        int i;
+        for (i = 0; i < 3; i++) {
+            if (index < n->counts[i])
+                break;
+            index -= n->counts[i];
+            if (index-- == 0)
+                return iter234_set(it, n, i);
+        }
+        n = n->kids[i];
+    }
+}
+
+void *iter234_first(iter234 *it, tree234 *t)
+{
+    return iter234_at(it, t, 0);
+}
+
+void *iter234_next(iter234 *it)
+{
+    int i = it->_pos;
+
+    if (!it->_node)
+        return NULL;
+
+    if (it->_tree->wide) {
+        bpnode234 *leaf = it->_node;
+        if (i + 1 < leaf->n)
+            return iter234_set(it, leaf, i + 1);
+        return iter234_set(it, leaf->next, 0);
+    } else {
+        node234 *n = it->_node;
+
+        /* If there's a subtree after this element, go to its start */
+        if (n->kids[i + 1]) {
+            n = n->kids[i + 1];
+            while (n->kids[0])
+                n = n->kids[0];
+            return iter234_set(it, n, 0);
+        }
+
+        if (i + 1 < 3 && n->elems[i + 1])
+            return iter234_set(it, n, i + 1);
+
+        /* Otherwise, climb until we come up from a kid that has an
+         * element after it */
+        while (n->parent) {
+            node234 *p = n->parent;
+            for (i = 0; p->kids[i] != n; i++);
+            if (i < 3 && p->elems[i])
+                return iter234_set(it, p, i);
+            n = p;
+        }
+        return iter234_set(it, NULL, 0);
+    }
+}
+
 /*
  * Find an element e in a sorted 2-3-4 tree t. Returns NULL if not
  * found. e is always passed as the first argument to cmp, so cmp
@@ -614,6 +1163,14 @@ void *findpos234(tree234 * t, void *e, cmpfn234 cmp, int *index)
 
 void search234_start(search234_state *state, tree234 *t)
 {
+    state->_tree = t;
+    if (t->wide) {
+        state->_node = t->broot;
+        state->_base = state->_lo = 0;
+        state->_hi = bp_count(t->broot);
+        bp_search_step(state, 0);
+        return;
+    }
     state->_node = t->root;
     state->_base = 0; /* index of first element in this node's subtree */
     state->_last = -1; /* indicate that this node is not previously visted */
@@ -624,6 +1181,11 @@ void search234_step(search234_state *state, int direction)
     node234 *node = state->_node;
     int i;
 
+    if (state->_tree->wide) {
+        bp_search_step(state, direction);
+        return;
+    }
+
     if (!node) {
         state->element = NULL;
         state->index = 0;
@@ -1027,8 +1589,10 @@ static void *delpos234_internal(tree234 * t, int index)
 }
 void *delpos234(tree234 * t, int index)
 {
-    if (index < 0 || index >= countnode234(t->root))
+    if (index < 0 || index >= count234(t))
         return NULL;
+    if (t->wide)
+        return bp_delete(t, index);
     return delpos234_internal(t, index);
 }
 void *del234(tree234 * t, void *e)
@@ -1036,6 +1600,8 @@ void *del234(tree234 * t, void *e)
     int index;
     if (!findrelpos234(t, e, NULL, REL234_EQ, &index))
         return NULL;                   /* it wasn't in there anyway */
+    if (t->wide)
+        return bp_delete(t, index);
     return delpos234_internal(t, index);        /* it's there; delete it. */
 }
 
@@ -1209,10 +1775,65 @@ int chknode(chkctx * ctx, int level, node234 * node,
     return count;
 }
 
+/*
+ * The equivalent checks for a wide tree:
+ *  - every kid's parent pointer points back to its parent
+ *  - tree has the same depth everywhere
+ *  - every node but the root has between BP234_MIN and BP234_MAX
+ *    entries, and the root has at least one (two if it's inner)
+ *  - subtree element counts are accurate
+ *  - each key in an inner node is the first element of that kid
+ *  - the leaves' next pointers visit them in order
+ */
+int bpchknode(chkctx *ctx, int level, bpnode234 *node, bpnode234 **leaf)
+{
+    int i, count = 0;
+
+    if (node->n > BP234_MAX)
+        error("node %p: %d entries, maximum %d", node, node->n, BP234_MAX);
+    if (node->parent ? node->n < BP234_MIN :
+        node->n < (node->leaf ? 1 : 2))
+        error("node %p: only %d entries", node, node->n);
+
+    if (node->leaf) {
+        if (ctx->treedepth < 0)
+            ctx->treedepth = level;
+        else if (ctx->treedepth != level)
+            error("node %p: leaf at depth %d, previously seen depth %d",
+                  node, level, ctx->treedepth);
+        if (*leaf && (*leaf)->next != node)
+            error("leaf %p: next is %p, expected %p",
+                  *leaf, (*leaf)->next, node);
+        *leaf = node;
+        ctx->elemcount += node->n;
+        return node->n;
+    }
+
+    for (i = 0; i < node->n; i++) {
+        bpinner234 *in = BPINNER(node);
+        bpnode234 *kid = in->kids[i];
+        int subcount;
+
+        if (kid->parent != in)
+            error("node %p kid %d: parent ptr is %p expected %p",
+                  node, i, kid->parent, node);
+        if (node->elems[i] != kid->elems[0])
+            error("node %p key %d: is %p, kid's first element is %p",
+                  node, i, node->elems[i], kid->elems[0]);
+        subcount = bpchknode(ctx, level + 1, kid, leaf);
+        if (in->counts[i] != subcount)
+            error("node %p kid %d: count says %d, subtree really has %d",
+                  node, i, in->counts[i], subcount);
+        count += subcount;
+    }
+    return count;
+}
+
 void verify(void)
 {
     chkctx ctx[1];
-    int i;
+    iter234 it;
+    int i, j;
     void *p;
 
     ctx->treedepth = -1;                /* depth unknown yet */
@@ -1220,6 +1841,14 @@ void verify(void)
     /*
      * Verify validity of tree properties.
      */
+    if (tree->broot) {
+        bpnode234 *leaf = NULL;
+        if (tree->broot->parent != NULL)
+            error("root->parent is %p should be null", tree->broot->parent);
+        bpchknode(ctx, 0, tree->broot, &leaf);
+        if (leaf->next != NULL)
+            error("last leaf %p: next is %p should be null", leaf, leaf->next);
+    }
     if (tree->root) {
         if (tree->root->parent != NULL)
             error("root->parent is %p should be null", tree->root->parent);
@@ -1243,6 +1872,25 @@ void verify(void)
     if (i < arraylen) {
         error("enum gave only %d elements, array has %d", i, arraylen);
     }
+    /*
+     * Walk the tree with a cursor, from every index, and ensure that
+     * matches too.
+     */
+    if (iter234_first(&it, tree) != (arraylen ? array[0] : NULL))
+        error("iter234_first gave the wrong element");
+    for (j = 0; j <= arraylen; j++) {
+        for (i = j, p = iter234_at(&it, tree, j); p;
+             i++, p = iter234_next(&it)) {
+            if (i >= arraylen)
+                error("cursor from %d passed end of array", j);
+            else if (array[i] != p)
+                error("cursor from %d at position %d: array says %s, "
+                      "tree says %s", j, i, array[i], p);
+        }
+        if (i < arraylen)
+            error("cursor from %d stopped at %d, array has %d",
+                  j, i, arraylen);
+    }
     i = count234(tree);
     if (ctx->elemcount != i) {
         error("tree really contains %d elements, count234 gave %d",
@@ -1536,17 +2184,17 @@ void searchtest(void)
     searchtest_recurse(ss, 0, n, expected, directionbuf, directionbuf);
 }
 
-int main(void)
+void runtests(tree234 *(*newtree)(cmpfn234), unsigned *seedp)
 {
     int in[NSTR];
     int i, j, k;
-    unsigned seed = 0;
+    unsigned seed = *seedp;
 
     for (i = 0; i < NSTR; i++)
         in[i] = 0;
     array = NULL;
     arraylen = arraysize = 0;
-    tree = newtree234(mycmp);
+    tree = newtree(mycmp);
     cmp = mycmp;
 
     verify();
@@ -1583,7 +2231,7 @@ int main(void)
      * completeness we'll use it to tear down our unsorted tree
      * once we've built it.
      */
-    tree = newtree234(NULL);
+    tree = newtree(NULL);
     cmp = NULL;
     verify();
     for (i = 0; i < 1000; i++) {
@@ -1604,6 +2252,20 @@ int main(void)
         delpostest(j);
     }
 
+    freetree234(tree);
+    sfree(array);
+    *seedp = seed;
+}
+
+int main(void)
+{
+    unsigned seed = 0;
+
+    printf("testing 2-3-4 trees\n");
+    runtests(newtree234, &seed);
+    printf("testing wide trees\n");
+    runtests(newtree234_wide, &seed);
+
     printf("%d errors found\n", n_errors);
     return (n_errors != 0);
 }
@@ -42,6 +42,16 @@ typedef int (*cmpfn234) (void *, void *);
  */
 tree234 *newtree234(cmpfn234 cmp);
 
+/*
+ * Create a wide tree: a B+tree with many elements per node, which
+ * supports all the same operations as a 2-3-4 tree and can be used
+ * anywhere one is. It's shallower, and keeps neighbouring elements
+ * together in memory, so it's faster for large trees that are
+ * searched or indexed often; but each node is much bigger, so it's
+ * a waste of memory for trees that are usually small.
+ */
+tree234 *newtree234_wide(cmpfn234 cmp);
+
 /*
  * Free a 2-3-4 tree (not including freeing the elements).
  */
@@ -83,6 +93,34 @@ void *addpos234(tree234 * t, void *e, int index);
  */
 void *index234(tree234 * t, int index);
 
+/*
+ * A cheaper way to walk a tree in order. iter234_first returns the
+ * first element of the tree (or NULL if it's empty), and iter234_at
+ * the element at a given index (NULL if out of range); after either,
+ * each call to iter234_next returns the element after the previous
+ * one, and NULL once the end of the tree is reached:
+ *
+ *   iter234 it;
+ *   for (p = iter234_first(&it, tree); p; p = iter234_next(&it))
+ *       consume(p);
+ *
+ * Each step costs O(1) amortised, where index234 costs O(log n).
+ *
+ * The tree must not be modified while a cursor is in use: adding or
+ * deleting anything invalidates every cursor on that tree. (Modifying
+ * the elements themselves, without changing their order, is fine.)
+ *
+ * As with search234_state, the fields are private.
+ */
+typedef struct iter234 {
+    tree234 *_tree;
+    void *_node;
+    int _pos;
+} iter234;
+void *iter234_first(iter234 *it, tree234 *t);
+void *iter234_at(iter234 *it, tree234 *t, int index);
+void *iter234_next(iter234 *it);
+
 /*
  * Find an element e in a sorted 2-3-4 tree t. Returns NULL if not
  * found. e is always passed as the first argument to cmp, so cmp
@@ -163,6 +201,7 @@ typedef struct search234_state {
     int index;
     int _lo, _hi, _last, _base;
     void *_node;
+    tree234 *_tree;
 } search234_state;
 void search234_start(search234_state *state, tree234 *t);
 void search234_step(search234_state *state, int direction);
@@ -3961,6 +3961,159 @@ void showeventlog(eventlog_stuff *es, void *parentwin)
                      G_CALLBACK(eventlog_selection_clear), es);
 }
 
+struct find_stuff {
+    GtkWidget *window;
+    struct controlbox *findbox;
+    struct Shortcuts scs;
+    struct dlgparam dp;
+    union control *editctrl;
+    Terminal *term;
+};
+
+static void find_destroy(GtkWidget *widget, gpointer data)
+{
+    find_stuff *fs = (find_stuff *)data;
+
+    fs->window = NULL;
+    dlg_cleanup(&fs->dp);
+    ctrl_free_box(fs->findbox);
+}
+
+static void find_do_search(find_stuff *fs, bool backwards,
+                           bool include_current)
+{
+    char *text = dlg_editbox_get(fs->editctrl, &fs->dp);
+    wchar_t *wtext = dup_mb_to_wc(CP_UTF8, 0, text);
+
+    if (*wtext && !term_find(fs->term, wtext, backwards, include_current))
+        dlg_beep(&fs->dp);
+
+    sfree(wtext);
+    sfree(text);
+}
+
+static void find_edit_handler(union control *ctrl, dlgparam *dp,
+                              void *data, int event)
+{
+    find_stuff *fs = (find_stuff *)data;
+
+    /*
+     * Search incrementally as the user types, so that the match
+     * under the cursor is extended in place where possible rather
+     * than jumping to the next occurrence.
+     */
+    if (event == EVENT_VALCHANGE)
+        find_do_search(fs, true, true);
+}
+
+static void find_button_handler(union control *ctrl, dlgparam *dp,
+                                void *data, int event)
+{
+    find_stuff *fs = (find_stuff *)data;
+
+    if (event == EVENT_ACTION)
+        find_do_search(fs, ctrl->generic.context.i != 0, false);
+}
+
+static void find_close_handler(union control *ctrl, dlgparam *dp,
+                               void *data, int event)
+{
+    if (event == EVENT_ACTION)
+        dlg_end(dp, 0);
+}
+
+void showfinddlg(find_stuff *fs, void *parentwin, Terminal *term)
+{
+    GtkWidget *window, *w0, *w1;
+    GtkWidget *parent = GTK_WIDGET(parentwin);
+    struct controlset *s0, *s1;
+    union control *c;
+    int index;
+    char *title;
+
+    fs->term = term;
+
+    if (fs->window) {
+        gtk_widget_grab_focus(fs->window);
+        return;
+    }
+
+    dlg_init(&fs->dp);
+
+    for (index = 0; index < lenof(fs->scs.sc); index++) {
+        fs->scs.sc[index].action = SHORTCUT_EMPTY;
+    }
+
+    fs->findbox = ctrl_new_box();
+
+    s0 = ctrl_getset(fs->findbox, "", "", "");
+    ctrl_columns(s0, 3, 33, 34, 33);
+    c = ctrl_pushbutton(s0, "Find Previous", 'p', HELPCTX(no_help),
+                        find_button_handler, I(1));
+    c->button.column = 0;
+    c->button.isdefault = true;
+    c = ctrl_pushbutton(s0, "Find Next", 'n', HELPCTX(no_help),
+                        find_button_handler, I(0));
+    c->button.column = 1;
+    c = ctrl_pushbutton(s0, "Close", 'c', HELPCTX(no_help),
+                        find_close_handler, P(NULL));
+    c->button.column = 2;
+    c->button.iscancel = true;
+
+    s1 = ctrl_getset(fs->findbox, "x", "", "");
+    fs->editctrl = ctrl_editbox(s1, "Find:", 'f', 100, HELPCTX(no_help),
+                                find_edit_handler, P(NULL), P(NULL));
+
+    fs->window = window = our_dialog_new();
+    title = dupcat(appname, " Find");
+    gtk_window_set_title(GTK_WINDOW(window), title);
+    sfree(title);
+    w0 = layout_ctrls(&fs->dp, NULL, &fs->scs, s0, GTK_WINDOW(window));
+    our_dialog_set_action_area(GTK_WINDOW(window), w0);
+    gtk_widget_show(w0);
+    w1 = layout_ctrls(&fs->dp, NULL, &fs->scs, s1, GTK_WINDOW(window));
+    gtk_container_set_border_width(GTK_CONTAINER(w1), 10);
+    gtk_widget_set_size_request(w1, 20 + string_width
+                                ("FIND TEXT BOX IS A REASONABLE WIDTH"), -1);
+    our_dialog_add_to_content_area(GTK_WINDOW(window), w1, true, true, 0);
+    gtk_widget_show(w1);
+
+    fs->dp.data = fs;
+    fs->dp.shortcuts = &fs->scs;
+    fs->dp.lastfocus = NULL;
+    fs->dp.retval = 0;
+    fs->dp.window = window;
+
+    dlg_refresh(NULL, &fs->dp);
+
+    if (parent) {
+        set_transient_window_pos(parent, window);
+        gtk_window_set_transient_for(GTK_WINDOW(window),
+                                     GTK_WINDOW(parent));
+    } else
+        gtk_window_set_position(GTK_WINDOW(window), GTK_WIN_POS_CENTER);
+    gtk_widget_show(window);
+
+    g_signal_connect(G_OBJECT(window), "destroy",
+                     G_CALLBACK(find_destroy), fs);
+    g_signal_connect(G_OBJECT(window), "key_press_event",
+                     G_CALLBACK(win_key_press), &fs->dp);
+}
+
+find_stuff *findstuff_new(void)
+{
+    find_stuff *fs = snew(find_stuff);
+    memset(fs, 0, sizeof(*fs));
+    return fs;
+}
+
+void findstuff_free(find_stuff *fs)
+{
+    if (fs->window)
+        gtk_widget_destroy(fs->window);
+    sfree(fs);
+}
+
 eventlog_stuff *eventlogstuff_new(void)
 {
     eventlog_stuff *es = snew(eventlog_stuff);
@@ -1327,6 +1327,19 @@ static char *pangofont_scale_fontname(GtkWidget *widget, const char *name,
                                       int size);
 static char *pangofont_size_increment(unifont *font, int increment);
 
+/*
+ * A laid-out run of text, kept so that redrawing the same string
+ * again doesn't make Pango itemise and shape it all over again.
+ */
+#define PANGO_LAYOUT_CACHE_SIZE 1024     /* must be a power of 2 */
+struct pango_cached_layout {
+    char *text;                        /* NULL if this slot is empty */
+    int textlen;
+    bool bolddesc;                     /* laid out with pfont->bolddesc */
+    PangoLayout *layout;
+    PangoRectangle rect;               /* pixel extents of the layout */
+};
+
 struct pangofont {
     /*
      * Pango objects.
@@ -1334,9 +1347,11 @@ struct pangofont {
     PangoFontDescription *desc;
     PangoFontset *fset;
     /*
-     * The containing widget.
+     * Our own context, made from the widget we were created for.
+     * (Not the widget's own, because multifont_create may share us
+     * with other windows, and the widget may go away first.)
      */
-    GtkWidget *widget;
+    PangoContext *pctx;
     /*
      * Data passed in to unifont_create().
      */
@@ -1349,6 +1364,20 @@ struct pangofont {
      */
     int *widthcache;
     unsigned nwidthcache;
+    /*
+     * Font description used for bold text if the font isn't bold
+     * already and we're not doing shadow bolding. NULL until first
+     * needed.
+     */
+    PangoFontDescription *bolddesc;
+    /*
+     * Hash table of laid-out text runs, indexed by a hash of the
+     * UTF-8 text, with a new run simply evicting whatever was in its
+     * slot. NULL until first needed. All the layouts belong to
+     * layoutctx, and are thrown away if the context changes.
+     */
+    struct pango_cached_layout *layoutcache;
+    PangoContext *layoutctx;
 
     struct unifont u;
 };
@@ -1475,12 +1504,15 @@ static unifont *pangofont_create_internal(GtkWidget *widget,
     pfont->u.public_charset = CS_UTF8;
     pfont->desc = desc;
     pfont->fset = fset;
-    pfont->widget = widget;
+    pfont->pctx = gtk_widget_create_pango_context(widget);
     pfont->bold = bold;
     pfont->shadowoffset = shadowoffset;
     pfont->shadowalways = shadowalways;
     pfont->widthcache = NULL;
     pfont->nwidthcache = 0;
+    pfont->bolddesc = NULL;
+    pfont->layoutcache = NULL;
+    pfont->layoutctx = NULL;
 
     pango_font_metrics_unref(metrics);
 
@@ -1530,12 +1562,32 @@ static unifont *pangofont_create_fallback(GtkWidget *widget, int height,
                                      shadowoffset, shadowalways);
 }
 
+static void pangofont_free_layout_cache(struct pangofont *pfont)
+{
+    if (pfont->layoutcache) {
+        for (int i = 0; i < PANGO_LAYOUT_CACHE_SIZE; i++) {
+            struct pango_cached_layout *cl = &pfont->layoutcache[i];
+            if (cl->text) {
+                sfree(cl->text);
+                g_object_unref(cl->layout);
+            }
+        }
+        sfree(pfont->layoutcache);
+        pfont->layoutcache = NULL;
+    }
+    pfont->layoutctx = NULL;
+}
+
 static void pangofont_destroy(unifont *font)
 {
     struct pangofont *pfont = container_of(font, struct pangofont, u);
+    pangofont_free_layout_cache(pfont);
     pango_font_description_free(pfont->desc);
+    if (pfont->bolddesc)
+        pango_font_description_free(pfont->bolddesc);
     sfree(pfont->widthcache);
     g_object_unref(pfont->fset);
+    g_object_unref(pfont->pctx);
     sfree(pfont);
 }
 
@@ -1568,6 +1620,53 @@ static int pangofont_char_width(PangoLayout *layout, struct pangofont *pfont,
     return pfont->widthcache[uchr];
 }
 
+/*
+ * Return a laid-out PangoLayout for a run of UTF-8 text, with its
+ * pixel extents, reusing a cached one if we've drawn the same run
+ * before.
+ */
+static struct pango_cached_layout *pangofont_get_layout(
+    struct pangofont *pfont, PangoContext *ctx, bool bolddesc,
+    const char *text, int textlen)
+{
+    if (ctx != pfont->layoutctx) {
+        pangofont_free_layout_cache(pfont);
+        pfont->layoutctx = ctx;
+    }
+    if (!pfont->layoutcache) {
+        pfont->layoutcache = snewn(PANGO_LAYOUT_CACHE_SIZE,
+                                   struct pango_cached_layout);
+        for (int i = 0; i < PANGO_LAYOUT_CACHE_SIZE; i++)
+            pfont->layoutcache[i].text = NULL;
+    }
+
+    /* FNV-1a */
+    unsigned hash = 2166136261U ^ bolddesc;
+    for (int i = 0; i < textlen; i++)
+        hash = (hash ^ (unsigned char)text[i]) * 16777619U;
+    struct pango_cached_layout *cl =
+        &pfont->layoutcache[hash & (PANGO_LAYOUT_CACHE_SIZE - 1)];
+
+    if (cl->text && cl->textlen == textlen && cl->bolddesc == bolddesc &&
+        !memcmp(cl->text, text, textlen))
+        return cl;
+
+    if (cl->text) {
+        sfree(cl->text);
+        g_object_unref(cl->layout);
+    }
+    cl->text = snewn(textlen, char);
+    memcpy(cl->text, text, textlen);
+    cl->textlen = textlen;
+    cl->bolddesc = bolddesc;
+    cl->layout = pango_layout_new(ctx);
+    pango_layout_set_font_description(
+        cl->layout, bolddesc ? pfont->bolddesc : pfont->desc);
+    pango_layout_set_text(cl->layout, text, textlen);
+    pango_layout_get_pixel_extents(cl->layout, NULL, &cl->rect);
+    return cl;
+}
+
 static bool pangofont_has_glyph(unifont *font, wchar_t glyph)
 {
     /* Pango implements font fallback, so assume it has everything */
@@ -1597,11 +1696,11 @@ static void pangofont_draw_internal(unifont_drawctx *ctx, unifont *font,
                                     int cellwidth, bool combining)
 {
     struct pangofont *pfont = container_of(font, struct pangofont, u);
+    PangoContext *pctx;
     PangoLayout *layout;
-    PangoRectangle rect;
     char *utfstring, *utfptr;
     int utflen;
-    bool shadowbold = false;
+    bool shadowbold = false, bolddesc = false;
     void (*draw_layout)(unifont_drawctx *ctx,
                         gint x, gint y, PangoLayout *layout) = NULL;
 
@@ -1622,19 +1721,29 @@ static void pangofont_draw_internal(unifont_drawctx *ctx, unifont *font,
 
     y -= pfont->u.ascent;
 
-    layout = pango_layout_new(gtk_widget_get_pango_context(pfont->widget));
-    pango_layout_set_font_description(layout, pfont->desc);
+    pctx = pfont->pctx;
     if (bold && !pfont->bold) {
         if (pfont->shadowalways)
             shadowbold = true;
         else {
-            PangoFontDescription *desc2 =
-                pango_font_description_copy_static(pfont->desc);
-            pango_font_description_set_weight(desc2, PANGO_WEIGHT_BOLD);
-            pango_layout_set_font_description(layout, desc2);
+            if (!pfont->bolddesc) {
+                pfont->bolddesc = pango_font_description_copy(pfont->desc);
+                pango_font_description_set_weight(pfont->bolddesc,
+                                                  PANGO_WEIGHT_BOLD);
+            }
+            bolddesc = true;
         }
     }
 
+    /*
+     * This layout is only used for measuring the widths of
+     * characters we haven't seen before; the text we actually draw
+     * comes from the layout cache.
+     */
+    layout = pango_layout_new(pctx);
+    pango_layout_set_font_description(
+        layout, bolddesc ? pfont->bolddesc : pfont->desc);
+
     /*
      * Pango always expects UTF-8, so convert the input wide character
      * string to UTF-8.
@@ -1726,16 +1835,21 @@ static void pangofont_draw_internal(unifont_drawctx *ctx, unifont *font,
             }
         }
 
-        pango_layout_set_text(layout, utfptr, clen);
-        pango_layout_get_pixel_extents(layout, NULL, &rect);
+        {
+            struct pango_cached_layout *cl = pangofont_get_layout(
+                pfont, pctx, bolddesc, utfptr, clen);
 
-        draw_layout(ctx,
-                    x + (n*cellwidth - rect.width)/2,
-                    y + (pfont->u.height - rect.height)/2, layout);
-        if (shadowbold)
             draw_layout(ctx,
-                        x + (n*cellwidth - rect.width)/2 + pfont->shadowoffset,
-                        y + (pfont->u.height - rect.height)/2, layout);
+                        x + (n*cellwidth - cl->rect.width)/2,
+                        y + (pfont->u.height - cl->rect.height)/2,
+                        cl->layout);
+            if (shadowbold)
+                draw_layout(ctx,
+                            x + (n*cellwidth - cl->rect.width)/2 +
+                            pfont->shadowoffset,
+                            y + (pfont->u.height - cl->rect.height)/2,
+                            cl->layout);
+        }
 
         utflen -= clen;
         utfptr += clen;
@@ -2189,9 +2303,25 @@ struct multifont {
     unifont *main;
     unifont *fallback;
 
+    /*
+     * In an application hosting several terminal windows (see
+     * gtkapp.c), each window would otherwise load its own copy of
+     * the same fonts and fill its own glyph and layout caches. So
+     * multifonts are shared, keyed on the arguments they were made
+     * from, and only destroyed when the last user lets go.
+     */
+    char *name;
+    bool wide, bold, shadowalways;
+    int shadowoffset;
+    void *screen;
+    int refcount;
+    struct multifont *cachenext;
+
     struct unifont u;
 };
 
+static struct multifont *multifont_cache;
+
 static const UnifontVtable multifont_vtable = {
     .create = NULL, /* creation is done specially */
     .create_fallback = NULL,
@@ -2213,6 +2343,20 @@ unifont *multifont_create(GtkWidget *widget, const char *name,
     int i;
     unifont *font, *fallback;
     struct multifont *mfont;
+    void *screen = NULL;
+
+#if GTK_CHECK_VERSION(2,2,0)
+    screen = gtk_widget_get_screen(widget);
+#endif
+
+    for (mfont = multifont_cache; mfont; mfont = mfont->cachenext) {
+        if (!strcmp(mfont->name, name) && mfont->wide == wide &&
+            mfont->bold == bold && mfont->shadowoffset == shadowoffset &&
+            mfont->shadowalways == shadowalways && mfont->screen == screen) {
+            mfont->refcount++;
+            return &mfont->u;
+        }
+    }
 
     font = unifont_create(widget, name, wide, bold,
                           shadowoffset, shadowalways);
@@ -2248,12 +2392,31 @@ unifont *multifont_create(GtkWidget *widget, const char *name,
     mfont->main = font;
     mfont->fallback = fallback;
 
+    mfont->name = dupstr(name);
+    mfont->wide = wide;
+    mfont->bold = bold;
+    mfont->shadowoffset = shadowoffset;
+    mfont->shadowalways = shadowalways;
+    mfont->screen = screen;
+    mfont->refcount = 1;
+    mfont->cachenext = multifont_cache;
+    multifont_cache = mfont;
+
     return &mfont->u;
 }
 
 static void multifont_destroy(unifont *font)
 {
     struct multifont *mfont = container_of(font, struct multifont, u);
+    struct multifont **prev;
+
+    if (--mfont->refcount > 0)
+        return;
+
+    for (prev = &multifont_cache; *prev != mfont; prev = &(*prev)->cachenext);
+    *prev = mfont->cachenext;
+
+    sfree(mfont->name);
     unifont_destroy(mfont->main);
     if (mfont->fallback)
         unifont_destroy(mfont->fallback);
@@ -168,6 +168,7 @@ struct GtkFrontend {
     struct unicode_data ucsdata;
     Conf *conf;
     eventlog_stuff *eventlogstuff;
+    find_stuff *findstuff;
     guint32 input_event_time; /* Timestamp of the most recent input event. */
     GtkWidget *dialogs[DIALOG_SLOT_LIMIT];
 #if GTK_CHECK_VERSION(3,4,0)
@@ -179,6 +180,12 @@ struct GtkFrontend {
     int cursor_type;
     int drawtype;
     int meta_mod_mask;
+    /*
+     * Area drawn on since it was last copied to the window (see
+     * draw_update).
+     */
+    bool update_pending;
+    int update_x, update_y, update_w, update_h;
 #ifdef OSX_META_KEY_CONFIG
     int system_mod_mask;
 #endif
@@ -377,6 +384,7 @@ static bool gtk_seat_get_cursor_position(Seat *seat, int *x, int *y);
 
 static const SeatVtable gtk_seat_vt = {
     .output = gtk_seat_output,
+    .sent = nullseat_sent,
     .eof = gtk_seat_eof,
     .get_userpass_input = gtk_seat_get_userpass_input,
     .notify_remote_exit = gtk_seat_notify_remote_exit,
@@ -714,6 +722,7 @@ static void show_mouseptr(GtkFrontend *inst, bool show)
 }
 
 static void draw_backing_rect(GtkFrontend *inst);
+static void draw_update_flush(GtkFrontend *inst);
 
 static void drawing_area_setup(GtkFrontend *inst, int width, int height)
 {
@@ -2331,6 +2340,11 @@ static void delete_inst(GtkFrontend *inst)
             inst->dialogs[dialog_slot] = NULL;
         }
     }
+    if (inst->findstuff) {
+        /* must go before term_free, since it refers to the terminal */
+        findstuff_free(inst->findstuff);
+        inst->findstuff = NULL;
+    }
     if (inst->window) {
         gtk_widget_destroy(inst->window);
         inst->window = NULL;
@@ -3429,6 +3443,7 @@ static bool gtkwin_setup_draw_ctx(TermWin *tw)
 static void gtkwin_free_draw_ctx(TermWin *tw)
 {
     GtkFrontend *inst = container_of(tw, GtkFrontend, termwin);
+    draw_update_flush(inst);
 #ifdef DRAW_TEXT_GDK
     if (inst->uctx.type == DRAWTYPE_GDK) {
         gdk_gc_unref(inst->uctx.u.gdk.gc);
@@ -3442,7 +3457,8 @@ static void gtkwin_free_draw_ctx(TermWin *tw)
 }
 
 
-static void draw_update(GtkFrontend *inst, int x, int y, int w, int h)
+static void draw_update_really(GtkFrontend *inst,
+                               int x, int y, int w, int h)
 {
 #if defined DRAW_TEXT_CAIRO && !defined NO_BACKING_PIXMAPS
     if (inst->uctx.type == DRAWTYPE_CAIRO) {
@@ -3471,6 +3487,51 @@ static void draw_update(GtkFrontend *inst, int x, int y, int w, int h)
     gtk_widget_queue_draw_area(inst->area, x, y, w, h);
 }
 
+static void draw_update_flush(GtkFrontend *inst)
+{
+    if (inst->update_pending) {
+        draw_update_really(inst, inst->update_x, inst->update_y,
+                           inst->update_w, inst->update_h);
+        inst->update_pending = false;
+    }
+}
+
+/*
+ * Record that an area of the drawing surface has changed and needs
+ * copying to the window. Each copy costs a Cairo context and an
+ * expose rectangle, and the terminal tends to draw a row as many
+ * short adjacent runs (and a full repaint as a stack of whole rows),
+ * so we merge each update into the pending one when the two are
+ * side by side in the same row or exactly stacked, and only pass
+ * the combined area on when something else comes along or the
+ * drawing context is freed.
+ */
+static void draw_update(GtkFrontend *inst, int x, int y, int w, int h)
+{
+    if (inst->update_pending) {
+        if (y == inst->update_y && h == inst->update_h &&
+            x <= inst->update_x + inst->update_w &&
+            x + w >= inst->update_x) {
+            int x1 = max(x + w, inst->update_x + inst->update_w);
+            inst->update_x = min(x, inst->update_x);
+            inst->update_w = x1 - inst->update_x;
+            return;
+        }
+        if (x == inst->update_x && w == inst->update_w &&
+            y == inst->update_y + inst->update_h) {
+            inst->update_h += h;
+            return;
+        }
+        draw_update_flush(inst);
+    }
+
+    inst->update_pending = true;
+    inst->update_x = x;
+    inst->update_y = y;
+    inst->update_w = w;
+    inst->update_h = h;
+}
+
 #ifdef DRAW_TEXT_CAIRO
 static void cairo_set_source_rgb_dim(cairo_t *cr, double r, double g, double b,
                                      bool dim)
@@ -4182,6 +4243,50 @@ static void gtkwin_draw_trust_sigil(TermWin *tw, int cx, int cy)
     draw_update(inst, x, y, w, h);
 }
 
+static bool gtkwin_scroll_rect(TermWin *tw, int topline, int botline,
+                               int lines)
+{
+    GtkFrontend *inst = container_of(tw, GtkFrontend, termwin);
+    int x = inst->window_border, w = inst->width * inst->font_width;
+    int y = topline * inst->font_height + inst->window_border;
+    int dy = lines * inst->font_height;
+    int h = (botline - topline + 1) * inst->font_height - abs(dy);
+    int srcy = dy > 0 ? y + dy : y, dsty = dy > 0 ? y : y - dy;
+
+#ifdef DRAW_TEXT_GDK
+    if (inst->uctx.type == DRAWTYPE_GDK) {
+        /* The X server copes with the source and destination
+         * overlapping, as draw_stretch_after already relies on */
+        gdk_draw_pixmap(inst->uctx.u.gdk.target, inst->uctx.u.gdk.gc,
+                        inst->uctx.u.gdk.target,
+                        x, srcy, x, dsty, w, h);
+    }
+#endif
+#ifdef DRAW_TEXT_CAIRO
+    if (inst->uctx.type == DRAWTYPE_CAIRO) {
+        /*
+         * Cairo doesn't promise anything about painting a surface
+         * onto itself, so go via a group (an intermediate surface
+         * the size of the clip). This works in device pixels, so we
+         * use a fresh context without the scaling in uctx.
+         */
+        int s = inst->scale;
+        cairo_t *cr = cairo_create(inst->surface);
+        cairo_rectangle(cr, x * s, dsty * s, w * s, h * s);
+        cairo_clip(cr);
+        cairo_push_group(cr);
+        cairo_set_source_surface(cr, inst->surface, 0, (dsty - srcy) * s);
+        cairo_paint(cr);
+        cairo_pop_group_to_source(cr);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+    }
+#endif
+
+    draw_update(inst, x, dsty, w, h);
+    return true;
+}
+
 GdkCursor *make_mouse_ptr(GtkFrontend *inst, int cursor_val)
 {
     if (cursor_val == -1) {
@@ -4516,6 +4621,12 @@ void copy_all_menuitem(GtkMenuItem *item, gpointer data)
     term_copyall(inst->term, clips, lenof(clips));
 }
 
+void find_menuitem(GtkMenuItem *item, gpointer data)
+{
+    GtkFrontend *inst = (GtkFrontend *)data;
+    showfinddlg(inst->findstuff, inst->window, inst->term);
+}
+
 void special_menuitem(GtkMenuItem *item, gpointer data)
 {
     GtkFrontend *inst = (GtkFrontend *)data;
@@ -5159,6 +5270,7 @@ static const TermWinVtable gtk_termwin_vt = {
     .draw_text = gtkwin_draw_text,
     .draw_cursor = gtkwin_draw_cursor,
     .draw_trust_sigil = gtkwin_draw_trust_sigil,
+    .scroll_rect = gtkwin_scroll_rect,
     .char_width = gtkwin_char_width,
     .free_draw_ctx = gtkwin_free_draw_ctx,
     .set_cursor_pos = gtkwin_set_cursor_pos,
@@ -5506,6 +5618,7 @@ void new_session_window(Conf *conf, const char *geometry_string)
         MKMENUITEM("Paste from " CLIPNAME_EXPLICIT_OBJECT,
                    paste_clipboard_menuitem);
         MKMENUITEM("Copy All", copy_all_menuitem);
+        MKMENUITEM("Find in Scrollback...", find_menuitem);
         MKSEP();
         s = dupcat("About ", appname);
         MKMENUITEM(s, about_menuitem);
@@ -5523,6 +5636,7 @@ void new_session_window(Conf *conf, const char *geometry_string)
     show_mouseptr(inst, true);
 
     inst->eventlogstuff = eventlogstuff_new();
+    inst->findstuff = findstuff_new();
 
     inst->term = term_init(inst->conf, &inst->ucsdata, &inst->termwin);
     setup_clipboards(inst, inst->term, inst->conf);
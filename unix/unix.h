@@ -215,6 +215,10 @@ eventlog_stuff *eventlogstuff_new(void);
 void eventlogstuff_free(eventlog_stuff *);
 void showeventlog(eventlog_stuff *estuff, void *parentwin);
 void logevent_dlg(eventlog_stuff *estuff, const char *string);
+typedef struct find_stuff find_stuff;
+find_stuff *findstuff_new(void);
+void findstuff_free(find_stuff *);
+void showfinddlg(find_stuff *fstuff, void *parentwin, Terminal *term);
 int gtkdlg_askappend(Seat *seat, Filename *filename,
                      void (*callback)(void *ctx, int result), void *ctx);
 int gtk_seat_verify_ssh_host_key(
@@ -307,6 +311,9 @@ enum { SELECT_R = 1, SELECT_W = 2, SELECT_X = 4 };
 void select_result(int fd, int event);
 int first_fd(int *state, int *rwx);
 int next_fd(int *state, int *rwx);
+/* in a child that goes on running after fork(), stop sharing the
+ * pipe that wakes the main loop for queue_toplevel_callback_from_thread */
+void uxsel_thread_callbacks_after_fork(void);
 /* The following are expected to be provided _to_ uxsel.c by the frontend */
 uxsel_id *uxsel_input_add(int fd, int rwx);  /* returns an id */
 void uxsel_input_remove(uxsel_id *id);
@@ -360,6 +367,9 @@ void *sk_getxdmdata(Socket *sock, int *lenp);
 int sk_net_get_fd(Socket *sock);
 SockAddr *unix_sock_addr(const char *path);
 Socket *new_unix_listener(SockAddr *listenaddr, Plug *plug);
+/* in a child that goes on running after fork(), restart the
+ * asynchronous name lookups that were in progress in the parent */
+void sk_namelookup_after_fork(void);
 
 /*
  * General helpful Unix stuff: more helpful version of the FD_SET
@@ -459,5 +469,6 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
 bool cliloop_no_pw_setup(void *ctx, pollwrapper *pw);
 void cliloop_no_pw_check(void *ctx, pollwrapper *pw);
 bool cliloop_always_continue(void *ctx, bool, bool);
+void cliloop_after_fork(void);
 
 #endif /* PUTTY_UNIX_H */
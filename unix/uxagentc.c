@@ -12,7 +12,6 @@
 
 #include "putty.h"
 #include "misc.h"
-#include "tree234.h"
 #include "puttymem.h"
 
 bool agent_exists(void)
@@ -23,106 +22,181 @@ bool agent_exists(void)
     return false;
 }
 
-static tree234 *agent_pending_queries;
-struct agent_pending_query {
-    int fd;
+/*
+ * Reassembles one reply from the agent, reading no further than its
+ * end, so that the next reply on the same connection is left for the
+ * next call.
+ */
+typedef struct agent_reader {
     char *retbuf;
     char sizebuf[4];
     int retsize, retlen;
-    void (*callback)(void *, void *, int);
-    void *callback_ctx;
-};
-static int agent_conncmp(void *av, void *bv)
+} agent_reader;
+
+static void agent_reader_init(agent_reader *rd)
 {
-    agent_pending_query *a = (agent_pending_query *) av;
-    agent_pending_query *b = (agent_pending_query *) bv;
-    if (a->fd < b->fd)
-        return -1;
-    if (a->fd > b->fd)
-        return +1;
-    return 0;
+    rd->retbuf = rd->sizebuf;
+    rd->retsize = 4;
+    rd->retlen = 0;
 }
-static int agent_connfind(void *av, void *bv)
+
+static void agent_reader_clear(agent_reader *rd)
 {
-    int afd = *(int *) av;
-    agent_pending_query *b = (agent_pending_query *) bv;
-    if (afd < b->fd)
-        return -1;
-    if (afd > b->fd)
-        return +1;
-    return 0;
+    if (rd->retbuf && rd->retbuf != rd->sizebuf)
+        sfree(rd->retbuf);
+    agent_reader_init(rd);
 }
 
 /*
  * Attempt to read from an agent socket fd. Returns false if the
  * expected response is as yet incomplete; returns true if it's either
- * complete (conn->retbuf non-NULL and filled with something useful)
- * or has failed totally (conn->retbuf is NULL).
+ * complete (rd->retbuf non-NULL and filled with something useful)
+ * or has failed totally (rd->retbuf is NULL).
  */
-static bool agent_try_read(agent_pending_query *conn)
+static bool agent_try_read(int fd, agent_reader *rd)
 {
     int ret;
 
-    ret = read(conn->fd, conn->retbuf+conn->retlen,
-               conn->retsize-conn->retlen);
+    ret = read(fd, rd->retbuf+rd->retlen, rd->retsize-rd->retlen);
     if (ret <= 0) {
-        if (conn->retbuf != conn->sizebuf) sfree(conn->retbuf);
-        conn->retbuf = NULL;
-        conn->retlen = 0;
+        if (rd->retbuf != rd->sizebuf) sfree(rd->retbuf);
+        rd->retbuf = NULL;
+        rd->retlen = 0;
         return true;
     }
-    conn->retlen += ret;
-    if (conn->retsize == 4 && conn->retlen == 4) {
-        conn->retsize = toint(GET_32BIT_MSB_FIRST(conn->retbuf) + 4);
-        if (conn->retsize <= 0) {
-            conn->retbuf = NULL;
-            conn->retlen = 0;
+    rd->retlen += ret;
+    if (rd->retsize == 4 && rd->retlen == 4) {
+        rd->retsize = toint(GET_32BIT_MSB_FIRST(rd->retbuf) + 4);
+        if (rd->retsize <= 0) {
+            rd->retbuf = NULL;
+            rd->retlen = 0;
             return true;                 /* way too large */
         }
-        assert(conn->retbuf == conn->sizebuf);
-        conn->retbuf = snewn(conn->retsize, char);
-        memcpy(conn->retbuf, conn->sizebuf, 4);
+        assert(rd->retbuf == rd->sizebuf);
+        rd->retbuf = snewn(rd->retsize, char);
+        memcpy(rd->retbuf, rd->sizebuf, 4);
     }
 
-    if (conn->retlen < conn->retsize)
+    if (rd->retlen < rd->retsize)
         return false;                  /* more data to come */
 
     return true;
 }
 
+/*
+ * Asynchronous queries in flight at the same time share a single
+ * connection to the agent, each one written as soon as it's made.
+ * The agent protocol answers requests strictly in order, so each
+ * reply belongs to the oldest query still waiting. The connection is
+ * closed again once nothing is waiting on it.
+ */
+struct agent_pending_query {
+    void (*callback)(void *, void *, int);
+    void *callback_ctx;
+    bool cancelled;
+    agent_pending_query *next;
+};
+
+static struct {
+    int fd;                            /* -1 if not connected */
+    agent_pending_query *head, *tail;
+    agent_reader rd;
+} agent_conn = { .fd = -1 };
+
+static void agent_conn_close(void)
+{
+    if (agent_conn.fd >= 0) {
+        uxsel_del(agent_conn.fd);
+        close(agent_conn.fd);
+        agent_conn.fd = -1;
+    }
+    agent_reader_clear(&agent_conn.rd);
+}
+
+/*
+ * Tear down the shared connection, failing every query still queued
+ * on it. The state is reset before any callback runs, so a callback
+ * is free to start a new query.
+ */
+static void agent_conn_fail(void)
+{
+    agent_pending_query *pq = agent_conn.head;
+
+    agent_conn_close();
+    agent_conn.head = agent_conn.tail = NULL;
+
+    while (pq) {
+        agent_pending_query *next = pq->next;
+        if (!pq->cancelled)
+            pq->callback(pq->callback_ctx, NULL, 0);
+        sfree(pq);
+        pq = next;
+    }
+}
+
 void agent_cancel_query(agent_pending_query *conn)
 {
-    uxsel_del(conn->fd);
-    close(conn->fd);
-    del234(agent_pending_queries, conn);
-    if (conn->retbuf && conn->retbuf != conn->sizebuf)
-        sfree(conn->retbuf);
-    sfree(conn);
+    agent_pending_query *pq;
+
+    /*
+     * The agent will still send a reply for this query, which we
+     * must consume to keep the rest in step; so just mark it. But if
+     * nobody is waiting for anything on the connection any more,
+     * there's no reason to hang on to it.
+     */
+    conn->cancelled = true;
+    for (pq = agent_conn.head; pq; pq = pq->next)
+        if (!pq->cancelled)
+            return;
+    agent_conn_fail();
 }
 
 static void agent_select_result(int fd, int event)
 {
-    agent_pending_query *conn;
+    agent_pending_query *pq;
+    char *retbuf;
+    int retlen;
 
     assert(event == SELECT_R);  /* not selecting for anything but R */
 
-    conn = find234(agent_pending_queries, &fd, agent_connfind);
-    if (!conn) {
+    if (fd != agent_conn.fd) {
         uxsel_del(fd);
         return;
     }
 
-    if (!agent_try_read(conn))
+    if (!agent_try_read(fd, &agent_conn.rd))
         return;                /* more data to come */
 
+    if (!agent_conn.rd.retbuf) {
+        agent_conn_fail();
+        return;
+    }
+
     /*
-     * We have now completed the agent query. Do the callback.
+     * We have now completed the query at the head of the queue.
+     * Ownership of the reply buffer passes to its callback.
      */
-    conn->callback(conn->callback_ctx, conn->retbuf, conn->retlen);
-    /* Null out conn->retbuf, since ownership of that buffer has
-     * passed to the callback. */
-    conn->retbuf = NULL;
-    agent_cancel_query(conn);
+    retbuf = agent_conn.rd.retbuf;
+    retlen = agent_conn.rd.retlen;
+    agent_reader_init(&agent_conn.rd);
+
+    pq = agent_conn.head;
+    if (!pq) {
+        /* The agent answered a question we never asked */
+        sfree(retbuf);
+        agent_conn_fail();
+        return;
+    }
+    if (!(agent_conn.head = pq->next)) {
+        agent_conn.tail = NULL;
+        agent_conn_close();
+    }
+
+    if (pq->cancelled)
+        sfree(retbuf);
+    else
+        pq->callback(pq->callback_ctx, retbuf, retlen);
+    sfree(pq);
 }
 
 static const char *agent_socket_path(void)
@@ -135,22 +209,19 @@ Socket *agent_connect(Plug *plug)
     const char *path = agent_socket_path();
     if (!path)
         return new_error_socket_fmt(plug, "SSH_AUTH_SOCK not set");
-    return sk_new(unix_sock_addr(path), 0, false, false, false, false, plug);
+    return sk_new(unix_sock_addr(path), 0, false, false, false, false, 0,
+                  plug);
 }
 
-agent_pending_query *agent_query(
-    strbuf *query, void **out, int *outlen,
-    void (*callback)(void *, void *, int), void *callback_ctx)
+static int agent_open_socket(void)
 {
     const char *name;
     int sock;
     struct sockaddr_un addr;
-    int done;
-    agent_pending_query *conn;
 
     name = agent_socket_path();
     if (!name || strlen(name) >= sizeof(addr.sun_path))
-        goto failure;
+        return -1;
 
     sock = socket(PF_UNIX, SOCK_STREAM, 0);
     if (sock < 0) {
@@ -164,28 +235,31 @@ agent_pending_query *agent_query(
     strcpy(addr.sun_path, name);
     if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         close(sock);
-        goto failure;
+        return -1;
     }
 
-    strbuf_finalise_agent_query(query);
+    return sock;
+}
 
-    for (done = 0; done < query->len ;) {
-        int ret = write(sock, query->s + done,
-                        query->len - done);
-        if (ret <= 0) {
-            close(sock);
-            goto failure;
-        }
+static bool agent_write_query(int sock, strbuf *query)
+{
+    for (size_t done = 0; done < query->len ;) {
+        int ret = write(sock, query->s + done, query->len - done);
+        if (ret <= 0)
+            return false;
         done += ret;
     }
+    return true;
+}
 
-    conn = snew(agent_pending_query);
-    conn->fd = sock;
-    conn->retbuf = conn->sizebuf;
-    conn->retsize = 4;
-    conn->retlen = 0;
-    conn->callback = callback;
-    conn->callback_ctx = callback_ctx;
+agent_pending_query *agent_query(
+    strbuf *query, void **out, int *outlen,
+    void (*callback)(void *, void *, int), void *callback_ctx)
+{
+    int sock;
+    agent_pending_query *conn;
+
+    strbuf_finalise_agent_query(query);
 
     if (!callback) {
         /*
@@ -195,28 +269,64 @@ agent_pending_query *agent_query(
          * of the program is trying to get anything useful done
          * simultaneously. But this special case shouldn't be used in
          * any more general program.
+         *
+         * This uses a connection of its own, so it can't get mixed up
+         * with any asynchronous queries that are in flight.
          */
-        no_nonblock(conn->fd);
-        while (!agent_try_read(conn))
+        agent_reader rd;
+
+        if ((sock = agent_open_socket()) < 0)
+            goto failure;
+        if (!agent_write_query(sock, query)) {
+            close(sock);
+            goto failure;
+        }
+
+        agent_reader_init(&rd);
+        while (!agent_try_read(sock, &rd))
             /* empty loop body */;
+        close(sock);
 
-        *out = conn->retbuf;
-        *outlen = conn->retlen;
-        sfree(conn);
+        *out = rd.retbuf;
+        *outlen = rd.retlen;
         return NULL;
     }
 
     /*
-     * Otherwise do it properly: add conn to the tree of agent
-     * connections currently in flight, return 0 to indicate that the
-     * response hasn't been received yet, and call the callback when
-     * select_result comes back to us.
+     * Otherwise do it properly: send the query down the shared
+     * connection (opening it if necessary), queue it to wait for its
+     * reply, and call the callback when select_result comes back to
+     * us.
      */
-    if (!agent_pending_queries)
-        agent_pending_queries = newtree234(agent_conncmp);
-    add234(agent_pending_queries, conn);
+    if (agent_conn.fd < 0) {
+        if ((sock = agent_open_socket()) < 0)
+            goto failure;
+        agent_conn.fd = sock;
+        agent_reader_init(&agent_conn.rd);
+        uxsel_set(sock, SELECT_R, agent_select_result);
+    }
+
+    if (!agent_write_query(agent_conn.fd, query)) {
+        /*
+         * Anything already queued will find out about the broken
+         * connection when agent_select_result next reads from it.
+         */
+        if (!agent_conn.head)
+            agent_conn_close();
+        goto failure;
+    }
+
+    conn = snew(agent_pending_query);
+    conn->callback = callback;
+    conn->callback_ctx = callback_ctx;
+    conn->cancelled = false;
+    conn->next = NULL;
+    if (agent_conn.tail)
+        agent_conn.tail->next = conn;
+    else
+        agent_conn.head = conn;
+    agent_conn.tail = conn;
 
-    uxsel_set(sock, SELECT_R, agent_select_result);
     return conn;
 
     failure:
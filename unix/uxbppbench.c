@@ -0,0 +1,633 @@
+/*
+ * bppbench: measure the speed of the SSH-2 binary packet protocol
+ * (ssh2bpp.c), i.e. the layer that frames, pads, compresses,
+ * encrypts and MACs packets, without a network or a real server.
+ *
+ * By default it runs every available combination of cipher, MAC and
+ * compression method over synthetic CHANNEL_DATA traffic. One ssh2bpp
+ * formats a batch of packets into a buffer, and a second one, given
+ * the same keys, decodes them again; the two halves are timed
+ * separately and reported as the 'send' and 'receive' rates. As in
+ * sshbench, each hw/sw implementation of a cipher is run separately,
+ * and wildcard arguments, matched against names of the form
+ * 'cipher/mac/compression' (e.g. 'ssh_aes256_sdctr_hw/hmac-sha2-256/
+ * none'), restrict the run to the matching combinations.
+ *
+ * With -replay, it instead reads a recording of a real session's
+ * incoming byte stream and keys, made by a build of PuTTY with
+ * -DBPP_RECORD (see ssh2bpp.c), and puts it through a fresh ssh2bpp
+ * as fast as it can.
+ *
+ * Everything runs on the main thread: the worker pool is stubbed out,
+ * so the figures are for one CPU's worth of work.
+ *
+ * Output is CSV, after a header line, in the same spirit as sshbench.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "putty.h"
+#include "ssh.h"
+#include "sshbpp.h"
+
+static NORETURN PRINTF_LIKE(1, 2) void fatal_error(const char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "bppbench: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+const bool buildinfo_gtk_relevant = false;
+
+void modalfatalbox(const char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "bppbench: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+/*
+ * The things the BPPs expect to find in the rest of an SSH
+ * connection. Any of them being called means the benchmark has gone
+ * wrong, except for the ones that are only notifications.
+ */
+void ssh_sw_abort(Ssh *ssh, const char *fmt, ...)
+{
+    va_list ap;
+    fprintf(stderr, "bppbench: SSH error: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+void ssh_remote_error(Ssh *ssh, const char *fmt, ...)
+{ fatal_error("unexpected end of connection"); }
+void ssh_remote_eof(Ssh *ssh, const char *fmt, ...)
+{ fatal_error("unexpected end of connection"); }
+void ssh_check_frozen(Ssh *ssh) {}
+void ssh_conn_processed_data(Ssh *ssh) {}
+
+void logevent_and_free(LogContext *logctx, char *event) { sfree(event); }
+void old_keyfile_warning(void) { }
+void noise_ultralight(NoiseSourceId id, unsigned long data) { }
+void log_packet(LogContext *logctx, int direction, int type,
+                const char *texttype, const void *data, size_t len,
+                int n_blanks, const struct logblank_t *blanks,
+                const unsigned long *seq,
+                unsigned downstream_id, const char *additional_log_text)
+{ unreachable("the benchmark never gives its BPPs a LogContext"); }
+
+/*
+ * Packet padding needs random bytes, but nothing here needs them to
+ * be unpredictable, so a trivial generator keeps the RNG out of the
+ * measurements.
+ */
+void random_read(void *vbuf, size_t size)
+{
+    static uint64_t state = 0x5DEECE66DULL;
+    unsigned char *buf = (unsigned char *)vbuf;
+
+    while (size-- > 0) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        *buf++ = state >> 56;
+    }
+}
+
+/*
+ * The algorithms. Ciphers are listed with the selector first and
+ * then its implementations, so that looking one up by its SSH-2 name
+ * (as -replay does) finds the selector.
+ */
+#define CIPHERS(X)                              \
+    X(ssh_aes256_sdctr)                         \
+    X(ssh_aes256_sdctr_hw)                      \
+    X(ssh_aes256_sdctr_sw)                      \
+    X(ssh_aes256_cbc)                           \
+    X(ssh_aes256_cbc_hw)                        \
+    X(ssh_aes256_cbc_sw)                        \
+    X(ssh_aes192_sdctr)                         \
+    X(ssh_aes192_sdctr_hw)                      \
+    X(ssh_aes192_sdctr_sw)                      \
+    X(ssh_aes192_cbc)                           \
+    X(ssh_aes192_cbc_hw)                        \
+    X(ssh_aes192_cbc_sw)                        \
+    X(ssh_aes128_sdctr)                         \
+    X(ssh_aes128_sdctr_hw)                      \
+    X(ssh_aes128_sdctr_sw)                      \
+    X(ssh_aes128_cbc)                           \
+    X(ssh_aes128_cbc_hw)                        \
+    X(ssh_aes128_cbc_sw)                        \
+    X(ssh_aes256_gcm)                           \
+    X(ssh_aes256_gcm_hw)                        \
+    X(ssh_aes256_gcm_sw)                        \
+    X(ssh_aes128_gcm)                           \
+    X(ssh_aes128_gcm_hw)                        \
+    X(ssh_aes128_gcm_sw)                        \
+    X(ssh2_chacha20_poly1305)                   \
+    X(ssh2_chacha20_poly1305_hw)                \
+    X(ssh2_chacha20_poly1305_avx2)              \
+    X(ssh2_chacha20_poly1305_sw)                \
+    X(ssh_3des_ssh2_ctr)                        \
+    X(ssh_3des_ssh2)                            \
+    X(ssh_des)                                  \
+    X(ssh_des_sshcom_ssh2)                      \
+    X(ssh_blowfish_ssh2_ctr)                    \
+    X(ssh_blowfish_ssh2)                        \
+    X(ssh_arcfour256_ssh2)                      \
+    X(ssh_arcfour128_ssh2)                      \
+    /* end of list */
+
+#define MACS(X)                                 \
+    X(ssh_hmac_sha256)                          \
+    X(ssh_hmac_sha1)                            \
+    X(ssh_hmac_sha1_96)                         \
+    X(ssh_hmac_md5)                             \
+    /* end of list */
+
+#define LISTENTRY(alg) { #alg, &alg },
+static const struct { const char *name; const ssh_cipheralg *alg; }
+    ciphers[] = { CIPHERS(LISTENTRY) };
+static const struct { const char *name; const ssh2_macalg *alg; }
+    macs[] = { MACS(LISTENTRY) };
+#undef LISTENTRY
+
+/*
+ * ssh2bpp always wants a compression method, even if it's none. (The
+ * one ssh2transport.c uses for that is private to it.)
+ */
+static ssh_compressor *bench_compress_new(int level) { return NULL; }
+static ssh_decompressor *bench_decompress_new(void) { return NULL; }
+static const ssh_compression_alg bench_no_compression = {
+    .name = "none",
+    .compress_new = bench_compress_new,
+    .decompress_new = bench_decompress_new,
+};
+
+static const ssh_compression_alg *const compressions[] = {
+    &bench_no_compression, &ssh_zlib, &ssh_zstd,
+};
+
+static const size_t default_sizes[] = { 256, 16384 };
+
+static double min_time = 0.1;
+static size_t *sizes;
+static size_t nsizes;
+static char **patterns;
+static size_t npatterns;
+static bool list_only;
+
+static bool selected(const char *name)
+{
+    bool ret = (npatterns == 0);
+    for (size_t i = 0; i < npatterns && !ret; i++)
+        if (wc_match(patterns[i], name))
+            ret = true;
+    if (ret && list_only) {
+        printf("%s\n", name);
+        ret = false;
+    }
+    return ret;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ----------------------------------------------------------------------
+ * Synthetic traffic.
+ */
+
+/* Aim for about this much payload in each batch of packets */
+#define BENCH_BATCH_BYTES 1048576
+
+/*
+ * The payload is made of words picked pseudo-randomly from a short
+ * list, so that it compresses about as well as typical text rather
+ * than not at all (random bytes) or absurdly well (a repeated byte).
+ */
+static unsigned char *bench_payload;
+static size_t bench_payload_len;
+
+static void make_payload(size_t len)
+{
+    static const char *const words[] = {
+        "the ", "of ", "and ", "packet ", "channel ", "window ", "data ",
+        "connection ", "key ", "server ", "client ", "0x3F000 ", "\n",
+        "static ", "void ", "return ", "struct ", "{ ", "} ", "if ",
+    };
+    uint64_t state = 12345;
+    size_t pos = 0;
+
+    bench_payload = snewn(len, unsigned char);
+    bench_payload_len = len;
+    while (pos < len) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        const char *w = words[(state >> 33) % lenof(words)];
+        size_t wlen = strlen(w);
+        if (wlen > len - pos)
+            wlen = len - pos;
+        memcpy(bench_payload + pos, w, wlen);
+        pos += wlen;
+    }
+}
+
+typedef struct BenchBpp {
+    BinaryPacketProtocol *bpp;
+    bufchain in_raw, out_raw;
+    struct DataTransferStats stats;
+} BenchBpp;
+
+static void bench_bpp_init(BenchBpp *b, bool is_server)
+{
+    memset(b, 0, sizeof(*b));
+    bufchain_init(&b->in_raw);
+    bufchain_init(&b->out_raw);
+    b->bpp = ssh2_bpp_new(NULL, &b->stats, is_server);
+    b->bpp->in_raw = &b->in_raw;
+    b->bpp->out_raw = &b->out_raw;
+}
+
+static void bench_bpp_cleanup(BenchBpp *b)
+{
+    ssh_bpp_free(b->bpp);
+    bufchain_clear(&b->in_raw);
+    bufchain_clear(&b->out_raw);
+    run_toplevel_callbacks();          /* free any popped packets */
+}
+
+/* Decode whatever is in the BPP's input, returning the packet count */
+static size_t bench_bpp_receive(BenchBpp *b)
+{
+    size_t npkts = 0;
+    PktIn *pktin;
+
+    ssh_bpp_handle_input(b->bpp);
+    while ((pktin = pq_pop(&b->bpp->in_pq)) != NULL)
+        npkts++;
+    run_toplevel_callbacks();          /* free the packets */
+    return npkts;
+}
+
+static void report(const char *direction, const char *cipher,
+                   const char *mac, const char *comp, size_t size,
+                   uint64_t npkts, uint64_t bytes, double elapsed)
+{
+    printf("%s,%s,%s,%s,", direction, cipher, mac, comp);
+    if (size)
+        printf("%"SIZEu",", size);
+    else
+        printf(",");
+    printf("%"PRIu64",%.1f,%.2f\n", npkts, npkts / elapsed,
+           bytes / elapsed / 1e6);
+    fflush(stdout);
+}
+
+static void bench_combination(const char *cipher_name,
+                              const ssh_cipheralg *cipher,
+                              const ssh2_macalg *mac, bool etm,
+                              const ssh_compression_alg *comp, size_t size)
+{
+    const char *mac_name = (cipher->required_mac ? "builtin" :
+                            etm ? mac->etm_name : mac->name);
+    const char *comp_name = comp->name ? comp->name : comp->delayed_name;
+    char *name = dupprintf("%s/%s/%s", cipher_name, mac_name, comp_name);
+    unsigned char ckey[64], iv[32], mackey[64];
+    BenchBpp tx, rx;
+    size_t batch;
+    uint64_t npkts = 0, bytes = 0;
+    double time_tx = 0, time_rx = 0;
+
+    bool wanted = selected(name);
+    sfree(name);
+    if (!wanted)
+        return;
+
+    /* The two ends just need the same keys, so they can be anything */
+    memset(ckey, 0x55, sizeof(ckey));
+    memset(iv, 0xAA, sizeof(iv));
+    memset(mackey, 0x33, sizeof(mackey));
+    assert(cipher->padded_keybytes <= sizeof(ckey));
+    assert(cipher->blksize <= sizeof(iv));
+    assert(!mac || mac->keylen <= sizeof(mackey));
+
+    bench_bpp_init(&tx, false);
+    bench_bpp_init(&rx, true);
+    ssh2_bpp_new_outgoing_crypto(tx.bpp, cipher, ckey, iv,
+                                 mac, etm, mackey, comp, false);
+    ssh2_bpp_new_incoming_crypto(rx.bpp, cipher, ckey, iv,
+                                 mac, etm, mackey, comp, false);
+
+    batch = BENCH_BATCH_BYTES / size;
+    if (batch == 0)
+        batch = 1;
+
+    /* The first batch is a warm-up, and isn't counted */
+    for (bool warm = false; !warm || time_tx + time_rx < min_time;
+         warm = true) {
+        size_t off = 0, got;
+        double t0, t1, t2;
+
+        t0 = now();
+        for (size_t i = 0; i < batch; i++) {
+            PktOut *pkt = ssh_bpp_new_pktout(tx.bpp, SSH2_MSG_CHANNEL_DATA);
+            if (off + size > bench_payload_len)
+                off = 0;
+            put_uint32(pkt, 0);        /* recipient channel */
+            put_string(pkt, bench_payload + off, size);
+            off += size;
+            pq_push(&tx.bpp->out_pq, pkt);
+        }
+        ssh_bpp_handle_output(tx.bpp);
+        t1 = now();
+
+        /* Transfer the output to the other end, which isn't timed */
+        while (bufchain_size(&tx.out_raw) > 0) {
+            ptrlen data = bufchain_prefix(&tx.out_raw);
+            bufchain_add(&rx.in_raw, data.ptr, data.len);
+            bufchain_consume(&tx.out_raw, data.len);
+        }
+
+        t2 = now();
+        got = bench_bpp_receive(&rx);
+        /* (With a CBC cipher there may be an IGNORE message or two as
+         * well, so we can only check for too few) */
+        if (got < batch)
+            fatal_error("%s: sent %"SIZEu" packets but received %"SIZEu,
+                        cipher_name, batch, got);
+
+        if (warm) {
+            time_tx += t1 - t0;
+            time_rx += now() - t2;
+            npkts += batch;
+            bytes += (uint64_t)batch * size;
+        }
+    }
+
+    report("send", cipher_name, mac_name, comp_name, size,
+           npkts, bytes, time_tx);
+    report("receive", cipher_name, mac_name, comp_name, size,
+           npkts, bytes, time_rx);
+
+    bench_bpp_cleanup(&tx);
+    bench_bpp_cleanup(&rx);
+}
+
+static void bench_cipher(const char *cipher_name, const ssh_cipheralg *cipher)
+{
+    ssh_cipher *c = ssh_cipher_new(cipher);
+    if (!c)
+        return;                        /* not available on this machine */
+    ssh_cipher_free(c);
+
+    for (size_t k = 0; k < lenof(compressions); k++) {
+        const ssh_compression_alg *comp = compressions[k];
+        if (comp->available && !comp->available())
+            continue;
+
+        for (size_t s = 0; s < nsizes; s++) {
+            if (cipher->required_mac) {
+                /* ssh2transport.c runs these in ETM mode, so we must */
+                bench_combination(cipher_name, cipher, cipher->required_mac,
+                                  true, comp, sizes[s]);
+                continue;
+            }
+            for (size_t m = 0; m < lenof(macs); m++) {
+                bench_combination(cipher_name, cipher, macs[m].alg,
+                                  false, comp, sizes[s]);
+                if (macs[m].alg->etm_name)
+                    bench_combination(cipher_name, cipher, macs[m].alg,
+                                      true, comp, sizes[s]);
+            }
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Replaying a recording.
+ */
+
+static const ssh_cipheralg *find_cipher(ptrlen name)
+{
+    for (size_t i = 0; i < lenof(ciphers); i++)
+        if (ptrlen_eq_string(name, ciphers[i].alg->ssh2_id))
+            return ciphers[i].alg;
+    fatal_error("recording uses unknown cipher '%.*s'", PTRLEN_PRINTF(name));
+}
+
+static const ssh2_macalg *find_mac(ptrlen name)
+{
+    for (size_t i = 0; i < lenof(macs); i++)
+        if (ptrlen_eq_string(name, macs[i].alg->name))
+            return macs[i].alg;
+    fatal_error("recording uses unknown MAC '%.*s'", PTRLEN_PRINTF(name));
+}
+
+static const ssh_compression_alg *find_compression(ptrlen name)
+{
+    for (size_t i = 0; i < lenof(compressions); i++) {
+        const ssh_compression_alg *comp = compressions[i];
+        if ((comp->name && ptrlen_eq_string(name, comp->name)) ||
+            (comp->delayed_name &&
+             ptrlen_eq_string(name, comp->delayed_name)))
+            return comp;
+    }
+    fatal_error("recording uses unknown compression '%.*s'",
+                PTRLEN_PRINTF(name));
+}
+
+/* Put a whole recording through a new BPP, returning the packet count */
+static uint64_t replay_once(ptrlen recording, bool is_server, uint64_t *bytes)
+{
+    BinarySource src[1];
+    BenchBpp b;
+    uint64_t npkts = 0;
+
+    BinarySource_BARE_INIT_PL(src, recording);
+    bench_bpp_init(&b, is_server);
+    *bytes = 0;
+
+    while (get_avail(src)) {
+        int type = get_byte(src);
+
+        if (type == 'D') {
+            ptrlen data = get_string(src);
+            if (get_err(src))
+                break;
+            bufchain_add(&b.in_raw, data.ptr, data.len);
+            *bytes += data.len;
+        } else if (type == 'K') {
+            ptrlen cipher_name = get_string(src);
+            ptrlen ckey = get_string(src);
+            ptrlen iv = get_string(src);
+            ptrlen mac_name = get_string(src);
+            bool etm = get_bool(src);
+            ptrlen mackey = get_string(src);
+            ptrlen comp_name = get_string(src);
+            bool delayed = get_bool(src);
+            if (get_err(src))
+                break;
+
+            const ssh_cipheralg *cipher =
+                cipher_name.len ? find_cipher(cipher_name) : NULL;
+            const ssh2_macalg *mac = NULL;
+            if (cipher && cipher->required_mac)
+                mac = cipher->required_mac;
+            else if (mac_name.len)
+                mac = find_mac(mac_name);
+
+            ssh2_bpp_new_incoming_crypto(
+                b.bpp, cipher, ckey.ptr, iv.ptr, mac, etm, mackey.ptr,
+                find_compression(comp_name), delayed);
+        } else {
+            fatal_error("recording is corrupt (record type %d)", type);
+        }
+
+        npkts += bench_bpp_receive(&b);
+    }
+    if (get_err(src))
+        fatal_error("recording is truncated");
+
+    bench_bpp_cleanup(&b);
+    return npkts;
+}
+
+static void replay(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    strbuf *sb = strbuf_new();
+    char buf[65536];
+    size_t len, magiclen = strlen(BPP_RECORD_MAGIC);
+    ptrlen recording;
+    bool is_server;
+    uint64_t npkts = 0, bytes = 0, this_bytes;
+    double elapsed = 0, t0;
+
+    if (!fp)
+        fatal_error("%s: open: %s", filename, strerror(errno));
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+        put_data(sb, buf, len);
+    fclose(fp);
+
+    if (sb->len < magiclen + 1 || memcmp(sb->s, BPP_RECORD_MAGIC, magiclen))
+        fatal_error("%s: not a BPP recording", filename);
+    is_server = sb->u[magiclen];
+    recording = make_ptrlen(sb->u + magiclen + 1, sb->len - magiclen - 1);
+
+    /* The first run is a warm-up, and checks the recording is sound */
+    replay_once(recording, is_server, &this_bytes);
+    do {
+        t0 = now();
+        npkts += replay_once(recording, is_server, &this_bytes);
+        elapsed += now() - t0;
+        bytes += this_bytes;
+    } while (elapsed < min_time);
+
+    report("replay", "", "", "", 0, npkts, bytes, elapsed);
+    strbuf_free(sb);
+}
+
+static void usage(void)
+{
+    printf("usage: bppbench [options] [name-wildcard...]\n");
+    printf("       bppbench [-time T] -replay FILE\n");
+    printf("options:\n");
+    printf("  -time T      run each measurement for at least T seconds"
+           " (default 0.1)\n");
+    printf("  -sizes LIST  comma-separated CHANNEL_DATA payload sizes"
+           " (default 256,16384)\n");
+    printf("  -list        list the combination names and exit\n");
+    printf("  -replay FILE replay a recording made by a PuTTY built with"
+           " -DBPP_RECORD\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *replay_file = NULL;
+
+    sizes = snewn(lenof(default_sizes), size_t);
+    memcpy(sizes, default_sizes, sizeof(default_sizes));
+    nsizes = lenof(default_sizes);
+    patterns = snewn(argc, char *);
+    npatterns = 0;
+
+    while (--argc) {
+        char *p = *++argv;
+        const char *val = argc > 1 ? argv[1] : NULL;
+
+        if (!strcmp(p, "-list")) {
+            list_only = true;
+        } else if (!strcmp(p, "--help") || !strcmp(p, "-h")) {
+            usage();
+            return 0;
+        } else if (!strcmp(p, "-time") || !strcmp(p, "-sizes") ||
+                   !strcmp(p, "-replay")) {
+            if (!val)
+                fatal_error("option '%s' expects an argument", p);
+            argc--, argv++;
+            if (!strcmp(p, "-time")) {
+                min_time = atof(val);
+                if (!(min_time > 0))
+                    fatal_error("time must be positive");
+            } else if (!strcmp(p, "-replay")) {
+                replay_file = val;
+            } else {
+                nsizes = 0;
+                for (const char *q = val; *q; q++)
+                    if (*q == ',')
+                        nsizes++;
+                sfree(sizes);
+                sizes = snewn(nsizes + 1, size_t);
+                nsizes = 0;
+                for (const char *q = val; *q ;) {
+                    char *end;
+                    unsigned long size = strtoul(q, &end, 10);
+                    if (end == q || size == 0 || size > OUR_V2_MAXPKT ||
+                        (*end && *end != ','))
+                        fatal_error("bad size list '%s'", val);
+                    sizes[nsizes++] = size;
+                    q = *end ? end + 1 : end;
+                }
+            }
+        } else if (p[0] == '-') {
+            fprintf(stderr, "bppbench: unknown option '%s'\n", p);
+            usage();
+            return 1;
+        } else {
+            patterns[npatterns++] = p;
+        }
+    }
+
+    if (!list_only)
+        printf("direction,cipher,mac,compression,bytes,packets,"
+               "packets/s,MB/s\n");
+
+    if (replay_file) {
+        replay(replay_file);
+    } else {
+        make_payload(BENCH_BATCH_BYTES + OUR_V2_MAXPKT);
+        for (size_t i = 0; i < lenof(ciphers); i++)
+            bench_cipher(ciphers[i].name, ciphers[i].alg);
+        sfree(bench_payload);
+    }
+
+    sfree(patterns);
+    sfree(sizes);
+    return 0;
+}
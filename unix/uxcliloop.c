@@ -1,6 +1,142 @@
 #include <errno.h>
+#include <unistd.h>
 
 #include "putty.h"
+#include "tree234.h"
+
+#if HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
+
+/*
+ * Every fd that uxsel.c asks us to watch gets one of these. Where
+ * the OS lets us, we keep the fd registered with the kernel for as
+ * long as uxsel has it, so that each turn of the main loop only has
+ * to hear about the fds that are actually ready. Anything we can't
+ * register that way (no epoll, or an fd that epoll refuses, such as
+ * a regular file) is marked 'polled' and handed to poll() afresh on
+ * every turn, as all fds used to be.
+ */
+struct uxsel_id {
+    int fd, rwx;
+    uint64_t serial;   /* identifies this registration in epoll events */
+    bool polled;
+};
+
+static tree234 *cliloop_ids;           /* all live uxsel_ids, by serial */
+static tree234 *cliloop_polled_ids;    /* the polled ones, by fd */
+static uint64_t cliloop_next_serial;
+
+static int cliloop_id_serial_cmp(void *av, void *bv)
+{
+    uxsel_id *a = (uxsel_id *)av, *b = (uxsel_id *)bv;
+    if (a->serial < b->serial)
+        return -1;
+    if (a->serial > b->serial)
+        return +1;
+    return 0;
+}
+static int cliloop_id_serial_find(void *av, void *bv)
+{
+    uint64_t a = *(uint64_t *)av;
+    uxsel_id *b = (uxsel_id *)bv;
+    if (a < b->serial)
+        return -1;
+    if (a > b->serial)
+        return +1;
+    return 0;
+}
+static int cliloop_id_fd_cmp(void *av, void *bv)
+{
+    uxsel_id *a = (uxsel_id *)av, *b = (uxsel_id *)bv;
+    if (a->fd < b->fd)
+        return -1;
+    if (a->fd > b->fd)
+        return +1;
+    return 0;
+}
+
+#if HAVE_EPOLL_CREATE1
+
+/* Maximum number of ready fds we collect from epoll per turn. Any
+ * more stay pending in the kernel until the next turn. */
+#define EPOLL_BATCH 64
+
+static int cliloop_epfd = -1;
+static bool cliloop_epoll_failed;
+
+/*
+ * Register (or re-register) an id with epoll. We use EPOLLONESHOT,
+ * and re-arm each fd after dispatching it: that way, an fd that gets
+ * closed before uxsel_del is called on it can at worst deliver one
+ * stale event, rather than one on every turn until somebody notices.
+ */
+static bool cliloop_epoll_arm(uxsel_id *id, int op)
+{
+    if (cliloop_epfd < 0) {
+        if (cliloop_epoll_failed)
+            return false;
+        cliloop_epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (cliloop_epfd < 0) {
+            cliloop_epoll_failed = true;
+            return false;
+        }
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLONESHOT;
+    if (id->rwx & SELECT_R)
+        ev.events |= EPOLLIN;
+    if (id->rwx & SELECT_W)
+        ev.events |= EPOLLOUT;
+    if (id->rwx & SELECT_X)
+        ev.events |= EPOLLPRI;
+    ev.data.u64 = id->serial;
+
+    int ret = epoll_ctl(cliloop_epfd, op, id->fd, &ev);
+    if (ret < 0 && op == EPOLL_CTL_ADD && errno == EEXIST)
+        ret = epoll_ctl(cliloop_epfd, EPOLL_CTL_MOD, id->fd, &ev);
+    return ret == 0;
+}
+
+static void cliloop_epoll_dispatch(void)
+{
+    struct epoll_event evs[EPOLL_BATCH];
+    int n = epoll_wait(cliloop_epfd, evs, lenof(evs), 0);
+
+    for (int i = 0; i < n; i++) {
+        uint64_t serial = evs[i].data.u64;
+        uxsel_id *id = find234(cliloop_ids, &serial, cliloop_id_serial_find);
+        if (!id)
+            continue;    /* registration has gone away since */
+
+        int fd = id->fd, rwx = 0;
+        uint32_t events = evs[i].events;
+        if ((id->rwx & SELECT_X) && (events & EPOLLPRI))
+            rwx |= SELECT_X;
+        if ((id->rwx & SELECT_R) && (events & (EPOLLIN|EPOLLERR|EPOLLHUP)))
+            rwx |= SELECT_R;
+        if ((id->rwx & SELECT_W) && (events & (EPOLLOUT|EPOLLERR)))
+            rwx |= SELECT_W;
+
+        /* Exceptional notifications first, as in the poll loop below */
+        if (rwx & SELECT_X)
+            select_result(fd, SELECT_X);
+        if (rwx & SELECT_R)
+            select_result(fd, SELECT_R);
+        if (rwx & SELECT_W)
+            select_result(fd, SELECT_W);
+
+        /* The callbacks may have removed or replaced this fd's
+         * registration. If they didn't, re-arm it. */
+        id = find234(cliloop_ids, &serial, cliloop_id_serial_find);
+        if (id)
+            cliloop_epoll_arm(id, EPOLL_CTL_MOD);
+    }
+}
+
+#endif /* HAVE_EPOLL_CREATE1 */
 
 void cli_main_loop(cliloop_pw_setup_t pw_setup,
                    cliloop_pw_check_t pw_check,
@@ -14,9 +150,7 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
     pollwrapper *pw = pollwrap_new();
 
     while (true) {
-        int rwx;
         int ret;
-        int fdstate;
         unsigned long next;
 
         pollwrap_clear(pw);
@@ -24,29 +158,39 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
         if (!pw_setup(ctx, pw))
             break; /* our client signalled emergency exit */
 
-        /* Count the currently active fds. */
-        size_t nfds = 0;
-        for (int fd = first_fd(&fdstate, &rwx); fd >= 0;
-             fd = next_fd(&fdstate, &rwx))
-            nfds++;
-
         /* Expand the fdlist buffer if necessary. */
+        size_t nfds = cliloop_polled_ids ? count234(cliloop_polled_ids) : 0;
         sgrowarray(fdlist, fdsize, nfds);
 
         /*
-         * Add all currently open uxsel fds to pw, and store them in
-         * fdlist as well.
+         * Add the uxsel fds that aren't registered with the kernel to
+         * pw, and store them in fdlist as well.
          */
         size_t fdcount = 0;
-        for (int fd = first_fd(&fdstate, &rwx); fd >= 0;
-             fd = next_fd(&fdstate, &rwx)) {
-            fdlist[fdcount++] = fd;
-            pollwrap_add_fd_rwx(pw, fd, rwx);
+        uxsel_id *id;
+        for (size_t i = 0; i < nfds &&
+                 (id = index234(cliloop_polled_ids, i)) != NULL; i++) {
+            fdlist[fdcount++] = id->fd;
+            pollwrap_add_fd_rwx(pw, id->fd, id->rwx);
         }
 
+#if HAVE_EPOLL_CREATE1
+        /* The epoll fd becomes readable when any of the others is ready */
+        if (cliloop_epfd >= 0)
+            pollwrap_add_fd_rwx(pw, cliloop_epfd, SELECT_R);
+#endif
+
+        /*
+         * Run any timers that are due. They may themselves queue
+         * toplevel callbacks, in which case we mustn't then sit in
+         * poll() waiting for some unrelated event before running
+         * those.
+         */
+        bool timers = !toplevel_callback_pending() && run_timers(now, &next);
+
         if (toplevel_callback_pending()) {
             ret = pollwrap_poll_instant(pw);
-        } else if (run_timers(now, &next)) {
+        } else if (timers) {
             do {
                 unsigned long then;
                 long ticks;
@@ -84,6 +228,12 @@ void cli_main_loop(cliloop_pw_setup_t pw_setup,
 
         bool found_fd = (ret > 0);
 
+#if HAVE_EPOLL_CREATE1
+        if (cliloop_epfd >= 0 &&
+            (pollwrap_get_fd_rwx(pw, cliloop_epfd) & SELECT_R))
+            cliloop_epoll_dispatch();
+#endif
+
         for (size_t i = 0; i < fdcount; i++) {
             int fd = fdlist[i];
             int rwx = pollwrap_get_fd_rwx(pw, fd);
@@ -116,10 +266,64 @@ bool cliloop_no_pw_setup(void *ctx, pollwrapper *pw) { return true; }
 void cliloop_no_pw_check(void *ctx, pollwrapper *pw) {}
 bool cliloop_always_continue(void *ctx, bool fd, bool cb) { return true; }
 
+uxsel_id *uxsel_input_add(int fd, int rwx)
+{
+    if (!cliloop_ids) {
+        cliloop_ids = newtree234(cliloop_id_serial_cmp);
+        cliloop_polled_ids = newtree234(cliloop_id_fd_cmp);
+    }
+
+    uxsel_id *id = snew(uxsel_id);
+    id->fd = fd;
+    id->rwx = rwx;
+    id->serial = cliloop_next_serial++;
+#if HAVE_EPOLL_CREATE1
+    id->polled = !cliloop_epoll_arm(id, EPOLL_CTL_ADD);
+#else
+    id->polled = true;
+#endif
+
+    add234(cliloop_ids, id);
+    if (id->polled)
+        add234(cliloop_polled_ids, id);
+    return id;
+}
+
 /*
- * Any application using this main loop doesn't need to do anything
- * when uxsel adds or removes an fd, because we synchronously re-check
- * the current list every time we go round the main loop above.
+ * Called in the child after a fork(), if the parent had already
+ * registered fds. The epoll instance is shared with the parent, so
+ * the child must not go on using it: make a fresh one and register
+ * everything with that instead.
  */
-uxsel_id *uxsel_input_add(int fd, int rwx) { return NULL; }
-void uxsel_input_remove(uxsel_id *id) { }
+void cliloop_after_fork(void)
+{
+#if HAVE_EPOLL_CREATE1
+    if (cliloop_epfd < 0)
+        return;
+    close(cliloop_epfd);
+    cliloop_epfd = -1;
+
+    uxsel_id *id;
+    for (int i = 0; cliloop_ids && (id = index234(cliloop_ids, i)); i++) {
+        if (!id->polled && !cliloop_epoll_arm(id, EPOLL_CTL_ADD)) {
+            id->polled = true;
+            add234(cliloop_polled_ids, id);
+        }
+    }
+#endif
+}
+
+void uxsel_input_remove(uxsel_id *id)
+{
+    del234(cliloop_ids, id);
+    if (id->polled) {
+        del234(cliloop_polled_ids, id);
+    } else {
+#if HAVE_EPOLL_CREATE1
+        /* This fails harmlessly if the fd has already been closed */
+        struct epoll_event ev;
+        epoll_ctl(cliloop_epfd, EPOLL_CTL_DEL, id->fd, &ev);
+#endif
+    }
+    sfree(id);
+}
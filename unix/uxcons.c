@@ -55,6 +55,7 @@ void cleanup_exit(int code)
      */
     sk_cleanup();
     random_save_seed();
+    platform_logwriter_close_all();
     exit(code);
 }
 
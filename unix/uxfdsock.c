@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include "tree234.h"
 #include "putty.h"
@@ -157,15 +158,26 @@ static void fdsocket_error_callback(void *vs)
                  fds->pending_error, 0);
 }
 
+#define WRITE_MAX_IOV 16
+
 static int fdsocket_try_send(FdSocket *fds)
 {
     int sent = 0;
 
     while (bufchain_size(&fds->pending_output_data) > 0) {
         ssize_t ret;
-
-        ptrlen data = bufchain_prefix(&fds->pending_output_data);
-        ret = write(fds->outfd, data.ptr, data.len);
+        ptrlen blocks[WRITE_MAX_IOV];
+        struct iovec iov[WRITE_MAX_IOV];
+        size_t i, n;
+
+        /* Write as many queued blocks as we can in one go */
+        n = bufchain_prefixes(&fds->pending_output_data,
+                              blocks, WRITE_MAX_IOV);
+        for (i = 0; i < n; i++) {
+            iov[i].iov_base = (void *)blocks[i].ptr;
+            iov[i].iov_len = blocks[i].len;
+        }
+        ret = writev(fds->outfd, iov, n);
         noise_ultralight(NOISE_SOURCE_IOID, ret);
         if (ret < 0 && errno != EWOULDBLOCK) {
             if (!fds->pending_error) {
@@ -250,7 +262,7 @@ static const char *fdsocket_socket_error(Socket *s)
 static void fdsocket_select_result_input(int fd, int event)
 {
     FdSocket *fds;
-    char buf[20480];
+    char buf[65536];                   /* nice big buffer for plenty of speed */
     int retd;
 
     if (!(fds = find234(fdsocket_by_infd, &fd, fdsocket_infd_find)))
@@ -103,6 +103,7 @@ void ssh_gss_cleanup(struct ssh_gss_liblist *list)
      * using it.
      */
     for (i = 0; i < list->nlibraries; i++) {
+        ssh_gssapi_free_cached_cred(&list->libraries[i]);
         dlclose(list->libraries[i].handle);
         if (list->libraries[i].id == 3) {
             /* The 'custom' id involves a dynamically allocated message.
@@ -166,6 +167,7 @@ struct ssh_gss_liblist *ssh_gss_setup(Conf *conf)
 
 void ssh_gss_cleanup(struct ssh_gss_liblist *list)
 {
+    ssh_gssapi_free_cached_cred(&list->libraries[0]);
     sfree(list->libraries);
     sfree(list);
 }
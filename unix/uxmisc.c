@@ -369,3 +369,74 @@ bool open_for_write_would_lose_data(const Filename *fn)
 
     return false;
 }
+
+struct TempFile {
+    int fd;
+};
+
+TempFile *tempfile_new(void)
+{
+    const char *dir = getenv("TMPDIR");
+    char *path;
+    int fd;
+
+    if (!dir || !*dir)
+        dir = "/tmp";
+    path = dupprintf("%s/putty-XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);                  /* we only need it while it's open */
+    sfree(path);
+    if (fd < 0)
+        return NULL;
+    cloexec(fd);
+
+    TempFile *tf = snew(TempFile);
+    tf->fd = fd;
+    return tf;
+}
+
+bool tempfile_write(TempFile *tf, uint64_t offset,
+                    const void *data, size_t len)
+{
+    const char *p = (const char *)data;
+
+    while (len > 0) {
+        ssize_t ret = pwrite(tf->fd, p, len, offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+bool tempfile_read(TempFile *tf, uint64_t offset, void *data, size_t len)
+{
+    char *p = (char *)data;
+
+    while (len > 0) {
+        ssize_t ret = pread(tf->fd, p, len, offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (ret == 0)
+            return false;              /* unexpected end of file */
+        p += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+void tempfile_free(TempFile *tf)
+{
+    close(tf->fd);
+    sfree(tf);
+}
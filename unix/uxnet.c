@@ -2,6 +2,8 @@
  * Unix networking abstraction.
  */
 
+#define _GNU_SOURCE                    /* for accept4() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,6 +12,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -23,6 +26,18 @@
 #include "network.h"
 #include "tree234.h"
 
+/*
+ * We do asynchronous name lookups in threads if we can. (But not
+ * when we're using gethostbyname, which isn't thread-safe.)
+ */
+#if HAVE_PTHREAD && !defined NO_IPV6
+#define NAMELOOKUP_THREADS 1
+#include <pthread.h>
+#include <signal.h>
+#else
+#define NAMELOOKUP_THREADS 0
+#endif
+
 /* Solaris needs <sys/sockio.h> for SIOCATMARK. */
 #ifndef SIOCATMARK
 #include <sys/sockio.h>
@@ -59,6 +74,7 @@ struct SockAddrStep_tag {
 };
 
 typedef struct NetSocket NetSocket;
+typedef struct ConnectAttempt ConnectAttempt;
 struct NetSocket {
     const char *error;
     int s;
@@ -89,9 +105,27 @@ struct NetSocket {
      */
     NetSocket *parent, *child;
 
+    /*
+     * For connect()-type sockets: while 's' and 'step' are our
+     * latest attempt to connect, attempts we started earlier on
+     * other candidate addresses may still be racing it. See
+     * net_connect_timer.
+     */
+    int connect_delay;                 /* ms between attempts; 0 = serial */
+    bool next_attempt_scheduled;
+    unsigned long next_attempt;
+    ConnectAttempt **racing;
+    size_t nracing, racingsize;
+
     Socket sock;
 };
 
+struct ConnectAttempt {
+    int fd;
+    SockAddrStep step;
+    NetSocket *sock;
+};
+
 struct SockAddr {
     int refcount;
     const char *error;
@@ -138,6 +172,7 @@ struct SockAddr {
 #endif
 
 static tree234 *sktree;
+static tree234 *racetree;              /* ConnectAttempts, by fd */
 
 static void uxsel_tell(NetSocket *s);
 
@@ -167,9 +202,31 @@ static int cmpforsearch(void *av, void *bv)
     return 0;
 }
 
+static int cmpforrace(void *av, void *bv)
+{
+    ConnectAttempt *a = (ConnectAttempt *) av, *b = (ConnectAttempt *) bv;
+    if (a->fd < b->fd)
+        return -1;
+    if (a->fd > b->fd)
+        return +1;
+    return 0;
+}
+
+static int cmpforracesearch(void *av, void *bv)
+{
+    ConnectAttempt *b = (ConnectAttempt *) bv;
+    int as = *(int *)av;
+    if (as < b->fd)
+        return -1;
+    if (as > b->fd)
+        return +1;
+    return 0;
+}
+
 void sk_init(void)
 {
     sktree = newtree234(cmpfortree);
+    racetree = newtree234(cmpforrace);
 }
 
 void sk_cleanup(void)
@@ -299,6 +356,196 @@ SockAddr *sk_nonamelookup(const char *host)
     return ret;
 }
 
+/*
+ * Asynchronous name lookup. Each lookup gets a thread of its own to
+ * call sk_namelookup in, which hands the finished NameLookup back to
+ * the main thread by writing its address down a pipe.
+ */
+struct NameLookup {
+    char *host;
+    int address_family;
+    SockAddr *addr;
+    char *canonicalname;
+    namelookup_done_fn_t done;
+    void *ctx;
+    bool cancelled;
+    NameLookup *next, *prev;    /* list of lookups running in threads */
+};
+
+static void namelookup_finish(NameLookup *nl)
+{
+    if (nl->cancelled) {
+        sk_addr_free(nl->addr);
+        sfree(nl->canonicalname);
+    } else {
+        nl->done(nl->ctx, nl->addr, nl->canonicalname);
+    }
+    sfree(nl->host);
+    sfree(nl);
+}
+
+static void namelookup_finish_callback(void *vctx)
+{
+    namelookup_finish((NameLookup *)vctx);
+}
+
+#if NAMELOOKUP_THREADS
+
+static int namelookup_pipe[2] = { -1, -1 };
+static NameLookup *namelookups_running;
+
+static void namelookup_link(NameLookup *nl)
+{
+    nl->prev = NULL;
+    nl->next = namelookups_running;
+    if (nl->next)
+        nl->next->prev = nl;
+    namelookups_running = nl;
+}
+
+static void namelookup_unlink(NameLookup *nl)
+{
+    if (nl->prev)
+        nl->prev->next = nl->next;
+    else
+        namelookups_running = nl->next;
+    if (nl->next)
+        nl->next->prev = nl->prev;
+}
+
+static void *namelookup_thread(void *vctx)
+{
+    NameLookup *nl = (NameLookup *)vctx;
+
+    nl->addr = sk_namelookup(nl->host, &nl->canonicalname,
+                             nl->address_family);
+
+    /* Writes this small to a pipe are atomic, so the main thread
+     * always reads a whole pointer at a time */
+    while (write(namelookup_pipe[1], &nl, sizeof(nl)) < 0 &&
+           errno == EINTR);
+    return NULL;
+}
+
+static void namelookup_select_result(int fd, int event)
+{
+    NameLookup *nl;
+
+    while (read(fd, &nl, sizeof(nl)) == sizeof(nl)) {
+        namelookup_unlink(nl);
+        namelookup_finish(nl);
+    }
+}
+
+static bool namelookup_start_thread(NameLookup *nl)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, old;
+    bool ok;
+
+    if (namelookup_pipe[0] < 0) {
+        if (pipe(namelookup_pipe) < 0) {
+            namelookup_pipe[0] = namelookup_pipe[1] = -1;
+            return false;
+        }
+        cloexec(namelookup_pipe[0]);
+        cloexec(namelookup_pipe[1]);
+        nonblock(namelookup_pipe[0]);
+        uxsel_set(namelookup_pipe[0], SELECT_R, namelookup_select_result);
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    /* Leave all signals to the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ok = (pthread_create(&thread, &attr, namelookup_thread, nl) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    pthread_attr_destroy(&attr);
+    if (ok)
+        namelookup_link(nl);
+    return ok;
+}
+
+static void namelookup_restart(void *vctx)
+{
+    NameLookup *nl = (NameLookup *)vctx;
+
+    namelookup_unlink(nl);
+    if (!namelookup_start_thread(nl)) {
+        nl->addr = sk_namelookup(nl->host, &nl->canonicalname,
+                                 nl->address_family);
+        namelookup_finish(nl);
+    }
+}
+
+#endif /* NAMELOOKUP_THREADS */
+
+/*
+ * Called in the child after a fork(), if it's going to carry on
+ * running rather than exec something. The lookup threads are gone,
+ * and the pipe is shared with the parent, whose threads might still
+ * write to it addresses of NameLookups that only they have filled
+ * in. So give the child a pipe of its own, and start every unfinished
+ * lookup again. (Whatever an old thread had got as far as storing in
+ * the child's copy of a NameLookup can't be trusted to be complete,
+ * so it's abandoned rather than freed.)
+ */
+void sk_namelookup_after_fork(void)
+{
+#if NAMELOOKUP_THREADS
+    if (namelookup_pipe[0] >= 0) {
+        uxsel_del(namelookup_pipe[0]);
+        close(namelookup_pipe[0]);
+        close(namelookup_pipe[1]);
+        namelookup_pipe[0] = namelookup_pipe[1] = -1;
+    }
+
+    for (NameLookup *nl = namelookups_running; nl; nl = nl->next) {
+        nl->addr = NULL;
+        nl->canonicalname = NULL;
+        queue_toplevel_callback(namelookup_restart, nl);
+    }
+#endif
+}
+
+NameLookup *sk_namelookup_start(const char *host, int address_family,
+                                namelookup_done_fn_t done, void *ctx)
+{
+    NameLookup *nl = snew(NameLookup);
+
+    nl->host = dupstr(host);
+    nl->address_family = address_family;
+    nl->addr = NULL;
+    nl->canonicalname = NULL;
+    nl->done = done;
+    nl->ctx = ctx;
+    nl->cancelled = false;
+
+#if NAMELOOKUP_THREADS
+    /* (Unix-domain socket paths need no lookup, so no thread either) */
+    if (host[0] != '/' && namelookup_start_thread(nl))
+        return nl;
+#endif
+
+    /*
+     * Failing that, do the lookup here and now, but still report it
+     * from a callback as the caller expects.
+     */
+    nl->addr = sk_namelookup(host, &nl->canonicalname, address_family);
+    queue_toplevel_callback(namelookup_finish_callback, nl);
+    return nl;
+}
+
+void sk_namelookup_cancel(NameLookup *nl)
+{
+    /* The lookup itself can't be stopped, so just ignore its result */
+    nl->cancelled = true;
+}
+
 static bool sk_nextaddr(SockAddr *addr, SockAddrStep *step)
 {
 #ifndef NO_IPV6
@@ -539,6 +786,10 @@ static Socket *sk_net_accept(accept_ctx_t ctx, Plug *plug)
     ret->incomingeof = false;
     ret->listener = false;
     ret->parent = ret->child = NULL;
+    ret->connect_delay = 0;
+    ret->next_attempt_scheduled = false;
+    ret->racing = NULL;
+    ret->nracing = ret->racingsize = 0;
     ret->addr = NULL;
     ret->connected = true;
 
@@ -574,8 +825,10 @@ static int try_connect(NetSocket *sock)
      */
     del234(sktree, sock);
 
-    if (sock->s >= 0)
+    if (sock->s >= 0) {
+        uxsel_del(sock->s);
         close(sock->s);
+    }
 
     {
         SockAddr thisaddr = sk_extractaddr_tmp(
@@ -604,7 +857,6 @@ static int try_connect(NetSocket *sock)
         if (setsockopt(s, SOL_SOCKET, SO_OOBINLINE,
                        (void *) &b, sizeof(b)) < 0) {
             err = errno;
-            close(s);
             goto ret;
         }
     }
@@ -614,7 +866,6 @@ static int try_connect(NetSocket *sock)
         if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY,
                        (void *) &b, sizeof(b)) < 0) {
             err = errno;
-            close(s);
             goto ret;
         }
     }
@@ -624,7 +875,6 @@ static int try_connect(NetSocket *sock)
         if (setsockopt(s, SOL_SOCKET, SO_KEEPALIVE,
                        (void *) &b, sizeof(b)) < 0) {
             err = errno;
-            close(s);
             goto ret;
         }
     }
@@ -747,6 +997,15 @@ static int try_connect(NetSocket *sock)
 
     ret:
 
+    /*
+     * Don't keep a failed attempt's fd: another attempt racing this
+     * one may be about to take over.
+     */
+    if (err && sock->s >= 0) {
+        close(sock->s);
+        sock->s = -1;
+    }
+
     /*
      * No matter what happened, put the socket back in the tree.
      */
@@ -761,8 +1020,119 @@ static int try_connect(NetSocket *sock)
     return err;
 }
 
+static bool sk_net_more_addrs(NetSocket *s)
+{
+    SockAddrStep step = s->step;
+    return s->addr && sk_nextaddr(s->addr, &step);
+}
+
+static void net_connect_timer(void *ctx, unsigned long now);
+static void net_race_select_result(int fd, int event);
+
+/*
+ * RFC 8305 ('Happy Eyeballs') says not to wait for each connection
+ * attempt to fail before trying the next candidate address. Instead,
+ * if an attempt hasn't succeeded after a short delay, we start the
+ * next one alongside it, and use whichever connects first. That
+ * way, a host with (say) unreachable IPv6 addresses costs us a
+ * fraction of a second per address, rather than a whole TCP timeout.
+ */
+static void sk_net_schedule_attempt(NetSocket *s)
+{
+    s->next_attempt_scheduled = false;
+    if (s->connect_delay > 0 && !s->connected && sk_net_more_addrs(s)) {
+        s->next_attempt = schedule_timer(s->connect_delay,
+                                         net_connect_timer, s);
+        s->next_attempt_scheduled = true;
+    }
+}
+
+static void sk_net_close_attempt(NetSocket *s, size_t i)
+{
+    ConnectAttempt *ca = s->racing[i];
+
+    del234(racetree, ca);
+    uxsel_del(ca->fd);
+    close(ca->fd);
+    s->racing[i] = s->racing[--s->nracing];
+    sfree(ca);
+}
+
+static void sk_net_stop_racing(NetSocket *s)
+{
+    while (s->nracing > 0)
+        sk_net_close_attempt(s, s->nracing - 1);
+    s->next_attempt_scheduled = false;
+}
+
+/*
+ * Make one of the racing attempts the socket's current one,
+ * discarding whatever the current one was.
+ */
+static void sk_net_adopt_attempt(NetSocket *s, size_t i)
+{
+    ConnectAttempt *ca = s->racing[i];
+
+    del234(sktree, s);
+    if (s->s >= 0) {
+        uxsel_del(s->s);
+        close(s->s);
+    }
+    s->s = ca->fd;
+    s->step = ca->step;
+    add234(sktree, s);
+
+    del234(racetree, ca);
+    s->racing[i] = s->racing[--s->nracing];
+    sfree(ca);
+
+    uxsel_tell(s);
+}
+
+static void net_connect_timer(void *ctx, unsigned long now)
+{
+    NetSocket *s = (NetSocket *)ctx;
+    ConnectAttempt *ca;
+    int err;
+
+    if (!s->next_attempt_scheduled || now != s->next_attempt)
+        return;
+    s->next_attempt_scheduled = false;
+    if (s->connected || !sk_net_more_addrs(s))
+        return;
+
+    /*
+     * Leave the attempt in progress to carry on in the background,
+     * and start another on the next address.
+     */
+    ca = snew(ConnectAttempt);
+    ca->fd = s->s;
+    ca->step = s->step;
+    ca->sock = s;
+    sgrowarray(s->racing, s->racingsize, s->nracing);
+    s->racing[s->nracing++] = ca;
+    add234(racetree, ca);
+    uxsel_set(ca->fd, SELECT_W, net_race_select_result);
+
+    del234(sktree, s);
+    s->s = -1;
+    add234(sktree, s);
+
+    do {
+        sk_nextaddr(s->addr, &s->step);
+        err = try_connect(s);
+    } while (err && sk_net_more_addrs(s));
+
+    if (err)
+        sk_net_adopt_attempt(s, s->nracing - 1); /* back to waiting */
+    else if (s->connected)
+        sk_net_stop_racing(s);
+    else
+        sk_net_schedule_attempt(s);
+}
+
 Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
-               bool nodelay, bool keepalive, Plug *plug)
+               bool nodelay, bool keepalive, int connect_delay, Plug *plug)
 {
     NetSocket *ret;
     int err;
@@ -782,6 +1152,10 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
     ret->localhost_only = false;    /* unused, but best init anyway */
     ret->pending_error = 0;
     ret->parent = ret->child = NULL;
+    ret->connect_delay = 0;
+    ret->next_attempt_scheduled = false;
+    ret->racing = NULL;
+    ret->nracing = ret->racingsize = 0;
     ret->oobpending = false;
     ret->outgoingeof = EOF_NO;
     ret->incomingeof = false;
@@ -794,6 +1168,7 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
     ret->keepalive = keepalive;
     ret->privport = privport;
     ret->port = port;
+    ret->connect_delay = connect_delay;
 
     do {
         err = try_connect(ret);
@@ -801,6 +1176,8 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
 
     if (err)
         ret->error = strerror(err);
+    else
+        sk_net_schedule_attempt(ret);
 
     return &ret->sock;
 }
@@ -835,6 +1212,10 @@ Socket *sk_newlistener(const char *srcaddr, int port, Plug *plug,
     ret->localhost_only = local_host_only;
     ret->pending_error = 0;
     ret->parent = ret->child = NULL;
+    ret->connect_delay = 0;
+    ret->next_attempt_scheduled = false;
+    ret->racing = NULL;
+    ret->nracing = ret->racingsize = 0;
     ret->oobpending = false;
     ret->outgoingeof = EOF_NO;
     ret->incomingeof = false;
@@ -968,6 +1349,8 @@ Socket *sk_newlistener(const char *srcaddr, int port, Plug *plug,
         return &ret->sock;
     }
 
+    nonblock(s);                       /* so we can accept until EAGAIN */
+
     if (listen(s, SOMAXCONN) < 0) {
         close(s);
         ret->error = strerror(errno);
@@ -1019,6 +1402,10 @@ static void sk_net_close(Socket *sock)
 
     bufchain_clear(&s->output_data);
 
+    sk_net_stop_racing(s);
+    sfree(s->racing);
+    expire_timer_context(s);
+
     del234(sktree, s);
     if (s->s >= 0) {
         uxsel_del(s->s);
@@ -1104,6 +1491,11 @@ static void socket_error_callback(void *vs)
     plug_closing(s->plug, strerror(s->pending_error), s->pending_error, 0);
 }
 
+/*
+ * Maximum number of output_data blocks we'll pass to one sendmsg.
+ */
+#define SEND_MAX_IOV 16
+
 /*
  * The function which tries to send on a socket once it's deemed
  * writable.
@@ -1113,22 +1505,31 @@ void try_send(NetSocket *s)
     while (s->sending_oob || bufchain_size(&s->output_data) > 0) {
         int nsent;
         int err;
-        const void *data;
-        size_t len;
-        int urgentflag;
 
         if (s->sending_oob) {
-            urgentflag = MSG_OOB;
-            len = s->sending_oob;
-            data = &s->oobdata;
+            nsent = send(s->s, &s->oobdata, s->sending_oob, MSG_OOB);
         } else {
-            urgentflag = 0;
-            ptrlen bufdata = bufchain_prefix(&s->output_data);
-            data = bufdata.ptr;
-            len = bufdata.len;
+            /*
+             * Send as many of the queued blocks as we can in one
+             * system call, rather than one send() apiece.
+             */
+            ptrlen blocks[SEND_MAX_IOV];
+            struct iovec iov[SEND_MAX_IOV];
+            struct msghdr msg;
+            size_t i, n = bufchain_prefixes(
+                &s->output_data, blocks, SEND_MAX_IOV);
+
+            for (i = 0; i < n; i++) {
+                iov[i].iov_base = (void *)blocks[i].ptr;
+                iov[i].iov_len = blocks[i].len;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            nsent = sendmsg(s->s, &msg, 0);
         }
-        nsent = send(s->s, data, len, urgentflag);
         noise_ultralight(NOISE_SOURCE_IOLEN, nsent);
+        probe2(socket_send, s->s, nsent);
         if (nsent <= 0) {
             err = (nsent < 0 ? errno : 0);
             if (err == EWOULDBLOCK) {
@@ -1163,6 +1564,7 @@ void try_send(NetSocket *s)
             }
         } else {
             if (s->sending_oob) {
+                size_t len = s->sending_oob;
                 if (nsent < len) {
                     memmove(s->oobdata, s->oobdata+nsent, len-nsent);
                     s->sending_oob = len - nsent;
@@ -1198,7 +1600,24 @@ static size_t sk_net_write(Socket *sock, const void *buf, size_t len)
     assert(s->outgoingeof == EOF_NO);
 
     /*
-     * Add the data to the buffer list on the socket.
+     * If nothing is queued ahead of this data, try sending it
+     * straight from the caller's buffer, so that we only have to
+     * copy whatever the kernel won't take right now. Errors are left
+     * for try_send to rediscover and report.
+     */
+    if (len > 0 && s->writable && !s->sending_oob &&
+        bufchain_size(&s->output_data) == 0) {
+        ssize_t nsent = send(s->s, buf, len, 0);
+        noise_ultralight(NOISE_SOURCE_IOLEN, nsent);
+        probe2(socket_send, s->s, nsent);
+        if (nsent > 0) {
+            buf = (const char *)buf + nsent;
+            len -= nsent;
+        }
+    }
+
+    /*
+     * Add the rest of the data to the buffer list on the socket.
      */
     bufchain_add(&s->output_data, buf, len);
 
@@ -1270,10 +1689,93 @@ static void sk_net_write_eof(Socket *sock)
     uxsel_tell(s);
 }
 
+/*
+ * Maximum amount of data net_select_result will read from one socket
+ * before returning to the event loop.
+ */
+#define NET_READ_BUDGET 262144
+
+/*
+ * Maximum number of connections net_select_result will accept from
+ * one listening socket before returning to the event loop.
+ */
+#define NET_ACCEPT_BUDGET 64
+
+/*
+ * Accept a connection on a listening socket, returning a socket set
+ * up the way we want it (non-blocking and close-on-exec) or -1 with
+ * errno set.
+ */
+static int net_accept(int s, struct sockaddr *sa, socklen_t *addrlen)
+{
+#if HAVE_ACCEPT4
+    return accept4(s, sa, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int t = accept(s, sa, addrlen);
+    if (t >= 0) {
+        nonblock(t);
+        cloexec(t);
+    }
+    return t;
+#endif
+}
+
+static void sk_net_connected(NetSocket *s)
+{
+    sk_net_stop_racing(s);
+    if (s->addr) {
+        sk_addr_free(s->addr);
+        s->addr = NULL;
+    }
+    s->connected = true;
+    s->writable = true;
+    uxsel_tell(s);
+}
+
+/*
+ * Called when one of the connection attempts racing a socket's
+ * current one completes or fails.
+ */
+static void net_race_select_result(int fd, int event)
+{
+    ConnectAttempt *ca = find234(racetree, &fd, cmpforracesearch);
+    NetSocket *s;
+    SockAddr thisaddr;
+    socklen_t errlen;
+    int err;
+    size_t i;
+
+    if (!ca || event != SELECT_W)
+        return;
+    s = ca->sock;
+    for (i = 0; s->racing[i] != ca; i++);
+
+    errlen = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+        err = errno;
+
+    thisaddr = sk_extractaddr_tmp(s->addr, &ca->step);
+    if (err) {
+        sk_net_close_attempt(s, i);
+        plug_log(s->plug, PLUGLOG_CONNECT_FAILED,
+                 &thisaddr, s->port, strerror(err), err);
+        return;
+    }
+
+    /*
+     * This attempt has won the race. (thisaddr is still good after
+     * we stop racing, since it points into s->addr.)
+     */
+    sk_net_adopt_attempt(s, i);
+    sk_net_stop_racing(s);
+    plug_log(s->plug, PLUGLOG_CONNECT_SUCCESS, &thisaddr, s->port, NULL, 0);
+    sk_net_connected(s);
+}
+
 static void net_select_result(int fd, int event)
 {
     int ret;
-    char buf[20480];                   /* nice big buffer for plenty of speed */
+    char buf[65536];                   /* nice big buffer for plenty of speed */
     NetSocket *s;
     bool atmark = true;
 
@@ -1295,6 +1797,7 @@ static void net_select_result(int fd, int event)
              */
             ret = recv(s->s, buf, sizeof(buf), MSG_OOB);
             noise_ultralight(NOISE_SOURCE_IOLEN, ret);
+            probe2(socket_recv, s->s, ret);
             if (ret <= 0) {
                 plug_closing(s->plug,
                              ret == 0 ? "Internal networking trouble" :
@@ -1325,28 +1828,36 @@ static void net_select_result(int fd, int event)
       case SELECT_R:                   /* readable; also acceptance */
         if (s->listener) {
             /*
-             * On a listening socket, the readability event means a
-             * connection is ready to be accepted.
+             * On a listening socket, the readability event means at
+             * least one connection is ready to be accepted. Take as
+             * many as are waiting, up to NET_ACCEPT_BUDGET, so that
+             * a burst of connections doesn't cost a trip round the
+             * event loop each.
              */
-            union sockaddr_union su;
-            socklen_t addrlen = sizeof(su);
-            accept_ctx_t actx;
-            int t;  /* socket of connection */
-
-            memset(&su, 0, addrlen);
-            t = accept(s->s, &su.sa, &addrlen);
-            if (t < 0) {
-                break;
-            }
+            for (int n = 0; n < NET_ACCEPT_BUDGET; n++) {
+                union sockaddr_union su;
+                socklen_t addrlen = sizeof(su);
+                accept_ctx_t actx;
+                int t;  /* socket of connection */
+
+                memset(&su, 0, addrlen);
+                t = net_accept(s->s, &su.sa, &addrlen);
+                if (t < 0) {
+                    /* A connection reset before we got to it, or a
+                     * signal, needn't stop us taking the next one */
+                    if (errno == ECONNABORTED || errno == EINTR)
+                        continue;
+                    break;             /* EAGAIN, or out of fds */
+                }
 
-            nonblock(t);
-            actx.i = t;
+                actx.i = t;
 
-            if ((!s->addr || s->addr->superfamily != UNIX) &&
-                s->localhost_only && !sockaddr_is_loopback(&su.sa)) {
-                close(t);              /* someone let nonlocal through?! */
-            } else if (plug_accepting(s->plug, sk_net_accept, actx)) {
-                close(t);              /* denied or error */
+                if ((!s->addr || s->addr->superfamily != UNIX) &&
+                    s->localhost_only && !sockaddr_is_loopback(&su.sa)) {
+                    close(t);          /* someone let nonlocal through?! */
+                } else if (plug_accepting(s->plug, sk_net_accept, actx)) {
+                    close(t);          /* denied or error */
+                }
             }
             break;
         }
@@ -1361,45 +1872,69 @@ static void net_select_result(int fd, int event)
             break;
 
         /*
-         * We have received data on the socket. For an oobinline
-         * socket, this might be data _before_ an urgent pointer,
-         * in which case we send it to the back end with type==1
-         * (data prior to urgent).
+         * Keep reading for as long as each recv fills the whole
+         * buffer (a sign that more is already waiting), up to
+         * NET_READ_BUDGET bytes, so that a fast incoming stream
+         * doesn't cost a trip round the event loop per buffer. A
+         * short read means we've probably drained the socket, so
+         * we leave it to the next poll rather than spending a
+         * syscall on the EWOULDBLOCK.
          */
-        if (s->oobinline && s->oobpending) {
-            int atmark_from_ioctl;
-            if (ioctl(s->s, SIOCATMARK, &atmark_from_ioctl) == 0) {
-                atmark = atmark_from_ioctl;
-                if (atmark)
-                    s->oobpending = false; /* clear this indicator */
+        for (size_t total = 0; total < NET_READ_BUDGET;) {
+            /*
+             * We have received data on the socket. For an oobinline
+             * socket, this might be data _before_ an urgent pointer,
+             * in which case we send it to the back end with type==1
+             * (data prior to urgent).
+             */
+            if (s->oobinline && s->oobpending) {
+                int atmark_from_ioctl;
+                if (ioctl(s->s, SIOCATMARK, &atmark_from_ioctl) == 0) {
+                    atmark = atmark_from_ioctl;
+                    if (atmark)
+                        s->oobpending = false; /* clear this indicator */
+                }
+            } else
+                atmark = true;
+
+            ret = recv(s->s, buf, s->oobpending ? 1 : sizeof(buf), 0);
+            noise_ultralight(NOISE_SOURCE_IOLEN, ret);
+            probe2(socket_recv, s->s, ret);
+            if (ret < 0) {
+                if (errno == EWOULDBLOCK) {
+                    break;
+                }
+            }
+            if (ret < 0) {
+                plug_closing(s->plug, strerror(errno), errno, 0);
+            } else if (0 == ret) {
+                s->incomingeof = true;     /* stop trying to read now */
+                uxsel_tell(s);
+                plug_closing(s->plug, NULL, 0, 0);
+            } else {
+                /*
+                 * Receiving actual data on a socket means we can
+                 * stop falling back through the candidate
+                 * addresses to connect to.
+                 */
+                if (s->addr) {
+                    sk_addr_free(s->addr);
+                    s->addr = NULL;
+                }
+                plug_receive(s->plug, atmark ? 0 : 1, buf, ret);
             }
-        } else
-            atmark = true;
 
-        ret = recv(s->s, buf, s->oobpending ? 1 : sizeof(buf), 0);
-        noise_ultralight(NOISE_SOURCE_IOLEN, ret);
-        if (ret < 0) {
-            if (errno == EWOULDBLOCK) {
+            if (ret <= 0 || ret < sizeof(buf))
                 break;
-            }
-        }
-        if (ret < 0) {
-            plug_closing(s->plug, strerror(errno), errno, 0);
-        } else if (0 == ret) {
-            s->incomingeof = true;     /* stop trying to read now */
-            uxsel_tell(s);
-            plug_closing(s->plug, NULL, 0, 0);
-        } else {
+            total += ret;
+
             /*
-             * Receiving actual data on a socket means we can
-             * stop falling back through the candidate
-             * addresses to connect to.
+             * plug_receive may have frozen or even closed the
+             * socket, so look it up again before going round.
              */
-            if (s->addr) {
-                sk_addr_free(s->addr);
-                s->addr = NULL;
-            }
-            plug_receive(s->plug, atmark ? 0 : 1, buf, ret);
+            s = find234(sktree, &fd, cmpforsearch);
+            if (!s || s->frozen || s->incomingeof)
+                break;
         }
         break;
       case SELECT_W:                   /* writable */
@@ -1437,12 +1972,20 @@ static void net_select_result(int fd, int event)
                     while (err && s->addr && sk_nextaddr(s->addr, &s->step)) {
                         err = try_connect(s);
                     }
+                    if (err && s->nracing > 0) {
+                        /* an earlier attempt is still in the running */
+                        sk_net_adopt_attempt(s, s->nracing - 1);
+                        err = 0;
+                    }
                     if (err) {
                         plug_closing(s->plug, strerror(err), err, 0);
                         return;      /* socket is now presumably defunct */
                     }
-                    if (!s->connected)
-                        return;      /* another async attempt in progress */
+                    if (!s->connected) {
+                        /* another async attempt in progress */
+                        sk_net_schedule_attempt(s);
+                        return;
+                    }
                 } else {
                     /*
                      * The connection attempt succeeded.
@@ -1456,13 +1999,7 @@ static void net_select_result(int fd, int event)
             /*
              * If we get here, we've managed to make a connection.
              */
-            if (s->addr) {
-                sk_addr_free(s->addr);
-                s->addr = NULL;
-            }
-            s->connected = true;
-            s->writable = true;
-            uxsel_tell(s);
+            sk_net_connected(s);
         } else {
             size_t bufsize_before, bufsize_after;
             s->writable = true;
@@ -1491,6 +2028,23 @@ static const char *sk_net_socket_error(Socket *sock)
     return s->error;
 }
 
+void sk_reset_on_close(Socket *sock)
+{
+    NetSocket *s;
+    struct linger l;
+
+    if (sock->vt != &NetSocket_sockvt)
+        return;
+    s = container_of(sock, NetSocket, sock);
+    if (s->s < 0)
+        return;
+
+    /* A zero linger time makes close() send RST instead of FIN */
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    setsockopt(s->s, SOL_SOCKET, SO_LINGER, (void *)&l, sizeof(l));
+}
+
 static void sk_net_set_frozen(Socket *sock, bool is_frozen)
 {
     NetSocket *s = container_of(sock, NetSocket, sock);
@@ -1698,6 +2252,10 @@ Socket *new_unix_listener(SockAddr *listenaddr, Plug *plug)
     ret->localhost_only = true;
     ret->pending_error = 0;
     ret->parent = ret->child = NULL;
+    ret->connect_delay = 0;
+    ret->next_attempt_scheduled = false;
+    ret->racing = NULL;
+    ret->nracing = ret->racingsize = 0;
     ret->oobpending = false;
     ret->outgoingeof = EOF_NO;
     ret->incomingeof = false;
@@ -1746,6 +2304,8 @@ Socket *new_unix_listener(SockAddr *listenaddr, Plug *plug)
         return &ret->sock;
     }
 
+    nonblock(s);                       /* so we can accept until EAGAIN */
+
     if (listen(s, SOMAXCONN) < 0) {
         close(s);
         ret->error = strerror(errno);
@@ -16,6 +16,10 @@
 #include "ssh.h"
 #include "storage.h"
 
+#if HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
 static bool read_dev_urandom(char *buf, int len)
 {
     int fd;
@@ -40,11 +44,43 @@ static bool read_dev_urandom(char *buf, int len)
     return true;
 }
 
+static bool read_os_random(char *buf, int len)
+{
+#if HAVE_GETRANDOM
+    /* getrandom() doesn't need a file descriptor or a /dev, and
+     * blocks only until the kernel's pool is first initialised */
+    int ngot = 0;
+    while (ngot < len) {
+        ssize_t ret = getrandom(buf + ngot, len - ngot, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        ngot += ret;
+    }
+    if (ngot == len)
+        return true;
+#endif
+    return read_dev_urandom(buf, len);
+}
+
+bool noise_get_fast(void (*func) (void *, int))
+{
+    char buf[32];
+
+    if (!read_os_random(buf, sizeof(buf)))
+        return false;
+    func(buf, sizeof(buf));
+    smemclr(buf, sizeof(buf));
+    return true;
+}
+
 /*
  * This function is called once, at PuTTY startup. It will do some
  * slightly silly things such as fetching an entire process listing
  * and scanning /tmp, load the saved random seed from disk, and
- * also read 32 bytes out of /dev/urandom.
+ * also read 32 bytes from the kernel random number generator.
  */
 
 void noise_get_heavy(void (*func) (void *, int))
@@ -54,7 +90,7 @@ void noise_get_heavy(void (*func) (void *, int))
     int ret;
     bool got_dev_urandom = false;
 
-    if (read_dev_urandom(buf, 32)) {
+    if (read_os_random(buf, 32)) {
         got_dev_urandom = true;
         func(buf, 32);
     }
@@ -196,6 +196,7 @@ static void usage(void)
     printf("  -D           delete all keys from the agent\n");
     printf("Other options:\n");
     printf("  -v           verbose mode (in agent mode)\n");
+    printf("  -E, --encrypted   load following keys encrypted, decrypt on first use\n");
     printf("  -s -c        force POSIX or C shell syntax (in agent mode)\n");
     printf("  --tty-prompt force tty-based passphrase prompt (in -a mode)\n");
     printf("  --gui-prompt force GUI-based passphrase prompt (in -a mode)\n");
@@ -1269,7 +1270,7 @@ int main(int argc, char **argv)
                 life = LIFE_X11;
             } else if (!strcmp(p, "-T")) {
                 life = LIFE_TTY;
-            } else if (!strcmp(p, "-E")) {
+            } else if (!strcmp(p, "-E") || !strcmp(p, "--encrypted")) {
                 if (curr_keyact == KEYACT_AGENT_LOAD)
                     curr_keyact = KEYACT_AGENT_LOAD_ENCRYPTED;
                 else if (curr_keyact == KEYACT_CLIENT_ADD)
@@ -14,6 +14,7 @@
 #include <pwd.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "putty.h"
 #include "ssh.h"
@@ -22,6 +23,17 @@
 
 #define MAX_STDIN_BACKLOG 4096
 
+/*
+ * When standard input isn't a terminal, plink is probably being used
+ * as a pipe for bulk data, so it reads in much larger chunks, and
+ * lets more of them queue up in the backend before it stops reading.
+ */
+#define BULK_STDIN_READ 131072
+#define MAX_BULK_STDIN_BACKLOG (2 * BULK_STDIN_READ)
+
+/* Maximum number of bufchain blocks passed to one writev() */
+#define WRITE_MAX_IOV 16
+
 static LogContext *logctx;
 
 static struct termios orig_termios;
@@ -330,13 +342,20 @@ size_t try_output(bool is_stderr)
 
     if (bufchain_size(chain) > 0) {
         bool prev_nonblock = nonblock(fd);
-        ptrlen senddata;
+        ptrlen blocks[WRITE_MAX_IOV];
+        struct iovec iov[WRITE_MAX_IOV];
+        size_t i, n, total;
         do {
-            senddata = bufchain_prefix(chain);
-            ret = write(fd, senddata.ptr, senddata.len);
+            n = bufchain_prefixes(chain, blocks, WRITE_MAX_IOV);
+            for (i = total = 0; i < n; i++) {
+                iov[i].iov_base = (void *)blocks[i].ptr;
+                iov[i].iov_len = blocks[i].len;
+                total += blocks[i].len;
+            }
+            ret = writev(fd, iov, n);
             if (ret > 0)
                 bufchain_consume(chain, ret);
-        } while (ret == senddata.len && bufchain_size(chain) != 0);
+        } while (ret == total && bufchain_size(chain) != 0);
         if (!prev_nonblock)
             no_nonblock(fd);
         if (ret < 0 && errno != EAGAIN) {
@@ -388,6 +407,7 @@ static bool plink_seat_interactive(Seat *seat)
 
 static const SeatVtable plink_seat_vt = {
     .output = plink_output,
+    .sent = nullseat_sent,
     .eof = plink_eof,
     .get_userpass_input = plink_get_userpass_input,
     .notify_remote_exit = nullseat_notify_remote_exit,
@@ -485,6 +505,14 @@ void sigwinch(int signum)
         /* not much we can do about it */;
 }
 
+/* SIGUSR1 asks for a dump of the memory pool statistics, and of the
+ * SSH connection's counters */
+void sigusr1(int signum)
+{
+    if (write(signalpipe[1], "m", 1) <= 0)
+        /* not much we can do about it */;
+}
+
 /*
  * Short description of parameters.
  */
@@ -506,6 +534,8 @@ static void usage(void)
     printf("  -batch    disable all interactive prompts\n");
     printf("  -proxycmd command\n");
     printf("            use 'command' as local proxy\n");
+    printf("  -J [user@]host[:port]\n");
+    printf("            connect via an SSH jump host\n");
     printf("  -sercfg configuration-string (e.g. 19200,8,n,1,X)\n");
     printf("            Specify the serial configuration (serial only)\n");
     printf("The following options only apply to SSH connections:\n");
@@ -516,6 +546,8 @@ static void usage(void)
     printf("            Forward local port to remote address\n");
     printf("  -R [listen-IP:]listen-port:host:port\n");
     printf("            Forward remote port to local address\n");
+    printf("  -fwdlimit [LRD][listen-IP:]listen-port=rate[:total[:weight]]\n");
+    printf("            Limit the bandwidth of a port forwarding\n");
     printf("  -X -x     enable / disable X11 forwarding\n");
     printf("  -A -a     enable / disable agent forwarding\n");
     printf("  -t -T     enable / disable pty allocation\n");
@@ -543,8 +575,17 @@ static void usage(void)
     printf("  -sshlog file\n");
     printf("  -sshrawlog file\n");
     printf("            log protocol details to a file\n");
+    printf("  -tracefile file\n");
+    printf("            record an event-loop trace to a file\n");
     printf("  -shareexists\n");
     printf("            test whether a connection-sharing upstream exists\n");
+    printf("  -sharestats\n");
+    printf("            show what a connection-sharing upstream's "
+           "downstreams are doing\n");
+    printf("  -sharepersist secs\n");
+    printf("            share this connection, and keep it open in the "
+           "background\n");
+    printf("            until unused for this many seconds\n");
     exit(1);
 }
 
@@ -570,15 +611,17 @@ const unsigned cmdline_tooltype =
     TOOLTYPE_HOST_ARG_FROM_LAUNCHABLE_LOAD;
 
 static bool sending;
+static bool detached;
 
 static bool plink_pw_setup(void *vctx, pollwrapper *pw)
 {
     pollwrap_add_fd_rwx(pw, signalpipe[0], SELECT_R);
 
-    if (!sending &&
+    if (!sending && !detached &&
         backend_connected(backend) &&
         backend_sendok(backend) &&
-        backend_sendbuffer(backend) < MAX_STDIN_BACKLOG) {
+        backend_sendbuffer(backend) < (local_tty ? MAX_STDIN_BACKLOG :
+                                       MAX_BULK_STDIN_BACKLOG)) {
         /* If we're OK to send, then try to read from stdin. */
         pollwrap_add_fd_rwx(pw, STDIN_FILENO, SELECT_R);
     }
@@ -602,18 +645,38 @@ static void plink_pw_check(void *vctx, pollwrapper *pw)
         char c[1];
         struct winsize size;
         if (read(signalpipe[0], c, 1) <= 0)
-            /* ignore error */;
-        /* ignore its value; it'll be `x' */
-        if (ioctl(STDIN_FILENO, TIOCGWINSZ, (void *)&size) >= 0)
+            c[0] = 'x';                /* ignore error */
+        if (c[0] == 'm') {
+            char *stats = mempool_stats_summary();
+            fprintf(stderr, "Memory pools: %s\n", stats);
+            sfree(stats);
+            if (backend->vt->protocol == PROT_SSH ||
+                backend->vt->protocol == PROT_SSHCONN) {
+                stats = ssh_counters_summary(backend);
+                fputs(stats, stderr);
+                sfree(stats);
+            }
+            fflush(stderr);
+        } else if (ioctl(STDIN_FILENO, TIOCGWINSZ, (void *)&size) >= 0) {
             backend_size(backend, size.ws_col, size.ws_row);
+        }
     }
 
     if (pollwrap_check_fd_rwx(pw, STDIN_FILENO, SELECT_R)) {
-        char buf[4096];
-        int ret;
+        static char *bulkbuf;
+        char ttybuf[4096], *buf = ttybuf;
+        size_t bufsize = sizeof(ttybuf);
+        ssize_t ret;
+
+        if (!local_tty) {
+            if (!bulkbuf)
+                bulkbuf = snewn(BULK_STDIN_READ, char);
+            buf = bulkbuf;
+            bufsize = BULK_STDIN_READ;
+        }
 
         if (backend_connected(backend)) {
-            ret = read(STDIN_FILENO, buf, sizeof(buf));
+            ret = read(STDIN_FILENO, buf, bufsize);
             noise_ultralight(NOISE_SOURCE_IOLEN, ret);
             if (ret < 0) {
                 perror("stdin: read");
@@ -639,12 +702,63 @@ static void plink_pw_check(void *vctx, pollwrapper *pw)
     }
 }
 
+/*
+ * If we're a connection-sharing upstream told to outlive our own
+ * session (-sharepersist), then once that session is over we fork.
+ * The parent exits with the session's status, as if the connection
+ * had closed; the child carries on in the background, cut off from
+ * our terminal and standard streams, serving downstreams until the
+ * connection layer decides it's been idle for long enough.
+ */
+static void plink_detach(void)
+{
+    int exitcode = backend_exitcode(backend);
+    int fd;
+    pid_t pid;
+
+    detached = true;
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "plink: unable to fork shared connection into "
+                "background: %s\n", strerror(errno));
+        return;
+    } else if (pid > 0) {
+        cleanup_termios();
+        _exit(exitcode);
+    }
+
+    /* The worker pool and log writers reset themselves in the child
+     * (see their pthread_atfork handlers), and start new threads when
+     * they're next needed. These have pipes to sort out as well. */
+    uxsel_thread_callbacks_after_fork();
+    sk_namelookup_after_fork();
+
+    setsid();
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO)
+            close(fd);
+    }
+    local_tty = false;
+}
+
 static bool plink_continue(void *vctx, bool found_any_fd,
                            bool ran_any_callback)
 {
     if (!backend_connected(backend) &&
         bufchain_size(&stdout_data) == 0 && bufchain_size(&stderr_data) == 0)
         return false;                  /* terminate main loop */
+
+    if (!detached &&
+        conf_get_int(conf, CONF_ssh_connection_sharing_persist) > 0 &&
+        backend_exitcode(backend) >= 0 &&
+        bufchain_size(&stdout_data) == 0 && bufchain_size(&stderr_data) == 0)
+        plink_detach();
+
     return true;
 }
 
@@ -655,6 +769,7 @@ int main(int argc, char **argv)
     enum TriState sanitise_stdout = AUTO, sanitise_stderr = AUTO;
     bool use_subsystem = false;
     bool just_test_share_exists = false;
+    bool just_query_share_stats = false;
     struct winsize size;
     const struct BackendVtable *backvt;
 
@@ -737,6 +852,19 @@ int main(int argc, char **argv)
             }
         } else if (!strcmp(p, "-shareexists")) {
             just_test_share_exists = true;
+        } else if (!strcmp(p, "-sharestats")) {
+            just_query_share_stats = true;
+        } else if (!strcmp(p, "-sharepersist")) {
+            if (argc <= 1) {
+                fprintf(stderr, "plink: option \"-sharepersist\" requires "
+                        "an argument\n");
+                errors = true;
+            } else {
+                --argc;
+                conf_set_bool(conf, CONF_ssh_connection_sharing, true);
+                conf_set_int(conf, CONF_ssh_connection_sharing_persist,
+                             atoi(*++argv));
+            }
         } else if (!strcmp(p, "-fuzznet")) {
             conf_set_int(conf, CONF_proxy_type, PROXY_FUZZ);
             conf_set_str(conf, CONF_proxy_telnet_command, "%host");
@@ -845,6 +973,7 @@ int main(int argc, char **argv)
     cloexec(signalpipe[0]);
     cloexec(signalpipe[1]);
     putty_signal(SIGWINCH, sigwinch);
+    putty_signal(SIGUSR1, sigusr1);
 
     /*
      * Now that we've got the SIGWINCH handler installed, try to find
@@ -909,6 +1038,22 @@ int main(int argc, char **argv)
             return 1;
     }
 
+    if (just_query_share_stats) {
+        /*
+         * Only ever talk to an existing upstream for this, rather
+         * than making a connection of our own to ask.
+         */
+        if (!backvt->test_for_upstream ||
+            !backvt->test_for_upstream(conf_get_str(conf, CONF_host),
+                                       conf_get_int(conf, CONF_port), conf)) {
+            fprintf(stderr, "plink: no connection-sharing upstream found\n");
+            return 1;
+        }
+        conf_set_bool(conf, CONF_ssh_connection_sharing, true);
+        conf_set_bool(conf, CONF_ssh_connection_sharing_upstream, false);
+        conf_set_bool(conf, CONF_ssh_connection_sharing_stats, true);
+    }
+
     /*
      * Start up the connection.
      */
@@ -954,6 +1099,7 @@ int main(int argc, char **argv)
         fprintf(stderr, "Remote process exit code unavailable\n");
         exitcode = 1;                  /* this is an error condition */
     }
+    logfclose(logctx);                 /* finish off a compressed log */
     cleanup_exit(exitcode);
     return exitcode;                   /* shouldn't happen, but placates gcc */
 }
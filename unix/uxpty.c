@@ -65,6 +65,12 @@
 
 typedef struct Pty Pty;
 
+/*
+ * Most data we'll read from the child's output in one select event
+ * before passing it on to the seat.
+ */
+#define PTY_READ_BUFSIZE 131072
+
 /*
  * The pty_signal_pipe, along with the SIGCHLD handler, must be
  * process-global rather than session-specific.
@@ -599,7 +605,7 @@ static void pty_try_wait(void);
 
 static void pty_real_select_result(Pty *pty, int fd, int event, int status)
 {
-    char buf[4096];
+    static char buf[PTY_READ_BUFSIZE];
     int ret;
     bool finished = false;
 
@@ -646,6 +652,25 @@ static void pty_real_select_result(Pty *pty, int fd, int event, int status)
             if (fd == pty->master_fd && ret < 0 && errno == EIO)
                 ret = 0;
 
+            /*
+             * If the child is producing output fast, keep reading
+             * until the pty master runs dry or our buffer is full,
+             * and hand the lot to the seat in one go, since each
+             * seat_output call means a separate pass through the
+             * terminal's input processing. (Only the pty master is
+             * non-blocking, so a pipe just gets the one read.) A
+             * read that fails or hits EOF here will do so again on
+             * the next select, once we've delivered what we have.
+             */
+            if (fd == pty->master_fd && ret > 0) {
+                while (ret < (int)sizeof(buf)) {
+                    ssize_t more = read(fd, buf + ret, sizeof(buf) - ret);
+                    if (more <= 0)
+                        break;
+                    ret += more;
+                }
+            }
+
             if (ret == 0) {
                 /*
                  * EOF on this input fd, so to begin with, we may as
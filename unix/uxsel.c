@@ -11,6 +11,7 @@
  */
 
 #include <assert.h>
+#include <unistd.h>
 
 #include "putty.h"
 #include "tree234.h"
@@ -122,6 +123,77 @@ void select_result(int fd, int event)
      * assume it means I need to ignore the event since it's on an
      * fd I've stopped being interested in. Sigh.
      */
-    if (fdstruct)
+    if (fdstruct) {
+        uint64_t trace_start = trace_begin();
         fdstruct->callback(fd, event);
+        trace_end("fd", fd, trace_start);
+    }
+}
+
+/*
+ * Other threads wake the main thread, to collect callbacks they've
+ * queued with queue_toplevel_callback_from_thread, by writing to a
+ * pipe.
+ */
+static int thread_wakeup_pipe[2] = { -1, -1 };
+
+static void uxsel_thread_wakeup(void)
+{
+    if (write(thread_wakeup_pipe[1], "", 1) < 0) {
+        /* The pipe can only be full if the main thread hasn't
+         * drained it yet, so it'll wake up anyway */
+    }
+}
+
+static void uxsel_thread_woken(int fd, int event)
+{
+    char buf[64];
+
+    /* Drain the pipe first, so that a wakeup after we've looked at
+     * the queue isn't lost */
+    while (read(fd, buf, sizeof(buf)) > 0);
+    run_thread_callbacks();
+}
+
+static bool uxsel_thread_pipe_open(void)
+{
+    if (pipe(thread_wakeup_pipe) < 0) {
+        thread_wakeup_pipe[0] = thread_wakeup_pipe[1] = -1;
+        return false;
+    }
+    for (unsigned i = 0; i < 2; i++) {
+        cloexec(thread_wakeup_pipe[i]);
+        nonblock(thread_wakeup_pipe[i]);
+    }
+    uxsel_set(thread_wakeup_pipe[0], SELECT_R, uxsel_thread_woken);
+    return true;
+}
+
+/*
+ * Called in the child after a fork(), if it's going to carry on
+ * running rather than exec something. It mustn't go on sharing the
+ * pipe with its parent, whose threads could still write to it. So it
+ * gets a new one, and wakes itself at once, in case any callbacks
+ * were queued before the fork.
+ */
+void uxsel_thread_callbacks_after_fork(void)
+{
+    if (thread_wakeup_pipe[0] < 0)
+        return;
+    uxsel_del(thread_wakeup_pipe[0]);
+    close(thread_wakeup_pipe[0]);
+    close(thread_wakeup_pipe[1]);
+    if (uxsel_thread_pipe_open())
+        uxsel_thread_wakeup();
+}
+
+bool platform_enable_thread_callbacks(void)
+{
+    if (thread_wakeup_pipe[0] >= 0)
+        return true;
+
+    if (!uxsel_thread_pipe_open())
+        return false;
+    request_thread_callback_wakeups(uxsel_thread_wakeup);
+    return true;
 }
@@ -15,7 +15,17 @@
 #include "putty.h"
 #include "tree234.h"
 
-#define SERIAL_MAX_BACKLOG 4096
+/*
+ * At multi-megabaud rates the port can deliver data faster than the
+ * terminal drains it in bursts, so we allow a generous backlog before
+ * we stop reading (and let the device's buffers overflow). Each time
+ * the port is readable we drain it as far as SERIAL_READ_BATCH before
+ * handing the data on, and we write in chunks of up to
+ * SERIAL_WRITE_BATCH rather than one bufchain block at a time.
+ */
+#define SERIAL_MAX_BACKLOG 65536
+#define SERIAL_READ_BATCH 65536
+#define SERIAL_WRITE_BATCH 16384
 
 typedef struct Serial Serial;
 struct Serial {
@@ -366,8 +376,9 @@ static void serial_reconfig(Backend *be, Conf *conf)
 static void serial_select_result(int fd, int event)
 {
     Serial *serial;
-    char buf[4096];
-    int ret;
+    char buf[SERIAL_READ_BATCH];
+    size_t got = 0;
+    ssize_t ret;
     bool finished = false;
 
     serial = find234(serial_by_fd, &fd, serial_find_by_fd);
@@ -376,9 +387,23 @@ static void serial_select_result(int fd, int event)
         return;                /* spurious event; keep going */
 
     if (event == 1) {
-        ret = read(serial->fd, buf, sizeof(buf));
+        /*
+         * A tty read returns at most what the line discipline has
+         * buffered, which is much less than arrives between two
+         * passes of the event loop at high baud rates, so keep
+         * reading until the port is empty.
+         */
+        while (got < sizeof(buf)) {
+            ret = read(serial->fd, buf + got, sizeof(buf) - got);
+            if (ret <= 0)
+                break;
+            got += ret;
+        }
 
-        if (ret == 0) {
+        if (got > 0) {
+            serial->inbufsize = seat_stdout(serial->seat, buf, got);
+            serial_uxsel_setup(serial); /* might acquire backlog and freeze */
+        } else if (ret == 0) {
             /*
              * Shouldn't happen on a real serial port, but I'm open
              * to the idea that there might be two-way devices we
@@ -396,9 +421,6 @@ static void serial_select_result(int fd, int event)
 #endif
             perror("read serial port");
             exit(1);
-        } else if (ret > 0) {
-            serial->inbufsize = seat_stdout(serial->seat, buf, ret);
-            serial_uxsel_setup(serial); /* might acquire backlog and freeze */
         }
     } else if (event == 2) {
         /*
@@ -435,6 +457,16 @@ static void serial_try_write(Serial *serial)
 
     while (bufchain_size(&serial->output_data) > 0) {
         ptrlen data = bufchain_prefix(&serial->output_data);
+        char buf[SERIAL_WRITE_BATCH];
+
+        /* Coalesce lots of small blocks (e.g. keystrokes) into one write */
+        if (data.len < sizeof(buf) &&
+            bufchain_size(&serial->output_data) > data.len) {
+            data.len = min(bufchain_size(&serial->output_data), sizeof(buf));
+            bufchain_fetch(&serial->output_data, buf, data.len);
+            data.ptr = buf;
+        }
+
         ret = write(serial->fd, data.ptr, data.len);
 
         if (ret < 0 && (errno == EWOULDBLOCK)) {
@@ -35,8 +35,10 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <pwd.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 
 #include "putty.h"
 #include "mpint.h"
@@ -104,6 +106,7 @@ void timer_change_notify(unsigned long next)
 char *platform_get_x_display(void) { return NULL; }
 
 static bool verbose;
+static int worker_index = -1;          /* >= 0 in a --workers child */
 
 struct AuthPolicyShared {
     struct AuthPolicy_ssh1_pubkey *ssh1keys;
@@ -123,6 +126,8 @@ struct server_instance {
 
 static void log_to_stderr(unsigned id, const char *msg)
 {
+    if (worker_index >= 0)
+        fprintf(stderr, "[w%d] ", worker_index);
     if (id != (unsigned)-1)
         fprintf(stderr, "#%u: ", id);
     fputs(msg, stderr);
@@ -307,6 +312,8 @@ static void show_help(FILE *fp)
     fputs("\n"
           "usage:   uppity [options]\n"
           "options: --listen [PORT|PATH] listen to a port on localhost, or Unix socket\n"
+          "         --workers N          (with --listen) serve connections "
+          "from N processes\n"
           "         --listen-once        (with --listen) stop after one "
           "connection\n"
           "         --hostkey KEY        SSH host key (need at least one)\n"
@@ -335,6 +342,9 @@ static void show_help(FILE *fp)
           "s->c compression types\n"
           "         --ssh1-ciphers STR     override list of SSH-1 ciphers\n"
           "         --ssh1-no-compression  forbid compression in SSH-1\n"
+          "         --coalesce-ms MS     hold back session output for up to "
+          "MS ms\n"
+          "         --coalesce-bytes N   ... or until N bytes are waiting\n"
           "         --exitsignum         send buggy numeric \"exit-signal\" "
           "message\n"
           "         --verbose            print event log messages to standard "
@@ -360,11 +370,20 @@ const bool buildinfo_gtk_relevant = false;
 
 static bool listening = false, listen_once = false;
 static bool finished = false;
+
+/* Per-process connection counts, reported by each --workers child */
+static unsigned long conns_accepted, conns_finished;
+static unsigned conns_active;
+
 void server_instance_terminated(LogPolicy *lp)
 {
     struct server_instance *inst = container_of(
         lp, struct server_instance, logpolicy);
 
+    conns_finished++;
+    if (conns_active)
+        conns_active--;
+
     if (listening && !listen_once) {
         log_to_stderr(inst->id, "connection terminated");
     } else {
@@ -498,6 +517,9 @@ static int server_accepting(Plug *p, accept_fn_t constructor, accept_ctx_t ctx)
     sfree(msg);
     sk_free_peer_info(pi);
 
+    conns_accepted++;
+    conns_active++;
+
     sk_set_frozen(s, false);
     ssh_server_start(plug, s);
     return 0;
@@ -509,6 +531,222 @@ static const PlugVtable server_plugvt = {
     .accepting = server_accepting,
 };
 
+/* ----------------------------------------------------------------------
+ * Multi-process mode (--workers). The listening socket is made once,
+ * and then each of N forked worker processes runs its own event loop
+ * accepting connections from it, so that kex, crypto and SFTP work
+ * for different clients can run on different cores. The parent just
+ * supervises: it restarts workers that die, and forwards SIGTERM
+ * (drain and exit) and SIGUSR1 (report statistics) to all of them.
+ *
+ * A draining worker stops accepting, and exits once its existing
+ * connections have all finished. A second SIGTERM makes it exit at
+ * once.
+ */
+
+#define MAX_WORKERS 256
+
+static int nworkers = 1;
+static pid_t worker_pids[MAX_WORKERS];
+static time_t worker_started[MAX_WORKERS];
+static volatile sig_atomic_t supervisor_draining;
+
+static struct server_config *worker_cfg;
+static bool worker_draining;
+static int worker_signalpipe[2] = { -1, -1 };
+
+static void supervisor_signal(int sig)
+{
+    if (sig == SIGTERM)
+        supervisor_draining = 1;
+    for (int i = 0; i < nworkers; i++)
+        if (worker_pids[i] > 0)
+            kill(worker_pids[i], sig);
+}
+
+static void worker_signal(int sig)
+{
+    char c = (sig == SIGTERM ? 't' : 's');
+    if (write(worker_signalpipe[1], &c, 1) < 0) {
+        /* not much we can do about it */
+    }
+}
+
+static void worker_report(void)
+{
+    char *msg = dupprintf("pid %d: %lu connections accepted, "
+                          "%lu finished, %u active%s", (int)getpid(),
+                          conns_accepted, conns_finished, conns_active,
+                          worker_draining ? " (draining)" : "");
+    log_to_stderr(-1, msg);
+    sfree(msg);
+}
+
+static void worker_signal_readable(int fd, int event)
+{
+    char buf[32];
+    int ret;
+
+    while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+        for (int i = 0; i < ret; i++) {
+            if (buf[i] == 's') {
+                worker_report();
+            } else if (worker_draining) {
+                log_to_stderr(-1, "second SIGTERM, exiting now");
+                worker_report();
+                exit(0);
+            } else {
+                worker_draining = true;
+                if (worker_cfg->listening_socket) {
+                    sk_close(worker_cfg->listening_socket);
+                    worker_cfg->listening_socket = NULL;
+                }
+                worker_report();
+            }
+        }
+    }
+}
+
+static bool worker_continue(void *ctx, bool found_fd, bool ran_callback)
+{
+    return !(worker_draining && conns_active == 0);
+}
+
+static void worker_seed_callback(void *noise, int length)
+{
+    random_reseed(make_ptrlen(noise, length));
+}
+
+/*
+ * Returns true in the child, with everything set up for it to enter
+ * the main loop; false in the parent (whether or not fork worked).
+ */
+static bool start_worker(int index)
+{
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        char *msg = dupprintf("fork: %s", strerror(errno));
+        log_to_stderr(-1, msg);
+        sfree(msg);
+        return false;
+    }
+
+    if (pid > 0) {
+        worker_pids[index] = pid;
+        worker_started[index] = time(NULL);
+        return false;
+    }
+
+    worker_index = index;
+    cliloop_after_fork();
+
+    /* Every worker starts with a copy of the parent's random pool,
+     * so they must each mix in something of their own before use. */
+    pid = getpid();
+    random_reseed(make_ptrlen(&pid, sizeof(pid)));
+    noise_get_fast(worker_seed_callback);
+
+    if (pipe(worker_signalpipe) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    cloexec(worker_signalpipe[0]);
+    cloexec(worker_signalpipe[1]);
+    nonblock(worker_signalpipe[0]);
+    nonblock(worker_signalpipe[1]);
+    uxsel_set(worker_signalpipe[0], SELECT_R, worker_signal_readable);
+    putty_signal(SIGTERM, worker_signal);
+    putty_signal(SIGUSR1, worker_signal);
+
+    return true;
+}
+
+/*
+ * Returns in each worker process. The parent never returns.
+ */
+static void run_workers(struct server_config *cfg)
+{
+    sigset_t sigs, oldsigs;
+    int alive = 0;
+    bool listener_closed = false;
+
+    worker_cfg = cfg;
+
+    /* Hold off our signals until each child has its own handlers */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &sigs, &oldsigs);
+    putty_signal(SIGTERM, supervisor_signal);
+    putty_signal(SIGUSR1, supervisor_signal);
+
+    for (int i = 0; i < nworkers; i++) {
+        if (start_worker(i)) {
+            sigprocmask(SIG_SETMASK, &oldsigs, NULL);
+            return;
+        }
+        if (worker_pids[i] > 0)
+            alive++;
+    }
+    sigprocmask(SIG_SETMASK, &oldsigs, NULL);
+
+    while (alive > 0) {
+        int status;
+        pid_t pid;
+
+        if (supervisor_draining && !listener_closed) {
+            sk_close(cfg->listening_socket);
+            cfg->listening_socket = NULL;
+            listener_closed = true;
+            log_to_stderr(-1, "draining workers");
+        }
+
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("waitpid");
+            exit(1);
+        }
+
+        int i;
+        for (i = 0; i < nworkers; i++)
+            if (worker_pids[i] == pid)
+                break;
+        if (i == nworkers)
+            continue;
+        worker_pids[i] = 0;
+        alive--;
+
+        char *msg;
+        if (WIFSIGNALED(status))
+            msg = dupprintf("worker %d (pid %d) killed by signal %d",
+                            i, (int)pid, WTERMSIG(status));
+        else
+            msg = dupprintf("worker %d (pid %d) exited with status %d",
+                            i, (int)pid, WEXITSTATUS(status));
+        log_to_stderr(-1, msg);
+        sfree(msg);
+
+        if (!supervisor_draining) {
+            /* Don't spin if a worker is failing straight away */
+            if (time(NULL) - worker_started[i] < 1)
+                sleep(1);
+            sigprocmask(SIG_BLOCK, &sigs, NULL);
+            if (start_worker(i)) {
+                sigprocmask(SIG_SETMASK, &oldsigs, NULL);
+                return;
+            }
+            sigprocmask(SIG_SETMASK, &oldsigs, NULL);
+            if (worker_pids[i] > 0)
+                alive++;
+        }
+    }
+
+    exit(0);
+}
+
 int main(int argc, char **argv)
 {
     int listen_port = -1;
@@ -531,6 +769,7 @@ int main(int argc, char **argv)
     ssc.session_starting_dir = getenv("HOME");
     ssc.ssh1_cipher_mask = SSH1_SUPPORTED_CIPHER_MASK;
     ssc.ssh1_allow_compression = true;
+    ssc.output_coalesce_bytes = 32768;
 
     if (argc <= 1) {
         /*
@@ -564,6 +803,13 @@ int main(int argc, char **argv)
             }
         } else if (!strcmp(arg, "--listen-once")) {
             listen_once = true;
+        } else if (longoptarg(arg, "--workers", &val, &argc, &argv)) {
+            nworkers = atoi(val);
+            if (nworkers < 1 || nworkers > MAX_WORKERS) {
+                fprintf(stderr, "%s: --workers expects a number from 1 "
+                        "to %d\n", appname, MAX_WORKERS);
+                exit(1);
+            }
         } else if (longoptarg(arg, "--hostkey", &val, &argc, &argv)) {
             Filename *keyfile;
             int keytype;
@@ -761,6 +1007,16 @@ int main(int argc, char **argv)
             ssc.ssh1_allow_compression = false;
         } else if (longoptnoarg(arg, "--exitsignum")) {
             ssc.exit_signal_numeric = true;
+        } else if (longoptarg(arg, "--coalesce-ms", &val, &argc, &argv)) {
+            int ms = atoi(val);
+            if (ms < 0 || ms > 1000) {
+                fprintf(stderr, "%s: --coalesce-ms expects a number from 0 "
+                        "to 1000\n", appname);
+                exit(1);
+            }
+            ssc.output_coalesce_ms = ms;
+        } else if (longoptarg(arg, "--coalesce-bytes", &val, &argc, &argv)) {
+            ssc.output_coalesce_bytes = strtoul(val, NULL, 0);
         } else if (longoptarg(arg, "--sshlog", &val, &argc, &argv) ||
                    longoptarg(arg, "-sshlog", &val, &argc, &argv)) {
             Filename *logfile = filename_from_str(val);
@@ -788,6 +1044,12 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    if (nworkers > 1 && (listen_once || (listen_port < 0 && !listen_socket))) {
+        fprintf(stderr, "%s: --workers requires --listen, and not "
+                "--listen-once\n", appname);
+        exit(1);
+    }
+
     random_ref();
 
     /*
@@ -828,6 +1090,9 @@ int main(int argc, char **argv)
 
         log_to_stderr(-1, msg);
         sfree(msg);
+
+        if (nworkers > 1)
+            run_workers(&scfg);
     } else {
         struct server_instance *inst;
         Plug *plug = server_conn_plug(&scfg, &inst);
@@ -836,6 +1101,7 @@ int main(int argc, char **argv)
     }
 
     cli_main_loop(cliloop_no_pw_setup, cliloop_no_pw_check,
+                  worker_index >= 0 ? worker_continue :
                   cliloop_always_continue, NULL);
 
     return 0;
@@ -2,9 +2,12 @@
  * uxsftp.c: the Unix-specific parts of PSFTP and PSCP.
  */
 
+#define _GNU_SOURCE /* for SEEK_DATA and SEEK_HOLE */
+
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <dirent.h>
@@ -110,8 +113,22 @@ char *psftp_getcwd(void)
     }
 }
 
+/*
+ * How much of a file read_from_file_mapped maps in at once. Mapping
+ * the whole thing could use up the address space of a 32-bit process
+ * when the file is large.
+ */
+#define MAP_WINDOW_SIZE ((size_t)32 << 20)
+
 struct RFile {
     int fd;
+    char *map;                         /* mapped window onto the file */
+    uint64_t mapoffset;
+    size_t maplen;
+    bool nomap;                        /* can't map it: use pread */
+    bool noseek;                       /* can't even do that: use read */
+    char *buf;                         /* ... into here */
+    size_t bufsize;
 };
 
 RFile *open_existing_file(const char *name, uint64_t *size,
@@ -126,6 +143,7 @@ RFile *open_existing_file(const char *name, uint64_t *size,
         return NULL;
 
     ret = snew(RFile);
+    memset(ret, 0, sizeof(*ret));
     ret->fd = fd;
 
     if (size || mtime || atime || perms) {
@@ -156,17 +174,116 @@ int read_from_file(RFile *f, void *buffer, int length)
     return read(f->fd, buffer, length);
 }
 
+/*
+ * Move the mapped window so that it starts at (or just before)
+ * offset, in a file currently of the given size. Returns false if the
+ * mapping failed.
+ */
+static bool rfile_remap(RFile *f, uint64_t offset, uint64_t size)
+{
+    uint64_t start;
+    void *map;
+
+    if (f->map) {
+        munmap(f->map, f->maplen);
+        f->map = NULL;
+    }
+
+    start = offset - offset % sysconf(_SC_PAGESIZE);
+    f->maplen = MAP_WINDOW_SIZE;
+    if (f->maplen > size - start)
+        f->maplen = size - start;
+
+    map = mmap(NULL, f->maplen, PROT_READ, MAP_SHARED, f->fd, start);
+    if (map == MAP_FAILED) {
+        f->nomap = true;
+        return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, f->maplen, MADV_SEQUENTIAL);
+#endif
+    f->map = map;
+    f->mapoffset = start;
+    return true;
+}
+
+int read_from_file_mapped(RFile *f, uint64_t offset,
+                          const void **data, int length)
+{
+    int ret;
+
+    if (!f->nomap) {
+        struct stat statbuf;
+
+        /*
+         * Check the file's current size every time. Touching a page
+         * of a shared mapping past the end of a file that has shrunk
+         * since we mapped it raises SIGBUS, so we must never hand
+         * back a pointer to more than is there now. (This narrows the
+         * window rather than closing it: a file truncated while we're
+         * actually sending from it can still do that.)
+         */
+        if (fstat(f->fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)) {
+            f->nomap = true;
+        } else {
+            uint64_t size = statbuf.st_size;
+
+            if (offset >= size)
+                return 0;              /* end of file */
+            if (length > size - offset)
+                length = size - offset;
+            if ((f->map && offset >= f->mapoffset &&
+                 offset + length <= f->mapoffset + f->maplen) ||
+                rfile_remap(f, offset, size)) {
+                uint64_t avail = f->mapoffset + f->maplen - offset;
+                if (length > avail)
+                    length = avail;
+                *data = f->map + (offset - f->mapoffset);
+                return length;
+            }
+        }
+    }
+
+    sgrowarray(f->buf, f->bufsize, length);
+    *data = f->buf;
+
+    /*
+     * A pipe or FIFO can't be read at an offset at all. Our callers
+     * read from start to end, so read it in order instead.
+     */
+    if (!f->noseek) {
+        ret = pread(f->fd, f->buf, length, offset);
+        if (ret >= 0 || errno != ESPIPE)
+            return ret;
+        f->noseek = true;
+    }
+    return read(f->fd, f->buf, length);
+}
+
 void close_rfile(RFile *f)
 {
+    if (f->map)
+        munmap(f->map, f->maplen);
     close(f->fd);
+    sfree(f->buf);
     sfree(f);
 }
 
 struct WFile {
     int fd;
     char *name;
+    bool seekable;
 };
 
+static WFile *wfile_new(int fd, const char *name)
+{
+    WFile *ret = snew(WFile);
+    ret->fd = fd;
+    ret->name = dupstr(name);
+    ret->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    return ret;
+}
+
 WFile *open_new_file(const char *name, long perms)
 {
     int fd;
@@ -177,9 +294,7 @@ WFile *open_new_file(const char *name, long perms)
     if (fd < 0)
         return NULL;
 
-    ret = snew(WFile);
-    ret->fd = fd;
-    ret->name = dupstr(name);
+    ret = wfile_new(fd, name);
 
     return ret;
 }
@@ -190,13 +305,11 @@ WFile *open_existing_wfile(const char *name, uint64_t *size)
     int fd;
     WFile *ret;
 
-    fd = open(name, O_APPEND | O_WRONLY);
+    fd = open(name, O_WRONLY);
     if (fd < 0)
         return NULL;
 
-    ret = snew(WFile);
-    ret->fd = fd;
-    ret->name = dupstr(name);
+    ret = wfile_new(fd, name);
 
     if (size) {
         struct stat statbuf;
@@ -234,6 +347,40 @@ int write_to_file(WFile *f, void *buffer, int length)
     return so_far;
 }
 
+int write_to_file_at(WFile *f, uint64_t offset, void *buffer, int length)
+{
+    char *p = (char *)buffer;
+    int so_far = 0;
+
+    /* Keep trying until we've really written as much as we can. */
+    while (length > 0) {
+        int ret = pwrite(f->fd, p, length, offset);
+
+        if (ret < 0)
+            return ret;
+
+        if (ret == 0)
+            break;
+
+        p += ret;
+        length -= ret;
+        offset += ret;
+        so_far += ret;
+    }
+
+    return so_far;
+}
+
+bool wfile_can_write_at(WFile *f)
+{
+    return f->seekable;
+}
+
+int truncate_file(WFile *f, uint64_t size)
+{
+    return ftruncate(f->fd, size) == 0 ? 0 : -1;
+}
+
 void set_file_times(WFile *f, unsigned long mtime, unsigned long atime)
 {
     struct utimbuf ut;
@@ -245,11 +392,12 @@ void set_file_times(WFile *f, unsigned long mtime, unsigned long atime)
 }
 
 /* Closes and frees the WFile */
-void close_wfile(WFile *f)
+int close_wfile(WFile *f)
 {
-    close(f->fd);
+    int ret = close(f->fd);
     sfree(f->name);
     sfree(f);
+    return ret < 0 ? -1 : 0;
 }
 
 /* Seek offset bytes through file, from whence, where whence is
@@ -280,6 +428,44 @@ uint64_t get_file_posn(WFile *f)
     return lseek(f->fd, (off_t) 0, SEEK_CUR);
 }
 
+bool find_file_data(RFile *f, uint64_t offset,
+                    uint64_t *start, uint64_t *end)
+{
+#if defined SEEK_DATA && defined SEEK_HOLE
+    off_t pos, data, hole;
+    struct stat statbuf;
+
+    if ((pos = lseek(f->fd, 0, SEEK_CUR)) < 0)
+        return false;
+
+    data = lseek(f->fd, offset, SEEK_DATA);
+    if (data < 0) {
+        /* ENXIO means there's no more data, only (maybe) a hole */
+        if (errno != ENXIO || fstat(f->fd, &statbuf) < 0) {
+            lseek(f->fd, pos, SEEK_SET);
+            return false;
+        }
+        data = hole = statbuf.st_size;
+    } else if ((hole = lseek(f->fd, data, SEEK_HOLE)) < 0) {
+        lseek(f->fd, pos, SEEK_SET);
+        return false;
+    }
+
+    if (lseek(f->fd, pos, SEEK_SET) < 0)
+        return false;
+    *start = data;
+    *end = hole;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void set_file_sparse(WFile *f)
+{
+    /* Unix filesystems leave holes wherever we don't write */
+}
+
 int file_type(const char *name)
 {
     struct stat statbuf;
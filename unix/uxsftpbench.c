@@ -0,0 +1,791 @@
+/*
+ * sftpbench: measure the throughput of PuTTY's SFTP client code
+ * (sftp.c, as used by PSFTP and PSCP) talking to its SFTP server code
+ * (uxsftpserver.c, as used by Uppity and psusan), so that a change
+ * which slows down the transfer path shows up without needing a
+ * network or a real server to notice it.
+ *
+ * Both ends run in this one process, connected by a socketpair, and
+ * a simple poll loop shuttles data between them. The SFTP byte stream
+ * can either go over the socket bare, or be wrapped in SSH-2
+ * CHANNEL_DATA packets by a pair of ordinary ssh2bpp instances, so
+ * that the cost of the cipher and MAC is included too. There's no key
+ * exchange and no connection layer: both ends are simply handed the
+ * same arbitrary keys, and channel windows don't come into it.
+ *
+ * The program uploads a file of the chosen size into a scratch
+ * directory, downloads it again, and reports the speed of each in
+ * MB/s. By default it keeps a fixed number of fixed-size requests in
+ * flight; with -xfer it uses the adaptive transfer manager from
+ * sftp.c instead, just as PSFTP does. With -aio the server end is
+ * allowed to answer READ and WRITE requests from its I/O threads, as
+ * it does in Uppity and psusan.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "putty.h"
+#include "ssh.h"
+#include "sshbpp.h"
+#include "sftp.h"
+
+static NORETURN PRINTF_LIKE(1, 2) void fatal_error(const char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "sftpbench: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+const bool buildinfo_gtk_relevant = false;
+
+void modalfatalbox(const char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "sftpbench: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+/*
+ * The things the BPPs expect to find in the rest of an SSH
+ * connection. Any of them being called means the benchmark has gone
+ * wrong, except for the ones that are only notifications.
+ */
+void ssh_sw_abort(Ssh *ssh, const char *fmt, ...)
+{
+    va_list ap;
+    fprintf(stderr, "sftpbench: SSH error: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+void ssh_remote_error(Ssh *ssh, const char *fmt, ...)
+{ fatal_error("unexpected end of connection"); }
+void ssh_remote_eof(Ssh *ssh, const char *fmt, ...)
+{ fatal_error("unexpected end of connection"); }
+void ssh_check_frozen(Ssh *ssh) {}
+void ssh_conn_processed_data(Ssh *ssh) {}
+
+void logevent_and_free(LogContext *logctx, char *event) { sfree(event); }
+void old_keyfile_warning(void) { }
+void noise_ultralight(NoiseSourceId id, unsigned long data) { }
+
+/* We poll uxsel's fds ourselves in bench_pump */
+uxsel_id *uxsel_input_add(int fd, int rwx) { return NULL; }
+void uxsel_input_remove(uxsel_id *id) { }
+void log_packet(LogContext *logctx, int direction, int type,
+                const char *texttype, const void *data, size_t len,
+                int n_blanks, const struct logblank_t *blanks,
+                const unsigned long *seq,
+                unsigned downstream_id, const char *additional_log_text)
+{ unreachable("the benchmark never gives its BPPs a LogContext"); }
+
+/*
+ * The benchmark doesn't need unpredictable numbers, only some bytes
+ * for packet padding and the server's handle key, so a trivial
+ * generator will do and keeps the RNG out of the measurements.
+ */
+void random_read(void *vbuf, size_t size)
+{
+    static uint64_t state = 0x5DEECE66DULL;
+    unsigned char *buf = (unsigned char *)vbuf;
+
+    while (size-- > 0) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        *buf++ = state >> 56;
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * The two ends of the connection.
+ */
+
+typedef struct BenchEnd {
+    int fd;
+    bufchain in_raw, out_raw;          /* what goes over the socket */
+    bufchain in;                       /* SFTP data received */
+    BinaryPacketProtocol *bpp;         /* NULL when running bare */
+    struct DataTransferStats stats;
+} BenchEnd;
+
+static BenchEnd client, server;
+static SftpServer *sftpsrv;
+static bool server_aio;
+
+/* We send CHANNEL_DATA in packets no bigger than PuTTY's own limit */
+#define BENCH_PACKET_DATA OUR_V2_MAXPKT
+
+/* Give up if the connection does nothing for this long */
+#define BENCH_STALL_TIMEOUT 30000      /* milliseconds */
+
+/*
+ * ssh2bpp always wants a compression method, even if it's none. (The
+ * one ssh2transport.c uses for that is private to it.)
+ */
+static ssh_compressor *bench_compress_new(int level) { return NULL; }
+static ssh_decompressor *bench_decompress_new(void) { return NULL; }
+static const ssh_compression_alg bench_no_compression = {
+    .name = "none",
+    .compress_new = bench_compress_new,
+    .decompress_new = bench_decompress_new,
+};
+
+static void end_init(BenchEnd *e, int fd)
+{
+    memset(e, 0, sizeof(*e));
+    e->fd = fd;
+    bufchain_init(&e->in_raw);
+    bufchain_init(&e->out_raw);
+    bufchain_init(&e->in);
+}
+
+static void end_start_ssh(BenchEnd *e, bool is_server,
+                          const ssh_cipheralg *cipher,
+                          const ssh2_macalg *mac, bool etm)
+{
+    unsigned char ckey[64], iv[32], mackey[64];
+
+    /*
+     * Both ends must get the same keys in both directions, so
+     * generate them from a fixed starting point rather than
+     * calling random_read.
+     */
+    memset(ckey, 0x55, sizeof(ckey));
+    memset(iv, 0xAA, sizeof(iv));
+    memset(mackey, 0x33, sizeof(mackey));
+    assert(cipher->padded_keybytes <= sizeof(ckey));
+    assert(cipher->blksize <= sizeof(iv));
+    assert(!mac || mac->keylen <= sizeof(mackey));
+
+    e->bpp = ssh2_bpp_new(NULL, &e->stats, is_server);
+    e->bpp->in_raw = &e->in_raw;
+    e->bpp->out_raw = &e->out_raw;
+    ssh2_bpp_new_outgoing_crypto(e->bpp, cipher, ckey, iv,
+                                 mac, etm, mackey, &bench_no_compression, false);
+    ssh2_bpp_new_incoming_crypto(e->bpp, cipher, ckey, iv,
+                                 mac, etm, mackey, &bench_no_compression, false);
+    queue_idempotent_callback(&e->bpp->ic_in_raw);
+}
+
+static void end_cleanup(BenchEnd *e)
+{
+    if (e->bpp) {
+        ssh_bpp_free(e->bpp);
+        e->bpp = NULL;
+    }
+    bufchain_clear(&e->in_raw);
+    bufchain_clear(&e->out_raw);
+    bufchain_clear(&e->in);
+    close(e->fd);
+}
+
+static void end_send(BenchEnd *e, const void *vdata, size_t len)
+{
+    const char *data = (const char *)vdata;
+
+    if (!e->bpp) {
+        bufchain_add(&e->out_raw, data, len);
+        return;
+    }
+
+    while (len > 0) {
+        size_t this_len = len < BENCH_PACKET_DATA ? len : BENCH_PACKET_DATA;
+        PktOut *pkt = ssh_bpp_new_pktout(e->bpp, SSH2_MSG_CHANNEL_DATA);
+        put_uint32(pkt, 0);            /* recipient channel */
+        put_string(pkt, data, this_len);
+        pq_push(&e->bpp->out_pq, pkt);
+        data += this_len;
+        len -= this_len;
+    }
+}
+
+/* Unwrap whatever CHANNEL_DATA packets the BPP has finished decoding */
+static void end_take_packets(BenchEnd *e)
+{
+    PktIn *pktin;
+
+    if (!e->bpp)
+        return;
+
+    while ((pktin = pq_pop(&e->bpp->in_pq)) != NULL) {
+        ptrlen data;
+
+        if (pktin->type == SSH2_MSG_IGNORE)
+            continue;                  /* CBC-mode countermeasure */
+        if (pktin->type != SSH2_MSG_CHANNEL_DATA)
+            fatal_error("unexpected SSH packet type %d", pktin->type);
+        get_uint32(pktin);             /* recipient channel */
+        data = get_string(pktin);
+        if (get_err(pktin))
+            fatal_error("malformed SSH packet");
+        bufchain_add(&e->in, data.ptr, data.len);
+    }
+}
+
+static void end_io(BenchEnd *e, short revents)
+{
+    if (revents & POLLOUT) {
+        ptrlen data = bufchain_prefix(&e->out_raw);
+        ssize_t ret = write(e->fd, data.ptr, data.len);
+        if (ret > 0)
+            bufchain_consume(&e->out_raw, ret);
+        else if (ret < 0 && errno != EAGAIN && errno != EINTR)
+            fatal_error("write: %s", strerror(errno));
+    }
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        char buf[65536];
+        ssize_t ret = read(e->fd, buf, sizeof(buf));
+        if (ret > 0) {
+            if (e->bpp) {
+                bufchain_add(&e->in_raw, buf, ret);
+                queue_idempotent_callback(&e->bpp->ic_in_raw);
+            } else {
+                bufchain_add(&e->in, buf, ret);
+            }
+        } else if (ret == 0) {
+            fatal_error("unexpected end of connection");
+        } else if (errno != EAGAIN && errno != EINTR) {
+            fatal_error("read: %s", strerror(errno));
+        }
+    }
+}
+
+static void server_send_reply(struct sftp_packet *reply)
+{
+    sftp_send_prepare(reply);
+    end_send(&server, reply->data, reply->length);
+    sftp_pkt_free(reply);
+}
+
+static void server_deferred_reply(void *ctx, struct sftp_packet *reply)
+{
+    if (reply)
+        server_send_reply(reply);
+}
+
+/*
+ * Answer any requests the server end has received in full, in the
+ * same way as the SFTP subsystem in sesschan.c. Returns true if it
+ * found any.
+ */
+static bool serve_requests(void)
+{
+    bool served = false;
+
+    while (bufchain_size(&server.in) >= 4) {
+        char lenbuf[4];
+        unsigned pktlen;
+        struct sftp_packet *pkt, *reply;
+
+        bufchain_fetch(&server.in, lenbuf, 4);
+        pktlen = GET_32BIT_MSB_FIRST(lenbuf);
+
+        if (bufchain_size(&server.in) - 4 < pktlen)
+            break;                     /* wait for more data */
+
+        bufchain_consume(&server.in, 4);
+        pkt = sftp_recv_prepare(pktlen);
+        bufchain_fetch_consume(&server.in, pkt->data, pktlen);
+        sftp_recv_finish(pkt);
+        reply = sftp_handle_request_deferrable(
+            sftpsrv, pkt, server_aio ? server_deferred_reply : NULL, NULL);
+        sftp_pkt_free(pkt);
+
+        if (reply)
+            server_send_reply(reply);
+        served = true;
+    }
+
+    return served;
+}
+
+/*
+ * Do everything that can be done without waiting, then wait for the
+ * socket to be ready for some more and do that too.
+ */
+static void bench_pump(void)
+{
+    BenchEnd *ends[2] = { &client, &server };
+    struct pollfd fds[16];
+    int i, nfds, fd, rwx, fdstate, ret;
+
+    do {
+        while (toplevel_callback_pending())
+            run_toplevel_callbacks();
+        end_take_packets(&client);
+        end_take_packets(&server);
+    } while (serve_requests());
+
+    for (i = 0; i < 2; i++) {
+        fds[i].fd = ends[i]->fd;
+        fds[i].events = POLLIN;
+        if (bufchain_size(&ends[i]->out_raw))
+            fds[i].events |= POLLOUT;
+        fds[i].revents = 0;
+    }
+    nfds = 2;
+    for (fd = first_fd(&fdstate, &rwx); fd >= 0 && nfds < lenof(fds);
+         fd = next_fd(&fdstate, &rwx)) {
+        fds[nfds].fd = fd;
+        fds[nfds].events = POLLIN;     /* only the server's I/O threads */
+        fds[nfds].revents = 0;
+        nfds++;
+    }
+
+    ret = poll(fds, nfds, BENCH_STALL_TIMEOUT);
+    if (ret < 0 && errno != EINTR)
+        fatal_error("poll: %s", strerror(errno));
+    if (ret == 0)
+        fatal_error("connection stalled");
+
+    for (i = 0; i < 2; i++)
+        end_io(ends[i], fds[i].revents);
+    for (i = 2; i < nfds; i++)
+        if (fds[i].revents)
+            select_result(fds[i].fd, SELECT_R);
+
+    do {
+        while (toplevel_callback_pending())
+            run_toplevel_callbacks();
+        end_take_packets(&client);
+        end_take_packets(&server);
+    } while (serve_requests());
+}
+
+/* ----------------------------------------------------------------------
+ * What sftp.c needs from its host application.
+ */
+
+bool sftp_recvdata(char *buf, size_t len)
+{
+    while (bufchain_size(&client.in) < len)
+        bench_pump();
+    bufchain_fetch_consume(&client.in, buf, len);
+    return true;
+}
+
+bool sftp_senddata(const char *buf, size_t len)
+{
+    end_send(&client, buf, len);
+    return true;
+}
+
+size_t sftp_sendbuffer(void)
+{
+    return bufchain_size(&client.out_raw);
+}
+
+static struct sftp_packet *bench_wait_for_reply(struct sftp_request *req)
+{
+    struct sftp_packet *pktin;
+
+    sftp_register(req);
+    pktin = sftp_recv();
+    if (sftp_find_request(pktin) != req)
+        fatal_error("unexpected SFTP reply: %s", fxp_error());
+    return pktin;
+}
+
+static struct fxp_handle *bench_open(const char *path, int type)
+{
+    struct sftp_request *req = fxp_open_send(path, type, NULL);
+    struct fxp_handle *fh = fxp_open_recv(bench_wait_for_reply(req), req);
+    if (!fh)
+        fatal_error("unable to open '%s': %s", path, fxp_error());
+    return fh;
+}
+
+static void bench_close(struct fxp_handle *fh)
+{
+    struct sftp_request *req = fxp_close_send(fh);
+    if (!fxp_close_recv(bench_wait_for_reply(req), req))
+        fatal_error("close failed: %s", fxp_error());
+}
+
+/* ----------------------------------------------------------------------
+ * The transfers themselves.
+ */
+
+struct bench_params {
+    uint64_t size;
+    int chunk, depth;
+    bool use_xfer;
+};
+
+static void upload_fixed(struct fxp_handle *fh, const struct bench_params *bp,
+                         const char *data)
+{
+    uint64_t offset = 0;
+    int inflight = 0;
+
+    while (offset < bp->size || inflight > 0) {
+        struct sftp_packet *pktin;
+        struct sftp_request *req;
+
+        while (offset < bp->size && inflight < bp->depth) {
+            int len = bp->size - offset < bp->chunk ?
+                bp->size - offset : bp->chunk;
+            sftp_register(req = fxp_write_send(fh, data, offset, len));
+            offset += len;
+            inflight++;
+        }
+
+        pktin = sftp_recv();
+        if (!(req = sftp_find_request(pktin)) || !fxp_write_recv(pktin, req))
+            fatal_error("write failed: %s", fxp_error());
+        inflight--;
+    }
+}
+
+static void download_fixed(struct fxp_handle *fh,
+                           const struct bench_params *bp)
+{
+    uint64_t offset = 0, received = 0;
+    int inflight = 0;
+
+    while (offset < bp->size || inflight > 0) {
+        struct sftp_packet *pktin;
+        struct sftp_request *req;
+        ptrlen data;
+        int ret;
+
+        while (offset < bp->size && inflight < bp->depth) {
+            int len = bp->size - offset < bp->chunk ?
+                bp->size - offset : bp->chunk;
+            sftp_register(req = fxp_read_send(fh, offset, len));
+            offset += len;
+            inflight++;
+        }
+
+        pktin = sftp_recv();
+        if (!(req = sftp_find_request(pktin)) ||
+            (ret = fxp_read_recv_ptr(pktin, req, &data, bp->chunk)) < 0)
+            fatal_error("read failed: %s", fxp_error());
+        received += ret;
+        sftp_pkt_free(pktin);
+        inflight--;
+    }
+
+    if (received != bp->size)
+        fatal_error("read %"PRIu64" bytes back, expected %"PRIu64,
+                    received, bp->size);
+}
+
+static void upload_xfer(struct fxp_handle *fh, const struct bench_params *bp,
+                        const char *data)
+{
+    struct fxp_xfer *xfer = xfer_upload_init(fh, 0);
+    uint64_t offset = 0;
+
+    while (offset < bp->size) {
+        int len;
+
+        while (!xfer_upload_ready(xfer)) {
+            if (xfer_upload_gotpkt(xfer, sftp_recv()) <= 0)
+                fatal_error("write failed: %s", fxp_error());
+        }
+
+        len = xfer_upload_chunksize(xfer);
+        if (len > bp->size - offset)
+            len = bp->size - offset;
+        xfer_upload_data(xfer, data, len);
+        offset += len;
+    }
+
+    while (!xfer_done(xfer)) {
+        if (xfer_upload_gotpkt(xfer, sftp_recv()) <= 0)
+            fatal_error("write failed: %s", fxp_error());
+    }
+    xfer_cleanup(xfer);
+}
+
+static void download_xfer(struct fxp_handle *fh,
+                          const struct bench_params *bp)
+{
+    struct fxp_xfer *xfer = xfer_download_init(fh, 0);
+    uint64_t received = 0;
+
+    while (!xfer_done(xfer)) {
+        void *vbuf;
+        int len;
+
+        xfer_download_queue(xfer);
+        if (xfer_download_gotpkt(xfer, sftp_recv()) <= 0)
+            fatal_error("read failed: %s", fxp_error());
+        while (xfer_download_data(xfer, &vbuf, &len)) {
+            received += len;
+            xfer_download_release(xfer, vbuf);
+        }
+    }
+    xfer_cleanup(xfer);
+
+    if (received != bp->size)
+        fatal_error("read %"PRIu64" bytes back, expected %"PRIu64,
+                    received, bp->size);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, uint64_t size, double start)
+{
+    double elapsed = now() - start;
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+    printf("  %-8s %10.1f MB/s\n", what, size / elapsed / 1e6);
+}
+
+/*
+ * Run one upload and one download over a fresh connection.
+ * 'cipher' is NULL for a bare connection.
+ */
+static void run_bench(const struct bench_params *bp, const char *path,
+                      const ssh_cipheralg *cipher,
+                      const ssh2_macalg *mac, bool etm)
+{
+    struct fxp_handle *fh;
+    struct sftp_request *req;
+    char *data;
+    int fds[2];
+    double start;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        fatal_error("socketpair: %s", strerror(errno));
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    end_init(&client, fds[0]);
+    end_init(&server, fds[1]);
+    if (cipher) {
+        end_start_ssh(&client, false, cipher, mac, etm);
+        end_start_ssh(&server, true, cipher, mac, etm);
+        if (cipher->required_mac)
+            printf("%s:\n", cipher->ssh2_id);
+        else
+            printf("%s, %s:\n", cipher->ssh2_id,
+                   etm ? mac->etm_name : mac->name);
+    } else {
+        printf("bare SFTP:\n");
+    }
+    sftpsrv = sftpsrv_new(&unix_live_sftpserver_vt);
+
+    if (!fxp_init())
+        fatal_error("unable to start SFTP: %s", fxp_error());
+
+    data = snewn(bp->chunk > 32768 ? bp->chunk : 32768, char);
+    random_read(data, bp->chunk > 32768 ? bp->chunk : 32768);
+
+    fh = bench_open(path, SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC);
+    start = now();
+    if (bp->use_xfer)
+        upload_xfer(fh, bp, data);
+    else
+        upload_fixed(fh, bp, data);
+    bench_close(fh);
+    report("upload", bp->size, start);
+
+    fh = bench_open(path, SSH_FXF_READ);
+    start = now();
+    if (bp->use_xfer)
+        download_xfer(fh, bp);
+    else
+        download_fixed(fh, bp);
+    bench_close(fh);
+    report("download", bp->size, start);
+
+    req = fxp_remove_send(path);
+    if (!fxp_remove_recv(bench_wait_for_reply(req), req))
+        fatal_error("unable to remove '%s': %s", path, fxp_error());
+
+    sfree(data);
+    sftpsrv_free(sftpsrv);
+    end_cleanup(&client);
+    end_cleanup(&server);
+}
+
+static const ssh2_ciphers *const cipher_lists[] = {
+    &ssh2_ccp, &ssh2_aes, &ssh2_aesgcm, &ssh2_blowfish, &ssh2_3des, &ssh2_des,
+    &ssh2_arcfour,
+};
+
+static const ssh2_macalg *const mac_list[] = {
+    &ssh_hmac_sha256, &ssh_hmac_sha1, &ssh_hmac_sha1_96, &ssh_hmac_md5,
+};
+
+static const ssh_cipheralg *find_cipher(const char *name)
+{
+    for (size_t i = 0; i < lenof(cipher_lists); i++)
+        for (int j = 0; j < cipher_lists[i]->nciphers; j++)
+            if (!strcmp(cipher_lists[i]->list[j]->ssh2_id, name))
+                return cipher_lists[i]->list[j];
+    return NULL;
+}
+
+static const ssh2_macalg *find_mac(const char *name, bool *etm)
+{
+    for (size_t i = 0; i < lenof(mac_list); i++) {
+        if (!strcmp(mac_list[i]->name, name)) {
+            *etm = false;
+            return mac_list[i];
+        }
+        if (mac_list[i]->etm_name && !strcmp(mac_list[i]->etm_name, name)) {
+            *etm = true;
+            return mac_list[i];
+        }
+    }
+    return NULL;
+}
+
+static uint64_t parse_size(const char *arg)
+{
+    char *end;
+    unsigned long long val = strtoull(arg, &end, 10);
+
+    switch (*end) {
+      case 'k': case 'K': val <<= 10; end++; break;
+      case 'm': case 'M': val <<= 20; end++; break;
+      case 'g': case 'G': val <<= 30; end++; break;
+    }
+    if (end == arg || *end)
+        fatal_error("unable to parse size '%s'", arg);
+    return val;
+}
+
+static void usage(void)
+{
+    printf("usage: sftpbench [options]\n");
+    printf("options:\n");
+    printf("  -size N      size of test file (default 256M)\n");
+    printf("  -chunk N     size of each read or write request"
+           " (default 32K)\n");
+    printf("  -depth N     number of requests in flight (default 32)\n");
+    printf("  -xfer        use the adaptive transfer manager instead\n");
+    printf("  -aio         let the server use its I/O threads\n");
+    printf("  -window N    limit its window to N bytes\n");
+    printf("  -bare        only test SFTP with no SSH packet layer\n");
+    printf("  -ssh         only test SFTP inside SSH packets\n");
+    printf("  -cipher ID   SSH cipher to use (default aes256-ctr)\n");
+    printf("  -mac ID      SSH MAC to use (default hmac-sha2-256)\n");
+    printf("  -dir DIR     where to put the test file (default /tmp)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_params bp;
+    const char *dir = NULL, *ciphername = "aes256-ctr";
+    const char *macname = "hmac-sha2-256";
+    const ssh_cipheralg *cipher;
+    const ssh2_macalg *mac;
+    bool etm, do_bare = true, do_ssh = true;
+    char *path;
+
+    bp.size = 256 << 20;
+    bp.chunk = 32768;
+    bp.depth = 32;
+    bp.use_xfer = false;
+
+    while (--argc) {
+        const char *p = *++argv;
+        const char *val = argc > 1 ? argv[1] : NULL;
+
+        if (!strcmp(p, "-bare")) {
+            do_ssh = false;
+        } else if (!strcmp(p, "-ssh")) {
+            do_bare = false;
+        } else if (!strcmp(p, "-xfer")) {
+            bp.use_xfer = true;
+        } else if (!strcmp(p, "-aio")) {
+            server_aio = true;
+        } else if (!strcmp(p, "--help") || !strcmp(p, "-h")) {
+            usage();
+            return 0;
+        } else if (!strcmp(p, "-size") || !strcmp(p, "-chunk") ||
+                   !strcmp(p, "-depth") || !strcmp(p, "-window") ||
+                   !strcmp(p, "-cipher") || !strcmp(p, "-mac") ||
+                   !strcmp(p, "-dir")) {
+            if (!val)
+                fatal_error("option '%s' expects an argument", p);
+            argc--, argv++;
+            if (!strcmp(p, "-size")) {
+                bp.size = parse_size(val);
+            } else if (!strcmp(p, "-chunk")) {
+                uint64_t chunk = parse_size(val);
+                if (chunk < 1 || chunk > 1048576)
+                    fatal_error("chunk size must be between 1 and 1M");
+                bp.chunk = chunk;
+            } else if (!strcmp(p, "-depth")) {
+                bp.depth = atoi(val);
+                if (bp.depth < 1)
+                    fatal_error("depth must be at least 1");
+            } else if (!strcmp(p, "-window")) {
+                xfer_set_window_limit(parse_size(val));
+            } else if (!strcmp(p, "-cipher")) {
+                ciphername = val;
+            } else if (!strcmp(p, "-mac")) {
+                macname = val;
+            } else {
+                dir = val;
+            }
+        } else {
+            fprintf(stderr, "sftpbench: unknown option '%s'\n", p);
+            usage();
+            return 1;
+        }
+    }
+
+    if (!(cipher = find_cipher(ciphername)))
+        fatal_error("unknown cipher '%s'", ciphername);
+    etm = false;
+    if (cipher->required_mac) {
+        /* The cipher has its own built-in MAC, as in ssh2transport.c */
+        mac = cipher->required_mac;
+        etm = !!mac->etm_name;
+    } else if (!(mac = find_mac(macname, &etm))) {
+        fatal_error("unknown MAC '%s'", macname);
+    }
+
+    uxsel_init();
+
+    if (!dir)
+        dir = getenv("TMPDIR");
+    path = dupprintf("%s/sftpbench.%d", dir ? dir : "/tmp", (int)getpid());
+
+    printf("%"PRIu64"-byte file, ", bp.size);
+    if (bp.use_xfer)
+        printf("adaptive transfer manager\n");
+    else
+        printf("%d requests of %d bytes in flight\n", bp.depth, bp.chunk);
+
+    if (do_bare)
+        run_bench(&bp, path, NULL, NULL, false);
+    if (do_ssh)
+        run_bench(&bp, path, cipher, mac, etm);
+
+    sfree(path);
+    return 0;
+}
@@ -3,6 +3,8 @@
  * really operating on the Unix filesystem).
  */
 
+#define _GNU_SOURCE                    /* for copy_file_range() */
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,44 +19,127 @@
 #include <grp.h>
 #include <dirent.h>
 #include <utime.h>
+#include <signal.h>
 
 #include "putty.h"
 #include "ssh.h"
 #include "sftp.h"
-#include "tree234.h"
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 typedef struct UnixSftpServer UnixSftpServer;
+typedef struct uss_aio_job uss_aio_job;
 
-struct UnixSftpServer {
-    unsigned *fdseqs;
-    bool *fdsopen;
-    size_t fdsize;
+/*
+ * Where we can, READ and WRITE requests on ordinary files are done by
+ * a pool of I/O threads rather than in the main event loop, so that
+ * one slow disk doesn't hold up everything else, and so that several
+ * requests from a client with a deep request window can be in
+ * progress on the disk at once. Their replies go back to the client
+ * in whatever order they complete.
+ *
+ * Requests on the same handle still have to behave as if they were
+ * done in the order they arrived, so each handle keeps a list of its
+ * outstanding jobs, and a job doesn't start until every earlier one
+ * it could interfere with has finished. FSTAT, FSETSTAT and CLOSE
+ * wait for everything before them on the same handle, and are then
+ * done by the main thread.
+ *
+ * A COPY (from the copy-data extension) is queued on its destination
+ * handle, and waits for everything before it there as the main-thread
+ * jobs do. It also waits for any earlier job that modifies its source
+ * file, and is then done in the pool like a READ or WRITE.
+ */
+typedef enum uss_aio_type {
+    USS_AIO_READ, USS_AIO_WRITE, USS_AIO_FSTAT, USS_AIO_FSETSTAT,
+    USS_AIO_CLOSE, USS_AIO_COPY
+} uss_aio_type;
+
+struct uss_aio_job {
+    UnixSftpServer *uss;
+    int h;                             /* index into uss->handles */
+    int fd;
+    uss_aio_type type;
+    SftpReplyBuilder *reply;           /* deferred */
 
-    tree234 *dirhandles;
-    int last_dirhandle_index;
+    uint64_t offset;                   /* READ, WRITE and COPY */
+    size_t len;
+    char *buf;
+    struct fxp_attrs attrs;            /* FSETSTAT */
 
-    char handlekey[8];
+    int src_h;                         /* COPY */
+    unsigned src_gen;
+    int srcfd;                         /* our own dup, so CLOSE can't race */
+    uint64_t srcoffset, copylen;       /* copylen 0 means to EOF */
+    uint64_t seq;                      /* arrival order across handles */
 
-    SftpServer srv;
+    bool dispatched;
+    size_t done;                       /* bytes read or written */
+    int error;                         /* errno, or 0 for success */
+
+    uss_aio_job *hnext;                /* next job on the same handle */
+    uss_aio_job *next;                 /* in the thread pool's queues */
 };
 
-struct uss_dirhandle {
-    int index;
-    DIR *dp;
+/*
+ * Open files and directories live in one array of handle slots. The
+ * handle we give the client is the slot index plus a generation
+ * count that goes up every time the slot is freed, so a stale handle
+ * is recognised without any searching. (The two words are XORed with
+ * a random key so that handles aren't just small integers, but that
+ * isn't meant to stop a client guessing them.)
+ */
+/* A directory entry we've read and stat()ed but not yet sent */
+struct uss_dirent {
+    char *name, *longname;
+    struct fxp_attrs attrs;
 };
 
-#define USS_DIRHANDLE_SEQ (0xFFFFFFFFU)
+/* Keep each SSH_FXP_NAME reply to about this size. OpenSSH's client
+ * accepts replies up to 256K, and PuTTY's has no limit of its own. */
+#define USS_READDIR_BYTES 32768
+
+struct uss_handle {
+    unsigned gen;
+    bool inuse;                        /* slot is allocated */
+    bool open;                         /* handle still valid for requests */
+    bool isdir;
+    int fd;                            /* files */
+    DIR *dp;                           /* directories */
+    struct uss_dirent *pending_dirent;
+    bool seekable, append;
+    uss_aio_job *jobs, *jobs_tail;     /* outstanding, in arrival order */
+    uint64_t seq_next;                 /* offset just after the last READ */
+    unsigned seq_reads;                /* consecutive READs ending there */
+    uint64_t readahead_end;            /* how far we've prefetched to */
+    int nextfree;
+};
 
-static int uss_dirhandle_cmp(void *av, void *bv)
-{
-    struct uss_dirhandle *a = (struct uss_dirhandle *)av;
-    struct uss_dirhandle *b = (struct uss_dirhandle *)bv;
-    if (a->index < b->index)
-        return -1;
-    if (a->index > b->index)
-        return +1;
-    return 0;
-}
+struct UnixSftpServer {
+    struct uss_handle *handles;
+    size_t nhandles, handlesize;
+    int freehandle;                    /* head of the free list, or -1 */
+    int aio_running;                   /* jobs currently in a worker */
+    int aio_copies;                    /* COPY jobs not yet finished */
+    uint64_t aio_seq;
+
+    unsigned char handlekey[8];
+
+    uid_t cached_uid;
+    gid_t cached_gid;
+    char *cached_user, *cached_group;
+
+    SftpServer srv;
+};
+
+static void uss_free_dirent(struct uss_dirent *ude);
+static bool uss_aio_start(void);
+static uss_aio_job *uss_aio_new_job(
+    UnixSftpServer *uss, SftpReplyBuilder *reply, int h, uss_aio_type type);
+static void uss_aio_queue(uss_aio_job *job);
+static void uss_aio_cancel(UnixSftpServer *uss);
 
 static SftpServer *uss_new(const SftpServerVtable *vt)
 {
@@ -62,7 +147,7 @@ static SftpServer *uss_new(const SftpServerVtable *vt)
 
     memset(uss, 0, sizeof(UnixSftpServer));
 
-    uss->dirhandles = newtree234(uss_dirhandle_cmp);
+    uss->freehandle = -1;
     uss->srv.vt = vt;
 
     random_read(uss->handlekey, sizeof(uss->handlekey));
@@ -73,119 +158,106 @@ static SftpServer *uss_new(const SftpServerVtable *vt)
 static void uss_free(SftpServer *srv)
 {
     UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
-    struct uss_dirhandle *udh;
 
-    for (size_t i = 0; i < uss->fdsize; i++)
-        if (uss->fdsopen[i])
-            close(i);
-    sfree(uss->fdseqs);
+    uss_aio_cancel(uss);
 
-    while ((udh = delpos234(uss->dirhandles, 0)) != NULL) {
-        closedir(udh->dp);
-        sfree(udh);
+    for (size_t i = 0; i < uss->nhandles; i++) {
+        struct uss_handle *uh = &uss->handles[i];
+        if (uh->open && uh->isdir)
+            closedir(uh->dp);
+        else if (uh->open)
+            close(uh->fd);
+        if (uh->pending_dirent)
+            uss_free_dirent(uh->pending_dirent);
     }
+    sfree(uss->handles);
+    sfree(uss->cached_user);
+    sfree(uss->cached_group);
 
     sfree(uss);
 }
 
-static void uss_return_handle_raw(
-    UnixSftpServer *uss, SftpReplyBuilder *reply, int index, unsigned seq)
+static int uss_new_handle(UnixSftpServer *uss, SftpReplyBuilder *reply)
 {
+    struct uss_handle *uh;
     unsigned char handlebuf[8];
-    PUT_32BIT_MSB_FIRST(handlebuf, index);
-    PUT_32BIT_MSB_FIRST(handlebuf + 4, seq);
-    des_encrypt_xdmauth(uss->handlekey, handlebuf, 8);
-    fxp_reply_handle(reply, make_ptrlen(handlebuf, 8));
-}
+    int h;
 
-static bool uss_decode_handle(
-    UnixSftpServer *uss, ptrlen handle, int *index, unsigned *seq)
-{
-    unsigned char handlebuf[8];
+    if (uss->freehandle >= 0) {
+        h = uss->freehandle;
+        uss->freehandle = uss->handles[h].nextfree;
+    } else {
+        sgrowarray(uss->handles, uss->handlesize, uss->nhandles);
+        h = uss->nhandles++;
+        memset(&uss->handles[h], 0, sizeof(*uss->handles));
+    }
 
-    if (handle.len != 8)
-        return false;
-    memcpy(handlebuf, handle.ptr, 8);
-    des_decrypt_xdmauth(uss->handlekey, handlebuf, 8);
-    *index = toint(GET_32BIT_MSB_FIRST(handlebuf));
-    *seq = GET_32BIT_MSB_FIRST(handlebuf + 4);
-    return true;
+    uh = &uss->handles[h];
+    assert(!uh->inuse);
+    assert(!uh->jobs);
+    uh->inuse = uh->open = true;
+    uh->seq_next = uh->readahead_end = 0;
+    uh->seq_reads = 0;
+
+    PUT_32BIT_MSB_FIRST(handlebuf, h);
+    PUT_32BIT_MSB_FIRST(handlebuf + 4, uh->gen);
+    for (size_t i = 0; i < 8; i++)
+        handlebuf[i] ^= uss->handlekey[i];
+    fxp_reply_handle(reply, make_ptrlen(handlebuf, 8));
+
+    return h;
 }
 
-static void uss_return_new_handle(
-    UnixSftpServer *uss, SftpReplyBuilder *reply, int fd)
+static void uss_free_handle(UnixSftpServer *uss, int h)
 {
-    assert(fd >= 0);
-    if (fd >= uss->fdsize) {
-        size_t old_size = uss->fdsize;
-        sgrowarray(uss->fdseqs, uss->fdsize, fd);
-        uss->fdsopen = sresize(uss->fdsopen, uss->fdsize, bool);
-        while (old_size < uss->fdsize) {
-            uss->fdseqs[old_size] = 0;
-            uss->fdsopen[old_size] = false;
-            old_size++;
-        }
+    struct uss_handle *uh = &uss->handles[h];
+
+    assert(uh->inuse && !uh->jobs);
+    if (uh->pending_dirent) {
+        uss_free_dirent(uh->pending_dirent);
+        uh->pending_dirent = NULL;
     }
-    assert(!uss->fdsopen[fd]);
-    uss->fdsopen[fd] = true;
-    if (++uss->fdseqs[fd] == USS_DIRHANDLE_SEQ)
-        uss->fdseqs[fd] = 0;
-    uss_return_handle_raw(uss, reply, fd, uss->fdseqs[fd]);
+    uh->inuse = uh->open = false;
+    uh->gen++;
+    uh->nextfree = uss->freehandle;
+    uss->freehandle = h;
 }
 
-static int uss_try_lookup_fd(UnixSftpServer *uss, ptrlen handle)
+static int uss_try_lookup_handle(UnixSftpServer *uss, ptrlen handle,
+                                 bool isdir)
 {
-    int fd;
-    unsigned seq;
-    if (!uss_decode_handle(uss, handle, &fd, &seq) ||
-        fd < 0 || fd >= uss->fdsize ||
-        !uss->fdsopen[fd] || uss->fdseqs[fd] != seq)
+    const unsigned char *hp = handle.ptr;
+    unsigned index, gen;
+
+    if (handle.len != 8)
         return -1;
+    index = GET_32BIT_MSB_FIRST(hp) ^ GET_32BIT_MSB_FIRST(uss->handlekey);
+    gen = GET_32BIT_MSB_FIRST(hp + 4) ^
+        GET_32BIT_MSB_FIRST(uss->handlekey + 4);
 
-    return fd;
+    if (index >= uss->nhandles || !uss->handles[index].open ||
+        uss->handles[index].gen != gen || uss->handles[index].isdir != isdir)
+        return -1;
+
+    return index;
 }
 
 static int uss_lookup_fd(UnixSftpServer *uss, SftpReplyBuilder *reply,
                          ptrlen handle)
 {
-    int fd = uss_try_lookup_fd(uss, handle);
-    if (fd < 0)
+    int h = uss_try_lookup_handle(uss, handle, false);
+    if (h < 0)
         fxp_reply_error(reply, SSH_FX_FAILURE, "invalid file handle");
-    return fd;
-}
-
-static void uss_return_new_dirhandle(
-    UnixSftpServer *uss, SftpReplyBuilder *reply, DIR *dp)
-{
-    struct uss_dirhandle *udh = snew(struct uss_dirhandle);
-    udh->index = uss->last_dirhandle_index++;
-    udh->dp = dp;
-    struct uss_dirhandle *added = add234(uss->dirhandles, udh);
-    assert(added == udh);
-    uss_return_handle_raw(uss, reply, udh->index, USS_DIRHANDLE_SEQ);
-}
-
-static struct uss_dirhandle *uss_try_lookup_dirhandle(
-    UnixSftpServer *uss, ptrlen handle)
-{
-    struct uss_dirhandle key, *udh;
-    unsigned seq;
-
-    if (!uss_decode_handle(uss, handle, &key.index, &seq) ||
-        seq != USS_DIRHANDLE_SEQ ||
-        (udh = find234(uss->dirhandles, &key, NULL)) == NULL)
-        return NULL;
-
-    return udh;
+    return h;
 }
 
-static struct uss_dirhandle *uss_lookup_dirhandle(
+static int uss_lookup_dirhandle(
     UnixSftpServer *uss, SftpReplyBuilder *reply, ptrlen handle)
 {
-    struct uss_dirhandle *udh = uss_try_lookup_dirhandle(uss, handle);
-    if (!udh)
+    int h = uss_try_lookup_handle(uss, handle, true);
+    if (h < 0)
         fxp_reply_error(reply, SSH_FX_FAILURE, "invalid file handle");
-    return udh;
+    return h;
 }
 
 static void uss_error(UnixSftpServer *uss, SftpReplyBuilder *reply)
@@ -247,7 +319,12 @@ static void uss_open(SftpServer *srv, SftpReplyBuilder *reply,
     if (fd < 0) {
         uss_error(uss, reply);
     } else {
-        uss_return_new_handle(uss, reply, fd);
+        int h = uss_new_handle(uss, reply);
+        struct uss_handle *uh = &uss->handles[h];
+        uh->isdir = false;
+        uh->fd = fd;
+        uh->seekable = (lseek(fd, 0, SEEK_CUR) >= 0);
+        uh->append = (flags & SSH_FXF_APPEND);
     }
 }
 
@@ -263,7 +340,10 @@ static void uss_opendir(SftpServer *srv, SftpReplyBuilder *reply,
     if (!dp) {
         uss_error(uss, reply);
     } else {
-        uss_return_new_dirhandle(uss, reply, dp);
+        int h = uss_new_handle(uss, reply);
+        struct uss_handle *uh = &uss->handles[h];
+        uh->isdir = true;
+        uh->dp = dp;
     }
 }
 
@@ -271,19 +351,24 @@ static void uss_close(SftpServer *srv, SftpReplyBuilder *reply,
                       ptrlen handle)
 {
     UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
-    int fd;
-    struct uss_dirhandle *udh;
+    int h;
+    uss_aio_job *job;
 
-    if ((udh = uss_try_lookup_dirhandle(uss, handle)) != NULL) {
-        closedir(udh->dp);
-        del234(uss->dirhandles, udh);
-        sfree(udh);
-        fxp_reply_ok(reply);
-    } else if ((fd = uss_lookup_fd(uss, reply, handle)) >= 0) {
-        close(fd);
-        assert(0 <= fd && fd <= uss->fdsize);
-        uss->fdsopen[fd] = false;
+    if ((h = uss_try_lookup_handle(uss, handle, true)) >= 0) {
+        closedir(uss->handles[h].dp);
+        uss_free_handle(uss, h);
         fxp_reply_ok(reply);
+    } else if ((h = uss_lookup_fd(uss, reply, handle)) >= 0) {
+        uss->handles[h].open = false;
+        if (uss->handles[h].jobs &&
+            (job = uss_aio_new_job(uss, reply, h, USS_AIO_CLOSE)) != NULL) {
+            /* The fd and its slot stay in use until its I/O finishes */
+            uss_aio_queue(job);
+        } else {
+            close(uss->handles[h].fd);
+            uss_free_handle(uss, h);
+            fxp_reply_ok(reply);
+        }
     }
     /* if both failed, uss_lookup_fd will have filled in an error response */
 }
@@ -394,15 +479,11 @@ static void uss_stat(SftpServer *srv, SftpReplyBuilder *reply,
     }
 }
 
-static void uss_fstat(SftpServer *srv, SftpReplyBuilder *reply,
-                      ptrlen handle)
+static void uss_do_fstat(UnixSftpServer *uss, SftpReplyBuilder *reply,
+                         int fd)
 {
-    UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
     struct stat st;
-    int fd;
 
-    if ((fd = uss_lookup_fd(uss, reply, handle)) < 0)
-        return;
     int status = fstat(fd, &st);
 
     if (status < 0) {
@@ -412,6 +493,25 @@ static void uss_fstat(SftpServer *srv, SftpReplyBuilder *reply,
     }
 }
 
+static void uss_fstat(SftpServer *srv, SftpReplyBuilder *reply,
+                      ptrlen handle)
+{
+    UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
+    uss_aio_job *job;
+    int h;
+
+    if ((h = uss_lookup_fd(uss, reply, handle)) < 0)
+        return;
+
+    if (uss->handles[h].jobs &&
+        (job = uss_aio_new_job(uss, reply, h, USS_AIO_FSTAT)) != NULL) {
+        uss_aio_queue(job);
+        return;
+    }
+
+    uss_do_fstat(uss, reply, uss->handles[h].fd);
+}
+
 #if !HAVE_FUTIMES
 static inline int futimes(int fd, const struct timeval tv[2])
 {
@@ -467,34 +567,588 @@ static void uss_setstat(SftpServer *srv, SftpReplyBuilder *reply,
     }
 }
 
+static void uss_do_fsetstat(UnixSftpServer *uss, SftpReplyBuilder *reply,
+                            int fd, struct fxp_attrs attrs)
+{
+    bool success = true;
+    SETSTAT_GUTS(FD_PREFIX, fd, attrs, success);
+
+    if (!success) {
+        uss_error(uss, reply);
+    } else {
+        fxp_reply_ok(reply);
+    }
+}
+
 static void uss_fsetstat(SftpServer *srv, SftpReplyBuilder *reply,
                          ptrlen handle, struct fxp_attrs attrs)
 {
     UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
-    int fd;
+    uss_aio_job *job;
+    int h;
 
-    if ((fd = uss_lookup_fd(uss, reply, handle)) < 0)
+    if ((h = uss_lookup_fd(uss, reply, handle)) < 0)
         return;
 
-    bool success = true;
-    SETSTAT_GUTS(FD_PREFIX, fd, attrs, success);
+    if (uss->handles[h].jobs &&
+        (job = uss_aio_new_job(uss, reply, h, USS_AIO_FSETSTAT)) != NULL) {
+        job->attrs = attrs;
+        uss_aio_queue(job);
+        return;
+    }
 
-    if (!success) {
-        uss_error(uss, reply);
+    uss_do_fsetstat(uss, reply, uss->handles[h].fd, attrs);
+}
+
+/* ----------------------------------------------------------------------
+ * Asynchronous file I/O.
+ */
+
+/* Number of I/O threads, shared between all the SftpServers in a
+ * process */
+#define USS_AIO_THREADS 4
+
+static bool uss_aio_conflict(struct uss_handle *uh,
+                             uss_aio_job *a, uss_aio_job *b)
+{
+    if (a->type == USS_AIO_READ && b->type == USS_AIO_READ)
+        return false;
+    if ((a->type != USS_AIO_READ && a->type != USS_AIO_WRITE) ||
+        (b->type != USS_AIO_READ && b->type != USS_AIO_WRITE))
+        return true;                   /* everything waits for those */
+    if (uh->append)
+        return true;                   /* writes go wherever EOF is */
+    return a->offset < b->offset + b->len && b->offset < a->offset + a->len;
+}
+
+static uss_aio_job *uss_aio_new_job(
+    UnixSftpServer *uss, SftpReplyBuilder *reply, int h, uss_aio_type type)
+{
+    SftpReplyBuilder *deferred = fxp_reply_defer(reply);
+    uss_aio_job *job;
+
+    if (!deferred)
+        return NULL;
+
+    job = snew(uss_aio_job);
+    memset(job, 0, sizeof(*job));
+    job->uss = uss;
+    job->h = h;
+    job->fd = uss->handles[h].fd;
+    job->type = type;
+    job->reply = deferred;
+    job->srcfd = -1;
+    job->seq = uss->aio_seq++;
+    return job;
+}
+
+static void uss_aio_free_job(uss_aio_job *job)
+{
+    if (job->reply)
+        sftp_deferred_reply_abandon(job->reply);
+    if (job->type == USS_AIO_COPY) {
+        if (job->srcfd >= 0)
+            close(job->srcfd);
+        job->uss->aio_copies--;
+    }
+    sfree(job->buf);
+    sfree(job);
+}
+
+/*
+ * Remove a finished job from its handle's list, and send its reply.
+ */
+static void uss_aio_complete(uss_aio_job *job)
+{
+    struct uss_handle *uh = &job->uss->handles[job->h];
+    uss_aio_job **pp, *prev = NULL;
+    SftpReplyBuilder *reply = job->reply;
+
+    for (pp = &uh->jobs; *pp != job; pp = &(*pp)->hnext)
+        prev = *pp;
+    *pp = job->hnext;
+    if (uh->jobs_tail == job)
+        uh->jobs_tail = prev;
+
+    job->reply = NULL;
+    uss_aio_free_job(job);
+    sftp_deferred_reply_send(reply);
+}
+
+static void uss_aio_run_here(uss_aio_job *job)
+{
+    UnixSftpServer *uss = job->uss;
+    int h = job->h;
+
+    switch (job->type) {
+      case USS_AIO_FSTAT:
+        uss_do_fstat(job->uss, job->reply, job->fd);
+        break;
+      case USS_AIO_FSETSTAT:
+        uss_do_fsetstat(job->uss, job->reply, job->fd, job->attrs);
+        break;
+      case USS_AIO_CLOSE:
+        close(job->fd);
+        fxp_reply_ok(job->reply);
+        uss_aio_complete(job);
+        uss_free_handle(uss, h);
+        return;
+      default:
+        unreachable("bad job type in uss_aio_run_here");
+    }
+    uss_aio_complete(job);
+}
+
+static void uss_aio_run_in_pool(uss_aio_job *job);
+
+/*
+ * A COPY also has to wait for earlier jobs on its source handle that
+ * might change what it reads. (Later ones aren't held back for it: a
+ * client that writes to a file it's still copying from gets what it
+ * asked for.)
+ */
+static bool uss_aio_source_busy(UnixSftpServer *uss, uss_aio_job *job)
+{
+    struct uss_handle *uh = &uss->handles[job->src_h];
+    uss_aio_job *prev;
+
+    if (!uh->inuse || uh->gen != job->src_gen)
+        return false;
+    for (prev = uh->jobs; prev && prev->seq < job->seq; prev = prev->hnext)
+        if (prev->type != USS_AIO_READ && prev->type != USS_AIO_FSTAT)
+            return true;
+    return false;
+}
+
+/*
+ * Start every job on this handle that isn't waiting for an earlier one.
+ */
+static void uss_aio_dispatch(UnixSftpServer *uss, int h)
+{
+    uss_aio_job *job, *prev;
+
+  restart:
+    for (job = uss->handles[h].jobs; job; job = job->hnext) {
+        if (job->dispatched)
+            continue;
+        for (prev = uss->handles[h].jobs; prev != job; prev = prev->hnext)
+            if (uss_aio_conflict(&uss->handles[h], prev, job))
+                break;
+        if (prev != job)
+            continue;
+        if (job->type == USS_AIO_COPY && uss_aio_source_busy(uss, job))
+            continue;
+
+        job->dispatched = true;
+        if (job->type == USS_AIO_READ || job->type == USS_AIO_WRITE ||
+            job->type == USS_AIO_COPY) {
+            uss_aio_run_in_pool(job);
+        } else {
+            uss_aio_run_here(job);
+            goto restart;              /* the list has changed under us */
+        }
+    }
+}
+
+static void uss_aio_queue(uss_aio_job *job)
+{
+    struct uss_handle *uh = &job->uss->handles[job->h];
+
+    if (uh->jobs_tail)
+        uh->jobs_tail->hnext = job;
+    else
+        uh->jobs = job;
+    uh->jobs_tail = job;
+
+    uss_aio_dispatch(job->uss, job->h);
+}
+
+/*
+ * Copy a range of one file into another for the copy-data extension,
+ * stopping early at end of file. Where the kernel can do it, the data
+ * never comes out to user space at all; otherwise (e.g. between
+ * filesystems, on older kernels) we fall back to reading and writing.
+ * Returns an errno value, or 0 for success.
+ */
+#define USS_COPY_BUFSIZE 65536
+
+static int uss_copy_range(int srcfd, uint64_t srcoffset, uint64_t length,
+                          int dstfd, uint64_t dstoffset)
+{
+    uint64_t done = 0;
+    char *buf;
+    int error = 0;
+
+#if HAVE_COPY_FILE_RANGE
+    while (!length || done < length) {
+        loff_t inoff = srcoffset + done, outoff = dstoffset + done;
+        size_t want = (length && length - done < 0x40000000) ?
+            length - done : 0x40000000;
+        ssize_t ret = copy_file_range(srcfd, &inoff, dstfd, &outoff, want, 0);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && (errno == ENOSYS || errno == EXDEV ||
+                        errno == EINVAL || errno == EOPNOTSUPP) && !done)
+            break;                     /* try it the slow way */
+        if (ret < 0)
+            return errno;
+        if (ret == 0)
+            return 0;                  /* end of file */
+        done += ret;
+    }
+    if (length && done == length)
+        return 0;
+#endif
+
+    if ((buf = malloc(USS_COPY_BUFSIZE)) == NULL)
+        return ENOMEM;
+
+    while (!length || done < length) {
+        size_t want = (length && length - done < USS_COPY_BUFSIZE) ?
+            length - done : USS_COPY_BUFSIZE;
+        ssize_t got = pread(srcfd, buf, want, srcoffset + done), put;
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            if (got < 0)
+                error = errno;
+            break;
+        }
+        for (ssize_t pos = 0; pos < got; pos += put) {
+            put = pwrite(dstfd, buf + pos, got - pos, dstoffset + done + pos);
+            if (put < 0 && errno == EINTR) {
+                put = 0;
+                continue;
+            }
+            if (put <= 0) {
+                error = put < 0 ? errno : EIO;
+                goto out;
+            }
+        }
+        done += got;
+    }
+
+  out:
+    free(buf);
+    return error;
+}
+
+#if HAVE_PTHREAD
+
+/* Called in the main thread when the pool has finished a job */
+static void uss_aio_finish(uss_aio_job *job)
+{
+    UnixSftpServer *uss = job->uss;
+    int h = job->h;
+
+    if (job->error) {
+        errno = job->error;
+        uss_error(uss, job->reply);
+    } else if (job->type == USS_AIO_WRITE || job->type == USS_AIO_COPY) {
+        fxp_reply_ok(job->reply);
+    } else if (job->done == 0) {
+        fxp_reply_error(job->reply, SSH_FX_EOF, "End of file");
     } else {
-        fxp_reply_ok(reply);
+        fxp_reply_data(job->reply, make_ptrlen(job->buf, job->done));
+    }
+
+    uss_aio_complete(job);
+    uss_aio_dispatch(uss, h);
+
+    /* That might have been what a COPY on another handle waited for */
+    if (uss->aio_copies) {
+        for (size_t i = 0; i < uss->nhandles; i++)
+            if ((int)i != h && uss->handles[i].jobs)
+                uss_aio_dispatch(uss, i);
+    }
+}
+
+static struct {
+    int state;                  /* 0 = not tried, 1 = running, -1 = failed */
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   /* signalled when runq gains a job */
+    pthread_cond_t idle_cond;   /* broadcast whenever a job finishes */
+    uss_aio_job *runq, *runq_tail;
+    uss_aio_job *doneq, *doneq_tail;
+    int pipefd[2];              /* wakes the main thread when doneq fills */
+} uss_aio;
+
+static void uss_aio_do_io(uss_aio_job *job)
+{
+    if (job->type == USS_AIO_COPY) {
+        job->error = uss_copy_range(job->srcfd, job->srcoffset, job->copylen,
+                                    job->fd, job->offset);
+        return;
+    }
+
+    if (job->type == USS_AIO_READ && (job->buf = malloc(job->len)) == NULL) {
+        /* As in the synchronous case, a failure we can localise to
+         * this one request */
+        job->error = ENOMEM;
+        return;
+    }
+
+    while (job->done < job->len) {
+        ssize_t ret;
+
+        if (job->type == USS_AIO_READ)
+            ret = pread(job->fd, job->buf + job->done, job->len - job->done,
+                        job->offset + job->done);
+        else
+            ret = pwrite(job->fd, job->buf + job->done, job->len - job->done,
+                         job->offset + job->done);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            job->error = errno;
+            return;
+        }
+        if (ret == 0) {
+            if (job->type == USS_AIO_WRITE)
+                job->error = EIO;
+            return;                    /* end of file, for a read */
+        }
+        job->done += ret;
+    }
+}
+
+static void *uss_aio_worker(void *arg)
+{
+    pthread_mutex_lock(&uss_aio.lock);
+    while (true) {
+        uss_aio_job *job;
+
+        while (!uss_aio.runq)
+            pthread_cond_wait(&uss_aio.work_cond, &uss_aio.lock);
+        job = uss_aio.runq;
+        if (!(uss_aio.runq = job->next))
+            uss_aio.runq_tail = NULL;
+        job->uss->aio_running++;
+        pthread_mutex_unlock(&uss_aio.lock);
+
+        uss_aio_do_io(job);
+
+        pthread_mutex_lock(&uss_aio.lock);
+        job->uss->aio_running--;
+        job->next = NULL;
+        if (uss_aio.doneq_tail) {
+            uss_aio.doneq_tail->next = job;
+        } else {
+            uss_aio.doneq = job;
+            if (write(uss_aio.pipefd[1], "", 1) < 0) {
+                /* The pipe can only be full if the main thread
+                 * hasn't drained it yet, so it'll wake up anyway */
+            }
+        }
+        uss_aio.doneq_tail = job;
+        pthread_cond_broadcast(&uss_aio.idle_cond);
+    }
+
+    return NULL;
+}
+
+static void uss_aio_completed(int fd, int event)
+{
+    char buf[64];
+    uss_aio_job *job;
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    /*
+     * Take one job at a time, in case sending a reply results in
+     * some other SftpServer being freed and its jobs being removed
+     * from the queue.
+     */
+    while (true) {
+        pthread_mutex_lock(&uss_aio.lock);
+        if ((job = uss_aio.doneq) != NULL &&
+            !(uss_aio.doneq = job->next))
+            uss_aio.doneq_tail = NULL;
+        pthread_mutex_unlock(&uss_aio.lock);
+
+        if (!job)
+            break;
+        uss_aio_finish(job);
     }
 }
 
+static bool uss_aio_start(void)
+{
+    sigset_t all, old;
+    pthread_t thread;
+    int i, nthreads = 0;
+
+    if (uss_aio.state)
+        return uss_aio.state > 0;
+    uss_aio.state = -1;
+
+    if (pipe(uss_aio.pipefd) < 0)
+        return false;
+    for (i = 0; i < 2; i++) {
+        cloexec(uss_aio.pipefd[i]);
+        nonblock(uss_aio.pipefd[i]);
+    }
+    pthread_mutex_init(&uss_aio.lock, NULL);
+    pthread_cond_init(&uss_aio.work_cond, NULL);
+    pthread_cond_init(&uss_aio.idle_cond, NULL);
+
+    /* Leave all signals to the main thread, which has handlers for
+     * the ones it cares about */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < USS_AIO_THREADS; i++) {
+        if (pthread_create(&thread, NULL, uss_aio_worker, NULL) == 0) {
+            pthread_detach(thread);
+            nthreads++;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!nthreads) {
+        close(uss_aio.pipefd[0]);
+        close(uss_aio.pipefd[1]);
+        return false;
+    }
+
+    uxsel_set(uss_aio.pipefd[0], SELECT_R, uss_aio_completed);
+    uss_aio.state = 1;
+    return true;
+}
+
+static void uss_aio_run_in_pool(uss_aio_job *job)
+{
+    pthread_mutex_lock(&uss_aio.lock);
+    job->next = NULL;
+    if (uss_aio.runq_tail)
+        uss_aio.runq_tail->next = job;
+    else
+        uss_aio.runq = job;
+    uss_aio.runq_tail = job;
+    pthread_cond_signal(&uss_aio.work_cond);
+    pthread_mutex_unlock(&uss_aio.lock);
+}
+
+static void uss_aio_unqueue(uss_aio_job **head, uss_aio_job **tail,
+                            UnixSftpServer *uss)
+{
+    uss_aio_job **pp = head;
+
+    *tail = NULL;
+    while (*pp) {
+        if ((*pp)->uss == uss) {
+            *pp = (*pp)->next;
+        } else {
+            *tail = *pp;
+            pp = &(*pp)->next;
+        }
+    }
+}
+
+#else /* HAVE_PTHREAD */
+
+static bool uss_aio_start(void) { return false; }
+static void uss_aio_run_in_pool(uss_aio_job *job)
+{ unreachable("no I/O threads to run a job"); }
+
+#endif /* HAVE_PTHREAD */
+
+/*
+ * Throw away everything outstanding for a server that's being freed,
+ * first waiting for any I/O that's actually in progress.
+ */
+static void uss_aio_cancel(UnixSftpServer *uss)
+{
+    uss_aio_job *job;
+
+#if HAVE_PTHREAD
+    if (uss_aio.state > 0) {
+        pthread_mutex_lock(&uss_aio.lock);
+        uss_aio_unqueue(&uss_aio.runq, &uss_aio.runq_tail, uss);
+        while (uss->aio_running > 0)
+            pthread_cond_wait(&uss_aio.idle_cond, &uss_aio.lock);
+        uss_aio_unqueue(&uss_aio.doneq, &uss_aio.doneq_tail, uss);
+        pthread_mutex_unlock(&uss_aio.lock);
+    }
+#endif
+
+    for (size_t i = 0; i < uss->nhandles; i++) {
+        while ((job = uss->handles[i].jobs) != NULL) {
+            uss->handles[i].jobs = job->hnext;
+            if (job->type == USS_AIO_CLOSE)
+                close(job->fd);
+            uss_aio_free_job(job);
+        }
+        uss->handles[i].jobs_tail = NULL;
+    }
+}
+
+/*
+ * Once a handle has seen a few READs each starting where the last
+ * one ended, ask the kernel to start fetching the data after them,
+ * keeping that prefetch at least USS_READAHEAD_MIN bytes in front of
+ * the client. Clients that only keep a few requests in flight then
+ * don't wait for storage latency (which can be long, on a network
+ * filesystem) on every one.
+ */
+#define USS_READAHEAD_RUN 3
+#define USS_READAHEAD_MIN (1024 * 1024)
+#define USS_READAHEAD_STEP (4 * 1024 * 1024)
+
+static void uss_readahead(struct uss_handle *uh, uint64_t offset,
+                          unsigned length)
+{
+    if (offset != uh->seq_next) {
+        uh->seq_reads = 0;
+        uh->readahead_end = 0;
+    } else if (uh->seq_reads < USS_READAHEAD_RUN) {
+        uh->seq_reads++;
+    }
+    uh->seq_next = offset + length;
+
+    if (uh->seq_reads < USS_READAHEAD_RUN)
+        return;
+
+#if HAVE_POSIX_FADVISE
+    if (!uh->readahead_end) {
+        /* Also widen the kernel's own read-ahead for this file */
+        posix_fadvise(uh->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (uh->readahead_end < uh->seq_next + USS_READAHEAD_MIN) {
+        uint64_t start = uh->readahead_end > uh->seq_next ?
+            uh->readahead_end : uh->seq_next;
+        posix_fadvise(uh->fd, start, USS_READAHEAD_STEP,
+                      POSIX_FADV_WILLNEED);
+        uh->readahead_end = start + USS_READAHEAD_STEP;
+    }
+#endif
+}
+
 static void uss_read(SftpServer *srv, SftpReplyBuilder *reply,
                      ptrlen handle, uint64_t offset, unsigned length)
 {
     UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
-    int fd;
+    uss_aio_job *job;
+    int h, fd;
     char *buf;
 
-    if ((fd = uss_lookup_fd(uss, reply, handle)) < 0)
+    if ((h = uss_lookup_fd(uss, reply, handle)) < 0)
+        return;
+    fd = uss->handles[h].fd;
+
+    if (uss->handles[h].seekable)
+        uss_readahead(&uss->handles[h], offset, length);
+
+    if (uss->handles[h].seekable && uss_aio_start() &&
+        (job = uss_aio_new_job(uss, reply, h, USS_AIO_READ)) != NULL) {
+        job->offset = offset;
+        job->len = length;
+        uss_aio_queue(job);
         return;
+    }
 
     if ((buf = malloc(length)) == NULL) {
         /* A rare case in which I bother to check malloc failure,
@@ -547,10 +1201,22 @@ static void uss_write(SftpServer *srv, SftpReplyBuilder *reply,
                      ptrlen handle, uint64_t offset, ptrlen data)
 {
     UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
-    int fd;
+    uss_aio_job *job;
+    int h, fd;
 
-    if ((fd = uss_lookup_fd(uss, reply, handle)) < 0)
+    if ((h = uss_lookup_fd(uss, reply, handle)) < 0)
         return;
+    fd = uss->handles[h].fd;
+
+    if (uss->handles[h].seekable && uss_aio_start() &&
+        (job = uss_aio_new_job(uss, reply, h, USS_AIO_WRITE)) != NULL) {
+        job->offset = offset;
+        job->len = data.len;
+        job->buf = snewn(data.len, char);
+        memcpy(job->buf, data.ptr, data.len);
+        uss_aio_queue(job);
+        return;
+    }
 
     const char *p = data.ptr;
     unsigned length = data.len;
@@ -578,107 +1244,236 @@ static void uss_write(SftpServer *srv, SftpReplyBuilder *reply,
     }
 }
 
+static void uss_copy_data(SftpServer *srv, SftpReplyBuilder *reply,
+                          ptrlen srchandle, uint64_t srcoffset,
+                          uint64_t length, ptrlen dsthandle,
+                          uint64_t dstoffset)
+{
+    UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
+    uss_aio_job *job;
+    int src, dst, srcfd, error;
+
+    if ((src = uss_lookup_fd(uss, reply, srchandle)) < 0 ||
+        (dst = uss_lookup_fd(uss, reply, dsthandle)) < 0)
+        return;
+
+    if (!uss->handles[src].seekable || !uss->handles[dst].seekable) {
+        fxp_reply_error(reply, SSH_FX_OP_UNSUPPORTED,
+                        "copy-data needs ordinary files");
+        return;
+    }
+
+    /* The extension's spec forbids overlapping copies within a file */
+    if (src == dst &&
+        (!length || srcoffset < dstoffset + length) &&
+        (!length || dstoffset < srcoffset + length)) {
+        fxp_reply_error(reply, SSH_FX_FAILURE,
+                        "copy-data source and destination overlap");
+        return;
+    }
+
+    if (uss_aio_start() && (srcfd = dup(uss->handles[src].fd)) >= 0) {
+        if ((job = uss_aio_new_job(uss, reply, dst, USS_AIO_COPY)) != NULL) {
+            job->src_h = src;
+            job->src_gen = uss->handles[src].gen;
+            job->srcfd = srcfd;
+            job->srcoffset = srcoffset;
+            job->copylen = length;
+            job->offset = dstoffset;
+            uss->aio_copies++;
+            uss_aio_queue(job);
+            return;
+        }
+        close(srcfd);
+    }
+
+    if ((error = uss_copy_range(uss->handles[src].fd, srcoffset, length,
+                                uss->handles[dst].fd, dstoffset)) != 0) {
+        errno = error;
+        uss_error(uss, reply);
+    } else {
+        fxp_reply_ok(reply);
+    }
+}
+
+/*
+ * Look up the user and group names for a longname. Most of the files
+ * in a directory tend to have the same owner, so remembering the last
+ * answer saves a trip through the passwd and group databases for
+ * nearly every entry.
+ */
+static const char *uss_user_name(UnixSftpServer *uss, uid_t uid)
+{
+    struct passwd *pwd;
+
+    if (!uss->cached_user || uss->cached_uid != uid) {
+        sfree(uss->cached_user);
+        if ((pwd = getpwuid(uid)) != NULL)
+            uss->cached_user = dupstr(pwd->pw_name);
+        else
+            uss->cached_user = dupprintf("%u", (unsigned)uid);
+        uss->cached_uid = uid;
+    }
+    return uss->cached_user;
+}
+
+static const char *uss_group_name(UnixSftpServer *uss, gid_t gid)
+{
+    struct group *grp;
+
+    if (!uss->cached_group || uss->cached_gid != gid) {
+        sfree(uss->cached_group);
+        if ((grp = getgrgid(gid)) != NULL)
+            uss->cached_group = dupstr(grp->gr_name);
+        else
+            uss->cached_group = dupprintf("%u", (unsigned)gid);
+        uss->cached_gid = gid;
+    }
+    return uss->cached_group;
+}
+
+static struct uss_dirent *uss_make_dirent(
+    UnixSftpServer *uss, DIR *dp, struct dirent *de, bool omit_longname)
+{
+    struct uss_dirent *ude = snew(struct uss_dirent);
+
+    ude->name = dupstr(de->d_name);
+    ude->longname = NULL;
+    ude->attrs = no_attrs;
+
+#if defined HAVE_FSTATAT && defined HAVE_DIRFD
+    struct stat st;
+    if (!fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+        char perms[11];
+        struct tm tm;
+
+        ude->attrs = uss_translate_struct_stat(&st);
+
+        if (!omit_longname) {
+
+            strcpy(perms, "----------");
+            switch (st.st_mode & S_IFMT) {
+              case S_IFBLK: perms[0] = 'b'; break;
+              case S_IFCHR: perms[0] = 'c'; break;
+              case S_IFDIR: perms[0] = 'd'; break;
+              case S_IFIFO: perms[0] = 'p'; break;
+              case S_IFLNK: perms[0] = 'l'; break;
+              case S_IFSOCK: perms[0] = 's'; break;
+            }
+            if (st.st_mode & S_IRUSR)
+                perms[1] = 'r';
+            if (st.st_mode & S_IWUSR)
+                perms[2] = 'w';
+            if (st.st_mode & S_IXUSR)
+                perms[3] = (st.st_mode & S_ISUID ? 's' : 'x');
+            else
+                perms[3] = (st.st_mode & S_ISUID ? 'S' : '-');
+            if (st.st_mode & S_IRGRP)
+                perms[4] = 'r';
+            if (st.st_mode & S_IWGRP)
+                perms[5] = 'w';
+            if (st.st_mode & S_IXGRP)
+                perms[6] = (st.st_mode & S_ISGID ? 's' : 'x');
+            else
+                perms[6] = (st.st_mode & S_ISGID ? 'S' : '-');
+            if (st.st_mode & S_IROTH)
+                perms[7] = 'r';
+            if (st.st_mode & S_IWOTH)
+                perms[8] = 'w';
+            if (st.st_mode & S_IXOTH)
+                perms[9] = 'x';
+
+            tm = *localtime(&st.st_mtime);
+
+            ude->longname = dupprintf(
+                "%s %3u %-8s %-8s %8"PRIuMAX" %.3s %2d %02d:%02d %s",
+                perms, (unsigned)st.st_nlink, uss_user_name(uss, st.st_uid),
+                uss_group_name(uss, st.st_gid), (uintmax_t)st.st_size,
+                (&"JanFebMarAprMayJunJulAugSepOctNovDec"[3*tm.tm_mon]),
+                tm.tm_mday, tm.tm_hour, tm.tm_min, de->d_name);
+        }
+    }
+#endif
+
+    return ude;
+}
+
+static void uss_free_dirent(struct uss_dirent *ude)
+{
+    sfree(ude->name);
+    sfree(ude->longname);
+    sfree(ude);
+}
+
+/* An overestimate of the space an entry takes up in an SSH_FXP_NAME */
+static size_t uss_dirent_size(struct uss_dirent *ude)
+{
+    return 4 + strlen(ude->name) + 4 +
+        (ude->longname ? strlen(ude->longname) : 0) + 4 + 8 + 4*5;
+}
+
 static void uss_readdir(SftpServer *srv, SftpReplyBuilder *reply,
                         ptrlen handle, int max_entries, bool omit_longname)
 {
     UnixSftpServer *uss = container_of(srv, UnixSftpServer, srv);
+    struct uss_handle *uh;
     struct dirent *de;
-    struct uss_dirhandle *udh;
+    struct uss_dirent **ents = NULL, *ude;
+    size_t nents = 0, entsize = 0, bytes = 0;
+    int h;
 
-    if ((udh = uss_lookup_dirhandle(uss, reply, handle)) == NULL)
+    if ((h = uss_lookup_dirhandle(uss, reply, handle)) < 0)
         return;
+    uh = &uss->handles[h];
+
+    /*
+     * Return as many names as fit comfortably in one reply, so that
+     * listing a big directory doesn't take a round trip per entry.
+     * The C library already reads the directory from the kernel in
+     * large batches underneath readdir. If the entry that takes us
+     * over the limit has already been read, we keep it in the handle
+     * for next time.
+     */
+    while (nents < max_entries) {
+        if (uh->pending_dirent) {
+            ude = uh->pending_dirent;
+            uh->pending_dirent = NULL;
+        } else {
+            errno = 0;
+            if ((de = readdir(uh->dp)) == NULL)
+                break;
+            ude = uss_make_dirent(uss, uh->dp, de, omit_longname);
+        }
+
+        if (nents > 0 && bytes + uss_dirent_size(ude) > USS_READDIR_BYTES) {
+            uh->pending_dirent = ude;
+            break;
+        }
 
-    errno = 0;
-    de = readdir(udh->dp);
-    if (!de) {
+        sgrowarray(ents, entsize, nents);
+        ents[nents++] = ude;
+        bytes += uss_dirent_size(ude);
+    }
+
+    if (nents == 0) {
         if (errno == 0) {
             fxp_reply_error(reply, SSH_FX_EOF, "End of directory");
         } else {
             uss_error(uss, reply);
         }
     } else {
-        ptrlen longname = PTRLEN_LITERAL("");
-        char *longnamebuf = NULL;
-        struct fxp_attrs attrs = no_attrs;
-
-#if defined HAVE_FSTATAT && defined HAVE_DIRFD
-        struct stat st;
-        if (!fstatat(dirfd(udh->dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
-            char perms[11], *uidbuf = NULL, *gidbuf = NULL;
-            struct passwd *pwd;
-            struct group *grp;
-            const char *user, *group;
-            struct tm tm;
-
-            attrs = uss_translate_struct_stat(&st);
-
-            if (!omit_longname) {
-
-                strcpy(perms, "----------");
-                switch (st.st_mode & S_IFMT) {
-                  case S_IFBLK: perms[0] = 'b'; break;
-                  case S_IFCHR: perms[0] = 'c'; break;
-                  case S_IFDIR: perms[0] = 'd'; break;
-                  case S_IFIFO: perms[0] = 'p'; break;
-                  case S_IFLNK: perms[0] = 'l'; break;
-                  case S_IFSOCK: perms[0] = 's'; break;
-                }
-                if (st.st_mode & S_IRUSR)
-                    perms[1] = 'r';
-                if (st.st_mode & S_IWUSR)
-                    perms[2] = 'w';
-                if (st.st_mode & S_IXUSR)
-                    perms[3] = (st.st_mode & S_ISUID ? 's' : 'x');
-                else
-                    perms[3] = (st.st_mode & S_ISUID ? 'S' : '-');
-                if (st.st_mode & S_IRGRP)
-                    perms[4] = 'r';
-                if (st.st_mode & S_IWGRP)
-                    perms[5] = 'w';
-                if (st.st_mode & S_IXGRP)
-                    perms[6] = (st.st_mode & S_ISGID ? 's' : 'x');
-                else
-                    perms[6] = (st.st_mode & S_ISGID ? 'S' : '-');
-                if (st.st_mode & S_IROTH)
-                    perms[7] = 'r';
-                if (st.st_mode & S_IWOTH)
-                    perms[8] = 'w';
-                if (st.st_mode & S_IXOTH)
-                    perms[9] = 'x';
-
-                if ((pwd = getpwuid(st.st_uid)) != NULL)
-                    user = pwd->pw_name;
-                else
-                    user = uidbuf = dupprintf("%u", (unsigned)st.st_uid);
-                if ((grp = getgrgid(st.st_gid)) != NULL)
-                    group = grp->gr_name;
-                else
-                    group = gidbuf = dupprintf("%u", (unsigned)st.st_gid);
-
-                tm = *localtime(&st.st_mtime);
-
-                longnamebuf = dupprintf(
-                    "%s %3u %-8s %-8s %8"PRIuMAX" %.3s %2d %02d:%02d %s",
-                    perms, (unsigned)st.st_nlink, user, group,
-                    (uintmax_t)st.st_size,
-                    (&"JanFebMarAprMayJunJulAugSepOctNovDec"[3*tm.tm_mon]),
-                    tm.tm_mday, tm.tm_hour, tm.tm_min, de->d_name);
-                longname = ptrlen_from_asciz(longnamebuf);
-
-                sfree(uidbuf);
-                sfree(gidbuf);
-            }
+        fxp_reply_name_count(reply, nents);
+        for (size_t i = 0; i < nents; i++) {
+            ude = ents[i];
+            fxp_reply_full_name(reply, ptrlen_from_asciz(ude->name),
+                                ptrlen_from_asciz(ude->longname ?
+                                                  ude->longname : ""),
+                                ude->attrs);
+            uss_free_dirent(ude);
         }
-#endif
-
-        /* FIXME: be able to return more than one, in which case we
-         * must also check max_entries */
-        fxp_reply_name_count(reply, 1);
-        fxp_reply_full_name(reply, ptrlen_from_asciz(de->d_name),
-                            longname, attrs);
-
-        sfree(longnamebuf);
     }
+
+    sfree(ents);
 }
 
 const SftpServerVtable unix_live_sftpserver_vt = {
@@ -699,4 +1494,5 @@ const SftpServerVtable unix_live_sftpserver_vt = {
     .read = uss_read,
     .write = uss_write,
     .readdir = uss_readdir,
+    .copy_data = uss_copy_data,
 };
@@ -2,11 +2,15 @@
  * Main program for Unix psocks.
  */
 
+#define _GNU_SOURCE                    /* for splice() */
+
 #include <string.h>
 #include <errno.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -129,9 +133,308 @@ static void start_subcommand(strbuf *args)
     }
 }
 
+/*
+ * Direct relaying between two sockets, once psocks has no further
+ * interest in the data passing through a connection. Each direction
+ * has a buffer, which starts small and grows whenever a read fills
+ * it, so that idle or interactive connections stay cheap while bulk
+ * transfers get to move large chunks at a time. Where splice() is
+ * available, the buffer is a pipe and the data never has to be
+ * copied into our own address space.
+ */
+
+#define RELAY_BUF_MIN 16384
+#define RELAY_BUF_MAX 1048576
+
+typedef struct Relay Relay;
+
+typedef struct RelayDirection {
+    int from, to;
+    size_t size, len;                  /* buffer capacity, and data in it */
+#if HAVE_SPLICE
+    int pipe[2];
+#else
+    char *buf;
+    size_t pos;                        /* start of unsent data in buf */
+#endif
+    bool eof_in, eof_out;
+} RelayDirection;
+
+typedef struct RelayEnd {
+    int fd;
+    Relay *relay;
+} RelayEnd;
+
+struct Relay {
+    RelayEnd end[2];
+    RelayDirection dir[2];             /* dir[i] reads from end[i] */
+    uint64_t *bytes;
+    void (*done)(void *ctx, const char *err);
+    void *ctx;
+};
+
+static tree234 *relayends;
+
+static int relayend_cmp(void *av, void *bv)
+{
+    RelayEnd *a = (RelayEnd *)av, *b = (RelayEnd *)bv;
+    if (a->fd < b->fd)
+        return -1;
+    if (a->fd > b->fd)
+        return +1;
+    return 0;
+}
+
+static int relayend_find(void *av, void *bv)
+{
+    int *a = (int *)av;
+    RelayEnd *b = (RelayEnd *)bv;
+    if (*a < b->fd)
+        return -1;
+    if (*a > b->fd)
+        return +1;
+    return 0;
+}
+
+static void relay_free(Relay *r)
+{
+    for (size_t i = 0; i < 2; i++) {
+        del234(relayends, &r->end[i]);
+        uxsel_del(r->end[i].fd);
+        close(r->end[i].fd);
+#if HAVE_SPLICE
+        close(r->dir[i].pipe[0]);
+        close(r->dir[i].pipe[1]);
+#else
+        sfree(r->dir[i].buf);
+#endif
+    }
+    sfree(r);
+}
+
+static void relay_grow(RelayDirection *d)
+{
+    if (d->size >= RELAY_BUF_MAX)
+        return;
+#if HAVE_SPLICE
+#ifdef F_SETPIPE_SZ
+    {
+        /* The kernel may round this up, or refuse it altogether if
+         * we'd exceed the per-user limit; either way, it tells us
+         * what we actually ended up with. */
+        int newsize = fcntl(d->pipe[1], F_SETPIPE_SZ, (int)(d->size * 2));
+        if (newsize > 0)
+            d->size = newsize;
+    }
+#endif
+#else
+    d->size *= 2;
+    d->buf = sresize(d->buf, d->size, char);
+#endif
+}
+
+/*
+ * Move as much data as we can in one direction without blocking.
+ * Returns true if anything happened, or sets *err.
+ */
+static bool relay_pump(RelayDirection *d, uint64_t *bytes, const char **err)
+{
+    bool progress = false;
+    ssize_t ret;
+
+    if (!d->eof_in && d->len < d->size) {
+        size_t space = d->size - d->len;
+#if HAVE_SPLICE
+        ret = splice(d->from, NULL, d->pipe[1], NULL, space,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+        if (d->pos > 0) {
+            memmove(d->buf, d->buf + d->pos, d->len);
+            d->pos = 0;
+        }
+        ret = read(d->from, d->buf + d->len, space);
+#endif
+        if (ret > 0) {
+            d->len += ret;
+            if (ret == space)
+                relay_grow(d);
+            progress = true;
+        } else if (ret == 0) {
+            d->eof_in = true;
+            progress = true;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                   errno != EINTR) {
+            *err = strerror(errno);
+            return false;
+        }
+    }
+
+    if (d->len > 0) {
+#if HAVE_SPLICE
+        ret = splice(d->pipe[0], NULL, d->to, NULL, d->len,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+        ret = write(d->to, d->buf + d->pos, d->len);
+#endif
+        if (ret > 0) {
+            d->len -= ret;
+            *bytes += ret;
+#if !HAVE_SPLICE
+            d->pos = d->len ? d->pos + ret : 0;
+#endif
+            progress = true;
+        } else if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                   errno != EINTR) {
+            *err = strerror(errno);
+            return false;
+        }
+    }
+
+    if (d->eof_in && d->len == 0 && !d->eof_out) {
+        shutdown(d->to, SHUT_WR);
+        d->eof_out = true;
+        progress = true;
+    }
+
+    return progress;
+}
+
+static void relay_select_result(int fd, int event);
+
+static void relay_reselect(Relay *r)
+{
+    for (size_t i = 0; i < 2; i++) {
+        RelayDirection *in = &r->dir[i], *out = &r->dir[1-i];
+        int rwx = 0;
+        if (!in->eof_in && in->len < in->size)
+            rwx |= SELECT_R;
+        if (out->len > 0)
+            rwx |= SELECT_W;
+        uxsel_set(r->end[i].fd, rwx, relay_select_result);
+    }
+}
+
+static void relay_run(Relay *r)
+{
+    const char *err = NULL;
+    bool progress;
+
+    do {
+        progress = false;
+        for (size_t i = 0; i < 2; i++) {
+            if (relay_pump(&r->dir[i], &r->bytes[i], &err))
+                progress = true;
+            if (err) {
+                r->done(r->ctx, err);
+                relay_free(r);
+                return;
+            }
+        }
+    } while (progress);
+
+    if (r->dir[0].eof_out && r->dir[1].eof_out) {
+        r->done(r->ctx, NULL);
+        relay_free(r);
+        return;
+    }
+
+    relay_reselect(r);
+}
+
+static void relay_select_result(int fd, int event)
+{
+    RelayEnd *end = find234(relayends, &fd, relayend_find);
+    if (end)
+        relay_run(end->relay);
+}
+
+static bool start_relay(Socket *s1, Socket *s2, uint64_t *bytes,
+                        void (*done)(void *ctx, const char *err), void *ctx)
+{
+    int fds[2] = { sk_net_get_fd(s1), sk_net_get_fd(s2) };
+    Relay *r;
+
+    if (fds[0] < 0 || fds[1] < 0)
+        return false;
+
+    r = snew(Relay);
+    for (size_t i = 0; i < 2; i++) {
+        RelayDirection *d = &r->dir[i];
+        d->size = RELAY_BUF_MIN;
+        d->len = 0;
+        d->eof_in = d->eof_out = false;
+#if HAVE_SPLICE
+        d->pipe[0] = d->pipe[1] = -1;
+#else
+        d->buf = snewn(d->size, char);
+        d->pos = 0;
+#endif
+        r->end[i].fd = -1;
+        r->end[i].relay = r;
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+#if HAVE_SPLICE
+        RelayDirection *d = &r->dir[i];
+        if (pipe(d->pipe) < 0)
+            goto fail;
+        cloexec(d->pipe[0]);
+        cloexec(d->pipe[1]);
+        nonblock(d->pipe[0]);
+        nonblock(d->pipe[1]);
+#ifdef F_GETPIPE_SZ
+        {
+            int size = fcntl(d->pipe[1], F_SETPIPE_SZ, RELAY_BUF_MIN);
+            if (size <= 0)
+                size = fcntl(d->pipe[1], F_GETPIPE_SZ);
+            if (size > 0)
+                d->size = size;
+        }
+#endif
+#endif
+        if ((r->end[i].fd = dup(fds[i])) < 0)
+            goto fail;
+        cloexec(r->end[i].fd);
+        nonblock(r->end[i].fd);
+    }
+
+    r->dir[0].from = r->dir[1].to = r->end[0].fd;
+    r->dir[1].from = r->dir[0].to = r->end[1].fd;
+    r->bytes = bytes;
+    r->done = done;
+    r->ctx = ctx;
+
+    if (!relayends)
+        relayends = newtree234(relayend_cmp);
+    add234(relayends, &r->end[0]);
+    add234(relayends, &r->end[1]);
+
+    /* Don't move any data yet: the caller isn't ready to hear that
+     * we've finished */
+    relay_reselect(r);
+    return true;
+
+  fail:
+    for (size_t i = 0; i < 2; i++) {
+        if (r->end[i].fd >= 0)
+            close(r->end[i].fd);
+#if HAVE_SPLICE
+        if (r->dir[i].pipe[0] >= 0) {
+            close(r->dir[i].pipe[0]);
+            close(r->dir[i].pipe[1]);
+        }
+#else
+        sfree(r->dir[i].buf);
+#endif
+    }
+    sfree(r);
+    return false;
+}
+
 static const PsocksPlatform platform = {
     open_pipes,
     start_subcommand,
+    start_relay,
 };
 
 static bool psocks_pw_setup(void *ctx, pollwrapper *pw)
@@ -170,6 +473,17 @@ int main(int argc, char **argv)
     psocks_state *ps = psocks_new(&platform);
     psocks_cmdline(ps, argc, argv);
 
+    /*
+     * Each connection costs us two fds, and the default soft limit
+     * is often low enough to run out at a few hundred connections,
+     * so raise it as far as we're allowed to.
+     */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
     sk_init();
     uxsel_init();
     psocks_start(ps);
@@ -0,0 +1,714 @@
+/*
+ * sshbench: time each of PuTTY's crypto primitives in isolation, so
+ * that a change to one of them (or to the code that chooses between
+ * a hardware-accelerated and a portable implementation) can be
+ * measured without the noise of a whole SSH session around it.
+ *
+ * Every cipher, MAC and hash is run over a range of buffer sizes,
+ * and every implementation of each one is run separately: the lists
+ * below name the _hw and _sw variants explicitly alongside the
+ * selector that picks between them at run time, just as testsc does.
+ * (An implementation that isn't available on this machine is simply
+ * left out of the output.) Ciphers with a built-in MAC, such as
+ * AES-GCM and ChaCha20-Poly1305, are timed together with it, since
+ * that's the only way they're ever used. Key exchange is timed as one
+ * side's share of the work, i.e. making a key pair and then combining
+ * it with the other side's public value; signature algorithms are
+ * timed signing and verifying a 32-byte message (except that
+ * rsa-sha2-* signatures are only timed signing).
+ *
+ * Output is one CSV line per measurement, after a header line, so
+ * that it can be fed straight into a spreadsheet or a script that
+ * compares two runs. cycles/byte and cycles/op are derived from the
+ * CPU timestamp counter where there is one, and left empty where
+ * there isn't.
+ *
+ * Arguments other than options are wildcards matched against names
+ * of the form 'kind_algorithm' (e.g. 'encrypt_ssh_aes256_sdctr_hw',
+ * 'sign_ssh-ed25519'), and restrict the run to the matching
+ * measurements. '-list' shows all the names.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "putty.h"
+#include "ssh.h"
+#include "sshkeygen.h"
+#include "mpint.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+static inline uint64_t cycle_count(void) { return __rdtsc(); }
+#else
+#define HAVE_CYCLE_COUNTER 0
+static inline uint64_t cycle_count(void) { return 0; }
+#endif
+
+static NORETURN PRINTF_LIKE(1, 2) void fatal_error(const char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "sshbench: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+void out_of_memory(void) { fatal_error("out of memory"); }
+FILE *f_open(const Filename *filename, char const *mode, bool is_private)
+{ unreachable("this is a stub needed to link, and should never be called"); }
+void old_keyfile_warning(void)
+{ unreachable("this is a stub needed to link, and should never be called"); }
+
+/*
+ * Key generation needs random numbers, but nothing here needs them
+ * to be secret, so a PRNG with a fixed seed will do, and makes the
+ * keys (and hence the timings) the same from one run to the next.
+ */
+static prng *bench_prng;
+void random_read(void *buf, size_t size)
+{
+    prng_read(bench_prng, buf, size);
+}
+
+uint64_t prng_reseed_time_ms(void)
+{
+    static uint64_t previous_time = 0;
+    return previous_time += 200;
+}
+
+#define CIPHERS(X)                              \
+    X(ssh_3des_ssh1)                            \
+    X(ssh_3des_ssh2_ctr)                        \
+    X(ssh_3des_ssh2)                            \
+    X(ssh_des)                                  \
+    X(ssh_des_sshcom_ssh2)                      \
+    X(ssh_aes256_sdctr)                         \
+    X(ssh_aes256_sdctr_hw)                      \
+    X(ssh_aes256_sdctr_sw)                      \
+    X(ssh_aes256_cbc)                           \
+    X(ssh_aes256_cbc_hw)                        \
+    X(ssh_aes256_cbc_sw)                        \
+    X(ssh_aes192_sdctr)                         \
+    X(ssh_aes192_sdctr_hw)                      \
+    X(ssh_aes192_sdctr_sw)                      \
+    X(ssh_aes192_cbc)                           \
+    X(ssh_aes192_cbc_hw)                        \
+    X(ssh_aes192_cbc_sw)                        \
+    X(ssh_aes128_sdctr)                         \
+    X(ssh_aes128_sdctr_hw)                      \
+    X(ssh_aes128_sdctr_sw)                      \
+    X(ssh_aes128_cbc)                           \
+    X(ssh_aes128_cbc_hw)                        \
+    X(ssh_aes128_cbc_sw)                        \
+    X(ssh_aes256_gcm)                           \
+    X(ssh_aes256_gcm_hw)                        \
+    X(ssh_aes256_gcm_sw)                        \
+    X(ssh_aes128_gcm)                           \
+    X(ssh_aes128_gcm_hw)                        \
+    X(ssh_aes128_gcm_sw)                        \
+    X(ssh2_chacha20_poly1305)                   \
+    X(ssh2_chacha20_poly1305_hw)                \
+    X(ssh2_chacha20_poly1305_avx2)              \
+    X(ssh2_chacha20_poly1305_sw)                \
+    X(ssh_blowfish_ssh1)                        \
+    X(ssh_blowfish_ssh2_ctr)                    \
+    X(ssh_blowfish_ssh2)                        \
+    X(ssh_arcfour256_ssh2)                      \
+    X(ssh_arcfour128_ssh2)                      \
+    /* end of list */
+
+#define MACS(X)                                 \
+    X(ssh_hmac_md5)                             \
+    X(ssh_hmac_sha1)                            \
+    X(ssh_hmac_sha1_96)                         \
+    X(ssh_hmac_sha256)                          \
+    /* end of list */
+
+#define HASHES(X)                               \
+    X(ssh_md5)                                  \
+    X(ssh_sha1)                                 \
+    X(ssh_sha1_hw)                              \
+    X(ssh_sha1_sw)                              \
+    X(ssh_sha256)                               \
+    X(ssh_sha256_hw)                            \
+    X(ssh_sha256_sw)                            \
+    X(ssh_sha384)                               \
+    X(ssh_sha384_hw)                            \
+    X(ssh_sha384_sw)                            \
+    X(ssh_sha512)                               \
+    X(ssh_sha512_hw)                            \
+    X(ssh_sha512_sw)                            \
+    X(ssh_sha3_224)                             \
+    X(ssh_sha3_256)                             \
+    X(ssh_sha3_384)                             \
+    X(ssh_sha3_512)                             \
+    X(ssh_shake256_114bytes)                    \
+    /* end of list */
+
+#define ECDH_KEXES(X)                           \
+    X(ssh_ec_kex_curve25519)                    \
+    X(ssh_ec_kex_curve448)                      \
+    X(ssh_ec_kex_nistp256)                      \
+    X(ssh_ec_kex_nistp384)                      \
+    X(ssh_ec_kex_nistp521)                      \
+    /* end of list */
+
+#define DH_KEXES(X)                             \
+    X(ssh_diffiehellman_group1)                 \
+    X(ssh_diffiehellman_group14)                \
+    /* end of list */
+
+#define LISTENTRY(alg) { #alg, &alg },
+static const struct { const char *name; const ssh_cipheralg *alg; }
+    ciphers[] = { CIPHERS(LISTENTRY) };
+static const struct { const char *name; const ssh2_macalg *alg; }
+    macs[] = { MACS(LISTENTRY) };
+static const struct { const char *name; const ssh_hashalg *alg; }
+    hashes[] = { HASHES(LISTENTRY) };
+static const struct { const char *name; const ssh_kex *alg; }
+    ecdh_kexes[] = { ECDH_KEXES(LISTENTRY) };
+static const struct { const char *name; const ssh_kexes *alg; }
+    dh_kexes[] = { DH_KEXES(LISTENTRY) };
+#undef LISTENTRY
+
+static const struct {
+    const char *name;
+    const ssh_keyalg *alg;
+    int bits;
+    unsigned flags;
+} keys[] = {
+    { "ssh-rsa-2048", &ssh_rsa, 2048, 0 },
+    { "rsa-sha2-256-2048", &ssh_rsa, 2048, SSH_AGENT_RSA_SHA2_256 },
+    { "rsa-sha2-512-2048", &ssh_rsa, 2048, SSH_AGENT_RSA_SHA2_512 },
+    { "ssh-rsa-4096", &ssh_rsa, 4096, 0 },
+    { "ssh-dss-2048", &ssh_dss, 2048, 0 },
+    { "ecdsa-sha2-nistp256", &ssh_ecdsa_nistp256, 256, 0 },
+    { "ecdsa-sha2-nistp384", &ssh_ecdsa_nistp384, 384, 0 },
+    { "ecdsa-sha2-nistp521", &ssh_ecdsa_nistp521, 521, 0 },
+    { "ssh-ed25519", &ssh_ecdsa_ed25519, 255, 0 },
+    { "ssh-ed448", &ssh_ecdsa_ed448, 448, 0 },
+};
+
+static const size_t default_sizes[] = { 16, 64, 256, 1024, 8192, 16384 };
+
+static double min_time = 0.1;
+static size_t *sizes;
+static size_t nsizes;
+static char **patterns;
+static size_t npatterns;
+static bool list_only;
+
+static bool selected(const char *kind, const char *name)
+{
+    if (!npatterns && !list_only)
+        return true;
+
+    char *fullname = dupprintf("%s_%s", kind, name);
+    bool ret = (npatterns == 0);
+    for (size_t i = 0; i < npatterns && !ret; i++)
+        if (wc_match(patterns[i], fullname))
+            ret = true;
+    if (ret && list_only) {
+        printf("%s\n", fullname);
+        ret = false;
+    }
+    sfree(fullname);
+    return ret;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run op(ctx) repeatedly until at least min_time has gone by, and
+ * report the rate. 'size' is the number of bytes each call processes,
+ * or zero if that isn't a meaningful thing to measure it by.
+ */
+static void measure(const char *kind, const char *name, size_t size,
+                    void (*op)(void *ctx), void *ctx)
+{
+    /* Warm up caches, branch predictors and any lazy initialisation */
+    for (size_t i = 0; i < 4; i++)
+        op(ctx);
+
+    uint64_t iters = 1;
+    double elapsed;
+    uint64_t cycles;
+    while (true) {
+        double t0 = now();
+        uint64_t c0 = cycle_count();
+        for (uint64_t i = 0; i < iters; i++)
+            op(ctx);
+        cycles = cycle_count() - c0;
+        elapsed = now() - t0;
+
+        if (elapsed >= min_time)
+            break;
+
+        /* Aim a little past min_time next time, but don't trust an
+         * extrapolation from a run too short to time accurately */
+        if (elapsed < min_time / 64)
+            iters *= 64;
+        else
+            iters = iters * (min_time * 1.1 / elapsed) + 1;
+    }
+
+    double ops = iters / elapsed;
+    printf("%s,%s,", kind, name);
+    if (size)
+        printf("%"SIZEu",%.1f,%.2f,", size, ops, ops * size / 1e6);
+    else
+        printf(",%.1f,,", ops);
+    if (HAVE_CYCLE_COUNTER) {
+        double cpo = (double)cycles / iters;
+        if (size)
+            printf("%.2f", cpo / size);
+        printf(",%.0f\n", cpo);
+    } else {
+        printf(",\n");
+    }
+    fflush(stdout);
+}
+
+typedef struct CipherBench {
+    const ssh_cipheralg *alg;
+    ssh_cipher *c;
+    ssh2_mac *m;
+    uint8_t *data;
+    size_t len;
+    uint32_t seq;
+} CipherBench;
+
+/*
+ * One direction of SSH-2 packet protection: length field, payload
+ * and MAC, in whatever combination the cipher wants them.
+ */
+static void cipher_encrypt_op(void *vctx)
+{
+    CipherBench *cb = (CipherBench *)vctx;
+    if (cb->alg->flags & SSH_CIPHER_SEPARATE_LENGTH)
+        ssh_cipher_encrypt_length(cb->c, cb->data, 4, cb->seq);
+    ssh_cipher_encrypt(cb->c, cb->data, cb->len);
+    if (cb->m)
+        ssh2_mac_generate(cb->m, cb->data, cb->len, cb->seq);
+    cb->seq++;
+}
+
+static void cipher_decrypt_op(void *vctx)
+{
+    CipherBench *cb = (CipherBench *)vctx;
+    if (cb->alg->flags & SSH_CIPHER_SEPARATE_LENGTH)
+        ssh_cipher_decrypt_length(cb->c, cb->data, 4, cb->seq);
+    if (cb->m)
+        ssh2_mac_verify(cb->m, cb->data, cb->len, cb->seq);
+    ssh_cipher_decrypt(cb->c, cb->data, cb->len);
+    cb->seq++;
+}
+
+static void bench_cipher(const char *name, const ssh_cipheralg *alg)
+{
+    bool do_enc = selected("encrypt", name);
+    bool do_dec = selected("decrypt", name);
+    if (!do_enc && !do_dec)
+        return;
+
+    CipherBench cb[1];
+    cb->alg = alg;
+    cb->c = ssh_cipher_new(alg);
+    if (!cb->c)
+        return;                        /* not available on this machine */
+    cb->m = NULL;
+    if (alg->required_mac) {
+        cb->m = ssh2_mac_new(alg->required_mac, cb->c);
+        if (!cb->m) {
+            ssh_cipher_free(cb->c);
+            return;
+        }
+    }
+
+    uint8_t *key = snewn(alg->padded_keybytes, uint8_t);
+    random_read(key, alg->padded_keybytes);
+    ssh_cipher_setkey(cb->c, key);
+    sfree(key);
+    if (alg->blksize > 1) {
+        uint8_t *iv = snewn(alg->blksize, uint8_t);
+        random_read(iv, alg->blksize);
+        ssh_cipher_setiv(cb->c, iv);
+        sfree(iv);
+    }
+    if (cb->m) {
+        uint8_t *mkey = snewn(alg->required_mac->keylen, uint8_t);
+        random_read(mkey, alg->required_mac->keylen);
+        ssh2_mac_setkey(cb->m, make_ptrlen(
+                            mkey, alg->required_mac->keylen));
+        sfree(mkey);
+    }
+
+    for (size_t i = 0; i < nsizes; i++) {
+        /* Cipher input has to be a whole number of blocks */
+        size_t blksize = alg->blksize ? alg->blksize : 1;
+        cb->len = (sizes[i] + blksize - 1) / blksize * blksize;
+        cb->data = snewn(cb->len + (cb->m ? ssh2_mac_alg(cb->m)->len : 0),
+                         uint8_t);
+        random_read(cb->data, cb->len);
+        cb->seq = 0;
+        if (do_enc)
+            measure("encrypt", name, cb->len, cipher_encrypt_op, cb);
+        if (do_dec)
+            measure("decrypt", name, cb->len, cipher_decrypt_op, cb);
+        sfree(cb->data);
+    }
+
+    if (cb->m)
+        ssh2_mac_free(cb->m);
+    ssh_cipher_free(cb->c);
+}
+
+typedef struct MacBench {
+    ssh2_mac *m;
+    uint8_t *data;
+    size_t len;
+    uint32_t seq;
+} MacBench;
+
+static void mac_op(void *vctx)
+{
+    MacBench *mb = (MacBench *)vctx;
+    ssh2_mac_generate(mb->m, mb->data, mb->len, mb->seq++);
+}
+
+static void bench_mac(const char *name, const ssh2_macalg *alg)
+{
+    if (!selected("mac", name))
+        return;
+
+    MacBench mb[1];
+    mb->m = ssh2_mac_new(alg, NULL);
+    if (!mb->m)
+        return;
+
+    uint8_t *key = snewn(alg->keylen, uint8_t);
+    random_read(key, alg->keylen);
+    ssh2_mac_setkey(mb->m, make_ptrlen(key, alg->keylen));
+    sfree(key);
+
+    for (size_t i = 0; i < nsizes; i++) {
+        mb->len = sizes[i];
+        mb->data = snewn(mb->len + alg->len, uint8_t);
+        random_read(mb->data, mb->len);
+        mb->seq = 0;
+        measure("mac", name, mb->len, mac_op, mb);
+        sfree(mb->data);
+    }
+
+    ssh2_mac_free(mb->m);
+}
+
+typedef struct HashBench {
+    ssh_hash *h;
+    uint8_t *data;
+    size_t len;
+    uint8_t digest[MAX_HASH_LEN];
+} HashBench;
+
+static void hash_op(void *vctx)
+{
+    HashBench *hb = (HashBench *)vctx;
+    ssh_hash_reset(hb->h);
+    put_data(hb->h, hb->data, hb->len);
+    ssh_hash_digest(hb->h, hb->digest);
+}
+
+static void bench_hash(const char *name, const ssh_hashalg *alg)
+{
+    if (!selected("hash", name))
+        return;
+
+    HashBench hb[1];
+    hb->h = ssh_hash_new(alg);
+    if (!hb->h)
+        return;
+
+    for (size_t i = 0; i < nsizes; i++) {
+        hb->len = sizes[i];
+        hb->data = snewn(hb->len, uint8_t);
+        random_read(hb->data, hb->len);
+        measure("hash", name, hb->len, hash_op, hb);
+        sfree(hb->data);
+    }
+
+    ssh_hash_free(hb->h);
+}
+
+typedef struct EcdhBench {
+    const ssh_kex *kex;
+    strbuf *remote;
+} EcdhBench;
+
+static void ecdh_op(void *vctx)
+{
+    EcdhBench *eb = (EcdhBench *)vctx;
+    ecdh_key *key = ssh_ecdhkex_newkey(eb->kex);
+    strbuf *pub = strbuf_new();
+    ssh_ecdhkex_getpublic(key, BinarySink_UPCAST(pub));
+    mp_int *K = ssh_ecdhkex_getkey(key, ptrlen_from_strbuf(eb->remote));
+    if (!K)
+        fatal_error("%s: shared secret computation failed", eb->kex->name);
+    mp_free(K);
+    strbuf_free(pub);
+    ssh_ecdhkex_freekey(key);
+}
+
+static void bench_ecdh(const ssh_kex *kex)
+{
+    if (!selected("kex", kex->name))
+        return;
+
+    EcdhBench eb[1];
+    eb->kex = kex;
+    ecdh_key *peer = ssh_ecdhkex_newkey(kex);
+    eb->remote = strbuf_new();
+    ssh_ecdhkex_getpublic(peer, BinarySink_UPCAST(eb->remote));
+    ssh_ecdhkex_freekey(peer);
+
+    measure("kex", kex->name, 0, ecdh_op, eb);
+
+    strbuf_free(eb->remote);
+}
+
+typedef struct DhBench {
+    const ssh_kex *kex;
+    mp_int *f;
+} DhBench;
+
+/* Exponent size, as ssh2kex-client.c would choose for AES-256 */
+#define DH_EXPONENT_BITS 512
+
+static void dh_op(void *vctx)
+{
+    DhBench *db = (DhBench *)vctx;
+    dh_ctx *ctx = dh_setup_group(db->kex);
+    dh_create_e(ctx, DH_EXPONENT_BITS);     /* owned by ctx */
+    mp_int *K = dh_find_K(ctx, db->f);
+    mp_free(K);
+    dh_cleanup(ctx);
+}
+
+static void bench_dh(const ssh_kexes *kexes)
+{
+    /* The hash variants of a group all cost the same */
+    const ssh_kex *kex = kexes->list[0];
+    if (!selected("kex", kex->name))
+        return;
+
+    DhBench db[1];
+    db->kex = kex;
+    dh_ctx *peer = dh_setup_group(kex);
+    db->f = mp_copy(dh_create_e(peer, DH_EXPONENT_BITS));
+    dh_cleanup(peer);
+
+    measure("kex", kex->name, 0, dh_op, db);
+
+    mp_free(db->f);
+}
+
+typedef struct SigBench {
+    ssh_key *key;
+    unsigned flags;
+    ptrlen data;
+    strbuf *sig;
+} SigBench;
+
+static void sign_op(void *vctx)
+{
+    SigBench *sb = (SigBench *)vctx;
+    strbuf_clear(sb->sig);
+    ssh_key_sign(sb->key, sb->data, sb->flags, BinarySink_UPCAST(sb->sig));
+}
+
+static void verify_op(void *vctx)
+{
+    SigBench *sb = (SigBench *)vctx;
+    if (!ssh_key_verify(sb->key, ptrlen_from_strbuf(sb->sig), sb->data))
+        fatal_error("%s: signature did not verify",
+                    ssh_key_alg(sb->key)->ssh_id);
+}
+
+static ssh_key *generate_key(const ssh_keyalg *alg, int bits)
+{
+    ProgressReceiver prog[1] = {{ .vt = &null_progress_vt }};
+
+    if (alg == &ssh_rsa) {
+        RSAKey *rsa = snew(RSAKey);
+        PrimeGenerationContext *pgc = primegen_new_context(
+            &primegen_probabilistic);
+        rsa_generate(rsa, bits, false, pgc, prog);
+        primegen_free_context(pgc);
+        rsa->comment = NULL;
+        return &rsa->sshk;
+    } else if (alg == &ssh_dss) {
+        struct dss_key *dss = snew(struct dss_key);
+        PrimeGenerationContext *pgc = primegen_new_context(
+            &primegen_probabilistic);
+        dsa_generate(dss, bits, pgc, prog);
+        primegen_free_context(pgc);
+        return &dss->sshk;
+    } else if (alg == &ssh_ecdsa_ed25519 || alg == &ssh_ecdsa_ed448) {
+        struct eddsa_key *ek = snew(struct eddsa_key);
+        if (!eddsa_generate(ek, bits))
+            fatal_error("unable to generate %d-bit EdDSA key", bits);
+        return &ek->sshk;
+    } else {
+        struct ecdsa_key *ek = snew(struct ecdsa_key);
+        if (!ecdsa_generate(ek, bits))
+            fatal_error("unable to generate %d-bit ECDSA key", bits);
+        return &ek->sshk;
+    }
+}
+
+static void bench_signatures(void)
+{
+    ssh_key *key = NULL;
+    const ssh_keyalg *keyalg = NULL;
+    int keybits = 0;
+    uint8_t msg[32];
+
+    random_read(msg, sizeof(msg));
+
+    for (size_t i = 0; i < lenof(keys); i++) {
+        bool do_sign = selected("sign", keys[i].name);
+        /* PuTTY's RSA verification only knows about ssh-rsa, since
+         * it never needs to check an rsa-sha2-* signature itself */
+        bool do_verify = keys[i].flags == 0 &&
+            selected("verify", keys[i].name);
+        if (!do_sign && !do_verify)
+            continue;
+
+        /* Consecutive entries differing only in flags share a key */
+        if (!key || keyalg != keys[i].alg || keybits != keys[i].bits) {
+            if (key)
+                ssh_key_free(key);
+            keyalg = keys[i].alg;
+            keybits = keys[i].bits;
+            key = generate_key(keyalg, keybits);
+        }
+
+        SigBench sb[1];
+        sb->key = key;
+        sb->flags = keys[i].flags;
+        sb->data = make_ptrlen(msg, sizeof(msg));
+        sb->sig = strbuf_new();
+
+        sign_op(sb);
+        if (do_sign)
+            measure("sign", keys[i].name, 0, sign_op, sb);
+        if (do_verify)
+            measure("verify", keys[i].name, 0, verify_op, sb);
+
+        strbuf_free(sb->sig);
+    }
+
+    if (key)
+        ssh_key_free(key);
+}
+
+static void usage(void)
+{
+    printf("usage: sshbench [options] [name-wildcard...]\n");
+    printf("options:\n");
+    printf("  -time T      run each measurement for at least T seconds"
+           " (default 0.1)\n");
+    printf("  -sizes LIST  comma-separated buffer sizes for ciphers,"
+           " MACs and hashes\n");
+    printf("               (default 16,64,256,1024,8192,16384)\n");
+    printf("  -list        list the measurement names and exit\n");
+}
+
+int main(int argc, char **argv)
+{
+    sizes = snewn(lenof(default_sizes), size_t);
+    memcpy(sizes, default_sizes, sizeof(default_sizes));
+    nsizes = lenof(default_sizes);
+    patterns = snewn(argc, char *);
+    npatterns = 0;
+
+    while (--argc) {
+        char *p = *++argv;
+        const char *val = argc > 1 ? argv[1] : NULL;
+
+        if (!strcmp(p, "-list")) {
+            list_only = true;
+        } else if (!strcmp(p, "--help") || !strcmp(p, "-h")) {
+            usage();
+            return 0;
+        } else if (!strcmp(p, "-time") || !strcmp(p, "-sizes")) {
+            if (!val)
+                fatal_error("option '%s' expects an argument", p);
+            argc--, argv++;
+            if (!strcmp(p, "-time")) {
+                min_time = atof(val);
+                if (!(min_time > 0))
+                    fatal_error("time must be positive");
+            } else {
+                nsizes = 0;
+                for (const char *q = val; *q; q++)
+                    if (*q == ',')
+                        nsizes++;
+                sfree(sizes);
+                sizes = snewn(nsizes + 1, size_t);
+                nsizes = 0;
+                for (const char *q = val; *q ;) {
+                    char *end;
+                    unsigned long size = strtoul(q, &end, 10);
+                    if (end == q || size == 0 || (*end && *end != ','))
+                        fatal_error("bad size list '%s'", val);
+                    sizes[nsizes++] = size;
+                    q = *end ? end + 1 : end;
+                }
+            }
+        } else if (p[0] == '-') {
+            fprintf(stderr, "sshbench: unknown option '%s'\n", p);
+            usage();
+            return 1;
+        } else {
+            patterns[npatterns++] = p;
+        }
+    }
+
+    bench_prng = prng_new(&ssh_sha256);
+    prng_seed_begin(bench_prng);
+    put_asciz(bench_prng, "sshbench");
+    prng_seed_finish(bench_prng);
+
+    if (!list_only)
+        printf("kind,algorithm,bytes,ops/s,MB/s,cycles/byte,cycles/op\n");
+
+    for (size_t i = 0; i < lenof(ciphers); i++)
+        bench_cipher(ciphers[i].name, ciphers[i].alg);
+    for (size_t i = 0; i < lenof(macs); i++)
+        bench_mac(macs[i].name, macs[i].alg);
+    for (size_t i = 0; i < lenof(hashes); i++)
+        bench_hash(hashes[i].name, hashes[i].alg);
+    for (size_t i = 0; i < lenof(ecdh_kexes); i++)
+        bench_ecdh(ecdh_kexes[i].alg);
+    for (size_t i = 0; i < lenof(dh_kexes); i++)
+        bench_dh(dh_kexes[i].alg);
+    bench_signatures();
+
+    prng_free(bench_prng);
+    sfree(patterns);
+    sfree(sizes);
+    return 0;
+}
@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include "putty.h"
@@ -28,7 +29,7 @@
 
 enum {
     INDEX_DIR, INDEX_HOSTKEYS, INDEX_HOSTKEYS_TMP, INDEX_RANDSEED,
-    INDEX_SESSIONDIR, INDEX_SESSION,
+    INDEX_SESSIONDIR, INDEX_SESSION, INDEX_AUTHHINTS, INDEX_AUTHHINTS_TMP,
 };
 
 static const char hex[16] = "0123456789ABCDEF";
@@ -193,6 +194,18 @@ static char *make_filename(int index, const char *subname)
         sfree(tmp);
         return ret;
     }
+    if (index == INDEX_AUTHHINTS) {
+        tmp = make_filename(INDEX_DIR, NULL);
+        ret = dupprintf("%s/sshauthhints", tmp);
+        sfree(tmp);
+        return ret;
+    }
+    if (index == INDEX_AUTHHINTS_TMP) {
+        tmp = make_filename(INDEX_AUTHHINTS, NULL);
+        ret = dupprintf("%s.tmp", tmp);
+        sfree(tmp);
+        return ret;
+    }
     if (index == INDEX_RANDSEED) {
         env = getenv("PUTTYRANDOMSEED");
         if (env)
@@ -594,73 +607,203 @@ void enum_settings_finish(settings_e *handle)
  * e.g.
  *
  *   rsa@22:foovax.example.org 0x23,0x293487364395345345....2343
+ *
+ * We call everything before the space the key's 'identifier'.
+ *
+ * To avoid reading the whole file on every connection, we normally
+ * keep most of it sorted by identifier, so that we can binary-search
+ * it in place. Such a file begins with a header line
+ *
+ *   #PuTTY-sorted-host-keys <length>
+ *
+ * saying how many bytes after the header line are in sorted order.
+ * Anything after that is an unsorted tail of keys stored since, which
+ * we search linearly. New keys are appended to the tail; when the
+ * tail gets too long, or an existing key has to be replaced, we
+ * rewrite the file sorted from scratch.
+ *
+ * Older versions of PuTTY ignore the header line, because it can't
+ * match any identifier, so they can still use the file. (If one of
+ * them edits it, the header is likely to be found inconsistent with
+ * the file, and then we fall back to a linear search of everything.)
+ * For the same reason, we never let an identifier appear twice.
  */
-int verify_host_key(const char *hostname, int port,
-                    const char *keytype, const char *key)
+#define HOSTKEY_HEADER "#PuTTY-sorted-host-keys "
+#define HOSTKEY_TAIL_LIMIT 65536
+
+typedef struct HostKeyFile {
+    char *data;
+    size_t len;
+    bool mapped;
+    bool indexed;                      /* header was present and valid */
+    size_t sorted_start, sorted_end;
+} HostKeyFile;
+
+static bool hostkey_file_open(HostKeyFile *hf)
 {
-    FILE *fp;
     char *filename;
-    char *line;
-    int ret;
+    struct stat st;
+    int fd;
+
+    memset(hf, 0, sizeof(*hf));
 
     filename = make_filename(INDEX_HOSTKEYS, NULL);
-    fp = fopen(filename, "r");
+    fd = open(filename, O_RDONLY);
     sfree(filename);
-    if (!fp)
-        return 1;                      /* key does not exist */
-
-    ret = 1;
-    while ( (line = fgetline(fp)) ) {
-        int i;
-        char *p = line;
-        char porttext[20];
+    if (fd < 0)
+        return false;
 
-        line[strcspn(line, "\n")] = '\0';   /* strip trailing newline */
-
-        i = strlen(keytype);
-        if (strncmp(p, keytype, i))
-            goto done;
-        p += i;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    hf->len = st.st_size;
 
-        if (*p != '@')
-            goto done;
-        p++;
+    if (hf->len > 0) {
+        void *map = mmap(NULL, hf->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            hf->data = map;
+            hf->mapped = true;
+        } else {
+            /* Not everything can be mapped; read it the slow way. */
+            size_t got = 0;
+            hf->data = snewn(hf->len, char);
+            while (got < hf->len) {
+                ssize_t ret = read(fd, hf->data + got, hf->len - got);
+                if (ret <= 0)
+                    break;
+                got += ret;
+            }
+            hf->len = got;
+        }
+    }
+    close(fd);
 
-        sprintf(porttext, "%d", port);
-        i = strlen(porttext);
-        if (strncmp(p, porttext, i))
-            goto done;
-        p += i;
+    /*
+     * Check the header, if any. The sorted region must lie within
+     * the file and end at the end of a line.
+     */
+    size_t hlen = strlen(HOSTKEY_HEADER);
+    if (hf->len > hlen && !memcmp(hf->data, HOSTKEY_HEADER, hlen)) {
+        size_t pos = hlen, sorted_len = 0;
+        bool ok = false;
+        while (pos < hf->len && hf->data[pos] >= '0' &&
+               hf->data[pos] <= '9' && sorted_len <= hf->len) {
+            sorted_len = sorted_len * 10 + (hf->data[pos++] - '0');
+            ok = true;
+        }
+        if (ok && pos < hf->len && hf->data[pos] == '\n') {
+            pos++;
+            if (sorted_len <= hf->len - pos &&
+                (sorted_len == 0 || hf->data[pos + sorted_len - 1] == '\n')) {
+                hf->indexed = true;
+                hf->sorted_start = pos;
+                hf->sorted_end = pos + sorted_len;
+            }
+        }
+    }
 
-        if (*p != ':')
-            goto done;
-        p++;
+    return true;
+}
 
-        i = strlen(hostname);
-        if (strncmp(p, hostname, i))
-            goto done;
-        p += i;
+static void hostkey_file_close(HostKeyFile *hf)
+{
+    if (hf->mapped)
+        munmap(hf->data, hf->len);
+    else
+        sfree(hf->data);
+}
 
-        if (*p != ' ')
-            goto done;
-        p++;
+/*
+ * Compare an identifier with the one at the start of a line, in the
+ * same order that the sorted region of the file is kept in.
+ */
+static int hostkey_id_cmp(ptrlen id, const char *line, const char *eol)
+{
+    const char *sp = memchr(line, ' ', eol - line);
+    size_t linelen = (sp ? sp : eol) - line;
+    int cmp = memcmp(id.ptr, line, id.len < linelen ? id.len : linelen);
+    if (cmp)
+        return cmp;
+    return id.len < linelen ? -1 : id.len > linelen ? +1 : 0;
+}
 
-        /*
-         * Found the key. Now just work out whether it's the right
-         * one or not.
-         */
-        if (!strcmp(p, key))
-            ret = 0;                   /* key matched OK */
-        else
-            ret = 2;                   /* key mismatch */
+static const char *hostkey_eol(const HostKeyFile *hf, const char *line)
+{
+    const char *eol = memchr(line, '\n', hf->data + hf->len - line);
+    return eol ? eol : hf->data + hf->len;
+}
 
-        done:
-        sfree(line);
-        if (ret != 1)
+/*
+ * Find the line for a given identifier. Returns a pointer to its key
+ * data, and sets *keylen; or returns NULL if there isn't one.
+ */
+static const char *hostkey_find(const HostKeyFile *hf, ptrlen id,
+                                size_t *keylen)
+{
+    const char *line = NULL, *eol = NULL;
+    size_t lo, hi, pos;
+
+    /* Binary search of the sorted region. */
+    lo = hf->sorted_start;
+    hi = hf->sorted_end;
+    while (lo < hi) {
+        size_t start = lo + (hi - lo) / 2;
+        int cmp;
+
+        while (start > lo && hf->data[start - 1] != '\n')
+            start--;
+        eol = hostkey_eol(hf, hf->data + start);
+        cmp = hostkey_id_cmp(id, hf->data + start, eol);
+        if (cmp == 0) {
+            line = hf->data + start;
             break;
+        } else if (cmp < 0) {
+            hi = start;
+        } else {
+            lo = eol + 1 - hf->data;
+        }
     }
 
-    fclose(fp);
+    /* Failing that, linear search of everything else. */
+    for (pos = hf->sorted_end; !line && pos < hf->len;
+         pos = eol + 1 - hf->data) {
+        eol = hostkey_eol(hf, hf->data + pos);
+        if (hostkey_id_cmp(id, hf->data + pos, eol) == 0)
+            line = hf->data + pos;
+    }
+
+    /* The identifier must be followed by a space to count as a match. */
+    if (!line || line + id.len == eol || line[id.len] != ' ')
+        return NULL;
+
+    *keylen = eol - (line + id.len + 1);
+    return line + id.len + 1;
+}
+
+int verify_host_key(const char *hostname, int port,
+                    const char *keytype, const char *key)
+{
+    HostKeyFile hf;
+    const char *found;
+    char *id;
+    size_t keylen;
+    int ret;
+
+    if (!hostkey_file_open(&hf))
+        return 1;                      /* key does not exist */
+
+    id = dupprintf("%s@%d:%s", keytype, port, hostname);
+    found = hostkey_find(&hf, ptrlen_from_asciz(id), &keylen);
+    if (!found)
+        ret = 1;                       /* key does not exist */
+    else if (keylen == strlen(key) && !memcmp(found, key, keylen))
+        ret = 0;                       /* key matched OK */
+    else
+        ret = 2;                       /* key mismatch */
+
+    sfree(id);
+    hostkey_file_close(&hf);
     return ret;
 }
 
@@ -674,17 +817,35 @@ bool have_ssh_host_key(const char *hostname, int port,
     return verify_host_key(hostname, port, keytype, "") != 1;
 }
 
-void store_host_key(const char *hostname, int port,
-                    const char *keytype, const char *key)
+typedef struct HostKeyLine {
+    ptrlen text, id;
+    size_t index;
+} HostKeyLine;
+
+static int hostkey_line_cmp(const void *av, const void *bv)
 {
-    FILE *rfp, *wfp;
-    char *newtext, *line;
-    int headerlen;
+    const HostKeyLine *a = (const HostKeyLine *)av;
+    const HostKeyLine *b = (const HostKeyLine *)bv;
+    int cmp = hostkey_id_cmp(a->id, b->text.ptr,
+                             (const char *)b->text.ptr + b->text.len);
+    if (cmp)
+        return cmp;
+    /* Keep the original order among equal identifiers */
+    return a->index < b->index ? -1 : a->index > b->index ? +1 : 0;
+}
+
+/*
+ * Rewrite the whole host keys file in sorted order, with 'newtext'
+ * replacing any existing line with the same identifier.
+ */
+static void hostkey_file_rewrite(HostKeyFile *hf, const char *newtext,
+                                 ptrlen newid)
+{
+    HostKeyLine *lines = NULL;
+    size_t nlines = 0, linesize = 0, pos, sorted_len, i;
     char *filename, *tmpfilename;
+    FILE *wfp;
 
-    /*
-     * Open both the old file and a new file.
-     */
     tmpfilename = make_filename(INDEX_HOSTKEYS_TMP, NULL);
     wfp = fopen(tmpfilename, "w");
     if (!wfp && errno == ENOENT) {
@@ -708,32 +869,72 @@ void store_host_key(const char *hostname, int port,
         sfree(tmpfilename);
         return;
     }
-    filename = make_filename(INDEX_HOSTKEYS, NULL);
-    rfp = fopen(filename, "r");
-
-    newtext = dupprintf("%s@%d:%s %s\n", keytype, port, hostname, key);
-    headerlen = 1 + strcspn(newtext, " ");   /* count the space too */
 
     /*
-     * Copy all lines from the old file to the new one that _don't_
-     * involve the same host key identifier as the one we're adding.
+     * Collect all the lines of the old file except any header, and
+     * except one with the same identifier as the one we're adding.
      */
-    if (rfp) {
-        while ( (line = fgetline(rfp)) ) {
-            if (strncmp(line, newtext, headerlen))
-                fputs(line, wfp);
-            sfree(line);
-        }
-        fclose(rfp);
+    for (pos = 0; pos < hf->len; ) {
+        const char *line = hf->data + pos, *eol = hostkey_eol(hf, line);
+        pos = eol + 1 - hf->data;
+
+        if (eol == line)
+            continue;                  /* drop blank lines */
+        if ((size_t)(eol - line) >= strlen(HOSTKEY_HEADER) &&
+            !memcmp(line, HOSTKEY_HEADER, strlen(HOSTKEY_HEADER)))
+            continue;
+        if (hostkey_id_cmp(newid, line, eol) == 0)
+            continue;
+
+        sgrowarray(lines, linesize, nlines);
+        lines[nlines].text = make_ptrlen(line, eol - line);
+        lines[nlines].index = nlines;
+        nlines++;
+    }
+    sgrowarray(lines, linesize, nlines);
+    lines[nlines].text = make_ptrlen(newtext, strlen(newtext) - 1);
+    lines[nlines].index = nlines;
+    nlines++;
+
+    for (i = 0; i < nlines; i++) {
+        const char *p = lines[i].text.ptr;
+        const char *sp = memchr(p, ' ', lines[i].text.len);
+        lines[i].id = make_ptrlen(p, sp ? sp - p : lines[i].text.len);
     }
+    qsort(lines, nlines, sizeof(*lines), hostkey_line_cmp);
 
     /*
-     * Now add the new line at the end.
+     * If a file we didn't write had the same identifier twice, the
+     * first one is the one that was in effect, so keep only that.
      */
-    fputs(newtext, wfp);
+    sorted_len = 0;
+    for (i = 0; i < nlines; i++) {
+        if (i > 0 && ptrlen_eq_ptrlen(lines[i].id, lines[i-1].id)) {
+            lines[i].text.ptr = NULL;
+            lines[i].id = lines[i-1].id;
+            continue;
+        }
+        sorted_len += lines[i].text.len + 1;
+    }
 
-    fclose(wfp);
+    fprintf(wfp, "%s%"SIZEu"\n", HOSTKEY_HEADER, sorted_len);
+    for (i = 0; i < nlines; i++) {
+        if (!lines[i].text.ptr)
+            continue;
+        fwrite(lines[i].text.ptr, 1, lines[i].text.len, wfp);
+        fputc('\n', wfp);
+    }
+    sfree(lines);
 
+    if (fclose(wfp) != 0) {
+        nonfatal("Unable to store host key: write(\"%s\") "
+                 "returned '%s'", tmpfilename, strerror(errno));
+        remove(tmpfilename);
+        sfree(tmpfilename);
+        return;
+    }
+
+    filename = make_filename(INDEX_HOSTKEYS, NULL);
     if (rename(tmpfilename, filename) < 0) {
         nonfatal("Unable to store host key: rename(\"%s\",\"%s\")"
                  " returned '%s'", tmpfilename, filename,
@@ -742,9 +943,151 @@ void store_host_key(const char *hostname, int port,
 
     sfree(tmpfilename);
     sfree(filename);
+}
+
+void store_host_key(const char *hostname, int port,
+                    const char *keytype, const char *key)
+{
+    HostKeyFile hf;
+    char *newtext;
+    ptrlen newid;
+    size_t keylen;
+    bool appended = false;
+
+    if (!hostkey_file_open(&hf))
+        memset(&hf, 0, sizeof(hf));
+
+    newtext = dupprintf("%s@%d:%s %s\n", keytype, port, hostname, key);
+    newid = make_ptrlen(newtext, strcspn(newtext, " "));
+
+    /*
+     * If this is a new identifier, and the unsorted tail of an
+     * indexed file has room for it, we can just append it.
+     * Otherwise, rewrite the file from scratch.
+     */
+    if (hf.indexed && !hostkey_find(&hf, newid, &keylen) &&
+        (hf.len == hf.sorted_end || hf.data[hf.len - 1] == '\n') &&
+        hf.len - hf.sorted_end + strlen(newtext) <= HOSTKEY_TAIL_LIMIT) {
+        char *filename = make_filename(INDEX_HOSTKEYS, NULL);
+        int fd = open(filename, O_WRONLY | O_APPEND);
+        if (fd >= 0) {
+            size_t len = strlen(newtext);
+            appended = (write(fd, newtext, len) == (ssize_t)len);
+            if (close(fd) < 0)
+                appended = false;
+        }
+        sfree(filename);
+    }
+
+    if (!appended)
+        hostkey_file_rewrite(&hf, newtext, newid);
+
+    hostkey_file_close(&hf);
     sfree(newtext);
 }
 
+/*
+ * The authentication hints file has one line per (user, server)
+ * pair, of the form 'user@port:host hint'. It's only ever a cache,
+ * so failures to read or write it are silently ignored.
+ */
+static char *auth_hint_id(const char *hostname, int port,
+                          const char *username)
+{
+    /* Names containing whitespace can't be represented in the file */
+    if (username[strcspn(username, " \t\r\n")] ||
+        hostname[strcspn(hostname, " \t\r\n")])
+        return NULL;
+    return dupprintf("%s@%d:%s ", username, port, hostname);
+}
+
+char *retrieve_auth_hint(const char *hostname, int port,
+                         const char *username)
+{
+    char *id, *filename, *line, *ret = NULL;
+    size_t idlen;
+    FILE *fp;
+
+    if (!(id = auth_hint_id(hostname, port, username)))
+        return NULL;
+    idlen = strlen(id);
+
+    filename = make_filename(INDEX_AUTHHINTS, NULL);
+    fp = fopen(filename, "r");
+    sfree(filename);
+
+    if (fp) {
+        while (!ret && (line = fgetline(fp)) != NULL) {
+            if (!strncmp(line, id, idlen)) {
+                line[idlen + strcspn(line + idlen, "\r\n")] = '\0';
+                ret = dupstr(line + idlen);
+            }
+            sfree(line);
+        }
+        fclose(fp);
+    }
+
+    sfree(id);
+    return ret;
+}
+
+void store_auth_hint(const char *hostname, int port,
+                     const char *username, const char *hint)
+{
+    char *id, *filename, *tmpfilename, *line;
+    size_t idlen;
+    FILE *rfp, *wfp;
+    bool ok;
+
+    if (!(id = auth_hint_id(hostname, port, username)))
+        return;
+    idlen = strlen(id);
+
+    tmpfilename = make_filename(INDEX_AUTHHINTS_TMP, NULL);
+    wfp = fopen(tmpfilename, "w");
+    if (!wfp && errno == ENOENT) {
+        char *dir = make_filename(INDEX_DIR, NULL), *errmsg;
+        if ((errmsg = make_dir_path(dir, 0700)) == NULL)
+            wfp = fopen(tmpfilename, "w");
+        sfree(errmsg);
+        sfree(dir);
+    }
+    if (!wfp) {
+        sfree(tmpfilename);
+        sfree(id);
+        return;
+    }
+
+    /*
+     * Put the new entry first, so that the most recently used
+     * servers are found quickest, and copy every other entry after
+     * it.
+     */
+    if (hint)
+        fprintf(wfp, "%s%s\n", id, hint);
+
+    filename = make_filename(INDEX_AUTHHINTS, NULL);
+    rfp = fopen(filename, "r");
+    if (rfp) {
+        while ((line = fgetline(rfp)) != NULL) {
+            if (strncmp(line, id, idlen))
+                fputs(line, wfp);
+            sfree(line);
+        }
+        fclose(rfp);
+    }
+
+    ok = !ferror(wfp);
+    if (fclose(wfp) < 0)
+        ok = false;
+    if (!ok || rename(tmpfilename, filename) < 0)
+        remove(tmpfilename);
+
+    sfree(filename);
+    sfree(tmpfilename);
+    sfree(id);
+}
+
 void read_random_seed(noise_consumer_t consumer)
 {
     int fd;
@@ -1,3 +1,7 @@
+#include <time.h>
+#include <signal.h>
+#include <string.h>
+
 #include "putty.h"
 #include "ssh.h"
 
@@ -40,6 +44,39 @@ bool platform_sha1_hw_available(void)
 #endif
 }
 
+bool platform_sha512_hw_available(void)
+{
+#if defined HWCAP_SHA512
+    return getauxval(AT_HWCAP) & HWCAP_SHA512;
+#elif defined HWCAP2_SHA512
+    return getauxval(AT_HWCAP2) & HWCAP2_SHA512;
+#else
+    return false;
+#endif
+}
+
+bool platform_sha3_hw_available(void)
+{
+#if defined HWCAP_SHA3
+    return getauxval(AT_HWCAP) & HWCAP_SHA3;
+#elif defined HWCAP2_SHA3
+    return getauxval(AT_HWCAP2) & HWCAP2_SHA3;
+#else
+    return false;
+#endif
+}
+
+bool platform_pmull_hw_available(void)
+{
+#if defined HWCAP_PMULL
+    return getauxval(AT_HWCAP) & HWCAP_PMULL;
+#elif defined HWCAP2_PMULL
+    return getauxval(AT_HWCAP2) & HWCAP2_PMULL;
+#else
+    return false;
+#endif
+}
+
 #else
 
 bool platform_aes_hw_available(void)
@@ -57,4 +94,444 @@ bool platform_sha1_hw_available(void)
     return false;
 }
 
+bool platform_sha512_hw_available(void)
+{
+    return false;
+}
+
+bool platform_sha3_hw_available(void)
+{
+    return false;
+}
+
+bool platform_pmull_hw_available(void)
+{
+    return false;
+}
+
 #endif
+
+#if HAVE_PTHREAD
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* No point going beyond this however big the machine is: the callers
+ * are looking for one success among a batch of attempts, so wider
+ * batches mostly generate more wasted work */
+#define MAX_PARALLEL_JOBS 64
+
+unsigned platform_parallel_jobs(void)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        return 1;
+    if (ncpus > MAX_PARALLEL_JOBS)
+        return MAX_PARALLEL_JOBS;
+    return ncpus;
+}
+
+struct parallel_job {
+    void (*fn)(void *);
+    void *ctx;
+};
+
+static void *parallel_job_thread(void *vjob)
+{
+    struct parallel_job *job = (struct parallel_job *)vjob;
+    job->fn(job->ctx);
+    return NULL;
+}
+
+void platform_run_parallel(void (*fn)(void *), void **ctxs, size_t n)
+{
+    struct parallel_job *jobs = snewn(n, struct parallel_job);
+    pthread_t *threads = snewn(n, pthread_t);
+    bool *started = snewn(n, bool);
+    sigset_t all, old;
+
+    /* Leave all signals to the main thread, as uxsftpserver.c does
+     * for its worker pool */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (size_t i = 1; i < n; i++) {
+        jobs[i].fn = fn;
+        jobs[i].ctx = ctxs[i];
+        started[i] = (pthread_create(&threads[i], NULL,
+                                     parallel_job_thread, &jobs[i]) == 0);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /* Do the first job in this thread, and any that we couldn't make
+     * a thread for */
+    if (n > 0)
+        fn(ctxs[0]);
+    for (size_t i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            fn(ctxs[i]);
+    }
+
+    sfree(jobs);
+    sfree(threads);
+    sfree(started);
+}
+
+/*
+ * Background log file writer. The main thread copies data into a
+ * ring buffer and the writer thread drains it with fwrite, so that a
+ * slow log file doesn't hold up the event loop. If the ring fills up,
+ * the main thread waits for space: we'd rather stall than silently
+ * lose part of a session log. For the same reason, a flush waits
+ * until everything written so far has reached the file, and every
+ * live writer is drained and joined at exit, so that a fatal error
+ * doesn't lose the end of the log (which is where it will have
+ * described the error).
+ */
+#define LOGWRITER_BUFSIZE (1024 * 1024)
+
+struct LogWriter {
+    FILE *fp;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;    /* signalled when there's work to do */
+    pthread_cond_t space_cond;   /* signalled when ring space is freed,
+                                  * or a flush has completed */
+    char *buf;
+    size_t start, len;           /* occupied region of the ring */
+    uint64_t flush_req, flush_done; /* flushes requested and completed */
+    bool running;                /* thread exists in this process */
+    bool closing, joined, error;
+    LogFilter *lf;               /* if non-NULL, data goes through this */
+    strbuf *filtered;            /* and comes out here */
+    LogWriter *next, *prev;      /* list of live writers */
+};
+
+static LogWriter *logwriters;
+static bool lw_exit_handlers_registered;
+
+/*
+ * Write some data to the file, through the filter if there is one.
+ * Called on the writer thread without the lock held.
+ */
+static bool logwriter_output(LogWriter *lw, ptrlen data)
+{
+    if (lw->lf) {
+        strbuf_clear(lw->filtered);
+        logfilter_write(lw->lf, data, lw->filtered);
+        data = ptrlen_from_strbuf(lw->filtered);
+    }
+    return fwrite(data.ptr, 1, data.len, lw->fp) == data.len;
+}
+
+/* Ask the filter for whatever it's holding, and write that out */
+static bool logwriter_output_filter(
+    LogWriter *lw, void (*fn)(LogFilter *, strbuf *))
+{
+    strbuf_clear(lw->filtered);
+    fn(lw->lf, lw->filtered);
+    return fwrite(lw->filtered->u, 1, lw->filtered->len, lw->fp) ==
+        lw->filtered->len;
+}
+
+static void *logwriter_thread(void *vlw)
+{
+    LogWriter *lw = (LogWriter *)vlw;
+
+    pthread_mutex_lock(&lw->lock);
+    while (true) {
+        if (lw->len) {
+            size_t start = lw->start;
+            size_t n = min(lw->len, LOGWRITER_BUFSIZE - start);
+            bool ok = true;
+
+            pthread_mutex_unlock(&lw->lock);
+            if (!lw->error)
+                ok = logwriter_output(lw, make_ptrlen(lw->buf + start, n));
+            pthread_mutex_lock(&lw->lock);
+
+            lw->start = (start + n) % LOGWRITER_BUFSIZE;
+            lw->len -= n;
+            if (!ok)
+                lw->error = true;
+            pthread_cond_broadcast(&lw->space_cond);
+        } else if (lw->flush_done != lw->flush_req) {
+            uint64_t req = lw->flush_req;
+            bool ok = true;
+
+            pthread_mutex_unlock(&lw->lock);
+            if (lw->lf && !lw->error)
+                ok = logwriter_output_filter(lw, logfilter_flush);
+            fflush(lw->fp);
+            pthread_mutex_lock(&lw->lock);
+            lw->flush_done = req;
+            if (!ok)
+                lw->error = true;
+            pthread_cond_broadcast(&lw->space_cond);
+        } else if (lw->closing) {
+            if (lw->lf && !lw->error &&
+                !logwriter_output_filter(lw, logfilter_finish))
+                lw->error = true;
+            fflush(lw->fp);
+            break;
+        } else {
+            pthread_cond_wait(&lw->work_cond, &lw->lock);
+        }
+    }
+    pthread_mutex_unlock(&lw->lock);
+    return NULL;
+}
+
+static bool logwriter_start(LogWriter *lw)
+{
+    sigset_t all, old;
+    int err;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&lw->thread, NULL, logwriter_thread, lw);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    lw->running = (err == 0);
+    return lw->running;
+}
+
+/*
+ * A child process has none of its parent's threads. So before a fork
+ * we let every writer get all its data as far as the file, and hold
+ * its lock so that nothing more arrives, which leaves nothing for the
+ * child to lose, or to write a second time. The child starts a new
+ * thread for a writer only if it writes to it (e.g. the session log
+ * of a Plink connection sharing upstream that detaches itself with
+ * -sharepersist).
+ */
+static void logwriter_atfork_prepare(void)
+{
+    for (LogWriter *lw = logwriters; lw; lw = lw->next) {
+        pthread_mutex_lock(&lw->lock);
+        while (lw->running && !lw->joined &&
+               (lw->len || lw->flush_done != lw->flush_req))
+            pthread_cond_wait(&lw->space_cond, &lw->lock);
+        fflush(lw->fp);
+    }
+}
+
+static void logwriter_atfork_parent(void)
+{
+    for (LogWriter *lw = logwriters; lw; lw = lw->next)
+        pthread_mutex_unlock(&lw->lock);
+}
+
+static void logwriter_atfork_child(void)
+{
+    for (LogWriter *lw = logwriters; lw; lw = lw->next) {
+        pthread_mutex_init(&lw->lock, NULL);
+        pthread_cond_init(&lw->work_cond, NULL);
+        pthread_cond_init(&lw->space_cond, NULL);
+        lw->running = false;
+    }
+}
+
+LogWriter *platform_logwriter_new(FILE *fp, LogFilter *lf)
+{
+    LogWriter *lw = snew(LogWriter);
+
+    lw->fp = fp;
+    lw->buf = snewn(LOGWRITER_BUFSIZE, char);
+    lw->start = lw->len = 0;
+    lw->flush_req = lw->flush_done = 0;
+    lw->closing = lw->joined = lw->error = false;
+    lw->lf = lf;
+    lw->filtered = strbuf_new_nm();
+    pthread_mutex_init(&lw->lock, NULL);
+    pthread_cond_init(&lw->work_cond, NULL);
+    pthread_cond_init(&lw->space_cond, NULL);
+
+    if (!logwriter_start(lw)) {
+        pthread_cond_destroy(&lw->space_cond);
+        pthread_cond_destroy(&lw->work_cond);
+        pthread_mutex_destroy(&lw->lock);
+        strbuf_free(lw->filtered);
+        sfree(lw->buf);
+        sfree(lw);
+        return NULL;
+    }
+
+    if (!lw_exit_handlers_registered) {
+        atexit(platform_logwriter_close_all);
+        pthread_atfork(logwriter_atfork_prepare, logwriter_atfork_parent,
+                       logwriter_atfork_child);
+        lw_exit_handlers_registered = true;
+    }
+    lw->prev = NULL;
+    lw->next = logwriters;
+    if (lw->next)
+        lw->next->prev = lw;
+    logwriters = lw;
+    return lw;
+}
+
+bool platform_logwriter_write(LogWriter *lw, ptrlen data)
+{
+    const char *p = data.ptr;
+    size_t left = data.len;
+    bool ok;
+
+    if (lw->joined)
+        return false;        /* too late: we're already shutting down */
+    if (!lw->running && !logwriter_start(lw))
+        return false;
+
+    pthread_mutex_lock(&lw->lock);
+    while (left > 0 && !lw->error) {
+        if (lw->len == LOGWRITER_BUFSIZE) {
+            pthread_cond_wait(&lw->space_cond, &lw->lock);
+            continue;
+        }
+        size_t end = (lw->start + lw->len) % LOGWRITER_BUFSIZE;
+        size_t n = min(left, LOGWRITER_BUFSIZE - lw->len);
+        n = min(n, LOGWRITER_BUFSIZE - end);
+        memcpy(lw->buf + end, p, n);
+        lw->len += n;
+        p += n;
+        left -= n;
+        pthread_cond_signal(&lw->work_cond);
+    }
+    ok = !lw->error;
+    pthread_mutex_unlock(&lw->lock);
+    return ok;
+}
+
+void platform_logwriter_flush(LogWriter *lw)
+{
+    uint64_t req;
+
+    if (!lw->joined && !lw->running && !logwriter_start(lw))
+        return;
+
+    pthread_mutex_lock(&lw->lock);
+    if (!lw->joined) {
+        req = ++lw->flush_req;
+        pthread_cond_signal(&lw->work_cond);
+        while (lw->flush_done < req && !lw->error)
+            pthread_cond_wait(&lw->space_cond, &lw->lock);
+    }
+    pthread_mutex_unlock(&lw->lock);
+}
+
+/*
+ * Write out everything a writer is holding, finish its filter, and
+ * stop its thread. Afterwards the LogWriter still has to be freed.
+ */
+static void logwriter_close(LogWriter *lw)
+{
+    if (lw->joined)
+        return;
+    if (!lw->running && !logwriter_start(lw)) {
+        lw->error = true;
+        lw->joined = true;
+        return;
+    }
+    pthread_mutex_lock(&lw->lock);
+    lw->closing = true;
+    pthread_cond_signal(&lw->work_cond);
+    pthread_mutex_unlock(&lw->lock);
+    pthread_join(lw->thread, NULL);
+    lw->joined = true;
+}
+
+void platform_logwriter_close_all(void)
+{
+    for (LogWriter *lw = logwriters; lw; lw = lw->next)
+        logwriter_close(lw);
+}
+
+bool platform_logwriter_free(LogWriter *lw)
+{
+    bool ok;
+
+    logwriter_close(lw);
+    if (lw->prev)
+        lw->prev->next = lw->next;
+    else
+        logwriters = lw->next;
+    if (lw->next)
+        lw->next->prev = lw->prev;
+
+    ok = !lw->error;
+    pthread_cond_destroy(&lw->space_cond);
+    pthread_cond_destroy(&lw->work_cond);
+    pthread_mutex_destroy(&lw->lock);
+    strbuf_free(lw->filtered);
+    sfree(lw->buf);
+    sfree(lw);
+    return ok;
+}
+
+#else /* HAVE_PTHREAD */
+
+unsigned platform_parallel_jobs(void)
+{
+    return 1;
+}
+
+void platform_run_parallel(void (*fn)(void *), void **ctxs, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        fn(ctxs[i]);
+}
+
+LogWriter *platform_logwriter_new(FILE *fp, LogFilter *lf)
+{
+    return NULL;                       /* caller will write synchronously */
+}
+
+bool platform_logwriter_write(LogWriter *lw, ptrlen data)
+{
+    unreachable("no LogWriter can exist without threads");
+}
+
+void platform_logwriter_flush(LogWriter *lw)
+{
+    unreachable("no LogWriter can exist without threads");
+}
+
+bool platform_logwriter_free(LogWriter *lw)
+{
+    unreachable("no LogWriter can exist without threads");
+}
+
+void platform_logwriter_close_all(void)
+{
+}
+
+#endif /* HAVE_PTHREAD */
+
+uint64_t platform_perf_counter_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* SIGUSR2 asks for the event trace to be written out now */
+static void (*trace_request_write_fn)(void);
+
+static void trace_sigusr2(int sig)
+{
+    trace_request_write_fn();
+}
+
+void platform_trace_started(void (*request_write)(void))
+{
+    struct sigaction sa;
+
+    trace_request_write_fn = request_write;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_sigusr2;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, NULL);
+}
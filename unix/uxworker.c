@@ -0,0 +1,250 @@
+/*
+ * uxworker.c: a pool of worker threads for running slow jobs (such
+ * as private-key operations) without holding up the event loop.
+ */
+
+#include <stdlib.h>
+
+#include "putty.h"
+#include "ssh.h"
+
+#if HAVE_PTHREAD
+
+#include <pthread.h>
+#include <signal.h>
+
+/* Enough to keep a few slow jobs from queueing behind each other,
+ * without starting a thread per CPU on a big machine */
+#define BGJOB_MAX_THREADS 8
+
+typedef struct bgjob bgjob;
+struct bgjob {
+    void (*fn)(void *);
+    void (*done)(void *);
+    void *ctx;
+    bgjob *next;
+};
+
+static struct {
+    int state;                  /* 0 = not tried, 1 = running, -1 = failed */
+    bool initialised;           /* lock and conditions set up */
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   /* signalled when runq gains a job */
+    pthread_cond_t done_cond;   /* broadcast when doneq gains a job */
+    bgjob *runq, *runq_tail;
+    bgjob *doneq, *doneq_tail;
+    unsigned busy;              /* jobs taken off runq, not yet on doneq */
+} bg;
+
+static void bgjob_completed(void *ctx);
+
+static void *bgjob_worker(void *arg)
+{
+    pthread_mutex_lock(&bg.lock);
+    while (true) {
+        bgjob *job;
+
+        while (!bg.runq)
+            pthread_cond_wait(&bg.work_cond, &bg.lock);
+        job = bg.runq;
+        if (!(bg.runq = job->next))
+            bg.runq_tail = NULL;
+        bg.busy++;
+        pthread_mutex_unlock(&bg.lock);
+
+        job->fn(job->ctx);
+
+        pthread_mutex_lock(&bg.lock);
+        bg.busy--;
+        job->next = NULL;
+        if (bg.doneq_tail) {
+            bg.doneq_tail->next = job;
+        } else {
+            /* The main thread will empty doneq when it gets round to
+             * it, so it only needs telling about the first job */
+            bg.doneq = job;
+            queue_toplevel_callback_from_thread(bgjob_completed, &bg);
+        }
+        bg.doneq_tail = job;
+        pthread_cond_broadcast(&bg.done_cond);
+    }
+
+    return NULL;
+}
+
+static void bgjob_completed(void *ctx)
+{
+    bgjob *job;
+
+    /*
+     * Take one job at a time, since a completion function might
+     * well start another job.
+     */
+    while (true) {
+        pthread_mutex_lock(&bg.lock);
+        if ((job = bg.doneq) != NULL && !(bg.doneq = job->next))
+            bg.doneq_tail = NULL;
+        pthread_mutex_unlock(&bg.lock);
+
+        if (!job)
+            break;
+        job->done(job->ctx);
+        sfree(job);
+    }
+}
+
+/*
+ * Only the forking thread survives into a child process, so the
+ * worker threads have to be started again there. Before the fork, we
+ * wait until every job has finished, so that none is lost half-done
+ * with the thread running it. The child inherits the finished jobs
+ * on doneq, and the callback that collects them, and starts new
+ * threads when it next has a job for them (e.g. a Plink connection
+ * sharing upstream that detaches itself with -sharepersist).
+ */
+static void bgjob_atfork_prepare(void)
+{
+    pthread_mutex_lock(&bg.lock);
+    while (bg.runq || bg.busy)
+        pthread_cond_wait(&bg.done_cond, &bg.lock);
+}
+
+static void bgjob_atfork_parent(void)
+{
+    pthread_mutex_unlock(&bg.lock);
+}
+
+static void bgjob_atfork_child(void)
+{
+    pthread_mutex_init(&bg.lock, NULL);
+    pthread_cond_init(&bg.work_cond, NULL);
+    pthread_cond_init(&bg.done_cond, NULL);
+    if (bg.state > 0)
+        bg.state = 0;
+}
+
+static bool bgjob_start(void)
+{
+    sigset_t all, old;
+    pthread_t thread;
+    unsigned i, nthreads = 0, wanted;
+
+    if (bg.state)
+        return bg.state > 0;
+    bg.state = -1;
+
+    wanted = platform_parallel_jobs();
+    if (wanted > BGJOB_MAX_THREADS)
+        wanted = BGJOB_MAX_THREADS;
+
+    if (!platform_enable_thread_callbacks())
+        return false;
+    if (!bg.initialised) {
+        pthread_mutex_init(&bg.lock, NULL);
+        pthread_cond_init(&bg.work_cond, NULL);
+        pthread_cond_init(&bg.done_cond, NULL);
+        pthread_atfork(bgjob_atfork_prepare, bgjob_atfork_parent,
+                       bgjob_atfork_child);
+        bg.initialised = true;
+    }
+
+    /* Leave all signals to the main thread, as uxsftpserver.c does
+     * for its worker pool */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < wanted; i++) {
+        if (pthread_create(&thread, NULL, bgjob_worker, NULL) == 0) {
+            pthread_detach(thread);
+            nthreads++;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!nthreads)
+        return false;
+
+    bg.state = 1;
+    return true;
+}
+
+bool platform_run_in_background(void (*fn)(void *), void (*done)(void *),
+                                void *ctx)
+{
+    bgjob *job;
+
+    if (!bgjob_start())
+        return false;
+
+    job = snew(bgjob);
+    job->fn = fn;
+    job->done = done;
+    job->ctx = ctx;
+    job->next = NULL;
+
+    pthread_mutex_lock(&bg.lock);
+    if (bg.runq_tail)
+        bg.runq_tail->next = job;
+    else
+        bg.runq = job;
+    bg.runq_tail = job;
+    pthread_cond_signal(&bg.work_cond);
+    pthread_mutex_unlock(&bg.lock);
+
+    return true;
+}
+
+/* Remove and return the job with a given context from a queue */
+static bgjob *bgjob_unlink(bgjob **head, bgjob **tail, void *ctx)
+{
+    bgjob *job, *prev = NULL;
+
+    for (job = *head; job; prev = job, job = job->next) {
+        if (job->ctx == ctx) {
+            if (prev)
+                prev->next = job->next;
+            else
+                *head = job->next;
+            if (*tail == job)
+                *tail = prev;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+void platform_finish_background(void *ctx)
+{
+    bgjob *job;
+
+    pthread_mutex_lock(&bg.lock);
+    while (true) {
+        if ((job = bgjob_unlink(&bg.runq, &bg.runq_tail, ctx)) != NULL) {
+            pthread_mutex_unlock(&bg.lock);
+            job->fn(job->ctx);
+            break;
+        }
+        if ((job = bgjob_unlink(&bg.doneq, &bg.doneq_tail, ctx)) != NULL) {
+            pthread_mutex_unlock(&bg.lock);
+            break;
+        }
+        pthread_cond_wait(&bg.done_cond, &bg.lock);
+    }
+
+    job->done(job->ctx);
+    sfree(job);
+}
+
+#else /* HAVE_PTHREAD */
+
+bool platform_run_in_background(void (*fn)(void *), void (*done)(void *),
+                                void *ctx)
+{
+    return false;
+}
+
+void platform_finish_background(void *ctx)
+{
+    unreachable("platform_run_in_background never starts a job here");
+}
+
+#endif /* HAVE_PTHREAD */
@@ -0,0 +1,22 @@
+/*
+ * uxzstd.c: find the zstd library at run time, for sshzstd.c.
+ */
+
+#include "putty.h"
+#include "ssh.h"
+
+void *platform_zstd_function(const char *name)
+{
+#ifndef NO_LIBDL
+    static bool tried = false;
+    static void *lib;
+
+    if (!tried) {
+        lib = dlopen("libzstd.so.1", RTLD_LAZY);
+        tried = true;
+    }
+    if (lib)
+        return dlsym(lib, name);
+#endif
+    return NULL;
+}
@@ -405,21 +405,86 @@ char *dupprintf(const char *fmt, ...)
     return ret;
 }
 
+/*
+ * Most strbufs are short-lived and small, so the first
+ * STRBUF_INLINE_SIZE bytes of buffer live in the same allocation as
+ * the strbuf_impl itself, and only move out to a separate heap block
+ * if the strbuf grows beyond that. Freed strbuf_impls are kept on a
+ * short per-thread list for reuse, so that the common case of
+ * strbuf_new() ... strbuf_free() needn't call malloc at all.
+ */
+#define STRBUF_INLINE_SIZE 512
+#define STRBUF_MAX_FREE 16
+
 struct strbuf_impl {
     size_t size;
     struct strbuf visible;
     bool nm;          /* true if we insist on non-moving buffer resizes */
+    struct strbuf_impl *next_free;
+    char inline_buf[STRBUF_INLINE_SIZE];
 };
 
 #define STRBUF_SET_UPTR(buf)                                    \
     ((buf)->visible.u = (unsigned char *)(buf)->visible.s)
 #define STRBUF_SET_PTR(buf, ptr)                                \
     ((buf)->visible.s = (ptr), STRBUF_SET_UPTR(buf))
+#define STRBUF_IS_INLINE(buf) ((buf)->visible.s == (buf)->inline_buf)
+
+#if defined THREAD_LOCAL && !defined MINEFIELD
+/* The list belonging to a thread that exits is never freed, so this
+ * is bounded at STRBUF_MAX_FREE impls per thread */
+static THREAD_LOCAL struct strbuf_impl *strbuf_free_list;
+static THREAD_LOCAL unsigned strbuf_nfree;
+
+static struct strbuf_impl *strbuf_impl_new(void)
+{
+    struct strbuf_impl *buf = strbuf_free_list;
+    if (buf) {
+        strbuf_free_list = buf->next_free;
+        strbuf_nfree--;
+        return buf;
+    }
+    return snew(struct strbuf_impl);
+}
+
+static void strbuf_impl_free(struct strbuf_impl *buf)
+{
+    if (strbuf_nfree < STRBUF_MAX_FREE) {
+        buf->next_free = strbuf_free_list;
+        strbuf_free_list = buf;
+        strbuf_nfree++;
+    } else {
+        sfree(buf);
+    }
+}
+#else
+static struct strbuf_impl *strbuf_impl_new(void)
+{
+    return snew(struct strbuf_impl);
+}
+
+static void strbuf_impl_free(struct strbuf_impl *buf)
+{
+    sfree(buf);
+}
+#endif
+
+/* Move the contents of the inline buffer out to the heap, so that
+ * the ordinary growth code can resize it. */
+static void strbuf_unembed(struct strbuf_impl *buf)
+{
+    char *s = snewn(buf->size, char);
+    memcpy(s, buf->inline_buf, buf->visible.len + 1);
+    smemclr(buf->inline_buf, buf->size);
+    STRBUF_SET_PTR(buf, s);
+}
 
 void *strbuf_append(strbuf *buf_o, size_t len)
 {
     struct strbuf_impl *buf = container_of(buf_o, struct strbuf_impl, visible);
     char *toret;
+    if (STRBUF_IS_INLINE(buf) && len >= buf->size - buf->visible.len)
+        strbuf_unembed(buf);
     sgrowarray_general(
         buf->visible.s, buf->size, buf->visible.len + 1, len, buf->nm);
     STRBUF_SET_UPTR(buf);
@@ -459,38 +524,73 @@ static void strbuf_BinarySink_write(
     memcpy(strbuf_append(buf_o, len), data, len);
 }
 
-static strbuf *strbuf_new_general(bool nm)
+static strbuf *strbuf_new_general(bool nm, size_t size)
 {
-    struct strbuf_impl *buf = snew(struct strbuf_impl);
+    struct strbuf_impl *buf = strbuf_impl_new();
     BinarySink_INIT(&buf->visible, strbuf_BinarySink_write);
     buf->visible.len = 0;
-    buf->size = 512;
     buf->nm = nm;
-    STRBUF_SET_PTR(buf, snewn(buf->size, char));
+    if (size < STRBUF_INLINE_SIZE) {
+        buf->size = STRBUF_INLINE_SIZE;
+        STRBUF_SET_PTR(buf, buf->inline_buf);
+    } else {
+        buf->size = size + 1;
+        STRBUF_SET_PTR(buf, snewn(buf->size, char));
+    }
     *buf->visible.s = '\0';
+    buf->visible.binarysink_->fastbuf = &buf->visible.u;
+    buf->visible.binarysink_->fastlen = &buf->visible.len;
+    buf->visible.binarysink_->fastsize = &buf->size;
     return &buf->visible;
 }
-strbuf *strbuf_new(void) { return strbuf_new_general(false); }
-strbuf *strbuf_new_nm(void) { return strbuf_new_general(true); }
+strbuf *strbuf_new(void) { return strbuf_new_general(false, 0); }
+strbuf *strbuf_new_nm(void) { return strbuf_new_general(true, 0); }
+strbuf *strbuf_new_sized(size_t size)
+{
+    return strbuf_new_general(false, size);
+}
 void strbuf_free(strbuf *buf_o)
 {
     struct strbuf_impl *buf = container_of(buf_o, struct strbuf_impl, visible);
     if (buf->visible.s) {
         smemclr(buf->visible.s, buf->size);
-        sfree(buf->visible.s);
+        if (!STRBUF_IS_INLINE(buf))
+            sfree(buf->visible.s);
     }
-    sfree(buf);
+    strbuf_impl_free(buf);
 }
 char *strbuf_to_str(strbuf *buf_o)
 {
     struct strbuf_impl *buf = container_of(buf_o, struct strbuf_impl, visible);
     char *ret = buf->visible.s;
-    sfree(buf);
+    if (STRBUF_IS_INLINE(buf)) {
+        ret = snewn(buf->visible.len + 1, char);
+        memcpy(ret, buf->inline_buf, buf->visible.len + 1);
+        smemclr(buf->inline_buf, buf->size);
+    }
+    strbuf_impl_free(buf);
     return ret;
 }
 void strbuf_catfv(strbuf *buf_o, const char *fmt, va_list ap)
 {
     struct strbuf_impl *buf = container_of(buf_o, struct strbuf_impl, visible);
+
+    if (STRBUF_IS_INLINE(buf)) {
+        /* Try formatting straight into the inline buffer, and only
+         * move to the heap if the result doesn't fit. */
+        size_t space = buf->size - buf->visible.len;
+        va_list aq;
+        va_copy(aq, ap);
+        int len = vsnprintf(buf->visible.s + buf->visible.len, space, fmt, aq);
+        va_end(aq);
+        if (len >= 0 && len < space) {
+            buf->visible.len += len;
+            return;
+        }
+        buf->visible.s[buf->visible.len] = '\0';
+        strbuf_unembed(buf);
+    }
+
     STRBUF_SET_PTR(buf, dupvprintf_inner(buf->visible.s, buf->visible.len,
                                          &buf->size, fmt, ap));
     buf->visible.len += strlen(buf->visible.s + buf->visible.len);
@@ -664,8 +764,22 @@ int base64_decode_atom(const char *atom, unsigned char *out)
 struct bufchain_granule {
     struct bufchain_granule *next;
     char *bufpos, *bufend, *bufmax;
+
+    /* For a granule added by bufchain_add_external, the data lives
+     * in the caller's buffer rather than after this header, and this
+     * is called when we've finished with it */
+    void (*release)(void *ctx);
+    void *release_ctx;
 };
 
+static void bufchain_granule_free(struct bufchain_granule *b)
+{
+    if (b->release)
+        b->release(b->release_ctx);
+    smemclr(b, sizeof(*b));
+    sfree_pooled(b);
+}
+
 static void uninitialised_queue_idempotent_callback(IdempotentCallback *ic)
 {
     unreachable("bufchain callback used while uninitialised");
@@ -685,8 +799,7 @@ void bufchain_clear(bufchain *ch)
     while (ch->head) {
         b = ch->head;
         ch->head = ch->head->next;
-        smemclr(b, sizeof(*b));
-        sfree(b);
+        bufchain_granule_free(b);
     }
     ch->tail = NULL;
     ch->buffersize = 0;
@@ -725,11 +838,12 @@ void bufchain_add(bufchain *ch, const void *data, size_t len)
             size_t grainlen =
                 max(sizeof(struct bufchain_granule) + len, BUFFER_MIN_GRANULE);
             struct bufchain_granule *newbuf;
-            newbuf = smalloc(grainlen);
+            newbuf = smalloc_pooled(MEMPOOL_BUFCHAIN, grainlen);
             newbuf->bufpos = newbuf->bufend =
                 (char *)newbuf + sizeof(struct bufchain_granule);
             newbuf->bufmax = (char *)newbuf + grainlen;
             newbuf->next = NULL;
+            newbuf->release = NULL;
             if (ch->tail)
                 ch->tail->next = newbuf;
             else
@@ -742,6 +856,38 @@ void bufchain_add(bufchain *ch, const void *data, size_t len)
         ch->queue_idempotent_callback(ch->ic);
 }
 
+/*
+ * Append a buffer to the chain without copying it. The chain takes
+ * ownership of the buffer: 'release' is called with 'ctx' once all
+ * of its data has been consumed (or the chain is cleared), and the
+ * caller must not modify or free it before then.
+ */
+void bufchain_add_external(bufchain *ch, const void *data, size_t len,
+                           void (*release)(void *ctx), void *ctx)
+{
+    if (len == 0) {
+        release(ctx);
+        return;
+    }
+
+    struct bufchain_granule *newbuf =
+        snew_pooled(MEMPOOL_BUFCHAIN, struct bufchain_granule);
+    newbuf->bufpos = (char *)data;
+    newbuf->bufend = newbuf->bufmax = newbuf->bufpos + len;
+    newbuf->next = NULL;
+    newbuf->release = release;
+    newbuf->release_ctx = ctx;
+    if (ch->tail)
+        ch->tail->next = newbuf;
+    else
+        ch->head = newbuf;
+    ch->tail = newbuf;
+    ch->buffersize += len;
+
+    if (ch->ic)
+        ch->queue_idempotent_callback(ch->ic);
+}
+
 void bufchain_consume(bufchain *ch, size_t len)
 {
     struct bufchain_granule *tmp;
@@ -756,8 +902,7 @@ void bufchain_consume(bufchain *ch, size_t len)
             ch->head = tmp->next;
             if (!ch->head)
                 ch->tail = NULL;
-            smemclr(tmp, sizeof(*tmp));
-            sfree(tmp);
+            bufchain_granule_free(tmp);
         } else
             ch->head->bufpos += remlen;
         ch->buffersize -= remlen;
@@ -770,6 +915,61 @@ ptrlen bufchain_prefix(bufchain *ch)
     return make_ptrlen(ch->head->bufpos, ch->head->bufend - ch->head->bufpos);
 }
 
+/*
+ * Like bufchain_prefix, but if the chain starts with several small
+ * blocks, merge them (up to 'limit' bytes in total) into one first,
+ * so that the caller can pass them all to a single write call.
+ */
+ptrlen bufchain_prefix_coalesced(bufchain *ch, size_t limit)
+{
+    struct bufchain_granule *b, *end, *newbuf;
+    size_t total = 0;
+
+    for (end = ch->head; end; end = end->next) {
+        size_t len = end->bufend - end->bufpos;
+        if (total + len > limit)
+            break;
+        total += len;
+    }
+
+    if (end != ch->head && end != ch->head->next) {
+        newbuf = snew_plus_pooled(MEMPOOL_BUFCHAIN,
+                                  struct bufchain_granule, total);
+        newbuf->bufpos = newbuf->bufend =
+            (char *)newbuf + sizeof(struct bufchain_granule);
+        newbuf->bufmax = newbuf->bufpos + total;
+        newbuf->release = NULL;
+        while (ch->head != end) {
+            b = ch->head;
+            ch->head = b->next;
+            memcpy(newbuf->bufend, b->bufpos, b->bufend - b->bufpos);
+            newbuf->bufend += b->bufend - b->bufpos;
+            bufchain_granule_free(b);
+        }
+        newbuf->next = end;
+        ch->head = newbuf;
+        if (!end)
+            ch->tail = newbuf;
+    }
+
+    return bufchain_prefix(ch);
+}
+
+/*
+ * Describe up to 'maxn' of the blocks at the start of the chain, for
+ * passing to a scatter-gather write call. Returns the number filled
+ * in.
+ */
+size_t bufchain_prefixes(bufchain *ch, ptrlen *out, size_t maxn)
+{
+    struct bufchain_granule *b;
+    size_t n = 0;
+
+    for (b = ch->head; b && n < maxn; b = b->next)
+        out[n++] = make_ptrlen(b->bufpos, b->bufend - b->bufpos);
+    return n;
+}
+
 void bufchain_fetch(bufchain *ch, void *data, size_t len)
 {
     struct bufchain_granule *tmp;
@@ -121,7 +121,7 @@ static bool bisearch(unsigned int ucs, const struct interval *table, int max) {
  * in ISO 10646.
  */
 
-int mk_wcwidth(unsigned int ucs)
+static int wcwidth_search(unsigned int ucs)
 {
   /* sorted list of non-overlapping intervals of non-spacing characters */
   /* generated by "uniset +cat=Me +cat=Mn +cat=Cf -00AD +1160-11FF +200B c" */
@@ -336,7 +336,7 @@ int mk_wcswidth(const unsigned int *pwcs, size_t n)
  * the traditional terminal character-width behaviour. It is not
  * otherwise recommended for general use.
  */
-int mk_wcwidth_cjk(unsigned int ucs)
+static int wcwidth_cjk_search(unsigned int ucs)
 {
   /* A sorted list of intervals of ambiguous width characters generated by:
    * https://raw.githubusercontent.com/GNOME/glib/37d4c2941bd0326b8b6e6bb22c81bd424fcc040b/glib/gen-unicode-tables.pl
@@ -530,7 +530,7 @@ int mk_wcwidth_cjk(unsigned int ucs)
                sizeof(ambiguous) / sizeof(struct interval) - 1))
     return 2;
 
-  return mk_wcwidth(ucs);
+  return wcwidth_search(ucs);
 }
 
 
@@ -546,3 +546,53 @@ int mk_wcswidth_cjk(const unsigned int *pwcs, size_t n)
 
   return width;
 }
+
+/*
+ * The binary searches above are too slow to do for every character a
+ * terminal displays, so we cache their results in a two-level table:
+ * one entry per 256-character block, pointing at an array of 2-bit
+ * widths (offset by 1, so that -1 fits) for the characters in that
+ * block. Each block is filled in from the interval tables the first
+ * time any character in it is looked up, so only the parts of
+ * Unicode actually in use cost any memory.
+ */
+#define WCWIDTH_BLOCKS (0x110000 >> 8)
+
+static unsigned char *wcwidth_blocks[2][WCWIDTH_BLOCKS];
+
+static int wcwidth_lookup(unsigned int ucs, bool cjk)
+{
+  unsigned char *block;
+
+  if (ucs >= 0x110000)
+    return cjk ? wcwidth_cjk_search(ucs) : wcwidth_search(ucs);
+
+  block = wcwidth_blocks[cjk][ucs >> 8];
+  if (!block) {
+    unsigned int base = ucs & ~0xFFU, i;
+
+    block = snewn(64, unsigned char);
+    memset(block, 0, 64);
+    for (i = 0; i < 256; i++) {
+      int w = cjk ? wcwidth_cjk_search(base + i) : wcwidth_search(base + i);
+      block[i >> 2] |= (w + 1) << ((i & 3) * 2);
+    }
+    wcwidth_blocks[cjk][ucs >> 8] = block;
+  }
+
+  return ((block[(ucs & 0xFF) >> 2] >> ((ucs & 3) * 2)) & 3) - 1;
+}
+
+int mk_wcwidth(unsigned int ucs)
+{
+  if (ucs >= 0x20 && ucs < 0x7f)
+    return 1;
+  return wcwidth_lookup(ucs, false);
+}
+
+int mk_wcwidth_cjk(unsigned int ucs)
+{
+  if (ucs >= 0x20 && ucs < 0x7f)
+    return 1;
+  return wcwidth_lookup(ucs, true);
+}
@@ -34,6 +34,16 @@ void cli_main_loop(cliloop_pre_t pre, cliloop_post_t post, void *ctx)
              * get WAIT_TIMEOUT */
         }
 
+        /*
+         * The timers we've just run may have queued toplevel
+         * callbacks, which shouldn't have to wait for some unrelated
+         * event to come along.
+         */
+        if (ticks != 0 && toplevel_callback_pending()) {
+            ticks = 0;
+            next = now;
+        }
+
         handles = handle_get_events(&nhandles);
         size_t winselcli_index = nhandles;
         size_t extra_base = winselcli_index + 1;
@@ -48,7 +58,10 @@ void cli_main_loop(cliloop_pre_t pre, cliloop_post_t post, void *ctx)
         size_t extra_handle_index = n_extra_handles;
 
         if ((unsigned)(n - WAIT_OBJECT_0) < (unsigned)nhandles) {
+            uint64_t trace_start = trace_begin();
             handle_got_event(handles[n - WAIT_OBJECT_0]);
+            trace_end("handle", (uintptr_t)handles[n - WAIT_OBJECT_0],
+                      trace_start);
         } else if (n == WAIT_OBJECT_0 + nhandles) {
             WSANETWORKEVENTS things;
             SOCKET socket;
@@ -100,7 +113,9 @@ void cli_main_loop(cliloop_pre_t pre, cliloop_post_t post, void *ctx)
                             LPARAM lp;
                             int err = things.iErrorCode[eventtypes[e].bit];
                             lp = WSAMAKESELECTREPLY(eventtypes[e].mask, err);
+                            uint64_t trace_start = trace_begin();
                             select_result(wp, lp);
+                            trace_end("socket", wp, trace_start);
                         }
                 }
             }
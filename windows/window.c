@@ -229,6 +229,7 @@ static void wintw_draw_text(TermWin *, int x, int y, wchar_t *text, int len,
 static void wintw_draw_cursor(TermWin *, int x, int y, wchar_t *text, int len,
                               unsigned long attrs, int lattrs, truecolour tc);
 static void wintw_draw_trust_sigil(TermWin *, int x, int y);
+static bool wintw_scroll_rect(TermWin *, int topline, int botline, int lines);
 static int wintw_char_width(TermWin *, int uc);
 static void wintw_free_draw_ctx(TermWin *);
 static void wintw_set_cursor_pos(TermWin *, int x, int y);
@@ -261,6 +262,7 @@ static const TermWinVtable windows_termwin_vt = {
     .draw_text = wintw_draw_text,
     .draw_cursor = wintw_draw_cursor,
     .draw_trust_sigil = wintw_draw_trust_sigil,
+    .scroll_rect = wintw_scroll_rect,
     .char_width = wintw_char_width,
     .free_draw_ctx = wintw_free_draw_ctx,
     .set_cursor_pos = wintw_set_cursor_pos,
@@ -290,6 +292,20 @@ static const TermWinVtable windows_termwin_vt = {
 static TermWin wintw[1];
 static HDC wintw_hdc;
 
+/*
+ * Terminal updates (though not WM_PAINT redraws) are drawn into an
+ * off-screen bitmap, and the parts of it that were drawn on are
+ * copied to the window when the drawing context is freed, so that
+ * the screen sees one set of blits per update rather than every
+ * individual text-drawing operation.
+ */
+static HDC offscreen_hdc, offscreen_window_hdc;
+static HBITMAP offscreen_bitmap, offscreen_oldbitmap;
+static int offscreen_w, offscreen_h;
+static RECT *offscreen_rects;
+static size_t offscreen_nrects, offscreen_rectsize;
+static void offscreen_add_rect(const RECT *r);
+
 static HICON trust_icon = INVALID_HANDLE_VALUE;
 
 const bool share_can_be_downstream = true;
@@ -341,6 +357,7 @@ static bool win_seat_get_cursor_position(Seat *seat, int *x, int *y);
 
 static const SeatVtable win_seat_vt = {
     .output = win_seat_output,
+    .sent = nullseat_sent,
     .eof = win_seat_eof,
     .get_userpass_input = win_seat_get_userpass_input,
     .notify_remote_exit = win_seat_notify_remote_exit,
@@ -844,8 +861,13 @@ int WINAPI WinMain(HINSTANCE inst, HINSTANCE prev, LPSTR cmdline, int show)
         AppendMenu(popup_menus[CTXMENU].menu, MF_ENABLED, IDM_COPY, "&Copy");
         AppendMenu(popup_menus[CTXMENU].menu, MF_ENABLED, IDM_PASTE, "&Paste");
 
+        /*
+         * The saved-session list isn't read until the submenu is
+         * about to appear (see WM_INITMENUPOPUP), so that starting a
+         * session straight from the command line doesn't have to
+         * enumerate every saved session first.
+         */
         savedsess_menu = CreateMenu();
-        get_sesslist(&sesslist, true);
         update_savedsess_menu();
 
         for (j = 0; j < lenof(popup_menus); j++) {
@@ -1027,6 +1049,7 @@ void cleanup_exit(int code)
         random_save_seed();
     }
     shutdown_help();
+    platform_logwriter_close_all();
 
     /* Clean up COM. */
     CoUninitialize();
@@ -3654,6 +3677,9 @@ static void do_text_internal(
     if (line_box.right > font_width*term->cols+offset_width)
         line_box.right = font_width*term->cols+offset_width;
 
+    /* Everything below is clipped to line_box */
+    offscreen_add_rect(&line_box);
+
     if (font_varpitch) {
         /*
          * If we're using a variable-pitch font, we unconditionally
@@ -3985,6 +4011,47 @@ static void wintw_draw_trust_sigil(TermWin *tw, int x, int y)
                0, NULL, DI_NORMAL);
 }
 
+static bool wintw_scroll_rect(TermWin *tw, int topline, int botline,
+                              int lines)
+{
+    RECT r, exposed;
+    HRGN update, exposed_rgn;
+
+    /* Parts of the window waiting for WM_PAINT might or might not
+     * move with the pixels, so don't try while there are any */
+    if (!wgs.term_hwnd || GetUpdateRect(wgs.term_hwnd, NULL, false))
+        return false;
+
+    r.left = offset_width;
+    r.right = offset_width + font_width * term->cols;
+    r.top = offset_height + topline * font_height;
+    r.bottom = offset_height + (botline + 1) * font_height;
+
+    exposed = r;
+    if (lines > 0)
+        exposed.top = r.bottom - lines * font_height;
+    else
+        exposed.bottom = r.top - lines * font_height;
+
+    /*
+     * The window is scrolled directly rather than via the off-screen
+     * bitmap, which only ever holds the parts of the window drawn in
+     * the current update. ScrollWindowEx tells us which parts it
+     * couldn't copy because another window was covering their
+     * source: the rows the terminal is about to redraw anyway don't
+     * matter, but anything else has to be repainted by WM_PAINT.
+     */
+    update = CreateRectRgn(0, 0, 0, 0);
+    exposed_rgn = CreateRectRgnIndirect(&exposed);
+    ScrollWindowEx(wgs.term_hwnd, 0, -lines * font_height, &r, &r,
+                   update, NULL, 0);
+    if (CombineRgn(update, update, exposed_rgn, RGN_DIFF) != NULLREGION)
+        InvalidateRgn(wgs.term_hwnd, update, false);
+    DeleteObject(exposed_rgn);
+    DeleteObject(update);
+    return true;
+}
+
 /* This function gets the actual width of a character in the normal font.
  */
 static int wintw_char_width(TermWin *tw, int uc)
@@ -4810,16 +4877,106 @@ static void wintw_set_scrollbar(TermWin *tw, int total, int start, int page)
         SetScrollInfo(wgs.term_hwnd, SB_VERT, &si, true);
 }
 
+static bool offscreen_setup(HDC hdc)
+{
+    RECT cr;
+
+    /* Palette-based displays are left to draw directly */
+    if (pal)
+        return false;
+
+    GetClientRect(wgs.term_hwnd, &cr);
+    if (cr.right <= 0 || cr.bottom <= 0)
+        return false;
+
+    if (offscreen_hdc &&
+        (offscreen_w != cr.right || offscreen_h != cr.bottom)) {
+        SelectObject(offscreen_hdc, offscreen_oldbitmap);
+        DeleteObject(offscreen_bitmap);
+        DeleteDC(offscreen_hdc);
+        offscreen_hdc = NULL;
+    }
+
+    if (!offscreen_hdc) {
+        offscreen_hdc = CreateCompatibleDC(hdc);
+        if (!offscreen_hdc)
+            return false;
+        offscreen_bitmap = CreateCompatibleBitmap(hdc, cr.right, cr.bottom);
+        if (!offscreen_bitmap) {
+            DeleteDC(offscreen_hdc);
+            offscreen_hdc = NULL;
+            return false;
+        }
+        offscreen_oldbitmap = SelectObject(offscreen_hdc, offscreen_bitmap);
+        offscreen_w = cr.right;
+        offscreen_h = cr.bottom;
+    }
+
+    offscreen_nrects = 0;
+    return true;
+}
+
+static void offscreen_add_rect(const RECT *r)
+{
+    if (!offscreen_window_hdc || r->left >= r->right)
+        return;
+
+    if (offscreen_nrects > 0) {
+        RECT *last = &offscreen_rects[offscreen_nrects - 1];
+
+        /* Merge runs side by side in a row, and rows stacked exactly */
+        if (r->top == last->top && r->bottom == last->bottom &&
+            r->left <= last->right && r->right >= last->left) {
+            last->left = min(last->left, r->left);
+            last->right = max(last->right, r->right);
+            return;
+        }
+        if (r->left == last->left && r->right == last->right &&
+            r->top == last->bottom) {
+            last->bottom = r->bottom;
+            return;
+        }
+    }
+
+    sgrowarray(offscreen_rects, offscreen_rectsize, offscreen_nrects);
+    offscreen_rects[offscreen_nrects++] = *r;
+}
+
+static void offscreen_flush(void)
+{
+    for (size_t i = 0; i < offscreen_nrects; i++) {
+        RECT *r = &offscreen_rects[i];
+        BitBlt(offscreen_window_hdc, r->left, r->top,
+               r->right - r->left, r->bottom - r->top,
+               offscreen_hdc, r->left, r->top, SRCCOPY);
+    }
+    offscreen_nrects = 0;
+}
+
 static bool wintw_setup_draw_ctx(TermWin *tw)
 {
     assert(!wintw_hdc);
     wintw_hdc = make_hdc();
-    return wintw_hdc != NULL;
+    if (!wintw_hdc)
+        return false;
+    if (offscreen_setup(wintw_hdc)) {
+        offscreen_window_hdc = wintw_hdc;
+        wintw_hdc = offscreen_hdc;
+    }
+    return true;
 }
 
 static void wintw_free_draw_ctx(TermWin *tw)
 {
     assert(wintw_hdc);
+    if (offscreen_window_hdc) {
+        offscreen_flush();
+        /* Don't keep any of our fonts selected into the memory DC,
+         * or deinit_fonts won't be able to delete them */
+        SelectObject(offscreen_hdc, GetStockObject(SYSTEM_FONT));
+        wintw_hdc = offscreen_window_hdc;
+        offscreen_window_hdc = NULL;
+    }
     free_hdc(wintw_hdc);
     wintw_hdc = NULL;
 }
@@ -4982,7 +5139,7 @@ static void wintw_clip_write(
     memcpy(lock, data, len * sizeof(wchar_t));
     WideCharToMultiByte(CP_ACP, 0, data, len, lock2, len2, NULL, NULL);
 
-    if (conf_get_bool(conf, CONF_rtf_paste)) {
+    if (attr && conf_get_bool(conf, CONF_rtf_paste)) {
         wchar_t unitab[256];
         strbuf *rtf = strbuf_new();
         unsigned char *tdata = (unsigned char *)lock2;
@@ -280,6 +280,15 @@ void ssh_gss_cleanup(struct ssh_gss_liblist *list)
      * another SSH instance still using it.
      */
     for (i = 0; i < list->nlibraries; i++) {
+        if (list->libraries[i].id == 1) {
+            CredHandle *cred = list->libraries[i].cached_cred;
+            if (cred) {
+                p_FreeCredentialsHandle(cred);
+                sfree(cred);
+            }
+        } else {
+            ssh_gssapi_free_cached_cred(&list->libraries[i]);
+        }
         FreeLibrary((HMODULE)list->libraries[i].handle);
         if (list->libraries[i].id == 2) {
             /* The 'custom' id involves a dynamically allocated message.
@@ -326,25 +335,41 @@ static Ssh_gss_stat ssh_sspi_acquire_cred(struct ssh_gss_library *lib,
     winctx->maj_stat =  winctx->min_stat = SEC_E_OK;
     winctx->context_handle = NULL;
 
-    /* Specifying no principal name here means use the credentials of
-       the current logged-in user */
-
-    winctx->maj_stat = p_AcquireCredentialsHandleA(NULL,
-                                                   "Kerberos",
-                                                   SECPKG_CRED_OUTBOUND,
-                                                   NULL,
-                                                   NULL,
-                                                   NULL,
-                                                   NULL,
-                                                   &winctx->cred_handle,
-                                                   NULL);
-
-    if (winctx->maj_stat != SEC_E_OK) {
-        p_FreeCredentialsHandle(&winctx->cred_handle);
-        sfree(winctx);
-        return SSH_GSS_FAILURE;
+    /*
+     * The credentials of the logged-in user stay usable for as long
+     * as the process runs (Windows renews the tickets behind them
+     * itself), so we get a handle to them once and keep it in the
+     * library structure for every later context.
+     */
+    if (!lib->cached_cred) {
+        CredHandle *cred = snew(CredHandle);
+
+        /* Specifying no principal name here means use the credentials
+           of the current logged-in user */
+
+        winctx->maj_stat = p_AcquireCredentialsHandleA(NULL,
+                                                       "Kerberos",
+                                                       SECPKG_CRED_OUTBOUND,
+                                                       NULL,
+                                                       NULL,
+                                                       NULL,
+                                                       NULL,
+                                                       cred,
+                                                       NULL);
+
+        if (winctx->maj_stat != SEC_E_OK) {
+            p_FreeCredentialsHandle(cred);
+            sfree(cred);
+            sfree(winctx);
+            return SSH_GSS_FAILURE;
+        }
+
+        lib->cached_cred = cred;
+        lib->cached_cred_time = time(NULL);
     }
 
+    winctx->cred_handle = *(CredHandle *)lib->cached_cred;
+
     /* Windows does not return a valid expiration from AcquireCredentials */
     if (expiry)
         *expiry = GSS_NO_EXPIRATION;
@@ -475,8 +500,8 @@ static Ssh_gss_stat ssh_sspi_release_cred(struct ssh_gss_library *lib,
     /* check input */
     if (winctx == NULL) return SSH_GSS_FAILURE;
 
-    /* free Windows data */
-    p_FreeCredentialsHandle(&winctx->cred_handle);
+    /* free Windows data (but not cred_handle, which is the library's
+     * cached one; see ssh_sspi_acquire_cred) */
     p_DeleteSecurityContext(&winctx->context);
 
     /* delete our "wrapper" structure */
@@ -646,6 +671,7 @@ static void ssh_sspi_bind_fns(struct ssh_gss_library *lib)
     lib->verify_mic = ssh_sspi_verify_mic;
     lib->free_mic = ssh_sspi_free_mic;
     lib->display_status = ssh_sspi_display_status;
+    lib->cached_cred = NULL;
 }
 
 #else
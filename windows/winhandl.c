@@ -27,6 +27,18 @@
  * and so we must use threads for those. This being the case, it's
  * simplest just to use threads for everything rather than trying
  * to keep track of multiple completely separate mechanisms.)
+ *
+ * The exception to that is handles which the caller _did_ open with
+ * the overlapped flag, such as the named pipes in winnpc.c and
+ * winnps.c. Those don't need a subthread of their own, and having one
+ * for each direction of every pipe adds up quickly, not least because
+ * each one also costs an event object in the main loop's
+ * WaitForMultipleObjects, which can't wait on more than
+ * MAXIMUM_WAIT_OBJECTS of them. So for those, the main thread issues
+ * overlapped reads and writes itself, and their completions all
+ * arrive on a single I/O completion port. A small fixed pool of
+ * worker threads waits on that port, and hands each completed
+ * operation back to the main thread via a list and one shared event.
  */
 
 #include <assert.h>
@@ -43,6 +55,21 @@
  */
 #define MAX_BACKLOG 32768
 
+/*
+ * When the data queued on an output handle is in lots of small
+ * bufchain blocks (keystrokes, or a serial console being typed or
+ * pasted into), we copy up to this much of it into one buffer and
+ * write that, instead of making a WriteFile call per block.
+ */
+#define OUTPUT_COALESCE_SIZE 16384
+
+/*
+ * Number of worker threads waiting on the completion port. They do
+ * nothing but pass completions on to the main thread, so we don't
+ * need many.
+ */
+#define IOCP_THREADS 2
+
 struct handle_generic {
     /*
      * Initial fields common to both handle_input and handle_output
@@ -67,6 +94,11 @@ struct handle_generic {
 
 typedef enum { HT_INPUT, HT_OUTPUT, HT_FOREIGN } HandleType;
 
+struct handle_input;
+struct handle_output;
+static bool handle_iocp_start_read(struct handle_input *ctx);
+static bool handle_iocp_start_write(struct handle_output *ctx);
+
 /* ----------------------------------------------------------------------
  * Input threads.
  */
@@ -207,7 +239,7 @@ static DWORD WINAPI handle_input_threadfunc(void *param)
  */
 static void handle_throttle(struct handle_input *ctx, int backlog)
 {
-    if (ctx->defunct)
+    if (ctx->defunct || ctx->moribund)
         return;
 
     /*
@@ -223,8 +255,9 @@ static void handle_throttle(struct handle_input *ctx, int backlog)
      * on the size of the backlog.
      */
     if (backlog < MAX_BACKLOG) {
-        SetEvent(ctx->ev_from_main);
         ctx->busy = true;
+        if (!handle_iocp_start_read(ctx))
+            SetEvent(ctx->ev_from_main);
     }
 }
 
@@ -259,6 +292,7 @@ struct handle_output {
      */
     const char *buffer;                /* the data to write */
     DWORD len;                         /* how much data there is */
+    char *coalesced;                   /* if non-NULL, buffer may point here */
 
     /*
      * Data set by the input thread before signalling ev_to_main,
@@ -347,12 +381,24 @@ static DWORD WINAPI handle_output_threadfunc(void *param)
 
 static void handle_try_output(struct handle_output *ctx)
 {
+    if (ctx->defunct || ctx->moribund)
+        return;
+
     if (!ctx->busy && bufchain_size(&ctx->queued_data)) {
         ptrlen data = bufchain_prefix(&ctx->queued_data);
+        size_t size = bufchain_size(&ctx->queued_data);
+        if (data.len < OUTPUT_COALESCE_SIZE && size > data.len) {
+            if (!ctx->coalesced)
+                ctx->coalesced = snewn(OUTPUT_COALESCE_SIZE, char);
+            data.len = min(size, OUTPUT_COALESCE_SIZE);
+            bufchain_fetch(&ctx->queued_data, ctx->coalesced, data.len);
+            data.ptr = ctx->coalesced;
+        }
         ctx->buffer = data.ptr;
         ctx->len = min(data.len, ~(DWORD)0);
-        SetEvent(ctx->ev_from_main);
         ctx->busy = true;
+        if (!handle_iocp_start_write(ctx))
+            SetEvent(ctx->ev_from_main);
     } else if (!ctx->busy && bufchain_size(&ctx->queued_data) == 0 &&
                ctx->outgoingeof == EOF_PENDING) {
         CloseHandle(ctx->h);
@@ -400,6 +446,18 @@ struct handle {
         struct handle_output o;
         struct handle_foreign f;
     } u;
+
+    /*
+     * Fields used only by handles whose I/O goes through the
+     * completion port rather than a subthread. Such a handle has at
+     * most one operation outstanding at a time, and 'ovl' belongs to
+     * it. The worker thread fills in iocp_len and iocp_err, and
+     * links the handle on to the completed list.
+     */
+    bool iocp;
+    OVERLAPPED ovl;
+    DWORD iocp_len, iocp_err;
+    struct handle *iocp_next;
 };
 
 static tree234 *handles_by_evtomain;
@@ -430,6 +488,199 @@ static int handle_find_evtomain(void *av, void *bv)
         return 0;
 }
 
+/* ----------------------------------------------------------------------
+ * The I/O completion port, for handles opened for overlapped I/O.
+ */
+
+static HANDLE iocp_port;               /* NULL until first needed */
+static bool iocp_failed;               /* if we couldn't set it up */
+static HANDLE iocp_event = INVALID_HANDLE_VALUE; /* signals main thread */
+static tree234 *handles_iocp;          /* all handles using the port */
+
+/*
+ * List of handles whose operation has completed, appended to by the
+ * worker threads and emptied by the main thread. Protected by
+ * iocp_lock.
+ */
+static CRITICAL_SECTION iocp_lock;
+static struct handle *iocp_done_head, *iocp_done_tail;
+
+static int handle_cmp_ptr(void *av, void *bv)
+{
+    if ((uintptr_t)av < (uintptr_t)bv)
+        return -1;
+    else if ((uintptr_t)av > (uintptr_t)bv)
+        return +1;
+    else
+        return 0;
+}
+
+static void handle_iocp_done(struct handle *h)
+{
+    EnterCriticalSection(&iocp_lock);
+    h->iocp_next = NULL;
+    if (iocp_done_tail)
+        iocp_done_tail->iocp_next = h;
+    else
+        iocp_done_head = h;
+    iocp_done_tail = h;
+    LeaveCriticalSection(&iocp_lock);
+
+    SetEvent(iocp_event);
+}
+
+static DWORD WINAPI handle_iocp_threadfunc(void *param)
+{
+    while (1) {
+        DWORD len;
+        ULONG_PTR key;
+        OVERLAPPED *ovl;
+        bool ret = GetQueuedCompletionStatus(iocp_port, &len, &key,
+                                             &ovl, INFINITE);
+        if (!ovl)
+            break;                     /* the port itself has failed */
+
+        /*
+         * Every operation we issue uses the OVERLAPPED inside its
+         * handle structure, so we can get back to that from here.
+         */
+        struct handle *h = container_of(ovl, struct handle, ovl);
+        h->iocp_len = len;
+        h->iocp_err = ret ? 0 : GetLastError();
+        handle_iocp_done(h);
+    }
+
+    return 0;
+}
+
+static bool handle_iocp_init(void)
+{
+    int i, nthreads = 0;
+
+    if (iocp_port)
+        return true;
+    if (iocp_failed)
+        return false;
+
+    iocp_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0,
+                                       IOCP_THREADS);
+    if (!iocp_port) {
+        iocp_failed = true;
+        return false;
+    }
+
+    iocp_event = CreateEvent(NULL, false, false, NULL);
+    InitializeCriticalSection(&iocp_lock);
+    handles_iocp = newtree234(handle_cmp_ptr);
+
+    for (i = 0; i < IOCP_THREADS; i++) {
+        DWORD threadid; /* required for Win9x */
+        HANDLE thread = CreateThread(NULL, 0, handle_iocp_threadfunc,
+                                     NULL, 0, &threadid);
+        if (thread) {
+            CloseHandle(thread);
+            nthreads++;
+        }
+    }
+
+    if (!nthreads) {
+        CloseHandle(iocp_port);
+        iocp_port = NULL;
+        iocp_failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Try to arrange for a handle's I/O to go through the completion
+ * port. If we can't, the caller falls back to using a subthread.
+ */
+static bool handle_iocp_associate(struct handle *h)
+{
+    if (!handle_iocp_init())
+        return false;
+
+    if (!CreateIoCompletionPort(h->u.g.h, iocp_port, 0, 0)) {
+        /*
+         * A handle can only be associated with one port, once, so
+         * this fails for the second direction of a bidirectional
+         * handle such as a named pipe. That's fine, provided it was
+         * us that associated it the first time.
+         */
+        struct handle *other;
+        int i;
+
+        for (i = 0; (other = index234(handles_iocp, i)) != NULL; i++)
+            if (other->u.g.h == h->u.g.h)
+                break;
+        if (!other)
+            return false;
+    }
+
+    h->iocp = true;
+    add234(handles_iocp, h);
+    return true;
+}
+
+/*
+ * Start an overlapped read or write on a handle using the port, or
+ * return false if the handle is one with a subthread.
+ */
+static bool handle_iocp_start_read(struct handle_input *ctx)
+{
+    struct handle *h = container_of(ctx, struct handle, u.i);
+    int readlen;
+
+    if (!h->iocp)
+        return false;
+
+    if (ctx->flags & HANDLE_FLAG_UNITBUFFER)
+        readlen = 1;
+    else
+        readlen = sizeof(ctx->buffer);
+
+    memset(&h->ovl, 0, sizeof(h->ovl));
+    if (!ReadFile(ctx->h, ctx->buffer, readlen, NULL, &h->ovl)) {
+        DWORD err = GetLastError();
+        if (err != ERROR_IO_PENDING) {
+            /*
+             * No completion packet will arrive for an operation that
+             * failed immediately, so report the failure ourselves.
+             * Going via the completed list means the client hears
+             * about it from the main loop, and not from inside
+             * whatever function of ours it has just called.
+             */
+            h->iocp_len = 0;
+            h->iocp_err = err;
+            handle_iocp_done(h);
+        }
+    }
+
+    return true;
+}
+
+static bool handle_iocp_start_write(struct handle_output *ctx)
+{
+    struct handle *h = container_of(ctx, struct handle, u.o);
+
+    if (!h->iocp)
+        return false;
+
+    memset(&h->ovl, 0, sizeof(h->ovl));
+    if (!WriteFile(ctx->h, ctx->buffer, ctx->len, NULL, &h->ovl)) {
+        DWORD err = GetLastError();
+        if (err != ERROR_IO_PENDING) {
+            h->iocp_len = 0;
+            h->iocp_err = err;
+            handle_iocp_done(h);
+        }
+    }
+
+    return true;
+}
+
 struct handle *handle_input_new(HANDLE handle, handle_inputfn_t gotdata,
                                 void *privdata, int flags)
 {
@@ -437,15 +688,25 @@ struct handle *handle_input_new(HANDLE handle, handle_inputfn_t gotdata,
     DWORD in_threadid; /* required for Win9x */
 
     h->type = HT_INPUT;
+    h->iocp = false;
     h->u.i.h = handle;
-    h->u.i.ev_to_main = CreateEvent(NULL, false, false, NULL);
-    h->u.i.ev_from_main = CreateEvent(NULL, false, false, NULL);
+    h->u.i.ev_to_main = INVALID_HANDLE_VALUE;
+    h->u.i.ev_from_main = INVALID_HANDLE_VALUE;
     h->u.i.gotdata = gotdata;
     h->u.i.defunct = false;
     h->u.i.moribund = false;
     h->u.i.done = false;
     h->u.i.privdata = privdata;
     h->u.i.flags = flags;
+    h->u.i.busy = true;
+
+    if ((flags & HANDLE_FLAG_OVERLAPPED) && handle_iocp_associate(h)) {
+        handle_iocp_start_read(&h->u.i);
+        return h;
+    }
+
+    h->u.i.ev_to_main = CreateEvent(NULL, false, false, NULL);
+    h->u.i.ev_from_main = CreateEvent(NULL, false, false, NULL);
 
     if (!handles_by_evtomain)
         handles_by_evtomain = newtree234(handle_cmp_evtomain);
@@ -453,7 +714,6 @@ struct handle *handle_input_new(HANDLE handle, handle_inputfn_t gotdata,
 
     CreateThread(NULL, 0, handle_input_threadfunc,
                  &h->u.i, 0, &in_threadid);
-    h->u.i.busy = true;
 
     return h;
 }
@@ -465,19 +725,27 @@ struct handle *handle_output_new(HANDLE handle, handle_outputfn_t sentdata,
     DWORD out_threadid; /* required for Win9x */
 
     h->type = HT_OUTPUT;
+    h->iocp = false;
     h->u.o.h = handle;
-    h->u.o.ev_to_main = CreateEvent(NULL, false, false, NULL);
-    h->u.o.ev_from_main = CreateEvent(NULL, false, false, NULL);
+    h->u.o.ev_to_main = INVALID_HANDLE_VALUE;
+    h->u.o.ev_from_main = INVALID_HANDLE_VALUE;
     h->u.o.busy = false;
     h->u.o.defunct = false;
     h->u.o.moribund = false;
     h->u.o.done = false;
     h->u.o.privdata = privdata;
     bufchain_init(&h->u.o.queued_data);
+    h->u.o.coalesced = NULL;
     h->u.o.outgoingeof = EOF_NO;
     h->u.o.sentdata = sentdata;
     h->u.o.flags = flags;
 
+    if ((flags & HANDLE_FLAG_OVERLAPPED) && handle_iocp_associate(h))
+        return h;
+
+    h->u.o.ev_to_main = CreateEvent(NULL, false, false, NULL);
+    h->u.o.ev_from_main = CreateEvent(NULL, false, false, NULL);
+
     if (!handles_by_evtomain)
         handles_by_evtomain = newtree234(handle_cmp_evtomain);
     add234(handles_by_evtomain, h);
@@ -494,6 +762,7 @@ struct handle *handle_add_foreign_event(HANDLE event,
     struct handle *h = snew(struct handle);
 
     h->type = HT_FOREIGN;
+    h->iocp = false;
     h->u.f.h = INVALID_HANDLE_VALUE;
     h->u.f.ev_to_main = event;
     h->u.f.ev_from_main = INVALID_HANDLE_VALUE;
@@ -512,6 +781,37 @@ struct handle *handle_add_foreign_event(HANDLE event,
     return h;
 }
 
+/*
+ * Other threads wake the main thread, to collect callbacks they've
+ * queued with queue_toplevel_callback_from_thread, by setting an
+ * auto-reset event. A wakeup arriving after we've looked at the
+ * queue is therefore kept until the next wait, rather than lost.
+ */
+static HANDLE thread_wakeup_event;
+
+static void handle_thread_wakeup(void)
+{
+    SetEvent(thread_wakeup_event);
+}
+
+static void handle_thread_woken(void *ctx)
+{
+    run_thread_callbacks();
+}
+
+bool platform_enable_thread_callbacks(void)
+{
+    if (thread_wakeup_event)
+        return true;
+
+    thread_wakeup_event = CreateEvent(NULL, false, false, NULL);
+    if (!thread_wakeup_event)
+        return false;
+    handle_add_foreign_event(thread_wakeup_event, handle_thread_woken, NULL);
+    request_thread_callback_wakeups(handle_thread_wakeup);
+    return true;
+}
+
 size_t handle_write(struct handle *h, const void *data, size_t len)
 {
     assert(h->type == HT_OUTPUT);
@@ -559,24 +859,57 @@ HANDLE *handle_get_events(int *nevents)
         }
     }
 
+    /*
+     * All the handles using the completion port share one event.
+     */
+    if (iocp_port) {
+        sgrowarray(ret, size, n);
+        ret[n++] = iocp_event;
+    }
+
     *nevents = n;
     return ret;
 }
 
 static void handle_destroy(struct handle *h)
 {
-    if (h->type == HT_OUTPUT)
+    if (h->type == HT_OUTPUT) {
         bufchain_clear(&h->u.o.queued_data);
-    CloseHandle(h->u.g.ev_from_main);
-    CloseHandle(h->u.g.ev_to_main);
-    del234(handles_by_evtomain, h);
+        sfree(h->u.o.coalesced);
+    }
+    if (h->iocp) {
+        del234(handles_iocp, h);
+    } else {
+        CloseHandle(h->u.g.ev_from_main);
+        CloseHandle(h->u.g.ev_to_main);
+        del234(handles_by_evtomain, h);
+    }
     sfree(h);
 }
 
+static void handle_destroy_callback(void *vh)
+{
+    handle_destroy((struct handle *)vh);
+}
+
 void handle_free(struct handle *h)
 {
     assert(h && !h->u.g.moribund);
-    if (h->u.g.busy && h->type != HT_FOREIGN) {
+    if (h->iocp) {
+        /*
+         * A handle using the completion port has no subthread to shut
+         * down, but if it has an operation in progress, the kernel
+         * still owns its OVERLAPPED and buffer. So we must wait for
+         * that to complete (which it will promptly, once the caller
+         * closes the underlying handle) before destroying it.
+         * Otherwise we can destroy it straight away - but not _right_
+         * now, because we might be inside one of its callbacks, so we
+         * do it from a toplevel callback.
+         */
+        h->u.g.moribund = true;
+        if (!h->u.g.busy)
+            queue_toplevel_callback(handle_destroy_callback, h);
+    } else if (h->u.g.busy && h->type != HT_FOREIGN) {
         /*
          * If the handle is currently busy, we cannot immediately free
          * it, because its subthread is in the middle of something.
@@ -608,43 +941,12 @@ void handle_free(struct handle *h)
     }
 }
 
-void handle_got_event(HANDLE event)
+/*
+ * Deal with the completion of a handle's I/O operation, once we know
+ * the handle is still wanted.
+ */
+static void handle_completed(struct handle *h)
 {
-    struct handle *h;
-
-    assert(handles_by_evtomain);
-    h = find234(handles_by_evtomain, &event, handle_find_evtomain);
-    if (!h) {
-        /*
-         * This isn't an error condition. If two or more event
-         * objects were signalled during the same select operation,
-         * and processing of the first caused the second handle to
-         * be closed, then it will sometimes happen that we receive
-         * an event notification here for a handle which is already
-         * deceased. In that situation we simply do nothing.
-         */
-        return;
-    }
-
-    if (h->u.g.moribund) {
-        /*
-         * A moribund handle is one which we have either already
-         * signalled to die, or are waiting until its current I/O op
-         * completes to do so. Either way, it's treated as already
-         * dead from the external user's point of view, so we ignore
-         * the actual I/O result. We just signal the thread to die if
-         * we haven't yet done so, or destroy the handle if not.
-         */
-        if (h->u.g.done) {
-            handle_destroy(h);
-        } else {
-            h->u.g.done = true;
-            h->u.g.busy = true;
-            SetEvent(h->u.g.ev_from_main);
-        }
-        return;
-    }
-
     switch (h->type) {
         int backlog;
 
@@ -697,6 +999,101 @@ void handle_got_event(HANDLE event)
     }
 }
 
+/*
+ * Process everything the completion port's worker threads have
+ * handed back to us since last time. We translate each result into
+ * the same form an input or output subthread would have left it in.
+ */
+static void handle_iocp_process(void)
+{
+    struct handle *list, *h;
+
+    EnterCriticalSection(&iocp_lock);
+    list = iocp_done_head;
+    iocp_done_head = iocp_done_tail = NULL;
+    LeaveCriticalSection(&iocp_lock);
+
+    while ((h = list) != NULL) {
+        /*
+         * Get the next pointer first, since we may be about to free
+         * h. (Handles further down the list can't be freed under our
+         * feet: they're still busy, so freeing one only marks it
+         * moribund.)
+         */
+        list = h->iocp_next;
+
+        if (h->u.g.moribund) {
+            handle_destroy(h);
+            continue;
+        }
+
+        if (h->type == HT_INPUT) {
+            h->u.i.len = h->iocp_len;
+            h->u.i.readerr = h->iocp_err;
+            if (h->u.i.readerr) {
+                /* As in handle_input_threadfunc */
+                if (h->u.i.readerr == ERROR_BROKEN_PIPE)
+                    h->u.i.readerr = 0;
+                h->u.i.len = 0;
+            } else if (h->u.i.len == 0 &&
+                       (h->u.i.flags & HANDLE_FLAG_IGNOREEOF)) {
+                handle_iocp_start_read(&h->u.i);
+                continue;
+            }
+        } else {
+            h->u.o.lenwritten = h->iocp_len;
+            h->u.o.writeerr = h->iocp_err;
+        }
+
+        handle_completed(h);
+    }
+}
+
+void handle_got_event(HANDLE event)
+{
+    struct handle *h;
+
+    if (iocp_port && event == iocp_event) {
+        handle_iocp_process();
+        return;
+    }
+
+    assert(handles_by_evtomain);
+    h = find234(handles_by_evtomain, &event, handle_find_evtomain);
+    if (!h) {
+        /*
+         * This isn't an error condition. If two or more event
+         * objects were signalled during the same select operation,
+         * and processing of the first caused the second handle to
+         * be closed, then it will sometimes happen that we receive
+         * an event notification here for a handle which is already
+         * deceased. In that situation we simply do nothing.
+         */
+        return;
+    }
+
+    if (h->u.g.moribund) {
+        /*
+         * A moribund handle is one which we have either already
+         * signalled to die, or are waiting until its current I/O op
+         * completes to do so. Either way, it's treated as already
+         * dead from the external user's point of view, so we ignore
+         * the actual I/O result. We just signal the thread to die if
+         * we haven't yet done so, or destroy the handle if not.
+         */
+        if (h->u.g.done) {
+            handle_destroy(h);
+        } else {
+            h->u.g.done = true;
+            h->u.g.busy = true;
+            SetEvent(h->u.g.ev_from_main);
+        }
+        return;
+    }
+
+    handle_completed(h);
+}
+
 void handle_unthrottle(struct handle *h, size_t backlog)
 {
     assert(h->type == HT_INPUT);
@@ -21,8 +21,11 @@
 #define WINHELP_CTX_logging_exists "config-logfileexists"
 #define WINHELP_CTX_logging_flush "config-logflush"
 #define WINHELP_CTX_logging_header "config-logheader"
+#define WINHELP_CTX_logging_compress "config-logcompress"
 #define WINHELP_CTX_logging_ssh_omit_password "config-logssh"
 #define WINHELP_CTX_logging_ssh_omit_data "config-logssh"
+#define WINHELP_CTX_logging_ssh_binary "config-logssh-binary"
+#define WINHELP_CTX_logging_ssh_pktmax "config-logssh-pktmax"
 #define WINHELP_CTX_keyboard_backspace "config-backspace"
 #define WINHELP_CTX_keyboard_homeend "config-homeend"
 #define WINHELP_CTX_keyboard_funkeys "config-funkeys"
@@ -82,6 +85,8 @@
 #define WINHELP_CTX_connection_nodelay "config-nodelay"
 #define WINHELP_CTX_connection_ipversion "config-address-family"
 #define WINHELP_CTX_connection_tcpkeepalive "config-tcp-keepalives"
+#define WINHELP_CTX_connection_connectdelay "config-connect-delay"
+#define WINHELP_CTX_connection_dnscache "config-dns-cache"
 #define WINHELP_CTX_connection_loghost "config-loghost"
 #define WINHELP_CTX_proxy_type "config-proxy-type"
 #define WINHELP_CTX_proxy_main "config-proxy"
@@ -116,6 +121,8 @@
 #define WINHELP_CTX_ssh_auth_agentfwd "config-ssh-agentfwd"
 #define WINHELP_CTX_ssh_auth_changeuser "config-ssh-changeuser"
 #define WINHELP_CTX_ssh_auth_pageant "config-ssh-tryagent"
+#define WINHELP_CTX_ssh_auth_probes "config-ssh-agentprobes"
+#define WINHELP_CTX_ssh_auth_remember "config-ssh-rememberauth"
 #define WINHELP_CTX_ssh_auth_tis "config-ssh-tis"
 #define WINHELP_CTX_ssh_auth_ki "config-ssh-ki"
 #define WINHELP_CTX_ssh_gssapi "config-ssh-auth-gssapi"
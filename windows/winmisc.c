@@ -467,3 +467,73 @@ char *registry_get_string(HKEY root, const char *path, const char *leaf)
     sfree(str);
     return toret;
 }
+
+struct TempFile {
+    HANDLE h;
+};
+
+TempFile *tempfile_new(void)
+{
+    char dir[MAX_PATH], path[MAX_PATH];
+    HANDLE h;
+
+    if (!GetTempPath(lenof(dir), dir) ||
+        !GetTempFileName(dir, "pty", 0, path))
+        return NULL;
+
+    h = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                   CREATE_ALWAYS,
+                   FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                   NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        DeleteFile(path);
+        return NULL;
+    }
+
+    TempFile *tf = snew(TempFile);
+    tf->h = h;
+    return tf;
+}
+
+static bool tempfile_io(TempFile *tf, uint64_t offset, void *data,
+                        size_t len, bool write)
+{
+    char *p = (char *)data;
+
+    while (len > 0) {
+        OVERLAPPED ov;
+        DWORD chunk = len > 0x40000000 ? 0x40000000 : len, done;
+        BOOL ok;
+
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        if (write)
+            ok = WriteFile(tf->h, p, chunk, &done, &ov);
+        else
+            ok = ReadFile(tf->h, p, chunk, &done, &ov);
+        if (!ok || done == 0)
+            return false;
+        p += done;
+        len -= done;
+        offset += done;
+    }
+    return true;
+}
+
+bool tempfile_write(TempFile *tf, uint64_t offset,
+                    const void *data, size_t len)
+{
+    return tempfile_io(tf, offset, (void *)data, len, true);
+}
+
+bool tempfile_read(TempFile *tf, uint64_t offset, void *data, size_t len)
+{
+    return tempfile_io(tf, offset, data, len, false);
+}
+
+void tempfile_free(TempFile *tf)
+{
+    CloseHandle(tf->h);                /* FILE_FLAG_DELETE_ON_CLOSE */
+    sfree(tf);
+}
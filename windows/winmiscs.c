@@ -266,6 +266,24 @@ bool platform_sha1_hw_available(void)
     return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE);
 }
 
+bool platform_sha512_hw_available(void)
+{
+    /* Windows has no PF_ flag for the Armv8.2 SHA-512 extension, so
+     * we can't tell whether it's safe to use. */
+    return false;
+}
+
+bool platform_sha3_hw_available(void)
+{
+    /* Nor for the SHA-3 extension. */
+    return false;
+}
+
+bool platform_pmull_hw_available(void)
+{
+    return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE);
+}
+
 #endif
 
 bool is_console_handle(HANDLE handle)
@@ -275,3 +293,314 @@ bool is_console_handle(HANDLE handle)
         return true;
     return false;
 }
+
+/* See the Unix version in uxutils.c */
+#define MAX_PARALLEL_JOBS 64
+
+unsigned platform_parallel_jobs(void)
+{
+#ifdef MINEFIELD
+    /* The minefield allocator isn't thread-safe */
+    return 1;
+#else
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    if (si.dwNumberOfProcessors < 1)
+        return 1;
+    if (si.dwNumberOfProcessors > MAX_PARALLEL_JOBS)
+        return MAX_PARALLEL_JOBS;
+    return si.dwNumberOfProcessors;
+#endif
+}
+
+struct parallel_job {
+    void (*fn)(void *);
+    void *ctx;
+};
+
+static DWORD WINAPI parallel_job_thread(void *vjob)
+{
+    struct parallel_job *job = (struct parallel_job *)vjob;
+    job->fn(job->ctx);
+    return 0;
+}
+
+void platform_run_parallel(void (*fn)(void *), void **ctxs, size_t n)
+{
+    struct parallel_job *jobs = snewn(n, struct parallel_job);
+    HANDLE *threads = snewn(n, HANDLE);
+
+    for (size_t i = 1; i < n; i++) {
+        DWORD tid;
+        jobs[i].fn = fn;
+        jobs[i].ctx = ctxs[i];
+        threads[i] = CreateThread(NULL, 0, parallel_job_thread,
+                                  &jobs[i], 0, &tid);
+    }
+
+    /* Do the first job in this thread, and any that we couldn't make
+     * a thread for */
+    if (n > 0)
+        fn(ctxs[0]);
+    for (size_t i = 1; i < n; i++) {
+        if (threads[i]) {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        } else {
+            fn(ctxs[i]);
+        }
+    }
+
+    sfree(jobs);
+    sfree(threads);
+}
+
+/* See the Unix version in uxutils.c */
+#define LOGWRITER_BUFSIZE (1024 * 1024)
+
+struct LogWriter {
+    FILE *fp;
+    HANDLE thread;
+    CRITICAL_SECTION lock;
+    HANDLE work_event;           /* set when there's work to do */
+    HANDLE space_event;          /* set when ring space is freed,
+                                  * or a flush has completed */
+    char *buf;
+    size_t start, len;           /* occupied region of the ring */
+    uint64_t flush_req, flush_done; /* flushes requested and completed */
+    bool closing, joined, error;
+    LogFilter *lf;               /* if non-NULL, data goes through this */
+    strbuf *filtered;            /* and comes out here */
+    LogWriter *next, *prev;      /* list of live writers */
+};
+
+static LogWriter *logwriters;
+static bool lw_atexit_registered;
+
+/*
+ * Write some data to the file, through the filter if there is one.
+ * Called on the writer thread without the lock held.
+ */
+static bool logwriter_output(LogWriter *lw, ptrlen data)
+{
+    if (lw->lf) {
+        strbuf_clear(lw->filtered);
+        logfilter_write(lw->lf, data, lw->filtered);
+        data = ptrlen_from_strbuf(lw->filtered);
+    }
+    return fwrite(data.ptr, 1, data.len, lw->fp) == data.len;
+}
+
+/* Ask the filter for whatever it's holding, and write that out */
+static bool logwriter_output_filter(
+    LogWriter *lw, void (*fn)(LogFilter *, strbuf *))
+{
+    strbuf_clear(lw->filtered);
+    fn(lw->lf, lw->filtered);
+    return fwrite(lw->filtered->u, 1, lw->filtered->len, lw->fp) ==
+        lw->filtered->len;
+}
+
+static DWORD WINAPI logwriter_thread(void *vlw)
+{
+    LogWriter *lw = (LogWriter *)vlw;
+
+    EnterCriticalSection(&lw->lock);
+    while (true) {
+        if (lw->len) {
+            size_t start = lw->start;
+            size_t n = min(lw->len, LOGWRITER_BUFSIZE - start);
+            bool ok = true;
+
+            LeaveCriticalSection(&lw->lock);
+            if (!lw->error)
+                ok = logwriter_output(lw, make_ptrlen(lw->buf + start, n));
+            EnterCriticalSection(&lw->lock);
+
+            lw->start = (start + n) % LOGWRITER_BUFSIZE;
+            lw->len -= n;
+            if (!ok)
+                lw->error = true;
+            SetEvent(lw->space_event);
+        } else if (lw->flush_done != lw->flush_req) {
+            uint64_t req = lw->flush_req;
+            bool ok = true;
+
+            LeaveCriticalSection(&lw->lock);
+            if (lw->lf && !lw->error)
+                ok = logwriter_output_filter(lw, logfilter_flush);
+            fflush(lw->fp);
+            EnterCriticalSection(&lw->lock);
+            lw->flush_done = req;
+            if (!ok)
+                lw->error = true;
+            SetEvent(lw->space_event);
+        } else if (lw->closing) {
+            if (lw->lf && !lw->error &&
+                !logwriter_output_filter(lw, logfilter_finish))
+                lw->error = true;
+            fflush(lw->fp);
+            break;
+        } else {
+            LeaveCriticalSection(&lw->lock);
+            WaitForSingleObject(lw->work_event, INFINITE);
+            EnterCriticalSection(&lw->lock);
+        }
+    }
+    LeaveCriticalSection(&lw->lock);
+    return 0;
+}
+
+LogWriter *platform_logwriter_new(FILE *fp, LogFilter *lf)
+{
+    LogWriter *lw = snew(LogWriter);
+    DWORD tid;
+
+    lw->fp = fp;
+    lw->buf = snewn(LOGWRITER_BUFSIZE, char);
+    lw->start = lw->len = 0;
+    lw->flush_req = lw->flush_done = 0;
+    lw->closing = lw->joined = lw->error = false;
+    lw->lf = lf;
+    lw->filtered = strbuf_new_nm();
+    InitializeCriticalSection(&lw->lock);
+    /* Auto-reset events, so a SetEvent with nobody waiting is kept
+     * until the next wait rather than lost */
+    lw->work_event = CreateEvent(NULL, false, false, NULL);
+    lw->space_event = CreateEvent(NULL, false, false, NULL);
+    lw->thread = NULL;
+    if (lw->work_event && lw->space_event)
+        lw->thread = CreateThread(NULL, 0, logwriter_thread, lw, 0, &tid);
+
+    if (!lw->thread) {
+        if (lw->work_event)
+            CloseHandle(lw->work_event);
+        if (lw->space_event)
+            CloseHandle(lw->space_event);
+        DeleteCriticalSection(&lw->lock);
+        strbuf_free(lw->filtered);
+        sfree(lw->buf);
+        sfree(lw);
+        return NULL;
+    }
+
+    if (!lw_atexit_registered) {
+        atexit(platform_logwriter_close_all);
+        lw_atexit_registered = true;
+    }
+    lw->prev = NULL;
+    lw->next = logwriters;
+    if (lw->next)
+        lw->next->prev = lw;
+    logwriters = lw;
+    return lw;
+}
+
+bool platform_logwriter_write(LogWriter *lw, ptrlen data)
+{
+    const char *p = data.ptr;
+    size_t left = data.len;
+    bool ok;
+
+    if (lw->joined)
+        return false;        /* too late: we're already shutting down */
+
+    EnterCriticalSection(&lw->lock);
+    while (left > 0 && !lw->error) {
+        if (lw->len == LOGWRITER_BUFSIZE) {
+            LeaveCriticalSection(&lw->lock);
+            WaitForSingleObject(lw->space_event, INFINITE);
+            EnterCriticalSection(&lw->lock);
+            continue;
+        }
+        size_t end = (lw->start + lw->len) % LOGWRITER_BUFSIZE;
+        size_t n = min(left, LOGWRITER_BUFSIZE - lw->len);
+        n = min(n, LOGWRITER_BUFSIZE - end);
+        memcpy(lw->buf + end, p, n);
+        lw->len += n;
+        p += n;
+        left -= n;
+        SetEvent(lw->work_event);
+    }
+    ok = !lw->error;
+    LeaveCriticalSection(&lw->lock);
+    return ok;
+}
+
+void platform_logwriter_flush(LogWriter *lw)
+{
+    uint64_t req;
+
+    if (lw->joined)
+        return;
+
+    EnterCriticalSection(&lw->lock);
+    req = ++lw->flush_req;
+    SetEvent(lw->work_event);
+    while (lw->flush_done < req && !lw->error) {
+        LeaveCriticalSection(&lw->lock);
+        WaitForSingleObject(lw->space_event, INFINITE);
+        EnterCriticalSection(&lw->lock);
+    }
+    LeaveCriticalSection(&lw->lock);
+}
+
+/* See logwriter_close in uxutils.c */
+static void logwriter_close(LogWriter *lw)
+{
+    if (lw->joined)
+        return;
+    EnterCriticalSection(&lw->lock);
+    lw->closing = true;
+    SetEvent(lw->work_event);
+    LeaveCriticalSection(&lw->lock);
+    WaitForSingleObject(lw->thread, INFINITE);
+    CloseHandle(lw->thread);
+    lw->joined = true;
+}
+
+void platform_logwriter_close_all(void)
+{
+    for (LogWriter *lw = logwriters; lw; lw = lw->next)
+        logwriter_close(lw);
+}
+
+bool platform_logwriter_free(LogWriter *lw)
+{
+    bool ok;
+
+    logwriter_close(lw);
+    if (lw->prev)
+        lw->prev->next = lw->next;
+    else
+        logwriters = lw->next;
+    if (lw->next)
+        lw->next->prev = lw->prev;
+
+    ok = !lw->error;
+    CloseHandle(lw->work_event);
+    CloseHandle(lw->space_event);
+    DeleteCriticalSection(&lw->lock);
+    strbuf_free(lw->filtered);
+    sfree(lw->buf);
+    sfree(lw);
+    return ok;
+}
+
+uint64_t platform_perf_counter_ns(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    /* Split the conversion so as not to overflow 64 bits */
+    uint64_t secs = count.QuadPart / freq.QuadPart;
+    uint64_t rem = count.QuadPart % freq.QuadPart;
+    return secs * 1000000000 + rem * 1000000000 / freq.QuadPart;
+}
+
+void platform_trace_started(void (*request_write)(void))
+{
+    /* Nothing here to ask with, so the trace is written at exit */
+}
@@ -49,6 +49,7 @@ struct SockAddrStep_tag {
 };
 
 typedef struct NetSocket NetSocket;
+typedef struct ConnectAttempt ConnectAttempt;
 struct NetSocket {
     const char *error;
     SOCKET s;
@@ -76,9 +77,27 @@ struct NetSocket {
      */
     NetSocket *parent, *child;
 
+    /*
+     * For connect()-type sockets: while 's' and 'step' are our
+     * latest attempt to connect, attempts we started earlier on
+     * other candidate addresses may still be racing it. See
+     * net_connect_timer.
+     */
+    int connect_delay;                 /* ms between attempts; 0 = serial */
+    bool next_attempt_scheduled;
+    unsigned long next_attempt;
+    ConnectAttempt **racing;
+    size_t nracing, racingsize;
+
     Socket sock;
 };
 
+struct ConnectAttempt {
+    SOCKET s;
+    SockAddrStep step;
+    NetSocket *sock;
+};
+
 struct SockAddr {
     int refcount;
     char *error;
@@ -121,6 +140,7 @@ struct SockAddr {
 #endif
 
 static tree234 *sktree;
+static tree234 *racetree;              /* ConnectAttempts, by socket */
 
 static int cmpfortree(void *av, void *bv)
 {
@@ -148,6 +168,28 @@ static int cmpforsearch(void *av, void *bv)
     return 0;
 }
 
+static int cmpforrace(void *av, void *bv)
+{
+    ConnectAttempt *a = (ConnectAttempt *)av, *b = (ConnectAttempt *)bv;
+    uintptr_t as = (uintptr_t) a->s, bs = (uintptr_t) b->s;
+    if (as < bs)
+        return -1;
+    if (as > bs)
+        return +1;
+    return 0;
+}
+
+static int cmpforracesearch(void *av, void *bv)
+{
+    ConnectAttempt *b = (ConnectAttempt *)bv;
+    uintptr_t as = (uintptr_t) av, bs = (uintptr_t) b->s;
+    if (as < bs)
+        return -1;
+    if (as > bs)
+        return +1;
+    return 0;
+}
+
 DECL_WINDOWS_FUNCTION(static, int, WSAStartup, (WORD, LPWSADATA));
 DECL_WINDOWS_FUNCTION(static, int, WSACleanup, (void));
 DECL_WINDOWS_FUNCTION(static, int, closesocket, (SOCKET));
@@ -173,6 +215,9 @@ DECL_WINDOWS_FUNCTION(static, int, setsockopt,
 DECL_WINDOWS_FUNCTION(static, SOCKET, socket, (int, int, int));
 DECL_WINDOWS_FUNCTION(static, int, listen, (SOCKET, int));
 DECL_WINDOWS_FUNCTION(static, int, send, (SOCKET, const char FAR *, int, int));
+DECL_WINDOWS_FUNCTION(static, int, WSASend,
+                      (SOCKET, LPWSABUF, DWORD, LPDWORD, DWORD,
+                       LPWSAOVERLAPPED, LPWSAOVERLAPPED_COMPLETION_ROUTINE));
 DECL_WINDOWS_FUNCTION(static, int, shutdown, (SOCKET, int));
 DECL_WINDOWS_FUNCTION(static, int, ioctlsocket,
                       (SOCKET, long, u_long FAR *));
@@ -310,6 +355,9 @@ void sk_init(void)
     GET_WINDOWS_FUNCTION(winsock_module, socket);
     GET_WINDOWS_FUNCTION(winsock_module, listen);
     GET_WINDOWS_FUNCTION(winsock_module, send);
+    /* WSASend is missing from wsock32.dll, in which case try_send
+     * falls back to one send() per bufchain block */
+    GET_WINDOWS_FUNCTION(winsock_module, WSASend);
     GET_WINDOWS_FUNCTION(winsock_module, shutdown);
     GET_WINDOWS_FUNCTION(winsock_module, ioctlsocket);
     GET_WINDOWS_FUNCTION(winsock_module, accept);
@@ -325,11 +373,13 @@ void sk_init(void)
     }
 
     sktree = newtree234(cmpfortree);
+    racetree = newtree234(cmpforrace);
 }
 
 void sk_cleanup(void)
 {
     NetSocket *s;
+    ConnectAttempt *ca;
     int i;
 
     if (sktree) {
@@ -340,6 +390,14 @@ void sk_cleanup(void)
         sktree = NULL;
     }
 
+    if (racetree) {
+        for (i = 0; (ca = index234(racetree, i)) != NULL; i++) {
+            p_closesocket(ca->s);
+        }
+        freetree234(racetree);
+        racetree = NULL;
+    }
+
     if (p_WSACleanup)
         p_WSACleanup();
     if (winsock_module)
@@ -572,6 +630,129 @@ SockAddr *sk_nonamelookup(const char *host)
     return ret;
 }
 
+/*
+ * Asynchronous name lookup. Each lookup gets a thread of its own to
+ * call sk_namelookup in. Finished lookups are passed back to the
+ * main thread on a list, with an event to say there's something on
+ * it.
+ */
+struct NameLookup {
+    char *host;
+    int address_family;
+    SockAddr *addr;
+    char *canonicalname;
+    namelookup_done_fn_t done;
+    void *ctx;
+    bool cancelled;
+    NameLookup *next;                  /* on namelookup_done_head */
+};
+
+static bool namelookup_initialised;
+static CRITICAL_SECTION namelookup_lock;
+static HANDLE namelookup_event;
+static NameLookup *namelookup_done_head, *namelookup_done_tail;
+
+static void namelookup_finish(NameLookup *nl)
+{
+    if (nl->cancelled) {
+        sk_addr_free(nl->addr);
+        sfree(nl->canonicalname);
+    } else {
+        nl->done(nl->ctx, nl->addr, nl->canonicalname);
+    }
+    sfree(nl->host);
+    sfree(nl);
+}
+
+static void namelookup_finish_callback(void *vctx)
+{
+    namelookup_finish((NameLookup *)vctx);
+}
+
+static DWORD WINAPI namelookup_thread(void *param)
+{
+    NameLookup *nl = (NameLookup *)param;
+
+    nl->addr = sk_namelookup(nl->host, &nl->canonicalname,
+                             nl->address_family);
+
+    EnterCriticalSection(&namelookup_lock);
+    nl->next = NULL;
+    if (namelookup_done_tail)
+        namelookup_done_tail->next = nl;
+    else
+        namelookup_done_head = nl;
+    namelookup_done_tail = nl;
+    LeaveCriticalSection(&namelookup_lock);
+
+    SetEvent(namelookup_event);
+    return 0;
+}
+
+static void namelookup_got_event(void *ctx)
+{
+    NameLookup *nl, *next;
+
+    EnterCriticalSection(&namelookup_lock);
+    nl = namelookup_done_head;
+    namelookup_done_head = namelookup_done_tail = NULL;
+    LeaveCriticalSection(&namelookup_lock);
+
+    for (; nl; nl = next) {
+        next = nl->next;
+        namelookup_finish(nl);
+    }
+}
+
+NameLookup *sk_namelookup_start(const char *host, int address_family,
+                                namelookup_done_fn_t done, void *ctx)
+{
+    NameLookup *nl = snew(NameLookup);
+    HANDLE thread;
+    DWORD tid;
+
+    nl->host = dupstr(host);
+    nl->address_family = address_family;
+    nl->addr = NULL;
+    nl->canonicalname = NULL;
+    nl->done = done;
+    nl->ctx = ctx;
+    nl->cancelled = false;
+    nl->next = NULL;
+
+    if (!namelookup_initialised) {
+        namelookup_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (namelookup_event) {
+            InitializeCriticalSection(&namelookup_lock);
+            handle_add_foreign_event(namelookup_event,
+                                     namelookup_got_event, NULL);
+            namelookup_initialised = true;
+        }
+    }
+
+    if (namelookup_initialised) {
+        thread = CreateThread(NULL, 0, namelookup_thread, nl, 0, &tid);
+        if (thread) {
+            CloseHandle(thread);       /* we don't need to wait for it */
+            return nl;
+        }
+    }
+
+    /*
+     * Failing that, do the lookup here and now, but still report it
+     * from a callback as the caller expects.
+     */
+    nl->addr = sk_namelookup(host, &nl->canonicalname, address_family);
+    queue_toplevel_callback(namelookup_finish_callback, nl);
+    return nl;
+}
+
+void sk_namelookup_cancel(NameLookup *nl)
+{
+    /* The lookup itself can't be stopped, so just ignore its result */
+    nl->cancelled = true;
+}
+
 SockAddr *sk_namedpipe_addr(const char *pipename)
 {
     SockAddr *ret = snew(SockAddr);
@@ -863,6 +1044,10 @@ static Socket *sk_net_accept(accept_ctx_t ctx, Plug *plug)
     ret->localhost_only = false;    /* unused, but best init anyway */
     ret->pending_error = 0;
     ret->parent = ret->child = NULL;
+    ret->connect_delay = 0;
+    ret->next_attempt_scheduled = false;
+    ret->racing = NULL;
+    ret->nracing = ret->racingsize = 0;
     ret->addr = NULL;
 
     ret->s = (SOCKET)ctx.p;
@@ -1091,8 +1276,153 @@ static DWORD try_connect(NetSocket *sock)
     return err;
 }
 
+static bool sk_net_more_addrs(NetSocket *s)
+{
+    SockAddrStep step = s->step;
+    return s->addr && sk_nextaddr(s->addr, &step);
+}
+
+static void net_connect_timer(void *ctx, unsigned long now);
+
+/*
+ * RFC 8305 ('Happy Eyeballs') says not to wait for each connection
+ * attempt to fail before trying the next candidate address. Instead,
+ * if an attempt hasn't succeeded after a short delay, we start the
+ * next one alongside it, and use whichever connects first. See the
+ * Unix version in uxnet.c.
+ */
+static void sk_net_schedule_attempt(NetSocket *s)
+{
+    s->next_attempt_scheduled = false;
+    if (s->connect_delay > 0 && !s->connected && !s->writable &&
+        sk_net_more_addrs(s)) {
+        s->next_attempt = schedule_timer(s->connect_delay,
+                                         net_connect_timer, s);
+        s->next_attempt_scheduled = true;
+    }
+}
+
+static void sk_net_close_attempt(NetSocket *s, size_t i)
+{
+    ConnectAttempt *ca = s->racing[i];
+
+    del234(racetree, ca);
+    do_select(ca->s, false);
+    p_closesocket(ca->s);
+    s->racing[i] = s->racing[--s->nracing];
+    sfree(ca);
+}
+
+static void sk_net_stop_racing(NetSocket *s)
+{
+    while (s->nracing > 0)
+        sk_net_close_attempt(s, s->nracing - 1);
+    s->next_attempt_scheduled = false;
+}
+
+/*
+ * Make one of the racing attempts the socket's current one,
+ * discarding whatever the current one was.
+ */
+static void sk_net_adopt_attempt(NetSocket *s, size_t i)
+{
+    ConnectAttempt *ca = s->racing[i];
+
+    del234(sktree, s);
+    if (s->s != INVALID_SOCKET) {
+        do_select(s->s, false);
+        p_closesocket(s->s);
+    }
+    s->s = ca->s;
+    s->step = ca->step;
+    s->error = NULL;
+    add234(sktree, s);
+
+    del234(racetree, ca);
+    s->racing[i] = s->racing[--s->nracing];
+    sfree(ca);
+}
+
+static void net_connect_timer(void *ctx, unsigned long now)
+{
+    NetSocket *s = (NetSocket *)ctx;
+    ConnectAttempt *ca;
+    DWORD err;
+
+    if (!s->next_attempt_scheduled || now != s->next_attempt)
+        return;
+    s->next_attempt_scheduled = false;
+    if (s->connected || s->writable || !sk_net_more_addrs(s))
+        return;
+
+    /*
+     * Leave the attempt in progress to carry on in the background
+     * (its network events still come to select_result), and start
+     * another on the next address.
+     */
+    ca = snew(ConnectAttempt);
+    ca->s = s->s;
+    ca->step = s->step;
+    ca->sock = s;
+    sgrowarray(s->racing, s->racingsize, s->nracing);
+    s->racing[s->nracing++] = ca;
+    add234(racetree, ca);
+
+    /* try_connect puts s back in sktree under its new socket */
+    del234(sktree, s);
+    s->s = INVALID_SOCKET;
+
+    do {
+        sk_nextaddr(s->addr, &s->step);
+        err = try_connect(s);
+    } while (err && sk_net_more_addrs(s));
+
+    if (err)
+        sk_net_adopt_attempt(s, s->nracing - 1); /* back to waiting */
+    else if (s->writable)
+        sk_net_stop_racing(s);
+    else
+        sk_net_schedule_attempt(s);
+}
+
+/*
+ * Handle a network event on one of the connection attempts racing a
+ * socket's current one.
+ */
+static void net_race_select_result(ConnectAttempt *ca, LPARAM lParam)
+{
+    NetSocket *s = ca->sock;
+    DWORD err = WSAGETSELECTERROR(lParam);
+    SockAddr thisaddr = sk_extractaddr_tmp(s->addr, &ca->step);
+    size_t i;
+
+    for (i = 0; s->racing[i] != ca; i++);
+
+    if (err) {
+        sk_net_close_attempt(s, i);
+        plug_log(s->plug, PLUGLOG_CONNECT_FAILED, &thisaddr, s->port,
+                 winsock_error_string(err), err);
+        return;
+    }
+
+    if (WSAGETSELECTEVENT(lParam) != FD_CONNECT)
+        return;
+
+    /*
+     * This attempt has won the race. (thisaddr is still good after
+     * we stop racing, since it points into s->addr.)
+     */
+    sk_net_adopt_attempt(s, i);
+    sk_net_stop_racing(s);
+    s->connected = true;
+    s->writable = true;
+    plug_log(s->plug, PLUGLOG_CONNECT_SUCCESS, &thisaddr, s->port, NULL, 0);
+    sk_addr_free(s->addr);
+    s->addr = NULL;
+}
+
 Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
-               bool nodelay, bool keepalive, Plug *plug)
+               bool nodelay, bool keepalive, int connect_delay, Plug *plug)
 {
     NetSocket *ret;
     DWORD err;
@@ -1114,6 +1444,10 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
     ret->localhost_only = false;    /* unused, but best init anyway */
     ret->pending_error = 0;
     ret->parent = ret->child = NULL;
+    ret->connect_delay = connect_delay;
+    ret->next_attempt_scheduled = false;
+    ret->racing = NULL;
+    ret->nracing = ret->racingsize = 0;
     ret->oobinline = oobinline;
     ret->nodelay = nodelay;
     ret->keepalive = keepalive;
@@ -1128,6 +1462,9 @@ Socket *sk_new(SockAddr *addr, int port, bool privport, bool oobinline,
         err = try_connect(ret);
     } while (err && sk_nextaddr(ret->addr, &ret->step));
 
+    if (!err)
+        sk_net_schedule_attempt(ret);
+
     return &ret->sock;
 }
 
@@ -1163,6 +1500,10 @@ Socket *sk_newlistener(const char *srcaddr, int port, Plug *plug,
     ret->localhost_only = local_host_only;
     ret->pending_error = 0;
     ret->parent = ret->child = NULL;
+    ret->connect_delay = 0;
+    ret->next_attempt_scheduled = false;
+    ret->racing = NULL;
+    ret->nracing = ret->racingsize = 0;
     ret->addr = NULL;
 
     /*
@@ -1337,6 +1678,10 @@ static void sk_net_close(Socket *sock)
 
     bufchain_clear(&s->output_data);
 
+    sk_net_stop_racing(s);
+    sfree(s->racing);
+    expire_timer_context(s);
+
     del234(sktree, s);
     do_select(s->s, false);
     p_closesocket(s->s);
@@ -1367,6 +1712,11 @@ static void socket_error_callback(void *vs)
                  s->pending_error, 0);
 }
 
+/*
+ * Maximum number of output_data blocks we'll pass to one WSASend.
+ */
+#define SEND_MAX_BUFS 16
+
 /*
  * The function which tries to send on a socket once it's deemed
  * writable.
@@ -1376,23 +1726,41 @@ void try_send(NetSocket *s)
     while (s->sending_oob || bufchain_size(&s->output_data) > 0) {
         int nsent;
         DWORD err;
-        const void *data;
         size_t len;
-        int urgentflag;
 
         if (s->sending_oob) {
-            urgentflag = MSG_OOB;
             len = s->sending_oob;
-            data = &s->oobdata;
+            nsent = p_send(s->s, s->oobdata, len, MSG_OOB);
+        } else if (p_WSASend) {
+            /*
+             * Send as many of the queued blocks as we can in one
+             * system call, rather than one send() apiece.
+             */
+            ptrlen blocks[SEND_MAX_BUFS];
+            WSABUF bufs[SEND_MAX_BUFS];
+            DWORD sent;
+            size_t i, n = bufchain_prefixes(
+                &s->output_data, blocks, SEND_MAX_BUFS);
+
+            /* WSABUF lengths are ULONG, and the total has to fit in
+             * the int we return */
+            len = 0;
+            for (i = 0; i < n && len < INT_MAX; i++) {
+                bufs[i].buf = (char *)blocks[i].ptr;
+                bufs[i].len = min(blocks[i].len, INT_MAX - len);
+                len += bufs[i].len;
+            }
+            if (p_WSASend(s->s, bufs, i, &sent, 0, NULL, NULL) == 0)
+                nsent = sent;
+            else
+                nsent = -1;
         } else {
-            urgentflag = 0;
             ptrlen bufdata = bufchain_prefix(&s->output_data);
-            data = bufdata.ptr;
-            len = bufdata.len;
+            len = min(bufdata.len, INT_MAX); /* WinSock send() takes an int */
+            nsent = p_send(s->s, bufdata.ptr, len, 0);
         }
-        len = min(len, INT_MAX);       /* WinSock send() takes an int */
-        nsent = p_send(s->s, data, len, urgentflag);
         noise_ultralight(NOISE_SOURCE_IOLEN, nsent);
+        probe2(socket_send, s->s, nsent);
         if (nsent <= 0) {
             err = (nsent < 0 ? p_WSAGetLastError() : 0);
             if ((err < WSABASEERR && nsent < 0) || err == WSAEWOULDBLOCK) {
@@ -1453,7 +1821,24 @@ static size_t sk_net_write(Socket *sock, const void *buf, size_t len)
     assert(s->outgoingeof == EOF_NO);
 
     /*
-     * Add the data to the buffer list on the socket.
+     * If nothing is queued ahead of this data, try sending it
+     * straight from the caller's buffer, so that we only have to
+     * copy whatever WinSock won't take right now. Errors are left
+     * for try_send to rediscover and report.
+     */
+    if (len > 0 && s->writable && !s->sending_oob &&
+        bufchain_size(&s->output_data) == 0) {
+        int nsent = p_send(s->s, buf, min(len, INT_MAX), 0);
+        noise_ultralight(NOISE_SOURCE_IOLEN, nsent);
+        probe2(socket_send, s->s, nsent);
+        if (nsent > 0) {
+            buf = (const char *)buf + nsent;
+            len -= nsent;
+        }
+    }
+
+    /*
+     * Add the rest of the data to the buffer list on the socket.
      */
     bufchain_add(&s->output_data, buf, len);
 
@@ -1507,11 +1892,17 @@ static void sk_net_write_eof(Socket *sock)
         try_send(s);
 }
 
+/*
+ * Maximum number of connections select_result will accept from one
+ * listening socket before returning to the event loop.
+ */
+#define NET_ACCEPT_BUDGET 64
+
 void select_result(WPARAM wParam, LPARAM lParam)
 {
     int ret;
     DWORD err;
-    char buf[20480];                   /* nice big buffer for plenty of speed */
+    char buf[65536];                   /* nice big buffer for plenty of speed */
     NetSocket *s;
     bool atmark;
 
@@ -1521,8 +1912,13 @@ void select_result(WPARAM wParam, LPARAM lParam)
         return;                /* boggle */
 
     s = find234(sktree, (void *) wParam, cmpforsearch);
-    if (!s)
-        return;                /* boggle */
+    if (!s) {
+        ConnectAttempt *ca = find234(racetree, (void *) wParam,
+                                     cmpforracesearch);
+        if (ca)
+            net_race_select_result(ca, lParam);
+        return;                /* otherwise, boggle */
+    }
 
     if ((err = WSAGETSELECTERROR(lParam)) != 0) {
         /*
@@ -1537,6 +1933,13 @@ void select_result(WPARAM wParam, LPARAM lParam)
             while (err && s->addr && sk_nextaddr(s->addr, &s->step)) {
                 err = try_connect(s);
             }
+            if (err && s->nracing > 0) {
+                /* an earlier attempt is still in the running */
+                sk_net_adopt_attempt(s, s->nracing - 1);
+                err = 0;
+            } else if (!err) {
+                sk_net_schedule_attempt(s);
+            }
         }
         if (err != 0)
             plug_closing(s->plug, winsock_error_string(err), err, 0);
@@ -1549,6 +1952,7 @@ void select_result(WPARAM wParam, LPARAM lParam)
       case FD_CONNECT:
         s->connected = true;
         s->writable = true;
+        sk_net_stop_racing(s);
 
         /*
          * Once a socket is connected, we can stop falling back
@@ -1594,6 +1998,7 @@ void select_result(WPARAM wParam, LPARAM lParam)
 
         ret = p_recv(s->s, buf, sizeof(buf), 0);
         noise_ultralight(NOISE_SOURCE_IOLEN, ret);
+        probe2(socket_recv, s->s, ret);
         if (ret < 0) {
             err = p_WSAGetLastError();
             if (err == WSAEWOULDBLOCK) {
@@ -1617,6 +2022,7 @@ void select_result(WPARAM wParam, LPARAM lParam)
          */
         ret = p_recv(s->s, buf, sizeof(buf), MSG_OOB);
         noise_ultralight(NOISE_SOURCE_IOLEN, ret);
+        probe2(socket_recv, s->s, ret);
         if (ret <= 0) {
             int err = p_WSAGetLastError();
             plug_closing(s->plug, winsock_error_string(err), err, 0);
@@ -1652,38 +2058,48 @@ void select_result(WPARAM wParam, LPARAM lParam)
         } while (ret > 0);
         return;
       case FD_ACCEPT: {
+        /*
+         * Accept every connection that's waiting, up to
+         * NET_ACCEPT_BUDGET, rather than one per FD_ACCEPT message,
+         * so that a burst of connections doesn't cost a trip round
+         * the event loop each.
+         */
+        for (int n = 0; n < NET_ACCEPT_BUDGET; n++) {
 #ifdef NO_IPV6
-        struct sockaddr_in isa;
+            struct sockaddr_in isa;
 #else
-        struct sockaddr_storage isa;
+            struct sockaddr_storage isa;
 #endif
-        int addrlen = sizeof(isa);
-        SOCKET t;  /* socket of connection */
-        accept_ctx_t actx;
-
-        memset(&isa, 0, sizeof(isa));
-        err = 0;
-        t = p_accept(s->s,(struct sockaddr *)&isa,&addrlen);
-        if (t == INVALID_SOCKET)
-        {
-          err = p_WSAGetLastError();
-          if (err == WSATRY_AGAIN)
-              break;
-        }
+            int addrlen = sizeof(isa);
+            SOCKET t;  /* socket of connection */
+            accept_ctx_t actx;
 
-        actx.p = (void *)t;
+            memset(&isa, 0, sizeof(isa));
+            err = 0;
+            t = p_accept(s->s,(struct sockaddr *)&isa,&addrlen);
+            if (t == INVALID_SOCKET) {
+                err = p_WSAGetLastError();
+                if (err == WSAEWOULDBLOCK || err == WSATRY_AGAIN)
+                    break;
+            }
+
+            actx.p = (void *)t;
 
 #ifndef NO_IPV6
-        if (isa.ss_family == AF_INET &&
-            s->localhost_only &&
-            !ipv4_is_local_addr(((struct sockaddr_in *)&isa)->sin_addr))
+            if (isa.ss_family == AF_INET &&
+                s->localhost_only &&
+                !ipv4_is_local_addr(((struct sockaddr_in *)&isa)->sin_addr))
 #else
-        if (s->localhost_only && !ipv4_is_local_addr(isa.sin_addr))
+            if (s->localhost_only && !ipv4_is_local_addr(isa.sin_addr))
 #endif
-        {
-          p_closesocket(t);      /* dodgy WinSock let nonlocal through */
-        } else if (plug_accepting(s->plug, sk_net_accept, actx)) {
-          p_closesocket(t);      /* denied or error */
+            {
+                p_closesocket(t);  /* dodgy WinSock let nonlocal through */
+            } else if (plug_accepting(s->plug, sk_net_accept, actx)) {
+                p_closesocket(t);  /* denied or error */
+            }
+
+            if (t == INVALID_SOCKET)
+                break;             /* reported that error; stop there */
         }
         break;
       }
@@ -1705,6 +2121,23 @@ static const char *sk_net_socket_error(Socket *sock)
     return s->error;
 }
 
+void sk_reset_on_close(Socket *sock)
+{
+    NetSocket *s;
+    struct linger l;
+
+    if (sock->vt != &NetSocket_sockvt)
+        return;
+    s = container_of(sock, NetSocket, sock);
+    if (s->s == INVALID_SOCKET)
+        return;
+
+    /* A zero linger time makes closesocket() reset the connection */
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    p_setsockopt(s->s, SOL_SOCKET, SO_LINGER, (void *)&l, sizeof(l));
+}
+
 static SocketPeerInfo *sk_net_peer_info(Socket *sock)
 {
     NetSocket *s = container_of(sock, NetSocket, sock);
@@ -1773,29 +2206,44 @@ static void sk_net_set_frozen(Socket *sock, bool is_frozen)
 void socket_reselect_all(void)
 {
     NetSocket *s;
+    ConnectAttempt *ca;
     int i;
 
     for (i = 0; (s = index234(sktree, i)) != NULL; i++) {
         if (!s->frozen)
             do_select(s->s, true);
     }
+    for (i = 0; (ca = index234(racetree, i)) != NULL; i++)
+        do_select(ca->s, true);
 }
 
 /*
- * For Plink: enumerate all sockets currently active.
+ * For Plink: enumerate all sockets currently active, including
+ * connection attempts racing a socket's main one.
  */
-SOCKET first_socket(int *state)
+static SOCKET socket_at_index(int i)
 {
+    int n = count234(sktree);
     NetSocket *s;
+    ConnectAttempt *ca;
+
+    if (i < n) {
+        s = index234(sktree, i);
+        return s->s;
+    }
+    ca = index234(racetree, i - n);
+    return ca ? ca->s : INVALID_SOCKET;
+}
+
+SOCKET first_socket(int *state)
+{
     *state = 0;
-    s = index234(sktree, (*state)++);
-    return s ? s->s : INVALID_SOCKET;
+    return socket_at_index((*state)++);
 }
 
 SOCKET next_socket(int *state)
 {
-    NetSocket *s = index234(sktree, (*state)++);
-    return s ? s->s : INVALID_SOCKET;
+    return socket_at_index((*state)++);
 }
 
 bool socket_writable(SOCKET skt)
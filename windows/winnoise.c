@@ -42,6 +42,17 @@ bool win_read_random(void *buf, unsigned wanted)
     return toret;
 }
 
+bool noise_get_fast(void (*func) (void *, int))
+{
+    BYTE buf[32];
+
+    if (!win_read_random(buf, sizeof(buf)))
+        return false;
+    func(buf, sizeof(buf));
+    smemclr(buf, sizeof(buf));
+    return true;
+}
+
 /*
  * This function is called once, at PuTTY startup.
  */
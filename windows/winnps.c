@@ -15,23 +15,42 @@
 
 #include "winsecur.h"
 
-typedef struct NamedPipeServerSocket {
-    /* Parameters for (repeated) creation of named pipe objects */
-    PSECURITY_DESCRIPTOR psd;
-    PACL acl;
-    char *pipename;
+/*
+ * Number of pipe instances we keep waiting for a connection at once.
+ * With only one, every client that tried to connect while we were
+ * between accepting a connection and making the next instance (or
+ * busy with something else in the main loop) got ERROR_PIPE_BUSY and
+ * had to wait and retry, which adds up when lots of clients turn up
+ * together, e.g. many sessions on a terminal server all wanting
+ * Pageant at login time.
+ */
+#define NPS_INSTANCES 4
+
+typedef struct NamedPipeServerSocket NamedPipeServerSocket;
+
+typedef struct NamedPipeServerInstance {
+    NamedPipeServerSocket *ps;
 
     /* The current named pipe object + attempt to connect to it */
     HANDLE pipehandle;
     OVERLAPPED connect_ovl;
     struct handle *callback_handle;    /* winhandl.c's reference */
+} NamedPipeServerInstance;
+
+struct NamedPipeServerSocket {
+    /* Parameters for (repeated) creation of named pipe objects */
+    PSECURITY_DESCRIPTOR psd;
+    PACL acl;
+    char *pipename;
+
+    NamedPipeServerInstance inst[NPS_INSTANCES];
 
     /* PuTTY Socket machinery */
     Plug *plug;
     char *error;
 
     Socket sock;
-} NamedPipeServerSocket;
+};
 
 static Plug *sk_namedpipeserver_plug(Socket *s, Plug *p)
 {
@@ -46,10 +65,15 @@ static void sk_namedpipeserver_close(Socket *s)
 {
     NamedPipeServerSocket *ps = container_of(s, NamedPipeServerSocket, sock);
 
-    if (ps->callback_handle)
-        handle_free(ps->callback_handle);
-    CloseHandle(ps->pipehandle);
-    CloseHandle(ps->connect_ovl.hEvent);
+    for (int i = 0; i < NPS_INSTANCES; i++) {
+        NamedPipeServerInstance *inst = &ps->inst[i];
+        if (inst->callback_handle)
+            handle_free(inst->callback_handle);
+        if (inst->pipehandle != INVALID_HANDLE_VALUE)
+            CloseHandle(inst->pipehandle);
+        if (inst->connect_ovl.hEvent)
+            CloseHandle(inst->connect_ovl.hEvent);
+    }
     sfree(ps->error);
     sfree(ps->pipename);
     if (ps->acl)
@@ -70,8 +94,10 @@ static SocketPeerInfo *sk_namedpipeserver_peer_info(Socket *s)
     return NULL;
 }
 
-static bool create_named_pipe(NamedPipeServerSocket *ps, bool first_instance)
+static bool create_named_pipe(NamedPipeServerInstance *inst,
+                              bool first_instance)
 {
+    NamedPipeServerSocket *ps = inst->ps;
     SECURITY_ATTRIBUTES sa;
 
     memset(&sa, 0, sizeof(sa));
@@ -79,7 +105,7 @@ static bool create_named_pipe(NamedPipeServerSocket *ps, bool first_instance)
     sa.lpSecurityDescriptor = ps->psd;
     sa.bInheritHandle = false;
 
-    ps->pipehandle = CreateNamedPipe
+    inst->pipehandle = CreateNamedPipe
         (/* lpName */
          ps->pipename,
 
@@ -107,7 +133,7 @@ static bool create_named_pipe(NamedPipeServerSocket *ps, bool first_instance)
          /* lpSecurityAttributes */
          &sa);
 
-    return ps->pipehandle != INVALID_HANDLE_VALUE;
+    return inst->pipehandle != INVALID_HANDLE_VALUE;
 }
 
 static Socket *named_pipe_accept(accept_ctx_t ctx, Plug *plug)
@@ -117,9 +143,11 @@ static Socket *named_pipe_accept(accept_ctx_t ctx, Plug *plug)
     return make_handle_socket(conn, conn, NULL, plug, true);
 }
 
-static void named_pipe_accept_loop(NamedPipeServerSocket *ps,
+static void named_pipe_accept_loop(NamedPipeServerInstance *inst,
                                    bool got_one_already)
 {
+    NamedPipeServerSocket *ps = inst->ps;
+
     while (1) {
         int error;
         char *errmsg;
@@ -135,7 +163,7 @@ static void named_pipe_accept_loop(NamedPipeServerSocket *ps,
              * tell us that an overlapped operation is in progress and
              * we should wait for our event object.
              */
-            if (ConnectNamedPipe(ps->pipehandle, &ps->connect_ovl))
+            if (ConnectNamedPipe(inst->pipehandle, &inst->connect_ovl))
                 error = 0;
             else
                 error = GetLastError();
@@ -147,12 +175,12 @@ static void named_pipe_accept_loop(NamedPipeServerSocket *ps,
         if (error == 0 || error == ERROR_PIPE_CONNECTED) {
             /*
              * We've successfully retrieved an incoming connection, so
-             * ps->pipehandle now refers to that connection. So
+             * inst->pipehandle now refers to that connection. So
              * convert that handle into a separate connection-type
              * Socket, and create a fresh one to be the new listening
              * pipe.
              */
-            HANDLE conn = ps->pipehandle;
+            HANDLE conn = inst->pipehandle;
             accept_ctx_t actx;
 
             actx.p = (void *)conn;
@@ -164,7 +192,7 @@ static void named_pipe_accept_loop(NamedPipeServerSocket *ps,
                 CloseHandle(conn);
             }
 
-            if (!create_named_pipe(ps, false)) {
+            if (!create_named_pipe(inst, false)) {
                 error = GetLastError();
             } else {
                 /*
@@ -184,10 +212,10 @@ static void named_pipe_accept_loop(NamedPipeServerSocket *ps,
     }
 }
 
-static void named_pipe_connect_callback(void *vps)
+static void named_pipe_connect_callback(void *vinst)
 {
-    NamedPipeServerSocket *ps = (NamedPipeServerSocket *)vps;
-    named_pipe_accept_loop(ps, true);
+    NamedPipeServerInstance *inst = (NamedPipeServerInstance *)vinst;
+    named_pipe_accept_loop(inst, true);
 }
 
 /*
@@ -210,7 +238,12 @@ Socket *new_named_pipe_listener(const char *pipename, Plug *plug)
     ret->psd = NULL;
     ret->pipename = dupstr(pipename);
     ret->acl = NULL;
-    ret->callback_handle = NULL;
+    for (int i = 0; i < NPS_INSTANCES; i++) {
+        ret->inst[i].ps = ret;
+        ret->inst[i].pipehandle = INVALID_HANDLE_VALUE;
+        memset(&ret->inst[i].connect_ovl, 0, sizeof(OVERLAPPED));
+        ret->inst[i].callback_handle = NULL;
+    }
 
     assert(strncmp(pipename, "\\\\.\\pipe\\", 9) == 0);
     assert(strchr(pipename + 9, '\\') == NULL);
@@ -220,18 +253,35 @@ Socket *new_named_pipe_listener(const char *pipename, Plug *plug)
         goto cleanup;
     }
 
-    if (!create_named_pipe(ret, true)) {
-        ret->error = dupprintf("unable to create named pipe '%s': %s",
-                               pipename, win_strerror(GetLastError()));
-        goto cleanup;
+    /*
+     * Only the first instance is created with
+     * FILE_FLAG_FIRST_PIPE_INSTANCE, so that we fail if somebody
+     * else already owns the pipe name. If we can't make the rest,
+     * we'll just have to manage with fewer.
+     */
+    for (int i = 0; i < NPS_INSTANCES; i++) {
+        NamedPipeServerInstance *inst = &ret->inst[i];
+
+        if (!create_named_pipe(inst, i == 0)) {
+            if (i == 0)
+                ret->error = dupprintf(
+                    "unable to create named pipe '%s': %s",
+                    pipename, win_strerror(GetLastError()));
+            break;
+        }
+
+        inst->connect_ovl.hEvent = CreateEvent(NULL, true, false, NULL);
+        inst->callback_handle =
+            handle_add_foreign_event(inst->connect_ovl.hEvent,
+                                     named_pipe_connect_callback, inst);
     }
 
-    memset(&ret->connect_ovl, 0, sizeof(ret->connect_ovl));
-    ret->connect_ovl.hEvent = CreateEvent(NULL, true, false, NULL);
-    ret->callback_handle =
-        handle_add_foreign_event(ret->connect_ovl.hEvent,
-                                 named_pipe_connect_callback, ret);
-    named_pipe_accept_loop(ret, false);
+    if (ret->error)
+        goto cleanup;
+
+    for (int i = 0; i < NPS_INSTANCES; i++)
+        if (ret->inst[i].pipehandle != INVALID_HANDLE_VALUE)
+            named_pipe_accept_loop(&ret->inst[i], false);
 
   cleanup:
     return &ret->sock;
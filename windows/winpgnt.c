@@ -394,7 +394,7 @@ void keylist_update(void)
     }
 }
 
-static void win_add_keyfile(Filename *filename)
+static void win_add_keyfile(Filename *filename, bool encrypted)
 {
     char *err;
     int ret;
@@ -404,7 +404,7 @@ static void win_add_keyfile(Filename *filename)
      * _new_ passphrase; pageant_add_keyfile will take care of trying
      * all the passphrases we've already stored.)
      */
-    ret = pageant_add_keyfile(filename, NULL, &err, false);
+    ret = pageant_add_keyfile(filename, NULL, &err, encrypted);
     if (ret == PAGEANT_ACTION_OK) {
         goto done;
     } else if (ret == PAGEANT_ACTION_FAILURE) {
@@ -477,7 +477,7 @@ static void prompt_add_keyfile(void)
         if(strlen(filelist) > of.nFileOffset) {
             /* Only one filename returned? */
             Filename *fn = filename_from_str(filelist);
-            win_add_keyfile(fn);
+            win_add_keyfile(fn, false);
             filename_free(fn);
         } else {
             /* we are returned a bunch of strings, end to
@@ -490,7 +490,7 @@ static void prompt_add_keyfile(void)
             while (*filewalker != '\0') {
                 char *filename = dupcat(dir, "\\", filewalker);
                 Filename *fn = filename_from_str(filename);
-                win_add_keyfile(fn);
+                win_add_keyfile(fn, false);
                 filename_free(fn);
                 sfree(filename);
                 filewalker += strlen(filewalker) + 1;
@@ -1247,7 +1247,7 @@ int WINAPI WinMain(HINSTANCE inst, HINSTANCE prev, LPSTR cmdline, int show)
 {
     MSG msg;
     const char *command = NULL;
-    bool added_keys = false;
+    bool added_keys = false, add_keys_encrypted = false;
     int argc, i;
     char **argv, **argstart;
 
@@ -1336,6 +1336,13 @@ int WINAPI WinMain(HINSTANCE inst, HINSTANCE prev, LPSTR cmdline, int show)
         } else if (!strcmp(argv[i], "-restrict-putty-acl") ||
                    !strcmp(argv[i], "-restrict_putty_acl")) {
             restrict_putty_acl = true;
+        } else if (!strcmp(argv[i], "--encrypted") ||
+                   !strcmp(argv[i], "-encrypted")) {
+            /*
+             * Load subsequent keys in encrypted form, deferring
+             * decryption until each one is first used.
+             */
+            add_keys_encrypted = true;
         } else if (!strcmp(argv[i], "-c")) {
             /*
              * If we see `-c', then the rest of the
@@ -1349,7 +1356,7 @@ int WINAPI WinMain(HINSTANCE inst, HINSTANCE prev, LPSTR cmdline, int show)
             break;
         } else {
             Filename *fn = filename_from_str(argv[i]);
-            win_add_keyfile(fn);
+            win_add_keyfile(fn, add_keys_encrypted);
             filename_free(fn);
             added_keys = true;
         }
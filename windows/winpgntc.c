@@ -163,13 +163,6 @@ bool agent_exists(void)
     return named_pipe_agent_exists() || wm_copydata_agent_exists();
 }
 
-struct agent_pending_query {
-    struct handle *handle;
-    strbuf *response;
-    void (*callback)(void *, void *, int);
-    void *callback_ctx;
-};
-
 static int named_pipe_agent_accumulate_response(
     strbuf *sb, const void *data, size_t len)
 {
@@ -187,29 +180,121 @@ static int named_pipe_agent_accumulate_response(
     return 0; /* not done yet */
 }
 
-static size_t named_pipe_agent_gotdata(
-    struct handle *h, const void *data, size_t len, int err)
+/*
+ * Asynchronous queries in flight at the same time share a single
+ * connection to the agent's named pipe, each one written as soon as
+ * it's made. The agent protocol answers requests strictly in order,
+ * so each reply belongs to the oldest query still waiting. The
+ * connection is closed again once nothing is waiting on it.
+ */
+struct agent_pending_query {
+    void (*callback)(void *, void *, int);
+    void *callback_ctx;
+    bool cancelled;
+    agent_pending_query *next;
+};
+
+static struct {
+    Socket *s;                         /* NULL if not connected */
+    bufchain inbuf;
+    agent_pending_query *head, *tail;
+    Plug plug;
+} agent_conn;
+
+static void agent_conn_close(void)
 {
-    agent_pending_query *pq = handle_get_privdata(h);
+    if (agent_conn.s) {
+        sk_close(agent_conn.s);
+        agent_conn.s = NULL;
+        bufchain_clear(&agent_conn.inbuf);
+    }
+}
 
-    if (err || len == 0) {
-        pq->callback(pq->callback_ctx, NULL, 0);
-        agent_cancel_query(pq);
+/*
+ * Tear down the shared connection, failing every query still queued
+ * on it. The state is reset before any callback runs, so a callback
+ * is free to start a new query.
+ */
+static void agent_conn_fail(void)
+{
+    agent_pending_query *pq = agent_conn.head;
+
+    agent_conn_close();
+    agent_conn.head = agent_conn.tail = NULL;
+
+    while (pq) {
+        agent_pending_query *next = pq->next;
+        if (!pq->cancelled)
+            pq->callback(pq->callback_ctx, NULL, 0);
+        sfree(pq);
+        pq = next;
     }
+}
+
+static void agent_conn_log(Plug *plug, PlugLogType type, SockAddr *addr,
+                           int port, const char *err_msg, int err_code)
+{
+}
+
+static void agent_conn_closing(Plug *plug, const char *error_msg,
+                               int error_code, bool calling_back)
+{
+    agent_conn_fail();
+}
 
-    int status = named_pipe_agent_accumulate_response(pq->response, data, len);
-    if (status == -1) {
-        pq->callback(pq->callback_ctx, NULL, 0);
-        agent_cancel_query(pq);
-    } else if (status > 0) {
-        void *response_buf = strbuf_to_str(pq->response);
-        pq->response = NULL;
-        pq->callback(pq->callback_ctx, response_buf, status);
-        agent_cancel_query(pq);
+static void agent_conn_receive(
+    Plug *plug, int urgent, const char *data, size_t len)
+{
+    bufchain_add(&agent_conn.inbuf, data, len);
+
+    while (agent_conn.s) {
+        unsigned char lenbuf[4];
+        agent_pending_query *pq;
+        size_t replylen;
+        void *reply;
+
+        if (bufchain_size(&agent_conn.inbuf) < 4)
+            return;
+        bufchain_fetch(&agent_conn.inbuf, lenbuf, 4);
+        replylen = GET_32BIT_MSB_FIRST(lenbuf);
+        if (replylen > AGENT_MAX_MSGLEN - 4 || !agent_conn.head) {
+            /* Badly formatted, or a reply to a question we never
+             * asked: either way we've lost track */
+            agent_conn_fail();
+            return;
+        }
+        replylen += 4;
+        if (bufchain_size(&agent_conn.inbuf) < replylen)
+            return;                    /* more data to come */
+
+        reply = snewn(replylen, char);
+        bufchain_fetch_consume(&agent_conn.inbuf, reply, replylen);
+
+        pq = agent_conn.head;
+        if (!(agent_conn.head = pq->next)) {
+            agent_conn.tail = NULL;
+            agent_conn_close();
+        }
+
+        if (pq->cancelled)
+            sfree(reply);
+        else
+            pq->callback(pq->callback_ctx, reply, replylen);
+        sfree(pq);
     }
-    return 0;
 }
 
+static void agent_conn_sent(Plug *plug, size_t bufsize)
+{
+}
+
+static const PlugVtable agent_conn_plugvt = {
+    .log = agent_conn_log,
+    .closing = agent_conn_closing,
+    .receive = agent_conn_receive,
+    .sent = agent_conn_sent,
+};
+
 static agent_pending_query *named_pipe_agent_query(
     strbuf *query, void **out, int *outlen,
     void (*callback)(void *, void *, int), void *callback_ctx)
@@ -217,15 +302,48 @@ static agent_pending_query *named_pipe_agent_query(
     agent_pending_query *pq = NULL;
     char *err = NULL, *pipename = NULL;
     strbuf *sb = NULL;
-    HANDLE pipehandle;
+    HANDLE pipehandle = INVALID_HANDLE_VALUE;
 
+    strbuf_finalise_agent_query(query);
+
+    if (callback) {
+        if (!agent_conn.s) {
+            pipename = agent_named_pipe_name();
+            pipehandle = connect_to_named_pipe(pipename, &err);
+            if (pipehandle == INVALID_HANDLE_VALUE)
+                goto failure;
+
+            agent_conn.plug.vt = &agent_conn_plugvt;
+            bufchain_init(&agent_conn.inbuf);
+            agent_conn.s = make_handle_socket(pipehandle, pipehandle, NULL,
+                                              &agent_conn.plug, true);
+            pipehandle = INVALID_HANDLE_VALUE; /* now owned by the Socket */
+        }
+
+        sk_write(agent_conn.s, query->s, query->len);
+
+        pq = snew(agent_pending_query);
+        pq->callback = callback;
+        pq->callback_ctx = callback_ctx;
+        pq->cancelled = false;
+        pq->next = NULL;
+        if (agent_conn.tail)
+            agent_conn.tail->next = pq;
+        else
+            agent_conn.head = pq;
+        agent_conn.tail = pq;
+        goto out;
+    }
+
+    /*
+     * A synchronous query gets a connection of its own, so it can't
+     * get mixed up with any asynchronous ones in flight.
+     */
     pipename = agent_named_pipe_name();
     pipehandle = connect_to_named_pipe(pipename, &err);
     if (pipehandle == INVALID_HANDLE_VALUE)
         goto failure;
 
-    strbuf_finalise_agent_query(query);
-
     for (DWORD done = 0; done < query->len ;) {
         DWORD nwritten;
         bool ret = WriteFile(pipehandle, query->s + done, query->len - done,
@@ -236,7 +354,7 @@ static agent_pending_query *named_pipe_agent_query(
         done += nwritten;
     }
 
-    if (!callback) {
+    {
         int status;
 
         sb = strbuf_new_nm();
@@ -259,14 +377,6 @@ static agent_pending_query *named_pipe_agent_query(
         goto out;
     }
 
-    pq = snew(agent_pending_query);
-    pq->handle = handle_input_new(pipehandle, named_pipe_agent_gotdata, pq, 0);
-    pipehandle = NULL;  /* prevent it being closed below */
-    pq->response = strbuf_new_nm();
-    pq->callback = callback;
-    pq->callback_ctx = callback_ctx;
-    goto out;
-
   failure:
     *out = NULL;
     *outlen = 0;
@@ -284,10 +394,17 @@ static agent_pending_query *named_pipe_agent_query(
 
 void agent_cancel_query(agent_pending_query *pq)
 {
-    handle_free(pq->handle);
-    if (pq->response)
-        strbuf_free(pq->response);
-    sfree(pq);
+    /*
+     * The agent will still send a reply for this query, which we
+     * must consume to keep the rest in step; so just mark it. But if
+     * nobody is waiting for anything on the connection any more,
+     * there's no reason to hang on to it.
+     */
+    pq->cancelled = true;
+    for (pq = agent_conn.head; pq; pq = pq->next)
+        if (!pq->cancelled)
+            return;
+    agent_conn_fail();
 }
 
 agent_pending_query *agent_query(
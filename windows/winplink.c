@@ -82,6 +82,7 @@ static bool plink_seat_interactive(Seat *seat)
 
 static const SeatVtable plink_seat_vt = {
     .output = plink_output,
+    .sent = nullseat_sent,
     .eof = plink_eof,
     .get_userpass_input = plink_get_userpass_input,
     .notify_remote_exit = nullseat_notify_remote_exit,
@@ -128,6 +129,8 @@ static void usage(void)
     printf("  -batch    disable all interactive prompts\n");
     printf("  -proxycmd command\n");
     printf("            use 'command' as local proxy\n");
+    printf("  -J [user@]host[:port]\n");
+    printf("            connect via an SSH jump host\n");
     printf("  -sercfg configuration-string (e.g. 19200,8,n,1,X)\n");
     printf("            Specify the serial configuration (serial only)\n");
     printf("The following options only apply to SSH connections:\n");
@@ -138,6 +141,8 @@ static void usage(void)
     printf("            Forward local port to remote address\n");
     printf("  -R [listen-IP:]listen-port:host:port\n");
     printf("            Forward remote port to local address\n");
+    printf("  -fwdlimit [LRD][listen-IP:]listen-port=rate[:total[:weight]]\n");
+    printf("            Limit the bandwidth of a port forwarding\n");
     printf("  -X -x     enable / disable X11 forwarding\n");
     printf("  -A -a     enable / disable agent forwarding\n");
     printf("  -t -T     enable / disable pty allocation\n");
@@ -165,8 +170,13 @@ static void usage(void)
     printf("  -sshlog file\n");
     printf("  -sshrawlog file\n");
     printf("            log protocol details to a file\n");
+    printf("  -tracefile file\n");
+    printf("            record an event-loop trace to a file\n");
     printf("  -shareexists\n");
     printf("            test whether a connection-sharing upstream exists\n");
+    printf("  -sharestats\n");
+    printf("            show what a connection-sharing upstream's "
+           "downstreams are doing\n");
     exit(1);
 }
 
@@ -264,6 +274,7 @@ int main(int argc, char **argv)
     bool errors;
     bool use_subsystem = false;
     bool just_test_share_exists = false;
+    bool just_query_share_stats = false;
     enum TriState sanitise_stdout = AUTO, sanitise_stderr = AUTO;
     const struct BackendVtable *vt;
 
@@ -325,6 +336,8 @@ int main(int argc, char **argv)
             exit(1);
         } else if (!strcmp(p, "-shareexists")) {
             just_test_share_exists = true;
+        } else if (!strcmp(p, "-sharestats")) {
+            just_query_share_stats = true;
         } else if (!strcmp(p, "-sanitise-stdout") ||
                    !strcmp(p, "-sanitize-stdout")) {
             sanitise_stdout = FORCE_ON;
@@ -431,6 +444,22 @@ int main(int argc, char **argv)
             return 1;
     }
 
+    if (just_query_share_stats) {
+        /*
+         * Only ever talk to an existing upstream for this, rather
+         * than making a connection of our own to ask.
+         */
+        if (!vt->test_for_upstream ||
+            !vt->test_for_upstream(conf_get_str(conf, CONF_host),
+                                   conf_get_int(conf, CONF_port), conf)) {
+            fprintf(stderr, "plink: no connection-sharing upstream found\n");
+            return 1;
+        }
+        conf_set_bool(conf, CONF_ssh_connection_sharing, true);
+        conf_set_bool(conf, CONF_ssh_connection_sharing_upstream, false);
+        conf_set_bool(conf, CONF_ssh_connection_sharing_stats, true);
+    }
+
     if (restricted_acl()) {
         lp_eventlog(console_cli_logpolicy,
                     "Running with restricted process ACL");
@@ -521,6 +550,7 @@ int main(int argc, char **argv)
         fprintf(stderr, "Remote process exit code unavailable\n");
         exitcode = 1;                  /* this is an error condition */
     }
+    logfclose(logctx);                 /* finish off a compressed log */
     cleanup_exit(exitcode);
     return 0;                          /* placate compiler warning */
 }
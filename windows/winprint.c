@@ -14,8 +14,16 @@ struct printer_enum_tag {
     } info;
 };
 
+/*
+ * Each WritePrinter call goes through the spooler, so printer
+ * passthrough output, which the terminal hands us in whatever pieces
+ * it arrived in, is collected up and written in chunks of this size.
+ */
+#define PRINTER_WRITE_SIZE 65536
+
 struct printer_job_tag {
     HANDLE hprinter;
+    strbuf *pending;
 };
 
 DECL_WINDOWS_FUNCTION(static, BOOL, EnumPrinters,
@@ -174,6 +182,7 @@ printer_job *printer_start_job(char *printer)
     init_winfuncs();
 
     ret->hprinter = NULL;
+    ret->pending = NULL;
     if (!p_OpenPrinter(printer, &ret->hprinter, NULL))
         goto error;
 
@@ -189,6 +198,7 @@ printer_job *printer_start_job(char *printer)
         goto error;
     pagestarted = true;
 
+    ret->pending = strbuf_new_nm();
     return ret;
 
     error:
@@ -202,6 +212,16 @@ printer_job *printer_start_job(char *printer)
     return NULL;
 }
 
+static void printer_job_write_pending(printer_job *pj)
+{
+    DWORD written;
+
+    if (pj->pending->len)
+        p_WritePrinter(pj->hprinter, pj->pending->u, pj->pending->len,
+                       &written);
+    strbuf_clear(pj->pending);
+}
+
 void printer_job_data(printer_job *pj, const void *data, size_t len)
 {
     DWORD written;
@@ -209,7 +229,16 @@ void printer_job_data(printer_job *pj, const void *data, size_t len)
     if (!pj)
         return;
 
-    p_WritePrinter(pj->hprinter, (void *)data, len, &written);
+    if (pj->pending->len + len < PRINTER_WRITE_SIZE) {
+        put_data(pj->pending, data, len);
+        return;
+    }
+
+    printer_job_write_pending(pj);
+    if (len >= PRINTER_WRITE_SIZE)
+        p_WritePrinter(pj->hprinter, (void *)data, len, &written);
+    else
+        put_data(pj->pending, data, len);
 }
 
 void printer_finish_job(printer_job *pj)
@@ -217,6 +246,9 @@ void printer_finish_job(printer_job *pj)
     if (!pj)
         return;
 
+    printer_job_write_pending(pj);
+    strbuf_free(pj->pending);
+
     p_EndPagePrinter(pj->hprinter);
     p_EndDocPrinter(pj->hprinter);
     p_ClosePrinter(pj->hprinter);
@@ -10,6 +10,13 @@
 
 #define SERIAL_MAX_BACKLOG 4096
 
+/*
+ * Size we ask the driver to make its receive and transmit queues,
+ * so that it can absorb a burst of data at multi-megabaud rates while
+ * the main loop is busy. Drivers may round this or ignore it.
+ */
+#define SERIAL_DRIVER_QUEUE 65536
+
 typedef struct Serial Serial;
 struct Serial {
     HANDLE port;
@@ -173,9 +180,22 @@ static char *serial_configure(Serial *serial, HANDLE serport, Conf *conf)
             return dupprintf("Configuring serial port: %s",
                              win_strerror(GetLastError()));
 
-        timeouts.ReadIntervalTimeout = 1;
-        timeouts.ReadTotalTimeoutMultiplier = 0;
-        timeouts.ReadTotalTimeoutConstant = 0;
+        if (!SetupComm(serport, SERIAL_DRIVER_QUEUE, SERIAL_DRIVER_QUEUE))
+            logeventf(serial->logctx, "Unable to set serial driver "
+                      "queue sizes: %s", win_strerror(GetLastError()));
+
+        /*
+         * This combination of timeouts means that a read returns at
+         * once with everything the driver has buffered, or if there
+         * is nothing, waits for the first byte to arrive and returns
+         * that. (Eventually it times out, returning nothing, which
+         * HANDLE_FLAG_IGNOREEOF deals with.) So we can give ReadFile
+         * a full-sized buffer, and still see each byte as soon as it
+         * arrives at low speeds.
+         */
+        timeouts.ReadIntervalTimeout = MAXDWORD;
+        timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+        timeouts.ReadTotalTimeoutConstant = MAXDWORD - 1;
         timeouts.WriteTotalTimeoutMultiplier = 0;
         timeouts.WriteTotalTimeoutConstant = 0;
         if (!SetCommTimeouts(serport, &timeouts))
@@ -266,8 +286,7 @@ static char *serial_init(const BackendVtable *vt, Seat *seat,
                                     HANDLE_FLAG_OVERLAPPED);
     serial->in = handle_input_new(serport, serial_gotdata, serial,
                                   HANDLE_FLAG_OVERLAPPED |
-                                  HANDLE_FLAG_IGNOREEOF |
-                                  HANDLE_FLAG_UNITBUFFER);
+                                  HANDLE_FLAG_IGNOREEOF);
 
     *realhost = dupstr(serline);
 
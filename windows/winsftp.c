@@ -89,8 +89,21 @@ static inline uint64_t uint64_from_words(uint32_t hi, uint32_t lo)
     (t) = (unsigned long) uli.QuadPart; \
 } while(0)
 
+/*
+ * How much of a file read_from_file_mapped maps in at once. Mapping
+ * the whole thing could use up our address space when the file is
+ * large.
+ */
+#define MAP_WINDOW_SIZE ((size_t)32 << 20)
+
 struct RFile {
     HANDLE h;
+    char *map;                         /* mapped view of the file */
+    uint64_t mapoffset;
+    size_t maplen;
+    bool nomap;                        /* can't map it: use ReadFile */
+    char *buf;                         /* ... into here */
+    size_t bufsize;
 };
 
 RFile *open_existing_file(const char *name, uint64_t *size,
@@ -100,12 +113,14 @@ RFile *open_existing_file(const char *name, uint64_t *size,
     HANDLE h;
     RFile *ret;
 
+    /* We mostly read files from start to end, so tell the cache */
     h = CreateFile(name, GENERIC_READ, FILE_SHARE_READ, NULL,
-                   OPEN_EXISTING, 0, 0);
+                   OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
     if (h == INVALID_HANDLE_VALUE)
         return NULL;
 
     ret = snew(RFile);
+    memset(ret, 0, sizeof(*ret));
     ret->h = h;
 
     if (size) {
@@ -138,114 +153,421 @@ int read_from_file(RFile *f, void *buffer, int length)
         return read;
 }
 
+/*
+ * Move the mapped view so that it starts at (or just before) offset.
+ * Returns false if there's no data there or the file can't be mapped
+ * at all.
+ */
+static bool rfile_remap(RFile *f, uint64_t offset)
+{
+    SYSTEM_INFO si;
+    DWORD lo, hi;
+    uint64_t size, start;
+    HANDLE mapping;
+    void *map;
+
+    if (f->map) {
+        UnmapViewOfFile(f->map);
+        f->map = NULL;
+    }
+
+    if (GetFileType(f->h) != FILE_TYPE_DISK) {
+        f->nomap = true;
+        return false;
+    }
+    lo = GetFileSize(f->h, &hi);
+    size = uint64_from_words(hi, lo);
+    if (offset >= size)
+        return false;
+
+    GetSystemInfo(&si);
+    start = offset - offset % si.dwAllocationGranularity;
+    f->maplen = MAP_WINDOW_SIZE;
+    if (f->maplen > size - start)
+        f->maplen = size - start;
+
+    /* The view keeps the mapping object alive for as long as it needs */
+    mapping = CreateFileMapping(f->h, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) {
+        f->nomap = true;
+        return false;
+    }
+    map = MapViewOfFile(mapping, FILE_MAP_READ, start >> 32,
+                        start & 0xFFFFFFFFU, f->maplen);
+    CloseHandle(mapping);
+    if (!map) {
+        f->nomap = true;
+        return false;
+    }
+    f->map = map;
+    f->mapoffset = start;
+    return true;
+}
+
+int read_from_file_mapped(RFile *f, uint64_t offset,
+                          const void **data, int length)
+{
+    DWORD read;
+    OVERLAPPED ov;
+
+    if (!f->nomap) {
+        if (!f->map || offset < f->mapoffset ||
+            offset + length > f->mapoffset + f->maplen) {
+            if (!rfile_remap(f, offset) && !f->nomap)
+                return 0;              /* end of file */
+        }
+        if (f->map) {
+            uint64_t avail = f->mapoffset + f->maplen - offset;
+            if (length > avail)
+                length = avail;
+            *data = f->map + (offset - f->mapoffset);
+            return length;
+        }
+    }
+
+    sgrowarray(f->buf, f->bufsize, length);
+    *data = f->buf;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = offset & 0xFFFFFFFFU;
+    ov.OffsetHigh = offset >> 32;
+    if (!ReadFile(f->h, f->buf, length, &read, &ov))
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    else
+        return read;
+}
+
 void close_rfile(RFile *f)
 {
+    if (f->map)
+        UnmapViewOfFile(f->map);
     CloseHandle(f->h);
+    sfree(f->buf);
     sfree(f);
 }
 
+/*
+ * Local files we're writing to are opened for overlapped I/O, so that
+ * a download can get on with receiving data while the disk (or the
+ * file server, for a network share) catches up. Writes to consecutive
+ * offsets are gathered into blocks of WFILE_BLOCK_SIZE, and up to
+ * WFILE_NBLOCKS of those can be in flight at once. A write that fails
+ * is reported by a later call that has to wait for it, or failing
+ * that by close_wfile.
+ */
+#define WFILE_BLOCK_SIZE ((size_t)256 << 10)
+#define WFILE_NBLOCKS 4
+
+struct wfile_block {
+    OVERLAPPED ov;
+    char *data;
+    size_t len;
+    uint64_t offset;
+    bool pending;                      /* is a write of it in flight? */
+};
+
 struct WFile {
     HANDLE h;
+    uint64_t posn;                     /* for write_to_file, seek_file */
+    struct wfile_block blocks[WFILE_NBLOCKS];
+    unsigned cur;                      /* the block we're filling */
+    bool error;                        /* has any write failed? */
+    uint64_t errpos;                   /* if so, lowest offset affected */
 };
 
+static WFile *wfile_new(HANDLE h)
+{
+    WFile *f = snew(WFile);
+    unsigned i;
+
+    memset(f, 0, sizeof(*f));
+    f->h = h;
+    for (i = 0; i < WFILE_NBLOCKS; i++) {
+        f->blocks[i].ov.hEvent = CreateEvent(NULL, true, false, NULL);
+        if (!f->blocks[i].ov.hEvent) {
+            while (i-- > 0)
+                CloseHandle(f->blocks[i].ov.hEvent);
+            CloseHandle(h);
+            sfree(f);
+            return NULL;
+        }
+        f->blocks[i].data = snewn(WFILE_BLOCK_SIZE, char);
+    }
+    return f;
+}
+
+static void wfile_failed(WFile *f, uint64_t offset)
+{
+    if (!f->error || f->errpos > offset)
+        f->errpos = offset;
+    f->error = true;
+}
+
+/* Wait for a block's write to finish, if it's in flight, and empty it */
+static void wfile_wait(WFile *f, struct wfile_block *b)
+{
+    DWORD written;
+
+    if (b->pending) {
+        if (!GetOverlappedResult(f->h, &b->ov, &written, true) ||
+            written != b->len)
+            wfile_failed(f, b->offset);
+        b->pending = false;
+    }
+    b->len = 0;
+}
+
+/* Start writing the block we've been filling, and move on to the next */
+static void wfile_submit(WFile *f)
+{
+    struct wfile_block *b = &f->blocks[f->cur];
+    HANDLE ev = b->ov.hEvent;
+
+    if (!b->len)
+        return;
+
+    memset(&b->ov, 0, sizeof(b->ov));
+    b->ov.hEvent = ev;
+    b->ov.Offset = b->offset & 0xFFFFFFFFU;
+    b->ov.OffsetHigh = b->offset >> 32;
+    if (!WriteFile(f->h, b->data, b->len, NULL, &b->ov) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        wfile_failed(f, b->offset);
+        b->len = 0;
+    } else {
+        b->pending = true;
+    }
+
+    f->cur = (f->cur + 1) % WFILE_NBLOCKS;
+    wfile_wait(f, &f->blocks[f->cur]);
+}
+
+/* Get everything we've been given on to the disk */
+static void wfile_flush(WFile *f)
+{
+    unsigned i;
+
+    wfile_submit(f);
+    for (i = 0; i < WFILE_NBLOCKS; i++)
+        wfile_wait(f, &f->blocks[i]);
+}
+
 WFile *open_new_file(const char *name, long perms)
 {
     HANDLE h;
-    WFile *ret;
 
-    h = CreateFile(name, GENERIC_WRITE, 0, NULL,
-                   CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    h = CreateFile(name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                   FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 0);
     if (h == INVALID_HANDLE_VALUE)
         return NULL;
 
-    ret = snew(WFile);
-    ret->h = h;
-
-    return ret;
+    return wfile_new(h);
 }
 
 WFile *open_existing_wfile(const char *name, uint64_t *size)
 {
     HANDLE h;
-    WFile *ret;
 
     h = CreateFile(name, GENERIC_WRITE, FILE_SHARE_READ, NULL,
-                   OPEN_EXISTING, 0, 0);
+                   OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
     if (h == INVALID_HANDLE_VALUE)
         return NULL;
 
-    ret = snew(WFile);
-    ret->h = h;
-
     if (size) {
         DWORD lo, hi;
         lo = GetFileSize(h, &hi);
         *size = uint64_from_words(hi, lo);
     }
 
-    return ret;
+    return wfile_new(h);
 }
 
 int write_to_file(WFile *f, void *buffer, int length)
 {
-    DWORD written;
-    if (!WriteFile(f->h, buffer, length, &written, NULL))
-        return -1;                     /* error */
-    else
-        return written;
+    int ret = write_to_file_at(f, f->posn, buffer, length);
+    if (ret > 0)
+        f->posn += ret;
+    return ret;
+}
+
+int write_to_file_at(WFile *f, uint64_t offset, void *buffer, int length)
+{
+    struct wfile_block *b = &f->blocks[f->cur];
+    const char *p = (const char *)buffer;
+    size_t left = length;
+
+    if (f->error)
+        return -1;
+
+    if (b->len && offset != b->offset + b->len) {
+        wfile_submit(f);
+        b = &f->blocks[f->cur];
+    }
+
+    while (left > 0) {
+        size_t n = min(left, WFILE_BLOCK_SIZE - b->len);
+
+        if (!b->len)
+            b->offset = offset;
+        memcpy(b->data + b->len, p, n);
+        b->len += n;
+        p += n;
+        offset += n;
+        left -= n;
+
+        if (b->len == WFILE_BLOCK_SIZE) {
+            wfile_submit(f);
+            b = &f->blocks[f->cur];
+        }
+    }
+
+    return f->error ? -1 : length;
+}
+
+bool wfile_can_write_at(WFile *f)
+{
+    return GetFileType(f->h) == FILE_TYPE_DISK;
+}
+
+int truncate_file(WFile *f, uint64_t size)
+{
+    LONG lo, hi;
+
+    wfile_flush(f);
+
+    /*
+     * Never leave the file looking as if it extends past a write that
+     * failed: the caller may be cutting it back to the part it thinks
+     * is complete, so that a reget can resume from there.
+     */
+    if (f->error && size > f->errpos)
+        size = f->errpos;
+
+    lo = size & 0xFFFFFFFFU;
+    hi = size >> 32;
+    if (SetFilePointer(f->h, lo, &hi, FILE_BEGIN) == INVALID_SET_FILE_POINTER
+        && GetLastError() != NO_ERROR)
+        return -1;
+    return SetEndOfFile(f->h) ? 0 : -1;
 }
 
 void set_file_times(WFile *f, unsigned long mtime, unsigned long atime)
 {
     FILETIME actime, wrtime;
+
+    /* Do this after the last write, or the write will undo it */
+    wfile_flush(f);
+
     TIME_POSIX_TO_WIN(atime, actime);
     TIME_POSIX_TO_WIN(mtime, wrtime);
     SetFileTime(f->h, NULL, &actime, &wrtime);
 }
 
-void close_wfile(WFile *f)
+int close_wfile(WFile *f)
 {
-    CloseHandle(f->h);
+    bool ok;
+    unsigned i;
+
+    wfile_flush(f);
+    ok = CloseHandle(f->h) && !f->error;
+    for (i = 0; i < WFILE_NBLOCKS; i++) {
+        CloseHandle(f->blocks[i].ov.hEvent);
+        sfree(f->blocks[i].data);
+    }
     sfree(f);
+    return ok ? 0 : -1;
 }
 
 /* Seek offset bytes through file, from whence, where whence is
    FROM_START, FROM_CURRENT, or FROM_END */
 int seek_file(WFile *f, uint64_t offset, int whence)
 {
-    DWORD movemethod;
+    DWORD lo, hi;
 
+    /*
+     * Overlapped I/O doesn't use the file pointer, so we keep our own
+     * position for write_to_file.
+     */
     switch (whence) {
     case FROM_START:
-        movemethod = FILE_BEGIN;
+        f->posn = offset;
         break;
     case FROM_CURRENT:
-        movemethod = FILE_CURRENT;
+        f->posn += offset;
         break;
     case FROM_END:
-        movemethod = FILE_END;
+        wfile_flush(f);
+        lo = GetFileSize(f->h, &hi);
+        if (lo == INVALID_FILE_SIZE && GetLastError() != NO_ERROR)
+            return -1;
+        f->posn = uint64_from_words(hi, lo) + offset;
         break;
     default:
         return -1;
     }
 
-    {
-        LONG lo = offset & 0xFFFFFFFFU, hi = offset >> 32;
-        SetFilePointer(f->h, lo, &hi, movemethod);
+    return 0;
+}
+
+uint64_t get_file_posn(WFile *f)
+{
+    return f->posn;
+}
+
+bool find_file_data(RFile *f, uint64_t offset,
+                    uint64_t *start, uint64_t *end)
+{
+    FILE_ALLOCATED_RANGE_BUFFER query, range;
+    DWORD lo, hi, got;
+    uint64_t size, rstart, rend;
+
+    lo = GetFileSize(f->h, &hi);
+    size = uint64_from_words(hi, lo);
+    if (offset >= size) {
+        *start = *end = size;
+        return true;
+    }
+
+    /*
+     * Ask for just the first allocated range in what's left of the
+     * file. There may well be more, but we'll come back for them.
+     */
+    query.FileOffset.QuadPart = offset;
+    query.Length.QuadPart = size - offset;
+    if (!DeviceIoControl(f->h, FSCTL_QUERY_ALLOCATED_RANGES,
+                         &query, sizeof(query), &range, sizeof(range),
+                         &got, NULL) &&
+        GetLastError() != ERROR_MORE_DATA)
+        return false;
+
+    if (got < sizeof(range)) {
+        *start = *end = size;
+        return true;
     }
 
-    if (GetLastError() != NO_ERROR)
-        return -1;
-    else
-        return 0;
+    rstart = range.FileOffset.QuadPart;
+    rend = rstart + range.Length.QuadPart;
+    *start = rstart > offset ? rstart : offset;
+    *end = rend < size ? rend : size;
+    return true;
 }
 
-uint64_t get_file_posn(WFile *f)
+void set_file_sparse(WFile *f)
 {
-    LONG lo, hi = 0;
+    struct wfile_block *b;
+    DWORD got;
 
-    lo = SetFilePointer(f->h, 0L, &hi, FILE_CURRENT);
-    return uint64_from_words(hi, lo);
+    /*
+     * The handle is overlapped, so this needs an OVERLAPPED too. Once
+     * everything is flushed, any block's will do.
+     */
+    wfile_flush(f);
+    b = &f->blocks[f->cur];
+    ResetEvent(b->ov.hEvent);
+
+    /* If the filesystem can't do it, we just end up writing zeroes */
+    if (DeviceIoControl(f->h, FSCTL_SET_SPARSE, NULL, 0, NULL, 0,
+                        &got, &b->ov) || GetLastError() == ERROR_IO_PENDING)
+        GetOverlappedResult(f->h, &b->ov, &got, true);
 }
 
 int file_type(const char *name)
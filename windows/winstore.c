@@ -9,6 +9,7 @@
 #include <assert.h>
 #include "putty.h"
 #include "storage.h"
+#include "tree234.h"
 
 #include <shlobj.h>
 #ifndef CSIDL_APPDATA
@@ -87,10 +88,50 @@ void close_settings_w(settings_w *handle)
     sfree(handle);
 }
 
+/*
+ * When reading a saved session, we fetch all its values from the
+ * registry in one pass when it's opened, rather than making a
+ * separate registry query for each of the several hundred settings
+ * we look for (most of which, in a typical session, aren't there).
+ * Value names in the registry are case-insensitive, so ours are too.
+ */
+typedef struct RegValue {
+    char *name;
+    DWORD type, size;
+    BYTE *data;                        /* with an extra NUL appended */
+} RegValue;
+
 struct settings_r {
-    HKEY sesskey;
+    tree234 *values;
 };
 
+static int regvalue_cmp(void *av, void *bv)
+{
+    RegValue *a = (RegValue *)av, *b = (RegValue *)bv;
+    return stricmp(a->name, b->name);
+}
+
+static int regvalue_find(void *av, void *bv)
+{
+    const char *a = (const char *)av;
+    RegValue *b = (RegValue *)bv;
+    return stricmp(a, b->name);
+}
+
+static void regvalue_free(RegValue *rv)
+{
+    sfree(rv->name);
+    sfree(rv->data);
+    sfree(rv);
+}
+
+static RegValue *find_setting(settings_r *handle, const char *key)
+{
+    if (!handle)
+        return NULL;
+    return find234(handle->values, (void *)key, regvalue_find);
+}
+
 settings_r *open_settings_r(const char *sessionname)
 {
     HKEY subkey1, sesskey;
@@ -117,51 +158,63 @@ settings_r *open_settings_r(const char *sessionname)
         return NULL;
 
     settings_r *toret = snew(settings_r);
-    toret->sesskey = sesskey;
+    toret->values = newtree234(regvalue_cmp);
+
+    DWORD nvalues, maxnamelen, maxdatalen;
+    if (RegQueryInfoKey(sesskey, NULL, NULL, NULL, NULL, NULL, NULL,
+                        &nvalues, &maxnamelen, &maxdatalen,
+                        NULL, NULL) == ERROR_SUCCESS) {
+        char *namebuf = snewn(maxnamelen + 1, char);
+        BYTE *databuf = snewn(maxdatalen + 1, BYTE);
+
+        for (DWORD i = 0; i < nvalues; i++) {
+            DWORD namelen = maxnamelen + 1, datalen = maxdatalen, type;
+            RegValue *rv;
+
+            if (RegEnumValue(sesskey, i, namebuf, &namelen, NULL, &type,
+                             databuf, &datalen) != ERROR_SUCCESS)
+                continue;
+
+            rv = snew(RegValue);
+            rv->name = dupstr(namebuf);
+            rv->type = type;
+            rv->size = datalen;
+            rv->data = snewn(datalen + 1, BYTE);
+            memcpy(rv->data, databuf, datalen);
+            rv->data[datalen] = '\0';
+            if (add234(toret->values, rv) != rv)
+                regvalue_free(rv);     /* can't happen, but just in case */
+        }
+
+        sfree(namebuf);
+        sfree(databuf);
+    }
+
+    RegCloseKey(sesskey);
     return toret;
 }
 
 char *read_setting_s(settings_r *handle, const char *key)
 {
-    DWORD type, allocsize, size;
-    char *ret;
+    RegValue *rv = find_setting(handle, key);
 
-    if (!handle)
-        return NULL;
-
-    /* Find out the type and size of the data. */
-    if (RegQueryValueEx(handle->sesskey, key, 0,
-                        &type, NULL, &size) != ERROR_SUCCESS ||
-        type != REG_SZ)
+    if (!rv || rv->type != REG_SZ)
         return NULL;
 
-    allocsize = size+1;         /* allow for an extra NUL if needed */
-    ret = snewn(allocsize, char);
-    if (RegQueryValueEx(handle->sesskey, key, 0,
-                        &type, (BYTE *)ret, &size) != ERROR_SUCCESS ||
-        type != REG_SZ) {
-        sfree(ret);
-        return NULL;
-    }
-    assert(size < allocsize);
-    ret[size] = '\0'; /* add an extra NUL in case RegQueryValueEx
-                       * didn't supply one */
-
-    return ret;
+    /* We appended a NUL on reading, in case the registry didn't */
+    return dupstr((const char *)rv->data);
 }
 
 int read_setting_i(settings_r *handle, const char *key, int defvalue)
 {
-    DWORD type, val, size;
-    size = sizeof(val);
+    RegValue *rv = find_setting(handle, key);
+    DWORD val;
 
-    if (!handle ||
-        RegQueryValueEx(handle->sesskey, key, 0, &type,
-                        (BYTE *) &val, &size) != ERROR_SUCCESS ||
-        size != sizeof(val) || type != REG_DWORD)
+    if (!rv || rv->type != REG_DWORD || rv->size != sizeof(val))
         return defvalue;
-    else
-        return val;
+
+    memcpy(&val, rv->data, sizeof(val));
+    return val;
 }
 
 FontSpec *read_setting_fontspec(settings_r *handle, const char *name)
@@ -240,8 +293,12 @@ void write_setting_filename(settings_w *handle,
 
 void close_settings_r(settings_r *handle)
 {
+    RegValue *rv;
+
     if (handle) {
-        RegCloseKey(handle->sesskey);
+        while ((rv = delpos234(handle->values, 0)) != NULL)
+            regvalue_free(rv);
+        freetree234(handle->values);
         sfree(handle);
     }
 }
@@ -322,23 +379,165 @@ static void hostkey_regname(strbuf *sb, const char *hostname,
     escape_registry_key(hostname, sb);
 }
 
+/*
+ * Cache of host key lookups, so that repeated checks in the same
+ * process (one per key type during key exchange, and again on every
+ * reconnection) don't each have to go back to the registry. Entries
+ * record absent keys as well as present ones. The whole cache is
+ * discarded whenever the last-write time of the SshHostKeys key
+ * changes, so that keys stored by other processes are noticed.
+ */
+typedef struct HostKeyCacheEntry {
+    char *regname;
+    char *value;                       /* NULL if there is no such key */
+} HostKeyCacheEntry;
+
+static tree234 *hostkey_cache;
+static FILETIME hostkey_cache_time;
+
+static int hostkey_cache_cmp(void *av, void *bv)
+{
+    HostKeyCacheEntry *a = (HostKeyCacheEntry *)av;
+    HostKeyCacheEntry *b = (HostKeyCacheEntry *)bv;
+    return strcmp(a->regname, b->regname);
+}
+
+static int hostkey_cache_find(void *av, void *bv)
+{
+    const char *a = (const char *)av;
+    HostKeyCacheEntry *b = (HostKeyCacheEntry *)bv;
+    return strcmp(a, b->regname);
+}
+
+static void hostkey_cache_clear(void)
+{
+    HostKeyCacheEntry *ent;
+
+    if (!hostkey_cache)
+        return;
+    while ((ent = delpos234(hostkey_cache, 0)) != NULL) {
+        sfree(ent->regname);
+        sfree(ent->value);
+        sfree(ent);
+    }
+}
+
+static void hostkey_cache_validate(HKEY rkey)
+{
+    FILETIME ft;
+
+    if (RegQueryInfoKey(rkey, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                        NULL, NULL, NULL, &ft) != ERROR_SUCCESS)
+        memset(&ft, 0, sizeof(ft));
+
+    if (!hostkey_cache)
+        hostkey_cache = newtree234(hostkey_cache_cmp);
+    else if (CompareFileTime(&ft, &hostkey_cache_time) != 0)
+        hostkey_cache_clear();
+    hostkey_cache_time = ft;
+}
+
+/*
+ * Read a string value in full. Returns NULL if it isn't there, or
+ * isn't a string.
+ */
+static char *hostkey_reg_read(HKEY rkey, const char *regname)
+{
+    DWORD type, size = 0;
+    char *value;
+
+    if (RegQueryValueEx(rkey, regname, NULL, &type,
+                        NULL, &size) != ERROR_SUCCESS || type != REG_SZ)
+        return NULL;
+
+    value = snewn(size + 1, char);
+    if (RegQueryValueEx(rkey, regname, NULL, &type,
+                        (BYTE *)value, &size) != ERROR_SUCCESS ||
+        type != REG_SZ) {
+        sfree(value);
+        return NULL;
+    }
+    value[size] = '\0';                /* in case it wasn't terminated */
+    return value;
+}
+
+/*
+ * Look up an RSA key stored by very old versions of PuTTY, under
+ * just the hostname and in a different format. If it matches the
+ * key we were given, re-store it in the new format.
+ */
+static int verify_old_style_rsa_key(HKEY rkey, const char *regname,
+                                    const char *key)
+{
+    const char *justhost = regname + 1 + strcspn(regname, ":");
+    char *oldstyle = hostkey_reg_read(rkey, justhost);
+    char *otherstr, *p, *q;
+    int i, j, ret;
+
+    if (!oldstyle)
+        return 1;                      /* key does not exist in registry */
+
+    /*
+     * The old format is two old-style bignums separated by a slash.
+     * An old-style bignum is made of groups of four hex digits:
+     * digits are ordered in sensible (most to least significant)
+     * order within each group, but groups are ordered in silly
+     * (least to most) order within the bignum. The new format is two
+     * ordinary C-format hex numbers (0xABCDEFG...XYZ, with A nonzero
+     * except in the special case 0x0, which doesn't appear anyway in
+     * RSA keys) separated by a comma. All hex digits are lowercase in
+     * both formats.
+     */
+    otherstr = snewn(strlen(oldstyle) + 10, char); /* safety margin */
+    p = otherstr;
+    q = oldstyle;
+    for (i = 0; i < 2; i++) {
+        int ndigits, nwords;
+        *p++ = '0';
+        *p++ = 'x';
+        ndigits = strcspn(q, "/");      /* find / or end of string */
+        nwords = ndigits / 4;
+        /* now trim ndigits to remove leading zeros */
+        while (q[(ndigits - 1) ^ 3] == '0' && ndigits > 1)
+            ndigits--;
+        /* now move digits over to new string */
+        for (j = 0; j < ndigits; j++)
+            p[ndigits - 1 - j] = q[j ^ 3];
+        p += ndigits;
+        q += nwords * 4;
+        if (*q) {
+            q++;               /* eat the slash */
+            *p++ = ',';        /* add a comma */
+        }
+        *p = '\0';             /* terminate the string */
+    }
+
+    /*
+     * Now _if_ this key matches, we'll enter it in the new format.
+     * If not, we'll assume something odd went wrong, and
+     * hyper-cautiously do nothing.
+     */
+    if (!strcmp(otherstr, key)) {
+        RegSetValueEx(rkey, regname, 0, REG_SZ, (BYTE *)otherstr,
+                      strlen(otherstr) + 1);
+        ret = 0;                       /* key matched OK in registry */
+    } else {
+        ret = 2;                       /* key is different in registry */
+    }
+
+    sfree(otherstr);
+    sfree(oldstyle);
+    return ret;
+}
+
 int verify_host_key(const char *hostname, int port,
                     const char *keytype, const char *key)
 {
-    char *otherstr;
+    HostKeyCacheEntry *ent;
     strbuf *regname;
-    int len;
     HKEY rkey;
-    DWORD readlen;
-    DWORD type;
-    int ret, compare;
-
-    len = 1 + strlen(key);
+    int ret;
 
-    /*
-     * Now read a saved key in from the registry and see what it
-     * says.
-     */
     regname = strbuf_new();
     hostkey_regname(regname, hostname, port, keytype);
 
@@ -348,89 +547,25 @@ int verify_host_key(const char *hostname, int port,
         return 1;                      /* key does not exist in registry */
     }
 
-    readlen = len;
-    otherstr = snewn(len, char);
-    ret = RegQueryValueEx(rkey, regname->s, NULL,
-                          &type, (BYTE *)otherstr, &readlen);
-
-    if (ret != ERROR_SUCCESS && ret != ERROR_MORE_DATA &&
-        !strcmp(keytype, "rsa")) {
-        /*
-         * Key didn't exist. If the key type is RSA, we'll try
-         * another trick, which is to look up the _old_ key format
-         * under just the hostname and translate that.
-         */
-        char *justhost = regname->s + 1 + strcspn(regname->s, ":");
-        char *oldstyle = snewn(len + 10, char); /* safety margin */
-        readlen = len;
-        ret = RegQueryValueEx(rkey, justhost, NULL, &type,
-                              (BYTE *)oldstyle, &readlen);
-
-        if (ret == ERROR_SUCCESS && type == REG_SZ) {
-            /*
-             * The old format is two old-style bignums separated by
-             * a slash. An old-style bignum is made of groups of
-             * four hex digits: digits are ordered in sensible
-             * (most to least significant) order within each group,
-             * but groups are ordered in silly (least to most)
-             * order within the bignum. The new format is two
-             * ordinary C-format hex numbers (0xABCDEFG...XYZ, with
-             * A nonzero except in the special case 0x0, which
-             * doesn't appear anyway in RSA keys) separated by a
-             * comma. All hex digits are lowercase in both formats.
-             */
-            char *p = otherstr;
-            char *q = oldstyle;
-            int i, j;
-
-            for (i = 0; i < 2; i++) {
-                int ndigits, nwords;
-                *p++ = '0';
-                *p++ = 'x';
-                ndigits = strcspn(q, "/");      /* find / or end of string */
-                nwords = ndigits / 4;
-                /* now trim ndigits to remove leading zeros */
-                while (q[(ndigits - 1) ^ 3] == '0' && ndigits > 1)
-                    ndigits--;
-                /* now move digits over to new string */
-                for (j = 0; j < ndigits; j++)
-                    p[ndigits - 1 - j] = q[j ^ 3];
-                p += ndigits;
-                q += nwords * 4;
-                if (*q) {
-                    q++;               /* eat the slash */
-                    *p++ = ',';        /* add a comma */
-                }
-                *p = '\0';             /* terminate the string */
-            }
-
-            /*
-             * Now _if_ this key matches, we'll enter it in the new
-             * format. If not, we'll assume something odd went
-             * wrong, and hyper-cautiously do nothing.
-             */
-            if (!strcmp(otherstr, key))
-                RegSetValueEx(rkey, regname->s, 0, REG_SZ, (BYTE *)otherstr,
-                              strlen(otherstr) + 1);
-        }
-
-        sfree(oldstyle);
+    hostkey_cache_validate(rkey);
+    ent = find234(hostkey_cache, regname->s, hostkey_cache_find);
+    if (!ent) {
+        ent = snew(HostKeyCacheEntry);
+        ent->regname = dupstr(regname->s);
+        ent->value = hostkey_reg_read(rkey, regname->s);
+        add234(hostkey_cache, ent);
     }
 
-    RegCloseKey(rkey);
-
-    compare = strcmp(otherstr, key);
+    if (ent->value)
+        ret = strcmp(ent->value, key) ? 2 : 0;
+    else if (!strcmp(keytype, "rsa"))
+        ret = verify_old_style_rsa_key(rkey, regname->s, key);
+    else
+        ret = 1;                       /* key does not exist in registry */
 
-    sfree(otherstr);
+    RegCloseKey(rkey);
     strbuf_free(regname);
-
-    if (ret == ERROR_MORE_DATA ||
-        (ret == ERROR_SUCCESS && type == REG_SZ && compare))
-        return 2;                      /* key is different in registry */
-    else if (ret != ERROR_SUCCESS || type != REG_SZ)
-        return 1;                      /* key does not exist in registry */
-    else
-        return 0;                      /* key matched OK in registry */
+    return ret;
 }
 
 bool have_ssh_host_key(const char *hostname, int port,
@@ -459,6 +594,58 @@ void store_host_key(const char *hostname, int port,
         RegCloseKey(rkey);
     } /* else key does not exist in registry */
 
+    hostkey_cache_clear();
+
+    strbuf_free(regname);
+}
+
+static void auth_hint_regname(strbuf *sb, const char *hostname,
+                              int port, const char *username)
+{
+    escape_registry_key(username, sb);
+    strbuf_catf(sb, "@%d:", port);
+    escape_registry_key(hostname, sb);
+}
+
+char *retrieve_auth_hint(const char *hostname, int port,
+                         const char *username)
+{
+    strbuf *regname;
+    HKEY rkey;
+    char *ret = NULL;
+
+    regname = strbuf_new();
+    auth_hint_regname(regname, hostname, port, username);
+
+    if (RegOpenKey(HKEY_CURRENT_USER, PUTTY_REG_POS "\\SshAuthHints",
+                   &rkey) == ERROR_SUCCESS) {
+        ret = hostkey_reg_read(rkey, regname->s);
+        RegCloseKey(rkey);
+    }
+
+    strbuf_free(regname);
+    return ret;
+}
+
+void store_auth_hint(const char *hostname, int port,
+                     const char *username, const char *hint)
+{
+    strbuf *regname;
+    HKEY rkey;
+
+    regname = strbuf_new();
+    auth_hint_regname(regname, hostname, port, username);
+
+    if (RegCreateKey(HKEY_CURRENT_USER, PUTTY_REG_POS "\\SshAuthHints",
+                     &rkey) == ERROR_SUCCESS) {
+        if (hint)
+            RegSetValueEx(rkey, regname->s, 0, REG_SZ,
+                          (BYTE *)hint, strlen(hint) + 1);
+        else
+            RegDeleteValue(rkey, regname->s);
+        RegCloseKey(rkey);
+    }
+
     strbuf_free(regname);
 }
 
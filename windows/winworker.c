@@ -0,0 +1,211 @@
+/*
+ * winworker.c: a pool of worker threads for running slow jobs (such
+ * as private-key operations) without holding up the event loop. See
+ * also the Unix version in uxworker.c.
+ */
+
+#include "putty.h"
+#include "ssh.h"
+
+#define BGJOB_MAX_THREADS 8
+
+typedef struct bgjob bgjob;
+struct bgjob {
+    void (*fn)(void *);
+    void (*done)(void *);
+    void *ctx;
+    bgjob *next;
+};
+
+static struct {
+    int state;                  /* 0 = not tried, 1 = running, -1 = failed */
+    CRITICAL_SECTION lock;
+    HANDLE work_sem;            /* counts the jobs in runq */
+    HANDLE finished_event;      /* set when doneq gains a job */
+    bgjob *runq, *runq_tail;
+    bgjob *doneq, *doneq_tail;
+} bg;
+
+static void bgjob_completed(void *ctx);
+
+static DWORD WINAPI bgjob_worker(void *arg)
+{
+    while (true) {
+        bgjob *job;
+
+        WaitForSingleObject(bg.work_sem, INFINITE);
+
+        EnterCriticalSection(&bg.lock);
+        job = bg.runq;
+        if (!job) {
+            /* platform_finish_background took it back */
+            LeaveCriticalSection(&bg.lock);
+            continue;
+        }
+        if (!(bg.runq = job->next))
+            bg.runq_tail = NULL;
+        LeaveCriticalSection(&bg.lock);
+
+        job->fn(job->ctx);
+
+        EnterCriticalSection(&bg.lock);
+        job->next = NULL;
+        if (bg.doneq_tail) {
+            bg.doneq_tail->next = job;
+        } else {
+            /* The main thread will empty doneq when it gets round to
+             * it, so it only needs telling about the first job */
+            bg.doneq = job;
+            queue_toplevel_callback_from_thread(bgjob_completed, &bg);
+        }
+        bg.doneq_tail = job;
+        LeaveCriticalSection(&bg.lock);
+        SetEvent(bg.finished_event);
+    }
+
+    return 0;
+}
+
+static void bgjob_completed(void *ctx)
+{
+    bgjob *job;
+
+    /*
+     * Take one job at a time, since a completion function might
+     * well start another job.
+     */
+    while (true) {
+        EnterCriticalSection(&bg.lock);
+        if ((job = bg.doneq) != NULL && !(bg.doneq = job->next))
+            bg.doneq_tail = NULL;
+        LeaveCriticalSection(&bg.lock);
+
+        if (!job)
+            break;
+        job->done(job->ctx);
+        sfree(job);
+    }
+}
+
+static bool bgjob_start(void)
+{
+    unsigned i, nthreads = 0, wanted;
+
+    if (bg.state)
+        return bg.state > 0;
+    bg.state = -1;
+
+    wanted = platform_parallel_jobs();
+    if (wanted < 2)
+        return false;     /* includes the MINEFIELD case: no threads */
+    if (wanted > BGJOB_MAX_THREADS)
+        wanted = BGJOB_MAX_THREADS;
+
+    if (!platform_enable_thread_callbacks())
+        return false;
+
+    /* Auto-reset event, so a SetEvent with nobody waiting is kept
+     * until the next wait rather than lost */
+    bg.finished_event = CreateEvent(NULL, false, false, NULL);
+    bg.work_sem = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+    if (!bg.finished_event || !bg.work_sem) {
+        if (bg.finished_event)
+            CloseHandle(bg.finished_event);
+        if (bg.work_sem)
+            CloseHandle(bg.work_sem);
+        return false;
+    }
+    InitializeCriticalSection(&bg.lock);
+
+    for (i = 0; i < wanted; i++) {
+        DWORD tid;
+        HANDLE thread = CreateThread(NULL, 0, bgjob_worker, NULL, 0, &tid);
+        if (thread) {
+            CloseHandle(thread);       /* we never need to wait for it */
+            nthreads++;
+        }
+    }
+
+    if (!nthreads) {
+        CloseHandle(bg.finished_event);
+        CloseHandle(bg.work_sem);
+        DeleteCriticalSection(&bg.lock);
+        return false;
+    }
+
+    bg.state = 1;
+    return true;
+}
+
+bool platform_run_in_background(void (*fn)(void *), void (*done)(void *),
+                                void *ctx)
+{
+    bgjob *job;
+
+    if (!bgjob_start())
+        return false;
+
+    job = snew(bgjob);
+    job->fn = fn;
+    job->done = done;
+    job->ctx = ctx;
+    job->next = NULL;
+
+    EnterCriticalSection(&bg.lock);
+    if (bg.runq_tail)
+        bg.runq_tail->next = job;
+    else
+        bg.runq = job;
+    bg.runq_tail = job;
+    LeaveCriticalSection(&bg.lock);
+    ReleaseSemaphore(bg.work_sem, 1, NULL);
+
+    return true;
+}
+
+/* Remove and return the job with a given context from a queue */
+static bgjob *bgjob_unlink(bgjob **head, bgjob **tail, void *ctx)
+{
+    bgjob *job, *prev = NULL;
+
+    for (job = *head; job; prev = job, job = job->next) {
+        if (job->ctx == ctx) {
+            if (prev)
+                prev->next = job->next;
+            else
+                *head = job->next;
+            if (*tail == job)
+                *tail = prev;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+void platform_finish_background(void *ctx)
+{
+    bgjob *job;
+
+    while (true) {
+        EnterCriticalSection(&bg.lock);
+        job = bgjob_unlink(&bg.runq, &bg.runq_tail, ctx);
+        if (job) {
+            /* Its semaphore count will wake a worker to an empty
+             * queue, which bgjob_worker allows for */
+            LeaveCriticalSection(&bg.lock);
+            job->fn(job->ctx);
+            break;
+        }
+        job = bgjob_unlink(&bg.doneq, &bg.doneq_tail, ctx);
+        LeaveCriticalSection(&bg.lock);
+        if (job)
+            break;
+
+        /* Auto-reset, so a job finishing between our look at the
+         * queue and this wait still wakes us */
+        WaitForSingleObject(bg.finished_event, INFINITE);
+    }
+
+    job->done(job->ctx);
+    sfree(job);
+}
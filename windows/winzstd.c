@@ -0,0 +1,22 @@
+/*
+ * winzstd.c: find the zstd library at run time, for sshzstd.c.
+ */
+
+#include "putty.h"
+#include "ssh.h"
+
+void *platform_zstd_function(const char *name)
+{
+    static bool tried = false;
+    static HMODULE module;
+
+    if (!tried) {
+        /* Only from the system directory, for the same reasons as
+         * every other DLL we load */
+        module = load_system32_dll("libzstd.dll");
+        tried = true;
+    }
+    if (module)
+        return (void *)GetProcAddress(module, name);
+    return NULL;
+}
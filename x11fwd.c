@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "putty.h"
 #include "ssh.h"
@@ -311,7 +313,7 @@ struct X11Display *x11_setup_display(const char *display, Conf *conf,
             /* Create trial connection to see if there is a useful Unix-domain
              * socket */
             Socket *s = sk_new(sk_addr_dup(ux), 0, false, false,
-                               false, false, nullplug);
+                               false, false, 0, nullplug);
             err = sk_socket_error(s);
             sk_close(s);
         }
@@ -467,12 +469,59 @@ void BinarySink_put_stringpl_xauth(BinarySink *bs, ptrlen pl)
 #define put_stringpl_xauth(bs, ptrlen) \
     BinarySink_put_stringpl_xauth(BinarySink_UPCAST(bs),ptrlen)
 
+/*
+ * The contents of the last Xauthority file we read, kept so that
+ * setting up another display (e.g. for a restarted session) needn't
+ * read a large file from a slow home directory all over again. The
+ * cache is considered stale if the file's size or modification time
+ * has changed since.
+ */
+static struct {
+    char *filename;
+    off_t size;
+    time_t mtime;
+    strbuf *data;
+} xauth_cache;
+
+static strbuf *x11_read_authfile(const char *authfilename)
+{
+    struct stat st;
+    FILE *authfp;
+    strbuf *data;
+    char buf[4096];
+    size_t got;
+
+    if (stat(authfilename, &st) < 0)
+        return NULL;
+
+    if (xauth_cache.data && !strcmp(xauth_cache.filename, authfilename) &&
+        xauth_cache.size == st.st_size && xauth_cache.mtime == st.st_mtime)
+        return xauth_cache.data;
+
+    authfp = fopen(authfilename, "rb");
+    if (!authfp)
+        return NULL;
+
+    data = strbuf_new_nm();
+    while ((got = fread(buf, 1, sizeof(buf), authfp)) > 0)
+        put_data(data, buf, got);
+    fclose(authfp);
+    smemclr(buf, sizeof(buf));
+
+    if (xauth_cache.data)
+        strbuf_free(xauth_cache.data);
+    sfree(xauth_cache.filename);
+    xauth_cache.filename = dupstr(authfilename);
+    xauth_cache.size = st.st_size;
+    xauth_cache.mtime = st.st_mtime;
+    xauth_cache.data = data;
+    return data;
+}
+
 void x11_get_auth_from_authfile(struct X11Display *disp,
                                 const char *authfilename)
 {
-    FILE *authfp;
-    char *buf;
-    int size;
+    strbuf *authdata;
     BinarySource src[1];
     int family, protocol;
     ptrlen addr, protoname, data;
@@ -481,15 +530,6 @@ void x11_get_auth_from_authfile(struct X11Display *disp,
     bool ideal_match = false;
     char *ourhostname;
 
-    /* A maximally sized (wildly implausible) .Xauthority record
-     * consists of a 16-bit integer to start with, then four strings,
-     * each of which has a 16-bit length field followed by that many
-     * bytes of data (i.e. up to 0xFFFF bytes). */
-    const size_t MAX_RECORD_SIZE = 2 + 4 * (2+0xFFFF);
-
-    /* We'll want a buffer of twice that size (see below). */
-    const size_t BUF_SIZE = 2 * MAX_RECORD_SIZE;
-
     /*
      * Normally we should look for precisely the details specified in
      * `disp'. However, there's an oddity when the display is local:
@@ -513,38 +553,17 @@ void x11_get_auth_from_authfile(struct X11Display *disp,
      */
     bool localhost = !disp->unixdomain && sk_address_is_local(disp->addr);
 
-    authfp = fopen(authfilename, "rb");
-    if (!authfp)
+    authdata = x11_read_authfile(authfilename);
+    if (!authdata)
         return;
 
     ourhostname = get_hostname();
 
-    /*
-     * Allocate enough space to hold two maximally sized records, so
-     * that a full record can start anywhere in the first half. That
-     * way we avoid the accidentally-quadratic algorithm that would
-     * arise if we moved everything to the front of the buffer after
-     * consuming each record; instead, we only move everything to the
-     * front after our current position gets past the half-way mark.
-     * Before then, there's no need to move anyway; so this guarantees
-     * linear time, in that every byte written into this buffer moves
-     * at most once (because every move is from the second half of the
-     * buffer to the first half).
-     */
-    buf = snewn(BUF_SIZE, char);
-    size = fread(buf, 1, BUF_SIZE, authfp);
-    BinarySource_BARE_INIT(src, buf, size);
+    BinarySource_BARE_INIT_PL(src, ptrlen_from_strbuf(authdata));
 
     while (!ideal_match) {
         bool match = false;
 
-        if (src->pos >= MAX_RECORD_SIZE) {
-            size -= src->pos;
-            memcpy(buf, buf + src->pos, size);
-            size += fread(buf + size, 1, BUF_SIZE - size, authfp);
-            BinarySource_BARE_INIT(src, buf, size);
-        }
-
         family = get_uint16(src);
         addr = get_string_xauth(src);
         displaynum_string = mkstr(get_string_xauth(src));
@@ -645,9 +664,6 @@ void x11_get_auth_from_authfile(struct X11Display *disp,
         }
     }
 
-    fclose(authfp);
-    smemclr(buf, 2 * MAX_RECORD_SIZE);
-    sfree(buf);
     sfree(ourhostname);
 }
 